@@ -2,6 +2,7 @@
 
 #include <event2/http.h>
 #include <glog/logging.h>
+#include <google/protobuf/io/coded_stream.h>
 #include <algorithm>
 #include <iterator>
 #include <memory>
@@ -24,8 +25,13 @@ using ct::SignedCertificateTimestamp;
 using ct::SignedTreeHead;
 using std::back_inserter;
 using std::bind;
+using std::function;
+using std::make_pair;
+using std::make_shared;
 using std::move;
 using std::placeholders::_1;
+using std::placeholders::_2;
+using std::shared_ptr;
 using std::string;
 using std::to_string;
 using std::unique_ptr;
@@ -59,12 +65,18 @@ bool SanityCheck(UrlFetcher::Response* resp,
 
 
 void DoneGetSTH(UrlFetcher::Response* resp, SignedTreeHead* sth,
-                const AsyncLogClient::Callback& done, util::Task* task) {
+                string* etag, const AsyncLogClient::Callback& done,
+                util::Task* task) {
   unique_ptr<UrlFetcher::Response> resp_deleter(CHECK_NOTNULL(resp));
   unique_ptr<util::Task> task_deleter(CHECK_NOTNULL(task));
 
   LOG_IF(INFO, !task->status().ok()) << "DoneGetSTH: " << task->status();
 
+  if (etag && task->status().ok() &&
+      resp->status_code == HTTP_NOTMODIFIED) {
+    return done(AsyncLogClient::NOT_MODIFIED);
+  }
+
   if (!SanityCheck(resp, done, task)) {
     return;
   }
@@ -101,6 +113,11 @@ void DoneGetSTH(UrlFetcher::Response* resp, SignedTreeHead* sth,
   sth->set_sha256_root_hash(root_hash.FromBase64());
   sth->mutable_signature()->CopyFrom(signature);
 
+  if (etag) {
+    const auto it(resp->headers.find("ETag"));
+    *etag = it != resp->headers.end() ? it->second : string();
+  }
+
   return done(AsyncLogClient::OK);
 }
 
@@ -142,7 +159,48 @@ void DoneGetRoots(UrlFetcher::Response* resp, vector<unique_ptr<Cert>>* roots,
 }
 
 
+// Decodes the entries of a get-entries response as its body arrives,
+// so that the whole body and its parsed form are never in memory.
+class GetEntriesStream {
+ public:
+  GetEntriesStream()
+      : stream_("entries", bind(&GetEntriesStream::AddEntry, this, _1)) {
+  }
+  GetEntriesStream(const GetEntriesStream&) = delete;
+  GetEntriesStream& operator=(const GetEntriesStream&) = delete;
+
+  void Add(const char* data, size_t size) {
+    stream_.Add(data, size);
+  }
+
+  // Returns false if the response was not valid.
+  bool Finish(vector<AsyncLogClient::Entry>* entries) {
+    if (!stream_.Finish()) {
+      return false;
+    }
+
+    entries->reserve(entries->size() + entries_.size());
+    move(entries_.begin(), entries_.end(), back_inserter(*entries));
+    return true;
+  }
+
+ private:
+  bool AddEntry(const JsonObject& entry) {
+    AsyncLogClient::Entry log_entry;
+    if (!AsyncLogClient::ParseEntry(entry, &log_entry)) {
+      return false;
+    }
+    entries_.emplace_back(move(log_entry));
+    return true;
+  }
+
+  JsonArrayStream stream_;
+  vector<AsyncLogClient::Entry> entries_;
+};
+
+
 void DoneGetEntries(UrlFetcher::Response* resp,
+                    const shared_ptr<GetEntriesStream>& stream,
                     vector<AsyncLogClient::Entry>* entries,
                     const AsyncLogClient::Callback& done, util::Task* task) {
   unique_ptr<UrlFetcher::Response> resp_deleter(CHECK_NOTNULL(resp));
@@ -152,75 +210,142 @@ void DoneGetEntries(UrlFetcher::Response* resp,
     return;
   }
 
-  JsonObject jresponse(resp->body);
-  if (!jresponse.Ok())
+  // The body is only kept if it was not streamed (by a UrlFetcher that
+  // does not support it).
+  stream->Add(resp->body.data(), resp->body.size());
+  if (!stream->Finish(entries)) {
     return done(AsyncLogClient::BAD_RESPONSE);
+  }
 
-  JsonArray jentries(jresponse, "entries");
-  if (!jentries.Ok())
-    return done(AsyncLogClient::BAD_RESPONSE);
+  return done(AsyncLogClient::OK);
 
-  vector<AsyncLogClient::Entry> new_entries;
-  new_entries.reserve(jentries.Length());
+}
 
-  for (int n = 0; n < jentries.Length(); ++n) {
-    JsonObject entry(jentries, n);
-    if (!entry.Ok()) {
-      return done(AsyncLogClient::BAD_RESPONSE);
-    }
 
-    JsonString leaf_input(entry, "leaf_input");
-    if (!leaf_input.Ok()) {
-      return done(AsyncLogClient::BAD_RESPONSE);
-    }
+// Decodes the records of a get-logged-entries response as its body
+// arrives: each is a LoggedEntryPB, preceded by its length as a
+// varint. Only the partial record at the end of what has arrived so
+// far is kept.
+class LoggedEntriesStream {
+ public:
+  LoggedEntriesStream() : ok_(true) {
+  }
+  LoggedEntriesStream(const LoggedEntriesStream&) = delete;
+  LoggedEntriesStream& operator=(const LoggedEntriesStream&) = delete;
 
-    AsyncLogClient::Entry log_entry;
-    if (Deserializer::DeserializeMerkleTreeLeaf(leaf_input.FromBase64(),
-                                                &log_entry.leaf) !=
-        DeserializeResult::OK) {
-      return done(AsyncLogClient::BAD_RESPONSE);
+  void Add(const char* data, size_t size) {
+    if (!ok_) {
+      return;
+    }
+    pending_.append(data, size);
+
+    size_t offset(0);
+    while (ok_ && offset < pending_.size()) {
+      const size_t available(pending_.size() - offset);
+      google::protobuf::io::CodedInputStream input(
+          reinterpret_cast<const uint8_t*>(pending_.data() + offset),
+          available);
+      uint32_t length;
+      if (!input.ReadVarint32(&length)) {
+        // Either the length is not all there yet, or it is garbage.
+        ok_ = available < kMaxVarint32Bytes;
+        break;
+      }
+      const size_t header(input.CurrentPosition());
+      if (available - header < length) {
+        break;
+      }
+      ok_ = AddRecord(pending_.data() + offset + header, length);
+      offset += header + length;
     }
+    pending_.erase(0, offset);
+  }
 
-    JsonString extra_data(entry, "extra_data");
-    if (!extra_data.Ok()) {
-      return done(AsyncLogClient::BAD_RESPONSE);
+  // Returns false if the response was not valid.
+  bool Finish(vector<AsyncLogClient::Entry>* entries) {
+    if (!ok_ || !pending_.empty()) {
+      return false;
     }
 
-    // This is an optional non-standard extension, used only by the log
-    // internally when running in clustered mode.
-    JsonString sct_data(entry, "sct");
-    if (sct_data.Ok()) {
-      unique_ptr<SignedCertificateTimestamp> sct(
-          new SignedCertificateTimestamp);
-      if (Deserializer::DeserializeSCT(sct_data.FromBase64(), sct.get()) !=
-          DeserializeResult::OK) {
-        return done(AsyncLogClient::BAD_RESPONSE);
-      }
-      log_entry.sct = move(sct);
+    entries->reserve(entries->size() + entries_.size());
+    move(entries_.begin(), entries_.end(), back_inserter(*entries));
+    return true;
+  }
+
+ private:
+  static const size_t kMaxVarint32Bytes = 5;
+
+  // Turns the record into what a get-entries response with SCTs
+  // would have given: the leaf is rebuilt from the entry and its SCT,
+  // the same way the log built it.
+  bool AddRecord(const char* data, size_t size) {
+    ct::LoggedEntryPB logged;
+    if (!logged.ParseFromArray(data, size) || !logged.contents().has_sct() ||
+        logged.contents().sct().version() != ct::V1) {
+      return false;
     }
 
-    switch (log_entry.leaf.timestamped_entry().entry_type()) {
+    AsyncLogClient::Entry entry;
+    entry.entry.Swap(logged.mutable_contents()->mutable_entry());
+    entry.sct.reset(new SignedCertificateTimestamp);
+    entry.sct->Swap(logged.mutable_contents()->mutable_sct());
+
+    entry.leaf.set_version(ct::V1);
+    entry.leaf.set_type(ct::TIMESTAMPED_ENTRY);
+    ct::TimestampedEntry* const timestamped(
+        entry.leaf.mutable_timestamped_entry());
+    timestamped->set_timestamp(entry.sct->timestamp());
+    timestamped->set_entry_type(entry.entry.type());
+    timestamped->set_extensions(entry.sct->extensions());
+    ct::SignedEntry* const signed_entry(timestamped->mutable_signed_entry());
+    switch (entry.entry.type()) {
       case ct::X509_ENTRY:
-        DeserializeX509Chain(extra_data.FromBase64(),
-                             log_entry.entry.mutable_x509_entry());
+        signed_entry->set_x509(entry.entry.x509_entry().leaf_certificate());
         break;
       case ct::PRECERT_ENTRY:
-        DeserializePrecertChainEntry(extra_data.FromBase64(),
-                                     log_entry.entry.mutable_precert_entry());
+        signed_entry->mutable_precert()->CopyFrom(
+            entry.entry.precert_entry().pre_cert());
         break;
       case ct::X_JSON_ENTRY:
-        // nothing to do
+        signed_entry->set_json(entry.entry.x_json_entry().json());
         break;
       default:
-        LOG(FATAL) << "Don't understand entry type: "
-                   << log_entry.leaf.timestamped_entry().entry_type();
+        LOG(WARNING) << "Don't understand entry type: " << entry.entry.type();
+        return false;
     }
 
-    new_entries.emplace_back(move(log_entry));
+    entries_.emplace_back(move(entry));
+    return true;
+  }
+
+  bool ok_;
+  string pending_;
+  vector<AsyncLogClient::Entry> entries_;
+};
+
+
+void DoneGetLoggedEntries(UrlFetcher::Response* resp,
+                          const shared_ptr<LoggedEntriesStream>& stream,
+                          vector<AsyncLogClient::Entry>* entries,
+                          const function<void()>& fallback,
+                          const AsyncLogClient::Callback& done,
+                          util::Task* task) {
+  unique_ptr<UrlFetcher::Response> resp_deleter(CHECK_NOTNULL(resp));
+  unique_ptr<util::Task> task_deleter(CHECK_NOTNULL(task));
+
+  // Nodes which predate get-logged-entries only have the JSON version.
+  if (task->status().ok() && resp->status_code == HTTP_NOTFOUND) {
+    return fallback();
   }
 
-  entries->reserve(entries->size() + new_entries.size());
-  move(new_entries.begin(), new_entries.end(), back_inserter(*entries));
+  if (!SanityCheck(resp, done, task)) {
+    return;
+  }
+
+  stream->Add(resp->body.data(), resp->body.size());
+  if (!stream->Finish(entries)) {
+    return done(AsyncLogClient::BAD_RESPONSE);
+  }
 
   return done(AsyncLogClient::OK);
 }
@@ -272,6 +397,70 @@ void DoneQueryInclusionProof(UrlFetcher::Response* resp,
 }
 
 
+void DoneQueryInclusionProofs(UrlFetcher::Response* resp,
+                              const SignedTreeHead& sth, size_t num_hashes,
+                              vector<MerkleAuditProof>* proofs,
+                              const AsyncLogClient::Callback& done,
+                              util::Task* task) {
+  unique_ptr<UrlFetcher::Response> resp_deleter(CHECK_NOTNULL(resp));
+  unique_ptr<util::Task> task_deleter(CHECK_NOTNULL(task));
+
+  if (!SanityCheck(resp, done, task)) {
+    return;
+  }
+
+  JsonObject jresponse(resp->body);
+  if (!jresponse.Ok())
+    return done(AsyncLogClient::BAD_RESPONSE);
+
+  // The audit paths refer to the nodes they share by their index in
+  // this array, so each node is only sent and decoded once.
+  JsonArray jnodes(jresponse, "nodes");
+  JsonArray jproofs(jresponse, "proofs");
+  if (!jnodes.Ok() || !jproofs.Ok() ||
+      static_cast<size_t>(jproofs.Length()) != num_hashes)
+    return done(AsyncLogClient::BAD_RESPONSE);
+
+  vector<string> nodes;
+  nodes.reserve(jnodes.Length());
+  for (int n = 0; n < jnodes.Length(); ++n) {
+    JsonString node(jnodes, n);
+    if (!node.Ok())
+      return done(AsyncLogClient::BAD_RESPONSE);
+    nodes.emplace_back(node.FromBase64());
+  }
+
+  proofs->clear();
+  proofs->resize(num_hashes);
+  for (size_t i = 0; i < num_hashes; ++i) {
+    JsonObject jproof(jproofs, i);
+    JsonInt leaf_index(jproof, "leaf_index");
+    JsonArray audit_path(jproof, "audit_path");
+    if (!jproof.Ok() || !leaf_index.Ok() || !audit_path.Ok())
+      return done(AsyncLogClient::BAD_RESPONSE);
+
+    MerkleAuditProof* const proof(&(*proofs)[i]);
+    proof->set_version(ct::V1);
+    proof->set_tree_size(sth.tree_size());
+    proof->set_timestamp(sth.timestamp());
+    proof->mutable_tree_head_signature()->CopyFrom(sth.signature());
+    // Not in the tree.
+    if (leaf_index.Value() < 0)
+      continue;
+    proof->set_leaf_index(leaf_index.Value());
+    for (int n = 0; n < audit_path.Length(); ++n) {
+      JsonInt node_index(audit_path, n);
+      if (!node_index.Ok() || node_index.Value() < 0 ||
+          static_cast<size_t>(node_index.Value()) >= nodes.size())
+        return done(AsyncLogClient::BAD_RESPONSE);
+      proof->add_path_node(nodes[node_index.Value()]);
+    }
+  }
+
+  return done(AsyncLogClient::OK);
+}
+
+
 void DoneGetSTHConsistency(UrlFetcher::Response* resp, vector<string>* proof,
                            const AsyncLogClient::Callback& done,
                            util::Task* task) {
@@ -385,10 +574,77 @@ AsyncLogClient::AsyncLogClient(util::Executor* const executor,
 }
 
 
+// static
+bool AsyncLogClient::ParseEntry(const JsonObject& entry,
+                                Entry* log_entry) {
+  JsonString leaf_input(entry, "leaf_input");
+  if (!leaf_input.Ok()) {
+    return false;
+  }
+
+  if (Deserializer::DeserializeMerkleTreeLeaf(leaf_input.FromBase64(),
+                                              &log_entry->leaf) !=
+      DeserializeResult::OK) {
+    return false;
+  }
+
+  JsonString extra_data(entry, "extra_data");
+  if (!extra_data.Ok()) {
+    return false;
+  }
+
+  // This is an optional non-standard extension, used only by the log
+  // internally when running in clustered mode.
+  JsonString sct_data(entry, "sct");
+  if (sct_data.Ok()) {
+    unique_ptr<SignedCertificateTimestamp> sct(new SignedCertificateTimestamp);
+    if (Deserializer::DeserializeSCT(sct_data.FromBase64(), sct.get()) !=
+        DeserializeResult::OK) {
+      return false;
+    }
+    log_entry->sct = move(sct);
+  }
+
+  switch (log_entry->leaf.timestamped_entry().entry_type()) {
+    case ct::X509_ENTRY:
+      DeserializeX509Chain(extra_data.FromBase64(),
+                           log_entry->entry.mutable_x509_entry());
+      break;
+    case ct::PRECERT_ENTRY:
+      DeserializePrecertChainEntry(extra_data.FromBase64(),
+                                   log_entry->entry.mutable_precert_entry());
+      break;
+    case ct::X_JSON_ENTRY:
+      // nothing to do
+      break;
+    default:
+      LOG(FATAL) << "Don't understand entry type: "
+                 << log_entry->leaf.timestamped_entry().entry_type();
+  }
+
+  return true;
+}
+
+
 void AsyncLogClient::GetSTH(SignedTreeHead* sth, const Callback& done) {
   UrlFetcher::Response* const resp(new UrlFetcher::Response);
   fetcher_->Fetch(GetURL("get-sth"), resp,
-                  new util::Task(bind(DoneGetSTH, resp, sth, done, _1),
+                  new util::Task(bind(DoneGetSTH, resp, sth, nullptr, done,
+                                      _1),
+                                 executor_));
+}
+
+
+void AsyncLogClient::GetSTHIfChanged(SignedTreeHead* sth, string* etag,
+                                     const Callback& done) {
+  UrlFetcher::Request req(GetURL("get-sth"));
+  if (!CHECK_NOTNULL(etag)->empty()) {
+    req.headers.insert(make_pair("If-None-Match", *etag));
+  }
+
+  UrlFetcher::Response* const resp(new UrlFetcher::Response);
+  fetcher_->Fetch(req, resp,
+                  new util::Task(bind(DoneGetSTH, resp, sth, etag, done, _1),
                                  executor_));
 }
 
@@ -413,8 +669,28 @@ void AsyncLogClient::GetEntries(int first, int last, vector<Entry>* entries,
 void AsyncLogClient::GetEntriesAndSCTs(int first, int last,
                                        vector<Entry>* entries,
                                        const Callback& done) {
-  return InternalGetEntries(first, last, entries, true /* request_scts */,
-                            done);
+  CHECK_GE(first, 0);
+  CHECK_GE(last, 0);
+
+  if (last < first) {
+    done(INVALID_INPUT);
+    return;
+  }
+
+  URL url(GetURL("get-logged-entries"));
+  url.SetQuery("start=" + to_string(first) + "&end=" + to_string(last));
+
+  UrlFetcher::Response* const resp(new UrlFetcher::Response);
+  const shared_ptr<LoggedEntriesStream> stream(
+      make_shared<LoggedEntriesStream>());
+  resp->body_sink = bind(&LoggedEntriesStream::Add, stream, _1, _2);
+  const function<void()> fallback(bind(&AsyncLogClient::InternalGetEntries,
+                                       this, first, last, entries,
+                                       true /* request_scts */, done));
+  fetcher_->Fetch(url, resp, new util::Task(bind(DoneGetLoggedEntries, resp,
+                                                 stream, entries, fallback,
+                                                 done, _1),
+                                            executor_));
 }
 
 
@@ -435,9 +711,11 @@ void AsyncLogClient::InternalGetEntries(int first, int last,
                (request_scts ? "&include_scts=true" : ""));
 
   UrlFetcher::Response* const resp(new UrlFetcher::Response);
-  fetcher_->Fetch(url, resp,
-                  new util::Task(bind(DoneGetEntries, resp, entries, done, _1),
-                                 executor_));
+  const shared_ptr<GetEntriesStream> stream(make_shared<GetEntriesStream>());
+  resp->body_sink = bind(&GetEntriesStream::Add, stream, _1, _2);
+  fetcher_->Fetch(url, resp, new util::Task(bind(DoneGetEntries, resp, stream,
+                                                 entries, done, _1),
+                                            executor_));
 }
 
 
@@ -458,6 +736,29 @@ void AsyncLogClient::QueryInclusionProof(const SignedTreeHead& sth,
 }
 
 
+void AsyncLogClient::QueryInclusionProofs(
+    const SignedTreeHead& sth, const vector<string>& merkle_leaf_hashes,
+    vector<MerkleAuditProof>* proofs, const Callback& done) {
+  CHECK_GE(sth.tree_size(), 0);
+  CHECK(!merkle_leaf_hashes.empty());
+
+  string query;
+  for (const string& hash : merkle_leaf_hashes) {
+    query += "hash=" + UriEncode(util::ToBase64(hash)) + "&";
+  }
+  query += "tree_size=" + to_string(sth.tree_size());
+  URL url(GetURL("get-proofs-by-hash"));
+  url.SetQuery(query);
+
+  UrlFetcher::Response* const resp(new UrlFetcher::Response);
+  fetcher_->Fetch(url, resp,
+                  new util::Task(bind(DoneQueryInclusionProofs, resp, sth,
+                                      merkle_leaf_hashes.size(), proofs, done,
+                                      _1),
+                                 executor_));
+}
+
+
 void AsyncLogClient::GetSTHConsistency(int64_t first, int64_t second,
                                        vector<string>* proof,
                                        const Callback& done) {
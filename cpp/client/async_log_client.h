@@ -11,6 +11,8 @@
 #include "net/url_fetcher.h"
 #include "proto/ct.pb.h"
 
+class JsonObject;
+
 namespace util {
 class Executor;
 }  // namespace util
@@ -30,6 +32,9 @@ class AsyncLogClient {
     BAD_RESPONSE,
     UNKNOWN_ERROR,
     INVALID_INPUT,
+    // Returned by a conditional request when the log still has what
+    // the caller was given last time.
+    NOT_MODIFIED,
   };
 
   struct Entry {
@@ -55,8 +60,24 @@ class AsyncLogClient {
   AsyncLogClient(const AsyncLogClient&) = delete;
   AsyncLogClient& operator=(const AsyncLogClient&) = delete;
 
+  const URL& server_url() const {
+    return server_url_;
+  }
+
+  // Parses an element of the "entries" of a get-entries response,
+  // whether fetched from a log or saved from one earlier.
+  static bool ParseEntry(const JsonObject& json, Entry* entry);
+
   void GetSTH(ct::SignedTreeHead* sth, const Callback& done);
 
+  // Same as GetSTH(), but if |*etag| is not empty, only fetches the
+  // tree head if the log no longer has the one with that entity tag.
+  // If it still does, "done" is called with NOT_MODIFIED and "sth" is
+  // left alone. Otherwise, |*etag| is set to that of the new tree head
+  // (empty if the log did not send one).
+  void GetSTHIfChanged(ct::SignedTreeHead* sth, std::string* etag,
+                       const Callback& done);
+
   // This does not clear "roots" before appending to it.
   void GetRoots(std::vector<std::unique_ptr<Cert>>* roots,
                 const Callback& done);
@@ -68,6 +89,9 @@ class AsyncLogClient {
 
   // This is NON-standard, and only works with this log implementation.
   // It's intended for internal use when running in a clustered configuration.
+  // The entries are fetched in binary form with get-logged-entries,
+  // or with the JSON get-entries (and include_scts) from nodes which
+  // do not have it yet.
   // This does not clear "entries" before appending the retrieved
   // entries.
   void GetEntriesAndSCTs(int first, int last, std::vector<Entry>* entries,
@@ -77,6 +101,16 @@ class AsyncLogClient {
                            const std::string& merkle_leaf_hash,
                            ct::MerkleAuditProof* proof, const Callback& done);
 
+  // This is NON-standard, and only works with this log implementation.
+  // Batch version of QueryInclusionProof(), with get-proofs-by-hash.
+  // "proofs" gets one proof per element of "merkle_leaf_hashes", in
+  // the same order, and those of hashes the log does not have in the
+  // tree of "sth" are left without a leaf_index.
+  void QueryInclusionProofs(const ct::SignedTreeHead& sth,
+                            const std::vector<std::string>& merkle_leaf_hashes,
+                            std::vector<ct::MerkleAuditProof>* proofs,
+                            const Callback& done);
+
   // This does not clear "proof" before appending to it.
   void GetSTHConsistency(int64_t first, int64_t second,
                          std::vector<std::string>* proof,
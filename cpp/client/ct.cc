@@ -3,6 +3,8 @@
 #include <fcntl.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
 #include <openssl/asn1.h>
 #include <openssl/bio.h>
 #include <openssl/bn.h>
@@ -13,19 +15,30 @@
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
 #include <stdio.h>
+#include <algorithm>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 
 #include "client/http_log_client.h"
 #include "client/ssl_client.h"
+#include "fetcher/fetcher.h"
+#include "fetcher/peer.h"
+#include "fetcher/peer_group.h"
 #include "log/cert.h"
 #include "log/cert_submission_handler.h"
 #include "log/ct_extensions.h"
 #include "log/log_signer.h"
 #include "log/log_verifier.h"
+#include "log/segment_db.h"
+#include "log/tree_signer.h"
+#include "merkletree/compact_merkle_tree.h"
 #include "merkletree/merkle_tree.h"
 #include "merkletree/merkle_verifier.h"
 #include "merkletree/serial_hasher.h"
@@ -33,8 +46,14 @@
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
 #include "util/init.h"
+#include "util/libevent_wrapper.h"
 #include "util/openssl_scoped_types.h"
+#include "util/parallel_for.h"
 #include "util/read_key.h"
+#include "util/sequential_for.h"
+#include "util/sync_task.h"
+#include "util/task.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
 DEFINE_string(ssl_client_trusted_cert_dir, "",
@@ -79,6 +98,34 @@ DEFINE_string(certificate_chain_in, "",
 DEFINE_string(sct_in, "", "SCT to wrap");
 DEFINE_int32(get_first, 0, "First entry to retrieve with the 'get' command");
 DEFINE_int32(get_last, 0, "Last entry to retrieve with the 'get' command");
+DEFINE_string(get_entries_dir, "",
+              "With the 'get_entries' command, download the whole log, up "
+              "to its current STH, into a segment database in this "
+              "directory (which must exist), rather than the "
+              "--get_first..--get_last entries into files of their own. "
+              "An interrupted download resumes where it left off.");
+DEFINE_int32(get_entries_checkpoint_entries, 100000,
+             "With --get_entries_dir, how many entries to verify between "
+             "checkpoints of the progress");
+DEFINE_string(audit_logs, "",
+              "With the 'batch_audit' command, the logs to check the SCTs "
+              "of, as a comma-separated list of <log URI>=<public key "
+              "file>. Defaults to --ct_server with --ct_server_public_key.");
+DEFINE_int32(audit_batch_scts, 100000,
+             "With the 'batch_audit' command, how many SCTs are read "
+             "before the inclusion proofs for them are fetched");
+DEFINE_int32(audit_proofs_per_request, 100,
+             "With the 'batch_audit' command, how many inclusion proofs "
+             "to ask for in each get-proofs-by-hash request, which only "
+             "this log implementation has, or 0 for one get-proof-by-hash "
+             "request per SCT");
+DEFINE_int32(audit_concurrent_requests, 16,
+             "With the 'batch_audit' command, how many proof requests to "
+             "keep in flight to each log");
+DEFINE_int32(audit_mmd_secs, 24 * 60 * 60,
+             "With the 'batch_audit' command, the maximum merge delay of "
+             "the logs: an SCT missing from the tree is only a failure if "
+             "it is older than this by the time of the STH");
 DEFINE_string(certificate_base, "",
               "Base name for retrieved certificates - "
               "files will be <base><entry>.<cert>.der");
@@ -106,16 +153,23 @@ static const char kUsage[] =
     "wrap_embedded - take a certificate chain with an embedded SCT and wrap\n"
     "                them as if they were retrieved via 'connect'\n"
     "get_roots - get roots from the log\n"
-    "get_entries - get entries from the log\n"
+    "get_entries - get entries from the log, or the whole log with\n"
+    "              --get_entries_dir\n"
     "sth - get the current STH from the log\n"
     "consistency - get and check consistency of two STHs\n"
+    "batch_audit - check that the SCTs of many SSLClientCTData, written\n"
+    "              length-delimited to --ssl_client_ct_data_in, are in\n"
+    "              the current trees of --audit_logs\n"
     "Use --help to display command-line flag options\n";
 
 using cert_trans::AsyncLogClient;
 using cert_trans::Cert;
 using cert_trans::CertChain;
 using cert_trans::CertSubmissionHandler;
+using cert_trans::Database;
 using cert_trans::HTTPLogClient;
+using cert_trans::Peer;
+using cert_trans::PeerGroup;
 using cert_trans::PreCertChain;
 using cert_trans::ReadPublicKey;
 using cert_trans::SSLClient;
@@ -126,21 +180,32 @@ using cert_trans::ScopedEVP_PKEY;
 using cert_trans::ScopedRSA;
 using cert_trans::ScopedX509;
 using cert_trans::ScopedX509_NAME;
+using cert_trans::SegmentDB;
 using cert_trans::TbsCertificate;
+using cert_trans::ThreadPool;
+using cert_trans::TreeSigner;
+using cert_trans::UrlFetcher;
 using cert_trans::serialization::SerializeResult;
 using cert_trans::serialization::DeserializeResult;
+using ct::CompactTreeCheckpoint;
 using ct::LogEntry;
 using ct::MerkleAuditProof;
 using ct::SSLClientCTData;
 using ct::SignedCertificateTimestamp;
 using ct::SignedCertificateTimestampList;
 using ct::SignedTreeHead;
+using std::make_pair;
+using std::make_shared;
+using std::move;
 using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
+using std::unordered_map;
+using std::unordered_set;
 using std::vector;
 using util::Status;
 using util::StatusOr;
+using util::SyncTask;
 
 // SCTs presented to clients have to be encoded as a list.
 // Helper method for encoding a single SCT.
@@ -153,19 +218,23 @@ static string SCTToList(const string& serialized_sct) {
   return result;
 }
 
-static LogVerifier* GetLogVerifierFromFlags() {
-  CHECK(!FLAGS_ct_server_public_key.empty()) <<
-    "Please give a CT server public key file with --ct_server_public_key";
-
-  StatusOr<EVP_PKEY*> pkey(ReadPublicKey(FLAGS_ct_server_public_key));
-  CHECK(pkey.ok()) << "could not read CT server public key file: "
-                   << pkey.status();
+static LogVerifier* NewLogVerifier(const string& public_key_file) {
+  StatusOr<EVP_PKEY*> pkey(ReadPublicKey(public_key_file));
+  CHECK(pkey.ok()) << "could not read CT server public key file "
+                   << public_key_file << ": " << pkey.status();
 
   return new LogVerifier(new LogSigVerifier(pkey.ValueOrDie()),
                          new MerkleVerifier(
                              unique_ptr<Sha256Hasher>(new Sha256Hasher)));
 }
 
+static LogVerifier* GetLogVerifierFromFlags() {
+  CHECK(!FLAGS_ct_server_public_key.empty()) <<
+    "Please give a CT server public key file with --ct_server_public_key";
+
+  return NewLogVerifier(FLAGS_ct_server_public_key);
+}
+
 // Adds the data to the cert as an extension, formatted as a single
 // ASN.1 octet string.
 static void AddOctetExtension(X509* cert, int nid, const unsigned char* data,
@@ -659,6 +728,383 @@ static AuditResult Audit() {
   return audit_result;
 }
 
+// An SCT read by BatchAudit(), in the batch of its log.
+struct BatchedSCT {
+  // The number of the SSLClientCTData it came in, for the report.
+  int64_t record;
+  const SSLClientCTData* data;
+  int sct_index;
+  // Filled in once its signature is checked.
+  string leaf_hash;
+
+  const SignedCertificateTimestamp& sct() const {
+    return data->attached_sct_info(sct_index).sct();
+  }
+};
+
+// A log whose SCTs are checked by BatchAudit(), against the one STH
+// fetched from it at the start.
+struct AuditedLog {
+  AuditedLog(const string& uri, LogVerifier* verifier, ThreadPool* pool,
+             UrlFetcher* url_fetcher)
+      : uri(uri), verifier(verifier), client(pool, url_fetcher, uri) {
+  }
+
+  const string uri;
+  const unique_ptr<LogVerifier> verifier;
+  AsyncLogClient client;
+  SignedTreeHead sth;
+  vector<BatchedSCT> batch;
+  // The leaf hashes already proven to be in the tree of |sth|, so that
+  // an SCT seen again (as for a certificate served by many hosts) is
+  // not looked up again.
+  unordered_set<string> included;
+
+  // What became of the SCTs of this log.
+  int64_t num_scts = 0;
+  int64_t num_bad_signature = 0;
+  int64_t num_included = 0;
+  // Not in the tree, but too recent to have to be yet.
+  int64_t num_pending = 0;
+  int64_t num_missing = 0;
+  int64_t num_unavailable = 0;
+};
+
+// Calls request(i, task) for each i in [0, count), with at most
+// |max_in_flight| requests in flight at once, each of which returns
+// on its task once done. Returns once they all have.
+static void RunRequests(
+    size_t count, int max_in_flight, ThreadPool* pool,
+    const std::function<void(size_t i, util::Task* task)>& request) {
+  const size_t num_lanes(
+      std::min(count, static_cast<size_t>(std::max(1, max_in_flight))));
+  vector<unique_ptr<SyncTask>> lanes;
+  for (size_t lane = 0; lane < num_lanes; ++lane) {
+    lanes.emplace_back(new SyncTask(pool));
+    // Each lane makes every num_lanes-th request, one after the other.
+    util::SequentialFor((count - lane + num_lanes - 1) / num_lanes,
+                        [&request, lane, num_lanes](size_t i,
+                                                    util::Task* task) {
+                          request(lane + i * num_lanes, task);
+                        },
+                        lanes.back()->task());
+  }
+  for (const unique_ptr<SyncTask>& lane : lanes) {
+    lane->Wait();
+  }
+}
+
+// Fetches the current STH of each of |logs| at once, and checks it.
+static bool GetAuditedSTHs(const vector<unique_ptr<AuditedLog>>& logs,
+                           ThreadPool* pool) {
+  vector<AsyncLogClient::Status> statuses(logs.size(),
+                                         AsyncLogClient::UNKNOWN_ERROR);
+  RunRequests(logs.size(), logs.size(), pool,
+              [&logs, &statuses](size_t i, util::Task* task) {
+                logs[i]->client.GetSTH(&logs[i]->sth,
+                                       [&statuses, i,
+                                        task](AsyncLogClient::Status status) {
+                                         statuses[i] = status;
+                                         task->Return();
+                                       });
+              });
+
+  bool ok(true);
+  for (size_t i = 0; i < logs.size(); ++i) {
+    if (statuses[i] != AsyncLogClient::OK) {
+      LOG(ERROR) << "Could not get the STH of " << logs[i]->uri;
+      ok = false;
+      continue;
+    }
+    const LogVerifier::LogVerifyResult result(
+        logs[i]->verifier->VerifySignedTreeHead(logs[i]->sth));
+    if (result != LogVerifier::VERIFY_OK) {
+      LOG(ERROR) << "Invalid STH from " << logs[i]->uri << ": "
+                 << LogVerifier::VerifyResultString(result);
+      ok = false;
+      continue;
+    }
+    LOG(INFO) << "Auditing against the STH of size "
+              << logs[i]->sth.tree_size() << " of " << logs[i]->uri;
+  }
+  return ok;
+}
+
+// Fetches the inclusion proofs of |hashes| from |log| into |proofs|,
+// with --audit_proofs_per_request proofs per request, and
+// --audit_concurrent_requests requests in flight. |answered[i]| is set
+// if the log answered for |hashes[i]|, in which case |proofs[i]| has
+// no leaf_index if it does not have it.
+static void FetchInclusionProofs(AuditedLog* log, const vector<string>& hashes,
+                                 ThreadPool* pool,
+                                 vector<MerkleAuditProof>* proofs,
+                                 vector<char>* answered) {
+  proofs->assign(hashes.size(), MerkleAuditProof());
+  answered->assign(hashes.size(), false);
+
+  if (FLAGS_audit_proofs_per_request <= 0) {
+    // The standard get-proof-by-hash fails for a hash the log does not
+    // have, which cannot be told apart from other failures, so those
+    // count as answered, without a proof, as in Audit().
+    RunRequests(hashes.size(), FLAGS_audit_concurrent_requests, pool,
+                [log, &hashes, proofs](size_t i, util::Task* task) {
+                  log->client.QueryInclusionProof(
+                      log->sth, hashes[i], &(*proofs)[i],
+                      [proofs, i, task](AsyncLogClient::Status status) {
+                        if (status != AsyncLogClient::OK) {
+                          (*proofs)[i].clear_leaf_index();
+                        }
+                        task->Return();
+                      });
+                });
+    answered->assign(hashes.size(), true);
+    return;
+  }
+
+  const size_t per_request(FLAGS_audit_proofs_per_request);
+  const size_t num_requests((hashes.size() + per_request - 1) / per_request);
+  vector<vector<MerkleAuditProof>> request_proofs(num_requests);
+  RunRequests(num_requests, FLAGS_audit_concurrent_requests, pool,
+              [log, &hashes, per_request, &request_proofs, proofs,
+               answered](size_t r, util::Task* task) {
+                const size_t begin(r * per_request);
+                const size_t end(std::min(hashes.size(), begin + per_request));
+                log->client.QueryInclusionProofs(
+                    log->sth, vector<string>(hashes.begin() + begin,
+                                             hashes.begin() + end),
+                    &request_proofs[r],
+                    [log, begin, end, &request_proofs, r, proofs, answered,
+                     task](AsyncLogClient::Status status) {
+                      if (status == AsyncLogClient::OK) {
+                        for (size_t i = begin; i < end; ++i) {
+                          (*proofs)[i].Swap(&request_proofs[r][i - begin]);
+                          (*answered)[i] = true;
+                        }
+                      } else {
+                        LOG(WARNING) << "Could not get " << end - begin
+                                     << " inclusion proofs from " << log->uri;
+                      }
+                      request_proofs[r].clear();
+                      task->Return();
+                    });
+              });
+}
+
+// Checks the SCTs in the batch of |log|, and empties it.
+static void AuditBatch(AuditedLog* log, ThreadPool* pool) {
+  vector<BatchedSCT>& batch(log->batch);
+  log->num_scts += batch.size();
+
+  // This also computes the leaf hashes.
+  vector<LogVerifier::LogVerifyResult> results(batch.size());
+  util::ParallelFor(pool, batch.size(), [log, &batch, &results](size_t i) {
+    results[i] = log->verifier->VerifySignedCertificateTimestamp(
+        batch[i].data->reconstructed_entry(), batch[i].sct(),
+        &batch[i].leaf_hash);
+  });
+
+  // The SCTs still to be looked up, and the leaf hashes to look up for
+  // them, each only once.
+  vector<size_t> to_check;
+  vector<string> hashes;
+  // The first SCT with each of |hashes|.
+  vector<size_t> first_scts;
+  unordered_map<string, size_t> hash_indices;
+  for (size_t i = 0; i < batch.size(); ++i) {
+    if (results[i] != LogVerifier::VERIFY_OK) {
+      LOG(WARNING) << "SCT " << batch[i].sct_index << " of record "
+                   << batch[i].record << " does not verify: "
+                   << LogVerifier::VerifyResultString(results[i]);
+      ++log->num_bad_signature;
+    } else if (batch[i].sct().timestamp() > log->sth.timestamp()) {
+      ++log->num_pending;
+    } else if (log->included.count(batch[i].leaf_hash) > 0) {
+      ++log->num_included;
+    } else {
+      to_check.push_back(i);
+      if (hash_indices.insert(make_pair(batch[i].leaf_hash, hashes.size()))
+              .second) {
+        hashes.push_back(batch[i].leaf_hash);
+        first_scts.push_back(i);
+      }
+    }
+  }
+
+  vector<MerkleAuditProof> proofs;
+  vector<char> answered;
+  if (!hashes.empty()) {
+    FetchInclusionProofs(log, hashes, pool, &proofs, &answered);
+  }
+
+  // The proofs with the same tree head are checked together, sharing
+  // their upper nodes.
+  vector<const LogEntry*> entries;
+  vector<const SignedCertificateTimestamp*> scts;
+  vector<const MerkleAuditProof*> proof_ptrs;
+  vector<size_t> proof_hashes;
+  for (size_t h = 0; h < hashes.size(); ++h) {
+    if (!answered[h] || !proofs[h].has_leaf_index()) {
+      continue;
+    }
+    // HTTP protocol does not supply this.
+    proofs[h].mutable_id()->set_key_id(log->verifier->KeyID());
+    const BatchedSCT& first(batch[first_scts[h]]);
+    entries.push_back(&first.data->reconstructed_entry());
+    scts.push_back(&first.sct());
+    proof_ptrs.push_back(&proofs[h]);
+    proof_hashes.push_back(h);
+  }
+  const vector<LogVerifier::LogVerifyResult> proof_results(
+      log->verifier->VerifyMerkleAuditProofs(entries, scts, proof_ptrs,
+                                             pool));
+  for (size_t p = 0; p < proof_results.size(); ++p) {
+    if (proof_results[p] == LogVerifier::VERIFY_OK) {
+      log->included.insert(hashes[proof_hashes[p]]);
+    } else {
+      LOG(ERROR) << "Invalid inclusion proof for record "
+                 << batch[first_scts[proof_hashes[p]]].record << ": "
+                 << LogVerifier::VerifyResultString(proof_results[p]);
+    }
+  }
+
+  const uint64_t mmd_ms(static_cast<uint64_t>(FLAGS_audit_mmd_secs) * 1000);
+  for (const size_t i : to_check) {
+    const BatchedSCT& sct(batch[i]);
+    if (log->included.count(sct.leaf_hash) > 0) {
+      ++log->num_included;
+    } else if (!answered[hash_indices[sct.leaf_hash]]) {
+      ++log->num_unavailable;
+    } else if (sct.sct().timestamp() + mmd_ms > log->sth.timestamp()) {
+      ++log->num_pending;
+    } else {
+      LOG(WARNING) << "SCT " << sct.sct_index << " of record " << sct.record
+                   << " (certificate SHA-256 "
+                   << util::HexString(sct.data->certificate_sha256_hash())
+                   << ") is not in the tree of size "
+                   << log->sth.tree_size() << " of " << log->uri;
+      ++log->num_missing;
+    }
+  }
+
+  batch.clear();
+}
+
+// Checks that the SCTs of the SSLClientCTData in
+// --ssl_client_ct_data_in are in the trees of --audit_logs. The SCTs
+// are read in batches of --audit_batch_scts, and the inclusion proofs
+// for each batch fetched from each log at once, against one STH per
+// log, and checked together. The results are reported per log.
+static AuditResult BatchAudit() {
+  CHECK(!FLAGS_ssl_client_ct_data_in.empty())
+      << "Please give the SSLClientCTData to audit with "
+         "--ssl_client_ct_data_in";
+  CHECK_GT(FLAGS_audit_batch_scts, 0);
+  CHECK_GT(FLAGS_audit_concurrent_requests, 0);
+
+  const shared_ptr<cert_trans::libevent::Base> base(
+      make_shared<cert_trans::libevent::Base>());
+  cert_trans::libevent::EventPumpThread pump(base);
+  ThreadPool pool;
+  UrlFetcher url_fetcher(base.get(), &pool);
+
+  vector<unique_ptr<AuditedLog>> logs;
+  if (FLAGS_audit_logs.empty()) {
+    CHECK(!FLAGS_ct_server.empty())
+        << "Please give the logs to audit with --audit_logs";
+    logs.emplace_back(new AuditedLog(FLAGS_ct_server,
+                                     GetLogVerifierFromFlags(), &pool,
+                                     &url_fetcher));
+  } else {
+    for (const string& log : util::split(FLAGS_audit_logs)) {
+      const size_t equals(log.rfind('='));
+      CHECK_NE(string::npos, equals) << "Invalid --audit_logs element \""
+                                     << log << "\"";
+      logs.emplace_back(new AuditedLog(log.substr(0, equals),
+                                       NewLogVerifier(log.substr(equals + 1)),
+                                       &pool, &url_fetcher));
+    }
+  }
+  unordered_map<string, AuditedLog*> logs_by_key_id;
+  for (const unique_ptr<AuditedLog>& log : logs) {
+    CHECK(logs_by_key_id.insert(make_pair(log->verifier->KeyID(), log.get()))
+              .second)
+        << "The key of " << log->uri << " is given twice";
+  }
+
+  if (!GetAuditedSTHs(logs, &pool)) {
+    return CT_SERVER_UNAVAILABLE;
+  }
+
+  const int fd(open(FLAGS_ssl_client_ct_data_in.c_str(), O_RDONLY));
+  PCHECK(fd >= 0) << "Could not open " << FLAGS_ssl_client_ct_data_in;
+  google::protobuf::io::FileInputStream input(fd);
+  input.SetCloseOnDelete(true);
+
+  // The records of the current batch, which its SCTs point into.
+  std::deque<SSLClientCTData> records;
+  int64_t num_records(0);
+  int64_t num_batched(0);
+  int64_t num_unknown_log(0);
+  while (true) {
+    // A new one per record, so as not to run into its total byte limit.
+    google::protobuf::io::CodedInputStream coded_input(&input);
+    uint32_t length;
+    if (!coded_input.ReadVarint32(&length)) {
+      break;
+    }
+    const google::protobuf::io::CodedInputStream::Limit limit(
+        coded_input.PushLimit(length));
+    records.emplace_back();
+    CHECK(records.back().ParseFromCodedStream(&coded_input) &&
+          coded_input.ConsumedEntireMessage())
+        << "Failed to parse record " << num_records << " of "
+        << FLAGS_ssl_client_ct_data_in;
+    coded_input.PopLimit(limit);
+
+    const SSLClientCTData& data(records.back());
+    for (int i = 0; i < data.attached_sct_info_size(); ++i) {
+      const auto log(
+          logs_by_key_id.find(data.attached_sct_info(i).sct().id().key_id()));
+      if (log == logs_by_key_id.end()) {
+        ++num_unknown_log;
+        continue;
+      }
+      log->second->batch.push_back(BatchedSCT{num_records, &data, i, ""});
+      ++num_batched;
+    }
+    ++num_records;
+
+    if (num_batched >= FLAGS_audit_batch_scts) {
+      for (const unique_ptr<AuditedLog>& log : logs) {
+        AuditBatch(log.get(), &pool);
+      }
+      records.clear();
+      num_batched = 0;
+      LOG(INFO) << "Audited the SCTs of " << num_records << " records";
+    }
+  }
+  for (const unique_ptr<AuditedLog>& log : logs) {
+    AuditBatch(log.get(), &pool);
+  }
+
+  std::cout << num_records << " records, with " << num_unknown_log
+            << " SCTs from other logs" << std::endl;
+  AuditResult audit_result(PROOF_OK);
+  for (const unique_ptr<AuditedLog>& log : logs) {
+    std::cout << log->uri << ": " << log->num_scts << " SCTs, "
+              << log->num_included << " included, " << log->num_pending
+              << " pending, " << log->num_missing << " missing, "
+              << log->num_bad_signature << " with a bad signature, "
+              << log->num_unavailable << " not checked" << std::endl;
+    if (log->num_missing > 0 || log->num_bad_signature > 0) {
+      audit_result = PROOF_NOT_FOUND;
+    } else if (log->num_unavailable > 0 && audit_result == PROOF_OK) {
+      audit_result = CT_SERVER_UNAVAILABLE;
+    }
+  }
+  return audit_result;
+}
+
 static int CheckConsistency() {
   HTTPLogClient client(FLAGS_ct_server);
   unique_ptr<LogVerifier> verifier(GetLogVerifierFromFlags());
@@ -838,8 +1284,170 @@ static void WriteCertificate(const std::string& cert, int entry,
   out << cert;
 }
 
-void GetEntries() {
+// Gets the current STH from --ct_server, and checks it with
+// --ct_server_public_key.
+static bool GetVerifiedSTH(SignedTreeHead* sth) {
+  HTTPLogClient client(FLAGS_ct_server);
+
+  const StatusOr<SignedTreeHead> status_or_sth(client.GetSTH());
+  CHECK_EQ(status_or_sth.status(), ::util::OkStatus());
+  *sth = status_or_sth.ValueOrDie();
+
+  const unique_ptr<LogVerifier> verifier(GetLogVerifierFromFlags());
+
+  // Allow for 10 seconds of clock skew
+  uint64_t latest = ((uint64_t)time(NULL) + 10) * 1000;
+  const LogVerifier::LogVerifyResult result =
+      verifier->VerifySignedTreeHead(*sth, 0, latest);
+
+  LOG(INFO) << "STH is " << sth->DebugString();
+
+  if (result != LogVerifier::VERIFY_OK) {
+    if (result == LogVerifier::INVALID_TIMESTAMP)
+      LOG(ERROR) << "STH has bad timestamp (" << sth->timestamp() << ")";
+    else if (result == LogVerifier::INVALID_SIGNATURE)
+      LOG(ERROR) << "STH signature doesn't validate";
+    else
+      LOG(ERROR) << "STH validation failed with unknown error " << result;
+    return false;
+  }
+
+  return true;
+}
+
+// The log as of one tree head, for FetchLogEntries(): the entries past
+// it are left alone, even if the log has grown since.
+class TreeHeadPeer : public Peer {
+ public:
+  TreeHeadPeer(unique_ptr<AsyncLogClient> client, int64_t tree_size)
+      : Peer(move(client)), tree_size_(tree_size) {
+  }
+
+  int64_t TreeSize() const override {
+    return tree_size_;
+  }
+
+ private:
+  const int64_t tree_size_;
+};
+
+static void WriteTreeCheckpoint(Database* db, CompactMerkleTree* tree) {
+  CompactTreeCheckpoint checkpoint;
+  checkpoint.set_tree_size(tree->LeafCount());
+  for (const string& node : tree->Frontier()) {
+    checkpoint.add_frontier(node);
+  }
+  checkpoint.set_sha256_root_hash(tree->CurrentRoot());
+  CHECK_EQ(Database::OK, db->WriteTreeCheckpoint(checkpoint));
+}
+
+// Appends the leaf hashes of the entries written to |db| since the
+// last call to |tree|, as far as they are contiguous, checkpointing
+// the tree every --get_entries_checkpoint_entries entries (the
+// checkpoint also syncs the entries it covers), so that a later run
+// picks up from there.
+static void HashWrittenEntries(Database* db, CompactMerkleTree* tree,
+                               size_t* checkpointed_size) {
+  const size_t tree_size(db->TreeSize());
+  if (tree->LeafCount() >= tree_size) {
+    return;
+  }
+
+  const unique_ptr<Database::LeafHashIterator> it(
+      db->ScanLeafHashes(tree->LeafCount()));
+  int64_t sequence_number;
+  string leaf_hash;
+  while (tree->LeafCount() < tree_size &&
+         it->GetNextLeafHash(&sequence_number, &leaf_hash)) {
+    CHECK_EQ(static_cast<size_t>(sequence_number), tree->LeafCount());
+    tree->AddLeafHash(leaf_hash);
+  }
+
+  if (tree->LeafCount() >=
+      *checkpointed_size + FLAGS_get_entries_checkpoint_entries) {
+    WriteTreeCheckpoint(db, tree);
+    *checkpointed_size = tree->LeafCount();
+    LOG(INFO) << "verified " << tree->LeafCount() << " entries so far";
+  }
+}
+
+// Downloads the log up to its current STH into --get_entries_dir,
+// with as many requests in flight and as many entries per request as
+// the log keeps up with (see FetchController). Entries are hashed into
+// a compact Merkle tree as they are written, and the download only
+// succeeds if its root matches that of the STH, which is then stored
+// with the entries.
+static int BulkGetEntries() {
+  SignedTreeHead sth;
+  if (!GetVerifiedSTH(&sth)) {
+    return 1;
+  }
+
+  SegmentDB db(FLAGS_get_entries_dir);
+  if (db.TreeSize() > sth.tree_size()) {
+    LOG(ERROR) << FLAGS_get_entries_dir << " already has " << db.TreeSize()
+               << " entries, more than the STH of size " << sth.tree_size();
+    return 1;
+  }
+
+  unique_ptr<CompactMerkleTree> tree(TreeSigner::TreeFromCheckpoint(&db));
+  if (!tree) {
+    tree.reset(
+        new CompactMerkleTree(unique_ptr<Sha256Hasher>(new Sha256Hasher)));
+  }
+  size_t checkpointed_size(tree->LeafCount());
+  LOG(INFO) << "have " << db.TreeSize() << " entries, " << tree->LeafCount()
+            << " of them verified, fetching up to " << sth.tree_size();
+
+  const shared_ptr<cert_trans::libevent::Base> base(
+      make_shared<cert_trans::libevent::Base>());
+  cert_trans::libevent::EventPumpThread pump(base);
+  ThreadPool pool;
+  UrlFetcher url_fetcher(base.get(), &pool);
+  const unique_ptr<LogVerifier> verifier(GetLogVerifierFromFlags());
+
+  unique_ptr<PeerGroup> peer_group(new PeerGroup(false /* fetch_scts */));
+  peer_group->Add(make_shared<TreeHeadPeer>(
+      unique_ptr<AsyncLogClient>(
+          new AsyncLogClient(&pool, &url_fetcher, FLAGS_ct_server)),
+      sth.tree_size()));
+
+  SyncTask fetch_task(&pool);
+  // The entries are written by one thread at a time, so this is not
+  // called concurrently.
+  FetchLogEntries(&db, move(peer_group), verifier.get(), fetch_task.task(),
+                  [&db, &tree, &checkpointed_size]() {
+                    HashWrittenEntries(&db, tree.get(), &checkpointed_size);
+                  });
+  fetch_task.Wait();
+  if (!fetch_task.status().ok()) {
+    LOG(ERROR) << "fetching entries failed: " << fetch_task.status();
+    HashWrittenEntries(&db, tree.get(), &checkpointed_size);
+    WriteTreeCheckpoint(&db, tree.get());
+    return 1;
+  }
+
+  HashWrittenEntries(&db, tree.get(), &checkpointed_size);
+  if (tree->LeafCount() != static_cast<size_t>(sth.tree_size()) ||
+      tree->CurrentRoot() != sth.sha256_root_hash()) {
+    LOG(ERROR) << "the " << tree->LeafCount()
+               << " entries fetched do not match the STH";
+    return 1;
+  }
+
+  WriteTreeCheckpoint(&db, tree.get());
+  CHECK_EQ(Database::OK, db.WriteTreeHead(sth));
+  LOG(INFO) << "fetched and verified all " << sth.tree_size() << " entries";
+
+  return 0;
+}
+
+int GetEntries() {
   CHECK_NE(FLAGS_ct_server, "");
+  if (!FLAGS_get_entries_dir.empty()) {
+    return BulkGetEntries();
+  }
+
   HTTPLogClient client(FLAGS_ct_server);
   const StatusOr<vector<AsyncLogClient::Entry>> entries(
       client.GetEntries(FLAGS_get_first, FLAGS_get_last));
@@ -871,6 +1479,8 @@ void GetEntries() {
                          "x509");
     }
   }
+
+  return 0;
 }
 
 int GetRoots() {
@@ -896,33 +1506,13 @@ int GetRoots() {
 int GetSTH() {
   CHECK_NE(FLAGS_ct_server, "");
 
-  HTTPLogClient client(FLAGS_ct_server);
-
-  const StatusOr<SignedTreeHead> sth(client.GetSTH());
-  CHECK_EQ(sth.status(), ::util::OkStatus());
-
-  const unique_ptr<LogVerifier> verifier(GetLogVerifierFromFlags());
-
-  // Allow for 10 seconds of clock skew
-  uint64_t latest = ((uint64_t)time(NULL) + 10) * 1000;
-  const LogVerifier::LogVerifyResult result =
-      verifier->VerifySignedTreeHead(sth.ValueOrDie(), 0, latest);
-
-  LOG(INFO) << "STH is " << sth.ValueOrDie().DebugString();
-
-  if (result != LogVerifier::VERIFY_OK) {
-    if (result == LogVerifier::INVALID_TIMESTAMP)
-      LOG(ERROR) << "STH has bad timestamp (" << sth.ValueOrDie().timestamp()
-                 << ")";
-    else if (result == LogVerifier::INVALID_SIGNATURE)
-      LOG(ERROR) << "STH signature doesn't validate";
-    else
-      LOG(ERROR) << "STH validation failed with unknown error " << result;
+  SignedTreeHead sth;
+  if (!GetVerifiedSTH(&sth)) {
     return 1;
   }
 
   string sth_str;
-  CHECK(sth.ValueOrDie().SerializeToString(&sth_str));
+  CHECK(sth.SerializeToString(&sth_str));
   WriteFile(FLAGS_ct_server_response_out, sth_str, "STH");
 
   return 0;
@@ -962,6 +1552,8 @@ int main(int argc, char** argv) {
     ret = Upload();
   } else if (cmd == "audit") {
     ret = Audit();
+  } else if (cmd == "batch_audit") {
+    ret = BatchAudit();
   } else if (cmd == "consistency") {
     ret = CheckConsistency();
   } else if (cmd == "certificate") {
@@ -977,7 +1569,7 @@ int main(int argc, char** argv) {
   } else if (cmd == "wrap_embedded") {
     WrapEmbedded();
   } else if (cmd == "get_entries") {
-    GetEntries();
+    ret = GetEntries();
   } else if (cmd == "get_roots") {
     ret = GetRoots();
   } else if (cmd == "sth") {
@@ -14,6 +14,7 @@ using std::map;
 using std::move;
 using std::mutex;
 using std::placeholders::_1;
+using std::set;
 using std::shared_ptr;
 using std::string;
 using std::unique_lock;
@@ -31,41 +32,57 @@ namespace {
 class ContinuousFetcherImpl : public ContinuousFetcher {
  public:
   ContinuousFetcherImpl(libevent::Base* base, Executor* executor, Database* db,
-                        const LogVerifier* log_verifier, bool fetch_scts);
+                        const LogVerifier* log_verifier, bool fetch_scts,
+                        FetchBudget::Share* budget);
   ContinuousFetcherImpl(const ContinuousFetcherImpl&) = delete;
   ContinuousFetcherImpl& operator=(const ContinuousFetcherImpl&) = delete;
 
   void AddPeer(const string& node_id, const shared_ptr<Peer>& peer) override;
   void RemovePeer(const string& node_id) override;
+  void FetchNow() override;
+  void AddEntriesWrittenCallback(
+      const EntriesWrittenCallback* callback) override;
+  void RemoveEntriesWrittenCallback(
+      const EntriesWrittenCallback* callback) override;
 
  private:
   void StartFetch(const unique_lock<mutex>& lock);
   void FetchDone(Task* task);
   void FetchDelayDone(Task* task);
+  void EntriesWritten();
 
   libevent::Base* const base_;
   Executor* const executor_;
   Database* const db_;
   const LogVerifier* const log_verifier_;
   const bool fetch_scts_;
+  FetchBudget::Share* const budget_;
 
   mutex lock_;
   map<string, shared_ptr<Peer>> peers_;
 
   bool restart_fetch_;
+  bool fetch_again_;
   unique_ptr<Task> fetch_task_;
+
+  // Not |lock_|, as the callbacks can call back into this instance.
+  mutex callbacks_lock_;
+  set<const EntriesWrittenCallback*> callbacks_;
 };
 
 
 ContinuousFetcherImpl::ContinuousFetcherImpl(
     libevent::Base* base, Executor* executor, Database* db,
-    const LogVerifier* const log_verifier, bool fetch_scts)
+    const LogVerifier* const log_verifier, bool fetch_scts,
+    FetchBudget::Share* budget)
     : base_(CHECK_NOTNULL(base)),
       executor_(CHECK_NOTNULL(executor)),
       db_(CHECK_NOTNULL(db)),
       log_verifier_(CHECK_NOTNULL(log_verifier)),
       fetch_scts_(fetch_scts),
-      restart_fetch_(false) {
+      budget_(budget),
+      restart_fetch_(false),
+      fetch_again_(false) {
 }
 
 
@@ -105,11 +122,37 @@ void ContinuousFetcherImpl::RemovePeer(const string& node_id) {
 }
 
 
+void ContinuousFetcherImpl::FetchNow() {
+  unique_lock<mutex> lock(lock_);
+
+  if (fetch_task_) {
+    fetch_again_ = true;
+  } else {
+    StartFetch(lock);
+  }
+}
+
+
+void ContinuousFetcherImpl::AddEntriesWrittenCallback(
+    const EntriesWrittenCallback* callback) {
+  lock_guard<mutex> lock(callbacks_lock_);
+  CHECK(callbacks_.insert(CHECK_NOTNULL(callback)).second);
+}
+
+
+void ContinuousFetcherImpl::RemoveEntriesWrittenCallback(
+    const EntriesWrittenCallback* callback) {
+  lock_guard<mutex> lock(callbacks_lock_);
+  CHECK_EQ(static_cast<size_t>(1), callbacks_.erase(callback));
+}
+
+
 void ContinuousFetcherImpl::StartFetch(const unique_lock<mutex>& lock) {
   CHECK(lock.owns_lock());
   CHECK(!fetch_task_);
 
   restart_fetch_ = false;
+  fetch_again_ = false;
 
   unique_ptr<PeerGroup> peer_group(new PeerGroup(fetch_scts_));
   for (const auto& peer : peers_) {
@@ -120,7 +163,9 @@ void ContinuousFetcherImpl::StartFetch(const unique_lock<mutex>& lock) {
       new Task(bind(&ContinuousFetcherImpl::FetchDone, this, _1), executor_));
 
   VLOG(1) << "starting fetch with tree size: " << peer_group->TreeSize();
-  FetchLogEntries(db_, move(peer_group), log_verifier_, fetch_task_.get());
+  FetchLogEntries(db_, move(peer_group), log_verifier_, fetch_task_.get(),
+                  bind(&ContinuousFetcherImpl::EntriesWritten, this),
+                  budget_);
 }
 
 
@@ -132,7 +177,7 @@ void ContinuousFetcherImpl::FetchDone(Task* task) {
   lock_guard<mutex> lock(lock_);
   fetch_task_.reset();
 
-  if (restart_fetch_) {
+  if (restart_fetch_ || fetch_again_) {
     executor_->Add(
         bind(&ContinuousFetcherImpl::FetchDelayDone, this, nullptr));
   } else {
@@ -158,15 +203,24 @@ void ContinuousFetcherImpl::FetchDelayDone(Task* task) {
 }
 
 
+void ContinuousFetcherImpl::EntriesWritten() {
+  lock_guard<mutex> lock(callbacks_lock_);
+  for (const EntriesWrittenCallback* callback : callbacks_) {
+    (*callback)();
+  }
+}
+
+
 }  // namespace
 
 
 // static
 unique_ptr<ContinuousFetcher> ContinuousFetcher::New(
     libevent::Base* base, Executor* executor, Database* db,
-    const LogVerifier* log_verifier, bool fetch_scts) {
-  return unique_ptr<ContinuousFetcher>(
-      new ContinuousFetcherImpl(base, executor, db, log_verifier, fetch_scts));
+    const LogVerifier* log_verifier, bool fetch_scts,
+    FetchBudget::Share* budget) {
+  return unique_ptr<ContinuousFetcher>(new ContinuousFetcherImpl(
+      base, executor, db, log_verifier, fetch_scts, budget));
 }
 
 
@@ -1,12 +1,14 @@
 #ifndef CERT_TRANS_FETCHER_CONTINUOUS_FETCHER_H_
 #define CERT_TRANS_FETCHER_CONTINUOUS_FETCHER_H_
 
+#include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <set>
 #include <string>
 
+#include "fetcher/fetch_budget.h"
 #include "fetcher/peer.h"
 #include "log/database.h"
 #include "log/logged_entry.h"
@@ -21,9 +23,14 @@ namespace cert_trans {
 
 class ContinuousFetcher {
  public:
+  typedef std::function<void()> EntriesWrittenCallback;
+
+  // If set, the fetch requests are only started as |budget| allows,
+  // which must outlive the returned instance.
   static std::unique_ptr<ContinuousFetcher> New(
       libevent::Base* base, util::Executor* executor, Database* db,
-      const LogVerifier* log_verifier, bool fetch_scts);
+      const LogVerifier* log_verifier, bool fetch_scts,
+      FetchBudget::Share* budget = nullptr);
 
   virtual ~ContinuousFetcher() = default;
   ContinuousFetcher(const ContinuousFetcher&) = delete;
@@ -34,6 +41,23 @@ class ContinuousFetcher {
 
   virtual void RemovePeer(const std::string& node_id) = 0;
 
+  // Fetches from the peers right away, rather than after
+  // --delay_between_fetches_seconds, for when one of them has new
+  // entries. If a fetch is under way already, another one is started
+  // as soon as it is done, so that it picks up the new entries.
+  virtual void FetchNow() = 0;
+
+  // Add/remove a callback to be called every time fetched entries are
+  // written to the database (from an executor thread), so that
+  // whatever waits on the database to grow can carry on right away.
+  // The pointer is used as a key, so it should be the same in
+  // matching add/remove calls. Once the removal returns, the callback
+  // is not running, and will not be called again.
+  virtual void AddEntriesWrittenCallback(
+      const EntriesWrittenCallback* callback) = 0;
+  virtual void RemoveEntriesWrittenCallback(
+      const EntriesWrittenCallback* callback) = 0;
+
  protected:
   ContinuousFetcher() = default;
 };
@@ -0,0 +1,146 @@
+#include "fetcher/fetch_budget.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+
+#include "monitoring/monitoring.h"
+
+using std::chrono::seconds;
+using std::lock_guard;
+using std::max;
+using std::mutex;
+using std::string;
+using std::unique_ptr;
+
+namespace cert_trans {
+namespace {
+
+
+static Gauge<string>* fetch_budget_in_flight(
+    Gauge<string>::New("fetch_budget_in_flight", "log",
+                       "Number of fetch requests in flight for a log, out "
+                       "of the budget shared by the logs of the process."));
+
+// How long a share which was refused counts as wanting more, so that
+// one that stopped fetching does not hold on to its part.
+const seconds kWantingExpiry(1);
+
+
+}  // namespace
+
+
+FetchBudget::FetchBudget(int max_in_flight)
+    : max_in_flight_(max_in_flight), in_flight_(0) {
+  CHECK_GT(max_in_flight_, 0);
+}
+
+
+FetchBudget::~FetchBudget() {
+  CHECK(shares_.empty());
+  CHECK_EQ(0, in_flight_);
+}
+
+
+unique_ptr<FetchBudget::Share> FetchBudget::NewShare(const string& name,
+                                                     int priority) {
+  CHECK_GT(priority, 0);
+  unique_ptr<Share> share(new Share(this, name, priority));
+  lock_guard<mutex> lock(lock_);
+  CHECK(shares_.insert(share.get()).second);
+  fetch_budget_in_flight->Set(name, 0);
+  return share;
+}
+
+
+bool FetchBudget::IsActive(const Share* share, clock::time_point now) const {
+  return share->in_flight_ > 0 || (share->refused_ != clock::time_point() &&
+                                   now - share->refused_ < kWantingExpiry);
+}
+
+
+int FetchBudget::Quota(const Share* share, int total_priority) const {
+  return max(1, max_in_flight_ * share->priority_ / total_priority);
+}
+
+
+bool FetchBudget::TryStart(Share* share) {
+  lock_guard<mutex> lock(lock_);
+  const clock::time_point now(clock::now());
+
+  bool start(in_flight_ < max_in_flight_);
+  if (start) {
+    int total_priority(share->priority_);
+    for (const Share* other : shares_) {
+      if (other != share && IsActive(other, now)) {
+        total_priority += other->priority_;
+      }
+    }
+
+    // What the other active shares could still start, within their
+    // part, is kept for them.
+    int reserved(0);
+    for (const Share* other : shares_) {
+      if (other != share && IsActive(other, now)) {
+        reserved += max(0, Quota(other, total_priority) - other->in_flight_);
+      }
+    }
+
+    start = share->in_flight_ < Quota(share, total_priority) ||
+            in_flight_ + reserved < max_in_flight_;
+  }
+
+  if (!start) {
+    share->refused_ = now;
+    return false;
+  }
+
+  share->refused_ = clock::time_point();
+  ++share->in_flight_;
+  ++in_flight_;
+  fetch_budget_in_flight->Set(share->name_, share->in_flight_);
+  return true;
+}
+
+
+void FetchBudget::Done(Share* share) {
+  lock_guard<mutex> lock(lock_);
+  CHECK_GT(share->in_flight_, 0);
+  --share->in_flight_;
+  --in_flight_;
+  fetch_budget_in_flight->Set(share->name_, share->in_flight_);
+}
+
+
+void FetchBudget::Remove(Share* share) {
+  lock_guard<mutex> lock(lock_);
+  CHECK_EQ(0, share->in_flight_) << "Share of " << share->name_
+                                 << " destroyed with requests in flight";
+  CHECK_EQ(static_cast<size_t>(1), shares_.erase(share));
+}
+
+
+FetchBudget::Share::Share(FetchBudget* budget, const string& name,
+                          int priority)
+    : budget_(CHECK_NOTNULL(budget)),
+      name_(name),
+      priority_(priority),
+      in_flight_(0) {
+}
+
+
+FetchBudget::Share::~Share() {
+  budget_->Remove(this);
+}
+
+
+bool FetchBudget::Share::TryStart() {
+  return budget_->TryStart(this);
+}
+
+
+void FetchBudget::Share::Done() {
+  budget_->Done(this);
+}
+
+
+}  // namespace cert_trans
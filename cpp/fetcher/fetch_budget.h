@@ -0,0 +1,106 @@
+#ifndef CERT_TRANS_FETCHER_FETCH_BUDGET_H_
+#define CERT_TRANS_FETCHER_FETCH_BUDGET_H_
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+
+namespace cert_trans {
+
+
+// Bounds how many fetch requests are in flight at once across all the
+// logs fetched by a process (such as a mirror of many logs), so that
+// they share its bandwidth rather than each taking as much as its
+// peers allow.
+//
+// Each log has a share of the budget with a priority. While several
+// logs are fetching, each can have a part of the budget in proportion
+// to its priority, and whatever a log leaves unused can be taken by
+// the others.
+//
+// The FetchController of each peer still applies: the budget only
+// lowers how many requests are started.
+//
+// This class is thread-safe.
+class FetchBudget {
+ public:
+  class Share;
+
+  explicit FetchBudget(int max_in_flight);
+  // All the shares must have been destroyed.
+  ~FetchBudget();
+  FetchBudget(const FetchBudget&) = delete;
+  FetchBudget& operator=(const FetchBudget&) = delete;
+
+  // Returns a new share for the log called |name| (for the metrics),
+  // with |priority|, which must be positive. It must not outlive this
+  // instance.
+  std::unique_ptr<Share> NewShare(const std::string& name, int priority);
+
+  int max_in_flight() const {
+    return max_in_flight_;
+  }
+
+ private:
+  typedef std::chrono::steady_clock clock;
+
+  bool TryStart(Share* share);
+  void Done(Share* share);
+  void Remove(Share* share);
+  // Whether |share| counts when dividing the budget.
+  bool IsActive(const Share* share, clock::time_point now) const;
+  // The part of the budget |share| can have when all the active
+  // shares want theirs, with their priorities adding up to
+  // |total_priority|.
+  int Quota(const Share* share, int total_priority) const;
+
+  const int max_in_flight_;
+
+  std::mutex lock_;
+  std::set<Share*> shares_;
+  int in_flight_;
+};
+
+
+class FetchBudget::Share {
+ public:
+  ~Share();
+  Share(const Share&) = delete;
+  Share& operator=(const Share&) = delete;
+
+  // Returns true if a request can be started now, in which case
+  // Done() must be called once it completes. Otherwise, the share
+  // counts as wanting more for a little while, so that the others
+  // leave room for it, and it should try again shortly.
+  bool TryStart();
+  void Done();
+
+  const std::string& name() const {
+    return name_;
+  }
+
+  int priority() const {
+    return priority_;
+  }
+
+ private:
+  friend class FetchBudget;
+
+  Share(FetchBudget* budget, const std::string& name, int priority);
+
+  FetchBudget* const budget_;
+  const std::string name_;
+  const int priority_;
+
+  // These are guarded by the lock of |budget_|.
+  int in_flight_;
+  // When TryStart() last returned false, if it did.
+  clock::time_point refused_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_FETCHER_FETCH_BUDGET_H_
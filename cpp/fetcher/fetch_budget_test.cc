@@ -0,0 +1,106 @@
+#include "fetcher/fetch_budget.h"
+
+#include <gtest/gtest.h>
+#include <memory>
+
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::unique_ptr;
+
+
+// Starts as many requests as |share| is allowed, returning how many.
+int StartAll(FetchBudget::Share* share) {
+  int started(0);
+  while (share->TryStart()) {
+    ++started;
+  }
+  return started;
+}
+
+
+TEST(FetchBudgetTest, BoundsRequestsInFlight) {
+  FetchBudget budget(4);
+  const unique_ptr<FetchBudget::Share> share(budget.NewShare("log", 1));
+
+  EXPECT_EQ(4, StartAll(share.get()));
+  share->Done();
+  EXPECT_TRUE(share->TryStart());
+  EXPECT_FALSE(share->TryStart());
+
+  for (int i = 0; i < 4; ++i) {
+    share->Done();
+  }
+}
+
+
+TEST(FetchBudgetTest, LendsWhatIsNotUsed) {
+  FetchBudget budget(8);
+  const unique_ptr<FetchBudget::Share> busy(budget.NewShare("busy", 1));
+  const unique_ptr<FetchBudget::Share> idle(budget.NewShare("idle", 3));
+
+  // The other share is not fetching, so all of it can be used.
+  EXPECT_EQ(8, StartAll(busy.get()));
+
+  // But once it wants some, it gets its part back as requests finish.
+  EXPECT_FALSE(idle->TryStart());
+  for (int i = 0; i < 8; ++i) {
+    busy->Done();
+  }
+  EXPECT_EQ(2, StartAll(busy.get()));
+  EXPECT_EQ(6, StartAll(idle.get()));
+
+  for (int i = 0; i < 6; ++i) {
+    idle->Done();
+  }
+  for (int i = 0; i < 2; ++i) {
+    busy->Done();
+  }
+}
+
+
+TEST(FetchBudgetTest, DividesByPriority) {
+  FetchBudget budget(8);
+  const unique_ptr<FetchBudget::Share> low(budget.NewShare("low", 1));
+  const unique_ptr<FetchBudget::Share> high(budget.NewShare("high", 3));
+
+  // With both active, the low priority one only gets its part, while
+  // the room for the other is kept.
+  EXPECT_TRUE(high->TryStart());
+  EXPECT_EQ(2, StartAll(low.get()));
+  EXPECT_EQ(5, StartAll(high.get()));
+
+  for (int i = 0; i < 2; ++i) {
+    low->Done();
+  }
+  for (int i = 0; i < 6; ++i) {
+    high->Done();
+  }
+}
+
+
+TEST(FetchBudgetTest, GivesEachShareAtLeastOne) {
+  FetchBudget budget(2);
+  const unique_ptr<FetchBudget::Share> a(budget.NewShare("a", 1));
+  const unique_ptr<FetchBudget::Share> b(budget.NewShare("b", 100));
+
+  EXPECT_TRUE(b->TryStart());
+  EXPECT_TRUE(a->TryStart());
+  EXPECT_FALSE(b->TryStart());
+  EXPECT_FALSE(a->TryStart());
+
+  a->Done();
+  b->Done();
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
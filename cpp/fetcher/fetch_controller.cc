@@ -0,0 +1,163 @@
+#include "fetcher/fetch_controller.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <algorithm>
+
+#include "monitoring/latency.h"
+#include "monitoring/monitoring.h"
+
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::lock_guard;
+using std::max;
+using std::min;
+using std::mutex;
+using std::string;
+
+DEFINE_int32(fetcher_concurrent_fetches, 2,
+             "number of concurrent fetch requests to start with, per peer");
+DEFINE_int32(fetcher_max_concurrent_fetches, 16,
+             "maximum number of concurrent fetch requests, per peer, as "
+             "they are increased while they succeed");
+DEFINE_int32(fetcher_batch_size, 1000,
+             "maximum number of entries to fetch per request");
+
+namespace cert_trans {
+namespace {
+
+
+static Gauge<string>* fetcher_peer_max_in_flight(
+    Gauge<string>::New("fetcher_peer_max_in_flight", "peer",
+                       "Number of fetch requests allowed in flight to a "
+                       "peer."));
+
+static Gauge<string>* fetcher_peer_batch_size(
+    Gauge<string>::New("fetcher_peer_batch_size", "peer",
+                       "Number of entries asked for per fetch request to a "
+                       "peer."));
+
+static Counter<string>* fetcher_peer_entries_fetched(
+    Counter<string>::New("fetcher_peer_entries_fetched", "peer",
+                         "Number of entries fetched from a peer."));
+
+static Counter<string>* fetcher_peer_fetch_errors(
+    Counter<string>::New("fetcher_peer_fetch_errors", "peer",
+                         "Number of failed fetch requests to a peer."));
+
+static Latency<milliseconds, string> fetcher_peer_fetch_latency_ms(
+    "fetcher_peer_fetch_latency_ms", "peer",
+    "Time taken by fetch requests to a peer, in ms.");
+
+
+// After this many responses in a row with all the entries asked for,
+// asking for more is tried again.
+const int kFullResponsesBeforeGrowing(16);
+
+// How much each successful request counts in the moving averages.
+const double kAverageWeight(0.2);
+
+
+}  // namespace
+
+
+FetchController::FetchController(const string& peer_name)
+    : peer_name_(peer_name),
+      window_(max(1, FLAGS_fetcher_concurrent_fetches)),
+      in_flight_(0),
+      batch_size_(max(1, FLAGS_fetcher_batch_size)),
+      num_full_responses_(0),
+      throughput_(0),
+      latency_(steady_clock::duration::zero()) {
+  fetcher_peer_max_in_flight->Set(peer_name_, window_);
+  fetcher_peer_batch_size->Set(peer_name_, batch_size_);
+}
+
+
+int64_t FetchController::BatchSize() const {
+  lock_guard<mutex> lock(lock_);
+  return batch_size_;
+}
+
+
+int FetchController::MaxInFlight() const {
+  lock_guard<mutex> lock(lock_);
+  return static_cast<int>(window_);
+}
+
+
+int FetchController::Room() const {
+  lock_guard<mutex> lock(lock_);
+  return static_cast<int>(window_) - in_flight_;
+}
+
+
+double FetchController::Throughput() const {
+  lock_guard<mutex> lock(lock_);
+  return throughput_;
+}
+
+
+steady_clock::duration FetchController::TypicalLatency() const {
+  lock_guard<mutex> lock(lock_);
+  return latency_;
+}
+
+
+void FetchController::FetchStarted() {
+  lock_guard<mutex> lock(lock_);
+  ++in_flight_;
+}
+
+
+void FetchController::FetchDone(bool ok, int64_t requested, int64_t received,
+                                const steady_clock::duration& latency) {
+  fetcher_peer_fetch_latency_ms.RecordLatency(peer_name_, latency);
+
+  lock_guard<mutex> lock(lock_);
+  CHECK_GT(in_flight_, 0);
+  --in_flight_;
+
+  if (!ok) {
+    fetcher_peer_fetch_errors->Increment(peer_name_);
+    window_ = max(1.0, window_ / 2);
+    fetcher_peer_max_in_flight->Set(peer_name_, static_cast<int>(window_));
+    return;
+  }
+
+  fetcher_peer_entries_fetched->IncrementBy(peer_name_, received);
+  // One more per window's worth of successful requests.
+  window_ = min<double>(max(1, FLAGS_fetcher_max_concurrent_fetches),
+                        window_ + 1 / window_);
+  fetcher_peer_max_in_flight->Set(peer_name_, static_cast<int>(window_));
+
+  const double seconds(max(duration<double>(latency).count(), 1e-3));
+  if (throughput_ == 0) {
+    throughput_ = received / seconds;
+    latency_ = latency;
+  } else {
+    throughput_ += kAverageWeight * (received / seconds - throughput_);
+    latency_ += duration_cast<steady_clock::duration>(
+        kAverageWeight * (latency - latency_));
+  }
+
+  if (received < requested) {
+    // That is as many as the peer returns at once, asking for more
+    // would only split ranges.
+    batch_size_ = max<int64_t>(1, min(batch_size_, received));
+    num_full_responses_ = 0;
+  } else if (requested >= batch_size_ &&
+             ++num_full_responses_ >= kFullResponsesBeforeGrowing) {
+    // The peer might have raised its limit, or returned a short
+    // response for another reason before.
+    batch_size_ = min<int64_t>(max(1, FLAGS_fetcher_batch_size),
+                               batch_size_ * 2);
+    num_full_responses_ = 0;
+  }
+  fetcher_peer_batch_size->Set(peer_name_, batch_size_);
+}
+
+
+}  // namespace cert_trans
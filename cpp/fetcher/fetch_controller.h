@@ -0,0 +1,74 @@
+#ifndef CERT_TRANS_FETCHER_FETCH_CONTROLLER_H_
+#define CERT_TRANS_FETCHER_FETCH_CONTROLLER_H_
+
+#include <stdint.h>
+#include <chrono>
+#include <mutex>
+#include <string>
+
+namespace cert_trans {
+
+
+// Adapts how entries are fetched from a peer to how it responds. How
+// many requests are in flight at once is increased additively while
+// they succeed, and halved when one fails, as logs throttle clients
+// by failing requests. How many entries are asked for at once is
+// lowered to what the peer actually returns, since logs cap their
+// responses, and is tried higher again once in a while.
+//
+// It also keeps track of the throughput and latency of the requests,
+// so that they can be spread across peers according to how fast they
+// are.
+//
+// The limits are exported as metrics labelled with |peer_name|, along
+// with the entries fetched, the errors and the latency.
+//
+// This class is thread-safe.
+class FetchController {
+ public:
+  explicit FetchController(const std::string& peer_name);
+  FetchController(const FetchController&) = delete;
+  FetchController& operator=(const FetchController&) = delete;
+
+  // Returns how many entries to ask for in a request.
+  int64_t BatchSize() const;
+
+  // Returns how many requests can be in flight at once.
+  int MaxInFlight() const;
+
+  // Returns how many more requests can be started right now, which is
+  // negative if there are too many in flight already.
+  int Room() const;
+
+  // Returns how many entries per second a request to this peer
+  // fetches, and how long it takes, on average. Both are zero until a
+  // request succeeded.
+  double Throughput() const;
+  std::chrono::steady_clock::duration TypicalLatency() const;
+
+  // To be called around each request, with the number of entries
+  // asked for and received (if |ok|).
+  void FetchStarted();
+  void FetchDone(bool ok, int64_t requested, int64_t received,
+                 const std::chrono::steady_clock::duration& latency);
+
+ private:
+  const std::string peer_name_;
+
+  mutable std::mutex lock_;
+  // The number of requests allowed in flight, in fractions, so that
+  // it can grow by one per round of requests.
+  double window_;
+  int in_flight_;
+  int64_t batch_size_;
+  // Consecutive responses with all the entries asked for.
+  int num_full_responses_;
+  // Moving averages over the successful requests.
+  double throughput_;
+  std::chrono::steady_clock::duration latency_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_FETCHER_FETCH_CONTROLLER_H_
@@ -0,0 +1,110 @@
+#include "fetcher/fetch_controller.h"
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include <chrono>
+
+#include "util/testing.h"
+
+DECLARE_int32(fetcher_batch_size);
+DECLARE_int32(fetcher_concurrent_fetches);
+DECLARE_int32(fetcher_max_concurrent_fetches);
+
+namespace cert_trans {
+namespace {
+
+using std::chrono::milliseconds;
+
+
+class FetchControllerTest : public ::testing::Test {
+ protected:
+  FetchControllerTest() {
+    FLAGS_fetcher_batch_size = 1000;
+    FLAGS_fetcher_concurrent_fetches = 2;
+    FLAGS_fetcher_max_concurrent_fetches = 4;
+  }
+
+  void Fetch(FetchController* controller, bool ok, int64_t received) {
+    const int64_t requested(controller->BatchSize());
+    controller->FetchStarted();
+    controller->FetchDone(ok, requested, received, milliseconds(10));
+  }
+};
+
+
+TEST_F(FetchControllerTest, GrowsAndHalvesConcurrency) {
+  FetchController controller("peer");
+  EXPECT_EQ(2, controller.MaxInFlight());
+  EXPECT_EQ(2, controller.Room());
+
+  controller.FetchStarted();
+  EXPECT_EQ(1, controller.Room());
+  controller.FetchDone(true, 1000, 1000, milliseconds(10));
+
+  // It takes about a window's worth of successes to grow by one.
+  for (int i = 0; i < 20; ++i) {
+    Fetch(&controller, true, 1000);
+  }
+  EXPECT_EQ(4, controller.MaxInFlight());
+
+  Fetch(&controller, false, 0);
+  EXPECT_EQ(2, controller.MaxInFlight());
+  Fetch(&controller, false, 0);
+  Fetch(&controller, false, 0);
+  EXPECT_EQ(1, controller.MaxInFlight());
+}
+
+
+TEST_F(FetchControllerTest, LearnsBatchSize) {
+  FetchController controller("peer");
+  EXPECT_EQ(1000, controller.BatchSize());
+
+  Fetch(&controller, true, 64);
+  EXPECT_EQ(64, controller.BatchSize());
+
+  // Failures are not a sign of a capped response.
+  Fetch(&controller, false, 0);
+  EXPECT_EQ(64, controller.BatchSize());
+
+  // Asking for more is tried again after enough full responses.
+  for (int i = 0; i < 16; ++i) {
+    EXPECT_EQ(64, controller.BatchSize());
+    Fetch(&controller, true, 64);
+  }
+  EXPECT_EQ(128, controller.BatchSize());
+
+  Fetch(&controller, true, 64);
+  EXPECT_EQ(64, controller.BatchSize());
+}
+
+
+TEST_F(FetchControllerTest, AveragesThroughputAndLatency) {
+  FetchController controller("peer");
+  EXPECT_EQ(0, controller.Throughput());
+  EXPECT_EQ(milliseconds(0), controller.TypicalLatency());
+
+  controller.FetchStarted();
+  controller.FetchDone(true, 1000, 1000, milliseconds(100));
+  EXPECT_DOUBLE_EQ(10000, controller.Throughput());
+  EXPECT_EQ(milliseconds(100), controller.TypicalLatency());
+
+  // Failures do not count.
+  controller.FetchStarted();
+  controller.FetchDone(false, 1000, 0, milliseconds(1000));
+  EXPECT_DOUBLE_EQ(10000, controller.Throughput());
+
+  controller.FetchStarted();
+  controller.FetchDone(true, 1000, 1000, milliseconds(200));
+  EXPECT_DOUBLE_EQ(9000, controller.Throughput());
+  EXPECT_EQ(milliseconds(120), controller.TypicalLatency());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -2,6 +2,7 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <chrono>
 #include <memory>
 #include <mutex>
 
@@ -12,6 +13,8 @@ using cert_trans::AsyncLogClient;
 using cert_trans::LoggedEntry;
 using cert_trans::PeerGroup;
 using std::bind;
+using std::chrono::milliseconds;
+using std::function;
 using std::lock_guard;
 using std::move;
 using std::mutex;
@@ -25,10 +28,9 @@ using util::Status;
 using util::Task;
 using util::TaskHold;
 
-DEFINE_int32(fetcher_concurrent_fetches, 2,
-             "number of concurrent fetch requests");
-DEFINE_int32(fetcher_batch_size, 1000,
-             "maximum number of entries to fetch per request");
+DEFINE_int32(fetcher_max_unwritten_entries, 100000,
+             "maximum number of fetched entries waiting to be written to the "
+             "database, beyond which fetching ahead of them pauses");
 
 namespace cert_trans {
 
@@ -41,56 +43,93 @@ Counter<string>* num_invalid_entries_fetched =
 namespace {
 
 
+// How long to wait before trying to start fetches again, when the
+// budget allowed none and none are in flight to trigger it.
+const milliseconds kBudgetRetryDelay(100);
+
+
 struct Range {
   enum State {
     HAVE,
     FETCHING,
+    // Fetched and verified, or being verified, waiting to be written
+    // to the database.
+    WRITING,
     WANT,
   };
 
   Range(State state, int64_t size, unique_ptr<Range> next = nullptr)
       : state_(state), size_(size), next_(move(next)) {
-    CHECK(state_ == HAVE || state_ == FETCHING || state_ == WANT);
+    CHECK(state_ == HAVE || state_ == FETCHING || state_ == WRITING ||
+          state_ == WANT);
     CHECK_GT(size_, 0);
   };
 
   State state_;
   int64_t size_;
   unique_ptr<Range> next_;
+  // For a WRITING range, the entries once they are verified.
+  unique_ptr<vector<LoggedEntry>> verified_;
 };
 
 
+// Fetched entries go through a pipeline: once a range is fetched, its
+// entries are verified right away (spreading the SCT signatures over
+// the executor), and the range stops counting against the concurrent
+// fetches, so that another one can be started. Verified ranges are
+// then written as many at once as are ready, by a single writer,
+// while the fetching carries on. They do not wait for the ranges
+// before them, as the database keeps track of the entries past its
+// contiguous prefix, which are skipped when fetching again.
 struct FetchState {
   FetchState(Database* db, unique_ptr<PeerGroup> peer_group,
-             const LogVerifier* log_verifier, Task* task);
+             const LogVerifier* log_verifier, Task* task,
+             const function<void()>& entries_written,
+             FetchBudget::Share* budget);
   FetchState(const FetchState&) = delete;
   FetchState& operator=(const FetchState&) = delete;
 
+  void PlanRanges(int64_t remote_tree_size);
   void WalkEntries();
   void FetchRange(const unique_lock<mutex>& lock, Range* current,
                   int64_t index, Task* range_task);
-  void WriteToDatabase(int64_t index, Range* range,
-                       const vector<AsyncLogClient::Entry>* retval,
-                       Task* range_task, Task* fetch_task);
+  void VerifyRange(int64_t index, Range* range,
+                   const vector<AsyncLogClient::Entry>* retval,
+                   Task* range_task, Task* fetch_task);
+  Status VerifyEntries(int64_t index,
+                       const vector<AsyncLogClient::Entry>& retval,
+                       vector<LoggedEntry>* certs) const;
+  void WriteRanges(Task* write_task);
 
   Database* const db_;
   const unique_ptr<PeerGroup> peer_group_;
   const LogVerifier* const log_verifier_;
   Task* const task_;
+  const function<void()> entries_written_;
+  FetchBudget::Share* const budget_;
 
   mutex lock_;
   int64_t start_;
   unique_ptr<Range> entries_;
+  // The number of entries in WRITING ranges.
+  int64_t unwritten_;
+  bool writing_;
 };
 
 
 FetchState::FetchState(Database* db, unique_ptr<PeerGroup> peer_group,
-                       const LogVerifier* log_verifier, Task* task)
+                       const LogVerifier* log_verifier, Task* task,
+                       const function<void()>& entries_written,
+                       FetchBudget::Share* budget)
     : db_(CHECK_NOTNULL(db)),
       peer_group_(move(peer_group)),
       log_verifier_(CHECK_NOTNULL(log_verifier)),
       task_(CHECK_NOTNULL(task)),
-      start_(db_->TreeSize()) {
+      entries_written_(entries_written),
+      budget_(budget),
+      start_(db_->TreeSize()),
+      unwritten_(0),
+      writing_(false) {
   // TODO(pphaneuf): Might be better to get that as a parameter?
   const int64_t remote_tree_size(peer_group_->TreeSize());
   CHECK_GE(start_, 0);
@@ -103,12 +142,59 @@ FetchState::FetchState(Database* db, unique_ptr<PeerGroup> peer_group,
     return;
   }
 
-  entries_.reset(new Range(Range::WANT, remote_tree_size - start_));
+  PlanRanges(remote_tree_size);
 
   WalkEntries();
 }
 
 
+// Sets up the ranges up to |remote_tree_size|: the database might
+// already have some entries past its contiguous prefix (left by a run
+// that was interrupted while filling a gap, for example), and only the
+// gaps between them are wanted.
+void FetchState::PlanRanges(int64_t remote_tree_size) {
+  unique_ptr<Range>* tail(&entries_);
+  Range* last(nullptr);
+  const auto append([&tail, &last](Range::State state, int64_t size) {
+    if (last && last->state_ == state) {
+      last->size_ += size;
+      return;
+    }
+    tail->reset(new Range(state, size));
+    last = tail->get();
+    tail = &last->next_;
+  });
+
+  const unique_ptr<Database::LeafHashIterator> it(
+      db_->ScanLeafHashes(start_));
+  int64_t index(start_);
+  int64_t num_present(0);
+  int64_t sequence_number;
+  string leaf_hash;
+  while (it->GetNextLeafHash(&sequence_number, &leaf_hash) &&
+         sequence_number < remote_tree_size) {
+    CHECK_GE(sequence_number, index);
+    if (sequence_number > index) {
+      append(Range::WANT, sequence_number - index);
+    }
+    append(Range::HAVE, 1);
+    index = sequence_number + 1;
+    ++num_present;
+  }
+
+  if (index < remote_tree_size) {
+    append(Range::WANT, remote_tree_size - index);
+  }
+
+  if (num_present > 0) {
+    LOG(INFO) << "database already has " << num_present
+              << " entries past its tree size of " << start_
+              << ", only fetching the "
+              << remote_tree_size - start_ - num_present << " missing ones";
+  }
+}
+
+
 // This is called either when starting the fetching, or when fetching
 // a range completed. In that both cases, there's a hold on our task,
 // so it shouldn't go away from under us.
@@ -142,12 +228,18 @@ void FetchState::WalkEntries() {
     return;
   }
 
+  // These adapt to how the peers respond.
+  const int64_t batch_size(peer_group_->BatchSize());
+  const int max_fetches(peer_group_->MaxConcurrentFetches());
   int64_t index(start_);
   int num_fetch(0);
+  bool waiting_to_write(false);
+  bool over_budget(false);
   for (Range *current = entries_.get(); current;
        index += current->size_, current = current->next_.get()) {
-    // Coalesce with the next Range, if possible.
-    if (current->state_ != Range::FETCHING) {
+    // Coalesce with the next Range, if possible. Fetching or writing
+    // ranges each have their own entries.
+    if (current->state_ == Range::HAVE || current->state_ == Range::WANT) {
       while (current->next_ && current->next_->state_ == current->state_) {
         current->size_ += current->next_->size_;
         current->next_ = move(current->next_->next_);
@@ -166,6 +258,12 @@ void FetchState::WalkEntries() {
         ++num_fetch;
         break;
 
+      case Range::WRITING:
+        VLOG(2) << "at offset " << index << ", writing " << current->size_
+                << " entries";
+        waiting_to_write = true;
+        break;
+
       case Range::WANT:
         VLOG(2) << "at offset " << index << ", we want " << current->size_
                 << " entries";
@@ -176,12 +274,25 @@ void FetchState::WalkEntries() {
           break;
         }
 
-        // If the range is bigger than the maximum batch size, split it.
-        if (current->size_ > FLAGS_fetcher_batch_size) {
-          current->next_.reset(
-              new Range(Range::WANT, current->size_ - FLAGS_fetcher_batch_size,
-                        move(current->next_)));
-          current->size_ = FLAGS_fetcher_batch_size;
+        // Bound how many entries can be waiting to be written, unless
+        // they are waiting on this range.
+        if (waiting_to_write &&
+            unwritten_ >= FLAGS_fetcher_max_unwritten_entries) {
+          break;
+        }
+
+        // Leave room for the other logs fetched by this process.
+        if (budget_ && !budget_->TryStart()) {
+          over_budget = true;
+          break;
+        }
+
+        // If the range is bigger than the batch size, split it.
+        if (current->size_ > batch_size) {
+          current->next_.reset(new Range(Range::WANT,
+                                         current->size_ - batch_size,
+                                         move(current->next_)));
+          current->size_ = batch_size;
         }
 
         FetchRange(lock, current, index,
@@ -191,11 +302,18 @@ void FetchState::WalkEntries() {
         break;
     }
 
-    if (num_fetch >= FLAGS_fetcher_concurrent_fetches ||
+    if (over_budget || num_fetch >= max_fetches ||
         index >= remote_tree_size) {
       break;
     }
   }
+
+  // Nothing in flight will walk the entries again once it is done.
+  if (over_budget && num_fetch == 0) {
+    task_->executor()->Delay(kBudgetRetryDelay,
+                             task_->AddChild(
+                                 bind(&FetchState::WalkEntries, this)));
+  }
 }
 
 
@@ -213,14 +331,18 @@ void FetchState::FetchRange(const unique_lock<mutex>& lock, Range* current,
 
   peer_group_->FetchEntries(index, end_index, retval,
                             range_task->AddChild(
-                                bind(&FetchState::WriteToDatabase, this, index,
+                                bind(&FetchState::VerifyRange, this, index,
                                      current, retval, range_task, _1)));
 }
 
 
-void FetchState::WriteToDatabase(int64_t index, Range* range,
-                                 const vector<AsyncLogClient::Entry>* retval,
-                                 Task* range_task, Task* fetch_task) {
+void FetchState::VerifyRange(int64_t index, Range* range,
+                             const vector<AsyncLogClient::Entry>* retval,
+                             Task* range_task, Task* fetch_task) {
+  if (budget_) {
+    budget_->Done();
+  }
+
   if (!fetch_task->status().ok()) {
     LOG(INFO) << "error fetching entries at index " << index << ": "
               << fetch_task->status();
@@ -233,22 +355,98 @@ void FetchState::WriteToDatabase(int64_t index, Range* range,
   CHECK_GT(retval->size(), static_cast<size_t>(0));
 
   VLOG(1) << "received " << retval->size() << " entries at offset " << index;
-  int64_t processed(0);
-  for (const auto& entry : *retval) {
-    LoggedEntry cert;
-    if (!cert.CopyFromClientLogEntry(entry)) {
+  unique_ptr<vector<LoggedEntry>> certs(new vector<LoggedEntry>);
+  const Status status(VerifyEntries(index, *retval, certs.get()));
+  if (!status.ok()) {
+    {
+      lock_guard<mutex> lock(lock_);
+      range->state_ = Range::WANT;
+    }
+    task_->Return(status);
+    range_task->Return(status);
+    return;
+  }
+
+  const int64_t verified(certs->size());
+  bool start_writing(false);
+  {
+    lock_guard<mutex> lock(lock_);
+    // TODO(pphaneuf): If we have problems fetching entries, to what
+    // point should we retry? Or should we just return on the task
+    // with an error?
+    if (verified > 0) {
+      // If we don't receive everything, split up the range.
+      if (range->size_ > verified) {
+        range->next_.reset(new Range(Range::WANT, range->size_ - verified,
+                                     move(range->next_)));
+        range->size_ = verified;
+      }
+
+      range->state_ = Range::WRITING;
+      range->verified_ = move(certs);
+      unwritten_ += verified;
+      start_writing = !writing_;
+      writing_ = true;
+    } else {
+      range->state_ = Range::WANT;
+    }
+  }
+
+  if (start_writing) {
+    Task* const write_task(
+        task_->AddChild(bind(&FetchState::WalkEntries, this)));
+    task_->executor()->Add(bind(&FetchState::WriteRanges, this, write_task));
+  }
+
+  if (static_cast<uint64_t>(verified) < retval->size()) {
+    // We couldn't convert everything that we received, this is fairly
+    // serious, return an error for the overall operation and let the
+    // higher level deal with it.
+    task_->Return(Status(util::error::INTERNAL,
+                         "could not convert some entries to LoggedEntry"));
+  }
+
+  range_task->Return();
+}
+
+
+Status FetchState::VerifyEntries(int64_t index,
+                                 const vector<AsyncLogClient::Entry>& retval,
+                                 vector<LoggedEntry>* certs) const {
+  certs->reserve(retval.size());
+  for (const auto& entry : retval) {
+    certs->emplace_back();
+    if (!certs->back().CopyFromClientLogEntry(entry)) {
       LOG(WARNING) << "could not convert entry to a LoggedEntry";
       num_invalid_entries_fetched->Increment("format");
+      certs->pop_back();
       break;
     }
     if (entry.sct) {
-      *cert.mutable_sct() = *entry.sct;
-      // If we have the full SCT (because this LogEntry came from another
-      // internal node which supports our private "give me the SCT too"
-      // option), then verify that the signature is good.
+      *certs->back().mutable_sct() = *entry.sct;
+    }
+  }
+
+  // If we have the full SCTs (because these LogEntries came from another
+  // internal node which supports our private "give me the SCT too"
+  // option), then verify that the signatures are good, all at once.
+  vector<const ct::LogEntry*> to_verify;
+  vector<const ct::SignedCertificateTimestamp*> scts;
+  for (size_t i = 0; i < certs->size(); ++i) {
+    if (retval[i].sct) {
+      to_verify.push_back(&(*certs)[i].contents().entry());
+      scts.push_back(&(*certs)[i].sct());
+    }
+  }
+  const vector<LogVerifier::LogVerifyResult> verify_results(
+      log_verifier_->VerifySignedCertificateTimestamps(to_verify, scts,
+                                                       task_->executor()));
+
+  size_t verified(0);
+  for (size_t i = 0; i < certs->size(); ++i) {
+    if (retval[i].sct) {
       const LogVerifier::LogVerifyResult verify_result(
-          log_verifier_->VerifySignedCertificateTimestamp(
-              cert.contents().entry(), cert.sct()));
+          verify_results[verified++]);
       VLOG(1) << "SCT verify entry #" << index << ": "
               << LogVerifier::VerifyResultString(verify_result);
       if (verify_result != LogVerifier::VERIFY_OK) {
@@ -257,48 +455,79 @@ void FetchState::WriteToDatabase(int64_t index, Range* range,
                          to_string(index) + " : " +
                          LogVerifier::VerifyResultString(verify_result));
         LOG(WARNING) << msg;
-        task_->Return(Status(util::error::FAILED_PRECONDITION, msg));
-        return;
+        return Status(util::error::FAILED_PRECONDITION, msg);
       }
     }
-    cert.set_sequence_number(index++);
-    if (db_->CreateSequencedEntry(cert) == Database::OK) {
-      ++processed;
-    } else {
-      LOG(WARNING) << "could not insert entry into the database:\n"
-                   << cert.DebugString();
-      break;
-    }
+    (*certs)[i].set_sequence_number(index++);
   }
 
-  {
-    lock_guard<mutex> lock(lock_);
-    // TODO(pphaneuf): If we have problems fetching entries, to what
-    // point should we retry? Or should we just return on the task
-    // with an error?
-    if (processed > 0) {
-      // If we don't receive everything, split up the range.
-      if (range->size_ > processed) {
-        range->next_.reset(new Range(Range::WANT, range->size_ - processed,
-                                     move(range->next_)));
-        range->size_ = processed;
+  return util::OkStatus();
+}
+
+
+// Only one of these runs at a time, the others that would be needed
+// are folded into it.
+void FetchState::WriteRanges(Task* write_task) {
+  unique_lock<mutex> lock(lock_);
+  while (true) {
+    // Gather all the verified ranges, in order. They cannot be pruned
+    // or coalesced while they are WRITING, so they can be used without
+    // the lock.
+    vector<Range*> ranges;
+    vector<const LoggedEntry*> to_write;
+    for (Range* current = entries_.get(); current;
+         current = current->next_.get()) {
+      if (current->state_ != Range::WRITING || !current->verified_) {
+        continue;
+      }
+      ranges.push_back(current);
+      for (const auto& cert : *current->verified_) {
+        to_write.push_back(&cert);
       }
+    }
 
-      range->state_ = Range::HAVE;
-    } else {
-      range->state_ = Range::WANT;
+    if (ranges.empty()) {
+      writing_ = false;
+      break;
     }
-  }
 
-  if (static_cast<uint64_t>(processed) < retval->size()) {
-    // We couldn't insert everything that we received into the
-    // database, this is fairly serious, return an error for the
-    // overall operation and let the higher level deal with it.
-    task_->Return(Status(util::error::INTERNAL,
-                         "could not write some entries to the database"));
+    lock.unlock();
+    VLOG(1) << "writing " << to_write.size() << " entries from offset "
+            << to_write.front()->sequence_number();
+    const Database::WriteResult result(db_->CreateSequencedEntries(to_write));
+    lock.lock();
+
+    for (Range* range : ranges) {
+      unwritten_ -= range->size_;
+      range->verified_.reset();
+      range->state_ = result == Database::OK ? Range::HAVE : Range::WANT;
+    }
+
+    if (result != Database::OK) {
+      LOG(WARNING) << "could not insert entries from offset "
+                   << to_write.front()->sequence_number()
+                   << " into the database: " << result;
+      writing_ = false;
+      lock.unlock();
+      // This is fairly serious, return an error for the overall
+      // operation and let the higher level deal with it.
+      task_->Return(Status(util::error::INTERNAL,
+                           "could not write some entries to the database"));
+      write_task->Return();
+      return;
+    }
+
+    if (entries_written_) {
+      lock.unlock();
+      entries_written_();
+      lock.lock();
+    }
   }
+  lock.unlock();
 
-  range_task->Return();
+  // This walks the entries again, to prune what was written and
+  // possibly start more fetches.
+  write_task->Return();
 }
 
 
@@ -306,10 +535,12 @@ void FetchState::WriteToDatabase(int64_t index, Range* range,
 
 
 void FetchLogEntries(Database* db, unique_ptr<PeerGroup> peer_group,
-                     const LogVerifier* log_verifier, Task* task) {
+                     const LogVerifier* log_verifier, Task* task,
+                     const function<void()>& entries_written,
+                     FetchBudget::Share* budget) {
   TaskHold hold(task);
-  task->DeleteWhenDone(
-      new FetchState(db, move(peer_group), log_verifier, task));
+  task->DeleteWhenDone(new FetchState(db, move(peer_group), log_verifier,
+                                      task, entries_written, budget));
 }
 
 
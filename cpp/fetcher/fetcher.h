@@ -1,8 +1,10 @@
 #ifndef CERT_TRANS_FETCHER_FETCHER_H_
 #define CERT_TRANS_FETCHER_FETCHER_H_
 
+#include <functional>
 #include <memory>
 
+#include "fetcher/fetch_budget.h"
 #include "fetcher/peer_group.h"
 #include "log/database.h"
 #include "util/task.h"
@@ -12,8 +14,13 @@ class LogVerifier;
 namespace cert_trans {
 
 
+// Fetches the entries that |db| is missing from |peer_group|. If set,
+// |entries_written| is called after each batch of entries is written
+// to |db|, and the requests are only started as |budget| allows.
 void FetchLogEntries(Database* db, std::unique_ptr<PeerGroup> peer_group,
-                     const LogVerifier* log_verifier, util::Task* task);
+                     const LogVerifier* log_verifier, util::Task* task,
+                     const std::function<void()>& entries_written = nullptr,
+                     FetchBudget::Share* budget = nullptr);
 
 
 }  // namespace cert_trans
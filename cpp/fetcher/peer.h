@@ -4,6 +4,7 @@
 #include <memory>
 
 #include "client/async_log_client.h"
+#include "fetcher/fetch_controller.h"
 
 namespace cert_trans {
 
@@ -19,11 +20,19 @@ class Peer {
     return *client_;
   }
 
+  // Adapts the requests made to this peer to how it responds.
+  FetchController& fetch_controller() {
+    return fetch_controller_;
+  }
+
   // Returns -1 if we do not know yet.
   virtual int64_t TreeSize() const = 0;
 
  protected:
   const std::unique_ptr<AsyncLogClient> client_;
+
+ private:
+  FetchController fetch_controller_;
 };
 
 
@@ -1,46 +1,69 @@
 #include "fetcher/peer_group.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
 
+#include "monitoring/monitoring.h"
+
+using std::chrono::duration;
+using std::chrono::steady_clock;
 using std::lock_guard;
+using std::make_shared;
 using std::max;
+using std::max_element;
 using std::mutex;
 using std::placeholders::_1;
 using std::shared_ptr;
+using std::unique_lock;
 using std::vector;
 using util::Status;
 using util::Task;
 
+DEFINE_double(fetcher_hedge_latency_factor, 3,
+              "if positive, fetch requests still pending after this many "
+              "times the typical latency of their peer are also sent to "
+              "another peer, keeping whichever response comes first");
+
 namespace cert_trans {
 
 namespace {
 
 
-void GetEntriesDone(AsyncLogClient::Status client_status,
-                    const vector<AsyncLogClient::Entry>* entries, Task* task) {
-  Status status;
+static Counter<>* fetcher_hedged_requests(
+    Counter<>::New("fetcher_hedged_requests",
+                   "Number of fetch requests also sent to another peer, "
+                   "because the first one was slow to respond."));
 
-  switch (client_status) {
-    case AsyncLogClient::OK:
-      break;
 
-    default:
-      // TODO(pphaneuf): Improve this a bit? Or wouldn't it be nice if
-      // AsyncLogClient gave us a util::Status in the first place? ;-)
-      status = util::Status::UNKNOWN;
-  }
+}  // namespace
 
-  if (status.ok() && entries->empty()) {
-    // This should never happen.
-    status =
-        Status(util::error::INTERNAL, "log server did not return any entries");
-  }
 
-  task->Return(status);
-}
+// A range of entries being fetched, from one peer, or two if the
+// first one is slow.
+struct PeerGroup::Fetch {
+  Fetch(int64_t start_index, int64_t end_index,
+        vector<AsyncLogClient::Entry>* entries, Task* task)
+      : start_index_(start_index),
+        end_index_(end_index),
+        entries_(entries),
+        task_(task),
+        num_pending_(0) {
+  }
 
+  const int64_t start_index_;
+  const int64_t end_index_;
 
-}  // namespace
+  mutex lock_;
+  // These are cleared once |task_| is returned, as it can then go
+  // away, along with |entries_|.
+  vector<AsyncLogClient::Entry>* entries_;
+  Task* task_;
+  // The number of requests sent to peers that did not respond yet.
+  int num_pending_;
+};
 
 
 PeerGroup::PeerGroup(bool fetch_scts) : fetch_scts_(fetch_scts) {
@@ -66,48 +89,221 @@ int64_t PeerGroup::TreeSize() const {
 }
 
 
+int64_t PeerGroup::BatchSize() const {
+  lock_guard<mutex> lock(lock_);
+
+  int64_t batch_size(1);
+  for (const auto& peer : peers_) {
+    batch_size = max(batch_size, peer.first->fetch_controller().BatchSize());
+  }
+
+  return batch_size;
+}
+
+
+int PeerGroup::MaxConcurrentFetches() const {
+  lock_guard<mutex> lock(lock_);
+
+  int max_fetches(0);
+  for (const auto& peer : peers_) {
+    max_fetches += peer.first->fetch_controller().MaxInFlight();
+  }
+
+  return max(1, max_fetches);
+}
+
+
 void PeerGroup::FetchEntries(int64_t start_index, int64_t end_index,
                              vector<AsyncLogClient::Entry>* entries,
                              Task* task) {
   CHECK_GE(start_index, 0);
   CHECK_GE(end_index, start_index);
 
-  const shared_ptr<Peer> peer(PickPeer(end_index + 1));
+  const shared_ptr<Peer> peer(PickPeer(end_index + 1, nullptr));
   if (!peer) {
     task->Return(Status(util::error::UNAVAILABLE,
                         "requested entries not available in the peer group"));
     return;
   }
 
+  const shared_ptr<Fetch> fetch(make_shared<Fetch>(start_index, end_index,
+                                                   CHECK_NOTNULL(entries),
+                                                   task));
+
+  // This has to be set up before sending the request, as the task
+  // could be returned right away. The timer is cancelled when it is.
+  const steady_clock::duration latency(
+      peer->fetch_controller().TypicalLatency());
+  if (FLAGS_fetcher_hedge_latency_factor > 0 &&
+      latency > steady_clock::duration::zero()) {
+    task->executor()->Delay(FLAGS_fetcher_hedge_latency_factor *
+                                duration<double>(latency),
+                            task->AddChild(bind(&PeerGroup::Hedge, this,
+                                                fetch, peer, _1)));
+  }
+
+  Send(fetch, peer);
+}
+
+
+void PeerGroup::Send(const shared_ptr<Fetch>& fetch,
+                     const shared_ptr<Peer>& peer) {
+  {
+    lock_guard<mutex> lock(fetch->lock_);
+    if (!fetch->task_) {
+      return;
+    }
+    ++fetch->num_pending_;
+  }
+
+  // Each request gets its own entries, as a slow peer can still be
+  // writing them after another one responded.
+  const shared_ptr<vector<AsyncLogClient::Entry>> entries(
+      make_shared<vector<AsyncLogClient::Entry>>());
+  peer->fetch_controller().FetchStarted();
+  const AsyncLogClient::Callback done(bind(&PeerGroup::SendDone, _1, entries,
+                                           peer, steady_clock::now(),
+                                           fetch));
+
   // TODO(pphaneuf): Handle the case where we have no peer more cleanly.
   if (fetch_scts_) {
-    peer->client().GetEntriesAndSCTs(start_index, end_index,
-                                     CHECK_NOTNULL(entries),
-                                     bind(GetEntriesDone, _1, entries, task));
+    peer->client().GetEntriesAndSCTs(fetch->start_index_, fetch->end_index_,
+                                     entries.get(), done);
   } else {
-    peer->client().GetEntries(start_index, end_index, CHECK_NOTNULL(entries),
-                              bind(GetEntriesDone, _1, entries, task));
+    peer->client().GetEntries(fetch->start_index_, fetch->end_index_,
+                              entries.get(), done);
+  }
+}
+
+
+// static
+void PeerGroup::SendDone(
+    AsyncLogClient::Status client_status,
+    const shared_ptr<vector<AsyncLogClient::Entry>>& entries,
+    const shared_ptr<Peer>& peer, steady_clock::time_point started,
+    const shared_ptr<Fetch>& fetch) {
+  Status status;
+
+  switch (client_status) {
+    case AsyncLogClient::OK:
+      break;
+
+    default:
+      // TODO(pphaneuf): Improve this a bit? Or wouldn't it be nice if
+      // AsyncLogClient gave us a util::Status in the first place? ;-)
+      status = util::Status::UNKNOWN;
+  }
+
+  if (status.ok() && entries->empty()) {
+    // This should never happen.
+    status =
+        Status(util::error::INTERNAL, "log server did not return any entries");
+  }
+
+  peer->fetch_controller().FetchDone(
+      status.ok(), fetch->end_index_ - fetch->start_index_ + 1,
+      status.ok() ? entries->size() : 0, steady_clock::now() - started);
+
+  unique_lock<mutex> lock(fetch->lock_);
+  --fetch->num_pending_;
+  if (!fetch->task_) {
+    // Another peer responded first.
+    return;
   }
+
+  if (!status.ok() && fetch->num_pending_ > 0) {
+    // Let the other peer have its chance.
+    return;
+  }
+
+  if (status.ok()) {
+    fetch->entries_->swap(*entries);
+  }
+  Task* const task(fetch->task_);
+  fetch->entries_ = nullptr;
+  fetch->task_ = nullptr;
+  lock.unlock();
+
+  task->Return(status);
 }
 
 
-shared_ptr<Peer> PeerGroup::PickPeer(const int64_t needed_size) const {
+void PeerGroup::Hedge(const shared_ptr<Fetch>& fetch,
+                      const shared_ptr<Peer>& slow_peer, Task* timer_task) {
+  if (!timer_task->status().ok()) {
+    // The fetch is already done.
+    return;
+  }
+
+  const shared_ptr<Peer> peer(PickPeer(fetch->end_index_ + 1, slow_peer));
+  if (!peer || peer->fetch_controller().Room() <= 0) {
+    return;
+  }
+
+  VLOG(1) << "fetching entries " << fetch->start_index_ << " to "
+          << fetch->end_index_ << " from another peer";
+  fetcher_hedged_requests->Increment();
+  Send(fetch, peer);
+}
+
+
+shared_ptr<Peer> PeerGroup::PickPeer(const int64_t needed_size,
+                                     const shared_ptr<Peer>& exclude) const {
   lock_guard<mutex> lock(lock_);
 
-  // TODO(pphaneuf): We should pick peers a bit more cleverly, to
-  // spread the load somewhat.
+  // The peers with room for more requests are picked randomly,
+  // weighted by their throughput, so that consecutive ranges are
+  // striped across them, more of them going to the faster ones. If
+  // they are all busy, the least busy one gets it.
   int64_t group_tree_size(-1);
+  shared_ptr<Peer> least_busy;
+  int most_room(0);
   vector<shared_ptr<Peer>> capable_peers;
+  vector<double> weights;
   for (const auto& peer : peers_) {
     const int64_t tree_size(peer.first->TreeSize());
     group_tree_size = max(group_tree_size, tree_size);
-    if (tree_size >= needed_size) {
+    if (tree_size < needed_size || peer.first == exclude) {
+      continue;
+    }
+
+    const FetchController& controller(peer.first->fetch_controller());
+    const int room(controller.Room());
+    if (!least_busy || room > most_room) {
+      least_busy = peer.first;
+      most_room = room;
+    }
+    if (room > 0) {
       capable_peers.push_back(peer.first);
+      weights.push_back(controller.Throughput());
     }
   }
 
   if (!capable_peers.empty()) {
-    return capable_peers[std::rand() % capable_peers.size()];
+    // Peers that did not respond yet are tried as if they were the
+    // fastest.
+    const double fastest(
+        max(1.0, *max_element(weights.begin(), weights.end())));
+    double total(0);
+    for (double& weight : weights) {
+      if (weight <= 0) {
+        weight = fastest;
+      }
+      total += weight;
+    }
+
+    double pick(total * std::rand() / (RAND_MAX + 1.0));
+    for (size_t i = 0; i < capable_peers.size(); ++i) {
+      if (pick < weights[i]) {
+        return capable_peers[i];
+      }
+      pick -= weights[i];
+    }
+    return capable_peers.back();
+  }
+
+  if (least_busy) {
+    return least_busy;
   }
 
   LOG(INFO) << "requested a peer with " << needed_size
@@ -2,6 +2,8 @@
 #define CERT_TRANS_FETCHER_PEER_GROUP_H_
 
 #include <stdint.h>
+#include <chrono>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <set>
@@ -19,6 +21,10 @@ namespace cert_trans {
 // errors will be retried, and unhealthy peers will be dropped (so the
 // available tree size can get smaller).
 // TODO(pphaneuf): Make that last sentence true!
+//
+// Ranges are spread across the peers that have them, according to
+// their throughput, and a range that takes much longer than usual is
+// also fetched from another peer.
 class PeerGroup {
  public:
   explicit PeerGroup(bool fetch_scts_);
@@ -31,17 +37,38 @@ class PeerGroup {
   // Returns the highest tree size of the peer group.
   int64_t TreeSize() const;
 
+  // Returns the largest number of entries to ask for in a request,
+  // and how many requests to have in flight, as adapted by the
+  // FetchController of each peer.
+  int64_t BatchSize() const;
+  int MaxConcurrentFetches() const;
+
   void FetchEntries(int64_t start_offset, int64_t end_offset,
                     std::vector<AsyncLogClient::Entry>* entries,
                     util::Task* task);
 
  private:
+  struct Fetch;
+
   struct PeerState {
     // TODO(pphaneuf): Keep a count of errors here, to prune away
     // unhealthy peers.
   };
 
-  std::shared_ptr<Peer> PickPeer(const int64_t needed_size) const;
+  void Send(const std::shared_ptr<Fetch>& fetch,
+            const std::shared_ptr<Peer>& peer);
+  static void SendDone(
+      AsyncLogClient::Status client_status,
+      const std::shared_ptr<std::vector<AsyncLogClient::Entry>>& entries,
+      const std::shared_ptr<Peer>& peer,
+      std::chrono::steady_clock::time_point started,
+      const std::shared_ptr<Fetch>& fetch);
+  void Hedge(const std::shared_ptr<Fetch>& fetch,
+             const std::shared_ptr<Peer>& slow_peer, util::Task* timer_task);
+  // Returns a peer with at least |needed_size| entries, other than
+  // |exclude|, or nullptr if there are none.
+  std::shared_ptr<Peer> PickPeer(const int64_t needed_size,
+                                 const std::shared_ptr<Peer>& exclude) const;
 
   mutable std::mutex lock_;
   const bool fetch_scts_;
@@ -50,9 +50,16 @@ struct RemotePeer::Impl {
   const std::function<void(const ct::SignedTreeHead&)> on_new_sth_;
   util::Task* const task_;
 
+  // The entity tag of the last tree head fetched, so that the next
+  // fetch only gets one if it changed. Only used by the chain of
+  // FetchSTH() and DoneGetSTH(), which run one after the other.
+  string etag_;
+
   mutex lock_;
   shared_ptr<SignedTreeHead> sth_;
 
+  bool IsCurrentSTH(const SignedTreeHead& sth);
+
   void FetchSTH();
   void DoneGetSTH(const std::shared_ptr<ct::SignedTreeHead>& on_new_sth,
                   AsyncLogClient::Status status);
@@ -65,7 +72,14 @@ void RemotePeer::Impl::FetchSTH() {
     return;
   }
   shared_ptr<SignedTreeHead> next_sth(make_shared<SignedTreeHead>());
-  client_->GetSTH(next_sth.get(), bind(&Impl::DoneGetSTH, this, next_sth, _1));
+  client_->GetSTHIfChanged(next_sth.get(), &etag_,
+                           bind(&Impl::DoneGetSTH, this, next_sth, _1));
+}
+
+
+bool RemotePeer::Impl::IsCurrentSTH(const SignedTreeHead& sth) {
+  lock_guard<mutex> lock(lock_);
+  return sth_ && sth_->SerializeAsString() == sth.SerializeAsString();
 }
 
 
@@ -77,7 +91,13 @@ void RemotePeer::Impl::DoneGetSTH(
     return;
   }
 
-  if (status == AsyncLogClient::OK) {
+  if (status == AsyncLogClient::NOT_MODIFIED) {
+    VLOG(1) << "STH unchanged on the remote peer";
+  } else if (status == AsyncLogClient::OK && IsCurrentSTH(*new_sth)) {
+    // The peer might not support conditional requests, but this one
+    // was verified already.
+    VLOG(1) << "Received the current STH again";
+  } else if (status == AsyncLogClient::OK) {
     bool sth_provisionally_valid(false);
 
     const LogVerifier::LogVerifyResult result(verifier_->VerifySignedTreeHead(
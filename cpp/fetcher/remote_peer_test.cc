@@ -40,11 +40,16 @@ using std::ostream;
 using std::set;
 using std::shared_ptr;
 using std::string;
+using std::to_string;
 using std::unique_ptr;
 using testing::_;
+using testing::Contains;
 using testing::InSequence;
 using testing::Invoke;
+using testing::Key;
 using testing::NiceMock;
+using testing::Not;
+using testing::Pair;
 using testing::Return;
 using util::Status;
 using util::SyncTask;
@@ -282,6 +287,45 @@ TEST_F(RemotePeerTest, RejectsSTHWithInvalidSignature) {
 }
 
 
+TEST_F(RemotePeerTest, PollsConditionally) {
+  tree_signer_.UpdateTree();
+  const SignedTreeHead sth(tree_signer_.LatestSTH());
+  const string etag("\"" + to_string(sth.timestamp()) + "\"");
+  const URL url(string(kLogUrl) + "/ct/v1/get-sth");
+
+  Notification notify;
+  {
+    InSequence s;
+    EXPECT_CALL(fetcher_, Fetch(IsUrlFetchRequest(
+                                    UrlFetcher::Verb::GET, url,
+                                    Not(Contains(Key("If-None-Match"))), ""),
+                                _, _))
+        .WillOnce(Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
+                              UrlFetcher::Headers{{"ETag", etag}},
+                              Jsonify(sth), _1, _2, _3)));
+    EXPECT_CALL(fetcher_,
+                Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET, url,
+                                        Contains(Pair("If-None-Match", etag)),
+                                        ""),
+                      _, _))
+        .WillOnce(Invoke([&notify](const UrlFetcher::Request& req,
+                                   UrlFetcher::Response* resp, Task* task) {
+          HandleFetch(::util::OkStatus(), 304, UrlFetcher::Headers{}, "", req,
+                      resp, task);
+          notify.Notify();
+        }))
+        .WillRepeatedly(Invoke(bind(&HandleFetch, ::util::OkStatus(), 304,
+                                    UrlFetcher::Headers{}, "", _1, _2, _3)));
+  }
+
+  // Only the first reply has a tree head.
+  EXPECT_CALL(*this, OnNewSTH(EqualsSTH(sth))).Times(1);
+
+  CreatePeer();
+  ASSERT_TRUE(notify.WaitForNotificationWithTimeout(seconds(5)));
+}
+
+
 }  // namespace cert_trans
 
 
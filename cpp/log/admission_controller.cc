@@ -0,0 +1,174 @@
+#include "log/admission_controller.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "monitoring/monitoring.h"
+
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::lock_guard;
+using std::max;
+using std::mutex;
+using std::string;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+static Gauge<string>* admission_load =
+    Gauge<string>::New("admission_load", "signal",
+                       "Load of the backends taking submissions, broken down "
+                       "by signal, where 1 is as much as they should take.");
+
+static Counter<string>* admission_decisions =
+    Counter<string>::New("admission_decisions", "action",
+                         "Number of submissions admitted, delayed, throttled "
+                         "or rejected because of the load of the backends.");
+
+
+// Keeps the percentiles cheap to work out.
+const size_t kMaxLatencySamples = 256;
+
+
+const char* SignalName(AdmissionController::Signal signal) {
+  switch (signal) {
+    case AdmissionController::Signal::PENDING_ENTRIES:
+      return "pending_entries";
+    case AdmissionController::Signal::SUBMISSION_QUEUE:
+      return "submission_queue";
+    case AdmissionController::Signal::ETCD_WRITE_LATENCY:
+      return "etcd_write_latency";
+    case AdmissionController::Signal::DB_WRITE_LATENCY:
+      return "db_write_latency";
+  }
+  LOG(FATAL) << "unknown signal " << static_cast<int>(signal);
+}
+
+
+const char* ActionName(AdmissionController::Action action) {
+  switch (action) {
+    case AdmissionController::Action::ADMIT:
+      return "admit";
+    case AdmissionController::Action::DELAY:
+      return "delay";
+    case AdmissionController::Action::THROTTLE:
+      return "throttle";
+    case AdmissionController::Action::REJECT:
+      return "reject";
+  }
+  LOG(FATAL) << "unknown action " << static_cast<int>(action);
+}
+
+
+bool IsLatency(AdmissionController::Signal signal) {
+  return signal == AdmissionController::Signal::ETCD_WRITE_LATENCY ||
+         signal == AdmissionController::Signal::DB_WRITE_LATENCY;
+}
+
+
+}  // namespace
+
+
+AdmissionController::AdmissionController(const Limits& limits)
+    : limits_(limits) {
+  CHECK_LE(0, limits_.delay_pressure);
+  CHECK_LE(limits_.delay_pressure, limits_.throttle_pressure);
+  CHECK_LE(limits_.throttle_pressure, 1);
+  CHECK_LT(0, limits_.etcd_write_latency.count());
+  CHECK_LT(0, limits_.db_write_latency.count());
+  for (int i = 0; i < kNumSignals; ++i) {
+    loads_[i] = 0;
+  }
+}
+
+
+void AdmissionController::SetLoad(Signal signal, double load) {
+  CHECK(!IsLatency(signal)) << SignalName(signal);
+  lock_guard<mutex> lock(lock_);
+  loads_[static_cast<int>(signal)] = load;
+}
+
+
+void AdmissionController::RecordLatency(Signal signal,
+                                        const duration<double>& latency) {
+  CHECK(IsLatency(signal)) << SignalName(signal);
+  lock_guard<mutex> lock(lock_);
+  LatencyWindow* const window(&latencies_[static_cast<int>(signal)]);
+  if (window->samples.size() >= kMaxLatencySamples) {
+    window->samples.pop_front();
+  }
+  window->samples.emplace_back(
+      steady_clock::now(),
+      duration_cast<duration<double, std::milli>>(latency).count());
+}
+
+
+double AdmissionController::LatencyLoad(Signal signal) const {
+  LatencyWindow* const window(&latencies_[static_cast<int>(signal)]);
+  // Old samples are dropped, so that the load goes back down once
+  // nothing is written anymore.
+  const steady_clock::time_point oldest(steady_clock::now() -
+                                        limits_.latency_window);
+  while (!window->samples.empty() && window->samples.front().first < oldest) {
+    window->samples.pop_front();
+  }
+  if (window->samples.empty()) {
+    return 0;
+  }
+
+  vector<double> latencies;
+  latencies.reserve(window->samples.size());
+  for (const auto& sample : window->samples) {
+    latencies.push_back(sample.second);
+  }
+  const auto p90(latencies.begin() + latencies.size() * 9 / 10);
+  std::nth_element(latencies.begin(), p90, latencies.end());
+  const milliseconds limit(signal == Signal::ETCD_WRITE_LATENCY
+                               ? limits_.etcd_write_latency
+                               : limits_.db_write_latency);
+  return *p90 / limit.count();
+}
+
+
+double AdmissionController::Pressure() const {
+  lock_guard<mutex> lock(lock_);
+  double pressure(0);
+  for (int i = 0; i < kNumSignals; ++i) {
+    const Signal signal(static_cast<Signal>(i));
+    const double load(IsLatency(signal) ? LatencyLoad(signal) : loads_[i]);
+    admission_load->Set(SignalName(signal), load);
+    pressure = max(pressure, load);
+  }
+  return pressure;
+}
+
+
+AdmissionController::Decision AdmissionController::Decide() const {
+  const double pressure(Pressure());
+  Decision decision{Action::ADMIT, milliseconds(0)};
+  if (pressure >= 1) {
+    decision.action = Action::REJECT;
+  } else if (pressure >= limits_.throttle_pressure) {
+    decision.action = Action::THROTTLE;
+  } else if (pressure >= limits_.delay_pressure) {
+    decision.action = Action::DELAY;
+    // Growing from nothing to |max_delay| across the range.
+    const double fraction((pressure - limits_.delay_pressure) /
+                          (limits_.throttle_pressure -
+                           limits_.delay_pressure));
+    decision.delay =
+        milliseconds(std::lround(fraction * limits_.max_delay.count()));
+  }
+  admission_decisions->Increment(ActionName(decision.action));
+  return decision;
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,103 @@
+#ifndef CERT_TRANS_LOG_ADMISSION_CONTROLLER_H_
+#define CERT_TRANS_LOG_ADMISSION_CONTROLLER_H_
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+namespace cert_trans {
+
+
+// Decides what to do with new submissions from how loaded the backends
+// they go to are, so that submitters are slowed down as the load
+// builds up, before they have to be turned away, and turned away
+// before the backends fall over.
+//
+// Each signal is a load, where 1 is as much as the log should take: it
+// is either set as such, or worked out from the latencies recorded for
+// it, the 90th percentile of those of the last |latency_window| over
+// the latency which counts as a load of 1. The highest load is the
+// pressure, which decides what to do:
+//
+//  - below |delay_pressure|, submissions are admitted;
+//  - up to |throttle_pressure|, they are admitted after a delay,
+//    growing with the pressure up to |max_delay|;
+//  - up to 1, they are refused with a 429, for clients to slow down;
+//  - beyond that, they are refused with a 503.
+//
+// This class is thread-safe.
+class AdmissionController {
+ public:
+  enum class Signal {
+    // Pending entries in the consistent store, over the number where
+    // it refuses more.
+    PENDING_ENTRIES = 0,
+    // Submissions queued or being checked, over the maximum.
+    SUBMISSION_QUEUE = 1,
+    // Time taken to add an entry to the consistent store.
+    ETCD_WRITE_LATENCY = 2,
+    // Time taken to write sequenced entries to the database.
+    DB_WRITE_LATENCY = 3,
+  };
+
+  enum class Action {
+    ADMIT,
+    DELAY,
+    THROTTLE,
+    REJECT,
+  };
+
+  struct Decision {
+    Action action;
+    // How long to hold the submission for, if |action| is DELAY.
+    std::chrono::milliseconds delay;
+  };
+
+  struct Limits {
+    double delay_pressure;
+    double throttle_pressure;
+    std::chrono::milliseconds max_delay;
+    std::chrono::milliseconds etcd_write_latency;
+    std::chrono::milliseconds db_write_latency;
+    std::chrono::seconds latency_window;
+  };
+
+  explicit AdmissionController(const Limits& limits);
+  AdmissionController(const AdmissionController&) = delete;
+  AdmissionController& operator=(const AdmissionController&) = delete;
+
+  // For the signals which are not latencies.
+  void SetLoad(Signal signal, double load);
+
+  // For the *_LATENCY signals.
+  void RecordLatency(Signal signal,
+                     const std::chrono::duration<double>& latency);
+
+  // The highest load of all the signals.
+  double Pressure() const;
+
+  Decision Decide() const;
+
+ private:
+  static const int kNumSignals = 4;
+
+  struct LatencyWindow {
+    // The samples, in ms, oldest first.
+    std::deque<std::pair<std::chrono::steady_clock::time_point, double>>
+        samples;
+  };
+
+  double LatencyLoad(Signal signal) const;
+
+  const Limits limits_;
+
+  mutable std::mutex lock_;
+  double loads_[kNumSignals];
+  mutable LatencyWindow latencies_[kNumSignals];
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_ADMISSION_CONTROLLER_H_
@@ -0,0 +1,108 @@
+#include <gtest/gtest.h>
+#include <chrono>
+#include <thread>
+
+#include "log/admission_controller.h"
+#include "util/testing.h"
+
+namespace {
+
+using cert_trans::AdmissionController;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+
+typedef AdmissionController::Action Action;
+typedef AdmissionController::Signal Signal;
+
+
+AdmissionController::Limits TestLimits() {
+  AdmissionController::Limits limits;
+  limits.delay_pressure = 0.5;
+  limits.throttle_pressure = 0.8;
+  limits.max_delay = milliseconds(900);
+  limits.etcd_write_latency = milliseconds(100);
+  limits.db_write_latency = milliseconds(1000);
+  limits.latency_window = seconds(1);
+  return limits;
+}
+
+
+TEST(AdmissionControllerTest, AdmitsWhenIdle) {
+  AdmissionController admission(TestLimits());
+  EXPECT_EQ(0, admission.Pressure());
+  EXPECT_EQ(Action::ADMIT, admission.Decide().action);
+}
+
+
+TEST(AdmissionControllerTest, GradedByLoad) {
+  AdmissionController admission(TestLimits());
+
+  admission.SetLoad(Signal::PENDING_ENTRIES, 0.4);
+  EXPECT_EQ(Action::ADMIT, admission.Decide().action);
+
+  admission.SetLoad(Signal::PENDING_ENTRIES, 0.6);
+  const AdmissionController::Decision decision(admission.Decide());
+  EXPECT_EQ(Action::DELAY, decision.action);
+  EXPECT_EQ(300, decision.delay.count());
+
+  admission.SetLoad(Signal::PENDING_ENTRIES, 0.9);
+  EXPECT_EQ(Action::THROTTLE, admission.Decide().action);
+
+  admission.SetLoad(Signal::PENDING_ENTRIES, 1.5);
+  EXPECT_EQ(Action::REJECT, admission.Decide().action);
+}
+
+
+TEST(AdmissionControllerTest, HighestLoadWins) {
+  AdmissionController admission(TestLimits());
+  admission.SetLoad(Signal::PENDING_ENTRIES, 0.1);
+  admission.SetLoad(Signal::SUBMISSION_QUEUE, 0.9);
+  EXPECT_DOUBLE_EQ(0.9, admission.Pressure());
+  EXPECT_EQ(Action::THROTTLE, admission.Decide().action);
+
+  admission.SetLoad(Signal::SUBMISSION_QUEUE, 0);
+  EXPECT_DOUBLE_EQ(0.1, admission.Pressure());
+}
+
+
+TEST(AdmissionControllerTest, LatencyPercentile) {
+  AdmissionController admission(TestLimits());
+  // One slow write in 20 is not enough...
+  for (int i = 0; i < 19; ++i) {
+    admission.RecordLatency(Signal::ETCD_WRITE_LATENCY, milliseconds(10));
+  }
+  admission.RecordLatency(Signal::ETCD_WRITE_LATENCY, milliseconds(1000));
+  EXPECT_DOUBLE_EQ(0.1, admission.Pressure());
+  EXPECT_EQ(Action::ADMIT, admission.Decide().action);
+
+  // ...but more than one in 10 is.
+  for (int i = 0; i < 10; ++i) {
+    admission.RecordLatency(Signal::ETCD_WRITE_LATENCY, milliseconds(60));
+  }
+  EXPECT_DOUBLE_EQ(0.6, admission.Pressure());
+  EXPECT_EQ(Action::DELAY, admission.Decide().action);
+
+  // Each latency signal has its own limit.
+  admission.RecordLatency(Signal::DB_WRITE_LATENCY, milliseconds(900));
+  EXPECT_DOUBLE_EQ(0.9, admission.Pressure());
+}
+
+
+TEST(AdmissionControllerTest, OldLatenciesExpire) {
+  AdmissionController admission(TestLimits());
+  admission.RecordLatency(Signal::DB_WRITE_LATENCY, seconds(2));
+  EXPECT_EQ(Action::REJECT, admission.Decide().action);
+
+  std::this_thread::sleep_for(milliseconds(1100));
+  EXPECT_EQ(0, admission.Pressure());
+  EXPECT_EQ(Action::ADMIT, admission.Decide().action);
+}
+
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
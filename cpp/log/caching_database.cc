@@ -0,0 +1,346 @@
+#include "log/caching_database.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+#include <functional>
+
+#include "monitoring/monitoring.h"
+
+using std::hash;
+using std::lock_guard;
+using std::make_shared;
+using std::max;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+static Counter<string>* caching_database_lookups(
+    Counter<string>::New("caching_database_lookups", "result",
+                         "Number of lookups of entries in the database "
+                         "cache, by result (hit or miss)."));
+
+// The fewest older entries a shard remembers having missed.
+const size_t kMinMissedEntries = 1024;
+
+
+}  // namespace
+
+
+CachingDatabase::CachingDatabase(Database* db, size_t max_bytes,
+                                 int64_t right_edge_entries)
+    : db_(CHECK_NOTNULL(db)),
+      max_shard_bytes_(max_bytes / kShardCount),
+      right_edge_entries_(right_edge_entries) {
+  CHECK_GE(right_edge_entries_, 0);
+}
+
+
+CachingDatabase::Shard* CachingDatabase::ShardFor(
+    int64_t sequence_number) const {
+  CHECK_GE(sequence_number, 0);
+  return &shards_[sequence_number % kShardCount];
+}
+
+
+CachingDatabase::HashShard* CachingDatabase::HashShardFor(
+    const string& hash_value) const {
+  return &hash_shards_[hash<string>()(hash_value) % kShardCount];
+}
+
+
+shared_ptr<const LoggedEntry> CachingDatabase::Find(
+    int64_t sequence_number) const {
+  Shard* const shard(ShardFor(sequence_number));
+  lock_guard<mutex> lock(shard->lock);
+  const auto it(shard->index.find(sequence_number));
+  if (it == shard->index.end()) {
+    return nullptr;
+  }
+  shard->lru.splice(shard->lru.begin(), shard->lru, it->second);
+  return it->second->entry;
+}
+
+
+bool CachingDatabase::Admit(int64_t sequence_number, int64_t tree_size,
+                            ReadPattern pattern) const {
+  if (sequence_number >= tree_size - right_edge_entries_) {
+    return true;
+  }
+  // A scan reads each entry once, and its misses would push those of
+  // the lookups out of |missed|.
+  if (pattern == BULK_SCAN) {
+    return false;
+  }
+
+  Shard* const shard(ShardFor(sequence_number));
+  lock_guard<mutex> lock(shard->lock);
+  if (shard->missed.erase(sequence_number) > 0) {
+    return true;
+  }
+  // Forget about the older misses now and then, so that only entries
+  // read again soon enough are kept.
+  if (shard->missed.size() >= max(kMinMissedEntries, shard->index.size())) {
+    shard->missed.clear();
+  }
+  shard->missed.insert(sequence_number);
+  return false;
+}
+
+
+void CachingDatabase::Insert(const LoggedEntry& entry,
+                             bool hash_indexed) const {
+  const size_t bytes(entry.ByteSize() + sizeof(Shard::Item));
+  if (bytes > max_shard_bytes_) {
+    return;
+  }
+
+  Shard* const shard(ShardFor(entry.sequence_number()));
+  lock_guard<mutex> lock(shard->lock);
+  auto it(shard->index.find(entry.sequence_number()));
+  if (it == shard->index.end()) {
+    while (shard->bytes + bytes > max_shard_bytes_) {
+      const Shard::Item& evicted(shard->lru.back());
+      if (evicted.hash_indexed) {
+        const string& evicted_hash(evicted.entry->Hash());
+        HashShard* const hash_shard(HashShardFor(evicted_hash));
+        lock_guard<mutex> hash_lock(hash_shard->lock);
+        hash_shard->sequence_numbers.erase(evicted_hash);
+      }
+      shard->bytes -= evicted.bytes;
+      shard->index.erase(evicted.sequence_number);
+      shard->lru.pop_back();
+    }
+
+    const shared_ptr<LoggedEntry> copy(make_shared<LoggedEntry>());
+    copy->CopyFrom(entry);
+    shard->lru.push_front(
+        Shard::Item{entry.sequence_number(), copy, bytes, false});
+    it = shard->index.emplace(entry.sequence_number(), shard->lru.begin())
+             .first;
+    shard->bytes += bytes;
+  } else {
+    // Another request got there first, and it is the same entry.
+    shard->lru.splice(shard->lru.begin(), shard->lru, it->second);
+  }
+
+  if (hash_indexed && !it->second->hash_indexed) {
+    HashShard* const hash_shard(HashShardFor(entry.Hash()));
+    lock_guard<mutex> hash_lock(hash_shard->lock);
+    hash_shard->sequence_numbers[entry.Hash()] = entry.sequence_number();
+    it->second->hash_indexed = true;
+  }
+}
+
+
+Database::WriteResult CachingDatabase::CreateSequencedEntry_(
+    const LoggedEntry& logged) {
+  const WriteResult result(db_->CreateSequencedEntry(logged));
+  if (result == OK) {
+    // This is not necessarily the entry LookupByHash() would find, if
+    // the same one was logged before.
+    Insert(logged, false);
+  }
+  return result;
+}
+
+
+Database::WriteResult CachingDatabase::CreateSequencedEntries_(
+    const vector<const LoggedEntry*>& entries) {
+  const WriteResult result(db_->CreateSequencedEntries(entries));
+  // On failure, the entries before the one that failed were created,
+  // but those are only cached once read.
+  if (result == OK) {
+    for (const LoggedEntry* logged : entries) {
+      Insert(*logged, false);
+    }
+  }
+  return result;
+}
+
+
+Database::LookupResult CachingDatabase::LookupByHash(
+    const string& hash_value, LoggedEntry* result) const {
+  int64_t sequence_number(-1);
+  {
+    HashShard* const hash_shard(HashShardFor(hash_value));
+    lock_guard<mutex> lock(hash_shard->lock);
+    const auto it(hash_shard->sequence_numbers.find(hash_value));
+    if (it != hash_shard->sequence_numbers.end()) {
+      sequence_number = it->second;
+    }
+  }
+
+  if (sequence_number >= 0) {
+    // The entry may have been evicted since.
+    const shared_ptr<const LoggedEntry> entry(Find(sequence_number));
+    if (entry && entry->Hash() == hash_value) {
+      caching_database_lookups->Increment("hit");
+      if (result) {
+        result->CopyFrom(*entry);
+      }
+      return LOOKUP_OK;
+    }
+  }
+
+  caching_database_lookups->Increment("miss");
+  LoggedEntry entry;
+  const LookupResult lookup(db_->LookupByHash(hash_value, &entry));
+  if (lookup == LOOKUP_OK && entry.has_sequence_number()) {
+    Insert(entry, true);
+  }
+  if (result) {
+    result->CopyFrom(entry);
+  }
+  return lookup;
+}
+
+
+Database::LookupResult CachingDatabase::LookupByIndex(
+    int64_t sequence_number, LoggedEntry* result) const {
+  CHECK_GE(sequence_number, 0);
+  const shared_ptr<const LoggedEntry> cached(Find(sequence_number));
+  if (cached) {
+    caching_database_lookups->Increment("hit");
+    if (result) {
+      result->CopyFrom(*cached);
+    }
+    return LOOKUP_OK;
+  }
+
+  caching_database_lookups->Increment("miss");
+  LoggedEntry entry;
+  const LookupResult lookup(db_->LookupByIndex(sequence_number, &entry));
+  if (lookup == LOOKUP_OK &&
+      Admit(sequence_number, db_->TreeSize(), POINT_READ)) {
+    Insert(entry, false);
+  }
+  if (result) {
+    result->CopyFrom(entry);
+  }
+  return lookup;
+}
+
+
+unique_ptr<Database::Iterator> CachingDatabase::ScanEntries(
+    int64_t start_index) const {
+  return db_->ScanEntries(start_index);
+}
+
+
+void CachingDatabase::ReadEntries(int64_t start_index, int64_t end_index,
+                                  size_t max_bytes, ReadPattern pattern,
+                                  vector<LoggedEntry>* entries) const {
+  CHECK_GE(start_index, 0);
+  CHECK_NOTNULL(entries);
+  size_t bytes(0);
+  int64_t next(start_index);
+  // Serve as much of the start of the range as is cached, and read
+  // the rest.
+  for (; next <= end_index; ++next) {
+    const shared_ptr<const LoggedEntry> cached(Find(next));
+    if (!cached) {
+      break;
+    }
+    if (next > start_index && bytes + cached->ByteSize() > max_bytes) {
+      caching_database_lookups->IncrementBy("hit", next - start_index);
+      return;
+    }
+    entries->emplace_back();
+    entries->back().CopyFrom(*cached);
+    bytes += cached->ByteSize();
+  }
+  caching_database_lookups->IncrementBy("hit", next - start_index);
+  if (next > end_index || (next > start_index && bytes >= max_bytes)) {
+    return;
+  }
+
+  caching_database_lookups->Increment("miss");
+  const size_t read_first(entries->size());
+  db_->ReadEntries(next, end_index, max_bytes - bytes, pattern, entries);
+  // The database returns its first entry whatever its size, but it
+  // may not fit after the cached ones.
+  if (next > start_index && entries->size() > read_first &&
+      bytes + (*entries)[read_first].ByteSize() > max_bytes) {
+    entries->resize(read_first);
+    return;
+  }
+
+  const int64_t tree_size(db_->TreeSize());
+  for (size_t i = read_first; i < entries->size(); ++i) {
+    const LoggedEntry& entry((*entries)[i]);
+    if (Admit(entry.sequence_number(), tree_size, pattern)) {
+      Insert(entry, false);
+    }
+  }
+}
+
+
+unique_ptr<Database::LeafHashIterator> CachingDatabase::ScanLeafHashes(
+    int64_t start_index) const {
+  return db_->ScanLeafHashes(start_index);
+}
+
+
+Database::WriteResult CachingDatabase::WriteTreeHead_(
+    const ct::SignedTreeHead& sth) {
+  return db_->WriteTreeHead(sth);
+}
+
+
+Database::LookupResult CachingDatabase::LatestTreeHead(
+    ct::SignedTreeHead* result) const {
+  return db_->LatestTreeHead(result);
+}
+
+
+Database::WriteResult CachingDatabase::WriteTreeCheckpoint_(
+    const ct::CompactTreeCheckpoint& checkpoint) {
+  return db_->WriteTreeCheckpoint(checkpoint);
+}
+
+
+Database::LookupResult CachingDatabase::LatestTreeCheckpoint(
+    ct::CompactTreeCheckpoint* result) const {
+  return db_->LatestTreeCheckpoint(result);
+}
+
+
+int64_t CachingDatabase::TreeSize() const {
+  return db_->TreeSize();
+}
+
+
+int64_t CachingDatabase::FirstSequenceNumberSince(uint64_t timestamp) const {
+  return db_->FirstSequenceNumberSince(timestamp);
+}
+
+
+void CachingDatabase::AddNotifySTHCallback(
+    const NotifySTHCallback* callback) {
+  db_->AddNotifySTHCallback(callback);
+}
+
+
+void CachingDatabase::RemoveNotifySTHCallback(
+    const NotifySTHCallback* callback) {
+  db_->RemoveNotifySTHCallback(callback);
+}
+
+
+void CachingDatabase::InitializeNode(const string& node_id) {
+  db_->InitializeNode(node_id);
+}
+
+
+Database::LookupResult CachingDatabase::NodeId(string* node_id) {
+  return db_->NodeId(node_id);
+}
+
+
+}  // namespace cert_trans
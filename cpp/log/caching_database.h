@@ -0,0 +1,150 @@
+#ifndef CERT_TRANS_LOG_CACHING_DATABASE_H_
+#define CERT_TRANS_LOG_CACHING_DATABASE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "log/database.h"
+#include "log/logged_entry.h"
+#include "proto/ct.pb.h"
+
+namespace cert_trans {
+
+
+// A Database that keeps the entries most recently read from (or
+// written to) another one parsed in memory, so that lookups of those
+// do not go to the underlying database at all. Entries never change
+// once sequenced, so nothing is ever invalidated, only evicted when
+// the cache is full.
+//
+// Most reads are of the newest entries, so the entries written, and
+// those read within |right_edge_entries| of the tree size, are always
+// kept. Older entries are only kept once they have been read twice
+// in a while, and never by a BULK_SCAN, so that a single pass over the
+// log (a mirror fetching it, say) does not wipe out the cache.
+//
+// Like JsonEntryCache, the cache is split into shards by sequence
+// number, each with its own lock and least recently used list. Hash
+// lookups also go through a map of the hashes last looked up to their
+// sequence numbers, split into shards by hash.
+//
+// Scans are not cached, and everything other than entries goes
+// straight to the underlying database.
+//
+// This class is thread-safe.
+class CachingDatabase : public Database {
+ public:
+  // Takes ownership of |db|, and keeps up to about |max_bytes| of its
+  // entries.
+  CachingDatabase(Database* db, size_t max_bytes, int64_t right_edge_entries);
+  CachingDatabase(const CachingDatabase&) = delete;
+  CachingDatabase& operator=(const CachingDatabase&) = delete;
+
+  // Implement abstract functions, see database.h for comments.
+  Database::WriteResult CreateSequencedEntry_(
+      const LoggedEntry& logged) override;
+
+  Database::WriteResult CreateSequencedEntries_(
+      const std::vector<const LoggedEntry*>& entries) override;
+
+  Database::LookupResult LookupByHash(const std::string& hash,
+                                      LoggedEntry* result) const override;
+
+  Database::LookupResult LookupByIndex(int64_t sequence_number,
+                                       LoggedEntry* result) const override;
+
+  std::unique_ptr<Database::Iterator> ScanEntries(
+      int64_t start_index) const override;
+
+  void ReadEntries(int64_t start_index, int64_t end_index, size_t max_bytes,
+                   ReadPattern pattern,
+                   std::vector<LoggedEntry>* entries) const override;
+
+  std::unique_ptr<Database::LeafHashIterator> ScanLeafHashes(
+      int64_t start_index) const override;
+
+  Database::WriteResult WriteTreeHead_(const ct::SignedTreeHead& sth) override;
+
+  Database::LookupResult LatestTreeHead(
+      ct::SignedTreeHead* result) const override;
+
+  Database::WriteResult WriteTreeCheckpoint_(
+      const ct::CompactTreeCheckpoint& checkpoint) override;
+
+  Database::LookupResult LatestTreeCheckpoint(
+      ct::CompactTreeCheckpoint* result) const override;
+
+  int64_t TreeSize() const override;
+
+  int64_t FirstSequenceNumberSince(uint64_t timestamp) const override;
+
+  void AddNotifySTHCallback(
+      const Database::NotifySTHCallback* callback) override;
+
+  void RemoveNotifySTHCallback(
+      const Database::NotifySTHCallback* callback) override;
+
+  void InitializeNode(const std::string& node_id) override;
+
+  Database::LookupResult NodeId(std::string* node_id) override;
+
+ private:
+  static const int kShardCount = 16;
+
+  struct Shard {
+    struct Item {
+      int64_t sequence_number;
+      std::shared_ptr<const LoggedEntry> entry;
+      size_t bytes;
+      // Set if |hash_shards_| maps the hash of |entry| to this.
+      bool hash_indexed;
+    };
+    typedef std::list<Item> List;
+
+    std::mutex lock;
+    // Most recently used first.
+    List lru;
+    std::unordered_map<int64_t, List::iterator> index;
+    size_t bytes = 0;
+    // The older entries missed once since this was last cleared, which
+    // will be kept when missed again.
+    std::unordered_set<int64_t> missed;
+  };
+
+  struct HashShard {
+    std::mutex lock;
+    std::unordered_map<std::string, int64_t> sequence_numbers;
+  };
+
+  Shard* ShardFor(int64_t sequence_number) const;
+  HashShard* HashShardFor(const std::string& hash) const;
+
+  // Returns the cached entry |sequence_number|, or nullptr.
+  std::shared_ptr<const LoggedEntry> Find(int64_t sequence_number) const;
+  // Whether an entry read from |db_| by a read following |pattern|
+  // should be kept, when it has |tree_size| entries.
+  bool Admit(int64_t sequence_number, int64_t tree_size,
+             ReadPattern pattern) const;
+  // Keeps |entry|, possibly evicting others, and, if |hash_indexed|,
+  // records that it is the entry LookupByHash() finds for its hash.
+  void Insert(const LoggedEntry& entry, bool hash_indexed) const;
+
+  const std::unique_ptr<Database> db_;
+  const size_t max_shard_bytes_;
+  const int64_t right_edge_entries_;
+  mutable Shard shards_[kShardCount];
+  mutable HashShard hash_shards_[kShardCount];
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_CACHING_DATABASE_H_
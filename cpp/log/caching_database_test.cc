@@ -0,0 +1,279 @@
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "log/caching_database.h"
+#include "log/logged_entry.h"
+#include "log/sqlite_db.h"
+#include "log/test_signer.h"
+#include "proto/cert_serializer.h"
+#include "util/test_db.h"
+#include "util/testing.h"
+
+namespace {
+
+using cert_trans::CachingDatabase;
+using cert_trans::Database;
+using cert_trans::LoggedEntry;
+using cert_trans::SQLiteDB;
+using std::atomic;
+using std::string;
+using std::vector;
+
+const size_t kCacheBytes = 1 << 20;
+const int64_t kRightEdgeEntries = 4;
+const int64_t kEntryCount = 32;
+
+
+// Counts the entries read, to tell which reads went to the cache.
+class CountingDB : public SQLiteDB {
+ public:
+  explicit CountingDB(const string& dbfile) : SQLiteDB(dbfile), reads_(0) {
+  }
+
+  LookupResult LookupByHash(const string& hash,
+                            LoggedEntry* result) const override {
+    ++reads_;
+    return SQLiteDB::LookupByHash(hash, result);
+  }
+
+  LookupResult LookupByIndex(int64_t sequence_number,
+                             LoggedEntry* result) const override {
+    ++reads_;
+    return SQLiteDB::LookupByIndex(sequence_number, result);
+  }
+
+  void ReadEntries(int64_t start_index, int64_t end_index, size_t max_bytes,
+                   ReadPattern pattern,
+                   vector<LoggedEntry>* entries) const override {
+    const size_t size(entries->size());
+    SQLiteDB::ReadEntries(start_index, end_index, max_bytes, pattern,
+                          entries);
+    reads_ += entries->size() - size;
+  }
+
+  int64_t reads() const {
+    return reads_;
+  }
+
+ private:
+  mutable atomic<int64_t> reads_;
+};
+
+
+class CachingDatabaseTest : public ::testing::Test {
+ protected:
+  CachingDatabaseTest()
+      : backend_(new CountingDB(tmp_.TmpStorageDir() + "/sqlite")),
+        db_(backend_, kCacheBytes, kRightEdgeEntries) {
+  }
+
+  // Writes entries with sequence numbers [0, kEntryCount) straight to
+  // the backend, so that none are cached.
+  void CreateEntries() {
+    for (int64_t seq = 0; seq < kEntryCount; ++seq) {
+      entries_.emplace_back();
+      test_signer_.CreateUnique(&entries_.back());
+      entries_.back().set_sequence_number(seq);
+      ASSERT_EQ(Database::OK, backend_->CreateSequencedEntry(entries_.back()));
+    }
+  }
+
+  // Whether LookupByIndex() of |sequence_number| is served from the
+  // cache.
+  bool Cached(int64_t sequence_number) {
+    const int64_t reads(backend_->reads());
+    LoggedEntry entry;
+    EXPECT_EQ(Database::LOOKUP_OK,
+              db_.LookupByIndex(sequence_number, &entry));
+    TestSigner::TestEqualLoggedCerts(entries_[sequence_number], entry);
+    return backend_->reads() == reads;
+  }
+
+  TmpStorage tmp_;
+  TestSigner test_signer_;
+  CountingDB* const backend_;
+  CachingDatabase db_;
+  vector<LoggedEntry> entries_;
+};
+
+
+TEST_F(CachingDatabaseTest, ReturnsEntries) {
+  CreateEntries();
+  for (int pass = 0; pass < 3; ++pass) {
+    for (const LoggedEntry& entry : entries_) {
+      LoggedEntry lookup;
+      ASSERT_EQ(Database::LOOKUP_OK,
+                db_.LookupByIndex(entry.sequence_number(), &lookup));
+      TestSigner::TestEqualLoggedCerts(entry, lookup);
+      ASSERT_EQ(Database::LOOKUP_OK, db_.LookupByHash(entry.Hash(), &lookup));
+      TestSigner::TestEqualLoggedCerts(entry, lookup);
+    }
+  }
+
+  vector<LoggedEntry> read;
+  db_.ReadEntries(0, kEntryCount, 1 << 20, Database::POINT_READ, &read);
+  ASSERT_EQ(entries_.size(), read.size());
+  for (size_t i = 0; i < read.size(); ++i) {
+    TestSigner::TestEqualLoggedCerts(entries_[i], read[i]);
+  }
+
+  LoggedEntry lookup;
+  EXPECT_EQ(Database::NOT_FOUND, db_.LookupByIndex(kEntryCount, &lookup));
+  LoggedEntry missing;
+  test_signer_.CreateUnique(&missing);
+  EXPECT_EQ(Database::NOT_FOUND, db_.LookupByHash(missing.Hash(), &lookup));
+}
+
+
+TEST_F(CachingDatabaseTest, KeepsWrittenEntries) {
+  entries_.emplace_back();
+  test_signer_.CreateUnique(&entries_.back());
+  entries_.back().set_sequence_number(0);
+  ASSERT_EQ(Database::OK, db_.CreateSequencedEntry(entries_.back()));
+  EXPECT_TRUE(Cached(0));
+}
+
+
+TEST_F(CachingDatabaseTest, AdmitsRightEdgeOnFirstRead) {
+  CreateEntries();
+  vector<LoggedEntry> read;
+  db_.ReadEntries(0, kEntryCount, 1 << 20, Database::POINT_READ, &read);
+  ASSERT_EQ(entries_.size(), read.size());
+
+  // Only the newest entries are kept after a single read.
+  EXPECT_FALSE(Cached(0));
+  EXPECT_FALSE(Cached(kEntryCount - kRightEdgeEntries - 1));
+  for (int64_t seq = kEntryCount - kRightEdgeEntries; seq < kEntryCount;
+       ++seq) {
+    EXPECT_TRUE(Cached(seq));
+  }
+}
+
+
+TEST_F(CachingDatabaseTest, AdmitsOlderEntriesOnSecondMiss) {
+  CreateEntries();
+  EXPECT_FALSE(Cached(0));
+  EXPECT_FALSE(Cached(0));
+  EXPECT_TRUE(Cached(0));
+
+  vector<LoggedEntry> read;
+  const int64_t reads(backend_->reads());
+  db_.ReadEntries(0, 0, 1 << 20, Database::POINT_READ, &read);
+  ASSERT_EQ(1U, read.size());
+  TestSigner::TestEqualLoggedCerts(entries_[0], read[0]);
+  EXPECT_EQ(reads, backend_->reads());
+}
+
+
+TEST_F(CachingDatabaseTest, ScansOnlyAdmitRightEdge) {
+  CreateEntries();
+  vector<LoggedEntry> read;
+  db_.ReadEntries(0, kEntryCount, 1 << 20, Database::BULK_SCAN, &read);
+  db_.ReadEntries(0, kEntryCount, 1 << 20, Database::BULK_SCAN, &read);
+  ASSERT_EQ(2 * entries_.size(), read.size());
+
+  for (int64_t seq = kEntryCount - kRightEdgeEntries; seq < kEntryCount;
+       ++seq) {
+    EXPECT_TRUE(Cached(seq));
+  }
+  // Nor do the misses of a scan count towards the older entries being
+  // kept.
+  EXPECT_FALSE(Cached(0));
+  EXPECT_FALSE(Cached(0));
+  EXPECT_TRUE(Cached(0));
+}
+
+
+TEST_F(CachingDatabaseTest, LookupByHashFindsFirstEntry) {
+  CreateEntries();
+  // The same entry logged again later on, and cached as it is written.
+  LoggedEntry again(entries_[3]);
+  again.set_sequence_number(kEntryCount);
+  ASSERT_EQ(Database::OK, db_.CreateSequencedEntry(again));
+
+  for (int i = 0; i < 2; ++i) {
+    LoggedEntry lookup;
+    ASSERT_EQ(Database::LOOKUP_OK,
+              db_.LookupByHash(entries_[3].Hash(), &lookup));
+    EXPECT_EQ(3, lookup.sequence_number());
+  }
+  const int64_t reads(backend_->reads());
+  LoggedEntry lookup;
+  ASSERT_EQ(Database::LOOKUP_OK,
+            db_.LookupByHash(entries_[3].Hash(), &lookup));
+  EXPECT_EQ(3, lookup.sequence_number());
+  EXPECT_EQ(reads, backend_->reads());
+}
+
+
+TEST_F(CachingDatabaseTest, ReadEntriesRespectsMaxBytes) {
+  CreateEntries();
+  // Cache the first half of the range, which takes two misses.
+  for (int64_t seq = 0; seq < kEntryCount / 2; ++seq) {
+    ASSERT_FALSE(Cached(seq));
+    ASSERT_FALSE(Cached(seq));
+    ASSERT_TRUE(Cached(seq));
+  }
+
+  size_t max_bytes(0);
+  for (int64_t seq = 0; seq < kEntryCount / 2 + 2; ++seq) {
+    max_bytes += entries_[seq].ByteSize();
+  }
+  vector<LoggedEntry> read;
+  db_.ReadEntries(0, kEntryCount, max_bytes, Database::POINT_READ, &read);
+  ASSERT_EQ(static_cast<size_t>(kEntryCount / 2 + 2), read.size());
+  for (size_t i = 0; i < read.size(); ++i) {
+    TestSigner::TestEqualLoggedCerts(entries_[i], read[i]);
+  }
+
+  // The first entry is always returned, cached or not, and only that.
+  read.clear();
+  db_.ReadEntries(0, kEntryCount, 1, Database::POINT_READ, &read);
+  EXPECT_EQ(1U, read.size());
+  read.clear();
+  db_.ReadEntries(kEntryCount / 2, kEntryCount, 1, Database::POINT_READ,
+                  &read);
+  EXPECT_EQ(1U, read.size());
+  read.clear();
+  db_.ReadEntries(kEntryCount / 2 - 1, kEntryCount,
+                  entries_[kEntryCount / 2 - 1].ByteSize() + 1,
+                  Database::POINT_READ, &read);
+  EXPECT_EQ(1U, read.size());
+}
+
+
+TEST_F(CachingDatabaseTest, EvictsEntries) {
+  TmpStorage tmp;
+  // Room for a few entries per shard, with all the entries written
+  // being on the right edge.
+  CachingDatabase db(new SQLiteDB(tmp.TmpStorageDir() + "/sqlite"),
+                     16 * 4 * 1024, 16 * kEntryCount);
+  for (int64_t seq = 0; seq < 16 * kEntryCount; ++seq) {
+    entries_.emplace_back();
+    test_signer_.CreateUnique(&entries_.back());
+    entries_.back().set_sequence_number(seq);
+    ASSERT_EQ(Database::OK, db.CreateSequencedEntry(entries_.back()));
+  }
+  for (int pass = 0; pass < 2; ++pass) {
+    for (const LoggedEntry& entry : entries_) {
+      LoggedEntry lookup;
+      ASSERT_EQ(Database::LOOKUP_OK,
+                db.LookupByIndex(entry.sequence_number(), &lookup));
+      TestSigner::TestEqualLoggedCerts(entry, lookup);
+      ASSERT_EQ(Database::LOOKUP_OK, db.LookupByHash(entry.Hash(), &lookup));
+      EXPECT_EQ(entry.sequence_number(), lookup.sequence_number());
+    }
+  }
+}
+
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  ConfigureSerializerForV1CT();
+  return RUN_ALL_TESTS();
+}
@@ -218,9 +218,16 @@ unique_ptr<Cert> Cert::Clone() const {
 
 
 unique_ptr<Cert> Cert::FromDerString(const string& der_string) {
-  const unsigned char* start =
-      reinterpret_cast<const unsigned char*>(der_string.data());
-  ScopedX509 x509(d2i_X509(nullptr, &start, der_string.size()));
+  return FromDerBuffer(
+      reinterpret_cast<const unsigned char*>(der_string.data()),
+      der_string.size());
+}
+
+
+unique_ptr<Cert> Cert::FromDerBuffer(const unsigned char* der,
+                                     size_t length) {
+  const unsigned char* start(der);
+  ScopedX509 x509(d2i_X509(nullptr, &start, length));
   if (!x509) {
     LOG(WARNING) << "Input is not a valid DER-encoded certificate";
     LOG_OPENSSL_ERRORS(WARNING);
@@ -494,24 +501,44 @@ StatusOr<bool> Cert::IsSignedBy(const Cert& issuer) const {
 }
 
 
-util::Status Cert::DerEncoding(string* result) const {
-  unsigned char* der_buf(nullptr);
-  int der_length = i2d_X509(CHECK_NOTNULL(x509_.get()), &der_buf);
-
-  if (der_length < 0) {
-    // Failed to decode. Several possible reasons but we will just reject
-    // the input rather than trying to interpret the cause
-    LOG(WARNING) << "Failed to serialize cert";
-    LOG_OPENSSL_ERRORS(WARNING);
-    return util::Status(Code::INVALID_ARGUMENT, "DER decoding failed");
+util::Status Cert::GetCached(
+    unique_ptr<const string>* cached,
+    const std::function<util::Status(string*)>& encode,
+    string* result) const {
+  std::lock_guard<std::mutex> lock(cache_lock_);
+  if (!*cached) {
+    string encoded;
+    const util::Status status(encode(&encoded));
+    if (!status.ok()) {
+      return status;
+    }
+    cached->reset(new string(move(encoded)));
   }
-
-  result->assign(reinterpret_cast<char*>(der_buf), der_length);
-  OPENSSL_free(der_buf);
+  CHECK_NOTNULL(result)->assign(**cached);
   return ::util::OkStatus();
 }
 
 
+util::Status Cert::DerEncoding(string* result) const {
+  return GetCached(&der_, [this](string* der) {
+    unsigned char* der_buf(nullptr);
+    int der_length = i2d_X509(CHECK_NOTNULL(x509_.get()), &der_buf);
+
+    if (der_length < 0) {
+      // Failed to decode. Several possible reasons but we will just reject
+      // the input rather than trying to interpret the cause
+      LOG(WARNING) << "Failed to serialize cert";
+      LOG_OPENSSL_ERRORS(WARNING);
+      return util::Status(Code::INVALID_ARGUMENT, "DER decoding failed");
+    }
+
+    der->assign(reinterpret_cast<char*>(der_buf), der_length);
+    OPENSSL_free(der_buf);
+    return ::util::OkStatus();
+  }, result);
+}
+
+
 util::Status Cert::PemEncoding(string* result) const {
   ScopedBIO bp(BIO_new(BIO_s_mem()));
   if (!PEM_write_bio_X509(bp.get(), CHECK_NOTNULL(x509_.get()))) {
@@ -532,47 +559,55 @@ util::Status Cert::PemEncoding(string* result) const {
 
 
 util::Status Cert::Sha256Digest(string* result) const {
-  unsigned char digest[EVP_MAX_MD_SIZE];
-  unsigned int len;
-  if (X509_digest(CHECK_NOTNULL(x509_.get()), EVP_sha256(), digest, &len) !=
-      1) {
-    // Failed to digest. Several possible reasons but we will just reject
-    // the input rather than trying to interpret the cause
-    LOG(WARNING) << "Failed to compute cert digest";
-    LOG_OPENSSL_ERRORS(WARNING);
-    return util::Status(Code::INVALID_ARGUMENT, "SHA256 digest failed");
-  }
+  return GetCached(&sha256_digest_, [this](string* sha256_digest) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int len;
+    if (X509_digest(CHECK_NOTNULL(x509_.get()), EVP_sha256(), digest,
+                    &len) != 1) {
+      // Failed to digest. Several possible reasons but we will just reject
+      // the input rather than trying to interpret the cause
+      LOG(WARNING) << "Failed to compute cert digest";
+      LOG_OPENSSL_ERRORS(WARNING);
+      return util::Status(Code::INVALID_ARGUMENT, "SHA256 digest failed");
+    }
 
-  result->assign(reinterpret_cast<char*>(digest), len);
-  return ::util::OkStatus();
+    sha256_digest->assign(reinterpret_cast<char*>(digest), len);
+    return ::util::OkStatus();
+  }, result);
 }
 
 
 util::Status Cert::DerEncodedTbsCertificate(string* result) const {
-  unsigned char* der_buf(nullptr);
-  int der_length = i2d_re_X509_tbs(CHECK_NOTNULL(x509_.get()), &der_buf);
-  if (der_length < 0) {
-    // Failed to serialize. Several possible reasons but we will just reject
-    // the input rather than trying to interpret the cause
-    LOG(WARNING) << "Failed to serialize the TBS component";
-    LOG_OPENSSL_ERRORS(WARNING);
-    return util::Status(Code::INVALID_ARGUMENT, "TBS DER serialize failed");
-  }
-  result->assign(reinterpret_cast<char*>(der_buf), der_length);
-  OPENSSL_free(der_buf);
-  return ::util::OkStatus();
+  return GetCached(&der_tbs_, [this](string* der_tbs) {
+    unsigned char* der_buf(nullptr);
+    int der_length = i2d_re_X509_tbs(CHECK_NOTNULL(x509_.get()), &der_buf);
+    if (der_length < 0) {
+      // Failed to serialize. Several possible reasons but we will just
+      // reject the input rather than trying to interpret the cause
+      LOG(WARNING) << "Failed to serialize the TBS component";
+      LOG_OPENSSL_ERRORS(WARNING);
+      return util::Status(Code::INVALID_ARGUMENT, "TBS DER serialize failed");
+    }
+    der_tbs->assign(reinterpret_cast<char*>(der_buf), der_length);
+    OPENSSL_free(der_buf);
+    return ::util::OkStatus();
+  }, result);
 }
 
 
 util::Status Cert::DerEncodedSubjectName(string* result) const {
-  return DerEncodedName(X509_get_subject_name(CHECK_NOTNULL(x509_.get())),
-                        result);
+  return GetCached(&der_subject_name_, [this](string* name) {
+    return DerEncodedName(X509_get_subject_name(CHECK_NOTNULL(x509_.get())),
+                          name);
+  }, result);
 }
 
 
 util::Status Cert::DerEncodedIssuerName(string* result) const {
-  return DerEncodedName(X509_get_issuer_name(CHECK_NOTNULL(x509_.get())),
-                        result);
+  return GetCached(&der_issuer_name_, [this](string* name) {
+    return DerEncodedName(X509_get_issuer_name(CHECK_NOTNULL(x509_.get())),
+                          name);
+  }, result);
 }
 
 
@@ -610,23 +645,29 @@ util::Status Cert::PublicKeySha256Digest(string* result) const {
 
 
 StatusOr<string> Cert::SPKI() const {
-  unsigned char* der_buf(nullptr);
-  const int der_length(
-      i2d_X509_PUBKEY(X509_get_X509_PUBKEY(CHECK_NOTNULL(x509_.get())),
-                      &der_buf));
-  if (der_length < 0) {
-    // What does this return value mean? Let's assume it means the cert
-    // is bad until proven otherwise.
-    LOG(WARNING) << "Failed to serialize the Subject Public Key Info";
-    LOG_OPENSSL_ERRORS(WARNING);
-    return util::Status(Code::INVALID_ARGUMENT, "Cert::SPKI() failed");
-  }
-
   string result;
-  result.assign(
-      string(reinterpret_cast<char*>(CHECK_NOTNULL(der_buf)), der_length));
+  const util::Status status(GetCached(&spki_, [this](string* spki) {
+    unsigned char* der_buf(nullptr);
+    const int der_length(
+        i2d_X509_PUBKEY(X509_get_X509_PUBKEY(CHECK_NOTNULL(x509_.get())),
+                        &der_buf));
+    if (der_length < 0) {
+      // What does this return value mean? Let's assume it means the cert
+      // is bad until proven otherwise.
+      LOG(WARNING) << "Failed to serialize the Subject Public Key Info";
+      LOG_OPENSSL_ERRORS(WARNING);
+      return util::Status(Code::INVALID_ARGUMENT, "Cert::SPKI() failed");
+    }
 
-  OPENSSL_free(der_buf);
+    spki->assign(reinterpret_cast<char*>(CHECK_NOTNULL(der_buf)),
+                 der_length);
+
+    OPENSSL_free(der_buf);
+    return ::util::OkStatus();
+  }, &result));
+  if (!status.ok()) {
+    return status;
+  }
   return result;
 }
 
@@ -855,6 +896,30 @@ util::Status Cert::SubjectAltNames(vector<string>* dns_alt_names) const {
 }
 
 
+util::Status Cert::SubjectCommonName(string* common_name) const {
+  CHECK_NOTNULL(common_name)->clear();
+  X509_NAME* const name(X509_get_subject_name(x509_.get()));
+  if (!name) {
+    return util::Status(Code::INVALID_ARGUMENT, "Missing X509 subject name");
+  }
+
+  const int name_pos(X509_NAME_get_index_by_NID(name, NID_commonName, -1));
+  if (name_pos < 0) {
+    return ::util::OkStatus();
+  }
+  X509_NAME_ENTRY* const name_entry(X509_NAME_get_entry(name, name_pos));
+  ASN1_STRING* const common_name_asn1(
+      name_entry ? X509_NAME_ENTRY_get_data(name_entry) : nullptr);
+  if (!common_name_asn1) {
+    return util::Status(Code::INVALID_ARGUMENT, "Missing CN data");
+  }
+
+  util::Status status;
+  *common_name = ASN1ToStringAndCheckForNulls(common_name_asn1, "CN", &status);
+  return status;
+}
+
+
 // Helper method for validating V2 redaction rules. If it returns true
 // then the result in status is final.
 bool Cert::ValidateRedactionSubjectAltNameAndCN(int* dns_alt_name_count,
@@ -1139,7 +1204,148 @@ util::Status Cert::IsValidNameConstrainedIntermediateCa() const {
   return ::util::OkStatus();
 }
 
-TbsCertificate::TbsCertificate(const Cert& cert) {
+namespace {
+
+
+const unsigned char kDerBoolean = 0x01;
+const unsigned char kDerInteger = 0x02;
+const unsigned char kDerOctetString = 0x04;
+const unsigned char kDerNull = 0x05;
+const unsigned char kDerObject = 0x06;
+const unsigned char kDerSequence = 0x30;
+const unsigned char kDerSet = 0x31;
+const unsigned char kDerConstructed = 0x20;
+const unsigned char kDerUniversal = 0xc0;
+const unsigned char kTbsVersion = 0xa0;
+const unsigned char kTbsIssuerUid = 0x81;
+const unsigned char kTbsSubjectUid = 0x82;
+const unsigned char kTbsExtensions = 0xa3;
+
+
+struct DerElement {
+  unsigned char tag;
+  // Offsets of the tag, of the contents and of the end of the element.
+  size_t start;
+  size_t contents;
+  size_t end;
+};
+
+
+// Reads the element at |*pos|, which must end by |end|, and moves |*pos|
+// past it. Only accepts low tag numbers and minimal definite lengths.
+bool ReadDerElement(const string& der, size_t* pos, size_t end,
+                    DerElement* element) {
+  size_t p(*pos);
+  if (end - p < 2) {
+    return false;
+  }
+  element->start = p;
+  element->tag = der[p++];
+  if ((element->tag & 0x1f) == 0x1f) {
+    return false;
+  }
+  size_t length(static_cast<unsigned char>(der[p++]));
+  if (length & 0x80) {
+    const size_t num_bytes(length & 0x7f);
+    if (num_bytes == 0 || num_bytes > 4 || end - p < num_bytes ||
+        der[p] == 0) {
+      return false;
+    }
+    length = 0;
+    for (size_t i = 0; i < num_bytes; ++i) {
+      length = (length << 8) | static_cast<unsigned char>(der[p++]);
+    }
+    if (length < 0x80) {
+      return false;
+    }
+  }
+  if (end - p < length) {
+    return false;
+  }
+  element->contents = p;
+  element->end = p + length;
+  *pos = element->end;
+  return true;
+}
+
+
+// Whether the elements in [pos, end) are encoded the way OpenSSL would
+// encode them again. That is DER, except that SETs need not be sorted:
+// they only occur in names, of which OpenSSL keeps the received encoding.
+bool IsCanonicalDer(const string& der, size_t pos, size_t end) {
+  while (pos < end) {
+    DerElement element;
+    if (!ReadDerElement(der, &pos, end, &element)) {
+      return false;
+    }
+    const size_t length(element.end - element.contents);
+    const unsigned char* const contents(
+        reinterpret_cast<const unsigned char*>(der.data()) +
+        element.contents);
+    switch (element.tag) {
+      case kDerBoolean:
+        // FALSE is only ever a default, which DER leaves out.
+        if (length != 1 || contents[0] != 0xff) {
+          return false;
+        }
+        break;
+      case kDerInteger:
+        if (length == 0 || (length > 1 && ((contents[0] == 0x00 &&
+                                            !(contents[1] & 0x80)) ||
+                                           (contents[0] == 0xff &&
+                                            (contents[1] & 0x80))))) {
+          return false;
+        }
+        break;
+      case kDerNull:
+        if (length != 0) {
+          return false;
+        }
+        break;
+      default:
+        if (element.tag & kDerConstructed) {
+          // Constructed strings are BER only.
+          if ((element.tag & kDerUniversal) == 0 &&
+              element.tag != kDerSequence && element.tag != kDerSet) {
+            return false;
+          }
+          if (!IsCanonicalDer(der, element.contents, element.end)) {
+            return false;
+          }
+        }
+    }
+  }
+  return true;
+}
+
+
+string DerLength(size_t length) {
+  if (length < 0x80) {
+    return string(1, static_cast<char>(length));
+  }
+  string bytes;
+  for (; length > 0; length >>= 8) {
+    bytes.insert(bytes.begin(), static_cast<char>(length & 0xff));
+  }
+  return static_cast<char>(0x80 | bytes.size()) + bytes;
+}
+
+
+string DerElementOf(unsigned char tag, const string& contents) {
+  return static_cast<char>(tag) + DerLength(contents.size()) + contents;
+}
+
+
+}  // namespace
+
+
+TbsCertificate::TbsCertificate(const Cert& cert)
+    : der_loaded_(false), der_has_extensions_(false) {
+  string der;
+  if (cert.DerEncoding(&der).ok() && LoadDer(der)) {
+    return;
+  }
+
   x509_.reset(X509_dup(CHECK_NOTNULL(cert.x509_.get())));
 
   if (!x509_)
@@ -1147,12 +1353,115 @@ TbsCertificate::TbsCertificate(const Cert& cert) {
 }
 
 
+bool TbsCertificate::LoadDer(const string& cert_der) {
+  size_t pos(0);
+  DerElement cert, tbs;
+  if (!ReadDerElement(cert_der, &pos, cert_der.size(), &cert) ||
+      cert.tag != kDerSequence || pos != cert_der.size()) {
+    return false;
+  }
+  pos = cert.contents;
+  if (!ReadDerElement(cert_der, &pos, cert.end, &tbs) ||
+      tbs.tag != kDerSequence ||
+      !IsCanonicalDer(cert_der, tbs.contents, tbs.end)) {
+    return false;
+  }
+
+  vector<DerElement> fields;
+  for (pos = tbs.contents; pos < tbs.end;) {
+    fields.emplace_back();
+    CHECK(ReadDerElement(cert_der, &pos, tbs.end, &fields.back()));
+  }
+
+  // Version, serial number, signature algorithm, issuer, validity, subject,
+  // public key, then the optional unique identifiers and extensions.
+  size_t i(0);
+  if (i < fields.size() && fields[i].tag == kTbsVersion) {
+    ++i;
+  }
+  const size_t issuer(i + 2);
+  if (fields.size() < i + 6 || fields[i].tag != kDerInteger) {
+    return false;
+  }
+  for (size_t j = i + 1; j < i + 6; ++j) {
+    if (fields[j].tag != kDerSequence) {
+      return false;
+    }
+  }
+  i += 6;
+  for (const unsigned char tag : {kTbsIssuerUid, kTbsSubjectUid}) {
+    if (i < fields.size() && fields[i].tag == tag) {
+      ++i;
+    }
+  }
+  const size_t tail_end(i < fields.size() ? fields[i].start : tbs.end);
+
+  vector<string> extensions;
+  if (i < fields.size()) {
+    DerElement list;
+    pos = fields[i].contents;
+    if (fields[i].tag != kTbsExtensions || i + 1 != fields.size() ||
+        !ReadDerElement(cert_der, &pos, fields[i].end, &list) ||
+        list.tag != kDerSequence || pos != fields[i].end) {
+      return false;
+    }
+    // Each is an object identifier, an optional critical flag and the
+    // value.
+    for (pos = list.contents; pos < list.end;) {
+      DerElement extension, field;
+      CHECK(ReadDerElement(cert_der, &pos, list.end, &extension));
+      size_t field_pos(extension.contents);
+      if (extension.tag != kDerSequence ||
+          !ReadDerElement(cert_der, &field_pos, extension.end, &field) ||
+          field.tag != kDerObject ||
+          !ReadDerElement(cert_der, &field_pos, extension.end, &field)) {
+        return false;
+      }
+      if (field.tag == kDerBoolean &&
+          !ReadDerElement(cert_der, &field_pos, extension.end, &field)) {
+        return false;
+      }
+      if (field.tag != kDerOctetString || field_pos != extension.end) {
+        return false;
+      }
+      extensions.emplace_back(cert_der, extension.start,
+                              extension.end - extension.start);
+    }
+  }
+
+  der_head_.assign(cert_der, tbs.contents,
+                   fields[issuer].start - tbs.contents);
+  der_issuer_.assign(cert_der, fields[issuer].start,
+                     fields[issuer].end - fields[issuer].start);
+  der_tail_.assign(cert_der, fields[issuer].end,
+                   tail_end - fields[issuer].end);
+  der_has_extensions_ = tail_end != tbs.end;
+  der_extensions_.swap(extensions);
+  der_loaded_ = true;
+  return true;
+}
+
+
 util::Status TbsCertificate::DerEncoding(string* result) const {
   if (!IsLoaded()) {
     LOG(ERROR) << "TBS not loaded";
     return util::Status(Code::FAILED_PRECONDITION, "Cert not loaded (TBS)");
   }
 
+  if (der_loaded_) {
+    string contents(der_head_ + der_issuer_ + der_tail_);
+    if (der_has_extensions_) {
+      string extensions;
+      for (const string& extension : der_extensions_) {
+        extensions.append(extension);
+      }
+      contents.append(DerElementOf(kTbsExtensions,
+                                   DerElementOf(kDerSequence, extensions)));
+    }
+    *result = DerElementOf(kDerSequence, contents);
+    return ::util::OkStatus();
+  }
+
   unsigned char* der_buf(nullptr);
   int der_length = i2d_re_X509_tbs(x509_.get(), &der_buf);
   if (der_length < 0) {
@@ -1174,6 +1483,10 @@ util::Status TbsCertificate::DeleteExtension(int extension_nid) {
     return util::Status(Code::FAILED_PRECONDITION, "Cert not loaded (TBS)");
   }
 
+  if (der_loaded_) {
+    return DeleteDerExtension(extension_nid);
+  }
+
   const StatusOr<int> extension_index(ExtensionIndex(extension_nid));
   // If the extension doesn't exist then there is nothing to do and this
   // propagates the NOT_FOUND status.
@@ -1219,6 +1532,10 @@ util::Status TbsCertificate::CopyIssuerFrom(const Cert& from) {
     return util::Status(Code::FAILED_PRECONDITION, "Cert not loaded (TBS)");
   }
 
+  if (der_loaded_) {
+    return CopyDerIssuerFrom(from);
+  }
+
   // This just looks up the relevant pointer so there shouldn't
   // be any errors to clear.
   X509_NAME* ca_name = X509_get_issuer_name(from.x509_.get());
@@ -1290,6 +1607,122 @@ util::Status TbsCertificate::CopyIssuerFrom(const Cert& from) {
 }
 
 
+util::Status TbsCertificate::DeleteDerExtension(int extension_nid) {
+  const StatusOr<size_t> extension_index(DerExtensionIndex(extension_nid));
+  if (!extension_index.ok()) {
+    return extension_index.status();
+  }
+  der_extensions_.erase(der_extensions_.begin() +
+                        extension_index.ValueOrDie());
+
+  const StatusOr<size_t> ignored_index(DerExtensionIndex(extension_nid));
+  if (ignored_index.ok()) {
+    LOG(WARNING)
+        << "Failed to delete the extension. Does the certificate have "
+        << "duplicate extensions?";
+    return util::Status(Code::ALREADY_EXISTS, "Multiple extensions in cert");
+  }
+
+  return ::util::OkStatus();
+}
+
+
+util::Status TbsCertificate::CopyDerIssuerFrom(const Cert& from) {
+  string issuer;
+  const util::Status status(from.DerEncodedIssuerName(&issuer));
+  if (!status.ok()) {
+    LOG(WARNING) << "Failed to encode issuer name: " << status;
+    return util::Status(Code::FAILED_PRECONDITION,
+                        "Failed to encode issuer name");
+  }
+  der_issuer_.swap(issuer);
+
+  const StatusOr<size_t> extension_index(
+      DerExtensionIndex(NID_authority_key_identifier));
+  if (extension_index.status().CanonicalCode() == Code::NOT_FOUND) {
+    // No extension found = nothing to copy
+    return ::util::OkStatus();
+  }
+  if (!extension_index.ok()) {
+    LOG(ERROR) << "Failed to check Authority Key Identifier extension";
+    return util::Status(Code::INTERNAL,
+                        "Failed to check Authority KeyID extension (TBS)");
+  }
+
+  const StatusOr<int> from_extension_index(
+      from.ExtensionIndex(NID_authority_key_identifier));
+  if (from_extension_index.status().CanonicalCode() ==
+      util::error::NOT_FOUND) {
+    LOG(WARNING) << "Unable to copy issuer: destination has an Authority "
+                 << "KeyID extension, but the source has none.";
+    return util::Status(Code::FAILED_PRECONDITION,
+                        "Incompatible Authority KeyID extensions");
+  }
+  if (!from_extension_index.ok()) {
+    LOG(ERROR) << "Failed to check Authority Key Identifier extension";
+    return util::Status(Code::INTERNAL,
+                        "Failed to check Authority KeyID extension");
+  }
+  X509_EXTENSION* const from_ext(
+      X509_get_ext(from.x509_.get(), from_extension_index.ValueOrDie()));
+  const ASN1_OCTET_STRING* const from_data(
+      from_ext ? X509_EXTENSION_get_data(from_ext) : nullptr);
+  if (!from_data) {
+    // Should not happen.
+    LOG(ERROR) << "Failed to retrieve extension";
+    LOG_OPENSSL_ERRORS(ERROR);
+    return util::Status(Code::INTERNAL, "Failed to retrieve extension");
+  }
+
+  // Keep the object identifier and critical bit, and replace the value,
+  // which LoadDer() checked is last.
+  string& to_ext(der_extensions_[extension_index.ValueOrDie()]);
+  size_t pos(0);
+  DerElement extension, field;
+  CHECK(ReadDerElement(to_ext, &pos, to_ext.size(), &extension));
+  pos = extension.contents;
+  do {
+    CHECK(ReadDerElement(to_ext, &pos, to_ext.size(), &field));
+  } while (field.tag != kDerOctetString);
+  to_ext = DerElementOf(
+      kDerSequence,
+      to_ext.substr(extension.contents, field.start - extension.contents) +
+          DerElementOf(kDerOctetString,
+                       string(reinterpret_cast<const char*>(from_data->data),
+                              from_data->length)));
+
+  return ::util::OkStatus();
+}
+
+
+StatusOr<size_t> TbsCertificate::DerExtensionIndex(int extension_nid) const {
+  ASN1_OBJECT* const object(OBJ_nid2obj(extension_nid));
+  unsigned char* object_der(nullptr);
+  const int object_length(object ? i2d_ASN1_OBJECT(object, &object_der) : -1);
+  if (object_length <= 0) {
+    LOG(ERROR) << "Cannot encode the object identifier of NID "
+               << extension_nid << ". Is the NID not recognised?";
+    LOG_OPENSSL_ERRORS(ERROR);
+    return util::Status(Code::INTERNAL,
+                        "Extension lookup failed. Incorrect NID?");
+  }
+  const string oid(reinterpret_cast<char*>(object_der), object_length);
+  OPENSSL_free(object_der);
+
+  for (size_t i = 0; i < der_extensions_.size(); ++i) {
+    size_t pos(0);
+    DerElement extension;
+    CHECK(ReadDerElement(der_extensions_[i], &pos, der_extensions_[i].size(),
+                         &extension));
+    if (der_extensions_[i].compare(extension.contents, oid.size(), oid) ==
+        0) {
+      return i;
+    }
+  }
+  return util::Status(Code::NOT_FOUND, "Extension not found.");
+}
+
+
 StatusOr<int> TbsCertificate::ExtensionIndex(int extension_nid) const {
   int index = X509_get_ext_by_NID(x509_.get(), extension_nid, -1);
   if (index < -1) {
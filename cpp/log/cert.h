@@ -4,7 +4,9 @@
 #include <gtest/gtest_prod.h>
 #include <openssl/asn1.h>
 #include <openssl/x509.h>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -24,6 +26,8 @@ class Cert {
   // The following factory static methods return null if the input is
   // not valid.
   static std::unique_ptr<Cert> FromDerString(const std::string& der_string);
+  static std::unique_ptr<Cert> FromDerBuffer(const unsigned char* der,
+                                             size_t length);
   // Caller still owns the BIO afterwards.
   static std::unique_ptr<Cert> FromDerBio(BIO* bio_in);
   static std::unique_ptr<Cert> FromPemString(const std::string& pem_string);
@@ -146,6 +150,12 @@ class Cert {
   // Returns FAILED_PRECONDITION if the cert is not loaded.
   util::Status SubjectAltNames(std::vector<std::string>* dns_alt_names) const;
 
+  // Sets the subject commonName in |common_name|, or clears it if the
+  // subject has none.
+  // Returns ::util::OkStatus() if the commonName was extracted.
+  // Returns INVALID_ARGUMENT if the commonName could not be extracted.
+  util::Status SubjectCommonName(std::string* common_name) const;
+
   // Sets the SHA256 digest of the cert's subjectPublicKeyInfo in |result|.
   // Returns TRUE if computing the digest succeeded.
   // Returns FALSE if computing the digest failed.
@@ -209,7 +219,24 @@ class Cert {
   static std::string PrintName(X509_NAME* name);
   static std::string PrintTime(ASN1_TIME* when);
   static util::Status DerEncodedName(X509_NAME* name, std::string* result);
+  // Sets |result| to |*cached|, computing it with |encode| first if
+  // that was not done yet. The certificate never changes, and so
+  // neither do its encodings, which the submission path asks for
+  // several times.
+  util::Status GetCached(
+      std::unique_ptr<const std::string>* cached,
+      const std::function<util::Status(std::string*)>& encode,
+      std::string* result) const;
+
   const ScopedX509 x509_;
+
+  mutable std::mutex cache_lock_;
+  mutable std::unique_ptr<const std::string> der_;
+  mutable std::unique_ptr<const std::string> sha256_digest_;
+  mutable std::unique_ptr<const std::string> der_tbs_;
+  mutable std::unique_ptr<const std::string> der_subject_name_;
+  mutable std::unique_ptr<const std::string> der_issuer_name_;
+  mutable std::unique_ptr<const std::string> spki_;
 };
 
 // A wrapper around X509_CINF for chopping at the TBS to CT-sign it or verify
@@ -223,7 +250,7 @@ class TbsCertificate {
   TbsCertificate& operator=(const TbsCertificate&) = delete;
 
   bool IsLoaded() const {
-    return x509_ != NULL;
+    return der_loaded_ || x509_ != NULL;
   }
 
   // Sets the DER-encoded TBS structure in |result|.
@@ -255,8 +282,30 @@ class TbsCertificate {
 
  private:
   util::StatusOr<int> ExtensionIndex(int extension_nid) const;
-  // OpenSSL does not expose a TBSCertificate API, so we keep the TBS wrapped
-  // in the X509.
+
+  // Splits the TBS of |cert_der| into the fields below. Returns false,
+  // leaving them unset, unless the whole TBS is in the canonical encoding
+  // OpenSSL would give it, so that editing the bytes gives the same result
+  // as editing the decoded structure and re-encoding it.
+  bool LoadDer(const std::string& cert_der);
+  util::StatusOr<size_t> DerExtensionIndex(int extension_nid) const;
+  util::Status DeleteDerExtension(int extension_nid);
+  util::Status CopyDerIssuerFrom(const Cert& from);
+
+  // Most certificates are in DER, and are edited as such, without
+  // decoding or re-encoding anything.
+  bool der_loaded_;
+  // The version, serial number and signature algorithm.
+  std::string der_head_;
+  std::string der_issuer_;
+  // The validity, subject, public key and unique identifiers.
+  std::string der_tail_;
+  bool der_has_extensions_;
+  // Each Extension, in order.
+  std::vector<std::string> der_extensions_;
+
+  // Otherwise, OpenSSL does not expose a TBSCertificate API, so we keep the
+  // TBS wrapped in the X509.
   ScopedX509 x509_;
 };
 
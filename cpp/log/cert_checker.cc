@@ -1,6 +1,7 @@
 /* -*- indent-tabs-mode: nil -*- */
 #include "log/cert_checker.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <openssl/asn1.h>
 #include <openssl/bio.h>
@@ -8,6 +9,7 @@
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
 #include <string.h>
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <utility>
@@ -19,9 +21,17 @@
 #include "util/openssl_util.h"  // for LOG_OPENSSL_ERRORS
 #include "util/util.h"
 
+DEFINE_int32(cert_checker_verified_signatures, 10000,
+             "Number of valid certificate chain signatures remembered, so "
+             "as not to verify them again. 0 to disable.");
+
+using std::find;
+using std::lock_guard;
+using std::make_shared;
 using std::move;
 using std::multimap;
-using std::pair;
+using std::mutex;
+using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
 using std::vector;
@@ -31,22 +41,67 @@ using util::StatusOr;
 using util::error::Code;
 
 namespace cert_trans {
+namespace {
+
+
+// Returns the subject key identifier of |x509|, or an empty string if
+// it has none.
+string SubjectKeyId(X509* x509) {
+  const ScopedASN1_OCTET_STRING key_id(static_cast<ASN1_OCTET_STRING*>(
+      X509_get_ext_d2i(x509, NID_subject_key_identifier, nullptr, nullptr)));
+  if (!key_id) {
+    // Missing or not parseable, either way it is of no use.
+    ClearOpenSSLErrors();
+    return string();
+  }
+  return string(reinterpret_cast<const char*>(key_id->data), key_id->length);
+}
 
-bool CertChecker::LoadTrustedCertificates(const string& cert_file) {
+
+// Returns the key identifier of the authority key identifier of |x509|,
+// or an empty string if it has none.
+string AuthorityKeyId(X509* x509) {
+  const ScopedAUTHORITY_KEYID akid(static_cast<AUTHORITY_KEYID*>(
+      X509_get_ext_d2i(x509, NID_authority_key_identifier, nullptr,
+                       nullptr)));
+  if (!akid || !akid->keyid) {
+    ClearOpenSSLErrors();
+    return string();
+  }
+  return string(reinterpret_cast<const char*>(akid->keyid->data),
+                akid->keyid->length);
+}
+
+
+// Opens |cert_file| for reading, or returns NULL (having logged why).
+BIO* OpenCertFile(const string& cert_file) {
   // A read-only BIO.
   ScopedBIO bio_in(BIO_new(BIO_s_file()));
   if (!bio_in) {
     LOG_OPENSSL_ERRORS(ERROR);
-    return false;
+    return nullptr;
   }
 
   if (BIO_read_filename(bio_in.get(), cert_file.c_str()) <= 0) {
     LOG(ERROR) << "Failed to open file " << cert_file << " for reading";
     LOG_OPENSSL_ERRORS(ERROR);
-    return false;
+    return nullptr;
   }
 
-  return LoadTrustedCertificatesFromBIO(bio_in.get());
+  return bio_in.release();
+}
+
+
+}  // namespace
+
+
+CertChecker::CertChecker() : store_(make_shared<TrustStore>()) {
+}
+
+
+bool CertChecker::LoadTrustedCertificates(const string& cert_file) {
+  ScopedBIO bio_in(OpenCertFile(cert_file));
+  return bio_in && LoadTrustedCertificatesFromBIO(bio_in.get(), false);
 }
 
 bool CertChecker::LoadTrustedCertificates(
@@ -65,15 +120,36 @@ bool CertChecker::LoadTrustedCertificates(
     return false;
   }
 
-  return LoadTrustedCertificatesFromBIO(bio_in.get());
+  return LoadTrustedCertificatesFromBIO(bio_in.get(), false);
+}
+
+
+bool CertChecker::ReloadTrustedCertificates(const string& cert_file) {
+  ScopedBIO bio_in(OpenCertFile(cert_file));
+  return bio_in && LoadTrustedCertificatesFromBIO(bio_in.get(), true);
+}
+
+
+shared_ptr<const CertChecker::TrustStore> CertChecker::GetTrustStore() const {
+  return std::atomic_load(&store_);
 }
 
-bool CertChecker::LoadTrustedCertificatesFromBIO(BIO* bio_in) {
+
+bool CertChecker::LoadTrustedCertificatesFromBIO(BIO* bio_in, bool replace) {
   CHECK_NOTNULL(bio_in);
-  vector<pair<string, unique_ptr<const Cert>>> certs_to_add;
+  lock_guard<mutex> lock(load_lock_);
+  const shared_ptr<const TrustStore> old_store(GetTrustStore());
+  // Built on the side, and only swapped in if all goes well.
+  const shared_ptr<TrustStore> store(make_shared<TrustStore>());
+  if (!replace) {
+    for (const auto& entry : old_store->by_name_) {
+      AddTrusted(entry.first, entry.second, store.get());
+    }
+  }
+  const size_t old_certs(store->by_name_.size());
   bool error = false;
-  // certs_to_add may be empty if no new certs were added, so keep track of
-  // successfully parsed cert count separately.
+  // No new certs may be added, so keep track of successfully parsed
+  // cert count separately.
   size_t cert_count = 0;
 
   while (!error) {
@@ -81,9 +157,9 @@ bool CertChecker::LoadTrustedCertificatesFromBIO(BIO* bio_in) {
     if (x509) {
       // TODO(ekasper): check that the issuing CA cert is temporally valid
       // and at least warn if it isn't.
-      unique_ptr<Cert> cert(Cert::FromX509(move(x509)));
+      shared_ptr<const Cert> cert(Cert::FromX509(move(x509)));
       string subject_name;
-      const StatusOr<bool> is_trusted(IsTrusted(*cert, &subject_name));
+      const StatusOr<bool> is_trusted(IsTrusted(*store, *cert, &subject_name));
       if (!is_trusted.ok()) {
         error = true;
         break;
@@ -91,7 +167,7 @@ bool CertChecker::LoadTrustedCertificatesFromBIO(BIO* bio_in) {
 
       ++cert_count;
       if (!is_trusted.ValueOrDie()) {
-        certs_to_add.push_back(make_pair(subject_name, move(cert)));
+        AddTrusted(subject_name, cert, store.get());
       }
     } else {
       // See if we reached the end of the file.
@@ -114,16 +190,30 @@ bool CertChecker::LoadTrustedCertificatesFromBIO(BIO* bio_in) {
     return false;
   }
 
-  size_t new_certs = certs_to_add.size();
-  while (!certs_to_add.empty()) {
-    trusted_.insert(move(certs_to_add.back()));
-    certs_to_add.pop_back();
+  std::atomic_store(&store_, shared_ptr<const TrustStore>(store));
+  if (replace) {
+    LOG(INFO) << "Replaced the " << old_store->by_name_.size()
+              << " trusted certificate(s) with " << store->by_name_.size();
+  } else {
+    LOG(INFO) << "Added " << store->by_name_.size() - old_certs
+              << " new certificate(s) to trusted store";
   }
-  LOG(INFO) << "Added " << new_certs << " new certificate(s) to trusted store";
 
   return true;
 }
 
+
+// static
+void CertChecker::AddTrusted(const string& subject_name,
+                             const shared_ptr<const Cert>& cert,
+                             TrustStore* store) {
+  const auto it(store->by_name_.emplace(subject_name, cert));
+  const string key_id(SubjectKeyId(cert->x509_.get()));
+  if (!key_id.empty()) {
+    store->by_key_id_.emplace(key_id, it);
+  }
+}
+
 Status CertChecker::CheckCertChain(CertChain* chain) const {
   if (!chain || !chain->IsLoaded())
     return Status(util::error::INVALID_ARGUMENT, "invalid certificate chain");
@@ -156,7 +246,7 @@ Status CertChecker::CheckIssuerChain(CertChain* chain) const {
     return Status(status.CanonicalCode(), "invalid certificate chain");
   }
 
-  const Status valid_chain(chain->IsValidSignatureChain());
+  const Status valid_chain(CheckSignatureChain(*chain));
   if (!valid_chain.ok()) {
     return valid_chain;
   }
@@ -164,6 +254,66 @@ Status CertChecker::CheckIssuerChain(CertChain* chain) const {
   return GetTrustedCa(chain);
 }
 
+Status CertChecker::CheckSignatureChain(const CertChain& chain) const {
+  for (size_t i = 0; i + 1 < chain.Length(); ++i) {
+    const StatusOr<bool> signed_by_issuer(
+        IsSignedBy(*chain.CertAt(i), *chain.CertAt(i + 1)));
+    // As in CertChain::IsValidSignatureChain(), this includes
+    // UNIMPLEMENTED for unsupported algorithms.
+    if (!signed_by_issuer.ok()) {
+      return signed_by_issuer.status();
+    }
+    if (!signed_by_issuer.ValueOrDie()) {
+      return Status(util::error::INVALID_ARGUMENT,
+                    "invalid certificate chain");
+    }
+  }
+
+  return ::util::OkStatus();
+}
+
+
+StatusOr<bool> CertChecker::IsSignedBy(const Cert& subject,
+                                       const Cert& issuer) const {
+  if (FLAGS_cert_checker_verified_signatures <= 0) {
+    return subject.IsSignedBy(issuer);
+  }
+
+  string subject_digest, issuer_digest;
+  if (!subject.Sha256Digest(&subject_digest).ok() ||
+      !issuer.Sha256Digest(&issuer_digest).ok()) {
+    return subject.IsSignedBy(issuer);
+  }
+  const string key(subject_digest + issuer_digest);
+
+  {
+    lock_guard<mutex> lock(verified_lock_);
+    const auto it(verified_.find(key));
+    if (it != verified_.end()) {
+      verified_lru_.splice(verified_lru_.begin(), verified_lru_, it->second);
+      return true;
+    }
+  }
+
+  const StatusOr<bool> signed_by_issuer(subject.IsSignedBy(issuer));
+  if (!signed_by_issuer.ok() || !signed_by_issuer.ValueOrDie()) {
+    return signed_by_issuer;
+  }
+
+  lock_guard<mutex> lock(verified_lock_);
+  if (verified_.find(key) == verified_.end()) {
+    verified_lru_.push_front(key);
+    verified_.emplace(key, verified_lru_.begin());
+    while (verified_lru_.size() >
+           static_cast<size_t>(FLAGS_cert_checker_verified_signatures)) {
+      verified_.erase(verified_lru_.back());
+      verified_lru_.pop_back();
+    }
+  }
+  return true;
+}
+
+
 Status CertChecker::CheckPreCertChain(PreCertChain* chain,
                                       string* issuer_key_hash,
                                       string* tbs_certificate) const {
@@ -250,15 +400,17 @@ Status CertChecker::GetTrustedCa(CertChain* chain) const {
     return Status(util::error::INTERNAL, "chain has no valid certificate");
   }
 
-  // Look up issuer from the trusted store.
-  if (trusted_.empty()) {
+  // Look up issuer from the trusted store, as it is now: it may be
+  // replaced meanwhile.
+  const shared_ptr<const TrustStore> store(GetTrustStore());
+  if (store->by_name_.empty()) {
     LOG(WARNING) << "No trusted certificates loaded";
     return Status(util::error::FAILED_PRECONDITION,
                   "no trusted certificates loaded");
   }
 
   string subject_name;
-  const StatusOr<bool> is_trusted(IsTrusted(*subject, &subject_name));
+  const StatusOr<bool> is_trusted(IsTrusted(*store, *subject, &subject_name));
   // Either an error, or true, meaning the last cert is in our trusted
   // store.  Note the trusted cert need not necessarily be
   // self-signed.
@@ -279,14 +431,31 @@ Status CertChecker::GetTrustedCa(CertChain* chain) const {
                   "untrusted self-signed certificate");
   }
 
-  const auto issuer_range(trusted_.equal_range(issuer_name));
-  const Cert* issuer(nullptr);
-  for (multimap<string, unique_ptr<const Cert>>::const_iterator it =
+  // Try the trusted certificates with the key the subject says it was
+  // signed with first, and then the others with the right name.
+  vector<const Cert*> candidates;
+  const string key_id(AuthorityKeyId(subject->x509_.get()));
+  if (!key_id.empty()) {
+    const auto key_id_range(store->by_key_id_.equal_range(key_id));
+    for (auto it = key_id_range.first; it != key_id_range.second; ++it) {
+      if (it->second->first == issuer_name) {
+        candidates.push_back(it->second->second.get());
+      }
+    }
+  }
+  const auto issuer_range(store->by_name_.equal_range(issuer_name));
+  for (multimap<string, shared_ptr<const Cert>>::const_iterator it =
            issuer_range.first;
        it != issuer_range.second; ++it) {
-    const unique_ptr<const Cert>& issuer_cand(it->second);
+    if (find(candidates.begin(), candidates.end(), it->second.get()) ==
+        candidates.end()) {
+      candidates.push_back(it->second.get());
+    }
+  }
 
-    StatusOr<bool> signed_by_issuer = subject->IsSignedBy(*issuer_cand);
+  const Cert* issuer(nullptr);
+  for (const Cert* issuer_cand : candidates) {
+    StatusOr<bool> signed_by_issuer = IsSignedBy(*subject, *issuer_cand);
     if (signed_by_issuer.status().CanonicalCode() == Code::UNIMPLEMENTED) {
       // If the cert's algorithm is unsupported, then there's no point
       // continuing: it's unconditionally invalid.
@@ -299,7 +468,7 @@ Status CertChecker::GetTrustedCa(CertChain* chain) const {
                     "failed to check signature for trusted root");
     }
     if (signed_by_issuer.ValueOrDie()) {
-      issuer = issuer_cand.get();
+      issuer = issuer_cand;
       break;
     }
   }
@@ -320,8 +489,10 @@ Status CertChecker::GetTrustedCa(CertChain* chain) const {
   return ::util::OkStatus();
 }
 
-StatusOr<bool> CertChecker::IsTrusted(const Cert& cert,
-                                      string* subject_name) const {
+// static
+StatusOr<bool> CertChecker::IsTrusted(const TrustStore& store,
+                                      const Cert& cert,
+                                      string* subject_name) {
   string cert_name;
   util::Status status = cert.DerEncodedSubjectName(&cert_name);
   if (status != ::util::OkStatus()) {
@@ -331,8 +502,8 @@ StatusOr<bool> CertChecker::IsTrusted(const Cert& cert,
 
   *subject_name = cert_name;
 
-  const auto cand_range(trusted_.equal_range(cert_name));
-  for (multimap<string, unique_ptr<const Cert>>::const_iterator it(
+  const auto cand_range(store.by_name_.equal_range(cert_name));
+  for (multimap<string, shared_ptr<const Cert>>::const_iterator it(
            cand_range.first);
        it != cand_range.second; ++it) {
     if (cert.IsIdenticalTo(*it->second)) {
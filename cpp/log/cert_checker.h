@@ -5,9 +5,12 @@
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
 
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "log/cert.h"
@@ -28,9 +31,47 @@ class PreCertChain;
 // want to check that submissions chain to a whitelisted CA, so that
 // (1) we know where a cert is coming from; and
 // (2) we get some spam protection.
+//
+// The signatures found to be valid are remembered (up to
+// --cert_checker_verified_signatures of them), since nearly all chains
+// share the same few intermediates, and clients often submit the same
+// chain again.
+//
+// The trusted certificates can be loaded or replaced while chains are
+// being checked: each load builds a new TrustStore, and swaps it in
+// for the one that checks in progress are still using.
 class CertChecker {
  public:
-  CertChecker() = default;
+  // The trusted certificates at some point in time. It never changes
+  // once built, so that it can be used without holding a lock, for as
+  // long as a reference to it is kept.
+  class TrustStore {
+   public:
+    TrustStore() = default;
+    TrustStore(const TrustStore&) = delete;
+    TrustStore& operator=(const TrustStore&) = delete;
+
+    // By the DER encoding of their subject name.
+    const std::multimap<std::string, std::shared_ptr<const Cert>>& certs()
+        const {
+      return by_name_;
+    }
+
+   private:
+    friend class CertChecker;
+
+    std::multimap<std::string, std::shared_ptr<const Cert>> by_name_;
+    // The entries of |by_name_| which have a subject key identifier,
+    // by it. Nearly all certificates say which key they were signed
+    // with, so this finds the right one among the trusted certificates
+    // with the same name without having to verify the signature of
+    // each.
+    std::multimap<std::string,
+                  std::multimap<std::string, std::shared_ptr<const Cert>>::
+                      const_iterator> by_key_id_;
+  };
+
+  CertChecker();
   virtual ~CertChecker() = default;
   CertChecker(const CertChecker&) = delete;
   CertChecker& operator=(const CertChecker&) = delete;
@@ -47,13 +88,17 @@ class CertChecker {
   virtual bool LoadTrustedCertificates(
       const std::vector<std::string>& trusted_certs);
 
-  virtual const std::multimap<std::string, std::unique_ptr<const Cert>>&
-  GetTrustedCertificates() const {
-    return trusted_;
-  }
+  // Like LoadTrustedCertificates(), but the certificates in
+  // |trusted_cert_file| replace all those loaded so far, rather than
+  // being added to them. If it returns false, those are kept.
+  virtual bool ReloadTrustedCertificates(
+      const std::string& trusted_cert_file);
+
+  // The trusted certificates as they are now.
+  virtual std::shared_ptr<const TrustStore> GetTrustStore() const;
 
   virtual size_t NumTrustedCertificates() const {
-    return trusted_.size();
+    return GetTrustStore()->certs().size();
   }
 
   // Check that:
@@ -84,23 +129,49 @@ class CertChecker {
  private:
   util::Status CheckIssuerChain(CertChain* chain) const;
 
+  // Checks that each certificate of |chain| is signed by the next one,
+  // like CertChain::IsValidSignatureChain().
+  util::Status CheckSignatureChain(const CertChain& chain) const;
+
+  // Like |subject.IsSignedBy(issuer)|, but without verifying the
+  // signature again if it was found to be valid before.
+  util::StatusOr<bool> IsSignedBy(const Cert& subject,
+                                  const Cert& issuer) const;
+
   // Look issuer up from the trusted store, and verify signature.
   util::Status GetTrustedCa(CertChain* chain) const;
 
-  // Returns true if the cert is trusted, false if it's not,
+  // Returns true if the cert is in |store|, false if it's not,
   // INVALID_ARGUMENT if something is wrong with the cert, and
   // INTERNAL if something terrible happened.
-  util::StatusOr<bool> IsTrusted(const Cert& cert,
-                                 std::string* subject_name) const;
-
-  // A map by the DER encoding of the subject name.
-  // All code manipulating this container must ensure contained elements are
-  // deallocated appropriately.
-  std::multimap<std::string, std::unique_ptr<const Cert>> trusted_;
-
-  // Helper for LoadTrustedCertificates, whether reading from file or memory.
-  // Takes ownership of bio_in and frees it.
-  bool LoadTrustedCertificatesFromBIO(BIO* bio_in);
+  static util::StatusOr<bool> IsTrusted(const TrustStore& store,
+                                        const Cert& cert,
+                                        std::string* subject_name);
+
+  // Adds |cert|, whose subject name is |subject_name|, to |store|.
+  static void AddTrusted(const std::string& subject_name,
+                         const std::shared_ptr<const Cert>& cert,
+                         TrustStore* store);
+
+  // Helper for LoadTrustedCertificates() and
+  // ReloadTrustedCertificates(), whether reading from file or memory:
+  // adds the certificates read from |bio_in| to the current ones (or
+  // to none, if |replace|), and swaps the result in.
+  bool LoadTrustedCertificatesFromBIO(BIO* bio_in, bool replace);
+
+  // Held while loading, so that loads are not lost to each other.
+  std::mutex load_lock_;
+  // Replaced with std::atomic_store() with |load_lock_| held, and read
+  // with std::atomic_load(), so that checking chains takes no lock.
+  std::shared_ptr<const TrustStore> store_;
+
+  mutable std::mutex verified_lock_;
+  // The SHA-256 digests of the subject and issuer of the valid
+  // signatures, most recently used first.
+  mutable std::list<std::string> verified_lru_;
+  // Their positions in |verified_lru_|.
+  mutable std::unordered_map<std::string, std::list<std::string>::iterator>
+      verified_;
 };
 
 }  // namespace cert_trans
@@ -4,8 +4,10 @@
 #include <gtest/gtest.h>
 #include <openssl/err.h>
 #include <openssl/evp.h>
+#include <atomic>
 #include <memory>
 #include <string>
+#include <thread>
 
 #include "log/cert.h"
 #include "log/cert_checker.h"
@@ -18,12 +20,17 @@ using cert_trans::Cert;
 using cert_trans::CertChain;
 using cert_trans::CertChecker;
 using cert_trans::PreCertChain;
+using std::atomic;
 using std::move;
+using std::shared_ptr;
 using std::string;
+using std::thread;
 using std::unique_ptr;
 using std::vector;
 using util::testing::StatusIs;
 
+DECLARE_int32(cert_checker_verified_signatures);
+
 // Valid certificates.
 // Self-signed
 static const char kCaCert[] = "ca-cert.pem";
@@ -384,6 +391,65 @@ TEST_F(CertCheckerTest, LoadTrustedCertificatesCorruptedFile) {
   EXPECT_EQ(0U, checker_.NumTrustedCertificates());
 }
 
+TEST_F(CertCheckerTest, ReloadTrustedCertificatesReplacesThem) {
+  EXPECT_TRUE(checker_.LoadTrustedCertificates(cert_dir_ + "/" + kCaCert));
+  EXPECT_TRUE(
+      checker_.LoadTrustedCertificates(cert_dir_ + "/" + kIntermediateCert));
+  const shared_ptr<const CertChecker::TrustStore> old_store(
+      checker_.GetTrustStore());
+  EXPECT_EQ(2U, old_store->certs().size());
+
+  EXPECT_TRUE(
+      checker_.ReloadTrustedCertificates(cert_dir_ + "/" + kIntermediateCert));
+  EXPECT_EQ(1U, checker_.NumTrustedCertificates());
+  // Whoever was still using the old ones can keep doing so.
+  EXPECT_EQ(2U, old_store->certs().size());
+
+  CertChain chain(leaf_pem_);
+  ASSERT_TRUE(chain.IsLoaded());
+  EXPECT_THAT(checker_.CheckCertChain(&chain),
+              StatusIs(util::error::FAILED_PRECONDITION));
+
+  EXPECT_TRUE(checker_.ReloadTrustedCertificates(cert_dir_ + "/" + kCaCert));
+  EXPECT_EQ(1U, checker_.NumTrustedCertificates());
+  EXPECT_OK(checker_.CheckCertChain(&chain));
+}
+
+TEST_F(CertCheckerTest, ReloadTrustedCertificatesKeepsThemOnError) {
+  EXPECT_TRUE(checker_.LoadTrustedCertificates(cert_dir_ + "/" + kCaCert));
+  const shared_ptr<const CertChecker::TrustStore> store(
+      checker_.GetTrustStore());
+
+  EXPECT_FALSE(
+      checker_.ReloadTrustedCertificates(cert_dir_ + "/" + kCorrupted));
+  EXPECT_FALSE(
+      checker_.ReloadTrustedCertificates(cert_dir_ + "/" + kNonexistent));
+  EXPECT_EQ(store, checker_.GetTrustStore());
+
+  CertChain chain(leaf_pem_);
+  ASSERT_TRUE(chain.IsLoaded());
+  EXPECT_OK(checker_.CheckCertChain(&chain));
+}
+
+TEST_F(CertCheckerTest, ChecksChainsWhileReloading) {
+  EXPECT_TRUE(checker_.LoadTrustedCertificates(cert_dir_ + "/" + kCaCert));
+
+  atomic<bool> done(false);
+  thread reloader([this, &done]() {
+    while (!done) {
+      EXPECT_TRUE(
+          checker_.ReloadTrustedCertificates(cert_dir_ + "/" + kCaCert));
+    }
+  });
+  for (int i = 0; i < 200; ++i) {
+    CertChain chain(leaf_pem_);
+    ASSERT_TRUE(chain.IsLoaded());
+    EXPECT_OK(checker_.CheckCertChain(&chain));
+  }
+  done = true;
+  reloader.join();
+}
+
 TEST_F(CertCheckerTest, Certificate) {
   CertChain chain(leaf_pem_);
   ASSERT_TRUE(chain.IsLoaded());
@@ -447,6 +513,30 @@ TEST_F(CertCheckerTest, Intermediates) {
               StatusIs(util::error::INVALID_ARGUMENT));
 }
 
+TEST_F(CertCheckerTest, RemembersValidSignatures) {
+  FLAGS_cert_checker_verified_signatures = 1;
+  EXPECT_TRUE(checker_.LoadTrustedCertificates(cert_dir_ + "/" + kCaCert));
+
+  // Each time, more links than are remembered.
+  for (int i = 0; i < 2; ++i) {
+    CertChain chain(chain_leaf_pem_ + intermediate_pem_);
+    ASSERT_TRUE(chain.IsLoaded());
+    EXPECT_OK(checker_.CheckCertChain(&chain));
+    EXPECT_EQ(3U, chain.Length());
+
+    CertChain leaf(leaf_pem_);
+    ASSERT_TRUE(leaf.IsLoaded());
+    EXPECT_OK(checker_.CheckCertChain(&leaf));
+  }
+
+  // A valid link is not mistaken for its reverse.
+  CertChain invalid(intermediate_pem_ + chain_leaf_pem_);
+  ASSERT_TRUE(invalid.IsLoaded());
+  EXPECT_THAT(checker_.CheckCertChain(&invalid),
+              StatusIs(util::error::INVALID_ARGUMENT));
+  FLAGS_cert_checker_verified_signatures = 10000;
+}
+
 TEST_F(CertCheckerTest, PreCert) {
   const string chain_pem = precert_pem_ + ca_pem_;
   PreCertChain chain(chain_pem);
@@ -124,20 +124,19 @@ Status CertSubmissionHandler::ProcessX509Submission(CertChain* chain,
   if (!status.ok())
     return status;
 
-  // We have a valid chain; make the entry.
-  string der_cert;
+  // We have a valid chain; make the entry. The certificates are
+  // encoded straight into it.
+  X509ChainEntry* x509_entry = entry->mutable_x509_entry();
   // Nothing should fail anymore as we have validated the chain.
-  if (chain->LeafCert()->DerEncoding(&der_cert) != ::util::OkStatus()) {
+  if (chain->LeafCert()->DerEncoding(x509_entry->mutable_leaf_certificate()) !=
+      ::util::OkStatus()) {
     return Status(util::error::INTERNAL, "could not DER-encode the chain");
   }
-
-  X509ChainEntry* x509_entry = entry->mutable_x509_entry();
-  x509_entry->set_leaf_certificate(der_cert);
   for (size_t i = 1; i < chain->Length(); ++i) {
-    if (chain->CertAt(i)->DerEncoding(&der_cert) != ::util::OkStatus()) {
+    if (chain->CertAt(i)->DerEncoding(x509_entry->add_certificate_chain()) !=
+        ::util::OkStatus()) {
       return Status(util::error::INTERNAL, "could not DER-encode the chain");
     }
-    x509_entry->add_certificate_chain(der_cert);
   }
   return ::util::OkStatus();
 }
@@ -154,17 +153,16 @@ Status CertSubmissionHandler::ProcessPreCertSubmission(PreCertChain* chain,
   if (!status.ok())
     return status;
 
-  // We have a valid chain; make the entry.
-  string der_cert;
+  // We have a valid chain; make the entry, as above.
   // Nothing should fail anymore as we have validated the chain.
-  if (chain->LeafCert()->DerEncoding(&der_cert) != ::util::OkStatus()) {
+  if (chain->LeafCert()->DerEncoding(
+          precert_entry->mutable_pre_certificate()) != ::util::OkStatus()) {
     return Status(util::error::INTERNAL, "could not DER-encode the chain");
   }
-  precert_entry->set_pre_certificate(der_cert);
   for (size_t i = 1; i < chain->Length(); ++i) {
-    if (chain->CertAt(i)->DerEncoding(&der_cert) != ::util::OkStatus())
+    if (chain->CertAt(i)->DerEncoding(
+            precert_entry->add_precertificate_chain()) != ::util::OkStatus())
       return Status(util::error::INTERNAL, "could not DER-encode the chain");
-    precert_entry->add_precertificate_chain(der_cert);
   }
   return ::util::OkStatus();
 }
@@ -362,6 +362,27 @@ TEST_F(CertTest, LoadValidFromDer) {
   EXPECT_TRUE(second.get());
 }
 
+TEST_F(CertTest, EncodingsAreComputedOnce) {
+  string der, again;
+  ASSERT_OK(leaf_cert_->DerEncoding(&der));
+  ASSERT_OK(leaf_cert_->DerEncoding(&again));
+  EXPECT_EQ(der, again);
+
+  // The cached encodings are the same as those of a fresh copy.
+  const unique_ptr<Cert> copy(Cert::FromDerString(der));
+  ASSERT_TRUE(copy.get());
+  string digest, copy_digest;
+  ASSERT_OK(leaf_cert_->Sha256Digest(&digest));
+  ASSERT_OK(leaf_cert_->Sha256Digest(&digest));
+  ASSERT_OK(copy->Sha256Digest(&copy_digest));
+  EXPECT_EQ(copy_digest, digest);
+  string tbs, copy_tbs;
+  ASSERT_OK(leaf_cert_->DerEncodedTbsCertificate(&tbs));
+  ASSERT_OK(leaf_cert_->DerEncodedTbsCertificate(&tbs));
+  ASSERT_OK(copy->DerEncodedTbsCertificate(&copy_tbs));
+  EXPECT_EQ(copy_tbs, tbs);
+}
+
 TEST_F(CertTest, LoadInvalidFromDer) {
   // Make it look almost good for extra fun.
   string der;
@@ -509,6 +530,12 @@ TEST_F(CertTest, TestSubjectAltNames) {
   EXPECT_EQ("youtubeeducation.com", sans[43]);
 }
 
+TEST_F(CertTest, TestSubjectCommonName) {
+  string common_name;
+  EXPECT_OK(google_cert_->SubjectCommonName(&common_name));
+  EXPECT_EQ("*.google.com", common_name);
+}
+
 TEST_F(CertTest, SPKI) {
   const StatusOr<string> spki(leaf_cert_->SPKI());
   EXPECT_OK(spki.status());
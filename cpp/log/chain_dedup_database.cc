@@ -0,0 +1,379 @@
+#include "log/chain_dedup_database.h"
+
+#include <glog/logging.h>
+
+#include "merkletree/serial_hasher.h"
+#include "monitoring/monitoring.h"
+
+using ct::LoggedEntryPB;
+using google::protobuf::RepeatedPtrField;
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+static Counter<string>* chain_certificates_written(
+    Counter<string>::New("chaindedup_certificates_written", "storage",
+                         "Number of chain certificates written, by whether "
+                         "they were stored in full or as a reference."));
+
+
+const RepeatedPtrField<string>* Chain(const LoggedEntry& entry) {
+  if (entry.entry().has_x509_entry()) {
+    return &entry.entry().x509_entry().certificate_chain();
+  }
+  if (entry.entry().has_precert_entry()) {
+    return &entry.entry().precert_entry().precertificate_chain();
+  }
+  return nullptr;
+}
+
+
+RepeatedPtrField<string>* MutableChain(LoggedEntry* entry) {
+  if (entry->entry().has_x509_entry()) {
+    return entry->mutable_entry()
+        ->mutable_x509_entry()
+        ->mutable_certificate_chain();
+  }
+  if (entry->entry().has_precert_entry()) {
+    return entry->mutable_entry()
+        ->mutable_precert_entry()
+        ->mutable_precertificate_chain();
+  }
+  return nullptr;
+}
+
+
+}  // namespace
+
+
+class ChainDedupDatabase::Iterator : public Database::Iterator {
+ public:
+  Iterator(const ChainDedupDatabase* db, unique_ptr<Database::Iterator> it)
+      : db_(CHECK_NOTNULL(db)), it_(std::move(it)) {
+    CHECK(it_);
+  }
+
+  bool GetNextEntry(LoggedEntry* entry) override {
+    if (!it_->GetNextEntry(entry)) {
+      return false;
+    }
+    db_->Decode(entry);
+    return true;
+  }
+
+ private:
+  const ChainDedupDatabase* const db_;
+  const unique_ptr<Database::Iterator> it_;
+};
+
+
+ChainDedupDatabase::ChainDedupDatabase(Database* db, size_t max_certificates)
+    : db_(CHECK_NOTNULL(db)), max_certificates_(max_certificates) {
+}
+
+
+Database::WriteResult ChainDedupDatabase::CreateSequencedEntry_(
+    const LoggedEntry& logged) {
+  LoggedEntry encoded;
+  vector<string> hashes;
+  Encode(logged, &encoded, &hashes);
+
+  const WriteResult result(db_->CreateSequencedEntry(encoded));
+  if (result == OK) {
+    AddCertificates(encoded, hashes);
+  } else if (result == SEQUENCE_NUMBER_ALREADY_IN_USE &&
+             SameAsStored(logged)) {
+    // It was stored before with other certificates left out (before a
+    // restart, say).
+    return OK;
+  }
+  return result;
+}
+
+
+Database::WriteResult ChainDedupDatabase::CreateSequencedEntries_(
+    const vector<const LoggedEntry*>& entries) {
+  // Certificates are only referenced across batches, so that no entry
+  // refers to one that might not get written.
+  vector<LoggedEntry> encoded(entries.size());
+  vector<vector<string>> hashes(entries.size());
+  vector<const LoggedEntry*> to_write;
+  to_write.reserve(entries.size());
+  for (size_t i = 0; i < entries.size(); ++i) {
+    Encode(*entries[i], &encoded[i], &hashes[i]);
+    to_write.push_back(&encoded[i]);
+  }
+
+  if (db_->CreateSequencedEntries(to_write) != OK) {
+    // Some entries may be stored already, with other certificates left
+    // out, which the database cannot tell are the same: go through
+    // them one at a time.
+    return Database::CreateSequencedEntries_(entries);
+  }
+  for (size_t i = 0; i < entries.size(); ++i) {
+    AddCertificates(encoded[i], hashes[i]);
+  }
+  return OK;
+}
+
+
+Database::LookupResult ChainDedupDatabase::LookupByHash(
+    const string& hash, LoggedEntry* result) const {
+  LoggedEntry entry;
+  const LookupResult lookup(db_->LookupByHash(hash, &entry));
+  if (lookup == LOOKUP_OK && result) {
+    Decode(&entry);
+    result->CopyFrom(entry);
+  }
+  return lookup;
+}
+
+
+Database::LookupResult ChainDedupDatabase::LookupByIndex(
+    int64_t sequence_number, LoggedEntry* result) const {
+  LoggedEntry entry;
+  const LookupResult lookup(db_->LookupByIndex(sequence_number, &entry));
+  if (lookup == LOOKUP_OK && result) {
+    Decode(&entry);
+    result->CopyFrom(entry);
+  }
+  return lookup;
+}
+
+
+unique_ptr<Database::Iterator> ChainDedupDatabase::ScanEntries(
+    int64_t start_index) const {
+  return unique_ptr<Iterator>(
+      new Iterator(this, db_->ScanEntries(start_index)));
+}
+
+
+void ChainDedupDatabase::ReadEntries(int64_t start_index, int64_t end_index,
+                                     size_t max_bytes, ReadPattern pattern,
+                                     vector<LoggedEntry>* entries) const {
+  CHECK_NOTNULL(entries);
+  const size_t first(entries->size());
+  // |max_bytes| then counts the entries as stored, which is what it is
+  // meant to bound.
+  db_->ReadEntries(start_index, end_index, max_bytes, pattern, entries);
+  for (size_t i = first; i < entries->size(); ++i) {
+    Decode(&(*entries)[i]);
+  }
+}
+
+
+unique_ptr<Database::LeafHashIterator> ChainDedupDatabase::ScanLeafHashes(
+    int64_t start_index) const {
+  // The chains are not part of the Merkle tree leaves.
+  return db_->ScanLeafHashes(start_index);
+}
+
+
+Database::WriteResult ChainDedupDatabase::WriteTreeHead_(
+    const ct::SignedTreeHead& sth) {
+  return db_->WriteTreeHead(sth);
+}
+
+
+Database::LookupResult ChainDedupDatabase::LatestTreeHead(
+    ct::SignedTreeHead* result) const {
+  return db_->LatestTreeHead(result);
+}
+
+
+Database::WriteResult ChainDedupDatabase::WriteTreeCheckpoint_(
+    const ct::CompactTreeCheckpoint& checkpoint) {
+  return db_->WriteTreeCheckpoint(checkpoint);
+}
+
+
+Database::LookupResult ChainDedupDatabase::LatestTreeCheckpoint(
+    ct::CompactTreeCheckpoint* result) const {
+  return db_->LatestTreeCheckpoint(result);
+}
+
+
+int64_t ChainDedupDatabase::TreeSize() const {
+  return db_->TreeSize();
+}
+
+
+int64_t ChainDedupDatabase::FirstSequenceNumberSince(uint64_t timestamp) const {
+  return db_->FirstSequenceNumberSince(timestamp);
+}
+
+
+void ChainDedupDatabase::AddNotifySTHCallback(
+    const NotifySTHCallback* callback) {
+  db_->AddNotifySTHCallback(callback);
+}
+
+
+void ChainDedupDatabase::RemoveNotifySTHCallback(
+    const NotifySTHCallback* callback) {
+  db_->RemoveNotifySTHCallback(callback);
+}
+
+
+void ChainDedupDatabase::InitializeNode(const string& node_id) {
+  db_->InitializeNode(node_id);
+}
+
+
+Database::LookupResult ChainDedupDatabase::NodeId(string* node_id) {
+  return db_->NodeId(node_id);
+}
+
+
+void ChainDedupDatabase::Encode(const LoggedEntry& logged,
+                                LoggedEntry* encoded,
+                                vector<string>* hashes) const {
+  CHECK_EQ(0, logged.chain_reference_size());
+  encoded->CopyFrom(logged);
+  hashes->clear();
+  RepeatedPtrField<string>* const chain(MutableChain(encoded));
+  // The chain is not part of the leaf, so the cached hashes still hold.
+  if (logged.has_entry_hash()) {
+    encoded->set_entry_hash(logged.entry_hash());
+  }
+  if (logged.has_merkle_leaf_hash()) {
+    encoded->set_merkle_leaf_hash(logged.merkle_leaf_hash());
+  }
+  if (!chain) {
+    return;
+  }
+  for (const string& certificate : *chain) {
+    hashes->emplace_back(Sha256Hasher::Sha256Digest(certificate));
+  }
+
+  lock_guard<mutex> lock(lock_);
+  for (int i = 0; i < chain->size(); ++i) {
+    const Certificate* const certificate(FindCertificate((*hashes)[i]));
+    // An entry written again must come out the same as the first time.
+    if (!certificate ||
+        certificate->sequence_number == logged.sequence_number()) {
+      continue;
+    }
+    LoggedEntryPB::ChainReference* const ref(encoded->add_chain_reference());
+    ref->set_index(i);
+    ref->set_sha256_hash((*hashes)[i]);
+    ref->set_sequence_number(certificate->sequence_number);
+    chain->Mutable(i)->clear();
+  }
+}
+
+
+void ChainDedupDatabase::Decode(LoggedEntry* entry) const {
+  if (entry->chain_reference_size() == 0) {
+    return;
+  }
+
+  RepeatedPtrField<string>* const chain(CHECK_NOTNULL(MutableChain(entry)));
+  for (const LoggedEntryPB::ChainReference& ref : entry->chain_reference()) {
+    CHECK_GE(ref.index(), 0);
+    CHECK_LT(ref.index(), chain->size())
+        << "bad chain reference in entry " << entry->sequence_number();
+    CHECK(chain->Get(ref.index()).empty())
+        << "bad chain reference in entry " << entry->sequence_number();
+    *chain->Mutable(ref.index()) = GetCertificate(ref);
+  }
+  entry->clear_chain_reference();
+}
+
+
+void ChainDedupDatabase::AddCertificates(
+    const LoggedEntry& encoded, const vector<string>& hashes) const {
+  const RepeatedPtrField<string>* const chain(Chain(encoded));
+  if (!chain) {
+    return;
+  }
+  CHECK_EQ(static_cast<size_t>(chain->size()), hashes.size());
+  const int references(encoded.chain_reference_size());
+  chain_certificates_written->IncrementBy("full", chain->size() - references);
+  chain_certificates_written->IncrementBy("reference", references);
+
+  for (int i = 0; i < chain->size(); ++i) {
+    if (!chain->Get(i).empty()) {
+      AddCertificate(hashes[i], encoded.sequence_number(), chain->Get(i));
+    }
+  }
+}
+
+
+string ChainDedupDatabase::GetCertificate(
+    const LoggedEntryPB::ChainReference& ref) const {
+  {
+    lock_guard<mutex> lock(lock_);
+    const Certificate* const certificate(FindCertificate(ref.sha256_hash()));
+    if (certificate) {
+      return certificate->data;
+    }
+  }
+
+  LoggedEntry holder;
+  CHECK_EQ(LOOKUP_OK, db_->LookupByIndex(ref.sequence_number(), &holder))
+      << "missing entry " << ref.sequence_number()
+      << " referenced for a chain certificate";
+  const RepeatedPtrField<string>* const chain(Chain(holder));
+  if (chain) {
+    for (const string& certificate : *chain) {
+      if (!certificate.empty() &&
+          Sha256Hasher::Sha256Digest(certificate) == ref.sha256_hash()) {
+        AddCertificate(ref.sha256_hash(), ref.sequence_number(), certificate);
+        return certificate;
+      }
+    }
+  }
+  LOG(FATAL) << "entry " << ref.sequence_number()
+             << " does not have the chain certificate referenced";
+}
+
+
+const ChainDedupDatabase::Certificate* ChainDedupDatabase::FindCertificate(
+    const string& hash) const {
+  const auto it(certificates_.find(hash));
+  if (it == certificates_.end()) {
+    return nullptr;
+  }
+  lru_.splice(lru_.begin(), lru_, it->second.lru);
+  return &it->second;
+}
+
+
+void ChainDedupDatabase::AddCertificate(const string& hash,
+                                        int64_t sequence_number,
+                                        const string& data) const {
+  if (max_certificates_ == 0) {
+    return;
+  }
+
+  lock_guard<mutex> lock(lock_);
+  // Keep referring to the entry that had it first, if it is known
+  // already (written twice in one batch, say).
+  if (FindCertificate(hash)) {
+    return;
+  }
+  if (certificates_.size() >= max_certificates_) {
+    certificates_.erase(lru_.back());
+    lru_.pop_back();
+  }
+  lru_.push_front(hash);
+  certificates_.emplace(hash,
+                        Certificate{sequence_number, data, lru_.begin()});
+}
+
+
+bool ChainDedupDatabase::SameAsStored(const LoggedEntry& logged) const {
+  LoggedEntry stored;
+  return LookupByIndex(logged.sequence_number(), &stored) == LOOKUP_OK &&
+         stored == logged;
+}
+
+
+}  // namespace cert_trans
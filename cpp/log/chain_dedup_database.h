@@ -0,0 +1,146 @@
+#ifndef CERT_TRANS_LOG_CHAIN_DEDUP_DATABASE_H_
+#define CERT_TRANS_LOG_CHAIN_DEDUP_DATABASE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "log/database.h"
+#include "log/logged_entry.h"
+#include "proto/ct.pb.h"
+
+namespace cert_trans {
+
+
+// A Database that stores the entries in another one, without the
+// certificates of their chains that are already in an earlier entry.
+// Those are replaced with a reference to that entry (see
+// LoggedEntryPB.chain_reference), and put back when the entries are
+// read. Nearly all chains are made of the same few intermediates, so
+// this leaves most entries with little more than their leaf
+// certificate.
+//
+// The |max_certificates| chain certificates most recently written or
+// read are remembered, along with the entry that has them, so that the
+// intermediates in use are served from memory. A certificate that was
+// forgotten is stored in full again the next time it comes, and
+// referenced from that entry on. This starts out empty every time,
+// which spares reading all the entries on startup; the certificates
+// referenced are read (and then kept) as needed.
+//
+// Entries stored with references can only be read back through this
+// class, so a database written with it must always be opened with it.
+// Entries stored without are read back as they are.
+//
+// This class is thread-safe.
+class ChainDedupDatabase : public Database {
+ public:
+  // Takes ownership of |db|.
+  ChainDedupDatabase(Database* db, size_t max_certificates);
+  ChainDedupDatabase(const ChainDedupDatabase&) = delete;
+  ChainDedupDatabase& operator=(const ChainDedupDatabase&) = delete;
+
+  // Implement abstract functions, see database.h for comments.
+  Database::WriteResult CreateSequencedEntry_(
+      const LoggedEntry& logged) override;
+
+  Database::WriteResult CreateSequencedEntries_(
+      const std::vector<const LoggedEntry*>& entries) override;
+
+  Database::LookupResult LookupByHash(const std::string& hash,
+                                      LoggedEntry* result) const override;
+
+  Database::LookupResult LookupByIndex(int64_t sequence_number,
+                                       LoggedEntry* result) const override;
+
+  std::unique_ptr<Database::Iterator> ScanEntries(
+      int64_t start_index) const override;
+
+  void ReadEntries(int64_t start_index, int64_t end_index, size_t max_bytes,
+                   ReadPattern pattern,
+                   std::vector<LoggedEntry>* entries) const override;
+
+  std::unique_ptr<Database::LeafHashIterator> ScanLeafHashes(
+      int64_t start_index) const override;
+
+  Database::WriteResult WriteTreeHead_(const ct::SignedTreeHead& sth) override;
+
+  Database::LookupResult LatestTreeHead(
+      ct::SignedTreeHead* result) const override;
+
+  Database::WriteResult WriteTreeCheckpoint_(
+      const ct::CompactTreeCheckpoint& checkpoint) override;
+
+  Database::LookupResult LatestTreeCheckpoint(
+      ct::CompactTreeCheckpoint* result) const override;
+
+  int64_t TreeSize() const override;
+
+  int64_t FirstSequenceNumberSince(uint64_t timestamp) const override;
+
+  void AddNotifySTHCallback(
+      const Database::NotifySTHCallback* callback) override;
+
+  void RemoveNotifySTHCallback(
+      const Database::NotifySTHCallback* callback) override;
+
+  void InitializeNode(const std::string& node_id) override;
+
+  Database::LookupResult NodeId(std::string* node_id) override;
+
+ private:
+  class Iterator;
+
+  struct Certificate {
+    // The entry that has it in full.
+    int64_t sequence_number;
+    std::string data;
+    // Its position in |lru_|.
+    std::list<std::string>::iterator lru;
+  };
+
+  // Sets |*encoded| to |logged| with references in place of the chain
+  // certificates known to be in other entries, and |*hashes| to the
+  // hashes of the certificates of the chain.
+  void Encode(const LoggedEntry& logged, LoggedEntry* encoded,
+              std::vector<std::string>* hashes) const;
+  // Puts the certificates referenced by |*entry| back into it.
+  void Decode(LoggedEntry* entry) const;
+  // Remembers the certificates |encoded|, which was written, has in
+  // full. |hashes| are as set by Encode().
+  void AddCertificates(const LoggedEntry& encoded,
+                       const std::vector<std::string>& hashes) const;
+  // Returns the certificate |ref| refers to, reading it from the entry
+  // that has it if needed.
+  std::string GetCertificate(
+      const ct::LoggedEntryPB::ChainReference& ref) const;
+  // Returns the certificate with SHA-256 hash |hash|, if known, and
+  // marks it as used. This must be called with "lock_" held.
+  const Certificate* FindCertificate(const std::string& hash) const;
+  // Remembers that the entry |sequence_number| has the certificate
+  // |data| in full, forgetting the least recently used one if needed.
+  void AddCertificate(const std::string& hash, int64_t sequence_number,
+                      const std::string& data) const;
+  // Whether the entry already at the sequence number of |logged| is
+  // the same, once decoded.
+  bool SameAsStored(const LoggedEntry& logged) const;
+
+  const std::unique_ptr<Database> db_;
+  const size_t max_certificates_;
+
+  mutable std::mutex lock_;
+  // By SHA-256 hash.
+  mutable std::unordered_map<std::string, Certificate> certificates_;
+  // The hashes of |certificates_|, most recently used first.
+  mutable std::list<std::string> lru_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_CHAIN_DEDUP_DATABASE_H_
@@ -0,0 +1,228 @@
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "log/chain_dedup_database.h"
+#include "log/logged_entry.h"
+#include "log/sqlite_db.h"
+#include "log/test_signer.h"
+#include "proto/cert_serializer.h"
+#include "util/test_db.h"
+#include "util/testing.h"
+
+DECLARE_bool(sqlite_batch_into_transactions);
+
+namespace {
+
+using cert_trans::ChainDedupDatabase;
+using cert_trans::Database;
+using cert_trans::LoggedEntry;
+using cert_trans::SQLiteDB;
+using google::protobuf::RepeatedPtrField;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+const size_t kMaxCertificates = 16;
+
+
+class ChainDedupDatabaseTest : public ::testing::Test {
+ protected:
+  ChainDedupDatabaseTest()
+      : intermediate_(test_signer_.UniqueFakeCertBytestring()),
+        root_(test_signer_.UniqueFakeCertBytestring()) {
+    OpenDB();
+  }
+
+  void OpenDB() {
+    db_.reset();
+    backend_ = new SQLiteDB(tmp_.TmpStorageDir() + "/sqlite");
+    db_.reset(new ChainDedupDatabase(backend_, kMaxCertificates));
+  }
+
+  static RepeatedPtrField<string>* MutableChain(LoggedEntry* entry) {
+    if (entry->entry().has_x509_entry()) {
+      return entry->mutable_entry()
+          ->mutable_x509_entry()
+          ->mutable_certificate_chain();
+    }
+    return entry->mutable_entry()
+        ->mutable_precert_entry()
+        ->mutable_precertificate_chain();
+  }
+
+  // Returns a new entry, with a chain made of a certificate of its own
+  // and the ones all entries share.
+  LoggedEntry NewEntry(int64_t sequence_number) {
+    LoggedEntry entry;
+    test_signer_.CreateUnique(&entry);
+    entry.set_sequence_number(sequence_number);
+    RepeatedPtrField<string>* const chain(MutableChain(&entry));
+    chain->Clear();
+    *chain->Add() = test_signer_.UniqueFakeCertBytestring();
+    *chain->Add() = intermediate_;
+    *chain->Add() = root_;
+    return entry;
+  }
+
+  // Returns the entry |sequence_number| as stored in |backend_|.
+  LoggedEntry Stored(int64_t sequence_number) {
+    LoggedEntry entry;
+    EXPECT_EQ(Database::LOOKUP_OK,
+              backend_->LookupByIndex(sequence_number, &entry));
+    return entry;
+  }
+
+  void ExpectEntries() {
+    for (const LoggedEntry& entry : entries_) {
+      LoggedEntry lookup;
+      ASSERT_EQ(Database::LOOKUP_OK,
+                db_->LookupByIndex(entry.sequence_number(), &lookup));
+      TestSigner::TestEqualLoggedCerts(entry, lookup);
+      EXPECT_EQ(0, lookup.chain_reference_size());
+      ASSERT_EQ(Database::LOOKUP_OK, db_->LookupByHash(entry.Hash(), &lookup));
+      TestSigner::TestEqualLoggedCerts(entry, lookup);
+    }
+
+    vector<LoggedEntry> read;
+    db_->ReadEntries(0, entries_.size(), 1 << 20, Database::POINT_READ,
+                     &read);
+    ASSERT_EQ(entries_.size(), read.size());
+    for (size_t i = 0; i < read.size(); ++i) {
+      TestSigner::TestEqualLoggedCerts(entries_[i], read[i]);
+    }
+
+    size_t count(0);
+    LoggedEntry entry;
+    const unique_ptr<Database::Iterator> it(db_->ScanEntries(0));
+    while (it->GetNextEntry(&entry)) {
+      ASSERT_LT(count, entries_.size());
+      TestSigner::TestEqualLoggedCerts(entries_[count], entry);
+      ++count;
+    }
+    EXPECT_EQ(entries_.size(), count);
+  }
+
+  TmpStorage tmp_;
+  TestSigner test_signer_;
+  string intermediate_;
+  const string root_;
+  // Owned by |db_|.
+  SQLiteDB* backend_;
+  unique_ptr<ChainDedupDatabase> db_;
+  vector<LoggedEntry> entries_;
+};
+
+
+TEST_F(ChainDedupDatabaseTest, StoresSharedCertificatesOnce) {
+  for (int64_t seq = 0; seq < 10; ++seq) {
+    entries_.emplace_back(NewEntry(seq));
+    ASSERT_EQ(Database::OK, db_->CreateSequencedEntry(entries_.back()));
+  }
+
+  EXPECT_EQ(0, Stored(0).chain_reference_size());
+  for (int64_t seq = 1; seq < 10; ++seq) {
+    LoggedEntry stored(Stored(seq));
+    ASSERT_EQ(2, stored.chain_reference_size());
+    EXPECT_EQ(0, stored.chain_reference().Get(0).sequence_number());
+    EXPECT_EQ(0, stored.chain_reference().Get(1).sequence_number());
+    const RepeatedPtrField<string>& chain(*MutableChain(&stored));
+    ASSERT_EQ(3, chain.size());
+    EXPECT_EQ(*MutableChain(&entries_[seq])->Mutable(0), chain.Get(0));
+    EXPECT_TRUE(chain.Get(1).empty());
+    EXPECT_TRUE(chain.Get(2).empty());
+  }
+  ExpectEntries();
+
+  // Writing an entry again is fine, a different one is not.
+  EXPECT_EQ(Database::OK, db_->CreateSequencedEntry(entries_[0]));
+  EXPECT_EQ(Database::OK, db_->CreateSequencedEntry(entries_[4]));
+  EXPECT_EQ(Database::SEQUENCE_NUMBER_ALREADY_IN_USE,
+            db_->CreateSequencedEntry(NewEntry(4)));
+}
+
+
+TEST_F(ChainDedupDatabaseTest, ReadsAfterRestart) {
+  for (int64_t seq = 0; seq < 5; ++seq) {
+    entries_.emplace_back(NewEntry(seq));
+    ASSERT_EQ(Database::OK, db_->CreateSequencedEntry(entries_.back()));
+  }
+
+  OpenDB();
+  ExpectEntries();
+  // Stored with references, which the new instance would not use.
+  EXPECT_EQ(Database::OK, db_->CreateSequencedEntry(entries_[3]));
+
+  entries_.emplace_back(NewEntry(5));
+  ASSERT_EQ(Database::OK, db_->CreateSequencedEntry(entries_.back()));
+  ExpectEntries();
+}
+
+
+TEST_F(ChainDedupDatabaseTest, Batches) {
+  entries_.emplace_back(NewEntry(0));
+  ASSERT_EQ(Database::OK, db_->CreateSequencedEntry(entries_.back()));
+
+  vector<const LoggedEntry*> batch;
+  for (int64_t seq = 1; seq < 5; ++seq) {
+    entries_.emplace_back(NewEntry(seq));
+  }
+  for (size_t i = 1; i < entries_.size(); ++i) {
+    batch.push_back(&entries_[i]);
+  }
+  ASSERT_EQ(Database::OK, db_->CreateSequencedEntries(batch));
+  for (int64_t seq = 1; seq < 5; ++seq) {
+    EXPECT_EQ(2, Stored(seq).chain_reference_size());
+  }
+  ExpectEntries();
+
+  // Again, after a restart, and with a new entry at the end.
+  OpenDB();
+  entries_.emplace_back(NewEntry(5));
+  batch.push_back(&entries_.back());
+  ASSERT_EQ(Database::OK, db_->CreateSequencedEntries(batch));
+  ExpectEntries();
+}
+
+
+TEST_F(ChainDedupDatabaseTest, KeepsRecentlyUsedCertificates) {
+  // Each entry brings a certificate of its own, which pushes the older
+  // ones out.
+  int64_t seq(0);
+  for (; seq < static_cast<int64_t>(2 * kMaxCertificates); ++seq) {
+    entries_.emplace_back(NewEntry(seq));
+    ASSERT_EQ(Database::OK, db_->CreateSequencedEntry(entries_.back()));
+    if (seq > 0) {
+      EXPECT_EQ(2, Stored(seq).chain_reference_size());
+    }
+  }
+
+  // A new intermediate still gets remembered.
+  intermediate_ = test_signer_.UniqueFakeCertBytestring();
+  entries_.emplace_back(NewEntry(seq));
+  ASSERT_EQ(Database::OK, db_->CreateSequencedEntry(entries_.back()));
+  EXPECT_EQ(1, Stored(seq).chain_reference_size());
+  ++seq;
+  entries_.emplace_back(NewEntry(seq));
+  ASSERT_EQ(Database::OK, db_->CreateSequencedEntry(entries_.back()));
+  EXPECT_EQ(2, Stored(seq).chain_reference_size());
+
+  // Forgotten certificates are read back as referenced.
+  OpenDB();
+  ExpectEntries();
+}
+
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  ConfigureSerializerForV1CT();
+  // So that the entries written are still there once the database is
+  // opened again.
+  FLAGS_sqlite_batch_into_transactions = false;
+  return RUN_ALL_TESTS();
+}
@@ -16,7 +16,7 @@ using std::bind;
 using std::lock_guard;
 using std::make_pair;
 using std::make_shared;
-using std::map;
+using std::max;
 using std::mutex;
 using std::pair;
 using std::placeholders::_1;
@@ -68,7 +68,9 @@ ClusterStateController::ClusterPeer::ClusterPeer(
 
 int64_t ClusterStateController::ClusterPeer::TreeSize() const {
   lock_guard<mutex> lock(lock_);
-  return state_.newest_sth().tree_size();
+  // The entries past the newest STH of the node are sequenced already,
+  // so they can be fetched ahead of the STH that will cover them.
+  return max(state_.newest_sth().tree_size(), state_.contiguous_tree_size());
 }
 
 
@@ -107,14 +109,18 @@ ClusterStateController::ClusterStateController(
       store_(CHECK_NOTNULL(store)),
       election_(CHECK_NOTNULL(election)),
       fetcher_(CHECK_NOTNULL(fetcher)),
+      entries_written_callback_(
+          bind(&ClusterStateController::OnEntriesWritten, this)),
       watch_config_task_(CHECK_NOTNULL(executor)),
       watch_node_states_task_(CHECK_NOTNULL(executor)),
       watch_serving_sth_task_(CHECK_NOTNULL(executor)),
+      node_is_stale_(true),
       exiting_(false),
       update_required_(false),
       cluster_serving_sth_update_thread_(
           bind(&ClusterStateController::ClusterServingSTHUpdater, this)) {
   CHECK_NOTNULL(base_.get());
+  fetcher_->AddEntriesWrittenCallback(&entries_written_callback_);
   store_->WatchClusterNodeStates(
       bind(&ClusterStateController::OnClusterStateUpdated, this, _1),
       watch_node_states_task_.task());
@@ -128,6 +134,7 @@ ClusterStateController::ClusterStateController(
 
 
 ClusterStateController::~ClusterStateController() {
+  fetcher_->RemoveEntriesWrittenCallback(&entries_written_callback_);
   watch_config_task_.Cancel();
   watch_node_states_task_.Cancel();
   watch_serving_sth_task_.Cancel();
@@ -165,6 +172,7 @@ void ClusterStateController::NewTreeHead(const SignedTreeHead& sth) {
   }
   local_node_state_.mutable_newest_sth()->CopyFrom(sth);
   PushLocalNodeState(lock);
+  UpdateNodeStaleness(lock);
 
   SignedTreeHead sth_to_write;
   if (write_sth) {
@@ -178,10 +186,7 @@ void ClusterStateController::NewTreeHead(const SignedTreeHead& sth) {
   lock.unlock();
 
   if (write_sth) {
-    // TODO(alcutter): Perhaps we need to know about updates to the contiguous
-    // tree size in the DB again, so that we can write this out as soon as
-    // we're able to serve it.
-    CHECK_EQ(Database::OK, database_->WriteTreeHead(sth_to_write));
+    WriteServingSTH(sth_to_write);
   }
 }
 
@@ -218,12 +223,17 @@ void ClusterStateController::RefreshNodeState() {
 }
 
 
-bool ClusterStateController::NodeIsStale() const {
-  lock_guard<mutex> lock(mutex_);
-  if (!actual_serving_sth_) {
-    return true;
+void ClusterStateController::UpdateContiguousTreeSize() {
+  unique_lock<mutex> lock(mutex_);
+  if (database_->TreeSize() != local_node_state_.contiguous_tree_size()) {
+    PushLocalNodeState(lock);
   }
-  return database_->TreeSize() < actual_serving_sth_->tree_size();
+  UpdateNodeStaleness(lock);
+}
+
+
+bool ClusterStateController::NodeIsStale() const {
+  return node_is_stale_.load();
 }
 
 
@@ -236,14 +246,20 @@ vector<ClusterNodeState> ClusterStateController::GetFreshNodes() const {
   vector<ClusterNodeState> fresh;  // for 1983.
   // Here we go:
   for (const auto& node : all_peers_) {
-    const bool is_self(
-        node.second->state().hostname() == local_node_state_.hostname() &&
-        node.second->state().log_port() == local_node_state_.log_port());
-    if (!is_self && node.second->state().has_newest_sth() &&
-        node.second->state().newest_sth().tree_size() >=
-            actual_serving_sth_->tree_size()) {
-      VLOG(1) << "Node is fresh: " << node.second->state().node_id();
-      fresh.push_back(node.second->state());
+    // Only nodes with a large enough STH can be fresh, so only those
+    // need their state copied.
+    const auto sth(node_sths_.find(node.first));
+    if (sth == node_sths_.end() ||
+        sth->second.tree_size() < actual_serving_sth_->tree_size()) {
+      continue;
+    }
+    ClusterNodeState state(node.second->state());
+    const bool is_self(state.hostname() == local_node_state_.hostname() &&
+                       state.log_port() == local_node_state_.log_port());
+    if (!is_self) {
+      VLOG(1) << "Node is fresh: " << state.node_id();
+      fresh.emplace_back();
+      fresh.back().Swap(&state);
     }
   }
   return fresh;
@@ -254,6 +270,7 @@ void ClusterStateController::PushLocalNodeState(
     const unique_lock<mutex>& lock) {
   CHECK(lock.owns_lock());
 
+  local_node_state_.set_contiguous_tree_size(database_->TreeSize());
   const Status status(store_->SetClusterNodeState(local_node_state_));
   LOG_IF(WARNING, !status.ok()) << "Couldn't set ClusterNodeState: " << status;
 }
@@ -278,12 +295,22 @@ void ClusterStateController::OnClusterStateUpdated(
         it = all_peers_.end();
       }
 
+      const ClusterNodeState& node_state(update.handle_.Entry());
+      UpdateNodeSTH(lock, node_id, node_state.has_newest_sth()
+                                       ? &node_state.newest_sth()
+                                       : nullptr);
+
       if (it != all_peers_.end()) {
-        it->second->UpdateClusterNodeState(update.handle_.Entry());
+        it->second->UpdateClusterNodeState(node_state);
+        // Fetch the new entries of the node now, instead of whenever
+        // the fetcher would next poll it, so that we can serve them as
+        // soon as possible.
+        if (it->second->TreeSize() > database_->TreeSize()) {
+          fetcher_->FetchNow();
+        }
       } else {
         const shared_ptr<ClusterPeer> peer(
-            make_shared<ClusterPeer>(base_, url_fetcher_,
-                                     update.handle_.Entry()));
+            make_shared<ClusterPeer>(base_, url_fetcher_, node_state));
         // TODO(pphaneuf): all_peers_ and fetcher_ both maintain a
         // list of cluster members, this should be split off into its
         // own class, and share an instance between the interested
@@ -294,6 +321,7 @@ void ClusterStateController::OnClusterStateUpdated(
     } else {
       VLOG(1) << "Node left: " << node_id;
       CHECK_EQ(static_cast<size_t>(1), all_peers_.erase(node_id));
+      UpdateNodeSTH(lock, node_id, nullptr);
       fetcher_->RemovePeer(node_id);
     }
   }
@@ -328,6 +356,7 @@ void ClusterStateController::OnServingSthUpdated(
   if (!update.exists_) {
     LOG(WARNING) << "Cluster has no Serving STH!";
     actual_serving_sth_.reset();
+    UpdateNodeStaleness(lock);
     write_sth = false;
   } else {
     // TODO(alcutter): Validate STH and verify consistency with whatever we've
@@ -342,6 +371,7 @@ void ClusterStateController::OnServingSthUpdated(
               << actual_serving_sth_->ShortDebugString();
     serving_tree_size->Set(actual_serving_sth_->tree_size());
     serving_tree_timestamp->Set(actual_serving_sth_->timestamp());
+    UpdateNodeStaleness(lock);
 
     // Double check this STH is newer than, or idential to, what we have in
     // the database. (It definitely should be!)
@@ -378,8 +408,9 @@ void ClusterStateController::OnServingSthUpdated(
 
     if (database_->TreeSize() < actual_serving_sth_->tree_size()) {
       LOG(INFO) << "Local node doesn't yet have all entries for "
-                << "serving STH, not writing to DB.";
+                << "serving STH, not writing to DB until they are fetched.";
       write_sth = false;
+      fetcher_->FetchNow();
     }
   }
 
@@ -392,39 +423,100 @@ void ClusterStateController::OnServingSthUpdated(
 
   if (write_sth) {
     // All good, write this STH to our local DB:
-    CHECK_EQ(Database::OK, database_->WriteTreeHead(sth_to_write));
+    WriteServingSTH(sth_to_write);
   }
 }
 
 
-void ClusterStateController::CalculateServingSTH(
+void ClusterStateController::OnEntriesWritten() {
+  unique_lock<mutex> lock(mutex_);
+  UpdateNodeStaleness(lock);
+  if (!actual_serving_sth_ ||
+      database_->TreeSize() < actual_serving_sth_->tree_size()) {
+    return;
+  }
+
+  SignedTreeHead db_sth;
+  const Database::LookupResult result(database_->LatestTreeHead(&db_sth));
+  CHECK(result == Database::LOOKUP_OK || result == Database::NOT_FOUND);
+  if (result == Database::LOOKUP_OK &&
+      db_sth.timestamp() >= actual_serving_sth_->timestamp()) {
+    return;
+  }
+
+  // The entries of the serving STH have just all arrived, serve it now
+  // rather than at our next local tree head.
+  const SignedTreeHead sth_to_write(*actual_serving_sth_);
+  lock.unlock();
+
+  VLOG(1) << "Fetched all the entries for serving STH of size "
+          << sth_to_write.tree_size();
+  WriteServingSTH(sth_to_write);
+}
+
+
+void ClusterStateController::UpdateNodeStaleness(
     const unique_lock<mutex>& lock) {
-  VLOG(1) << "Calculating new ServingSTH...";
   CHECK(lock.owns_lock());
+  node_is_stale_.store(!actual_serving_sth_ ||
+                       database_->TreeSize() <
+                           actual_serving_sth_->tree_size());
+}
 
-  // First, create a mapping of tree size to number of nodes at that size, and
-  // a mapping of the newst STH for any given size:
-  map<int64_t, SignedTreeHead> sth_by_size;
-  map<int64_t, int> num_nodes_by_sth_size;
-  for (const auto& node : all_peers_) {
-    const ClusterNodeState node_state(node.second->state());
-    if (node_state.has_newest_sth()) {
-      const int64_t tree_size(node_state.newest_sth().tree_size());
-      CHECK_LE(0, tree_size);
-      const int64_t timestamp(node_state.newest_sth().timestamp());
-      CHECK_LE(0, timestamp);
-
-      num_nodes_by_sth_size[tree_size]++;
-
-      // Default timestamp (first call in here) will be 0
-      if (node_state.newest_sth().timestamp() >
-          sth_by_size[tree_size].timestamp()) {
-        sth_by_size[tree_size] = node_state.newest_sth();
-      }
+
+void ClusterStateController::WriteServingSTH(const SignedTreeHead& sth) {
+  // This is done without |mutex_| held, as the database notifies its
+  // STH callbacks (updating the serving tree) before returning, so
+  // NewTreeHead(), OnServingSthUpdated() and OnEntriesWritten() can
+  // race to write the same STH.
+  const Database::WriteResult result(database_->WriteTreeHead(sth));
+  CHECK(result == Database::OK ||
+        result == Database::DUPLICATE_TREE_HEAD_TIMESTAMP)
+      << result;
+}
+
+
+void ClusterStateController::UpdateNodeSTH(const unique_lock<mutex>& lock,
+                                           const string& node_id,
+                                           const SignedTreeHead* sth) {
+  CHECK(lock.owns_lock());
+
+  auto it(node_sths_.find(node_id));
+  if (it != node_sths_.end()) {
+    const auto by_size(sths_by_size_.find(it->second.tree_size()));
+    CHECK(by_size != sths_by_size_.end());
+    CHECK_EQ(static_cast<size_t>(1),
+             by_size->second.erase(
+                 make_pair(it->second.timestamp(), node_id)));
+    if (by_size->second.empty()) {
+      sths_by_size_.erase(by_size);
     }
+    if (!sth) {
+      node_sths_.erase(it);
+      return;
+    }
+    it->second = *sth;
+  } else if (!sth) {
+    return;
+  } else {
+    it = node_sths_.emplace(node_id, *sth).first;
   }
 
-  // Next calculate the newest STH we've seen which satisfies the following
+  const int64_t tree_size(it->second.tree_size());
+  CHECK_LE(0, tree_size);
+  const int64_t timestamp(it->second.timestamp());
+  CHECK_LE(0, timestamp);
+  sths_by_size_[tree_size].emplace(make_pair(timestamp, node_id),
+                                   &it->second);
+}
+
+
+void ClusterStateController::CalculateServingSTH(
+    const unique_lock<mutex>& lock) {
+  VLOG(1) << "Calculating new ServingSTH...";
+  CHECK(lock.owns_lock());
+
+  // Calculate the newest STH we've seen which satisfies the following
   // criteria:
   //   - at least minimum_serving_nodes have an STH at least as large
   //   - at least minimum_serving_fraction have an STH at least as large
@@ -439,18 +531,18 @@ void ClusterStateController::CalculateServingSTH(
   // Work backwards (from largest STH size) until we see that there's enough
   // coverage (according to the criteria above) to serve an STH (or determine
   // that there are insufficient nodes to serve anything.)
-  for (auto it = num_nodes_by_sth_size.rbegin();
-       it != num_nodes_by_sth_size.rend() && it->first >= current_tree_size;
-       ++it) {
+  for (auto it = sths_by_size_.rbegin();
+       it != sths_by_size_.rend() && it->first >= current_tree_size; ++it) {
     // num_nodes_seen keeps track of the number of nodes we've seen so far (and
     // since we're working from larger to smaller size STH, they should all be
     // able to serve this [and smaller] STHs.)
-    num_nodes_seen += it->second;
+    num_nodes_seen += it->second.size();
     const double serving_fraction(static_cast<double>(num_nodes_seen) /
                                   all_peers_.size());
     if (serving_fraction >= cluster_config_.minimum_serving_fraction() &&
         num_nodes_seen >= cluster_config_.minimum_serving_nodes()) {
-      const SignedTreeHead& candidate_sth(sth_by_size[it->first]);
+      // The newest STH of this size.
+      const SignedTreeHead& candidate_sth(*it->second.rbegin()->second);
 
       // This STH isn't a viable candidate unless its timestamp is strictly
       // newer than any current serving STH:
@@ -459,15 +551,17 @@ void ClusterStateController::CalculateServingSTH(
         VLOG(1) << "Discarding candidate STH:\n" << candidate_sth.DebugString()
                 << "\nbecause its timestamp is <= current serving STH "
                 << "timestamp (" << actual_serving_sth_->timestamp() << ")";
-        candidates_include_current |= candidate_sth.SerializeAsString() ==
-                                      actual_serving_sth_->SerializeAsString();
+        candidates_include_current |=
+            candidate_sth.timestamp() == actual_serving_sth_->timestamp() &&
+            candidate_sth.tree_size() == actual_serving_sth_->tree_size() &&
+            candidate_sth.sha256_root_hash() ==
+                actual_serving_sth_->sha256_root_hash();
         continue;
       }
 
       LOG(INFO) << "Can serve @" << it->first << " with " << num_nodes_seen
                 << " nodes (" << (serving_fraction * 100) << "% of cluster)";
-      calculated_serving_sth_.reset(
-          new SignedTreeHead(sth_by_size[it->first]));
+      calculated_serving_sth_.reset(new SignedTreeHead(candidate_sth));
       // Push this STH out to the cluster if we're master:
       if (election_->IsMaster()) {
         VLOG(1) << "Pushing new STH out to cluster";
@@ -1,6 +1,7 @@
 #ifndef CERT_TRANS_LOG_CLUSTER_STATE_CONTROLLER_H_
 #define CERT_TRANS_LOG_CLUSTER_STATE_CONTROLLER_H_
 
+#include <atomic>
 #include <condition_variable>
 #include <functional>
 #include <map>
@@ -63,6 +64,15 @@ class ClusterStateController {
 
   void RefreshNodeState();
 
+  // Publishes the number of contiguous entries in the local database in
+  // this node's ClusterNodeState, if it has changed, so that the other
+  // nodes can fetch them ahead of the STH that will cover them. For the
+  // master to call once it has sequenced new entries.
+  void UpdateContiguousTreeSize();
+
+  // Whether the local database lacks entries of the serving STH (or
+  // there is none). This is kept up to date as either changes, so it
+  // is cheap enough to check for every request.
   bool NodeIsStale() const;
 
   // Returns a vector of the other nodes in the cluster which are able to serve
@@ -104,6 +114,26 @@ class ClusterStateController {
   // Called whenever the ClusterConfig is changed.
   void OnServingSthUpdated(const Update<ct::SignedTreeHead>& update);
 
+  // Records the newest STH of node |node_id| in the aggregates used by
+  // CalculateServingSTH(), in place of its previous one. A NULL |sth|
+  // means the node has none (any more).
+  void UpdateNodeSTH(const std::unique_lock<std::mutex>& lock,
+                     const std::string& node_id,
+                     const ct::SignedTreeHead* sth);
+
+  // Entry point for the fetcher callback.
+  // Called whenever fetched entries have been written to the database, which
+  // may now have all the entries of the serving STH.
+  void OnEntriesWritten();
+
+  // Updates |node_is_stale_|, after a change of the serving STH or of
+  // the size of the local tree.
+  void UpdateNodeStaleness(const std::unique_lock<std::mutex>& lock);
+
+  // Writes the serving STH |sth| to the database, once it has all of its
+  // entries.
+  void WriteServingSTH(const ct::SignedTreeHead& sth);
+
   // Calculates the STH which should be served by the cluster, given the
   // current state of the nodes.
   // If this node is the cluster master then the calculated serving STH is
@@ -124,6 +154,7 @@ class ClusterStateController {
   ConsistentStore* const store_;      // Not owned by us
   MasterElection* const election_;    // Not owned by us
   ContinuousFetcher* const fetcher_;  // Not owned by us
+  const ContinuousFetcher::EntriesWrittenCallback entries_written_callback_;
   util::SyncTask watch_config_task_;
   util::SyncTask watch_node_states_task_;
   util::SyncTask watch_serving_sth_task_;
@@ -132,8 +163,18 @@ class ClusterStateController {
   mutable std::mutex mutex_;  // covers the members below:
   ct::ClusterNodeState local_node_state_;
   std::map<std::string, const std::shared_ptr<ClusterPeer>> all_peers_;
+  // The newest STH of each of |all_peers_| which has one, and the same
+  // grouped by tree size, ordered by timestamp (then node ID) in each
+  // group. Kept up to date as the node states change, so that
+  // CalculateServingSTH() does not have to go through every node.
+  std::map<std::string, ct::SignedTreeHead> node_sths_;
+  std::map<int64_t, std::map<std::pair<int64_t, std::string>,
+                             const ct::SignedTreeHead*>>
+      sths_by_size_;
   std::unique_ptr<ct::SignedTreeHead> calculated_serving_sth_;
   std::unique_ptr<ct::SignedTreeHead> actual_serving_sth_;
+  // Set by UpdateNodeStaleness(), but read without |mutex_|.
+  std::atomic<bool> node_is_stale_;
   bool exiting_;
   bool update_required_;
   std::condition_variable update_required_cv_;
@@ -101,6 +101,11 @@ class ClusterStateControllerTest : public ::testing::Test {
     return controller_.local_node_state_;
   }
 
+  // As if the fetcher had written some entries to the database.
+  void EntriesWritten() {
+    controller_.OnEntriesWritten();
+  }
+
   // TODO: This should probably return a util::StatusOr<ClusterNodeState>
   // rather than failing a CHECK if absent.
   ct::ClusterNodeState GetNodeStateView(const string& node_id) {
@@ -124,7 +129,7 @@ class ClusterStateControllerTest : public ::testing::Test {
   ThreadPool pool_;
   shared_ptr<libevent::Base> base_;
   MockUrlFetcher url_fetcher_;
-  MockContinuousFetcher fetcher_;
+  NiceMock<MockContinuousFetcher> fetcher_;
   libevent::EventPumpThread pump_;
   FakeEtcdClient etcd_;
   TestDB<FileDB> test_db_;
@@ -584,6 +589,77 @@ TEST_F(ClusterStateControllerTest, TestWaitsToStoreSTHInDatabaseWhenStale) {
 }
 
 
+TEST_F(ClusterStateControllerTest, TestStoresSTHInDatabaseOnceFetched) {
+  SignedTreeHead sth1;
+  sth1.set_timestamp(10000);
+  sth1.set_tree_size(0);
+  store1_->SetServingSTH(sth1);
+  sleep(1);
+
+  // The node goes after the entries under sth2 as soon as it hears of
+  // it.
+  EXPECT_CALL(fetcher_, FetchNow());
+  SignedTreeHead sth2;
+  sth2.set_timestamp(10001);
+  sth2.set_tree_size(1);
+  store1_->SetServingSTH(sth2);
+  sleep(1);
+
+  // Nothing to do until the entries are all there.
+  EntriesWritten();
+  {
+    SignedTreeHead db_sth;
+    EXPECT_EQ(Database::LOOKUP_OK, test_db_.db()->LatestTreeHead(&db_sth));
+    EXPECT_EQ(sth1.DebugString(), db_sth.DebugString());
+  }
+
+  // Now pretend the fetcher has written the entry, which is enough to
+  // serve sth2, without waiting for the local signer.
+  LoggedEntry cert;
+  cert.RandomForTest();
+  cert.set_sequence_number(0);
+  EXPECT_EQ(Database::OK, test_db_.db()->CreateSequencedEntry(cert));
+  EntriesWritten();
+  {
+    SignedTreeHead db_sth;
+    EXPECT_EQ(Database::LOOKUP_OK, test_db_.db()->LatestTreeHead(&db_sth));
+    EXPECT_EQ(sth2.DebugString(), db_sth.DebugString());
+  }
+
+  // Again is harmless.
+  EntriesWritten();
+}
+
+
+TEST_F(ClusterStateControllerTest, TestFetchesNewEntriesOfPeers) {
+  ClusterNodeState cns;
+  cns.set_hostname(kNodeId2);
+  cns.set_log_port(9001);
+  store2_->SetClusterNodeState(cns);
+  sleep(1);
+
+  EXPECT_CALL(fetcher_, FetchNow());
+  cns.mutable_newest_sth()->CopyFrom(sth200_);
+  store2_->SetClusterNodeState(cns);
+  sleep(1);
+}
+
+
+TEST_F(ClusterStateControllerTest, TestFetchesSequencedEntriesOfPeers) {
+  ClusterNodeState cns;
+  cns.set_hostname(kNodeId2);
+  cns.set_log_port(9001);
+  store2_->SetClusterNodeState(cns);
+  sleep(1);
+
+  // The node has entries that are not in any of its tree heads yet.
+  EXPECT_CALL(fetcher_, FetchNow());
+  cns.set_contiguous_tree_size(150);
+  store2_->SetClusterNodeState(cns);
+  sleep(1);
+}
+
+
 TEST_F(ClusterStateControllerTest, TestNodeIsStale) {
   EXPECT_TRUE(controller_.NodeIsStale());  // no STH yet.
 
@@ -613,6 +689,9 @@ TEST_F(ClusterStateControllerTest, TestNodeIsStale) {
     cert.set_sequence_number(0);
     EXPECT_EQ(Database::OK, test_db_.db()->CreateSequencedEntry(cert));
   }
+  // Only noticed once the entries are reported.
+  EXPECT_TRUE(controller_.NodeIsStale());
+  EntriesWritten();
 
   EXPECT_FALSE(controller_.NodeIsStale());
 }
@@ -1,37 +1,55 @@
 /* -*- indent-tabs-mode: nil -*- */
 #include "log/cms_verifier.h"
+
+#include <gflags/gflags.h>
+
 #include "log/ct_extensions.h"
+#include "merkletree/serial_hasher.h"
 #include "util/cms_scoped_types.h"
 #include "util/openssl_scoped_types.h"
 
+DEFINE_int32(cms_verifier_verified_signatures, 10000,
+             "Number of valid CMS signatures remembered, so as not to verify "
+             "them again. 0 to disable.");
+
+using std::lock_guard;
+using std::mutex;
 using std::string;
 using std::unique_ptr;
 using util::Status;
 using util::StatusOr;
 
 namespace cert_trans {
-util::StatusOr<bool> CmsVerifier::IsCmsSignedByCert(BIO* cms_bio_in,
-                                                    const Cert& cert) const {
-  CHECK_NOTNULL(cms_bio_in);
+namespace {
 
-  ScopedCMS_ContentInfo cms_content_info(d2i_CMS_bio(cms_bio_in, nullptr));
+
+// Parses |cms_object| straight from memory, rather than through a
+// BIO. Returns NULL if it is not a DER encoded CMS object.
+ScopedCMS_ContentInfo ParseCmsObject(const string& cms_object) {
+  const unsigned char* p(
+      reinterpret_cast<const unsigned char*>(cms_object.data()));
+  ScopedCMS_ContentInfo cms_content_info(
+      d2i_CMS_ContentInfo(nullptr, &p, cms_object.size()));
 
   if (!cms_content_info) {
     LOG(ERROR) << "Could not parse CMS data";
     LOG_OPENSSL_ERRORS(WARNING);
-    return Status(util::error::INVALID_ARGUMENT,
-                  "CMS data could not be parsed");
   }
 
+  return cms_content_info;
+}
+
+
+bool HasSignerCert(CMS_ContentInfo* cms_content_info, X509* cert) {
   // This stack must not be freed as it points into the CMS structure
   STACK_OF(CMS_SignerInfo) *
-      const signers(CMS_get0_SignerInfos(cms_content_info.get()));
+      const signers(CMS_get0_SignerInfos(cms_content_info));
 
   if (signers) {
     for (int s = 0; s < sk_CMS_SignerInfo_num(signers); ++s) {
       CMS_SignerInfo* const signer = sk_CMS_SignerInfo_value(signers, s);
 
-      if (CMS_SignerInfo_cert_cmp(signer, cert.x509_.get()) == 0) {
+      if (CMS_SignerInfo_cert_cmp(signer, cert) == 0) {
         return true;
       }
     }
@@ -40,14 +58,15 @@ util::StatusOr<bool> CmsVerifier::IsCmsSignedByCert(BIO* cms_bio_in,
   return false;
 }
 
-StatusOr<bool> CmsVerifier::IsCmsSignedByCert(const string& cms_object,
-                                              const Cert& cert) const {
-  // Load a source bio with the CMS signed data object and parse it
-  ScopedBIO source_bio(BIO_new(BIO_s_mem()));
-  BIO_write(source_bio.get(), cms_object.c_str(), cms_object.length());
 
-  ScopedCMS_ContentInfo cms_content_info(
-      d2i_CMS_bio(source_bio.get(), nullptr));
+}  // namespace
+
+
+util::StatusOr<bool> CmsVerifier::IsCmsSignedByCert(BIO* cms_bio_in,
+                                                    const Cert& cert) const {
+  CHECK_NOTNULL(cms_bio_in);
+
+  ScopedCMS_ContentInfo cms_content_info(d2i_CMS_bio(cms_bio_in, nullptr));
 
   if (!cms_content_info) {
     LOG(ERROR) << "Could not parse CMS data";
@@ -56,6 +75,31 @@ StatusOr<bool> CmsVerifier::IsCmsSignedByCert(const string& cms_object,
                   "CMS data could not be parsed");
   }
 
+  return HasSignerCert(cms_content_info.get(), cert.x509_.get());
+}
+
+
+StatusOr<bool> CmsVerifier::IsCmsSignedByCert(const string& cms_object,
+                                              const Cert& cert) const {
+  string key;
+  if (FLAGS_cms_verifier_verified_signatures > 0 &&
+      cert.Sha256Digest(&key).ok()) {
+    key.insert(0, Sha256Hasher::Sha256Digest(cms_object));
+
+    lock_guard<mutex> lock(verified_lock_);
+    const auto it(verified_.find(key));
+    if (it != verified_.end()) {
+      verified_lru_.splice(verified_lru_.begin(), verified_lru_, it->second);
+      return true;
+    }
+  }
+
+  const ScopedCMS_ContentInfo cms_content_info(ParseCmsObject(cms_object));
+  if (!cms_content_info) {
+    return Status(util::error::INVALID_ARGUMENT,
+                  "CMS data could not be parsed");
+  }
+
   // Now that we've got the CMS unpacked check it has a valid signature using
   // the same key as the cert. First create a certificate stack from our
   // expected signing cert that can be used by CMS_verify.
@@ -79,21 +123,23 @@ StatusOr<bool> CmsVerifier::IsCmsSignedByCert(const string& cms_object,
     return false;
   }
 
-  // This stack must not be freed as it points into the CMS structure
-  STACK_OF(CMS_SignerInfo) *
-      const signers(CMS_get0_SignerInfos(cms_content_info.get()));
-
-  if (signers) {
-    for (int s = 0; s < sk_CMS_SignerInfo_num(signers); ++s) {
-      CMS_SignerInfo* const signer = sk_CMS_SignerInfo_value(signers, s);
+  if (!HasSignerCert(cms_content_info.get(), cert.x509_.get())) {
+    return false;
+  }
 
-      if (CMS_SignerInfo_cert_cmp(signer, cert.x509_.get()) == 0) {
-        return true;
+  if (!key.empty()) {
+    lock_guard<mutex> lock(verified_lock_);
+    if (verified_.find(key) == verified_.end()) {
+      verified_lru_.push_front(key);
+      verified_.emplace(key, verified_lru_.begin());
+      while (verified_lru_.size() >
+             static_cast<size_t>(FLAGS_cms_verifier_verified_signatures)) {
+        verified_.erase(verified_lru_.back());
+        verified_lru_.pop_back();
       }
     }
   }
-
-  return false;
+  return true;
 }
 
 
@@ -207,24 +253,46 @@ unique_ptr<Cert> CmsVerifier::UnpackCmsSignedCertificate(
 
 unique_ptr<Cert> CmsVerifier::UnpackCmsSignedCertificate(
     const string& cms_object) {
-  // Load the source bio with the CMS signed data object
-  ScopedBIO source_bio(BIO_new(BIO_s_mem()));
-  BIO_write(source_bio.get(), cms_object.c_str(), cms_object.length());
+  const ScopedCMS_ContentInfo cms_content_info(ParseCmsObject(cms_object));
+  if (!cms_content_info) {
+    return nullptr;
+  }
 
-  ScopedBIO unpacked_bio(BIO_new(BIO_s_mem()));
-  unique_ptr<Cert> cert;
+  const ASN1_OBJECT* message_content_type(
+      CMS_get0_eContentType(cms_content_info.get()));
+  const int content_type_nid = OBJ_obj2nid(message_content_type);
+  // TODO: Enforce content type here. This is not yet defined in the RFC.
+  if (content_type_nid != NID_ctV2CmsPayloadContentType) {
+    LOG(WARNING) << "CMS message content has unexpected type: "
+                 << content_type_nid;
+  }
 
-  if (UnpackCmsDerBio(source_bio.get(), unpacked_bio.get()).ok()) {
-    // The unpacked data should be a valid DER certificate.
-    // TODO: The RFC does not yet define this as the format so this may
-    // need to change.
-    cert = Cert::FromDerBio(unpacked_bio.get());
+  // No signature is checked here, so the content is read where it is
+  // embedded rather than through CMS_verify(), which would need the
+  // signer certificate: the RFC says it SHOULD be omitted from the
+  // message.
+  if (OBJ_obj2nid(CMS_get0_type(cms_content_info.get())) !=
+      NID_pkcs7_signed) {
+    LOG(WARNING) << "CMS message is not signed data";
+    return nullptr;
+  }
 
-    if (!cert) {
-      LOG(WARNING) << "Could not unpack cert from CMS DER encoded data";
-    }
-  } else {
-    LOG_OPENSSL_ERRORS(ERROR);
+  // This must not be freed as it points into the CMS structure
+  ASN1_OCTET_STRING** const content(
+      CMS_get0_content(cms_content_info.get()));
+  if (!content || !*content) {
+    LOG(WARNING) << "CMS message has no embedded content";
+    return nullptr;
+  }
+
+  // The unpacked data should be a valid DER certificate.
+  // TODO: The RFC does not yet define this as the format so this may
+  // need to change.
+  unique_ptr<Cert> cert(Cert::FromDerBuffer(ASN1_STRING_data(*content),
+                                            ASN1_STRING_length(*content)));
+
+  if (!cert) {
+    LOG(WARNING) << "Could not unpack cert from CMS DER encoded data";
   }
 
   return cert;
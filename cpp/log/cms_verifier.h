@@ -4,7 +4,11 @@
 #include <openssl/asn1.h>
 #include <openssl/bio.h>
 #include <openssl/cms.h>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 
 #include "log/cert.h"
 #include "util/openssl_util.h"  // for LOG_OPENSSL_ERRORS
@@ -12,6 +16,10 @@
 
 namespace cert_trans {
 
+// The CMS objects found signed by a given certificate through the
+// std::string overload of IsCmsSignedByCert() are remembered (up to
+// --cms_verifier_verified_signatures of them), as clients resubmitting
+// the same object would otherwise have its signature verified again.
 class CmsVerifier {
  public:
   CmsVerifier() = default;
@@ -29,8 +37,8 @@ class CmsVerifier {
   // certificate. Does not verify the signature or check the payload.
   virtual util::StatusOr<bool> IsCmsSignedByCert(BIO* cms_bio_in,
                                                  const Cert& cert) const;
-  // Checks that a CMS_ContentInfo has a signer that matches a specified
-  // certificate. Does not verify the signature or check the payload.
+  // Checks that a CMS_ContentInfo has a valid signature by a specified
+  // certificate. Does not check the payload.
   virtual util::StatusOr<bool> IsCmsSignedByCert(const std::string& cms_object,
                                                  const Cert& cert) const;
 
@@ -68,6 +76,14 @@ class CmsVerifier {
   // The unpacked data may not be a valid X.509 cert. The caller must
   // apply any additional checks necessary.
   util::Status UnpackCmsDerBio(BIO* cms_bio_in, BIO* cms_bio_out);
+
+  mutable std::mutex verified_lock_;
+  // The SHA-256 digests of the CMS objects and of the certificates
+  // they were found signed by, most recently used first.
+  mutable std::list<std::string> verified_lru_;
+  // Their positions in |verified_lru_|.
+  mutable std::unordered_map<std::string, std::list<std::string>::iterator>
+      verified_;
 };
 
 }  // namespace cert_trans
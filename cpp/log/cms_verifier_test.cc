@@ -113,6 +113,30 @@ TEST_F(CmsVerifierTest, CmsSignTestCase4) {
 }
 
 
+TEST_F(CmsVerifierTest, CmsSignStringRemembered) {
+  string cms_object;
+  ASSERT_TRUE(
+      util::ReadBinaryFile(cert_dir_v2_ + kCmsSignedDataTest3, &cms_object));
+  EXPECT_TRUE(
+      verifier_.IsCmsSignedByCert(cms_object, *ca_cert_).ValueOrDie());
+  // The second time around, the signature does not get verified again,
+  // but it is still only good for the cert that signed it.
+  EXPECT_TRUE(
+      verifier_.IsCmsSignedByCert(cms_object, *ca_cert_).ValueOrDie());
+  EXPECT_FALSE(
+      verifier_.IsCmsSignedByCert(cms_object, *intermediate_cert_)
+          .ValueOrDie());
+
+  string other_cms_object;
+  ASSERT_TRUE(util::ReadBinaryFile(cert_dir_v2_ + kCmsSignedDataTest5,
+                                   &other_cms_object));
+  EXPECT_FALSE(
+      verifier_.IsCmsSignedByCert(other_cms_object, *ca_cert_).ValueOrDie());
+  EXPECT_THAT(verifier_.IsCmsSignedByCert("not CMS", *ca_cert_).status(),
+              StatusIs(util::error::INVALID_ARGUMENT));
+}
+
+
 TEST_F(CmsVerifierTest, CmsVerifyTestCase2) {
   ScopedBIO bio(OpenTestFileBio(cert_dir_v2_ + kCmsSignedDataTest2));
   unique_ptr<Cert> unpacked_cert(
@@ -165,6 +189,25 @@ TEST_F(CmsVerifierTest, CmsVerifyTestCase5) {
 }
 
 
+TEST_F(CmsVerifierTest, CmsUnpackString) {
+  string cms_object;
+  ASSERT_TRUE(
+      util::ReadBinaryFile(cert_dir_v2_ + kCmsSignedDataTest5, &cms_object));
+  unique_ptr<Cert> unpacked_cert(
+      verifier_.UnpackCmsSignedCertificate(cms_object));
+
+  ASSERT_TRUE(unpacked_cert.get());
+  ASSERT_OK(unpacked_cert->IsValidWildcardRedaction());
+  ASSERT_EQ(kCmsTestSubject, unpacked_cert->PrintSubjectName());
+
+  // The embedded data is not a certificate.
+  ASSERT_TRUE(
+      util::ReadBinaryFile(cert_dir_v2_ + kCmsSignedDataTest2, &cms_object));
+  EXPECT_FALSE(verifier_.UnpackCmsSignedCertificate(cms_object));
+  EXPECT_FALSE(verifier_.UnpackCmsSignedCertificate("not CMS"));
+}
+
+
 TEST_F(CmsVerifierTest, CmsVerifyTestCase7) {
   // For this test the embedded cert is signed by the intermediate
   ScopedBIO bio(OpenTestFileBio(cert_dir_v2_ + kCmsSignedDataTest5));
@@ -132,6 +132,8 @@ class ConsistentStore {
                                  updates)> ClusterNodeStateCallback;
   typedef std::function<void(const Update<ct::ClusterConfig>& update)>
       ClusterConfigCallback;
+  typedef std::function<void(const std::vector<Update<LoggedEntry>>& updates)>
+      PendingEntriesCallback;
 
   ConsistentStore() = default;
   ConsistentStore(const ConsistentStore&) = delete;
@@ -147,6 +149,23 @@ class ConsistentStore {
 
   virtual util::Status AddPendingEntry(LoggedEntry* entry) = 0;
 
+  // Same as AddPendingEntry(), returning the status on |task|. |entry|
+  // must stay valid until then. By default, this just calls
+  // AddPendingEntry() on the executor of |task|; stores which wait on
+  // a remote service should rather continue from its replies, so that
+  // no thread is parked for every submission in flight.
+  virtual void AddPendingEntryAsync(LoggedEntry* entry, util::Task* task) {
+    task->executor()->Add(
+        [this, entry, task]() { task->Return(AddPendingEntry(entry)); });
+  }
+
+  // How many entries are pending, as a fraction of the number beyond
+  // which AddPendingEntry() refuses more, or 0 if there is no such
+  // limit.
+  virtual double PendingEntriesLoad() const {
+    return 0;
+  }
+
   virtual util::Status GetPendingEntryForHash(
       const std::string& hash, EntryHandle<LoggedEntry>* entry) const = 0;
 
@@ -173,6 +192,11 @@ class ConsistentStore {
   virtual void WatchClusterConfig(const ClusterConfigCallback& cb,
                                   util::Task* task) = 0;
 
+  // The first update has all the pending entries. The updates for
+  // entries that were removed only have their key set.
+  virtual void WatchPendingEntries(const PendingEntriesCallback& cb,
+                                   util::Task* task) = 0;
+
   virtual util::Status SetClusterConfig(const ct::ClusterConfig& config) = 0;
 
   // Cleans up entries in the store according to the implementation's policy.
@@ -1,6 +1,127 @@
 #include "log/database.h"
 
+#include <gflags/gflags.h>
+#include <algorithm>
+#include <thread>
+
+#include "util/executor.h"
+#include "util/task.h"
+#include "util/trace.h"
+
+using std::move;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using util::Executor;
+using util::Task;
+
+DEFINE_int32(build_index_threads, 0,
+             "number of threads parsing and hashing the entries when "
+             "opening a database, 0 for one per CPU");
+
 namespace cert_trans {
+namespace {
+
+
+class EntryLeafHashIterator : public ReadOnlyDatabase::LeafHashIterator {
+ public:
+  explicit EntryLeafHashIterator(unique_ptr<ReadOnlyDatabase::Iterator> it)
+      : it_(move(it)) {
+  }
+
+  bool GetNextLeafHash(int64_t* sequence_number, string* leaf_hash) override {
+    CHECK_NOTNULL(sequence_number);
+    CHECK_NOTNULL(leaf_hash);
+    LoggedEntry entry;
+    if (!it_->GetNextEntry(&entry)) {
+      return false;
+    }
+
+    CHECK(entry.has_sequence_number());
+    *sequence_number = entry.sequence_number();
+    CHECK(entry.LeafHash(leaf_hash));
+    return true;
+  }
+
+ private:
+  const unique_ptr<ReadOnlyDatabase::Iterator> it_;
+};
+
+
+}  // namespace
+
+
+void ReadOnlyDatabase::ReadEntries(int64_t start_index, int64_t end_index,
+                                   size_t max_bytes, ReadPattern,
+                                   vector<LoggedEntry>* entries) const {
+  CHECK_GE(start_index, 0);
+  CHECK_NOTNULL(entries);
+  const unique_ptr<Iterator> it(ScanEntries(start_index));
+  size_t bytes(0);
+  for (int64_t i = start_index; i <= end_index; ++i) {
+    entries->emplace_back();
+    const LoggedEntry& entry(entries->back());
+    if (!it->GetNextEntry(&entries->back()) || entry.sequence_number() != i ||
+        (i > start_index && bytes + entry.ByteSize() > max_bytes)) {
+      entries->pop_back();
+      return;
+    }
+    bytes += entry.ByteSize();
+  }
+}
+
+
+void ReadOnlyDatabase::ReadEntriesAsync(int64_t start_index,
+                                        int64_t end_index, size_t max_bytes,
+                                        ReadPattern pattern,
+                                        Executor* executor,
+                                        vector<LoggedEntry>* entries,
+                                        Task* task) const {
+  CHECK_NOTNULL(executor);
+  CHECK_NOTNULL(entries);
+  CHECK_NOTNULL(task);
+  executor->Add([this, start_index, end_index, max_bytes, pattern, entries,
+                 task]() {
+    if (task->CancelRequested()) {
+      task->Return(util::Status::CANCELLED);
+      return;
+    }
+
+    {
+      const util::trace::Span span("db_read_entries",
+                                   util::trace::Phase::DB);
+      ReadEntries(start_index, end_index, max_bytes, pattern, entries);
+    }
+    task->Return();
+  });
+}
+
+
+unique_ptr<ReadOnlyDatabase::LeafHashIterator>
+ReadOnlyDatabase::ScanLeafHashes(int64_t start_index) const {
+  return unique_ptr<LeafHashIterator>(
+      new EntryLeafHashIterator(ScanEntries(start_index)));
+}
+
+
+Database::WriteResult Database::CreateSequencedEntries_(
+    const vector<const LoggedEntry*>& entries) {
+  for (const LoggedEntry* logged : entries) {
+    const WriteResult result(CreateSequencedEntry_(*logged));
+    if (result != OK) {
+      return result;
+    }
+  }
+  return OK;
+}
+
+
+int BuildIndexThreadCount() {
+  if (FLAGS_build_index_threads > 0) {
+    return FLAGS_build_index_threads;
+  }
+  return std::max(1U, std::thread::hardware_concurrency());
+}
 
 
 DatabaseNotifierHelper::~DatabaseNotifierHelper() {
@@ -6,10 +6,17 @@
 #include <functional>
 #include <memory>
 #include <set>
+#include <string>
+#include <vector>
 
 #include "log/logged_entry.h"
 #include "proto/ct.pb.h"
 
+namespace util {
+class Executor;
+class Task;
+}  // namespace util
+
 namespace cert_trans {
 
 // This is a database interface for the log server.
@@ -34,6 +41,19 @@ class ReadOnlyDatabase {
     NOT_FOUND,
   };
 
+  // How a read of entries is going to be followed, so that databases
+  // keep a pass over the whole log (a mirror fetching it, a backfill)
+  // from evicting what the lookups of single entries and the reads of
+  // the newest ones rely on from their caches.
+  enum ReadPattern {
+    // Reads of a few entries, or of the newest ones, which are likely
+    // to be read again soon.
+    POINT_READ,
+    // Part of a sequential pass over many entries, each read once:
+    // databases read ahead, and leave their caches alone.
+    BULK_SCAN,
+  };
+
   class Iterator {
    public:
     Iterator() = default;
@@ -46,6 +66,20 @@ class ReadOnlyDatabase {
     virtual bool GetNextEntry(LoggedEntry* entry) = 0;
   };
 
+  class LeafHashIterator {
+   public:
+    LeafHashIterator() = default;
+    virtual ~LeafHashIterator() = default;
+    LeafHashIterator(const LeafHashIterator&) = delete;
+    LeafHashIterator& operator=(const LeafHashIterator&) = delete;
+
+    // If there is an entry available, fill *sequence_number and
+    // *leaf_hash with its sequence number and Merkle tree leaf hash
+    // and return true, otherwise return false.
+    virtual bool GetNextLeafHash(int64_t* sequence_number,
+                                 std::string* leaf_hash) = 0;
+  };
+
   virtual ~ReadOnlyDatabase() = default;
   ReadOnlyDatabase(const ReadOnlyDatabase&) = delete;
   ReadOnlyDatabase& operator=(const ReadOnlyDatabase&) = delete;
@@ -62,14 +96,57 @@ class ReadOnlyDatabase {
   // Return the tree head with the freshest timestamp.
   virtual LookupResult LatestTreeHead(ct::SignedTreeHead* result) const = 0;
 
-  // Scan the entries, starting with the given index.
+  // Return the compact Merkle tree checkpoint last written with
+  // WriteTreeCheckpoint().
+  virtual LookupResult LatestTreeCheckpoint(
+      ct::CompactTreeCheckpoint* result) const = 0;
+
+  // Scan the entries, starting with the given index. This is a
+  // BULK_SCAN.
   virtual std::unique_ptr<Iterator> ScanEntries(int64_t start_index) const = 0;
 
+  // Append the consecutive entries from |start_index| to |end_index|
+  // (inclusive) to |*entries|, stopping early at the first missing
+  // entry, or before going over |max_bytes| of serialized entries
+  // (the first entry is always read, whatever its size). Databases
+  // read the span in one go, as suits |pattern|; the default
+  // implementation uses ScanEntries().
+  virtual void ReadEntries(int64_t start_index, int64_t end_index,
+                           size_t max_bytes, ReadPattern pattern,
+                           std::vector<LoggedEntry>* entries) const;
+
+  // Asynchronous variant of ReadEntries(), which runs it on
+  // |executor|, so that the caller's thread never waits on storage,
+  // and then returns |task|, with CANCELLED if |task| was cancelled
+  // before the read started.
+  void ReadEntriesAsync(int64_t start_index, int64_t end_index,
+                        size_t max_bytes, ReadPattern pattern,
+                        util::Executor* executor,
+                        std::vector<LoggedEntry>* entries,
+                        util::Task* task) const;
+
+  // Scan the Merkle tree leaf hashes of the entries, starting with
+  // the given index, in the same order as ScanEntries(), as a
+  // BULK_SCAN. Databases
+  // that store the leaf hashes alongside the entries (written by
+  // CreateSequencedEntry()) only read those; the default
+  // implementation reads the entries and hashes them.
+  virtual std::unique_ptr<LeafHashIterator> ScanLeafHashes(
+      int64_t start_index) const;
+
   // Return the number of entries of contiguous entries (what could be
   // put in a signed tree head). This can be greater than the tree
   // size returned by LatestTreeHead.
   virtual int64_t TreeSize() const = 0;
 
+  // Return a sequence number, at most TreeSize(), below which no entry
+  // has an SCT timestamp of |timestamp| or later, so that a read of
+  // the entries logged since then can start there. Entries are only
+  // nearly sequenced in timestamp order, so a few older ones can
+  // follow it. Databases keep a sparse TimestampIndex for this, which
+  // the first call after opening them fills in.
+  virtual int64_t FirstSequenceNumberSince(uint64_t timestamp) const = 0;
+
   // Add/remove a callback to be called when a new tree head is
   // available. The pointer is used as a key, so it should be the same
   // in matching add/remove calls.
@@ -119,6 +196,21 @@ class Database : public ReadOnlyDatabase {
     return CreateSequencedEntry_(logged);
   }
 
+  // Attempt to create several entries, in order, as
+  // CreateSequencedEntry() would, but in as few writes as the
+  // database allows (LevelDB and SQLite use a single one). Stops at
+  // the first entry that cannot be created and returns its result,
+  // in which case the entries before it have been created.
+  WriteResult CreateSequencedEntries(
+      const std::vector<const LoggedEntry*>& entries) {
+    for (const LoggedEntry* logged : entries) {
+      CHECK_NOTNULL(logged);
+      CHECK(logged->has_sequence_number());
+      CHECK_GE(logged->sequence_number(), 0);
+    }
+    return CreateSequencedEntries_(entries);
+  }
+
   // Attempt to write a tree head. Fails only if a tree head with this
   // timestamp already exists (i.e., |timestamp| is primary key). Does
   // not check that the timestamp is newer than previous entries.
@@ -128,16 +220,37 @@ class Database : public ReadOnlyDatabase {
     return WriteTreeHead_(sth);
   }
 
+  // Store |checkpoint|, replacing the previous one. It cannot be for a
+  // larger tree than TreeSize(), so that the entries from there on
+  // can always be appended to the tree it restores.
+  WriteResult WriteTreeCheckpoint(
+      const ct::CompactTreeCheckpoint& checkpoint) {
+    CHECK_GE(checkpoint.tree_size(), 0);
+    CHECK_LE(checkpoint.tree_size(), TreeSize());
+    return WriteTreeCheckpoint_(checkpoint);
+  }
+
  protected:
   Database() = default;
 
   // See the inline methods with similar names defined above for more
   // documentation.
   virtual WriteResult CreateSequencedEntry_(const LoggedEntry& logged) = 0;
+  // The default implementation calls CreateSequencedEntry_() for each
+  // entry.
+  virtual WriteResult CreateSequencedEntries_(
+      const std::vector<const LoggedEntry*>& entries);
   virtual WriteResult WriteTreeHead_(const ct::SignedTreeHead& sth) = 0;
+  virtual WriteResult WriteTreeCheckpoint_(
+      const ct::CompactTreeCheckpoint& checkpoint) = 0;
 };
 
 
+// The number of threads databases should use to index their entries
+// when they are opened.
+int BuildIndexThreadCount();
+
+
 class DatabaseNotifierHelper {
  public:
   typedef std::function<void(const ct::SignedTreeHead&)> NotifySTHCallback;
@@ -0,0 +1,192 @@
+#include <benchmark/benchmark.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stdint.h>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "log/database.h"
+#include "log/file_db.h"
+#include "log/leveldb_db.h"
+#include "log/logged_entry.h"
+#include "log/segment_db.h"
+#include "log/sqlite_db.h"
+#include "log/test_db.h"
+#include "log/test_signer.h"
+#include "proto/cert_serializer.h"
+#include "util/testing.h"
+
+DEFINE_int32(database_bench_entries, 1000000,
+             "Number of entries in the databases read by the lookup and "
+             "scan benchmarks. Each database is filled once, before its "
+             "first benchmark, and takes a few kB of disk per entry (see "
+             "--database_test_dir).");
+
+namespace {
+
+using cert_trans::Database;
+using cert_trans::FileDB;
+using cert_trans::LevelDB;
+using cert_trans::LoggedEntry;
+using cert_trans::SQLiteDB;
+using cert_trans::SegmentDB;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+const int kFillBatchEntries = 1000;
+
+
+class FilledDBBase {
+ public:
+  virtual ~FilledDBBase() = default;
+};
+
+
+// A database of --database_bench_entries entries, and the hashes of
+// those.
+template <class DB>
+class FilledDB : public FilledDBBase {
+ public:
+  FilledDB() {
+    TestSigner signer;
+    vector<LoggedEntry> batch(kFillBatchEntries);
+    for (int64_t next = 0; next < FLAGS_database_bench_entries;) {
+      vector<const LoggedEntry*> to_write;
+      for (LoggedEntry& entry : batch) {
+        if (next == FLAGS_database_bench_entries) {
+          break;
+        }
+        signer.CreateUniqueFakeSignature(&entry);
+        entry.set_sequence_number(next++);
+        hashes_.push_back(entry.Hash());
+        to_write.push_back(&entry);
+      }
+      CHECK_EQ(Database::OK, db()->CreateSequencedEntries(to_write));
+    }
+  }
+
+  // Only one database is kept at once, so as to keep the disk usage
+  // reasonable; the benchmarks of each type of database are run one
+  // after the other.
+  static FilledDB* Get() {
+    static unique_ptr<FilledDBBase>* const current(
+        new unique_ptr<FilledDBBase>);
+    FilledDB* filled(dynamic_cast<FilledDB*>(current->get()));
+    if (!filled) {
+      current->reset();
+      filled = new FilledDB;
+      current->reset(filled);
+    }
+    return filled;
+  }
+
+  DB* db() const {
+    return test_db_.db();
+  }
+
+  const vector<string>& hashes() const {
+    return hashes_;
+  }
+
+ private:
+  TestDB<DB> test_db_;
+  vector<string> hashes_;
+};
+
+
+template <class DB>
+void BM_LookupByIndex(benchmark::State& state) {
+  const FilledDB<DB>* const filled(FilledDB<DB>::Get());
+  std::mt19937 generator;
+  std::uniform_int_distribution<int64_t> index(
+      0, FLAGS_database_bench_entries - 1);
+  LoggedEntry entry;
+  for (auto _ : state) {
+    CHECK_EQ(Database::LOOKUP_OK,
+             filled->db()->LookupByIndex(index(generator), &entry));
+  }
+}
+
+
+template <class DB>
+void BM_LookupByHash(benchmark::State& state) {
+  const FilledDB<DB>* const filled(FilledDB<DB>::Get());
+  std::mt19937 generator;
+  std::uniform_int_distribution<size_t> index(0,
+                                              filled->hashes().size() - 1);
+  LoggedEntry entry;
+  for (auto _ : state) {
+    CHECK_EQ(Database::LOOKUP_OK,
+             filled->db()->LookupByHash(filled->hashes()[index(generator)],
+                                        &entry));
+  }
+}
+
+
+// Each iteration reads one entry, starting over at the end.
+template <class DB>
+void BM_ScanEntries(benchmark::State& state) {
+  const FilledDB<DB>* const filled(FilledDB<DB>::Get());
+  unique_ptr<Database::Iterator> it(filled->db()->ScanEntries(0));
+  LoggedEntry entry;
+  for (auto _ : state) {
+    if (!it->GetNextEntry(&entry)) {
+      it = filled->db()->ScanEntries(0);
+      CHECK(it->GetNextEntry(&entry));
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+
+// Each iteration creates a batch of entries (of the size given by the
+// argument) in an initially empty database.
+template <class DB>
+void BM_CreateSequencedEntries(benchmark::State& state) {
+  TestDB<DB> test_db;
+  TestSigner signer;
+  vector<LoggedEntry> batch(state.range(0));
+  vector<const LoggedEntry*> to_write;
+  for (const LoggedEntry& entry : batch) {
+    to_write.push_back(&entry);
+  }
+  int64_t next(0);
+  for (auto _ : state) {
+    state.PauseTiming();
+    for (LoggedEntry& entry : batch) {
+      signer.CreateUniqueFakeSignature(&entry);
+      entry.set_sequence_number(next++);
+    }
+    state.ResumeTiming();
+    CHECK_EQ(Database::OK, test_db.db()->CreateSequencedEntries(to_write));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+
+#define DATABASE_BENCHMARKS(DB)                                     \
+  BENCHMARK_TEMPLATE(BM_LookupByIndex, DB);                         \
+  BENCHMARK_TEMPLATE(BM_LookupByHash, DB);                          \
+  BENCHMARK_TEMPLATE(BM_ScanEntries, DB);                           \
+  BENCHMARK_TEMPLATE(BM_CreateSequencedEntries, DB)->Arg(1)->Arg(1000)
+
+DATABASE_BENCHMARKS(FileDB);
+DATABASE_BENCHMARKS(SQLiteDB);
+DATABASE_BENCHMARKS(LevelDB);
+DATABASE_BENCHMARKS(SegmentDB);
+
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  ConfigureSerializerForV1CT();
+  CHECK_GT(FLAGS_database_bench_entries, 0);
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -4,14 +4,18 @@
 #include <gtest/gtest.h>
 #include <stdlib.h>
 #include <sys/resource.h>
+#include <limits>
+#include <memory>
 #include <set>
 #include <string>
+#include <vector>
 
 #include "log/database.h"
 #include "log/file_db.h"
 #include "log/file_storage.h"
 #include "log/leveldb_db.h"
 #include "log/logged_entry.h"
+#include "log/segment_db.h"
 #include "log/sqlite_db.h"
 #include "log/test_db.h"
 #include "log/test_signer.h"
@@ -24,6 +28,13 @@ DEFINE_int32(database_size, 100,
              "choosing this, as the database will fill up your disk (entries "
              "are a few kB each). Maximum is limited to 1 000 000. Also note "
              "that SQLite may be very slow with small batch sizes.");
+DEFINE_int32(tree_head_interval, 1000,
+             "Number of entries between tree heads, in the LevelDB "
+             "profile benchmarks.");
+
+DECLARE_int32(leveldb_block_cache_mb);
+DECLARE_bool(leveldb_compression);
+DECLARE_bool(leveldb_separate_entries);
 
 namespace {
 
@@ -32,7 +43,12 @@ using cert_trans::FileDB;
 using cert_trans::LevelDB;
 using cert_trans::LoggedEntry;
 using cert_trans::SQLiteDB;
+using cert_trans::SegmentDB;
+using std::numeric_limits;
 using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
 
 
 template <class T>
@@ -63,6 +79,16 @@ class LargeDBTest : public ::testing::Test {
     return num;
   }
 
+  int ScanAllEntries() {
+    unique_ptr<Database::Iterator> it(this->db()->ScanEntries(0));
+    LoggedEntry entry;
+    int num(0);
+    while (it->GetNextEntry(&entry)) {
+      ++num;
+    }
+    return num;
+  }
+
   T* db() const {
     return test_db_.db();
   }
@@ -71,7 +97,7 @@ class LargeDBTest : public ::testing::Test {
   TestSigner test_signer_;
 };
 
-typedef testing::Types<FileDB, SQLiteDB, LevelDB> Databases;
+typedef testing::Types<FileDB, SQLiteDB, LevelDB, SegmentDB> Databases;
 
 TYPED_TEST_CASE(LargeDBTest, Databases);
 
@@ -109,8 +135,120 @@ TYPED_TEST(LargeDBTest, Benchmark) {
   LOG(INFO) << "Peak RSS delta (as reported by getrusage()) was "
             << ru_after.ru_maxrss - ru_before.ru_maxrss << " kB";
   FLAGS_minloglevel = original_log_level;
+
+  // Iterators used to look up each entry by index, as above, so
+  // compare with that.
+  realtime_before = util::TimeInMilliseconds();
+  CHECK_EQ(FLAGS_database_size, this->ScanAllEntries());
+  realtime_after = util::TimeInMilliseconds();
+
+  FLAGS_minloglevel = 0;
+  LOG(INFO) << "Real time spent scanning " << FLAGS_database_size
+            << " entries: " << realtime_after - realtime_before << " ms";
+  FLAGS_minloglevel = original_log_level;
 }
 
+
+struct LevelDBProfile {
+  const char* name;
+  int block_cache_mb;
+  bool compression;
+  bool separate_entries;
+};
+
+
+// Fills a LevelDB database with entries, with tree heads in between
+// as the signer would write them, and reads it back, with the leveldb
+// flags of each profile in turn.
+class LevelDBProfileTest : public ::testing::TestWithParam<LevelDBProfile> {
+ protected:
+  LevelDBProfileTest()
+      : block_cache_mb_(FLAGS_leveldb_block_cache_mb),
+        compression_(FLAGS_leveldb_compression),
+        separate_entries_(FLAGS_leveldb_separate_entries) {
+  }
+
+  void SetUp() override {
+    FLAGS_leveldb_block_cache_mb = GetParam().block_cache_mb;
+    FLAGS_leveldb_compression = GetParam().compression;
+    FLAGS_leveldb_separate_entries = GetParam().separate_entries;
+    test_db_.reset(new TestDB<LevelDB>);
+  }
+
+  void TearDown() override {
+    test_db_.reset();
+    FLAGS_leveldb_block_cache_mb = block_cache_mb_;
+    FLAGS_leveldb_compression = compression_;
+    FLAGS_leveldb_separate_entries = separate_entries_;
+  }
+
+  LevelDB* db() const {
+    return test_db_->db();
+  }
+
+  void LogTime(const string& what, uint64_t realtime_before) {
+    const int original_log_level(FLAGS_minloglevel);
+    FLAGS_minloglevel = 0;
+    LOG(INFO) << GetParam().name << ": real time spent " << what << ": "
+              << util::TimeInMilliseconds() - realtime_before << " ms";
+    FLAGS_minloglevel = original_log_level;
+  }
+
+  const int block_cache_mb_;
+  const bool compression_;
+  const bool separate_entries_;
+  unique_ptr<TestDB<LevelDB>> test_db_;
+  TestSigner test_signer_;
+};
+
+
+TEST_P(LevelDBProfileTest, Benchmark) {
+  const int entries(FLAGS_database_size);
+  vector<string> hashes;
+  hashes.reserve(entries);
+
+  uint64_t realtime_before(util::TimeInMilliseconds());
+  LoggedEntry logged_cert;
+  for (int i = 0; i < entries; ++i) {
+    test_signer_.CreateUniqueFakeSignature(&logged_cert);
+    logged_cert.set_sequence_number(i);
+    ASSERT_EQ(Database::OK, db()->CreateSequencedEntry(logged_cert));
+    hashes.push_back(logged_cert.Hash());
+    if ((i + 1) % FLAGS_tree_head_interval == 0) {
+      ct::SignedTreeHead sth;
+      sth.set_timestamp(i + 1);
+      sth.set_tree_size(i + 1);
+      ASSERT_EQ(Database::OK, db()->WriteTreeHead(sth));
+    }
+  }
+  LogTime("creating " + to_string(entries) + " entries",
+          realtime_before);
+
+  realtime_before = util::TimeInMilliseconds();
+  vector<LoggedEntry> read_entries;
+  db()->ReadEntries(0, entries - 1, numeric_limits<size_t>::max(),
+                    Database::BULK_SCAN, &read_entries);
+  ASSERT_EQ(static_cast<size_t>(entries), read_entries.size());
+  LogTime("reading the entries in order", realtime_before);
+
+  realtime_before = util::TimeInMilliseconds();
+  for (const string& hash : hashes) {
+    ASSERT_EQ(Database::LOOKUP_OK, db()->LookupByHash(hash, &logged_cert));
+  }
+  LogTime("looking up the entries by hash", realtime_before);
+}
+
+
+const LevelDBProfile kLevelDBProfiles[] = {
+    {"default", 0, true, false},
+    {"uncompressed", 0, false, false},
+    {"separate_entries", 0, true, true},
+    {"separate_entries_64mb_cache", 64, true, true},
+};
+
+INSTANTIATE_TEST_CASE_P(Profiles, LevelDBProfileTest,
+                        ::testing::ValuesIn(kLevelDBProfiles));
+
 }  // namespace
 
 int main(int argc, char** argv) {
@@ -1,32 +1,65 @@
 /* -*- indent-tabs-mode: nil -*- */
+#include "config.h"
+
+#include <gflags/gflags.h>
 #include <gtest/gtest.h>
+#include <chrono>
 #include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include "base/notification.h"
+#include "log/caching_database.h"
+#include "log/chain_dedup_database.h"
 #include "log/database.h"
 #include "log/file_db.h"
 #include "log/file_storage.h"
 #include "log/leveldb_db.h"
 #include "log/logged_entry.h"
+#ifdef HAVE_ROCKSDB
+#include "log/rocksdb_db.h"
+#endif
+#include "log/segment_db.h"
 #include "log/sqlite_db.h"
 #include "log/test_db.h"
 #include "log/test_signer.h"
+#include "log/timestamp_index.h"
 #include "proto/cert_serializer.h"
+#include "util/status_test_util.h"
+#include "util/sync_task.h"
 #include "util/testing.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
+DECLARE_int32(sqlite_checkpoint_interval_ms);
+DECLARE_int32(sqlite_checkpoint_restart_wal_mb);
+DECLARE_int32(sqlite_mmap_size_mb);
+
 // TODO(benl): Introduce a test |Logged| type.
 
 namespace {
 
+using cert_trans::CachingDatabase;
+using cert_trans::ChainDedupDatabase;
 using cert_trans::Database;
 using cert_trans::FileDB;
 using cert_trans::LevelDB;
 using cert_trans::LoggedEntry;
+using cert_trans::Notification;
+#ifdef HAVE_ROCKSDB
+using cert_trans::RocksDB;
+#endif
 using cert_trans::SQLiteDB;
+using cert_trans::SegmentDB;
+using cert_trans::ThreadPool;
+using cert_trans::TimestampIndex;
+using ct::CompactTreeCheckpoint;
 using ct::SignedTreeHead;
 using std::string;
 using std::unique_ptr;
+using std::vector;
+using util::SyncTask;
 
 
 template <class T>
@@ -46,7 +79,12 @@ class DBTest : public ::testing::Test {
   TestSigner test_signer_;
 };
 
-typedef testing::Types<FileDB, SQLiteDB, LevelDB> Databases;
+typedef testing::Types<FileDB, SQLiteDB, LevelDB,
+#ifdef HAVE_ROCKSDB
+                       RocksDB,
+#endif
+                       SegmentDB, CachingDatabase, ChainDedupDatabase>
+    Databases;
 
 
 template <class T>
@@ -172,6 +210,51 @@ TYPED_TEST(DBTest, CreateSequencedDuplicateSequenceNumber) {
 }
 
 
+TYPED_TEST(DBTest, CreateSequencedEntries) {
+  const int64_t kCount(5);
+  vector<LoggedEntry> logged_certs(kCount + 1);
+  vector<const LoggedEntry*> batch;
+  for (int64_t seq = 0; seq < kCount; ++seq) {
+    this->test_signer_.CreateUnique(&logged_certs[seq]);
+    logged_certs[seq].set_sequence_number(seq);
+    batch.push_back(&logged_certs[seq]);
+  }
+  // The same entry twice in a batch is fine.
+  batch.push_back(&logged_certs[1]);
+
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntries(batch));
+  EXPECT_EQ(kCount, this->db()->TreeSize());
+  for (int64_t seq = 0; seq < kCount; ++seq) {
+    LoggedEntry lookup_cert;
+    EXPECT_EQ(Database::LOOKUP_OK,
+              this->db()->LookupByHash(logged_certs[seq].Hash(),
+                                       &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(logged_certs[seq], lookup_cert);
+  }
+
+  // Writing entries again is fine too, but stops at the first entry
+  // to reuse a sequence number.
+  LoggedEntry duplicate_seq;
+  this->test_signer_.CreateUnique(&duplicate_seq);
+  duplicate_seq.set_sequence_number(2);
+  this->test_signer_.CreateUnique(&logged_certs[kCount]);
+  logged_certs[kCount].set_sequence_number(kCount);
+  EXPECT_EQ(Database::SEQUENCE_NUMBER_ALREADY_IN_USE,
+            this->db()->CreateSequencedEntries(
+                {&logged_certs[0], &duplicate_seq, &logged_certs[kCount]}));
+  LoggedEntry lookup_cert;
+  EXPECT_EQ(Database::NOT_FOUND,
+            this->db()->LookupByHash(duplicate_seq.Hash(), &lookup_cert));
+  EXPECT_EQ(Database::NOT_FOUND,
+            this->db()->LookupByIndex(kCount, &lookup_cert));
+
+  EXPECT_EQ(Database::OK,
+            this->db()->CreateSequencedEntries({&logged_certs[kCount]}));
+  EXPECT_EQ(kCount + 1, this->db()->TreeSize());
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntries({}));
+}
+
+
 TYPED_TEST(DBTest, TreeSize) {
   LoggedEntry logged_cert;
 
@@ -299,6 +382,37 @@ TYPED_TEST(DBTest, WriteTreeHeadOlderTimestamp) {
 }
 
 
+TYPED_TEST(DBTest, WriteTreeCheckpoint) {
+  LoggedEntry logged_cert;
+  this->test_signer_.CreateUnique(&logged_cert);
+  logged_cert.set_sequence_number(0);
+  EXPECT_EQ(Database::OK, this->db()->CreateSequencedEntry(logged_cert));
+
+  CompactTreeCheckpoint checkpoint, checkpoint2, lookup_checkpoint;
+  EXPECT_EQ(Database::NOT_FOUND,
+            this->db()->LatestTreeCheckpoint(&lookup_checkpoint));
+
+  checkpoint.set_tree_size(0);
+  EXPECT_EQ(Database::OK, this->db()->WriteTreeCheckpoint(checkpoint));
+  checkpoint2.set_tree_size(1);
+  checkpoint2.add_frontier("leaf hash");
+  checkpoint2.set_sha256_root_hash("leaf hash");
+  EXPECT_EQ(Database::OK, this->db()->WriteTreeCheckpoint(checkpoint2));
+
+  EXPECT_EQ(Database::LOOKUP_OK,
+            this->db()->LatestTreeCheckpoint(&lookup_checkpoint));
+  EXPECT_EQ(checkpoint2.SerializeAsString(),
+            lookup_checkpoint.SerializeAsString());
+
+  // It is kept across restarts.
+  unique_ptr<Database> db2(this->test_db_.SecondDB());
+  lookup_checkpoint.Clear();
+  EXPECT_EQ(Database::LOOKUP_OK, db2->LatestTreeCheckpoint(&lookup_checkpoint));
+  EXPECT_EQ(checkpoint2.SerializeAsString(),
+            lookup_checkpoint.SerializeAsString());
+}
+
+
 TYPED_TEST(DBTest, Resume) {
   LoggedEntry logged_cert, logged_cert2, lookup_cert, lookup_cert2;
   const int64_t kSeq1(129);
@@ -428,6 +542,247 @@ TYPED_TEST(DBTest, Iterator) {
 }
 
 
+TYPED_TEST(DBTest, ScanLeafHashes) {
+  // More than fits in one batch read by some of the databases, and
+  // with a gap.
+  const int64_t kCount(2500);
+  const int64_t kGap(1500);
+  std::vector<string> leaf_hashes;
+  for (int64_t seq = 0; seq < kCount; ++seq) {
+    LoggedEntry logged_cert;
+    this->test_signer_.CreateUnique(&logged_cert);
+    logged_cert.set_sequence_number(seq);
+    leaf_hashes.emplace_back();
+    ASSERT_TRUE(logged_cert.LeafHash(&leaf_hashes.back()));
+    if (seq != kGap) {
+      ASSERT_EQ(Database::OK, this->db()->CreateSequencedEntry(logged_cert));
+    }
+  }
+
+  unique_ptr<Database::LeafHashIterator> it(this->db()->ScanLeafHashes(0));
+  int64_t seq;
+  string leaf_hash;
+  for (int64_t i = 0; i < kCount; ++i) {
+    if (i == kGap) {
+      continue;
+    }
+    ASSERT_TRUE(it->GetNextLeafHash(&seq, &leaf_hash));
+    ASSERT_EQ(i, seq);
+    ASSERT_EQ(leaf_hashes[i], leaf_hash);
+  }
+  EXPECT_FALSE(it->GetNextLeafHash(&seq, &leaf_hash));
+
+  // The leaf hashes are persisted.
+  unique_ptr<Database> db2(this->test_db_.SecondDB());
+  it = db2->ScanLeafHashes(kGap);
+  ASSERT_TRUE(it->GetNextLeafHash(&seq, &leaf_hash));
+  EXPECT_EQ(kGap + 1, seq);
+  EXPECT_EQ(leaf_hashes[kGap + 1], leaf_hash);
+
+  it = db2->ScanLeafHashes(kCount);
+  EXPECT_FALSE(it->GetNextLeafHash(&seq, &leaf_hash));
+}
+
+
+TYPED_TEST(DBTest, ReadEntries) {
+  const int64_t kCount(10);
+  const int64_t kGap(7);
+  vector<LoggedEntry> logged_certs;
+  for (int64_t seq = 0; seq < kCount; ++seq) {
+    logged_certs.emplace_back();
+    this->test_signer_.CreateUnique(&logged_certs.back());
+    logged_certs.back().set_sequence_number(seq);
+    if (seq != kGap) {
+      ASSERT_EQ(Database::OK,
+                this->db()->CreateSequencedEntry(logged_certs.back()));
+    }
+  }
+
+  vector<LoggedEntry> entries;
+  this->db()->ReadEntries(2, 4, 1 << 20, Database::POINT_READ, &entries);
+  ASSERT_EQ(3U, entries.size());
+  for (int64_t i = 0; i < 3; ++i) {
+    TestSigner::TestEqualLoggedCerts(logged_certs[2 + i], entries[i]);
+  }
+
+  // The read pattern only changes how the entries are read.
+  entries.clear();
+  this->db()->ReadEntries(2, 4, 1 << 20, Database::BULK_SCAN, &entries);
+  ASSERT_EQ(3U, entries.size());
+  for (int64_t i = 0; i < 3; ++i) {
+    TestSigner::TestEqualLoggedCerts(logged_certs[2 + i], entries[i]);
+  }
+
+  // Reading stops at the gap, and appends to what is there.
+  this->db()->ReadEntries(5, kCount, 1 << 20, Database::POINT_READ, &entries);
+  ASSERT_EQ(5U, entries.size());
+  EXPECT_EQ(6, entries.back().sequence_number());
+
+  entries.clear();
+  this->db()->ReadEntries(kGap, kCount, 1 << 20, Database::POINT_READ,
+                          &entries);
+  EXPECT_TRUE(entries.empty());
+  this->db()->ReadEntries(kCount, kCount + 5, 1 << 20, Database::POINT_READ,
+                          &entries);
+  EXPECT_TRUE(entries.empty());
+
+  // The first entry is returned however big it is, but no more.
+  this->db()->ReadEntries(0, 5, 1, Database::POINT_READ, &entries);
+  ASSERT_EQ(1U, entries.size());
+  TestSigner::TestEqualLoggedCerts(logged_certs[0], entries[0]);
+
+  entries.clear();
+  ThreadPool pool(1);
+  SyncTask task(&pool);
+  this->db()->ReadEntriesAsync(8, kCount, 1 << 20, Database::POINT_READ,
+                               &pool, &entries, task.task());
+  task.Wait();
+  EXPECT_OK(task.status());
+  ASSERT_EQ(2U, entries.size());
+  TestSigner::TestEqualLoggedCerts(logged_certs[8], entries[0]);
+  TestSigner::TestEqualLoggedCerts(logged_certs[9], entries[1]);
+}
+
+
+TYPED_TEST(DBTest, FirstSequenceNumberSince) {
+  const int64_t kBlock(TimestampIndex::kBlockSize);
+  const int64_t kCount(2 * kBlock + 10);
+  // One entry of the first block is timestamped well after the others
+  // around it.
+  const int64_t kLate(3);
+  const uint64_t kLateTimestamp(1000 + 10 * (kBlock + 50));
+  EXPECT_EQ(0, this->db()->FirstSequenceNumberSince(0));
+
+  vector<LoggedEntry> logged_certs(kCount);
+  vector<const LoggedEntry*> batch;
+  for (int64_t seq = 0; seq < kCount; ++seq) {
+    this->test_signer_.CreateUnique(&logged_certs[seq]);
+    logged_certs[seq].set_sequence_number(seq);
+    logged_certs[seq].mutable_sct()->set_timestamp(
+        seq == kLate ? kLateTimestamp : 1000 + 10 * seq);
+    // Half of them in a batch.
+    if (seq < kCount / 2) {
+      ASSERT_EQ(Database::OK,
+                this->db()->CreateSequencedEntry(logged_certs[seq]));
+    } else {
+      batch.push_back(&logged_certs[seq]);
+    }
+  }
+  ASSERT_EQ(Database::OK, this->db()->CreateSequencedEntries(batch));
+
+  const auto check([=](const Database* db) {
+    EXPECT_EQ(0, db->FirstSequenceNumberSince(0));
+    EXPECT_EQ(0, db->FirstSequenceNumberSince(1000 + 10 * (kBlock - 1)));
+    // The late entry is still to be read.
+    EXPECT_EQ(0, db->FirstSequenceNumberSince(1000 + 10 * kBlock));
+    EXPECT_EQ(0, db->FirstSequenceNumberSince(kLateTimestamp));
+    EXPECT_EQ(kBlock, db->FirstSequenceNumberSince(kLateTimestamp + 1));
+    EXPECT_EQ(2 * kBlock,
+              db->FirstSequenceNumberSince(1000 + 10 * (kCount - 1)));
+    EXPECT_EQ(kCount, db->FirstSequenceNumberSince(1000 + 10 * kCount));
+  });
+  // Indexed as they were written, then read back after a restart.
+  check(this->db());
+  // This commits the entries, for SQLite.
+  SignedTreeHead sth;
+  sth.set_timestamp(1);
+  sth.set_tree_size(kCount);
+  ASSERT_EQ(Database::OK, this->db()->WriteTreeHead(sth));
+  unique_ptr<Database> db2(this->test_db_.SecondDB());
+  check(db2.get());
+}
+
+
+// Lookups of committed entries go to the read connections, the others
+// to the writer's, which must see everything either way.
+TEST(SQLiteDBTest, ReadConnections) {
+  TestDB<SQLiteDB> test_db;
+  TestSigner test_signer;
+  const int64_t kCount(20);
+  vector<LoggedEntry> logged_certs(2 * kCount);
+  for (int64_t seq = 0; seq < kCount; ++seq) {
+    test_signer.CreateUnique(&logged_certs[seq]);
+    logged_certs[seq].set_sequence_number(seq);
+    ASSERT_EQ(Database::OK,
+              test_db.db()->CreateSequencedEntry(logged_certs[seq]));
+  }
+
+  SignedTreeHead sth;
+  sth.set_timestamp(1);
+  sth.set_tree_size(kCount);
+  ASSERT_EQ(Database::OK, test_db.db()->WriteTreeHead(sth));
+  EXPECT_EQ(kCount, test_db.db()->TreeSize());
+
+  // These are not committed.
+  for (int64_t seq = kCount; seq < 2 * kCount; ++seq) {
+    test_signer.CreateUnique(&logged_certs[seq]);
+    logged_certs[seq].set_sequence_number(seq);
+    ASSERT_EQ(Database::OK,
+              test_db.db()->CreateSequencedEntry(logged_certs[seq]));
+  }
+
+  ThreadPool pool(4);
+  vector<Notification> done(8);
+  for (Notification& notification : done) {
+    pool.Add([&test_db, &logged_certs, &notification]() {
+      LoggedEntry lookup_cert;
+      for (int64_t seq = 0; seq < 2 * kCount; ++seq) {
+        EXPECT_EQ(Database::LOOKUP_OK,
+                  test_db.db()->LookupByHash(logged_certs[seq].Hash(),
+                                             &lookup_cert));
+        TestSigner::TestEqualLoggedCerts(logged_certs[seq], lookup_cert);
+        EXPECT_EQ(Database::LOOKUP_OK,
+                  test_db.db()->LookupByIndex(seq, &lookup_cert));
+        TestSigner::TestEqualLoggedCerts(logged_certs[seq], lookup_cert);
+      }
+      vector<LoggedEntry> entries;
+      test_db.db()->ReadEntries(0, 2 * kCount - 1, 1 << 20,
+                                Database::POINT_READ, &entries);
+      EXPECT_EQ(static_cast<size_t>(2 * kCount), entries.size());
+      notification.Notify();
+    });
+  }
+  for (const Notification& notification : done) {
+    notification.WaitForNotification();
+  }
+}
+
+
+// With a checkpoint thread, the writer commits without checkpointing,
+// and nothing is lost.
+TEST(SQLiteDBTest, BackgroundCheckpoints) {
+  FLAGS_sqlite_checkpoint_interval_ms = 1;
+  FLAGS_sqlite_checkpoint_restart_wal_mb = 0;
+  FLAGS_sqlite_mmap_size_mb = 1;
+  TestDB<SQLiteDB> test_db;
+  TestSigner test_signer;
+  const int64_t kCount(20);
+  vector<LoggedEntry> logged_certs(kCount);
+  for (int64_t seq = 0; seq < kCount; ++seq) {
+    test_signer.CreateUnique(&logged_certs[seq]);
+    logged_certs[seq].set_sequence_number(seq);
+    ASSERT_EQ(Database::OK,
+              test_db.db()->CreateSequencedEntry(logged_certs[seq]));
+    SignedTreeHead sth;
+    sth.set_timestamp(seq + 1);
+    sth.set_tree_size(seq + 1);
+    ASSERT_EQ(Database::OK, test_db.db()->WriteTreeHead(sth));
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  unique_ptr<SQLiteDB> db2(test_db.SecondDB());
+  EXPECT_EQ(kCount, db2->TreeSize());
+  LoggedEntry lookup_cert;
+  for (int64_t seq = 0; seq < kCount; ++seq) {
+    EXPECT_EQ(Database::LOOKUP_OK, db2->LookupByIndex(seq, &lookup_cert));
+    TestSigner::TestEqualLoggedCerts(logged_certs[seq], lookup_cert);
+  }
+  FLAGS_sqlite_checkpoint_interval_ms = 0;
+  FLAGS_sqlite_checkpoint_restart_wal_mb = 64;
+  FLAGS_sqlite_mmap_size_mb = 0;
+}
+
+
 }  // namespace
 
 
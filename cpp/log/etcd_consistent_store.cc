@@ -2,6 +2,11 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+#include <algorithm>
 #include <chrono>
 #include <unordered_map>
 #include <vector>
@@ -13,6 +18,7 @@
 #include "util/etcd_delete.h"
 #include "util/executor.h"
 #include "util/masterelection.h"
+#include "util/sequential_for.h"
 #include "util/util.h"
 
 using ct::ClusterConfig;
@@ -21,11 +27,16 @@ using ct::SequenceMapping;
 using ct::SignedTreeHead;
 using std::bind;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::lock_guard;
+using std::make_shared;
 using std::map;
+using std::max;
+using std::min;
 using std::move;
 using std::mutex;
 using std::placeholders::_1;
+using std::shared_ptr;
 using std::string;
 using std::unique_lock;
 using std::unique_ptr;
@@ -43,6 +54,22 @@ DEFINE_int32(etcd_stats_collection_interval_seconds, 2,
              "Number of seconds between fetches of etcd stats.");
 DEFINE_int32(node_state_ttl_seconds, 60,
              "TTL in seconds on the node state files.");
+DEFINE_int32(etcd_cleanup_batch_size, 10000,
+             "Maximum number of old entries removed from etcd by each "
+             "cleanup run.");
+DEFINE_int32(etcd_cleanup_max_deletes_per_second, 0,
+             "If greater than 0, the rate at which cleanup runs remove old "
+             "entries from etcd is kept under this, to leave room for other "
+             "requests.");
+DEFINE_int32(etcd_sequence_mapping_chunk_size, 1000,
+             "Number of sequence numbers covered by each of the chunks the "
+             "sequence mapping is stored in.");
+DEFINE_bool(etcd_compress_values, false,
+            "Compress the values written to etcd (mostly, the pending "
+            "entries and their chains) with zlib, when it makes them "
+            "smaller. Compressed values are always readable, but this "
+            "should only be turned on once all the nodes are of a version "
+            "that can read them.");
 
 namespace cert_trans {
 namespace {
@@ -51,6 +78,7 @@ namespace {
 const char kClusterConfigFile[] = "/cluster_config";
 const char kEntriesDir[] = "/entries/";
 const char kSequenceFile[] = "/sequence_mapping";
+const char kSequenceChunksDir[] = "/sequence_mapping_chunks/";
 const char kServingSthFile[] = "/serving_sth";
 const char kNodesDir[] = "/nodes/";
 
@@ -75,11 +103,82 @@ static Counter<string>* etcd_rejected_requests =
                          "Total number of requests rejected due to overload, "
                          "broken down by request type.");
 
+static Counter<string>* etcd_coalesced_requests =
+    Counter<string>::New("etcd_coalesced_requests", "type",
+                         "Total number of requests answered by another "
+                         "identical one already in flight, broken down by "
+                         "request type.");
+
 static Latency<std::chrono::milliseconds, string> etcd_latency_by_op_ms(
     "etcd_latency_by_op_ms", "operation",
     "Etcd latency in ms broken down by operation.");
 
 
+// Marks compressed values. No serialized protobuf starts with a zero
+// byte, as field numbers start at 1.
+const char kCompressedValuePrefix('\0');
+
+
+// Feeds |size| bytes at |data| to |stream|, and appends whatever
+// comes out to |out|. Returns true if the end of the stream was
+// reached, false if not or if the data is corrupt.
+template <int (*Process)(z_stream*, int)>
+bool ZlibProcess(z_stream* stream, const char* data, size_t size, int flush,
+                 string* out) {
+  stream->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+  stream->avail_in = size;
+  int ret;
+  do {
+    char buf[16 * 1024];
+    stream->next_out = reinterpret_cast<Bytef*>(buf);
+    stream->avail_out = sizeof(buf);
+    ret = Process(stream, flush);
+    // Z_BUF_ERROR only means that there was nothing to do.
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+      return false;
+    }
+    out->append(buf, sizeof(buf) - stream->avail_out);
+  } while (stream->avail_out == 0);
+  return ret == Z_STREAM_END;
+}
+
+
+// Values are stored base64-encoded, compressed first with
+// --etcd_compress_values if that saves anything.
+string EncodeValue(const string& flat_value) {
+  if (FLAGS_etcd_compress_values) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    CHECK_EQ(deflateInit(&stream, Z_DEFAULT_COMPRESSION), Z_OK);
+    string compressed(1, kCompressedValuePrefix);
+    CHECK(ZlibProcess<deflate>(&stream, flat_value.data(), flat_value.size(),
+                               Z_FINISH, &compressed));
+    CHECK_EQ(deflateEnd(&stream), Z_OK);
+    if (compressed.size() < flat_value.size()) {
+      return ToBase64(compressed);
+    }
+  }
+  return ToBase64(flat_value);
+}
+
+
+string DecodeNodeValue(const EtcdClient::Node& node) {
+  const string value(FromBase64(node.value_.data(), node.value_.size()));
+  if (value.empty() || value[0] != kCompressedValuePrefix) {
+    return value;
+  }
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  CHECK_EQ(inflateInit(&stream), Z_OK);
+  string flat_value;
+  CHECK(ZlibProcess<inflate>(&stream, value.data() + 1, value.size() - 1,
+                             Z_NO_FLUSH, &flat_value))
+      << "corrupt compressed value at " << node.key_;
+  CHECK_EQ(inflateEnd(&stream), Z_OK);
+  return flat_value;
+}
+
+
 // TODO(pphaneuf): Hmm, I think this should check that it's not just
 // ordered, but contiguous?
 void CheckMappingIsOrdered(const SequenceMapping& mapping) {
@@ -146,7 +245,10 @@ EtcdConsistentStore::EtcdConsistentStore(
       etcd_stats_task_(executor_),
       received_initial_sth_(false),
       exiting_(false),
-      num_etcd_entries_(0) {
+      num_etcd_entries_(0),
+      cleaned_up_to_(-1) {
+  CHECK_GT(FLAGS_etcd_sequence_mapping_chunk_size, 0);
+  CHECK_GT(FLAGS_etcd_cleanup_batch_size, 0);
   // Set up watches on things we're interested in...
   WatchServingSTH(bind(&EtcdConsistentStore::OnEtcdServingSTHUpdated, this,
                        _1),
@@ -203,12 +305,14 @@ StatusOr<int64_t> EtcdConsistentStore::NextAvailableSequenceNumber() const {
            1;
   }
 
-  if (!serving_sth_) {
+  const shared_ptr<const SignedTreeHead> serving_sth(
+      std::atomic_load(&serving_sth_cache_));
+  if (!serving_sth) {
     LOG(WARNING) << "Log has no Serving STH [new log?], returning 0";
     return 0;
   }
 
-  return serving_sth_->Entry().tree_size();
+  return serving_sth->tree_size();
 }
 
 
@@ -269,9 +373,10 @@ Status EtcdConsistentStore::SetServingSTH(const SignedTreeHead& new_sth) {
 
 
 StatusOr<SignedTreeHead> EtcdConsistentStore::GetServingSTH() const {
-  lock_guard<mutex> lock(mutex_);
-  if (serving_sth_) {
-    return serving_sth_->Entry();
+  const shared_ptr<const SignedTreeHead> serving_sth(
+      std::atomic_load(&serving_sth_cache_));
+  if (serving_sth) {
+    return *serving_sth;
   } else {
     return Status(util::error::NOT_FOUND, "No current Serving STH.");
   }
@@ -303,38 +408,118 @@ bool LeafEntriesMatch(const LoggedEntry& a, const LoggedEntry& b) {
 
 
 Status EtcdConsistentStore::AddPendingEntry(LoggedEntry* entry) {
-  ScopedLatency scoped_latency(
-      etcd_latency_by_op_ms.GetScopedLatency("add_pending_entry"));
+  SyncTask task(executor_);
+  AddPendingEntryAsync(entry, task.task());
+  task.Wait();
+  return task.status();
+}
+
 
+void EtcdConsistentStore::AddPendingEntryAsync(LoggedEntry* entry,
+                                               Task* task) {
   CHECK_NOTNULL(entry);
+  CHECK_NOTNULL(task);
   CHECK(!entry->has_sequence_number());
 
-  Status status(MaybeReject("add_pending_entry"));
+  const steady_clock::time_point started(steady_clock::now());
+  task->CleanupWhenDone([started]() {
+    etcd_latency_by_op_ms.RecordLatency("add_pending_entry",
+                                        steady_clock::now() - started);
+  });
+
+  const Status status(MaybeReject("add_pending_entry"));
   if (!status.ok()) {
-    return status;
+    task->Return(status);
+    return;
   }
 
   const string full_path(GetEntryPath(*entry));
-  EntryHandle<LoggedEntry> handle(full_path, *entry);
-  status = CreateEntry(&handle);
-  if (status.CanonicalCode() == util::error::FAILED_PRECONDITION) {
-    // Entry with that hash already exists.
-    EntryHandle<LoggedEntry> preexisting_entry;
-    status = GetEntry(full_path, &preexisting_entry);
-    if (!status.ok()) {
-      LOG(ERROR) << "Couldn't create or fetch " << full_path << " : "
-                 << status;
-      return status;
+  {
+    lock_guard<mutex> lock(pending_adds_lock_);
+    const auto it(pending_adds_.find(full_path));
+    if (it != pending_adds_.end()) {
+      // Someone else is already adding this entry, their answer is ours.
+      etcd_coalesced_requests->Increment("add_pending_entry");
+      it->second.emplace_back(entry, task);
+      return;
     }
+    pending_adds_.emplace(full_path, PendingAdd());
+  }
+
+  string flat_entry;
+  CHECK(entry->SerializeToString(&flat_entry));
+  EtcdClient::Response* const resp(new EtcdClient::Response);
+  task->DeleteWhenDone(resp);
+  client_->Create(full_path, EncodeValue(flat_entry), resp,
+                  task->AddChild(bind(&EtcdConsistentStore::PendingEntryCreated,
+                                      this, full_path, entry, task, _1)));
+}
+
 
-    // Check the leaf certs are the same (we might be seeing the same cert
-    // submitted with a different chain.)
-    CHECK(LeafEntriesMatch(preexisting_entry.Entry(), *entry));
-    *entry->mutable_sct() = preexisting_entry.Entry().sct();
-    return Status(util::error::ALREADY_EXISTS,
-                  "Pending entry already exists.");
+void EtcdConsistentStore::PendingEntryCreated(const string& full_path,
+                                              LoggedEntry* entry, Task* task,
+                                              Task* create_task) {
+  if (create_task->status().CanonicalCode() !=
+      util::error::FAILED_PRECONDITION) {
+    FinishPendingAdd(full_path, *entry, create_task->status(), task);
+    return;
   }
-  return status;
+
+  // Entry with that hash already exists.
+  EtcdClient::GetResponse* const resp(new EtcdClient::GetResponse);
+  task->DeleteWhenDone(resp);
+  client_->Get(full_path, resp,
+               task->AddChild(bind(&EtcdConsistentStore::PendingEntryFetched,
+                                   this, full_path, entry, resp, task, _1)));
+}
+
+
+void EtcdConsistentStore::PendingEntryFetched(
+    const string& full_path, LoggedEntry* entry,
+    const EtcdClient::GetResponse* resp, Task* task, Task* get_task) {
+  if (!get_task->status().ok()) {
+    LOG(ERROR) << "Couldn't create or fetch " << full_path << " : "
+               << get_task->status();
+    FinishPendingAdd(full_path, *entry, get_task->status(), task);
+    return;
+  }
+
+  LoggedEntry preexisting_entry;
+  CHECK(preexisting_entry.ParseFromString(DecodeNodeValue(resp->node)));
+  // Check the leaf certs are the same (we might be seeing the same cert
+  // submitted with a different chain.)
+  CHECK(LeafEntriesMatch(preexisting_entry, *entry));
+  *entry->mutable_sct() = preexisting_entry.sct();
+  FinishPendingAdd(full_path, *entry,
+                   Status(util::error::ALREADY_EXISTS,
+                          "Pending entry already exists."),
+                   task);
+}
+
+
+void EtcdConsistentStore::FinishPendingAdd(const string& full_path,
+                                           const LoggedEntry& entry,
+                                           const Status& status, Task* task) {
+  PendingAdd waiters;
+  {
+    lock_guard<mutex> lock(pending_adds_lock_);
+    const auto it(pending_adds_.find(full_path));
+    CHECK(it != pending_adds_.end());
+    waiters.swap(it->second);
+    pending_adds_.erase(it);
+  }
+
+  for (const auto& waiter : waiters) {
+    if (!status.ok() && status.CanonicalCode() != util::error::ALREADY_EXISTS) {
+      waiter.second->Return(status);
+      continue;
+    }
+    CHECK(LeafEntriesMatch(entry, *waiter.first));
+    *waiter.first->mutable_sct() = entry.sct();
+    waiter.second->Return(Status(util::error::ALREADY_EXISTS,
+                                 "Pending entry already exists."));
+  }
+  task->Return(status);
 }
 
 
@@ -373,14 +558,40 @@ Status EtcdConsistentStore::GetSequenceMapping(
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("get_sequence_mapping"));
 
-  Status status(GetEntry(GetFullPath(kSequenceFile), sequence_mapping));
+  EntryHandle<SequenceMapping> legacy;
+  map<string, EntryHandle<SequenceMapping>> chunks;
+  Status status(GetSequenceMappingChunks(&legacy, &chunks));
   if (!status.ok()) {
     return status;
   }
-  CheckMappingIsOrdered(sequence_mapping->Entry());
-  CheckMappingIsContiguousWithServingTree(sequence_mapping->Entry());
-  etcd_total_entries->Set("sequenced",
-                          sequence_mapping->Entry().mapping_size());
+
+  SequenceMapping mapping;
+  if (legacy.Entry().mapping_size() == 0) {
+    for (const auto& chunk : chunks) {
+      mapping.mutable_mapping()->MergeFrom(chunk.second.Entry().mapping());
+    }
+  } else {
+    // Mappings written before the mapping was split into chunks, some
+    // of which may be in chunks already if moving them was interrupted.
+    CheckMappingIsOrdered(legacy.Entry());
+    map<int64_t, const SequenceMapping::Mapping*> merged;
+    for (const auto& m : legacy.Entry().mapping()) {
+      merged[m.sequence_number()] = &m;
+    }
+    for (const auto& chunk : chunks) {
+      for (const auto& m : chunk.second.Entry().mapping()) {
+        merged[m.sequence_number()] = &m;
+      }
+    }
+    for (const auto& m : merged) {
+      *mapping.add_mapping() = *m.second;
+    }
+  }
+  CheckMappingIsOrdered(mapping);
+  CheckMappingIsContiguousWithServingTree(mapping);
+  etcd_total_entries->Set("sequenced", mapping.mapping_size());
+  etcd_total_entries->Set("sequence_mapping_chunks", chunks.size());
+  sequence_mapping->Set(legacy.Key(), mapping, legacy.Handle());
   return ::util::OkStatus();
 }
 
@@ -393,7 +604,71 @@ Status EtcdConsistentStore::UpdateSequenceMapping(
   CHECK(entry->HasHandle());
   CheckMappingIsOrdered(entry->Entry());
   CheckMappingIsContiguousWithServingTree(entry->Entry());
-  return UpdateEntry(entry);
+
+  EntryHandle<SequenceMapping> legacy;
+  map<string, EntryHandle<SequenceMapping>> chunks;
+  Status status(GetSequenceMappingChunks(&legacy, &chunks));
+  if (!status.ok()) {
+    return status;
+  }
+  if (legacy.Handle() != entry->Handle()) {
+    return Status(util::error::FAILED_PRECONDITION,
+                  "Sequence mapping was updated since it was read.");
+  }
+  // Every update rewrites the sequence mapping file (unchanged until
+  // its mappings are moved into chunks), so that an update made with
+  // an out of date handle fails before writing any chunk.
+  EntryHandle<SequenceMapping> handle(legacy.Key(), legacy.Entry(),
+                                      legacy.Handle());
+  status = UpdateEntry(&handle);
+  if (!status.ok()) {
+    return status;
+  }
+
+  map<string, SequenceMapping> updated;
+  for (const auto& m : entry->Entry().mapping()) {
+    *updated[GetSequenceMappingChunkPath(m.sequence_number())]
+         .add_mapping() = m;
+  }
+
+  // The chunks are written in order, then the ones left empty deleted,
+  // so that the mappings above the serving tree stay contiguous if this
+  // fails half-way.
+  for (const auto& chunk : updated) {
+    const auto it(chunks.find(chunk.first));
+    if (it == chunks.end()) {
+      EntryHandle<SequenceMapping> chunk_handle(chunk.first, chunk.second);
+      status = CreateEntry(&chunk_handle);
+    } else if (it->second.Entry().SerializeAsString() !=
+               chunk.second.SerializeAsString()) {
+      EntryHandle<SequenceMapping> chunk_handle(chunk.first, chunk.second,
+                                                it->second.Handle());
+      status = UpdateEntry(&chunk_handle);
+    }
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  for (const auto& chunk : chunks) {
+    if (updated.find(chunk.first) == updated.end()) {
+      status = DeleteEntry(chunk.second);
+      if (!status.ok()) {
+        return status;
+      }
+    }
+  }
+
+  if (legacy.Entry().mapping_size() > 0) {
+    LOG(INFO) << "Moved " << legacy.Entry().mapping_size()
+              << " sequence mappings into chunks.";
+    handle.MutableEntry()->Clear();
+    status = UpdateEntry(&handle);
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  entry->SetHandle(handle.Handle());
+  return ::util::OkStatus();
 }
 
 
@@ -401,6 +676,14 @@ StatusOr<ClusterNodeState> EtcdConsistentStore::GetClusterNodeState() const {
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("get_cluster_node_state"));
 
+  // Only this node writes its state, so what it last wrote is still
+  // there, unless it expired.
+  const shared_ptr<const CachedNodeState> cached(
+      std::atomic_load(&node_state_cache_));
+  if (cached && steady_clock::now() < cached->expires) {
+    return cached->state;
+  }
+
   EntryHandle<ClusterNodeState> handle;
   Status status(GetEntry(GetNodePath(node_id_), &handle));
   if (!status.ok()) {
@@ -421,7 +704,16 @@ Status EtcdConsistentStore::SetClusterNodeState(
   local_state.set_node_id(node_id_);
   EntryHandle<ClusterNodeState> entry(GetNodePath(node_id_), local_state);
   const seconds ttl(FLAGS_node_state_ttl_seconds);
-  return ForceSetEntryWithTTL(ttl, &entry);
+  // The clock starts before the request, to expire no later than etcd.
+  const steady_clock::time_point started(steady_clock::now());
+  std::atomic_store(&node_state_cache_, shared_ptr<const CachedNodeState>());
+  const Status status(ForceSetEntryWithTTL(ttl, &entry));
+  if (status.ok()) {
+    std::atomic_store(&node_state_cache_,
+                      shared_ptr<const CachedNodeState>(
+                          new CachedNodeState{local_state, started + ttl}));
+  }
+  return status;
 }
 
 
@@ -487,6 +779,17 @@ void EtcdConsistentStore::WatchClusterConfig(
 }
 
 
+void EtcdConsistentStore::WatchPendingEntries(
+    const ConsistentStore::PendingEntriesCallback& cb, Task* task) {
+  client_->Watch(
+      GetFullPath(kEntriesDir),
+      bind(&ConvertMultipleUpdate<LoggedEntry,
+                                  ConsistentStore::PendingEntriesCallback>,
+           cb, _1),
+      task);
+}
+
+
 Status EtcdConsistentStore::SetClusterConfig(const ClusterConfig& config) {
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("set_cluster_config"));
@@ -511,7 +814,7 @@ Status EtcdConsistentStore::GetEntry(const string& path,
     return task.status();
   }
   T t;
-  CHECK(t.ParseFromString(FromBase64(resp.node.value_.c_str())));
+  CHECK(t.ParseFromString(DecodeNodeValue(resp.node)));
   entry->Set(path, t, resp.node.modified_index_);
   return ::util::OkStatus();
 }
@@ -537,7 +840,7 @@ Status EtcdConsistentStore::GetAllEntriesInDir(
   }
   for (const auto& node : resp.node.nodes_) {
     LoggedEntry entry;
-    CHECK(entry.ParseFromString(FromBase64(node.value_.c_str())));
+    CHECK(entry.ParseFromString(DecodeNodeValue(node)));
     entries->emplace_back(
         EntryHandle<LoggedEntry>(node.key_, entry, node.modified_index_));
   }
@@ -545,6 +848,47 @@ Status EtcdConsistentStore::GetAllEntriesInDir(
 }
 
 
+Status EtcdConsistentStore::GetSequenceMappingChunks(
+    EntryHandle<SequenceMapping>* legacy,
+    map<string, EntryHandle<SequenceMapping>>* chunks) const {
+  ScopedLatency scoped_latency(
+      etcd_latency_by_op_ms.GetScopedLatency("get_sequence_mapping_chunks"));
+
+  CHECK_NOTNULL(chunks);
+  CHECK(chunks->empty());
+  Status status(GetEntry(GetFullPath(kSequenceFile), legacy));
+  if (!status.ok()) {
+    return status;
+  }
+
+  const string dir(GetFullPath(kSequenceChunksDir));
+  SyncTask task(executor_);
+  EtcdClient::GetResponse resp;
+  client_->Get(dir, &resp, task.task());
+  task.Wait();
+  if (task.status().CanonicalCode() == util::error::NOT_FOUND) {
+    // Nothing was written in chunks yet.
+    return ::util::OkStatus();
+  }
+  if (!task.status().ok()) {
+    return task.status();
+  }
+  if (!resp.node.is_dir_) {
+    return Status(util::error::FAILED_PRECONDITION,
+                  "node is not a directory: " + dir);
+  }
+  // The chunk keys have the same length, so that this orders them by
+  // sequence number.
+  for (const auto& node : resp.node.nodes_) {
+    SequenceMapping chunk;
+    CHECK(chunk.ParseFromString(DecodeNodeValue(node)));
+    chunks->emplace(node.key_, EntryHandle<SequenceMapping>(
+                                   node.key_, chunk, node.modified_index_));
+  }
+  return ::util::OkStatus();
+}
+
+
 Status EtcdConsistentStore::UpdateEntry(EntryHandleBase* t) {
   ScopedLatency scoped_latency(
       etcd_latency_by_op_ms.GetScopedLatency("update_entry"));
@@ -556,7 +900,7 @@ Status EtcdConsistentStore::UpdateEntry(EntryHandleBase* t) {
   CHECK(t->SerializeToString(&flat_entry));
   SyncTask task(executor_);
   EtcdClient::Response resp;
-  client_->Update(t->Key(), ToBase64(flat_entry), t->Handle(), &resp,
+  client_->Update(t->Key(), EncodeValue(flat_entry), t->Handle(), &resp,
                   task.task());
   task.Wait();
   if (task.status().ok()) {
@@ -577,7 +921,7 @@ Status EtcdConsistentStore::CreateEntry(EntryHandleBase* t) {
   CHECK(t->SerializeToString(&flat_entry));
   SyncTask task(executor_);
   EtcdClient::Response resp;
-  client_->Create(t->Key(), ToBase64(flat_entry), &resp, task.task());
+  client_->Create(t->Key(), EncodeValue(flat_entry), &resp, task.task());
   task.Wait();
   if (task.status().ok()) {
     t->SetHandle(resp.etcd_index);
@@ -601,7 +945,7 @@ Status EtcdConsistentStore::ForceSetEntry(EntryHandleBase* t) {
   CHECK(t->SerializeToString(&flat_entry));
   SyncTask task(executor_);
   EtcdClient::Response resp;
-  client_->ForceSet(t->Key(), ToBase64(flat_entry), &resp, task.task());
+  client_->ForceSet(t->Key(), EncodeValue(flat_entry), &resp, task.task());
   task.Wait();
   if (task.status().ok()) {
     t->SetHandle(resp.etcd_index);
@@ -627,7 +971,7 @@ Status EtcdConsistentStore::ForceSetEntryWithTTL(const seconds& ttl,
   CHECK(t->SerializeToString(&flat_entry));
   SyncTask task(executor_);
   EtcdClient::Response resp;
-  client_->ForceSetWithTTL(t->Key(), ToBase64(flat_entry), ttl, &resp,
+  client_->ForceSetWithTTL(t->Key(), EncodeValue(flat_entry), ttl, &resp,
                            task.task());
   task.Wait();
   if (task.status().ok()) {
@@ -665,6 +1009,17 @@ string EtcdConsistentStore::GetNodePath(const string& id) const {
 }
 
 
+string EtcdConsistentStore::GetSequenceMappingChunkPath(
+    int64_t sequence_number) const {
+  CHECK_GE(sequence_number, 0);
+  const int64_t chunk_size(FLAGS_etcd_sequence_mapping_chunk_size);
+  const int64_t first(sequence_number - sequence_number % chunk_size);
+  char name[21];
+  CHECK_EQ(20, snprintf(name, sizeof(name), "%020" PRId64, first));
+  return GetFullPath(string(kSequenceChunksDir) + name);
+}
+
+
 string EtcdConsistentStore::GetFullPath(const string& key) const {
   CHECK(key.size() > 0);
   CHECK_EQ('/', key[0]);
@@ -706,9 +1061,12 @@ void EtcdConsistentStore::CheckMappingIsContiguousWithServingTree(
 template <class T>
 Update<T> EtcdConsistentStore::TypedUpdateFromNode(
     const EtcdClient::Node& node) {
-  const string raw_value(FromBase64(node.value_.c_str()));
   T thing;
-  CHECK(thing.ParseFromString(raw_value)) << raw_value;
+  // Deleted nodes have no value.
+  if (!node.deleted_) {
+    const string raw_value(DecodeNodeValue(node));
+    CHECK(thing.ParseFromString(raw_value)) << raw_value;
+  }
   EntryHandle<T> handle(node.key_, thing);
   if (!node.deleted_) {
     handle.SetHandle(node.modified_index_);
@@ -726,6 +1084,9 @@ void EtcdConsistentStore::UpdateLocalServingSTH(
 
   VLOG(1) << "Updating serving_sth_ to: " << handle.Entry().DebugString();
   serving_sth_.reset(new EntryHandle<SignedTreeHead>(handle));
+  std::atomic_store(&serving_sth_cache_,
+                    shared_ptr<const SignedTreeHead>(
+                        new SignedTreeHead(handle.Entry())));
 }
 
 
@@ -741,6 +1102,7 @@ void EtcdConsistentStore::OnEtcdServingSTHUpdated(
     LOG(WARNING) << "ServingSTH non-existent/deleted.";
     // TODO(alcutter): What to do here?
     serving_sth_.reset();
+    std::atomic_store(&serving_sth_cache_, shared_ptr<const SignedTreeHead>());
   }
   received_initial_sth_ = true;
   lock.unlock();
@@ -753,8 +1115,9 @@ void EtcdConsistentStore::OnClusterConfigUpdated(
   if (update.exists_) {
     VLOG(1) << "Got ClusterConfig version " << update.handle_.Handle() << ": "
             << update.handle_.Entry().DebugString();
-    lock_guard<mutex> lock(mutex_);
-    cluster_config_.reset(new ClusterConfig(update.handle_.Entry()));
+    std::atomic_store(&cluster_config_,
+                      shared_ptr<const ClusterConfig>(
+                          new ClusterConfig(update.handle_.Entry())));
   } else {
     LOG(WARNING) << "ClusterConfig non-existent/deleted.";
     // TODO(alcutter): What to do here?
@@ -779,38 +1142,99 @@ StatusOr<int64_t> EtcdConsistentStore::CleanupOldEntries() {
   }
   const int64_t clean_up_to_sequence_number(serving_sth_->Entry().tree_size() -
                                             1);
+  const int64_t cleaned_up_to_sequence_number(cleaned_up_to_);
   lock.unlock();
+  if (clean_up_to_sequence_number <= cleaned_up_to_sequence_number) {
+    return 0;
+  }
 
-  LOG(INFO) << "Cleaning old entries up to and including sequence number: "
+  LOG(INFO) << "Cleaning old entries from sequence number "
+            << cleaned_up_to_sequence_number + 1
+            << " up to and including sequence number: "
             << clean_up_to_sequence_number;
 
-  EntryHandle<SequenceMapping> sequence_mapping;
-  Status status(GetSequenceMapping(&sequence_mapping));
+  EntryHandle<SequenceMapping> legacy;
+  map<string, EntryHandle<SequenceMapping>> chunks;
+  Status status(GetSequenceMappingChunks(&legacy, &chunks));
   if (!status.ok()) {
     LOG(WARNING) << "Couldn't get sequence mapping: " << status;
     return status;
   }
 
+  // Each run removes at most --etcd_cleanup_batch_size entries, so
+  // that a large backlog is worked through in bounded steps.
   vector<string> keys_to_delete;
-  for (int mapping_index = 0;
-       mapping_index < sequence_mapping.Entry().mapping_size() &&
-       sequence_mapping.Entry().mapping(mapping_index).sequence_number() <=
-           clean_up_to_sequence_number;
-       ++mapping_index) {
-    // Delete the entry from /entries.
-    keys_to_delete.emplace_back(GetEntryPath(
-        sequence_mapping.Entry().mapping(mapping_index).entry_hash()));
+  int64_t batch_up_to_sequence_number(clean_up_to_sequence_number);
+  const auto add_keys_to_delete([&](const SequenceMapping& mapping) {
+    for (const auto& m : mapping.mapping()) {
+      if (m.sequence_number() <= cleaned_up_to_sequence_number) {
+        continue;
+      }
+      if (m.sequence_number() > clean_up_to_sequence_number) {
+        return false;
+      }
+      if (keys_to_delete.size() >=
+          static_cast<size_t>(FLAGS_etcd_cleanup_batch_size)) {
+        batch_up_to_sequence_number = m.sequence_number() - 1;
+        return false;
+      }
+      // Delete the entry from /entries.
+      keys_to_delete.emplace_back(GetEntryPath(m.entry_hash()));
+    }
+    return true;
+  });
+  // The chunks past the serving tree need not be looked at.
+  if (add_keys_to_delete(legacy.Entry())) {
+    for (const auto& chunk : chunks) {
+      if (!add_keys_to_delete(chunk.second.Entry())) {
+        break;
+      }
+    }
   }
 
-
+  // With a rate limit, the keys are deleted a second's worth at a
+  // time.
+  const size_t slice_size(FLAGS_etcd_cleanup_max_deletes_per_second > 0
+                              ? FLAGS_etcd_cleanup_max_deletes_per_second
+                              : keys_to_delete.size());
   const int64_t num_entries_cleaned(keys_to_delete.size());
+  // The slices are deleted one after the other, and the pauses between
+  // them are timers of |executor_|, so only this thread waits, once.
+  const size_t num_slices(
+      keys_to_delete.empty()
+          ? 0
+          : (keys_to_delete.size() + slice_size - 1) / slice_size);
   SyncTask task(executor_);
-  EtcdForceDeleteKeys(client_, move(keys_to_delete), task.task());
+  util::SequentialFor(
+      num_slices,
+      [this, &keys_to_delete, slice_size](size_t i, Task* slice_task) {
+        const steady_clock::time_point started(steady_clock::now());
+        const auto begin(keys_to_delete.begin() + i * slice_size);
+        const auto end(keys_to_delete.begin() +
+                       min(keys_to_delete.size(), (i + 1) * slice_size));
+        // Once the slice is deleted, wait out the rest of the second
+        // if rate-limited.
+        Task* const deleted(slice_task->AddChild(
+            [this, started, slice_task](Task* delete_task) {
+              if (!delete_task->status().ok() ||
+                  FLAGS_etcd_cleanup_max_deletes_per_second <= 0) {
+                slice_task->Return(delete_task->status());
+                return;
+              }
+              executor_->Delay(started + seconds(1) - steady_clock::now(),
+                               slice_task);
+            }));
+        EtcdForceDeleteKeys(client_, vector<string>(begin, end), deleted);
+      },
+      task.task());
   task.Wait();
-  status = task.status();
-  if (!status.ok()) {
+  if (!task.status().ok()) {
     LOG(WARNING) << "EtcdDeleteKeys failed: " << task.status();
+    return task.status();
   }
+
+  lock.lock();
+  cleaned_up_to_ = max(cleaned_up_to_, batch_up_to_sequence_number);
   return num_entries_cleaned;
 }
 
@@ -840,11 +1264,8 @@ void EtcdConsistentStore::EtcdStatsFetchDone(
     const StatusOr<int64_t> num_entries(
         CalculateNumEtcdEntries(response->stats));
     if (num_entries.ok()) {
-      {
-        lock_guard<mutex> lock(mutex_);
-        num_etcd_entries_ = num_entries.ValueOrDie();
-      }
-      etcd_total_entries->Set("all", num_etcd_entries_);
+      num_etcd_entries_ = num_entries.ValueOrDie();
+      etcd_total_entries->Set("all", num_entries.ValueOrDie());
     } else {
       VLOG(1) << "Failed to calculate num_entries: " << num_entries.status();
     }
@@ -857,6 +1278,18 @@ void EtcdConsistentStore::EtcdStatsFetchDone(
                    bind(&EtcdConsistentStore::StartEtcdStatsFetch, this)));
 }
 
+double EtcdConsistentStore::PendingEntriesLoad() const {
+  const shared_ptr<const ClusterConfig> cluster_config(
+      std::atomic_load(&cluster_config_));
+  if (!cluster_config ||
+      cluster_config->etcd_reject_add_pending_threshold() <= 0) {
+    return 0;
+  }
+  return static_cast<double>(num_etcd_entries_) /
+         cluster_config->etcd_reject_add_pending_threshold();
+}
+
+
 // This method attempts to modulate the incoming traffic in response to the
 // number of entries currently in etcd.
 //
@@ -864,17 +1297,16 @@ void EtcdConsistentStore::EtcdStatsFetchDone(
 // returning a RESOURCE_EXHAUSTED status, which should result in a 503 being
 // sent to the client.
 Status EtcdConsistentStore::MaybeReject(const string& type) const {
-  unique_lock<mutex> lock(mutex_);
-
-  if (!cluster_config_) {
+  const shared_ptr<const ClusterConfig> cluster_config(
+      std::atomic_load(&cluster_config_));
+  if (!cluster_config) {
     // No config, whatever.
     return ::util::OkStatus();
   }
 
   const int64_t etcd_size(num_etcd_entries_);
   const int64_t reject_threshold(
-      cluster_config_->etcd_reject_add_pending_threshold());
-  lock.unlock();
+      cluster_config->etcd_reject_add_pending_threshold());
 
   if (etcd_size >= reject_threshold) {
     etcd_rejected_requests->Increment(type);
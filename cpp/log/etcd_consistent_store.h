@@ -2,8 +2,14 @@
 #define CERT_TRANS_LOG_ETCD_CONSISTENT_STORE_H_
 
 #include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "log/consistent_store.h"
@@ -36,22 +42,45 @@ class EtcdConsistentStore : public ConsistentStore {
 
   util::Status SetServingSTH(const ct::SignedTreeHead& new_sth) override;
 
+  // Answered from the copy kept up to date by a watch, without
+  // blocking.
   util::StatusOr<ct::SignedTreeHead> GetServingSTH() const override;
 
+  // Concurrent calls adding the same entry share a single round trip
+  // to etcd, the later ones getting ALREADY_EXISTS and the SCT of the
+  // first.
   util::Status AddPendingEntry(LoggedEntry* entry) override;
 
+  // Same as AddPendingEntry(), which waits on this, but continues from
+  // the replies of etcd, without a thread waiting for them.
+  void AddPendingEntryAsync(LoggedEntry* entry, util::Task* task) override;
+
+  // The number of entries in etcd (pending or not, as it counts
+  // towards what etcd can take), over the reject threshold of the
+  // cluster config.
+  double PendingEntriesLoad() const override;
+
   util::Status GetPendingEntryForHash(
       const std::string& hash, EntryHandle<LoggedEntry>* entry) const override;
 
   util::Status GetPendingEntries(
       std::vector<EntryHandle<LoggedEntry>>* entries) const override;
 
+  // The sequence mapping is stored in chunks, each covering
+  // --etcd_sequence_mapping_chunk_size sequence numbers, so that an
+  // update only rewrites the chunks it changes. The handle is that of
+  // the sequence mapping file, which each update rewrites first.
   util::Status GetSequenceMapping(
       EntryHandle<ct::SequenceMapping>* entry) const override;
 
+  // Chunks are written one at a time (with their own compare-and-swap),
+  // so unlike the rest of an update, a failure can leave some of them
+  // written. The mappings above the serving tree stay contiguous.
   util::Status UpdateSequenceMapping(
       EntryHandle<ct::SequenceMapping>* entry) override;
 
+  // Answered from what SetClusterNodeState() last wrote, if it has not
+  // expired yet.
   util::StatusOr<ct::ClusterNodeState> GetClusterNodeState() const override;
 
   util::Status SetClusterNodeState(const ct::ClusterNodeState& state) override;
@@ -66,10 +95,14 @@ class EtcdConsistentStore : public ConsistentStore {
   void WatchClusterConfig(const ConsistentStore::ClusterConfigCallback& cb,
                           util::Task* task) override;
 
+  void WatchPendingEntries(const ConsistentStore::PendingEntriesCallback& cb,
+                           util::Task* task) override;
+
   util::Status SetClusterConfig(const ct::ClusterConfig& config) override;
 
   // Removes sequenced entries with sequence numbers covered by the current
-  // serving STH.
+  // serving STH, at most --etcd_cleanup_batch_size of them, starting
+  // after those removed by the previous run.
   util::StatusOr<int64_t> CleanupOldEntries() override;
 
  private:
@@ -83,6 +116,35 @@ class EtcdConsistentStore : public ConsistentStore {
       const std::string& dir,
       std::vector<EntryHandle<LoggedEntry>>* entries) const;
 
+  // Sets |*legacy| to the sequence mapping file, holding the mappings
+  // not yet moved into chunks, and |*chunks| to the chunks, by key.
+  util::Status GetSequenceMappingChunks(
+      EntryHandle<ct::SequenceMapping>* legacy,
+      std::map<std::string, EntryHandle<ct::SequenceMapping>>* chunks) const;
+
+  struct CachedNodeState {
+    ct::ClusterNodeState state;
+    std::chrono::steady_clock::time_point expires;
+  };
+
+  // The other calls adding the same entry as an AddPendingEntryAsync()
+  // call in flight, which get its answer.
+  typedef std::vector<std::pair<LoggedEntry*, util::Task*>> PendingAdd;
+
+  // The continuations of AddPendingEntryAsync(), for the call in
+  // flight adding |entry| at |full_path| on behalf of |task|: once
+  // etcd replied to its create request, and, if the entry was there
+  // already, to the request getting it.
+  void PendingEntryCreated(const std::string& full_path, LoggedEntry* entry,
+                           util::Task* task, util::Task* create_task);
+  void PendingEntryFetched(const std::string& full_path, LoggedEntry* entry,
+                           const EtcdClient::GetResponse* resp,
+                           util::Task* task, util::Task* get_task);
+  // Returns on |task|, and on those of the calls waiting for it.
+  void FinishPendingAdd(const std::string& full_path,
+                        const LoggedEntry& entry, const util::Status& status,
+                        util::Task* task);
+
   util::Status UpdateEntry(EntryHandleBase* entry);
 
   util::Status CreateEntry(EntryHandleBase* entry);
@@ -100,6 +162,9 @@ class EtcdConsistentStore : public ConsistentStore {
 
   std::string GetNodePath(const std::string& node_id) const;
 
+  // Returns the key of the chunk with the mapping for |sequence_number|.
+  std::string GetSequenceMappingChunkPath(int64_t sequence_number) const;
+
   std::string GetFullPath(const std::string& key) const;
 
   void CheckMappingIsContiguousWithServingTree(
@@ -153,9 +218,23 @@ class EtcdConsistentStore : public ConsistentStore {
   mutable std::mutex mutex_;
   bool received_initial_sth_;
   std::unique_ptr<EntryHandle<ct::SignedTreeHead>> serving_sth_;
-  std::unique_ptr<ct::ClusterConfig> cluster_config_;
   bool exiting_;
-  int64_t num_etcd_entries_;
+
+  // These are read and replaced with std::atomic_load() and
+  // std::atomic_store(), so that they can be read without |mutex_|.
+  // A copy of |serving_sth_|'s entry.
+  std::shared_ptr<const ct::SignedTreeHead> serving_sth_cache_;
+  std::shared_ptr<const ct::ClusterConfig> cluster_config_;
+  std::shared_ptr<const CachedNodeState> node_state_cache_;
+  std::atomic<int64_t> num_etcd_entries_;
+  // The sequence number up to which CleanupOldEntries() removed the
+  // entries, or -1. A new master starts over from the sequence mapping,
+  // which the sequencer prunes of removed entries.
+  int64_t cleaned_up_to_;
+
+  std::mutex pending_adds_lock_;
+  // By path.
+  std::map<std::string, PendingAdd> pending_adds_;
 
   friend class EtcdConsistentStoreTest;
   template <class T>
@@ -26,6 +26,9 @@
 
 DECLARE_int32(node_state_ttl_seconds);
 DECLARE_int32(etcd_stats_collection_interval_seconds);
+DECLARE_int32(etcd_sequence_mapping_chunk_size);
+DECLARE_int32(etcd_cleanup_batch_size);
+DECLARE_bool(etcd_compress_values);
 
 namespace cert_trans {
 
@@ -80,6 +83,9 @@ class EtcdConsistentStoreTest : public ::testing::Test {
   void SetUp() override {
     Registry::Instance()->ResetForTestingOnly();
     FLAGS_etcd_stats_collection_interval_seconds = 1;
+    FLAGS_etcd_sequence_mapping_chunk_size = 1000;
+    FLAGS_etcd_cleanup_batch_size = 10000;
+    FLAGS_etcd_compress_values = false;
     store_.reset(new EtcdConsistentStore(base_.get(), &executor_, &client_,
                                          &election_, kRoot, kNodeId));
     InsertEntry("/root/sequence_mapping", SequenceMapping());
@@ -204,6 +210,15 @@ class EtcdConsistentStoreTest : public ::testing::Test {
     return EtcdClient::Node(index, index, key, Serialize(t));
   }
 
+  // Returns the modified index of |key|, or 0 if it does not exist.
+  int64_t ModifiedIndex(const string& key) {
+    EtcdClient::GetResponse resp;
+    SyncTask task(base_.get());
+    client_.Get(key, &resp, task.task());
+    task.Wait();
+    return task.status().ok() ? resp.node.modified_index_ : 0;
+  }
+
   ct::SignedTreeHead ServingSTH() {
     return store_->serving_sth_->Entry();
   }
@@ -321,6 +336,36 @@ TEST_F(EtcdConsistentStoreTest, TestAddPendingEntryWorks) {
 }
 
 
+TEST_F(EtcdConsistentStoreTest, TestAddPendingEntryCompressed) {
+  FLAGS_etcd_compress_values = true;
+  LoggedEntry cert(MakeCert(kTimestamp, string(4096, 'x')));
+  ASSERT_OK(store_->AddPendingEntry(&cert));
+  EtcdClient::GetResponse resp;
+  SyncTask task(base_.get());
+  client_.Get(string(kRoot) + "/entries/" + util::HexString(cert.Hash()),
+              &resp, task.task());
+  task.Wait();
+  EXPECT_OK(task.status());
+  EXPECT_LT(resp.node.value_.size(), Serialize(cert).size());
+
+  // Compressed and uncompressed entries can be read back alike.
+  const LoggedEntry other(MakeCert(kTimestamp, "other"));
+  InsertEntry(string(kRoot) + "/entries/" + util::HexString(other.Hash()),
+              other);
+  vector<EntryHandle<LoggedEntry>> entries;
+  ASSERT_OK(store_->GetPendingEntries(&entries));
+  vector<LoggedEntry> certs;
+  for (const auto& e : entries) {
+    certs.push_back(e.Entry());
+  }
+  EXPECT_THAT(certs, AllOf(Contains(cert), Contains(other)));
+
+  EntryHandle<LoggedEntry> handle;
+  ASSERT_OK(store_->GetPendingEntryForHash(cert.Hash(), &handle));
+  EXPECT_EQ(cert, handle.Entry());
+}
+
+
 TEST_F(EtcdConsistentStoreTest,
        TestAddPendingEntryForExistingEntryReturnsSct) {
   LoggedEntry cert(DefaultCert());
@@ -338,6 +383,39 @@ TEST_F(EtcdConsistentStoreTest,
 }
 
 
+TEST_F(EtcdConsistentStoreTest, TestConcurrentAddPendingEntryShareSct) {
+  const int kNumThreads(8);
+  vector<LoggedEntry> certs;
+  for (int i = 0; i < kNumThreads; ++i) {
+    certs.emplace_back(DefaultCert());
+    certs.back().mutable_sct()->set_timestamp(kTimestamp + i);
+  }
+
+  atomic<int> num_ok(0);
+  vector<thread> threads;
+  for (LoggedEntry& cert : certs) {
+    threads.emplace_back([this, &cert, &num_ok]() {
+      const Status status(store_->AddPendingEntry(&cert));
+      if (status.ok()) {
+        ++num_ok;
+      } else {
+        EXPECT_THAT(status, StatusIs(util::error::ALREADY_EXISTS));
+      }
+    });
+  }
+  for (thread& t : threads) {
+    t.join();
+  }
+
+  EXPECT_EQ(1, num_ok.load());
+  EntryHandle<LoggedEntry> stored;
+  ASSERT_OK(store_->GetPendingEntryForHash(certs[0].Hash(), &stored));
+  for (const LoggedEntry& cert : certs) {
+    EXPECT_EQ(stored.Entry().timestamp(), cert.timestamp());
+  }
+}
+
+
 TEST_F(EtcdConsistentStoreDeathTest,
        TestAddPendingEntryForExistingNonIdenticalEntry) {
   LoggedEntry cert(DefaultCert());
@@ -517,6 +595,85 @@ TEST_F(EtcdConsistentStoreDeathTest,
 }
 
 
+TEST_F(EtcdConsistentStoreTest, TestUpdateSequenceMappingWritesChunks) {
+  FLAGS_etcd_sequence_mapping_chunk_size = 2;
+  const string kChunksDir(string(kRoot) + "/sequence_mapping_chunks/");
+  for (int64_t seq = 0; seq < 5; ++seq) {
+    AddSequenceMapping(seq, "hash" + std::to_string(seq));
+  }
+  SequenceMapping chunk;
+  PeekEntry(kChunksDir + "00000000000000000002", &chunk);
+  ASSERT_EQ(2, chunk.mapping_size());
+  EXPECT_EQ(2, chunk.mapping(0).sequence_number());
+  EXPECT_EQ("hash3", chunk.mapping(1).entry_hash());
+  PeekEntry(kChunksDir + "00000000000000000004", &chunk);
+  EXPECT_EQ(1, chunk.mapping_size());
+  SequenceMapping legacy;
+  PeekEntry("/root/sequence_mapping", &legacy);
+  EXPECT_EQ(0, legacy.mapping_size());
+
+  // Only the chunk changed is written.
+  const string kFirstChunk(kChunksDir + "00000000000000000000");
+  const string kLastChunk(kChunksDir + "00000000000000000004");
+  const int64_t first_index(ModifiedIndex(kFirstChunk));
+  const int64_t last_index(ModifiedIndex(kLastChunk));
+  AddSequenceMapping(5, "hash5");
+  EXPECT_EQ(first_index, ModifiedIndex(kFirstChunk));
+  EXPECT_LT(last_index, ModifiedIndex(kLastChunk));
+
+  // Chunks left empty are removed.
+  EntryHandle<SequenceMapping> mapping;
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  ASSERT_EQ(6, mapping.Entry().mapping_size());
+  mapping.MutableEntry()->mutable_mapping()->DeleteSubrange(0, 2);
+  ASSERT_OK(store_->UpdateSequenceMapping(&mapping));
+  EXPECT_EQ(0, ModifiedIndex(kFirstChunk));
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  ASSERT_EQ(4, mapping.Entry().mapping_size());
+  EXPECT_EQ(2, mapping.Entry().mapping(0).sequence_number());
+}
+
+
+TEST_F(EtcdConsistentStoreTest, TestUpdateSequenceMappingMovesOldMappings) {
+  SequenceMapping old_mapping;
+  for (int64_t seq = 0; seq < 2; ++seq) {
+    SequenceMapping::Mapping* m(old_mapping.add_mapping());
+    m->set_sequence_number(seq);
+    m->set_entry_hash("hash" + std::to_string(seq));
+  }
+  ForceSetEntry("/root/sequence_mapping", old_mapping);
+  AddSequenceMapping(2, "hash2");
+
+  SequenceMapping legacy;
+  PeekEntry("/root/sequence_mapping", &legacy);
+  EXPECT_EQ(0, legacy.mapping_size());
+  SequenceMapping chunk;
+  PeekEntry(string(kRoot) + "/sequence_mapping_chunks/00000000000000000000",
+            &chunk);
+  EXPECT_EQ(3, chunk.mapping_size());
+
+  EntryHandle<SequenceMapping> mapping;
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  ASSERT_EQ(3, mapping.Entry().mapping_size());
+  EXPECT_EQ("hash0", mapping.Entry().mapping(0).entry_hash());
+  EXPECT_EQ("hash2", mapping.Entry().mapping(2).entry_hash());
+}
+
+
+TEST_F(EtcdConsistentStoreTest, TestUpdateSequenceMappingFailsIfOutOfDate) {
+  EntryHandle<SequenceMapping> mapping;
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  AddSequenceMapping(0, "zero");
+
+  mapping.MutableEntry()->add_mapping()->set_sequence_number(0);
+  EXPECT_THAT(store_->UpdateSequenceMapping(&mapping),
+              StatusIs(util::error::FAILED_PRECONDITION));
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+  ASSERT_EQ(1, mapping.Entry().mapping_size());
+  EXPECT_EQ("zero", mapping.Entry().mapping(0).entry_hash());
+}
+
+
 TEST_F(EtcdConsistentStoreTest, TestSetClusterNodeState) {
   const string kPath(string(kRoot) + "/nodes/" + kNodeId);
 
@@ -553,6 +710,24 @@ TEST_F(EtcdConsistentStoreTest, TestSetClusterNodeStateHasTTL) {
   client_.Get(kPath, &resp, task.task());
   task.Wait();
   EXPECT_THAT(task.status(), StatusIs(util::error::NOT_FOUND));
+  EXPECT_THAT(store_->GetClusterNodeState().status(),
+              StatusIs(util::error::NOT_FOUND));
+}
+
+
+TEST_F(EtcdConsistentStoreTest, TestGetClusterNodeStateUsesWhatWasSet) {
+  const string kPath(string(kRoot) + "/nodes/" + kNodeId);
+  ct::ClusterNodeState state;
+  state.set_hostname("here");
+  ASSERT_OK(store_->SetClusterNodeState(state));
+
+  // Changed behind our back, which only this node is meant to do.
+  state.set_hostname("there");
+  ForceSetEntry(kPath, state);
+
+  const StatusOr<ct::ClusterNodeState> got(store_->GetClusterNodeState());
+  ASSERT_OK(got.status());
+  EXPECT_EQ("here", got.ValueOrDie().hostname());
 }
 
 
@@ -735,9 +910,10 @@ TEST_F(EtcdConsistentStoreTest, TestCleansUpToNewSTH) {
   sth.set_tree_size(105);
   CHECK(store_->SetServingSTH(sth).ok());
   {
+    // Only those not cleaned up by the previous run.
     const StatusOr<int64_t> num_cleaned(CleanupOldEntries());
     ASSERT_OK(num_cleaned.status());
-    EXPECT_EQ(5, num_cleaned.ValueOrDie());
+    EXPECT_EQ(2, num_cleaned.ValueOrDie());
   }
 
 
@@ -764,6 +940,31 @@ TEST_F(EtcdConsistentStoreTest, TestCleansUpToNewSTH) {
 }
 
 
+TEST_F(EtcdConsistentStoreTest, TestCleansUpInBatches) {
+  FLAGS_etcd_cleanup_batch_size = 2;
+  PopulateForCleanupTests(5, 0, 100);
+  EntryHandle<SequenceMapping> mapping;
+  ASSERT_OK(store_->GetSequenceMapping(&mapping));
+
+  EXPECT_CALL(election_, IsMaster()).WillRepeatedly(Return(true));
+  SignedTreeHead sth;
+  sth.set_timestamp(345345);
+  sth.set_tree_size(105);
+  CHECK(store_->SetServingSTH(sth).ok());
+
+  for (const int expected : {2, 2, 1, 0}) {
+    const StatusOr<int64_t> num_cleaned(CleanupOldEntries());
+    ASSERT_OK(num_cleaned.status());
+    EXPECT_EQ(expected, num_cleaned.ValueOrDie());
+  }
+  for (const auto& m : mapping.Entry().mapping()) {
+    EntryHandle<LoggedEntry> unused;
+    EXPECT_THAT(store_->GetPendingEntryForHash(m.entry_hash(), &unused),
+                StatusIs(util::error::NOT_FOUND));
+  }
+}
+
+
 TEST_F(EtcdConsistentStoreTest, TestStoreStatsFetcher) {
   EXPECT_EQ(0, GetNumEtcdEntries());
   PopulateForCleanupTests(100, 100, 100);
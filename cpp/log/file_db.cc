@@ -2,30 +2,38 @@
 
 #include <glog/logging.h>
 #include <stdint.h>
+#include <string.h>
+#include <algorithm>
 #include <map>
 #include <set>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "log/file_storage.h"
 #include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
+#include "monitoring/startup.h"
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
 #include "util/util.h"
 
 using cert_trans::serialization::DeserializeResult;
+using std::chrono::duration_cast;
 using std::chrono::milliseconds;
+using std::chrono::steady_clock;
 using std::lock_guard;
-using std::make_pair;
+using std::map;
 using std::min;
 using std::mutex;
+using std::pair;
 using std::set;
 using std::stoll;
 using std::string;
 using std::to_string;
 using std::unique_lock;
 using std::unique_ptr;
+using std::vector;
 
 namespace cert_trans {
 namespace {
@@ -36,7 +44,31 @@ static Latency<milliseconds, string> latency_by_op_ms(
     "Database latency in ms broken out by operation.");
 
 
+static Gauge<>* build_index_time_ms(
+    Gauge<>::New("filedb_build_index_time_ms",
+                 "Time taken to index the entries when the database was "
+                 "opened, in ms."));
+
+
 const char kMetaNodeIdKey[] = "node_id";
+const char kMetaTreeCheckpointKey[] = "tree_checkpoint";
+// The hashes of the entries below the index checkpoint are stored in
+// the meta storage, in chunks of kIndexCheckpointInterval consecutive
+// entries, keyed by this followed by the first sequence number.
+const char kMetaHashIndexPrefix[] = "hash_index-";
+// The Merkle tree leaf hashes of the same entries, in chunks keyed the
+// same way. A chunk of those is written before the chunk of hashes,
+// but databases written before they were stored have none.
+const char kMetaLeafHashIndexPrefix[] = "leaf_hash_index-";
+// How far the contiguous entries get past the index checkpoint before
+// the next chunk of hashes is written. BuildIndex() only reads the
+// entries from the checkpoint on, so this bounds the work it has to
+// do.
+const int64_t kIndexCheckpointInterval = 1 << 16;
+// The size of LoggedEntry::Hash() and LeafHash(), SHA-256 digests.
+const size_t kHashBytes = 32;
+// How many entries ReadEntries() reads at once.
+const int64_t kReadEntriesBatchSize = 64;
 
 
 string FormatSequenceNumber(const int64_t seq) {
@@ -88,12 +120,113 @@ class FileDB::Iterator : public Database::Iterator {
 };
 
 
+class FileDB::LeafHashIterator : public Database::LeafHashIterator {
+ public:
+  LeafHashIterator(const FileDB* db, int64_t start_index)
+      : db_(CHECK_NOTNULL(db)),
+        next_index_(start_index),
+        buffer_begin_(start_index),
+        missing_chunk_(-1) {
+    CHECK_GE(next_index_, 0);
+  }
+
+  bool GetNextLeafHash(int64_t* sequence_number, string* leaf_hash) override {
+    CHECK_NOTNULL(sequence_number);
+    CHECK_NOTNULL(leaf_hash);
+    if (!Buffered()) {
+      Refill();
+    }
+    if (Buffered()) {
+      *sequence_number = next_index_;
+      leaf_hash->assign(buffer_, (next_index_ - buffer_begin_) * kHashBytes,
+                        kHashBytes);
+      ++next_index_;
+      return true;
+    }
+
+    // Not at hand, so read the entry and hash it, like the default
+    // ReadOnlyDatabase::ScanLeafHashes() does.
+    LoggedEntry entry;
+    Iterator entries(db_, next_index_);
+    if (!entries.GetNextEntry(&entry)) {
+      return false;
+    }
+    *sequence_number = entry.sequence_number();
+    CHECK(entry.LeafHash(leaf_hash));
+    next_index_ = entry.sequence_number() + 1;
+    return true;
+  }
+
+ private:
+  bool Buffered() const {
+    return next_index_ >= buffer_begin_ &&
+           next_index_ < buffer_begin_ +
+                             static_cast<int64_t>(buffer_.size() / kHashBytes);
+  }
+
+  // Fills |buffer_| with the leaf hashes from |next_index_| on, from
+  // the stored chunk it is in, or from those not stored yet. Leaves it
+  // empty if they are not at hand.
+  void Refill() {
+    buffer_.clear();
+    buffer_begin_ = next_index_;
+    {
+      lock_guard<mutex> lock(db_->lock_);
+      if (next_index_ >= db_->index_checkpoint_) {
+        // Only the contiguous ones, the others are sparse.
+        for (auto it(db_->unindexed_hashes_.find(next_index_));
+             it != db_->unindexed_hashes_.end() &&
+             it->first < db_->contiguous_size_ &&
+             it->first == buffer_begin_ +
+                              static_cast<int64_t>(buffer_.size() /
+                                                   kHashBytes);
+             ++it) {
+          buffer_.append(it->second.second);
+        }
+        return;
+      }
+    }
+
+    // Chunks are immutable once written, so they can be read without
+    // the lock.
+    const int64_t chunk_begin(next_index_ -
+                              next_index_ % kIndexCheckpointInterval);
+    if (chunk_begin == missing_chunk_) {
+      return;
+    }
+    string chunk;
+    if (!db_->meta_storage_
+             ->LookupEntry(kMetaLeafHashIndexPrefix +
+                               FormatSequenceNumber(chunk_begin),
+                           &chunk)
+             .ok()) {
+      missing_chunk_ = chunk_begin;
+      return;
+    }
+    CHECK_EQ(kIndexCheckpointInterval * kHashBytes, chunk.size())
+        << "Leaf hash index chunk " << chunk_begin << " is truncated";
+    buffer_ = chunk.substr((next_index_ - chunk_begin) * kHashBytes);
+  }
+
+  const FileDB* const db_;
+  int64_t next_index_;
+  // The leaf hashes from |buffer_begin_| on.
+  string buffer_;
+  int64_t buffer_begin_;
+  // The start of the last chunk found not to be stored, whose leaf
+  // hashes are read from the entries instead.
+  int64_t missing_chunk_;
+};
+
+
 FileDB::FileDB(FileStorage* cert_storage, FileStorage* tree_storage,
                FileStorage* meta_storage)
     : cert_storage_(CHECK_NOTNULL(cert_storage)),
       tree_storage_(CHECK_NOTNULL(tree_storage)),
       meta_storage_(CHECK_NOTNULL(meta_storage)),
       contiguous_size_(0),
+      id_by_hash_memory_("db_hash_index"),
+      index_checkpoint_(0),
       latest_tree_timestamp_(0) {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("open"));
   BuildIndex();
@@ -131,37 +264,110 @@ Database::WriteResult FileDB::CreateSequencedEntry_(
   }
   CHECK_EQ(status, ::util::OkStatus());
 
-  InsertEntryMapping(logged.sequence_number(), logged.Hash());
+  const string hash(logged.Hash());
+  string leaf_hash;
+  CHECK(logged.LeafHash(&leaf_hash));
+  InsertEntryMapping(logged.sequence_number(), hash);
+  unindexed_hashes_[logged.sequence_number()] = EntryHashes(hash, leaf_hash);
+  timestamp_index_.Add(logged.sequence_number(), logged.timestamp());
+  WriteIndexCheckpoints();
 
   return this->OK;
 }
 
 
+Database::WriteResult FileDB::CreateSequencedEntries_(
+    const vector<const LoggedEntry*>& entries) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("create_sequenced_entries"));
+
+  vector<pair<string, string>> writes;
+  vector<pair<int64_t, EntryHashes>> hashes;
+  // Where the entries of the batch went in |writes|, by key.
+  map<string, size_t> batch_writes;
+  Database::WriteResult result(this->OK);
+
+  lock_guard<mutex> lock(lock_);
+
+  for (const LoggedEntry* logged : entries) {
+    string data;
+    CHECK(logged->SerializeToString(&data));
+    const string seq_str(FormatSequenceNumber(logged->sequence_number()));
+
+    // Entries already there, whether stored or earlier in the batch,
+    // are fine if they are the same.
+    const auto batch_write(batch_writes.find(seq_str));
+    if (batch_write != batch_writes.end()) {
+      if (writes[batch_write->second].second != data) {
+        result = this->SEQUENCE_NUMBER_ALREADY_IN_USE;
+        break;
+      }
+      continue;
+    }
+    string existing_data;
+    const util::Status status(
+        cert_storage_->LookupEntry(seq_str, &existing_data));
+    if (status.ok()) {
+      if (existing_data != data) {
+        result = this->SEQUENCE_NUMBER_ALREADY_IN_USE;
+        break;
+      }
+      continue;
+    }
+    CHECK_EQ(status.CanonicalCode(), util::error::NOT_FOUND);
+
+    batch_writes.emplace(seq_str, writes.size());
+    writes.emplace_back(seq_str, std::move(data));
+    string leaf_hash;
+    CHECK(logged->LeafHash(&leaf_hash));
+    hashes.emplace_back(logged->sequence_number(),
+                        EntryHashes(logged->Hash(), leaf_hash));
+    timestamp_index_.Add(logged->sequence_number(), logged->timestamp());
+  }
+
+  // The entries before one that could not be created still are.
+  if (!writes.empty()) {
+    CHECK_EQ(cert_storage_->CreateEntries(writes), ::util::OkStatus());
+  }
+  for (const pair<int64_t, EntryHashes>& seq_hashes : hashes) {
+    InsertEntryMapping(seq_hashes.first, seq_hashes.second.first);
+    unindexed_hashes_.insert(seq_hashes);
+  }
+  WriteIndexCheckpoints();
+
+  return result;
+}
+
+
 Database::LookupResult FileDB::LookupByHash(const string& hash,
                                             LoggedEntry* result) const {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_hash"));
 
-  unique_lock<mutex> lock(lock_);
-
-  auto i(id_by_hash_.find(hash));
-  if (i == id_by_hash_.end()) {
-    return this->NOT_FOUND;
+  vector<int64_t> candidates;
+  {
+    lock_guard<mutex> lock(lock_);
+    id_by_hash_.Find(hash, &candidates);
   }
-  const string seq_str(FormatSequenceNumber(i->second));
-
-  lock.unlock();
 
+  // The index only knows about hash prefixes, so check the entries
+  // themselves, lowest sequence number first.
   string cert_data;
-  const util::Status status(cert_storage_->LookupEntry(seq_str, &cert_data));
-  // Gotta be there, or we're in trouble...
-  CHECK_EQ(status, ::util::OkStatus());
-
-  if (result) {
-    CHECK(result->ParseFromString(cert_data));
-    CHECK_EQ(result->Hash(), hash);
+  LoggedEntry logged;
+  for (const int64_t seq : candidates) {
+    const util::Status status(
+        cert_storage_->LookupEntry(FormatSequenceNumber(seq), &cert_data));
+    // Gotta be there, or we're in trouble...
+    CHECK_EQ(status, ::util::OkStatus());
+    CHECK(logged.ParseFromString(cert_data));
+    if (logged.Hash() == hash) {
+      if (result) {
+        result->CopyFrom(logged);
+      }
+      return this->LOOKUP_OK;
+    }
   }
 
-  return this->LOOKUP_OK;
+  return this->NOT_FOUND;
 }
 
 
@@ -189,6 +395,71 @@ unique_ptr<Database::Iterator> FileDB::ScanEntries(int64_t start_index) const {
 }
 
 
+unique_ptr<Database::LeafHashIterator> FileDB::ScanLeafHashes(
+    int64_t start_index) const {
+  return unique_ptr<LeafHashIterator>(
+      new LeafHashIterator(this, start_index));
+}
+
+
+void FileDB::ReadEntries(int64_t start_index, int64_t end_index,
+                         size_t max_bytes, ReadPattern,
+                         vector<LoggedEntry>* entries) const {
+  CHECK_GE(start_index, 0);
+  CHECK_NOTNULL(entries);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("read_entries"));
+
+  // Work out which entries exist up front, so that the files can then
+  // be read without the lock, rather than going back to it for every
+  // entry.
+  {
+    lock_guard<mutex> lock(lock_);
+    if (start_index < contiguous_size_) {
+      end_index = min(end_index, contiguous_size_ - 1);
+    } else {
+      int64_t last(start_index - 1);
+      for (set<int64_t>::const_iterator it(
+               sparse_entries_.lower_bound(start_index));
+           it != sparse_entries_.end() && *it == last + 1 &&
+           *it <= end_index;
+           ++it) {
+        last = *it;
+      }
+      end_index = last;
+    }
+  }
+
+  // The files are read a batch at a time, which FileStorage can have
+  // in flight all at once.
+  size_t bytes(0);
+  vector<string> keys;
+  vector<string> cert_data;
+  for (int64_t batch_start = start_index; batch_start <= end_index;
+       batch_start += kReadEntriesBatchSize) {
+    const int64_t batch_end(
+        min(end_index, batch_start + kReadEntriesBatchSize - 1));
+    keys.clear();
+    for (int64_t seq = batch_start; seq <= batch_end; ++seq) {
+      keys.push_back(FormatSequenceNumber(seq));
+    }
+    const vector<util::Status> statuses(
+        cert_storage_->LookupEntries(keys, &cert_data));
+    for (int64_t seq = batch_start; seq <= batch_end; ++seq) {
+      const size_t i(seq - batch_start);
+      CHECK_EQ(statuses[i], ::util::OkStatus());
+      if (seq > start_index && bytes + cert_data[i].size() > max_bytes) {
+        return;
+      }
+      bytes += cert_data[i].size();
+
+      entries->emplace_back();
+      CHECK(entries->back().ParseFromString(cert_data[i]));
+      CHECK_EQ(entries->back().sequence_number(), seq);
+    }
+  }
+}
+
+
 Database::WriteResult FileDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
   CHECK_GE(sth.tree_size(), 0);
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("write_tree_head"));
@@ -235,6 +506,41 @@ Database::LookupResult FileDB::LatestTreeHead(
 }
 
 
+Database::WriteResult FileDB::WriteTreeCheckpoint_(
+    const ct::CompactTreeCheckpoint& checkpoint) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("write_tree_checkpoint"));
+  string data;
+  CHECK(checkpoint.SerializeToString(&data));
+
+  lock_guard<mutex> lock(lock_);
+  const util::Status status(
+      meta_storage_->CreateEntry(kMetaTreeCheckpointKey, data));
+  if (status.CanonicalCode() == util::error::ALREADY_EXISTS) {
+    CHECK_EQ(meta_storage_->UpdateEntry(kMetaTreeCheckpointKey, data),
+             ::util::OkStatus());
+  } else {
+    CHECK_EQ(status, ::util::OkStatus());
+  }
+  return this->OK;
+}
+
+
+Database::LookupResult FileDB::LatestTreeCheckpoint(
+    ct::CompactTreeCheckpoint* result) const {
+  CHECK_NOTNULL(result);
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("latest_tree_checkpoint"));
+  string data;
+  lock_guard<mutex> lock(lock_);
+  if (!meta_storage_->LookupEntry(kMetaTreeCheckpointKey, &data).ok()) {
+    return this->NOT_FOUND;
+  }
+  CHECK(result->ParseFromString(data));
+  return this->LOOKUP_OK;
+}
+
+
 int64_t FileDB::TreeSize() const {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("tree_size"));
   lock_guard<mutex> lock(lock_);
@@ -243,6 +549,13 @@ int64_t FileDB::TreeSize() const {
 }
 
 
+int64_t FileDB::FirstSequenceNumberSince(uint64_t timestamp) const {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("first_sequence_number_since"));
+  return timestamp_index_.Lookup(*this, timestamp);
+}
+
+
 void FileDB::AddNotifySTHCallback(
     const Database::NotifySTHCallback* callback) {
   unique_lock<mutex> lock(lock_);
@@ -289,32 +602,55 @@ Database::LookupResult FileDB::NodeId(string* node_id) {
 
 void FileDB::BuildIndex() {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("build_index"));
+  const steady_clock::time_point start(steady_clock::now());
   // Technically, this should only be called from the constructor, so
   // this should not be necessarily, but just to be sure...
   lock_guard<mutex> lock(lock_);
 
-  const set<string> sequence_numbers(cert_storage_->Scan());
-  id_by_hash_.reserve(sequence_numbers.size());
-
-  for (const auto& seq_path : sequence_numbers) {
-    const int64_t seq(ParseSequenceNumber(seq_path));
-    string cert_data;
-    // Read the data; tolerate no errors.
-    CHECK_EQ(cert_storage_->LookupEntry(seq_path, &cert_data),
-             ::util::OkStatus())
-        << "Failed to read entry with sequence number " << seq;
-
-    LoggedEntry logged;
-    CHECK(logged.ParseFromString(cert_data))
-        << "Failed to parse entry with sequence number " << seq;
-    CHECK(logged.has_sequence_number())
-        << "sequence_number() is unset for for entry with sequence number "
-        << seq;
-    CHECK_EQ(logged.sequence_number(), seq)
-        << "Entry has a negative sequence_number(): " << seq;
+  ReadIndexCheckpoints();
+
+  // The entries below the checkpoint are indexed already, so only the
+  // ones after it need to be read. Reading, parsing and hashing them
+  // is what takes time, so each worker of the scan does that for the
+  // entries it finds, as it finds them, and their hashes are only
+  // merged into |id_by_hash_| at the end. Their leaf hashes are kept
+  // too, for ScanLeafHashes() to build the Merkle tree from, rather
+  // than reading the entries a second time.
+  // The number of entries is not known until they are all found.
+  StartupPhase phase("filedb_build_index");
+  const int thread_count(BuildIndexThreadCount());
+  vector<vector<pair<int64_t, EntryHashes>>> worker_hashes(thread_count);
+  cert_storage_->ScanKeys(
+      thread_count,
+      [this, &worker_hashes, &phase](size_t worker, const string& seq_path) {
+        if (ParseSequenceNumber(seq_path) >= index_checkpoint_) {
+          IndexEntry(seq_path, &worker_hashes[worker]);
+          phase.AddDone(1);
+        }
+      });
 
-    InsertEntryMapping(logged.sequence_number(), logged.Hash());
+  size_t entry_count(0);
+  for (const vector<pair<int64_t, EntryHashes>>& hashes : worker_hashes) {
+    entry_count += hashes.size();
+  }
+  id_by_hash_.Reserve(index_checkpoint_ + entry_count);
+  id_by_hash_memory_.Set(id_by_hash_.AllocatedBytes());
+  for (vector<pair<int64_t, EntryHashes>>& hashes : worker_hashes) {
+    for (const pair<int64_t, EntryHashes>& seq_hashes : hashes) {
+      InsertEntryMapping(seq_hashes.first, seq_hashes.second.first);
+      unindexed_hashes_.insert(seq_hashes);
+    }
+    vector<pair<int64_t, EntryHashes>>().swap(hashes);
   }
+  // Databases written before the hashes were stored get all of theirs
+  // written here.
+  WriteIndexCheckpoints();
+
+  const milliseconds elapsed(
+      duration_cast<milliseconds>(steady_clock::now() - start));
+  build_index_time_ms->Set(elapsed.count());
+  LOG(INFO) << "Indexed " << entry_count << " entries with " << thread_count
+            << " threads in " << elapsed.count() << " ms";
 
   // Now read the STH entries.
   set<string> sth_timestamps = tree_storage_->Scan();
@@ -328,6 +664,32 @@ void FileDB::BuildIndex() {
 }
 
 
+void FileDB::IndexEntry(const string& seq_path,
+                        vector<pair<int64_t, EntryHashes>>* hashes) const {
+  CHECK_NOTNULL(hashes);
+  const int64_t seq(ParseSequenceNumber(seq_path));
+  // Read the data; tolerate no errors.
+  string cert_data;
+  CHECK_EQ(cert_storage_->LookupEntry(seq_path, &cert_data),
+           ::util::OkStatus())
+      << "Failed to read entry with sequence number " << seq;
+
+  LoggedEntry logged;
+  CHECK(logged.ParseFromString(cert_data))
+      << "Failed to parse entry with sequence number " << seq;
+  CHECK(logged.has_sequence_number())
+      << "sequence_number() is unset for for entry with sequence number "
+      << seq;
+  CHECK_EQ(logged.sequence_number(), seq)
+      << "Entry has a negative sequence_number(): " << seq;
+
+  string leaf_hash;
+  CHECK(logged.LeafHash(&leaf_hash))
+      << "Failed to hash entry with sequence number " << seq;
+  hashes->emplace_back(seq, EntryHashes(logged.Hash(), leaf_hash));
+}
+
+
 Database::LookupResult FileDB::LatestTreeHeadNoLock(
     ct::SignedTreeHead* result) const {
   if (latest_tree_timestamp_ == 0) {
@@ -346,12 +708,82 @@ Database::LookupResult FileDB::LatestTreeHeadNoLock(
 
 
 // This must be called with "lock_" held.
-void FileDB::InsertEntryMapping(int64_t sequence_number, const string& hash) {
-  if (!id_by_hash_.insert(make_pair(hash, sequence_number)).second) {
-    // This is a duplicate hash under a new sequence number.
-    // Make sure we track the entry with the lowest sequence number:
-    id_by_hash_[hash] = min(id_by_hash_[hash], sequence_number);
+void FileDB::ReadIndexCheckpoints() {
+  map<int64_t, string> chunk_keys;
+  for (const string& key : meta_storage_->Scan()) {
+    if (key.compare(0, strlen(kMetaHashIndexPrefix), kMetaHashIndexPrefix) ==
+        0) {
+      chunk_keys.emplace(
+          ParseSequenceNumber(key.substr(strlen(kMetaHashIndexPrefix))), key);
+    }
+  }
+
+  string hashes;
+  for (const auto& chunk_key : chunk_keys) {
+    // A chunk past a missing one cannot be used, as the entries in
+    // between are not known to be indexed.
+    if (chunk_key.first != index_checkpoint_) {
+      LOG(WARNING) << "Ignoring hash index chunk " << chunk_key.second;
+      break;
+    }
+    CHECK_EQ(meta_storage_->LookupEntry(chunk_key.second, &hashes),
+             ::util::OkStatus());
+    CHECK_EQ(0U, hashes.size() % kHashBytes)
+        << "Hash index chunk " << chunk_key.second << " is truncated";
+    for (size_t i = 0; i < hashes.size(); i += kHashBytes) {
+      InsertEntryMapping(index_checkpoint_++,
+                         hashes.substr(i, kHashBytes));
+    }
+  }
+}
+
+
+// This must be called with "lock_" held.
+void FileDB::WriteIndexCheckpoints() {
+  while (contiguous_size_ >= index_checkpoint_ + kIndexCheckpointInterval) {
+    const int64_t end(index_checkpoint_ + kIndexCheckpointInterval);
+    string hashes;
+    string leaf_hashes;
+    hashes.reserve(kIndexCheckpointInterval * kHashBytes);
+    leaf_hashes.reserve(kIndexCheckpointInterval * kHashBytes);
+    int64_t seq(index_checkpoint_);
+    for (auto it(unindexed_hashes_.begin());
+         it != unindexed_hashes_.end() && it->first < end;
+         it = unindexed_hashes_.erase(it), ++seq) {
+      CHECK_EQ(seq, it->first);
+      CHECK_EQ(kHashBytes, it->second.first.size());
+      CHECK_EQ(kHashBytes, it->second.second.size());
+      hashes.append(it->second.first);
+      leaf_hashes.append(it->second.second);
+    }
+    CHECK_EQ(end, seq);
+
+    const string seq_str(FormatSequenceNumber(index_checkpoint_));
+    StoreChunk(kMetaLeafHashIndexPrefix + seq_str, leaf_hashes);
+    StoreChunk(kMetaHashIndexPrefix + seq_str, hashes);
+    index_checkpoint_ = end;
   }
+}
+
+
+// This must be called with "lock_" held.
+void FileDB::StoreChunk(const string& key, const string& chunk) {
+  // A chunk can have been written before the checkpoint was lost.
+  const util::Status status(meta_storage_->CreateEntry(key, chunk));
+  if (status.CanonicalCode() == util::error::ALREADY_EXISTS) {
+    CHECK_EQ(meta_storage_->UpdateEntry(key, chunk), ::util::OkStatus());
+  } else {
+    CHECK_EQ(status, ::util::OkStatus());
+  }
+}
+
+
+// This must be called with "lock_" held.
+void FileDB::InsertEntryMapping(int64_t sequence_number, const string& hash) {
+  // Duplicate hashes get an entry each, and lookups return the one
+  // with the lowest sequence number.
+  id_by_hash_.Insert(hash, sequence_number);
+  id_by_hash_memory_.Set(id_by_hash_.AllocatedBytes());
 
   if (sequence_number == contiguous_size_) {
     ++contiguous_size_;
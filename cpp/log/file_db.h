@@ -6,10 +6,14 @@
 #include <memory>
 #include <mutex>
 #include <set>
-#include <unordered_map>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "log/database.h"
+#include "log/hash_prefix_index.h"
+#include "log/timestamp_index.h"
+#include "monitoring/memory.h"
 #include "proto/ct.pb.h"
 #include "util/statusor.h"
 
@@ -45,6 +49,11 @@ class FileDB : public Database {
   Database::WriteResult CreateSequencedEntry_(
       const LoggedEntry& logged) override;
 
+  // Commits the new entries to |cert_storage| as a group, see
+  // FileStorage::CreateEntries().
+  Database::WriteResult CreateSequencedEntries_(
+      const std::vector<const LoggedEntry*>& entries) override;
+
   Database::LookupResult LookupByHash(const std::string& hash,
                                       LoggedEntry* result) const override;
 
@@ -54,13 +63,31 @@ class FileDB : public Database {
   std::unique_ptr<Database::Iterator> ScanEntries(
       int64_t start_index) const override;
 
+  // Serves the leaf hashes from those stored along with the hash
+  // index, and from the ones computed as the database was opened, so
+  // that building the Merkle tree on startup reads no entries.
+  std::unique_ptr<Database::LeafHashIterator> ScanLeafHashes(
+      int64_t start_index) const override;
+
+  void ReadEntries(int64_t start_index, int64_t end_index, size_t max_bytes,
+                   ReadPattern pattern,
+                   std::vector<LoggedEntry>* entries) const override;
+
   Database::WriteResult WriteTreeHead_(const ct::SignedTreeHead& sth) override;
 
   Database::LookupResult LatestTreeHead(
       ct::SignedTreeHead* result) const override;
 
+  Database::WriteResult WriteTreeCheckpoint_(
+      const ct::CompactTreeCheckpoint& checkpoint) override;
+
+  Database::LookupResult LatestTreeCheckpoint(
+      ct::CompactTreeCheckpoint* result) const override;
+
   int64_t TreeSize() const override;
 
+  int64_t FirstSequenceNumberSince(uint64_t timestamp) const override;
+
   void AddNotifySTHCallback(
       const Database::NotifySTHCallback* callback) override;
 
@@ -73,11 +100,29 @@ class FileDB : public Database {
 
  private:
   class Iterator;
+  class LeafHashIterator;
+
+  // The hash and the Merkle tree leaf hash of an entry.
+  typedef std::pair<std::string, std::string> EntryHashes;
 
   void BuildIndex();
+  // Appends the sequence number and hashes of the entry at |seq_path|
+  // to |hashes|. This does not need |lock_|.
+  void IndexEntry(
+      const std::string& seq_path,
+      std::vector<std::pair<int64_t, EntryHashes>>* hashes) const;
   Database::LookupResult LatestTreeHeadNoLock(
       ct::SignedTreeHead* result) const;
+  // Loads the hashes stored by WriteIndexCheckpoints(), which moves
+  // |index_checkpoint_| up to the first entry not in them.
+  void ReadIndexCheckpoints();
+  // Stores the hashes and leaf hashes of |unindexed_hashes_| up to the
+  // contiguous size, a chunk at a time, and moves |index_checkpoint_|
+  // past them.
+  void WriteIndexCheckpoints();
   void InsertEntryMapping(int64_t sequence_number, const std::string& hash);
+  // Creates or replaces the chunk at |key| in |meta_storage_|.
+  void StoreChunk(const std::string& key, const std::string& chunk);
 
   const std::unique_ptr<FileStorage> cert_storage_;
   // Store all tree heads, but currently only support looking up the latest
@@ -90,7 +135,12 @@ class FileDB : public Database {
   mutable std::mutex lock_;
 
   int64_t contiguous_size_;
-  std::unordered_map<std::string, int64_t> id_by_hash_;
+  HashPrefixIndex id_by_hash_;
+  MemoryAccount id_by_hash_memory_;
+  // The hashes of the entries below this are kept in |meta_storage_|.
+  int64_t index_checkpoint_;
+  // The hashes of the entries from |index_checkpoint_| on.
+  std::map<int64_t, EntryHashes> unindexed_hashes_;
 
   // This is a mapping of the non-contiguous entries of the log (which
   // can happen while it is being fetched). When entries here become
@@ -101,6 +151,7 @@ class FileDB : public Database {
   // The same as a string;
   std::string latest_timestamp_key_;
   DatabaseNotifierHelper callbacks_;
+  TimestampIndex timestamp_index_;
 };
 
 
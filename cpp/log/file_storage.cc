@@ -3,21 +3,63 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <algorithm>
+#include <atomic>
 #include <cstdlib>
 #include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include "base/notification.h"
+#include "config.h"
 #include "log/filesystem_ops.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
 using cert_trans::BasicFilesystemOps;
 using cert_trans::FilesystemOps;
+using cert_trans::IoUringFilesystemOps;
+using std::atomic;
+using std::min;
+using std::pair;
+using std::set;
 using std::string;
+using std::unique_ptr;
+using std::vector;
+
+DEFINE_bool(file_storage_io_uring, false,
+            "Whether file storage does its batches of filesystem operations "
+            "(when writing several entries at once, and reading ranges of "
+            "them) through io_uring, with all of a batch in flight at once, "
+            "rather than one by one. Falls back to the latter where io_uring "
+            "is not available.");
 
 namespace cert_trans {
+namespace {
+
+
+FilesystemOps* DefaultFilesystemOps() {
+  if (FLAGS_file_storage_io_uring) {
+    unique_ptr<IoUringFilesystemOps> io_uring_ops(
+        IoUringFilesystemOps::Create());
+    if (io_uring_ops) {
+      return io_uring_ops.release();
+    }
+    LOG(WARNING) << "io_uring is not available, doing filesystem "
+                    "operations one by one";
+  }
+  return new BasicFilesystemOps;
+}
+
+
+}  // namespace
 
 
 FileStorage::FileStorage(const string& file_base, int storage_depth)
@@ -25,7 +67,7 @@ FileStorage::FileStorage(const string& file_base, int storage_depth)
       tmp_dir_(file_base + "/tmp"),
       tmp_file_template_(tmp_dir_ + "/tmpXXXXXX"),
       storage_depth_(storage_depth),
-      file_op_(new BasicFilesystemOps()) {
+      file_op_(DefaultFilesystemOps()) {
   CHECK_GE(storage_depth_, 0);
   CreateMissingDirectory(storage_dir_);
   CreateMissingDirectory(tmp_dir_);
@@ -52,11 +94,45 @@ FileStorage::~FileStorage() {
 
 std::set<string> FileStorage::Scan() const {
   std::set<string> storage_keys;
-  ScanDir(storage_dir_, storage_depth_, &storage_keys);
+  ScanDir(storage_dir_, storage_depth_, 0,
+          [&storage_keys](size_t, const string& key) {
+            storage_keys.insert(key);
+          });
   return storage_keys;
 }
 
 
+void FileStorage::ScanKeys(int thread_count,
+                           const ScanCallback& callback) const {
+  CHECK_GT(thread_count, 0);
+  if (storage_depth_ == 0 || thread_count == 1) {
+    ScanDir(storage_dir_, storage_depth_, 0, callback);
+    return;
+  }
+
+  // The top-level directories are the units of work, handed out to
+  // whichever worker is free next, as some may hold more keys than
+  // others.
+  const vector<string> shards(ListDir(storage_dir_));
+  const size_t worker_count(min<size_t>(thread_count, shards.size()));
+  atomic<size_t> next_shard(0);
+  ThreadPool pool(worker_count);
+  vector<Notification> done(worker_count);
+  for (size_t worker = 0; worker < worker_count; ++worker) {
+    pool.Add([this, &shards, &next_shard, &done, &callback, worker]() {
+      for (size_t i = next_shard++; i < shards.size(); i = next_shard++) {
+        ScanDir(storage_dir_ + "/" + shards[i], storage_depth_ - 1, worker,
+                callback);
+      }
+      done[worker].Notify();
+    });
+  }
+  for (const Notification& notification : done) {
+    notification.WaitForNotification();
+  }
+}
+
+
 util::Status FileStorage::CreateEntry(const string& key, const string& data) {
   if (LookupEntry(key, NULL).ok()) {
     return util::Status(util::error::ALREADY_EXISTS,
@@ -67,6 +143,75 @@ util::Status FileStorage::CreateEntry(const string& key, const string& data) {
 }
 
 
+util::Status FileStorage::CreateEntries(
+    const vector<pair<string, string>>& entries) {
+  set<string> keys;
+  vector<string> hexes;
+  vector<string> paths;
+  hexes.reserve(entries.size());
+  paths.reserve(entries.size());
+  for (const pair<string, string>& entry : entries) {
+    if (!keys.insert(entry.first).second) {
+      return util::Status(util::error::INVALID_ARGUMENT,
+                          "duplicate key in entries: " + entry.first);
+    }
+    hexes.push_back(util::HexString(entry.first));
+    paths.push_back(StoragePath(entry.first));
+  }
+  const vector<int> exists(file_op_->AccessAll(paths, F_OK));
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (exists[i] == 0) {
+      return util::Status(util::error::ALREADY_EXISTS,
+                          "entry already exists: " + entries[i].first);
+    }
+    CHECK_EQ(exists[i], ENOENT) << "Cannot access " << paths[i] << ": "
+                                << strerror(exists[i]);
+  }
+
+  vector<int> fds;
+  vector<const string*> data;
+  vector<pair<string, string>> renames;
+  set<string> dirs;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const string dir(CreateStorageDirectories(hexes[i]));
+    dirs.insert(dir);
+    string tmp_file;
+    fds.push_back(CreateTemporaryFile(&tmp_file));
+    data.push_back(&entries[i].second);
+    renames.emplace_back(tmp_file,
+                         dir + "/" + StoragePathBasename(hexes[i]));
+  }
+  const vector<int> written(file_op_->WriteAll(fds, data));
+  for (size_t i = 0; i < renames.size(); ++i) {
+    CHECK_EQ(written[i], 0) << "Failed to write " << renames[i].first << ": "
+                            << strerror(written[i]);
+  }
+
+  // Only put the files in place once their data is on disk, so that
+  // none of them can be found empty after a crash.
+  SyncFiles(fds);
+  for (const int fd : fds) {
+    PCHECK(close(fd) == 0);
+  }
+  for (const int renamed : file_op_->RenameAll(renames)) {
+    CHECK_EQ(renamed, 0) << "Failed to rename: " << strerror(renamed);
+  }
+
+  fds.clear();
+  for (const string& dir : dirs) {
+    const int fd(open(dir.c_str(), O_RDONLY));
+    PCHECK(fd >= 0) << "Cannot open " << dir;
+    fds.push_back(fd);
+  }
+  SyncFiles(fds);
+  for (const int fd : fds) {
+    PCHECK(close(fd) == 0);
+  }
+
+  return ::util::OkStatus();
+}
+
+
 util::Status FileStorage::UpdateEntry(const string& key, const string& data) {
   if (!LookupEntry(key, NULL).ok()) {
     return util::Status(util::error::NOT_FOUND,
@@ -90,6 +235,31 @@ util::Status FileStorage::LookupEntry(const string& key,
 }
 
 
+vector<util::Status> FileStorage::LookupEntries(
+    const vector<string>& keys, vector<string>* results) const {
+  vector<string> paths;
+  paths.reserve(keys.size());
+  for (const string& key : keys) {
+    paths.push_back(StoragePath(key));
+  }
+  const vector<int> read(file_op_->ReadAll(paths, CHECK_NOTNULL(results)));
+
+  vector<util::Status> statuses;
+  statuses.reserve(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    if (read[i] == ENOENT) {
+      statuses.emplace_back(util::error::NOT_FOUND,
+                            "entry not found: " + keys[i]);
+      continue;
+    }
+    CHECK_EQ(read[i], 0) << "Failed to read " << paths[i] << ": "
+                         << strerror(read[i]);
+    statuses.push_back(::util::OkStatus());
+  }
+  return statuses;
+}
+
+
 string FileStorage::StoragePathBasename(const string& hex) const {
   if (hex.length() <= static_cast<uint>(storage_depth_))
     return "-";
@@ -132,16 +302,22 @@ string FileStorage::StorageKey(const string& storage_path) const {
 }
 
 
-void FileStorage::WriteStorageEntry(const string& key, const string& data) {
-  string hex = util::HexString(key);
-
-  // Make the intermediate directories, if needed.
-  // TODO(ekasper): we can skip this if we know we're updating.
+string FileStorage::CreateStorageDirectories(const string& hex) {
   string dir = storage_dir_;
   for (int n = 0; n < storage_depth_; ++n) {
     dir += "/" + StoragePathComponent(hex, n);
     CreateMissingDirectory(dir);
   }
+  return dir;
+}
+
+
+void FileStorage::WriteStorageEntry(const string& key, const string& data) {
+  string hex = util::HexString(key);
+
+  // Make the intermediate directories, if needed.
+  // TODO(ekasper): we can skip this if we know we're updating.
+  const string dir(CreateStorageDirectories(hex));
 
   // == StoragePath(key)
   string filename = dir + "/" + StoragePathBasename(hex);
@@ -149,36 +325,46 @@ void FileStorage::WriteStorageEntry(const string& key, const string& data) {
 }
 
 
-void FileStorage::ScanFiles(const string& dir_path,
-                            std::set<string>* keys) const {
+vector<string> FileStorage::ListDir(const string& dir_path) const {
+  // TODO: make opendir part of filesystemop.
   DIR* dir = CHECK_NOTNULL(opendir(dir_path.c_str()));
+  vector<string> names;
   struct dirent* entry;
   while ((entry = readdir(dir)) != NULL) {
     if (entry->d_name[0] == '.')
       continue;
-    keys->insert(StorageKey(dir_path + "/" + entry->d_name));
+    names.emplace_back(entry->d_name);
   }
   closedir(dir);
+  return names;
 }
 
 
-void FileStorage::ScanDir(const string& dir_path, int depth,
-                          std::set<string>* keys) const {
+void FileStorage::ScanFiles(const string& dir_path, size_t worker,
+                            const ScanCallback& callback) const {
+  DIR* dir = CHECK_NOTNULL(opendir(dir_path.c_str()));
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
+    callback(worker, StorageKey(dir_path + "/" + entry->d_name));
+  }
+  closedir(dir);
+}
+
+
+void FileStorage::ScanDir(const string& dir_path, int depth, size_t worker,
+                          const ScanCallback& callback) const {
   CHECK_GE(depth, 0);
   if (depth > 0) {
-    // Parse subdirectories. (TODO: make opendir part of filesystemop).
-    DIR* dir = CHECK_NOTNULL(opendir(dir_path.c_str()));
-    struct dirent* entry;
-    std::set<string> result;
-    while ((entry = readdir(dir)) != NULL) {
-      if (entry->d_name[0] == '.')
-        continue;
-      ScanDir(dir_path + "/" + entry->d_name, depth - 1, keys);
+    // Parse subdirectories. There are at most 17 of them (hex digits
+    // and "-"), so they can be listed first.
+    for (const string& name : ListDir(dir_path)) {
+      ScanDir(dir_path + "/" + name, depth - 1, worker, callback);
     }
-    closedir(dir);
   } else {
     // depth == 0; parse files.
-    ScanFiles(dir_path, keys);
+    ScanFiles(dir_path, worker, callback);
   }
 }
 
@@ -203,6 +389,32 @@ void FileStorage::AtomicWriteBinaryFile(const string& file_path,
 }
 
 
+int FileStorage::CreateTemporaryFile(string* tmp_file) {
+  vector<char> name(tmp_file_template_.begin(), tmp_file_template_.end());
+  name.push_back('\0');
+  const int fd(mkstemp(name.data()));
+  PCHECK(fd >= 0) << "Failed to create a file in " << tmp_dir_;
+  tmp_file->assign(name.data());
+  return fd;
+}
+
+
+void FileStorage::SyncFiles(const vector<int>& fds) const {
+  if (fds.empty()) {
+    return;
+  }
+#ifdef HAVE_SYNCFS
+  // All the files are on the same filesystem, and flushing it in one
+  // go costs about as much as flushing any one of them.
+  PCHECK(syncfs(fds.front()) == 0) << "Failed to sync " << storage_dir_;
+#else
+  for (const int fd : fds) {
+    PCHECK(fsync(fd) == 0) << "Failed to sync in " << storage_dir_;
+  }
+#endif
+}
+
+
 void FileStorage::CreateMissingDirectory(const string& dir_path) {
   if (file_op_->mkdir(dir_path, 0700) != 0) {
     CHECK_EQ(errno, EEXIST);
@@ -1,10 +1,14 @@
 #ifndef CERT_TRANS_LOG_FILE_STORAGE_H_
 #define CERT_TRANS_LOG_FILE_STORAGE_H_
 
+#include <stddef.h>
 #include <stdint.h>
+#include <functional>
 #include <memory>
 #include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "util/status.h"
 
@@ -43,7 +47,8 @@ class FilesystemOps;
 // threadsafe.
 class FileStorage {
  public:
-  // Default constructor, uses BasicFilesystemOps.
+  // Default constructor, uses BasicFilesystemOps, or
+  // IoUringFilesystemOps with --file_storage_io_uring.
   FileStorage(const std::string& file_base, int storage_depth);
   // Takes ownership of the FilesystemOps.
   FileStorage(const std::string& file_base, int storage_depth,
@@ -52,34 +57,77 @@ class FileStorage {
   FileStorage(const FileStorage&) = delete;
   FileStorage& operator=(const FileStorage&) = delete;
 
+  // Called by ScanKeys() with each key, and which of its workers
+  // found it, from 0 to |thread_count| - 1.
+  typedef std::function<void(size_t worker, const std::string& key)>
+      ScanCallback;
+
   // Scan the entire database and return the list of keys.
   std::set<std::string> Scan() const;
 
+  // Scan the entire database, calling |callback| with each key as the
+  // directories are read, in no particular order, and without keeping
+  // the keys around. The top-level directories are shared out between
+  // |thread_count| workers, each with its own thread, so |callback| is
+  // called from that many threads at once, but never concurrently for
+  // the same |worker|.
+  void ScanKeys(int thread_count, const ScanCallback& callback) const;
+
   // Write (key, data) unless an entry matching |key| already exists.
   util::Status CreateEntry(const std::string& key, const std::string& data);
 
+  // Write all the (key, data) |entries|, unless one of their keys
+  // already exists (or appears twice), in which case nothing is
+  // written. The entries are committed as a group: all of their
+  // temporary files are written, then synced together, and then all
+  // renamed into place, and synced again, so that the whole batch
+  // costs a couple of syncs rather than some for each entry. Unlike
+  // CreateEntry(), the entries are on disk once this returns. The
+  // checks, writes and renames each go through the batch operations
+  // of the FilesystemOps.
+  util::Status CreateEntries(
+      const std::vector<std::pair<std::string, std::string>>& entries);
+
   // Update an existing entry; fail if it doesn't already exist.
   util::Status UpdateEntry(const std::string& key, const std::string& data);
 
   // Lookup entry based on key.
   util::Status LookupEntry(const std::string& key, std::string* result) const;
 
+  // Looks up all of |keys| at once, through FilesystemOps::ReadAll(),
+  // putting the data of each in |results|, which gets as many
+  // elements. Returns the status of each lookup, as LookupEntry()
+  // would.
+  std::vector<util::Status> LookupEntries(
+      const std::vector<std::string>& keys,
+      std::vector<std::string>* results) const;
+
  private:
   std::string StoragePathBasename(const std::string& hex) const;
   std::string StoragePathComponent(const std::string& hex, int n) const;
   std::string StoragePath(const std::string& key) const;
   std::string StorageKey(const std::string& storage_path) const;
+  // Make the intermediate directories for |hex|, if needed, and
+  // return the one its file goes in.
+  std::string CreateStorageDirectories(const std::string& hex);
   // Write or overwrite.
   void WriteStorageEntry(const std::string& key, const std::string& data);
-  void ScanFiles(const std::string& dir_path,
-                 std::set<std::string>* keys) const;
-  void ScanDir(const std::string& dir_path, int depth,
-               std::set<std::string>* keys) const;
+  // The names in |dir_path|, other than the hidden ones.
+  std::vector<std::string> ListDir(const std::string& dir_path) const;
+  void ScanFiles(const std::string& dir_path, size_t worker,
+                 const ScanCallback& callback) const;
+  void ScanDir(const std::string& dir_path, int depth, size_t worker,
+               const ScanCallback& callback) const;
 
   // The following methods abort upon any error.
   bool FileExists(const std::string& file_path) const;
   void AtomicWriteBinaryFile(const std::string& file_path,
                              const std::string& data);
+  // Create a new temporary file, whose name is put in |*tmp_file|, and
+  // return its (still open) file descriptor.
+  int CreateTemporaryFile(std::string* tmp_file);
+  // Make what was written to the files of |fds| durable.
+  void SyncFiles(const std::vector<int>& fds) const;
   // Create directory, unless it already exists.
   void CreateMissingDirectory(const std::string& dir_path);
 
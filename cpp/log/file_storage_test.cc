@@ -4,6 +4,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <iostream>
+#include <mutex>
 #include <set>
 #include <string>
 
@@ -16,7 +17,10 @@
 
 using cert_trans::FailingFilesystemOps;
 using cert_trans::FileStorage;
+using cert_trans::IoUringFilesystemOps;
 using std::string;
+using std::unique_ptr;
+using std::vector;
 using util::testing::StatusIs;
 
 namespace {
@@ -73,6 +77,114 @@ TEST_F(BasicFileStorageTest, Scan) {
   EXPECT_EQ(keys, scan_keys);
 }
 
+TEST_F(BasicFileStorageTest, ScanKeys) {
+  std::set<string> keys;
+  for (int i = 0; i < 300; ++i) {
+    const string key(util::RandomString(4, 8));
+    if (keys.insert(key).second) {
+      EXPECT_OK(fs()->CreateEntry(key, "value"));
+    }
+  }
+
+  const int kThreads = 4;
+  std::mutex lock;
+  std::set<string> scan_keys;
+  fs()->ScanKeys(kThreads, [&lock, &scan_keys](size_t worker,
+                                                const string& key) {
+    EXPECT_LT(worker, static_cast<size_t>(kThreads));
+    std::lock_guard<std::mutex> guard(lock);
+    EXPECT_TRUE(scan_keys.insert(key).second);
+  });
+  EXPECT_EQ(keys, scan_keys);
+}
+
+TEST_F(BasicFileStorageTest, CreateEntries) {
+  const string key0("1234xyzw", 8);
+  const string key1("1245abcd", 8);
+  const string key2("9876", 4);
+  EXPECT_OK(fs()->CreateEntry(key0, "unicorn"));
+
+  // One existing key and nothing is written.
+  EXPECT_THAT(fs()->CreateEntries({{key1, "Alice"}, {key0, "Bob"}}),
+              StatusIs(util::error::ALREADY_EXISTS));
+  EXPECT_THAT(fs()->LookupEntry(key1, NULL), StatusIs(util::error::NOT_FOUND));
+  EXPECT_THAT(fs()->CreateEntries({{key1, "Alice"}, {key1, "Bob"}}),
+              StatusIs(util::error::INVALID_ARGUMENT));
+  EXPECT_THAT(fs()->LookupEntry(key1, NULL), StatusIs(util::error::NOT_FOUND));
+
+  EXPECT_OK(fs()->CreateEntries({{key1, "Alice"}, {key2, "Bob"}}));
+  string lookup_result;
+  EXPECT_OK(fs()->LookupEntry(key1, &lookup_result));
+  EXPECT_EQ("Alice", lookup_result);
+  EXPECT_OK(fs()->LookupEntry(key2, &lookup_result));
+  EXPECT_EQ("Bob", lookup_result);
+  EXPECT_OK(fs()->CreateEntries({}));
+
+  std::set<string> keys;
+  keys.insert(key0);
+  keys.insert(key1);
+  keys.insert(key2);
+  EXPECT_EQ(keys, fs()->Scan());
+}
+
+TEST_F(BasicFileStorageTest, LookupEntries) {
+  const string key0("1234xyzw", 8);
+  const string key1("1245abcd", 8);
+  const string key2("9876", 4);
+  EXPECT_OK(fs()->CreateEntries({{key0, "unicorn"}, {key1, ""}}));
+
+  vector<string> results;
+  const vector<util::Status> statuses(
+      fs()->LookupEntries({key0, key2, key1}, &results));
+  ASSERT_EQ(3U, statuses.size());
+  ASSERT_EQ(3U, results.size());
+  EXPECT_OK(statuses[0]);
+  EXPECT_EQ("unicorn", results[0]);
+  EXPECT_THAT(statuses[1], StatusIs(util::error::NOT_FOUND));
+  EXPECT_OK(statuses[2]);
+  EXPECT_EQ("", results[2]);
+
+  EXPECT_TRUE(fs()->LookupEntries({}, &results).empty());
+  EXPECT_TRUE(results.empty());
+}
+
+// The same batches, through io_uring where it is available.
+TEST(IoUringFileStorageTest, CreateAndLookupEntries) {
+  unique_ptr<IoUringFilesystemOps> file_op(IoUringFilesystemOps::Create());
+  if (!file_op) {
+    LOG(WARNING) << "io_uring is not available, skipping";
+    return;
+  }
+  TmpStorage tmp;
+  FileStorage db(tmp.TmpStorageDir(), kStorageDepth, file_op.release());
+
+  // Enough entries to take more than one go around the ring, of
+  // different sizes.
+  vector<std::pair<string, string>> entries;
+  vector<string> keys;
+  for (int i = 0; i < 600; ++i) {
+    keys.push_back("key" + std::to_string(i));
+    entries.emplace_back(keys.back(), string(i * 37, 'a' + i % 26));
+  }
+  EXPECT_OK(db.CreateEntries(entries));
+  EXPECT_THAT(db.CreateEntries({{keys[42], "again"}}),
+              StatusIs(util::error::ALREADY_EXISTS));
+
+  keys.push_back("missing");
+  vector<string> results;
+  const vector<util::Status> statuses(db.LookupEntries(keys, &results));
+  ASSERT_EQ(keys.size(), statuses.size());
+  for (size_t i = 0; i < entries.size(); ++i) {
+    EXPECT_OK(statuses[i]);
+    EXPECT_EQ(entries[i].second, results[i]);
+  }
+  EXPECT_THAT(statuses.back(), StatusIs(util::error::NOT_FOUND));
+
+  string lookup_result;
+  EXPECT_OK(db.LookupEntry(keys[599], &lookup_result));
+  EXPECT_EQ(entries[599].second, lookup_result);
+}
+
 TEST_F(BasicFileStorageTest, CreateDuplicate) {
   string key("1234xyzw", 8);
   string value("unicorn", 7);
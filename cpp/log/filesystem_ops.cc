@@ -1,11 +1,125 @@
 #include "log/filesystem_ops.h"
 
+#include "config.h"
+
 #include <errno.h>
+#include <fcntl.h>
+#include <glog/logging.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#include <algorithm>
+
+using std::lock_guard;
+using std::min;
+using std::mutex;
+using std::pair;
+using std::string;
+using std::unique_ptr;
+using std::vector;
 
 namespace cert_trans {
+namespace {
+
+
+// Writes |data| from |offset| on to the file open as |fd|, at the same
+// offset, and returns 0 or the errno it failed with.
+int WriteFrom(int fd, const string& data, size_t offset) {
+  while (offset < data.size()) {
+    const ssize_t written(
+        pwrite(fd, data.data() + offset, data.size() - offset, offset));
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    offset += written;
+  }
+  return 0;
+}
+
+
+// Reads the file open as |fd| from |contents->size()| on, to the end,
+// appending it to |contents|, and returns 0 or the errno it failed
+// with.
+int ReadRest(int fd, string* contents) {
+  char buf[1 << 12];
+  while (true) {
+    const ssize_t bytes(pread(fd, buf, sizeof(buf), contents->size()));
+    if (bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno;
+    }
+    if (bytes == 0) {
+      return 0;
+    }
+    contents->append(buf, bytes);
+  }
+}
+
+
+}  // namespace
+
+
+vector<int> FilesystemOps::RenameAll(
+    const vector<pair<string, string>>& renames) {
+  vector<int> results;
+  results.reserve(renames.size());
+  for (const pair<string, string>& names : renames) {
+    results.push_back(rename(names.first, names.second) == 0 ? 0 : errno);
+  }
+  return results;
+}
+
+
+vector<int> FilesystemOps::AccessAll(const vector<string>& paths,
+                                     int amode) {
+  vector<int> results;
+  results.reserve(paths.size());
+  for (const string& path : paths) {
+    results.push_back(access(path, amode) == 0 ? 0 : errno);
+  }
+  return results;
+}
+
+
+vector<int> FilesystemOps::WriteAll(const vector<int>& fds,
+                                    const vector<const string*>& data) {
+  CHECK_EQ(fds.size(), data.size());
+  vector<int> results;
+  results.reserve(fds.size());
+  for (size_t i = 0; i < fds.size(); ++i) {
+    results.push_back(WriteFrom(fds[i], *data[i], 0));
+  }
+  return results;
+}
+
+
+vector<int> FilesystemOps::ReadAll(const vector<string>& paths,
+                                   vector<string>* contents) {
+  CHECK_NOTNULL(contents)->assign(paths.size(), string());
+  vector<int> results;
+  results.reserve(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    const int fd(open(paths[i].c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd < 0) {
+      results.push_back(errno);
+      continue;
+    }
+    results.push_back(ReadRest(fd, &(*contents)[i]));
+    PCHECK(close(fd) == 0);
+  }
+  return results;
+}
 
 
 int BasicFilesystemOps::mkdir(const std::string& path, mode_t mode) {
@@ -29,6 +143,411 @@ int BasicFilesystemOps::access(const std::string& path, int amode) {
 }
 
 
+#ifdef HAVE_LINUX_IO_URING_H
+
+namespace {
+
+
+// Enough for the batches of FileStorage in one go, larger ones are
+// split.
+const unsigned kRingEntries = 256;
+
+
+io_uring_sqe MakeSqe(uint8_t opcode, int fd, const void* addr, uint32_t len,
+                     uint64_t offset) {
+  io_uring_sqe sqe;
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = opcode;
+  sqe.fd = fd;
+  sqe.addr = reinterpret_cast<uintptr_t>(addr);
+  sqe.len = len;
+  sqe.off = offset;
+  return sqe;
+}
+
+
+}  // namespace
+
+
+// The submission and completion queues of an io_uring instance, set
+// up without liburing.
+class IoUringFilesystemOps::Ring {
+ public:
+  // Returns NULL if the ring cannot be set up, or does not support
+  // all the |opcodes|.
+  static unique_ptr<Ring> Create(const vector<uint8_t>& opcodes);
+  ~Ring();
+
+  // Submits |sqes| and waits for them all to complete, returning the
+  // result of each, in the same order.
+  vector<int> Run(const vector<io_uring_sqe>& sqes);
+
+ private:
+  explicit Ring(int fd) : fd_(fd) {
+  }
+
+  bool Map(const io_uring_params& params);
+  bool Supports(const vector<uint8_t>& opcodes) const;
+
+  const int fd_;
+  void* sq_ring_ = MAP_FAILED;
+  size_t sq_ring_size_ = 0;
+  void* cq_ring_ = MAP_FAILED;
+  size_t cq_ring_size_ = 0;
+  io_uring_sqe* sqes_ = static_cast<io_uring_sqe*>(MAP_FAILED);
+  size_t sqes_size_ = 0;
+  unsigned sq_entries_ = 0;
+
+  unsigned* sq_tail_ = nullptr;
+  const unsigned* sq_mask_ = nullptr;
+  unsigned* sq_array_ = nullptr;
+  unsigned* cq_head_ = nullptr;
+  const unsigned* cq_tail_ = nullptr;
+  const unsigned* cq_mask_ = nullptr;
+  const io_uring_cqe* cqes_ = nullptr;
+};
+
+
+// static
+unique_ptr<IoUringFilesystemOps::Ring> IoUringFilesystemOps::Ring::Create(
+    const vector<uint8_t>& opcodes) {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  const int fd(syscall(__NR_io_uring_setup, kRingEntries, &params));
+  if (fd < 0) {
+    PLOG(WARNING) << "Cannot set up io_uring";
+    return nullptr;
+  }
+  unique_ptr<Ring> ring(new Ring(fd));
+  if (!ring->Map(params) || !ring->Supports(opcodes)) {
+    return nullptr;
+  }
+  return ring;
+}
+
+
+IoUringFilesystemOps::Ring::~Ring() {
+  if (sqes_ != MAP_FAILED) {
+    PCHECK(munmap(sqes_, sqes_size_) == 0);
+  }
+  if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) {
+    PCHECK(munmap(cq_ring_, cq_ring_size_) == 0);
+  }
+  if (sq_ring_ != MAP_FAILED) {
+    PCHECK(munmap(sq_ring_, sq_ring_size_) == 0);
+  }
+  PCHECK(close(fd_) == 0);
+}
+
+
+bool IoUringFilesystemOps::Ring::Map(const io_uring_params& params) {
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  const bool single_mmap(params.features & IORING_FEAT_SINGLE_MMAP);
+  if (single_mmap) {
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+  }
+
+  sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    PLOG(WARNING) << "Cannot map the io_uring submission queue";
+    return false;
+  }
+  cq_ring_ = single_mmap
+                 ? sq_ring_
+                 : mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+  if (cq_ring_ == MAP_FAILED) {
+    PLOG(WARNING) << "Cannot map the io_uring completion queue";
+    return false;
+  }
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  sqes_ = static_cast<io_uring_sqe*>(
+      mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES));
+  if (sqes_ == MAP_FAILED) {
+    PLOG(WARNING) << "Cannot map the io_uring submission queue entries";
+    return false;
+  }
+
+  char* const sq(static_cast<char*>(sq_ring_));
+  char* const cq(static_cast<char*>(cq_ring_));
+  sq_entries_ = params.sq_entries;
+  sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  sq_mask_ = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  cq_mask_ = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+  return true;
+}
+
+
+bool IoUringFilesystemOps::Ring::Supports(
+    const vector<uint8_t>& opcodes) const {
+  const size_t num_ops(256);
+  vector<char> buf(sizeof(io_uring_probe) +
+                   num_ops * sizeof(io_uring_probe_op));
+  io_uring_probe* const probe(reinterpret_cast<io_uring_probe*>(buf.data()));
+  if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe,
+              num_ops) < 0) {
+    PLOG(WARNING) << "Cannot probe the io_uring operations";
+    return false;
+  }
+  for (const uint8_t opcode : opcodes) {
+    if (opcode > probe->last_op ||
+        !(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED)) {
+      LOG(WARNING) << "io_uring does not support operation "
+                   << static_cast<int>(opcode);
+      return false;
+    }
+  }
+  return true;
+}
+
+
+vector<int> IoUringFilesystemOps::Ring::Run(
+    const vector<io_uring_sqe>& sqes) {
+  vector<int> results(sqes.size());
+  // Batches larger than the ring are split, so that the completion
+  // queue, which is twice as large, cannot overflow.
+  for (size_t begin = 0; begin < sqes.size(); begin += sq_entries_) {
+    const size_t count(min<size_t>(sq_entries_, sqes.size() - begin));
+    // Only this thread adds to the submission queue.
+    unsigned tail(*sq_tail_);
+    for (size_t i = 0; i < count; ++i) {
+      const unsigned index(tail & *sq_mask_);
+      sqes_[index] = sqes[begin + i];
+      sqes_[index].user_data = begin + i;
+      sq_array_[index] = index;
+      ++tail;
+    }
+    __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+
+    size_t submitted(0);
+    size_t completed(0);
+    while (completed < count) {
+      const int ret(syscall(__NR_io_uring_enter, fd_, count - submitted,
+                            count - completed, IORING_ENTER_GETEVENTS,
+                            nullptr, 0));
+      if (ret < 0) {
+        PCHECK(errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            << "io_uring_enter failed";
+      } else {
+        submitted += ret;
+      }
+
+      unsigned head(*cq_head_);
+      const unsigned cq_tail(__atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE));
+      for (; head != cq_tail; ++head) {
+        const io_uring_cqe& cqe(cqes_[head & *cq_mask_]);
+        results[cqe.user_data] = cqe.res;
+        ++completed;
+      }
+      __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+  }
+  return results;
+}
+
+
+// static
+unique_ptr<IoUringFilesystemOps> IoUringFilesystemOps::Create() {
+  unique_ptr<Ring> ring(Ring::Create({IORING_OP_RENAMEAT, IORING_OP_STATX,
+                                      IORING_OP_WRITE, IORING_OP_OPENAT,
+                                      IORING_OP_READ, IORING_OP_CLOSE}));
+  if (!ring) {
+    return nullptr;
+  }
+  return unique_ptr<IoUringFilesystemOps>(
+      new IoUringFilesystemOps(std::move(ring)));
+}
+
+
+IoUringFilesystemOps::IoUringFilesystemOps(unique_ptr<Ring> ring)
+    : ring_(std::move(ring)) {
+}
+
+
+IoUringFilesystemOps::~IoUringFilesystemOps() {
+}
+
+
+vector<int> IoUringFilesystemOps::RenameAll(
+    const vector<pair<string, string>>& renames) {
+  vector<io_uring_sqe> sqes;
+  sqes.reserve(renames.size());
+  for (const pair<string, string>& names : renames) {
+    sqes.push_back(MakeSqe(IORING_OP_RENAMEAT, AT_FDCWD, names.first.c_str(),
+                           AT_FDCWD,
+                           reinterpret_cast<uintptr_t>(names.second.c_str())));
+  }
+
+  lock_guard<mutex> lock(lock_);
+  vector<int> results(ring_->Run(sqes));
+  for (int& result : results) {
+    result = -result;
+  }
+  return results;
+}
+
+
+vector<int> IoUringFilesystemOps::AccessAll(const vector<string>& paths,
+                                            int amode) {
+  // Only whether the files exist can be told from their status.
+  if (amode != F_OK) {
+    return FilesystemOps::AccessAll(paths, amode);
+  }
+
+  vector<struct statx> stats(paths.size());
+  vector<io_uring_sqe> sqes;
+  sqes.reserve(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    sqes.push_back(MakeSqe(IORING_OP_STATX, AT_FDCWD, paths[i].c_str(), 0,
+                           reinterpret_cast<uintptr_t>(&stats[i])));
+  }
+
+  lock_guard<mutex> lock(lock_);
+  vector<int> results(ring_->Run(sqes));
+  for (int& result : results) {
+    result = -result;
+  }
+  return results;
+}
+
+
+vector<int> IoUringFilesystemOps::WriteAll(const vector<int>& fds,
+                                           const vector<const string*>& data) {
+  CHECK_EQ(fds.size(), data.size());
+  vector<io_uring_sqe> sqes;
+  sqes.reserve(fds.size());
+  for (size_t i = 0; i < fds.size(); ++i) {
+    sqes.push_back(
+        MakeSqe(IORING_OP_WRITE, fds[i], data[i]->data(), data[i]->size(), 0));
+  }
+
+  lock_guard<mutex> lock(lock_);
+  vector<int> results(ring_->Run(sqes));
+  for (size_t i = 0; i < results.size(); ++i) {
+    // Short writes are finished off one by one.
+    results[i] = results[i] < 0 ? -results[i]
+                                : WriteFrom(fds[i], *data[i], results[i]);
+  }
+  return results;
+}
+
+
+vector<int> IoUringFilesystemOps::ReadAll(const vector<string>& paths,
+                                          vector<string>* contents) {
+  CHECK_NOTNULL(contents)->assign(paths.size(), string());
+  lock_guard<mutex> lock(lock_);
+
+  // The files are opened and their sizes found out in one batch, read
+  // in a second one, and closed in a third.
+  vector<struct statx> stats(paths.size());
+  vector<io_uring_sqe> sqes;
+  sqes.reserve(2 * paths.size());
+  for (size_t i = 0; i < paths.size(); ++i) {
+    io_uring_sqe open_sqe(MakeSqe(IORING_OP_OPENAT, AT_FDCWD,
+                                  paths[i].c_str(), 0, 0));
+    open_sqe.open_flags = O_RDONLY | O_CLOEXEC;
+    sqes.push_back(open_sqe);
+    sqes.push_back(MakeSqe(IORING_OP_STATX, AT_FDCWD, paths[i].c_str(),
+                           STATX_SIZE,
+                           reinterpret_cast<uintptr_t>(&stats[i])));
+  }
+  const vector<int> opened(ring_->Run(sqes));
+
+  vector<int> results(paths.size());
+  vector<size_t> reads;
+  sqes.clear();
+  for (size_t i = 0; i < paths.size(); ++i) {
+    const int fd(opened[2 * i]);
+    if (fd < 0) {
+      results[i] = -fd;
+      continue;
+    }
+    if (opened[2 * i + 1] < 0) {
+      results[i] = -opened[2 * i + 1];
+      continue;
+    }
+    (*contents)[i].resize(stats[i].stx_size);
+    if (!(*contents)[i].empty()) {
+      reads.push_back(i);
+      sqes.push_back(MakeSqe(IORING_OP_READ, fd, &(*contents)[i][0],
+                             (*contents)[i].size(), 0));
+    }
+  }
+  const vector<int> read(ring_->Run(sqes));
+  for (size_t j = 0; j < reads.size(); ++j) {
+    const size_t i(reads[j]);
+    if (read[j] < 0) {
+      results[i] = -read[j];
+      (*contents)[i].clear();
+    } else if (static_cast<size_t>(read[j]) < (*contents)[i].size()) {
+      // The file was truncated since, read whatever is left of it.
+      (*contents)[i].resize(read[j]);
+      results[i] = ReadRest(opened[2 * i], &(*contents)[i]);
+    }
+  }
+
+  sqes.clear();
+  for (size_t i = 0; i < paths.size(); ++i) {
+    if (opened[2 * i] >= 0) {
+      sqes.push_back(MakeSqe(IORING_OP_CLOSE, opened[2 * i], nullptr, 0, 0));
+    }
+  }
+  for (const int result : ring_->Run(sqes)) {
+    CHECK_EQ(result, 0) << "Failed to close: " << strerror(-result);
+  }
+  return results;
+}
+
+#else  // HAVE_LINUX_IO_URING_H
+
+class IoUringFilesystemOps::Ring {};
+
+
+// static
+unique_ptr<IoUringFilesystemOps> IoUringFilesystemOps::Create() {
+  LOG(WARNING) << "Built without io_uring";
+  return nullptr;
+}
+
+
+IoUringFilesystemOps::~IoUringFilesystemOps() {
+}
+
+
+vector<int> IoUringFilesystemOps::RenameAll(
+    const vector<pair<string, string>>& renames) {
+  return FilesystemOps::RenameAll(renames);
+}
+
+
+vector<int> IoUringFilesystemOps::AccessAll(const vector<string>& paths,
+                                            int amode) {
+  return FilesystemOps::AccessAll(paths, amode);
+}
+
+
+vector<int> IoUringFilesystemOps::WriteAll(const vector<int>& fds,
+                                           const vector<const string*>& data) {
+  return FilesystemOps::WriteAll(fds, data);
+}
+
+
+vector<int> IoUringFilesystemOps::ReadAll(const vector<string>& paths,
+                                          vector<string>* contents) {
+  return FilesystemOps::ReadAll(paths, contents);
+}
+
+#endif  // HAVE_LINUX_IO_URING_H
+
+
 FailingFilesystemOps::FailingFilesystemOps(int fail_point)
     : op_count_(0), fail_point_(fail_point) {
 }
@@ -2,7 +2,11 @@
 #define CERT_TRANS_LOG_FILESYSTEM_OPS_H_
 
 #include <sys/types.h>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace cert_trans {
 
@@ -21,6 +25,27 @@ class FilesystemOps {
                      const std::string& new_name) = 0;
   virtual int access(const std::string& path, int amode) = 0;
 
+  // The batch operations below each do the same as the operation
+  // they are named after would for every item, and return what
+  // became of each: 0, or the errno it failed with. The items are
+  // independent of each other, and may be done in any order, or all
+  // at once. Unless overridden, they are done one after the other.
+
+  // As rename(), for each (old_name, new_name) of |renames|.
+  virtual std::vector<int> RenameAll(
+      const std::vector<std::pair<std::string, std::string>>& renames);
+  // As access(), for each of |paths|.
+  virtual std::vector<int> AccessAll(const std::vector<std::string>& paths,
+                                     int amode);
+  // Writes all of |data[i]| to the (new, empty) file open as |fds[i]|.
+  virtual std::vector<int> WriteAll(
+      const std::vector<int>& fds,
+      const std::vector<const std::string*>& data);
+  // Reads the whole of each of |paths| into |contents|, which gets
+  // as many elements.
+  virtual std::vector<int> ReadAll(const std::vector<std::string>& paths,
+                                   std::vector<std::string>* contents);
+
  protected:
   FilesystemOps() = default;
 };
@@ -38,6 +63,41 @@ class BasicFilesystemOps : public FilesystemOps {
 };
 
 
+// Does the batch operations with io_uring, submitting the items of a
+// batch together, so that they are all in flight at once, rather than
+// waiting on each in turn. This matters on storage with high latency,
+// such as network or spinning disks. Single operations are done as by
+// BasicFilesystemOps.
+//
+// This class is thread-safe, although batches are done one at a time.
+class IoUringFilesystemOps : public BasicFilesystemOps {
+ public:
+  // Returns NULL if io_uring is not available, or lacks some of the
+  // operations needed (renames need Linux 5.11).
+  static std::unique_ptr<IoUringFilesystemOps> Create();
+  ~IoUringFilesystemOps();
+
+  std::vector<int> RenameAll(
+      const std::vector<std::pair<std::string, std::string>>& renames)
+      override;
+  std::vector<int> AccessAll(const std::vector<std::string>& paths,
+                             int amode) override;
+  std::vector<int> WriteAll(
+      const std::vector<int>& fds,
+      const std::vector<const std::string*>& data) override;
+  std::vector<int> ReadAll(const std::vector<std::string>& paths,
+                           std::vector<std::string>* contents) override;
+
+ private:
+  class Ring;
+
+  explicit IoUringFilesystemOps(std::unique_ptr<Ring> ring);
+
+  std::mutex lock_;
+  const std::unique_ptr<Ring> ring_;
+};
+
+
 // Fail at an operation with a given op count.
 class FailingFilesystemOps : public BasicFilesystemOps {
  public:
@@ -1,7 +1,10 @@
 /* -*- indent-tabs-mode: nil -*- */
 #include "log/frontend.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <chrono>
+#include <utility>
 
 #include "log/cert.h"
 #include "log/cert_submission_handler.h"
@@ -9,15 +12,41 @@
 #include "monitoring/event_metric.h"
 #include "proto/ct.pb.h"
 #include "util/status.h"
+#include "util/task.h"
 
+using cert_trans::AdmissionController;
 using cert_trans::CertChain;
 using cert_trans::PreCertChain;
 using ct::LogEntry;
 using ct::SignedCertificateTimestamp;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::string;
 using std::lock_guard;
+using std::move;
 using std::mutex;
 using util::Status;
+using util::Task;
+
+DEFINE_double(admission_delay_pressure, 0.5,
+              "Load of the backends (1 being as much as they should "
+              "take) from which new submissions are delayed.");
+DEFINE_double(admission_throttle_pressure, 0.8,
+              "Load of the backends from which new submissions are "
+              "refused with a 429, until it reaches 1, from which they "
+              "are refused with a 503.");
+DEFINE_int32(admission_max_delay_ms, 500,
+             "Longest delay of new submissions, just before they are "
+             "throttled.");
+DEFINE_int32(admission_etcd_write_latency_ms, 2000,
+             "90th percentile of the time taken to add an entry to the "
+             "consistent store which counts as a full load.");
+DEFINE_int32(admission_db_write_latency_ms, 5000,
+             "90th percentile of the time taken to write sequenced entries "
+             "to the database which counts as a full load.");
+DEFINE_int32(admission_latency_window_seconds, 10,
+             "Latencies older than this are left out of the load.");
 
 namespace {
 
@@ -37,9 +66,22 @@ Status UpdateStats(ct::LogEntryType type, const Status& status) {
   return status;
 }
 
+AdmissionController::Limits LimitsFromFlags() {
+  AdmissionController::Limits limits;
+  limits.delay_pressure = FLAGS_admission_delay_pressure;
+  limits.throttle_pressure = FLAGS_admission_throttle_pressure;
+  limits.max_delay = milliseconds(FLAGS_admission_max_delay_ms);
+  limits.etcd_write_latency =
+      milliseconds(FLAGS_admission_etcd_write_latency_ms);
+  limits.db_write_latency = milliseconds(FLAGS_admission_db_write_latency_ms);
+  limits.latency_window = seconds(FLAGS_admission_latency_window_seconds);
+  return limits;
+}
+
 }  // namespace
 
-Frontend::Frontend(FrontendSigner* signer) : signer_(CHECK_NOTNULL(signer)) {
+Frontend::Frontend(FrontendSigner* signer)
+    : signer_(CHECK_NOTNULL(signer)), admission_(LimitsFromFlags()) {
 }
 
 Frontend::~Frontend() {
@@ -53,5 +95,64 @@ Status Frontend::QueueProcessedEntry(Status pre_status, const LogEntry& entry,
   }
 
   // Step 2. Submit to database.
-  return UpdateStats(entry.type(), signer_->QueueEntry(entry, sct));
+  const steady_clock::time_point started(steady_clock::now());
+  const Status status(signer_->QueueEntry(entry, sct));
+  if (status.ok()) {
+    admission_.RecordLatency(AdmissionController::Signal::ETCD_WRITE_LATENCY,
+                             steady_clock::now() - started);
+  }
+  return UpdateStats(entry.type(), status);
+}
+
+void Frontend::QueueProcessedEntryAsync(Status pre_status, LogEntry&& entry,
+                                        SignedCertificateTimestamp* sct,
+                                        Task* task) {
+  CHECK(entry.has_type());
+  if (!pre_status.ok()) {
+    task->Return(UpdateStats(entry.type(), pre_status));
+    return;
+  }
+
+  const ct::LogEntryType type(entry.type());
+  const steady_clock::time_point started(steady_clock::now());
+  signer_->QueueEntryAsync(
+      move(entry), sct,
+      task->AddChild([this, type, started, task](Task* child_task) {
+        // Entries which did not make it to the store (as duplicates)
+        // would make it look faster than it is.
+        if (child_task->status().ok()) {
+          admission_.RecordLatency(
+              AdmissionController::Signal::ETCD_WRITE_LATENCY,
+              steady_clock::now() - started);
+        }
+        task->Return(UpdateStats(type, child_task->status()));
+      }));
+}
+
+Status Frontend::LookupX509Chain(const CertChain& chain,
+                                 SignedCertificateTimestamp* sct) {
+  if (!chain.IsLoaded()) {
+    return Status(util::error::INVALID_ARGUMENT, "empty submission");
+  }
+
+  // Only the leaf certificate goes into the hash of the entry.
+  LogEntry entry;
+  entry.set_type(ct::X509_ENTRY);
+  const Status status(chain.LeafCert()->DerEncoding(
+      entry.mutable_x509_entry()->mutable_leaf_certificate()));
+  if (!status.ok()) {
+    return status;
+  }
+
+  const Status lookup_status(signer_->LookupEntry(entry, sct));
+  if (lookup_status.CanonicalCode() == util::error::ALREADY_EXISTS) {
+    UpdateStats(entry.type(), lookup_status);
+  }
+  return lookup_status;
+}
+
+AdmissionController::Decision Frontend::AdmitSubmission() {
+  admission_.SetLoad(AdmissionController::Signal::PENDING_ENTRIES,
+                     signer_->PendingEntriesLoad());
+  return admission_.Decide();
 }
@@ -4,6 +4,7 @@
 #include <memory>
 #include <mutex>
 
+#include "log/admission_controller.h"
 #include "log/cert.h"
 #include "proto/ct.pb.h"
 
@@ -11,12 +12,14 @@ class FrontendSigner;
 
 namespace util {
 class Status;
+class Task;
 }  // namespace util
 
 // Frontend for accepting new submissions.
 class Frontend {
  public:
-  // Takes ownership of the signer.
+  // Takes ownership of the signer. The limits of the admission
+  // controller come from the flags.
   Frontend(FrontendSigner* signer);
   ~Frontend();
   Frontend(const Frontend&) = delete;
@@ -26,8 +29,37 @@ class Frontend {
                                    const ct::LogEntry& entry,
                                    ct::SignedCertificateTimestamp* sct);
 
+  // Same as QueueProcessedEntry(), returning the status on |task|,
+  // without a thread waiting on the consistent store. |entry| is moved
+  // into the pending entry, but |sct| must stay valid until |task| is
+  // done.
+  void QueueProcessedEntryAsync(util::Status pre_status,
+                                ct::LogEntry&& entry,
+                                ct::SignedCertificateTimestamp* sct,
+                                util::Task* task);
+
+  // If the leaf certificate of |chain| is already in the database,
+  // sets |*sct| to the SCT it was given and returns ALREADY_EXISTS,
+  // like QueueProcessedEntry() would, but without the cost of checking
+  // |chain| first. Otherwise, returns NOT_FOUND (or another error), and
+  // |chain| has to be processed and queued as usual.
+  util::Status LookupX509Chain(const cert_trans::CertChain& chain,
+                               ct::SignedCertificateTimestamp* sct);
+
+  // Whether to take a new submission now, later or not at all, going
+  // by the pending entries in the consistent store and the signals
+  // reported to admission().
+  cert_trans::AdmissionController::Decision AdmitSubmission();
+
+  // The time taken to queue entries is recorded here as the
+  // ETCD_WRITE_LATENCY signal; the others are up to the owner.
+  cert_trans::AdmissionController* admission() {
+    return &admission_;
+  }
+
  private:
   const std::unique_ptr<FrontendSigner> signer_;
+  cert_trans::AdmissionController admission_;
 };
 
 #endif  // CERT_TRANS_LOG_FRONTEND_H_
@@ -2,6 +2,7 @@
 #include "log/frontend_signer.h"
 
 #include <glog/logging.h>
+#include <utility>
 
 #include "log/database.h"
 #include "log/log_signer.h"
@@ -9,6 +10,8 @@
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
 #include "util/status.h"
+#include "util/task.h"
+#include "util/trace.h"
 #include "util/util.h"
 
 using cert_trans::ConsistentStore;
@@ -16,8 +19,10 @@ using cert_trans::Database;
 using cert_trans::LoggedEntry;
 using ct::LogEntry;
 using ct::SignedCertificateTimestamp;
+using std::move;
 using std::string;
 using util::Status;
+using util::Task;
 
 
 FrontendSigner::FrontendSigner(Database* db, ConsistentStore* store,
@@ -29,18 +34,72 @@ FrontendSigner::FrontendSigner(Database* db, ConsistentStore* store,
 
 Status FrontendSigner::QueueEntry(const LogEntry& entry,
                                   SignedCertificateTimestamp* sct) {
-  const string sha256_hash(
-      Sha256Hasher::Sha256Digest(Serializer::LeafData(entry)));
-  CHECK(!sha256_hash.empty());
+  const util::trace::ScopedSpan span("frontend_signer_queue_entry");
+  cert_trans::LoggedEntry new_logged;
+  const Status prepare_status(PrepareEntry(LogEntry(entry), sct, &new_logged));
+  if (!prepare_status.ok()) {
+    return prepare_status;
+  }
+  const string sha256_hash(new_logged.Hash());
 
-  // Check if the entry already exists in the local DB (i.e. it's been
-  // integrated into the tree.)
-  // This isn't foolproof; it could be that the local node doesn't yet have
-  // a copy of this if the cert was added recently, but it's not fatal if the
-  // same cert gets added twice.
+  // If this cert has already been added (but not yet integrated into the
+  // tree), then this call will update new_logged.sct with the previously
+  // issued one.
+  util::Status status(store_->AddPendingEntry(&new_logged));
+  CHECK_EQ(new_logged.Hash(), sha256_hash);
+
+  if (sct != nullptr) {
+    *sct = new_logged.sct();
+  }
+
+  return status;
+}
+
+
+void FrontendSigner::QueueEntryAsync(LogEntry&& entry,
+                                     SignedCertificateTimestamp* sct,
+                                     Task* task) {
+  cert_trans::LoggedEntry* const new_logged(new cert_trans::LoggedEntry);
+  task->DeleteWhenDone(new_logged);
+  {
+    const util::trace::ScopedSpan span("frontend_signer_queue_entry");
+    const Status prepare_status(
+        PrepareEntry(move(entry), sct, new_logged));
+    if (!prepare_status.ok()) {
+      task->Return(prepare_status);
+      return;
+    }
+  }
+  const string sha256_hash(new_logged->Hash());
+
+  // As in QueueEntry(), the store may update the SCT of |new_logged|.
+  store_->AddPendingEntryAsync(
+      new_logged, task->AddChild([new_logged, sct, sha256_hash,
+                                  task](Task* child_task) {
+        CHECK_EQ(new_logged->Hash(), sha256_hash);
+        if (sct != nullptr) {
+          *sct = new_logged->sct();
+        }
+        task->Return(child_task->status());
+      }));
+}
+
+
+Status FrontendSigner::LookupEntry(const LogEntry& entry,
+                                   SignedCertificateTimestamp* sct) const {
   // TODO(ekasper): switch to using SignedEntryWithType as the DB key.
+  return LookupHash(Sha256Hasher::Sha256Digest(Serializer::LeafData(entry)),
+                    sct);
+}
+
+
+Status FrontendSigner::LookupHash(const string& sha256_hash,
+                                  SignedCertificateTimestamp* sct) const {
   cert_trans::LoggedEntry logged;
-  Database::LookupResult db_result = db_->LookupByHash(sha256_hash, &logged);
+  util::trace::Span db_span("db_lookup_by_hash", util::trace::Phase::DB);
+  const Database::LookupResult db_result(
+      db_->LookupByHash(sha256_hash, &logged));
+  db_span.End();
 
   if (db_result == Database::LOOKUP_OK) {
     // If we did find a local copy, return the previously issued SCT.
@@ -52,26 +111,37 @@ Status FrontendSigner::QueueEntry(const LogEntry& entry,
   }
   CHECK_EQ(Database::NOT_FOUND, db_result);
 
-  // Dont have the cert locally, so create an SCT and store it and the cert.
-  SignedCertificateTimestamp local_sct;
-  TimestampAndSign(entry, &local_sct);
+  return Status(util::error::NOT_FOUND, "entry not in Database");
+}
 
-  cert_trans::LoggedEntry new_logged;
-  new_logged.mutable_sct()->CopyFrom(local_sct);
-  new_logged.mutable_entry()->CopyFrom(entry);
-  CHECK_EQ(new_logged.Hash(), sha256_hash);
 
-  // If this cert has already been added (but not yet integrated into the
-  // tree), then this call will update new_logged.sct with the previously
-  // issued one.
-  util::Status status(store_->AddPendingEntry(&new_logged));
-  CHECK_EQ(new_logged.Hash(), sha256_hash);
+Status FrontendSigner::PrepareEntry(LogEntry&& entry,
+                                    SignedCertificateTimestamp* sct,
+                                    cert_trans::LoggedEntry* new_logged) const {
+  const string sha256_hash(
+      Sha256Hasher::Sha256Digest(Serializer::LeafData(entry)));
+  CHECK(!sha256_hash.empty());
 
-  if (sct != nullptr) {
-    *sct = new_logged.sct();
+  // Check if the entry already exists in the local DB (i.e. it's been
+  // integrated into the tree.)
+  // This isn't foolproof; it could be that the local node doesn't yet have
+  // a copy of this if the cert was added recently, but it's not fatal if the
+  // same cert gets added twice.
+  const Status lookup_status(LookupHash(sha256_hash, sct));
+  if (lookup_status.CanonicalCode() != util::error::NOT_FOUND) {
+    return lookup_status;
   }
 
-  return status;
+  // Dont have the cert locally, so create an SCT and store it and the cert.
+  SignedCertificateTimestamp local_sct;
+  TimestampAndSign(entry, &local_sct);
+
+  new_logged->mutable_sct()->Swap(&local_sct);
+  // Only the buffers change hands, which matters for long chains.
+  new_logged->mutable_entry()->Swap(&entry);
+  CHECK(new_logged->CacheHashes());
+  CHECK_EQ(new_logged->Hash(), sha256_hash);
+  return ::util::OkStatus();
 }
 
 
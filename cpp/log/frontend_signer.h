@@ -11,6 +11,7 @@ class LogSigner;
 
 namespace util {
 class Status;
+class Task;
 }  // namespace util
 
 namespace cert_trans {
@@ -33,7 +34,35 @@ class FrontendSigner {
   util::Status QueueEntry(const ct::LogEntry& entry,
                           ct::SignedCertificateTimestamp* sct);
 
+  // Same as QueueEntry(), returning the status on |task|, without
+  // waiting on the consistent store. |entry| is moved into the pending
+  // entry rather than copied, but |sct| (if not NULL) must stay valid
+  // until |task| is done.
+  void QueueEntryAsync(ct::LogEntry&& entry,
+                       ct::SignedCertificateTimestamp* sct, util::Task* task);
+
+  // If |entry| is already in the database, sets |*sct| (if not NULL)
+  // to the SCT it was given and returns ALREADY_EXISTS. Returns
+  // NOT_FOUND otherwise. Only what the hash of |entry| is made of
+  // needs to be set.
+  util::Status LookupEntry(const ct::LogEntry& entry,
+                           ct::SignedCertificateTimestamp* sct) const;
+
+  // See ConsistentStore::PendingEntriesLoad().
+  double PendingEntriesLoad() const {
+    return store_->PendingEntriesLoad();
+  }
+
  private:
+  // LookupEntry(), for an entry of hash |sha256_hash|.
+  util::Status LookupHash(const std::string& sha256_hash,
+                          ct::SignedCertificateTimestamp* sct) const;
+  // Looks |entry| up in the database, like LookupEntry(), and if it
+  // is not there, moves it into |*new_logged|, prepared to be added to
+  // the consistent store, and returns OK.
+  util::Status PrepareEntry(ct::LogEntry&& entry,
+                            ct::SignedCertificateTimestamp* sct,
+                            cert_trans::LoggedEntry* new_logged) const;
   void TimestampAndSign(const ct::LogEntry& entry,
                         ct::SignedCertificateTimestamp* sct) const;
 
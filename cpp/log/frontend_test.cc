@@ -279,6 +279,38 @@ TYPED_TEST(FrontendTest, TestSubmitDuplicate) {
                 logged_cert.entry(), sct));
 }
 
+TYPED_TEST(FrontendTest, TestLookupLoggedChain) {
+  CertChain chain(this->chain_leaf_pem_ + this->intermediate_pem_);
+  EXPECT_TRUE(chain.IsLoaded());
+  SignedCertificateTimestamp sct;
+  EXPECT_THAT(this->frontend_.LookupX509Chain(chain, &sct),
+              StatusIs(util::error::NOT_FOUND));
+
+  LogEntry entry;
+  EXPECT_OK(this->frontend_.QueueProcessedEntry(
+      this->submission_handler_.ProcessX509Submission(&chain, &entry), entry,
+      &sct));
+  // Only found once it is in the database.
+  CertChain resubmitted(this->chain_leaf_pem_);
+  EXPECT_TRUE(resubmitted.IsLoaded());
+  SignedCertificateTimestamp found_sct;
+  EXPECT_THAT(this->frontend_.LookupX509Chain(resubmitted, &found_sct),
+              StatusIs(util::error::NOT_FOUND));
+
+  LoggedEntry logged;
+  logged.mutable_entry()->CopyFrom(entry);
+  logged.mutable_sct()->CopyFrom(sct);
+  logged.set_sequence_number(0);
+  ASSERT_EQ(Database::OK, this->db()->CreateSequencedEntry(logged));
+
+  // The chain is missing its intermediate, but the certificate is
+  // already logged anyway.
+  EXPECT_THAT(this->frontend_.LookupX509Chain(resubmitted, &found_sct),
+              StatusIs(util::error::ALREADY_EXISTS));
+  EXPECT_EQ(sct.timestamp(), found_sct.timestamp());
+  EXPECT_EQ(sct.signature().signature(), found_sct.signature().signature());
+}
+
 TYPED_TEST(FrontendTest, TestSubmitInvalidChain) {
   CertChain chain(this->chain_leaf_pem_);
   EXPECT_TRUE(chain.IsLoaded());
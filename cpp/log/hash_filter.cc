@@ -0,0 +1,75 @@
+#include "log/hash_filter.h"
+
+#include <glog/logging.h>
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+
+using std::max;
+using std::min;
+using std::string;
+
+namespace cert_trans {
+namespace {
+
+
+// The size of the filter, in whole 64-bit words.
+uint64_t NumBits(size_t capacity, int bits_per_hash) {
+  const uint64_t bits(static_cast<uint64_t>(capacity) * bits_per_hash);
+  return (bits + 63) / 64 * 64;
+}
+
+
+}  // namespace
+
+
+HashFilter::HashFilter(size_t capacity, int bits_per_hash)
+    : capacity_(max<size_t>(capacity, 1)),
+      num_bits_(NumBits(capacity_, max(bits_per_hash, 1))),
+      // The number of probes which makes for the fewest false
+      // positives is ln(2) times the bits per hash.
+      num_probes_(max(1, static_cast<int>(std::lround(
+                             std::log(2.0) * max(bits_per_hash, 1))))),
+      bits_(num_bits_ / 64, 0),
+      size_(0) {
+}
+
+
+void HashFilter::Add(const string& hash) {
+  uint64_t probe;
+  uint64_t step;
+  Probes(hash, &probe, &step);
+  for (int i = 0; i < num_probes_; ++i, probe += step) {
+    const uint64_t bit(probe % num_bits_);
+    bits_[bit / 64] |= uint64_t(1) << (bit % 64);
+  }
+  ++size_;
+}
+
+
+bool HashFilter::MayContain(const string& hash) const {
+  uint64_t probe;
+  uint64_t step;
+  Probes(hash, &probe, &step);
+  for (int i = 0; i < num_probes_; ++i, probe += step) {
+    const uint64_t bit(probe % num_bits_);
+    if ((bits_[bit / 64] & (uint64_t(1) << (bit % 64))) == 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+// static
+void HashFilter::Probes(const string& hash, uint64_t* first,
+                        uint64_t* step) {
+  uint64_t words[2] = {0, 0};
+  memcpy(words, hash.data(), min(hash.size(), sizeof(words)));
+  *first = words[0];
+  // Never zero, so that the probes are distinct bits.
+  *step = words[1] | 1;
+}
+
+
+}  // namespace cert_trans
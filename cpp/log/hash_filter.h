@@ -0,0 +1,58 @@
+#ifndef CERT_TRANS_LOG_HASH_FILTER_H_
+#define CERT_TRANS_LOG_HASH_FILTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace cert_trans {
+
+
+// A Bloom filter of entry hashes, to answer lookups of hashes which
+// are not in a database (such as those of new submissions) without
+// going to it. MayContain() is never wrong about hashes which were
+// added, and rarely wrong about others: about 1% of the time with 10
+// bits per hash, as long as no more than the capacity were added.
+//
+// The hashes are SHA-256 digests, uniformly distributed already, so
+// the bits are picked straight from their bytes rather than by hashing
+// them again. Shorter hashes are padded.
+//
+// This class is thread-compatible, but not thread-safe.
+class HashFilter {
+ public:
+  // Sized for |capacity| hashes of |bits_per_hash| bits each.
+  HashFilter(size_t capacity, int bits_per_hash);
+  HashFilter(const HashFilter&) = delete;
+  HashFilter& operator=(const HashFilter&) = delete;
+
+  void Add(const std::string& hash);
+
+  bool MayContain(const std::string& hash) const;
+
+  // The number of hashes added so far, duplicates included.
+  size_t size() const {
+    return size_;
+  }
+
+  size_t capacity() const {
+    return capacity_;
+  }
+
+ private:
+  // The two halves of the double hashing which picks the bits.
+  static void Probes(const std::string& hash, uint64_t* first,
+                     uint64_t* step);
+
+  const size_t capacity_;
+  const uint64_t num_bits_;
+  const int num_probes_;
+  std::vector<uint64_t> bits_;
+  size_t size_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_HASH_FILTER_H_
@@ -0,0 +1,68 @@
+#include <gtest/gtest.h>
+#include <string>
+
+#include "log/hash_filter.h"
+#include "merkletree/serial_hasher.h"
+#include "util/testing.h"
+
+namespace {
+
+using cert_trans::HashFilter;
+using std::string;
+using std::to_string;
+
+
+string Hash(int i) {
+  return Sha256Hasher::Sha256Digest("entry" + to_string(i));
+}
+
+
+TEST(HashFilterTest, ContainsAdded) {
+  HashFilter filter(1000, 10);
+  EXPECT_EQ(0U, filter.size());
+  EXPECT_EQ(1000U, filter.capacity());
+  EXPECT_FALSE(filter.MayContain(Hash(0)));
+
+  for (int i = 0; i < 1000; ++i) {
+    filter.Add(Hash(i));
+  }
+  EXPECT_EQ(1000U, filter.size());
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_TRUE(filter.MayContain(Hash(i))) << i;
+  }
+}
+
+
+TEST(HashFilterTest, FewFalsePositives) {
+  HashFilter filter(10000, 10);
+  for (int i = 0; i < 10000; ++i) {
+    filter.Add(Hash(i));
+  }
+
+  int false_positives(0);
+  for (int i = 10000; i < 20000; ++i) {
+    if (filter.MayContain(Hash(i))) {
+      ++false_positives;
+    }
+  }
+  // About 1%.
+  EXPECT_LT(false_positives, 200);
+}
+
+
+TEST(HashFilterTest, ShortHashes) {
+  HashFilter filter(10, 10);
+  filter.Add("a");
+  filter.Add("");
+  EXPECT_TRUE(filter.MayContain("a"));
+  EXPECT_TRUE(filter.MayContain(""));
+}
+
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
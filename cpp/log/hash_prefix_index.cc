@@ -0,0 +1,91 @@
+#include "log/hash_prefix_index.h"
+
+#include <glog/logging.h>
+#include <string.h>
+#include <algorithm>
+
+using std::string;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+const size_t kMinSlots = 1024;
+
+
+// The table is grown once it is three quarters full.
+size_t MaxSize(size_t slot_count) {
+  return slot_count - slot_count / 4;
+}
+
+
+}  // namespace
+
+
+HashPrefixIndex::HashPrefixIndex() : slots_(kMinSlots), size_(0) {
+}
+
+
+// static
+uint64_t HashPrefixIndex::Prefix(const string& hash) {
+  uint64_t prefix(0);
+  memcpy(&prefix, hash.data(), std::min(sizeof(prefix), hash.size()));
+  return prefix;
+}
+
+
+void HashPrefixIndex::Reserve(size_t count) {
+  size_t slot_count(slots_.size());
+  while (MaxSize(slot_count) < count)
+    slot_count *= 2;
+  if (slot_count > slots_.size())
+    Rehash(slot_count);
+}
+
+
+void HashPrefixIndex::Insert(const string& hash, int64_t sequence_number) {
+  CHECK_GE(sequence_number, 0);
+  if (size_ + 1 > MaxSize(slots_.size()))
+    Rehash(2 * slots_.size());
+  Place(Prefix(hash), sequence_number);
+  ++size_;
+}
+
+
+void HashPrefixIndex::Find(const string& hash,
+                           vector<int64_t>* sequence_numbers) const {
+  CHECK_NOTNULL(sequence_numbers)->clear();
+  const uint64_t prefix(Prefix(hash));
+  const size_t mask(slots_.size() - 1);
+
+  for (size_t i = prefix & mask; slots_[i].sequence_number != 0;
+       i = (i + 1) & mask) {
+    if (slots_[i].prefix == prefix)
+      sequence_numbers->push_back(slots_[i].sequence_number - 1);
+  }
+  std::sort(sequence_numbers->begin(), sequence_numbers->end());
+}
+
+
+void HashPrefixIndex::Place(uint64_t prefix, int64_t sequence_number) {
+  const size_t mask(slots_.size() - 1);
+  size_t i(prefix & mask);
+  while (slots_[i].sequence_number != 0)
+    i = (i + 1) & mask;
+  slots_[i].prefix = prefix;
+  slots_[i].sequence_number = sequence_number + 1;
+}
+
+
+void HashPrefixIndex::Rehash(size_t slot_count) {
+  VLOG(1) << "Growing hash prefix index to " << slot_count << " slots";
+  vector<Slot> old_slots(slot_count, Slot{0, 0});
+  old_slots.swap(slots_);
+  for (const Slot& slot : old_slots) {
+    if (slot.sequence_number != 0)
+      Place(slot.prefix, slot.sequence_number - 1);
+  }
+}
+
+
+}  // namespace cert_trans
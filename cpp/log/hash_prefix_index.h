@@ -0,0 +1,71 @@
+#ifndef CERT_TRANS_LOG_HASH_PREFIX_INDEX_H_
+#define CERT_TRANS_LOG_HASH_PREFIX_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace cert_trans {
+
+
+// Maps entry hashes to sequence numbers, in 16 bytes per slot of a
+// table kept between three eighths and three quarters full.
+//
+// This is an open-addressing hash table which only keeps the first 8
+// bytes of each hash, so a lookup returns candidates, which the
+// caller has to check against the full hash of the stored entries. As
+// the hashes come out of SHA-256, there is rarely more than one
+// candidate, and mostly none for hashes that were not added.
+//
+// This class is thread-compatible, but not thread-safe.
+class HashPrefixIndex {
+ public:
+  HashPrefixIndex();
+  HashPrefixIndex(const HashPrefixIndex&) = delete;
+  HashPrefixIndex& operator=(const HashPrefixIndex&) = delete;
+
+  // Number of sequence numbers in the index.
+  size_t size() const {
+    return size_;
+  }
+
+  // Bytes of memory allocated for the table.
+  size_t AllocatedBytes() const {
+    return slots_.capacity() * sizeof(Slot);
+  }
+
+  // Make room for |count| sequence numbers in total without further
+  // growth.
+  void Reserve(size_t count);
+
+  // Record |sequence_number| under |hash|. The same hash can be added
+  // with several sequence numbers.
+  void Insert(const std::string& hash, int64_t sequence_number);
+
+  // Replaces the contents of |sequence_numbers| with those recorded
+  // under a hash starting like |hash|, in increasing order.
+  void Find(const std::string& hash,
+            std::vector<int64_t>* sequence_numbers) const;
+
+ private:
+  struct Slot {
+    uint64_t prefix;
+    // Zero for empty slots, otherwise the sequence number plus one.
+    int64_t sequence_number;
+  };
+
+  static uint64_t Prefix(const std::string& hash);
+
+  // Put an entry into its slot, assuming there is room.
+  void Place(uint64_t prefix, int64_t sequence_number);
+  void Rehash(size_t slot_count);
+
+  std::vector<Slot> slots_;
+  size_t size_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_HASH_PREFIX_INDEX_H_
@@ -0,0 +1,86 @@
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "log/hash_prefix_index.h"
+#include "merkletree/serial_hasher.h"
+#include "util/testing.h"
+
+namespace {
+
+using cert_trans::HashPrefixIndex;
+using std::string;
+using std::to_string;
+using std::vector;
+
+string Hash(const string& data) {
+  Sha256Hasher hasher;
+  hasher.Reset();
+  hasher.Update(data);
+  return hasher.Final();
+}
+
+class HashPrefixIndexTest : public ::testing::Test {
+ protected:
+  vector<int64_t> Find(const string& hash) const {
+    vector<int64_t> sequence_numbers;
+    index_.Find(hash, &sequence_numbers);
+    return sequence_numbers;
+  }
+
+  HashPrefixIndex index_;
+};
+
+TEST_F(HashPrefixIndexTest, FindsHashes) {
+  // Enough to grow the table a few times.
+  const int kCount = 20000;
+  for (int i = 0; i < kCount; ++i)
+    index_.Insert(Hash(to_string(i)), i);
+
+  EXPECT_EQ(static_cast<size_t>(kCount), index_.size());
+  for (int i = 0; i < kCount; ++i)
+    ASSERT_EQ(vector<int64_t>(1, i), Find(Hash(to_string(i))));
+}
+
+TEST_F(HashPrefixIndexTest, NotFound) {
+  EXPECT_TRUE(Find(Hash("a")).empty());
+  index_.Insert(Hash("a"), 0);
+  EXPECT_TRUE(Find(Hash("b")).empty());
+}
+
+TEST_F(HashPrefixIndexTest, MatchesOnPrefix) {
+  const string hash(Hash("a"));
+  index_.Insert(hash, 3);
+  // Only the first 8 bytes count, the caller checks the rest.
+  string other(hash);
+  other[31] ^= 1;
+  EXPECT_EQ(vector<int64_t>(1, 3), Find(other));
+  other[7] ^= 1;
+  EXPECT_TRUE(Find(other).empty());
+}
+
+TEST_F(HashPrefixIndexTest, DuplicatesInOrder) {
+  index_.Insert(Hash("a"), 7);
+  index_.Insert(Hash("b"), 1);
+  index_.Insert(Hash("a"), 2);
+  index_.Insert(Hash("a"), 5);
+  EXPECT_EQ(4U, index_.size());
+  EXPECT_EQ(vector<int64_t>({2, 5, 7}), Find(Hash("a")));
+  EXPECT_EQ(vector<int64_t>(1, 1), Find(Hash("b")));
+}
+
+TEST_F(HashPrefixIndexTest, Reserve) {
+  index_.Reserve(5000);
+  for (int i = 0; i < 5000; ++i)
+    index_.Insert(Hash(to_string(i)), i);
+  for (int i = 0; i < 5000; ++i)
+    ASSERT_EQ(vector<int64_t>(1, i), Find(Hash(to_string(i))));
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
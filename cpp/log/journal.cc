@@ -0,0 +1,179 @@
+#include "log/journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+
+using std::function;
+using std::mutex;
+using std::string;
+using std::unique_lock;
+
+namespace cert_trans {
+namespace {
+
+
+// Each record is a type, the size of the payload (in host byte order),
+// and the payload.
+const size_t kRecordHeaderBytes = 1 + sizeof(uint32_t);
+const char kTmpSuffix[] = ".tmp";
+
+
+void WriteFully(int fd, const string& data, const string& path) {
+  const char* buf(data.data());
+  size_t size(data.size());
+  while (size > 0) {
+    const ssize_t ret(write(fd, buf, size));
+    PCHECK(ret > 0) << "Failed to write to " << path;
+    buf += ret;
+    size -= ret;
+  }
+}
+
+
+// Returns an empty string if there is no file at |path|.
+string ReadFile(const string& path) {
+  string data;
+  const int fd(open(path.c_str(), O_RDONLY));
+  if (fd < 0) {
+    PCHECK(errno == ENOENT) << "Cannot open " << path;
+    return data;
+  }
+  char buf[1 << 16];
+  ssize_t ret;
+  while ((ret = read(fd, buf, sizeof(buf))) != 0) {
+    PCHECK(ret > 0) << "Failed to read " << path;
+    data.append(buf, ret);
+  }
+  PCHECK(close(fd) == 0);
+  return data;
+}
+
+
+// Makes the creation and renaming of files in the directory of |path|
+// durable.
+void SyncParentDir(const string& path) {
+  const size_t slash(path.rfind('/'));
+  const string dir(slash == string::npos ? "." : path.substr(0, slash + 1));
+  const int fd(open(dir.c_str(), O_RDONLY | O_DIRECTORY));
+  PCHECK(fd >= 0) << "Cannot open " << dir;
+  PCHECK(fsync(fd) == 0) << "Failed to sync " << dir;
+  PCHECK(close(fd) == 0);
+}
+
+
+}  // namespace
+
+
+Journal::Journal(const string& path)
+    : path_(path), fd_(-1), num_records_(0), num_synced_(0), syncing_(false) {
+  CHECK(!path_.empty());
+}
+
+
+Journal::~Journal() {
+  if (fd_ >= 0) {
+    PCHECK(close(fd_) == 0);
+  }
+}
+
+
+// static
+string Journal::Record(char type, const string& payload) {
+  const uint32_t size(payload.size());
+  string record(1, type);
+  record.append(reinterpret_cast<const char*>(&size), sizeof(size));
+  record.append(payload);
+  return record;
+}
+
+
+void Journal::Read(const RecordCallback& callback) const {
+  const string data(ReadFile(path_));
+  size_t offset(0);
+  while (offset + kRecordHeaderBytes <= data.size()) {
+    uint32_t size;
+    memcpy(&size, data.data() + offset + 1, sizeof(size));
+    if (size > data.size() - offset - kRecordHeaderBytes ||
+        !callback(data[offset],
+                  string(data, offset + kRecordHeaderBytes, size))) {
+      break;
+    }
+    offset += kRecordHeaderBytes + size;
+  }
+  // Only a record being written at the time of a crash can be cut
+  // short, and it was not acknowledged.
+  if (offset < data.size()) {
+    LOG(WARNING) << "Ignoring the last " << data.size() - offset
+                 << " bytes of " << path_;
+  }
+}
+
+
+void Journal::Rewrite(unique_lock<mutex>* lock,
+                      const function<string()>& records) {
+  CHECK(lock->owns_lock());
+  cv_.wait(*lock, [this]() { return !syncing_; });
+
+  const string tmp_path(path_ + kTmpSuffix);
+  const int fd(open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+  PCHECK(fd >= 0) << "Cannot create " << tmp_path;
+  WriteFully(fd, records(), tmp_path);
+  PCHECK(fsync(fd) == 0) << "Failed to sync " << tmp_path;
+  PCHECK(close(fd) == 0);
+  PCHECK(rename(tmp_path.c_str(), path_.c_str()) == 0)
+      << "Failed to rename " << tmp_path;
+  SyncParentDir(path_);
+
+  if (fd_ >= 0) {
+    PCHECK(close(fd_) == 0);
+  }
+  fd_ = open(path_.c_str(), O_WRONLY | O_APPEND);
+  PCHECK(fd_ >= 0) << "Cannot open " << path_;
+  // Whatever was waiting for a sync is in there.
+  num_synced_ = num_records_;
+  cv_.notify_all();
+}
+
+
+int64_t Journal::Append(const unique_lock<mutex>& lock, char type,
+                        const string& payload) {
+  CHECK(lock.owns_lock());
+  CHECK_GE(fd_, 0);
+  WriteFully(fd_, Record(type, payload), path_);
+  return ++num_records_;
+}
+
+
+void Journal::WaitForSync(unique_lock<mutex>* lock, int64_t record) {
+  CHECK(lock->owns_lock());
+  while (num_synced_ < record) {
+    if (syncing_) {
+      cv_.wait(*lock);
+      continue;
+    }
+
+    // Sync everything so far, for whoever else is waiting too.
+    syncing_ = true;
+    const int64_t target(num_records_);
+    const int fd(fd_);
+    lock->unlock();
+    PCHECK(fdatasync(fd) == 0) << "Failed to sync " << path_;
+    lock->lock();
+    syncing_ = false;
+    num_synced_ = std::max(num_synced_, target);
+    cv_.notify_all();
+  }
+}
+
+
+int64_t Journal::LastRecord(const unique_lock<mutex>& lock) const {
+  CHECK(lock.owns_lock());
+  return num_records_;
+}
+
+
+}  // namespace cert_trans
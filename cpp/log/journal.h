@@ -0,0 +1,73 @@
+#ifndef CERT_TRANS_LOG_JOURNAL_H_
+#define CERT_TRANS_LOG_JOURNAL_H_
+
+#include <stdint.h>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+
+namespace cert_trans {
+
+// An append-only file of records, each a type and a payload, which
+// the consistent stores keeping a local journal write their changes
+// to. Syncs are shared: a record appended while another is being
+// synced is synced, along with those appended meanwhile, by the next
+// fdatasync().
+//
+// This class has no lock of its own: Rewrite(), Append() and
+// WaitForSync() must be called with the lock of the owner held, which
+// is released while syncing.
+class Journal {
+ public:
+  typedef std::function<bool(char type, const std::string& payload)>
+      RecordCallback;
+
+  explicit Journal(const std::string& path);
+  ~Journal();
+  Journal(const Journal&) = delete;
+  Journal& operator=(const Journal&) = delete;
+
+  // Returns a record, for Rewrite().
+  static std::string Record(char type, const std::string& payload);
+
+  // Calls |callback| with each record of the file, in order, until it
+  // returns false. The records past one cut short (which can only be
+  // the last, and was not acknowledged) are ignored. The file need not
+  // exist.
+  void Read(const RecordCallback& callback) const;
+
+  // Replaces the file with the records returned by |records| (made
+  // with Record()), and opens it for appending. Must be called before
+  // Append(). |records| is called once no sync is in progress, after
+  // which the lock is held until the file is replaced, so that no
+  // record is appended to the old one meanwhile.
+  void Rewrite(std::unique_lock<std::mutex>* lock,
+               const std::function<std::string()>& records);
+
+  // Appends a record, returning its number, to wait for with
+  // WaitForSync().
+  int64_t Append(const std::unique_lock<std::mutex>& lock, char type,
+                 const std::string& payload);
+
+  // Returns once the records up to |record| are synced, syncing them
+  // if no other thread is already doing so.
+  void WaitForSync(std::unique_lock<std::mutex>* lock, int64_t record);
+
+  // The number of the last record appended.
+  int64_t LastRecord(const std::unique_lock<std::mutex>& lock) const;
+
+ private:
+  const std::string path_;
+  std::condition_variable cv_;
+  int fd_;
+  // Records appended, and synced, since the file was opened.
+  int64_t num_records_;
+  int64_t num_synced_;
+  bool syncing_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_JOURNAL_H_
@@ -0,0 +1,235 @@
+#include "log/journaled_consistent_store.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+#include "monitoring/monitoring.h"
+#include "util/parallel_for.h"
+
+DEFINE_int32(journal_replication_batch_size, 256,
+             "Maximum number of journaled pending entries added to the "
+             "consistent store at a time.");
+DEFINE_int32(journal_replication_retry_delay_ms, 1000,
+             "How long to wait before trying again to add journaled pending "
+             "entries to the consistent store, after a failure.");
+DEFINE_int32(journal_compaction_entries, 10000,
+             "The pending entry journal is rewritten once this many of the "
+             "entries in it were added to the consistent store.");
+
+using std::chrono::milliseconds;
+using std::min;
+using std::mutex;
+using std::string;
+using std::thread;
+using std::unique_lock;
+using std::vector;
+using util::Status;
+
+namespace cert_trans {
+namespace {
+
+
+static Gauge<>* journaled_entries =
+    Gauge<>::New("journaled_pending_entries",
+                 "Number of journaled pending entries not yet added to the "
+                 "consistent store.");
+
+static Counter<>* journal_conflicting_scts =
+    Counter<>::New("journal_conflicting_scts",
+                   "Number of journaled pending entries which the consistent "
+                   "store already had with a different SCT.");
+
+
+// The payload of an entry record is a LoggedEntry.
+const char kEntryRecord = 'E';
+// The payload is the number of entry records before it which were
+// added to the consistent store.
+const char kReplicatedRecord = 'R';
+
+
+}  // namespace
+
+
+JournaledConsistentStore::JournaledConsistentStore(const string& journal_path,
+                                                   util::Executor* executor,
+                                                   ConsistentStore* peer)
+    : journal_(journal_path),
+      executor_(CHECK_NOTNULL(executor)),
+      peer_(CHECK_NOTNULL(peer)),
+      num_replicated_(0),
+      unreplicated_memory_("pending_entries"),
+      exiting_(false) {
+  CHECK_GT(FLAGS_journal_replication_batch_size, 0);
+  Recover();
+  replication_thread_ =
+      thread(&JournaledConsistentStore::ReplicationLoop, this);
+}
+
+
+JournaledConsistentStore::~JournaledConsistentStore() {
+  {
+    unique_lock<mutex> lock(lock_);
+    exiting_ = true;
+  }
+  cv_.notify_all();
+  replication_thread_.join();
+}
+
+
+Status JournaledConsistentStore::AddPendingEntry(LoggedEntry* entry) {
+  CHECK_NOTNULL(entry);
+  CHECK(!entry->has_sequence_number());
+  const string hash(entry->Hash());
+  string flat_entry;
+  CHECK(entry->SerializeToString(&flat_entry));
+
+  unique_lock<mutex> lock(lock_);
+  const auto it(unreplicated_hashes_.find(hash));
+  if (it != unreplicated_hashes_.end()) {
+    *entry->mutable_sct() = it->second->sct();
+    // The earlier submission might still be waiting for its record.
+    journal_.WaitForSync(&lock, journal_.LastRecord(lock));
+    return Status(util::error::ALREADY_EXISTS,
+                  "Pending entry already exists.");
+  }
+
+  unreplicated_.push_back(*entry);
+  unreplicated_hashes_.emplace(hash, &unreplicated_.back());
+  unreplicated_memory_.Add(flat_entry.size());
+  journaled_entries->Set(unreplicated_.size());
+  const int64_t record(journal_.Append(lock, kEntryRecord, flat_entry));
+  cv_.notify_all();
+  journal_.WaitForSync(&lock, record);
+  return ::util::OkStatus();
+}
+
+
+size_t JournaledConsistentStore::NumUnreplicated() const {
+  unique_lock<mutex> lock(lock_);
+  return unreplicated_.size();
+}
+
+
+void JournaledConsistentStore::Recover() {
+  vector<LoggedEntry> entries;
+  uint64_t num_replicated(0);
+  journal_.Read([&entries, &num_replicated](char type,
+                                             const string& payload) {
+    if (type == kEntryRecord) {
+      entries.emplace_back();
+      if (!entries.back().ParseFromString(payload)) {
+        entries.pop_back();
+        return false;
+      }
+    } else if (type == kReplicatedRecord &&
+               payload.size() == sizeof(num_replicated)) {
+      memcpy(&num_replicated, payload.data(), sizeof(num_replicated));
+    } else {
+      return false;
+    }
+    return true;
+  });
+  CHECK_LE(num_replicated, entries.size());
+
+  unique_lock<mutex> lock(lock_);
+  for (size_t i = num_replicated; i < entries.size(); ++i) {
+    unreplicated_.push_back(entries[i]);
+    unreplicated_hashes_.emplace(entries[i].Hash(), &unreplicated_.back());
+    unreplicated_memory_.Add(entries[i].ByteSize());
+  }
+  journaled_entries->Set(unreplicated_.size());
+  LOG(INFO) << "Recovered " << unreplicated_.size()
+            << " pending entries from the journal";
+  Compact(&lock);
+}
+
+
+void JournaledConsistentStore::Compact(unique_lock<mutex>* lock) {
+  journal_.Rewrite(lock, [this]() {
+    string records;
+    for (const LoggedEntry& entry : unreplicated_) {
+      string flat_entry;
+      CHECK(entry.SerializeToString(&flat_entry));
+      records.append(Journal::Record(kEntryRecord, flat_entry));
+    }
+    return records;
+  });
+  // Whatever was waiting for a sync is in there, or in the peer.
+  num_replicated_ = 0;
+}
+
+
+void JournaledConsistentStore::ReplicationLoop() {
+  unique_lock<mutex> lock(lock_);
+  while (true) {
+    cv_.wait(lock, [this]() { return exiting_ || !unreplicated_.empty(); });
+    if (exiting_) {
+      return;
+    }
+
+    vector<LoggedEntry> batch(
+        unreplicated_.begin(),
+        unreplicated_.begin() +
+            min<size_t>(unreplicated_.size(),
+                        FLAGS_journal_replication_batch_size));
+    lock.unlock();
+
+    vector<char> added(batch.size(), false);
+    const auto add([this, &batch, &added](size_t i) {
+      const uint64_t timestamp(batch[i].timestamp());
+      Status status(peer_->AddPendingEntry(&batch[i]));
+      if (status.CanonicalCode() == util::error::ALREADY_EXISTS) {
+        // Either another node got it too, or we added it before but
+        // did not get to record it.
+        if (batch[i].timestamp() != timestamp) {
+          LOG(WARNING) << "Journaled entry already had an SCT with timestamp "
+                       << batch[i].timestamp() << ", ours is lost: "
+                       << timestamp;
+          journal_conflicting_scts->Increment();
+        }
+        status = ::util::OkStatus();
+      }
+      LOG_IF(WARNING, !status.ok()) << "Failed to add journaled entry: "
+                                    << status;
+      added[i] = status.ok();
+    });
+    util::ParallelFor(executor_, batch.size(), add);
+
+    // Only the entries at the start of the journal can be recorded as
+    // added, the others will be added again next time.
+    size_t num_added(0);
+    while (num_added < batch.size() && added[num_added]) {
+      ++num_added;
+    }
+
+    lock.lock();
+    for (size_t i = 0; i < num_added; ++i) {
+      unreplicated_hashes_.erase(unreplicated_.front().Hash());
+      unreplicated_memory_.Add(-unreplicated_.front().ByteSize());
+      unreplicated_.pop_front();
+    }
+    journaled_entries->Set(unreplicated_.size());
+    if (num_added > 0) {
+      num_replicated_ += num_added;
+      if (num_replicated_ >= FLAGS_journal_compaction_entries) {
+        Compact(&lock);
+      } else {
+        const string payload(reinterpret_cast<const char*>(&num_replicated_),
+                             sizeof(num_replicated_));
+        journal_.WaitForSync(&lock,
+                             journal_.Append(lock, kReplicatedRecord, payload));
+      }
+    }
+    if (num_added < batch.size()) {
+      cv_.wait_for(lock,
+                   milliseconds(FLAGS_journal_replication_retry_delay_ms),
+                   [this]() { return exiting_; });
+    }
+  }
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,156 @@
+#ifndef CERT_TRANS_LOG_JOURNALED_CONSISTENT_STORE_H_
+#define CERT_TRANS_LOG_JOURNALED_CONSISTENT_STORE_H_
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "log/consistent_store.h"
+#include "log/journal.h"
+#include "log/logged_entry.h"
+#include "monitoring/memory.h"
+#include "util/executor.h"
+
+namespace cert_trans {
+
+// A wrapper around a ConsistentStore which acknowledges new pending
+// entries once they are synced to a local append-only journal file,
+// and adds them to |peer| in the background, in batches. Entries not
+// known to have been added to |peer| are added again when the journal
+// is next opened, e.g. after a crash.
+//
+// Submitting an entry again before it made it to |peer| gets the SCT
+// it already has, but this only knows of its own entries: an entry
+// submitted to two nodes within the time it takes to reach |peer| can
+// be issued two SCTs, only one of which will be logged. This is only
+// worth it where the latency of AddPendingEntry() matters more.
+class JournaledConsistentStore : public ConsistentStore {
+ public:
+  // Takes ownership of |peer|, but not |executor|, over which the
+  // batches are spread.
+  JournaledConsistentStore(const std::string& journal_path,
+                           util::Executor* executor, ConsistentStore* peer);
+
+  ~JournaledConsistentStore() override;
+
+  util::Status AddPendingEntry(LoggedEntry* entry) override;
+
+  // The number of entries not yet added to the peer.
+  size_t NumUnreplicated() const;
+
+  // Other methods:
+
+  util::StatusOr<int64_t> NextAvailableSequenceNumber() const override {
+    return peer_->NextAvailableSequenceNumber();
+  }
+
+  util::Status SetServingSTH(const ct::SignedTreeHead& new_sth) override {
+    return peer_->SetServingSTH(new_sth);
+  }
+
+  util::StatusOr<ct::SignedTreeHead> GetServingSTH() const override {
+    return peer_->GetServingSTH();
+  }
+
+  double PendingEntriesLoad() const override {
+    return peer_->PendingEntriesLoad();
+  }
+
+  util::Status GetPendingEntryForHash(
+      const std::string& hash,
+      EntryHandle<LoggedEntry>* entry) const override {
+    return peer_->GetPendingEntryForHash(hash, entry);
+  }
+
+  util::Status GetPendingEntries(
+      std::vector<EntryHandle<LoggedEntry>>* entries) const override {
+    return peer_->GetPendingEntries(entries);
+  }
+
+  util::Status GetSequenceMapping(
+      EntryHandle<ct::SequenceMapping>* entry) const override {
+    return peer_->GetSequenceMapping(entry);
+  }
+
+  util::Status UpdateSequenceMapping(
+      EntryHandle<ct::SequenceMapping>* entry) override {
+    return peer_->UpdateSequenceMapping(entry);
+  }
+
+  util::StatusOr<ct::ClusterNodeState> GetClusterNodeState() const override {
+    return peer_->GetClusterNodeState();
+  }
+
+  util::Status SetClusterNodeState(
+      const ct::ClusterNodeState& state) override {
+    return peer_->SetClusterNodeState(state);
+  }
+
+  void WatchServingSTH(const ConsistentStore::ServingSTHCallback& cb,
+                       util::Task* task) override {
+    return peer_->WatchServingSTH(cb, task);
+  }
+
+  void WatchClusterNodeStates(
+      const ConsistentStore::ClusterNodeStateCallback& cb,
+      util::Task* task) override {
+    return peer_->WatchClusterNodeStates(cb, task);
+  }
+
+  void WatchClusterConfig(const ConsistentStore::ClusterConfigCallback& cb,
+                          util::Task* task) override {
+    return peer_->WatchClusterConfig(cb, task);
+  }
+
+  void WatchPendingEntries(const ConsistentStore::PendingEntriesCallback& cb,
+                           util::Task* task) override {
+    return peer_->WatchPendingEntries(cb, task);
+  }
+
+  util::Status SetClusterConfig(const ct::ClusterConfig& config) override {
+    return peer_->SetClusterConfig(config);
+  }
+
+  util::StatusOr<int64_t> CleanupOldEntries() override {
+    return peer_->CleanupOldEntries();
+  }
+
+ private:
+  // Reads the journal, keeping the entries still to be added to the
+  // peer, and rewrites it with only those.
+  void Recover();
+
+  // Replaces the journal with one holding only the entries in
+  // |unreplicated_|.
+  void Compact(std::unique_lock<std::mutex>* lock);
+
+  void ReplicationLoop();
+
+  Journal journal_;
+  util::Executor* const executor_;
+  const std::unique_ptr<ConsistentStore> peer_;
+
+  mutable std::mutex lock_;
+  std::condition_variable cv_;
+  // The entries in the journal, in order, that were added to the peer.
+  int64_t num_replicated_;
+  // The ones that were not, in order, with their hashes.
+  std::deque<LoggedEntry> unreplicated_;
+  std::unordered_map<std::string, const LoggedEntry*> unreplicated_hashes_;
+  // Counts |unreplicated_| as serialized.
+  MemoryAccount unreplicated_memory_;
+  bool exiting_;
+
+  std::thread replication_thread_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_JOURNALED_CONSISTENT_STORE_H_
@@ -0,0 +1,193 @@
+#include "log/journaled_consistent_store.h"
+
+#include <gflags/gflags.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <memory>
+#include <string>
+
+#include "base/notification.h"
+#include "log/logged_entry.h"
+#include "log/mock_consistent_store.h"
+#include "log/test_signer.h"
+#include "proto/cert_serializer.h"
+#include "util/status.h"
+#include "util/status_test_util.h"
+#include "util/test_db.h"
+#include "util/testing.h"
+#include "util/thread_pool.h"
+
+DECLARE_int32(journal_replication_retry_delay_ms);
+DECLARE_int32(journal_compaction_entries);
+
+namespace cert_trans {
+namespace {
+
+using testing::_;
+using testing::Invoke;
+using testing::NiceMock;
+using testing::Return;
+using std::string;
+using std::unique_ptr;
+using util::Status;
+using util::testing::StatusIs;
+
+
+class JournaledConsistentStoreTest : public ::testing::Test {
+ public:
+  JournaledConsistentStoreTest() : pool_(2) {
+  }
+
+ protected:
+  void SetUp() override {
+    FLAGS_journal_replication_retry_delay_ms = 10;
+    FLAGS_journal_compaction_entries = 10000;
+  }
+
+  // Opens the journal, with a new peer, which it keeps in |peer_|.
+  unique_ptr<JournaledConsistentStore> Open() {
+    peer_ = new NiceMock<MockConsistentStore>();
+    ON_CALL(*peer_, AddPendingEntry(_))
+        .WillByDefault(Return(Status(util::error::UNAVAILABLE, "nope")));
+    return unique_ptr<JournaledConsistentStore>(new JournaledConsistentStore(
+        tmp_.TmpStorageDir() + "/journal", &pool_, peer_));
+  }
+
+  // Waits for |store| to add all its entries to the peer.
+  void WaitForReplication(const JournaledConsistentStore& store) const {
+    for (int i = 0; i < 500 && store.NumUnreplicated() > 0; ++i) {
+      usleep(10000);
+    }
+    ASSERT_EQ(0U, store.NumUnreplicated());
+  }
+
+  // Pending entries have no sequence number yet.
+  void CreatePending(LoggedEntry* entry) {
+    test_signer_.CreateUnique(entry);
+    entry->clear_sequence_number();
+  }
+
+  TmpStorage tmp_;
+  ThreadPool pool_;
+  TestSigner test_signer_;
+  // Owned by the store.
+  NiceMock<MockConsistentStore>* peer_;
+};
+
+
+TEST_F(JournaledConsistentStoreTest, AddsEntryToPeer) {
+  unique_ptr<JournaledConsistentStore> store(Open());
+  LoggedEntry entry;
+  CreatePending(&entry);
+
+  Notification added;
+  EXPECT_CALL(*peer_, AddPendingEntry(_))
+      .WillOnce(Invoke([&entry, &added](LoggedEntry* e) {
+        EXPECT_EQ(entry.Hash(), e->Hash());
+        EXPECT_EQ(entry.timestamp(), e->timestamp());
+        added.Notify();
+        return ::util::OkStatus();
+      }));
+  EXPECT_OK(store->AddPendingEntry(&entry));
+  added.WaitForNotification();
+  WaitForReplication(*store);
+}
+
+
+TEST_F(JournaledConsistentStoreTest, ResubmissionGetsSameSct) {
+  unique_ptr<JournaledConsistentStore> store(Open());
+  LoggedEntry entry;
+  CreatePending(&entry);
+  EXPECT_OK(store->AddPendingEntry(&entry));
+
+  LoggedEntry again(entry);
+  again.mutable_sct()->set_timestamp(entry.timestamp() + 1);
+  EXPECT_THAT(store->AddPendingEntry(&again),
+              StatusIs(util::error::ALREADY_EXISTS));
+  EXPECT_EQ(entry.timestamp(), again.timestamp());
+  EXPECT_EQ(1U, store->NumUnreplicated());
+}
+
+
+TEST_F(JournaledConsistentStoreTest, ReplaysUnreplicatedEntries) {
+  LoggedEntry first, second;
+  CreatePending(&first);
+  CreatePending(&second);
+  {
+    unique_ptr<JournaledConsistentStore> store(Open());
+    EXPECT_CALL(*peer_, AddPendingEntry(_))
+        .WillOnce(Return(::util::OkStatus()))
+        .WillRepeatedly(Return(Status(util::error::UNAVAILABLE, "nope")));
+    EXPECT_OK(store->AddPendingEntry(&first));
+    WaitForReplication(*store);
+    EXPECT_OK(store->AddPendingEntry(&second));
+  }
+
+  unique_ptr<JournaledConsistentStore> store(Open());
+  EXPECT_EQ(1U, store->NumUnreplicated());
+  EXPECT_CALL(*peer_, AddPendingEntry(_))
+      .WillOnce(Invoke([&second](LoggedEntry* e) {
+        EXPECT_EQ(second.Hash(), e->Hash());
+        return ::util::OkStatus();
+      }));
+  WaitForReplication(*store);
+  store.reset();
+
+  store = Open();
+  EXPECT_EQ(0U, store->NumUnreplicated());
+}
+
+
+TEST_F(JournaledConsistentStoreTest, ReplaysAfterCompaction) {
+  FLAGS_journal_compaction_entries = 2;
+  const int kNumEntries(5);
+  LoggedEntry entries[kNumEntries];
+  {
+    unique_ptr<JournaledConsistentStore> store(Open());
+    EXPECT_CALL(*peer_, AddPendingEntry(_))
+        .WillRepeatedly(Return(::util::OkStatus()));
+    for (int i = 0; i < kNumEntries - 1; ++i) {
+      CreatePending(&entries[i]);
+      EXPECT_OK(store->AddPendingEntry(&entries[i]));
+      WaitForReplication(*store);
+    }
+    EXPECT_CALL(*peer_, AddPendingEntry(_))
+        .WillRepeatedly(Return(Status(util::error::UNAVAILABLE, "nope")));
+    CreatePending(&entries[kNumEntries - 1]);
+    EXPECT_OK(store->AddPendingEntry(&entries[kNumEntries - 1]));
+  }
+
+  unique_ptr<JournaledConsistentStore> store(Open());
+  EXPECT_EQ(1U, store->NumUnreplicated());
+}
+
+
+TEST_F(JournaledConsistentStoreTest, IgnoresTruncatedRecord) {
+  LoggedEntry entry;
+  CreatePending(&entry);
+  {
+    unique_ptr<JournaledConsistentStore> store(Open());
+    EXPECT_OK(store->AddPendingEntry(&entry));
+  }
+  const string path(tmp_.TmpStorageDir() + "/journal");
+  FILE* const file(fopen(path.c_str(), "a"));
+  ASSERT_NE(nullptr, file);
+  fputs("E\x10", file);
+  fclose(file);
+
+  unique_ptr<JournaledConsistentStore> store(Open());
+  EXPECT_EQ(1U, store->NumUnreplicated());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  ConfigureSerializerForV1CT();
+  return RUN_ALL_TESTS();
+}
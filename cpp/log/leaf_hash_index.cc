@@ -0,0 +1,134 @@
+#include "log/leaf_hash_index.h"
+
+#include <glog/logging.h>
+#include <string.h>
+#include <algorithm>
+
+#include "merkletree/merkle_tree.h"
+#include "merkletree/stored_merkle_tree.h"
+
+using std::string;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+// Leaf indices take up the low bits of a slot, which leaves room for
+// a trillion leaves, and the tag the rest.
+const int kIndexBits = 40;
+const uint64_t kIndexMask = (static_cast<uint64_t>(1) << kIndexBits) - 1;
+const size_t kMinSlots = 1024;
+
+
+uint64_t Tag(uint64_t prefix) {
+  return prefix >> kIndexBits;
+}
+
+
+// The table is grown once it is three quarters full.
+size_t MaxSize(size_t slot_count) {
+  return slot_count - slot_count / 4;
+}
+
+
+}  // namespace
+
+
+LeafHashIndex::LeafHashIndex(const MerkleTree* tree)
+    : tree_(CHECK_NOTNULL(tree)),
+      stored_tree_(nullptr),
+      slots_(kMinSlots),
+      size_(0) {
+}
+
+
+LeafHashIndex::LeafHashIndex(const StoredMerkleTree* tree)
+    : tree_(nullptr),
+      stored_tree_(CHECK_NOTNULL(tree)),
+      slots_(kMinSlots),
+      size_(0) {
+}
+
+
+// static
+uint64_t LeafHashIndex::Prefix(const string& leaf_hash) {
+  // Leaf hashes come out of a cryptographic hash, so any of their bits
+  // will do.
+  uint64_t prefix(0);
+  memcpy(&prefix, leaf_hash.data(),
+         std::min(sizeof(prefix), leaf_hash.size()));
+  return prefix;
+}
+
+
+void LeafHashIndex::Reserve(size_t count) {
+  size_t slot_count(slots_.size());
+  while (MaxSize(slot_count) < count)
+    slot_count *= 2;
+  if (slot_count > slots_.size())
+    Rehash(slot_count);
+}
+
+
+bool LeafHashIndex::Insert(const string& leaf_hash, int64_t index) {
+  CHECK_GE(index, 0);
+  CHECK_LT(static_cast<uint64_t>(index), kIndexMask);
+  if (Find(leaf_hash) >= 0)
+    return false;
+
+  if (size_ + 1 > MaxSize(slots_.size()))
+    Rehash(2 * slots_.size());
+  Place(Prefix(leaf_hash), index);
+  ++size_;
+  return true;
+}
+
+
+int64_t LeafHashIndex::Find(const string& leaf_hash) const {
+  const uint64_t prefix(Prefix(leaf_hash));
+  const uint64_t tag(Tag(prefix));
+  const size_t mask(slots_.size() - 1);
+
+  for (size_t i = prefix & mask; slots_[i] != 0; i = (i + 1) & mask) {
+    if (Tag(slots_[i]) != tag)
+      continue;
+    const int64_t index((slots_[i] & kIndexMask) - 1);
+    if (LeafHash(index) == leaf_hash)
+      return index;
+  }
+
+  return -1;
+}
+
+
+void LeafHashIndex::Place(uint64_t prefix, int64_t index) {
+  const size_t mask(slots_.size() - 1);
+  size_t i(prefix & mask);
+  while (slots_[i] != 0)
+    i = (i + 1) & mask;
+  slots_[i] = (Tag(prefix) << kIndexBits) | (index + 1);
+}
+
+
+void LeafHashIndex::Rehash(size_t slot_count) {
+  VLOG(1) << "Growing leaf hash index to " << slot_count << " slots";
+  vector<uint64_t> old_slots(slot_count);
+  old_slots.swap(slots_);
+  for (const uint64_t slot : old_slots) {
+    if (slot == 0)
+      continue;
+    // Slots only keep the top bits of the prefix, so go back to the
+    // tree for the full leaf hash.
+    const int64_t index((slot & kIndexMask) - 1);
+    Place(Prefix(LeafHash(index)), index);
+  }
+}
+
+
+string LeafHashIndex::LeafHash(int64_t index) const {
+  return tree_ ? tree_->LeafHash(index + 1)
+               : stored_tree_->LeafHash(index + 1);
+}
+
+
+}  // namespace cert_trans
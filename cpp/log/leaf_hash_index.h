@@ -0,0 +1,79 @@
+#ifndef CERT_TRANS_LOG_LEAF_HASH_INDEX_H_
+#define CERT_TRANS_LOG_LEAF_HASH_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class MerkleTree;
+
+namespace cert_trans {
+
+class StoredMerkleTree;
+
+
+// Maps the leaf hashes of a MerkleTree to their (0-based) index in
+// the tree, in 8 bytes per slot of a table kept between three eighths
+// and three quarters full.
+//
+// This is an open-addressing hash table which does not store the
+// leaf hashes: a slot only holds a leaf index and a short tag taken
+// from its hash. The hash itself is used to pick the slot, and
+// candidates are confirmed against the leaf level of the tree, so
+// lookups are exact.
+//
+// This class is thread-compatible, but not thread-safe. It does not
+// take ownership of |tree|, which must outlive it, and must contain
+// every leaf added to the index.
+class LeafHashIndex {
+ public:
+  explicit LeafHashIndex(const MerkleTree* tree);
+  explicit LeafHashIndex(const StoredMerkleTree* tree);
+  LeafHashIndex(const LeafHashIndex&) = delete;
+  LeafHashIndex& operator=(const LeafHashIndex&) = delete;
+
+  // Number of leaves in the index.
+  size_t size() const {
+    return size_;
+  }
+
+  // Bytes of memory allocated for the table.
+  size_t AllocatedBytes() const {
+    return slots_.capacity() * sizeof(uint64_t);
+  }
+
+  // Make room for |count| leaves in total without further growth.
+  void Reserve(size_t count);
+
+  // Record that |leaf_hash| is at |index| in the tree. If the hash is
+  // already in the index, the original (earlier) index is kept, and
+  // false is returned.
+  bool Insert(const std::string& leaf_hash, int64_t index);
+
+  // Returns the index of |leaf_hash|, or -1 if it is not in the index.
+  int64_t Find(const std::string& leaf_hash) const;
+
+ private:
+  // Where probing for |leaf_hash| starts, and what its slots are
+  // tagged with.
+  static uint64_t Prefix(const std::string& leaf_hash);
+
+  // Put an entry known not to be in the table into its slot.
+  void Place(uint64_t prefix, int64_t index);
+  void Rehash(size_t slot_count);
+  // The leaf hash at |index| in whichever tree we have.
+  std::string LeafHash(int64_t index) const;
+
+  const MerkleTree* const tree_;
+  const StoredMerkleTree* const stored_tree_;
+  // Zero for empty slots, otherwise a tag in the top bits and the
+  // leaf index plus one in the others.
+  std::vector<uint64_t> slots_;
+  size_t size_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_LEAF_HASH_INDEX_H_
@@ -0,0 +1,78 @@
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "log/leaf_hash_index.h"
+#include "merkletree/merkle_tree.h"
+#include "merkletree/serial_hasher.h"
+#include "util/testing.h"
+
+namespace {
+
+using cert_trans::LeafHashIndex;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+
+class LeafHashIndexTest : public ::testing::Test {
+ protected:
+  LeafHashIndexTest()
+      : tree_(unique_ptr<Sha256Hasher>(new Sha256Hasher)), index_(&tree_) {
+  }
+
+  // Add a leaf to both the tree and the index.
+  void AddLeaf(const string& data) {
+    const size_t position(tree_.AddLeaf(data));
+    EXPECT_TRUE(index_.Insert(tree_.LeafHash(position), position - 1));
+  }
+
+  MerkleTree tree_;
+  LeafHashIndex index_;
+};
+
+TEST_F(LeafHashIndexTest, FindsLeaves) {
+  // Enough to grow the table a few times.
+  const int kLeafCount = 20000;
+  for (int i = 0; i < kLeafCount; ++i)
+    AddLeaf(to_string(i));
+
+  EXPECT_EQ(static_cast<size_t>(kLeafCount), index_.size());
+  for (int i = 0; i < kLeafCount; ++i)
+    ASSERT_EQ(i, index_.Find(tree_.LeafHash(to_string(i))));
+}
+
+TEST_F(LeafHashIndexTest, NotFound) {
+  EXPECT_EQ(-1, index_.Find(tree_.LeafHash("a")));
+  AddLeaf("a");
+  EXPECT_EQ(-1, index_.Find(tree_.LeafHash("b")));
+  // Hashes of the wrong size cannot be leaf hashes.
+  EXPECT_EQ(-1, index_.Find(""));
+  EXPECT_EQ(-1, index_.Find(tree_.LeafHash("a").substr(0, 8)));
+}
+
+TEST_F(LeafHashIndexTest, DuplicatesKeepFirstIndex) {
+  AddLeaf("a");
+  AddLeaf("b");
+  const size_t position(tree_.AddLeaf("a"));
+  EXPECT_FALSE(index_.Insert(tree_.LeafHash(position), position - 1));
+  EXPECT_EQ(0, index_.Find(tree_.LeafHash("a")));
+  EXPECT_EQ(2U, index_.size());
+}
+
+TEST_F(LeafHashIndexTest, Reserve) {
+  index_.Reserve(5000);
+  for (int i = 0; i < 5000; ++i)
+    AddLeaf(to_string(i));
+  // Shrinking is not a thing.
+  index_.Reserve(10);
+  for (int i = 0; i < 5000; ++i)
+    ASSERT_EQ(i, index_.Find(tree_.LeafHash(to_string(i))));
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
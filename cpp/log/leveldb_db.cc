@@ -3,29 +3,58 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <stdint.h>
+#include <algorithm>
 #include <map>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 
+#include "base/notification.h"
 #include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
+#include "monitoring/startup.h"
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
-using cert_trans::serialization::DeserializeResult;
+using std::chrono::duration_cast;
 using std::chrono::milliseconds;
+using std::chrono::steady_clock;
 using std::lock_guard;
-using std::make_pair;
+using std::make_shared;
+using std::map;
+using std::max;
 using std::min;
+using std::move;
 using std::mutex;
+using std::pair;
+using std::shared_ptr;
 using std::string;
 using std::unique_lock;
 using std::unique_ptr;
+using std::unordered_map;
+using std::unordered_set;
+using std::vector;
 
 DEFINE_int32(leveldb_max_open_files, 0,
              "number of open files that can be used by leveldb");
 DEFINE_int32(leveldb_bloom_filter_bits_per_key, 0,
              "number of open files that can be used by leveldb");
+DEFINE_int32(leveldb_block_cache_mb, 0,
+             "size of the block cache shared by all the keyspaces of the "
+             "database, in MB, 0 for the leveldb default (8MB)");
+DEFINE_bool(leveldb_compression, true,
+            "whether leveldb compresses its blocks with Snappy");
+DEFINE_int32(leveldb_write_buffer_mb, 0,
+             "size of the leveldb memtable, in MB, 0 for the leveldb "
+             "default (4MB)");
+DEFINE_bool(leveldb_separate_entries, false,
+            "when creating a database, keep its entries in a leveldb "
+            "database of their own, next to the one given, so that "
+            "compacting the index and the tree heads does not rewrite "
+            "the entries");
 
 namespace cert_trans {
 namespace {
@@ -35,11 +64,34 @@ static Latency<milliseconds, string> latency_by_op_ms(
     "leveldb_latency_by_operation_ms", "operation",
     "Database latency in ms broken out by operation.");
 
+static Gauge<>* build_index_time_ms(
+    Gauge<>::New("leveldb_build_index_time_ms",
+                 "Time taken to index the entries when the database was "
+                 "opened, in ms."));
+
 
 const char kMetaNodeIdKey[] = "metadata";
 const char kEntryPrefix[] = "entry-";
+const char kLeafHashPrefix[] = "leafhash-";
+// Maps entry hashes to their (lowest) sequence number.
+const char kHashPrefix[] = "hash-";
 const char kTreeHeadPrefix[] = "sth-";
 const char kMetaPrefix[] = "meta-";
+const char kMetaIndexCheckpointKey[] = "index_checkpoint";
+const char kMetaTreeCheckpointKey[] = "tree_checkpoint";
+// Appended to the name of the database for that of the entry
+// database, if any.
+const char kEntryDBSuffix[] = ".entries";
+// How many missing leaf hashes or hash mappings to write at once, when
+// adding them to an existing database.
+const int64_t kLeafHashBatchSize = 1 << 14;
+// How far the contiguous entries get past the index checkpoint before
+// it is moved up. BuildIndex() reads the entries from the checkpoint
+// on, so this bounds the work it has to do.
+const int64_t kIndexCheckpointInterval = 1 << 16;
+// The fewest entries a partition of BuildIndex() gets, below which
+// splitting the work further is not worth it.
+const int64_t kMinIndexPartitionSize = 1 << 16;
 
 
 #ifdef HAVE_LEVELDB_FILTER_POLICY_H
@@ -58,7 +110,7 @@ unique_ptr<const leveldb::FilterPolicy> BuildFilterPolicy() {
 
 // WARNING: Do NOT change the type of "index" from int64_t, or you'll
 // break existing databases!
-string IndexToKey(int64_t index) {
+string IndexToKey(const char* prefix, int64_t index) {
   const char nibble[] = "0123456789abcdef";
   string index_str(sizeof(index) * 2, nibble[0]);
   for (int i = sizeof(index) * 2; i > 0 && index > 0; --i) {
@@ -66,22 +118,41 @@ string IndexToKey(int64_t index) {
     index = index >> 4;
   }
 
-  return kEntryPrefix + index_str;
+  return prefix + index_str;
+}
+
+
+int HexDigitValue(char digit) {
+  if (digit >= '0' && digit <= '9') {
+    return digit - '0';
+  }
+  CHECK(digit >= 'a' && digit <= 'f') << "invalid hex digit: " << digit;
+  return digit - 'a' + 10;
 }
 
 
-int64_t KeyToIndex(leveldb::Slice key) {
-  CHECK(key.starts_with(kEntryPrefix));
-  key.remove_prefix(strlen(kEntryPrefix));
-  const string index_str(util::BinaryString(key.ToString()));
+// This is called for every entry scanned, so it decodes |key| in
+// place rather than copying it.
+int64_t KeyToIndex(const char* prefix, leveldb::Slice key) {
+  CHECK(key.starts_with(prefix));
+  key.remove_prefix(strlen(prefix));
 
-  int64_t index(0);
-  CHECK_EQ(index_str.size(), sizeof(index));
-  for (size_t i = 0; i < sizeof(index); ++i) {
-    index = (index << 8) | static_cast<unsigned char>(index_str[i]);
+  uint64_t index(0);
+  CHECK_EQ(key.size(), sizeof(index) * 2);
+  for (size_t i = 0; i < key.size(); ++i) {
+    index = (index << 4) | HexDigitValue(key[i]);
   }
 
-  return index;
+  return static_cast<int64_t>(index);
+}
+
+
+// LevelDB does no readahead of its own, but the blocks read by a
+// BULK_SCAN can at least be kept out of the block cache.
+leveldb::ReadOptions ReadOptionsFor(Database::ReadPattern pattern) {
+  leveldb::ReadOptions options;
+  options.fill_cache = pattern != Database::BULK_SCAN;
+  return options;
 }
 
 
@@ -91,9 +162,10 @@ int64_t KeyToIndex(leveldb::Slice key) {
 class LevelDB::Iterator : public Database::Iterator {
  public:
   Iterator(const LevelDB* db, int64_t start_index)
-      : it_(CHECK_NOTNULL(db)->db_->NewIterator(leveldb::ReadOptions())) {
+      : it_(CHECK_NOTNULL(db)->EntryDB()->NewIterator(
+            ReadOptionsFor(Database::BULK_SCAN))) {
     CHECK(it_);
-    it_->Seek(IndexToKey(start_index));
+    it_->Seek(IndexToKey(kEntryPrefix, start_index));
   }
 
   bool GetNextEntry(LoggedEntry* entry) override {
@@ -101,7 +173,7 @@ class LevelDB::Iterator : public Database::Iterator {
       return false;
     }
 
-    const int64_t seq(KeyToIndex(it_->key()));
+    const int64_t seq(KeyToIndex(kEntryPrefix, it_->key()));
     CHECK(entry->ParseFromArray(it_->value().data(), it_->value().size()))
         << "failed to parse entry for key " << it_->key().ToString();
     CHECK(entry->has_sequence_number())
@@ -119,6 +191,35 @@ class LevelDB::Iterator : public Database::Iterator {
 };
 
 
+class LevelDB::LeafHashIterator : public Database::LeafHashIterator {
+ public:
+  LeafHashIterator(const LevelDB* db, int64_t start_index)
+      : it_(CHECK_NOTNULL(db)->db_->NewIterator(
+            ReadOptionsFor(Database::BULK_SCAN))) {
+    CHECK(it_);
+    it_->Seek(IndexToKey(kLeafHashPrefix, start_index));
+  }
+
+  bool GetNextLeafHash(int64_t* sequence_number, string* leaf_hash) override {
+    CHECK_NOTNULL(sequence_number);
+    CHECK_NOTNULL(leaf_hash);
+    if (!it_->Valid() || !it_->key().starts_with(kLeafHashPrefix)) {
+      return false;
+    }
+
+    *sequence_number = KeyToIndex(kLeafHashPrefix, it_->key());
+    leaf_hash->assign(it_->value().data(), it_->value().size());
+
+    it_->Next();
+
+    return true;
+  }
+
+ private:
+  const unique_ptr<leveldb::Iterator> it_;
+};
+
+
 const size_t LevelDB::kTimestampBytesIndexed = 6;
 
 
@@ -127,8 +228,13 @@ LevelDB::LevelDB(const string& dbfile)
 #ifdef HAVE_LEVELDB_FILTER_POLICY_H
       filter_policy_(BuildFilterPolicy()),
 #endif
+      block_cache_(FLAGS_leveldb_block_cache_mb > 0
+                       ? leveldb::NewLRUCache(FLAGS_leveldb_block_cache_mb
+                                              << 20)
+                       : nullptr),
+      block_cache_memory_("leveldb_block_cache"),
       contiguous_size_(0),
-      latest_tree_timestamp_(0) {
+      index_checkpoint_(0) {
   LOG(INFO) << "Opening " << dbfile;
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("open"));
   leveldb::Options options;
@@ -142,47 +248,146 @@ LevelDB::LevelDB(const string& dbfile)
   CHECK_EQ(FLAGS_leveldb_bloom_filter_bits_per_key, 0)
       << "this version of leveldb does not have bloom filter support";
 #endif
+  options.block_cache = block_cache_.get();
+  options.compression = FLAGS_leveldb_compression
+                            ? leveldb::kSnappyCompression
+                            : leveldb::kNoCompression;
+  if (FLAGS_leveldb_write_buffer_mb > 0) {
+    options.write_buffer_size = FLAGS_leveldb_write_buffer_mb << 20;
+  }
   leveldb::DB* db;
   leveldb::Status status(leveldb::DB::Open(options, dbfile, &db));
   CHECK(status.ok()) << status.ToString();
   db_.reset(db);
 
+  // Entries are written in sequence and rarely read, and the keys of
+  // the index are not, so keeping them apart lets leveldb compact the
+  // entries by moving whole files around. Databases which already
+  // have a separate entry database keep using it, whatever the flag.
+  const string entry_dbfile(dbfile + kEntryDBSuffix);
+  options.create_if_missing = false;
+  status = leveldb::DB::Open(options, entry_dbfile, &db);
+  if (!status.ok() && FLAGS_leveldb_separate_entries) {
+    const unique_ptr<leveldb::Iterator> it(
+        db_->NewIterator(leveldb::ReadOptions()));
+    CHECK(it);
+    it->Seek(kEntryPrefix);
+    CHECK(!it->Valid() || !it->key().starts_with(kEntryPrefix))
+        << dbfile << " already has entries, which cannot be moved to "
+        << entry_dbfile;
+    options.create_if_missing = true;
+    status = leveldb::DB::Open(options, entry_dbfile, &db);
+    CHECK(status.ok()) << status.ToString();
+  }
+  if (status.ok()) {
+    LOG(INFO) << "Keeping entries in " << entry_dbfile;
+    entry_db_.reset(db);
+  }
+
   BuildIndex();
 }
 
 
 Database::WriteResult LevelDB::CreateSequencedEntry_(
     const LoggedEntry& logged) {
-  CHECK(logged.has_sequence_number());
-  CHECK_GE(logged.sequence_number(), 0);
   ScopedLatency latency(
       latency_by_op_ms.GetScopedLatency("create_sequenced_entry"));
+  return WriteSequencedEntries(vector<const LoggedEntry*>(1, &logged));
+}
 
-  unique_lock<mutex> lock(lock_);
 
-  string data;
-  CHECK(logged.SerializeToString(&data));
+Database::WriteResult LevelDB::CreateSequencedEntries_(
+    const vector<const LoggedEntry*>& entries) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("create_sequenced_entries"));
+  return WriteSequencedEntries(entries);
+}
 
-  const string key(IndexToKey(logged.sequence_number()));
 
-  string existing_data;
-  leveldb::Status status(
-      db_->Get(leveldb::ReadOptions(), key, &existing_data));
-  if (status.IsNotFound()) {
-    status = db_->Put(leveldb::WriteOptions(), key, data);
-    CHECK(status.ok()) << "Failed to write sequenced entry (seq: "
-                       << logged.sequence_number()
-                       << "): " << status.ToString();
-  } else {
-    if (existing_data == data) {
-      return this->OK;
+Database::WriteResult LevelDB::WriteSequencedEntries(
+    const vector<const LoggedEntry*>& entries) {
+  lock_guard<mutex> lock(lock_);
+
+  leveldb::WriteBatch batch;
+  leveldb::WriteBatch separate_entry_batch;
+  leveldb::WriteBatch* const entry_batch(entry_db_ ? &separate_entry_batch
+                                                   : &batch);
+  // What is already in the batches, which Get() does not see: the entries
+  // by sequence number, and the lowest sequence number of each hash.
+  map<int64_t, string> batch_entries;
+  unordered_map<string, int64_t> batch_hashes;
+  WriteResult result(this->OK);
+  for (const LoggedEntry* logged : entries) {
+    const int64_t sequence_number(logged->sequence_number());
+    string data;
+    CHECK(logged->SerializeToString(&data));
+
+    const string key(IndexToKey(kEntryPrefix, sequence_number));
+    const auto batch_entry(batch_entries.find(sequence_number));
+    string existing_data;
+    leveldb::Status status;
+    if (batch_entry != batch_entries.end()) {
+      existing_data = batch_entry->second;
+    } else {
+      status = EntryDB()->Get(leveldb::ReadOptions(), key, &existing_data);
+      CHECK(status.ok() || status.IsNotFound())
+          << "Failed to look up sequenced entry (seq: " << sequence_number
+          << "): " << status.ToString();
+    }
+    if (!status.IsNotFound()) {
+      if (existing_data == data) {
+        continue;
+      }
+      result = this->SEQUENCE_NUMBER_ALREADY_IN_USE;
+      break;
     }
-    return this->SEQUENCE_NUMBER_ALREADY_IN_USE;
+
+    string leaf_hash;
+    CHECK(logged->LeafHash(&leaf_hash));
+    entry_batch->Put(key, data);
+    batch.Put(IndexToKey(kLeafHashPrefix, sequence_number), leaf_hash);
+    const string hash(logged->Hash());
+    const auto batch_hash(batch_hashes.find(hash));
+    if (batch_hash != batch_hashes.end()) {
+      if (sequence_number < batch_hash->second) {
+        batch.Put(kHashPrefix + hash, IndexToKey("", sequence_number));
+        batch_hash->second = sequence_number;
+      }
+    } else if (AddHashMapping(sequence_number, hash, &batch)) {
+      batch_hashes.emplace(hash, sequence_number);
+    }
+    timestamp_index_.Add(sequence_number, logged->timestamp());
+    batch_entries.emplace(sequence_number, move(data));
   }
 
-  InsertEntryMapping(logged.sequence_number(), logged.Hash());
+  if (batch_entries.empty()) {
+    return result;
+  }
 
-  return this->OK;
+  // The entries go first: should the index not make it, BuildIndex()
+  // adds it back from them.
+  leveldb::Status status;
+  if (entry_db_) {
+    status = entry_db_->Write(leveldb::WriteOptions(), entry_batch);
+    CHECK(status.ok()) << "Failed to write " << batch_entries.size()
+                       << " sequenced entries (first seq: "
+                       << batch_entries.begin()->first
+                       << "): " << status.ToString();
+  }
+  status = db_->Write(leveldb::WriteOptions(), &batch);
+  CHECK(status.ok()) << "Failed to write " << batch_entries.size()
+                     << " sequenced entries (first seq: "
+                     << batch_entries.begin()->first
+                     << "): " << status.ToString();
+
+  for (const auto& entry : batch_entries) {
+    InsertSequenceNumber(entry.first);
+  }
+  if (contiguous_size_ >= index_checkpoint_ + kIndexCheckpointInterval) {
+    WriteIndexCheckpoint();
+  }
+
+  return result;
 }
 
 
@@ -190,16 +395,19 @@ Database::LookupResult LevelDB::LookupByHash(const string& hash,
                                              LoggedEntry* result) const {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_hash"));
 
-  unique_lock<mutex> lock(lock_);
-
-  auto i(id_by_hash_.find(hash));
-  if (i == id_by_hash_.end()) {
+  string seq_data;
+  leveldb::Status status(
+      db_->Get(leveldb::ReadOptions(), kHashPrefix + hash, &seq_data));
+  if (status.IsNotFound()) {
     return this->NOT_FOUND;
   }
+  CHECK(status.ok()) << "Failed to look up hash(" << util::HexString(hash)
+                     << "): " << status.ToString();
 
   string cert_data;
-  const leveldb::Status status(
-      db_->Get(leveldb::ReadOptions(), IndexToKey(i->second), &cert_data));
+  status = EntryDB()->Get(leveldb::ReadOptions(),
+                          IndexToKey(kEntryPrefix, KeyToIndex("", seq_data)),
+                    &cert_data);
   if (status.IsNotFound()) {
     return this->NOT_FOUND;
   }
@@ -221,8 +429,10 @@ Database::LookupResult LevelDB::LookupByIndex(int64_t sequence_number,
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_index"));
 
   string cert_data;
-  leveldb::Status status(db_->Get(leveldb::ReadOptions(),
-                                  IndexToKey(sequence_number), &cert_data));
+  leveldb::Status status(EntryDB()->Get(leveldb::ReadOptions(),
+                                        IndexToKey(kEntryPrefix,
+                                                   sequence_number),
+                                        &cert_data));
   if (status.IsNotFound()) {
     return this->NOT_FOUND;
   }
@@ -244,6 +454,50 @@ unique_ptr<Database::Iterator> LevelDB::ScanEntries(
 }
 
 
+void LevelDB::ReadEntries(int64_t start_index, int64_t end_index,
+                          size_t max_bytes, ReadPattern pattern,
+                          vector<LoggedEntry>* entries) const {
+  CHECK_GE(start_index, 0);
+  CHECK_NOTNULL(entries);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("read_entries"));
+
+  // A single iterator walks the span, so consecutive entries come out
+  // of the same blocks, instead of each being looked up separately.
+  const unique_ptr<leveldb::Iterator> it(
+      EntryDB()->NewIterator(ReadOptionsFor(pattern)));
+  CHECK(it);
+  size_t bytes(0);
+  int64_t seq(start_index);
+  for (it->Seek(IndexToKey(kEntryPrefix, start_index));
+       seq <= end_index && it->Valid(); it->Next(), ++seq) {
+    if (!it->key().starts_with(kEntryPrefix) ||
+        KeyToIndex(kEntryPrefix, it->key()) != seq) {
+      break;
+    }
+    if (seq > start_index && bytes + it->value().size() > max_bytes) {
+      break;
+    }
+    bytes += it->value().size();
+
+    entries->emplace_back();
+    CHECK(entries->back().ParseFromArray(it->value().data(),
+                                         it->value().size()))
+        << "failed to parse entry for key " << it->key().ToString();
+    CHECK_EQ(entries->back().sequence_number(), seq)
+        << "unexpected sequence_number";
+  }
+  CHECK(it->status().ok()) << "Failed to read entries from " << start_index
+                           << ": " << it->status().ToString();
+}
+
+
+unique_ptr<Database::LeafHashIterator> LevelDB::ScanLeafHashes(
+    int64_t start_index) const {
+  return unique_ptr<LeafHashIterator>(
+      new LeafHashIterator(this, start_index));
+}
+
+
 Database::WriteResult LevelDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
   CHECK_GE(sth.tree_size(), 0);
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("write_tree_head"));
@@ -273,12 +527,15 @@ Database::WriteResult LevelDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
   CHECK(status.ok()) << "Failed to write tree head (" << timestamp_key
                      << "): " << status.ToString();
 
-  if (sth.timestamp() > latest_tree_timestamp_) {
-    latest_tree_timestamp_ = sth.timestamp();
-    latest_timestamp_key_ = timestamp_key;
+  if (!latest_tree_head_ || sth.timestamp() > latest_tree_head_->timestamp()) {
+    std::atomic_store(&latest_tree_head_,
+                      make_shared<const ct::SignedTreeHead>(sth));
   }
 
   lock.unlock();
+  if (block_cache_) {
+    block_cache_memory_.Set(block_cache_->TotalCharge());
+  }
   callbacks_.Call(sth);
 
   return this->OK;
@@ -288,17 +545,62 @@ Database::WriteResult LevelDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
 Database::LookupResult LevelDB::LatestTreeHead(
     ct::SignedTreeHead* result) const {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("latest_tree_head"));
-  lock_guard<mutex> lock(lock_);
+  const shared_ptr<const ct::SignedTreeHead> sth(
+      std::atomic_load(&latest_tree_head_));
+  if (!sth) {
+    return this->NOT_FOUND;
+  }
+  result->CopyFrom(*sth);
+  return this->LOOKUP_OK;
+}
+
+
+Database::WriteResult LevelDB::WriteTreeCheckpoint_(
+    const ct::CompactTreeCheckpoint& checkpoint) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("write_tree_checkpoint"));
+  string data;
+  CHECK(checkpoint.SerializeToString(&data));
 
-  return LatestTreeHeadNoLock(result);
+  leveldb::WriteOptions opts;
+  opts.sync = true;
+  const leveldb::Status status(
+      db_->Put(opts, string(kMetaPrefix) + kMetaTreeCheckpointKey, data));
+  CHECK(status.ok()) << "Failed to write tree checkpoint: "
+                     << status.ToString();
+  return this->OK;
+}
+
+
+Database::LookupResult LevelDB::LatestTreeCheckpoint(
+    ct::CompactTreeCheckpoint* result) const {
+  CHECK_NOTNULL(result);
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("latest_tree_checkpoint"));
+  string data;
+  const leveldb::Status status(
+      db_->Get(leveldb::ReadOptions(),
+               string(kMetaPrefix) + kMetaTreeCheckpointKey, &data));
+  if (status.IsNotFound()) {
+    return this->NOT_FOUND;
+  }
+  CHECK(status.ok()) << "Failed to read tree checkpoint: "
+                     << status.ToString();
+  CHECK(result->ParseFromString(data));
+  return this->LOOKUP_OK;
 }
 
 
 int64_t LevelDB::TreeSize() const {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("tree_size"));
-  lock_guard<mutex> lock(lock_);
+  return contiguous_size_.load();
+}
+
 
-  return contiguous_size_;
+int64_t LevelDB::FirstSequenceNumberSince(uint64_t timestamp) const {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("first_sequence_number_since"));
+  return timestamp_index_.Lookup(*this, timestamp);
 }
 
 
@@ -308,10 +610,11 @@ void LevelDB::AddNotifySTHCallback(
 
   callbacks_.Add(callback);
 
-  ct::SignedTreeHead sth;
-  if (LatestTreeHeadNoLock(&sth) == this->LOOKUP_OK) {
+  const shared_ptr<const ct::SignedTreeHead> sth(
+      std::atomic_load(&latest_tree_head_));
+  if (sth) {
     lock.unlock();
-    (*callback)(sth);
+    (*callback)(*sth);
   }
 }
 
@@ -359,70 +662,234 @@ Database::LookupResult LevelDB::NodeId(string* node_id) {
 
 void LevelDB::BuildIndex() {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("build_index"));
+  const steady_clock::time_point start(steady_clock::now());
   // Technically, this should only be called from the constructor, so
   // this should not be necessarily, but just to be sure...
   lock_guard<mutex> lock(lock_);
 
+  // The entries below the checkpoint are known to be contiguous, and
+  // to have their hash mapping stored already, so only the ones after
+  // it need to be read. Databases written before the hash mappings
+  // were stored have no checkpoint, and get all of theirs added.
+  string checkpoint_data;
+  const leveldb::Status status(
+      db_->Get(leveldb::ReadOptions(),
+               string(kMetaPrefix) + kMetaIndexCheckpointKey,
+               &checkpoint_data));
+  if (status.ok()) {
+    index_checkpoint_ = KeyToIndex("", checkpoint_data);
+  } else {
+    CHECK(status.IsNotFound()) << "Failed to read index checkpoint: "
+                               << status.ToString();
+  }
+  contiguous_size_ = index_checkpoint_;
+
+  leveldb::ReadOptions options;
+  options.fill_cache = false;
+  unique_ptr<leveldb::Iterator> it(EntryDB()->NewIterator(options));
+  CHECK(it);
+
+  // Parsing and hashing the entries is what takes time, so split the
+  // range of sequence numbers into partitions indexed in parallel,
+  // and only merge their hashes into the hash mappings at the end.
+  StartupPhase phase("leveldb_build_index");
+  vector<IndexPartition> partitions;
+  it->Seek(IndexToKey(kEntryPrefix, index_checkpoint_));
+  if (it->Valid() && it->key().starts_with(kEntryPrefix)) {
+    const int64_t first(KeyToIndex(kEntryPrefix, it->key()));
+    // Sequence numbers are in hexadecimal, which sorts before "g".
+    it->Seek(string(kEntryPrefix) + "g");
+    if (it->Valid()) {
+      it->Prev();
+    } else {
+      it->SeekToLast();
+    }
+    const int64_t last(KeyToIndex(kEntryPrefix, it->key()));
+    phase.SetTotal(last - first + 1);
+
+    const int thread_count(BuildIndexThreadCount());
+    // A few partitions per thread, to even out sparse ranges.
+    const int64_t partition_size(max<int64_t>(
+        kMinIndexPartitionSize, (last - first) / (4 * thread_count) + 1));
+    for (int64_t begin = first; begin <= last; begin += partition_size) {
+      partitions.emplace_back();
+      partitions.back().begin = begin;
+      partitions.back().end = min(begin + partition_size, last + 1);
+    }
+
+    ThreadPool pool(min<size_t>(thread_count, partitions.size()));
+    vector<Notification> done(partitions.size());
+    for (size_t i = 0; i < partitions.size(); ++i) {
+      pool.Add([this, &partitions, &phase, &done, i]() {
+        IndexPartitionEntries(&partitions[i], &phase);
+        done[i].Notify();
+      });
+    }
+    for (const Notification& notification : done) {
+      notification.WaitForNotification();
+    }
+  }
+
+  int64_t entry_count(0);
+  int64_t missing_count(0);
+  for (const IndexPartition& partition : partitions) {
+    entry_count += partition.hashes.size();
+    missing_count += partition.missing_leaf_hashes;
+  }
+  // This goes through the entries in order, so that duplicate hashes
+  // map to their first entry. Mappings not written yet are tracked in
+  // |batch_hashes|, as AddHashMapping() only sees written ones.
+  leveldb::WriteBatch batch;
+  unordered_set<string> batch_hashes;
+  for (IndexPartition& partition : partitions) {
+    for (const pair<int64_t, string>& seq_hash : partition.hashes) {
+      InsertSequenceNumber(seq_hash.first);
+      if (batch_hashes.count(seq_hash.second) == 0 &&
+          AddHashMapping(seq_hash.first, seq_hash.second, &batch)) {
+        batch_hashes.insert(seq_hash.second);
+        if (static_cast<int64_t>(batch_hashes.size()) == kLeafHashBatchSize) {
+          FlushBatch(&batch);
+          batch_hashes.clear();
+        }
+      }
+    }
+    vector<pair<int64_t, string>>().swap(partition.hashes);
+  }
+  FlushBatch(&batch);
+  WriteIndexCheckpoint();
+  if (missing_count > 0) {
+    LOG(INFO) << "Added " << missing_count << " missing leaf hashes";
+  }
+
+  const milliseconds elapsed(
+      duration_cast<milliseconds>(steady_clock::now() - start));
+  build_index_time_ms->Set(elapsed.count());
+  LOG(INFO) << "Indexed " << entry_count << " entries in "
+            << partitions.size() << " partitions in " << elapsed.count()
+            << " ms";
+
+  // Now read the STH entries.
+  it.reset(db_->NewIterator(options));
+  CHECK(it);
+  // The keys sort by timestamp, so the latest is the last.
+  string tree_data;
+  it->Seek(kTreeHeadPrefix);
+  for (; it->Valid() && it->key().starts_with(kTreeHeadPrefix); it->Next()) {
+    tree_data = it->value().ToString();
+  }
+  if (!tree_data.empty()) {
+    ct::SignedTreeHead sth;
+    CHECK(sth.ParseFromString(tree_data));
+    std::atomic_store(&latest_tree_head_,
+                      make_shared<const ct::SignedTreeHead>(sth));
+  }
+}
+
+
+void LevelDB::IndexPartitionEntries(IndexPartition* partition,
+                                    StartupPhase* phase) {
+  CHECK_NOTNULL(partition);
+  CHECK_NOTNULL(phase);
   leveldb::ReadOptions options;
   options.fill_cache = false;
-  unique_ptr<leveldb::Iterator> it(db_->NewIterator(options));
+  const unique_ptr<leveldb::Iterator> it(EntryDB()->NewIterator(options));
   CHECK(it);
-  it->Seek(kEntryPrefix);
 
-  for (; it->Valid() && it->key().starts_with(kEntryPrefix); it->Next()) {
-    const int64_t seq(KeyToIndex(it->key()));
-    LoggedEntry logged;
-    CHECK(logged.ParseFromString(it->value().ToString()))
+  // Databases written before leaf hashes were stored lack some or all
+  // of them, so walk the leaf hashes alongside the entries, and fill
+  // in the missing ones.
+  const unique_ptr<leveldb::Iterator> leaf_hash_it(
+      db_->NewIterator(options));
+  CHECK(leaf_hash_it);
+  leaf_hash_it->Seek(IndexToKey(kLeafHashPrefix, partition->begin));
+  leveldb::WriteBatch missing_leaf_hashes;
+  // Parsed into again for every entry, so that its fields only get
+  // allocated once.
+  LoggedEntry logged;
+
+  for (it->Seek(IndexToKey(kEntryPrefix, partition->begin));
+       it->Valid() && it->key().starts_with(kEntryPrefix); it->Next()) {
+    const int64_t seq(KeyToIndex(kEntryPrefix, it->key()));
+    if (seq >= partition->end) {
+      break;
+    }
+    CHECK(logged.ParseFromArray(it->value().data(), it->value().size()))
         << "Failed to parse entry with sequence number " << seq;
     CHECK(logged.has_sequence_number())
         << "No sequence number for entry with sequence number " << seq;
     CHECK_EQ(logged.sequence_number(), seq)
         << "Entry has unexpected sequence_number: " << seq;
 
-    InsertEntryMapping(logged.sequence_number(), logged.Hash());
+    partition->hashes.emplace_back(seq, logged.Hash());
+    phase->AddDone(1);
+
+    int64_t leaf_hash_seq(-1);
+    for (; leaf_hash_it->Valid() &&
+           leaf_hash_it->key().starts_with(kLeafHashPrefix);
+         leaf_hash_it->Next()) {
+      leaf_hash_seq = KeyToIndex(kLeafHashPrefix, leaf_hash_it->key());
+      if (leaf_hash_seq >= seq) {
+        break;
+      }
+    }
+    if (leaf_hash_seq != seq) {
+      string leaf_hash;
+      CHECK(logged.LeafHash(&leaf_hash));
+      missing_leaf_hashes.Put(IndexToKey(kLeafHashPrefix, seq), leaf_hash);
+      if (++partition->missing_leaf_hashes % kLeafHashBatchSize == 0) {
+        FlushBatch(&missing_leaf_hashes);
+      }
+    }
   }
+  FlushBatch(&missing_leaf_hashes);
+}
 
-  // Now read the STH entries.
-  it->Seek(kTreeHeadPrefix);
-  for (; it->Valid() && it->key().starts_with(kTreeHeadPrefix); it->Next()) {
-    leveldb::Slice key_slice(it->key());
-    key_slice.remove_prefix(strlen(kTreeHeadPrefix));
-    latest_timestamp_key_ = key_slice.ToString();
-    CHECK_EQ(DeserializeResult::OK,
-             Deserializer::DeserializeUint<uint64_t>(
-                 latest_timestamp_key_, LevelDB::kTimestampBytesIndexed,
-                 &latest_tree_timestamp_));
-  }
+
+void LevelDB::FlushBatch(leveldb::WriteBatch* batch) {
+  const leveldb::Status status(db_->Write(leveldb::WriteOptions(), batch));
+  CHECK(status.ok()) << "Failed to write batch: " << status.ToString();
+  batch->Clear();
 }
 
 
-Database::LookupResult LevelDB::LatestTreeHeadNoLock(
-    ct::SignedTreeHead* result) const {
-  if (latest_tree_timestamp_ == 0) {
-    return this->NOT_FOUND;
+bool LevelDB::AddHashMapping(int64_t sequence_number, const string& hash,
+                             leveldb::WriteBatch* batch) const {
+  CHECK_NOTNULL(batch);
+  const string key(kHashPrefix + hash);
+  string seq_data;
+  const leveldb::Status status(
+      db_->Get(leveldb::ReadOptions(), key, &seq_data));
+  if (status.ok()) {
+    // This is a duplicate hash under a new sequence number. Make
+    // sure we track the entry with the lowest sequence number.
+    if (KeyToIndex("", seq_data) <= sequence_number) {
+      return false;
+    }
+  } else {
+    CHECK(status.IsNotFound()) << "Failed to look up hash("
+                               << util::HexString(hash)
+                               << "): " << status.ToString();
   }
 
-  string tree_data;
-  leveldb::Status status(db_->Get(leveldb::ReadOptions(),
-                                  kTreeHeadPrefix + latest_timestamp_key_,
-                                  &tree_data));
-  CHECK(status.ok()) << "Failed to read latest tree head: "
-                     << status.ToString();
+  batch->Put(key, IndexToKey("", sequence_number));
+  return true;
+}
 
-  CHECK(result->ParseFromString(tree_data));
-  CHECK_EQ(result->timestamp(), latest_tree_timestamp_);
 
-  return this->LOOKUP_OK;
+// This must be called with "lock_" held.
+void LevelDB::WriteIndexCheckpoint() {
+  const leveldb::Status status(
+      db_->Put(leveldb::WriteOptions(),
+               string(kMetaPrefix) + kMetaIndexCheckpointKey,
+               IndexToKey("", contiguous_size_)));
+  CHECK(status.ok()) << "Failed to write index checkpoint: "
+                     << status.ToString();
+  index_checkpoint_ = contiguous_size_;
 }
 
 
 // This must be called with "lock_" held.
-void LevelDB::InsertEntryMapping(int64_t sequence_number, const string& hash) {
-  if (!id_by_hash_.insert(make_pair(hash, sequence_number)).second) {
-    // This is a duplicate hash under a new sequence number.
-    // Make sure we track the entry with the lowest sequence number:
-    id_by_hash_[hash] = min(id_by_hash_[hash], sequence_number);
-  }
+void LevelDB::InsertSequenceNumber(int64_t sequence_number) {
   if (sequence_number == contiguous_size_) {
     ++contiguous_size_;
     for (auto i = sparse_entries_.find(contiguous_size_);
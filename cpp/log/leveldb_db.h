@@ -3,23 +3,31 @@
 
 #include "config.h"
 
+#include <leveldb/cache.h>
 #include <leveldb/db.h>
+#include <leveldb/write_batch.h>
 #ifdef HAVE_LEVELDB_FILTER_POLICY_H
 #include <leveldb/filter_policy.h>
 #endif
 #include <stdint.h>
+#include <atomic>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <set>
-#include <unordered_map>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "log/database.h"
+#include "log/timestamp_index.h"
+#include "monitoring/memory.h"
 #include "proto/ct.pb.h"
 
 namespace cert_trans {
 
+class StartupPhase;
+
 
 class LevelDB : public Database {
  public:
@@ -34,6 +42,9 @@ class LevelDB : public Database {
   Database::WriteResult CreateSequencedEntry_(
       const LoggedEntry& logged) override;
 
+  Database::WriteResult CreateSequencedEntries_(
+      const std::vector<const LoggedEntry*>& entries) override;
+
   Database::LookupResult LookupByHash(const std::string& hash,
                                       LoggedEntry* result) const override;
 
@@ -43,13 +54,28 @@ class LevelDB : public Database {
   std::unique_ptr<Database::Iterator> ScanEntries(
       int64_t start_index) const override;
 
+  void ReadEntries(int64_t start_index, int64_t end_index, size_t max_bytes,
+                   ReadPattern pattern,
+                   std::vector<LoggedEntry>* entries) const override;
+
+  std::unique_ptr<Database::LeafHashIterator> ScanLeafHashes(
+      int64_t start_index) const override;
+
   Database::WriteResult WriteTreeHead_(const ct::SignedTreeHead& sth) override;
 
   Database::LookupResult LatestTreeHead(
       ct::SignedTreeHead* result) const override;
 
+  Database::WriteResult WriteTreeCheckpoint_(
+      const ct::CompactTreeCheckpoint& checkpoint) override;
+
+  Database::LookupResult LatestTreeCheckpoint(
+      ct::CompactTreeCheckpoint* result) const override;
+
   int64_t TreeSize() const override;
 
+  int64_t FirstSequenceNumberSince(uint64_t timestamp) const override;
+
   void AddNotifySTHCallback(
       const Database::NotifySTHCallback* callback) override;
 
@@ -62,31 +88,74 @@ class LevelDB : public Database {
 
  private:
   class Iterator;
-
+  class LeafHashIterator;
+
+  // A range of sequence numbers indexed by BuildIndex(), from |begin|
+  // to |end| (exclusive).
+  struct IndexPartition {
+    int64_t begin = 0;
+    int64_t end = 0;
+    // The sequence numbers and hashes of the entries in the range.
+    std::vector<std::pair<int64_t, std::string>> hashes;
+    int64_t missing_leaf_hashes = 0;
+  };
+
+  // Writes the new |entries| in a single batch.
+  Database::WriteResult WriteSequencedEntries(
+      const std::vector<const LoggedEntry*>& entries);
+  // Where the entries are kept, |db_| itself unless they are in a
+  // database of their own.
+  leveldb::DB* EntryDB() const {
+    return entry_db_ ? entry_db_.get() : db_.get();
+  }
   void BuildIndex();
-  Database::LookupResult LatestTreeHeadNoLock(
-      ct::SignedTreeHead* result) const;
-  void InsertEntryMapping(int64_t sequence_number, const std::string& hash);
-
+  // Reads the entries of |partition|, and writes the leaf hashes
+  // missing from it. This does not need |lock_|.
+  void IndexPartitionEntries(IndexPartition* partition, StartupPhase* phase);
+  void FlushBatch(leveldb::WriteBatch* batch);
+  // Adds the mapping from |hash| to |sequence_number| to |batch|,
+  // unless the hash already maps to an earlier entry, in which case
+  // false is returned.
+  bool AddHashMapping(int64_t sequence_number, const std::string& hash,
+                      leveldb::WriteBatch* batch) const;
+  void WriteIndexCheckpoint();
+  void InsertSequenceNumber(int64_t sequence_number);
+
+  // Serializes the writers. The readers only go to leveldb, which
+  // takes care of them, and to |contiguous_size_| and
+  // |latest_tree_head_|, which they read without this.
   mutable std::mutex lock_;
 #ifdef HAVE_LEVELDB_FILTER_POLICY_H
   // filter_policy_ must be valid for at least as long as db_ is, so
   // keep this order.
   const std::unique_ptr<const leveldb::FilterPolicy> filter_policy_;
 #endif
+  // Shared by |db_| and |entry_db_|, so it must outlive them. If
+  // null, each database has a default cache of its own.
+  const std::unique_ptr<leveldb::Cache> block_cache_;
+  // Only updated as tree heads are written, which is often enough.
+  MemoryAccount block_cache_memory_;
   std::unique_ptr<leveldb::DB> db_;
+  // Null if the entries are in |db_|.
+  std::unique_ptr<leveldb::DB> entry_db_;
 
-  int64_t contiguous_size_;
-  std::unordered_map<std::string, int64_t> id_by_hash_;
+  // Only moved up with |lock_| held, once the entries below it are
+  // written.
+  std::atomic<int64_t> contiguous_size_;
+  // The entries below this are contiguous, and have their hash
+  // mapping stored, which is also recorded in the database.
+  int64_t index_checkpoint_;
 
   // This is a mapping of the non-contiguous entries of the log (which
   // can happen while it is being fetched). When entries here become
   // contiguous with the beginning of the tree, they are removed.
   std::set<int64_t> sparse_entries_;
 
-  uint64_t latest_tree_timestamp_;
-  std::string latest_timestamp_key_;
+  // Replaced with std::atomic_store() with |lock_| held, and read with
+  // std::atomic_load(). Null until there is a tree head.
+  std::shared_ptr<const ct::SignedTreeHead> latest_tree_head_;
   cert_trans::DatabaseNotifierHelper callbacks_;
+  TimestampIndex timestamp_index_;
 };
 
 
@@ -0,0 +1,559 @@
+#include "log/local_consistent_store.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include "log/database.h"
+#include "monitoring/monitoring.h"
+#include "util/executor.h"
+#include "util/util.h"
+
+DEFINE_int32(local_store_compaction_records, 10000,
+             "The journal of the local consistent store is rewritten with "
+             "only its current state once this many records were appended "
+             "to it.");
+
+using ct::ClusterConfig;
+using ct::ClusterNodeState;
+using ct::SequenceMapping;
+using ct::SignedTreeHead;
+using std::bind;
+using std::function;
+using std::lock_guard;
+using std::move;
+using std::mutex;
+using std::pair;
+using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+using util::Status;
+using util::StatusOr;
+using util::Task;
+
+namespace cert_trans {
+namespace {
+
+
+static Gauge<>* local_store_pending_entries =
+    Gauge<>::New("local_store_pending_entries",
+                 "Number of entries in the local consistent store.");
+
+static Counter<>* local_store_rejected_entries =
+    Counter<>::New("local_store_rejected_entries",
+                   "Number of pending entries rejected due to the number of "
+                   "entries in the local consistent store.");
+
+
+// The payload of each record is a protobuf: a LoggedEntry for those
+// added, a SequenceMapping of the entries removed (of which only the
+// hashes matter), and the new value of the sequence mapping, serving
+// STH or cluster config.
+const char kEntryRecord = 'E';
+const char kRemovedEntriesRecord = 'R';
+const char kSequenceMappingRecord = 'M';
+const char kServingSTHRecord = 'S';
+const char kClusterConfigRecord = 'C';
+
+// The keys, like the paths in etcd.
+const char kClusterConfigKey[] = "/cluster_config";
+const char kEntriesDir[] = "/entries/";
+const char kSequenceMappingKey[] = "/sequence_mapping";
+const char kServingSTHKey[] = "/serving_sth";
+const char kNodesDir[] = "/nodes/";
+
+
+template <class T>
+string Serialize(const T& message) {
+  string flat;
+  CHECK(message.SerializeToString(&flat));
+  return flat;
+}
+
+
+template <class CB>
+void RemoveWatch(Task* task, vector<pair<CB, Task*>>* watches) {
+  for (auto it(watches->begin()); it != watches->end(); ++it) {
+    if (it->second == task) {
+      watches->erase(it);
+      return;
+    }
+  }
+}
+
+
+}  // namespace
+
+
+LocalConsistentStore::LocalConsistentStore(const string& journal_path,
+                                           const ReadOnlyDatabase* db,
+                                           const string& node_id)
+    : node_id_(node_id),
+      journal_(journal_path),
+      version_(0),
+      num_records_since_compaction_(0),
+      pending_memory_("pending_entries"),
+      mapping_version_(0),
+      serving_sth_version_(0),
+      cluster_config_version_(0),
+      node_state_version_(0) {
+  CHECK_GT(FLAGS_local_store_compaction_records, 0);
+  Recover(CHECK_NOTNULL(db));
+}
+
+
+StatusOr<int64_t> LocalConsistentStore::NextAvailableSequenceNumber() const {
+  lock_guard<mutex> lock(lock_);
+  if (mapping_.mapping_size() > 0) {
+    return mapping_.mapping(mapping_.mapping_size() - 1).sequence_number() +
+           1;
+  }
+  if (!serving_sth_) {
+    LOG(WARNING) << "Log has no Serving STH [new log?], returning 0";
+    return 0;
+  }
+  return serving_sth_->tree_size();
+}
+
+
+Status LocalConsistentStore::SetServingSTH(const SignedTreeHead& new_sth) {
+  unique_lock<mutex> lock(lock_);
+  if (serving_sth_) {
+    if (serving_sth_->timestamp() >= new_sth.timestamp()) {
+      return Status(util::error::OUT_OF_RANGE,
+                    "Tree head is not newer than existing head");
+    }
+    CHECK_LE(serving_sth_->tree_size(), new_sth.tree_size());
+  }
+
+  serving_sth_.reset(new SignedTreeHead(new_sth));
+  serving_sth_version_ = ++version_;
+  const Update<SignedTreeHead> update(
+      Handle(kServingSTHKey, new_sth, serving_sth_version_), true);
+  for (const auto& watch : serving_sth_watches_) {
+    ScheduleWatchCallback(lock, watch.second, bind(watch.first, update));
+  }
+  Write(&lock, kServingSTHRecord, Serialize(new_sth));
+  return ::util::OkStatus();
+}
+
+
+StatusOr<SignedTreeHead> LocalConsistentStore::GetServingSTH() const {
+  lock_guard<mutex> lock(lock_);
+  if (!serving_sth_) {
+    return Status(util::error::NOT_FOUND, "No current Serving STH.");
+  }
+  return *serving_sth_;
+}
+
+
+Status LocalConsistentStore::AddPendingEntry(LoggedEntry* entry) {
+  CHECK_NOTNULL(entry);
+  CHECK(!entry->has_sequence_number());
+  const string hash(entry->Hash());
+
+  unique_lock<mutex> lock(lock_);
+  const auto it(pending_.find(hash));
+  if (it != pending_.end()) {
+    *entry->mutable_sct() = it->second.entry.sct();
+    // The earlier submission might still be waiting for its record.
+    journal_.WaitForSync(&lock, journal_.LastRecord(lock));
+    return Status(util::error::ALREADY_EXISTS,
+                  "Pending entry already exists.");
+  }
+  if (cluster_config_ &&
+      pending_.size() >=
+          cluster_config_->etcd_reject_add_pending_threshold()) {
+    local_store_rejected_entries->Increment();
+    return Status(util::error::RESOURCE_EXHAUSTED,
+                  "Rejected due to high number of pending entries.");
+  }
+
+  PendingEntry& pending(pending_[hash]);
+  pending.entry = *entry;
+  pending.version = ++version_;
+  pending_memory_.Add(entry->ByteSize());
+  local_store_pending_entries->Set(pending_.size());
+  const vector<Update<LoggedEntry>> updates{
+      Update<LoggedEntry>(Handle(EntryKey(hash), *entry, pending.version),
+                          true)};
+  for (const auto& watch : pending_entries_watches_) {
+    ScheduleWatchCallback(lock, watch.second, bind(watch.first, updates));
+  }
+  Write(&lock, kEntryRecord, Serialize(*entry));
+  return ::util::OkStatus();
+}
+
+
+double LocalConsistentStore::PendingEntriesLoad() const {
+  lock_guard<mutex> lock(lock_);
+  if (!cluster_config_ ||
+      cluster_config_->etcd_reject_add_pending_threshold() <= 0) {
+    return 0;
+  }
+  return static_cast<double>(pending_.size()) /
+         cluster_config_->etcd_reject_add_pending_threshold();
+}
+
+
+Status LocalConsistentStore::GetPendingEntryForHash(
+    const string& hash, EntryHandle<LoggedEntry>* entry) const {
+  lock_guard<mutex> lock(lock_);
+  const auto it(pending_.find(hash));
+  if (it == pending_.end()) {
+    return Status(util::error::NOT_FOUND, "No such pending entry.");
+  }
+  *entry = Handle(EntryKey(hash), it->second.entry, it->second.version);
+  return ::util::OkStatus();
+}
+
+
+Status LocalConsistentStore::GetPendingEntries(
+    vector<EntryHandle<LoggedEntry>>* entries) const {
+  CHECK(entries->empty());
+  lock_guard<mutex> lock(lock_);
+  for (const auto& pending : pending_) {
+    entries->emplace_back(Handle(EntryKey(pending.first),
+                                 pending.second.entry,
+                                 pending.second.version));
+  }
+  return ::util::OkStatus();
+}
+
+
+Status LocalConsistentStore::GetSequenceMapping(
+    EntryHandle<SequenceMapping>* entry) const {
+  lock_guard<mutex> lock(lock_);
+  *entry = Handle(kSequenceMappingKey, mapping_, mapping_version_);
+  return ::util::OkStatus();
+}
+
+
+Status LocalConsistentStore::UpdateSequenceMapping(
+    EntryHandle<SequenceMapping>* entry) {
+  CHECK(entry->HasHandle());
+  const SequenceMapping& mapping(entry->Entry());
+  for (int i = 1; i < mapping.mapping_size(); ++i) {
+    CHECK_LT(mapping.mapping(i - 1).sequence_number(),
+             mapping.mapping(i).sequence_number());
+  }
+
+  unique_lock<mutex> lock(lock_);
+  if (entry->Handle() != mapping_version_) {
+    return Status(util::error::FAILED_PRECONDITION,
+                  "Sequence mapping was updated since it was read.");
+  }
+  mapping_ = mapping;
+  mapping_version_ = ++version_;
+  entry->SetHandle(mapping_version_);
+  Write(&lock, kSequenceMappingRecord, Serialize(mapping));
+  return ::util::OkStatus();
+}
+
+
+StatusOr<ClusterNodeState> LocalConsistentStore::GetClusterNodeState() const {
+  lock_guard<mutex> lock(lock_);
+  if (!node_state_) {
+    return Status(util::error::NOT_FOUND, "No cluster node state.");
+  }
+  return *node_state_;
+}
+
+
+Status LocalConsistentStore::SetClusterNodeState(
+    const ClusterNodeState& state) {
+  unique_lock<mutex> lock(lock_);
+  node_state_.reset(new ClusterNodeState(state));
+  node_state_->set_node_id(node_id_);
+  node_state_version_ = ++version_;
+  const vector<Update<ClusterNodeState>> updates{Update<ClusterNodeState>(
+      Handle(kNodesDir + node_id_, *node_state_, node_state_version_), true)};
+  for (const auto& watch : node_state_watches_) {
+    ScheduleWatchCallback(lock, watch.second, bind(watch.first, updates));
+  }
+  return ::util::OkStatus();
+}
+
+
+void LocalConsistentStore::WatchServingSTH(const ServingSTHCallback& cb,
+                                           Task* task) {
+  unique_lock<mutex> lock(lock_);
+  EntryHandle<SignedTreeHead> handle;
+  handle.SetKey(kServingSTHKey);
+  if (serving_sth_) {
+    handle = Handle(kServingSTHKey, *serving_sth_, serving_sth_version_);
+  }
+  ScheduleWatchCallback(lock, task,
+                        bind(cb, Update<SignedTreeHead>(
+                                     handle, serving_sth_ != nullptr)));
+  serving_sth_watches_.emplace_back(cb, task);
+  task->WhenCancelled(bind(&LocalConsistentStore::CancelWatch, this, task));
+}
+
+
+void LocalConsistentStore::WatchClusterNodeStates(
+    const ClusterNodeStateCallback& cb, Task* task) {
+  unique_lock<mutex> lock(lock_);
+  vector<Update<ClusterNodeState>> updates;
+  if (node_state_) {
+    updates.emplace_back(
+        Handle(kNodesDir + node_id_, *node_state_, node_state_version_),
+        true);
+  }
+  ScheduleWatchCallback(lock, task, bind(cb, move(updates)));
+  node_state_watches_.emplace_back(cb, task);
+  task->WhenCancelled(bind(&LocalConsistentStore::CancelWatch, this, task));
+}
+
+
+void LocalConsistentStore::WatchClusterConfig(const ClusterConfigCallback& cb,
+                                              Task* task) {
+  unique_lock<mutex> lock(lock_);
+  EntryHandle<ClusterConfig> handle;
+  handle.SetKey(kClusterConfigKey);
+  if (cluster_config_) {
+    handle =
+        Handle(kClusterConfigKey, *cluster_config_, cluster_config_version_);
+  }
+  ScheduleWatchCallback(lock, task,
+                        bind(cb, Update<ClusterConfig>(
+                                     handle, cluster_config_ != nullptr)));
+  cluster_config_watches_.emplace_back(cb, task);
+  task->WhenCancelled(bind(&LocalConsistentStore::CancelWatch, this, task));
+}
+
+
+void LocalConsistentStore::WatchPendingEntries(
+    const PendingEntriesCallback& cb, Task* task) {
+  unique_lock<mutex> lock(lock_);
+  vector<Update<LoggedEntry>> updates;
+  for (const auto& pending : pending_) {
+    updates.emplace_back(Handle(EntryKey(pending.first), pending.second.entry,
+                                pending.second.version),
+                         true);
+  }
+  ScheduleWatchCallback(lock, task, bind(cb, move(updates)));
+  pending_entries_watches_.emplace_back(cb, task);
+  task->WhenCancelled(bind(&LocalConsistentStore::CancelWatch, this, task));
+}
+
+
+Status LocalConsistentStore::SetClusterConfig(const ClusterConfig& config) {
+  unique_lock<mutex> lock(lock_);
+  cluster_config_.reset(new ClusterConfig(config));
+  cluster_config_version_ = ++version_;
+  const Update<ClusterConfig> update(
+      Handle(kClusterConfigKey, config, cluster_config_version_), true);
+  for (const auto& watch : cluster_config_watches_) {
+    ScheduleWatchCallback(lock, watch.second, bind(watch.first, update));
+  }
+  Write(&lock, kClusterConfigRecord, Serialize(config));
+  return ::util::OkStatus();
+}
+
+
+StatusOr<int64_t> LocalConsistentStore::CleanupOldEntries() {
+  unique_lock<mutex> lock(lock_);
+  if (!serving_sth_) {
+    LOG(INFO) << "No current serving_sth, nothing to do.";
+    return 0;
+  }
+
+  const int64_t tree_size(serving_sth_->tree_size());
+  SequenceMapping removed;
+  vector<Update<LoggedEntry>> updates;
+  for (const auto& m : mapping_.mapping()) {
+    if (m.sequence_number() >= tree_size) {
+      break;
+    }
+    const auto it(pending_.find(m.entry_hash()));
+    if (it != pending_.end()) {
+      pending_memory_.Add(-it->second.entry.ByteSize());
+      pending_.erase(it);
+      *removed.add_mapping() = m;
+      EntryHandle<LoggedEntry> handle;
+      handle.SetKey(EntryKey(m.entry_hash()));
+      updates.emplace_back(handle, false);
+    }
+  }
+  if (removed.mapping_size() == 0) {
+    return 0;
+  }
+
+  LOG(INFO) << "Cleaned up " << removed.mapping_size()
+            << " entries below sequence number " << tree_size;
+  ++version_;
+  local_store_pending_entries->Set(pending_.size());
+  for (const auto& watch : pending_entries_watches_) {
+    ScheduleWatchCallback(lock, watch.second, bind(watch.first, updates));
+  }
+  Write(&lock, kRemovedEntriesRecord, Serialize(removed));
+  return removed.mapping_size();
+}
+
+
+void LocalConsistentStore::Recover(const ReadOnlyDatabase* db) {
+  unique_lock<mutex> lock(lock_);
+  journal_.Read([this](char type, const string& payload) {
+    ++version_;
+    switch (type) {
+      case kEntryRecord: {
+        LoggedEntry entry;
+        if (!entry.ParseFromString(payload)) {
+          return false;
+        }
+        PendingEntry& pending(pending_[entry.Hash()]);
+        pending.entry = entry;
+        pending.version = version_;
+        return true;
+      }
+      case kRemovedEntriesRecord: {
+        SequenceMapping removed;
+        if (!removed.ParseFromString(payload)) {
+          return false;
+        }
+        for (const auto& m : removed.mapping()) {
+          pending_.erase(m.entry_hash());
+        }
+        return true;
+      }
+      case kSequenceMappingRecord:
+        mapping_version_ = version_;
+        return mapping_.ParseFromString(payload);
+      case kServingSTHRecord:
+        serving_sth_.reset(new SignedTreeHead);
+        serving_sth_version_ = version_;
+        return serving_sth_->ParseFromString(payload);
+      case kClusterConfigRecord:
+        cluster_config_.reset(new ClusterConfig);
+        cluster_config_version_ = version_;
+        return cluster_config_->ParseFromString(payload);
+    }
+    return false;
+  });
+
+  if (!serving_sth_) {
+    SignedTreeHead sth;
+    if (db->LatestTreeHead(&sth) == Database::LOOKUP_OK) {
+      LOG(INFO) << "Serving the latest tree head of the database: "
+                << sth.ShortDebugString();
+      serving_sth_.reset(new SignedTreeHead(sth));
+      serving_sth_version_ = ++version_;
+    }
+  }
+  int64_t pending_bytes(0);
+  for (const auto& pending : pending_) {
+    pending_bytes += pending.second.entry.ByteSize();
+  }
+  pending_memory_.Set(pending_bytes);
+  local_store_pending_entries->Set(pending_.size());
+  LOG(INFO) << "Recovered " << pending_.size() << " pending entries and "
+            << mapping_.mapping_size() << " sequence mappings";
+  Compact(&lock);
+}
+
+
+void LocalConsistentStore::Compact(unique_lock<mutex>* lock) {
+  journal_.Rewrite(lock, [this]() {
+    string records;
+    if (cluster_config_) {
+      records.append(Journal::Record(kClusterConfigRecord,
+                                     Serialize(*cluster_config_)));
+    }
+    if (serving_sth_) {
+      records.append(
+          Journal::Record(kServingSTHRecord, Serialize(*serving_sth_)));
+    }
+    records.append(
+        Journal::Record(kSequenceMappingRecord, Serialize(mapping_)));
+    for (const auto& pending : pending_) {
+      records.append(
+          Journal::Record(kEntryRecord, Serialize(pending.second.entry)));
+    }
+    return records;
+  });
+  num_records_since_compaction_ = 0;
+}
+
+
+void LocalConsistentStore::Write(unique_lock<mutex>* lock, char type,
+                                 const string& payload) {
+  // The change is already in the state that compaction writes out.
+  if (++num_records_since_compaction_ >=
+      FLAGS_local_store_compaction_records) {
+    Compact(lock);
+    return;
+  }
+  journal_.WaitForSync(lock, journal_.Append(*lock, type, payload));
+}
+
+
+template <class T>
+EntryHandle<T> LocalConsistentStore::Handle(const string& key, const T& entry,
+                                            int64_t version) const {
+  EntryHandle<T> handle;
+  handle.SetKey(key);
+  *handle.MutableEntry() = entry;
+  handle.SetHandle(version);
+  return handle;
+}
+
+
+string LocalConsistentStore::EntryKey(const string& hash) const {
+  return kEntriesDir + util::HexString(hash);
+}
+
+
+void LocalConsistentStore::ScheduleWatchCallback(
+    const unique_lock<mutex>& lock, Task* task,
+    const function<void()>& callback) {
+  CHECK(lock.owns_lock());
+  const bool already_running(!watch_callbacks_.empty());
+
+  task->AddHold();
+  watch_callbacks_.emplace_back(task, callback);
+  if (!already_running) {
+    task->executor()->Add(bind(&LocalConsistentStore::RunWatchCallback, this));
+  }
+}
+
+
+void LocalConsistentStore::RunWatchCallback() {
+  Task* current;
+  function<void()> callback;
+  {
+    lock_guard<mutex> lock(lock_);
+    CHECK(!watch_callbacks_.empty());
+    current = watch_callbacks_.front().first;
+    callback = move(watch_callbacks_.front().second);
+  }
+
+  callback();
+
+  Task* next(nullptr);
+  {
+    lock_guard<mutex> lock(lock_);
+    watch_callbacks_.pop_front();
+    if (!watch_callbacks_.empty()) {
+      next = watch_callbacks_.front().first;
+    }
+  }
+  current->RemoveHold();
+  if (next) {
+    next->executor()->Add(bind(&LocalConsistentStore::RunWatchCallback, this));
+  }
+}
+
+
+void LocalConsistentStore::CancelWatch(Task* task) {
+  lock_guard<mutex> lock(lock_);
+  RemoveWatch(task, &serving_sth_watches_);
+  RemoveWatch(task, &node_state_watches_);
+  RemoveWatch(task, &cluster_config_watches_);
+  RemoveWatch(task, &pending_entries_watches_);
+  // The callbacks already scheduled hold the task, and still run.
+  task->Return(Status::CANCELLED);
+}
+
+
+}  // namespace cert_trans
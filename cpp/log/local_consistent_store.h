@@ -0,0 +1,153 @@
+#ifndef CERT_TRANS_LOG_LOCAL_CONSISTENT_STORE_H_
+#define CERT_TRANS_LOG_LOCAL_CONSISTENT_STORE_H_
+
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "log/consistent_store.h"
+#include "log/journal.h"
+#include "log/logged_entry.h"
+#include "monitoring/memory.h"
+#include "proto/ct.pb.h"
+
+namespace cert_trans {
+
+class ReadOnlyDatabase;
+
+
+// A ConsistentStore for a log served by a single node, kept in memory
+// and in a local journal rather than in etcd, so that nothing waits on
+// a round trip to another process. Every change is synced to the
+// journal before it returns, and the journal is replayed when the
+// store is next opened. Until a serving STH was set, the latest tree
+// head of the database is served, if there is one.
+//
+// The cluster node state is only kept in memory, as it would have
+// expired by the time the node restarts anyway.
+class LocalConsistentStore : public ConsistentStore {
+ public:
+  // |db| is only read from the constructor.
+  LocalConsistentStore(const std::string& journal_path,
+                       const ReadOnlyDatabase* db, const std::string& node_id);
+
+  util::StatusOr<int64_t> NextAvailableSequenceNumber() const override;
+
+  util::Status SetServingSTH(const ct::SignedTreeHead& new_sth) override;
+
+  util::StatusOr<ct::SignedTreeHead> GetServingSTH() const override;
+
+  util::Status AddPendingEntry(LoggedEntry* entry) override;
+
+  // The number of pending entries (sequenced or not, until they are
+  // cleaned up), over the reject threshold of the cluster config.
+  double PendingEntriesLoad() const override;
+
+  util::Status GetPendingEntryForHash(
+      const std::string& hash, EntryHandle<LoggedEntry>* entry) const override;
+
+  util::Status GetPendingEntries(
+      std::vector<EntryHandle<LoggedEntry>>* entries) const override;
+
+  util::Status GetSequenceMapping(
+      EntryHandle<ct::SequenceMapping>* entry) const override;
+
+  util::Status UpdateSequenceMapping(
+      EntryHandle<ct::SequenceMapping>* entry) override;
+
+  util::StatusOr<ct::ClusterNodeState> GetClusterNodeState() const override;
+
+  util::Status SetClusterNodeState(const ct::ClusterNodeState& state) override;
+
+  void WatchServingSTH(const ConsistentStore::ServingSTHCallback& cb,
+                       util::Task* task) override;
+
+  void WatchClusterNodeStates(
+      const ConsistentStore::ClusterNodeStateCallback& cb,
+      util::Task* task) override;
+
+  void WatchClusterConfig(const ConsistentStore::ClusterConfigCallback& cb,
+                          util::Task* task) override;
+
+  void WatchPendingEntries(const ConsistentStore::PendingEntriesCallback& cb,
+                           util::Task* task) override;
+
+  util::Status SetClusterConfig(const ct::ClusterConfig& config) override;
+
+  // Removes the entries covered by the serving STH.
+  util::StatusOr<int64_t> CleanupOldEntries() override;
+
+ private:
+  // Reads the journal, and rewrites it with only the current state.
+  void Recover(const ReadOnlyDatabase* db);
+
+  // Replaces the journal with one holding only the current state.
+  void Compact(std::unique_lock<std::mutex>* lock);
+
+  // Appends a record to the journal, compacting it instead if enough
+  // records were appended since it was last, and returns once it is
+  // synced.
+  void Write(std::unique_lock<std::mutex>* lock, char type,
+             const std::string& payload);
+
+  template <class T>
+  EntryHandle<T> Handle(const std::string& key, const T& entry,
+                        int64_t version) const;
+
+  std::string EntryKey(const std::string& hash) const;
+
+  // The watch callbacks are run one at a time, in the order they were
+  // scheduled, each on the executor of its task, which is held until
+  // then.
+  void ScheduleWatchCallback(const std::unique_lock<std::mutex>& lock,
+                             util::Task* task,
+                             const std::function<void()>& callback);
+  void RunWatchCallback();
+  void CancelWatch(util::Task* task);
+
+  struct PendingEntry {
+    LoggedEntry entry;
+    int64_t version;
+  };
+
+  template <class CB>
+  using Watches = std::vector<std::pair<CB, util::Task*>>;
+
+  const std::string node_id_;
+
+  mutable std::mutex lock_;
+  Journal journal_;
+  // Incremented by every change, whose version it becomes, like the
+  // index of etcd.
+  int64_t version_;
+  int64_t num_records_since_compaction_;
+  // By hash.
+  std::map<std::string, PendingEntry> pending_;
+  // Counts the entries of |pending_| as serialized.
+  MemoryAccount pending_memory_;
+  ct::SequenceMapping mapping_;
+  int64_t mapping_version_;
+  std::unique_ptr<ct::SignedTreeHead> serving_sth_;
+  int64_t serving_sth_version_;
+  std::unique_ptr<ct::ClusterConfig> cluster_config_;
+  int64_t cluster_config_version_;
+  std::unique_ptr<ct::ClusterNodeState> node_state_;
+  int64_t node_state_version_;
+
+  Watches<ServingSTHCallback> serving_sth_watches_;
+  Watches<ClusterNodeStateCallback> node_state_watches_;
+  Watches<ClusterConfigCallback> cluster_config_watches_;
+  Watches<PendingEntriesCallback> pending_entries_watches_;
+  std::deque<std::pair<util::Task*, std::function<void()>>> watch_callbacks_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_LOCAL_CONSISTENT_STORE_H_
@@ -0,0 +1,280 @@
+#include "log/local_consistent_store.h"
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "base/notification.h"
+#include "log/file_db.h"
+#include "log/logged_entry.h"
+#include "log/test_db.h"
+#include "log/test_signer.h"
+#include "proto/cert_serializer.h"
+#include "util/status_test_util.h"
+#include "util/sync_task.h"
+#include "util/testing.h"
+#include "util/thread_pool.h"
+
+DECLARE_int32(local_store_compaction_records);
+
+namespace cert_trans {
+namespace {
+
+using ct::ClusterConfig;
+using ct::SequenceMapping;
+using ct::SignedTreeHead;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using util::SyncTask;
+using util::testing::StatusIs;
+
+
+class LocalConsistentStoreTest : public ::testing::Test {
+ public:
+  LocalConsistentStoreTest() : pool_(2) {
+  }
+
+ protected:
+  void SetUp() override {
+    FLAGS_local_store_compaction_records = 10000;
+  }
+
+  unique_ptr<LocalConsistentStore> Open() {
+    return unique_ptr<LocalConsistentStore>(new LocalConsistentStore(
+        tmp_.TmpStorageDir() + "/journal", test_db_.db(), "node"));
+  }
+
+  // Adds |entry| at |sequence_number| to the sequence mapping.
+  void Sequence(LocalConsistentStore* store, const LoggedEntry& entry,
+                int64_t sequence_number) {
+    EntryHandle<SequenceMapping> mapping;
+    ASSERT_OK(store->GetSequenceMapping(&mapping));
+    SequenceMapping::Mapping* const m(mapping.MutableEntry()->add_mapping());
+    m->set_entry_hash(entry.Hash());
+    m->set_sequence_number(sequence_number);
+    ASSERT_OK(store->UpdateSequenceMapping(&mapping));
+  }
+
+  // Pending entries have no sequence number yet.
+  void CreatePending(LoggedEntry* entry) {
+    test_signer_.CreateUnique(entry);
+    entry->clear_sequence_number();
+  }
+
+  SignedTreeHead TreeHead(int64_t tree_size, uint64_t timestamp) {
+    SignedTreeHead sth;
+    test_signer_.CreateUnique(&sth);
+    sth.set_tree_size(tree_size);
+    sth.set_timestamp(timestamp);
+    return sth;
+  }
+
+  TmpStorage tmp_;
+  TestDB<FileDB> test_db_;
+  ThreadPool pool_;
+  TestSigner test_signer_;
+};
+
+
+TEST_F(LocalConsistentStoreTest, AddsPendingEntry) {
+  unique_ptr<LocalConsistentStore> store(Open());
+  LoggedEntry entry;
+  CreatePending(&entry);
+  EXPECT_OK(store->AddPendingEntry(&entry));
+
+  EntryHandle<LoggedEntry> handle;
+  EXPECT_OK(store->GetPendingEntryForHash(entry.Hash(), &handle));
+  EXPECT_EQ(entry.Hash(), handle.Entry().Hash());
+  EXPECT_EQ(entry.timestamp(), handle.Entry().timestamp());
+  EXPECT_THAT(store->GetPendingEntryForHash("nope", &handle),
+              StatusIs(util::error::NOT_FOUND));
+
+  vector<EntryHandle<LoggedEntry>> entries;
+  EXPECT_OK(store->GetPendingEntries(&entries));
+  ASSERT_EQ(1U, entries.size());
+  EXPECT_EQ(entry.Hash(), entries[0].Entry().Hash());
+}
+
+
+TEST_F(LocalConsistentStoreTest, ResubmissionGetsSameSct) {
+  unique_ptr<LocalConsistentStore> store(Open());
+  LoggedEntry entry;
+  CreatePending(&entry);
+  EXPECT_OK(store->AddPendingEntry(&entry));
+
+  LoggedEntry again(entry);
+  again.mutable_sct()->set_timestamp(entry.timestamp() + 1);
+  EXPECT_THAT(store->AddPendingEntry(&again),
+              StatusIs(util::error::ALREADY_EXISTS));
+  EXPECT_EQ(entry.timestamp(), again.timestamp());
+}
+
+
+TEST_F(LocalConsistentStoreTest, RejectsOverThreshold) {
+  unique_ptr<LocalConsistentStore> store(Open());
+  ClusterConfig config;
+  config.set_etcd_reject_add_pending_threshold(1);
+  EXPECT_OK(store->SetClusterConfig(config));
+
+  LoggedEntry first, second;
+  CreatePending(&first);
+  CreatePending(&second);
+  EXPECT_OK(store->AddPendingEntry(&first));
+  EXPECT_EQ(1, store->PendingEntriesLoad());
+  EXPECT_THAT(store->AddPendingEntry(&second),
+              StatusIs(util::error::RESOURCE_EXHAUSTED));
+}
+
+
+TEST_F(LocalConsistentStoreTest, SequenceMappingNeedsCurrentHandle) {
+  unique_ptr<LocalConsistentStore> store(Open());
+  EntryHandle<SequenceMapping> stale;
+  EXPECT_OK(store->GetSequenceMapping(&stale));
+  EXPECT_EQ(0, store->NextAvailableSequenceNumber().ValueOrDie());
+
+  LoggedEntry entry;
+  CreatePending(&entry);
+  EXPECT_OK(store->AddPendingEntry(&entry));
+  Sequence(store.get(), entry, 0);
+  EXPECT_EQ(1, store->NextAvailableSequenceNumber().ValueOrDie());
+
+  stale.MutableEntry()->add_mapping()->set_sequence_number(0);
+  EXPECT_THAT(store->UpdateSequenceMapping(&stale),
+              StatusIs(util::error::FAILED_PRECONDITION));
+}
+
+
+TEST_F(LocalConsistentStoreTest, ServingSTHMustBeNewer) {
+  unique_ptr<LocalConsistentStore> store(Open());
+  EXPECT_THAT(store->GetServingSTH().status(),
+              StatusIs(util::error::NOT_FOUND));
+  EXPECT_OK(store->SetServingSTH(TreeHead(0, 1000)));
+  EXPECT_THAT(store->SetServingSTH(TreeHead(0, 1000)),
+              StatusIs(util::error::OUT_OF_RANGE));
+  EXPECT_EQ(1000U, store->GetServingSTH().ValueOrDie().timestamp());
+}
+
+
+TEST_F(LocalConsistentStoreTest, ServesTreeHeadOfDatabase) {
+  const SignedTreeHead sth(TreeHead(0, 1234));
+  EXPECT_EQ(Database::OK, test_db_.db()->WriteTreeHead(sth));
+
+  unique_ptr<LocalConsistentStore> store(Open());
+  EXPECT_EQ(1234U, store->GetServingSTH().ValueOrDie().timestamp());
+}
+
+
+TEST_F(LocalConsistentStoreTest, CleansUpServedEntries) {
+  unique_ptr<LocalConsistentStore> store(Open());
+  LoggedEntry first, second;
+  CreatePending(&first);
+  CreatePending(&second);
+  EXPECT_OK(store->AddPendingEntry(&first));
+  EXPECT_OK(store->AddPendingEntry(&second));
+  Sequence(store.get(), first, 0);
+  Sequence(store.get(), second, 1);
+  EXPECT_OK(store->SetServingSTH(TreeHead(1, 1000)));
+
+  EXPECT_EQ(1, store->CleanupOldEntries().ValueOrDie());
+  EXPECT_EQ(0, store->CleanupOldEntries().ValueOrDie());
+  EntryHandle<LoggedEntry> handle;
+  EXPECT_THAT(store->GetPendingEntryForHash(first.Hash(), &handle),
+              StatusIs(util::error::NOT_FOUND));
+  EXPECT_OK(store->GetPendingEntryForHash(second.Hash(), &handle));
+
+  store = Open();
+  EXPECT_THAT(store->GetPendingEntryForHash(first.Hash(), &handle),
+              StatusIs(util::error::NOT_FOUND));
+  EXPECT_OK(store->GetPendingEntryForHash(second.Hash(), &handle));
+}
+
+
+TEST_F(LocalConsistentStoreTest, ReplaysJournal) {
+  LoggedEntry entry;
+  CreatePending(&entry);
+  {
+    unique_ptr<LocalConsistentStore> store(Open());
+    ClusterConfig config;
+    config.set_minimum_serving_nodes(1);
+    EXPECT_OK(store->SetClusterConfig(config));
+    EXPECT_OK(store->AddPendingEntry(&entry));
+    Sequence(store.get(), entry, 0);
+    EXPECT_OK(store->SetServingSTH(TreeHead(0, 1000)));
+  }
+
+  unique_ptr<LocalConsistentStore> store(Open());
+  EntryHandle<LoggedEntry> handle;
+  EXPECT_OK(store->GetPendingEntryForHash(entry.Hash(), &handle));
+  EXPECT_EQ(entry.timestamp(), handle.Entry().timestamp());
+  EXPECT_EQ(1, store->NextAvailableSequenceNumber().ValueOrDie());
+  EXPECT_EQ(1000U, store->GetServingSTH().ValueOrDie().timestamp());
+  // The cluster node state is not kept.
+  EXPECT_THAT(store->GetClusterNodeState().status(),
+              StatusIs(util::error::NOT_FOUND));
+}
+
+
+TEST_F(LocalConsistentStoreTest, ReplaysAfterCompaction) {
+  FLAGS_local_store_compaction_records = 2;
+  const int kNumEntries(5);
+  LoggedEntry entries[kNumEntries];
+  {
+    unique_ptr<LocalConsistentStore> store(Open());
+    for (int i = 0; i < kNumEntries; ++i) {
+      CreatePending(&entries[i]);
+      EXPECT_OK(store->AddPendingEntry(&entries[i]));
+    }
+  }
+
+  unique_ptr<LocalConsistentStore> store(Open());
+  vector<EntryHandle<LoggedEntry>> pending;
+  EXPECT_OK(store->GetPendingEntries(&pending));
+  EXPECT_EQ(static_cast<size_t>(kNumEntries), pending.size());
+}
+
+
+TEST_F(LocalConsistentStoreTest, WatchesPendingEntries) {
+  unique_ptr<LocalConsistentStore> store(Open());
+  LoggedEntry first, second;
+  CreatePending(&first);
+  CreatePending(&second);
+  EXPECT_OK(store->AddPendingEntry(&first));
+
+  Notification initial, added;
+  SyncTask task(&pool_);
+  int num_updates(0);
+  store->WatchPendingEntries(
+      [&](const vector<Update<LoggedEntry>>& updates) {
+        ASSERT_EQ(1U, updates.size());
+        EXPECT_TRUE(updates[0].exists_);
+        if (++num_updates == 1) {
+          EXPECT_EQ(first.Hash(), updates[0].handle_.Entry().Hash());
+          initial.Notify();
+        } else {
+          EXPECT_EQ(second.Hash(), updates[0].handle_.Entry().Hash());
+          added.Notify();
+        }
+      },
+      task.task());
+  initial.WaitForNotification();
+  EXPECT_OK(store->AddPendingEntry(&second));
+  added.WaitForNotification();
+
+  task.Cancel();
+  task.Wait();
+  EXPECT_THAT(task.status(), StatusIs(util::error::CANCELLED));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  ConfigureSerializerForV1CT();
+  return RUN_ALL_TESTS();
+}
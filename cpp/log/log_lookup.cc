@@ -3,7 +3,8 @@
 #include <glog/logging.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <map>
+#include <algorithm>
+#include <chrono>
 #include <string>
 #include <utility>
 #include <vector>
@@ -11,6 +12,7 @@
 #include "base/time_support.h"
 #include "merkletree/merkle_tree.h"
 #include "merkletree/serial_hasher.h"
+#include "monitoring/startup.h"
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
 #include "util/util.h"
@@ -19,12 +21,18 @@ using ct::MerkleAuditProof;
 using ct::ShortMerkleAuditProof;
 using ct::SignedTreeHead;
 using std::bind;
-using std::lock_guard;
 using std::make_pair;
-using std::map;
+using std::chrono::seconds;
+using std::lock_guard;
+using std::max;
+using std::min;
+using std::move;
 using std::mutex;
+using std::pair;
 using std::placeholders::_1;
+using std::shared_ptr;
 using std::string;
+using std::thread;
 using std::unique_lock;
 using std::unique_ptr;
 using std::vector;
@@ -34,24 +42,198 @@ namespace cert_trans {
 
 
 static const int kCtimeBufSize = 26;
+// How many entries to read from the database before adding them to
+// the tree, when catching up, and so how long lookups may have to
+// wait for the tree.
+static const int64_t kUpdateBatchSize = 1 << 14;
+// How often to check whether a shared tree covers the pending tree
+// head.
+static const seconds kSharedTreePollInterval(1);
+// How many of the previous tree heads to keep a consistency proof to
+// the current one ready for.
+static const size_t kRecentTreeHeads = 8;
+// How many of the leaves added by a tree head, the newest ones, to
+// compute the audit path of as it is published.
+static const size_t kMaxRecentPaths = 1 << 12;
+
+
+namespace {
+
+
+// Makes sure that a tree persisted in |store| belongs with |db|,
+// discarding it otherwise, and trims it back to the latest tree head
+// of |db|, as it cannot serve anything beyond that yet.
+unique_ptr<MerkleTreeNodeStore> CheckStoredTree(
+    const ReadOnlyDatabase* db, unique_ptr<MerkleTreeNodeStore> store) {
+  CHECK_NOTNULL(store.get());
+  if (store->LevelCount() == 0) {
+    return store;
+  }
+
+  int64_t tree_size(0);
+  SignedTreeHead sth;
+  if (db->LatestTreeHead(&sth) == ReadOnlyDatabase::LOOKUP_OK) {
+    tree_size = sth.tree_size();
+  }
+  CHECK_LE(0, tree_size);
+
+  int64_t leaf_count(store->NodeCount(0));
+  if (leaf_count > tree_size) {
+    LOG(WARNING) << "Stored Merkle tree has " << leaf_count
+                 << " leaves but the latest tree head only " << tree_size
+                 << ", trimming it";
+    store->TruncateLevel(0, tree_size);
+    leaf_count = tree_size;
+  }
+
+  if (leaf_count > 0) {
+    // Spot-check the last leaf against the database; if the tree came
+    // from another log, this will almost certainly catch it, and if
+    // not, the root hash check on the next update will.
+    LoggedEntry logged;
+    string leaf_hash;
+    if (db->LookupByIndex(leaf_count - 1, &logged) !=
+            ReadOnlyDatabase::LOOKUP_OK ||
+        !logged.LeafHash(&leaf_hash) ||
+        leaf_hash !=
+            string(store->Node(0, leaf_count - 1), store->NodeSize())) {
+      LOG(WARNING) << "Stored Merkle tree does not match the database, "
+                   << "discarding it";
+      store->TruncateLevels(0);
+    }
+  }
+
+  return store;
+}
+
+
+}  // namespace
 
 
 LogLookup::LogLookup(ReadOnlyDatabase* db)
     : db_(CHECK_NOTNULL(db)),
+      executor_(nullptr),
+      cert_tree_(unique_ptr<Sha256Hasher>(new Sha256Hasher)),
+      leaf_index_(&cert_tree_),
+      latest_tree_head_(),
+      stop_polling_(false),
+      update_from_sth_cb_(bind(&LogLookup::UpdateFromSTH, this, _1)),
+      ready_(false) {
+  db_->AddNotifySTHCallback(&update_from_sth_cb_);
+  ready_ = true;
+}
+
+
+LogLookup::LogLookup(ReadOnlyDatabase* db,
+                     unique_ptr<MerkleTreeNodeStore> store,
+                     util::Executor* executor, bool load_in_background)
+    : db_(CHECK_NOTNULL(db)),
+      executor_(executor),
+      cert_tree_(unique_ptr<Sha256Hasher>(new Sha256Hasher),
+                 CheckStoredTree(db_, move(store))),
+      leaf_index_(&cert_tree_),
+      latest_tree_head_(),
+      stop_polling_(false),
+      update_from_sth_cb_(bind(&LogLookup::UpdateFromSTH, this, _1)),
+      ready_(false) {
+  if (load_in_background) {
+    loader_ = thread(&LogLookup::Load, this);
+  } else {
+    Load();
+  }
+}
+
+
+LogLookup::LogLookup(ReadOnlyDatabase* db,
+                     unique_ptr<StoredMerkleTree> shared_tree)
+    : db_(CHECK_NOTNULL(db)),
+      executor_(nullptr),
+      cert_tree_(unique_ptr<Sha256Hasher>(new Sha256Hasher)),
+      shared_tree_(move(shared_tree)),
+      leaf_index_(shared_tree_.get()),
+      latest_tree_head_(),
+      stop_polling_(false),
+      shared_tree_poller_(&LogLookup::PollSharedTree, this),
+      update_from_sth_cb_(bind(&LogLookup::UpdateFromSTH, this, _1)),
+      ready_(false) {
+  db_->AddNotifySTHCallback(&update_from_sth_cb_);
+  ready_ = true;
+}
+
+
+LogLookup::LogLookup(ReadOnlyDatabase* db,
+                     unique_ptr<TreePartition> partition)
+    : db_(CHECK_NOTNULL(db)),
+      executor_(nullptr),
       cert_tree_(unique_ptr<Sha256Hasher>(new Sha256Hasher)),
+      partition_(move(partition)),
+      leaf_index_(&cert_tree_),
       latest_tree_head_(),
-      update_from_sth_cb_(bind(&LogLookup::UpdateFromSTH, this, _1)) {
+      stop_polling_(false),
+      update_from_sth_cb_(bind(&LogLookup::UpdateFromSTH, this, _1)),
+      ready_(false) {
+  CHECK(partition_);
+  LOG(INFO) << "Serving the proofs of the leaves [" << partition_->begin()
+            << ", " << partition_->end() << ") of the tree";
   db_->AddNotifySTHCallback(&update_from_sth_cb_);
+  ready_ = true;
 }
 
 
 LogLookup::~LogLookup() {
+  // There is no interrupting the initial load.
+  if (loader_.joinable()) {
+    loader_.join();
+  }
   db_->RemoveNotifySTHCallback(&update_from_sth_cb_);
+  if (shared_tree_poller_.joinable()) {
+    {
+      lock_guard<mutex> update_lock(update_lock_);
+      stop_polling_ = true;
+    }
+    pending_cond_.notify_all();
+    shared_tree_poller_.join();
+  }
 }
 
 
-void LogLookup::UpdateFromSTH(const SignedTreeHead& sth) {
+void LogLookup::Load() {
+  {
+    // The leaves are at hand in the tree, no need to go to the
+    // database for those. Lookups only take |lock_|, so let them in
+    // between batches.
+    lock_guard<mutex> update_lock(update_lock_);
+    const int64_t leaf_count(cert_tree_.LeafCount());
+    StartupPhase phase("log_lookup_index_stored_tree");
+    phase.SetTotal(leaf_count);
+    {
+      lock_guard<mutex> lock(lock_);
+      leaf_index_.Reserve(leaf_count);
+    }
+    for (int64_t begin = 0; begin < leaf_count; begin += kUpdateBatchSize) {
+      const int64_t end(min(leaf_count, begin + kUpdateBatchSize));
+      lock_guard<mutex> lock(lock_);
+      for (int64_t leaf = begin; leaf < end; ++leaf) {
+        leaf_index_.Insert(cert_tree_.LeafHash(leaf + 1), leaf);
+      }
+      UpdateMemory();
+      phase.AddDone(end - begin);
+    }
+    LOG(INFO) << "Loaded " << leaf_count
+              << " leaves from the stored Merkle tree";
+  }
+
+  // This catches up with the latest tree head of the database.
+  db_->AddNotifySTHCallback(&update_from_sth_cb_);
   lock_guard<mutex> lock(lock_);
+  ready_ = true;
+}
+
+
+void LogLookup::UpdateFromSTH(const SignedTreeHead& sth) {
+  // |latest_tree_head_| only changes with |update_lock_| held, so it
+  // can be read here without |lock_|, but |cert_tree_| cannot.
+  unique_lock<mutex> update_lock(update_lock_);
 
   CHECK_EQ(ct::V1, sth.version())
       << "Tree head signed with an unknown version";
@@ -61,50 +243,60 @@ void LogLookup::UpdateFromSTH(const SignedTreeHead& sth) {
 
   CHECK_LE(0, sth.tree_size());
   if (sth.timestamp() <= latest_tree_head_.timestamp() ||
-      static_cast<uint64_t>(sth.tree_size()) < cert_tree_.LeafCount()) {
+      sth.tree_size() < latest_tree_head_.tree_size()) {
     LOG(WARNING) << "Database replied with an STH that is older than ours: "
                  << "Our STH:\n" << latest_tree_head_.DebugString()
                  << "Database STH:\n" << sth.DebugString();
     return;
   }
 
-  // Record the new hashes: append all of them, die on any error.
-  // TODO(ekasper): make tree signer write leaves out to the database,
-  // so that we don't have to read the entries in.
-  string leaf_hash;
-  auto it(db_->ScanEntries(cert_tree_.LeafCount()));
-  // LeafCount() is potentially unsigned here but as this is using memory
-  // the count can never get close to overflow in 64 bits.
-  CHECK_LE(cert_tree_.LeafCount(), static_cast<uint64_t>(INT64_MAX));
+  if (shared_tree_) {
+    // Left to PollSharedTree(), as the shared tree might not have it
+    // yet.
+    if (sth.timestamp() > pending_tree_head_.timestamp() &&
+        sth.tree_size() >= pending_tree_head_.tree_size()) {
+      pending_tree_head_.CopyFrom(sth);
+      pending_cond_.notify_all();
+    }
+    return;
+  }
 
-  for (int64_t sequence_number = cert_tree_.LeafCount();
-       sequence_number < sth.tree_size(); ++sequence_number) {
-    LoggedEntry logged;
-    // TODO(ekasper): perhaps some of these errors can/should be
-    // handled more gracefully. E.g. we could retry a failed update
-    // a number of times -- but until we know under which conditions
-    // the database might fail (database busy?), just die.
-    CHECK(it->GetNextEntry(&logged))
-        << "Latest STH has " << sth.tree_size() << "entries but we failed to "
-        << "retrieve entry number " << sequence_number;
-    CHECK(logged.has_sequence_number())
-        << "Logged entry has no sequence number";
-    CHECK_EQ(sequence_number, logged.sequence_number());
-
-    leaf_hash = LeafHash(logged);
-    // TODO(ekasper): plug in the log public key so that we can verify the STH.
-    CHECK_EQ(static_cast<size_t>(sequence_number + 1),
-             cert_tree_.AddLeafHash(leaf_hash));
-    // Duplicate leaves shouldn't really happen but are not a problem either:
-    // we just return the Merkle proof of the first occurrence.
-    leaf_index_.insert(make_pair(leaf_hash, sequence_number));
-  }
-  CHECK_EQ(HexString(cert_tree_.CurrentRoot()),
-           HexString(sth.sha256_root_hash()))
+  // The first update, as the server starts, catches up with the whole
+  // database.
+  unique_ptr<StartupPhase> phase;
+  if (latest_tree_head_.timestamp() == 0) {
+    phase.reset(new StartupPhase("log_lookup_build_tree"));
+  }
+
+  // The leaves might be there already, if they were prefetched.
+  AddLeaves(update_lock, sth.tree_size(), phase.get());
+
+  lock_guard<mutex> lock(lock_);
+  // TODO(ekasper): plug in the log public key so that we can verify the
+  // STH.
+  string root;
+  if (partition_) {
+    // Partitions are not prefetched into, so the tree head is at the
+    // end of it.
+    CHECK_EQ(sth.tree_size(), partition_->LeafCount());
+    partition_->RecordSnapshot();
+    CHECK(partition_->RootAtSnapshot(sth.tree_size(), &root));
+  } else {
+    root = cert_tree_.LeafCount() == static_cast<uint64_t>(sth.tree_size())
+               ? cert_tree_.CurrentRoot(executor_)
+               : cert_tree_.RootAtSnapshot(sth.tree_size());
+  }
+  CHECK_EQ(HexString(root), HexString(sth.sha256_root_hash()))
       << "Computed root hash and stored STH root hash do not match";
+  if (!partition_) {
+    // Clients will keep asking about this tree size for a while.
+    cert_tree_.CacheSnapshot(sth.tree_size());
+    cert_tree_.Sync();
+  }
   LOG(INFO) << "Found " << sth.tree_size() - latest_tree_head_.tree_size()
             << " new log entries";
-  latest_tree_head_.CopyFrom(sth);
+  // This makes the new leaves visible to lookups.
+  PublishTreeHead(sth);
 
   const time_t last_update(static_cast<time_t>(latest_tree_head_.timestamp() /
                                                kNumMillisPerSecond));
@@ -113,6 +305,251 @@ void LogLookup::UpdateFromSTH(const SignedTreeHead& sth) {
 }
 
 
+void LogLookup::PrefetchLeaves(int64_t tree_size) {
+  if (shared_tree_ || partition_) {
+    return;
+  }
+  unique_lock<mutex> update_lock(update_lock_);
+  tree_size = min(tree_size, db_->TreeSize());
+  int64_t leaf_count;
+  {
+    lock_guard<mutex> lock(lock_);
+    leaf_count = cert_tree_.LeafCount();
+  }
+  if (tree_size <= leaf_count) {
+    return;
+  }
+
+  AddLeaves(update_lock, tree_size, nullptr);
+  // Hash the upper levels now too, so that only the right edge of the
+  // tree is left to hash for the tree head that covers these leaves.
+  lock_guard<mutex> lock(lock_);
+  cert_tree_.CurrentRoot(executor_);
+  cert_tree_.Sync();
+  VLOG(1) << "Prefetched " << tree_size - leaf_count << " leaves past the "
+          << "tree head of size " << latest_tree_head_.tree_size();
+}
+
+
+void LogLookup::AddLeafHashes(int64_t begin,
+                              const vector<string>& leaf_hashes) {
+  // Until it is loaded, the tree is held by Load(), which the signer
+  // should not wait for.
+  if (shared_tree_ || partition_ || !IsReady()) {
+    return;
+  }
+  unique_lock<mutex> update_lock(update_lock_);
+  int64_t leaf_count;
+  {
+    lock_guard<mutex> lock(lock_);
+    leaf_count = cert_tree_.LeafCount();
+  }
+  const int64_t end(begin + leaf_hashes.size());
+  if (begin > leaf_count || end <= leaf_count) {
+    return;
+  }
+
+  vector<string> batch;
+  for (int64_t batch_begin = leaf_count; batch_begin < end;
+       batch_begin += kUpdateBatchSize) {
+    const int64_t batch_end(min(end, batch_begin + kUpdateBatchSize));
+    batch.assign(leaf_hashes.begin() + (batch_begin - begin),
+                 leaf_hashes.begin() + (batch_end - begin));
+    lock_guard<mutex> lock(lock_);
+    AppendLeafHashes(batch, end);
+  }
+  VLOG(1) << "Added " << end - leaf_count << " leaves from the signer past "
+          << "the tree head of size " << latest_tree_head_.tree_size();
+}
+
+
+void LogLookup::PollSharedTree() {
+  unique_lock<mutex> update_lock(update_lock_);
+  while (!stop_polling_) {
+    if (pending_tree_head_.timestamp() > latest_tree_head_.timestamp()) {
+      CatchUpWithSharedTree(update_lock);
+    }
+    pending_cond_.wait_for(update_lock, kSharedTreePollInterval);
+  }
+}
+
+
+void LogLookup::CatchUpWithSharedTree(const unique_lock<mutex>& update_lock) {
+  CHECK(update_lock.owns_lock());
+  const SignedTreeHead sth(pending_tree_head_);
+  {
+    lock_guard<mutex> lock(lock_);
+    shared_tree_->Refresh();
+    if (!shared_tree_->Covers(sth.tree_size())) {
+      VLOG(1) << "Shared Merkle tree does not cover the tree head of size "
+              << sth.tree_size() << " yet";
+      return;
+    }
+  }
+
+  unique_ptr<StartupPhase> phase;
+  if (latest_tree_head_.timestamp() == 0) {
+    phase.reset(new StartupPhase("log_lookup_index_shared_tree"));
+    phase->SetTotal(sth.tree_size());
+  }
+
+  // Only the leaves up to |latest_tree_head_| are in the index so far.
+  for (int64_t begin = latest_tree_head_.tree_size(); begin < sth.tree_size();
+       begin += kUpdateBatchSize) {
+    const int64_t end(min(sth.tree_size(), begin + kUpdateBatchSize));
+    lock_guard<mutex> lock(lock_);
+    leaf_index_.Reserve(sth.tree_size());
+    for (int64_t leaf = begin; leaf < end; ++leaf) {
+      leaf_index_.Insert(shared_tree_->LeafHash(leaf + 1), leaf);
+    }
+    UpdateMemory();
+    if (phase) {
+      phase->AddDone(end - begin);
+    }
+  }
+
+  lock_guard<mutex> lock(lock_);
+  CHECK_EQ(HexString(shared_tree_->RootAtSnapshot(sth.tree_size())),
+           HexString(sth.sha256_root_hash()))
+      << "Shared Merkle tree root hash and stored STH root hash do not match";
+  LOG(INFO) << "Found " << sth.tree_size() - latest_tree_head_.tree_size()
+            << " new log entries in the shared Merkle tree";
+  PublishTreeHead(sth);
+}
+
+
+void LogLookup::PublishTreeHead(const SignedTreeHead& sth) {
+  const size_t tree_size(sth.tree_size());
+  const size_t previous_size(latest_tree_head_.tree_size());
+  if (previous_size > 0 && previous_size < tree_size &&
+      (recent_tree_sizes_.empty() ||
+       recent_tree_sizes_.back() != previous_size)) {
+    recent_tree_sizes_.push_back(previous_size);
+    if (recent_tree_sizes_.size() > kRecentTreeHeads) {
+      recent_tree_sizes_.pop_front();
+    }
+  }
+
+  consistency_to_latest_.clear();
+  for (const size_t first : recent_tree_sizes_) {
+    if (first < tree_size) {
+      consistency_to_latest_[first] = SnapshotConsistency(first, tree_size);
+    }
+  }
+
+  // The newest leaves are the ones clients ask about first. A tree
+  // head which adds none keeps the paths of the previous one.
+  const shared_ptr<const RecentPaths> previous(
+      std::atomic_load(&recent_paths_));
+  shared_ptr<RecentPaths> recent(new RecentPaths);
+  recent->sth.CopyFrom(sth);
+  if (previous && previous_size == tree_size) {
+    recent->paths = previous->paths;
+  }
+  for (size_t leaf = max(previous_size, tree_size - min(tree_size,
+                                                        kMaxRecentPaths));
+       leaf < tree_size; ++leaf) {
+    string leaf_hash;
+    int64_t index;
+    if (partition_) {
+      // Those of a range which is complete already are not kept.
+      leaf_hash = partition_->LeafHash(leaf);
+      index = partition_->FindLeaf(leaf_hash);
+    } else {
+      leaf_hash = shared_tree_ ? shared_tree_->LeafHash(leaf + 1)
+                               : cert_tree_.LeafHash(leaf + 1);
+      index = leaf_index_.Find(leaf_hash);
+    }
+    // Lookups return the first occurrence of a duplicate leaf.
+    if (index != static_cast<int64_t>(leaf)) {
+      continue;
+    }
+    vector<string> path;
+    if (PathToRootAtSnapshot(leaf + 1, tree_size, &path)) {
+      recent->paths.emplace(move(leaf_hash), make_pair(leaf, move(path)));
+    }
+  }
+
+  latest_tree_head_.CopyFrom(sth);
+  std::atomic_store(&recent_paths_,
+                    shared_ptr<const RecentPaths>(move(recent)));
+}
+
+
+void LogLookup::AddLeaves(const unique_lock<mutex>& update_lock,
+                          int64_t tree_size, StartupPhase* phase) {
+  CHECK(update_lock.owns_lock());
+  int64_t sequence_number;
+  {
+    lock_guard<mutex> lock(lock_);
+    sequence_number = LeafCount();
+  }
+  if (phase) {
+    phase->SetTotal(max<int64_t>(0, tree_size - sequence_number));
+  }
+
+  // Record the new hashes: append all of them, die on any error.
+  auto it(db_->ScanLeafHashes(sequence_number));
+
+  // Read the leaf hashes in batches, so that lookups only ever have to
+  // wait for one batch to be added to the tree.
+  vector<string> leaf_hashes;
+  while (sequence_number < tree_size) {
+    const int64_t batch_end(
+        min(tree_size, sequence_number + kUpdateBatchSize));
+    leaf_hashes.clear();
+    for (; sequence_number < batch_end; ++sequence_number) {
+      int64_t entry_sequence_number;
+      leaf_hashes.emplace_back();
+      // TODO(ekasper): perhaps some of these errors can/should be
+      // handled more gracefully. E.g. we could retry a failed update
+      // a number of times -- but until we know under which conditions
+      // the database might fail (database busy?), just die.
+      CHECK(it->GetNextLeafHash(&entry_sequence_number, &leaf_hashes.back()))
+          << "Adding leaves up to " << tree_size << " but we failed "
+          << "to retrieve entry number " << sequence_number;
+      CHECK_EQ(sequence_number, entry_sequence_number);
+    }
+
+    lock_guard<mutex> lock(lock_);
+    AppendLeafHashes(leaf_hashes, tree_size);
+    if (phase) {
+      phase->AddDone(leaf_hashes.size());
+    }
+  }
+}
+
+
+void LogLookup::AppendLeafHashes(const vector<string>& leaf_hashes,
+                                 int64_t tree_size) {
+  if (partition_) {
+    partition_->AddLeafHashes(leaf_hashes);
+    return;
+  }
+  const int64_t batch_begin(cert_tree_.LeafCount());
+  leaf_index_.Reserve(tree_size);
+  CHECK_EQ(batch_begin + leaf_hashes.size(),
+           cert_tree_.AddLeafHashes(leaf_hashes));
+  for (size_t i = 0; i < leaf_hashes.size(); ++i) {
+    // Duplicate leaves shouldn't really happen but are not a problem
+    // either: we just return the Merkle proof of the first occurrence.
+    leaf_index_.Insert(leaf_hashes[i], batch_begin + i);
+  }
+  // Hash the upper levels as we go, rather than all at once at the
+  // end, which would hold the lock for as long.
+  cert_tree_.CurrentRoot(executor_);
+  cert_tree_.Sync();
+  UpdateMemory();
+}
+
+
+void LogLookup::UpdateMemory() {
+  // A shared tree is in its files, only mapped here.
+  tree_memory_.Set(cert_tree_.AllocatedBytes());
+  leaf_index_memory_.Set(leaf_index_.AllocatedBytes());
+}
+
+
 LogLookup::LookupResult LogLookup::GetIndex(const string& merkle_leaf_hash,
                                             int64_t* index) {
   unique_lock<mutex> lock(lock_);
@@ -130,6 +567,22 @@ LogLookup::LookupResult LogLookup::GetIndex(const string& merkle_leaf_hash,
 // Look up by SHA256-hash of the certificate.
 LogLookup::LookupResult LogLookup::AuditProof(const string& merkle_leaf_hash,
                                               MerkleAuditProof* proof) {
+  shared_ptr<const RecentPaths> recent;
+  const RecentPaths::Path* const recent_path(
+      FindRecentPath(merkle_leaf_hash, &recent));
+  if (recent_path) {
+    proof->set_version(ct::V1);
+    proof->set_tree_size(recent->sth.tree_size());
+    proof->set_timestamp(recent->sth.timestamp());
+    proof->set_leaf_index(recent_path->first);
+    proof->clear_path_node();
+    for (const string& node : recent_path->second)
+      proof->add_path_node(node);
+    proof->mutable_id()->CopyFrom(recent->sth.id());
+    proof->mutable_tree_head_signature()->CopyFrom(recent->sth.signature());
+    return OK;
+  }
+
   unique_lock<mutex> lock(lock_);
 
   const int64_t leaf_index(GetIndexInternal(lock, merkle_leaf_hash));
@@ -138,13 +591,17 @@ LogLookup::LookupResult LogLookup::AuditProof(const string& merkle_leaf_hash,
   }
 
   CHECK_GE(leaf_index, 0);
+  const size_t tree_size(latest_tree_head_.tree_size());
   proof->set_version(ct::V1);
-  proof->set_tree_size(cert_tree_.LeafCount());
+  proof->set_tree_size(tree_size);
   proof->set_timestamp(latest_tree_head_.timestamp());
   proof->set_leaf_index(leaf_index);
 
+  vector<string> audit_path;
+  if (!PathToRootAtSnapshot(leaf_index + 1, tree_size, &audit_path)) {
+    return NOT_FOUND;
+  }
   proof->clear_path_node();
-  vector<string> audit_path = cert_tree_.PathToCurrentRoot(leaf_index + 1);
   for (size_t i = 0; i < audit_path.size(); ++i)
     proof->add_path_node(audit_path[i]);
 
@@ -159,12 +616,17 @@ LogLookup::LookupResult LogLookup::AuditProof(int64_t leaf_index,
                                               size_t tree_size,
                                               ShortMerkleAuditProof* proof) {
   lock_guard<mutex> lock(lock_);
+  if (tree_size > static_cast<size_t>(latest_tree_head_.tree_size()))
+    return NOT_FOUND;
+
+  vector<string> audit_path;
+  if (!PathToRootAtSnapshot(leaf_index + 1, tree_size, &audit_path)) {
+    return NOT_FOUND;
+  }
 
   proof->set_leaf_index(leaf_index);
 
   proof->clear_path_node();
-  vector<string> audit_path =
-      cert_tree_.PathToRootAtSnapshot(leaf_index + 1, tree_size);
   for (size_t i = 0; i < audit_path.size(); ++i)
     proof->add_path_node(audit_path[i]);
 
@@ -176,6 +638,18 @@ LogLookup::LookupResult LogLookup::AuditProof(int64_t leaf_index,
 LogLookup::LookupResult LogLookup::AuditProof(const string& merkle_leaf_hash,
                                               size_t tree_size,
                                               ShortMerkleAuditProof* proof) {
+  shared_ptr<const RecentPaths> recent;
+  const RecentPaths::Path* const recent_path(
+      FindRecentPath(merkle_leaf_hash, &recent));
+  if (recent_path &&
+      tree_size == static_cast<size_t>(recent->sth.tree_size())) {
+    proof->set_leaf_index(recent_path->first);
+    proof->clear_path_node();
+    for (const string& node : recent_path->second)
+      proof->add_path_node(node);
+    return OK;
+  }
+
   int64_t leaf_index;
   if (GetIndex(merkle_leaf_hash, &leaf_index) != OK)
     return NOT_FOUND;
@@ -185,27 +659,111 @@ LogLookup::LookupResult LogLookup::AuditProof(const string& merkle_leaf_hash,
 }
 
 
+void LogLookup::AuditProofs(const vector<string>& merkle_leaf_hashes,
+                            size_t tree_size, vector<LookupResult>* results,
+                            vector<ShortMerkleAuditProof>* proofs) {
+  CHECK_NOTNULL(results);
+  CHECK_NOTNULL(proofs);
+  results->assign(merkle_leaf_hashes.size(), NOT_FOUND);
+  proofs->clear();
+  proofs->resize(merkle_leaf_hashes.size());
+
+  unique_lock<mutex> lock(lock_);
+  if (tree_size > static_cast<size_t>(latest_tree_head_.tree_size()))
+    return;
+
+  for (size_t i = 0; i < merkle_leaf_hashes.size(); ++i) {
+    const int64_t leaf_index(GetIndexInternal(lock, merkle_leaf_hashes[i]));
+    if (leaf_index < 0 || static_cast<size_t>(leaf_index) >= tree_size)
+      continue;
+
+    vector<string> audit_path;
+    if (!PathToRootAtSnapshot(leaf_index + 1, tree_size, &audit_path))
+      continue;
+
+    ShortMerkleAuditProof* const proof(&(*proofs)[i]);
+    proof->set_leaf_index(leaf_index);
+    for (string& node : audit_path)
+      proof->add_path_node()->swap(node);
+    (*results)[i] = OK;
+  }
+}
+
+
+LogLookup::LookupResult LogLookup::Node(int level, int64_t index,
+                                        size_t tree_size, string* node) {
+  CHECK_NOTNULL(node);
+  if (level < 0 || index < 0)
+    return NOT_FOUND;
+
+  lock_guard<mutex> lock(lock_);
+  if (tree_size > static_cast<size_t>(latest_tree_head_.tree_size()))
+    return NOT_FOUND;
+
+  *node = PathNodeAtSnapshot(index + 1, tree_size, level);
+  return node->empty() ? NOT_FOUND : OK;
+}
+
+
+vector<string> LogLookup::ConsistencyProof(size_t first, size_t second) {
+  lock_guard<mutex> lock(lock_);
+  if (second > static_cast<size_t>(latest_tree_head_.tree_size()))
+    return vector<string>();
+  if (second == static_cast<size_t>(latest_tree_head_.tree_size())) {
+    const auto it(consistency_to_latest_.find(first));
+    if (it != consistency_to_latest_.end()) {
+      return it->second;
+    }
+  }
+  return SnapshotConsistency(first, second);
+}
+
+
 string LogLookup::RootAtSnapshot(size_t tree_size) {
   lock_guard<mutex> lock(lock_);
-  return cert_tree_.RootAtSnapshot(tree_size);
+  if (tree_size > static_cast<size_t>(latest_tree_head_.tree_size()))
+    return string();
+  if (partition_) {
+    string root;
+    return partition_->RootAtSnapshot(tree_size, &root) ? root : string();
+  }
+  return shared_tree_ ? shared_tree_->RootAtSnapshot(tree_size)
+                      : cert_tree_.RootAtSnapshot(tree_size);
 }
 
 
 string LogLookup::LeafHash(const LoggedEntry& logged) const {
-  string serialized_leaf;
-  CHECK(logged.SerializeForLeaf(&serialized_leaf));
-  // We do not need to take the lock for this call into cert_tree_, as
-  // this is merely a const forwarder (to another const, thread-safe
-  // method).
-  return cert_tree_.LeafHash(serialized_leaf);
+  // The tree is a SHA-256 one, so the leaf hash cached in |logged|, if
+  // any, will do.
+  string leaf_hash;
+  CHECK(logged.LeafHash(&leaf_hash));
+  return leaf_hash;
 }
 
 
 unique_ptr<CompactMerkleTree> LogLookup::GetCompactMerkleTree(
     SerialHasher* hasher) {
+  // Leaves beyond |latest_tree_head_| may be there, from an update in
+  // progress (hence waiting for it) or prefetched.
+  lock_guard<mutex> update_lock(update_lock_);
   lock_guard<mutex> lock(lock_);
+  const size_t tree_size(latest_tree_head_.tree_size());
+  if (partition_) {
+    // The right edge of the tree is in the newest range, and the whole
+    // ranges before it.
+    vector<string> frontier;
+    CHECK(partition_->FrontierAtSnapshot(tree_size, &frontier));
+    return unique_ptr<CompactMerkleTree>(new CompactMerkleTree(
+        tree_size, move(frontier), unique_ptr<SerialHasher>(hasher)));
+  }
+  if (shared_tree_) {
+    return unique_ptr<CompactMerkleTree>(new CompactMerkleTree(
+        tree_size, shared_tree_->FrontierAtSnapshot(tree_size),
+        unique_ptr<SerialHasher>(hasher)));
+  }
   return unique_ptr<CompactMerkleTree>(
-      new CompactMerkleTree(&cert_tree_, unique_ptr<SerialHasher>(hasher)));
+      new CompactMerkleTree(&cert_tree_, tree_size,
+                            unique_ptr<SerialHasher>(hasher)));
 }
 
 
@@ -213,13 +771,71 @@ int64_t LogLookup::GetIndexInternal(const unique_lock<mutex>& lock,
                                     const string& merkle_leaf_hash) const {
   CHECK(lock.owns_lock());
 
-  const map<string, int64_t>::const_iterator it(
-      leaf_index_.find(merkle_leaf_hash));
-  if (it == leaf_index_.end())
-    return -1;
+  const int64_t index(partition_ ? partition_->FindLeaf(merkle_leaf_hash)
+                                 : leaf_index_.Find(merkle_leaf_hash));
+  // Leaves being added by an update in progress are not visible yet.
+  return index < latest_tree_head_.tree_size() ? index : -1;
+}
+
+
+const LogLookup::RecentPaths::Path* LogLookup::FindRecentPath(
+    const string& merkle_leaf_hash,
+    shared_ptr<const RecentPaths>* recent) const {
+  *recent = std::atomic_load(&recent_paths_);
+  if (!*recent) {
+    return nullptr;
+  }
+  const auto it((*recent)->paths.find(merkle_leaf_hash));
+  return it != (*recent)->paths.end() ? &it->second : nullptr;
+}
+
+
+int64_t LogLookup::LeafCount() const {
+  if (partition_) {
+    return partition_->LeafCount();
+  }
+  // LeafCount() is potentially unsigned here but as this is using
+  // memory the count can never get close to overflow in 64 bits.
+  CHECK_LE(cert_tree_.LeafCount(), static_cast<uint64_t>(INT64_MAX));
+  return cert_tree_.LeafCount();
+}
+
+
+bool LogLookup::PathToRootAtSnapshot(size_t leaf, size_t snapshot,
+                                     vector<string>* path) {
+  if (partition_) {
+    return partition_->PathToRootAtSnapshot(leaf - 1, snapshot, path);
+  }
+  *path = shared_tree_ ? shared_tree_->PathToRootAtSnapshot(leaf, snapshot)
+                       : cert_tree_.PathToRootAtSnapshot(leaf, snapshot);
+  return true;
+}
+
 
-  CHECK_GE(it->second, 0);
-  return it->second;
+string LogLookup::PathNodeAtSnapshot(size_t leaf, size_t snapshot,
+                                     size_t position) {
+  if (partition_) {
+    vector<string> path;
+    if (!partition_->PathToRootAtSnapshot(leaf - 1, snapshot, &path) ||
+        position >= path.size()) {
+      return string();
+    }
+    return path[position];
+  }
+  return shared_tree_
+             ? shared_tree_->PathNodeAtSnapshot(leaf, snapshot, position)
+             : cert_tree_.PathNodeAtSnapshot(leaf, snapshot, position);
+}
+
+
+vector<string> LogLookup::SnapshotConsistency(size_t first, size_t second) {
+  if (partition_) {
+    vector<string> proof;
+    partition_->SnapshotConsistency(first, second, &proof);
+    return proof;
+  }
+  return shared_tree_ ? shared_tree_->SnapshotConsistency(first, second)
+                      : cert_tree_.SnapshotConsistency(first, second);
 }
 
 
@@ -2,24 +2,64 @@
 #define CERT_TRANS_LOG_LOG_LOOKUP_H_
 
 #include <stdint.h>
+#include <condition_variable>
+#include <deque>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "log/database.h"
+#include "log/leaf_hash_index.h"
+#include "log/tree_partition.h"
 #include "merkletree/compact_merkle_tree.h"
 #include "merkletree/merkle_tree.h"
+#include "merkletree/node_store.h"
+#include "merkletree/stored_merkle_tree.h"
+#include "monitoring/memory.h"
 #include "proto/ct.pb.h"
+#include "util/executor.h"
 
 namespace cert_trans {
 
+class StartupPhase;
+
 
 // Lookups into the database. Read-only, so could also be a mirror.
-// Keeps the entire Merkle Tree in memory to serve audit proofs.
+// Keeps the entire Merkle Tree at hand to serve audit proofs, either
+// in memory or in a MerkleTreeNodeStore, or reads it from a tree that
+// another LogLookup keeps in a FileNodeStore, or only keeps one
+// TreePartition of it.
 class LogLookup {
  public:
   // The constructor loads the content from the database.
   explicit LogLookup(ReadOnlyDatabase* db);
+  // As above, but keeps the Merkle tree in |store|. If |store| already
+  // holds a tree from a previous run that matches the database (e.g.
+  // a FileNodeStore), it is reused, and only the entries it lacks are
+  // read from the database. If |executor| is not NULL, large updates
+  // of the tree (such as the initial load) are hashed in parallel on
+  // it. If |load_in_background| is true, the constructor returns at
+  // once and the initial load happens on a thread of its own; until it
+  // is done (see IsReady()), lookups are served as of an empty tree.
+  LogLookup(ReadOnlyDatabase* db, std::unique_ptr<MerkleTreeNodeStore> store,
+            util::Executor* executor, bool load_in_background = false);
+  // As above, but serves proofs from |shared_tree|, which is written
+  // by another process (typically another node's LogLookup, with a
+  // read-only FileNodeStore on its directory), and only keeps the leaf
+  // hash index in memory. A new tree head takes effect once the shared
+  // tree covers it, which is checked for in the background.
+  LogLookup(ReadOnlyDatabase* db,
+            std::unique_ptr<StoredMerkleTree> shared_tree);
+  // As the first one, but only keeps |partition| of the tree, and only
+  // indexes its leaves. The lookups that need the rest of the tree
+  // return NOT_FOUND (or an empty proof or root), and are left to the
+  // other partitions, behind a PartitionRouter.
+  LogLookup(ReadOnlyDatabase* db, std::unique_ptr<TreePartition> partition);
   ~LogLookup();
   LogLookup(const LogLookup&) = delete;
   LogLookup& operator=(const LogLookup&) = delete;
@@ -31,7 +71,10 @@ class LogLookup {
 
   LookupResult GetIndex(const std::string& merkle_leaf_hash, int64_t* index);
 
-  // Look up by hash of the logged item.
+  // Look up by hash of the logged item. The audit paths of the entries
+  // that the current tree head added (or the newest of them, if it
+  // added many) are computed as it is published, and served without
+  // waiting for the tree.
   // TODO(pphaneuf): Looking up an audit proof without a tree size is
   // unreliable in the case of multiple CT servers (some might be
   // behind). New code should avoid this variant.
@@ -46,43 +89,176 @@ class LogLookup {
   LookupResult AuditProof(const std::string& merkle_leaf_hash,
                           size_t tree_size, ct::ShortMerkleAuditProof* proof);
 
-  // Get a consitency proof between two tree heads
-  std::vector<std::string> ConsistencyProof(size_t first, size_t second) {
+  // Look up by hash of each of |merkle_leaf_hashes|, all at
+  // |tree_size|, taking the lock only once for the whole batch.
+  // |results| and |proofs| are filled in the same order as
+  // |merkle_leaf_hashes|; a proof is only meaningful if its result is
+  // OK, NOT_FOUND meaning the leaf is unknown or beyond |tree_size|.
+  void AuditProofs(const std::vector<std::string>& merkle_leaf_hashes,
+                   size_t tree_size, std::vector<LookupResult>* results,
+                   std::vector<ct::ShortMerkleAuditProof>* proofs);
+
+  // The |level|-th node of the audit path of the leaf at |index| for
+  // |tree_size| (that is, path_node(level) of the ShortMerkleAuditProof
+  // from AuditProof()), looked up on its own rather than as part of
+  // the whole path. NOT_FOUND if there is no such node.
+  LookupResult Node(int level, int64_t index, size_t tree_size,
+                    std::string* node);
+
+  // Get a consitency proof between two tree heads. The proofs from the
+  // last few tree heads to the current one, which are what monitors
+  // mostly ask for, are computed as the current one is published. Also
+  // empty if the partition we have does not have the nodes for it.
+  std::vector<std::string> ConsistencyProof(size_t first, size_t second);
+
+  ct::SignedTreeHead GetSTH() const {
+    std::lock_guard<std::mutex> lock(lock_);
+    return latest_tree_head_;
+  }
+
+  // The timestamp of GetSTH(), which is cheaper to check for changes
+  // than the whole tree head.
+  uint64_t GetSTHTimestamp() const {
     std::lock_guard<std::mutex> lock(lock_);
-    return cert_tree_.SnapshotConsistency(first, second);
+    return latest_tree_head_.timestamp();
   }
 
-  const ct::SignedTreeHead& GetSTH() const {
+  // Whether the initial load of the tree is done, so that GetSTH() is
+  // the latest tree head the database had at construction (or a later
+  // one), rather than an empty one. Only ever false with
+  // |load_in_background|.
+  bool IsReady() const {
     std::lock_guard<std::mutex> lock(lock_);
-    return latest_tree_head_;
+    return ready_;
   }
 
   std::string RootAtSnapshot(size_t tree_size);
 
+  // Adds the leaves of the entries that the database has past the
+  // current tree head, up to |tree_size|, to the tree and the index,
+  // ahead of the tree head that will cover them. Lookups do not see
+  // them until then, but the update to that tree head is left with
+  // little more to do than to check its root hash. For followers,
+  // which get entries before the tree heads that cover them. Does
+  // nothing with a shared tree, which someone else fills in, nor with
+  // a partition, which only records the newest range at tree heads.
+  void PrefetchLeaves(int64_t tree_size);
+
+  // Like PrefetchLeaves(), but with the leaf hashes of the entries from
+  // |begin| on given, as by the TreeSigner of the same node (see
+  // TreeSigner::SetLeavesAppendedCallback()), rather than read from
+  // the database. Those the tree has already are skipped. They are all
+  // ignored if they do not follow on from the tree, or if the initial
+  // load is not done yet: they are read from the database then.
+  void AddLeafHashes(int64_t begin,
+                     const std::vector<std::string>& leaf_hashes);
+
   std::string LeafHash(const LoggedEntry& logged) const;
 
   // Creates a CompactMerkleTree based on the current state of our MerkleTree.
+  // Waits for any update of the tree in progress to complete first.
   // Takes ownership of |hasher|.
   std::unique_ptr<CompactMerkleTree> GetCompactMerkleTree(
       SerialHasher* hasher);
 
  private:
+  // The audit paths of the newest leaves at the size of |sth|.
+  struct RecentPaths {
+    // The index of the leaf, and its audit path.
+    typedef std::pair<int64_t, std::vector<std::string>> Path;
+
+    ct::SignedTreeHead sth;
+    // Keyed by leaf hash.
+    std::unordered_map<std::string, Path> paths;
+  };
+
+  // Indexes the leaves of the stored tree, and catches up with the
+  // database, then sets |ready_|.
+  void Load();
   void UpdateFromSTH(const ct::SignedTreeHead& sth);
+  // Adds the leaves from the database to the tree and the index, up to
+  // |tree_size|, reporting progress to |phase| if it is not NULL.
+  void AddLeaves(const std::unique_lock<std::mutex>& update_lock,
+                 int64_t tree_size, StartupPhase* phase);
+  // Appends |leaf_hashes|, those of the leaves from the last one of the
+  // tree on, to the tree and the index, which is sized for |tree_size|
+  // leaves. |lock_| must be held.
+  void AppendLeafHashes(const std::vector<std::string>& leaf_hashes,
+                        int64_t tree_size);
   int64_t GetIndexInternal(const std::unique_lock<std::mutex>& lock,
                            const std::string& merkle_leaf_hash) const;
 
+  // With a shared tree, |pending_tree_head_| is applied by this
+  // thread, once the shared tree covers it.
+  void PollSharedTree();
+  void CatchUpWithSharedTree(const std::unique_lock<std::mutex>& update_lock);
+  // Makes |sth| the tree head lookups are served at, and computes the
+  // consistency proofs to it from the recent ones, and the audit paths
+  // of the leaves it adds. |lock_| must be held, and the tree must
+  // cover |sth|.
+  void PublishTreeHead(const ct::SignedTreeHead& sth);
+  // The recent path of |merkle_leaf_hash|, or NULL if there is none.
+  // Does not take |lock_|; |recent| keeps the path alive.
+  const RecentPaths::Path* FindRecentPath(
+      const std::string& merkle_leaf_hash,
+      std::shared_ptr<const RecentPaths>* recent) const;
+
+  // Accounts for the memory of the tree and the index, after they
+  // grew. |lock_| must be held.
+  void UpdateMemory();
+  // The number of leaves in whichever tree we have.
+  int64_t LeafCount() const;
+  // The lookups below, from whichever tree we have. With a partition,
+  // PathToRootAtSnapshot() returns false, and the others empty, if it
+  // does not have the nodes.
+  bool PathToRootAtSnapshot(size_t leaf, size_t snapshot,
+                            std::vector<std::string>* path);
+  std::string PathNodeAtSnapshot(size_t leaf, size_t snapshot,
+                                 size_t position);
+  std::vector<std::string> SnapshotConsistency(size_t first, size_t second);
+
+  // Serializes updates of the tree. Lookups do not take it: an update
+  // only holds |lock_| for one batch of entries at a time, and until
+  // it is complete, lookups keep being served from the tree as of
+  // |latest_tree_head_|, ignoring the leaves added beyond it (as they
+  // do for prefetched leaves).
+  std::mutex update_lock_;
   mutable std::mutex lock_;
-  // We keep a hash -> index mapping in memory so that we can quickly serve
-  // Merkle proofs without having to query the database at all.
-  // Note that 32 bytes is an overkill and we can optimize this to use
-  // a shorter prefix (possibly with a multimap).
-  std::map<std::string, int64_t> leaf_index_;
 
   ReadOnlyDatabase* const db_;
+  util::Executor* const executor_;
+  // Empty if |shared_tree_| or |partition_| is set.
   MerkleTree cert_tree_;
+  const std::unique_ptr<StoredMerkleTree> shared_tree_;
+  // Guarded by |lock_|, like |cert_tree_|.
+  const std::unique_ptr<TreePartition> partition_;
+  // We keep a hash -> index mapping in memory so that we can quickly serve
+  // Merkle proofs without having to query the database at all. Empty if
+  // |partition_| is set, which indexes its own leaves.
+  LeafHashIndex leaf_index_;
+  // Kept up to date by UpdateMemory().
+  MemoryAccount tree_memory_{"merkle_tree"};
+  MemoryAccount leaf_index_memory_{"leaf_hash_index"};
   ct::SignedTreeHead latest_tree_head_;
+  // The sizes of the tree heads before |latest_tree_head_|, oldest
+  // first, and the consistency proofs from those to it.
+  std::deque<size_t> recent_tree_sizes_;
+  std::map<size_t, std::vector<std::string>> consistency_to_latest_;
+  // Replaced with std::atomic_store() by PublishTreeHead(), and read
+  // with std::atomic_load(), without |lock_|.
+  std::shared_ptr<const RecentPaths> recent_paths_;
+
+  // Only used with |shared_tree_|, and guarded by |update_lock_|.
+  ct::SignedTreeHead pending_tree_head_;
+  bool stop_polling_;
+  std::condition_variable pending_cond_;
+  std::thread shared_tree_poller_;
 
   const Database::NotifySTHCallback update_from_sth_cb_;
+  // Guarded by |lock_|.
+  bool ready_;
+  // Runs Load(), with |load_in_background|.
+  std::thread loader_;
 };
 
 
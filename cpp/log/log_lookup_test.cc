@@ -1,7 +1,9 @@
 /* -*- indent-tabs-mode: nil -*- */
 #include <gtest/gtest.h>
+#include <chrono>
 #include <memory>
 #include <string>
+#include <thread>
 
 #include "log/etcd_consistent_store.h"
 #include "log/file_db.h"
@@ -14,8 +16,11 @@
 #include "log/test_db.h"
 #include "log/test_signer.h"
 #include "log/tree_signer.h"
+#include "merkletree/file_node_store.h"
+#include "merkletree/merkle_tree.h"
 #include "merkletree/merkle_verifier.h"
 #include "merkletree/serial_hasher.h"
+#include "merkletree/stored_merkle_tree.h"
 #include "proto/cert_serializer.h"
 #include "util/fake_etcd.h"
 #include "util/mock_masterelection.h"
@@ -33,18 +38,23 @@ using cert_trans::EntryHandle;
 using cert_trans::EtcdClient;
 using cert_trans::FakeEtcdClient;
 using cert_trans::FileDB;
+using cert_trans::FileNodeStore;
 using cert_trans::LogLookup;
 using cert_trans::LoggedEntry;
 using cert_trans::MockMasterElection;
 using cert_trans::SQLiteDB;
+using cert_trans::StoredMerkleTree;
 using cert_trans::ThreadPool;
+using cert_trans::TreePartition;
 using cert_trans::TreeSigner;
 using ct::MerkleAuditProof;
 using ct::SequenceMapping;
+using ct::ShortMerkleAuditProof;
 using std::make_shared;
 using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
+using std::vector;
 using testing::NiceMock;
 
 
@@ -94,12 +104,16 @@ class LogLookupTest : public ::testing::Test {
     CHECK(this->store_.UpdateSequenceMapping(&mapping).ok());
   }
 
-  void UpdateTree() {
-    // first need to populate the local DB with the sequenced entries in etcd:
+  // Populates the local DB with the sequenced entries in etcd that it
+  // does not have yet.
+  void WriteSequencedEntries() {
     EntryHandle<SequenceMapping> mapping;
     CHECK(this->store_.GetSequenceMapping(&mapping).ok());
 
     for (const auto& m : mapping.Entry().mapping()) {
+      if (m.sequence_number() < this->db()->TreeSize()) {
+        continue;
+      }
       EntryHandle<LoggedEntry> entry;
       CHECK_EQ(::util::OkStatus(),
                this->store_.GetPendingEntryForHash(m.entry_hash(), &entry));
@@ -107,6 +121,11 @@ class LogLookupTest : public ::testing::Test {
       CHECK_EQ(this->db()->OK,
                this->db()->CreateSequencedEntry(entry.Entry()));
     }
+  }
+
+  void UpdateTree() {
+    // first need to populate the local DB with the sequenced entries in etcd:
+    WriteSequencedEntries();
 
     // then do the actual update.
     EXPECT_EQ(TreeSigner::OK, this->tree_signer_.UpdateTree());
@@ -117,8 +136,33 @@ class LogLookupTest : public ::testing::Test {
     return test_db_.db();
   }
 
+  unique_ptr<FileNodeStore> TreeStore() const {
+    return unique_ptr<FileNodeStore>(
+        new FileNodeStore(tree_storage_.TmpStorageDir(),
+                          Sha256Hasher().DigestSize()));
+  }
+
+  unique_ptr<StoredMerkleTree> SharedTree() const {
+    return unique_ptr<StoredMerkleTree>(new StoredMerkleTree(
+        unique_ptr<Sha256Hasher>(new Sha256Hasher),
+        unique_ptr<FileNodeStore>(
+            new FileNodeStore(tree_storage_.TmpStorageDir(),
+                              Sha256Hasher().DigestSize(), true))));
+  }
+
+  // Wait for |lookup|, which has a shared tree, to take up the tree
+  // head of size |tree_size|.
+  static void WaitForTreeSize(const LogLookup& lookup, int64_t tree_size) {
+    for (int i = 0; i < 100 && lookup.GetSTH().tree_size() != tree_size;
+         ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    ASSERT_EQ(tree_size, lookup.GetSTH().tree_size());
+  }
+
 
   TestDB<T> test_db_;
+  TmpStorage tree_storage_;
   shared_ptr<libevent::Base> base_;
   libevent::EventPumpThread event_pump_;
   FakeEtcdClient etcd_client_;
@@ -229,6 +273,392 @@ TYPED_TEST(LogLookupTest, VerifyWithPath) {
 }
 
 
+TYPED_TEST(LogLookupTest, AuditProofs) {
+  LoggedEntry logged_certs[13];
+  for (int i = 0; i < 13; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  LogLookup lookup(this->db());
+  const size_t kTreeSize = 11;
+  std::vector<string> hashes;
+  for (int i = 12; i >= 0; --i)
+    hashes.push_back(logged_certs[i].merkle_leaf_hash());
+  hashes.push_back(this->test_signer_.UniqueHash());
+
+  std::vector<LogLookup::LookupResult> results;
+  std::vector<ct::ShortMerkleAuditProof> proofs;
+  lookup.AuditProofs(hashes, kTreeSize, &results, &proofs);
+  ASSERT_EQ(hashes.size(), results.size());
+  ASSERT_EQ(hashes.size(), proofs.size());
+
+  // The two leaves beyond the tree size, and the unknown one, are not
+  // found.
+  EXPECT_EQ(LogLookup::NOT_FOUND, results[0]);
+  EXPECT_EQ(LogLookup::NOT_FOUND, results[1]);
+  EXPECT_EQ(LogLookup::NOT_FOUND, results[13]);
+  for (size_t i = 2; i < 13; ++i) {
+    ASSERT_EQ(LogLookup::OK, results[i]);
+    ct::ShortMerkleAuditProof proof;
+    EXPECT_EQ(LogLookup::OK, lookup.AuditProof(hashes[i], kTreeSize, &proof));
+    EXPECT_EQ(proof.DebugString(), proofs[i].DebugString());
+  }
+}
+
+
+TYPED_TEST(LogLookupTest, Node) {
+  LoggedEntry logged_certs[13];
+  for (int i = 0; i < 13; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  LogLookup lookup(this->db());
+  string node;
+  for (size_t tree_size = 1; tree_size <= 13; ++tree_size) {
+    for (int64_t index = 0; index < static_cast<int64_t>(tree_size);
+         ++index) {
+      ct::ShortMerkleAuditProof proof;
+      ASSERT_EQ(LogLookup::OK, lookup.AuditProof(index, tree_size, &proof));
+      for (int level = 0; level < proof.path_node_size(); ++level) {
+        EXPECT_EQ(LogLookup::OK, lookup.Node(level, index, tree_size, &node));
+        EXPECT_EQ(proof.path_node(level), node);
+      }
+      EXPECT_EQ(LogLookup::NOT_FOUND,
+                lookup.Node(proof.path_node_size(), index, tree_size, &node));
+    }
+  }
+
+  EXPECT_EQ(LogLookup::NOT_FOUND, lookup.Node(0, 13, 13, &node));
+  EXPECT_EQ(LogLookup::NOT_FOUND, lookup.Node(0, 0, 14, &node));
+}
+
+
+// Followers get entries before the tree heads that cover them.
+TYPED_TEST(LogLookupTest, PrefetchLeaves) {
+  LoggedEntry logged_certs[13];
+  for (int i = 0; i < 5; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  LogLookup lookup(this->db());
+  for (int i = 5; i < 9; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->WriteSequencedEntries();
+  EXPECT_EQ(TreeSigner::OK, this->tree_signer_.UpdateTree());
+  const ct::SignedTreeHead sth(this->tree_signer_.LatestSTH());
+  ASSERT_EQ(9, sth.tree_size());
+  for (int i = 9; i < 13; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->WriteSequencedEntries();
+
+  // The leaves are not visible until a tree head covers them.
+  lookup.PrefetchLeaves(13);
+  MerkleAuditProof proof;
+  for (int i = 0; i < 13; ++i) {
+    EXPECT_EQ(i < 5 ? LogLookup::OK : LogLookup::NOT_FOUND,
+              lookup.AuditProof(logged_certs[i].merkle_leaf_hash(), &proof));
+  }
+  EXPECT_EQ(5U, lookup.GetCompactMerkleTree(new Sha256Hasher)->LeafCount());
+
+  // Not even by a tree head that covers some of them.
+  this->db()->WriteTreeHead(sth);
+  for (int i = 0; i < 13; ++i) {
+    EXPECT_EQ(i < 9 ? LogLookup::OK : LogLookup::NOT_FOUND,
+              lookup.AuditProof(logged_certs[i].merkle_leaf_hash(), &proof));
+  }
+  EXPECT_EQ(sth.sha256_root_hash(),
+            lookup.GetCompactMerkleTree(new Sha256Hasher)->CurrentRoot());
+
+  this->UpdateTree();
+  for (int i = 0; i < 13; ++i) {
+    EXPECT_EQ(LogLookup::OK,
+              lookup.AuditProof(logged_certs[i].merkle_leaf_hash(), &proof));
+    EXPECT_EQ(LogVerifier::VERIFY_OK,
+              this->verifier_.VerifyMerkleAuditProof(logged_certs[i].entry(),
+                                                     logged_certs[i].sct(),
+                                                     proof));
+  }
+}
+
+
+TYPED_TEST(LogLookupTest, LeavesFromTreeSigner) {
+  LoggedEntry logged_certs[8];
+  for (int i = 0; i < 4; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  LogLookup lookup(this->db());
+  this->tree_signer_.SetLeavesAppendedCallback(
+      [&lookup](int64_t begin, const vector<string>& leaf_hashes) {
+        lookup.AddLeafHashes(begin, leaf_hashes);
+      });
+  for (int i = 4; i < 8; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->WriteSequencedEntries();
+  EXPECT_EQ(TreeSigner::OK, this->tree_signer_.UpdateTree());
+
+  // The leaves are not visible until a tree head covers them.
+  MerkleAuditProof proof;
+  for (int i = 0; i < 8; ++i) {
+    EXPECT_EQ(i < 4 ? LogLookup::OK : LogLookup::NOT_FOUND,
+              lookup.AuditProof(logged_certs[i].merkle_leaf_hash(), &proof));
+  }
+
+  // A gap is ignored, and so are the leaves the tree has already.
+  lookup.AddLeafHashes(9, vector<string>(1, string(32, 'x')));
+  lookup.AddLeafHashes(6, vector<string>(2, string(32, 'x')));
+
+  this->db()->WriteTreeHead(this->tree_signer_.LatestSTH());
+  for (int i = 0; i < 8; ++i) {
+    EXPECT_EQ(LogLookup::OK,
+              lookup.AuditProof(logged_certs[i].merkle_leaf_hash(), &proof));
+    EXPECT_EQ(LogVerifier::VERIFY_OK,
+              this->verifier_.VerifyMerkleAuditProof(logged_certs[i].entry(),
+                                                     logged_certs[i].sct(),
+                                                     proof));
+  }
+}
+
+
+// The proofs from the previous tree heads to the current one are
+// computed as it is published, and are the same as on demand.
+TYPED_TEST(LogLookupTest, ConsistencyProofsFromRecentTreeHeads) {
+  LogLookup lookup(this->db());
+  MerkleTree tree(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  vector<size_t> tree_sizes;
+  LoggedEntry logged_certs[12];
+  for (int i = 0; i < 12; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+    tree.AddLeafHash(logged_certs[i].merkle_leaf_hash());
+    if (i % 3 == 2) {
+      this->UpdateTree();
+      tree_sizes.push_back(i + 1);
+    }
+  }
+  ASSERT_EQ(12, lookup.GetSTH().tree_size());
+
+  for (const size_t first : tree_sizes) {
+    EXPECT_EQ(tree.SnapshotConsistency(first, 12),
+              lookup.ConsistencyProof(first, 12));
+  }
+  EXPECT_EQ(tree.SnapshotConsistency(4, 12), lookup.ConsistencyProof(4, 12));
+  EXPECT_EQ(tree.SnapshotConsistency(3, 9), lookup.ConsistencyProof(3, 9));
+}
+
+
+// The audit paths of the entries a tree head adds, which are computed
+// as it is published, are the same as those of the other entries.
+TYPED_TEST(LogLookupTest, RecentAuditPaths) {
+  LogLookup lookup(this->db());
+  MerkleTree tree(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  LoggedEntry logged_certs[8];
+  for (int i = 0; i < 8; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+    tree.AddLeafHash(logged_certs[i].merkle_leaf_hash());
+    if (i == 4 || i == 7) {
+      this->UpdateTree();
+    }
+  }
+  ASSERT_EQ(8, lookup.GetSTH().tree_size());
+
+  for (int i = 0; i < 8; ++i) {
+    for (size_t tree_size = i + 1; tree_size <= 8; ++tree_size) {
+      ShortMerkleAuditProof proof;
+      ASSERT_EQ(LogLookup::OK,
+                lookup.AuditProof(logged_certs[i].merkle_leaf_hash(),
+                                  tree_size, &proof));
+      EXPECT_EQ(i, proof.leaf_index());
+      const vector<string> path(tree.PathToRootAtSnapshot(i + 1, tree_size));
+      EXPECT_EQ(path, vector<string>(proof.path_node().begin(),
+                                     proof.path_node().end()));
+    }
+
+    MerkleAuditProof proof;
+    ASSERT_EQ(LogLookup::OK,
+              lookup.AuditProof(logged_certs[i].merkle_leaf_hash(), &proof));
+    EXPECT_EQ(8, proof.tree_size());
+    EXPECT_EQ(LogVerifier::VERIFY_OK,
+              this->verifier_.VerifyMerkleAuditProof(logged_certs[i].entry(),
+                                                     logged_certs[i].sct(),
+                                                     proof));
+  }
+}
+
+
+// Restart with the tree kept in files, after the log has grown.
+TYPED_TEST(LogLookupTest, ReuseStoredTree) {
+  LoggedEntry logged_certs[13];
+  for (int i = 0; i < 5; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  MerkleAuditProof proof;
+  {
+    LogLookup lookup(this->db(), this->TreeStore(), &this->pool_);
+    EXPECT_EQ(LogLookup::OK,
+              lookup.AuditProof(logged_certs[4].merkle_leaf_hash(), &proof));
+  }
+
+  for (int i = 5; i < 13; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  LogLookup lookup(this->db(), this->TreeStore(), &this->pool_);
+  for (int i = 0; i < 13; ++i) {
+    EXPECT_EQ(LogLookup::OK,
+              lookup.AuditProof(logged_certs[i].merkle_leaf_hash(), &proof));
+    EXPECT_EQ(LogVerifier::VERIFY_OK,
+              this->verifier_.VerifyMerkleAuditProof(logged_certs[i].entry(),
+                                                     logged_certs[i].sct(),
+                                                     proof));
+  }
+}
+
+
+// Loading the tree in the background, after a restart.
+TYPED_TEST(LogLookupTest, LoadInBackground) {
+  LoggedEntry logged_certs[13];
+  for (int i = 0; i < 5; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+  {
+    LogLookup lookup(this->db(), this->TreeStore(), &this->pool_);
+  }
+  for (int i = 5; i < 13; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  LogLookup lookup(this->db(), this->TreeStore(), &this->pool_, true);
+  for (int i = 0; i < 100 && !lookup.IsReady(); ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+  ASSERT_TRUE(lookup.IsReady());
+  EXPECT_EQ(13, lookup.GetSTH().tree_size());
+
+  MerkleAuditProof proof;
+  for (int i = 0; i < 13; ++i) {
+    EXPECT_EQ(LogLookup::OK,
+              lookup.AuditProof(logged_certs[i].merkle_leaf_hash(), &proof));
+    EXPECT_EQ(LogVerifier::VERIFY_OK,
+              this->verifier_.VerifyMerkleAuditProof(logged_certs[i].entry(),
+                                                     logged_certs[i].sct(),
+                                                     proof));
+  }
+}
+
+
+// A replica serving proofs from the tree another lookup keeps in
+// files.
+TYPED_TEST(LogLookupTest, SharedTree) {
+  LoggedEntry logged_certs[13];
+  for (int i = 0; i < 5; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  LogLookup writer(this->db(), this->TreeStore(), &this->pool_);
+  LogLookup replica(this->db(), this->SharedTree());
+  this->WaitForTreeSize(replica, 5);
+
+  for (int i = 5; i < 13; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+  this->WaitForTreeSize(replica, 13);
+
+  MerkleAuditProof proof;
+  for (int i = 0; i < 13; ++i) {
+    EXPECT_EQ(LogLookup::OK,
+              replica.AuditProof(logged_certs[i].merkle_leaf_hash(), &proof));
+    EXPECT_EQ(LogVerifier::VERIFY_OK,
+              this->verifier_.VerifyMerkleAuditProof(logged_certs[i].entry(),
+                                                     logged_certs[i].sct(),
+                                                     proof));
+  }
+  EXPECT_EQ(writer.ConsistencyProof(5, 13), replica.ConsistencyProof(5, 13));
+  EXPECT_EQ(writer.RootAtSnapshot(7), replica.RootAtSnapshot(7));
+  EXPECT_EQ(writer.GetCompactMerkleTree(new Sha256Hasher)->CurrentRoot(),
+            replica.GetCompactMerkleTree(new Sha256Hasher)->CurrentRoot());
+}
+
+
+TYPED_TEST(LogLookupTest, Partition) {
+  LoggedEntry logged_certs[13];
+  for (int i = 0; i < 5; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  LogLookup lookup(this->db());
+  // The leaves [4, 8), in ranges of 4.
+  LogLookup partition(this->db(),
+                      unique_ptr<TreePartition>(new TreePartition(2, 1)));
+
+  for (int i = 5; i < 13; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->CreateSequencedEntry(&logged_certs[i], i);
+  }
+  this->UpdateTree();
+
+  // Its own leaves, and those of the newest range.
+  MerkleAuditProof proof;
+  for (int i = 0; i < 13; ++i) {
+    const string& leaf_hash(logged_certs[i].merkle_leaf_hash());
+    if ((i >= 4 && i < 8) || i >= 12) {
+      EXPECT_EQ(LogLookup::OK, partition.AuditProof(leaf_hash, &proof));
+      EXPECT_EQ(LogVerifier::VERIFY_OK,
+                this->verifier_.VerifyMerkleAuditProof(logged_certs[i].entry(),
+                                                       logged_certs[i].sct(),
+                                                       proof));
+    } else {
+      EXPECT_EQ(LogLookup::NOT_FOUND, partition.AuditProof(leaf_hash, &proof));
+    }
+  }
+
+  // At the tree size of a previous tree head too.
+  ShortMerkleAuditProof short_proof, expected;
+  EXPECT_EQ(LogLookup::OK, lookup.AuditProof(4, 5, &expected));
+  EXPECT_EQ(LogLookup::OK, partition.AuditProof(4, 5, &short_proof));
+  EXPECT_EQ(expected.DebugString(), short_proof.DebugString());
+  // But not at any tree size.
+  EXPECT_EQ(LogLookup::NOT_FOUND, partition.AuditProof(4, 11, &short_proof));
+
+  EXPECT_EQ(lookup.ConsistencyProof(5, 13), partition.ConsistencyProof(5, 13));
+  EXPECT_TRUE(partition.ConsistencyProof(1, 13).empty());
+  EXPECT_EQ(lookup.RootAtSnapshot(5), partition.RootAtSnapshot(5));
+  EXPECT_EQ(lookup.RootAtSnapshot(13), partition.RootAtSnapshot(13));
+  EXPECT_EQ(lookup.GetCompactMerkleTree(new Sha256Hasher)->CurrentRoot(),
+            partition.GetCompactMerkleTree(new Sha256Hasher)->CurrentRoot());
+}
+
+
 }  // namespace
 
 
@@ -2,12 +2,14 @@
 
 #include <glog/logging.h>
 #include <stdint.h>
+#include <map>
 
 #include "log/cert_submission_handler.h"
 #include "log/log_signer.h"
 #include "merkletree/merkle_verifier.h"
 #include "proto/ct.pb.h"
 #include "proto/serializer.h"
+#include "util/parallel_for.h"
 #include "util/util.h"
 
 using cert_trans::serialization::SerializeResult;
@@ -15,7 +17,9 @@ using ct::LogEntry;
 using ct::MerkleAuditProof;
 using ct::SignedCertificateTimestamp;
 using ct::SignedTreeHead;
+using std::map;
 using std::string;
+using std::vector;
 
 LogVerifier::LogVerifier(LogSigVerifier* sig_verifier,
                          MerkleVerifier* merkle_verifier)
@@ -56,6 +60,23 @@ LogVerifier::LogVerifyResult LogVerifier::VerifySignedCertificateTimestamp(
                                           merkle_leaf_hash);
 }
 
+vector<LogVerifier::LogVerifyResult>
+LogVerifier::VerifySignedCertificateTimestamps(
+    const vector<const LogEntry*>& entries,
+    const vector<const SignedCertificateTimestamp*>& scts,
+    util::Executor* executor) const {
+  CHECK_EQ(entries.size(), scts.size());
+  // Allow a bit of slack, say 1 second into the future.
+  const uint64_t end_range(util::TimeInMilliseconds() + 1000);
+  vector<LogVerifyResult> results(entries.size());
+  util::ParallelFor(executor, entries.size(),
+                    [this, &entries, &scts, end_range, &results](size_t i) {
+                      results[i] = VerifySignedCertificateTimestamp(
+                          *entries[i], *scts[i], 0, end_range);
+                    });
+  return results;
+}
+
 LogVerifier::LogVerifyResult LogVerifier::VerifySignedTreeHead(
     const SignedTreeHead& sth, uint64_t begin_range,
     uint64_t end_range) const {
@@ -113,6 +134,88 @@ LogVerifier::LogVerifyResult LogVerifier::VerifyMerkleAuditProof(
   return VERIFY_OK;
 }
 
+vector<LogVerifier::LogVerifyResult> LogVerifier::VerifyMerkleAuditProofs(
+    const vector<const LogEntry*>& entries,
+    const vector<const SignedCertificateTimestamp*>& scts,
+    const vector<const MerkleAuditProof*>& merkle_proofs,
+    util::Executor* executor) const {
+  CHECK_EQ(entries.size(), scts.size());
+  CHECK_EQ(entries.size(), merkle_proofs.size());
+  const uint64_t end_range(util::TimeInMilliseconds() + 1000);
+  vector<LogVerifyResult> results(entries.size(), VERIFY_OK);
+  vector<string> serialized_leaves(entries.size());
+  vector<MerkleVerifier::PathProof> paths(entries.size());
+  util::ParallelFor(executor, entries.size(), [&](size_t i) {
+    const MerkleAuditProof& proof(*merkle_proofs[i]);
+    if (!IsBetween(proof.timestamp(), scts[i]->timestamp(), end_range)) {
+      results[i] = INCONSISTENT_TIMESTAMPS;
+      return;
+    }
+    if (Serializer::SerializeSCTMerkleTreeLeaf(*scts[i], *entries[i],
+                                               &serialized_leaves[i]) !=
+        SerializeResult::OK) {
+      results[i] = INVALID_FORMAT;
+      return;
+    }
+    // Leaf indexing in the MerkleTree starts from 1.
+    paths[i].leaf = proof.leaf_index() + 1;
+    paths[i].leaf_hash = merkle_verifier_->LeafHash(serialized_leaves[i]);
+    paths[i].path.assign(proof.path_node().begin(), proof.path_node().end());
+  });
+
+  // Group the proofs by the tree head they claim, which is everything
+  // but the root.
+  map<string, vector<size_t>> groups;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (results[i] != VERIFY_OK)
+      continue;
+    const MerkleAuditProof& proof(*merkle_proofs[i]);
+    SignedTreeHead sth;
+    sth.set_version(proof.version());
+    sth.mutable_id()->CopyFrom(proof.id());
+    sth.set_timestamp(proof.timestamp());
+    sth.set_tree_size(proof.tree_size());
+    sth.mutable_signature()->CopyFrom(proof.tree_head_signature());
+    groups[sth.SerializeAsString()].push_back(i);
+  }
+
+  // Anything that doesn't verify against the group's tree head gets
+  // verified on its own, for the precise error.
+  vector<size_t> singles;
+  for (const auto& group : groups) {
+    const vector<size_t>& members(group.second);
+    const MerkleAuditProof& first(*merkle_proofs[members[0]]);
+    SignedTreeHead sth;
+    CHECK(sth.ParseFromString(group.first));
+    sth.set_sha256_root_hash(merkle_verifier_->RootFromPath(
+        first.leaf_index() + 1, first.tree_size(), paths[members[0]].path,
+        serialized_leaves[members[0]]));
+    if (sth.sha256_root_hash().empty() ||
+        sig_verifier_->VerifySTHSignature(sth) != LogSigVerifier::OK) {
+      singles.insert(singles.end(), members.begin(), members.end());
+      continue;
+    }
+
+    vector<MerkleVerifier::PathProof> group_paths;
+    group_paths.reserve(members.size());
+    for (size_t i : members)
+      group_paths.emplace_back(std::move(paths[i]));
+    const vector<bool> valid(
+        merkle_verifier_->VerifyPaths(sth.tree_size(), sth.sha256_root_hash(),
+                                      group_paths, executor));
+    for (size_t j = 0; j < members.size(); ++j)
+      if (!valid[j])
+        singles.push_back(members[j]);
+  }
+
+  util::ParallelFor(executor, singles.size(), [&](size_t j) {
+    const size_t i(singles[j]);
+    results[i] =
+        VerifyMerkleAuditProof(*entries[i], *scts[i], *merkle_proofs[i]);
+  });
+  return results;
+}
+
 /* static */
 bool LogVerifier::IsBetween(uint64_t timestamp, uint64_t earliest,
                             uint64_t latest) {
@@ -127,3 +230,16 @@ bool LogVerifier::VerifyConsistency(
                                              sth1.sha256_root_hash(),
                                              sth2.sha256_root_hash(), proof);
 }
+
+size_t LogVerifier::VerifyConsistencyChain(
+    const vector<const SignedTreeHead*>& sths,
+    const vector<vector<string>>& proofs, util::Executor* executor) const {
+  vector<size_t> snapshots;
+  vector<string> roots;
+  for (const SignedTreeHead* sth : sths) {
+    snapshots.push_back(sth->tree_size());
+    roots.push_back(sth->sha256_root_hash());
+  }
+  return merkle_verifier_->VerifyConsistencyChain(snapshots, roots, proofs,
+                                                  executor);
+}
@@ -3,9 +3,11 @@
 
 #include <glog/logging.h>
 #include <stdint.h>
+#include <vector>
 
 #include "log/log_signer.h"
 #include "proto/ct.pb.h"
+#include "util/executor.h"
 
 class MerkleVerifier;
 
@@ -88,6 +90,14 @@ class LogVerifier {
     return VerifySignedCertificateTimestamp(entry, sct, NULL);
   }
 
+  // As above, for |scts[i]| and |entries[i]| for every i, spread over
+  // |executor| and the calling thread. For a mirror catching up with
+  // millions of entries.
+  std::vector<LogVerifyResult> VerifySignedCertificateTimestamps(
+      const std::vector<const ct::LogEntry*>& entries,
+      const std::vector<const ct::SignedCertificateTimestamp*>& scts,
+      util::Executor* executor) const;
+
   // Verify that the timestamp is in the given range,
   // and the signature is valid.
   // Timestamps are given in milliseconds, since January 1, 1970,
@@ -108,10 +118,28 @@ class LogVerifier {
       const ct::LogEntry& entry, const ct::SignedCertificateTimestamp& sct,
       const ct::MerkleAuditProof& merkle_proof) const;
 
+  // As above, for |entries[i]|, |scts[i]| and |merkle_proofs[i]| for
+  // every i, spread over |executor| and the calling thread. Proofs
+  // against the same tree head have its signature checked once, and
+  // their paths verified together by MerkleVerifier::VerifyPaths().
+  std::vector<LogVerifyResult> VerifyMerkleAuditProofs(
+      const std::vector<const ct::LogEntry*>& entries,
+      const std::vector<const ct::SignedCertificateTimestamp*>& scts,
+      const std::vector<const ct::MerkleAuditProof*>& merkle_proofs,
+      util::Executor* executor) const;
+
   bool VerifyConsistency(const ct::SignedTreeHead& sth1,
                          const ct::SignedTreeHead& sth2,
                          const std::vector<std::string>& proof) const;
 
+  // Verify that each of |sths| is consistent with the next, |proofs[i]|
+  // being the proof from |sths[i]| to |sths[i + 1]|. Returns the number
+  // of leading proofs that verify. Does not check the signatures.
+  size_t VerifyConsistencyChain(
+      const std::vector<const ct::SignedTreeHead*>& sths,
+      const std::vector<std::vector<std::string>>& proofs,
+      util::Executor* executor) const;
+
  private:
   LogSigVerifier* sig_verifier_;
   MerkleVerifier* merkle_verifier_;
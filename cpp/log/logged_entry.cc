@@ -1,5 +1,6 @@
 #include "log/logged_entry.h"
 
+#include "merkletree/tree_hasher.h"
 #include "proto/cert_serializer.h"
 #include "proto/serializer.h"
 #include "util/util.h"
@@ -10,12 +11,16 @@ using ct::LogEntry;
 using ct::PreCert;
 using ct::SignedCertificateTimestamp;
 using std::string;
+using std::unique_ptr;
 using util::RandomString;
 
 namespace cert_trans {
 
 
 string LoggedEntry::Hash() const {
+  if (has_entry_hash()) {
+    return entry_hash();
+  }
   return Sha256Hasher::Sha256Digest(Serializer::LeafData(entry()));
 }
 
@@ -26,6 +31,36 @@ bool LoggedEntry::SerializeForLeaf(string* dst) const {
 }
 
 
+bool LoggedEntry::LeafHash(string* dst) const {
+  if (has_merkle_leaf_hash()) {
+    dst->assign(merkle_leaf_hash());
+    return true;
+  }
+  // TreeHasher is thread-safe.
+  static const TreeHasher* const hasher(
+      new TreeHasher(unique_ptr<Sha256Hasher>(new Sha256Hasher)));
+  string serialized_leaf;
+  if (!SerializeForLeaf(&serialized_leaf)) {
+    return false;
+  }
+  dst->assign(hasher->HashLeaf(serialized_leaf));
+  return true;
+}
+
+
+bool LoggedEntry::CacheHashes() {
+  clear_entry_hash();
+  clear_merkle_leaf_hash();
+  string leaf_hash;
+  if (!LeafHash(&leaf_hash)) {
+    return false;
+  }
+  set_entry_hash(Hash());
+  set_merkle_leaf_hash(leaf_hash);
+  return true;
+}
+
+
 bool LoggedEntry::SerializeExtraData(string* dst) const {
   switch (entry().type()) {
     case ct::X509_ENTRY:
@@ -12,17 +12,25 @@ namespace cert_trans {
 class LoggedEntry : private ct::LoggedEntryPB {
  public:
   // Pull only what is used.
+  using LoggedEntryPB::ByteSize;
   using LoggedEntryPB::Clear;
   using LoggedEntryPB::DebugString;
   using LoggedEntryPB::ParseFromArray;
   using LoggedEntryPB::ParseFromString;
   using LoggedEntryPB::SerializeToString;
+  using LoggedEntryPB::SerializeWithCachedSizesToArray;
   using LoggedEntryPB::Swap;
+  using LoggedEntryPB::clear_entry_hash;
+  using LoggedEntryPB::clear_merkle_leaf_hash;
   using LoggedEntryPB::clear_sequence_number;
   using LoggedEntryPB::contents;
+  using LoggedEntryPB::entry_hash;
+  using LoggedEntryPB::has_entry_hash;
+  using LoggedEntryPB::has_merkle_leaf_hash;
   using LoggedEntryPB::has_sequence_number;
   using LoggedEntryPB::sequence_number;
   using LoggedEntryPB::merkle_leaf_hash;
+  using LoggedEntryPB::set_entry_hash;
   using LoggedEntryPB::set_merkle_leaf_hash;
   using LoggedEntryPB::set_sequence_number;
   using LoggedEntryPB::CopyFrom;
@@ -30,6 +38,9 @@ class LoggedEntry : private ct::LoggedEntryPB {
     LoggedEntryPB::CopyFrom(from);
   }
 
+  // The SHA-256 hash of the leaf data of entry(), which is what the
+  // databases and the consistent store look entries up by. This is
+  // |entry_hash|, if set (see CacheHashes()).
   std::string Hash() const;
 
   uint64_t timestamp() const {
@@ -40,7 +51,10 @@ class LoggedEntry : private ct::LoggedEntryPB {
     return contents().sct();
   }
 
+  // Changing the SCT or the entry forgets the cached hashes that
+  // depend on it.
   ct::SignedCertificateTimestamp* mutable_sct() {
+    clear_merkle_leaf_hash();
     return mutable_contents()->mutable_sct();
   }
 
@@ -49,18 +63,49 @@ class LoggedEntry : private ct::LoggedEntryPB {
   }
 
   ct::LogEntry* mutable_entry() {
+    clear_entry_hash();
+    clear_merkle_leaf_hash();
     return mutable_contents()->mutable_entry();
   }
 
+  // See ChainDedupDatabase.
+  const google::protobuf::RepeatedPtrField<ChainReference>& chain_reference()
+      const {
+    return contents().chain_reference();
+  }
+
+  int chain_reference_size() const {
+    return contents().chain_reference_size();
+  }
+
+  ChainReference* add_chain_reference() {
+    return mutable_contents()->add_chain_reference();
+  }
+
+  void clear_chain_reference() {
+    mutable_contents()->clear_chain_reference();
+  }
+
   bool SerializeForDatabase(std::string* dst) const {
     return contents().SerializeToString(dst);
   }
 
   bool ParseFromDatabase(const std::string& src) {
+    clear_entry_hash();
+    clear_merkle_leaf_hash();
     return mutable_contents()->ParseFromString(src);
   }
 
   bool SerializeForLeaf(std::string* dst) const;
+  // The SHA-256 Merkle tree leaf hash of SerializeForLeaf(). This is
+  // |merkle_leaf_hash|, if set, so that it is only computed once, when
+  // the entry is first made (see CacheHashes()).
+  bool LeafHash(std::string* dst) const;
+  // Sets |entry_hash| to Hash() and |merkle_leaf_hash| to LeafHash(),
+  // once the SCT and entry are final. They are carried along with the
+  // entry (but not stored in databases, which keep hashes of their
+  // own).
+  bool CacheHashes();
   bool SerializeExtraData(std::string* dst) const;
 
   // Note that this method will not fully populate the SCT.
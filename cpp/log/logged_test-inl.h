@@ -97,6 +97,69 @@ TYPED_TEST(LoggedTest, DifferentMerkleSerialization) {
   EXPECT_NE(s1, s2);
 }
 
+TYPED_TEST(LoggedTest, CachedLeafHash) {
+  TypeParam l1;
+  l1.RandomForTest();
+
+  std::string computed;
+  EXPECT_TRUE(l1.LeafHash(&computed));
+  EXPECT_TRUE(l1.CacheHashes());
+  EXPECT_EQ(computed, l1.merkle_leaf_hash());
+
+  // The cached hash is used as it is...
+  TypeParam l2;
+  l2.CopyFrom(l1);
+  l2.set_merkle_leaf_hash("cached");
+  std::string leaf_hash;
+  EXPECT_TRUE(l2.LeafHash(&leaf_hash));
+  EXPECT_EQ("cached", leaf_hash);
+
+  // ...until the SCT changes...
+  l2.mutable_sct()->set_timestamp(l2.timestamp() + 1);
+  EXPECT_FALSE(l2.has_merkle_leaf_hash());
+  EXPECT_TRUE(l2.LeafHash(&leaf_hash));
+  EXPECT_NE(computed, leaf_hash);
+
+  // ...and it is not stored in databases.
+  std::string d1;
+  EXPECT_TRUE(l1.SerializeForDatabase(&d1));
+  EXPECT_TRUE(l2.CacheHashes());
+  EXPECT_TRUE(l2.ParseFromDatabase(d1));
+  EXPECT_FALSE(l2.has_merkle_leaf_hash());
+  EXPECT_TRUE(l2.LeafHash(&leaf_hash));
+  EXPECT_EQ(computed, leaf_hash);
+}
+
+TYPED_TEST(LoggedTest, CachedHash) {
+  TypeParam l1;
+  l1.RandomForTest();
+
+  const std::string computed(l1.Hash());
+  EXPECT_TRUE(l1.CacheHashes());
+  EXPECT_EQ(computed, l1.entry_hash());
+
+  // The cached hash is used as it is, even if the SCT changes...
+  TypeParam l2;
+  l2.CopyFrom(l1);
+  l2.set_entry_hash("cached");
+  EXPECT_EQ("cached", l2.Hash());
+  l2.mutable_sct()->set_timestamp(l2.timestamp() + 1);
+  EXPECT_EQ("cached", l2.Hash());
+
+  // ...until the entry changes...
+  l2.mutable_entry();
+  EXPECT_FALSE(l2.has_entry_hash());
+  EXPECT_EQ(computed, l2.Hash());
+
+  // ...and it is not stored in databases.
+  std::string d1;
+  EXPECT_TRUE(l1.SerializeForDatabase(&d1));
+  EXPECT_TRUE(l2.CacheHashes());
+  EXPECT_TRUE(l2.ParseFromDatabase(d1));
+  EXPECT_FALSE(l2.has_entry_hash());
+  EXPECT_EQ(computed, l2.Hash());
+}
+
 int main(int argc, char** argv) {
   cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
   ConfigureSerializerForV1CT();
@@ -0,0 +1,293 @@
+#include "log/name_index.h"
+
+#include <glog/logging.h>
+#include <leveldb/write_batch.h>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+#include "log/cert.h"
+#include "log/logged_entry.h"
+#include "monitoring/latency.h"
+#include "monitoring/monitoring.h"
+#include "util/executor.h"
+
+using std::bind;
+using std::chrono::milliseconds;
+using std::lock_guard;
+using std::max;
+using std::min;
+using std::mutex;
+using std::placeholders::_1;
+using std::set;
+using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+using util::Status;
+
+namespace cert_trans {
+namespace {
+
+static Latency<milliseconds, string> latency_by_op_ms(
+    "name_index_latency_by_operation_ms", "operation",
+    "Name index latency in ms broken down by operation.");
+
+static Gauge<>* indexed_size_gauge(Gauge<>::New(
+    "name_index_indexed_size", "Number of entries in the name index."));
+
+const char kIndexedSizeKey[] = "meta-indexed_size";
+const char kNamePrefix[] = "name-";
+// How many entries are read, and indexed in one write, at once, and
+// how many bytes of them at most.
+const int64_t kIndexBatchSize = 1024;
+const size_t kIndexBatchBytes = 4 << 20;
+
+
+// Lower case, without a trailing dot.
+string NormalizeName(const string& name) {
+  string normalized(name);
+  std::transform(normalized.begin(), normalized.end(), normalized.begin(),
+                 ::tolower);
+  if (!normalized.empty() && normalized.back() == '.') {
+    normalized.pop_back();
+  }
+  return normalized;
+}
+
+
+// "www.example.com" <-> "com.example.www"
+string ReverseLabels(const string& name) {
+  string reversed;
+  reversed.reserve(name.size());
+  size_t end(name.size());
+  while (end > 0) {
+    const size_t dot(name.rfind('.', end - 1));
+    if (dot == string::npos) {
+      break;
+    }
+    reversed.append(name, dot + 1, end - dot - 1);
+    reversed.push_back('.');
+    end = dot;
+  }
+  reversed.append(name, 0, end);
+  return reversed;
+}
+
+
+// The names sort before the sequence numbers that follow them, and
+// before the names under them, which start with a dot.
+string NameKey(const string& reversed_name, int64_t sequence_number) {
+  string key(kNamePrefix + reversed_name);
+  key.push_back('\0');
+  for (int shift = 56; shift >= 0; shift -= 8) {
+    key.push_back(static_cast<char>((sequence_number >> shift) & 0xff));
+  }
+  return key;
+}
+
+
+bool ParseNameKey(const leveldb::Slice& key, NameIndex::Match* match) {
+  const size_t prefix_size(strlen(kNamePrefix));
+  if (key.size() < prefix_size + 9 || !key.starts_with(kNamePrefix) ||
+      key[key.size() - 9] != '\0') {
+    return false;
+  }
+  match->name = ReverseLabels(
+      string(key.data() + prefix_size, key.size() - prefix_size - 9));
+  match->sequence_number = 0;
+  for (size_t i = key.size() - 8; i < key.size(); ++i) {
+    match->sequence_number = (match->sequence_number << 8) |
+                             static_cast<unsigned char>(key[i]);
+  }
+  return true;
+}
+
+
+}  // namespace
+
+
+NameIndex::NameIndex(const string& path, ReadOnlyDatabase* db,
+                     util::Executor* executor)
+    : db_(CHECK_NOTNULL(db)),
+      executor_(CHECK_NOTNULL(executor)),
+      notify_sth_callback_(bind(&NameIndex::OnNewTreeHead, this, _1)),
+      indexed_size_(0),
+      target_size_(0),
+      indexing_(false),
+      exiting_(false) {
+  LOG(INFO) << "Opening name index " << path;
+  leveldb::Options options;
+  options.create_if_missing = true;
+  leveldb::DB* index_db;
+  const leveldb::Status status(leveldb::DB::Open(options, path, &index_db));
+  CHECK(status.ok()) << "Failed to open name index " << path << ": "
+                     << status.ToString();
+  index_db_.reset(index_db);
+
+  string indexed_size;
+  const leveldb::Status size_status(
+      index_db_->Get(leveldb::ReadOptions(), kIndexedSizeKey, &indexed_size));
+  if (size_status.ok()) {
+    indexed_size_ = std::stoll(indexed_size);
+  } else {
+    CHECK(size_status.IsNotFound()) << "Failed to read the indexed size: "
+                                    << size_status.ToString();
+  }
+  indexed_size_gauge->Set(indexed_size_);
+
+  // Called right away with the latest tree head, if there is one.
+  db_->AddNotifySTHCallback(&notify_sth_callback_);
+}
+
+
+NameIndex::~NameIndex() {
+  db_->RemoveNotifySTHCallback(&notify_sth_callback_);
+  unique_lock<mutex> lock(lock_);
+  exiting_ = true;
+  indexed_.wait(lock, [this]() { return !indexing_; });
+}
+
+
+Status NameIndex::Search(const string& domain, const string& cursor,
+                         size_t max_results, vector<Match>* matches,
+                         string* next_cursor) const {
+  CHECK_NOTNULL(matches)->clear();
+  CHECK_NOTNULL(next_cursor)->clear();
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("search"));
+  const string reversed(ReverseLabels(NormalizeName(domain)));
+  if (reversed.empty()) {
+    return Status(util::error::INVALID_ARGUMENT, "Empty domain.");
+  }
+  const string domain_key(kNamePrefix + reversed);
+  if (!cursor.empty() && cursor.compare(0, domain_key.size(), domain_key)) {
+    return Status(util::error::INVALID_ARGUMENT, "Cursor not for domain.");
+  }
+
+  leveldb::ReadOptions options;
+  options.fill_cache = false;
+  const unique_ptr<leveldb::Iterator> it(index_db_->NewIterator(options));
+  // The name itself, then the names under it.
+  for (const string& prefix :
+       {domain_key + string(1, '\0'), domain_key + '.'}) {
+    for (it->Seek(max(prefix, cursor));
+         it->Valid() && it->key().starts_with(prefix); it->Next()) {
+      if (matches->size() >= max_results) {
+        *next_cursor = it->key().ToString();
+        return util::OkStatus();
+      }
+      matches->emplace_back();
+      CHECK(ParseNameKey(it->key(), &matches->back()))
+          << "Bad name index key: " << it->key().ToString();
+    }
+    CHECK(it->status().ok()) << "Failed to search the name index: "
+                             << it->status().ToString();
+  }
+  return util::OkStatus();
+}
+
+
+int64_t NameIndex::IndexedSize() const {
+  lock_guard<mutex> lock(lock_);
+  return indexed_size_;
+}
+
+
+void NameIndex::WaitForIndexedSize(int64_t tree_size) const {
+  unique_lock<mutex> lock(lock_);
+  indexed_.wait(lock,
+                [this, tree_size]() { return indexed_size_ >= tree_size; });
+}
+
+
+// static
+void NameIndex::EntryNames(const LoggedEntry& entry, set<string>* names) {
+  CHECK_NOTNULL(names);
+  const string* der;
+  switch (entry.entry().type()) {
+    case ct::X509_ENTRY:
+      der = &entry.entry().x509_entry().leaf_certificate();
+      break;
+    case ct::PRECERT_ENTRY:
+      der = &entry.entry().precert_entry().pre_certificate();
+      break;
+    default:
+      return;
+  }
+  // V2 entries only have the TBSCertificate.
+  const unique_ptr<Cert> cert(der->empty() ? nullptr
+                                           : Cert::FromDerString(*der));
+  if (!cert) {
+    return;
+  }
+
+  vector<string> alt_names;
+  if (cert->SubjectAltNames(&alt_names).ok()) {
+    for (const string& name : alt_names) {
+      if (!name.empty()) {
+        names->insert(NormalizeName(name));
+      }
+    }
+  }
+  string common_name;
+  if (cert->SubjectCommonName(&common_name).ok() && !common_name.empty()) {
+    names->insert(NormalizeName(common_name));
+  }
+}
+
+
+void NameIndex::OnNewTreeHead(const ct::SignedTreeHead& sth) {
+  lock_guard<mutex> lock(lock_);
+  target_size_ = max<int64_t>(target_size_, sth.tree_size());
+  if (!indexing_ && !exiting_ && indexed_size_ < target_size_) {
+    indexing_ = true;
+    executor_->Add(bind(&NameIndex::IndexEntries, this));
+  }
+}
+
+
+void NameIndex::IndexEntries() {
+  unique_lock<mutex> lock(lock_);
+  while (!exiting_ && indexed_size_ < target_size_) {
+    const int64_t start(indexed_size_);
+    const int64_t end(min(target_size_, start + kIndexBatchSize) - 1);
+    lock.unlock();
+
+    ScopedLatency latency(latency_by_op_ms.GetScopedLatency("index_entries"));
+    vector<LoggedEntry> entries;
+    db_->ReadEntries(start, end, kIndexBatchBytes, ReadOnlyDatabase::BULK_SCAN,
+                     &entries);
+    if (entries.empty()) {
+      // Left for the next tree head.
+      LOG(WARNING) << "Entry " << start << " is missing, not indexing it yet";
+      lock.lock();
+      break;
+    }
+
+    leveldb::WriteBatch batch;
+    set<string> names;
+    for (const LoggedEntry& entry : entries) {
+      names.clear();
+      EntryNames(entry, &names);
+      for (const string& name : names) {
+        batch.Put(NameKey(ReverseLabels(name), entry.sequence_number()), "");
+      }
+    }
+    const int64_t new_size(start + entries.size());
+    batch.Put(kIndexedSizeKey, std::to_string(new_size));
+    const leveldb::Status status(
+        index_db_->Write(leveldb::WriteOptions(), &batch));
+    CHECK(status.ok()) << "Failed to write to the name index: "
+                       << status.ToString();
+    indexed_size_gauge->Set(new_size);
+
+    lock.lock();
+    indexed_size_ = new_size;
+    indexed_.notify_all();
+  }
+  indexing_ = false;
+  indexed_.notify_all();
+}
+
+
+}  // namespace cert_trans
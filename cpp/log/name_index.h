@@ -0,0 +1,100 @@
+#ifndef CERT_TRANS_LOG_NAME_INDEX_H_
+#define CERT_TRANS_LOG_NAME_INDEX_H_
+
+#include <leveldb/db.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "log/database.h"
+#include "proto/ct.pb.h"
+#include "util/status.h"
+
+namespace util {
+class Executor;
+}  // namespace util
+
+namespace cert_trans {
+
+class LoggedEntry;
+
+
+// A search index of the DNS names of the logged certificates (their
+// subjectAltName dNSNames and subject commonName), kept in a LevelDB
+// of its own, so that finding the certificates for a domain does not
+// take a scan of the whole log.
+//
+// Entries are indexed as tree heads covering them are written to the
+// database, from the notifications of the database, on |executor|.
+// The names are stored with their labels reversed ("com.example.www"),
+// followed by the sequence number of the entry, so that the names
+// under a domain are next to each other.
+//
+// This class is thread-safe.
+class NameIndex {
+ public:
+  struct Match {
+    // As in the certificate, but in lower case.
+    std::string name;
+    int64_t sequence_number;
+  };
+
+  // Does not take ownership of |db| or |executor|, which must outlive
+  // this instance.
+  NameIndex(const std::string& path, ReadOnlyDatabase* db,
+            util::Executor* executor);
+  ~NameIndex();
+  NameIndex(const NameIndex&) = delete;
+  NameIndex& operator=(const NameIndex&) = delete;
+
+  // Sets |matches| to up to |max_results| of the names equal to
+  // |domain| or under it, in order of their reversed labels, then of
+  // their sequence number. |cursor| is where to start, empty for the
+  // first call, then |*next_cursor| of the previous one, which is set
+  // to empty once there are no more (so it cannot be |cursor| itself).
+  // Returns INVALID_ARGUMENT if |domain| or |cursor| is not valid.
+  util::Status Search(const std::string& domain, const std::string& cursor,
+                      size_t max_results, std::vector<Match>* matches,
+                      std::string* next_cursor) const;
+
+  // The number of entries indexed, all of those below it.
+  int64_t IndexedSize() const;
+
+  // Returns once the entries up to |tree_size| are indexed, which must
+  // be covered by a tree head written to the database.
+  void WaitForIndexedSize(int64_t tree_size) const;
+
+  // Adds the names of the certificate of |entry| to |names|, in lower
+  // case, if it has one.
+  static void EntryNames(const LoggedEntry& entry,
+                         std::set<std::string>* names);
+
+ private:
+  void OnNewTreeHead(const ct::SignedTreeHead& sth);
+
+  // Indexes the entries up to |target_size_|, run on |executor_|.
+  void IndexEntries();
+
+  ReadOnlyDatabase* const db_;
+  util::Executor* const executor_;
+  const ReadOnlyDatabase::NotifySTHCallback notify_sth_callback_;
+  std::unique_ptr<leveldb::DB> index_db_;
+
+  mutable std::mutex lock_;
+  mutable std::condition_variable indexed_;
+  int64_t indexed_size_;
+  // The tree size of the latest tree head.
+  int64_t target_size_;
+  // Whether IndexEntries() is scheduled or running.
+  bool indexing_;
+  bool exiting_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_NAME_INDEX_H_
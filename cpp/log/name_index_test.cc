@@ -0,0 +1,234 @@
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "log/cert.h"
+#include "log/logged_entry.h"
+#include "log/name_index.h"
+#include "log/sqlite_db.h"
+#include "log/test_signer.h"
+#include "proto/cert_serializer.h"
+#include "util/status_test_util.h"
+#include "util/test_db.h"
+#include "util/testing.h"
+#include "util/thread_pool.h"
+#include "util/util.h"
+
+namespace cert_trans {
+namespace {
+
+using std::set;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using util::testing::StatusIs;
+
+// Its subjectAltNames include "google.com", "*.google.com",
+// "*.appengine.google.com", "*.cloud.google.com" and
+// "*.url.google.com", but no other name under "google.com".
+const char kGoogleCert[] = "google-cert.pem";
+// No subjectAltName nor commonName.
+const char kLeafCert[] = "test-cert.pem";
+
+
+string ReadCertDer(const string& filename) {
+  string pem;
+  CHECK(util::ReadTextFile(FLAGS_test_srcdir + "/test/testdata/" + filename,
+                           &pem))
+      << "Could not read test data from " << filename
+      << ". Wrong --test_srcdir?";
+  const unique_ptr<Cert> cert(Cert::FromPemString(pem));
+  CHECK(cert);
+  string der;
+  CHECK(cert->DerEncoding(&der).ok());
+  return der;
+}
+
+
+class NameIndexTest : public ::testing::Test {
+ protected:
+  NameIndexTest()
+      : db_(tmp_.TmpStorageDir() + "/sqlite"),
+        index_path_(tmp_.TmpStorageDir() + "/names"),
+        google_der_(ReadCertDer(kGoogleCert)),
+        leaf_der_(ReadCertDer(kLeafCert)) {
+  }
+
+  void OpenIndex() {
+    index_.reset(new NameIndex(index_path_, &db_, &pool_));
+  }
+
+  // Logs the certificate |der| as the next entry, as an X509_ENTRY or
+  // PRECERT_ENTRY.
+  void AddEntry(const string& der, ct::LogEntryType type) {
+    LoggedEntry entry;
+    test_signer_.CreateUnique(&entry);
+    ct::LogEntry* const log_entry(entry.mutable_entry());
+    log_entry->Clear();
+    log_entry->set_type(type);
+    if (type == ct::X509_ENTRY) {
+      log_entry->mutable_x509_entry()->set_leaf_certificate(der);
+    } else {
+      ct::PrecertChainEntry* const precert(log_entry->mutable_precert_entry());
+      precert->set_pre_certificate(der);
+      precert->mutable_pre_cert()->set_issuer_key_hash(string(32, 'k'));
+      precert->mutable_pre_cert()->set_tbs_certificate(der);
+    }
+    entry.clear_entry_hash();
+    entry.clear_merkle_leaf_hash();
+    ASSERT_TRUE(entry.CacheHashes());
+    entry.set_sequence_number(db_.TreeSize());
+    ASSERT_EQ(Database::OK, db_.CreateSequencedEntry(entry));
+  }
+
+  void WriteTreeHead() {
+    ct::SignedTreeHead sth;
+    test_signer_.CreateUnique(&sth);
+    sth.set_tree_size(db_.TreeSize());
+    sth.set_timestamp(sth.tree_size());
+    ASSERT_EQ(Database::OK, db_.WriteTreeHead(sth));
+  }
+
+  // Searches |domain| |max_results| at a time, to the end.
+  vector<NameIndex::Match> SearchAll(const string& domain,
+                                     size_t max_results) {
+    vector<NameIndex::Match> all;
+    string cursor;
+    do {
+      vector<NameIndex::Match> matches;
+      string next_cursor;
+      EXPECT_OK(index_->Search(domain, cursor, max_results, &matches,
+                               &next_cursor));
+      cursor = next_cursor;
+      EXPECT_GE(max_results, matches.size());
+      all.insert(all.end(), matches.begin(), matches.end());
+    } while (!cursor.empty());
+    return all;
+  }
+
+  static string ToString(const vector<NameIndex::Match>& matches) {
+    string result;
+    for (const NameIndex::Match& match : matches) {
+      result += match.name + ":" + std::to_string(match.sequence_number) + " ";
+    }
+    return result;
+  }
+
+  TmpStorage tmp_;
+  SQLiteDB db_;
+  ThreadPool pool_;
+  TestSigner test_signer_;
+  const string index_path_;
+  const string google_der_;
+  const string leaf_der_;
+  unique_ptr<NameIndex> index_;
+};
+
+
+TEST_F(NameIndexTest, EntryNames) {
+  AddEntry(google_der_, ct::X509_ENTRY);
+  AddEntry(leaf_der_, ct::X509_ENTRY);
+  vector<LoggedEntry> entries;
+  db_.ReadEntries(0, 1, 1 << 20, ReadOnlyDatabase::POINT_READ, &entries);
+  ASSERT_EQ(2U, entries.size());
+
+  set<string> names;
+  NameIndex::EntryNames(entries[0], &names);
+  EXPECT_EQ(44U, names.size());
+  EXPECT_EQ(1U, names.count("google.com"));
+  EXPECT_EQ(1U, names.count("*.google.com"));
+  EXPECT_EQ(1U, names.count("youtu.be"));
+
+  names.clear();
+  NameIndex::EntryNames(entries[1], &names);
+  EXPECT_TRUE(names.empty());
+}
+
+
+TEST_F(NameIndexTest, Search) {
+  AddEntry(google_der_, ct::X509_ENTRY);
+  AddEntry(leaf_der_, ct::X509_ENTRY);
+  AddEntry(google_der_, ct::PRECERT_ENTRY);
+  OpenIndex();
+  WriteTreeHead();
+  index_->WaitForIndexedSize(3);
+  EXPECT_EQ(3, index_->IndexedSize());
+
+  const string expected(
+      "google.com:0 google.com:2 *.google.com:0 *.google.com:2 "
+      "*.appengine.google.com:0 *.appengine.google.com:2 "
+      "*.cloud.google.com:0 *.cloud.google.com:2 "
+      "*.url.google.com:0 *.url.google.com:2 ");
+  EXPECT_EQ(expected, ToString(SearchAll("google.com", 100)));
+  EXPECT_EQ(expected, ToString(SearchAll("Google.COM.", 100)));
+  EXPECT_EQ("youtu.be:0 youtu.be:2 ", ToString(SearchAll("youtu.be", 100)));
+  EXPECT_EQ("", ToString(SearchAll("www.google.com", 100)));
+  EXPECT_EQ("", ToString(SearchAll("oogle.com", 100)));
+  EXPECT_EQ(ToString(SearchAll("com", 100)), ToString(SearchAll("com", 7)));
+}
+
+
+TEST_F(NameIndexTest, SearchPages) {
+  AddEntry(google_der_, ct::X509_ENTRY);
+  AddEntry(google_der_, ct::PRECERT_ENTRY);
+  OpenIndex();
+  WriteTreeHead();
+  index_->WaitForIndexedSize(2);
+
+  const string all(ToString(SearchAll("google.com", 100)));
+  for (size_t max_results = 1; max_results <= 11; ++max_results) {
+    EXPECT_EQ(all, ToString(SearchAll("google.com", max_results)))
+        << max_results;
+  }
+
+  vector<NameIndex::Match> matches;
+  string cursor;
+  EXPECT_OK(index_->Search("google.com", "", 3, &matches, &cursor));
+  EXPECT_EQ(3U, matches.size());
+  EXPECT_FALSE(cursor.empty());
+  string next_cursor;
+  EXPECT_THAT(index_->Search("youtu.be", cursor, 3, &matches, &next_cursor),
+              StatusIs(util::error::INVALID_ARGUMENT));
+  EXPECT_THAT(index_->Search("", "", 3, &matches, &next_cursor),
+              StatusIs(util::error::INVALID_ARGUMENT));
+}
+
+
+TEST_F(NameIndexTest, ResumesOnRestart) {
+  AddEntry(google_der_, ct::X509_ENTRY);
+  WriteTreeHead();
+  OpenIndex();
+  index_->WaitForIndexedSize(1);
+  index_.reset();
+
+  // Not indexed again, nor twice.
+  AddEntry(google_der_, ct::PRECERT_ENTRY);
+  AddEntry(leaf_der_, ct::X509_ENTRY);
+  OpenIndex();
+  EXPECT_EQ(1, index_->IndexedSize());
+  WriteTreeHead();
+  index_->WaitForIndexedSize(3);
+  EXPECT_EQ(3, index_->IndexedSize());
+  EXPECT_EQ(
+      "google.com:0 google.com:1 *.google.com:0 *.google.com:1 "
+      "*.appengine.google.com:0 *.appengine.google.com:1 "
+      "*.cloud.google.com:0 *.cloud.google.com:1 "
+      "*.url.google.com:0 *.url.google.com:1 ",
+      ToString(SearchAll("google.com", 2)));
+  EXPECT_EQ("youtu.be:0 youtu.be:1 ", ToString(SearchAll("youtu.be", 100)));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  ConfigureSerializerForV1CT();
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,798 @@
+#include "log/rocksdb_db.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <rocksdb/cache.h>
+#include <rocksdb/filter_policy.h>
+#include <rocksdb/slice_transform.h>
+#include <rocksdb/table.h>
+#include <stdint.h>
+#include <limits>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "monitoring/latency.h"
+#include "monitoring/monitoring.h"
+#include "monitoring/startup.h"
+#include "proto/ct.pb.h"
+#include "proto/serializer.h"
+#include "util/util.h"
+
+using cert_trans::serialization::DeserializeResult;
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::lock_guard;
+using std::map;
+using std::move;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::unordered_map;
+using std::vector;
+
+DEFINE_int32(rocksdb_max_open_files, 0,
+             "number of open files that can be used by rocksdb, 0 for the "
+             "rocksdb default (unlimited)");
+DEFINE_int32(rocksdb_bloom_filter_bits_per_key, 10,
+             "bits per key of the bloom filters of the rocksdb column "
+             "families, 0 for none");
+DEFINE_int32(rocksdb_block_cache_mb, 0,
+             "size of the block cache shared by all the column families of "
+             "the database, in MB, 0 for the rocksdb default (8MB each)");
+DEFINE_bool(rocksdb_compression, true,
+            "whether rocksdb compresses its blocks with Snappy");
+DEFINE_int32(rocksdb_write_buffer_mb, 0,
+             "size of the rocksdb memtable of each column family, in MB, 0 "
+             "for the rocksdb default (64MB)");
+DEFINE_int32(rocksdb_background_jobs, 4,
+             "number of threads rocksdb flushes and compacts with");
+DEFINE_int32(rocksdb_max_subcompactions, 4,
+             "number of threads a single rocksdb compaction can be split "
+             "across");
+DEFINE_bool(rocksdb_direct_io_for_compaction, false,
+            "whether rocksdb bypasses the page cache when flushing and "
+            "compacting, so that rewriting the entries does not evict the "
+            "pages being served (not supported by some filesystems, such "
+            "as tmpfs)");
+
+namespace cert_trans {
+namespace {
+
+
+static Latency<milliseconds, string> latency_by_op_ms(
+    "rocksdb_latency_by_operation_ms", "operation",
+    "Database latency in ms broken out by operation.");
+
+static Gauge<>* build_index_time_ms(
+    Gauge<>::New("rocksdb_build_index_time_ms",
+                 "Time taken to index the entries when the database was "
+                 "opened, in ms."));
+
+
+// The names of the column families other than the default one, which
+// has the metadata, in the order of RocksDB::ColumnFamily.
+const char* const kColumnFamilyNames[] = {
+    "entries", "leaf_hashes", "hashes", "tree_heads",
+};
+
+const char kMetaNodeIdKey[] = "metadata";
+const char kMetaIndexCheckpointKey[] = "index_checkpoint";
+const char kMetaTreeCheckpointKey[] = "tree_checkpoint";
+// How many hexadecimal digits of the sequence numbers make up the
+// prefixes of the keys of the entries and leaf hashes, which the bloom
+// filters are on: all but the last 4, for runs of 65536 entries.
+const size_t kIndexPrefixLength = 12;
+// How far the contiguous entries get past the index checkpoint before
+// it is moved up. BuildIndex() reads the sequence numbers from the
+// checkpoint on, so this bounds the work it has to do.
+const int64_t kIndexCheckpointInterval = 1 << 16;
+// How far ahead a BULK_SCAN reads.
+const size_t kBulkScanReadaheadBytes = 2 << 20;
+
+
+// In the same format as the keys of LevelDB, without the prefix.
+string IndexToKey(int64_t index) {
+  const char nibble[] = "0123456789abcdef";
+  string index_str(sizeof(index) * 2, nibble[0]);
+  for (int i = sizeof(index) * 2; i > 0 && index > 0; --i) {
+    index_str[i - 1] = nibble[index & 0xf];
+    index = index >> 4;
+  }
+
+  return index_str;
+}
+
+
+int HexDigitValue(char digit) {
+  if (digit >= '0' && digit <= '9') {
+    return digit - '0';
+  }
+  CHECK(digit >= 'a' && digit <= 'f') << "invalid hex digit: " << digit;
+  return digit - 'a' + 10;
+}
+
+
+int64_t KeyToIndex(const rocksdb::Slice& key) {
+  uint64_t index(0);
+  CHECK_EQ(key.size(), sizeof(index) * 2);
+  for (size_t i = 0; i < key.size(); ++i) {
+    index = (index << 4) | HexDigitValue(key[i]);
+  }
+
+  return static_cast<int64_t>(index);
+}
+
+
+// Options for iterators which go across prefixes, which the bloom
+// filters on prefixes would otherwise stop them from doing. A
+// BULK_SCAN reads ahead, and keeps its blocks out of the block cache.
+rocksdb::ReadOptions ScanOptions(Database::ReadPattern pattern) {
+  rocksdb::ReadOptions options;
+  options.total_order_seek = true;
+  if (pattern == Database::BULK_SCAN) {
+    options.fill_cache = false;
+    options.readahead_size = kBulkScanReadaheadBytes;
+  }
+  return options;
+}
+
+
+// The keys of the column families with |index_keys| are sequence
+// numbers, which are filtered by prefix, while those of the others are
+// filtered whole.
+rocksdb::ColumnFamilyOptions BuildColumnFamilyOptions(
+    const shared_ptr<rocksdb::Cache>& block_cache, bool index_keys) {
+  rocksdb::ColumnFamilyOptions options;
+  rocksdb::BlockBasedTableOptions table_options;
+  if (block_cache) {
+    table_options.block_cache = block_cache;
+  }
+  if (FLAGS_rocksdb_bloom_filter_bits_per_key > 0) {
+    table_options.filter_policy.reset(CHECK_NOTNULL(
+        rocksdb::NewBloomFilterPolicy(FLAGS_rocksdb_bloom_filter_bits_per_key,
+                                      false)));
+  }
+  if (index_keys) {
+    options.prefix_extractor.reset(
+        rocksdb::NewFixedPrefixTransform(kIndexPrefixLength));
+    table_options.whole_key_filtering = false;
+    options.memtable_prefix_bloom_size_ratio = 0.02;
+  }
+
+  options.table_factory.reset(
+      rocksdb::NewBlockBasedTableFactory(table_options));
+  options.compression = FLAGS_rocksdb_compression
+                            ? rocksdb::kSnappyCompression
+                            : rocksdb::kNoCompression;
+  if (FLAGS_rocksdb_write_buffer_mb > 0) {
+    options.write_buffer_size =
+        static_cast<size_t>(FLAGS_rocksdb_write_buffer_mb) << 20;
+  }
+  return options;
+}
+
+
+}  // namespace
+
+
+class RocksDB::Iterator : public Database::Iterator {
+ public:
+  Iterator(const RocksDB* db, int64_t start_index)
+      : it_(CHECK_NOTNULL(db)->db_->NewIterator(
+            ScanOptions(Database::BULK_SCAN), db->Handle(kEntries))) {
+    CHECK(it_);
+    it_->Seek(IndexToKey(start_index));
+  }
+
+  bool GetNextEntry(LoggedEntry* entry) override {
+    if (!it_->Valid()) {
+      return false;
+    }
+
+    const int64_t seq(KeyToIndex(it_->key()));
+    CHECK(entry->ParseFromArray(it_->value().data(), it_->value().size()))
+        << "failed to parse entry for key " << it_->key().ToString();
+    CHECK(entry->has_sequence_number())
+        << "no sequence number for entry with expected sequence number "
+        << seq;
+    CHECK_EQ(entry->sequence_number(), seq) << "unexpected sequence_number";
+
+    it_->Next();
+
+    return true;
+  }
+
+ private:
+  const unique_ptr<rocksdb::Iterator> it_;
+};
+
+
+class RocksDB::LeafHashIterator : public Database::LeafHashIterator {
+ public:
+  LeafHashIterator(const RocksDB* db, int64_t start_index)
+      : it_(CHECK_NOTNULL(db)->db_->NewIterator(
+            ScanOptions(Database::BULK_SCAN), db->Handle(kLeafHashes))) {
+    CHECK(it_);
+    it_->Seek(IndexToKey(start_index));
+  }
+
+  bool GetNextLeafHash(int64_t* sequence_number, string* leaf_hash) override {
+    CHECK_NOTNULL(sequence_number);
+    CHECK_NOTNULL(leaf_hash);
+    if (!it_->Valid()) {
+      return false;
+    }
+
+    *sequence_number = KeyToIndex(it_->key());
+    leaf_hash->assign(it_->value().data(), it_->value().size());
+
+    it_->Next();
+
+    return true;
+  }
+
+ private:
+  const unique_ptr<rocksdb::Iterator> it_;
+};
+
+
+const size_t RocksDB::kTimestampBytesIndexed = 6;
+
+
+RocksDB::RocksDB(const string& dbfile)
+    : contiguous_size_(0), index_checkpoint_(0), latest_tree_timestamp_(0) {
+  LOG(INFO) << "Opening " << dbfile;
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("open"));
+  rocksdb::DBOptions options;
+  options.create_if_missing = true;
+  options.create_missing_column_families = true;
+  if (FLAGS_rocksdb_max_open_files > 0) {
+    options.max_open_files = FLAGS_rocksdb_max_open_files;
+  }
+  options.max_background_jobs = FLAGS_rocksdb_background_jobs;
+  options.max_subcompactions = FLAGS_rocksdb_max_subcompactions;
+  options.use_direct_io_for_flush_and_compaction =
+      FLAGS_rocksdb_direct_io_for_compaction;
+
+  const shared_ptr<rocksdb::Cache> block_cache(
+      FLAGS_rocksdb_block_cache_mb > 0
+          ? rocksdb::NewLRUCache(
+                static_cast<size_t>(FLAGS_rocksdb_block_cache_mb) << 20)
+          : nullptr);
+  vector<rocksdb::ColumnFamilyDescriptor> descriptors;
+  for (int i = 0; i < kNumColumnFamilies; ++i) {
+    descriptors.emplace_back(
+        i == kMeta ? rocksdb::kDefaultColumnFamilyName
+                   : kColumnFamilyNames[i - 1],
+        BuildColumnFamilyOptions(block_cache,
+                                 i == kEntries || i == kLeafHashes));
+  }
+
+  rocksdb::DB* db;
+  const rocksdb::Status status(rocksdb::DB::Open(options, dbfile, descriptors,
+                                                 &column_families_, &db));
+  CHECK(status.ok()) << status.ToString();
+  CHECK_EQ(column_families_.size(), static_cast<size_t>(kNumColumnFamilies));
+  db_.reset(db);
+
+  BuildIndex();
+}
+
+
+RocksDB::~RocksDB() {
+  for (rocksdb::ColumnFamilyHandle* handle : column_families_) {
+    const rocksdb::Status status(db_->DestroyColumnFamilyHandle(handle));
+    CHECK(status.ok()) << status.ToString();
+  }
+}
+
+
+Database::WriteResult RocksDB::CreateSequencedEntry_(
+    const LoggedEntry& logged) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("create_sequenced_entry"));
+  return WriteSequencedEntries(vector<const LoggedEntry*>(1, &logged));
+}
+
+
+Database::WriteResult RocksDB::CreateSequencedEntries_(
+    const vector<const LoggedEntry*>& entries) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("create_sequenced_entries"));
+  return WriteSequencedEntries(entries);
+}
+
+
+Database::WriteResult RocksDB::WriteSequencedEntries(
+    const vector<const LoggedEntry*>& entries) {
+  lock_guard<mutex> lock(lock_);
+
+  // The existing entries and hash mappings are all looked up at once,
+  // rather than one by one: the entries first, then the hashes.
+  vector<string> keys;
+  vector<string> hashes;
+  keys.reserve(entries.size());
+  hashes.reserve(entries.size());
+  for (const LoggedEntry* logged : entries) {
+    keys.push_back(IndexToKey(logged->sequence_number()));
+    hashes.push_back(logged->Hash());
+  }
+  vector<rocksdb::ColumnFamilyHandle*> lookup_families;
+  vector<rocksdb::Slice> lookup_keys;
+  lookup_families.reserve(2 * entries.size());
+  lookup_keys.reserve(2 * entries.size());
+  for (const string& key : keys) {
+    lookup_families.push_back(Handle(kEntries));
+    lookup_keys.emplace_back(key);
+  }
+  for (const string& hash : hashes) {
+    lookup_families.push_back(Handle(kHashes));
+    lookup_keys.emplace_back(hash);
+  }
+  vector<string> existing;
+  const vector<rocksdb::Status> statuses(db_->MultiGet(
+      rocksdb::ReadOptions(), lookup_families, lookup_keys, &existing));
+  CHECK_EQ(statuses.size(), lookup_keys.size());
+  for (const rocksdb::Status& status : statuses) {
+    CHECK(status.ok() || status.IsNotFound())
+        << "Failed to look up sequenced entries: " << status.ToString();
+  }
+
+  rocksdb::WriteBatch batch;
+  // What is already in the batch, which the lookups did not see: the
+  // entries by sequence number, and the lowest sequence number of each
+  // hash.
+  map<int64_t, string> batch_entries;
+  unordered_map<string, int64_t> batch_hashes;
+  WriteResult result(this->OK);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    const LoggedEntry* const logged(entries[i]);
+    const int64_t sequence_number(logged->sequence_number());
+    string data;
+    CHECK(logged->SerializeToString(&data));
+
+    const auto batch_entry(batch_entries.find(sequence_number));
+    const string* existing_data(nullptr);
+    if (batch_entry != batch_entries.end()) {
+      existing_data = &batch_entry->second;
+    } else if (statuses[i].ok()) {
+      existing_data = &existing[i];
+    }
+    if (existing_data) {
+      if (*existing_data == data) {
+        continue;
+      }
+      result = this->SEQUENCE_NUMBER_ALREADY_IN_USE;
+      break;
+    }
+
+    string leaf_hash;
+    CHECK(logged->LeafHash(&leaf_hash));
+    batch.Put(Handle(kEntries), keys[i], data);
+    batch.Put(Handle(kLeafHashes), keys[i], leaf_hash);
+    // Duplicate hashes map to the entry with the lowest sequence
+    // number.
+    const string& hash(hashes[i]);
+    auto batch_hash(batch_hashes.find(hash));
+    if (batch_hash == batch_hashes.end()) {
+      const size_t lookup(entries.size() + i);
+      batch_hash =
+          batch_hashes
+              .emplace(hash, statuses[lookup].ok()
+                                 ? KeyToIndex(existing[lookup])
+                                 : std::numeric_limits<int64_t>::max())
+              .first;
+    }
+    if (sequence_number < batch_hash->second) {
+      batch.Put(Handle(kHashes), hash, keys[i]);
+      batch_hash->second = sequence_number;
+    }
+    timestamp_index_.Add(sequence_number, logged->timestamp());
+    batch_entries.emplace(sequence_number, move(data));
+  }
+
+  if (batch_entries.empty()) {
+    return result;
+  }
+
+  const rocksdb::Status status(db_->Write(rocksdb::WriteOptions(), &batch));
+  CHECK(status.ok()) << "Failed to write " << batch_entries.size()
+                     << " sequenced entries (first seq: "
+                     << batch_entries.begin()->first
+                     << "): " << status.ToString();
+
+  for (const auto& entry : batch_entries) {
+    InsertSequenceNumber(entry.first);
+  }
+  if (contiguous_size_ >= index_checkpoint_ + kIndexCheckpointInterval) {
+    WriteIndexCheckpoint();
+  }
+
+  return result;
+}
+
+
+Database::LookupResult RocksDB::LookupByHash(const string& hash,
+                                             LoggedEntry* result) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_hash"));
+
+  string seq_data;
+  rocksdb::Status status(
+      db_->Get(rocksdb::ReadOptions(), Handle(kHashes), hash, &seq_data));
+  if (status.IsNotFound()) {
+    return this->NOT_FOUND;
+  }
+  CHECK(status.ok()) << "Failed to look up hash(" << util::HexString(hash)
+                     << "): " << status.ToString();
+
+  string cert_data;
+  status = db_->Get(rocksdb::ReadOptions(), Handle(kEntries), seq_data,
+                    &cert_data);
+  if (status.IsNotFound()) {
+    return this->NOT_FOUND;
+  }
+  CHECK(status.ok()) << "Failed to get entry by hash(" << util::HexString(hash)
+                     << "): " << status.ToString();
+
+  if (result) {
+    CHECK(result->ParseFromString(cert_data));
+    CHECK_EQ(result->Hash(), hash);
+  }
+
+  return this->LOOKUP_OK;
+}
+
+
+Database::LookupResult RocksDB::LookupByIndex(int64_t sequence_number,
+                                              LoggedEntry* result) const {
+  CHECK_GE(sequence_number, 0);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_index"));
+
+  string cert_data;
+  const rocksdb::Status status(db_->Get(rocksdb::ReadOptions(),
+                                        Handle(kEntries),
+                                        IndexToKey(sequence_number),
+                                        &cert_data));
+  if (status.IsNotFound()) {
+    return this->NOT_FOUND;
+  }
+  CHECK(status.ok()) << "Failed to get entry for sequence number "
+                     << sequence_number << ": " << status.ToString();
+
+  if (result) {
+    CHECK(result->ParseFromString(cert_data));
+    CHECK_EQ(result->sequence_number(), sequence_number);
+  }
+
+  return this->LOOKUP_OK;
+}
+
+
+unique_ptr<Database::Iterator> RocksDB::ScanEntries(
+    int64_t start_index) const {
+  return unique_ptr<Iterator>(new Iterator(this, start_index));
+}
+
+
+void RocksDB::ReadEntries(int64_t start_index, int64_t end_index,
+                          size_t max_bytes, ReadPattern pattern,
+                          vector<LoggedEntry>* entries) const {
+  CHECK_GE(start_index, 0);
+  CHECK_NOTNULL(entries);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("read_entries"));
+
+  // As in LevelDB, a single iterator walks the span, and stops short
+  // of its end so as not to read blocks past it.
+  rocksdb::ReadOptions options(ScanOptions(pattern));
+  const string upper_bound(
+      end_index < std::numeric_limits<int64_t>::max()
+          ? IndexToKey(end_index + 1)
+          : string());
+  const rocksdb::Slice upper_bound_slice(upper_bound);
+  if (!upper_bound.empty()) {
+    options.iterate_upper_bound = &upper_bound_slice;
+  }
+  const unique_ptr<rocksdb::Iterator> it(
+      db_->NewIterator(options, Handle(kEntries)));
+  CHECK(it);
+  size_t bytes(0);
+  int64_t seq(start_index);
+  for (it->Seek(IndexToKey(start_index)); seq <= end_index && it->Valid();
+       it->Next(), ++seq) {
+    if (KeyToIndex(it->key()) != seq) {
+      break;
+    }
+    if (seq > start_index && bytes + it->value().size() > max_bytes) {
+      break;
+    }
+    bytes += it->value().size();
+
+    entries->emplace_back();
+    CHECK(entries->back().ParseFromArray(it->value().data(),
+                                         it->value().size()))
+        << "failed to parse entry for key " << it->key().ToString();
+    CHECK_EQ(entries->back().sequence_number(), seq)
+        << "unexpected sequence_number";
+  }
+  CHECK(it->status().ok()) << "Failed to read entries from " << start_index
+                           << ": " << it->status().ToString();
+}
+
+
+unique_ptr<Database::LeafHashIterator> RocksDB::ScanLeafHashes(
+    int64_t start_index) const {
+  return unique_ptr<LeafHashIterator>(
+      new LeafHashIterator(this, start_index));
+}
+
+
+Database::WriteResult RocksDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
+  CHECK_GE(sth.tree_size(), 0);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("write_tree_head"));
+
+  // 6 bytes are good enough for some 9000 years.
+  const string timestamp_key(
+      Serializer::SerializeUint(sth.timestamp(),
+                                RocksDB::kTimestampBytesIndexed));
+  string data;
+  CHECK(sth.SerializeToString(&data));
+
+  unique_lock<mutex> lock(lock_);
+  string existing_data;
+  rocksdb::Status status(db_->Get(rocksdb::ReadOptions(), Handle(kTreeHeads),
+                                  timestamp_key, &existing_data));
+  if (status.ok()) {
+    if (existing_data == data) {
+      return this->OK;
+    }
+    return this->DUPLICATE_TREE_HEAD_TIMESTAMP;
+  }
+  CHECK(status.IsNotFound()) << "Failed to look up tree head ("
+                             << timestamp_key << "): " << status.ToString();
+
+  rocksdb::WriteOptions opts;
+  opts.sync = true;
+  status = db_->Put(opts, Handle(kTreeHeads), timestamp_key, data);
+  CHECK(status.ok()) << "Failed to write tree head (" << timestamp_key
+                     << "): " << status.ToString();
+
+  if (sth.timestamp() > latest_tree_timestamp_) {
+    latest_tree_timestamp_ = sth.timestamp();
+    latest_timestamp_key_ = timestamp_key;
+  }
+
+  lock.unlock();
+  callbacks_.Call(sth);
+
+  return this->OK;
+}
+
+
+Database::LookupResult RocksDB::LatestTreeHead(
+    ct::SignedTreeHead* result) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("latest_tree_head"));
+  lock_guard<mutex> lock(lock_);
+
+  return LatestTreeHeadNoLock(result);
+}
+
+
+Database::WriteResult RocksDB::WriteTreeCheckpoint_(
+    const ct::CompactTreeCheckpoint& checkpoint) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("write_tree_checkpoint"));
+  string data;
+  CHECK(checkpoint.SerializeToString(&data));
+
+  rocksdb::WriteOptions opts;
+  opts.sync = true;
+  const rocksdb::Status status(
+      db_->Put(opts, Handle(kMeta), kMetaTreeCheckpointKey, data));
+  CHECK(status.ok()) << "Failed to write tree checkpoint: "
+                     << status.ToString();
+  return this->OK;
+}
+
+
+Database::LookupResult RocksDB::LatestTreeCheckpoint(
+    ct::CompactTreeCheckpoint* result) const {
+  CHECK_NOTNULL(result);
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("latest_tree_checkpoint"));
+  string data;
+  const rocksdb::Status status(db_->Get(
+      rocksdb::ReadOptions(), Handle(kMeta), kMetaTreeCheckpointKey, &data));
+  if (status.IsNotFound()) {
+    return this->NOT_FOUND;
+  }
+  CHECK(status.ok()) << "Failed to read tree checkpoint: "
+                     << status.ToString();
+  CHECK(result->ParseFromString(data));
+  return this->LOOKUP_OK;
+}
+
+
+int64_t RocksDB::TreeSize() const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("tree_size"));
+  lock_guard<mutex> lock(lock_);
+
+  return contiguous_size_;
+}
+
+
+int64_t RocksDB::FirstSequenceNumberSince(uint64_t timestamp) const {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("first_sequence_number_since"));
+  return timestamp_index_.Lookup(*this, timestamp);
+}
+
+
+void RocksDB::AddNotifySTHCallback(
+    const Database::NotifySTHCallback* callback) {
+  unique_lock<mutex> lock(lock_);
+
+  callbacks_.Add(callback);
+
+  ct::SignedTreeHead sth;
+  if (LatestTreeHeadNoLock(&sth) == this->LOOKUP_OK) {
+    lock.unlock();
+    (*callback)(sth);
+  }
+}
+
+
+void RocksDB::RemoveNotifySTHCallback(
+    const Database::NotifySTHCallback* callback) {
+  lock_guard<mutex> lock(lock_);
+
+  callbacks_.Remove(callback);
+}
+
+
+void RocksDB::InitializeNode(const string& node_id) {
+  CHECK(!node_id.empty());
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("initialize_node"));
+  unique_lock<mutex> lock(lock_);
+  string existing_id;
+  if (NodeId(&existing_id) != this->NOT_FOUND) {
+    LOG(FATAL)
+        << "Attempting to initialize DB belonging to node with node_id: "
+        << existing_id;
+  }
+  const rocksdb::Status status(db_->Put(rocksdb::WriteOptions(),
+                                        Handle(kMeta), kMetaNodeIdKey,
+                                        node_id));
+  CHECK(status.ok()) << "Failed to store NodeId: " << status.ToString();
+}
+
+
+Database::LookupResult RocksDB::NodeId(string* node_id) {
+  CHECK_NOTNULL(node_id);
+  const rocksdb::Status status(db_->Get(rocksdb::ReadOptions(), Handle(kMeta),
+                                        kMetaNodeIdKey, node_id));
+
+  if (status.ok()) {
+    return this->LOOKUP_OK;
+  }
+  if (status.IsNotFound()) {
+    return this->NOT_FOUND;
+  }
+  LOG(FATAL) << "Node ID lookup failed: " << status.ToString();
+}
+
+
+void RocksDB::BuildIndex() {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("build_index"));
+  const steady_clock::time_point start(steady_clock::now());
+  // Technically, this should only be called from the constructor, so
+  // this should not be necessarily, but just to be sure...
+  lock_guard<mutex> lock(lock_);
+
+  // The entries below the checkpoint are known to be contiguous, so
+  // only the sequence numbers after it need to be read. As entries are
+  // written along with their leaf hashes and hash mappings, these are
+  // taken from the leaf hashes, which are much smaller, and nothing
+  // needs to be added back.
+  string checkpoint_data;
+  const rocksdb::Status status(db_->Get(rocksdb::ReadOptions(), Handle(kMeta),
+                                        kMetaIndexCheckpointKey,
+                                        &checkpoint_data));
+  if (status.ok()) {
+    index_checkpoint_ = KeyToIndex(checkpoint_data);
+  } else {
+    CHECK(status.IsNotFound()) << "Failed to read index checkpoint: "
+                               << status.ToString();
+  }
+  contiguous_size_ = index_checkpoint_;
+
+  const rocksdb::ReadOptions options(ScanOptions(Database::BULK_SCAN));
+  unique_ptr<rocksdb::Iterator> it(
+      db_->NewIterator(options, Handle(kLeafHashes)));
+  CHECK(it);
+  StartupPhase phase("rocksdb_build_index");
+  int64_t entry_count(0);
+  for (it->Seek(IndexToKey(index_checkpoint_)); it->Valid(); it->Next()) {
+    InsertSequenceNumber(KeyToIndex(it->key()));
+    ++entry_count;
+    phase.AddDone(1);
+  }
+  CHECK(it->status().ok()) << "Failed to read leaf hashes: "
+                           << it->status().ToString();
+  WriteIndexCheckpoint();
+
+  const milliseconds elapsed(
+      duration_cast<milliseconds>(steady_clock::now() - start));
+  build_index_time_ms->Set(elapsed.count());
+  LOG(INFO) << "Indexed " << entry_count << " entries in " << elapsed.count()
+            << " ms";
+
+  // Now find the latest tree head, which sorts last.
+  it.reset(db_->NewIterator(options, Handle(kTreeHeads)));
+  CHECK(it);
+  it->SeekToLast();
+  if (it->Valid()) {
+    latest_timestamp_key_ = it->key().ToString();
+    CHECK_EQ(DeserializeResult::OK,
+             Deserializer::DeserializeUint<uint64_t>(
+                 latest_timestamp_key_, RocksDB::kTimestampBytesIndexed,
+                 &latest_tree_timestamp_));
+  }
+  CHECK(it->status().ok()) << "Failed to read tree heads: "
+                           << it->status().ToString();
+}
+
+
+Database::LookupResult RocksDB::LatestTreeHeadNoLock(
+    ct::SignedTreeHead* result) const {
+  if (latest_tree_timestamp_ == 0) {
+    return this->NOT_FOUND;
+  }
+
+  string tree_data;
+  const rocksdb::Status status(db_->Get(rocksdb::ReadOptions(),
+                                        Handle(kTreeHeads),
+                                        latest_timestamp_key_, &tree_data));
+  CHECK(status.ok()) << "Failed to read latest tree head: "
+                     << status.ToString();
+
+  CHECK(result->ParseFromString(tree_data));
+  CHECK_EQ(result->timestamp(), latest_tree_timestamp_);
+
+  return this->LOOKUP_OK;
+}
+
+
+// This must be called with "lock_" held.
+void RocksDB::WriteIndexCheckpoint() {
+  const rocksdb::Status status(db_->Put(rocksdb::WriteOptions(),
+                                        Handle(kMeta), kMetaIndexCheckpointKey,
+                                        IndexToKey(contiguous_size_)));
+  CHECK(status.ok()) << "Failed to write index checkpoint: "
+                     << status.ToString();
+  index_checkpoint_ = contiguous_size_;
+}
+
+
+// This must be called with "lock_" held.
+void RocksDB::InsertSequenceNumber(int64_t sequence_number) {
+  if (sequence_number == contiguous_size_) {
+    ++contiguous_size_;
+    for (auto i = sparse_entries_.find(contiguous_size_);
+         i != sparse_entries_.end() && *i == contiguous_size_;) {
+      ++contiguous_size_;
+      i = sparse_entries_.erase(i);
+    }
+  } else {
+    // It's not contiguous, put it with the other sparse entries.
+    CHECK(sparse_entries_.insert(sequence_number).second)
+        << "sequence number " << sequence_number << " already assigned.";
+  }
+}
+
+
+}  // namespace cert_trans
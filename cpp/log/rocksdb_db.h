@@ -0,0 +1,143 @@
+#ifndef CERT_TRANS_LOG_ROCKSDB_DB_H_
+#define CERT_TRANS_LOG_ROCKSDB_DB_H_
+
+#include <rocksdb/db.h>
+#include <rocksdb/write_batch.h>
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "log/database.h"
+#include "log/timestamp_index.h"
+#include "proto/ct.pb.h"
+
+namespace cert_trans {
+
+
+// A database kept in RocksDB, which is only built where it is
+// available (HAVE_ROCKSDB).
+//
+// Unlike LevelDB, which keeps everything in one keyspace under
+// different prefixes, each kind of record has a column family of its
+// own, with options to match how it is used: the entries and leaf
+// hashes, which are written in order and read in ranges, have bloom
+// filters on the prefixes of their keys, while the hash mappings, only
+// ever looked up one at a time (and often for hashes which are not
+// there), have them on whole keys. The records of a batch of entries
+// are written atomically across the column families.
+class RocksDB : public Database {
+ public:
+  static const size_t kTimestampBytesIndexed;
+
+  explicit RocksDB(const std::string& dbfile);
+  ~RocksDB();
+  RocksDB(const RocksDB&) = delete;
+  RocksDB& operator=(const RocksDB&) = delete;
+
+  // Implement abstract functions, see database.h for comments.
+  Database::WriteResult CreateSequencedEntry_(
+      const LoggedEntry& logged) override;
+
+  Database::WriteResult CreateSequencedEntries_(
+      const std::vector<const LoggedEntry*>& entries) override;
+
+  Database::LookupResult LookupByHash(const std::string& hash,
+                                      LoggedEntry* result) const override;
+
+  Database::LookupResult LookupByIndex(int64_t sequence_number,
+                                       LoggedEntry* result) const override;
+
+  std::unique_ptr<Database::Iterator> ScanEntries(
+      int64_t start_index) const override;
+
+  void ReadEntries(int64_t start_index, int64_t end_index, size_t max_bytes,
+                   ReadPattern pattern,
+                   std::vector<LoggedEntry>* entries) const override;
+
+  std::unique_ptr<Database::LeafHashIterator> ScanLeafHashes(
+      int64_t start_index) const override;
+
+  Database::WriteResult WriteTreeHead_(const ct::SignedTreeHead& sth) override;
+
+  Database::LookupResult LatestTreeHead(
+      ct::SignedTreeHead* result) const override;
+
+  Database::WriteResult WriteTreeCheckpoint_(
+      const ct::CompactTreeCheckpoint& checkpoint) override;
+
+  Database::LookupResult LatestTreeCheckpoint(
+      ct::CompactTreeCheckpoint* result) const override;
+
+  int64_t TreeSize() const override;
+
+  int64_t FirstSequenceNumberSince(uint64_t timestamp) const override;
+
+  void AddNotifySTHCallback(
+      const Database::NotifySTHCallback* callback) override;
+
+  void RemoveNotifySTHCallback(
+      const Database::NotifySTHCallback* callback) override;
+
+  void InitializeNode(const std::string& node_id) override;
+
+  Database::LookupResult NodeId(std::string* node_id) override;
+
+ private:
+  class Iterator;
+  class LeafHashIterator;
+
+  // The column families, in the order they are opened in.
+  enum ColumnFamily {
+    // The node ID and the checkpoints.
+    kMeta = 0,
+    // The entries, by sequence number.
+    kEntries,
+    // The leaf hashes of the entries, by sequence number.
+    kLeafHashes,
+    // The (lowest) sequence number of each entry hash.
+    kHashes,
+    // The tree heads, by timestamp.
+    kTreeHeads,
+    kNumColumnFamilies,
+  };
+
+  rocksdb::ColumnFamilyHandle* Handle(ColumnFamily column_family) const {
+    return column_families_[column_family];
+  }
+  // Writes the new |entries| in a single batch.
+  Database::WriteResult WriteSequencedEntries(
+      const std::vector<const LoggedEntry*>& entries);
+  void BuildIndex();
+  Database::LookupResult LatestTreeHeadNoLock(
+      ct::SignedTreeHead* result) const;
+  void WriteIndexCheckpoint();
+  void InsertSequenceNumber(int64_t sequence_number);
+
+  mutable std::mutex lock_;
+  std::unique_ptr<rocksdb::DB> db_;
+  // Owned, and released before |db_| is closed.
+  std::vector<rocksdb::ColumnFamilyHandle*> column_families_;
+
+  int64_t contiguous_size_;
+  // The entries below this are contiguous, which is also recorded in
+  // the database.
+  int64_t index_checkpoint_;
+
+  // This is a mapping of the non-contiguous entries of the log (which
+  // can happen while it is being fetched). When entries here become
+  // contiguous with the beginning of the tree, they are removed.
+  std::set<int64_t> sparse_entries_;
+
+  uint64_t latest_tree_timestamp_;
+  std::string latest_timestamp_key_;
+  cert_trans::DatabaseNotifierHelper callbacks_;
+  TimestampIndex timestamp_index_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_ROCKSDB_DB_H_
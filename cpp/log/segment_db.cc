@@ -0,0 +1,1188 @@
+#include "log/segment_db.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "monitoring/latency.h"
+#include "monitoring/monitoring.h"
+#include "monitoring/startup.h"
+#include "proto/ct.pb.h"
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::lock_guard;
+using std::make_pair;
+using std::mutex;
+using std::pair;
+using std::set;
+using std::shared_ptr;
+using std::string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+static Latency<milliseconds, string> latency_by_op_ms(
+    "segmentdb_latency_by_operation_ms", "operation",
+    "Database latency in ms broken out by operation.");
+
+
+static Counter<>* segments_moved(
+    Counter<>::New("segmentdb_segments_moved",
+                   "Number of segments moved to the cold directory."));
+
+
+static Gauge<>* build_index_time_ms(
+    Gauge<>::New("segmentdb_build_index_time_ms",
+                 "Time taken to index the entries when the database was "
+                 "opened, in ms."));
+
+
+const char kMagic[8] = {'C', 'T', 'S', 'E', 'G', 'D', 'B', '1'};
+// The header occupies the first page of each index file, so that the
+// slots that follow it are page-aligned.
+const size_t kHeaderBytes = 4096;
+const char kSegmentPrefix[] = "segment-";
+const char kDataSuffix[] = ".data";
+const char kIndexSuffix[] = ".index";
+const char kTreeHeadsFile[] = "tree_heads";
+const char kNodeIdFile[] = "node_id";
+const char kTreeCheckpointFile[] = "tree_checkpoint";
+// The size of LoggedEntry::Hash() and LeafHash(), SHA-256 digests.
+const size_t kHashBytes = 32;
+// How many entries the iterators read at a time.
+const size_t kScanBatchEntries = 256;
+const size_t kScanBatchBytes = 1 << 20;
+const size_t kLeafHashBatchEntries = 4096;
+// How much is copied at a time when moving a segment.
+const size_t kCopyBytes = 1 << 20;
+const char kTmpSuffix[] = ".tmp";
+
+
+string SegmentFileName(int64_t segment_number, const char* suffix) {
+  char name[64];
+  snprintf(name, sizeof(name), "%s%012" PRId64 "%s", kSegmentPrefix,
+           segment_number, suffix);
+  return name;
+}
+
+
+// Returns whether |name| is the name of an index file, and if so sets
+// |*segment_number|.
+bool ParseIndexFileName(const string& name, int64_t* segment_number) {
+  const size_t prefix_len(strlen(kSegmentPrefix));
+  const size_t suffix_len(strlen(kIndexSuffix));
+  if (name.size() <= prefix_len + suffix_len ||
+      name.compare(0, prefix_len, kSegmentPrefix) != 0 ||
+      name.compare(name.size() - suffix_len, suffix_len, kIndexSuffix) != 0) {
+    return false;
+  }
+  const string number(name.substr(prefix_len,
+                                  name.size() - prefix_len - suffix_len));
+  char* end;
+  errno = 0;
+  *segment_number = strtoll(number.c_str(), &end, 10);
+  return errno == 0 && *end == '\0' && *segment_number >= 0;
+}
+
+
+void ReadFully(int fd, char* buf, size_t size, int64_t offset) {
+  while (size > 0) {
+    const ssize_t ret(pread(fd, buf, size, offset));
+    PCHECK(ret >= 0) << "Failed to read at " << offset;
+    CHECK_GT(ret, 0) << "Unexpected end of file at " << offset;
+    buf += ret;
+    size -= ret;
+    offset += ret;
+  }
+}
+
+
+void WriteFully(int fd, const char* buf, size_t size, int64_t offset) {
+  while (size > 0) {
+    const ssize_t ret(pwrite(fd, buf, size, offset));
+    PCHECK(ret > 0) << "Failed to write at " << offset;
+    buf += ret;
+    size -= ret;
+    offset += ret;
+  }
+}
+
+
+int64_t FileSize(int fd) {
+  struct stat st;
+  PCHECK(fstat(fd, &st) == 0);
+  return st.st_size;
+}
+
+
+// Makes the creation and renaming of files in |dir| durable.
+void SyncDir(const string& dir) {
+  const int fd(open(dir.c_str(), O_RDONLY | O_DIRECTORY));
+  PCHECK(fd >= 0) << "Cannot open " << dir;
+  PCHECK(fsync(fd) == 0) << "Failed to sync " << dir;
+  PCHECK(close(fd) == 0);
+}
+
+
+void CheckIsDir(const string& dir) {
+  struct stat st;
+  PCHECK(stat(dir.c_str(), &st) == 0) << "Cannot stat " << dir;
+  CHECK(S_ISDIR(st.st_mode)) << dir << " is not a directory";
+}
+
+
+set<int64_t> ListSegments(const string& dir) {
+  set<int64_t> segment_numbers;
+  DIR* const d(opendir(dir.c_str()));
+  PCHECK(d) << "Cannot open " << dir;
+  while (const struct dirent* const entry = readdir(d)) {
+    int64_t segment_number;
+    if (ParseIndexFileName(entry->d_name, &segment_number)) {
+      segment_numbers.insert(segment_number);
+    }
+  }
+  PCHECK(closedir(d) == 0);
+  return segment_numbers;
+}
+
+
+// Writes |size| bytes of |data| to a new file at |path|, and syncs it.
+void WriteFile(const string& path, const char* data, size_t size) {
+  const int fd(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+  PCHECK(fd >= 0) << "Cannot create " << path;
+  WriteFully(fd, data, size, 0);
+  PCHECK(fsync(fd) == 0) << "Failed to sync " << path;
+  PCHECK(close(fd) == 0);
+}
+
+
+// Copies the first |size| bytes of |src_fd| to a new file at |path|,
+// and syncs it.
+void CopyFile(int src_fd, int64_t size, const string& path) {
+  const int fd(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644));
+  PCHECK(fd >= 0) << "Cannot create " << path;
+  string buf;
+  for (int64_t offset = 0; offset < size; offset += buf.size()) {
+    buf.resize(std::min<int64_t>(kCopyBytes, size - offset));
+    ReadFully(src_fd, &buf[0], buf.size(), offset);
+    WriteFully(fd, buf.data(), buf.size(), offset);
+  }
+  PCHECK(fsync(fd) == 0) << "Failed to sync " << path;
+  PCHECK(close(fd) == 0);
+  // Reading it all in should not push the newer segments out of the
+  // page cache.
+  posix_fadvise(src_fd, 0, size, POSIX_FADV_DONTNEED);
+}
+
+
+// Returns false if there was no file at |path|.
+bool RemoveFile(const string& path) {
+  if (unlink(path.c_str()) != 0) {
+    PCHECK(errno == ENOENT) << "Failed to remove " << path;
+    return false;
+  }
+  return true;
+}
+
+
+// Replaces the contents of the file |name| in |dir| with |data|,
+// durably, and so that readers see either the old or new contents.
+void ReplaceFile(const string& dir, const char* name, const string& data) {
+  const string path(dir + "/" + name);
+  const string tmp_path(path + kTmpSuffix);
+  WriteFile(tmp_path, data.data(), data.size());
+  PCHECK(rename(tmp_path.c_str(), path.c_str()) == 0)
+      << "Failed to rename " << tmp_path;
+  SyncDir(dir);
+}
+
+
+// Reads the whole file at |path| into |*data|. Returns false if there
+// is no such file.
+bool ReadWholeFile(const string& path, string* data) {
+  const int fd(open(path.c_str(), O_RDONLY));
+  if (fd < 0) {
+    PCHECK(errno == ENOENT) << "Cannot open " << path;
+    return false;
+  }
+  data->assign(FileSize(fd), '\0');
+  ReadFully(fd, &(*data)[0], data->size(), 0);
+  PCHECK(close(fd) == 0);
+  return true;
+}
+
+
+}  // namespace
+
+
+struct SegmentDB::Header {
+  char magic[sizeof(kMagic)];
+  uint64_t segment_entries;
+  // Everything in the data file up to here was synced, along with the
+  // slots pointing to it.
+  uint64_t synced_data_size;
+};
+
+
+// An empty slot has a |size| of zero, which no serialized entry has.
+struct SegmentDB::Slot {
+  uint64_t offset;
+  uint32_t size;
+  uint32_t reserved;
+  char hash[kHashBytes];
+  char leaf_hash[kHashBytes];
+};
+
+
+class SegmentDB::Iterator : public Database::Iterator {
+ public:
+  Iterator(const SegmentDB* db, int64_t start_index)
+      : db_(CHECK_NOTNULL(db)), next_index_(start_index), pos_(0) {
+    CHECK_GE(next_index_, 0);
+  }
+
+  bool GetNextEntry(LoggedEntry* entry) override {
+    CHECK_NOTNULL(entry);
+    if (pos_ == entries_.size()) {
+      entries_.clear();
+      pos_ = 0;
+      int64_t next;
+      {
+        lock_guard<mutex> lock(db_->lock_);
+        next = db_->NextSequenceNumber(next_index_);
+      }
+      if (next < 0) {
+        return false;
+      }
+
+      // Entries are never removed, so there is at least the one found
+      // above. This prefetches the next batch itself, below.
+      db_->ReadEntries(next, next + kScanBatchEntries - 1, kScanBatchBytes,
+                       POINT_READ, &entries_);
+      CHECK(!entries_.empty());
+      next_index_ = entries_.back().sequence_number() + 1;
+      db_->PrefetchEntries(next_index_, kScanBatchBytes);
+    }
+
+    entry->CopyFrom(entries_[pos_++]);
+    return true;
+  }
+
+ private:
+  const SegmentDB* const db_;
+  int64_t next_index_;
+  vector<LoggedEntry> entries_;
+  size_t pos_;
+};
+
+
+class SegmentDB::LeafHashIterator : public Database::LeafHashIterator {
+ public:
+  LeafHashIterator(const SegmentDB* db, int64_t start_index)
+      : db_(CHECK_NOTNULL(db)), next_index_(start_index), pos_(0) {
+    CHECK_GE(next_index_, 0);
+  }
+
+  bool GetNextLeafHash(int64_t* sequence_number, string* leaf_hash) override {
+    CHECK_NOTNULL(sequence_number);
+    CHECK_NOTNULL(leaf_hash);
+    if (pos_ == leaf_hashes_.size()) {
+      leaf_hashes_.clear();
+      pos_ = 0;
+      // The leaf hashes are in the slots, so there is nothing to read
+      // from the data files.
+      lock_guard<mutex> lock(db_->lock_);
+      for (int64_t seq = db_->NextSequenceNumber(next_index_);
+           seq >= 0 && leaf_hashes_.size() < kLeafHashBatchEntries;
+           seq = db_->NextSequenceNumber(seq + 1)) {
+        const Slot* const slot(CHECK_NOTNULL(db_->FindSlot(seq, nullptr)));
+        leaf_hashes_.emplace_back(seq, string(slot->leaf_hash, kHashBytes));
+      }
+      if (leaf_hashes_.empty()) {
+        return false;
+      }
+      next_index_ = leaf_hashes_.back().first + 1;
+    }
+
+    *sequence_number = leaf_hashes_[pos_].first;
+    leaf_hash->swap(leaf_hashes_[pos_].second);
+    ++pos_;
+    return true;
+  }
+
+ private:
+  const SegmentDB* const db_;
+  int64_t next_index_;
+  vector<pair<int64_t, string>> leaf_hashes_;
+  size_t pos_;
+};
+
+
+const int64_t SegmentDB::kDefaultSegmentEntries = 1 << 20;
+
+
+SegmentDB::DataFile::~DataFile() {
+  PCHECK(close(fd) == 0);
+}
+
+
+SegmentDB::SegmentDB(const string& dir, int64_t segment_entries)
+    : SegmentDB(dir, "", 0, segment_entries) {
+}
+
+
+SegmentDB::SegmentDB(const string& dir, const string& cold_dir,
+                     int64_t hot_entries, int64_t segment_entries)
+    : dir_(dir),
+      cold_dir_(cold_dir),
+      hot_entries_(hot_entries),
+      segment_entries_(segment_entries),
+      contiguous_size_(0),
+      id_by_hash_memory_("db_hash_index"),
+      tree_heads_fd_(-1),
+      tree_heads_size_(0),
+      exiting_(false),
+      // Catch up on the segments that became cold while closed.
+      migration_required_(true) {
+  static_assert(sizeof(Header) <= kHeaderBytes, "index file header too big");
+  static_assert(sizeof(Slot) == 16 + 2 * kHashBytes, "unexpected slot size");
+  CHECK_GT(segment_entries_, 0);
+  CHECK_GE(hot_entries_, 0);
+  LOG(INFO) << "Opening " << dir_;
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("open"));
+  CheckIsDir(dir_);
+  if (!cold_dir_.empty()) {
+    CHECK_NE(dir_, cold_dir_);
+    CheckIsDir(cold_dir_);
+  }
+
+  BuildIndex();
+  ReadTreeHeads();
+
+  if (!cold_dir_.empty()) {
+    migration_thread_ = std::thread(&SegmentDB::MigrateSegments, this);
+  }
+}
+
+
+SegmentDB::~SegmentDB() {
+  if (migration_thread_.joinable()) {
+    {
+      lock_guard<mutex> lock(lock_);
+      exiting_ = true;
+    }
+    migration_required_cv_.notify_all();
+    migration_thread_.join();
+  }
+
+  lock_guard<mutex> lock(lock_);
+  SyncSegments();
+  for (auto& segment : segments_) {
+    CloseSegment(segment.second.get());
+  }
+  PCHECK(close(tree_heads_fd_) == 0);
+}
+
+
+Database::WriteResult SegmentDB::CreateSequencedEntry_(
+    const LoggedEntry& logged) {
+  CHECK(logged.has_sequence_number());
+  CHECK_GE(logged.sequence_number(), 0);
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("create_sequenced_entry"));
+
+  string data;
+  CHECK(logged.SerializeToString(&data));
+  CHECK_GT(data.size(), 0U);
+  CHECK_LE(data.size(), UINT32_MAX);
+  const string hash(logged.Hash());
+  CHECK_EQ(hash.size(), kHashBytes);
+  string leaf_hash;
+  CHECK(logged.LeafHash(&leaf_hash));
+  CHECK_EQ(leaf_hash.size(), kHashBytes);
+
+  const int64_t seq(logged.sequence_number());
+  lock_guard<mutex> lock(lock_);
+
+  Location existing;
+  const Slot* const existing_slot(FindSlot(seq, &existing));
+  if (existing_slot) {
+    if (existing.size == data.size() &&
+        memcmp(existing_slot->hash, hash.data(), kHashBytes) == 0) {
+      string existing_data(existing.size, '\0');
+      ReadFully(existing.data->fd, &existing_data[0], existing.size,
+                existing.offset);
+      if (existing_data == data) {
+        return this->OK;
+      }
+    }
+    return this->SEQUENCE_NUMBER_ALREADY_IN_USE;
+  }
+
+  const int64_t segment_number(seq / segment_entries_);
+  Segment* segment;
+  const auto it(segments_.find(segment_number));
+  if (it != segments_.end()) {
+    segment = it->second.get();
+  } else {
+    segment = OpenSegment(segment_number, true, false);
+  }
+
+  WriteFully(segment->data->fd, data.data(), data.size(), segment->data_size);
+
+  // The size goes in last, as it is what makes the slot used.
+  Slot* const slot(&segment->slots[seq % segment_entries_]);
+  memcpy(slot->hash, hash.data(), kHashBytes);
+  memcpy(slot->leaf_hash, leaf_hash.data(), kHashBytes);
+  slot->offset = segment->data_size;
+  slot->size = data.size();
+  segment->data_size += data.size();
+  dirty_segments_.insert(segment_number);
+
+  InsertEntryMapping(seq, hash);
+  timestamp_index_.Add(seq, logged.timestamp());
+
+  return this->OK;
+}
+
+
+Database::LookupResult SegmentDB::LookupByHash(const string& hash,
+                                               LoggedEntry* result) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_hash"));
+  if (hash.size() != kHashBytes) {
+    return this->NOT_FOUND;
+  }
+
+  Location location;
+  {
+    lock_guard<mutex> lock(lock_);
+    vector<int64_t> candidates;
+    id_by_hash_.Find(hash, &candidates);
+
+    // The index only knows about hash prefixes, but the slots have the
+    // whole hashes, lowest sequence number first.
+    vector<int64_t>::const_iterator it(candidates.begin());
+    for (; it != candidates.end(); ++it) {
+      const Slot* const slot(CHECK_NOTNULL(FindSlot(*it, &location)));
+      if (memcmp(slot->hash, hash.data(), kHashBytes) == 0) {
+        break;
+      }
+    }
+    if (it == candidates.end()) {
+      return this->NOT_FOUND;
+    }
+  }
+
+  if (result) {
+    ReadLocation(location, result);
+  }
+  return this->LOOKUP_OK;
+}
+
+
+Database::LookupResult SegmentDB::LookupByIndex(int64_t sequence_number,
+                                                LoggedEntry* result) const {
+  CHECK_GE(sequence_number, 0);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_index"));
+
+  Location location;
+  {
+    lock_guard<mutex> lock(lock_);
+    if (!FindSlot(sequence_number, &location)) {
+      return this->NOT_FOUND;
+    }
+  }
+
+  if (result) {
+    ReadLocation(location, result);
+  }
+  return this->LOOKUP_OK;
+}
+
+
+unique_ptr<Database::Iterator> SegmentDB::ScanEntries(
+    int64_t start_index) const {
+  return unique_ptr<Iterator>(new Iterator(this, start_index));
+}
+
+
+void SegmentDB::ReadEntries(int64_t start_index, int64_t end_index,
+                            size_t max_bytes, ReadPattern pattern,
+                            vector<LoggedEntry>* entries) const {
+  CHECK_GE(start_index, 0);
+  CHECK_NOTNULL(entries);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("read_entries"));
+
+  // The slots have the sizes of the entries, so the whole span can be
+  // worked out up front, and then read without the lock.
+  vector<Location> locations;
+  {
+    lock_guard<mutex> lock(lock_);
+    size_t bytes(0);
+    Location location;
+    for (int64_t seq = start_index;
+         seq <= end_index && FindSlot(seq, &location); ++seq) {
+      if (seq > start_index && bytes + location.size > max_bytes) {
+        break;
+      }
+      bytes += location.size;
+      locations.emplace_back(location);
+    }
+  }
+
+  ReadLocations(locations, entries);
+  // As the Iterator does, have the kernel read as much again while
+  // this span is used.
+  if (pattern == BULK_SCAN && !locations.empty()) {
+    size_t bytes(0);
+    for (const Location& location : locations) {
+      bytes += location.size;
+    }
+    PrefetchEntries(start_index + locations.size(), bytes);
+  }
+}
+
+
+unique_ptr<Database::LeafHashIterator> SegmentDB::ScanLeafHashes(
+    int64_t start_index) const {
+  return unique_ptr<LeafHashIterator>(
+      new LeafHashIterator(this, start_index));
+}
+
+
+Database::WriteResult SegmentDB::WriteTreeHead_(
+    const ct::SignedTreeHead& sth) {
+  CHECK_GE(sth.tree_size(), 0);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("write_tree_head"));
+
+  string data;
+  CHECK(sth.SerializeToString(&data));
+  CHECK_LE(data.size(), UINT32_MAX);
+
+  unique_lock<mutex> lock(lock_);
+  const auto it(tree_heads_.find(sth.timestamp()));
+  if (it != tree_heads_.end()) {
+    string existing_data(it->second.second, '\0');
+    ReadFully(tree_heads_fd_, &existing_data[0], existing_data.size(),
+              it->second.first);
+    if (existing_data == data) {
+      return this->OK;
+    }
+    return this->DUPLICATE_TREE_HEAD_TIMESTAMP;
+  }
+
+  // The entries must be on disk before a tree head covering them.
+  SyncSegments();
+
+  const uint32_t size(data.size());
+  string record(reinterpret_cast<const char*>(&size), sizeof(size));
+  record.append(data);
+  WriteFully(tree_heads_fd_, record.data(), record.size(), tree_heads_size_);
+  PCHECK(fdatasync(tree_heads_fd_) == 0) << "Failed to sync tree heads";
+
+  tree_heads_.emplace(sth.timestamp(),
+                      make_pair(tree_heads_size_ + sizeof(size), data.size()));
+  tree_heads_size_ += record.size();
+  migration_required_ = true;
+
+  lock.unlock();
+  migration_required_cv_.notify_all();
+  callbacks_.Call(sth);
+
+  return this->OK;
+}
+
+
+Database::LookupResult SegmentDB::LatestTreeHead(
+    ct::SignedTreeHead* result) const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("latest_tree_head"));
+  lock_guard<mutex> lock(lock_);
+
+  return LatestTreeHeadNoLock(result);
+}
+
+
+Database::WriteResult SegmentDB::WriteTreeCheckpoint_(
+    const ct::CompactTreeCheckpoint& checkpoint) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("write_tree_checkpoint"));
+  string data;
+  CHECK(checkpoint.SerializeToString(&data));
+
+  lock_guard<mutex> lock(lock_);
+  // The entries must be on disk before a checkpoint covering them.
+  SyncSegments();
+  ReplaceFile(dir_, kTreeCheckpointFile, data);
+  return this->OK;
+}
+
+
+Database::LookupResult SegmentDB::LatestTreeCheckpoint(
+    ct::CompactTreeCheckpoint* result) const {
+  CHECK_NOTNULL(result);
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("latest_tree_checkpoint"));
+  string data;
+  lock_guard<mutex> lock(lock_);
+  if (!ReadWholeFile(dir_ + "/" + kTreeCheckpointFile, &data)) {
+    return this->NOT_FOUND;
+  }
+  CHECK(result->ParseFromString(data));
+  return this->LOOKUP_OK;
+}
+
+
+int64_t SegmentDB::TreeSize() const {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("tree_size"));
+  lock_guard<mutex> lock(lock_);
+
+  return contiguous_size_;
+}
+
+
+int64_t SegmentDB::FirstSequenceNumberSince(uint64_t timestamp) const {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("first_sequence_number_since"));
+  return timestamp_index_.Lookup(*this, timestamp);
+}
+
+
+void SegmentDB::AddNotifySTHCallback(
+    const Database::NotifySTHCallback* callback) {
+  unique_lock<mutex> lock(lock_);
+
+  callbacks_.Add(callback);
+
+  ct::SignedTreeHead sth;
+  if (LatestTreeHeadNoLock(&sth) == this->LOOKUP_OK) {
+    lock.unlock();
+    (*callback)(sth);
+  }
+}
+
+
+void SegmentDB::RemoveNotifySTHCallback(
+    const Database::NotifySTHCallback* callback) {
+  lock_guard<mutex> lock(lock_);
+
+  callbacks_.Remove(callback);
+}
+
+
+void SegmentDB::InitializeNode(const string& node_id) {
+  CHECK(!node_id.empty());
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("initialize_node"));
+  lock_guard<mutex> lock(lock_);
+  string existing_id;
+  if (NodeId(&existing_id) != this->NOT_FOUND) {
+    LOG(FATAL) << "Attempting to initialze DB belonging to node with node_id: "
+               << existing_id;
+  }
+
+  ReplaceFile(dir_, kNodeIdFile, node_id);
+}
+
+
+Database::LookupResult SegmentDB::NodeId(string* node_id) {
+  CHECK_NOTNULL(node_id);
+  return ReadWholeFile(dir_ + "/" + kNodeIdFile, node_id) ? this->LOOKUP_OK
+                                                          : this->NOT_FOUND;
+}
+
+
+size_t SegmentDB::IndexBytes() const {
+  return kHeaderBytes + segment_entries_ * sizeof(Slot);
+}
+
+
+void SegmentDB::BuildIndex() {
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("build_index"));
+  const steady_clock::time_point start(steady_clock::now());
+  // Technically, this should only be called from the constructor, so
+  // this should not be necessarily, but just to be sure...
+  lock_guard<mutex> lock(lock_);
+
+  set<int64_t> segment_numbers(ListSegments(dir_));
+  set<int64_t> cold_segment_numbers;
+  if (!cold_dir_.empty()) {
+    cold_segment_numbers = ListSegments(cold_dir_);
+  }
+  for (const int64_t segment_number : cold_segment_numbers) {
+    // The segment may have been moved, but not removed from |dir_|
+    // yet (the copy is complete once its index file is there).
+    segment_numbers.erase(segment_number);
+    const string path(dir_ + "/" + SegmentFileName(segment_number, ""));
+    // Not short-circuited, as either file can be left.
+    if (RemoveFile(path + kIndexSuffix) | RemoveFile(path + kDataSuffix)) {
+      LOG(INFO) << "Removed segment " << segment_number
+                << " already in " << cold_dir_;
+    }
+  }
+
+  // Only the slots need reading, and all of them are known to point
+  // at complete entries once checked.
+  StartupPhase phase("segmentdb_build_index");
+  phase.SetTotal(segment_numbers.size() + cold_segment_numbers.size());
+  int64_t entry_count(0);
+  for (const int64_t segment_number : segment_numbers) {
+    entry_count += CheckSegment(segment_number,
+                                OpenSegment(segment_number, false, false));
+    phase.AddDone(1);
+  }
+  for (const int64_t segment_number : cold_segment_numbers) {
+    entry_count += CheckSegment(segment_number,
+                                OpenSegment(segment_number, false, true));
+    phase.AddDone(1);
+  }
+  id_by_hash_.Reserve(entry_count);
+  id_by_hash_memory_.Set(id_by_hash_.AllocatedBytes());
+
+  for (const auto& segment : segments_) {
+    const int64_t first_seq(segment.first * segment_entries_);
+    for (int64_t i = 0; i < segment_entries_; ++i) {
+      const Slot& slot(segment.second->slots[i]);
+      if (slot.size > 0) {
+        InsertEntryMapping(first_seq + i, string(slot.hash, kHashBytes));
+      }
+    }
+  }
+
+  const milliseconds elapsed(
+      duration_cast<milliseconds>(steady_clock::now() - start));
+  build_index_time_ms->Set(elapsed.count());
+  LOG(INFO) << "Indexed " << entry_count << " entries in "
+            << segments_.size() << " segments in " << elapsed.count()
+            << " ms";
+}
+
+
+// This must be called with "lock_" held.
+int64_t SegmentDB::CheckSegment(int64_t segment_number, Segment* segment) {
+  const int64_t first_seq(segment_number * segment_entries_);
+  int64_t entry_count(0);
+  for (int64_t i = 0; i < segment_entries_; ++i) {
+    Slot* const slot(&segment->slots[i]);
+    if (slot->size == 0) {
+      continue;
+    }
+
+    // Past the synced part of the data file, the entry or its slot
+    // may have been cut short by a crash.
+    bool complete(slot->offset + slot->size <=
+                  static_cast<uint64_t>(segment->data_size));
+    if (complete &&
+        slot->offset + slot->size > segment->header->synced_data_size) {
+      LoggedEntry logged;
+      string leaf_hash;
+      string data(slot->size, '\0');
+      ReadFully(segment->data->fd, &data[0], data.size(), slot->offset);
+      complete = logged.ParseFromString(data) &&
+                 logged.sequence_number() == first_seq + i &&
+                 logged.Hash() == string(slot->hash, kHashBytes) &&
+                 logged.LeafHash(&leaf_hash) &&
+                 leaf_hash == string(slot->leaf_hash, kHashBytes);
+    }
+
+    if (complete) {
+      ++entry_count;
+      if (slot->offset + slot->size > segment->header->synced_data_size) {
+        // Sync it with the next tree head, so that it can be moved.
+        dirty_segments_.insert(segment_number);
+      }
+    } else {
+      LOG(WARNING) << "Dropping incomplete entry " << first_seq + i;
+      memset(slot, 0, sizeof(*slot));
+      dirty_segments_.insert(segment_number);
+    }
+  }
+  return entry_count;
+}
+
+
+// This must be called with "lock_" held.
+SegmentDB::Segment* SegmentDB::OpenSegment(int64_t segment_number,
+                                           bool create, bool cold) {
+  CHECK(segments_.find(segment_number) == segments_.end());
+  unique_ptr<Segment> segment(MapSegment(segment_number, create, cold));
+  Segment* const ret(segment.get());
+  segments_.emplace(segment_number, std::move(segment));
+  return ret;
+}
+
+
+unique_ptr<SegmentDB::Segment> SegmentDB::MapSegment(int64_t segment_number,
+                                                     bool create,
+                                                     bool cold) const {
+  const string& dir(cold ? cold_dir_ : dir_);
+  const string data_path(dir + "/" +
+                         SegmentFileName(segment_number, kDataSuffix));
+  const string index_path(dir + "/" +
+                          SegmentFileName(segment_number, kIndexSuffix));
+  const int flags(O_RDWR | (create ? O_CREAT | O_EXCL : 0));
+
+  unique_ptr<Segment> segment(new Segment);
+  segment->cold = cold;
+  const int data_fd(open(data_path.c_str(), flags, 0644));
+  PCHECK(data_fd >= 0) << "Failed to open " << data_path;
+  segment->data.reset(new DataFile(data_fd));
+  segment->data_size = FileSize(data_fd);
+
+  const int index_fd(open(index_path.c_str(), flags, 0644));
+  PCHECK(index_fd >= 0) << "Failed to open " << index_path;
+  if (create) {
+    PCHECK(ftruncate(index_fd, IndexBytes()) == 0) << "Failed to size "
+                                                   << index_path;
+  }
+  CHECK_EQ(static_cast<int64_t>(IndexBytes()), FileSize(index_fd))
+      << index_path << " has the wrong size";
+  void* const index(mmap(nullptr, IndexBytes(), PROT_READ | PROT_WRITE,
+                         MAP_SHARED, index_fd, 0));
+  PCHECK(index != MAP_FAILED) << "Failed to map " << index_path;
+  PCHECK(close(index_fd) == 0);
+  segment->header = static_cast<Header*>(index);
+  segment->slots = reinterpret_cast<Slot*>(static_cast<char*>(index) +
+                                           kHeaderBytes);
+
+  if (create) {
+    memcpy(segment->header->magic, kMagic, sizeof(kMagic));
+    segment->header->segment_entries = segment_entries_;
+    segment->header->synced_data_size = 0;
+    SyncDir(dir);
+  }
+  CHECK_EQ(0, memcmp(segment->header->magic, kMagic, sizeof(kMagic)))
+      << index_path << " is not a segment index file";
+  CHECK_EQ(static_cast<uint64_t>(segment_entries_),
+           segment->header->segment_entries)
+      << index_path << " has the wrong number of entries per segment";
+
+  return segment;
+}
+
+
+// Reads still going on may keep the data file open a little longer.
+void SegmentDB::CloseSegment(Segment* segment) const {
+  PCHECK(munmap(segment->header, IndexBytes()) == 0);
+  segment->header = nullptr;
+  segment->slots = nullptr;
+  segment->data.reset();
+}
+
+
+// This must be called with "lock_" held.
+const SegmentDB::Slot* SegmentDB::FindSlot(int64_t sequence_number,
+                                           Location* location) const {
+  const auto it(segments_.find(sequence_number / segment_entries_));
+  if (it == segments_.end()) {
+    return nullptr;
+  }
+  const Slot* const slot(
+      &it->second->slots[sequence_number % segment_entries_]);
+  if (slot->size == 0) {
+    return nullptr;
+  }
+
+  if (location) {
+    location->sequence_number = sequence_number;
+    location->data = it->second->data;
+    location->offset = slot->offset;
+    location->size = slot->size;
+  }
+  return slot;
+}
+
+
+// This must be called with "lock_" held.
+int64_t SegmentDB::NextSequenceNumber(int64_t sequence_number) const {
+  if (sequence_number < contiguous_size_) {
+    return sequence_number;
+  }
+  const set<int64_t>::const_iterator it(
+      sparse_entries_.lower_bound(sequence_number));
+  return it == sparse_entries_.end() ? -1 : *it;
+}
+
+
+void SegmentDB::ReadLocation(const Location& location,
+                             LoggedEntry* entry) const {
+  string data(location.size, '\0');
+  ReadFully(location.data->fd, &data[0], data.size(), location.offset);
+  CHECK(entry->ParseFromString(data)) << "failed to parse entry "
+                                      << location.sequence_number;
+  CHECK_EQ(entry->sequence_number(), location.sequence_number);
+}
+
+
+void SegmentDB::ReadLocations(const vector<Location>& locations,
+                              vector<LoggedEntry>* entries) const {
+  string data;
+  for (size_t begin = 0; begin < locations.size();) {
+    // Entries written one after the other are next to one another in
+    // the data file, so they come in a single read.
+    size_t end(begin + 1);
+    size_t size(locations[begin].size);
+    while (end < locations.size() &&
+           locations[end].data == locations[begin].data &&
+           locations[end].offset == locations[begin].offset +
+                                        static_cast<int64_t>(size)) {
+      size += locations[end].size;
+      ++end;
+    }
+
+    data.resize(size);
+    ReadFully(locations[begin].data->fd, &data[0], size,
+              locations[begin].offset);
+    size_t offset(0);
+    for (size_t i = begin; i < end; ++i) {
+      entries->emplace_back();
+      CHECK(entries->back().ParseFromArray(data.data() + offset,
+                                           locations[i].size))
+          << "failed to parse entry " << locations[i].sequence_number;
+      CHECK_EQ(entries->back().sequence_number(),
+               locations[i].sequence_number)
+          << "unexpected sequence_number";
+      offset += locations[i].size;
+    }
+    begin = end;
+  }
+}
+
+
+void SegmentDB::PrefetchEntries(int64_t start_index, size_t max_bytes) const {
+  shared_ptr<const DataFile> data;
+  int64_t begin, end;
+  {
+    lock_guard<mutex> lock(lock_);
+    const auto it(segments_.find(start_index / segment_entries_));
+    if (it == segments_.end() || !it->second->cold) {
+      // The newer segments are mostly in the page cache already.
+      return;
+    }
+    const Segment& segment(*it->second);
+    const int64_t first_seq(it->first * segment_entries_);
+    const Slot* slot(&segment.slots[start_index - first_seq]);
+    if (slot->size == 0) {
+      return;
+    }
+    data = segment.data;
+    begin = slot->offset;
+    end = begin + slot->size;
+    // Cold segments are complete, and were written in order for the
+    // most part, so a span of slots is usually a span of the file.
+    for (int64_t i = start_index - first_seq + 1;
+         i < segment_entries_ && static_cast<size_t>(end - begin) < max_bytes;
+         ++i) {
+      slot = &segment.slots[i];
+      if (slot->offset != static_cast<uint64_t>(end)) {
+        break;
+      }
+      end += slot->size;
+    }
+  }
+
+  posix_fadvise(data->fd, begin, end - begin, POSIX_FADV_WILLNEED);
+}
+
+
+// This must be called with "lock_" held.
+void SegmentDB::SyncSegments() {
+  for (const int64_t segment_number : dirty_segments_) {
+    Segment* const segment(segments_.at(segment_number).get());
+    // The data first, then the slots pointing to it.
+    PCHECK(fdatasync(segment->data->fd) == 0) << "Failed to sync segment "
+                                             << segment_number;
+    segment->header->synced_data_size = segment->data_size;
+    PCHECK(msync(segment->header, IndexBytes(), MS_SYNC) == 0)
+        << "Failed to sync segment index " << segment_number;
+  }
+  dirty_segments_.clear();
+}
+
+
+// This must be called from the constructor.
+void SegmentDB::ReadTreeHeads() {
+  const string path(dir_ + "/" + kTreeHeadsFile);
+  tree_heads_fd_ = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  PCHECK(tree_heads_fd_ >= 0) << "Failed to open " << path;
+
+  string data(FileSize(tree_heads_fd_), '\0');
+  ReadFully(tree_heads_fd_, &data[0], data.size(), 0);
+  ct::SignedTreeHead sth;
+  uint32_t size;
+  while (data.size() - tree_heads_size_ >= sizeof(size)) {
+    memcpy(&size, data.data() + tree_heads_size_, sizeof(size));
+    const int64_t offset(tree_heads_size_ + sizeof(size));
+    if (data.size() - offset < size ||
+        !sth.ParseFromArray(data.data() + offset, size)) {
+      break;
+    }
+    CHECK(tree_heads_.emplace(sth.timestamp(), make_pair(offset, size))
+              .second)
+        << "Duplicate tree head timestamp " << sth.timestamp();
+    tree_heads_size_ = offset + size;
+  }
+
+  if (tree_heads_size_ < static_cast<int64_t>(data.size())) {
+    // Written after the last sync; the write was never acknowledged.
+    LOG(WARNING) << "Dropping incomplete tree head at " << tree_heads_size_
+                 << " in " << path;
+    PCHECK(ftruncate(tree_heads_fd_, tree_heads_size_) == 0);
+  }
+  VLOG(1) << "Read " << tree_heads_.size() << " tree heads";
+}
+
+
+Database::LookupResult SegmentDB::LatestTreeHeadNoLock(
+    ct::SignedTreeHead* result) const {
+  if (tree_heads_.empty()) {
+    return this->NOT_FOUND;
+  }
+
+  const auto& latest(*tree_heads_.rbegin());
+  string data(latest.second.second, '\0');
+  ReadFully(tree_heads_fd_, &data[0], data.size(), latest.second.first);
+  CHECK(result->ParseFromString(data));
+  CHECK_EQ(result->timestamp(), latest.first);
+
+  return this->LOOKUP_OK;
+}
+
+
+void SegmentDB::InsertEntryMapping(int64_t sequence_number,
+                                   const string& hash) {
+  // Duplicate hashes get an entry each, and lookups return the one
+  // with the lowest sequence number.
+  id_by_hash_.Insert(hash, sequence_number);
+  id_by_hash_memory_.Set(id_by_hash_.AllocatedBytes());
+
+  if (sequence_number == contiguous_size_) {
+    ++contiguous_size_;
+    for (auto i = sparse_entries_.find(contiguous_size_);
+         i != sparse_entries_.end() && *i == contiguous_size_;) {
+      ++contiguous_size_;
+      i = sparse_entries_.erase(i);
+    }
+  } else {
+    // It's not contiguous, put it with the other sparse entries.
+    CHECK(sparse_entries_.insert(sequence_number).second)
+        << "sequence number " << sequence_number << " already assigned.";
+  }
+}
+
+
+// This must be called with "lock_" held.
+int64_t SegmentDB::NextColdSegment() const {
+  for (const auto& segment : segments_) {
+    if (segment.second->cold) {
+      continue;
+    }
+    // Segments only get moved once they are full, so that they are never
+    // written to again, and synced.
+    const int64_t end((segment.first + 1) * segment_entries_);
+    if (end > contiguous_size_ - hot_entries_) {
+      return -1;
+    }
+    if (dirty_segments_.count(segment.first) == 0 &&
+        segment.second->header->synced_data_size ==
+            static_cast<uint64_t>(segment.second->data_size)) {
+      return segment.first;
+    }
+  }
+  return -1;
+}
+
+
+void SegmentDB::MoveToColdDir(int64_t segment_number) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("move_to_cold_dir"));
+  const string data_name(SegmentFileName(segment_number, kDataSuffix));
+  const string index_name(SegmentFileName(segment_number, kIndexSuffix));
+
+  // The segment is full, so nothing changes it while it is copied, and
+  // only this thread unmaps it.
+  shared_ptr<const DataFile> data;
+  int64_t data_size;
+  const Header* header;
+  {
+    lock_guard<mutex> lock(lock_);
+    const Segment* const segment(segments_.at(segment_number).get());
+    CHECK(!segment->cold);
+    data = segment->data;
+    data_size = segment->data_size;
+    header = segment->header;
+  }
+
+  // The index file goes in last, as it is what makes the copy used
+  // when the database is opened again.
+  const string data_path(cold_dir_ + "/" + data_name);
+  const string index_path(cold_dir_ + "/" + index_name);
+  CopyFile(data->fd, data_size, data_path + kTmpSuffix);
+  WriteFile(index_path + kTmpSuffix, reinterpret_cast<const char*>(header),
+            IndexBytes());
+  PCHECK(rename((data_path + kTmpSuffix).c_str(), data_path.c_str()) == 0)
+      << "Failed to rename " << data_path << kTmpSuffix;
+  PCHECK(rename((index_path + kTmpSuffix).c_str(), index_path.c_str()) == 0)
+      << "Failed to rename " << index_path << kTmpSuffix;
+  SyncDir(cold_dir_);
+
+  {
+    lock_guard<mutex> lock(lock_);
+    unique_ptr<Segment> cold(MapSegment(segment_number, false, true));
+    CHECK_EQ(data_size, cold->data_size);
+    unique_ptr<Segment>& segment(segments_.at(segment_number));
+    CloseSegment(segment.get());
+    segment = std::move(cold);
+  }
+
+  CHECK(RemoveFile(dir_ + "/" + index_name));
+  CHECK(RemoveFile(dir_ + "/" + data_name));
+  SyncDir(dir_);
+  segments_moved->Increment();
+  LOG(INFO) << "Moved segment " << segment_number << " to " << cold_dir_;
+}
+
+
+// Thread entry point for migration_thread_.
+void SegmentDB::MigrateSegments() {
+  unique_lock<mutex> lock(lock_);
+  while (true) {
+    migration_required_cv_.wait(lock, [this]() {
+      return migration_required_ || exiting_;
+    });
+    if (exiting_) {
+      VLOG(1) << "SegmentDB migration thread returning.";
+      return;
+    }
+    migration_required_ = false;
+
+    for (int64_t segment_number = NextColdSegment();
+         segment_number >= 0 && !exiting_;
+         segment_number = NextColdSegment()) {
+      lock.unlock();
+      MoveToColdDir(segment_number);
+      lock.lock();
+    }
+  }
+}
+
+
+}  // namespace cert_trans
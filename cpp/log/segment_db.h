@@ -0,0 +1,236 @@
+#ifndef CERT_TRANS_LOG_SEGMENT_DB_H_
+#define CERT_TRANS_LOG_SEGMENT_DB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "log/database.h"
+#include "log/hash_prefix_index.h"
+#include "log/timestamp_index.h"
+#include "monitoring/memory.h"
+#include "proto/ct.pb.h"
+
+namespace cert_trans {
+
+
+// Database interface that packs the entries into a few large segment
+// files in a directory, rather than a file each.
+//
+// Each segment covers |segment_entries| consecutive sequence numbers,
+// and is made of a data file, to which the serialized entries are
+// appended, and an index file, mmap()ed, with a fixed-size slot per
+// sequence number giving the offset and size of the entry in the data
+// file, along with its hash and Merkle tree leaf hash. Writes are
+// therefore sequential, a lookup is a single pread(), and opening the
+// database only reads the index files. A segment is never written to
+// again once all of its entries are in.
+//
+// The slots are filled in after the data they point to is written,
+// and the segments written to are synced before a tree head is
+// stored, so the entries covered by a tree head survive a crash.
+// Entries written since the last tree head may be lost, in which case
+// they are dropped when the database is opened again.
+//
+// Optionally, the segments can be kept in two tiers: only the newest
+// ones, which take nearly all the reads, stay in |dir|, and the older
+// ones are moved, once all of their entries are in and covered by a
+// tree head, to |cold_dir|, which can be on slower, cheaper storage.
+// They are moved by a background thread, and reads go to whichever
+// tier a segment is in, so this does not change the interface.
+//
+// Only one instance may have a given directory open at a time.
+class SegmentDB : public Database {
+ public:
+  static const int64_t kDefaultSegmentEntries;
+
+  // |dir| must exist, and is filled with the segments and tree heads.
+  // |segment_entries| must be the same every time a directory is
+  // opened.
+  explicit SegmentDB(const std::string& dir,
+                     int64_t segment_entries = kDefaultSegmentEntries);
+  // As above, but moving the segments that only have entries older
+  // than the |hot_entries| newest ones to |cold_dir|, which must exist.
+  SegmentDB(const std::string& dir, const std::string& cold_dir,
+            int64_t hot_entries,
+            int64_t segment_entries = kDefaultSegmentEntries);
+  ~SegmentDB();
+  SegmentDB(const SegmentDB&) = delete;
+  SegmentDB& operator=(const SegmentDB&) = delete;
+
+  // Implement abstract functions, see database.h for comments.
+  Database::WriteResult CreateSequencedEntry_(
+      const LoggedEntry& logged) override;
+
+  Database::LookupResult LookupByHash(const std::string& hash,
+                                      LoggedEntry* result) const override;
+
+  Database::LookupResult LookupByIndex(int64_t sequence_number,
+                                       LoggedEntry* result) const override;
+
+  std::unique_ptr<Database::Iterator> ScanEntries(
+      int64_t start_index) const override;
+
+  void ReadEntries(int64_t start_index, int64_t end_index, size_t max_bytes,
+                   ReadPattern pattern,
+                   std::vector<LoggedEntry>* entries) const override;
+
+  std::unique_ptr<Database::LeafHashIterator> ScanLeafHashes(
+      int64_t start_index) const override;
+
+  Database::WriteResult WriteTreeHead_(const ct::SignedTreeHead& sth) override;
+
+  Database::LookupResult LatestTreeHead(
+      ct::SignedTreeHead* result) const override;
+
+  Database::WriteResult WriteTreeCheckpoint_(
+      const ct::CompactTreeCheckpoint& checkpoint) override;
+
+  Database::LookupResult LatestTreeCheckpoint(
+      ct::CompactTreeCheckpoint* result) const override;
+
+  int64_t TreeSize() const override;
+
+  int64_t FirstSequenceNumberSince(uint64_t timestamp) const override;
+
+  void AddNotifySTHCallback(
+      const Database::NotifySTHCallback* callback) override;
+
+  void RemoveNotifySTHCallback(
+      const Database::NotifySTHCallback* callback) override;
+
+  void InitializeNode(const std::string& node_id) override;
+
+  Database::LookupResult NodeId(std::string* node_id) override;
+
+ private:
+  class Iterator;
+  class LeafHashIterator;
+  struct Header;
+  struct Slot;
+
+  // Closes the file when the last reference goes, so that reads can
+  // keep using a segment's data file after it was moved.
+  struct DataFile {
+    explicit DataFile(int fd) : fd(fd) {
+    }
+    ~DataFile();
+    DataFile(const DataFile&) = delete;
+    DataFile& operator=(const DataFile&) = delete;
+
+    const int fd;
+  };
+
+  struct Segment {
+    std::shared_ptr<const DataFile> data;
+    // Where the next entry goes in the data file.
+    int64_t data_size;
+    // The whole index file, which does not need to be kept open.
+    Header* header;
+    // |segment_entries_| of them, following |header|.
+    Slot* slots;
+    // Whether it is in |cold_dir_|.
+    bool cold;
+  };
+
+  // Where an entry is, for reading it without |lock_|.
+  struct Location {
+    int64_t sequence_number;
+    std::shared_ptr<const DataFile> data;
+    int64_t offset;
+    size_t size;
+  };
+
+  size_t IndexBytes() const;
+  // Opens all the segments in |dir_| (and |cold_dir_|) and indexes
+  // their entries.
+  void BuildIndex();
+  // Checks the entries of |segment| that were not synced yet, and
+  // drops those that did not make it to the disk in full. Returns the
+  // number of entries left.
+  int64_t CheckSegment(int64_t segment_number, Segment* segment);
+  Segment* OpenSegment(int64_t segment_number, bool create, bool cold);
+  std::unique_ptr<Segment> MapSegment(int64_t segment_number, bool create,
+                                      bool cold) const;
+  void CloseSegment(Segment* segment) const;
+  // Returns the slot of |sequence_number| if it holds an entry, and
+  // where that entry is in |*location| (if not nullptr), or nullptr.
+  // This must be called with |lock_| held.
+  const Slot* FindSlot(int64_t sequence_number, Location* location) const;
+  // Returns the lowest sequence number of an entry from
+  // |sequence_number| on, or -1 if there are none. This must be
+  // called with |lock_| held.
+  int64_t NextSequenceNumber(int64_t sequence_number) const;
+  void ReadLocation(const Location& location, LoggedEntry* entry) const;
+  // Reads the entries at |locations|, which are in sequence number
+  // order, coalescing those next to one another in the same file.
+  void ReadLocations(const std::vector<Location>& locations,
+                     std::vector<LoggedEntry>* entries) const;
+  // Tells the kernel to start reading the entries from |start_index|
+  // on, up to |max_bytes| of them, if they are in a cold segment, so
+  // that sequential scans of those do not wait on every read.
+  void PrefetchEntries(int64_t start_index, size_t max_bytes) const;
+  // Flushes the segments written since the last call, then the tree
+  // heads can be written. This must be called with |lock_| held.
+  void SyncSegments();
+  void ReadTreeHeads();
+  Database::LookupResult LatestTreeHeadNoLock(
+      ct::SignedTreeHead* result) const;
+  void InsertEntryMapping(int64_t sequence_number, const std::string& hash);
+  // Returns the number of the oldest segment that should be moved to
+  // |cold_dir_|, or -1 if there are none. This must be called with
+  // |lock_| held.
+  int64_t NextColdSegment() const;
+  // Copies the segment to |cold_dir_|, then switches over to the copy.
+  void MoveToColdDir(int64_t segment_number);
+  // Thread entry point for |migration_thread_|.
+  void MigrateSegments();
+
+  const std::string dir_;
+  const std::string cold_dir_;
+  const int64_t hot_entries_;
+  const int64_t segment_entries_;
+
+  mutable std::mutex lock_;
+
+  // By segment number (sequence number / |segment_entries_|). There can
+  // be gaps, when entries are not written in order.
+  std::map<int64_t, std::unique_ptr<Segment>> segments_;
+  // The segments written to since the last SyncSegments().
+  std::set<int64_t> dirty_segments_;
+
+  int64_t contiguous_size_;
+  HashPrefixIndex id_by_hash_;
+  MemoryAccount id_by_hash_memory_;
+  // This is a mapping of the non-contiguous entries of the log (which
+  // can happen while it is being fetched). When entries here become
+  // contiguous with the head of the tree they'll be removed.
+  std::set<int64_t> sparse_entries_;
+
+  // The tree heads are appended to a single file, and indexed by
+  // timestamp, with where their data starts and its size.
+  int tree_heads_fd_;
+  int64_t tree_heads_size_;
+  std::map<uint64_t, std::pair<int64_t, size_t>> tree_heads_;
+
+  DatabaseNotifierHelper callbacks_;
+  TimestampIndex timestamp_index_;
+
+  bool exiting_;
+  bool migration_required_;
+  std::condition_variable migration_required_cv_;
+  std::thread migration_thread_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_SEGMENT_DB_H_
@@ -0,0 +1,293 @@
+#include <fcntl.h>
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "log/logged_entry.h"
+#include "log/segment_db.h"
+#include "log/test_signer.h"
+#include "proto/cert_serializer.h"
+#include "proto/ct.pb.h"
+#include "util/test_db.h"
+#include "util/testing.h"
+
+namespace {
+
+using cert_trans::Database;
+using cert_trans::LoggedEntry;
+using cert_trans::SegmentDB;
+using ct::SignedTreeHead;
+using std::chrono::milliseconds;
+using std::string;
+using std::this_thread::sleep_for;
+using std::unique_ptr;
+using std::vector;
+
+// Small enough for the tests to span several segments.
+const int64_t kSegmentEntries = 16;
+
+class SegmentDBTest : public ::testing::Test {
+ protected:
+  unique_ptr<SegmentDB> OpenDB() {
+    return unique_ptr<SegmentDB>(
+        new SegmentDB(tmp_.TmpStorageDir(), kSegmentEntries));
+  }
+
+  // Writes entries with sequence numbers [begin, end) to |db|, and
+  // keeps them in |entries_|.
+  void CreateEntries(SegmentDB* db, int64_t begin, int64_t end) {
+    for (int64_t seq = begin; seq < end; ++seq) {
+      entries_.emplace_back();
+      test_signer_.CreateUnique(&entries_.back());
+      entries_.back().set_sequence_number(seq);
+      ASSERT_EQ(Database::OK, db->CreateSequencedEntry(entries_.back()));
+    }
+  }
+
+  void ExpectEntries(const SegmentDB& db) {
+    for (const LoggedEntry& entry : entries_) {
+      LoggedEntry lookup;
+      ASSERT_EQ(Database::LOOKUP_OK,
+                db.LookupByIndex(entry.sequence_number(), &lookup));
+      TestSigner::TestEqualLoggedCerts(entry, lookup);
+      ASSERT_EQ(Database::LOOKUP_OK, db.LookupByHash(entry.Hash(), &lookup));
+      EXPECT_EQ(entry.sequence_number(), lookup.sequence_number());
+    }
+  }
+
+  unique_ptr<SegmentDB> OpenTieredDB() {
+    for (const string& dir : {HotDir(), ColdDir()}) {
+      if (access(dir.c_str(), F_OK) != 0) {
+        CHECK_ERR(mkdir(dir.c_str(), 0700));
+      }
+    }
+    return unique_ptr<SegmentDB>(
+        new SegmentDB(HotDir(), ColdDir(), kHotEntries, kSegmentEntries));
+  }
+
+  string HotDir() const {
+    return tmp_.TmpStorageDir() + "/hot";
+  }
+
+  string ColdDir() const {
+    return tmp_.TmpStorageDir() + "/cold";
+  }
+
+  static string SegmentPath(const string& dir, int64_t segment_number,
+                            const char* suffix) {
+    char name[64];
+    snprintf(name, sizeof(name), "/segment-%012lld.%s",
+             static_cast<long long>(segment_number), suffix);
+    return dir + name;
+  }
+
+  string DataPath(int64_t segment_number) const {
+    return SegmentPath(tmp_.TmpStorageDir(), segment_number, "data");
+  }
+
+  // Waits for segment |segment_number| to be moved to the cold
+  // directory, and removed from the hot one.
+  void WaitForColdSegment(int64_t segment_number) {
+    const string hot_index(SegmentPath(HotDir(), segment_number, "index"));
+    for (int i = 0; i < 1000 && access(hot_index.c_str(), F_OK) == 0; ++i) {
+      sleep_for(milliseconds(10));
+    }
+    ASSERT_NE(0, access(hot_index.c_str(), F_OK));
+    ASSERT_EQ(0, access(SegmentPath(ColdDir(), segment_number, "index")
+                            .c_str(),
+                        F_OK));
+  }
+
+  // Entries within these of the tree size stay in the hot directory.
+  static const int64_t kHotEntries = 2 * kSegmentEntries;
+
+  TmpStorage tmp_;
+  TestSigner test_signer_;
+  vector<LoggedEntry> entries_;
+};
+
+TEST_F(SegmentDBTest, Reopen) {
+  const int64_t kCount = 5 * kSegmentEntries + 3;
+  SignedTreeHead sth;
+  {
+    unique_ptr<SegmentDB> db(OpenDB());
+    CreateEntries(db.get(), 0, kCount);
+    // Out of order, and leaving whole segments out.
+    CreateEntries(db.get(), 10 * kSegmentEntries, 10 * kSegmentEntries + 2);
+    test_signer_.CreateUnique(&sth);
+    EXPECT_EQ(Database::OK, db->WriteTreeHead(sth));
+    db->InitializeNode("node");
+  }
+
+  unique_ptr<SegmentDB> db(OpenDB());
+  EXPECT_EQ(kCount, db->TreeSize());
+  ExpectEntries(*db);
+
+  SignedTreeHead latest;
+  EXPECT_EQ(Database::LOOKUP_OK, db->LatestTreeHead(&latest));
+  TestSigner::TestEqualTreeHeads(sth, latest);
+  string node_id;
+  EXPECT_EQ(Database::LOOKUP_OK, db->NodeId(&node_id));
+  EXPECT_EQ("node", node_id);
+
+  // Reads go across segments.
+  vector<LoggedEntry> read;
+  db->ReadEntries(kSegmentEntries - 2, kCount + 10, 1 << 20,
+                  Database::POINT_READ, &read);
+  ASSERT_EQ(static_cast<size_t>(kCount - kSegmentEntries + 2), read.size());
+  EXPECT_EQ(kCount - 1, read.back().sequence_number());
+
+  int64_t count(0);
+  int64_t seq;
+  string leaf_hash;
+  const unique_ptr<Database::LeafHashIterator> it(db->ScanLeafHashes(0));
+  while (it->GetNextLeafHash(&seq, &leaf_hash)) {
+    ASSERT_LT(static_cast<size_t>(count), entries_.size());
+    EXPECT_EQ(entries_[count].sequence_number(), seq);
+    string expected;
+    ASSERT_TRUE(entries_[count].LeafHash(&expected));
+    EXPECT_EQ(expected, leaf_hash);
+    ++count;
+  }
+  EXPECT_EQ(static_cast<int64_t>(entries_.size()), count);
+}
+
+TEST_F(SegmentDBTest, DropsIncompleteEntries) {
+  {
+    unique_ptr<SegmentDB> db(OpenDB());
+    CreateEntries(db.get(), 0, kSegmentEntries + 4);
+  }
+  // Cut the last entry short, as a crash could have.
+  const int fd(open(DataPath(1).c_str(), O_RDWR));
+  ASSERT_GE(fd, 0);
+  const off_t size(lseek(fd, 0, SEEK_END));
+  ASSERT_EQ(0, ftruncate(fd, size - 1));
+  close(fd);
+  entries_.pop_back();
+
+  {
+    unique_ptr<SegmentDB> db(OpenDB());
+    EXPECT_EQ(kSegmentEntries + 3, db->TreeSize());
+    EXPECT_EQ(Database::NOT_FOUND,
+              db->LookupByIndex(kSegmentEntries + 3, nullptr));
+    ExpectEntries(*db);
+
+    // The sequence number can be used again.
+    CreateEntries(db.get(), kSegmentEntries + 3, kSegmentEntries + 5);
+  }
+
+  unique_ptr<SegmentDB> db(OpenDB());
+  EXPECT_EQ(kSegmentEntries + 5, db->TreeSize());
+  ExpectEntries(*db);
+}
+
+TEST_F(SegmentDBTest, DropsIncompleteTreeHead) {
+  SignedTreeHead sth;
+  {
+    unique_ptr<SegmentDB> db(OpenDB());
+    test_signer_.CreateUnique(&sth);
+    EXPECT_EQ(Database::OK, db->WriteTreeHead(sth));
+  }
+  // Half a length prefix.
+  const string path(tmp_.TmpStorageDir() + "/tree_heads");
+  const int fd(open(path.c_str(), O_WRONLY | O_APPEND));
+  ASSERT_GE(fd, 0);
+  ASSERT_EQ(2, write(fd, "\x10\x00", 2));
+  close(fd);
+
+  SignedTreeHead newer;
+  {
+    unique_ptr<SegmentDB> db(OpenDB());
+    SignedTreeHead latest;
+    EXPECT_EQ(Database::LOOKUP_OK, db->LatestTreeHead(&latest));
+    TestSigner::TestEqualTreeHeads(sth, latest);
+
+    test_signer_.CreateUnique(&newer);
+    newer.set_timestamp(sth.timestamp() + 1);
+    EXPECT_EQ(Database::OK, db->WriteTreeHead(newer));
+  }
+
+  unique_ptr<SegmentDB> db(OpenDB());
+  SignedTreeHead latest;
+  EXPECT_EQ(Database::LOOKUP_OK, db->LatestTreeHead(&latest));
+  TestSigner::TestEqualTreeHeads(newer, latest);
+  // The first one is still there.
+  SignedTreeHead other(sth);
+  other.set_tree_size(sth.tree_size() + 1);
+  EXPECT_EQ(Database::DUPLICATE_TREE_HEAD_TIMESTAMP, db->WriteTreeHead(other));
+}
+
+TEST_F(SegmentDBTest, MovesOldSegmentsToColdDir) {
+  const int64_t kCount = 5 * kSegmentEntries + 3;
+  {
+    unique_ptr<SegmentDB> db(OpenTieredDB());
+    CreateEntries(db.get(), 0, kCount);
+    // Entries are only moved once a tree head covers them.
+    SignedTreeHead sth;
+    test_signer_.CreateUnique(&sth);
+    EXPECT_EQ(Database::OK, db->WriteTreeHead(sth));
+
+    // Only the segments with entries older than the kHotEntries newest
+    // ones move.
+    WaitForColdSegment(0);
+    WaitForColdSegment(1);
+    WaitForColdSegment(2);
+    ExpectEntries(*db);
+    vector<LoggedEntry> read;
+    db->ReadEntries(0, kCount, 1 << 20, Database::BULK_SCAN, &read);
+    EXPECT_EQ(static_cast<size_t>(kCount), read.size());
+  }
+  EXPECT_EQ(0, access(SegmentPath(HotDir(), 3, "index").c_str(), F_OK));
+
+  unique_ptr<SegmentDB> db(OpenTieredDB());
+  EXPECT_EQ(kCount, db->TreeSize());
+  ExpectEntries(*db);
+
+  int64_t count(0);
+  LoggedEntry entry;
+  const unique_ptr<Database::Iterator> it(db->ScanEntries(0));
+  while (it->GetNextEntry(&entry)) {
+    ASSERT_LT(count, kCount);
+    TestSigner::TestEqualLoggedCerts(entries_[count], entry);
+    ++count;
+  }
+  EXPECT_EQ(kCount, count);
+}
+
+TEST_F(SegmentDBTest, FinishesInterruptedMove) {
+  const int64_t kCount = 4 * kSegmentEntries;
+  {
+    unique_ptr<SegmentDB> db(OpenTieredDB());
+    CreateEntries(db.get(), 0, kCount);
+    SignedTreeHead sth;
+    test_signer_.CreateUnique(&sth);
+    EXPECT_EQ(Database::OK, db->WriteTreeHead(sth));
+    WaitForColdSegment(0);
+  }
+  // As if the hot copy had not been removed yet.
+  for (const char* suffix : {"data", "index"}) {
+    const string cold(SegmentPath(ColdDir(), 0, suffix));
+    const string hot(SegmentPath(HotDir(), 0, suffix));
+    ASSERT_EQ(0, link(cold.c_str(), hot.c_str()));
+  }
+
+  unique_ptr<SegmentDB> db(OpenTieredDB());
+  EXPECT_NE(0, access(SegmentPath(HotDir(), 0, "index").c_str(), F_OK));
+  EXPECT_EQ(kCount, db->TreeSize());
+  ExpectEntries(*db);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  ConfigureSerializerForV1CT();
+  return RUN_ALL_TESTS();
+}
@@ -4,7 +4,9 @@
 #include <glog/logging.h>
 #include <openssl/evp.h>
 #include <openssl/opensslv.h>
+#include <openssl/sha.h>
 #include <stdint.h>
+#include <utility>
 
 #include "log/verifier.h"
 #include "proto/ct.pb.h"
@@ -15,6 +17,10 @@
 #endif
 
 using cert_trans::Verifier;
+using std::lock_guard;
+using std::move;
+using std::mutex;
+using std::string;
 
 namespace cert_trans {
 
@@ -51,21 +57,43 @@ Signer::Signer()
 }
 
 std::string Signer::RawSign(const std::string& data) const {
-  EVP_MD_CTX ctx;
-  EVP_MD_CTX_init(&ctx);
-  // NOTE: this syntax for setting the hash function requires OpenSSL >= 1.0.0.
-  CHECK_EQ(1, EVP_SignInit(&ctx, EVP_sha256()));
-  CHECK_EQ(1, EVP_SignUpdate(&ctx, data.data(), data.size()));
-  unsigned int sig_size = EVP_PKEY_size(pkey_.get());
-  unsigned char* sig = new unsigned char[sig_size];
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const unsigned char*>(data.data()), data.size(),
+         digest);
 
-  CHECK_EQ(1, EVP_SignFinal(&ctx, sig, &sig_size, pkey_.get()));
+  ScopedEVP_PKEY_CTX ctx(GetContext());
+  size_t sig_size(EVP_PKEY_size(pkey_.get()));
+  string ret(sig_size, '\0');
+  CHECK_EQ(1, EVP_PKEY_sign(ctx.get(),
+                            reinterpret_cast<unsigned char*>(&ret[0]),
+                            &sig_size, digest, sizeof(digest)));
+  ReleaseContext(move(ctx));
 
-  EVP_MD_CTX_cleanup(&ctx);
-  std::string ret(reinterpret_cast<char*>(sig), sig_size);
-
-  delete[] sig;
+  ret.resize(sig_size);
   return ret;
 }
 
+ScopedEVP_PKEY_CTX Signer::GetContext() const {
+  {
+    lock_guard<mutex> lock(ctx_lock_);
+    if (!free_ctxs_.empty()) {
+      ScopedEVP_PKEY_CTX ctx(move(free_ctxs_.back()));
+      free_ctxs_.pop_back();
+      return ctx;
+    }
+  }
+
+  ScopedEVP_PKEY_CTX ctx(EVP_PKEY_CTX_new(pkey_.get(), nullptr));
+  CHECK(ctx);
+  CHECK_EQ(1, EVP_PKEY_sign_init(ctx.get()));
+  // Same as EVP_SignFinal() would do.
+  CHECK_LT(0, EVP_PKEY_CTX_set_signature_md(ctx.get(), EVP_sha256()));
+  return ctx;
+}
+
+void Signer::ReleaseContext(ScopedEVP_PKEY_CTX ctx) const {
+  lock_guard<mutex> lock(ctx_lock_);
+  free_ctxs_.emplace_back(move(ctx));
+}
+
 }  // namespace cert_trans
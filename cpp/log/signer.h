@@ -6,12 +6,18 @@
 #include <openssl/evp.h>
 #include <openssl/x509.h>  // for i2d_PUBKEY
 #include <stdint.h>
+#include <mutex>
+#include <string>
+#include <vector>
 
 #include "proto/ct.pb.h"
 #include "util/openssl_scoped_types.h"
 
 namespace cert_trans {
 
+// Signing is thread-safe. Each concurrent signature gets an
+// EVP_PKEY_CTX of its own, which is kept for the next ones instead of
+// being set up again every time.
 class Signer {
  public:
   explicit Signer(EVP_PKEY* pkey);
@@ -31,10 +37,20 @@ class Signer {
  private:
   std::string RawSign(const std::string& data) const;
 
+  // Returns a context ready to sign with |pkey_|, reusing a free one if
+  // there is any.
+  ScopedEVP_PKEY_CTX GetContext() const;
+  // Makes |ctx| available to the next signatures.
+  void ReleaseContext(ScopedEVP_PKEY_CTX ctx) const;
+
   ScopedEVP_PKEY pkey_;
   ct::DigitallySigned::HashAlgorithm hash_algo_;
   ct::DigitallySigned::SignatureAlgorithm sig_algo_;
   std::string key_id_;
+
+  mutable std::mutex ctx_lock_;
+  // As many as there were signatures at the same time, at most.
+  mutable std::vector<ScopedEVP_PKEY_CTX> free_ctxs_;
 };
 
 }  // namespace cert_trans
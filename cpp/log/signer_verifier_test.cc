@@ -3,6 +3,8 @@
 #include <gtest/gtest.h>
 #include <stdint.h>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "log/signer.h"
 #include "log/test_signer.h"
@@ -16,6 +18,8 @@
 using cert_trans::Verifier;
 using ct::DigitallySigned;
 using std::string;
+using std::thread;
+using std::vector;
 
 namespace cert_trans {
 namespace {
@@ -91,6 +95,28 @@ TEST_F(SignerVerifierTest, SignAndVerify) {
   EXPECT_EQ(Verifier::OK, verifier_->Verify(kTestString, signature2));
 }
 
+// Check that signatures made at the same time, which each get a
+// context of their own, all verify.
+TEST_F(SignerVerifierTest, SignConcurrently) {
+  const int kNumThreads(4);
+  const int kNumSignatures(50);
+  vector<thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([this, i]() {
+      for (int j = 0; j < kNumSignatures; ++j) {
+        const string data(kTestString +
+                          std::to_string(i * kNumSignatures + j));
+        DigitallySigned signature;
+        signer_->Sign(data, &signature);
+        EXPECT_EQ(Verifier::OK, verifier_->Verify(data, signature));
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+}
+
 // Check various error cases.
 TEST_F(SignerVerifierTest, Errors) {
   DigitallySigned signature;
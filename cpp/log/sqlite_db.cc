@@ -3,6 +3,8 @@
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <sqlite3.h>
+#include <strings.h>
+#include <algorithm>
 
 #include "log/sqlite_statement.h"
 #include "monitoring/latency.h"
@@ -11,11 +13,16 @@
 
 using std::unique_ptr;
 using std::chrono::milliseconds;
+using std::condition_variable;
 using std::lock_guard;
+using std::max;
+using std::move;
 using std::mutex;
 using std::ostringstream;
+using std::pair;
 using std::string;
 using std::unique_lock;
+using std::vector;
 
 // Several of these flags pass their value directly through to SQLite PRAGMA
 // statements, see the SQLite documentation
@@ -42,6 +49,30 @@ DEFINE_bool(sqlite_batch_into_transactions, true,
             "scenes.");
 DEFINE_int32(sqlite_transaction_batch_size, 400,
              "Max number of operations to batch into one transaction.");
+DEFINE_int32(sqlite_read_connections, 4,
+             "Number of read-only connections looking up committed entries "
+             "when the journal mode is WAL, so that they do not wait on "
+             "the writer. With 0, all lookups use the writer's "
+             "connection.");
+DEFINE_int32(sqlite_hash_filter_bits_per_entry, 10,
+             "Bits per entry of the in-memory Bloom filter of entry "
+             "hashes which answers lookups of hashes that are not in the "
+             "database (such as new submissions) without querying it. It "
+             "is built when the process first writes an entry, and must "
+             "not be used if another process writes to the database. 0 "
+             "to disable.");
+DEFINE_int32(sqlite_mmap_size_mb, 0,
+             "Megabytes of the database that each connection reads through "
+             "a memory map rather than read() calls, 0 for none.");
+DEFINE_int32(sqlite_checkpoint_interval_ms, 0,
+             "When the journal mode is WAL, if not 0, checkpoint the "
+             "write-ahead log from a thread of its own this often, rather "
+             "than from the writer after every commit.");
+DEFINE_int32(sqlite_checkpoint_restart_wal_mb, 64,
+             "With --sqlite_checkpoint_interval_ms, once the write-ahead log "
+             "is over this size, the checkpoints also try to have the next "
+             "writes start over at its beginning (RESTART), rather than "
+             "only copying what they can to the database (PASSIVE).");
 
 namespace cert_trans {
 namespace {
@@ -51,6 +82,40 @@ static Latency<milliseconds, string> latency_by_op_ms(
     "sqlitedb_latency_by_operation_ms", "operation",
     "Database latency in ms broken out by operation");
 
+static Counter<string>* hash_filter_lookups(Counter<string>::New(
+    "sqlitedb_hash_filter_lookups", "result",
+    "Lookups by hash answered by the hash filter (\"filtered\"), or "
+    "let through and found (\"found\") or not (\"false_positive\")."));
+
+static Counter<string>* wal_checkpoints(Counter<string>::New(
+    "sqlitedb_wal_checkpoints", "mode",
+    "Background checkpoints of the write-ahead log, by mode (\"passive\", "
+    "\"restart\", or \"busy\" for a restart held up by a writer or "
+    "readers, which only checkpointed what it could)."));
+
+static Gauge<>* wal_bytes(Gauge<>::New(
+    "sqlitedb_wal_bytes",
+    "Size of the write-ahead log as of the last background checkpoint."));
+
+// The smallest hash filter built, so that a new database does not
+// have it rebuilt every few entries.
+const size_t kMinHashFilterCapacity = 1 << 20;
+// The header of the write-ahead log, and that of each of its frames.
+const int64_t kWALHeaderBytes = 32;
+const int64_t kWALFrameHeaderBytes = 24;
+
+
+void SetMmapSize(sqlite3* db) {
+  if (FLAGS_sqlite_mmap_size_mb > 0) {
+    ostringstream oss;
+    oss << "PRAGMA mmap_size = "
+        << (static_cast<int64_t>(FLAGS_sqlite_mmap_size_mb) << 20);
+    CHECK_EQ(SQLITE_OK,
+             sqlite3_exec(db, oss.str().c_str(), nullptr, nullptr, nullptr))
+        << sqlite3_errmsg(db);
+  }
+}
+
 
 sqlite3* SQLiteOpen(const string& dbfile) {
   ScopedLatency scoped_latency(latency_by_op_ms.GetScopedLatency("open"));
@@ -73,7 +138,8 @@ sqlite3* SQLiteOpen(const string& dbfile) {
                            nullptr)) << sqlite3_errmsg(retval);
   CHECK_EQ(SQLITE_OK, sqlite3_exec(retval,
                                    "CREATE TABLE leaves(hash BLOB, "
-                                   "entry BLOB, sequence INTEGER UNIQUE)",
+                                   "entry BLOB, sequence INTEGER UNIQUE, "
+                                   "leaf_hash BLOB)",
                                    nullptr, nullptr, nullptr)) <<
       sqlite3_errmsg(retval);
   CHECK_EQ(SQLITE_OK, sqlite3_exec(retval,
@@ -97,45 +163,330 @@ sqlite3* SQLiteOpen(const string& dbfile) {
 }
 
 
+// Databases created before tree checkpoints were stored lack the
+// table, add it if needed.
+void AddTreeCheckpointTable(sqlite3* db) {
+  CHECK_EQ(SQLITE_OK,
+           sqlite3_exec(db,
+                        "CREATE TABLE IF NOT EXISTS "
+                        "tree_checkpoint(checkpoint BLOB)",
+                        nullptr, nullptr, nullptr)) << sqlite3_errmsg(db);
+}
+
+
+// Databases created before leaf hashes were stored lack the column,
+// add it and fill it in.
+void AddLeafHashColumn(sqlite3* db) {
+  {
+    sqlite::Statement statement(db, "PRAGMA table_info(leaves)");
+    int ret;
+    while ((ret = statement.Step()) == SQLITE_ROW) {
+      string name;
+      statement.GetBlob(1, &name);
+      if (name == "leaf_hash") {
+        return;
+      }
+    }
+    CHECK_EQ(SQLITE_DONE, ret) << sqlite3_errmsg(db);
+  }
+
+  LOG(INFO) << "Adding leaf hashes to the SQLite database";
+  CHECK_EQ(SQLITE_OK, sqlite3_exec(db, "BEGIN TRANSACTION", nullptr, nullptr,
+                                   nullptr)) << sqlite3_errmsg(db);
+  CHECK_EQ(SQLITE_OK,
+           sqlite3_exec(db, "ALTER TABLE leaves ADD COLUMN leaf_hash BLOB",
+                        nullptr, nullptr, nullptr)) << sqlite3_errmsg(db);
+  sqlite::Statement select(db, "SELECT entry, sequence FROM leaves");
+  int ret;
+  while ((ret = select.Step()) == SQLITE_ROW) {
+    string data;
+    select.GetBlob(0, &data);
+    LoggedEntry logged;
+    CHECK(logged.ParseFromDatabase(data));
+    string leaf_hash;
+    CHECK(logged.LeafHash(&leaf_hash));
+
+    sqlite::Statement update(db,
+                             "UPDATE leaves SET leaf_hash = ? "
+                             "WHERE sequence = ?");
+    update.BindBlob(0, leaf_hash);
+    update.BindUInt64(1, select.GetUInt64(1));
+    CHECK_EQ(SQLITE_DONE, update.Step()) << sqlite3_errmsg(db);
+  }
+  CHECK_EQ(SQLITE_DONE, ret) << sqlite3_errmsg(db);
+  CHECK_EQ(SQLITE_OK, sqlite3_exec(db, "END TRANSACTION", nullptr, nullptr,
+                                   nullptr)) << sqlite3_errmsg(db);
+}
+
+
+Database::LookupResult SelectByHash(sqlite::StatementCache* statements,
+                                    const string& hash, LoggedEntry* result) {
+  sqlite::Statement statement(statements,
+                              "SELECT entry, sequence FROM leaves "
+                              "WHERE hash = ? ORDER BY sequence LIMIT 1");
+
+  statement.BindBlob(0, hash);
+
+  int ret = statement.Step();
+  if (ret == SQLITE_DONE) {
+    return Database::NOT_FOUND;
+  }
+  CHECK_EQ(SQLITE_ROW, ret) << sqlite3_errmsg(statements->db());
+
+  string data;
+  statement.GetBlob(0, &data);
+  CHECK(result->ParseFromDatabase(data));
+
+  if (statement.GetType(1) == SQLITE_NULL) {
+    result->clear_sequence_number();
+  } else {
+    result->set_sequence_number(statement.GetUInt64(1));
+  }
+
+  return Database::LOOKUP_OK;
+}
+
+
+Database::LookupResult SelectByIndex(sqlite::StatementCache* statements,
+                                     int64_t sequence_number,
+                                     LoggedEntry* result) {
+  sqlite::Statement statement(statements,
+                              "SELECT entry, hash FROM leaves "
+                              "WHERE sequence = ?");
+  statement.BindUInt64(0, sequence_number);
+  int ret = statement.Step();
+  if (ret == SQLITE_DONE) {
+    return Database::NOT_FOUND;
+  }
+
+  string data;
+  statement.GetBlob(0, &data);
+  CHECK(result->ParseFromDatabase(data));
+
+  string hash;
+  statement.GetBlob(1, &hash);
+
+  CHECK_EQ(result->Hash(), hash);
+
+  result->set_sequence_number(sequence_number);
+
+  return Database::LOOKUP_OK;
+}
+
+
+void SelectEntries(sqlite::StatementCache* statements, int64_t start_index,
+                   int64_t end_index, size_t max_bytes,
+                   vector<LoggedEntry>* entries) {
+  sqlite::Statement statement(statements,
+                              "SELECT entry, hash, sequence FROM leaves "
+                              "WHERE sequence >= ? AND sequence <= ? "
+                              "ORDER BY sequence");
+  statement.BindUInt64(0, start_index);
+  statement.BindUInt64(1, end_index);
+  size_t bytes(0);
+  string data;
+  string hash;
+  for (int64_t seq = start_index; statement.Step() == SQLITE_ROW; ++seq) {
+    if (statement.GetUInt64(2) != static_cast<uint64_t>(seq)) {
+      break;
+    }
+    statement.GetBlob(0, &data);
+    if (seq > start_index && bytes + data.size() > max_bytes) {
+      break;
+    }
+    bytes += data.size();
+
+    entries->emplace_back();
+    LoggedEntry* const entry(&entries->back());
+    CHECK(entry->ParseFromDatabase(data));
+    statement.GetBlob(1, &hash);
+    CHECK_EQ(entry->Hash(), hash);
+    entry->set_sequence_number(seq);
+  }
+}
+
+
 }  // namespace
 
 
+// A read-only connection, with the statements prepared on it.
+class SQLiteDB::ReadConnection {
+ public:
+  explicit ReadConnection(const string& dbfile) : db_(nullptr) {
+    CHECK_EQ(SQLITE_OK, sqlite3_open_v2(dbfile.c_str(), &db_,
+                                        SQLITE_OPEN_READONLY, nullptr))
+        << sqlite3_errmsg(db_);
+    SetMmapSize(db_);
+    statements_.reset(new sqlite::StatementCache(db_));
+  }
+
+  ~ReadConnection() {
+    statements_.reset();
+    CHECK_EQ(SQLITE_OK, sqlite3_close(db_)) << sqlite3_errmsg(db_);
+  }
+
+  ReadConnection(const ReadConnection&) = delete;
+  ReadConnection& operator=(const ReadConnection&) = delete;
+
+  sqlite::StatementCache* statements() const {
+    return statements_.get();
+  }
+
+ private:
+  sqlite3* db_;
+  unique_ptr<sqlite::StatementCache> statements_;
+};
+
+
+// Holds one of the read connections of a SQLiteDB for as long as it
+// lives, waiting for one to be free if necessary.
+class SQLiteDB::ScopedReadConnection {
+ public:
+  explicit ScopedReadConnection(const SQLiteDB* db)
+      : db_(CHECK_NOTNULL(db)), connection_(nullptr) {
+    unique_lock<mutex> lock(db_->read_lock_);
+    db_->read_connection_freed_.wait(lock, [this]() {
+      return !db_->free_read_connections_.empty();
+    });
+    connection_ = db_->free_read_connections_.back();
+    db_->free_read_connections_.pop_back();
+  }
+
+  ~ScopedReadConnection() {
+    {
+      lock_guard<mutex> lock(db_->read_lock_);
+      db_->free_read_connections_.push_back(connection_);
+    }
+    db_->read_connection_freed_.notify_one();
+  }
+
+  ScopedReadConnection(const ScopedReadConnection&) = delete;
+  ScopedReadConnection& operator=(const ScopedReadConnection&) = delete;
+
+  sqlite::StatementCache* statements() const {
+    return connection_->statements();
+  }
+
+ private:
+  const SQLiteDB* const db_;
+  ReadConnection* connection_;
+};
+
+
 class SQLiteDB::Iterator : public Database::Iterator {
  public:
   Iterator(const SQLiteDB* db, int64_t start_index)
       : db_(CHECK_NOTNULL(db)), next_index_(start_index) {
     CHECK_GE(next_index_, 0);
+    lock_guard<mutex> lock(db_->lock_);
+    CHECK(db_->iterators_.insert(this).second);
+  }
+
+  ~Iterator() {
+    unique_lock<mutex> lock(db_->lock_);
+    CHECK_EQ(1U, db_->iterators_.erase(this));
+    Stop(lock);
+  }
+
+  // Finish the statement stepping through the entries, which the next
+  // call to GetNextEntry() starts again from where it was.
+  void Stop(const unique_lock<mutex>& lock) {
+    CHECK(lock.owns_lock());
+    // The statement goes back to the cache of the connection.
+    statement_.reset();
   }
 
   bool GetNextEntry(LoggedEntry* entry) override {
     CHECK_NOTNULL(entry);
     unique_lock<mutex> lock(db_->lock_);
-    if (next_index_ < db_->tree_size_) {
-      CHECK_EQ(db_->LookupByIndex(lock, next_index_, entry), db_->LOOKUP_OK);
-      ++next_index_;
-      return true;
+    if (!statement_) {
+      statement_.reset(
+          new sqlite::Statement(db_->statements_.get(),
+                                "SELECT entry, hash, sequence FROM leaves "
+                                "WHERE sequence >= ? ORDER BY sequence"));
+      statement_->BindUInt64(0, next_index_);
     }
 
-    const bool retval(db_->LookupNextIndex(lock, next_index_, entry) ==
-                      db_->LOOKUP_OK);
-    if (retval) {
-      next_index_ = entry->sequence_number() + 1;
+    const int ret(statement_->Step());
+    if (ret != SQLITE_ROW) {
+      CHECK_EQ(SQLITE_DONE, ret) << sqlite3_errmsg(db_->db_);
+      // Entries could be added by the next call.
+      Stop(lock);
+      return false;
     }
 
-    return retval;
+    string data;
+    statement_->GetBlob(0, &data);
+    CHECK(entry->ParseFromDatabase(data));
+    string hash;
+    statement_->GetBlob(1, &hash);
+    CHECK_EQ(entry->Hash(), hash);
+    entry->set_sequence_number(statement_->GetUInt64(2));
+
+    next_index_ = entry->sequence_number() + 1;
+    if (entry->sequence_number() == db_->tree_size_) {
+      ++db_->tree_size_;
+    }
+
+    return true;
+  }
+
+ private:
+  const SQLiteDB* const db_;
+  int64_t next_index_;
+  // Only used with |db_->lock_| held.
+  unique_ptr<sqlite::Statement> statement_;
+};
+
+
+class SQLiteDB::LeafHashIterator : public Database::LeafHashIterator {
+ public:
+  LeafHashIterator(const SQLiteDB* db, int64_t start_index)
+      : db_(CHECK_NOTNULL(db)), next_index_(start_index), next_row_(0) {
+    CHECK_GE(next_index_, 0);
+  }
+
+  bool GetNextLeafHash(int64_t* sequence_number, string* leaf_hash) override {
+    CHECK_NOTNULL(sequence_number);
+    CHECK_NOTNULL(leaf_hash);
+    if (next_row_ == rows_.size()) {
+      next_row_ = 0;
+      rows_.clear();
+      db_->LookupLeafHashes(next_index_, kBatchSize, &rows_);
+      if (rows_.empty()) {
+        return false;
+      }
+      next_index_ = rows_.back().first + 1;
+    }
+
+    *sequence_number = rows_[next_row_].first;
+    leaf_hash->swap(rows_[next_row_].second);
+    ++next_row_;
+    return true;
   }
 
  private:
+  // Rows are read a batch at a time, rather than a statement being
+  // kept open across calls, so that writers are not held up.
+  static const int kBatchSize = 1024;
+
   const SQLiteDB* const db_;
   int64_t next_index_;
+  vector<pair<int64_t, string>> rows_;
+  size_t next_row_;
 };
 
 
 SQLiteDB::SQLiteDB(const string& dbfile)
     : db_(SQLiteOpen(dbfile)),
+      statements_(new sqlite::StatementCache(db_)),
       tree_size_(0),
+      committed_tree_size_(0),
+      uncommitted_entries_(false),
       transaction_size_(0),
-      in_transaction_(false) {
+      in_transaction_(false),
+      checkpoint_db_(nullptr),
+      exiting_(false) {
   unique_lock<mutex> lock(lock_);
   {
     ostringstream oss;
@@ -167,12 +518,52 @@ SQLiteDB::SQLiteDB(const string& dbfile)
     sqlite::Statement statement(db_, oss.str().c_str());
     CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db_);
   }
+  SetMmapSize(db_);
+
+  AddLeafHashColumn(db_);
+  AddTreeCheckpointTable(db_);
+
+  // Only WAL lets readers on other connections go on while the writer
+  // has a transaction open.
+  if (strcasecmp(FLAGS_sqlite_journal_mode.c_str(), "WAL") == 0) {
+    for (int i = 0; i < FLAGS_sqlite_read_connections; ++i) {
+      read_connections_.emplace_back(new ReadConnection(dbfile));
+      free_read_connections_.push_back(read_connections_.back().get());
+    }
+
+    // The writer then leaves the checkpoints to the thread, on a
+    // connection of its own.
+    if (FLAGS_sqlite_checkpoint_interval_ms > 0) {
+      CHECK_EQ(SQLITE_OK,
+               sqlite3_exec(db_, "PRAGMA wal_autocheckpoint = 0", nullptr,
+                            nullptr, nullptr)) << sqlite3_errmsg(db_);
+      CHECK_EQ(SQLITE_OK,
+               sqlite3_open_v2(dbfile.c_str(), &checkpoint_db_,
+                               SQLITE_OPEN_READWRITE, nullptr))
+          << sqlite3_errmsg(checkpoint_db_);
+      checkpoint_thread_ = std::thread(&SQLiteDB::CheckpointWAL, this);
+    }
+  }
 
   BeginTransaction(lock);
+  UpdateCommittedTreeSize(lock);
 }
 
 
 SQLiteDB::~SQLiteDB() {
+  if (checkpoint_thread_.joinable()) {
+    {
+      lock_guard<mutex> lock(checkpoint_lock_);
+      exiting_ = true;
+    }
+    checkpoint_cv_.notify_all();
+    checkpoint_thread_.join();
+    CHECK_EQ(SQLITE_OK, sqlite3_close(checkpoint_db_))
+        << sqlite3_errmsg(checkpoint_db_);
+  }
+  CHECK_EQ(read_connections_.size(), free_read_connections_.size());
+  read_connections_.clear();
+  statements_.reset();
   CHECK_EQ(SQLITE_OK, sqlite3_close(db_)) << sqlite3_errmsg(db_);
 }
 
@@ -185,11 +576,67 @@ Database::WriteResult SQLiteDB::CreateSequencedEntry_(
 
   MaybeStartNewTransaction(lock);
 
-  sqlite::Statement statement(db_,
-                              "INSERT INTO leaves(hash, entry, sequence) "
-                              "VALUES(?, ?, ?)");
+  return InsertEntry(lock, logged);
+}
+
+
+Database::WriteResult SQLiteDB::CreateSequencedEntries_(
+    const vector<const LoggedEntry*>& entries) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("create_sequenced_entries"));
+  unique_lock<mutex> lock(lock_);
+
+  // The whole batch goes into one transaction: the current one, where
+  // it counts as a single operation, if transactions are batched, or
+  // one of its own otherwise.
+  MaybeStartNewTransaction(lock);
+  if (!FLAGS_sqlite_batch_into_transactions) {
+    sqlite::Statement s(statements_.get(), "BEGIN TRANSACTION");
+    CHECK_EQ(SQLITE_DONE, s.Step()) << sqlite3_errmsg(db_);
+    in_transaction_ = true;
+  }
+
+  WriteResult result(this->OK);
+  for (const LoggedEntry* logged : entries) {
+    result = InsertEntry(lock, *logged);
+    if (result != this->OK) {
+      break;
+    }
+  }
+
+  if (!FLAGS_sqlite_batch_into_transactions) {
+    {
+      sqlite::Statement s(statements_.get(), "END TRANSACTION");
+      CHECK_EQ(SQLITE_DONE, s.Step()) << sqlite3_errmsg(db_);
+    }
+    in_transaction_ = false;
+    uncommitted_entries_ = false;
+    UpdateCommittedTreeSize(lock);
+  }
+
+  return result;
+}
+
+
+Database::WriteResult SQLiteDB::InsertEntry(const unique_lock<mutex>& lock,
+                                            const LoggedEntry& logged) {
+  CHECK(lock.owns_lock());
+  StopIterators(lock);
+  if (in_transaction_) {
+    // Set before the entry can be seen on this connection.
+    uncommitted_entries_ = true;
+  }
+  sqlite::Statement statement(statements_.get(),
+                              "INSERT INTO leaves(hash, entry, sequence, "
+                              "leaf_hash) VALUES(?, ?, ?, ?)");
   const string hash(logged.Hash());
   statement.BindBlob(0, hash);
+  {
+    lock_guard<mutex> filter_lock(hash_filter_lock_);
+    if (hash_filter_) {
+      hash_filter_->Add(hash);
+    }
+  }
 
   string data;
   CHECK(logged.SerializeForDatabase(&data));
@@ -198,12 +645,17 @@ Database::WriteResult SQLiteDB::CreateSequencedEntry_(
   CHECK(logged.has_sequence_number());
   statement.BindUInt64(2, logged.sequence_number());
 
+  string leaf_hash;
+  CHECK(logged.LeafHash(&leaf_hash));
+  statement.BindBlob(3, leaf_hash);
+
   int ret = statement.Step();
   if (ret == SQLITE_CONSTRAINT) {
     // Check whether we're trying to store a hash/sequence pair which already
     // exists - if it's identical we'll return OK as it could be the fetcher.
     sqlite::Statement s2(
-        db_, "SELECT sequence, hash FROM leaves WHERE sequence = ?");
+        statements_.get(),
+        "SELECT sequence, hash FROM leaves WHERE sequence = ?");
     s2.BindUInt64(0, logged.sequence_number());
     if (s2.Step() == SQLITE_ROW) {
       string existing_hash;
@@ -220,54 +672,128 @@ Database::WriteResult SQLiteDB::CreateSequencedEntry_(
     return this->SEQUENCE_NUMBER_ALREADY_IN_USE;
   }
   CHECK_EQ(SQLITE_DONE, ret) << sqlite3_errmsg(db_);
+  timestamp_index_.Add(logged.sequence_number(), logged.timestamp());
 
   if (logged.sequence_number() == tree_size_) {
     ++tree_size_;
   }
+  UpdateCommittedTreeSize(lock);
+  MaybeBuildHashFilter(lock);
 
   return this->OK;
 }
 
 
+void SQLiteDB::MaybeBuildHashFilter(const unique_lock<mutex>& lock) {
+  CHECK(lock.owns_lock());
+  if (FLAGS_sqlite_hash_filter_bits_per_entry <= 0) {
+    return;
+  }
+  {
+    lock_guard<mutex> filter_lock(hash_filter_lock_);
+    if (hash_filter_ && hash_filter_->size() < hash_filter_->capacity()) {
+      return;
+    }
+  }
+
+  // Writes wait on |lock_| meanwhile, so this sees all the entries,
+  // and lookups keep using the previous filter, if any.
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("build_hash_filter"));
+  size_t count;
+  {
+    sqlite::Statement statement(statements_.get(),
+                                "SELECT COUNT(*) FROM leaves");
+    CHECK_EQ(SQLITE_ROW, statement.Step()) << sqlite3_errmsg(db_);
+    count = statement.GetUInt64(0);
+  }
+  unique_ptr<HashFilter> filter(
+      new HashFilter(max(2 * count, kMinHashFilterCapacity),
+                     FLAGS_sqlite_hash_filter_bits_per_entry));
+  sqlite::Statement statement(statements_.get(), "SELECT hash FROM leaves");
+  int ret;
+  string hash;
+  while ((ret = statement.Step()) == SQLITE_ROW) {
+    statement.GetBlob(0, &hash);
+    filter->Add(hash);
+  }
+  CHECK_EQ(SQLITE_DONE, ret) << sqlite3_errmsg(db_);
+  LOG(INFO) << "Built hash filter of " << filter->size() << " entries, for "
+            << filter->capacity();
+
+  lock_guard<mutex> filter_lock(hash_filter_lock_);
+  hash_filter_ = move(filter);
+}
+
+
 Database::LookupResult SQLiteDB::LookupByHash(const string& hash,
                                               LoggedEntry* result) const {
   CHECK_NOTNULL(result);
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_hash"));
 
-  lock_guard<mutex> lock(lock_);
+  bool filtered;
+  {
+    lock_guard<mutex> filter_lock(hash_filter_lock_);
+    filtered = hash_filter_ != nullptr;
+    if (filtered && !hash_filter_->MayContain(hash)) {
+      hash_filter_lookups->Increment("filtered");
+      return this->NOT_FOUND;
+    }
+  }
 
-  sqlite::Statement statement(db_,
-                              "SELECT entry, sequence FROM leaves "
-                              "WHERE hash = ? ORDER BY sequence LIMIT 1");
+  const LookupResult lookup_result(LookupByHashUnfiltered(hash, result));
+  if (filtered) {
+    hash_filter_lookups->Increment(
+        lookup_result == this->LOOKUP_OK ? "found" : "false_positive");
+  }
+  return lookup_result;
+}
 
-  statement.BindBlob(0, hash);
 
-  int ret = statement.Step();
-  if (ret == SQLITE_DONE) {
-    return this->NOT_FOUND;
+Database::LookupResult SQLiteDB::LookupByHashUnfiltered(
+    const string& hash, LoggedEntry* result) const {
+  if (!read_connections_.empty()) {
+    ScopedReadConnection connection(this);
+    const LookupResult read_result(
+        SelectByHash(connection.statements(), hash, result));
+    // Any earlier entry with the same hash is committed, if this one
+    // is, so this is the right one. Uncommitted entries are not seen
+    // from the read connections at all, so only the writer's can tell
+    // whether they have the hash.
+    if (read_result == this->LOOKUP_OK
+            ? result->has_sequence_number() &&
+                  result->sequence_number() < committed_tree_size_
+            : !uncommitted_entries_) {
+      return read_result;
+    }
   }
-  CHECK_EQ(SQLITE_ROW, ret) << sqlite3_errmsg(db_);
 
-  string data;
-  statement.GetBlob(0, &data);
-  CHECK(result->ParseFromDatabase(data));
+  lock_guard<mutex> lock(lock_);
 
-  if (statement.GetType(1) == SQLITE_NULL) {
-    result->clear_sequence_number();
-  } else {
-    result->set_sequence_number(statement.GetUInt64(1));
-    if (result->sequence_number() == tree_size_) {
-      ++tree_size_;
-    }
+  const LookupResult lookup_result(
+      SelectByHash(statements_.get(), hash, result));
+  if (lookup_result == this->LOOKUP_OK && result->has_sequence_number() &&
+      result->sequence_number() == tree_size_) {
+    ++tree_size_;
   }
 
-  return this->LOOKUP_OK;
+  return lookup_result;
 }
 
 
 Database::LookupResult SQLiteDB::LookupByIndex(int64_t sequence_number,
                                                LoggedEntry* result) const {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("lookup_by_index"));
+  CHECK_GE(sequence_number, 0);
+  CHECK_NOTNULL(result);
+
+  // Committed entries never change, so they can be read from any
+  // connection.
+  if (!read_connections_.empty() && sequence_number < committed_tree_size_) {
+    ScopedReadConnection connection(this);
+    return SelectByIndex(connection.statements(), sequence_number, result);
+  }
+
   unique_lock<mutex> lock(lock_);
 
   return LookupByIndex(lock, sequence_number, result);
@@ -280,68 +806,76 @@ Database::LookupResult SQLiteDB::LookupByIndex(const unique_lock<mutex>& lock,
   CHECK(lock.owns_lock());
   CHECK_GE(sequence_number, 0);
   CHECK_NOTNULL(result);
-  sqlite::Statement statement(db_,
-                              "SELECT entry, hash FROM leaves "
-                              "WHERE sequence = ?");
-  statement.BindUInt64(0, sequence_number);
-  int ret = statement.Step();
-  if (ret == SQLITE_DONE) {
-    return this->NOT_FOUND;
-  }
-
-  string data;
-  statement.GetBlob(0, &data);
-  CHECK(result->ParseFromDatabase(data));
-
-  string hash;
-  statement.GetBlob(1, &hash);
-
-  CHECK_EQ(result->Hash(), hash);
-
-  result->set_sequence_number(sequence_number);
-  if (result->sequence_number() == tree_size_) {
+  const LookupResult lookup_result(
+      SelectByIndex(statements_.get(), sequence_number, result));
+  if (lookup_result == this->LOOKUP_OK && sequence_number == tree_size_) {
     ++tree_size_;
   }
 
-  return this->LOOKUP_OK;
+  return lookup_result;
 }
 
 
-Database::LookupResult SQLiteDB::LookupNextIndex(
-    const unique_lock<mutex>& lock, int64_t sequence_number,
-    LoggedEntry* result) const {
-  CHECK(lock.owns_lock());
-  CHECK_GE(sequence_number, 0);
-  CHECK_NOTNULL(result);
-  sqlite::Statement statement(db_,
-                              "SELECT entry, hash, sequence FROM leaves "
-                              "WHERE sequence >= ? ORDER BY sequence");
-  statement.BindUInt64(0, sequence_number);
-  if (statement.Step() == SQLITE_DONE) {
-    return this->NOT_FOUND;
-  }
-
-  string data;
-  statement.GetBlob(0, &data);
-  CHECK(result->ParseFromDatabase(data));
+unique_ptr<Database::Iterator> SQLiteDB::ScanEntries(
+    int64_t start_index) const {
+  return unique_ptr<Iterator>(new Iterator(this, start_index));
+}
 
-  string hash;
-  statement.GetBlob(1, &hash);
 
-  CHECK_EQ(result->Hash(), hash);
+void SQLiteDB::ReadEntries(int64_t start_index, int64_t end_index,
+                           size_t max_bytes, ReadPattern,
+                           vector<LoggedEntry>* entries) const {
+  CHECK_GE(start_index, 0);
+  CHECK_NOTNULL(entries);
+  ScopedLatency latency(latency_by_op_ms.GetScopedLatency("read_entries"));
 
-  result->set_sequence_number(statement.GetUInt64(2));
-  if (result->sequence_number() == tree_size_) {
-    ++tree_size_;
+  if (!read_connections_.empty() && end_index < committed_tree_size_) {
+    ScopedReadConnection connection(this);
+    SelectEntries(connection.statements(), start_index, end_index, max_bytes,
+                  entries);
+    return;
   }
 
-  return this->LOOKUP_OK;
+  lock_guard<mutex> lock(lock_);
+
+  const size_t first(entries->size());
+  SelectEntries(statements_.get(), start_index, end_index, max_bytes,
+                entries);
+  for (size_t i = first; i < entries->size(); ++i) {
+    if ((*entries)[i].sequence_number() == tree_size_) {
+      ++tree_size_;
+    }
+  }
 }
 
 
-unique_ptr<Database::Iterator> SQLiteDB::ScanEntries(
+unique_ptr<Database::LeafHashIterator> SQLiteDB::ScanLeafHashes(
     int64_t start_index) const {
-  return unique_ptr<Iterator>(new Iterator(this, start_index));
+  return unique_ptr<LeafHashIterator>(
+      new LeafHashIterator(this, start_index));
+}
+
+
+void SQLiteDB::LookupLeafHashes(int64_t sequence_number, int64_t limit,
+                                vector<pair<int64_t, string>>* rows) const {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("lookup_leaf_hashes"));
+  CHECK_GE(sequence_number, 0);
+  CHECK_NOTNULL(rows);
+  lock_guard<mutex> lock(lock_);
+
+  sqlite::Statement statement(statements_.get(),
+                              "SELECT sequence, leaf_hash FROM leaves "
+                              "WHERE sequence >= ? ORDER BY sequence "
+                              "LIMIT ?");
+  statement.BindUInt64(0, sequence_number);
+  statement.BindUInt64(1, limit);
+  int ret;
+  while ((ret = statement.Step()) == SQLITE_ROW) {
+    rows->emplace_back(statement.GetUInt64(0), string());
+    statement.GetBlob(1, &rows->back().second);
+  }
+  CHECK_EQ(SQLITE_DONE, ret) << sqlite3_errmsg(db_);
 }
 
 
@@ -349,7 +883,7 @@ Database::WriteResult SQLiteDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("write_tree_head"));
   unique_lock<mutex> lock(lock_);
 
-  sqlite::Statement statement(db_,
+  sqlite::Statement statement(statements_.get(),
                               "INSERT INTO trees(timestamp, sth) "
                               "VALUES(?, ?)");
   statement.BindUInt64(0, sth.timestamp());
@@ -360,7 +894,7 @@ Database::WriteResult SQLiteDB::WriteTreeHead_(const ct::SignedTreeHead& sth) {
 
   int r2 = statement.Step();
   if (r2 == SQLITE_CONSTRAINT) {
-    sqlite::Statement s2(db_,
+    sqlite::Statement s2(statements_.get(),
                          "SELECT timestamp,sth FROM trees "
                          "WHERE timestamp = ?");
     s2.BindUInt64(0, sth.timestamp());
@@ -396,13 +930,64 @@ Database::LookupResult SQLiteDB::LatestTreeHead(
 }
 
 
+Database::WriteResult SQLiteDB::WriteTreeCheckpoint_(
+    const ct::CompactTreeCheckpoint& checkpoint) {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("write_tree_checkpoint"));
+  string data;
+  CHECK(checkpoint.SerializeToString(&data));
+
+  unique_lock<mutex> lock(lock_);
+  {
+    sqlite::Statement statement(statements_.get(),
+                                "DELETE FROM tree_checkpoint");
+    CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db_);
+  }
+  {
+    sqlite::Statement statement(statements_.get(),
+                                "INSERT INTO tree_checkpoint(checkpoint) "
+                                "VALUES(?)");
+    statement.BindBlob(0, data);
+    CHECK_EQ(SQLITE_DONE, statement.Step()) << sqlite3_errmsg(db_);
+  }
+
+  EndTransaction(lock);
+  BeginTransaction(lock);
+
+  return this->OK;
+}
+
+
+Database::LookupResult SQLiteDB::LatestTreeCheckpoint(
+    ct::CompactTreeCheckpoint* result) const {
+  CHECK_NOTNULL(result);
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("latest_tree_checkpoint"));
+  unique_lock<mutex> lock(lock_);
+
+  sqlite::Statement statement(statements_.get(),
+                              "SELECT checkpoint FROM tree_checkpoint");
+  const int ret(statement.Step());
+  if (ret == SQLITE_DONE) {
+    return this->NOT_FOUND;
+  }
+  CHECK_EQ(SQLITE_ROW, ret) << sqlite3_errmsg(db_);
+
+  string data;
+  statement.GetBlob(0, &data);
+  CHECK(result->ParseFromString(data));
+
+  return this->LOOKUP_OK;
+}
+
+
 int64_t SQLiteDB::TreeSize() const {
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("tree_size"));
   unique_lock<mutex> lock(lock_);
 
   CHECK_GE(tree_size_, 0);
   sqlite::Statement statement(
-      db_,
+      statements_.get(),
       "SELECT sequence FROM leaves WHERE sequence >= ? ORDER BY sequence");
   statement.BindUInt64(0, tree_size_);
 
@@ -418,11 +1003,19 @@ int64_t SQLiteDB::TreeSize() const {
     ret = statement.Step();
   }
   CHECK_EQ(SQLITE_DONE, ret) << sqlite3_errmsg(db_);
+  UpdateCommittedTreeSize(lock);
 
   return tree_size_;
 }
 
 
+int64_t SQLiteDB::FirstSequenceNumberSince(uint64_t timestamp) const {
+  ScopedLatency latency(
+      latency_by_op_ms.GetScopedLatency("first_sequence_number_since"));
+  return timestamp_index_.Lookup(*this, timestamp);
+}
+
+
 void SQLiteDB::AddNotifySTHCallback(
     const Database::NotifySTHCallback* callback) {
   unique_lock<mutex> lock(lock_);
@@ -456,7 +1049,8 @@ void SQLiteDB::InitializeNode(const string& node_id) {
     LOG(FATAL) << "Attempting to initialize DB beloging to node with node_id: "
                << existing_id;
   }
-  sqlite::Statement statement(db_, "INSERT INTO node(node_id) VALUES(?)");
+  sqlite::Statement statement(statements_.get(),
+                              "INSERT INTO node(node_id) VALUES(?)");
   statement.BindBlob(0, node_id);
 
   const int result(statement.Step());
@@ -475,7 +1069,7 @@ Database::LookupResult SQLiteDB::NodeId(const unique_lock<mutex>& lock,
   ScopedLatency latency(latency_by_op_ms.GetScopedLatency("set_node_id"));
   CHECK(lock.owns_lock());
   CHECK_NOTNULL(node_id);
-  sqlite::Statement statement(db_, "SELECT node_id FROM node");
+  sqlite::Statement statement(statements_.get(), "SELECT node_id FROM node");
 
   int result(statement.Step());
   if (result == SQLITE_DONE) {
@@ -491,13 +1085,60 @@ Database::LookupResult SQLiteDB::NodeId(const unique_lock<mutex>& lock,
 }
 
 
+void SQLiteDB::CheckpointWAL() {
+  const int64_t restart_bytes(
+      static_cast<int64_t>(FLAGS_sqlite_checkpoint_restart_wal_mb) << 20);
+  int64_t page_size;
+  {
+    sqlite::Statement s(checkpoint_db_, "PRAGMA page_size");
+    CHECK_EQ(SQLITE_ROW, s.Step()) << sqlite3_errmsg(checkpoint_db_);
+    page_size = s.GetUInt64(0);
+  }
+  int64_t wal_size(0);
+  unique_lock<mutex> lock(checkpoint_lock_);
+  while (!checkpoint_cv_.wait_for(
+      lock, milliseconds(FLAGS_sqlite_checkpoint_interval_ms),
+      [this]() { return exiting_; })) {
+    lock.unlock();
+    ScopedLatency latency(latency_by_op_ms.GetScopedLatency("wal_checkpoint"));
+    // A PASSIVE checkpoint copies what it can without waiting on the
+    // writer or the readers. A RESTART waits for them too, but without
+    // a busy handler on this connection, it gives up on SQLITE_BUSY
+    // having done what a PASSIVE one would.
+    const bool restart(wal_size > restart_bytes);
+    int log_frames(0), checkpointed_frames(0);
+    const int ret(sqlite3_wal_checkpoint_v2(
+        checkpoint_db_, nullptr, restart ? SQLITE_CHECKPOINT_RESTART
+                                         : SQLITE_CHECKPOINT_PASSIVE,
+        &log_frames, &checkpointed_frames));
+    if (ret == SQLITE_BUSY) {
+      wal_checkpoints->Increment("busy");
+    } else {
+      CHECK_EQ(SQLITE_OK, ret) << sqlite3_errmsg(checkpoint_db_);
+      wal_checkpoints->Increment(restart ? "restart" : "passive");
+    }
+
+    // After a restart, the next writes overwrite the log from its
+    // beginning, rather than grow it any further.
+    if (restart && ret == SQLITE_OK) {
+      wal_size = 0;
+    } else if (log_frames > 0) {
+      wal_size = kWALHeaderBytes +
+                 log_frames * (page_size + kWALFrameHeaderBytes);
+    }
+    wal_bytes->Set(wal_size);
+    lock.lock();
+  }
+}
+
+
 void SQLiteDB::BeginTransaction(const unique_lock<mutex>& lock) {
   CHECK(lock.owns_lock());
   if (FLAGS_sqlite_batch_into_transactions) {
     CHECK_EQ(0, transaction_size_);
     CHECK(!in_transaction_);
     VLOG(1) << "Beginning new transaction.";
-    sqlite::Statement s(db_, "BEGIN TRANSACTION");
+    sqlite::Statement s(statements_.get(), "BEGIN TRANSACTION");
     CHECK_EQ(SQLITE_DONE, s.Step()) << sqlite3_errmsg(db_);
     in_transaction_ = true;
   }
@@ -509,18 +1150,24 @@ void SQLiteDB::EndTransaction(const unique_lock<mutex>& lock) {
   if (FLAGS_sqlite_batch_into_transactions) {
     CHECK(in_transaction_);
     VLOG(1) << "Committing transaction.";
+    // Checkpointing fails while statements are reading on the
+    // connection.
+    StopIterators(lock);
     {
-      sqlite::Statement s(db_, "END TRANSACTION");
+      sqlite::Statement s(statements_.get(), "END TRANSACTION");
       CHECK_EQ(SQLITE_DONE, s.Step()) << sqlite3_errmsg(db_);
     }
-    {
-      sqlite::Statement s(db_, "PRAGMA wal_checkpoint(TRUNCATE)");
+    if (!checkpoint_db_) {
+      sqlite::Statement s(statements_.get(),
+                          "PRAGMA wal_checkpoint(TRUNCATE)");
       CHECK_EQ(SQLITE_ROW, s.Step()) << sqlite3_errmsg(db_);
       CHECK_EQ(SQLITE_DONE, s.Step()) << sqlite3_errmsg(db_);
     }
 
     transaction_size_ = 0;
     in_transaction_ = false;
+    uncommitted_entries_ = false;
+    UpdateCommittedTreeSize(lock);
   }
 }
 
@@ -537,6 +1184,23 @@ void SQLiteDB::MaybeStartNewTransaction(const unique_lock<mutex>& lock) {
 }
 
 
+void SQLiteDB::StopIterators(const unique_lock<mutex>& lock) const {
+  for (Iterator* iterator : iterators_) {
+    iterator->Stop(lock);
+  }
+}
+
+
+void SQLiteDB::UpdateCommittedTreeSize(const unique_lock<mutex>& lock) const {
+  CHECK(lock.owns_lock());
+  // Unless entries were added in the current transaction, everything
+  // the writer sees is committed.
+  if (!in_transaction_ || !uncommitted_entries_) {
+    committed_tree_size_ = tree_size_;
+  }
+}
+
+
 void SQLiteDB::ForceNotifySTH() {
   unique_lock<mutex> lock(lock_);
 
@@ -559,7 +1223,7 @@ void SQLiteDB::ForceNotifySTH() {
 Database::LookupResult SQLiteDB::LatestTreeHeadNoLock(
     const unique_lock<mutex>& lock, ct::SignedTreeHead* result) const {
   CHECK(lock.owns_lock());
-  sqlite::Statement statement(db_,
+  sqlite::Statement statement(statements_.get(),
                               "SELECT sth FROM trees WHERE timestamp IN "
                               "(SELECT MAX(timestamp) FROM trees)");
 
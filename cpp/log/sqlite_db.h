@@ -1,14 +1,27 @@
 #ifndef CERT_TRANS_LOG_SQLITE_DB_H_
 #define CERT_TRANS_LOG_SQLITE_DB_H_
 
+#include <atomic>
+#include <condition_variable>
+#include <memory>
 #include <mutex>
+#include <set>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include "log/database.h"
+#include "log/hash_filter.h"
 #include "log/logged_entry.h"
+#include "log/timestamp_index.h"
 
 struct sqlite3;
 
+namespace sqlite {
+class StatementCache;
+}  // namespace sqlite
+
 namespace cert_trans {
 
 
@@ -25,6 +38,9 @@ class SQLiteDB : public Database {
 
   WriteResult CreateSequencedEntry_(const LoggedEntry& logged) override;
 
+  WriteResult CreateSequencedEntries_(
+      const std::vector<const LoggedEntry*>& entries) override;
+
   LookupResult LookupByHash(const std::string& hash,
                             LoggedEntry* result) const override;
 
@@ -34,12 +50,27 @@ class SQLiteDB : public Database {
   std::unique_ptr<Database::Iterator> ScanEntries(
       int64_t start_index) const override;
 
+  void ReadEntries(int64_t start_index, int64_t end_index, size_t max_bytes,
+                   ReadPattern pattern,
+                   std::vector<LoggedEntry>* entries) const override;
+
+  std::unique_ptr<Database::LeafHashIterator> ScanLeafHashes(
+      int64_t start_index) const override;
+
   WriteResult WriteTreeHead_(const ct::SignedTreeHead& sth) override;
 
   LookupResult LatestTreeHead(ct::SignedTreeHead* result) const override;
 
+  WriteResult WriteTreeCheckpoint_(
+      const ct::CompactTreeCheckpoint& checkpoint) override;
+
+  LookupResult LatestTreeCheckpoint(
+      ct::CompactTreeCheckpoint* result) const override;
+
   int64_t TreeSize() const override;
 
+  int64_t FirstSequenceNumberSince(uint64_t timestamp) const override;
+
   void AddNotifySTHCallback(
       const Database::NotifySTHCallback* callback) override;
 
@@ -56,15 +87,27 @@ class SQLiteDB : public Database {
 
  private:
   class Iterator;
-
+  class LeafHashIterator;
+  class ReadConnection;
+  class ScopedReadConnection;
+
+  // Inserts |logged| in the current transaction, if there is one.
+  WriteResult InsertEntry(const std::unique_lock<std::mutex>& lock,
+                          const LoggedEntry& logged);
+  LookupResult LookupByHashUnfiltered(const std::string& hash,
+                                      LoggedEntry* result) const;
+  // (Re)builds |hash_filter_| from the hashes in the database if there
+  // is none yet, or it is full.
+  void MaybeBuildHashFilter(const std::unique_lock<std::mutex>& lock);
   LookupResult LookupByIndex(const std::unique_lock<std::mutex>& lock,
                              int64_t sequence_number,
                              LoggedEntry* result) const;
-  // This finds the next entry with a sequence number equal or greater
-  // to the one specified.
-  LookupResult LookupNextIndex(const std::unique_lock<std::mutex>& lock,
-                               int64_t sequence_number,
-                               LoggedEntry* result) const;
+  // Appends the sequence numbers and leaf hashes of up to |limit|
+  // entries, with a sequence number equal or greater to the one
+  // specified, to |rows|.
+  void LookupLeafHashes(
+      int64_t sequence_number, int64_t limit,
+      std::vector<std::pair<int64_t, std::string>>* rows) const;
   LookupResult LatestTreeHeadNoLock(const std::unique_lock<std::mutex>& lock,
                                     ct::SignedTreeHead* result) const;
   LookupResult NodeId(const std::unique_lock<std::mutex>& lock,
@@ -76,14 +119,62 @@ class SQLiteDB : public Database {
 
   void MaybeStartNewTransaction(const std::unique_lock<std::mutex>& lock);
 
+  // Makes the iterators finish their statement, which they start
+  // again when next used. Writing entries could otherwise change what
+  // they see, and commits cannot checkpoint the database with them
+  // open.
+  void StopIterators(const std::unique_lock<std::mutex>& lock) const;
+
+  // Moves |committed_tree_size_| up to |tree_size_|, if all the
+  // entries the writer sees are committed.
+  void UpdateCommittedTreeSize(const std::unique_lock<std::mutex>& lock) const;
+
+  // Run by |checkpoint_thread_|, until the destructor sets |exiting_|.
+  void CheckpointWAL();
+
   mutable std::mutex lock_;
   sqlite3* const db_;
+  std::unique_ptr<sqlite::StatementCache> statements_;
   // This is marked mutable, as it is a lazily updated cache updated
   // from some of the getters.
   mutable int64_t tree_size_;
+  // The entries below this are committed, and can be read from the
+  // read connections. Lags behind |tree_size_|.
+  mutable std::atomic<int64_t> committed_tree_size_;
+  // Whether the current transaction has added entries, which the
+  // read connections cannot see yet.
+  std::atomic<bool> uncommitted_entries_;
   DatabaseNotifierHelper callbacks_;
+  TimestampIndex timestamp_index_;
   int64_t transaction_size_;
   bool in_transaction_;
+  // The live iterators, which hold a statement open on |db_| between
+  // calls.
+  mutable std::set<Iterator*> iterators_;
+
+  // Read-only connections for the lookups which do not need to see
+  // uncommitted entries, empty if the journal mode is not WAL.
+  mutable std::mutex read_lock_;
+  mutable std::condition_variable read_connection_freed_;
+  std::vector<std::unique_ptr<ReadConnection>> read_connections_;
+  mutable std::vector<ReadConnection*> free_read_connections_;
+
+  // With --sqlite_checkpoint_interval_ms, the connection the
+  // write-ahead log is checkpointed on, outside of |lock_|, NULL
+  // otherwise.
+  sqlite3* checkpoint_db_;
+  std::mutex checkpoint_lock_;
+  std::condition_variable checkpoint_cv_;
+  bool exiting_;
+  std::thread checkpoint_thread_;
+
+  mutable std::mutex hash_filter_lock_;
+  // The hashes of all the entries, built when this instance first
+  // writes one: from then on, it sees all of them, assuming that no
+  // other process writes to the database. Hashes are added before
+  // their entry is, so that it is never missing any. NULL until then,
+  // or if disabled.
+  std::unique_ptr<HashFilter> hash_filter_;
 };
 
 
@@ -4,22 +4,96 @@
 #include <glog/logging.h>
 #include <sqlite3.h>
 #include <string>
+#include <unordered_map>
 
 namespace sqlite {
 
+namespace internal {
+
+
+inline sqlite3_stmt* Prepare(sqlite3* db, const char* sql) {
+  sqlite3_stmt* stmt(NULL);
+  int ret = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+  if (ret != SQLITE_OK)
+    LOG(ERROR) << "ret = " << ret << ", err = " << sqlite3_errmsg(db)
+               << ", sql = " << sql << std::endl;
+
+  CHECK_EQ(SQLITE_OK, ret);
+  return stmt;
+}
+
+
+}  // namespace internal
+
+
+// Keeps the statements prepared on a connection, so that Statement
+// instances running the same SQL again reuse them, instead of
+// compiling it every time. Like the connection itself, this must
+// only be used by one thread at a time, and it must be destroyed
+// before the connection is closed.
+class StatementCache {
+ public:
+  explicit StatementCache(sqlite3* db) : db_(db) {
+  }
+
+  ~StatementCache() {
+    for (const auto& entry : statements_) {
+      CHECK_EQ(SQLITE_OK, sqlite3_finalize(entry.second));
+    }
+  }
+
+  StatementCache(const StatementCache&) = delete;
+  StatementCache& operator=(const StatementCache&) = delete;
+
+  sqlite3* db() const {
+    return db_;
+  }
+
+ private:
+  friend class Statement;
+
+  sqlite3_stmt* Take(const char* sql) {
+    const auto it(statements_.find(sql));
+    if (it == statements_.end()) {
+      return internal::Prepare(db_, sql);
+    }
+    sqlite3_stmt* const stmt(it->second);
+    statements_.erase(it);
+    return stmt;
+  }
+
+  void Return(const char* sql, sqlite3_stmt* stmt) {
+    // This returns the error of the last step, if any, which the user
+    // of the statement has seen already.
+    sqlite3_reset(stmt);
+    CHECK_EQ(SQLITE_OK, sqlite3_clear_bindings(stmt));
+    statements_.emplace(sql, stmt);
+  }
+
+  sqlite3* const db_;
+  // Statements which are not in use, by SQL. The same SQL can be
+  // running more than once at a time, so there can be several.
+  std::unordered_multimap<std::string, sqlite3_stmt*> statements_;
+};
+
+
 // Reduce the ugliness of the sqlite3 API.
 class Statement {
  public:
-  Statement(sqlite3* db, const char* sql) : stmt_(NULL) {
-    int ret = sqlite3_prepare_v2(db, sql, -1, &stmt_, NULL);
-    if (ret != SQLITE_OK)
-      LOG(ERROR) << "ret = " << ret << ", err = " << sqlite3_errmsg(db)
-                 << ", sql = " << sql << std::endl;
+  Statement(sqlite3* db, const char* sql)
+      : cache_(NULL), sql_(sql), stmt_(internal::Prepare(db, sql)) {
+  }
 
-    CHECK_EQ(SQLITE_OK, ret);
+  // Use a statement from |cache|, if there is one for |sql|.
+  Statement(StatementCache* cache, const char* sql)
+      : cache_(CHECK_NOTNULL(cache)), sql_(sql), stmt_(cache_->Take(sql)) {
   }
 
   ~Statement() {
+    if (cache_) {
+      cache_->Return(sql_, stmt_);
+      return;
+    }
     int ret = sqlite3_finalize(stmt_);
     // can get SQLITE_CONSTRAINT if an insert failed due to a duplicate key.
     CHECK(ret == SQLITE_OK || ret == SQLITE_CONSTRAINT);
@@ -60,6 +134,8 @@ class Statement {
   }
 
  private:
+  StatementCache* const cache_;
+  const char* const sql_;
   sqlite3_stmt* stmt_;
 };
 
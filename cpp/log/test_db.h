@@ -1,13 +1,21 @@
 #ifndef CERT_TRANS_LOG_TEST_DB_H_
 #define CERT_TRANS_LOG_TEST_DB_H_
 
+#include "config.h"
+
 #include <sys/stat.h>
 
+#include "log/caching_database.h"
+#include "log/chain_dedup_database.h"
 #include "log/database.h"
 #include "log/file_db.h"
 #include "log/file_storage.h"
 #include "log/leveldb_db.h"
 #include "log/logged_entry.h"
+#ifdef HAVE_ROCKSDB
+#include "log/rocksdb_db.h"
+#endif
+#include "log/segment_db.h"
 #include "log/sqlite_db.h"
 #include "util/test_db.h"
 
@@ -63,6 +71,73 @@ cert_trans::LevelDB* TestDB<cert_trans::LevelDB>::SecondDB() {
   return new cert_trans::LevelDB(tmp_.TmpStorageDir() + "/leveldb");
 }
 
+#ifdef HAVE_ROCKSDB
+template <>
+void TestDB<cert_trans::RocksDB>::Setup() {
+  db_.reset(new cert_trans::RocksDB(tmp_.TmpStorageDir() + "/rocksdb"));
+}
+
+template <>
+cert_trans::RocksDB* TestDB<cert_trans::RocksDB>::SecondDB() {
+  // As with LevelDB, the original has to be closed first.
+  db_.reset();
+  return new cert_trans::RocksDB(tmp_.TmpStorageDir() + "/rocksdb");
+}
+#endif
+
+template <>
+void TestDB<cert_trans::SegmentDB>::Setup() {
+  std::string segments_dir = tmp_.TmpStorageDir() + "/segments";
+  CHECK_ERR(mkdir(segments_dir.c_str(), 0700));
+  db_.reset(new cert_trans::SegmentDB(segments_dir));
+}
+
+template <>
+cert_trans::SegmentDB* TestDB<cert_trans::SegmentDB>::SecondDB() {
+  // Only one SegmentDB can have the directory open at a time.
+  db_.reset();
+  return new cert_trans::SegmentDB(this->tmp_.TmpStorageDir() + "/segments");
+}
+
+// Small enough for the tests to evict entries.
+static const size_t kCacheBytes = 1 << 16;
+static const int64_t kCacheRightEdgeEntries = 8;
+
+template <>
+void TestDB<cert_trans::CachingDatabase>::Setup() {
+  std::string segments_dir = tmp_.TmpStorageDir() + "/segments";
+  CHECK_ERR(mkdir(segments_dir.c_str(), 0700));
+  db_.reset(new cert_trans::CachingDatabase(
+      new cert_trans::SegmentDB(segments_dir), kCacheBytes,
+      kCacheRightEdgeEntries));
+}
+
+template <>
+cert_trans::CachingDatabase*
+TestDB<cert_trans::CachingDatabase>::SecondDB() {
+  db_.reset();
+  return new cert_trans::CachingDatabase(
+      new cert_trans::SegmentDB(this->tmp_.TmpStorageDir() + "/segments"),
+      kCacheBytes, kCacheRightEdgeEntries);
+}
+
+static const size_t kChainDedupCertificates = 64;
+
+template <>
+void TestDB<cert_trans::ChainDedupDatabase>::Setup() {
+  db_.reset(new cert_trans::ChainDedupDatabase(
+      new cert_trans::SQLiteDB(tmp_.TmpStorageDir() + "/sqlite"),
+      kChainDedupCertificates));
+}
+
+template <>
+cert_trans::ChainDedupDatabase*
+TestDB<cert_trans::ChainDedupDatabase>::SecondDB() {
+  return new cert_trans::ChainDedupDatabase(
+      new cert_trans::SQLiteDB(tmp_.TmpStorageDir() + "/sqlite"),
+      kChainDedupCertificates);
+}
+
 // Not a Database; we just use the same template for setup.
 template <>
 void TestDB<cert_trans::FileStorage>::Setup() {
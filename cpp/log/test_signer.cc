@@ -362,6 +362,8 @@ void TestSigner::CreateUnique(LoggedEntry* logged_cert) {
   CHECK_EQ(LogSigner::OK,
            default_signer_->SignCertificateTimestamp(
                logged_cert->entry(), logged_cert->mutable_sct()));
+  // Signing forgets the leaf hash, which the signature is not part of.
+  CHECK(logged_cert->CacheHashes());
 }
 
 void TestSigner::CreateUniqueFakeSignature(LoggedEntry* logged_cert) {
@@ -373,6 +375,7 @@ void TestSigner::CreateUniqueFakeSignature(LoggedEntry* logged_cert) {
       DigitallySigned::ECDSA);
   logged_cert->mutable_sct()->mutable_signature()->set_signature(
       B(kDefaultCertSCTSignature));
+  CHECK(logged_cert->CacheHashes());
 }
 
 void TestSigner::CreateUnique(SignedTreeHead* sth) {
@@ -0,0 +1,99 @@
+#include "log/timestamp_index.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+
+#include "log/database.h"
+#include "log/logged_entry.h"
+
+using std::lock_guard;
+using std::lower_bound;
+using std::max;
+using std::min;
+using std::mutex;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+// How many entries Lookup() reads at once, and how many bytes of them
+// at most.
+const int64_t kReadBatchSize = 1024;
+const size_t kReadBatchBytes = 4 << 20;
+
+
+}  // namespace
+
+
+const int64_t TimestampIndex::kBlockSize = 1024;
+
+
+TimestampIndex::TimestampIndex() : size_(0) {
+}
+
+
+void TimestampIndex::Add(int64_t sequence_number, uint64_t timestamp) {
+  lock_guard<mutex> lock(lock_);
+  if (sequence_number == size_) {
+    AddLocked(lock, sequence_number, timestamp);
+  }
+}
+
+
+int64_t TimestampIndex::Lookup(const ReadOnlyDatabase& db,
+                               uint64_t timestamp) const {
+  // Add() can index entries before they count in the tree size.
+  const int64_t tree_size(db.TreeSize());
+  {
+    lock_guard<mutex> catch_up_lock(catch_up_lock_);
+    int64_t next;
+    {
+      lock_guard<mutex> lock(lock_);
+      next = size_;
+    }
+    while (next < tree_size) {
+      vector<LoggedEntry> entries;
+      db.ReadEntries(next, min(tree_size, next + kReadBatchSize) - 1,
+                     kReadBatchBytes, ReadOnlyDatabase::BULK_SCAN, &entries);
+      CHECK(!entries.empty()) << "Missing entry " << next << " below tree "
+                              << "size " << tree_size;
+      lock_guard<mutex> lock(lock_);
+      // Add() may have indexed some of them meanwhile.
+      for (const LoggedEntry& entry : entries) {
+        if (entry.sequence_number() == size_) {
+          AddLocked(lock, entry.sequence_number(), entry.timestamp());
+        }
+      }
+      next = size_;
+    }
+  }
+
+  lock_guard<mutex> lock(lock_);
+  const vector<uint64_t>::const_iterator it(lower_bound(
+      latest_timestamps_.begin(), latest_timestamps_.end(), timestamp));
+  if (it == latest_timestamps_.end()) {
+    return min<int64_t>(size_, tree_size);
+  }
+  return min<int64_t>((it - latest_timestamps_.begin()) * kBlockSize,
+                      tree_size);
+}
+
+
+void TimestampIndex::AddLocked(const lock_guard<mutex>& lock,
+                               int64_t sequence_number,
+                               uint64_t timestamp) const {
+  CHECK_EQ(sequence_number, size_);
+  const size_t block(sequence_number / kBlockSize);
+  if (block == latest_timestamps_.size()) {
+    latest_timestamps_.push_back(
+        latest_timestamps_.empty() ? timestamp
+                                   : max(latest_timestamps_.back(), timestamp));
+  } else {
+    CHECK_EQ(block + 1, latest_timestamps_.size());
+    latest_timestamps_.back() = max(latest_timestamps_.back(), timestamp);
+  }
+  ++size_;
+}
+
+
+}  // namespace cert_trans
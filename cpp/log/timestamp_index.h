@@ -0,0 +1,63 @@
+#ifndef CERT_TRANS_LOG_TIMESTAMP_INDEX_H_
+#define CERT_TRANS_LOG_TIMESTAMP_INDEX_H_
+
+#include <stdint.h>
+#include <mutex>
+#include <vector>
+
+namespace cert_trans {
+
+class ReadOnlyDatabase;
+
+
+// A sparse index of the SCT timestamps of the entries of a database,
+// for ReadOnlyDatabase::FirstSequenceNumberSince(). For each block of
+// kBlockSize sequence numbers, it keeps the latest timestamp of the
+// entries up to the end of that block. Entries are sequenced nearly in
+// the order they were timestamped, so the first block where that
+// reaches a timestamp is about where the entries logged since then
+// start, and no entry before it is as recent.
+//
+// Databases Add() the entries they write. The entries which were not
+// added in order (such as those written before the database was
+// opened) are read from the database by Lookup(), the first time it
+// needs them.
+//
+// This class is thread-safe.
+class TimestampIndex {
+ public:
+  static const int64_t kBlockSize;
+
+  TimestampIndex();
+  TimestampIndex(const TimestampIndex&) = delete;
+  TimestampIndex& operator=(const TimestampIndex&) = delete;
+
+  // Indexes the entry |sequence_number|, if it is the one following
+  // those indexed already, otherwise leaves it to Lookup().
+  void Add(int64_t sequence_number, uint64_t timestamp);
+
+  // Indexes the entries of |db| up to its TreeSize(), and returns the
+  // first sequence number of the first block with entries timestamped
+  // at |timestamp| or later, or the tree size if there are none.
+  int64_t Lookup(const ReadOnlyDatabase& db, uint64_t timestamp) const;
+
+ private:
+  void AddLocked(const std::lock_guard<std::mutex>& lock,
+                 int64_t sequence_number, uint64_t timestamp) const;
+
+  // Held by Lookup() while it reads the entries not indexed yet, so
+  // that only one does. Add() does not wait for it.
+  mutable std::mutex catch_up_lock_;
+  // The members below are marked mutable, as Lookup() updates them
+  // with what it reads.
+  mutable std::mutex lock_;
+  // The number of entries indexed, all of those below it.
+  mutable int64_t size_;
+  // By block, the last of which can be incomplete. Never decreasing.
+  mutable std::vector<uint64_t> latest_timestamps_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_TIMESTAMP_INDEX_H_
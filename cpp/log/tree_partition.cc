@@ -0,0 +1,355 @@
+#include "log/tree_partition.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+#include <utility>
+
+#include "log/leaf_hash_index.h"
+#include "merkletree/merkle_tree.h"
+#include "merkletree/node_store.h"
+#include "merkletree/serial_hasher.h"
+
+using std::min;
+using std::move;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+// The largest power of two smaller than |n|, which must be at least 2.
+int64_t SplitPoint(int64_t n) {
+  int64_t k(1);
+  while (k << 1 < n) {
+    k <<= 1;
+  }
+  return k;
+}
+
+
+bool IsPowerOfTwo(int64_t n) {
+  return n > 0 && (n & (n - 1)) == 0;
+}
+
+
+int Log2(int64_t n) {
+  int log(0);
+  while (n > 1) {
+    n >>= 1;
+    ++log;
+  }
+  return log;
+}
+
+
+}  // namespace
+
+
+TreePartition::TreePartition(int partition_bits, int64_t partition_index)
+    : partition_bits_(partition_bits),
+      hasher_(unique_ptr<SerialHasher>(new Sha256Hasher)),
+      leaf_count_(0) {
+  CHECK_GE(partition_bits_, 0);
+  CHECK_LT(partition_bits_, 62);
+  CHECK_GE(partition_index, 0);
+  ResetRange(partition_index << partition_bits_, &own_);
+  newest_.begin = -1;
+  newest_.store = nullptr;
+}
+
+
+TreePartition::~TreePartition() {
+}
+
+
+void TreePartition::ResetRange(int64_t begin, Range* range) {
+  // The index refers to the tree, which must outlive it.
+  range->index.reset();
+  unique_ptr<MerkleTreeNodeStore> store(
+      new MemoryNodeStore(hasher_.DigestSize()));
+  range->begin = begin;
+  range->store = store.get();
+  range->tree.reset(new MerkleTree(
+      unique_ptr<SerialHasher>(new Sha256Hasher), move(store)));
+  range->index.reset(new LeafHashIndex(range->tree.get()));
+}
+
+
+void TreePartition::AddLeafHashes(const vector<string>& leaf_hashes) {
+  size_t i(0);
+  while (i < leaf_hashes.size()) {
+    const int64_t range_begin(leaf_count_ & ~(RangeSize() - 1));
+    Range* range(&own_);
+    if (range_begin != own_.begin) {
+      if (newest_.begin != range_begin) {
+        ResetRange(range_begin, &newest_);
+      }
+      range = &newest_;
+    }
+
+    // Up to the end of the range.
+    const size_t count(min<int64_t>(leaf_hashes.size() - i,
+                                    range_begin + RangeSize() - leaf_count_));
+    const vector<string> batch(leaf_hashes.begin() + i,
+                               leaf_hashes.begin() + i + count);
+    range->tree->AddLeafHashes(batch);
+    for (size_t j = 0; j < count; ++j) {
+      range->index->Insert(batch[j], leaf_count_ - range_begin + j);
+    }
+    const string root(range->tree->CurrentRoot());
+    leaf_count_ += count;
+    i += count;
+
+    if (leaf_count_ == range_begin + RangeSize()) {
+      AddRangeRoot(root);
+      if (range == &newest_) {
+        newest_.index.reset();
+        newest_.tree.reset();
+        newest_.store = nullptr;
+        newest_.begin = -1;
+      }
+    }
+  }
+}
+
+
+void TreePartition::AddRangeRoot(const string& root) {
+  string node(root);
+  for (size_t level = 0;; ++level) {
+    if (top_levels_.size() <= level) {
+      top_levels_.emplace_back();
+    }
+    vector<string>* const nodes(&top_levels_[level]);
+    nodes->push_back(node);
+    if (nodes->size() % 2 != 0) {
+      break;
+    }
+    node = hasher_.HashChildren((*nodes)[nodes->size() - 2], nodes->back());
+  }
+}
+
+
+void TreePartition::RecordSnapshot() {
+  if (leaf_count_ % RangeSize() == 0 || FindRange(leaf_count_ - 1) == &own_) {
+    return;
+  }
+  const int64_t range_begin(leaf_count_ & ~(RangeSize() - 1));
+  string root;
+  CHECK(RangeSubtreeHash(newest_, range_begin, leaf_count_, &root));
+  snapshot_roots_[leaf_count_] = root;
+}
+
+
+int64_t TreePartition::FindLeaf(const string& leaf_hash) const {
+  // The own range comes first, if it is before the newest one.
+  for (const Range* range : {&own_, &newest_}) {
+    if (range->index) {
+      const int64_t index(range->index->Find(leaf_hash));
+      if (index >= 0) {
+        return range->begin + index;
+      }
+    }
+  }
+  return -1;
+}
+
+
+string TreePartition::LeafHash(int64_t index) const {
+  const Range* const range(index >= 0 ? FindRange(index) : nullptr);
+  if (!range || index >= leaf_count_) {
+    return string();
+  }
+  return range->tree->LeafHash(index - range->begin + 1);
+}
+
+
+bool TreePartition::RootAtSnapshot(int64_t tree_size, string* root) const {
+  CHECK_NOTNULL(root);
+  CHECK_LE(tree_size, leaf_count_);
+  if (tree_size <= 0) {
+    *root = hasher_.HashEmpty();
+    return true;
+  }
+  return SubtreeHash(0, tree_size, root);
+}
+
+
+bool TreePartition::PathToRootAtSnapshot(int64_t index, int64_t tree_size,
+                                         vector<string>* path) const {
+  CHECK_NOTNULL(path)->clear();
+  CHECK_LE(tree_size, leaf_count_);
+  if (index < 0 || index >= tree_size) {
+    return true;
+  }
+  return Path(index, 0, tree_size, path);
+}
+
+
+bool TreePartition::SnapshotConsistency(int64_t first, int64_t tree_size,
+                                        vector<string>* proof) const {
+  CHECK_NOTNULL(proof)->clear();
+  CHECK_LE(tree_size, leaf_count_);
+  if (first <= 0 || first >= tree_size) {
+    return true;
+  }
+  return SubProof(first, 0, tree_size, true, proof);
+}
+
+
+bool TreePartition::FrontierAtSnapshot(int64_t tree_size,
+                                       vector<string>* frontier) const {
+  CHECK_NOTNULL(frontier)->clear();
+  CHECK_LE(tree_size, leaf_count_);
+  for (int level = 0; tree_size >> level > 0; ++level) {
+    frontier->emplace_back();
+    if ((tree_size >> level) & 1) {
+      const int64_t begin(((tree_size >> level) - 1) << level);
+      if (!SubtreeHash(begin, begin + (int64_t(1) << level),
+                       &frontier->back())) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+
+const TreePartition::Range* TreePartition::FindRange(int64_t index) const {
+  const int64_t range_begin(index & ~(RangeSize() - 1));
+  if (range_begin == own_.begin) {
+    return &own_;
+  }
+  if (newest_.tree && range_begin == newest_.begin) {
+    return &newest_;
+  }
+  return nullptr;
+}
+
+
+bool TreePartition::SubtreeHash(int64_t begin, int64_t end,
+                                string* hash) const {
+  const int64_t size(end - begin);
+  CHECK_LT(0, size);
+  CHECK_LE(end, leaf_count_);
+
+  const int64_t range_begin(begin & ~(RangeSize() - 1));
+  if (end <= range_begin + RangeSize()) {
+    const Range* const range(FindRange(begin));
+    if (range) {
+      return RangeSubtreeHash(*range, begin, end, hash);
+    }
+    // Of the other ranges, only their root is kept.
+    if (begin != range_begin) {
+      return false;
+    }
+    if (size == RangeSize()) {
+      *hash = top_levels_[0][begin >> partition_bits_];
+      return true;
+    }
+    const auto it(snapshot_roots_.find(end));
+    if (it == snapshot_roots_.end()) {
+      return false;
+    }
+    *hash = it->second;
+    return true;
+  }
+
+  // Whole ranges are in the top levels.
+  if (begin == range_begin && IsPowerOfTwo(size)) {
+    const int level(Log2(size) - partition_bits_);
+    *hash = top_levels_[level][begin / size];
+    return true;
+  }
+
+  const int64_t split(begin + SplitPoint(size));
+  string left, right;
+  if (!SubtreeHash(begin, split, &left) || !SubtreeHash(split, end, &right)) {
+    return false;
+  }
+  *hash = hasher_.HashChildren(left, right);
+  return true;
+}
+
+
+bool TreePartition::RangeSubtreeHash(const Range& range, int64_t begin,
+                                     int64_t end, string* hash) const {
+  const int64_t size(end - begin);
+  const int64_t offset(begin - range.begin);
+  // Complete subtrees are nodes of the tree of the range.
+  if (IsPowerOfTwo(size) && offset % size == 0) {
+    const int level(Log2(size));
+    hash->assign(range.store->Node(level, offset / size),
+                 range.store->NodeSize());
+    return true;
+  }
+
+  const int64_t split(begin + SplitPoint(size));
+  string left, right;
+  if (!RangeSubtreeHash(range, begin, split, &left) ||
+      !RangeSubtreeHash(range, split, end, &right)) {
+    return false;
+  }
+  *hash = hasher_.HashChildren(left, right);
+  return true;
+}
+
+
+bool TreePartition::Path(int64_t index, int64_t begin, int64_t end,
+                         vector<string>* path) const {
+  const int64_t size(end - begin);
+  if (size == 1) {
+    return true;
+  }
+  const int64_t split(begin + SplitPoint(size));
+  string sibling;
+  if (index < split) {
+    if (!Path(index, begin, split, path) ||
+        !SubtreeHash(split, end, &sibling)) {
+      return false;
+    }
+  } else {
+    if (!Path(index, split, end, path) ||
+        !SubtreeHash(begin, split, &sibling)) {
+      return false;
+    }
+  }
+  path->push_back(sibling);
+  return true;
+}
+
+
+bool TreePartition::SubProof(int64_t first, int64_t begin, int64_t end,
+                             bool complete, vector<string>* proof) const {
+  const int64_t size(end - begin);
+  if (first == end) {
+    if (complete) {
+      return true;
+    }
+    string hash;
+    if (!SubtreeHash(begin, end, &hash)) {
+      return false;
+    }
+    proof->push_back(hash);
+    return true;
+  }
+  const int64_t split(begin + SplitPoint(size));
+  string node;
+  if (first <= split) {
+    if (!SubProof(first, begin, split, complete, proof) ||
+        !SubtreeHash(split, end, &node)) {
+      return false;
+    }
+  } else {
+    if (!SubProof(first, split, end, false, proof) ||
+        !SubtreeHash(begin, split, &node)) {
+      return false;
+    }
+  }
+  proof->push_back(node);
+  return true;
+}
+
+
+}  // namespace cert_trans
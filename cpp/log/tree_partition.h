@@ -0,0 +1,140 @@
+#ifndef CERT_TRANS_LOG_TREE_PARTITION_H_
+#define CERT_TRANS_LOG_TREE_PARTITION_H_
+
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "merkletree/tree_hasher.h"
+
+class MerkleTree;
+
+namespace cert_trans {
+
+class LeafHashIndex;
+class MerkleTreeNodeStore;
+
+
+// One partition of a Merkle tree, for serving the proofs of a log too
+// large for one machine from several, each of which only keeps:
+//   - the leaves and nodes of its own range of the tree, the
+//     |partition_index|-th range of 2^|partition_bits| leaves;
+//   - the root of every complete range, and the levels of the tree
+//     above those (the "top levels"), which all partitions share;
+//   - the leaves and nodes of the newest range, while it is
+//     incomplete, so that every partition can serve the newest leaves;
+//   - the root of the newest range as of each RecordSnapshot(), for
+//     once it is complete.
+// Leaves must be added in order, all of them, as they come.
+//
+// The proofs need nodes of other ranges only where they are complete
+// subtrees of whole ranges, or the right edge of the tree at a recorded
+// snapshot, so a partition can serve audit paths for its own leaves
+// and the newest ones at those tree sizes, and consistency proofs from
+// a tree size within its own range or the newest one. Anything else is
+// left to the partition owning the range.
+//
+// This class is thread-compatible, but not thread-safe.
+class TreePartition {
+ public:
+  TreePartition(int partition_bits, int64_t partition_index);
+  ~TreePartition();
+  TreePartition(const TreePartition&) = delete;
+  TreePartition& operator=(const TreePartition&) = delete;
+
+  // The leaves of the range this partition owns.
+  int64_t begin() const {
+    return own_.begin;
+  }
+  int64_t end() const {
+    return own_.begin + RangeSize();
+  }
+
+  // Number of leaves added, whether kept or not.
+  int64_t LeafCount() const {
+    return leaf_count_;
+  }
+
+  // Adds |leaf_hashes|, the leaves following the LeafCount() first.
+  void AddLeafHashes(const std::vector<std::string>& leaf_hashes);
+
+  // Keeps the root of the newest range as of LeafCount(), so that
+  // proofs at this tree size can still be served once it is complete.
+  // For the tree heads, as they are published.
+  void RecordSnapshot();
+
+  // The (0-based) index of the first leaf with hash |leaf_hash|, if it
+  // is in the own range or the newest one, -1 otherwise.
+  int64_t FindLeaf(const std::string& leaf_hash) const;
+
+  // The hash of the leaf at |index|, or empty if it is not kept.
+  std::string LeafHash(int64_t index) const;
+
+  // The lookups below, at tree size |tree_size|, which must be no more
+  // than LeafCount(). They return false if they need nodes that this
+  // partition does not have.
+  bool RootAtSnapshot(int64_t tree_size, std::string* root) const;
+  // The audit path of the leaf at |index|, from the leaf up.
+  bool PathToRootAtSnapshot(int64_t index, int64_t tree_size,
+                            std::vector<std::string>* path) const;
+  // The consistency proof from |first| to |tree_size|, as
+  // MerkleTree::SnapshotConsistency().
+  bool SnapshotConsistency(int64_t first, int64_t tree_size,
+                           std::vector<std::string>* proof) const;
+  // The right edge of the tree, as StoredMerkleTree::FrontierAtSnapshot(),
+  // for a CompactMerkleTree.
+  bool FrontierAtSnapshot(int64_t tree_size,
+                          std::vector<std::string>* frontier) const;
+
+ private:
+  // A range whose leaves and nodes are kept.
+  struct Range {
+    int64_t begin;
+    std::unique_ptr<MerkleTree> tree;
+    // Owned by |tree|.
+    const MerkleTreeNodeStore* store;
+    std::unique_ptr<LeafHashIndex> index;
+  };
+
+  int64_t RangeSize() const {
+    return int64_t(1) << partition_bits_;
+  }
+
+  void ResetRange(int64_t begin, Range* range);
+  // The kept range with the leaf at |index|, or NULL.
+  const Range* FindRange(int64_t index) const;
+  // Adds the root of the range which was just completed.
+  void AddRangeRoot(const std::string& root);
+
+  // Sets |hash| to the hash of the leaves [|begin|, |end|) as they
+  // make up a subtree of the tree of size |end|, as in the RFC 6962
+  // definition of MTH(D[begin:end]).
+  bool SubtreeHash(int64_t begin, int64_t end, std::string* hash) const;
+  // As above, for leaves all within |range|.
+  bool RangeSubtreeHash(const Range& range, int64_t begin, int64_t end,
+                        std::string* hash) const;
+  // PATH() and SUBPROOF() of RFC 6962, appending to |proof|.
+  bool Path(int64_t index, int64_t begin, int64_t end,
+            std::vector<std::string>* path) const;
+  bool SubProof(int64_t first, int64_t begin, int64_t end, bool complete,
+                std::vector<std::string>* proof) const;
+
+  const int partition_bits_;
+  const TreeHasher hasher_;
+  Range own_;
+  // Set while the newest range is incomplete and is not |own_|.
+  Range newest_;
+  int64_t leaf_count_;
+  // The roots of the complete ranges first, then the levels above.
+  std::vector<std::vector<std::string>> top_levels_;
+  // The roots of the newest range at the recorded tree sizes, by tree
+  // size.
+  std::map<int64_t, std::string> snapshot_roots_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_LOG_TREE_PARTITION_H_
@@ -0,0 +1,154 @@
+#include <gtest/gtest.h>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "log/tree_partition.h"
+#include "merkletree/compact_merkle_tree.h"
+#include "merkletree/merkle_tree.h"
+#include "merkletree/serial_hasher.h"
+#include "util/testing.h"
+
+namespace {
+
+using cert_trans::TreePartition;
+using std::set;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+
+// Ranges of 4 leaves.
+const int kPartitionBits = 2;
+const int64_t kLeafCount = 37;
+
+class TreePartitionTest : public ::testing::Test {
+ protected:
+  TreePartitionTest() : tree_(unique_ptr<Sha256Hasher>(new Sha256Hasher)) {
+    for (int64_t i = 0; i < kLeafCount; ++i) {
+      tree_.AddLeaf(to_string(i));
+    }
+  }
+
+  // Adds the leaves of |tree_| to |partition| in batches of 1, 2, 3...
+  // leaves, recording a snapshot after each, in |snapshots_|.
+  void AddLeaves(TreePartition* partition) {
+    snapshots_.clear();
+    int64_t begin(0);
+    for (int64_t batch = 1; begin < kLeafCount; ++batch) {
+      vector<string> leaf_hashes;
+      for (; begin < kLeafCount && leaf_hashes.size() < batch; ++begin) {
+        leaf_hashes.push_back(tree_.LeafHash(begin + 1));
+      }
+      partition->AddLeafHashes(leaf_hashes);
+      partition->RecordSnapshot();
+      snapshots_.insert(partition->LeafCount());
+    }
+    EXPECT_EQ(kLeafCount, partition->LeafCount());
+  }
+
+  MerkleTree tree_;
+  set<int64_t> snapshots_;
+};
+
+TEST_F(TreePartitionTest, Roots) {
+  TreePartition partition(kPartitionBits, 2);
+  AddLeaves(&partition);
+  EXPECT_EQ(8, partition.begin());
+  EXPECT_EQ(12, partition.end());
+
+  string root;
+  vector<string> frontier;
+  for (int64_t tree_size = 0; tree_size <= kLeafCount; ++tree_size) {
+    const bool recorded(snapshots_.count(tree_size) > 0 ||
+                        tree_size % 4 == 0 ||
+                        (tree_size > 8 && tree_size <= 12));
+    if (partition.RootAtSnapshot(tree_size, &root)) {
+      EXPECT_EQ(tree_.RootAtSnapshot(tree_size), root) << tree_size;
+    } else {
+      EXPECT_FALSE(recorded) << tree_size;
+    }
+    // The frontier needs the nodes of the range at the right edge.
+    if (partition.FrontierAtSnapshot(tree_size, &frontier)) {
+      CompactMerkleTree compact(tree_size, frontier,
+                                unique_ptr<Sha256Hasher>(new Sha256Hasher));
+      EXPECT_EQ(tree_.RootAtSnapshot(tree_size), compact.CurrentRoot())
+          << tree_size;
+    } else {
+      EXPECT_FALSE(tree_size % 4 == 0 || (tree_size > 8 && tree_size <= 12) ||
+                   tree_size > 36)
+          << tree_size;
+    }
+  }
+}
+
+TEST_F(TreePartitionTest, AuditPaths) {
+  for (int64_t partition_index = 0; partition_index < 12; ++partition_index) {
+    TreePartition partition(kPartitionBits, partition_index);
+    AddLeaves(&partition);
+    vector<string> path;
+    for (int64_t tree_size = 1; tree_size <= kLeafCount; ++tree_size) {
+      for (int64_t index = 0; index < tree_size; ++index) {
+        const bool served(partition.PathToRootAtSnapshot(index, tree_size,
+                                                          &path));
+        if (served) {
+          EXPECT_EQ(tree_.PathToRootAtSnapshot(index + 1, tree_size), path)
+              << index << " " << tree_size;
+        }
+        // Its own leaves, and those of the newest range, at the
+        // recorded tree sizes.
+        if (snapshots_.count(tree_size) > 0 &&
+            (index / 4 == partition_index ||
+             (tree_size == kLeafCount && index >= 36))) {
+          EXPECT_TRUE(served) << partition_index << " " << index << " "
+                              << tree_size;
+        }
+      }
+    }
+  }
+}
+
+TEST_F(TreePartitionTest, Consistency) {
+  for (int64_t partition_index = 0; partition_index < 12; ++partition_index) {
+    TreePartition partition(kPartitionBits, partition_index);
+    AddLeaves(&partition);
+    vector<string> proof;
+    for (int64_t tree_size = 1; tree_size <= kLeafCount; ++tree_size) {
+      for (int64_t first = 1; first <= tree_size; ++first) {
+        const bool served(
+            partition.SnapshotConsistency(first, tree_size, &proof));
+        if (served) {
+          EXPECT_EQ(tree_.SnapshotConsistency(first, tree_size), proof)
+              << first << " " << tree_size;
+        }
+        // From within its own range.
+        if (snapshots_.count(tree_size) > 0 &&
+            (first - 1) / 4 == partition_index &&
+            first / 4 == partition_index) {
+          EXPECT_TRUE(served) << partition_index << " " << first << " "
+                              << tree_size;
+        }
+      }
+    }
+  }
+}
+
+TEST_F(TreePartitionTest, FindsLeaves) {
+  TreePartition partition(kPartitionBits, 3);
+  AddLeaves(&partition);
+  for (int64_t index = 0; index < kLeafCount; ++index) {
+    const string leaf_hash(tree_.LeafHash(index + 1));
+    // Its own range, and the newest one.
+    const bool kept((index >= 12 && index < 16) || index >= 36);
+    EXPECT_EQ(kept ? index : -1, partition.FindLeaf(leaf_hash)) << index;
+    EXPECT_EQ(kept ? leaf_hash : "", partition.LeafHash(index)) << index;
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -1,30 +1,50 @@
 #include "log/tree_signer.h"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <stdint.h>
 #include <algorithm>
 #include <chrono>
+#include <functional>
+#include <iterator>
+#include <limits>
 #include <set>
 #include <unordered_map>
 
+#include "base/notification.h"
+#include "log/admission_controller.h"
 #include "log/database.h"
 #include "log/log_signer.h"
+#include "merkletree/serial_hasher.h"
+#include "monitoring/latency.h"
 #include "proto/serializer.h"
+#include "util/executor.h"
+#include "util/parallel_for.h"
 #include "util/status.h"
+#include "util/sync_task.h"
 #include "util/util.h"
 
 using ct::ClusterNodeState;
+using ct::CompactTreeCheckpoint;
 using ct::SequenceMapping;
 using ct::SequenceMapping_Mapping;
 using ct::SignedTreeHead;
+using std::bind;
 using std::chrono::duration;
 using std::chrono::milliseconds;
+using std::chrono::steady_clock;
 using std::chrono::system_clock;
+using std::lock_guard;
+using std::lower_bound;
 using std::make_pair;
 using std::map;
 using std::max;
 using std::move;
+using std::min;
+using std::mutex;
+using std::numeric_limits;
 using std::pair;
+using std::placeholders::_1;
 using std::sort;
 using std::string;
 using std::unique_ptr;
@@ -35,9 +55,24 @@ using util::StatusOr;
 using util::TimeInMilliseconds;
 using util::ToBase64;
 
+DEFINE_int32(tree_signer_update_batch_size, 4096,
+             "Number of entries read from the database at a time when "
+             "updating the tree with an executor.");
+
 namespace cert_trans {
 namespace {
 
+// Number of leaves hashed by each unit of parallel work.
+const size_t kLeafHashChunkSize = 256;
+
+
+static Latency<milliseconds, string> tree_signer_update_tree_latency_ms(
+    "tree_signer_update_tree_latency_ms", "stage",
+    "Latency of the stages of TreeSigner::UpdateTree() in ms: reading "
+    "entries (which overlaps with the other stages, when pipelined), "
+    "waiting for them, hashing, appending to the tree, and signing.");
+
+
 
 bool LessThanBySequence(const SequenceMapping::Mapping& lhs,
                         const SequenceMapping::Mapping& rhs) {
@@ -71,13 +106,19 @@ bool PendingEntriesOrder::operator()(const EntryHandle<LoggedEntry>& x,
 
 TreeSigner::TreeSigner(const duration<double>& guard_window, Database* db,
                        unique_ptr<CompactMerkleTree> merkle_tree,
-                       ConsistentStore* consistent_store, LogSigner* signer)
+                       ConsistentStore* consistent_store, LogSigner* signer,
+                       util::Executor* executor)
     : guard_window_(guard_window),
       db_(db),
       consistent_store_(consistent_store),
       signer_(signer),
       cert_tree_(move(merkle_tree)),
-      latest_tree_head_() {
+      executor_(executor),
+      admission_(nullptr),
+      latest_tree_head_(),
+      checkpointed_tree_size_(-1),
+      pending_watch_task_(executor ? new util::SyncTask(executor) : nullptr),
+      received_pending_entries_(false) {
   CHECK(cert_tree_);
   // Try to get any STH previously published by this node.
   const StatusOr<ClusterNodeState> node_state(
@@ -89,6 +130,52 @@ TreeSigner::TreeSigner(const duration<double>& guard_window, Database* db,
   if (node_state.ok()) {
     latest_tree_head_ = node_state.ValueOrDie().newest_sth();
   }
+
+  if (pending_watch_task_) {
+    consistent_store_->WatchPendingEntries(
+        bind(&TreeSigner::OnPendingEntriesUpdated, this, _1),
+        pending_watch_task_->task());
+  }
+}
+
+
+TreeSigner::~TreeSigner() {
+  if (pending_watch_task_) {
+    pending_watch_task_->Cancel();
+    pending_watch_task_->Wait();
+  }
+}
+
+
+// static
+unique_ptr<CompactMerkleTree> TreeSigner::TreeFromCheckpoint(
+    const ReadOnlyDatabase* db) {
+  CompactTreeCheckpoint checkpoint;
+  if (CHECK_NOTNULL(db)->LatestTreeCheckpoint(&checkpoint) !=
+      Database::LOOKUP_OK) {
+    return nullptr;
+  }
+  // The entries past the last sync can have been lost along the way.
+  if (checkpoint.tree_size() > db->TreeSize()) {
+    LOG(WARNING) << "Ignoring tree checkpoint of size "
+                 << checkpoint.tree_size() << ", the database only has "
+                 << db->TreeSize() << " entries";
+    return nullptr;
+  }
+
+  unique_ptr<CompactMerkleTree> tree(new CompactMerkleTree(
+      checkpoint.tree_size(),
+      vector<string>(checkpoint.frontier().begin(),
+                     checkpoint.frontier().end()),
+      unique_ptr<Sha256Hasher>(new Sha256Hasher)));
+  if (tree->CurrentRoot() != checkpoint.sha256_root_hash()) {
+    LOG(WARNING) << "Ignoring tree checkpoint of size "
+                 << checkpoint.tree_size() << " with a mismatched root";
+    return nullptr;
+  }
+  LOG(INFO) << "Restored the tree of size " << checkpoint.tree_size()
+            << " from its checkpoint";
+  return tree;
 }
 
 
@@ -99,6 +186,10 @@ uint64_t TreeSigner::LastUpdateTime() const {
 
 Status TreeSigner::SequenceNewEntries() {
   const system_clock::time_point now(system_clock::now());
+  if (pending_watch_task_) {
+    return SequenceWatchedEntries(now);
+  }
+
   StatusOr<int64_t> status_or_sequence_number(
       consistent_store_->NextAvailableSequenceNumber());
   if (!status_or_sequence_number.ok()) {
@@ -217,19 +308,292 @@ Status TreeSigner::SequenceNewEntries() {
 
   // Now add the sequenced entries to our local DB so that the local signer can
   // incorporate them.
+  vector<const LoggedEntry*> new_entries;
   for (auto it(seq_to_entry.find(db_->TreeSize())); it != seq_to_entry.end();
        ++it) {
     VLOG(1) << "Adding to local DB: " << it->first;
     CHECK_EQ(it->first, it->second->sequence_number());
-    CHECK_EQ(Database::OK, db_->CreateSequencedEntry(*(it->second)));
+    new_entries.push_back(it->second);
+  }
+  WriteSequencedEntries(new_entries);
+
+  VLOG(1) << "Sequenced " << num_sequenced << " entries.";
+
+  return ::util::OkStatus();
+}
+
+
+// This follows the same rules as SequenceNewEntries() above, but
+// starting from the state left by its previous run.
+Status TreeSigner::SequenceWatchedEntries(
+    const system_clock::time_point& now) {
+  if (!ApplyPendingEntryUpdates()) {
+    return Status(util::error::UNAVAILABLE,
+                  "Pending entries not received yet.");
+  }
+
+  const StatusOr<SignedTreeHead> serving_sth(
+      consistent_store_->GetServingSTH());
+  if (!serving_sth.ok()) {
+    LOG(WARNING) << "Failed to get ServingSTH: " << serving_sth.status();
+    return serving_sth.status();
+  }
+  CHECK_LE(serving_sth.ValueOrDie().tree_size(), INT64_MAX);
+  const int64_t serving_tree_size(serving_sth.ValueOrDie().tree_size());
+
+  if (!mapping_) {
+    const Status status(LoadSequenceMapping());
+    if (!status.ok()) {
+      return status;
+    }
   }
 
+  EntryHandle<SequenceMapping> mapping(*mapping_);
+  int64_t next_sequence_number(serving_tree_size);
+  if (mapping.Entry().mapping_size() > 0) {
+    next_sequence_number =
+        mapping.Entry()
+            .mapping(mapping.Entry().mapping_size() - 1)
+            .sequence_number() +
+        1;
+  }
+  CHECK_GE(next_sequence_number, 0);
+  VLOG(1) << "Next available sequence number: " << next_sequence_number;
+
+  // Drop the mappings of the entries no longer pending, which must be
+  // in the serving tree already.
+  if (!removed_.empty()) {
+    google::protobuf::RepeatedPtrField<SequenceMapping_Mapping> kept;
+    for (const auto& m : mapping.Entry().mapping()) {
+      if (removed_.count(m.entry_hash()) > 0) {
+        CHECK_LT(m.sequence_number(), serving_tree_size);
+      } else {
+        *kept.Add() = m;
+      }
+    }
+    mapping.MutableEntry()->mutable_mapping()->Swap(&kept);
+  }
+
+  // Those are in timestamp order, so the ones too recent are all at
+  // the end.
+  auto unsequenced_end(unsequenced_.begin());
+  for (; unsequenced_end != unsequenced_.end(); ++unsequenced_end) {
+    const system_clock::time_point cert_time(
+        milliseconds(unsequenced_end->first));
+    if (now - cert_time < guard_window_) {
+      VLOG(1) << "Entry too recent: " << ToBase64(unsequenced_end->second);
+      break;
+    }
+    VLOG(1) << ToBase64(unsequenced_end->second) << " = "
+            << next_sequence_number;
+    SequenceMapping::Mapping* const seq_mapping(
+        mapping.MutableEntry()->add_mapping());
+    seq_mapping->set_sequence_number(next_sequence_number);
+    seq_mapping->set_entry_hash(unsequenced_end->second);
+    ++next_sequence_number;
+  }
+  const int num_sequenced(
+      std::distance(unsequenced_.begin(), unsequenced_end));
+  VLOG(1) << "Sequencing " << num_sequenced << " new entr"
+          << (num_sequenced == 1 ? "y" : "ies");
+
+  if (mapping.Entry().mapping_size() > 0) {
+    CHECK_LE(mapping.Entry().mapping(0).sequence_number(), serving_tree_size);
+  }
+
+  const Status status(consistent_store_->UpdateSequenceMapping(&mapping));
+  if (!status.ok()) {
+    // It may have been changed by someone else, start over from what
+    // is stored next time.
+    ResetSequenceMapping();
+    return status;
+  }
+
+  const int mapping_size(mapping.Entry().mapping_size());
+  for (int i = mapping_size - num_sequenced; i < mapping_size; ++i) {
+    const SequenceMapping::Mapping& m(mapping.Entry().mapping(i));
+    CHECK(sequenced_.emplace(m.entry_hash(), m.sequence_number()).second);
+  }
+  unsequenced_.erase(unsequenced_.begin(), unsequenced_end);
+  for (const string& hash : removed_) {
+    CHECK_EQ(1U, sequenced_.erase(hash));
+  }
+  removed_.clear();
+  *mapping_ = move(mapping);
+
+  // Now add the sequenced entries to our local DB so that the local signer can
+  // incorporate them.
+  const int64_t tree_size(db_->TreeSize());
+  SequenceMapping::Mapping tree_size_mapping;
+  tree_size_mapping.set_sequence_number(tree_size);
+  vector<LoggedEntry> new_entries;
+  for (auto it(lower_bound(mapping_->Entry().mapping().begin(),
+                           mapping_->Entry().mapping().end(),
+                           tree_size_mapping, LessThanBySequence));
+       it != mapping_->Entry().mapping().end() &&
+       it->sequence_number() ==
+           tree_size + static_cast<int64_t>(new_entries.size());
+       ++it) {
+    const auto pending_it(pending_.find(it->entry_hash()));
+    if (pending_it == pending_.end()) {
+      break;
+    }
+    VLOG(1) << "Adding to local DB: " << it->sequence_number();
+    new_entries.emplace_back();
+    new_entries.back().CopyFrom(pending_it->second);
+    new_entries.back().set_sequence_number(it->sequence_number());
+  }
+  vector<const LoggedEntry*> new_entry_ptrs;
+  new_entry_ptrs.reserve(new_entries.size());
+  for (const LoggedEntry& entry : new_entries) {
+    new_entry_ptrs.push_back(&entry);
+  }
+  WriteSequencedEntries(new_entry_ptrs);
+
   VLOG(1) << "Sequenced " << num_sequenced << " entries.";
 
   return ::util::OkStatus();
 }
 
 
+void TreeSigner::OnPendingEntriesUpdated(
+    const vector<Update<LoggedEntry>>& updates) {
+  lock_guard<mutex> lock(watch_lock_);
+  for (const auto& update : updates) {
+    pending_updates_.push_back(update);
+  }
+  received_pending_entries_ = true;
+}
+
+
+bool TreeSigner::ApplyPendingEntryUpdates() {
+  vector<Update<LoggedEntry>> updates;
+  {
+    lock_guard<mutex> lock(watch_lock_);
+    if (!received_pending_entries_) {
+      return false;
+    }
+    updates.swap(pending_updates_);
+  }
+
+  for (const auto& update : updates) {
+    const string& key(update.handle_.Key());
+    const auto key_it(pending_hashes_.find(key));
+    if (key_it != pending_hashes_.end()) {
+      RemovePendingEntry(key_it->second);
+      pending_hashes_.erase(key_it);
+    }
+    if (!update.exists_) {
+      continue;
+    }
+
+    const LoggedEntry& entry(update.handle_.Entry());
+    CHECK(!entry.has_sequence_number());
+    const string hash(entry.Hash());
+    pending_hashes_.emplace(key, hash);
+    CHECK(pending_.emplace(hash, entry).second);
+    removed_.erase(hash);
+    // Without |mapping_|, this is all worked out when reading it.
+    if (mapping_ && sequenced_.count(hash) == 0) {
+      unsequenced_.emplace(entry.timestamp(), hash);
+    }
+  }
+  return true;
+}
+
+
+void TreeSigner::RemovePendingEntry(const string& hash) {
+  const auto it(pending_.find(hash));
+  CHECK(it != pending_.end());
+  unsequenced_.erase(make_pair(it->second.timestamp(), hash));
+  if (sequenced_.count(hash) > 0) {
+    removed_.insert(hash);
+  }
+  pending_.erase(it);
+}
+
+
+Status TreeSigner::LoadSequenceMapping() {
+  ResetSequenceMapping();
+  unique_ptr<EntryHandle<SequenceMapping>> mapping(
+      new EntryHandle<SequenceMapping>);
+  const Status status(consistent_store_->GetSequenceMapping(mapping.get()));
+  if (!status.ok()) {
+    return status;
+  }
+
+  for (const auto& m : mapping->Entry().mapping()) {
+    CHECK(sequenced_.emplace(m.entry_hash(), m.sequence_number()).second);
+    if (pending_.count(m.entry_hash()) == 0) {
+      removed_.insert(m.entry_hash());
+    }
+  }
+  for (const auto& pending : pending_) {
+    if (sequenced_.count(pending.first) == 0) {
+      unsequenced_.emplace(pending.second.timestamp(), pending.first);
+    }
+  }
+  mapping_ = move(mapping);
+  return ::util::OkStatus();
+}
+
+
+void TreeSigner::ResetSequenceMapping() {
+  mapping_.reset();
+  sequenced_.clear();
+  unsequenced_.clear();
+  removed_.clear();
+}
+
+
+void TreeSigner::WriteSequencedEntries(
+    const vector<const LoggedEntry*>& entries) {
+  const steady_clock::time_point started(steady_clock::now());
+  CHECK_EQ(Database::OK, db_->CreateSequencedEntries(entries));
+  if (admission_) {
+    admission_->RecordLatency(
+        AdmissionController::Signal::DB_WRITE_LATENCY,
+        steady_clock::now() - started);
+  }
+}
+
+
+Status TreeSigner::SequencingBacklog(Backlog* backlog) {
+  CHECK_NOTNULL(backlog);
+  if (!pending_watch_task_ || !ApplyPendingEntryUpdates() || !mapping_) {
+    return Status(util::error::UNAVAILABLE,
+                  "Sequencing backlog not known yet.");
+  }
+
+  const system_clock::time_point now(system_clock::now());
+  backlog->entries = 0;
+  backlog->oldest_timestamp = 0;
+  for (const auto& unsequenced : unsequenced_) {
+    if (now - system_clock::time_point(milliseconds(unsequenced.first)) <
+        guard_window_) {
+      break;
+    }
+    ++backlog->entries;
+  }
+  if (backlog->entries > 0) {
+    backlog->oldest_timestamp = unsequenced_.begin()->first;
+  }
+  return ::util::OkStatus();
+}
+
+
+TreeSigner::Backlog TreeSigner::UpdateBacklog() const {
+  const int64_t leaf_count(cert_tree_->LeafCount());
+  Backlog backlog{max<int64_t>(db_->TreeSize() - leaf_count, 0), 0};
+  LoggedEntry logged;
+  if (backlog.entries > 0 &&
+      db_->LookupByIndex(leaf_count, &logged) == Database::LOOKUP_OK) {
+    backlog.oldest_timestamp = logged.timestamp();
+  }
+  return backlog;
+}
+
+
 // DB_ERROR: the database is inconsistent with our inner self.
 // However, if the database itself is giving inconsistent answers, or failing
 // reads/writes, then we die.
@@ -240,15 +604,10 @@ typename TreeSigner::UpdateResult TreeSigner::UpdateTree() {
   uint64_t min_timestamp = LastUpdateTime() + 1;
 
   // Add any newly sequenced entries from our local DB.
-  auto it(db_->ScanEntries(cert_tree_->LeafCount()));
-  for (int64_t i(cert_tree_->LeafCount());; ++i) {
-    LoggedEntry logged;
-    if (!it->GetNextEntry(&logged) || logged.sequence_number() != i) {
-      break;
-    }
-    CHECK_EQ(logged.sequence_number(), i);
-    AppendToTree(logged);
-    min_timestamp = max(min_timestamp, logged.sct().timestamp());
+  if (executor_) {
+    AppendNewEntriesPipelined(&min_timestamp);
+  } else {
+    AppendNewEntries(&min_timestamp);
   }
   int64_t next_seq(cert_tree_->LeafCount());
   CHECK_GE(next_seq, 0);
@@ -257,7 +616,14 @@ typename TreeSigner::UpdateResult TreeSigner::UpdateTree() {
   // a matching sequence number in the database (at least assuming overwriting
   // the sequence number is not allowed).
   SignedTreeHead new_sth;
-  TimestampAndSign(min_timestamp, &new_sth);
+  {
+    ScopedLatency latency(
+        tree_signer_update_tree_latency_ms.GetScopedLatency("sign"));
+    TimestampAndSign(min_timestamp, &new_sth);
+  }
+  if (next_seq != checkpointed_tree_size_) {
+    WriteTreeCheckpoint(new_sth.sha256_root_hash());
+  }
 
   // We don't actually store this STH anywhere durable yet, but rather let the
   // caller decide what to do with it.  (In practice, this will mean that it's
@@ -268,10 +634,131 @@ typename TreeSigner::UpdateResult TreeSigner::UpdateTree() {
 }
 
 
+void TreeSigner::AppendNewEntries(uint64_t* min_timestamp) {
+  ScopedLatency latency(
+      tree_signer_update_tree_latency_ms.GetScopedLatency("scan"));
+  const int64_t begin(cert_tree_->LeafCount());
+  auto it(db_->ScanEntries(begin));
+  vector<string> appended;
+  for (int64_t i(begin);; ++i) {
+    LoggedEntry logged;
+    if (!it->GetNextEntry(&logged) || logged.sequence_number() != i) {
+      break;
+    }
+    CHECK_EQ(logged.sequence_number(), i);
+    string leaf_hash(AppendToTree(logged));
+    if (leaves_appended_) {
+      appended.emplace_back(move(leaf_hash));
+    }
+    *min_timestamp = max(*min_timestamp, logged.sct().timestamp());
+  }
+  if (leaves_appended_ && !appended.empty()) {
+    leaves_appended_(begin, appended);
+  }
+}
+
+
+void TreeSigner::AppendNewEntriesPipelined(uint64_t* min_timestamp) {
+  CHECK_GT(FLAGS_tree_signer_update_batch_size, 0);
+  struct Batch {
+    vector<LoggedEntry> entries;
+    // The leaf hashes the database has for the first of |entries|.
+    vector<string> leaf_hashes;
+    Notification read;
+  };
+  const int64_t end(db_->TreeSize());
+  // Starts reading the entries from |start| on, if there are any.
+  const auto read_batch([this, end](int64_t start) {
+    unique_ptr<Batch> batch;
+    if (start < end) {
+      batch.reset(new Batch);
+      Batch* const b(batch.get());
+      const int64_t last(
+          min(end, start + FLAGS_tree_signer_update_batch_size) - 1);
+      // Only the last batch is of entries about to be served; the
+      // others are of a tree catching up with the database.
+      const Database::ReadPattern pattern(
+          last < end - 1 ? Database::BULK_SCAN : Database::POINT_READ);
+      executor_->Add([this, b, start, last, pattern]() {
+        ScopedLatency latency(
+            tree_signer_update_tree_latency_ms.GetScopedLatency("read"));
+        db_->ReadEntries(start, last, numeric_limits<size_t>::max(), pattern,
+                         &b->entries);
+        const unique_ptr<Database::LeafHashIterator> it(
+            db_->ScanLeafHashes(start));
+        int64_t seq;
+        string leaf_hash;
+        while (start + static_cast<int64_t>(b->leaf_hashes.size()) <= last &&
+               it->GetNextLeafHash(&seq, &leaf_hash) &&
+               seq == start + static_cast<int64_t>(b->leaf_hashes.size())) {
+          b->leaf_hashes.emplace_back(move(leaf_hash));
+        }
+        b->read.Notify();
+      });
+    }
+    return batch;
+  });
+
+  int64_t next(cert_tree_->LeafCount());
+  for (unique_ptr<Batch> batch(read_batch(next)); batch;) {
+    {
+      ScopedLatency latency(
+          tree_signer_update_tree_latency_ms.GetScopedLatency("read_wait"));
+      batch->read.WaitForNotification();
+    }
+    const vector<LoggedEntry> entries(move(batch->entries));
+    vector<string> hashes(move(batch->leaf_hashes));
+    // Only the entries that come next in the tree are appended, as in
+    // AppendNewEntries().
+    size_t count(0);
+    while (count < entries.size() &&
+           entries[count].sequence_number() ==
+               next + static_cast<int64_t>(count)) {
+      ++count;
+    }
+    batch.reset();
+    if (count > 0 && count == entries.size()) {
+      batch = read_batch(next + count);
+    }
+
+    // Only the leaf hashes the database did not have are computed.
+    const size_t known(min(count, hashes.size()));
+    hashes.resize(count);
+    {
+      ScopedLatency latency(
+          tree_signer_update_tree_latency_ms.GetScopedLatency("hash"));
+      const size_t missing(count - known);
+      util::ParallelFor(
+          executor_, (missing + kLeafHashChunkSize - 1) / kLeafHashChunkSize,
+          [&entries, &hashes, count, known](size_t chunk) {
+            const size_t chunk_end(
+                min(count, known + (chunk + 1) * kLeafHashChunkSize));
+            for (size_t i = known + chunk * kLeafHashChunkSize; i < chunk_end;
+                 ++i) {
+              CHECK(entries[i].LeafHash(&hashes[i]));
+            }
+          });
+    }
+    {
+      ScopedLatency latency(
+          tree_signer_update_tree_latency_ms.GetScopedLatency("append"));
+      cert_tree_->AddLeafHashes(hashes, executor_);
+      for (size_t i = 0; i < count; ++i) {
+        *min_timestamp = max(*min_timestamp, entries[i].sct().timestamp());
+      }
+    }
+    if (leaves_appended_ && count > 0) {
+      leaves_appended_(next, hashes);
+    }
+    next += count;
+  }
+}
+
+
 bool TreeSigner::Append(const LoggedEntry& logged) {
-  // Serialize for inclusion in the tree.
-  string serialized_leaf;
-  CHECK(logged.SerializeForLeaf(&serialized_leaf));
+  // Usually cached by the frontend, when the entry was submitted.
+  string leaf_hash;
+  CHECK(logged.LeafHash(&leaf_hash));
 
   CHECK_LE(cert_tree_->LeafCount(), static_cast<uint64_t>(INT64_MAX));
   CHECK_EQ(logged.sequence_number(),
@@ -287,18 +774,30 @@ bool TreeSigner::Append(const LoggedEntry& logged) {
   }
 
   // Update in-memory tree.
-  cert_tree_->AddLeaf(serialized_leaf);
+  cert_tree_->AddLeafHash(leaf_hash);
   return true;
 }
 
 
-void TreeSigner::AppendToTree(const LoggedEntry& logged) {
-  // Serialize for inclusion in the tree.
-  string serialized_leaf;
-  CHECK(logged.SerializeForLeaf(&serialized_leaf));
+string TreeSigner::AppendToTree(const LoggedEntry& logged) {
+  string leaf_hash;
+  CHECK(logged.LeafHash(&leaf_hash));
 
   // Update in-memory tree.
-  cert_tree_->AddLeaf(serialized_leaf);
+  cert_tree_->AddLeafHash(leaf_hash);
+  return leaf_hash;
+}
+
+
+void TreeSigner::WriteTreeCheckpoint(const string& root_hash) {
+  CompactTreeCheckpoint checkpoint;
+  checkpoint.set_tree_size(cert_tree_->LeafCount());
+  for (const string& node : cert_tree_->Frontier()) {
+    checkpoint.add_frontier(node);
+  }
+  checkpoint.set_sha256_root_hash(root_hash);
+  CHECK_EQ(Database::OK, db_->WriteTreeCheckpoint(checkpoint));
+  checkpointed_tree_size_ = checkpoint.tree_size();
 }
 
 
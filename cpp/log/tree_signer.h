@@ -4,6 +4,15 @@
 #include <stdint.h>
 #include <algorithm>
 #include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
 #include "log/cluster_state_controller.h"
 #include "log/consistent_store.h"
@@ -13,7 +22,9 @@
 
 
 namespace util {
+class Executor;
 class Status;
+class SyncTask;
 }  // namespace util
 
 class LogSigner;
@@ -21,7 +32,9 @@ class LogSigner;
 
 namespace cert_trans {
 
+class AdmissionController;
 class Database;
+class ReadOnlyDatabase;
 
 
 // Signer for appending new entries to the log.
@@ -34,9 +47,30 @@ class TreeSigner {
  public:
   // No transfer of ownership for params other than merkle_tree whose contents
   // is moved into this object.
+  //
+  // If |executor| is not NULL, the pending entries are tracked with a
+  // watch on |consistent_store| (run on |executor|), and
+  // SequenceNewEntries() only deals with what changed since it last
+  // ran. Otherwise, it reads all the pending entries every time.
+  // UpdateTree() also uses |executor|, if any, to read the new entries
+  // ahead, along with their leaf hashes, and hash those missing in
+  // parallel.
+  //
+  // |merkle_tree| must hash with SHA-256: the leaf hashes cached in the
+  // entries (see LoggedEntry::LeafHash()) and kept by |db| are used as
+  // they are, and only computed when missing.
   TreeSigner(const std::chrono::duration<double>& guard_window, Database* db,
              std::unique_ptr<CompactMerkleTree> merkle_tree,
-             cert_trans::ConsistentStore* consistent_store, LogSigner* signer);
+             cert_trans::ConsistentStore* consistent_store, LogSigner* signer,
+             util::Executor* executor = nullptr);
+  ~TreeSigner();
+
+  // The tree of the checkpoint UpdateTree() last wrote to |db|, which
+  // saves building the tree from the whole log on startup: only the
+  // entries past it are then appended by the first UpdateTree().
+  // Returns NULL if there is no usable checkpoint.
+  static std::unique_ptr<CompactMerkleTree> TreeFromCheckpoint(
+      const ReadOnlyDatabase* db);
 
   enum UpdateResult {
     OK,
@@ -46,14 +80,49 @@ class TreeSigner {
     INSUFFICIENT_DATA,
   };
 
+  // Has the time taken by each write of newly sequenced entries to the
+  // database recorded as the DB_WRITE_LATENCY signal of |admission|,
+  // which must outlive this instance. Must be called before
+  // SequenceNewEntries().
+  void SetAdmissionController(AdmissionController* admission) {
+    admission_ = admission;
+  }
+
+  // Called by UpdateTree() with the leaf hashes it appends to the
+  // tree, the first being that of the entry at |begin|.
+  typedef std::function<void(int64_t begin,
+                             const std::vector<std::string>& leaf_hashes)>
+      LeavesAppendedCallback;
+
+  // Has |callback| called with the leaves appended to the tree (before
+  // the tree head that covers them is signed), so that a LogLookup of
+  // the same database can add them without reading and hashing the
+  // entries again (see LogLookup::AddLeafHashes()). Must be called
+  // before UpdateTree().
+  void SetLeavesAppendedCallback(const LeavesAppendedCallback& callback) {
+    leaves_appended_ = callback;
+  }
+
   // Latest Tree Head timestamp;
   uint64_t LastUpdateTime() const;
 
+  // Must not be called concurrently. When watching the pending
+  // entries, this returns UNAVAILABLE until they are first received,
+  // and entries added since the latest update received are sequenced
+  // on the next run.
   util::Status SequenceNewEntries();
 
   // Simplest update mechanism: take all pending entries and append
   // (in random order) to the tree. Checks that the update it writes
-  // to the database is consistent with the latest STH.
+  // to the database is consistent with the latest STH. When the tree
+  // grew, a checkpoint of it is written to the database (see
+  // TreeFromCheckpoint()).
+  //
+  // With an executor, the entries are read in batches of
+  // --tree_signer_update_batch_size, the next one being read while the
+  // current one is hashed (on the executor and the calling thread) and
+  // appended, so this must not be called from a thread of the
+  // executor.
   UpdateResult UpdateTree();
 
   // Latest Tree Head (does not build a new tree, just retrieves the
@@ -62,17 +131,89 @@ class TreeSigner {
     return latest_tree_head_;
   }
 
+  // The entries waiting on the next SequenceNewEntries() or
+  // UpdateTree() run, for deciding when to do it.
+  struct Backlog {
+    int64_t entries;
+    // The timestamp of the first of them, in milliseconds, or 0 if
+    // there are none. They are sequenced in timestamp order, so this is
+    // about the oldest.
+    uint64_t oldest_timestamp;
+  };
+
+  // The pending entries that SequenceNewEntries() would sequence now
+  // (those past the guard window). Only available when watching the
+  // pending entries, once they were received and sequenced at least
+  // once. Must not be called concurrently with SequenceNewEntries().
+  util::Status SequencingBacklog(Backlog* backlog);
+
+  // The entries of the database that UpdateTree() would add to the
+  // tree. Must not be called concurrently with UpdateTree().
+  Backlog UpdateBacklog() const;
+
  private:
+  util::Status SequenceWatchedEntries(
+      const std::chrono::system_clock::time_point& now);
+  void OnPendingEntriesUpdated(
+      const std::vector<Update<LoggedEntry>>& updates);
+  // Brings |pending_| up to date with the updates received. Returns
+  // false if the pending entries were not received yet.
+  bool ApplyPendingEntryUpdates();
+  void RemovePendingEntry(const std::string& hash);
+  util::Status LoadSequenceMapping();
+  void ResetSequenceMapping();
+  // Writes entries just sequenced to |db_|.
+  void WriteSequencedEntries(const std::vector<const LoggedEntry*>& entries);
+
+  // Append the entries of the database that come next to the tree,
+  // raising |*min_timestamp| to the newest of their timestamps.
+  void AppendNewEntries(uint64_t* min_timestamp);
+  void AppendNewEntriesPipelined(uint64_t* min_timestamp);
+
   bool Append(const LoggedEntry& logged);
-  void AppendToTree(const LoggedEntry& logged_cert);
+  // Returns the leaf hash of |logged_cert|.
+  std::string AppendToTree(const LoggedEntry& logged_cert);
   void TimestampAndSign(uint64_t min_timestamp, ct::SignedTreeHead* sth);
+  void WriteTreeCheckpoint(const std::string& root_hash);
 
   const std::chrono::duration<double> guard_window_;
   Database* const db_;
   cert_trans::ConsistentStore* const consistent_store_;
   LogSigner* const signer_;
   const std::unique_ptr<CompactMerkleTree> cert_tree_;
+  util::Executor* const executor_;
+  // Can be NULL.
+  AdmissionController* admission_;
+  // Can be empty.
+  LeavesAppendedCallback leaves_appended_;
   ct::SignedTreeHead latest_tree_head_;
+  // The size of the tree last written with WriteTreeCheckpoint(), or
+  // -1 if none was.
+  int64_t checkpointed_tree_size_;
+
+  // The remaining members are only used when watching the pending
+  // entries.
+  const std::unique_ptr<util::SyncTask> pending_watch_task_;
+
+  std::mutex watch_lock_;
+  bool received_pending_entries_;
+  // The updates received since SequenceNewEntries() last ran.
+  std::vector<Update<LoggedEntry>> pending_updates_;
+
+  // The rest is only used by SequenceNewEntries().
+  // The pending entries, by hash, and their hashes, by key.
+  std::unordered_map<std::string, LoggedEntry> pending_;
+  std::unordered_map<std::string, std::string> pending_hashes_;
+  // The sequence mapping as last written, or NULL if it must be read
+  // again.
+  std::unique_ptr<EntryHandle<ct::SequenceMapping>> mapping_;
+  // The sequence numbers of the hashes in |mapping_|.
+  std::unordered_map<std::string, int64_t> sequenced_;
+  // The pending entries not in |mapping_|, by timestamp and hash,
+  // which is the order they are sequenced in.
+  std::set<std::pair<uint64_t, std::string>> unsequenced_;
+  // The hashes in |mapping_| no longer pending.
+  std::unordered_set<std::string> removed_;
 
   template <class T>
   friend class TreeSignerTest;
@@ -1,4 +1,5 @@
 /* -*- indent-tabs-mode: nil -*- */
+#include <gflags/gflags.h>
 #include <gtest/gtest.h>
 #include <stdint.h>
 #include <memory>
@@ -23,6 +24,8 @@
 #include "util/thread_pool.h"
 #include "util/util.h"
 
+DECLARE_int32(tree_signer_update_batch_size);
+
 namespace cert_trans {
 
 using cert_trans::EntryHandle;
@@ -32,6 +35,7 @@ using ct::ClusterNodeState;
 using ct::SequenceMapping;
 using ct::SignedTreeHead;
 using std::make_shared;
+using std::min;
 using std::move;
 using std::shared_ptr;
 using std::string;
@@ -119,6 +123,35 @@ class TreeSignerTest : public ::testing::Test {
                           store_.get(), log_signer_.get());
   }
 
+  // A signer that watches the pending entries.
+  TreeSigner* GetWatching() {
+    return new TreeSigner(std::chrono::duration<double>(0), db(),
+                          unique_ptr<CompactMerkleTree>(new CompactMerkleTree(
+                              *tree_signer_->cert_tree_,
+                              unique_ptr<Sha256Hasher>(new Sha256Hasher))),
+                          store_.get(), log_signer_.get(), &pool_);
+  }
+
+  int MappingSize() const {
+    EntryHandle<SequenceMapping> mapping;
+    CHECK_EQ(::util::OkStatus(), this->store_->GetSequenceMapping(&mapping));
+    return mapping.Entry().mapping_size();
+  }
+
+  // Runs |signer| until the sequence mapping has |size| entries, as
+  // the updates to the pending entries it watches come in their own
+  // time.
+  void SequenceUntil(TreeSigner* signer, int size) const {
+    for (int i = 0; i < 500; ++i) {
+      if (signer->SequenceNewEntries().ok() && MappingSize() == size) {
+        return;
+      }
+      usleep(10000);
+    }
+    ADD_FAILURE() << "sequence mapping still has " << MappingSize()
+                  << " entries, expected " << size;
+  }
+
   T* db() const {
     return test_db_->db();
   }
@@ -276,6 +309,66 @@ TYPED_TEST(TreeSignerTest, ResumePartialSign) {
 }
 
 
+TYPED_TEST(TreeSignerTest, ResumeFromCheckpoint) {
+  EXPECT_EQ(nullptr, TreeSigner::TreeFromCheckpoint(this->db()));
+
+  LoggedEntry logged_cert;
+  for (int64_t seq = 0; seq < 5; ++seq) {
+    this->test_signer_.CreateUnique(&logged_cert);
+    this->AddSequencedEntry(&logged_cert, seq);
+  }
+  EXPECT_EQ(TreeSigner::OK, this->tree_signer_->UpdateTree());
+  const SignedTreeHead sth(this->tree_signer_->LatestSTH());
+
+  unique_ptr<CompactMerkleTree> tree(
+      TreeSigner::TreeFromCheckpoint(this->db()));
+  ASSERT_TRUE(tree);
+  EXPECT_EQ(5U, tree->LeafCount());
+  EXPECT_EQ(sth.sha256_root_hash(), tree->CurrentRoot());
+
+  // A signer starting from the checkpoint only appends the newer
+  // entries, and ends up with the same tree.
+  for (int64_t seq = 5; seq < 8; ++seq) {
+    this->test_signer_.CreateUnique(&logged_cert);
+    this->AddSequencedEntry(&logged_cert, seq);
+  }
+  TreeSigner signer2(std::chrono::duration<double>(0), this->db(),
+                     move(tree), this->store_.get(), this->log_signer_.get());
+  EXPECT_EQ(TreeSigner::OK, signer2.UpdateTree());
+  EXPECT_EQ(TreeSigner::OK, this->tree_signer_->UpdateTree());
+  EXPECT_EQ(8, signer2.LatestSTH().tree_size());
+  EXPECT_EQ(this->tree_signer_->LatestSTH().sha256_root_hash(),
+            signer2.LatestSTH().sha256_root_hash());
+}
+
+
+TYPED_TEST(TreeSignerTest, UpdateTreePipelined) {
+  FLAGS_tree_signer_update_batch_size = 3;
+  unique_ptr<TreeSigner> signer(this->GetWatching());
+  // The entries are written straight to the database, as if sequenced
+  // by another node.
+  int64_t seq(0);
+  for (int round = 0; round < 3; ++round) {
+    for (int i = 0; i < 8 + round; ++i, ++seq) {
+      LoggedEntry logged_cert;
+      this->test_signer_.CreateUnique(&logged_cert);
+      logged_cert.set_sequence_number(seq);
+      CHECK_EQ(Database::OK, this->db()->CreateSequencedEntry(logged_cert));
+    }
+    EXPECT_EQ(TreeSigner::OK, this->tree_signer_->UpdateTree());
+    EXPECT_EQ(TreeSigner::OK, signer->UpdateTree());
+
+    const SignedTreeHead sth(this->tree_signer_->LatestSTH());
+    const SignedTreeHead pipelined_sth(signer->LatestSTH());
+    EXPECT_EQ(static_cast<uint64_t>(seq), pipelined_sth.tree_size());
+    EXPECT_EQ(sth.sha256_root_hash(), pipelined_sth.sha256_root_hash());
+    EXPECT_EQ(LogVerifier::VERIFY_OK,
+              this->verifier_->VerifySignedTreeHead(pipelined_sth));
+  }
+  FLAGS_tree_signer_update_batch_size = 4096;
+}
+
+
 TYPED_TEST(TreeSignerTest, SignEmpty) {
   EXPECT_EQ(TreeSigner::OK, this->tree_signer_->UpdateTree());
 
@@ -327,6 +420,133 @@ TYPED_TEST(TreeSignerTest, SequenceNewEntriesCleansUpOldSequenceMappings) {
 }
 
 
+TYPED_TEST(TreeSignerTest, SequenceWatchedEntries) {
+  unique_ptr<TreeSigner> signer(this->GetWatching());
+  vector<LoggedEntry> logged_certs(5);
+  for (int i = 0; i < 3; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->AddPendingEntry(&logged_certs[i]);
+  }
+  this->SequenceUntil(signer.get(), 3);
+  EXPECT_EQ(3, this->db()->TreeSize());
+
+  // Only the new ones get sequenced.
+  for (int i = 3; i < 5; ++i) {
+    this->test_signer_.CreateUnique(&logged_certs[i]);
+    this->AddPendingEntry(&logged_certs[i]);
+  }
+  this->SequenceUntil(signer.get(), 5);
+  EXPECT_EQ(5, this->db()->TreeSize());
+  EXPECT_EQ(TreeSigner::OK, signer->UpdateTree());
+  EXPECT_EQ(5U, signer->LatestSTH().tree_size());
+
+  EntryHandle<SequenceMapping> mapping;
+  CHECK_EQ(::util::OkStatus(), this->store_->GetSequenceMapping(&mapping));
+  unordered_map<string, int64_t> sequence_numbers;
+  for (int i = 0; i < mapping.Entry().mapping_size(); ++i) {
+    EXPECT_EQ(i, mapping.Entry().mapping(i).sequence_number());
+    sequence_numbers[mapping.Entry().mapping(i).entry_hash()] = i;
+  }
+  for (const LoggedEntry& logged_cert : logged_certs) {
+    const auto it(sequence_numbers.find(logged_cert.Hash()));
+    ASSERT_NE(sequence_numbers.end(), it);
+    LoggedEntry stored;
+    ASSERT_EQ(Database::LOOKUP_OK,
+              this->db()->LookupByIndex(it->second, &stored));
+    EXPECT_EQ(logged_cert.Hash(), stored.Hash());
+  }
+}
+
+
+TYPED_TEST(TreeSignerTest, Backlogs) {
+  TreeSigner::Backlog backlog;
+  EXPECT_EQ(util::error::UNAVAILABLE,
+            this->tree_signer_->SequencingBacklog(&backlog).CanonicalCode());
+
+  unique_ptr<TreeSigner> signer(this->GetWatching());
+  this->SequenceUntil(signer.get(), 0);
+  ASSERT_EQ(::util::OkStatus(), signer->SequencingBacklog(&backlog));
+  EXPECT_EQ(0, backlog.entries);
+
+  vector<LoggedEntry> logged_certs(2);
+  for (LoggedEntry& logged_cert : logged_certs) {
+    this->test_signer_.CreateUnique(&logged_cert);
+    this->AddPendingEntry(&logged_cert);
+  }
+  for (int i = 0; i < 500 && backlog.entries < 2; ++i) {
+    usleep(10000);
+    ASSERT_EQ(::util::OkStatus(), signer->SequencingBacklog(&backlog));
+  }
+  EXPECT_EQ(2, backlog.entries);
+  EXPECT_EQ(min(logged_certs[0].timestamp(), logged_certs[1].timestamp()),
+            backlog.oldest_timestamp);
+  EXPECT_EQ(0, signer->UpdateBacklog().entries);
+
+  this->SequenceUntil(signer.get(), 2);
+  ASSERT_EQ(::util::OkStatus(), signer->SequencingBacklog(&backlog));
+  EXPECT_EQ(0, backlog.entries);
+  backlog = signer->UpdateBacklog();
+  EXPECT_EQ(2, backlog.entries);
+  LoggedEntry first;
+  ASSERT_EQ(Database::LOOKUP_OK, this->db()->LookupByIndex(0, &first));
+  EXPECT_EQ(first.timestamp(), backlog.oldest_timestamp);
+
+  EXPECT_EQ(TreeSigner::OK, signer->UpdateTree());
+  EXPECT_EQ(0, signer->UpdateBacklog().entries);
+}
+
+
+TYPED_TEST(TreeSignerTest, SequenceWatchedEntriesCleansUpOldSequenceMappings) {
+  unique_ptr<TreeSigner> signer(this->GetWatching());
+  LoggedEntry logged_cert;
+  this->test_signer_.CreateUnique(&logged_cert);
+  this->AddPendingEntry(&logged_cert);
+  this->SequenceUntil(signer.get(), 1);
+  EXPECT_EQ(TreeSigner::OK, signer->UpdateTree());
+  EXPECT_EQ(::util::OkStatus(),
+            this->store_->SetServingSTH(signer->LatestSTH()));
+  sleep(1);
+
+  unordered_map<string, LoggedEntry> new_logged_certs;
+  for (int i(0); i < 2; ++i) {
+    LoggedEntry c;
+    this->test_signer_.CreateUnique(&c);
+    this->AddPendingEntry(&c);
+    new_logged_certs.insert(make_pair(c.Hash(), c));
+  }
+  this->DeletePendingEntry(logged_cert);
+  this->SequenceUntil(signer.get(), 2);
+
+  EntryHandle<SequenceMapping> mapping;
+  CHECK_EQ(::util::OkStatus(), this->store_->GetSequenceMapping(&mapping));
+  for (int i(0); i < mapping.Entry().mapping_size(); ++i) {
+    const auto& m(mapping.Entry().mapping(i));
+    EXPECT_EQ(i + 1, m.sequence_number());
+    EXPECT_NE(new_logged_certs.end(), new_logged_certs.find(m.entry_hash()));
+  }
+}
+
+
+TYPED_TEST(TreeSignerTest, SequenceWatchedEntriesAfterOtherUpdate) {
+  unique_ptr<TreeSigner> signer(this->GetWatching());
+  LoggedEntry logged_cert;
+  this->test_signer_.CreateUnique(&logged_cert);
+  this->AddPendingEntry(&logged_cert);
+  this->SequenceUntil(signer.get(), 1);
+
+  // Another signer updates the mapping in the meantime.
+  this->test_signer_.CreateUnique(&logged_cert);
+  this->AddPendingEntry(&logged_cert);
+  EXPECT_OK(this->tree_signer_->SequenceNewEntries());
+  EXPECT_EQ(2, this->MappingSize());
+
+  this->test_signer_.CreateUnique(&logged_cert);
+  this->AddPendingEntry(&logged_cert);
+  this->SequenceUntil(signer.get(), 3);
+  EXPECT_EQ(3, this->db()->TreeSize());
+}
+
+
 }  // namespace cert_trans
 
 
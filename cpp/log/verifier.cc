@@ -4,7 +4,9 @@
 #include <glog/logging.h>
 #include <openssl/evp.h>
 #include <openssl/opensslv.h>
+#include <openssl/sha.h>
 #include <stdint.h>
+#include <utility>
 
 #include "merkletree/serial_hasher.h"
 #include "proto/ct.pb.h"
@@ -15,6 +17,9 @@
 #endif
 
 using ct::DigitallySigned;
+using std::lock_guard;
+using std::move;
+using std::mutex;
 
 namespace cert_trans {
 
@@ -71,16 +76,40 @@ Verifier::Verifier()
 
 bool Verifier::RawVerify(const std::string& data,
                          const std::string& sig_string) const {
-  EVP_MD_CTX ctx;
-  EVP_MD_CTX_init(&ctx);
-  // NOTE: this syntax for setting the hash function requires OpenSSL >= 1.0.0.
-  CHECK_EQ(1, EVP_VerifyInit(&ctx, EVP_sha256()));
-  CHECK_EQ(1, EVP_VerifyUpdate(&ctx, data.data(), data.size()));
-  bool ret = (EVP_VerifyFinal(&ctx, reinterpret_cast<const unsigned char*>(
-                                        sig_string.data()),
-                              sig_string.size(), pkey_.get()) == 1);
-  EVP_MD_CTX_cleanup(&ctx);
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const unsigned char*>(data.data()), data.size(),
+         digest);
+
+  ScopedEVP_PKEY_CTX ctx(GetContext());
+  const bool ret(
+      EVP_PKEY_verify(ctx.get(),
+                      reinterpret_cast<const unsigned char*>(sig_string.data()),
+                      sig_string.size(), digest, sizeof(digest)) == 1);
+  ReleaseContext(move(ctx));
   return ret;
 }
 
+ScopedEVP_PKEY_CTX Verifier::GetContext() const {
+  {
+    lock_guard<mutex> lock(ctx_lock_);
+    if (!free_ctxs_.empty()) {
+      ScopedEVP_PKEY_CTX ctx(move(free_ctxs_.back()));
+      free_ctxs_.pop_back();
+      return ctx;
+    }
+  }
+
+  ScopedEVP_PKEY_CTX ctx(EVP_PKEY_CTX_new(pkey_.get(), nullptr));
+  CHECK(ctx);
+  CHECK_EQ(1, EVP_PKEY_verify_init(ctx.get()));
+  // Same as EVP_VerifyFinal() would do.
+  CHECK_LT(0, EVP_PKEY_CTX_set_signature_md(ctx.get(), EVP_sha256()));
+  return ctx;
+}
+
+void Verifier::ReleaseContext(ScopedEVP_PKEY_CTX ctx) const {
+  lock_guard<mutex> lock(ctx_lock_);
+  free_ctxs_.emplace_back(move(ctx));
+}
+
 }  // namespace cert_trans
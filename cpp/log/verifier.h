@@ -7,12 +7,18 @@
 #include <openssl/evp.h>
 #include <openssl/x509.h>  // for i2d_PUBKEY
 #include <stdint.h>
+#include <mutex>
+#include <string>
+#include <vector>
 
 #include "proto/ct.pb.h"
 #include "util/openssl_scoped_types.h"
 
 namespace cert_trans {
 
+// Verification is thread-safe. Like with Signer, each concurrent
+// verification gets an EVP_PKEY_CTX of its own, which is kept for the
+// next ones.
 class Verifier {
  public:
   enum Status {
@@ -41,10 +47,19 @@ class Verifier {
  private:
   bool RawVerify(const std::string& data, const std::string& sig_string) const;
 
+  // Returns a context ready to verify with |pkey_|, reusing a free one
+  // if there is any.
+  ScopedEVP_PKEY_CTX GetContext() const;
+  // Makes |ctx| available to the next verifications.
+  void ReleaseContext(ScopedEVP_PKEY_CTX ctx) const;
+
   ScopedEVP_PKEY pkey_;
   ct::DigitallySigned::HashAlgorithm hash_algo_;
   ct::DigitallySigned::SignatureAlgorithm sig_algo_;
   std::string key_id_;
+
+  mutable std::mutex ctx_lock_;
+  mutable std::vector<ScopedEVP_PKEY_CTX> free_ctxs_;
 };
 
 }  // namespace cert_trans
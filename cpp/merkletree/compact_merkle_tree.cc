@@ -3,16 +3,41 @@
 #include <assert.h>
 #include <glog/logging.h>
 #include <stddef.h>
+#include <string.h>
+#include <algorithm>
 #include <string>
 #include <vector>
 
 #include "merkletree/merkle_tree_math.h"
+#include "util/parallel_for.h"
 
 using cert_trans::MerkleTreeInterface;
+using std::min;
 using std::move;
 using std::string;
 using std::unique_ptr;
 
+namespace {
+
+// How many pairs of nodes to hand to the hasher at once.
+const size_t kHashBatchSize = 64;
+// Pairs of nodes per unit of work when hashing a level in parallel.
+const size_t kParallelChunkSize = 1 << 12;
+
+// The number of levels of a tree of |leaf_count| leaves.
+size_t LevelCountAt(size_t leaf_count) {
+  if (leaf_count == 0) {
+    return 0;
+  }
+  size_t level_count(1);
+  for (size_t n = leaf_count - 1; n != 0; n >>= 1) {
+    ++level_count;
+  }
+  return level_count;
+}
+
+}  // namespace
+
 CompactMerkleTree::CompactMerkleTree(unique_ptr<SerialHasher> hasher)
     : MerkleTreeInterface(),
       treehasher_(move(hasher)),
@@ -24,19 +49,27 @@ CompactMerkleTree::CompactMerkleTree(unique_ptr<SerialHasher> hasher)
 
 CompactMerkleTree::CompactMerkleTree(MerkleTree* model,
                                      unique_ptr<SerialHasher> hasher)
+    : CompactMerkleTree(model, CHECK_NOTNULL(model)->LeafCount(),
+                        move(hasher)) {
+}
+
+
+CompactMerkleTree::CompactMerkleTree(MerkleTree* model, size_t snapshot,
+                                     unique_ptr<SerialHasher> hasher)
     : MerkleTreeInterface(),
-      tree_(std::max<int64_t>(0, CHECK_NOTNULL(model)->LevelCount() - 1)),
+      tree_(std::max<int64_t>(0, LevelCountAt(snapshot) - 1)),
       treehasher_(move(hasher)),
-      leaf_count_(model->LeafCount()),
+      leaf_count_(snapshot),
       leaves_processed_(0),
-      level_count_(model->LevelCount()),
+      level_count_(LevelCountAt(snapshot)),
       root_(treehasher_.HashEmpty()) {
-  if (model->LeafCount() == 0) {
+  CHECK_LE(snapshot, CHECK_NOTNULL(model)->LeafCount());
+  if (snapshot == 0) {
     return;
   }
   // Get the inclusion proof path to the last entry in the tree, which by
   // definition must consist purely of left-hand nodes.
-  std::vector<string> path(model->PathToCurrentRoot(model->LeafCount()));
+  std::vector<string> path(model->PathToRootAtSnapshot(snapshot, snapshot));
   if (!path.empty()) {
     /* We have to do some juggling here as tree_[] differs from our MerkleTree
     // structure in that incomplete right-hand subtrees 'fall-through' to lower
@@ -73,7 +106,7 @@ CompactMerkleTree::CompactMerkleTree(MerkleTree* model,
     // index into tree_, starting at the leaf level:
     int level(0);
     std::vector<string>::const_iterator i = path.begin();
-    size_t size_of_previous_tree(model->LeafCount() - 1);
+    size_t size_of_previous_tree(snapshot - 1);
     for (; size_of_previous_tree != 0; size_of_previous_tree >>= 1) {
       if ((size_of_previous_tree & 1) != 0) {
         // if the level'th bit in the previous tree size is set, then we have
@@ -91,10 +124,31 @@ CompactMerkleTree::CompactMerkleTree(MerkleTree* model,
   // the last entry was added, so we PushBack the final right-hand entry
   // here, which will perform any recalculations necessary to reach the final
   // tree.
-  PushBack(0, model->LeafHash(model->LeafCount()));
-  assert(model->CurrentRoot() == CurrentRoot());
-  assert(model->LeafCount() == LeafCount());
-  assert(model->LevelCount() == LevelCount());
+  PushBack(0, model->LeafHash(snapshot));
+  assert(model->RootAtSnapshot(snapshot) == CurrentRoot());
+  assert(snapshot == LeafCount());
+}
+
+
+CompactMerkleTree::CompactMerkleTree(size_t leaf_count,
+                                     std::vector<string> frontier,
+                                     unique_ptr<SerialHasher> hasher)
+    : tree_(move(frontier)),
+      treehasher_(move(hasher)),
+      leaf_count_(leaf_count),
+      leaves_processed_(0),
+      level_count_(LevelCountAt(leaf_count)),
+      root_(treehasher_.HashEmpty()) {
+  // There is a lone left node exactly at the levels where the binary
+  // representation of |leaf_count| has a bit set.
+  CHECK_EQ(leaf_count >> tree_.size(), static_cast<size_t>(0));
+  for (size_t level = 0; level < tree_.size(); ++level) {
+    if ((leaf_count >> level) & 1) {
+      CHECK_EQ(tree_[level].size(), treehasher_.DigestSize());
+    } else {
+      CHECK(tree_[level].empty());
+    }
+  }
 }
 
 
@@ -126,6 +180,52 @@ size_t CompactMerkleTree::AddLeafHash(const string& hash) {
   return leaf_count_;
 }
 
+size_t CompactMerkleTree::AddLeafHashes(const std::vector<string>& hashes,
+                                        util::Executor* executor) {
+  const size_t node_size(NodeSize());
+  std::vector<char> nodes;
+  std::vector<char> parents;
+  size_t next(0);
+  while (next < hashes.size()) {
+    // The largest full subtree starting right after the current last
+    // leaf that the remaining hashes complete. Since |leaf_count_| is a
+    // multiple of its width, the levels below it hold no lone left
+    // sibling, and its root can go straight in at its own level.
+    const size_t remaining(hashes.size() - next);
+    size_t height(0);
+    while (((leaf_count_ >> height) & 1) == 0 &&
+           (static_cast<size_t>(2) << height) <= remaining) {
+      ++height;
+    }
+    if (height == 0) {
+      AddLeafHash(hashes[next++]);
+      continue;
+    }
+
+    const size_t width(static_cast<size_t>(1) << height);
+    nodes.resize(width * node_size);
+    parents.resize(width / 2 * node_size);
+    for (size_t i = 0; i < width; ++i) {
+      const string& hash(hashes[next + i]);
+      assert(hash.size() == node_size);
+      memcpy(&nodes[i * node_size], hash.data(), node_size);
+    }
+    for (size_t count = width / 2; count > 0; count /= 2) {
+      HashPairs(nodes.data(), count, parents.data(), executor);
+      nodes.swap(parents);
+    }
+
+    if (tree_.size() < height) {
+      tree_.resize(height);
+    }
+    PushBack(height, string(nodes.data(), node_size));
+    leaf_count_ += width;
+    next += width;
+  }
+  level_count_ = LevelCountAt(leaf_count_);
+  return leaf_count_;
+}
+
 string CompactMerkleTree::CurrentRoot() {
   UpdateRoot();
   return root_;
@@ -146,6 +246,36 @@ void CompactMerkleTree::PushBack(size_t level, string node) {
   }
 }
 
+void CompactMerkleTree::HashPairs(const char* children, size_t count,
+                                  char* parents,
+                                  util::Executor* executor) const {
+  const size_t node_size(NodeSize());
+  const auto hash_pairs = [this, children, parents, node_size](size_t first,
+                                                               size_t end) {
+    const char* batch_children[kHashBatchSize];
+    while (first < end) {
+      const size_t batch(min(end - first, kHashBatchSize));
+      for (size_t i = 0; i < batch; ++i) {
+        batch_children[i] = children + 2 * (first + i) * node_size;
+      }
+      treehasher_.HashChildrenBatch(batch_children, batch,
+                                    parents + first * node_size);
+      first += batch;
+    }
+  };
+
+  if (!executor || count <= kParallelChunkSize) {
+    hash_pairs(0, count);
+    return;
+  }
+  util::ParallelFor(executor,
+                    (count + kParallelChunkSize - 1) / kParallelChunkSize,
+                    [&hash_pairs, count](size_t chunk) {
+                      hash_pairs(chunk * kParallelChunkSize,
+                                 min(count, (chunk + 1) * kParallelChunkSize));
+                    });
+}
+
 void CompactMerkleTree::UpdateRoot() {
   if (leaves_processed_ == LeafCount())
     return;
@@ -36,6 +36,13 @@ class CompactMerkleTree : public cert_trans::MerkleTreeInterface {
   // TODO(pphaneuf): It should also get its |hasher| from |model|,
   // somehow.
   CompactMerkleTree(MerkleTree* model, std::unique_ptr<SerialHasher> hasher);
+  // As above, but for the tree of the first |snapshot| leaves of
+  // |model|, which may have more.
+  CompactMerkleTree(MerkleTree* model, size_t snapshot,
+                    std::unique_ptr<SerialHasher> hasher);
+  // Restores a tree of |leaf_count| leaves from its Frontier().
+  CompactMerkleTree(size_t leaf_count, std::vector<std::string> frontier,
+                    std::unique_ptr<SerialHasher> hasher);
 
   virtual ~CompactMerkleTree();
 
@@ -84,6 +91,15 @@ class CompactMerkleTree : public cert_trans::MerkleTreeInterface {
   // @param hash leaf hash
   virtual size_t AddLeafHash(const std::string& hash);
 
+  // Same as calling AddLeafHash() for each element of |hashes|, in
+  // order, but the full subtrees that the new leaves complete are
+  // hashed as whole blocks before being merged into the tree, spread
+  // over |executor| if not NULL.
+  //
+  // Returns the position of the last leaf in the tree.
+  size_t AddLeafHashes(const std::vector<std::string>& hashes,
+                       util::Executor* executor);
+
   // Get the current root of the tree.
   // Update the root to reflect the current shape of the tree,
   // and return the tree digest.
@@ -92,10 +108,21 @@ class CompactMerkleTree : public cert_trans::MerkleTreeInterface {
   // (and hence, no root).
   virtual std::string CurrentRoot();
 
+  // The lone left node of each level, from the leaves up, or an empty
+  // string for the levels that have none (see |tree_| below). Along
+  // with LeafCount(), this is all it takes to restore the tree.
+  const std::vector<std::string>& Frontier() const {
+    return tree_;
+  }
+
  private:
   // Append a node to the level.
   void PushBack(size_t level, std::string node);
 
+  // Hash the |count| pairs of nodes in |children| into |parents|.
+  void HashPairs(const char* children, size_t count, char* parents,
+                 util::Executor* executor) const;
+
   void UpdateRoot();
   // Since the tree is append-only to the right, at any given point in time,
   // at each level, all nodes that have a right sibling are fixed and will
@@ -0,0 +1,308 @@
+#include "merkletree/file_node_store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+
+using std::string;
+
+namespace cert_trans {
+namespace {
+
+const char kMagic[8] = {'C', 'T', 'M', 'T', 'N', 'S', '0', '1'};
+// The header occupies the first page of each level file, so that the
+// segments that follow it are page-aligned.
+const size_t kHeaderBytes = 4096;
+// Nodes per segment; 2MB worth of SHA-256 hashes.
+const size_t kSegmentNodes = 1 << 16;
+
+
+// The node count in a header may be updated by another process while
+// we read it.
+uint64_t LoadNodeCount(const uint64_t* node_count) {
+  return __atomic_load_n(node_count, __ATOMIC_ACQUIRE);
+}
+
+
+void StoreNodeCount(uint64_t* node_count, uint64_t value) {
+  __atomic_store_n(node_count, value, __ATOMIC_RELEASE);
+}
+
+
+}  // namespace
+
+
+struct FileNodeStore::Header {
+  char magic[sizeof(kMagic)];
+  uint64_t node_size;
+  uint64_t node_count;
+};
+
+
+FileNodeStore::FileNodeStore(const string& dir, size_t node_size,
+                             bool read_only)
+    : MerkleTreeNodeStore(node_size), dir_(dir), read_only_(read_only) {
+  static_assert(sizeof(Header) <= kHeaderBytes, "level file header too big");
+  CHECK_GT(node_size, 0U);
+  struct stat st;
+  PCHECK(stat(dir_.c_str(), &st) == 0) << "Cannot stat " << dir_;
+  CHECK(S_ISDIR(st.st_mode)) << dir_ << " is not a directory";
+
+  while (OpenLevel(false)) {
+  }
+  VLOG(1) << "Opened " << levels_.size() << " levels from " << dir_;
+}
+
+
+FileNodeStore::~FileNodeStore() {
+  Sync();
+  for (Level& level : levels_) {
+    CloseLevel(&level);
+  }
+}
+
+
+string FileNodeStore::LevelPath(size_t level) const {
+  char name[16];
+  snprintf(name, sizeof(name), "level-%02zu", level);
+  return dir_ + "/" + name;
+}
+
+
+size_t FileNodeStore::SegmentBytes() const {
+  return kSegmentNodes * NodeSize();
+}
+
+
+bool FileNodeStore::OpenLevel(bool create) {
+  CHECK(!create || !read_only_);
+  const string path(LevelPath(levels_.size()));
+  const int fd(open(path.c_str(),
+                    (read_only_ ? O_RDONLY : O_RDWR) |
+                        (create ? O_CREAT | O_EXCL : 0),
+                    0644));
+  if (fd < 0) {
+    PCHECK(!create && errno == ENOENT) << "Failed to open " << path;
+    return false;
+  }
+
+  if (create) {
+    PCHECK(ftruncate(fd, kHeaderBytes) == 0) << "Failed to size " << path;
+  }
+
+  struct stat st;
+  PCHECK(fstat(fd, &st) == 0) << "Cannot stat " << path;
+  if (read_only_ && static_cast<size_t>(st.st_size) < kHeaderBytes) {
+    // The writer is still creating it.
+    PCHECK(close(fd) == 0);
+    return false;
+  }
+  CHECK_GE(static_cast<size_t>(st.st_size), kHeaderBytes)
+      << path << " is truncated";
+
+  Level level;
+  level.fd = fd;
+  void* const header(mmap(nullptr, kHeaderBytes,
+                          read_only_ ? PROT_READ : PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, 0));
+  PCHECK(header != MAP_FAILED) << "Failed to map " << path;
+  level.header = static_cast<Header*>(header);
+
+  if (create) {
+    // The magic goes last, as it tells readers the header is complete.
+    level.header->node_size = NodeSize();
+    level.header->node_count = 0;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(level.header->magic, kMagic, sizeof(kMagic));
+  }
+  if (read_only_ && level.header->magic[0] == '\0') {
+    // Sized, but the writer has not filled in the header yet.
+    CloseLevel(&level);
+    return false;
+  }
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  CHECK_EQ(0, memcmp(level.header->magic, kMagic, sizeof(kMagic)))
+      << path << " is not a Merkle tree level file";
+  CHECK_EQ(NodeSize(), level.header->node_size)
+      << path << " has the wrong node size";
+
+  level.node_count = LoadNodeCount(&level.header->node_count);
+  level.dirty_from = level.node_count;
+  const size_t segment_count((level.node_count + kSegmentNodes - 1) /
+                             kSegmentNodes);
+  CHECK_GE(static_cast<size_t>(st.st_size),
+           kHeaderBytes + segment_count * SegmentBytes())
+      << path << " is truncated";
+  MapSegments(&level, segment_count);
+
+  levels_.emplace_back(level);
+  return true;
+}
+
+
+void FileNodeStore::CloseLevel(Level* level) {
+  for (char* segment : level->segments) {
+    PCHECK(munmap(segment, SegmentBytes()) == 0);
+  }
+  level->segments.clear();
+  PCHECK(munmap(level->header, kHeaderBytes) == 0);
+  PCHECK(close(level->fd) == 0);
+  level->fd = -1;
+}
+
+
+void FileNodeStore::MapSegments(Level* level, size_t segment_count) {
+  const off_t file_size(kHeaderBytes + segment_count * SegmentBytes());
+  // Readers only map what the writer has already made room for.
+  if (!read_only_ && segment_count > level->segments.size()) {
+    PCHECK(ftruncate(level->fd, file_size) == 0)
+        << "Failed to grow level file";
+  }
+
+  while (level->segments.size() < segment_count) {
+    const off_t offset(kHeaderBytes + level->segments.size() * SegmentBytes());
+    void* const segment(mmap(nullptr, SegmentBytes(),
+                             read_only_ ? PROT_READ : PROT_READ | PROT_WRITE,
+                             MAP_SHARED, level->fd, offset));
+    PCHECK(segment != MAP_FAILED) << "Failed to map level file segment";
+    level->segments.push_back(static_cast<char*>(segment));
+  }
+
+  if (segment_count < level->segments.size()) {
+    for (size_t i = segment_count; i < level->segments.size(); ++i) {
+      PCHECK(munmap(level->segments[i], SegmentBytes()) == 0);
+    }
+    level->segments.resize(segment_count);
+    if (!read_only_) {
+      PCHECK(ftruncate(level->fd, file_size) == 0)
+          << "Failed to shrink level file";
+    }
+  }
+}
+
+
+void FileNodeStore::AddLevel() {
+  CHECK(OpenLevel(true));
+}
+
+
+void FileNodeStore::TruncateLevels(size_t level_count) {
+  CHECK(!read_only_);
+  while (levels_.size() > level_count) {
+    CloseLevel(&levels_.back());
+    PCHECK(unlink(LevelPath(levels_.size() - 1).c_str()) == 0)
+        << "Failed to remove " << LevelPath(levels_.size() - 1);
+    levels_.pop_back();
+  }
+}
+
+
+size_t FileNodeStore::NodeCount(size_t level) const {
+  DCHECK_LT(level, levels_.size());
+  return levels_[level].node_count;
+}
+
+
+const char* FileNodeStore::Node(size_t level, size_t index) const {
+  DCHECK_LT(index, NodeCount(level));
+  return levels_[level].segments[index / kSegmentNodes] +
+         (index % kSegmentNodes) * NodeSize();
+}
+
+
+char* FileNodeStore::MutableNode(size_t level, size_t index) {
+  CHECK(!read_only_);
+  Level* const l(&levels_[level]);
+  l->dirty_from = std::min(l->dirty_from, index);
+  return const_cast<char*>(Node(level, index));
+}
+
+
+void FileNodeStore::PushBack(size_t level, const char* node) {
+  DCHECK_LT(level, levels_.size());
+  Level* const l(&levels_[level]);
+  if (l->node_count % kSegmentNodes == 0) {
+    MapSegments(l, l->node_count / kSegmentNodes + 1);
+  }
+  ++l->node_count;
+  memcpy(MutableNode(level, l->node_count - 1), node, NodeSize());
+}
+
+
+void FileNodeStore::SetNode(size_t level, size_t index, const char* node) {
+  memcpy(MutableNode(level, index), node, NodeSize());
+}
+
+
+void FileNodeStore::TruncateLevel(size_t level, size_t node_count) {
+  CHECK(!read_only_);
+  DCHECK_LT(level, levels_.size());
+  Level* const l(&levels_[level]);
+  if (node_count >= l->node_count) {
+    return;
+  }
+  l->node_count = node_count;
+  l->dirty_from = std::min(l->dirty_from, node_count);
+  MapSegments(l, (node_count + kSegmentNodes - 1) / kSegmentNodes);
+}
+
+
+void FileNodeStore::Sync() {
+  if (read_only_) {
+    return;
+  }
+
+  // Flush the nodes first, and only then the node counts which make
+  // them visible.
+  for (Level& level : levels_) {
+    const size_t page_size(sysconf(_SC_PAGESIZE));
+    for (size_t i = level.dirty_from / kSegmentNodes;
+         i < level.segments.size(); ++i) {
+      size_t begin(0);
+      if (i == level.dirty_from / kSegmentNodes) {
+        begin = (level.dirty_from % kSegmentNodes) * NodeSize();
+        begin -= begin % page_size;
+      }
+      PCHECK(msync(level.segments[i] + begin, SegmentBytes() - begin,
+                   MS_SYNC) == 0)
+          << "Failed to flush level file";
+    }
+  }
+
+  // From the top down, so that readers, which go from the leaves up,
+  // do not see a level that lags behind the ones below it.
+  for (auto level = levels_.rbegin(); level != levels_.rend(); ++level) {
+    if (level->header->node_count != level->node_count) {
+      StoreNodeCount(&level->header->node_count, level->node_count);
+      PCHECK(msync(level->header, kHeaderBytes, MS_SYNC) == 0)
+          << "Failed to flush level file header";
+    }
+    level->dirty_from = level->node_count;
+  }
+}
+
+
+void FileNodeStore::Refresh() {
+  if (!read_only_) {
+    return;
+  }
+
+  for (Level& level : levels_) {
+    const size_t node_count(LoadNodeCount(&level.header->node_count));
+    CHECK_GE(node_count, level.node_count)
+        << "Merkle tree level shrank under a reader";
+    MapSegments(&level, (node_count + kSegmentNodes - 1) / kSegmentNodes);
+    level.node_count = node_count;
+  }
+  while (OpenLevel(false)) {
+  }
+}
+
+
+}  // namespace cert_trans
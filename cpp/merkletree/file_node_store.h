@@ -0,0 +1,92 @@
+#ifndef CERT_TRANS_MERKLETREE_FILE_NODE_STORE_H_
+#define CERT_TRANS_MERKLETREE_FILE_NODE_STORE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "merkletree/node_store.h"
+
+namespace cert_trans {
+
+
+// Keeps the nodes of a MerkleTree in memory-mapped files, one per
+// level, under a directory. Each level file is a small header
+// followed by the level's nodes, packed back to back:
+//
+//   level-00: [header][node 0][node 1][node 2]...
+//   level-01: [header][node 0]...
+//
+// The files grow in fixed-size segments, each mapped separately, so
+// that growing a level never moves nodes which have already been
+// handed out. Resident memory is then bounded by the page cache
+// rather than by the size of the tree.
+//
+// Node counts are only recorded in the headers by Sync(), after the
+// nodes themselves have been flushed, so reopening the directory
+// after a crash yields the state as of the last Sync(). Nodes
+// modified after that Sync() may have reached the disk regardless;
+// MerkleTree copes with that by recomputing the right edge of the
+// tree when it is given a non-empty store.
+//
+// A directory can also be opened read-only, by any number of other
+// processes, while one process writes it. Readers only see the nodes
+// as of the writer's last Sync(), and pick up later ones with
+// Refresh(). Sync() records the node counts from the top level down,
+// so that a reader, which refreshes from the leaves up, never sees a
+// level that is behind the leaves it has seen. The writer must only
+// ever append to the levels while it has readers.
+class FileNodeStore : public MerkleTreeNodeStore {
+ public:
+  // Opens the tree stored in |dir|, which must exist, or starts a new
+  // one if there is none. Dies if the files there are unusable or do
+  // not match |node_size|. If |read_only| is true, the store cannot be
+  // modified, and holds no levels until the writer has created them.
+  FileNodeStore(const std::string& dir, size_t node_size,
+                bool read_only = false);
+  ~FileNodeStore() override;
+
+  size_t LevelCount() const override {
+    return levels_.size();
+  }
+
+  void AddLevel() override;
+  void TruncateLevels(size_t level_count) override;
+  size_t NodeCount(size_t level) const override;
+  const char* Node(size_t level, size_t index) const override;
+  void PushBack(size_t level, const char* node) override;
+  void SetNode(size_t level, size_t index, const char* node) override;
+  void TruncateLevel(size_t level, size_t node_count) override;
+  void Sync() override;
+  void Refresh() override;
+
+ private:
+  struct Header;
+
+  struct Level {
+    int fd = -1;
+    Header* header = nullptr;
+    std::vector<char*> segments;
+    size_t node_count = 0;
+    // Lowest index modified since the last Sync().
+    size_t dirty_from = 0;
+  };
+
+  std::string LevelPath(size_t level) const;
+  size_t SegmentBytes() const;
+  // Open (or create, if |create| is true) the file for the next level.
+  bool OpenLevel(bool create);
+  void CloseLevel(Level* level);
+  void MapSegments(Level* level, size_t segment_count);
+  char* MutableNode(size_t level, size_t index);
+
+  const std::string dir_;
+  const bool read_only_;
+  std::vector<Level> levels_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MERKLETREE_FILE_NODE_STORE_H_
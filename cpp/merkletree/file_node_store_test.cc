@@ -0,0 +1,221 @@
+#include <gtest/gtest.h>
+#include <stddef.h>
+#include <memory>
+#include <string>
+
+#include "merkletree/file_node_store.h"
+#include "merkletree/merkle_tree.h"
+#include "merkletree/serial_hasher.h"
+#include "util/test_db.h"
+#include "util/testing.h"
+
+namespace {
+
+using cert_trans::FileNodeStore;
+using cert_trans::MerkleTreeNodeStore;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+
+const size_t kNodeSize = 32;
+
+string TestNode(size_t value) {
+  string node(kNodeSize, '\0');
+  for (size_t i = 0; i < sizeof(value); ++i) {
+    node[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+  }
+  return node;
+}
+
+string NodeAt(const MerkleTreeNodeStore& store, size_t level, size_t index) {
+  return string(store.Node(level, index), kNodeSize);
+}
+
+unique_ptr<SerialHasher> NewSha256Hasher() {
+  return unique_ptr<SerialHasher>(new Sha256Hasher);
+}
+
+class FileNodeStoreTest : public ::testing::Test {
+ protected:
+  unique_ptr<FileNodeStore> OpenStore() {
+    return unique_ptr<FileNodeStore>(
+        new FileNodeStore(tmp_.TmpStorageDir(), kNodeSize));
+  }
+
+  // A MerkleTree kept in memory, for comparison.
+  unique_ptr<MerkleTree> ReferenceTree(size_t leaf_count) {
+    unique_ptr<MerkleTree> tree(new MerkleTree(NewSha256Hasher()));
+    for (size_t i = 0; i < leaf_count; ++i) {
+      tree->AddLeaf(to_string(i));
+    }
+    return tree;
+  }
+
+  TmpStorage tmp_;
+};
+
+TEST_F(FileNodeStoreTest, PushBackAndReopen) {
+  // Spans a few segments.
+  const size_t kCount = 200000;
+  {
+    unique_ptr<FileNodeStore> store(OpenStore());
+    EXPECT_EQ(0U, store->LevelCount());
+    store->AddLevel();
+    store->AddLevel();
+    for (size_t i = 0; i < kCount; ++i) {
+      store->PushBack(0, TestNode(i).data());
+    }
+    store->PushBack(1, TestNode(kCount).data());
+    for (size_t i = 0; i < kCount; ++i) {
+      ASSERT_EQ(TestNode(i), NodeAt(*store, 0, i));
+    }
+  }
+
+  unique_ptr<FileNodeStore> store(OpenStore());
+  ASSERT_EQ(2U, store->LevelCount());
+  ASSERT_EQ(kCount, store->NodeCount(0));
+  ASSERT_EQ(1U, store->NodeCount(1));
+  for (size_t i = 0; i < kCount; ++i) {
+    ASSERT_EQ(TestNode(i), NodeAt(*store, 0, i));
+  }
+  EXPECT_EQ(TestNode(kCount), NodeAt(*store, 1, 0));
+}
+
+TEST_F(FileNodeStoreTest, Truncate) {
+  {
+    unique_ptr<FileNodeStore> store(OpenStore());
+    for (size_t level = 0; level < 3; ++level) {
+      store->AddLevel();
+      for (size_t i = 0; i < 100000; ++i) {
+        store->PushBack(level, TestNode(i).data());
+      }
+    }
+    store->TruncateLevel(0, 70000);
+    store->TruncateLevels(2);
+    store->SetNode(1, 5, TestNode(42).data());
+  }
+
+  unique_ptr<FileNodeStore> store(OpenStore());
+  ASSERT_EQ(2U, store->LevelCount());
+  EXPECT_EQ(70000U, store->NodeCount(0));
+  EXPECT_EQ(100000U, store->NodeCount(1));
+  EXPECT_EQ(TestNode(69999), NodeAt(*store, 0, 69999));
+  EXPECT_EQ(TestNode(42), NodeAt(*store, 1, 5));
+
+  // Levels can be added again after being removed.
+  store->AddLevel();
+  EXPECT_EQ(0U, store->NodeCount(2));
+}
+
+TEST_F(FileNodeStoreTest, ReopenTree) {
+  const size_t kFirst = 1000;
+  const size_t kSecond = 1357;
+  {
+    MerkleTree tree(NewSha256Hasher(), OpenStore());
+    for (size_t i = 0; i < kFirst; ++i) {
+      tree.AddLeaf(to_string(i));
+    }
+    EXPECT_EQ(ReferenceTree(kFirst)->CurrentRoot(), tree.CurrentRoot());
+  }
+
+  MerkleTree tree(NewSha256Hasher(), OpenStore());
+  EXPECT_EQ(kFirst, tree.LeafCount());
+  EXPECT_EQ(ReferenceTree(kFirst)->CurrentRoot(), tree.CurrentRoot());
+
+  for (size_t i = kFirst; i < kSecond; ++i) {
+    tree.AddLeaf(to_string(i));
+  }
+  unique_ptr<MerkleTree> reference(ReferenceTree(kSecond));
+  EXPECT_EQ(reference->CurrentRoot(), tree.CurrentRoot());
+  EXPECT_EQ(reference->RootAtSnapshot(kFirst - 1),
+            tree.RootAtSnapshot(kFirst - 1));
+  EXPECT_EQ(reference->PathToRootAtSnapshot(17, kFirst),
+            tree.PathToRootAtSnapshot(17, kFirst));
+  EXPECT_EQ(reference->SnapshotConsistency(kFirst, kSecond),
+            tree.SnapshotConsistency(kFirst, kSecond));
+}
+
+TEST_F(FileNodeStoreTest, ReopenTreeWithUnprocessedLeaves) {
+  const size_t kProcessed = 300;
+  const size_t kTotal = 777;
+  {
+    MerkleTree tree(NewSha256Hasher(), OpenStore());
+    for (size_t i = 0; i < kProcessed; ++i) {
+      tree.AddLeaf(to_string(i));
+    }
+    tree.CurrentRoot();
+    // The upper levels now lag behind the leaves.
+    for (size_t i = kProcessed; i < kTotal; ++i) {
+      tree.AddLeaf(to_string(i));
+    }
+  }
+
+  MerkleTree tree(NewSha256Hasher(), OpenStore());
+  EXPECT_EQ(kTotal, tree.LeafCount());
+  EXPECT_EQ(ReferenceTree(kTotal)->CurrentRoot(), tree.CurrentRoot());
+}
+
+TEST_F(FileNodeStoreTest, ReopenTreeWithStaleRightEdge) {
+  const size_t kLeaves = 777;
+  {
+    MerkleTree tree(NewSha256Hasher(), OpenStore());
+    for (size_t i = 0; i < kLeaves; ++i) {
+      tree.AddLeaf(to_string(i));
+    }
+    tree.CurrentRoot();
+  }
+  {
+    // Scribble over the right edge of the upper levels, as an
+    // interrupted update could have done.
+    unique_ptr<FileNodeStore> store(OpenStore());
+    for (size_t level = 1; level < store->LevelCount(); ++level) {
+      store->SetNode(level, store->NodeCount(level) - 1, TestNode(0).data());
+    }
+    store->TruncateLevel(3, 2);
+  }
+
+  MerkleTree tree(NewSha256Hasher(), OpenStore());
+  EXPECT_EQ(kLeaves, tree.LeafCount());
+  EXPECT_EQ(ReferenceTree(kLeaves)->CurrentRoot(), tree.CurrentRoot());
+}
+
+TEST_F(FileNodeStoreTest, ReadOnlySeesSyncedNodes) {
+  FileNodeStore reader(tmp_.TmpStorageDir(), kNodeSize, true);
+  EXPECT_EQ(0U, reader.LevelCount());
+
+  unique_ptr<FileNodeStore> writer(OpenStore());
+  writer->AddLevel();
+  writer->AddLevel();
+  for (size_t i = 0; i < 100000; ++i) {
+    writer->PushBack(0, TestNode(i).data());
+  }
+  writer->PushBack(1, TestNode(42).data());
+  reader.Refresh();
+  ASSERT_EQ(2U, reader.LevelCount());
+  EXPECT_EQ(0U, reader.NodeCount(0));
+  EXPECT_EQ(0U, reader.NodeCount(1));
+
+  writer->Sync();
+  reader.Refresh();
+  ASSERT_EQ(100000U, reader.NodeCount(0));
+  ASSERT_EQ(1U, reader.NodeCount(1));
+  EXPECT_EQ(TestNode(99999), NodeAt(reader, 0, 99999));
+  EXPECT_EQ(TestNode(42), NodeAt(reader, 1, 0));
+
+  // Nodes keep coming, in new segments too.
+  for (size_t i = 100000; i < 200000; ++i) {
+    writer->PushBack(0, TestNode(i).data());
+  }
+  writer->Sync();
+  EXPECT_EQ(100000U, reader.NodeCount(0));
+  reader.Refresh();
+  ASSERT_EQ(200000U, reader.NodeCount(0));
+  EXPECT_EQ(TestNode(150000), NodeAt(reader, 0, 150000));
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
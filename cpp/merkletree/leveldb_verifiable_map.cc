@@ -0,0 +1,434 @@
+#include "merkletree/leveldb_verifiable_map.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <string.h>
+#include <algorithm>
+#include <utility>
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using util::Status;
+using util::StatusOr;
+
+// Shared with the log database, see log/leveldb_db.cc.
+DECLARE_int32(leveldb_max_open_files);
+DECLARE_int32(leveldb_block_cache_mb);
+DECLARE_bool(leveldb_compression);
+
+namespace cert_trans {
+namespace {
+
+
+// The nodes are keyed by their level, the path to them (with the bits
+// below the level cleared), and the version which wrote them, inverted
+// so that seeking to a version finds the latest one up to it:
+//
+//   node-<level, 2 bytes><path><~version, 8 bytes> -> node
+//   value-<path><~version> -> value
+//   root-<~version> -> root hash
+//
+// Integers are big-endian, so that they sort numerically.
+const char kNodePrefix[] = "node-";
+const char kValuePrefix[] = "value-";
+const char kRootPrefix[] = "root-";
+
+const char kLeafNode = 'L';
+const char kInternalNode = 'I';
+
+
+void AppendInt(uint64_t value, int bytes, string* out) {
+  for (int i(bytes - 1); i >= 0; --i) {
+    out->push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+  }
+}
+
+
+uint64_t ReadInt(leveldb::Slice in) {
+  uint64_t value(0);
+  for (size_t i(0); i < in.size(); ++i) {
+    value = (value << 8) | static_cast<uint8_t>(in[i]);
+  }
+  return value;
+}
+
+
+void AppendVersion(int64_t version, string* out) {
+  CHECK_LE(0, version);
+  AppendInt(~static_cast<uint64_t>(version), 8, out);
+}
+
+
+void AppendPath(const SparseMerkleTree::Path& path, string* out) {
+  out->append(reinterpret_cast<const char*>(path.data()), path.size());
+}
+
+
+// The key of the node at |level| on the way to |path|, without the
+// version.
+string NodeKeyPrefix(int level, const SparseMerkleTree::Path& path) {
+  SparseMerkleTree::Path masked(path);
+  for (size_t i(0); i < masked.size(); ++i) {
+    const int bits(std::min(8, std::max(0, level - static_cast<int>(i) * 8)));
+    masked[i] &= static_cast<uint8_t>(0xff00 >> bits);
+  }
+  string key(kNodePrefix);
+  AppendInt(level, 2, &key);
+  AppendPath(masked, &key);
+  return key;
+}
+
+
+string ValueKeyPrefix(const SparseMerkleTree::Path& path) {
+  string key(kValuePrefix);
+  AppendPath(path, &key);
+  return key;
+}
+
+
+string RootKey(int64_t version) {
+  string key(kRootPrefix);
+  AppendVersion(version, &key);
+  return key;
+}
+
+
+// Returns the value of the latest version of |key_prefix| up to
+// |version|, if any.
+bool ReadVersioned(leveldb::DB* db, const string& key_prefix,
+                   int64_t version, string* value) {
+  string key(key_prefix);
+  AppendVersion(version, &key);
+  const unique_ptr<leveldb::Iterator> it(
+      db->NewIterator(leveldb::ReadOptions()));
+  CHECK(it);
+  it->Seek(key);
+  if (!it->Valid() || !it->key().starts_with(key_prefix)) {
+    CHECK(it->status().ok()) << it->status().ToString();
+    return false;
+  }
+  value->assign(it->value().data(), it->value().size());
+  return true;
+}
+
+
+}  // namespace
+
+
+// A node of the tree, as stored: either a lone leaf, or an internal
+// node with the hashes of its children (empty for empty subtrees).
+struct LevelDBVerifiableMap::Node {
+  bool leaf = false;
+  Path path;
+  string leaf_hash;
+  string child_hashes[2];
+};
+
+
+LevelDBVerifiableMap::LevelDBVerifiableMap(SerialHasher* hasher,
+                                           const string& dbfile)
+    : hasher_model_(CHECK_NOTNULL(hasher)),
+      treehasher_(unique_ptr<SerialHasher>(hasher->Create())),
+      null_hashes_(GetNullHashes(treehasher_)),
+      block_cache_(FLAGS_leveldb_block_cache_mb > 0
+                       ? leveldb::NewLRUCache(FLAGS_leveldb_block_cache_mb
+                                              << 20)
+                       : nullptr),
+      latest_version_(0) {
+  CHECK_EQ(SparseMerkleTree::kDigestSizeBits / 8, treehasher_.DigestSize());
+  LOG(INFO) << "Opening " << dbfile;
+  leveldb::Options options;
+  options.create_if_missing = true;
+  if (FLAGS_leveldb_max_open_files > 0) {
+    options.max_open_files = FLAGS_leveldb_max_open_files;
+  }
+  options.block_cache = block_cache_.get();
+  options.compression = FLAGS_leveldb_compression
+                            ? leveldb::kSnappyCompression
+                            : leveldb::kNoCompression;
+  leveldb::DB* db;
+  const leveldb::Status status(leveldb::DB::Open(options, dbfile, &db));
+  CHECK(status.ok()) << status.ToString();
+  db_.reset(db);
+
+  // The latest root is the first one.
+  const unique_ptr<leveldb::Iterator> it(
+      db_->NewIterator(leveldb::ReadOptions()));
+  CHECK(it);
+  it->Seek(kRootPrefix);
+  if (it->Valid() && it->key().starts_with(kRootPrefix)) {
+    leveldb::Slice version(it->key());
+    version.remove_prefix(strlen(kRootPrefix));
+    CHECK_EQ(8U, version.size());
+    latest_version_ = static_cast<int64_t>(~ReadInt(version));
+    latest_root_.assign(it->value().data(), it->value().size());
+  } else {
+    CHECK(it->status().ok()) << it->status().ToString();
+    latest_root_ = NodeHash(0, Node());
+  }
+  LOG(INFO) << dbfile << " is at version " << latest_version_;
+}
+
+
+LevelDBVerifiableMap::~LevelDBVerifiableMap() {
+  // Closes the database before its cache goes away.
+  db_.reset();
+}
+
+
+StatusOr<string> LevelDBVerifiableMap::RootAtVersion(int64_t version) const {
+  if (version < 0 || version > latest_version_) {
+    return Status(util::error::NOT_FOUND, "No such version.");
+  }
+  if (version == 0) {
+    return NodeHash(0, Node());
+  }
+  string root;
+  const leveldb::Status status(
+      db_->Get(leveldb::ReadOptions(), RootKey(version), &root));
+  CHECK(status.ok()) << "root of version " << version << ": "
+                     << status.ToString();
+  return root;
+}
+
+
+void LevelDBVerifiableMap::Set(const string& key, const string& value) {
+  staged_[PathFromKey(key)] = value;
+}
+
+
+int64_t LevelDBVerifiableMap::Commit() {
+  if (staged_.empty()) {
+    return latest_version_;
+  }
+  const int64_t version(latest_version_ + 1);
+  leveldb::WriteBatch batch;
+
+  Node root;
+  const bool have_root(
+      ReadNode(0, staged_.begin()->first, latest_version_, &root));
+  const string root_hash(WriteSubtree(0, have_root ? &root : nullptr,
+                                      staged_.begin(), staged_.end(),
+                                      version, &batch));
+  for (const auto& update : staged_) {
+    string key(ValueKeyPrefix(update.first));
+    AppendVersion(version, &key);
+    batch.Put(key, update.second);
+  }
+  batch.Put(RootKey(version), root_hash);
+
+  const leveldb::Status status(db_->Write(leveldb::WriteOptions(), &batch));
+  CHECK(status.ok()) << status.ToString();
+  latest_version_ = version;
+  latest_root_ = root_hash;
+  staged_.clear();
+  return version;
+}
+
+
+StatusOr<string> LevelDBVerifiableMap::Get(const string& key) const {
+  return GetAtVersion(key, latest_version_);
+}
+
+
+StatusOr<string> LevelDBVerifiableMap::GetAtVersion(const string& key,
+                                                    int64_t version) const {
+  if (version < 0 || version > latest_version_) {
+    return Status(util::error::NOT_FOUND, "No such version.");
+  }
+  string value;
+  if (!ReadVersioned(db_.get(), ValueKeyPrefix(PathFromKey(key)), version,
+                     &value)) {
+    return Status(util::error::NOT_FOUND, "No such entry.");
+  }
+  return value;
+}
+
+
+StatusOr<SparseMerkleTree::CompressedProof>
+LevelDBVerifiableMap::InclusionProof(const string& key,
+                                     int64_t version) const {
+  if (version < 0 || version > latest_version_) {
+    return Status(util::error::NOT_FOUND, "No such version.");
+  }
+  const Path path(PathFromKey(key));
+  SparseMerkleTree::CompressedProof proof;
+  proof.bitmap.assign(SparseMerkleTree::kDigestSizeBits / 8, 0);
+  // As in SparseMerkleTree::CompressedInclusionProof(), the sibling at
+  // |depth| is the element kDigestSizeBits - 1 - depth of the full proof.
+  const auto add_sibling = [&proof](int depth, const string& hash) {
+    const int index(SparseMerkleTree::kDigestSizeBits - 1 - depth);
+    proof.bitmap[index / 8] |= 0x80 >> (index % 8);
+    proof.hashes.emplace_back(hash);
+  };
+
+  Node node;
+  bool found(ReadNode(0, path, version, &node));
+  int level(0);
+  while (found && !node.leaf) {
+    // The children of a node at |level| are at depth |level|.
+    const int bit(PathBit(path, level));
+    if (!node.child_hashes[1 - bit].empty()) {
+      add_sibling(level, node.child_hashes[1 - bit]);
+    }
+    found = !node.child_hashes[bit].empty();
+    ++level;
+    if (found) {
+      CHECK(ReadNode(level, path, version, &node))
+          << "missing node at level " << level << " on the way to " << path
+          << " in version " << version;
+    }
+  }
+  // Below a lone leaf, the only non-empty sibling is where the path of
+  // the leaf parts from |path|, if it does.
+  if (found && node.path != path) {
+    int depth(level);
+    while (PathBit(node.path, depth) == PathBit(path, depth)) {
+      ++depth;
+    }
+    add_sibling(depth, SparseMerkleTree::LoneLeafHash(treehasher_, depth,
+                                                      node.path,
+                                                      node.leaf_hash));
+  }
+  std::reverse(proof.hashes.begin(), proof.hashes.end());
+  return proof;
+}
+
+
+SparseMerkleTree::Path LevelDBVerifiableMap::PathFromKey(
+    const string& key) const {
+  unique_ptr<SerialHasher> h(hasher_model_->Create());
+  h->Update(key);
+  return PathFromBytes(h->Final());
+}
+
+
+bool LevelDBVerifiableMap::ReadNode(int level, const Path& path,
+                                    int64_t version, Node* node) const {
+  string value;
+  if (!ReadVersioned(db_.get(), NodeKeyPrefix(level, path), version,
+                     &value)) {
+    return false;
+  }
+
+  const size_t digest_size(treehasher_.DigestSize());
+  CHECK(!value.empty());
+  *node = Node();
+  if (value[0] == kLeafNode) {
+    CHECK_EQ(1 + path.size() + digest_size, value.size());
+    node->leaf = true;
+    std::copy(value.begin() + 1, value.begin() + 1 + path.size(),
+              node->path.begin());
+    node->leaf_hash = value.substr(1 + path.size());
+    return true;
+  }
+  CHECK_EQ(kInternalNode, value[0]);
+  CHECK_LE(2U, value.size());
+  size_t offset(2);
+  for (int side(0); side < 2; ++side) {
+    if (value[1] & (1 << side)) {
+      CHECK_LE(offset + digest_size, value.size());
+      node->child_hashes[side] = value.substr(offset, digest_size);
+      offset += digest_size;
+    }
+  }
+  CHECK_EQ(offset, value.size());
+  return true;
+}
+
+
+string LevelDBVerifiableMap::WriteNode(int level, const Path& path,
+                                       const Node& node, int64_t version,
+                                       leveldb::WriteBatch* batch) const {
+  string value;
+  if (node.leaf) {
+    value.push_back(kLeafNode);
+    AppendPath(node.path, &value);
+    value.append(node.leaf_hash);
+  } else {
+    value.push_back(kInternalNode);
+    value.push_back((node.child_hashes[0].empty() ? 0 : 1) |
+                    (node.child_hashes[1].empty() ? 0 : 2));
+    value.append(node.child_hashes[0]);
+    value.append(node.child_hashes[1]);
+  }
+  string key(NodeKeyPrefix(level, path));
+  AppendVersion(version, &key);
+  batch->Put(key, value);
+  return NodeHash(level, node);
+}
+
+
+string LevelDBVerifiableMap::NodeHash(int level, const Node& node) const {
+  if (node.leaf) {
+    CHECK_LT(0, level);
+    return SparseMerkleTree::LoneLeafHash(treehasher_, level - 1, node.path,
+                                          node.leaf_hash);
+  }
+  // The children of a node at |level| are at depth |level| in the
+  // terms of SparseMerkleTree, the root being above depth 0.
+  const string& null_hash(null_hashes_->at(level));
+  return treehasher_.HashChildren(
+      node.child_hashes[0].empty() ? null_hash : node.child_hashes[0],
+      node.child_hashes[1].empty() ? null_hash : node.child_hashes[1]);
+}
+
+
+string LevelDBVerifiableMap::WriteSubtree(int level, const Node* old,
+                                          UpdateIterator begin,
+                                          UpdateIterator end, int64_t version,
+                                          leveldb::WriteBatch* batch) const {
+  CHECK(begin != end);
+  // A single update, in an empty subtree or replacing the same leaf,
+  // makes a lone leaf. The root is always an internal node.
+  if (level > 0 && std::next(begin) == end &&
+      (!old || (old->leaf && old->path == begin->first))) {
+    Node leaf;
+    leaf.leaf = true;
+    leaf.path = begin->first;
+    leaf.leaf_hash = treehasher_.HashLeaf(begin->second);
+    return WriteNode(level, leaf.path, leaf, version, batch);
+  }
+
+  // Otherwise, this is an internal node, an existing leaf being pushed
+  // down a level as in SparseMerkleTree::SetLeaf().
+  CHECK_LT(level, SparseMerkleTree::kDigestSizeBits);
+  Node internal;
+  if (old && !old->leaf) {
+    internal.child_hashes[0] = old->child_hashes[0];
+    internal.child_hashes[1] = old->child_hashes[1];
+  }
+  const UpdateIterator split(std::partition_point(
+      begin, end, [level](const std::pair<const Path, string>& update) {
+        return PathBit(update.first, level) == 0;
+      }));
+  const UpdateIterator bounds[3] = {begin, split, end};
+  for (int side(0); side < 2; ++side) {
+    const Node* child_old(nullptr);
+    Node child;
+    if (old && old->leaf && PathBit(old->path, level) == side) {
+      child_old = old;
+    } else if (bounds[side] != bounds[side + 1] &&
+               !internal.child_hashes[side].empty()) {
+      CHECK(ReadNode(level + 1, bounds[side]->first, latest_version_, &child))
+          << "missing node at level " << level + 1 << " on the way to "
+          << bounds[side]->first;
+      child_old = &child;
+    }
+
+    if (bounds[side] != bounds[side + 1]) {
+      internal.child_hashes[side] =
+          WriteSubtree(level + 1, child_old, bounds[side], bounds[side + 1],
+                       version, batch);
+    } else if (child_old) {
+      // Only the pushed down leaf.
+      internal.child_hashes[side] =
+          WriteNode(level + 1, child_old->path, *child_old, version, batch);
+    }
+  }
+  return WriteNode(level, begin->first, internal, version, batch);
+}
+
+
+}  // namespace cert_trans
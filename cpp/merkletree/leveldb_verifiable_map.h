@@ -0,0 +1,123 @@
+#ifndef CERT_TRANS_MERKLETREE_LEVELDB_VERIFIABLE_MAP_H_
+#define CERT_TRANS_MERKLETREE_LEVELDB_VERIFIABLE_MAP_H_
+
+#include <leveldb/cache.h>
+#include <leveldb/db.h>
+#include <leveldb/write_batch.h>
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "merkletree/serial_hasher.h"
+#include "merkletree/sparse_merkle_tree.h"
+#include "merkletree/tree_hasher.h"
+#include "util/statusor.h"
+
+namespace cert_trans {
+
+
+// A Verifiable Map kept in a leveldb database, rather than in memory,
+// so that it can be reopened without being rebuilt, and grow beyond
+// the memory of the process. It has the same roots and proofs as a
+// VerifiableMap holding the same entries.
+//
+// The map is versioned: changes are staged by Set(), and written
+// atomically as the next version by Commit(). The roots, values and
+// proofs of every version committed remain available.
+//
+// The nodes of the tree are stored the same way as those of the
+// SparseMerkleTree (an internal node for every branching, and a lone
+// leaf at the top of each subtree holding only one), each keyed by the
+// prefix of the paths below it and by the version which wrote it, and
+// holding the hashes of its children. They are only read as they are
+// needed, by path prefix: committing a change, or producing a proof,
+// reads and (re)writes about log2(number of entries) nodes. Nodes are
+// never rewritten in place, so older versions stay intact.
+//
+// This class is thread-compatible: the const methods can be called
+// concurrently, but not with Set() or Commit().
+class LevelDBVerifiableMap {
+ public:
+  // Opens the map in the leveldb database |dbfile|, creating an empty
+  // one if there is none. Takes ownership of |hasher|.
+  LevelDBVerifiableMap(SerialHasher* hasher, const std::string& dbfile);
+  ~LevelDBVerifiableMap();
+  LevelDBVerifiableMap(const LevelDBVerifiableMap&) = delete;
+  LevelDBVerifiableMap& operator=(const LevelDBVerifiableMap&) = delete;
+
+  // The latest version committed, or 0 for a new, empty map.
+  int64_t LatestVersion() const {
+    return latest_version_;
+  }
+
+  // The root of the latest version.
+  std::string CurrentRoot() const {
+    return latest_root_;
+  }
+
+  util::StatusOr<std::string> RootAtVersion(int64_t version) const;
+
+  // Stages |value| for |key|, to be written by the next Commit(). The
+  // last value staged for a key wins.
+  void Set(const std::string& key, const std::string& value);
+
+  // Writes the changes staged since the last Commit() as a new version,
+  // and returns it. Returns the latest version if nothing is staged.
+  int64_t Commit();
+
+  // Returns the value of |key| in the latest version.
+  util::StatusOr<std::string> Get(const std::string& key) const;
+
+  util::StatusOr<std::string> GetAtVersion(const std::string& key,
+                                           int64_t version) const;
+
+  // Returns the proof for |key| against the root of |version|, in the
+  // same form as SparseMerkleTree::CompressedInclusionProof().
+  util::StatusOr<SparseMerkleTree::CompressedProof> InclusionProof(
+      const std::string& key, int64_t version) const;
+
+ private:
+  typedef SparseMerkleTree::Path Path;
+  typedef std::map<Path, std::string>::const_iterator UpdateIterator;
+  struct Node;
+
+  Path PathFromKey(const std::string& key) const;
+
+  // Reads the node at |level| (that is, below the first |level| bits of
+  // |path|) as of |version|, returning false if there is none.
+  bool ReadNode(int level, const Path& path, int64_t version,
+                Node* node) const;
+
+  // Adds |node| at |level|, on the way to |path|, to |batch| as part of
+  // |version|, and returns its hash.
+  std::string WriteNode(int level, const Path& path, const Node& node,
+                        int64_t version, leveldb::WriteBatch* batch) const;
+
+  std::string NodeHash(int level, const Node& node) const;
+
+  // Adds the subtree at |level| with the updates in [|begin|, |end|)
+  // applied to |batch| as part of |version|, and returns its hash.
+  // |old| is the subtree as of the latest version, NULL if it was
+  // empty. There must be at least one update.
+  std::string WriteSubtree(int level, const Node* old, UpdateIterator begin,
+                           UpdateIterator end, int64_t version,
+                           leveldb::WriteBatch* batch) const;
+
+  const std::unique_ptr<SerialHasher> hasher_model_;
+  const TreeHasher treehasher_;
+  const std::vector<std::string>* const null_hashes_;
+  // If null, the database has the default cache.
+  const std::unique_ptr<leveldb::Cache> block_cache_;
+  std::unique_ptr<leveldb::DB> db_;
+
+  int64_t latest_version_;
+  std::string latest_root_;
+  std::map<Path, std::string> staged_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MERKLETREE_LEVELDB_VERIFIABLE_MAP_H_
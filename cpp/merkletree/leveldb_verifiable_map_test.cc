@@ -0,0 +1,181 @@
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "merkletree/leveldb_verifiable_map.h"
+#include "merkletree/verifiable_map.h"
+#include "util/status_test_util.h"
+#include "util/test_db.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+using util::StatusOr;
+using util::testing::StatusIs;
+using util::ToBase64;
+
+
+class LevelDBVerifiableMapTest : public testing::Test {
+ protected:
+  unique_ptr<LevelDBVerifiableMap> OpenMap() {
+    return unique_ptr<LevelDBVerifiableMap>(
+        new LevelDBVerifiableMap(new Sha256Hasher, tmp_.TmpStorageDir() +
+                                                       "/map"));
+  }
+
+  // Expects |map| to hold the same entries as |reference|, with the
+  // same proofs, for |keys| and a key which was never set.
+  void ExpectSameAs(VerifiableMap* reference, const LevelDBVerifiableMap& map,
+                    const vector<string>& keys) {
+    EXPECT_EQ(ToBase64(reference->CurrentRoot()), ToBase64(map.CurrentRoot()));
+    vector<string> all_keys(keys);
+    all_keys.emplace_back("never set");
+    for (const string& key : all_keys) {
+      const StatusOr<string> expected(reference->Get(key));
+      const StatusOr<string> value(map.Get(key));
+      EXPECT_EQ(expected.ok(), value.ok()) << key;
+      if (expected.ok() && value.ok()) {
+        EXPECT_EQ(expected.ValueOrDie(), value.ValueOrDie());
+      }
+
+      const SparseMerkleTree::CompressedProof expected_proof(
+          reference->CompressedInclusionProof(key));
+      const StatusOr<SparseMerkleTree::CompressedProof> proof(
+          map.InclusionProof(key, map.LatestVersion()));
+      ASSERT_OK(proof);
+      EXPECT_EQ(expected_proof.bitmap, proof.ValueOrDie().bitmap) << key;
+      EXPECT_EQ(expected_proof.hashes, proof.ValueOrDie().hashes) << key;
+    }
+  }
+
+  TmpStorage tmp_;
+};
+
+
+TEST_F(LevelDBVerifiableMapTest, EmptyMap) {
+  VerifiableMap reference(new Sha256Hasher);
+  const unique_ptr<LevelDBVerifiableMap> map(OpenMap());
+  EXPECT_EQ(0, map->LatestVersion());
+  EXPECT_EQ(0, map->Commit());
+  ExpectSameAs(&reference, *map, {});
+  EXPECT_THAT(map->Get("key").status(), StatusIs(util::error::NOT_FOUND));
+}
+
+
+TEST_F(LevelDBVerifiableMapTest, MatchesVerifiableMap) {
+  VerifiableMap reference(new Sha256Hasher);
+  const unique_ptr<LevelDBVerifiableMap> map(OpenMap());
+  vector<string> keys;
+  for (int version(1); version <= 5; ++version) {
+    for (int i(0); i < 200; ++i) {
+      keys.emplace_back("key" + to_string(version * 1000 + i));
+      const string value("value" + to_string(version * 1000 + i));
+      reference.Set(keys.back(), value);
+      map->Set(keys.back(), value);
+    }
+    // Replace some of the earlier values, more than once.
+    for (int i(0); i < 10; ++i) {
+      for (const string& value : {"first", "second"}) {
+        reference.Set(keys[i * 7], value + to_string(version));
+        map->Set(keys[i * 7], value + to_string(version));
+      }
+    }
+    EXPECT_EQ(version, map->Commit());
+    ExpectSameAs(&reference, *map, keys);
+  }
+}
+
+
+TEST_F(LevelDBVerifiableMapTest, Reopen) {
+  VerifiableMap reference(new Sha256Hasher);
+  vector<string> keys;
+  {
+    const unique_ptr<LevelDBVerifiableMap> map(OpenMap());
+    for (int i(0); i < 100; ++i) {
+      keys.emplace_back("key" + to_string(i));
+      reference.Set(keys.back(), to_string(i));
+      map->Set(keys.back(), to_string(i));
+    }
+    map->Commit();
+    // Not committed, so lost.
+    map->Set("uncommitted", "value");
+  }
+
+  const unique_ptr<LevelDBVerifiableMap> map(OpenMap());
+  EXPECT_EQ(1, map->LatestVersion());
+  ExpectSameAs(&reference, *map, keys);
+  EXPECT_THAT(map->Get("uncommitted").status(),
+              StatusIs(util::error::NOT_FOUND));
+
+  reference.Set("another", "value");
+  map->Set("another", "value");
+  EXPECT_EQ(2, map->Commit());
+  keys.emplace_back("another");
+  ExpectSameAs(&reference, *map, keys);
+}
+
+
+TEST_F(LevelDBVerifiableMapTest, OlderVersions) {
+  const unique_ptr<LevelDBVerifiableMap> map(OpenMap());
+  const string empty_root(map->CurrentRoot());
+  vector<string> roots{empty_root};
+  vector<SparseMerkleTree::CompressedProof> proofs;
+  for (int version(1); version <= 3; ++version) {
+    for (int i(0); i < 50; ++i) {
+      map->Set("key" + to_string(version * 100 + i), to_string(version));
+    }
+    map->Set("changing", to_string(version));
+    map->Commit();
+    roots.emplace_back(map->CurrentRoot());
+    proofs.emplace_back(
+        map->InclusionProof("changing", version).ValueOrDie());
+  }
+
+  for (int version(0); version <= 3; ++version) {
+    const StatusOr<string> root(map->RootAtVersion(version));
+    ASSERT_OK(root);
+    EXPECT_EQ(ToBase64(roots[version]), ToBase64(root.ValueOrDie()));
+  }
+  for (int version(1); version <= 3; ++version) {
+    const StatusOr<string> value(map->GetAtVersion("changing", version));
+    ASSERT_OK(value);
+    EXPECT_EQ(to_string(version), value.ValueOrDie());
+    // Not set yet in the previous version.
+    const string key("key" + to_string(version * 100));
+    EXPECT_THAT(map->GetAtVersion(key, version - 1).status(),
+                StatusIs(util::error::NOT_FOUND));
+
+    const StatusOr<SparseMerkleTree::CompressedProof> proof(
+        map->InclusionProof("changing", version));
+    ASSERT_OK(proof);
+    EXPECT_EQ(proofs[version - 1].bitmap, proof.ValueOrDie().bitmap);
+    EXPECT_EQ(proofs[version - 1].hashes, proof.ValueOrDie().hashes);
+  }
+
+  EXPECT_THAT(map->RootAtVersion(4).status(),
+              StatusIs(util::error::NOT_FOUND));
+  EXPECT_THAT(map->GetAtVersion("changing", -1).status(),
+              StatusIs(util::error::NOT_FOUND));
+  EXPECT_THAT(map->InclusionProof("changing", 4).status(),
+              StatusIs(util::error::NOT_FOUND));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -2,21 +2,55 @@
 
 #include <assert.h>
 #include <stddef.h>
+#include <algorithm>
 #include <string>
 #include <vector>
 
 #include "merkletree/merkle_tree_math.h"
+#include "util/executor.h"
+#include "util/parallel_for.h"
 
+using cert_trans::MemoryNodeStore;
 using cert_trans::MerkleTreeInterface;
+using cert_trans::MerkleTreeNodeStore;
+using std::min;
 using std::move;
 using std::string;
 using std::unique_ptr;
 
+namespace {
+
+// How many pairs of nodes to hand to the hasher at once.
+const size_t kHashBatchSize = 64;
+// Units of work of the parallel paths, in leaves or pairs of nodes.
+// Smaller inputs are not worth spreading over several threads.
+const size_t kParallelChunkSize = 1 << 12;
+// Bounds the scratch space used to hash a level in parallel.
+const size_t kParallelWindowPairs = 1 << 18;
+// How many snapshots CacheSnapshot() remembers.
+const size_t kMaxCachedSnapshots = 16;
+
+}  // namespace
+
 MerkleTree::MerkleTree(unique_ptr<SerialHasher> hasher)
     : MerkleTreeInterface(),
       treehasher_(move(hasher)),
+      tree_(new MemoryNodeStore(treehasher_.DigestSize())),
+      leaves_processed_(0),
+      level_count_(0) {
+}
+
+MerkleTree::MerkleTree(unique_ptr<SerialHasher> hasher,
+                       unique_ptr<MerkleTreeNodeStore> store)
+    : MerkleTreeInterface(),
+      treehasher_(move(hasher)),
+      tree_(move(store)),
       leaves_processed_(0),
       level_count_(0) {
+  assert(tree_);
+  assert(tree_->NodeSize() == treehasher_.DigestSize());
+  if (LazyLevelCount() > 0)
+    RepairUpperLevels();
 }
 
 MerkleTree::~MerkleTree() {
@@ -26,6 +60,31 @@ size_t MerkleTree::AddLeaf(const string& data) {
   return AddLeafHash(treehasher_.HashLeaf(data));
 }
 
+size_t MerkleTree::AddLeaves(const std::vector<string>& data,
+                             util::Executor* executor) {
+  if (!executor || data.size() <= kParallelChunkSize) {
+    for (const string& leaf : data)
+      AddLeaf(leaf);
+    return LeafCount();
+  }
+
+  std::vector<string> hashes(data.size());
+  const size_t chunks((data.size() + kParallelChunkSize - 1) /
+                      kParallelChunkSize);
+  util::ParallelFor(executor, chunks, [this, &data, &hashes](size_t chunk) {
+    const size_t end(min(data.size(), (chunk + 1) * kParallelChunkSize));
+    for (size_t i = chunk * kParallelChunkSize; i < end; ++i)
+      hashes[i] = treehasher_.HashLeaf(data[i]);
+  });
+  return AddLeafHashes(hashes);
+}
+
+size_t MerkleTree::AddLeafHashes(const std::vector<string>& hashes) {
+  for (const string& hash : hashes)
+    AddLeafHash(hash);
+  return LeafCount();
+}
+
 size_t MerkleTree::AddLeafHash(const string& hash) {
   if (LazyLevelCount() == 0) {
     AddLevel();
@@ -47,6 +106,13 @@ string MerkleTree::CurrentRoot() {
   return RootAtSnapshot(LeafCount());
 }
 
+string MerkleTree::CurrentRoot(util::Executor* executor) {
+  const size_t leaf_count(LeafCount());
+  if (leaf_count == 0)
+    return treehasher_.HashEmpty();
+  return UpdateToSnapshot(leaf_count, executor);
+}
+
 string MerkleTree::RootAtSnapshot(size_t snapshot) {
   if (snapshot == 0)
     return treehasher_.HashEmpty();
@@ -54,7 +120,7 @@ string MerkleTree::RootAtSnapshot(size_t snapshot) {
   if (snapshot > leaf_count)
     return string();
   if (snapshot >= leaves_processed_)
-    return UpdateToSnapshot(snapshot);
+    return UpdateToSnapshot(snapshot, NULL);
   // snapshot < leaves_processed_: recompute the snapshot root.
   return RecomputePastSnapshot(snapshot, 0, NULL);
 }
@@ -72,6 +138,36 @@ std::vector<string> MerkleTree::PathToRootAtSnapshot(size_t leaf,
   return PathFromNodeToRootAtSnapshot(leaf - 1, 0, snapshot);
 }
 
+string MerkleTree::PathNodeAtSnapshot(size_t leaf, size_t snapshot,
+                                      size_t position) {
+  if (leaf > snapshot || snapshot > LeafCount() || leaf == 0)
+    return string();
+
+  if (snapshot > leaves_processed_) {
+    // Bring the tree sufficiently up to date.
+    UpdateToSnapshot(snapshot, NULL);
+  }
+
+  // Move up as PathFromNodeToRootAtSnapshot() does, counting the
+  // siblings that it would record, until the one we want.
+  size_t node = leaf - 1;
+  size_t last_node = snapshot - 1;
+  for (size_t level = 0; last_node; ++level) {
+    const size_t sibling = MerkleTreeMath::Sibling(node);
+    if (sibling <= last_node && position-- == 0) {
+      if (sibling < last_node)
+        return NodeString(level, sibling);
+      string recompute_node;
+      RecomputePastSnapshot(snapshot, level, &recompute_node);
+      return recompute_node;
+    }
+    node = MerkleTreeMath::Parent(node);
+    last_node = MerkleTreeMath::Parent(last_node);
+  }
+
+  return string();
+}
+
 std::vector<string> MerkleTree::SnapshotConsistency(size_t snapshot1,
                                                     size_t snapshot2) {
   std::vector<string> proof;
@@ -91,12 +187,12 @@ std::vector<string> MerkleTree::SnapshotConsistency(size_t snapshot1,
 
   if (snapshot2 > leaves_processed_) {
     // Bring the tree sufficiently up to date.
-    UpdateToSnapshot(snapshot2);
+    UpdateToSnapshot(snapshot2, NULL);
   }
 
   // Record the node, unless we already reached the root of snapshot1.
   if (node)
-    proof.push_back(Node(level, node));
+    proof.push_back(NodeString(level, node));
 
   // Now record the path from this node to the root of snapshot2.
   std::vector<string> path =
@@ -105,11 +201,12 @@ std::vector<string> MerkleTree::SnapshotConsistency(size_t snapshot1,
   return proof;
 }
 
-string MerkleTree::UpdateToSnapshot(size_t snapshot) {
+string MerkleTree::UpdateToSnapshot(size_t snapshot,
+                                    util::Executor* executor) {
   if (snapshot == 0)
     return treehasher_.HashEmpty();
   if (snapshot == 1)
-    return Node(0, 0);
+    return NodeString(0, 0);
   if (snapshot == leaves_processed_)
     return Root();
   assert(snapshot <= LeafCount());
@@ -136,10 +233,7 @@ string MerkleTree::UpdateToSnapshot(size_t snapshot) {
 
     // Compute the parents of new nodes at the current level.
     // Start with a left sibling and parse an even number of nodes.
-    for (size_t j = first_node & ~1; j < last_node; j += 2) {
-      PushBack(level + 1,
-               treehasher_.HashChildren(Node(level, j), Node(level, j + 1)));
-    }
+    PushParents(level, first_node & ~1, last_node + 1, executor);
     // If the last node at the current level is a left sibling,
     // dummy-propagate it one level up.
     if (!MerkleTreeMath::IsRightChild(last_node))
@@ -164,10 +258,10 @@ string MerkleTree::RecomputePastSnapshot(size_t snapshot, size_t node_level,
     // Nothing to recompute.
     if (node && LazyLevelCount() > node_level) {
       if (node_level > 0) {
-        node->assign(LastNode(node_level));
+        node->assign(LastNode(node_level), NodeSize());
       } else {
         // Leaf level: grab the last processed leaf.
-        node->assign(Node(node_level, last_node));
+        node->assign(Node(node_level, last_node), NodeSize());
       }
     }
     return Root();
@@ -175,10 +269,18 @@ string MerkleTree::RecomputePastSnapshot(size_t snapshot, size_t node_level,
 
   assert(snapshot < leaves_processed_);
 
+  const auto cached(snapshot_edges_.find(snapshot));
+  if (cached != snapshot_edges_.end()) {
+    const std::vector<string>& edge(cached->second);
+    if (node && node_level < edge.size())
+      node->assign(edge[node_level]);
+    return edge.back();
+  }
+
   // Recompute nodes on the path of the last leaf.
   while (MerkleTreeMath::IsRightChild(last_node)) {
     if (node && node_level == level)
-      node->assign(Node(level, last_node));
+      node->assign(Node(level, last_node), NodeSize());
     // Left sibling and parent exist in the snapshot, and are equal to
     // those in the tree; no need to rehash, move one level up.
     last_node = MerkleTreeMath::Parent(last_node);
@@ -187,7 +289,7 @@ string MerkleTree::RecomputePastSnapshot(size_t snapshot, size_t node_level,
 
   // Now last_node is the index of a left sibling with no right sibling.
   // Record the node.
-  string subtree_root = Node(level, last_node);
+  string subtree_root = NodeString(level, last_node);
 
   if (node && node_level == level)
     node->assign(subtree_root);
@@ -195,8 +297,8 @@ string MerkleTree::RecomputePastSnapshot(size_t snapshot, size_t node_level,
   while (last_node) {
     if (MerkleTreeMath::IsRightChild(last_node)) {
       // Recompute the parent of tree_[level][last_node].
-      subtree_root =
-          treehasher_.HashChildren(Node(level, last_node - 1), subtree_root);
+      subtree_root = treehasher_.HashChildren(
+          Node(level, last_node - 1), subtree_root.data());
     }
     // Else the parent is a dummy copy of the current node; do nothing.
 
@@ -209,6 +311,62 @@ string MerkleTree::RecomputePastSnapshot(size_t snapshot, size_t node_level,
   return subtree_root;
 }
 
+void MerkleTree::CacheSnapshot(size_t snapshot) {
+  if (snapshot == 0 || snapshot > LeafCount())
+    return;
+  if (snapshot > leaves_processed_)
+    UpdateToSnapshot(snapshot, NULL);
+
+  std::vector<string> edge;
+  if (snapshot == leaves_processed_) {
+    // The tree is exactly at the snapshot, read the edge off it.
+    edge.push_back(NodeString(0, snapshot - 1));
+    for (size_t level = 1; level < LazyLevelCount(); ++level)
+      edge.push_back(string(LastNode(level), NodeSize()));
+  } else {
+    edge = PastSnapshotRightEdge(snapshot);
+  }
+  snapshot_edges_[snapshot] = move(edge);
+
+  // Monitors ask about recent tree sizes, so drop the oldest.
+  while (snapshot_edges_.size() > kMaxCachedSnapshots)
+    snapshot_edges_.erase(snapshot_edges_.begin());
+}
+
+std::vector<string> MerkleTree::PastSnapshotRightEdge(size_t snapshot) const {
+  assert(snapshot > 0);
+  assert(snapshot < leaves_processed_);
+  std::vector<string> edge;
+  size_t level = 0;
+  size_t last_node = snapshot - 1;
+
+  // As in RecomputePastSnapshot(): the nodes on the path of the last
+  // leaf are unchanged up to the first left sibling.
+  while (MerkleTreeMath::IsRightChild(last_node)) {
+    edge.push_back(NodeString(level, last_node));
+    last_node = MerkleTreeMath::Parent(last_node);
+    ++level;
+  }
+
+  string subtree_root(NodeString(level, last_node));
+  edge.push_back(subtree_root);
+  while (last_node) {
+    if (MerkleTreeMath::IsRightChild(last_node))
+      subtree_root = treehasher_.HashChildren(Node(level, last_node - 1),
+                                              subtree_root.data());
+    last_node = MerkleTreeMath::Parent(last_node);
+    ++level;
+    edge.push_back(subtree_root);
+  }
+
+  return edge;
+}
+
+void MerkleTree::InvalidateSnapshotsFrom(size_t leaf) {
+  snapshot_edges_.erase(snapshot_edges_.lower_bound(leaf),
+                        snapshot_edges_.end());
+}
+
 std::vector<string> MerkleTree::PathFromNodeToRootAtSnapshot(size_t node,
                                                              size_t level,
                                                              size_t snapshot) {
@@ -222,7 +380,7 @@ std::vector<string> MerkleTree::PathFromNodeToRootAtSnapshot(size_t node,
 
   if (snapshot > leaves_processed_) {
     // Bring the tree sufficiently up to date.
-    UpdateToSnapshot(snapshot);
+    UpdateToSnapshot(snapshot, NULL);
   }
 
   // Move up, recording the sibling of the current node at each level.
@@ -231,7 +389,7 @@ std::vector<string> MerkleTree::PathFromNodeToRootAtSnapshot(size_t node,
     if (sibling < last_node) {
       // The sibling is not the last node of the level in the snapshot
       // tree, so its value is correct in the tree.
-      path.push_back(Node(level, sibling));
+      path.push_back(NodeString(level, sibling));
     } else if (sibling == last_node) {
       // The sibling is the last node of the level in the snapshot tree,
       // so we get its value for the snapshot. Get the root in the same pass.
@@ -250,44 +408,141 @@ std::vector<string> MerkleTree::PathFromNodeToRootAtSnapshot(size_t node,
   return path;
 }
 
-string MerkleTree::Node(size_t level, size_t index) const {
+const char* MerkleTree::Node(size_t level, size_t index) const {
   assert(NodeCount(level) > index);
-  return tree_[level].substr(index * treehasher_.DigestSize(),
-                             treehasher_.DigestSize());
+  return tree_->Node(level, index);
+}
+
+string MerkleTree::NodeString(size_t level, size_t index) const {
+  return string(Node(level, index), NodeSize());
 }
 
 string MerkleTree::Root() const {
-  assert(tree_.back().size() == treehasher_.DigestSize());
-  return tree_.back();
+  const size_t root_level(LazyLevelCount() - 1);
+  assert(NodeCount(root_level) == 1U);
+  return NodeString(root_level, 0);
 }
 
 size_t MerkleTree::NodeCount(size_t level) const {
   assert(LazyLevelCount() > level);
-  return tree_[level].size() / treehasher_.DigestSize();
+  return tree_->NodeCount(level);
 }
 
-string MerkleTree::LastNode(size_t level) const {
+const char* MerkleTree::LastNode(size_t level) const {
   assert(NodeCount(level) >= 1U);
-  return tree_[level].substr(tree_[level].size() - treehasher_.DigestSize());
+  return Node(level, NodeCount(level) - 1);
 }
 
 void MerkleTree::PopBack(size_t level) {
   assert(NodeCount(level) >= 1U);
-  tree_[level].erase(tree_[level].size() - treehasher_.DigestSize());
+  tree_->TruncateLevel(level, NodeCount(level) - 1);
 }
 
-void MerkleTree::PushBack(size_t level, string node) {
-  assert(node.size() == treehasher_.DigestSize());
+void MerkleTree::PushBack(size_t level, const char* node) {
   assert(LazyLevelCount() > level);
-  tree_[level].append(node);
+  tree_->PushBack(level, node);
+}
+
+void MerkleTree::PushBack(size_t level, const string& node) {
+  assert(node.size() == treehasher_.DigestSize());
+  PushBack(level, node.data());
+}
+
+void MerkleTree::PushParents(size_t level, size_t begin, size_t end,
+                             util::Executor* executor) {
+  assert(begin % 2 == 0);
+  assert(end <= NodeCount(level));
+  if (begin + 1 >= end)
+    return;
+
+  const size_t node_size(NodeSize());
+  const size_t pair_count((end - begin) / 2);
+  // Hash the parents of pairs [first, first + count) into |out|, pair
+  // p being nodes 2p and 2p + 1 of the level. This only reads the
+  // store, so it can run concurrently.
+  const auto hash_pairs = [this, level](size_t first, size_t count,
+                                        char* out) {
+    const char* children[kHashBatchSize];
+    while (count > 0) {
+      const size_t batch(min(count, kHashBatchSize));
+      for (size_t i = 0; i < batch; ++i)
+        children[i] = Node(level, 2 * (first + i));
+      treehasher_.HashChildrenBatch(children, batch, out);
+      first += batch;
+      count -= batch;
+      out += batch * NodeSize();
+    }
+  };
+
+  const size_t window_pairs(
+      executor && pair_count > kParallelChunkSize
+          ? kParallelWindowPairs
+          : kHashBatchSize);
+  std::vector<char> parents(min(window_pairs, pair_count) * node_size);
+  for (size_t done = 0; done < pair_count;) {
+    const size_t first(begin / 2 + done);
+    const size_t count(min(window_pairs, pair_count - done));
+    if (executor && count > kParallelChunkSize) {
+      const size_t chunks((count + kParallelChunkSize - 1) /
+                          kParallelChunkSize);
+      util::ParallelFor(executor, chunks, [&](size_t chunk) {
+        const size_t offset(chunk * kParallelChunkSize);
+        hash_pairs(first + offset, min(kParallelChunkSize, count - offset),
+                   &parents[offset * node_size]);
+      });
+    } else {
+      hash_pairs(first, count, parents.data());
+    }
+    for (size_t i = 0; i < count; ++i)
+      PushBack(level + 1, &parents[i * node_size]);
+    done += count;
+  }
 }
 
 void MerkleTree::AddLevel() {
-  tree_.push_back(string());
+  tree_->AddLevel();
 }
 
 size_t MerkleTree::LazyLevelCount() const {
-  return tree_.size();
+  return tree_->LevelCount();
+}
+
+void MerkleTree::RepairUpperLevels() {
+  const size_t leaf_count(LeafCount());
+  if (leaf_count == 0) {
+    tree_->TruncateLevels(0);
+    leaves_processed_ = 0;
+    level_count_ = 0;
+    return;
+  }
+
+  // At each level, every node but the last one is fixed once written,
+  // so only the last one could be stale (or missing). Working our way
+  // up, we drop the last node, and any node whose children are gone,
+  // then compute the parents that are missing.
+  size_t level = 0;
+  while (NodeCount(level) > 1) {
+    const size_t child_count(NodeCount(level));
+    if (LazyLevelCount() <= level + 1) {
+      AddLevel();
+    } else {
+      const size_t parent_count(NodeCount(level + 1));
+      tree_->TruncateLevel(level + 1,
+                           std::min(parent_count > 0 ? parent_count - 1 : 0,
+                                    child_count / 2));
+    }
+
+    PushParents(level, 2 * NodeCount(level + 1), child_count, NULL);
+    // Dummy-propagate a last lone left sibling.
+    if (child_count % 2 == 1)
+      PushBack(level + 1, Node(level, child_count - 1));
+
+    ++level;
+  }
+  tree_->TruncateLevels(level + 1);
+
+  leaves_processed_ = leaf_count;
+  level_count_ = LazyLevelCount();
 }
 
 MutableMerkleTree::MutableMerkleTree(unique_ptr<SerialHasher> hasher)
@@ -302,9 +557,10 @@ bool MutableMerkleTree::UpdateLeafHash(size_t leaf, const string& hash) {
     return false;
 
   // Update the leaf node.
+  assert(hash.size() == treehasher_.DigestSize());
   size_t child = leaf - 1;
-  tree_[0].replace(treehasher_.DigestSize() * child, treehasher_.DigestSize(),
-                   hash);
+  tree_->SetNode(0, child, hash.data());
+  InvalidateSnapshotsFrom(leaf);
 
   if (leaf > leaves_processed_)
     return true;
@@ -322,11 +578,10 @@ bool MutableMerkleTree::UpdateLeafHash(size_t leaf, const string& hash) {
                                              Node(child_level, child + 1));
     } else {
       // Propagate the "dummy" node.
-      parent_hash = Node(child_level, child);
+      parent_hash = NodeString(child_level, child);
     }
 
-    tree_[child_level + 1].replace(treehasher_.DigestSize() * parent,
-                                   treehasher_.DigestSize(), parent_hash);
+    tree_->SetNode(child_level + 1, parent, parent_hash.data());
 
     child = parent;
     parent = MerkleTreeMath::Parent(parent);
@@ -340,8 +595,9 @@ bool MutableMerkleTree::Truncate(size_t leaf) {
   if (leaf > LeafCount())
     return false;
 
+  InvalidateSnapshotsFrom(leaf + 1);
   if (leaf == 0) {
-    tree_.clear();
+    tree_->TruncateLevels(0);
     leaves_processed_ = 0;
     level_count_ = 0;
 
@@ -350,7 +606,7 @@ bool MutableMerkleTree::Truncate(size_t leaf) {
 
   // Truncate leaves level.
   size_t child = leaf - 1;
-  tree_[0].erase(treehasher_.DigestSize() * (child + 1));
+  tree_->TruncateLevel(0, child + 1);
 
   // Update levels count.
   level_count_ = 1;
@@ -367,7 +623,7 @@ bool MutableMerkleTree::Truncate(size_t leaf) {
   size_t child_level = 0;
   size_t parent = MerkleTreeMath::Parent(child);
   while (child) {
-    tree_[child_level + 1].erase(treehasher_.DigestSize() * (parent + 1));
+    tree_->TruncateLevel(child_level + 1, parent + 1);
 
     child = parent;
     parent = MerkleTreeMath::Parent(parent);
@@ -376,8 +632,7 @@ bool MutableMerkleTree::Truncate(size_t leaf) {
 
   // The current child_level value corresponds to the root level - remove empty
   // levels.
-  if (child_level + 1 < tree_.size())
-    tree_.erase(tree_.begin() + child_level + 1, tree_.end());
+  tree_->TruncateLevels(child_level + 1);
 
   // Update rightmost chain of nodes.
   assert(UpdateLeafHash(leaf, LeafHash(leaf)));
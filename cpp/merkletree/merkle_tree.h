@@ -2,15 +2,21 @@
 #define CERT_TRANS_MERKLETREE_MERKLE_TREE_H_
 
 #include <stddef.h>
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
 
 #include "merkletree/merkle_tree_interface.h"
+#include "merkletree/node_store.h"
 #include "merkletree/tree_hasher.h"
 
 class SerialHasher;
 
+namespace util {
+class Executor;
+}  // namespace util
+
 // Class for manipulating Merkle Hash Trees, as specified in the
 // Certificate Transparency specificationdoc/sunlight.xml
 // Implement binary Merkle Hash Trees, using an arbitrary hash function
@@ -23,8 +29,16 @@ class SerialHasher;
 class MerkleTree : public cert_trans::MerkleTreeInterface {
  public:
   // The constructor takes a pointer to some concrete hash function
-  // instantiation of the SerialHasher abstract class.
+  // instantiation of the SerialHasher abstract class. The nodes are
+  // kept in a cert_trans::MemoryNodeStore.
   explicit MerkleTree(std::unique_ptr<SerialHasher> hasher);
+  // As above, but keeps the nodes in |store|, which must have a node
+  // size matching the digest size of |hasher|. If |store| already
+  // holds nodes (e.g. a cert_trans::FileNodeStore reopened after a
+  // restart), the tree carries on from its leaves, recomputing only
+  // the right edge of the levels above.
+  MerkleTree(std::unique_ptr<SerialHasher> hasher,
+             std::unique_ptr<cert_trans::MerkleTreeNodeStore> store);
   virtual ~MerkleTree();
 
   // Length of a node (i.e., a hash), in bytes.
@@ -34,14 +48,14 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
 
   // Number of leaves in the tree.
   virtual size_t LeafCount() const {
-    return tree_.empty() ? 0 : NodeCount(0);
+    return LazyLevelCount() == 0 ? 0 : NodeCount(0);
   }
 
   // The |leaf|th leaf hash in the tree. Indexing starts from 1.
   std::string LeafHash(size_t leaf) const {
     if (leaf == 0 || leaf > LeafCount())
       return std::string();
-    return Node(0, leaf - 1);
+    return NodeString(0, leaf - 1);
   }
 
   // Return the leaf hash, but do not append the data to the tree.
@@ -79,6 +93,19 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
   // @param hash leaf hash
   virtual size_t AddLeafHash(const std::string& hash);
 
+  // Same as calling AddLeaf() for each element of |data| in order, but
+  // the leaves are hashed in parallel on |executor|, if not NULL.
+  //
+  // Returns the position of the last leaf in the tree.
+  size_t AddLeaves(const std::vector<std::string>& data,
+                   util::Executor* executor);
+
+  // Same as calling AddLeafHash() for each element of |hashes|, in
+  // order.
+  //
+  // Returns the position of the last leaf in the tree.
+  size_t AddLeafHashes(const std::vector<std::string>& hashes);
+
   // Get the current root of the tree.
   // Update the root to reflect the current shape of the tree,
   // and return the tree digest.
@@ -87,6 +114,12 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
   // (and hence, no root).
   virtual std::string CurrentRoot();
 
+  // Same as above, but when many leaves were added since the tree was
+  // last brought up to date, the lower levels are hashed in parallel
+  // on |executor|, if not NULL. The calling thread takes part in the
+  // work, so it may itself be running on |executor|.
+  std::string CurrentRoot(util::Executor* executor);
+
   // Get the root of the tree for a previous snapshot,
   // where snapshot 0 is an empty tree, snapshot 1 is the tree with
   // 1 leaf, etc.
@@ -120,6 +153,15 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
   // @param snapshot point in time (= number of leaves at that point)
   std::vector<std::string> PathToRootAtSnapshot(size_t leaf, size_t snapshot);
 
+  // Get the |position|-th node of PathToRootAtSnapshot(leaf, snapshot)
+  // (0 being the sibling of the leaf hash), without computing the rest
+  // of the path.
+  //
+  // Returns an empty string if the path is empty or shorter than
+  // that.
+  std::string PathNodeAtSnapshot(size_t leaf, size_t snapshot,
+                                 size_t position);
+
   // Get the Merkle consistency proof between two snapshots.
   // Returns a vector of node hashes, ordered according to levels.
   // Returns an empty vector if snapshot1 is 0, snapshot 1 >= snapshot2,
@@ -130,9 +172,28 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
   std::vector<std::string> SnapshotConsistency(size_t snapshot1,
                                                size_t snapshot2);
 
+  // Remember the right edge of the tree at |snapshot|, i.e. the last
+  // node of each level, so that RootAtSnapshot(), PathToRootAtSnapshot()
+  // and SnapshotConsistency() for that snapshot do not have to
+  // recompute it once the tree has grown past it. Meant to be called
+  // for each published tree size; only the most recent few snapshots
+  // are kept.
+  void CacheSnapshot(size_t snapshot);
+
+  // Make the nodes of the tree durable, if its store supports it.
+  void Sync() {
+    tree_->Sync();
+  }
+
+  // Bytes of memory allocated for the nodes, by its store.
+  size_t AllocatedBytes() const {
+    return tree_->AllocatedBytes();
+  }
+
  protected:
-  // Update to a given snapshot, return the root.
-  std::string UpdateToSnapshot(size_t snapshot);
+  // Update to a given snapshot, return the root. If |executor| is not
+  // NULL, large levels are hashed in parallel on it.
+  std::string UpdateToSnapshot(size_t snapshot, util::Executor* executor);
   // Return the root of a past snapshot.
   // If node is not NULL, additionally record the rightmost node
   // for the given snapshot and node_level.
@@ -145,7 +206,11 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
                                                         size_t snapshot);
   // Get the |index|-th node at level |level|. Indexing starts at 0;
   // caller is responsible for ensuring tree is sufficiently up to date.
-  std::string Node(size_t level, size_t index) const;
+  // Returns a pointer to the NodeSize() bytes of the node in the store.
+  const char* Node(size_t level, size_t index) const;
+
+  // Same as Node(), but returns a copy.
+  std::string NodeString(size_t level, size_t index) const;
 
   // Get the current root (of the lazily evaluated tree).
   // Caller is responsible for keeping track of the lazy evaluation status.
@@ -156,19 +221,41 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
   size_t NodeCount(size_t level) const;
 
   // Last node of the given level.
-  std::string LastNode(size_t level) const;
+  const char* LastNode(size_t level) const;
 
   // Pop the last node of the level.
   void PopBack(size_t level);
 
   // Append a node to the level.
-  void PushBack(size_t level, std::string node);
+  void PushBack(size_t level, const char* node);
+  void PushBack(size_t level, const std::string& node);
+
+  // Append to level |level| + 1 the parents of the pairs of siblings
+  // among nodes [|begin|, |end|) of level |level|, hashing them in
+  // batches, spread over |executor| if not NULL. |begin| must be a
+  // left sibling; a trailing lone node is left alone.
+  void PushParents(size_t level, size_t begin, size_t end,
+                   util::Executor* executor);
 
   // Start a new level.
   void AddLevel();
 
   // Current level count of the lazily evaluated tree.
   size_t LazyLevelCount() const;
+
+  // The right edge of |snapshot|, from the leaves up to its root.
+  // REQUIRES: 0 < |snapshot| < leaves_processed_.
+  std::vector<std::string> PastSnapshotRightEdge(size_t snapshot) const;
+
+  // Forget the cached snapshots which include leaf |leaf| (indexed
+  // from 1), after it changed.
+  void InvalidateSnapshotsFrom(size_t leaf);
+
+  // Bring the levels above the leaves up to date with the leaves,
+  // when they were loaded from a store and might lag behind, or hold
+  // stale nodes on their right edge.
+  void RepairUpperLevels();
+  TreeHasher treehasher_;
   // A container for nodes, organized according to levels and sorted
   // left-to-right in each level. tree_[0] is the leaf level, etc.
   // The hash of nodes tree_[i][j] and tree_[i][j+1] (j even) is stored
@@ -200,13 +287,14 @@ class MerkleTree : public cert_trans::MerkleTreeInterface {
   // Since the tree is append-only from the right, at any given point in time,
   // at each level, all nodes computed so far, except possibly the last node,
   // are fixed and will no longer change.
-  std::vector<std::string> tree_;
-  TreeHasher treehasher_;
+  const std::unique_ptr<cert_trans::MerkleTreeNodeStore> tree_;
   // Number of leaves propagated up to the root,
   // to keep track of lazy evaluation.
   size_t leaves_processed_;
   // The "true" level count for a fully evaluated tree.
   size_t level_count_;
+  // Right edges saved by CacheSnapshot(), keyed by snapshot.
+  std::map<size_t, std::vector<std::string>> snapshot_edges_;
 };
 
 // Mutable Merkle Tree, supports updating nodes and truncating the tree.
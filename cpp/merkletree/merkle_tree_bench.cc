@@ -0,0 +1,186 @@
+#include <benchmark/benchmark.h>
+#include <stddef.h>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "merkletree/compact_merkle_tree.h"
+#include "merkletree/merkle_tree.h"
+#include "merkletree/serial_hasher.h"
+#include "merkletree/sparse_merkle_tree.h"
+#include "merkletree/tree_hasher.h"
+#include "util/testing.h"
+
+namespace {
+
+using std::map;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+const size_t kLeafBytes = 1024;
+
+
+unique_ptr<Sha256Hasher> NewHasher() {
+  return unique_ptr<Sha256Hasher>(new Sha256Hasher);
+}
+
+
+// Returns a tree of |size| leaves, built once and kept for the
+// benchmarks which read from it.
+MerkleTree* TreeOfSize(size_t size) {
+  static map<size_t, unique_ptr<MerkleTree>>* const trees(
+      new map<size_t, unique_ptr<MerkleTree>>);
+  unique_ptr<MerkleTree>& tree((*trees)[size]);
+  if (!tree) {
+    tree.reset(new MerkleTree(NewHasher()));
+    const string data(kLeafBytes, 0x42);
+    for (size_t i = 0; i < size; ++i) {
+      tree->AddLeaf(data);
+    }
+    tree->CurrentRoot();
+  }
+  return tree.get();
+}
+
+
+void BM_TreeHasherHashLeaf(benchmark::State& state) {
+  const TreeHasher hasher(NewHasher());
+  const string data(state.range(0), 0x42);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(hasher.HashLeaf(data));
+  }
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_TreeHasherHashLeaf)->Arg(32)->Arg(kLeafBytes)->Arg(16 * 1024);
+
+
+void BM_TreeHasherHashChildren(benchmark::State& state) {
+  const TreeHasher hasher(NewHasher());
+  const string left(hasher.HashLeaf("left"));
+  const string right(hasher.HashLeaf("right"));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(hasher.HashChildren(left, right));
+  }
+}
+BENCHMARK(BM_TreeHasherHashChildren);
+
+
+void BM_MerkleTreeAddLeaf(benchmark::State& state) {
+  MerkleTree tree(NewHasher());
+  const string data(kLeafBytes, 0x42);
+  for (auto _ : state) {
+    tree.AddLeaf(data);
+  }
+}
+BENCHMARK(BM_MerkleTreeAddLeaf);
+
+
+// Adds a leaf and computes the new root, as the signer does.
+void BM_MerkleTreeAddLeafAndRoot(benchmark::State& state) {
+  MerkleTree tree(NewHasher());
+  const string data(kLeafBytes, 0x42);
+  for (auto _ : state) {
+    tree.AddLeaf(data);
+    benchmark::DoNotOptimize(tree.CurrentRoot());
+  }
+}
+BENCHMARK(BM_MerkleTreeAddLeafAndRoot);
+
+
+void BM_CompactMerkleTreeAddLeafAndRoot(benchmark::State& state) {
+  CompactMerkleTree tree(NewHasher());
+  const string data(kLeafBytes, 0x42);
+  for (auto _ : state) {
+    tree.AddLeaf(data);
+    benchmark::DoNotOptimize(tree.CurrentRoot());
+  }
+}
+BENCHMARK(BM_CompactMerkleTreeAddLeafAndRoot);
+
+
+// The argument is the size of the tree.
+void BM_MerkleTreePathToCurrentRoot(benchmark::State& state) {
+  MerkleTree* const tree(TreeOfSize(state.range(0)));
+  size_t leaf(1);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(tree->PathToCurrentRoot(leaf));
+    // Visit leaves all over the tree, by a stride coprime with its size.
+    leaf = (leaf + 7919 - 1) % tree->LeafCount() + 1;
+  }
+}
+BENCHMARK(BM_MerkleTreePathToCurrentRoot)->Range(1 << 10, 1 << 20);
+
+
+// The argument is the size of the tree, and the proofs are between
+// snapshots all over it and its current size.
+void BM_MerkleTreeSnapshotConsistency(benchmark::State& state) {
+  MerkleTree* const tree(TreeOfSize(state.range(0)));
+  size_t snapshot(1);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        tree->SnapshotConsistency(snapshot, tree->LeafCount()));
+    snapshot = (snapshot + 7919 - 1) % tree->LeafCount() + 1;
+  }
+}
+BENCHMARK(BM_MerkleTreeSnapshotConsistency)->Range(1 << 10, 1 << 20);
+
+
+SparseMerkleTree::Path RandomPath(std::mt19937* generator) {
+  SparseMerkleTree::Path path;
+  for (uint8_t& byte : path) {
+    byte = (*generator)() & 0xff;
+  }
+  return path;
+}
+
+
+// Sets a leaf at a random path and computes the new root, in a tree of
+// the size given by the argument.
+void BM_SparseMerkleTreeSetLeafAndRoot(benchmark::State& state) {
+  SparseMerkleTree tree(new Sha256Hasher);
+  std::mt19937 generator;
+  for (int64_t i = 0; i < state.range(0); ++i) {
+    tree.SetLeaf(RandomPath(&generator), "value");
+  }
+  tree.CurrentRoot();
+  for (auto _ : state) {
+    tree.SetLeaf(RandomPath(&generator), "value");
+    benchmark::DoNotOptimize(tree.CurrentRoot());
+  }
+}
+BENCHMARK(BM_SparseMerkleTreeSetLeafAndRoot)->Range(1 << 10, 1 << 18);
+
+
+// Computes the compressed inclusion proof of a random leaf, in a tree of
+// the size given by the argument.
+void BM_SparseMerkleTreeCompressedInclusionProof(benchmark::State& state) {
+  SparseMerkleTree tree(new Sha256Hasher);
+  std::mt19937 generator;
+  std::vector<SparseMerkleTree::Path> paths;
+  for (int64_t i = 0; i < state.range(0); ++i) {
+    paths.emplace_back(RandomPath(&generator));
+    tree.SetLeaf(paths.back(), "value");
+  }
+  tree.CurrentRoot();
+  std::uniform_int_distribution<size_t> index(0, paths.size() - 1);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        tree.CompressedInclusionProof(paths[index(generator)]));
+  }
+}
+BENCHMARK(BM_SparseMerkleTreeCompressedInclusionProof)
+    ->Range(1 << 10, 1 << 18);
+
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -4,11 +4,14 @@
 #include <stdint.h>
 #include <sys/resource.h>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "merkletree/merkle_tree.h"
 #include "merkletree/serial_hasher.h"
+#include "merkletree/tree_hasher.h"
 #include "util/testing.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
 namespace {
@@ -48,7 +51,9 @@ TEST_F(MerkleTreeLargeTest, BuildLargeTree) {
 
     FLAGS_minloglevel = 0;
     LOG(INFO) << "Peak RSS delta (as reported by getrusage()) was "
-              << ru.ru_maxrss - max_rss_before << " kB";
+              << ru.ru_maxrss - max_rss_before << " kB ("
+              << (ru.ru_maxrss - max_rss_before) * 1024.0 / tree_size
+              << " bytes per leaf)";
 
     LOG(INFO) << "Elapsed time: " << time_after - time_before << " ms";
     FLAGS_minloglevel = original_log_level;
@@ -60,6 +65,66 @@ TEST_F(MerkleTreeLargeTest, BuildLargeTree) {
   }
 }
 
+// Hashes a fixed amount of work through a single shared TreeHasher,
+// spread over an increasing number of threads, to show that hashing
+// scales with cores rather than serializing on the hasher.
+TEST_F(MerkleTreeLargeTest, ConcurrentHashing) {
+  const size_t kTotalHashes = 1 << 20;
+  const TreeHasher hasher(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  const string expected(
+      hasher.HashChildren(hasher.HashLeaf(data_), hasher.HashLeaf(data_)));
+  int original_log_level = FLAGS_minloglevel;
+
+  for (size_t num_threads = 1; num_threads <= 16; num_threads *= 2) {
+    std::vector<std::thread> threads;
+    std::vector<bool> results(num_threads, false);
+    uint64_t time_before = util::TimeInMilliseconds();
+
+    for (size_t t = 0; t < num_threads; ++t) {
+      threads.emplace_back([this, &hasher, &expected, &results, t,
+                            num_threads, kTotalHashes]() {
+        bool ok = true;
+        for (size_t i = 0; i < kTotalHashes / num_threads / 2; ++i) {
+          ok &= hasher.HashChildren(hasher.HashLeaf(data_),
+                                    hasher.HashLeaf(data_)) == expected;
+        }
+        results[t] = ok;
+      });
+    }
+    for (auto& thread : threads)
+      thread.join();
+    uint64_t time_after = util::TimeInMilliseconds();
+
+    for (size_t t = 0; t < num_threads; ++t)
+      EXPECT_TRUE(results[t]);
+
+    FLAGS_minloglevel = 0;
+    LOG(INFO) << kTotalHashes << " hashes on " << num_threads
+              << " thread(s): " << time_after - time_before << " ms";
+    FLAGS_minloglevel = original_log_level;
+  }
+}
+
+// Same as BuildLargeTree, through the parallel bulk path.
+TEST_F(MerkleTreeLargeTest, BuildLargeTreeInParallel) {
+  const size_t kTreeSize = 4194304;
+  cert_trans::ThreadPool pool;
+  const std::vector<string> data(kTreeSize, data_);
+  int original_log_level = FLAGS_minloglevel;
+
+  MerkleTree tree(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  uint64_t time_before = util::TimeInMilliseconds();
+  EXPECT_EQ(kTreeSize, tree.AddLeaves(data, &pool));
+  EXPECT_FALSE(tree.CurrentRoot(&pool).empty());
+  uint64_t time_after = util::TimeInMilliseconds();
+
+  FLAGS_minloglevel = 0;
+  LOG(INFO) << "Built a tree with " << kTreeSize << " leaves on "
+            << std::thread::hardware_concurrency() << " core(s) in "
+            << time_after - time_before << " ms";
+  FLAGS_minloglevel = original_log_level;
+}
+
 }  // namespace
 
 int main(int argc, char** argv) {
@@ -13,6 +13,7 @@
 #include "merkletree/serial_hasher.h"
 #include "merkletree/tree_hasher.h"
 #include "util/testing.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
 namespace {
@@ -220,6 +221,28 @@ TEST_F(MerkleTreeFuzzTest, PathFuzz) {
   }
 }
 
+// Check single path nodes against the whole paths.
+TEST_F(MerkleTreeFuzzTest, PathNodeFuzz) {
+  for (size_t tree_size = 1; tree_size <= data_.size(); ++tree_size) {
+    MerkleTree tree(NewSha256Hasher());
+    for (size_t j = 0; j < tree_size; ++j)
+      tree.AddLeaf(data_[j]);
+
+    for (size_t j = 0; j < 8; ++j) {
+      // A snapshot in the range 0... length.
+      const size_t snapshot = rand() % (tree_size + 1);
+      // A leaf in the range 0... snapshot.
+      const size_t leaf = rand() % (snapshot + 1);
+      const std::vector<string> path(
+          ReferenceMerklePath(data_.data(), snapshot, leaf, &tree_hasher_));
+      for (size_t position = 0; position <= path.size(); ++position) {
+        EXPECT_EQ(position < path.size() ? path[position] : string(),
+                  tree.PathNodeAtSnapshot(leaf, snapshot, position));
+      }
+    }
+  }
+}
+
 // Make random proof queries and check against the reference implementation.
 TEST_F(MerkleTreeFuzzTest, ConsistencyFuzz) {
   for (size_t tree_size = 1; tree_size <= data_.size(); ++tree_size) {
@@ -241,6 +264,31 @@ TEST_F(MerkleTreeFuzzTest, ConsistencyFuzz) {
   }
 }
 
+// Grow a tree, caching each snapshot along the way as published tree
+// heads would, and check queries about past snapshots.
+TEST_F(MerkleTreeFuzzTest, CachedSnapshotFuzz) {
+  MerkleTree tree(NewSha256Hasher());
+  for (size_t tree_size = 1; tree_size <= data_.size(); ++tree_size) {
+    tree.AddLeaf(data_[tree_size - 1]);
+    if (rand() % 2)
+      tree.CacheSnapshot(tree_size);
+
+    for (size_t j = 0; j < 8; ++j) {
+      const size_t snapshot2 = rand() % (tree_size + 1);
+      const size_t snapshot1 = rand() % (snapshot2 + 1);
+      EXPECT_EQ(tree.RootAtSnapshot(snapshot2),
+                ReferenceMerkleTreeHash(data_.data(), snapshot2,
+                                        &tree_hasher_));
+      EXPECT_EQ(tree.PathToRootAtSnapshot(snapshot1, snapshot2),
+                ReferenceMerklePath(data_.data(), snapshot2, snapshot1,
+                                    &tree_hasher_));
+      EXPECT_EQ(tree.SnapshotConsistency(snapshot1, snapshot2),
+                ReferenceSnapshotConsistency(data_.data(), snapshot2,
+                                             snapshot1, &tree_hasher_, true));
+    }
+  }
+}
+
 // KNOWN ANSWER TESTS
 
 typedef struct {
@@ -334,6 +382,30 @@ TEST_F(MerkleTreeTest, RootTestVectors) {
   EXPECT_STREQ(H(tree3.CurrentRoot()).c_str(), kSHA256Roots[7].str);
 }
 
+// Changing leaves must not leave stale cached snapshots behind.
+TEST_F(MutableMerkleTreeTest, CachedSnapshotAfterUpdate) {
+  MutableMerkleTree tree(NewSha256Hasher());
+  MerkleTree reference(NewSha256Hasher());
+  for (int i = 0; i < 8; ++i) {
+    tree.AddLeaf(S(kInputs[i]));
+    tree.CacheSnapshot(i + 1);
+    reference.AddLeaf(S(kInputs[i == 6 ? 5 : i]));
+  }
+  EXPECT_STREQ(H(tree.RootAtSnapshot(5)).c_str(), kSHA256Roots[4].str);
+
+  EXPECT_TRUE(tree.UpdateLeafHash(7, tree.LeafHash(S(kInputs[5]))));
+  EXPECT_STREQ(H(tree.RootAtSnapshot(6)).c_str(), kSHA256Roots[5].str);
+  for (size_t snapshot = 7; snapshot <= 8; ++snapshot) {
+    EXPECT_EQ(H(reference.RootAtSnapshot(snapshot)),
+              H(tree.RootAtSnapshot(snapshot)));
+  }
+
+  EXPECT_TRUE(tree.Truncate(6));
+  tree.AddLeaf(S(kInputs[6]));
+  tree.AddLeaf(S(kInputs[7]));
+  EXPECT_STREQ(H(tree.RootAtSnapshot(7)).c_str(), kSHA256Roots[6].str);
+}
+
 // Test Truncate(), indirectly this tests UpdateLeaf() and UpdateLeafHash().
 TEST_F(MutableMerkleTreeTest, RootTestVectors) {
   const size_t kMaxLeavesCount = 8;
@@ -510,6 +582,68 @@ TEST_F(CompactMerkleTreeFuzzTest, CopyCtorForLargerTreesThenAppend) {
   }
 }
 
+TEST_F(CompactMerkleTreeFuzzTest, SnapshotCtorThenAppend) {
+  MerkleTree tree(NewSha256Hasher());
+  std::vector<string> leaves;
+  for (size_t i = 0; i < 300; ++i) {
+    leaves.push_back(RandomLeaf(64));
+    tree.AddLeaf(leaves.back());
+  }
+
+  for (size_t snapshot = 0; snapshot <= leaves.size(); ++snapshot) {
+    // Build a CompactMerkleTree of the first |snapshot| leaves of |tree|
+    CompactMerkleTree ctree(&tree, snapshot, NewSha256Hasher());
+    EXPECT_EQ(snapshot, ctree.LeafCount());
+    EXPECT_EQ(tree.RootAtSnapshot(snapshot), ctree.CurrentRoot());
+    // And check that it catches up with |tree| leaf by leaf
+    MerkleTree reference(NewSha256Hasher());
+    for (size_t i = 0; i < snapshot; ++i) {
+      reference.AddLeaf(leaves[i]);
+    }
+    EXPECT_EQ(reference.LevelCount(), ctree.LevelCount());
+    for (size_t i = snapshot; i < std::min(snapshot + 16, leaves.size());
+         ++i) {
+      reference.AddLeaf(leaves[i]);
+      ctree.AddLeaf(leaves[i]);
+      EXPECT_EQ(reference.LevelCount(), ctree.LevelCount());
+      EXPECT_EQ(tree.RootAtSnapshot(i + 1), ctree.CurrentRoot());
+    }
+  }
+}
+
+TEST_F(CompactMerkleTreeFuzzTest, AddLeafHashesMatchesAddLeafHash) {
+  std::vector<string> hashes;
+  for (size_t i = 0; i < 301; ++i) {
+    hashes.push_back(tree_hasher_.HashLeaf(RandomLeaf(64)));
+  }
+
+  for (size_t start = 0; start <= 40; ++start) {
+    for (size_t count : {0, 1, 2, 3, 7, 8, 64, 100, 260}) {
+      CompactMerkleTree reference(NewSha256Hasher());
+      for (size_t i = 0; i < start + count; ++i) {
+        reference.AddLeafHash(hashes[i]);
+      }
+
+      CompactMerkleTree tree(NewSha256Hasher());
+      for (size_t i = 0; i < start; ++i) {
+        tree.AddLeafHash(hashes[i]);
+      }
+      EXPECT_EQ(start + count,
+                tree.AddLeafHashes(std::vector<string>(
+                                       hashes.begin() + start,
+                                       hashes.begin() + start + count),
+                                   nullptr));
+      EXPECT_EQ(reference.LeafCount(), tree.LeafCount());
+      EXPECT_EQ(reference.LevelCount(), tree.LevelCount());
+      EXPECT_EQ(reference.CurrentRoot(), tree.CurrentRoot());
+      // And it keeps agreeing as leaves are added one by one.
+      reference.AddLeafHash(hashes[start + count]);
+      tree.AddLeafHash(hashes[start + count]);
+      EXPECT_EQ(reference.CurrentRoot(), tree.CurrentRoot());
+    }
+  }
+}
+
 // Some paths for the reference tree.
 typedef struct {
   int leaf;
@@ -643,6 +777,65 @@ TEST_F(MerkleTreeTest, AddLeafHash) {
   EXPECT_EQ(kHashValue, tree.LeafHash(index));
 }
 
+TEST_F(MerkleTreeTest, AddLeavesInParallel) {
+  // Enough leaves to be worth spreading, and an unbalanced tree.
+  const size_t kLeafCount = 100003;
+  std::vector<string> data;
+  for (size_t i = 0; i < kLeafCount; ++i)
+    data.push_back(std::to_string(i));
+
+  MerkleTree serial(NewSha256Hasher());
+  for (size_t i = 0; i < kLeafCount / 2; ++i)
+    serial.AddLeaf(data[i]);
+  const string half_root(serial.CurrentRoot());
+  for (size_t i = kLeafCount / 2; i < kLeafCount; ++i)
+    serial.AddLeaf(data[i]);
+
+  cert_trans::ThreadPool pool(4);
+  MerkleTree parallel(NewSha256Hasher());
+  // Bring the tree up to date halfway, so that the second update
+  // starts from a partly built tree.
+  parallel.AddLeaves(std::vector<string>(data.begin(),
+                                         data.begin() + kLeafCount / 2),
+                     &pool);
+  EXPECT_EQ(H(half_root), H(parallel.CurrentRoot(&pool)));
+  EXPECT_EQ(kLeafCount,
+            parallel.AddLeaves(std::vector<string>(
+                                   data.begin() + kLeafCount / 2, data.end()),
+                               &pool));
+
+  EXPECT_EQ(H(serial.CurrentRoot()), H(parallel.CurrentRoot(&pool)));
+  EXPECT_EQ(serial.LevelCount(), parallel.LevelCount());
+  for (size_t leaf = 1; leaf <= kLeafCount; leaf += 9973) {
+    EXPECT_EQ(serial.PathToCurrentRoot(leaf),
+              parallel.PathToCurrentRoot(leaf));
+  }
+  EXPECT_EQ(serial.SnapshotConsistency(12345, kLeafCount),
+            parallel.SnapshotConsistency(12345, kLeafCount));
+}
+
+TEST_F(CompactMerkleTreeTest, AddLeafHashesInParallel) {
+  const size_t kLeafCount = 3 * 12345;
+  std::vector<string> hashes;
+  for (size_t i = 0; i < kLeafCount; ++i)
+    hashes.push_back(tree_hasher_.HashLeaf(std::to_string(i)));
+
+  CompactMerkleTree serial(NewSha256Hasher());
+  for (const string& hash : hashes)
+    serial.AddLeafHash(hash);
+
+  cert_trans::ThreadPool pool(4);
+  CompactMerkleTree parallel(NewSha256Hasher());
+  parallel.AddLeafHash(hashes[0]);
+  EXPECT_EQ(kLeafCount,
+            parallel.AddLeafHashes(std::vector<string>(hashes.begin() + 1,
+                                                       hashes.end()),
+                                   &pool));
+
+  EXPECT_EQ(H(serial.CurrentRoot()), H(parallel.CurrentRoot()));
+  EXPECT_EQ(serial.LevelCount(), parallel.LevelCount());
+}
+
 TEST_F(CompactMerkleTreeTest, TestCloneEmptyTreeProducesWorkingTree) {
   MerkleTree tree(NewSha256Hasher());
   CompactMerkleTree compact(&tree, NewSha256Hasher());
@@ -898,6 +1091,75 @@ TEST_F(MerkleVerifierTest, VerifyConsistencyProof) {
   }
 }
 
+TEST_F(MerkleVerifierTest, VerifyPathsMatchesVerifyPath) {
+  cert_trans::ThreadPool pool(4);
+  for (size_t tree_size = 1; tree_size <= data_.size() / 2; ++tree_size) {
+    const string root(
+        ReferenceMerkleTreeHash(data_.data(), tree_size, &tree_hasher_));
+    std::vector<MerkleVerifier::PathProof> proofs;
+    // Every leaf backwards, so VerifyPaths has to sort them, and some
+    // broken ones in between.
+    for (size_t leaf = tree_size; leaf >= 1; --leaf) {
+      MerkleVerifier::PathProof proof;
+      proof.leaf = leaf;
+      proof.leaf_hash = verifier_.LeafHash(data_[leaf - 1]);
+      proof.path =
+          ReferenceMerklePath(data_.data(), tree_size, leaf, &tree_hasher_);
+      proofs.push_back(proof);
+
+      if (!proof.path.empty()) {
+        proof.path.back() = S(kSHA256EmptyTreeHash);
+        proofs.push_back(proof);
+        proof.path.pop_back();
+        proofs.push_back(proof);
+      }
+      proof.leaf = tree_size + 1;
+      proofs.push_back(proof);
+    }
+
+    const std::vector<bool> valid(
+        verifier_.VerifyPaths(tree_size, root, proofs, &pool));
+    ASSERT_EQ(proofs.size(), valid.size());
+    for (size_t i = 0; i < proofs.size(); ++i) {
+      // VerifyPath takes the leaf data rather than its hash.
+      EXPECT_EQ(proofs[i].leaf <= tree_size &&
+                    verifier_.VerifyPath(proofs[i].leaf, tree_size,
+                                         proofs[i].path, root,
+                                         data_[proofs[i].leaf - 1]),
+                valid[i])
+          << "tree_size " << tree_size << " proof " << i;
+    }
+
+    EXPECT_EQ(std::vector<bool>(proofs.size(), false),
+              verifier_.VerifyPaths(tree_size, S(kSHA256EmptyTreeHash),
+                                    proofs, nullptr));
+  }
+}
+
+TEST_F(MerkleVerifierTest, VerifyConsistencyChain) {
+  cert_trans::ThreadPool pool(4);
+  std::vector<size_t> snapshots;
+  std::vector<string> roots;
+  std::vector<std::vector<string>> proofs;
+  for (size_t tree_size = 1; tree_size <= data_.size() / 2; tree_size += 3) {
+    if (!snapshots.empty())
+      proofs.push_back(ReferenceSnapshotConsistency(data_.data(), tree_size,
+                                                    snapshots.back(),
+                                                    &tree_hasher_, true));
+    snapshots.push_back(tree_size);
+    roots.push_back(
+        ReferenceMerkleTreeHash(data_.data(), tree_size, &tree_hasher_));
+  }
+  ASSERT_LT(3U, proofs.size());
+  EXPECT_EQ(proofs.size(),
+            verifier_.VerifyConsistencyChain(snapshots, roots, proofs, &pool));
+
+  roots[3] = S(kSHA256EmptyTreeHash);
+  EXPECT_EQ(2U,
+            verifier_.VerifyConsistencyChain(snapshots, roots, proofs,
+                                             nullptr));
+}
+
 #undef S
 #undef H
 
@@ -1,11 +1,18 @@
 #include "merkletree/merkle_verifier.h"
 
+#include <glog/logging.h>
 #include <stddef.h>
+#include <string.h>
+#include <algorithm>
+#include <numeric>
 #include <vector>
 
+#include "util/parallel_for.h"
+
 using std::move;
 using std::string;
 using std::unique_ptr;
+using std::vector;
 
 MerkleVerifier::MerkleVerifier(unique_ptr<SerialHasher> hasher)
     : treehasher_(move(hasher)) {
@@ -22,6 +29,129 @@ static inline bool IsRightChild(size_t leaf) {
   return leaf & 1;
 }
 
+namespace {
+
+// Proofs per unit of work in VerifyPaths().
+const size_t kPathChunkSize = 256;
+
+// Walks audit paths into one tree, remembering the nodes on the last
+// valid path, so that a later path that joins it with the same node
+// hash and the same remaining siblings is known to be valid without
+// hashing the rest of the way up. Works best on paths sorted by leaf.
+class PathWalker {
+ public:
+  PathWalker(const TreeHasher* hasher, size_t tree_size, const string& root)
+      : hasher_(hasher),
+        tree_size_(tree_size),
+        root_(root),
+        digest_size_(hasher->DigestSize()),
+        last_(nullptr),
+        pair_(2 * digest_size_),
+        current_(digest_size_) {
+  }
+
+  bool Verify(const MerkleVerifier::PathProof& proof) {
+    if (proof.leaf > tree_size_ || proof.leaf == 0 ||
+        proof.leaf_hash.size() != digest_size_ ||
+        root_.size() != digest_size_)
+      return false;
+
+    size_t node = proof.leaf - 1;
+    size_t last_node = tree_size_ - 1;
+    size_t level = 0;
+    size_t it = 0;
+    memcpy(current_.data(), proof.leaf_hash.data(), digest_size_);
+    nodes_.clear();
+    offsets_.clear();
+
+    while (last_node) {
+      if (JoinsLastPath(proof.path, level, node, it))
+        return true;
+      Remember(it);
+
+      if (it == proof.path.size() ||
+          proof.path[it].size() != digest_size_)
+        return false;
+      if (IsRightChild(node)) {
+        memcpy(pair_.data(), proof.path[it++].data(), digest_size_);
+        memcpy(pair_.data() + digest_size_, current_.data(), digest_size_);
+        Hash();
+      } else if (node < last_node) {
+        memcpy(pair_.data(), current_.data(), digest_size_);
+        memcpy(pair_.data() + digest_size_, proof.path[it++].data(),
+               digest_size_);
+        Hash();
+      }
+      // Else the sibling does not exist and the parent is a dummy copy.
+
+      node = Parent(node);
+      last_node = Parent(last_node);
+      ++level;
+    }
+
+    if (it != proof.path.size() ||
+        memcmp(current_.data(), root_.data(), digest_size_) != 0)
+      return false;
+
+    last_ = &proof;
+    last_nodes_.swap(nodes_);
+    last_offsets_.swap(offsets_);
+    return true;
+  }
+
+ private:
+  // Whether the node we are at, |node| at |level|, with its hash in
+  // |current_| and |path| continuing from |it|, is also on the last
+  // valid path.
+  bool JoinsLastPath(const vector<string>& path, size_t level, size_t node,
+                     size_t it) const {
+    if (!last_ || level >= last_offsets_.size() ||
+        (last_->leaf - 1) >> level != node)
+      return false;
+    if (memcmp(current_.data(), last_nodes_.data() + level * digest_size_,
+               digest_size_) != 0)
+      return false;
+    // Same node in the same tree, so the same number of siblings
+    // remain.
+    const size_t last_it(last_offsets_[level]);
+    if (path.size() - it != last_->path.size() - last_it)
+      return false;
+    return std::equal(path.begin() + it, path.end(),
+                      last_->path.begin() + last_it);
+  }
+
+  void Remember(size_t it) {
+    nodes_.insert(nodes_.end(), current_.begin(), current_.end());
+    offsets_.push_back(it);
+  }
+
+  void Hash() {
+    const char* children(pair_.data());
+    hasher_->HashChildrenBatch(&children, 1, current_.data());
+  }
+
+  const TreeHasher* const hasher_;
+  const size_t tree_size_;
+  const string& root_;
+  const size_t digest_size_;
+
+  // The last valid path, the hash of its node at each level back to
+  // back, and where its siblings for that level start.
+  const MerkleVerifier::PathProof* last_;
+  vector<char> last_nodes_;
+  vector<size_t> last_offsets_;
+
+  // The same, for the path being walked.
+  vector<char> nodes_;
+  vector<size_t> offsets_;
+
+  // A left and right child, and the node the walk is at.
+  vector<char> pair_;
+  vector<char> current_;
+};
+
+}  // namespace
+
 bool MerkleVerifier::VerifyPath(size_t leaf, size_t tree_size,
                                 const std::vector<string>& path,
                                 const string& root, const string& data) {
@@ -65,6 +195,36 @@ string MerkleVerifier::RootFromPath(size_t leaf, size_t tree_size,
   return node_hash;
 }
 
+vector<bool> MerkleVerifier::VerifyPaths(size_t tree_size, const string& root,
+                                         const vector<PathProof>& proofs,
+                                         util::Executor* executor) {
+  // Sort by leaf, so that each chunk gets runs of neighbouring paths.
+  vector<size_t> order(proofs.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(),
+                   [&proofs](size_t a, size_t b) {
+                     return proofs[a].leaf < proofs[b].leaf;
+                   });
+
+  // Not vector<bool>, which can't be written from several threads.
+  vector<char> valid(proofs.size());
+  const size_t chunks((proofs.size() + kPathChunkSize - 1) / kPathChunkSize);
+  const auto verify_chunk = [&](size_t chunk) {
+    PathWalker walker(&treehasher_, tree_size, root);
+    const size_t end(std::min(proofs.size(), (chunk + 1) * kPathChunkSize));
+    for (size_t i = chunk * kPathChunkSize; i < end; ++i)
+      valid[order[i]] = walker.Verify(proofs[order[i]]);
+  };
+  if (executor) {
+    util::ParallelFor(executor, chunks, verify_chunk);
+  } else {
+    for (size_t chunk = 0; chunk < chunks; ++chunk)
+      verify_chunk(chunk);
+  }
+
+  return vector<bool>(valid.begin(), valid.end());
+}
+
 bool MerkleVerifier::VerifyConsistency(size_t snapshot1, size_t snapshot2,
                                        const string& root1,
                                        const string& root2,
@@ -133,6 +293,25 @@ bool MerkleVerifier::VerifyConsistency(size_t snapshot1, size_t snapshot2,
   return node2_hash == root2 && it == proof.end();
 }
 
+size_t MerkleVerifier::VerifyConsistencyChain(
+    const vector<size_t>& snapshots, const vector<string>& roots,
+    const vector<vector<string>>& proofs, util::Executor* executor) {
+  CHECK_EQ(snapshots.size(), roots.size());
+  CHECK(proofs.empty() || snapshots.size() == proofs.size() + 1);
+  vector<char> valid(proofs.size());
+  const auto verify_link = [&](size_t i) {
+    valid[i] = VerifyConsistency(snapshots[i], snapshots[i + 1], roots[i],
+                                 roots[i + 1], proofs[i]);
+  };
+  if (executor) {
+    util::ParallelFor(executor, proofs.size(), verify_link);
+  } else {
+    for (size_t i = 0; i < proofs.size(); ++i)
+      verify_link(i);
+  }
+  return std::find(valid.begin(), valid.end(), 0) - valid.begin();
+}
+
 string MerkleVerifier::LeafHash(const std::string& data) {
   return treehasher_.HashLeaf(data);
 }
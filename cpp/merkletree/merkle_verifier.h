@@ -3,9 +3,11 @@
 
 #include <stddef.h>
 #include <memory>
+#include <string>
 #include <vector>
 
 #include "merkletree/tree_hasher.h"
+#include "util/executor.h"
 
 class SerialHasher;
 
@@ -14,6 +16,15 @@ class SerialHasher;
 
 class MerkleVerifier {
  public:
+  // An audit path for one leaf, as checked by VerifyPaths().
+  struct PathProof {
+    // Index of the leaf, starting from 1 as for VerifyPath().
+    size_t leaf;
+    // The leaf hash, as returned by LeafHash().
+    std::string leaf_hash;
+    std::vector<std::string> path;
+  };
+
   MerkleVerifier(std::unique_ptr<SerialHasher> hasher);
   ~MerkleVerifier();
 
@@ -43,10 +54,31 @@ class MerkleVerifier {
                            const std::vector<std::string>& path,
                            const std::string& data);
 
+  // Verify many audit paths into the same tree at once, spread over
+  // |executor| (if not NULL) and the calling thread. Element i of the
+  // result is what VerifyPath() would return for |proofs[i]|. Paths
+  // for nearby leaves share their upper nodes, which are only hashed
+  // once, and hashing reuses the same buffers instead of allocating a
+  // string per level.
+  std::vector<bool> VerifyPaths(size_t tree_size, const std::string& root,
+                                const std::vector<PathProof>& proofs,
+                                util::Executor* executor);
+
   bool VerifyConsistency(size_t snapshot1, size_t snapshot2,
                          const std::string& root1, const std::string& root2,
                          const std::vector<std::string>& proof);
 
+  // Verify a chain of snapshots, |proofs[i]| being the consistency
+  // proof from |snapshots[i]| to |snapshots[i + 1]|, spread over
+  // |executor| (if not NULL) and the calling thread. Returns the
+  // number of leading proofs that verify, which is proofs.size() iff
+  // the whole chain is consistent.
+  size_t VerifyConsistencyChain(
+      const std::vector<size_t>& snapshots,
+      const std::vector<std::string>& roots,
+      const std::vector<std::vector<std::string>>& proofs,
+      util::Executor* executor);
+
   // Return the leaf hash corresponding to the leaf input.
   std::string LeafHash(const std::string& data);
 
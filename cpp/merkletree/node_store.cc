@@ -0,0 +1,140 @@
+#include "merkletree/node_store.h"
+
+#include <glog/logging.h>
+#include <string.h>
+
+namespace cert_trans {
+namespace {
+
+// The first chunk of each level holds this many nodes, and each
+// subsequent chunk twice as many as the previous one...
+const size_t kMinChunkNodes = 16;
+// ...until we reach chunks of this many nodes (2MB worth of SHA-256
+// hashes), from then on all chunks are this size.
+const size_t kMaxChunkNodes = 1 << 16;
+// Number of chunks before they stop growing, and the number of nodes
+// they hold together.
+const size_t kGrowingChunks = 13;
+const size_t kGrowingNodes = kMinChunkNodes * ((1 << kGrowingChunks) - 1);
+
+static_assert(kMinChunkNodes << (kGrowingChunks - 1) == kMaxChunkNodes,
+              "chunk sizes must double up to kMaxChunkNodes");
+
+
+size_t Log2(size_t n) {
+  return 63 - __builtin_clzll(n);
+}
+
+
+}  // namespace
+
+
+MemoryNodeStore::MemoryNodeStore(size_t node_size)
+    : MerkleTreeNodeStore(node_size) {
+  CHECK_GT(node_size, 0U);
+}
+
+
+MemoryNodeStore::~MemoryNodeStore() {
+}
+
+
+void MemoryNodeStore::AddLevel() {
+  levels_.emplace_back();
+}
+
+
+void MemoryNodeStore::TruncateLevels(size_t level_count) {
+  if (level_count < levels_.size()) {
+    levels_.resize(level_count);
+  }
+}
+
+
+size_t MemoryNodeStore::NodeCount(size_t level) const {
+  DCHECK_LT(level, levels_.size());
+  return levels_[level].node_count;
+}
+
+
+// static
+size_t MemoryNodeStore::ChunkCapacity(size_t chunk) {
+  return chunk < kGrowingChunks ? kMinChunkNodes << chunk : kMaxChunkNodes;
+}
+
+
+// static
+void MemoryNodeStore::Locate(size_t index, size_t* chunk, size_t* offset) {
+  if (index < kGrowingNodes) {
+    // Chunk i starts at kMinChunkNodes * (2^i - 1).
+    *chunk = Log2(index / kMinChunkNodes + 1);
+    *offset = index - kMinChunkNodes * ((1 << *chunk) - 1);
+  } else {
+    *chunk = kGrowingChunks + (index - kGrowingNodes) / kMaxChunkNodes;
+    *offset = (index - kGrowingNodes) % kMaxChunkNodes;
+  }
+}
+
+
+const char* MemoryNodeStore::Node(size_t level, size_t index) const {
+  DCHECK_LT(index, NodeCount(level));
+  size_t chunk, offset;
+  Locate(index, &chunk, &offset);
+  return levels_[level].chunks[chunk].get() + offset * NodeSize();
+}
+
+
+char* MemoryNodeStore::MutableNode(size_t level, size_t index) {
+  return const_cast<char*>(Node(level, index));
+}
+
+
+void MemoryNodeStore::PushBack(size_t level, const char* node) {
+  DCHECK_LT(level, levels_.size());
+  Level* const l(&levels_[level]);
+  size_t chunk, offset;
+  Locate(l->node_count, &chunk, &offset);
+  if (chunk == l->chunks.size()) {
+    l->chunks.emplace_back(new char[ChunkCapacity(chunk) * NodeSize()]);
+  }
+  ++l->node_count;
+  memcpy(MutableNode(level, l->node_count - 1), node, NodeSize());
+}
+
+
+void MemoryNodeStore::SetNode(size_t level, size_t index, const char* node) {
+  memcpy(MutableNode(level, index), node, NodeSize());
+}
+
+
+void MemoryNodeStore::TruncateLevel(size_t level, size_t node_count) {
+  DCHECK_LT(level, levels_.size());
+  Level* const l(&levels_[level]);
+  if (node_count >= l->node_count) {
+    return;
+  }
+  l->node_count = node_count;
+
+  // Release the chunks which no longer hold any nodes.
+  size_t chunks_needed(0);
+  if (node_count > 0) {
+    size_t offset;
+    Locate(node_count - 1, &chunks_needed, &offset);
+    ++chunks_needed;
+  }
+  l->chunks.resize(chunks_needed);
+}
+
+
+size_t MemoryNodeStore::AllocatedBytes() const {
+  size_t bytes(0);
+  for (const Level& level : levels_) {
+    for (size_t chunk = 0; chunk < level.chunks.size(); ++chunk) {
+      bytes += ChunkCapacity(chunk) * NodeSize();
+    }
+  }
+  return bytes;
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,121 @@
+#ifndef CERT_TRANS_MERKLETREE_NODE_STORE_H_
+#define CERT_TRANS_MERKLETREE_NODE_STORE_H_
+
+#include <stddef.h>
+#include <memory>
+#include <vector>
+
+namespace cert_trans {
+
+// Storage for the nodes of a MerkleTree: a list of levels, each level
+// being an array of fixed-width node hashes ordered left-to-right.
+// Level 0 holds the leaf hashes. See merkletree/merkle_tree.h for how
+// MerkleTree lays out the levels above it.
+//
+// Nodes are handed out as pointers to exactly NodeSize() bytes, so
+// that readers do not have to copy them. A pointer returned by Node()
+// remains valid until that node is removed from the store. Nodes 2k
+// and 2k+1 of a level are always adjacent, so that a pair of siblings
+// can be hashed in place.
+//
+// Implementations are thread-compatible, but not thread-safe.
+class MerkleTreeNodeStore {
+ public:
+  explicit MerkleTreeNodeStore(size_t node_size) : node_size_(node_size) {
+  }
+  virtual ~MerkleTreeNodeStore() = default;
+  MerkleTreeNodeStore(const MerkleTreeNodeStore&) = delete;
+  MerkleTreeNodeStore& operator=(const MerkleTreeNodeStore&) = delete;
+
+  // Length of a node, in bytes.
+  size_t NodeSize() const {
+    return node_size_;
+  }
+
+  virtual size_t LevelCount() const = 0;
+
+  // Start a new, empty level at the top.
+  virtual void AddLevel() = 0;
+
+  // Keep only the lowest |level_count| levels.
+  virtual void TruncateLevels(size_t level_count) = 0;
+
+  virtual size_t NodeCount(size_t level) const = 0;
+
+  // The |index|-th node of level |level|, both indexed from 0.
+  virtual const char* Node(size_t level, size_t index) const = 0;
+
+  // Append a node, NodeSize() bytes long, to the level.
+  virtual void PushBack(size_t level, const char* node) = 0;
+
+  // Overwrite an existing node with NodeSize() bytes from |node|.
+  virtual void SetNode(size_t level, size_t index, const char* node) = 0;
+
+  // Keep only the first |node_count| nodes of the level.
+  virtual void TruncateLevel(size_t level, size_t node_count) = 0;
+
+  // Make the current contents durable, for stores which persist
+  // them. Does nothing by default.
+  virtual void Sync() {
+  }
+
+  // Pick up the nodes added since the store was opened (or last
+  // refreshed) by whoever writes it, for stores which are only read
+  // here. Does nothing by default.
+  virtual void Refresh() {
+  }
+
+  // Bytes of memory allocated for the nodes, for accounting. Stores
+  // whose nodes are in files (memory-mapped or not) return 0.
+  virtual size_t AllocatedBytes() const {
+    return 0;
+  }
+
+ private:
+  const size_t node_size_;
+};
+
+
+// Keeps the nodes in memory, packed contiguously in chunks. Chunks
+// grow geometrically up to a fixed maximum size, so that small trees
+// stay small, and growing a large level never copies it nor
+// over-allocates by more than one chunk.
+class MemoryNodeStore : public MerkleTreeNodeStore {
+ public:
+  explicit MemoryNodeStore(size_t node_size);
+  ~MemoryNodeStore() override;
+
+  size_t LevelCount() const override {
+    return levels_.size();
+  }
+
+  void AddLevel() override;
+  void TruncateLevels(size_t level_count) override;
+  size_t NodeCount(size_t level) const override;
+  const char* Node(size_t level, size_t index) const override;
+  void PushBack(size_t level, const char* node) override;
+  void SetNode(size_t level, size_t index, const char* node) override;
+  void TruncateLevel(size_t level, size_t node_count) override;
+
+  // Bytes allocated for nodes, across all levels.
+  size_t AllocatedBytes() const override;
+
+ private:
+  struct Level {
+    std::vector<std::unique_ptr<char[]>> chunks;
+    size_t node_count = 0;
+  };
+
+  // Determine in which chunk, and where in that chunk, a node lives.
+  static void Locate(size_t index, size_t* chunk, size_t* offset);
+  static size_t ChunkCapacity(size_t chunk);
+
+  char* MutableNode(size_t level, size_t index);
+
+  std::vector<Level> levels_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MERKLETREE_NODE_STORE_H_
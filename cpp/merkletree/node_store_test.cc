@@ -0,0 +1,144 @@
+#include <gtest/gtest.h>
+#include <stddef.h>
+#include <string>
+
+#include "merkletree/node_store.h"
+#include "util/testing.h"
+
+namespace {
+
+using cert_trans::MemoryNodeStore;
+using std::string;
+
+const size_t kNodeSize = 32;
+
+// A node whose bytes are derived from |value|, so that every node in
+// a test can be told apart.
+string TestNode(size_t value) {
+  string node(kNodeSize, '\0');
+  for (size_t i = 0; i < sizeof(value); ++i) {
+    node[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+  }
+  return node;
+}
+
+string NodeAt(const MemoryNodeStore& store, size_t level, size_t index) {
+  return string(store.Node(level, index), kNodeSize);
+}
+
+class MemoryNodeStoreTest : public ::testing::Test {
+ protected:
+  MemoryNodeStoreTest() : store_(kNodeSize) {
+  }
+
+  MemoryNodeStore store_;
+};
+
+TEST_F(MemoryNodeStoreTest, Empty) {
+  EXPECT_EQ(kNodeSize, store_.NodeSize());
+  EXPECT_EQ(0U, store_.LevelCount());
+  EXPECT_EQ(0U, store_.AllocatedBytes());
+
+  store_.AddLevel();
+  EXPECT_EQ(1U, store_.LevelCount());
+  EXPECT_EQ(0U, store_.NodeCount(0));
+}
+
+TEST_F(MemoryNodeStoreTest, PushBackAcrossChunks) {
+  // Enough to go past the growing chunks into fixed-size ones.
+  const size_t kCount = 600000;
+  store_.AddLevel();
+  for (size_t i = 0; i < kCount; ++i) {
+    store_.PushBack(0, TestNode(i).data());
+  }
+
+  ASSERT_EQ(kCount, store_.NodeCount(0));
+  for (size_t i = 0; i < kCount; ++i) {
+    ASSERT_EQ(TestNode(i), NodeAt(store_, 0, i)) << i;
+  }
+  EXPECT_LE(kCount * kNodeSize, store_.AllocatedBytes());
+  // No more than one (maximum-sized) chunk of slack.
+  EXPECT_GE(kCount * kNodeSize + (kNodeSize << 16), store_.AllocatedBytes());
+}
+
+TEST_F(MemoryNodeStoreTest, NodesDoNotMove) {
+  store_.AddLevel();
+  store_.PushBack(0, TestNode(0).data());
+  const char* const first(store_.Node(0, 0));
+
+  for (size_t i = 1; i < 100000; ++i) {
+    store_.PushBack(0, TestNode(i).data());
+  }
+  EXPECT_EQ(first, store_.Node(0, 0));
+}
+
+TEST_F(MemoryNodeStoreTest, SiblingsAreAdjacent) {
+  store_.AddLevel();
+  for (size_t i = 0; i < 100000; ++i) {
+    store_.PushBack(0, TestNode(i).data());
+  }
+  for (size_t i = 0; i < 100000; i += 2) {
+    ASSERT_EQ(store_.Node(0, i) + kNodeSize, store_.Node(0, i + 1)) << i;
+  }
+}
+
+TEST_F(MemoryNodeStoreTest, SetNode) {
+  store_.AddLevel();
+  for (size_t i = 0; i < 100; ++i) {
+    store_.PushBack(0, TestNode(i).data());
+  }
+
+  store_.SetNode(0, 42, TestNode(1000).data());
+  EXPECT_EQ(TestNode(41), NodeAt(store_, 0, 41));
+  EXPECT_EQ(TestNode(1000), NodeAt(store_, 0, 42));
+  EXPECT_EQ(TestNode(43), NodeAt(store_, 0, 43));
+}
+
+TEST_F(MemoryNodeStoreTest, TruncateLevel) {
+  store_.AddLevel();
+  for (size_t i = 0; i < 1000; ++i) {
+    store_.PushBack(0, TestNode(i).data());
+  }
+  const size_t allocated(store_.AllocatedBytes());
+
+  store_.TruncateLevel(0, 10);
+  EXPECT_EQ(10U, store_.NodeCount(0));
+  EXPECT_GT(allocated, store_.AllocatedBytes());
+
+  // Truncating to a larger size is a no-op.
+  store_.TruncateLevel(0, 20);
+  EXPECT_EQ(10U, store_.NodeCount(0));
+
+  // Appending after a truncation overwrites what was there.
+  store_.PushBack(0, TestNode(2000).data());
+  EXPECT_EQ(TestNode(9), NodeAt(store_, 0, 9));
+  EXPECT_EQ(TestNode(2000), NodeAt(store_, 0, 10));
+
+  store_.TruncateLevel(0, 0);
+  EXPECT_EQ(0U, store_.NodeCount(0));
+  EXPECT_EQ(0U, store_.AllocatedBytes());
+}
+
+TEST_F(MemoryNodeStoreTest, TruncateLevels) {
+  for (size_t level = 0; level < 3; ++level) {
+    store_.AddLevel();
+    store_.PushBack(level, TestNode(level).data());
+  }
+
+  store_.TruncateLevels(5);
+  EXPECT_EQ(3U, store_.LevelCount());
+
+  store_.TruncateLevels(1);
+  ASSERT_EQ(1U, store_.LevelCount());
+  EXPECT_EQ(TestNode(0), NodeAt(store_, 0, 0));
+
+  store_.AddLevel();
+  EXPECT_EQ(0U, store_.NodeCount(1));
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -2,10 +2,29 @@
 
 #include <openssl/sha.h>
 #include <stddef.h>
+#include <string.h>
 
+using std::initializer_list;
 using std::string;
 using std::unique_ptr;
 
+string SerialHasher::Digest(initializer_list<Piece> data) const {
+  const unique_ptr<SerialHasher> hasher(Create());
+  hasher->Reset();
+  for (const Piece& piece : data)
+    hasher->Update(string(piece.data, piece.size));
+  return hasher->Final();
+}
+
+void SerialHasher::DigestBatch(const Piece& prefix, const char* const* inputs,
+                               size_t size, size_t count, char* out) const {
+  const size_t digest_size(DigestSize());
+  for (size_t i = 0; i < count; ++i) {
+    const string digest(Digest({prefix, {inputs[i], size}}));
+    memcpy(out + i * digest_size, digest.data(), digest_size);
+  }
+}
+
 const size_t Sha256Hasher::kDigestSize = SHA256_DIGEST_LENGTH;
 
 Sha256Hasher::Sha256Hasher() : initialized_(false) {
@@ -37,6 +56,34 @@ unique_ptr<SerialHasher> Sha256Hasher::Create() const {
   return unique_ptr<SerialHasher>(new Sha256Hasher);
 }
 
+string Sha256Hasher::Digest(initializer_list<Piece> data) const {
+  SHA256_CTX ctx;
+  SHA256_Init(&ctx);
+  for (const Piece& piece : data)
+    SHA256_Update(&ctx, piece.data, piece.size);
+
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  SHA256_Final(hash, &ctx);
+  return string(reinterpret_cast<char*>(hash), SHA256_DIGEST_LENGTH);
+}
+
+void Sha256Hasher::DigestBatch(const Piece& prefix, const char* const* inputs,
+                               size_t size, size_t count, char* out) const {
+  // The prefix is hashed once, and each input resumes from there.
+  SHA256_CTX prefix_ctx;
+  SHA256_Init(&prefix_ctx);
+  SHA256_Update(&prefix_ctx, prefix.data, prefix.size);
+
+  SHA256_CTX ctx;
+  for (size_t i = 0; i < count; ++i) {
+    ctx = prefix_ctx;
+    SHA256_Update(&ctx, inputs[i], size);
+    SHA256_Final(reinterpret_cast<unsigned char*>(out) +
+                     i * SHA256_DIGEST_LENGTH,
+                 &ctx);
+  }
+}
+
 // static
 string Sha256Hasher::Sha256Digest(const string& data) {
   Sha256Hasher hasher;
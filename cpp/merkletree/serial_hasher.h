@@ -3,6 +3,7 @@
 
 #include <openssl/sha.h>
 #include <stddef.h>
+#include <initializer_list>
 #include <memory>
 #include <string>
 
@@ -29,6 +30,35 @@ class SerialHasher {
 
   // A virtual constructor, creates a new instance of the same type.
   virtual std::unique_ptr<SerialHasher> Create() const = 0;
+
+  // A run of contiguous input bytes, for Digest().
+  struct Piece {
+    Piece(const std::string& str) : data(str.data()), size(str.size()) {
+    }
+    Piece(const char* d, size_t s) : data(d), size(s) {
+    }
+
+    const char* data;
+    size_t size;
+  };
+
+  // Return the binary digest of the concatenation of |data|, without
+  // touching the context of this hasher. Unlike Reset(), Update() and
+  // Final(), this may be called concurrently from multiple threads.
+  //
+  // The default implementation creates a fresh instance with
+  // Create(); subclasses should override it with something cheaper.
+  virtual std::string Digest(std::initializer_list<Piece> data) const;
+
+  // Hash |count| independent inputs of |size| bytes each, all starting
+  // with the same |prefix|: digest i, of |prefix| followed by the
+  // |size| bytes at inputs[i], is written to out + i * DigestSize().
+  // Like Digest(), this may be called concurrently.
+  //
+  // The default implementation calls Digest() for each input;
+  // subclasses can hash several inputs at once instead.
+  virtual void DigestBatch(const Piece& prefix, const char* const* inputs,
+                           size_t size, size_t count, char* out) const;
 };
 
 class Sha256Hasher : public SerialHasher {
@@ -45,6 +75,11 @@ class Sha256Hasher : public SerialHasher {
   void Update(const std::string& data);
   std::string Final();
   std::unique_ptr<SerialHasher> Create() const;
+  // Uses a context on the stack, so it neither allocates nor locks.
+  std::string Digest(std::initializer_list<Piece> data) const;
+  // Writes the digests straight to |out|, reusing one context.
+  void DigestBatch(const Piece& prefix, const char* const* inputs,
+                   size_t size, size_t count, char* out) const;
 
   // Create a new hasher and call Reset(), Update(), and Final().
   static std::string Sha256Digest(const std::string& data);
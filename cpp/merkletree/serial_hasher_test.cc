@@ -107,6 +107,44 @@ TYPED_TEST(SerialHasherTest, Create) {
   }
 }
 
+// Test one-shot digests of fragmented input
+TYPED_TEST(SerialHasherTest, Digest) {
+  const string input(kTestString, kTestStringLength);
+  const string first(input.substr(0, kTestStringLength / 2));
+  const string second(input.substr(kTestStringLength / 2));
+
+  this->hasher_->Reset();
+  this->hasher_->Update(input);
+  const string digest(this->hasher_->Final());
+
+  EXPECT_EQ(H(digest), H(this->hasher_->Digest({input})));
+  EXPECT_EQ(H(digest), H(this->hasher_->Digest({first, second})));
+
+  // Digest() must not disturb a context in progress.
+  this->hasher_->Reset();
+  this->hasher_->Update(first);
+  this->hasher_->Digest({second});
+  this->hasher_->Update(second);
+  EXPECT_EQ(H(digest), H(this->hasher_->Final()));
+}
+
+TYPED_TEST(SerialHasherTest, DigestBatch) {
+  const string prefix("prefix");
+  const string input(kTestString, kTestStringLength);
+  const size_t size(4);
+  const char* const inputs[] = {input.data(), input.data() + 4,
+                                input.data() + 8, input.data()};
+  const size_t count(sizeof(inputs) / sizeof(inputs[0]));
+  const size_t digest_size(this->hasher_->DigestSize());
+
+  string out(count * digest_size, '\0');
+  this->hasher_->DigestBatch(prefix, inputs, size, count, &out[0]);
+  for (size_t i = 0; i < count; ++i) {
+    EXPECT_EQ(H(this->hasher_->Digest({prefix, {inputs[i], size}})),
+              H(out.substr(i * digest_size, digest_size)));
+  }
+}
+
 TEST(Sha256Test, StaticDigest) {
   string input, output, digest;
 
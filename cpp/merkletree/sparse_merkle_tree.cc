@@ -2,21 +2,59 @@
 
 #include <stddef.h>
 #include <algorithm>
+#include <sstream>
 #include <vector>
 
 #include "merkletree/merkle_tree_math.h"
+#include "util/parallel_for.h"
 #include "util/util.h"
 
-using std::make_pair;
+using std::move;
 using std::ostream;
 using std::ostringstream;
+using std::pair;
 using std::reverse;
 using std::string;
 using std::unique_ptr;
-using std::unordered_map;
 using std::vector;
 
 
+namespace {
+
+// SetLeaves() updates subtrees with at most this many leaves to set
+// as a unit of parallel work.
+const ptrdiff_t kParallelChunkSize = 256;
+
+
+// The bit of a CompressedProof::bitmap for the |index|-th element of
+// the full proof.
+uint8_t ProofBitMask(int index) {
+  return 0x80 >> (index % 8);
+}
+
+
+// Whether the |depth|-th bit of the path of |leaf| is 0, by which
+// sorted leaves are partitioned.
+struct LeftOf {
+  bool operator()(const pair<SparseMerkleTree::Path, string>& leaf) const {
+    return PathBit(leaf.first, depth) == 0;
+  }
+
+  const int depth;
+};
+
+
+}  // namespace
+
+
+struct SparseMerkleTree::PendingSubtree {
+  int depth;
+  unique_ptr<TreeNode>* slot;
+  LeafIterator begin;
+  LeafIterator end;
+};
+
+
 const vector<string>* GetNullHashes(const TreeHasher& hasher) {
   static unique_ptr<const vector<string>> null_hashes;
   if (!null_hashes) {
@@ -39,67 +77,126 @@ SparseMerkleTree::SparseMerkleTree(SerialHasher* hasher)
 }
 
 
-void SparseMerkleTree::EnsureHaveLevel(size_t level) {
-  if (tree_.size() < (level + 1)) {
-    tree_.resize(level + 1);
-  }
-}
-
-
 void SparseMerkleTree::SetLeaf(const Path& path, const string& data) {
   CHECK_EQ(treehasher_.DigestSize(), path.size());
-  // Mark the tree dirty:
-  root_hash_.clear();
   string leaf_hash(treehasher_.HashLeaf(data));
 
-  IndexType node_index(0);
-  for (int depth(0); depth <= kDigestSizeBits; ++depth) {
-    node_index += PathBit(path, depth);
-    EnsureHaveLevel(depth);
-    auto it(tree_[depth].find(node_index));
-    if (it == tree_[depth].end()) {
-      CHECK(tree_[depth]
-                .emplace(make_pair(node_index, TreeNode(path, leaf_hash)))
-                .second);
+  TreeNode* parent(&root_);
+  for (int depth(0); depth < kDigestSizeBits; ++depth) {
+    // Mark the hashes along the path dirty.
+    parent->hash_.clear();
+    unique_ptr<TreeNode>& node(parent->children_[PathBit(path, depth)]);
+    if (!node) {
+      node.reset(new TreeNode);
+      node->path_.reset(new Path(path));
+      node->leaf_hash_ = move(leaf_hash);
       return;
-    } else if (it->second.type_ == TreeNode::INTERNAL) {
-      // Mark the internal node hash dirty
-      it->second.hash_.clear();
-    } else if (*it->second.path_ == path) {
-      // replacement
-      CHECK_EQ(TreeNode::LEAF, it->second.type_);
-      it->second.hash_ = std::move(leaf_hash);
-      return;
-    } else {
-      // restructure: push the existing node down a level and replace this one
-      // with an INTERNAL node
-      CHECK_LT(depth, kDigestSizeBits);
-      EnsureHaveLevel(depth + 1);
-      IndexType child_index((node_index << 1) +
-                            PathBit(*it->second.path_, depth + 1));
-      CHECK(tree_[depth + 1]
-                .emplace(make_pair(child_index, std::move(it->second)))
-                .second);
-      it->second.type_ = TreeNode::INTERNAL;
-      it->second.hash_.clear();
     }
-    node_index <<= 1;
+    if (node->IsLeaf()) {
+      if (*node->path_ == path) {
+        // replacement
+        node->leaf_hash_ = move(leaf_hash);
+        node->hash_.clear();
+        return;
+      }
+      // restructure: push the existing leaf down a level, below a new
+      // INTERNAL node, and carry on down from there.
+      CHECK_LT(depth + 1, kDigestSizeBits);
+      unique_ptr<TreeNode> internal(new TreeNode);
+      node->hash_.clear();
+      internal->children_[PathBit(*node->path_, depth + 1)] = move(node);
+      node = move(internal);
+    }
+    parent = node.get();
   }
   LOG(FATAL) << "Failed to set " << path << " to " << data;
 }
 
 
-void SparseMerkleTree::DumpTree(ostream* os, size_t depth,
-                                IndexType index) const {
-  if (tree_.size() <= depth) {
+void SparseMerkleTree::SetLeaves(const vector<pair<Path, string>>& leaves,
+                                 util::Executor* executor) {
+  CHECK(std::is_sorted(leaves.begin(), leaves.end(),
+                       [](const pair<Path, string>& a,
+                          const pair<Path, string>& b) {
+                         return a.first < b.first;
+                       }));
+  if (leaves.empty()) {
     return;
   }
+  CHECK_EQ(treehasher_.DigestSize(), leaves.front().first.size());
+
+  root_.hash_.clear();
+  vector<PendingSubtree> pending;
+  const LeafIterator split(
+      std::partition_point(leaves.begin(), leaves.end(), LeftOf{0}));
+  SetLeavesBelow(0, &root_.children_[0], leaves.begin(), split,
+                 executor ? &pending : nullptr);
+  SetLeavesBelow(0, &root_.children_[1], split, leaves.end(),
+                 executor ? &pending : nullptr);
+
+  if (!pending.empty()) {
+    util::ParallelFor(executor, pending.size(), [this, &pending](size_t i) {
+      const PendingSubtree& subtree(pending[i]);
+      SetLeavesBelow(subtree.depth, subtree.slot, subtree.begin, subtree.end,
+                     nullptr);
+      SubtreeHash(subtree.depth, *subtree.slot);
+    });
+  }
+}
+
+
+void SparseMerkleTree::SetLeavesBelow(int depth, unique_ptr<TreeNode>* slot,
+                                      LeafIterator begin, LeafIterator end,
+                                      vector<PendingSubtree>* pending) {
+  if (begin == end) {
+    return;
+  }
+  if (pending && end - begin <= kParallelChunkSize) {
+    pending->push_back(PendingSubtree{depth, slot, begin, end});
+    return;
+  }
+
+  unique_ptr<TreeNode>& node(*slot);
+  // When all the leaves have the same path, the last one wins.
+  const Path& last_path((end - 1)->first);
+  if (begin->first == last_path &&
+      (!node || (node->IsLeaf() && *node->path_ == last_path))) {
+    if (!node) {
+      node.reset(new TreeNode);
+      node->path_.reset(new Path(last_path));
+    }
+    node->leaf_hash_ = treehasher_.HashLeaf((end - 1)->second);
+    node->hash_.clear();
+    return;
+  }
+
+  // Otherwise, this has to be an INTERNAL node, the existing leaf being
+  // pushed down a level as in SetLeaf().
+  CHECK_LT(depth + 1, kDigestSizeBits);
+  if (!node) {
+    node.reset(new TreeNode);
+  } else if (node->IsLeaf()) {
+    unique_ptr<TreeNode> internal(new TreeNode);
+    node->hash_.clear();
+    internal->children_[PathBit(*node->path_, depth + 1)] = move(node);
+    node = move(internal);
+  }
+  node->hash_.clear();
+  const LeafIterator split(
+      std::partition_point(begin, end, LeftOf{depth + 1}));
+  SetLeavesBelow(depth + 1, &node->children_[0], begin, split, pending);
+  SetLeavesBelow(depth + 1, &node->children_[1], split, end, pending);
+}
+
+
+void SparseMerkleTree::DumpTree(ostream* os, size_t depth,
+                                const TreeNode& node) const {
   const string indent((depth + 1) * 2, '-');
   for (int side(0); side < 2; ++side) {
-    auto child(tree_[depth].find(index + side));
-    if (child != tree_[depth].end()) {
-      *os << indent << side << ": " << child->second.DebugString() << "\n";
-      DumpTree(os, depth + 1, (index + side) << 1);
+    const unique_ptr<TreeNode>& child(node.children_[side]);
+    if (child) {
+      *os << indent << side << ": " << child->DebugString() << "\n";
+      DumpTree(os, depth + 1, *child);
     }
   }
 }
@@ -107,82 +204,158 @@ void SparseMerkleTree::DumpTree(ostream* os, size_t depth,
 
 string SparseMerkleTree::Dump() const {
   ostringstream ret;
-  ret << "\nTree [Root: " << util::ToBase64(root_hash_) << "]:\n";
-  if (!tree_.empty()) {
-    DumpTree(&ret, 0, 0);
-  }
+  ret << "\nTree [Root: " << util::ToBase64(root_.hash_) << "]:\n";
+  DumpTree(&ret, 0, root_);
   return ret.str();
 }
 
 
-string SparseMerkleTree::CalculateSubtreeHash(size_t depth, IndexType index) {
-  if (tree_.size() <= depth) {
-    return null_hashes_->at(depth);
+// static
+string SparseMerkleTree::LoneLeafHash(const TreeHasher& hasher, size_t depth,
+                                      const Path& path,
+                                      const string& leaf_hash) {
+  const vector<string>& null_hashes(*GetNullHashes(hasher));
+  string ret(leaf_hash);
+  const int64_t signed_depth(depth);
+  CHECK_LE(0, signed_depth);
+  for (int i(kDigestSizeBits - 1); i > signed_depth; --i) {
+    if (PathBit(path, i) == 0) {
+      ret = hasher.HashChildren(ret, null_hashes[i]);
+    } else {
+      ret = hasher.HashChildren(null_hashes[i], ret);
+    }
   }
+  return ret;
+}
 
-  auto it(tree_[depth].find(index));
-  if (it != tree_[depth].end()) {
-    switch (it->second.type_) {
-      case TreeNode::INTERNAL: {
-        if (!it->second.hash_.empty()) {
-          return it->second.hash_;
-        }
-        IndexType left_child_index(index << 1);
-        const string left(CalculateSubtreeHash(depth + 1, left_child_index));
-        const string right(
-            CalculateSubtreeHash(depth + 1, left_child_index + 1));
-        it->second.hash_.assign(treehasher_.HashChildren(left, right));
-        return it->second.hash_;
-      }
 
-      case TreeNode::LEAF: {
-        string ret(it->second.hash_);
-        const int64_t signed_depth(depth);
-        CHECK_LE(0, signed_depth);
-        for (int i(kDigestSizeBits - 1); i > signed_depth; --i) {
-          if (PathBit(*(it->second.path_), i) == 0) {
-            ret = treehasher_.HashChildren(ret, null_hashes_->at(i));
-          } else {
-            ret = treehasher_.HashChildren(null_hashes_->at(i), ret);
-          }
-        }
-        // TODO(alcutter): maybe cache this?
-        return ret;
-      }
+const string& SparseMerkleTree::SubtreeHash(size_t depth,
+                                            const unique_ptr<TreeNode>& node) {
+  if (!node) {
+    return null_hashes_->at(depth);
+  }
+  if (node->hash_.empty()) {
+    if (node->IsLeaf()) {
+      node->hash_ =
+          LoneLeafHash(treehasher_, depth, *node->path_, node->leaf_hash_);
+    } else {
+      node->hash_ =
+          treehasher_.HashChildren(SubtreeHash(depth + 1, node->children_[0]),
+                                   SubtreeHash(depth + 1, node->children_[1]));
     }
-    LOG(FATAL) << "Unknown node type " << it->second.type_ << " !";
   }
-
-  return null_hashes_->at(depth);
+  return node->hash_;
 }
 
 
 string SparseMerkleTree::CurrentRoot() {
-  if (root_hash_.empty()) {
-    root_hash_ = treehasher_.HashChildren(CalculateSubtreeHash(0, 0),
-                                          CalculateSubtreeHash(0, 1));
+  if (root_.hash_.empty()) {
+    root_.hash_ = treehasher_.HashChildren(SubtreeHash(0, root_.children_[0]),
+                                           SubtreeHash(0, root_.children_[1]));
+  }
+  return root_.hash_;
+}
+
+
+vector<string> SparseMerkleTree::InclusionProof(const Path& path) {
+  const util::StatusOr<vector<string>> proof(
+      ExpandProof(treehasher_, CompressedInclusionProof(path)));
+  CHECK(proof.ok()) << proof.status();
+  return proof.ValueOrDie();
+}
+
+
+SparseMerkleTree::CompressedProof SparseMerkleTree::CompressedInclusionProof(
+    const Path& path) {
+  CHECK_EQ(treehasher_.DigestSize(), path.size());
+  CompressedProof proof;
+  proof.bitmap.assign(kDigestSizeBits / 8, 0);
+  // The sibling at |depth| is the element kDigestSizeBits - 1 - depth of
+  // the full proof. They are collected from the root down, and the hashes
+  // reversed at the end.
+  const auto add_sibling = [&proof](int depth, string hash) {
+    const int index(kDigestSizeBits - 1 - depth);
+    proof.bitmap[index / 8] |= ProofBitMask(index);
+    proof.hashes.emplace_back(move(hash));
+  };
+  const TreeNode* node(&root_);
+  int depth(0);
+  for (; node && !node->IsLeaf(); ++depth) {
+    const int bit(PathBit(path, depth));
+    const unique_ptr<TreeNode>& sibling(node->children_[1 - bit]);
+    if (sibling) {
+      add_sibling(depth, SubtreeHash(depth, sibling));
+    }
+    node = node->children_[bit].get();
   }
-  return root_hash_;
+  // Below a lone leaf (or in an empty subtree), the only non-empty sibling
+  // is where the path of the leaf parts from |path|, if it does.
+  if (node && *node->path_ != path) {
+    while (PathBit(*node->path_, depth) == PathBit(path, depth)) {
+      ++depth;
+    }
+    add_sibling(depth, LoneLeafHash(treehasher_, depth, *node->path_,
+                                    node->leaf_hash_));
+  }
+  reverse(proof.hashes.begin(), proof.hashes.end());
+  return proof;
 }
 
 
-std::vector<string> SparseMerkleTree::InclusionProof(const Path& path) {
-  // TODO(alcutter): implement
-  LOG(FATAL) << "Not implemented.";
+// static
+SparseMerkleTree::CompressedProof SparseMerkleTree::CompressProof(
+    const TreeHasher& hasher, const vector<string>& proof) {
+  CHECK_EQ(static_cast<size_t>(kDigestSizeBits), proof.size());
+  const vector<string>& null_hashes(*GetNullHashes(hasher));
+  CompressedProof compressed;
+  compressed.bitmap.assign(kDigestSizeBits / 8, 0);
+  for (int i(0); i < kDigestSizeBits; ++i) {
+    if (proof[i] != null_hashes[kDigestSizeBits - 1 - i]) {
+      compressed.bitmap[i / 8] |= ProofBitMask(i);
+      compressed.hashes.emplace_back(proof[i]);
+    }
+  }
+  return compressed;
+}
+
+
+// static
+util::StatusOr<vector<string>> SparseMerkleTree::ExpandProof(
+    const TreeHasher& hasher, const CompressedProof& proof) {
+  if (proof.bitmap.size() != kDigestSizeBits / 8) {
+    return util::Status(util::error::INVALID_ARGUMENT,
+                        "wrong size of proof bitmap");
+  }
+  const vector<string>& null_hashes(*GetNullHashes(hasher));
+  vector<string> expanded;
+  expanded.reserve(kDigestSizeBits);
+  size_t next(0);
+  for (int i(0); i < kDigestSizeBits; ++i) {
+    if (!(proof.bitmap[i / 8] & ProofBitMask(i))) {
+      expanded.emplace_back(null_hashes[kDigestSizeBits - 1 - i]);
+      continue;
+    }
+    if (next == proof.hashes.size()) {
+      return util::Status(util::error::INVALID_ARGUMENT,
+                          "too few hashes in proof");
+    }
+    if (proof.hashes[next].size() != hasher.DigestSize()) {
+      return util::Status(util::error::INVALID_ARGUMENT,
+                          "wrong size of hash in proof");
+    }
+    expanded.emplace_back(proof.hashes[next++]);
+  }
+  if (next != proof.hashes.size()) {
+    return util::Status(util::error::INVALID_ARGUMENT,
+                        "too many hashes in proof");
+  }
+  return expanded;
 }
 
 
 string SparseMerkleTree::TreeNode::DebugString() const {
   ostringstream os;
-  os << "[TreeNode type: ";
-  switch (type_) {
-    case INTERNAL:
-      os << "I";
-      break;
-    case LEAF:
-      os << "L";
-      break;
-  }
+  os << "[TreeNode type: " << (IsLeaf() ? "L" : "I");
 
   os << " hash: ";
   if (!hash_.empty()) {
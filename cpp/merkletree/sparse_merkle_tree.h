@@ -4,15 +4,21 @@
 #include <glog/logging.h>
 #include <stddef.h>
 #include <array>
+#include <memory>
 #include <string>
-#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "merkletree/merkle_tree_interface.h"
 #include "merkletree/tree_hasher.h"
+#include "util/statusor.h"
 
 class SerialHasher;
 
+namespace util {
+class Executor;
+}  // namespace util
+
 
 // Calculates the set of "null" hashes:
 // ...H(H(H("")||H(""))||H("")||(H(""))||...)...
@@ -105,7 +111,15 @@ const std::vector<std::string>* GetNullHashes(const TreeHasher& hasher);
  * optimised by cribbing the value of "missing" nodes from a simple cache. This
  * removes the need to calculate the vast majority of nodes from scratch.
  *
- * TODO(alcutter): LOTS!
+ * The hash of every node is kept once calculated, including that of the
+ * subtree holding a lone leaf (which takes one HashChildren() for each level
+ * between the node and the bottom of the tree). SetLeaf() only invalidates
+ * the hashes of the nodes along its path, so the next root calculation only
+ * recomputes those: about log2(number of leaves) hashes, plus the subtrees of
+ * the new (or moved) leaves.
+ *
+ * The nodes are linked from their parent, rather than looked up by their
+ * index, so the full width of the paths can be used.
  *
  * This class is thread-compatible, but not thread-safe.
  */
@@ -132,6 +146,16 @@ class SparseMerkleTree {
   //  that the paths are lexographically sortable.
   typedef std::array<uint8_t, kDigestSizeBits / 8> Path;
 
+  // An inclusion proof without the siblings which are null hashes
+  // (almost all of them, in a sparse tree): bit i of |bitmap| (the MSB
+  // of its first byte being bit 0) is set if the i-th element of the
+  // full proof, as returned by InclusionProof(), is not a null hash, and
+  // |hashes| holds those elements, in the same order.
+  struct CompressedProof {
+    std::string bitmap;
+    std::vector<std::string> hashes;
+  };
+
   // The constructor takes a pointer to some concrete hash function
   // instantiation of the SerialHasher abstract class.
   // Takes ownership of the hasher.
@@ -154,6 +178,14 @@ class SparseMerkleTree {
   // @param path Binary path of node to set.
   virtual void SetLeaf(const Path& path, const std::string& data);
 
+  // Same as calling SetLeaf() for each element of |leaves| in order, which
+  // must be sorted by path. If |executor| is not NULL, the leaves are split
+  // into groups falling in disjoint subtrees, which are updated and rehashed
+  // in parallel on it, leaving only the nodes above them for CurrentRoot()
+  // to rehash. The calling thread takes part in the work.
+  void SetLeaves(const std::vector<std::pair<Path, std::string>>& leaves,
+                 util::Executor* executor);
+
   // Get the current root of the tree.
   // Update the root to reflect the current shape of the tree,
   // and return the tree digest.
@@ -164,55 +196,76 @@ class SparseMerkleTree {
 
   // Get the Merkle path from the leaf at |path| to the current root.
   //
-  // Returns a vector of node hashes, ordered by levels from leaf to root.
-  // The first element is the sibling of the leaf hash, and the last element
-  // is one below the root.
-  // Returns an empty vector if the tree is not large enough
-  // or the leaf index is 0.
+  // Returns a vector of kDigestSizeBits node hashes, ordered by levels from
+  // leaf to root. The first element is the sibling of the leaf hash, and the
+  // last element is one below the root. If no leaf was set at |path|, the
+  // proof is that of the empty leaf there.
   //
   // @param path the path of the leaf whose inclusion proof to return.
   std::vector<std::string> InclusionProof(const Path& path);
 
+  // Same as InclusionProof(), but compressed: about log2(number of
+  // leaves) hashes, rather than kDigestSizeBits of them. The null hashes
+  // are not copied to begin with, so this is also cheaper to produce.
+  CompressedProof CompressedInclusionProof(const Path& path);
+
+  // Converts between the full and the compressed forms of a proof, for
+  // a tree using |hasher|. ExpandProof() checks that |proof| is
+  // well-formed, since it usually comes from elsewhere.
+  static CompressedProof CompressProof(const TreeHasher& hasher,
+                                       const std::vector<std::string>& proof);
+  static util::StatusOr<std::vector<std::string>> ExpandProof(
+      const TreeHasher& hasher, const CompressedProof& proof);
+
+  // Returns the hash of a subtree at |depth| holding only the leaf with the
+  // given |path| and |leaf_hash|, in a tree using |hasher|.
+  static std::string LoneLeafHash(const TreeHasher& hasher, size_t depth,
+                                  const Path& path,
+                                  const std::string& leaf_hash);
+
   std::string Dump() const;
 
  private:
-  // WARNING WARNING WARNING
-  // 64 < 256 !
-  // WARNING WARNING WARNING
-  // TODO(alcutter): BIGNUM probably.
-  typedef uint64_t IndexType;
-
+  // A node at some depth below the root: either an internal node, or the
+  // only leaf in its subtree (see above). Empty subtrees have no node.
   struct TreeNode {
-    TreeNode(const std::string& hash) : type_(INTERNAL), hash_(hash) {
-    }
-
-    TreeNode(const Path& path, const std::string& leaf_hash)
-        : type_(LEAF), path_(new Path(path)), hash_(leaf_hash) {
+    bool IsLeaf() const {
+      return path_ != nullptr;
     }
 
     std::string DebugString() const;
 
-    enum { INTERNAL, LEAF } type_;
+    // The children of an internal node, either of which can be empty.
+    std::unique_ptr<TreeNode> children_[2];
+    // The path and hash of a leaf.
     std::unique_ptr<Path> path_;
+    std::string leaf_hash_;
+    // The hash of the subtree, or empty if it needs recalculating.
     std::string hash_;
   };
 
-  std::string CalculateSubtreeHash(size_t depth, IndexType index);
+  typedef std::vector<std::pair<Path, std::string>>::const_iterator
+      LeafIterator;
+  struct PendingSubtree;
 
-  void DumpTree(std::ostream* os, size_t depth, IndexType index) const;
+  // Sets the leaves in [|begin|, |end|), which all fall in the subtree at
+  // |depth| held by |*slot|. If |pending| is not NULL, subtrees with few
+  // enough leaves are added to it instead of being updated.
+  void SetLeavesBelow(int depth, std::unique_ptr<TreeNode>* slot,
+                      LeafIterator begin, LeafIterator end,
+                      std::vector<PendingSubtree>* pending);
 
-  // Get the |index|-th node at level |level|. Indexing starts at 0;
-  // caller is responsible for ensuring tree is sufficiently up to date.
-  std::string Node(size_t level, size_t index) const;
+  // Returns the hash of the subtree at |depth| rooted at |node|, which may
+  // be empty, calculating whatever is out of date in it.
+  const std::string& SubtreeHash(size_t depth,
+                                 const std::unique_ptr<TreeNode>& node);
 
-  // Maybe add a new tree level.
-  void EnsureHaveLevel(size_t n);
+  void DumpTree(std::ostream* os, size_t depth, const TreeNode& node) const;
 
   TreeHasher treehasher_;
   const std::vector<std::string>* const null_hashes_;
-  // TODO(alcutter): investigate other structures
-  std::vector<std::unordered_map<IndexType, TreeNode>> tree_;
-  std::string root_hash_;
+  // An internal node, the hash of which is the root hash.
+  TreeNode root_;
 };
 
 
@@ -10,11 +10,13 @@
 #include "merkletree/sparse_merkle_tree.h"
 #include "util/openssl_scoped_types.h"
 #include "util/testing.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
 namespace {
 
 using cert_trans::ScopedBIGNUM;
+using cert_trans::ThreadPool;
 using std::fill;
 using std::lower_bound;
 using std::map;
@@ -75,6 +77,16 @@ pair<ScopedBIGNUM, string> Value(uint64_t n, const string& v) {
   return ret;
 }
 
+
+pair<ScopedBIGNUM, string> Value(const SparseMerkleTree::Path& p,
+                                 const string& v) {
+  pair<ScopedBIGNUM, string> ret;
+  ret.second = v;
+  ret.first.reset(BN_bin2bn(p.data(), p.size(), nullptr));
+  CHECK(ret.first);
+  return ret;
+}
+
 // Implements (more-or-less) the reference python code given in the
 // revocation transparency paper for calculating the root-hash of a sparse
 // tree with a given set of leaf nodes.
@@ -193,6 +205,21 @@ class SparseMerkleTreeTest : public testing::Test {
     return ret;
   }
 
+  // Returns the root hash obtained by hashing |leaf_hash| at |path| with
+  // the siblings in |proof|.
+  string RootFromProof(const SparseMerkleTree::Path& path,
+                       const string& leaf_hash, const vector<string>& proof) {
+    CHECK_EQ(static_cast<size_t>(SparseMerkleTree::kDigestSizeBits),
+             proof.size());
+    string hash(leaf_hash);
+    for (int i(SparseMerkleTree::kDigestSizeBits - 1); i >= 0; --i) {
+      const string& sibling(proof[SparseMerkleTree::kDigestSizeBits - 1 - i]);
+      hash = PathBit(path, i) == 0 ? tree_hasher_.HashChildren(hash, sibling)
+                                   : tree_hasher_.HashChildren(sibling, hash);
+    }
+    return hash;
+  }
+
   SparseMerkleTree::Path PathFromString(const string& s) {
     SparseMerkleTree::Path ret;
     CHECK_LE(s.size(), ret.size());
@@ -267,6 +294,181 @@ TEST_F(SparseMerkleTreeTest, RandomReferenceTest) {
 }
 
 
+TEST_F(SparseMerkleTreeTest, RandomFullPathReferenceTest) {
+  Reference ref(new Sha256Hasher);
+  ValueList values;
+  for (int i(0); i < 1000; ++i) {
+    const SparseMerkleTree::Path p(RandomPath());
+    const string value(to_string(i));
+    values.emplace_back(Value(p, value));
+    tree_.SetLeaf(p, value);
+  }
+  const string ref_root(ref.HStar2(256, &values));
+  EXPECT_EQ(ToBase64(ref_root), ToBase64(tree_.CurrentRoot()));
+}
+
+
+TEST_F(SparseMerkleTreeTest, IncrementalRootMatchesFreshTree) {
+  vector<SparseMerkleTree::Path> paths;
+  for (int i(0); i < 200; ++i) {
+    paths.emplace_back(RandomPath());
+  }
+  // Paths sharing long prefixes, to push leaves far down.
+  for (uint64_t i(0); i < 50; ++i) {
+    paths.emplace_back(PathLow(i));
+  }
+
+  // The same leaves are set in both trees, but only |tree_| has its root
+  // calculated after every change. Some of the leaves are set twice.
+  SparseMerkleTree fresh(new Sha256Hasher);
+  for (size_t i(0); i < paths.size(); ++i) {
+    const SparseMerkleTree::Path& p(paths[(i * 7) % paths.size()]);
+    tree_.SetLeaf(p, "old" + to_string(i));
+    fresh.SetLeaf(p, "old" + to_string(i));
+    tree_.CurrentRoot();
+    tree_.SetLeaf(paths[i], to_string(i));
+    fresh.SetLeaf(paths[i], to_string(i));
+    tree_.CurrentRoot();
+  }
+  EXPECT_EQ(ToBase64(fresh.CurrentRoot()), ToBase64(tree_.CurrentRoot()));
+}
+
+
+TEST_F(SparseMerkleTreeTest, InclusionProof) {
+  vector<SparseMerkleTree::Path> paths;
+  for (int i(0); i < 100; ++i) {
+    paths.emplace_back(RandomPath());
+    tree_.SetLeaf(paths.back(), to_string(i));
+  }
+  // A leaf sharing all but its last bit with another.
+  paths.emplace_back(paths[0]);
+  paths.back().back() ^= 1;
+  tree_.SetLeaf(paths.back(), "neighbour");
+
+  const string root(tree_.CurrentRoot());
+  for (size_t i(0); i < 100; ++i) {
+    EXPECT_EQ(ToBase64(root),
+              ToBase64(RootFromProof(paths[i],
+                                     tree_hasher_.HashLeaf(to_string(i)),
+                                     tree_.InclusionProof(paths[i]))));
+  }
+  EXPECT_EQ(ToBase64(root),
+            ToBase64(RootFromProof(paths.back(),
+                                   tree_hasher_.HashLeaf("neighbour"),
+                                   tree_.InclusionProof(paths.back()))));
+
+  // Paths without a leaf are proven to hold the empty leaf, whether they
+  // end up in an empty subtree, or next to a lone leaf.
+  SparseMerkleTree::Path near(paths[1]);
+  near.back() ^= 1;
+  for (const SparseMerkleTree::Path& p : {RandomPath(), near}) {
+    EXPECT_EQ(ToBase64(root),
+              ToBase64(RootFromProof(p, tree_hasher_.HashLeaf(""),
+                                     tree_.InclusionProof(p))));
+  }
+}
+
+
+TEST_F(SparseMerkleTreeTest, CompressedInclusionProof) {
+  vector<SparseMerkleTree::Path> paths;
+  for (int i(0); i < 1000; ++i) {
+    paths.emplace_back(RandomPath());
+    tree_.SetLeaf(paths.back(), to_string(i));
+  }
+  SparseMerkleTree::Path near(paths[1]);
+  near.back() ^= 1;
+  paths.emplace_back(near);
+  paths.emplace_back(RandomPath());
+
+  for (const SparseMerkleTree::Path& p : paths) {
+    const vector<string> proof(tree_.InclusionProof(p));
+    const SparseMerkleTree::CompressedProof compressed(
+        tree_.CompressedInclusionProof(p));
+    EXPECT_EQ(static_cast<size_t>(SparseMerkleTree::kDigestSizeBits / 8),
+              compressed.bitmap.size());
+    // A few more than log2(1000) hashes, rather than 256.
+    EXPECT_GT(20U, compressed.hashes.size());
+
+    const SparseMerkleTree::CompressedProof recompressed(
+        SparseMerkleTree::CompressProof(tree_hasher_, proof));
+    EXPECT_EQ(compressed.bitmap, recompressed.bitmap);
+    EXPECT_EQ(compressed.hashes, recompressed.hashes);
+
+    const util::StatusOr<vector<string>> expanded(
+        SparseMerkleTree::ExpandProof(tree_hasher_, compressed));
+    ASSERT_TRUE(expanded.ok());
+    EXPECT_EQ(proof, expanded.ValueOrDie());
+  }
+}
+
+
+TEST_F(SparseMerkleTreeTest, ExpandProofRejectsMalformedProofs) {
+  tree_.SetLeaf(RandomPath(), "one");
+  tree_.SetLeaf(RandomPath(), "two");
+  const SparseMerkleTree::CompressedProof proof(
+      tree_.CompressedInclusionProof(RandomPath()));
+  ASSERT_FALSE(proof.hashes.empty());
+
+  SparseMerkleTree::CompressedProof bad(proof);
+  bad.bitmap.pop_back();
+  EXPECT_FALSE(SparseMerkleTree::ExpandProof(tree_hasher_, bad).ok());
+
+  bad = proof;
+  bad.hashes.pop_back();
+  EXPECT_FALSE(SparseMerkleTree::ExpandProof(tree_hasher_, bad).ok());
+
+  bad = proof;
+  bad.hashes.push_back(bad.hashes.back());
+  EXPECT_FALSE(SparseMerkleTree::ExpandProof(tree_hasher_, bad).ok());
+
+  bad = proof;
+  bad.hashes.back().pop_back();
+  EXPECT_FALSE(SparseMerkleTree::ExpandProof(tree_hasher_, bad).ok());
+}
+
+
+TEST_F(SparseMerkleTreeTest, SetLeavesMatchesSetLeaf) {
+  ThreadPool pool(4);
+  SparseMerkleTree serial(new Sha256Hasher);
+  SparseMerkleTree parallel(new Sha256Hasher);
+  // Some leaves already in the trees, to be replaced or pushed down.
+  for (int i(0); i < 100; ++i) {
+    const SparseMerkleTree::Path p(RandomPath());
+    tree_.SetLeaf(p, to_string(i));
+    serial.SetLeaf(p, to_string(i));
+    parallel.SetLeaf(p, to_string(i));
+  }
+  parallel.CurrentRoot();
+
+  vector<pair<SparseMerkleTree::Path, string>> leaves;
+  for (int i(0); i < 5000; ++i) {
+    leaves.emplace_back(RandomPath(), to_string(i));
+  }
+  // Paths sharing long prefixes.
+  for (uint64_t i(0); i < 1000; ++i) {
+    leaves.emplace_back(PathLow(i), "low" + to_string(i));
+  }
+  // The same path more than once.
+  for (int i(0); i < 3; ++i) {
+    leaves.emplace_back(leaves[0].first, "again" + to_string(i));
+  }
+  std::stable_sort(leaves.begin(), leaves.end(),
+                   [](const pair<SparseMerkleTree::Path, string>& a,
+                      const pair<SparseMerkleTree::Path, string>& b) {
+                     return a.first < b.first;
+                   });
+
+  for (const auto& leaf : leaves) {
+    tree_.SetLeaf(leaf.first, leaf.second);
+  }
+  serial.SetLeaves(leaves, nullptr);
+  parallel.SetLeaves(leaves, &pool);
+  const string root(ToBase64(tree_.CurrentRoot()));
+  EXPECT_EQ(root, ToBase64(serial.CurrentRoot()));
+  EXPECT_EQ(root, ToBase64(parallel.CurrentRoot()));
+}
+
+
 TEST_F(SparseMerkleTreeTest, DISABLED_RefMemTest) {
   Reference ref(new Sha256Hasher);
   ValueList values;
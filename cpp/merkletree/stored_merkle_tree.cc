@@ -0,0 +1,191 @@
+#include "merkletree/stored_merkle_tree.h"
+
+#include <glog/logging.h>
+
+#include "merkletree/serial_hasher.h"
+
+using std::move;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+bool IsPowerOfTwo(size_t n) {
+  return (n & (n - 1)) == 0;
+}
+
+
+// The largest power of two smaller than |n|, which must be greater
+// than one: where a tree of |n| leaves splits into its two subtrees.
+size_t SplitPoint(size_t n) {
+  DCHECK_GT(n, 1U);
+  size_t split(1);
+  while (split << 1 < n) {
+    split <<= 1;
+  }
+  return split;
+}
+
+
+// Level of the root of a complete subtree of |n| leaves.
+size_t Height(size_t n) {
+  DCHECK(IsPowerOfTwo(n));
+  size_t height(0);
+  while (n >> height > 1) {
+    ++height;
+  }
+  return height;
+}
+
+
+}  // namespace
+
+
+StoredMerkleTree::StoredMerkleTree(unique_ptr<SerialHasher> hasher,
+                                   unique_ptr<MerkleTreeNodeStore> store)
+    : treehasher_(move(hasher)), store_(move(store)) {
+  CHECK(store_);
+  CHECK_EQ(treehasher_.DigestSize(), store_->NodeSize());
+}
+
+
+size_t StoredMerkleTree::LeafCount() const {
+  return store_->LevelCount() == 0 ? 0 : store_->NodeCount(0);
+}
+
+
+bool StoredMerkleTree::Covers(size_t snapshot) const {
+  for (size_t level = 0; snapshot >> level > 0; ++level) {
+    if (level >= store_->LevelCount() ||
+        store_->NodeCount(level) < snapshot >> level) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+string StoredMerkleTree::LeafHash(size_t leaf) const {
+  if (leaf == 0 || leaf > LeafCount()) {
+    return string();
+  }
+  return NodeString(0, leaf - 1);
+}
+
+
+string StoredMerkleTree::RootAtSnapshot(size_t snapshot) const {
+  if (snapshot == 0) {
+    return treehasher_.HashEmpty();
+  }
+  if (!Covers(snapshot)) {
+    return string();
+  }
+  return SubtreeRoot(0, snapshot);
+}
+
+
+vector<string> StoredMerkleTree::PathToRootAtSnapshot(size_t leaf,
+                                                      size_t snapshot) const {
+  vector<string> path;
+  if (leaf > snapshot || leaf == 0 || !Covers(snapshot)) {
+    return path;
+  }
+  AppendPath(leaf - 1, 0, snapshot, &path);
+  return path;
+}
+
+
+string StoredMerkleTree::PathNodeAtSnapshot(size_t leaf, size_t snapshot,
+                                            size_t position) const {
+  const vector<string> path(PathToRootAtSnapshot(leaf, snapshot));
+  return position < path.size() ? path[position] : string();
+}
+
+
+vector<string> StoredMerkleTree::SnapshotConsistency(size_t snapshot1,
+                                                     size_t snapshot2) const {
+  vector<string> proof;
+  if (snapshot1 == 0 || snapshot1 >= snapshot2 || !Covers(snapshot2)) {
+    return proof;
+  }
+  AppendConsistency(snapshot1, 0, snapshot2, true, &proof);
+  return proof;
+}
+
+
+vector<string> StoredMerkleTree::FrontierAtSnapshot(size_t snapshot) const {
+  vector<string> frontier;
+  if (!Covers(snapshot)) {
+    return frontier;
+  }
+  for (size_t level = 0; snapshot >> level > 0; ++level) {
+    frontier.emplace_back();
+    if ((snapshot >> level) & 1) {
+      frontier.back() = NodeString(level, (snapshot >> level) - 1);
+    }
+  }
+  return frontier;
+}
+
+
+string StoredMerkleTree::NodeString(size_t level, size_t index) const {
+  return string(store_->Node(level, index), store_->NodeSize());
+}
+
+
+string StoredMerkleTree::SubtreeRoot(size_t begin, size_t end) const {
+  DCHECK_LT(begin, end);
+  if (IsPowerOfTwo(end - begin)) {
+    const size_t height(Height(end - begin));
+    return NodeString(height, begin >> height);
+  }
+  const size_t split(begin + SplitPoint(end - begin));
+  return treehasher_.HashChildren(SubtreeRoot(begin, split),
+                                  SubtreeRoot(split, end));
+}
+
+
+void StoredMerkleTree::AppendPath(size_t leaf, size_t begin, size_t end,
+                                  vector<string>* path) const {
+  if (IsPowerOfTwo(end - begin)) {
+    // A complete subtree, the siblings are all in the store.
+    for (size_t level = 0; end - begin > size_t(1) << level; ++level) {
+      path->emplace_back(NodeString(level, (leaf >> level) ^ 1));
+    }
+    return;
+  }
+  const size_t split(begin + SplitPoint(end - begin));
+  if (leaf < split) {
+    AppendPath(leaf, begin, split, path);
+    path->emplace_back(SubtreeRoot(split, end));
+  } else {
+    AppendPath(leaf, split, end, path);
+    path->emplace_back(SubtreeRoot(begin, split));
+  }
+}
+
+
+void StoredMerkleTree::AppendConsistency(size_t snapshot1, size_t begin,
+                                         size_t end, bool skip_root,
+                                         vector<string>* proof) const {
+  if (snapshot1 == end) {
+    if (!skip_root) {
+      proof->emplace_back(SubtreeRoot(begin, end));
+    }
+    return;
+  }
+  const size_t split(begin + SplitPoint(end - begin));
+  if (snapshot1 <= split) {
+    AppendConsistency(snapshot1, begin, split, skip_root, proof);
+    proof->emplace_back(SubtreeRoot(split, end));
+  } else {
+    AppendConsistency(snapshot1, split, end, false, proof);
+    proof->emplace_back(SubtreeRoot(begin, split));
+  }
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,94 @@
+#ifndef CERT_TRANS_MERKLETREE_STORED_MERKLE_TREE_H_
+#define CERT_TRANS_MERKLETREE_STORED_MERKLE_TREE_H_
+
+#include <stddef.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "merkletree/node_store.h"
+#include "merkletree/tree_hasher.h"
+
+class SerialHasher;
+
+namespace cert_trans {
+
+
+// Serves proofs from a Merkle tree which is built elsewhere, and only
+// read here: typically a FileNodeStore opened read-only on the
+// directory where the LogLookup of another process keeps its tree.
+//
+// Only the nodes of complete subtrees are read from the store, as
+// they never change once written; the right edge of a snapshot is
+// hashed from those as needed. A snapshot can be served once the
+// store holds all of its complete subtrees, see Covers().
+//
+// The methods mirror those of MerkleTree, and return the same thing
+// for a snapshot that is covered, or nothing if it is not.
+//
+// This class is thread-compatible, but not thread-safe.
+class StoredMerkleTree {
+ public:
+  // |store| must have a node size matching the digest size of
+  // |hasher|.
+  StoredMerkleTree(std::unique_ptr<SerialHasher> hasher,
+                   std::unique_ptr<MerkleTreeNodeStore> store);
+  StoredMerkleTree(const StoredMerkleTree&) = delete;
+  StoredMerkleTree& operator=(const StoredMerkleTree&) = delete;
+
+  // Pick up what the writer of the store has added since.
+  void Refresh() {
+    store_->Refresh();
+  }
+
+  // Number of leaves in the store, some of which may not be covered
+  // by the upper levels yet.
+  size_t LeafCount() const;
+
+  // Whether the store holds everything needed for |snapshot|.
+  bool Covers(size_t snapshot) const;
+
+  // The |leaf|th leaf hash in the tree. Indexing starts from 1.
+  std::string LeafHash(size_t leaf) const;
+
+  std::string RootAtSnapshot(size_t snapshot) const;
+
+  std::vector<std::string> PathToRootAtSnapshot(size_t leaf,
+                                                size_t snapshot) const;
+
+  std::string PathNodeAtSnapshot(size_t leaf, size_t snapshot,
+                                 size_t position) const;
+
+  std::vector<std::string> SnapshotConsistency(size_t snapshot1,
+                                               size_t snapshot2) const;
+
+  // The roots of the complete subtrees that |snapshot| is made of,
+  // indexed by their level, as taken by the CompactMerkleTree
+  // constructor. Empty if |snapshot| is not covered.
+  std::vector<std::string> FrontierAtSnapshot(size_t snapshot) const;
+
+ private:
+  std::string NodeString(size_t level, size_t index) const;
+  // The root of the subtree of leaves [begin, end), |begin| being a
+  // multiple of a power of two no smaller than end - begin, as it is
+  // for any subtree of the tree.
+  std::string SubtreeRoot(size_t begin, size_t end) const;
+  // Append the path from |leaf| to the root of the subtree [begin,
+  // end), both 0-based.
+  void AppendPath(size_t leaf, size_t begin, size_t end,
+                  std::vector<std::string>* path) const;
+  // Append the consistency proof from |snapshot1| to the subtree
+  // [begin, end), leaving out the root of the subtree [begin,
+  // snapshot1) if |skip_root| is true.
+  void AppendConsistency(size_t snapshot1, size_t begin, size_t end,
+                         bool skip_root,
+                         std::vector<std::string>* proof) const;
+
+  TreeHasher treehasher_;
+  const std::unique_ptr<MerkleTreeNodeStore> store_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MERKLETREE_STORED_MERKLE_TREE_H_
@@ -0,0 +1,123 @@
+#include "merkletree/stored_merkle_tree.h"
+
+#include <gtest/gtest.h>
+#include <stddef.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "merkletree/compact_merkle_tree.h"
+#include "merkletree/file_node_store.h"
+#include "merkletree/merkle_tree.h"
+#include "merkletree/serial_hasher.h"
+#include "util/test_db.h"
+#include "util/testing.h"
+
+namespace {
+
+using cert_trans::FileNodeStore;
+using cert_trans::MerkleTreeNodeStore;
+using cert_trans::StoredMerkleTree;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+
+unique_ptr<SerialHasher> NewSha256Hasher() {
+  return unique_ptr<SerialHasher>(new Sha256Hasher);
+}
+
+class StoredMerkleTreeTest : public ::testing::Test {
+ protected:
+  StoredMerkleTreeTest()
+      : writer_(NewSha256Hasher(),
+                unique_ptr<MerkleTreeNodeStore>(
+                    new FileNodeStore(tmp_.TmpStorageDir(), kNodeSize))),
+        reference_(NewSha256Hasher()),
+        reader_(NewSha256Hasher(),
+                unique_ptr<MerkleTreeNodeStore>(new FileNodeStore(
+                    tmp_.TmpStorageDir(), kNodeSize, true))) {
+  }
+
+  // Add leaves to the tree being written, and publish them as
+  // LogLookup does.
+  void AddLeaves(size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      const string leaf(to_string(writer_.LeafCount()));
+      writer_.AddLeaf(leaf);
+      reference_.AddLeaf(leaf);
+    }
+    writer_.CurrentRoot();
+    writer_.Sync();
+  }
+
+  static const size_t kNodeSize = 32;
+
+  TmpStorage tmp_;
+  MerkleTree writer_;
+  MerkleTree reference_;
+  StoredMerkleTree reader_;
+};
+
+TEST_F(StoredMerkleTreeTest, MatchesMerkleTree) {
+  AddLeaves(70);
+  reader_.Refresh();
+  EXPECT_EQ(70U, reader_.LeafCount());
+  EXPECT_EQ(reference_.LeafHash(17), reader_.LeafHash(17));
+  EXPECT_EQ(string(), reader_.LeafHash(71));
+
+  for (size_t snapshot = 0; snapshot <= 70; ++snapshot) {
+    ASSERT_TRUE(reader_.Covers(snapshot));
+    EXPECT_EQ(reference_.RootAtSnapshot(snapshot),
+              reader_.RootAtSnapshot(snapshot))
+        << snapshot;
+    for (size_t leaf = 0; leaf <= snapshot + 1; ++leaf) {
+      const vector<string> path(reader_.PathToRootAtSnapshot(leaf, snapshot));
+      EXPECT_EQ(reference_.PathToRootAtSnapshot(leaf, snapshot), path)
+          << leaf << " " << snapshot;
+      EXPECT_EQ(reference_.PathNodeAtSnapshot(leaf, snapshot, 2),
+                reader_.PathNodeAtSnapshot(leaf, snapshot, 2));
+    }
+    for (size_t snapshot1 = 0; snapshot1 <= snapshot; ++snapshot1) {
+      EXPECT_EQ(reference_.SnapshotConsistency(snapshot1, snapshot),
+                reader_.SnapshotConsistency(snapshot1, snapshot))
+          << snapshot1 << " " << snapshot;
+    }
+  }
+}
+
+TEST_F(StoredMerkleTreeTest, OnlyCoversSyncedSnapshots) {
+  EXPECT_TRUE(reader_.Covers(0));
+  EXPECT_FALSE(reader_.Covers(1));
+  EXPECT_EQ(string(), reader_.RootAtSnapshot(1));
+
+  AddLeaves(5);
+  // Added, but not synced.
+  writer_.AddLeaf("unsynced");
+  EXPECT_FALSE(reader_.Covers(5));
+  reader_.Refresh();
+  EXPECT_TRUE(reader_.Covers(5));
+  EXPECT_FALSE(reader_.Covers(6));
+  EXPECT_TRUE(reader_.PathToRootAtSnapshot(1, 6).empty());
+  EXPECT_TRUE(reader_.SnapshotConsistency(3, 6).empty());
+  EXPECT_EQ(reference_.CurrentRoot(), reader_.RootAtSnapshot(5));
+}
+
+TEST_F(StoredMerkleTreeTest, FrontierAtSnapshot) {
+  AddLeaves(1000);
+  reader_.Refresh();
+  for (size_t snapshot : {1, 2, 3, 512, 999, 1000}) {
+    CompactMerkleTree compact(snapshot, reader_.FrontierAtSnapshot(snapshot),
+                              NewSha256Hasher());
+    EXPECT_EQ(reference_.RootAtSnapshot(snapshot), compact.CurrentRoot())
+        << snapshot;
+  }
+  EXPECT_TRUE(reader_.FrontierAtSnapshot(1001).empty());
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -4,9 +4,7 @@
 
 #include "merkletree/serial_hasher.h"
 
-using std::lock_guard;
 using std::move;
-using std::mutex;
 using std::string;
 using std::unique_ptr;
 
@@ -15,6 +13,14 @@ namespace {
 const char kLeafPrefix('\x00');
 const char kNodePrefix('\x01');
 
+string AsString(const TreeHasherT<Sha256>::Digest& digest) {
+  return string(reinterpret_cast<const char*>(digest.data()), digest.size());
+}
+
+const uint8_t* AsBytes(const char* data) {
+  return reinterpret_cast<const uint8_t*>(data);
+}
+
 std::string EmptyHash(SerialHasher* hasher) {
   hasher->Reset();
   return hasher->Final();
@@ -23,24 +29,47 @@ std::string EmptyHash(SerialHasher* hasher) {
 }  // namespace
 
 TreeHasher::TreeHasher(unique_ptr<SerialHasher> hasher)
-    : hasher_(move(hasher)), empty_hash_(EmptyHash(hasher_.get())) {
+    : hasher_(move(hasher)),
+      sha256_(dynamic_cast<Sha256Hasher*>(hasher_.get()) != nullptr),
+      empty_hash_(EmptyHash(hasher_.get())) {
   assert(hasher_);
 }
 
 string TreeHasher::HashLeaf(const string& data) const {
-  lock_guard<mutex> lock(lock_);
-  hasher_->Reset();
-  hasher_->Update(string(1, kLeafPrefix));
-  hasher_->Update(data);
-  return hasher_->Final();
+  if (sha256_)
+    return AsString(Sha256TreeHasher::HashLeaf(data.data(), data.size()));
+  return hasher_->Digest({{&kLeafPrefix, 1}, data});
 }
 
 string TreeHasher::HashChildren(const string& left_child,
                                 const string& right_child) const {
-  lock_guard<mutex> lock(lock_);
-  hasher_->Reset();
-  hasher_->Update(string(1, kNodePrefix));
-  hasher_->Update(left_child);
-  hasher_->Update(right_child);
-  return hasher_->Final();
+  if (sha256_ && left_child.size() == Sha256TreeHasher::kDigestSize &&
+      right_child.size() == Sha256TreeHasher::kDigestSize)
+    return HashChildren(left_child.data(), right_child.data());
+  return hasher_->Digest({{&kNodePrefix, 1}, left_child, right_child});
+}
+
+string TreeHasher::HashChildren(const char* left_child,
+                                const char* right_child) const {
+  if (sha256_)
+    return AsString(Sha256TreeHasher::HashChildren(AsBytes(left_child),
+                                                   AsBytes(right_child)));
+  const size_t size(DigestSize());
+  return hasher_->Digest(
+      {{&kNodePrefix, 1}, {left_child, size}, {right_child, size}});
+}
+
+void TreeHasher::HashChildrenBatch(const char* const* children, size_t count,
+                                   char* out) const {
+  if (sha256_) {
+    uint8_t* const parents(reinterpret_cast<uint8_t*>(out));
+    for (size_t i = 0; i < count; ++i)
+      Sha256TreeHasher::HashChildren(
+          AsBytes(children[i]),
+          AsBytes(children[i] + Sha256TreeHasher::kDigestSize),
+          parents + i * Sha256TreeHasher::kDigestSize);
+    return;
+  }
+  hasher_->DigestBatch({&kNodePrefix, 1}, children, 2 * DigestSize(), count,
+                       out);
 }
@@ -1,13 +1,101 @@
 #ifndef CERT_TRANS_MERKLETREE_TREE_HASHER_H_
 #define CERT_TRANS_MERKLETREE_TREE_HASHER_H_
 
+#include <openssl/sha.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <array>
 #include <memory>
-#include <mutex>
 #include <string>
 
 #include "merkletree/serial_hasher.h"
 
+// SHA-256, as a parameter of TreeHasherT.
+struct Sha256 {
+  static const size_t kDigestSize = SHA256_DIGEST_LENGTH;
+
+  static void Hash(const void* data, size_t size, uint8_t* out) {
+    SHA256(static_cast<const unsigned char*>(data), size, out);
+  }
+};
+
+// The hashes of RFC 6962, for a |Hash| known at compile time: each
+// node is hashed with a single inlined call over a buffer on the
+// stack, and digests are returned in std::arrays rather than strings,
+// so that nothing is allocated and nothing is called virtually.
+//
+// This class is thread-safe, as it has no state.
+template <class Hash>
+class TreeHasherT {
+ public:
+  static const size_t kDigestSize = Hash::kDigestSize;
+  typedef std::array<uint8_t, kDigestSize> Digest;
+
+  static Digest HashEmpty() {
+    Digest digest;
+    Hash::Hash(nullptr, 0, digest.data());
+    return digest;
+  }
+
+  static Digest HashLeaf(const char* data, size_t size) {
+    Digest digest;
+    HashLeaf(data, size, digest.data());
+    return digest;
+  }
+
+  // Writes the hash of the leaf to |out|, which must hold kDigestSize
+  // bytes.
+  static void HashLeaf(const char* data, size_t size, uint8_t* out) {
+    // Leaves are usually small enough for the stack, too.
+    uint8_t buffer[kLeafBufferSize];
+    if (size < sizeof(buffer)) {
+      buffer[0] = kLeafPrefix;
+      memcpy(buffer + 1, data, size);
+      Hash::Hash(buffer, size + 1, out);
+    } else {
+      std::string input(1, kLeafPrefix);
+      input.append(data, size);
+      Hash::Hash(input.data(), input.size(), out);
+    }
+  }
+
+  // Both children are kDigestSize bytes long.
+  static Digest HashChildren(const uint8_t* left_child,
+                             const uint8_t* right_child) {
+    Digest digest;
+    HashChildren(left_child, right_child, digest.data());
+    return digest;
+  }
+
+  static Digest HashChildren(const Digest& left_child,
+                             const Digest& right_child) {
+    return HashChildren(left_child.data(), right_child.data());
+  }
+
+  // Writes the parent of the two children to |out|, which must hold
+  // kDigestSize bytes (and may be one of the children).
+  static void HashChildren(const uint8_t* left_child,
+                           const uint8_t* right_child, uint8_t* out) {
+    uint8_t buffer[1 + 2 * kDigestSize];
+    buffer[0] = kNodePrefix;
+    memcpy(buffer + 1, left_child, kDigestSize);
+    memcpy(buffer + 1 + kDigestSize, right_child, kDigestSize);
+    Hash::Hash(buffer, sizeof(buffer), out);
+  }
+
+ private:
+  static const uint8_t kLeafPrefix = 0x00;
+  static const uint8_t kNodePrefix = 0x01;
+  static const size_t kLeafBufferSize = 1024;
+};
+
+// The hashes of RFC 6962, for any SerialHasher. With a Sha256Hasher,
+// TreeHasherT<Sha256> is used instead of going through it.
+//
+// This class is thread-safe: hashing goes through
+// SerialHasher::Digest(), which keeps no shared state, so concurrent
+// callers do not serialize on each other.
 class TreeHasher {
  public:
   TreeHasher(std::unique_ptr<SerialHasher> hasher);
@@ -30,9 +118,25 @@ class TreeHasher {
   std::string HashChildren(const std::string& left_child,
                            const std::string& right_child) const;
 
+  // Same as above, for children of exactly DigestSize() bytes each,
+  // which saves copying them out of wherever they are stored.
+  std::string HashChildren(const char* left_child,
+                           const char* right_child) const;
+
+  // Hash |count| pairs of children at once. Each of |children| points
+  // to a left child immediately followed by its right child, both
+  // DigestSize() bytes long; the parents are written back to back to
+  // |out|, which must hold |count| * DigestSize() bytes.
+  void HashChildrenBatch(const char* const* children, size_t count,
+                         char* out) const;
+
  private:
-  mutable std::mutex lock_;
+  typedef TreeHasherT<Sha256> Sha256TreeHasher;
+
   const std::unique_ptr<SerialHasher> hasher_;
+  // Whether |hasher_| is a Sha256Hasher, which is then bypassed in
+  // favour of the inlined Sha256TreeHasher.
+  const bool sha256_;
   // The pre-computed hash of an empty tree.
   const std::string empty_hash_;
 };
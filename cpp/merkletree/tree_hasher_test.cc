@@ -149,6 +149,71 @@ TYPED_TEST(TreeHasherTest, TestVectors) {
   }
 }
 
+TYPED_TEST(TreeHasherTest, HashChildrenBatch) {
+  const size_t digest_size(this->tree_hasher_.DigestSize());
+  // A level of leaf hashes, with siblings next to each other.
+  string level;
+  for (int i = 0; i < 6; ++i)
+    level += this->tree_hasher_.HashLeaf(string(1, 'a' + i));
+
+  const char* const children[] = {&level[0], &level[4 * digest_size],
+                                  &level[2 * digest_size]};
+  string parents(3 * digest_size, '\0');
+  this->tree_hasher_.HashChildrenBatch(children, 3, &parents[0]);
+  for (size_t i = 0; i < 3; ++i) {
+    EXPECT_EQ(H(this->tree_hasher_.HashChildren(children[i],
+                                                children[i] + digest_size)),
+              H(parents.substr(i * digest_size, digest_size)));
+  }
+}
+
+TEST(TreeHasherTTest, MatchesTreeHasher) {
+  typedef TreeHasherT<Sha256> Sha256TreeHasher;
+  // The generic path, which Sha256Hasher itself would bypass.
+  class GenericSha256Hasher : public SerialHasher {
+   public:
+    size_t DigestSize() const {
+      return hasher_.DigestSize();
+    }
+    void Reset() {
+      hasher_.Reset();
+    }
+    void Update(const string& data) {
+      hasher_.Update(data);
+    }
+    string Final() {
+      return hasher_.Final();
+    }
+    unique_ptr<SerialHasher> Create() const {
+      return unique_ptr<SerialHasher>(new GenericSha256Hasher);
+    }
+
+   private:
+    Sha256Hasher hasher_;
+  };
+  const TreeHasher tree_hasher(
+      unique_ptr<SerialHasher>(new GenericSha256Hasher));
+  const auto as_string = [](const Sha256TreeHasher::Digest& digest) {
+    return string(reinterpret_cast<const char*>(digest.data()),
+                  digest.size());
+  };
+
+  EXPECT_EQ(H(tree_hasher.HashEmpty()),
+            H(as_string(Sha256TreeHasher::HashEmpty())));
+
+  // Short leaves, and one too long for the buffer on the stack.
+  for (const size_t size : {0, 1, 32, 1022, 1023, 1024, 5000}) {
+    const string leaf(size, 'x');
+    EXPECT_EQ(H(tree_hasher.HashLeaf(leaf)),
+              H(as_string(Sha256TreeHasher::HashLeaf(leaf.data(), size))));
+  }
+
+  const Sha256TreeHasher::Digest left(Sha256TreeHasher::HashLeaf("a", 1));
+  const Sha256TreeHasher::Digest right(Sha256TreeHasher::HashLeaf("b", 1));
+  EXPECT_EQ(H(tree_hasher.HashChildren(as_string(left), as_string(right))),
+            H(as_string(Sha256TreeHasher::HashChildren(left, right))));
+}
+
 #undef S
 #undef H
 
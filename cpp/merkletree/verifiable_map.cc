@@ -1,9 +1,11 @@
+#include <algorithm>
 #include <array>
 #include <string>
 
 #include "merkletree/verifiable_map.h"
 
 
+using std::pair;
 using std::string;
 using std::unique_ptr;
 using std::vector;
@@ -26,6 +28,26 @@ void VerifiableMap::Set(const string& key, const string& value) {
 }
 
 
+void VerifiableMap::Set(const vector<pair<string, string>>& entries,
+                        util::Executor* executor) {
+  vector<pair<SparseMerkleTree::Path, string>> leaves;
+  leaves.reserve(entries.size());
+  for (const pair<string, string>& entry : entries) {
+    leaves.emplace_back(PathFromKey(entry.first), entry.second);
+  }
+  // Stable, so that the last value set for a key still wins.
+  std::stable_sort(leaves.begin(), leaves.end(),
+                   [](const pair<SparseMerkleTree::Path, string>& a,
+                      const pair<SparseMerkleTree::Path, string>& b) {
+                     return a.first < b.first;
+                   });
+  merkle_tree_.SetLeaves(leaves, executor);
+  for (pair<SparseMerkleTree::Path, string>& leaf : leaves) {
+    values_[leaf.first] = std::move(leaf.second);
+  }
+}
+
+
 StatusOr<string> VerifiableMap::Get(const string& key) const {
   const SparseMerkleTree::Path path(PathFromKey(key));
   const auto it(values_.find(path));
@@ -41,6 +63,12 @@ vector<string> VerifiableMap::InclusionProof(const string& key) {
 }
 
 
+SparseMerkleTree::CompressedProof VerifiableMap::CompressedInclusionProof(
+    const string& key) {
+  return merkle_tree_.CompressedInclusionProof(PathFromKey(key));
+}
+
+
 SparseMerkleTree::Path VerifiableMap::PathFromKey(const string& key) const {
   unique_ptr<SerialHasher> h(hasher_model_->Create());
   h->Update(key);
@@ -3,6 +3,7 @@
 
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include "merkletree/sparse_merkle_tree.h"
@@ -24,10 +25,20 @@ class VerifiableMap {
 
   void Set(const std::string& key, const std::string& value);
 
+  // Same as calling Set() for each of |entries| in order, but the tree is
+  // updated in parallel on |executor|, if not NULL (see
+  // SparseMerkleTree::SetLeaves()). For bulk loading.
+  void Set(const std::vector<std::pair<std::string, std::string>>& entries,
+           util::Executor* executor);
+
   util::StatusOr<std::string> Get(const std::string& key) const;
 
   std::vector<std::string> InclusionProof(const std::string& key);
 
+  // See SparseMerkleTree::CompressedInclusionProof().
+  SparseMerkleTree::CompressedProof CompressedInclusionProof(
+      const std::string& key);
+
  private:
   SparseMerkleTree::Path PathFromKey(const std::string& key) const;
 
@@ -5,6 +5,7 @@
 #include "merkletree/verifiable_map.h"
 #include "util/status_test_util.h"
 #include "util/testing.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
 
@@ -12,7 +13,10 @@ namespace cert_trans {
 namespace {
 
 using std::array;
+using std::pair;
 using std::string;
+using std::to_string;
+using std::vector;
 using std::unique_ptr;
 using util::StatusOr;
 using util::testing::StatusIs;
@@ -47,6 +51,27 @@ TEST_F(VerifiableMapTest, TestSetGet) {
 }
 
 
+TEST_F(VerifiableMapTest, TestSetMany) {
+  vector<pair<string, string>> entries;
+  for (int i(0); i < 2000; ++i) {
+    entries.emplace_back("key" + to_string(i), "value" + to_string(i));
+  }
+  entries.emplace_back("key0", "last");
+  for (const auto& entry : entries) {
+    map_.Set(entry.first, entry.second);
+  }
+
+  ThreadPool pool(4);
+  VerifiableMap batched(new Sha256Hasher());
+  batched.Set(entries, &pool);
+  EXPECT_EQ(ToBase64(map_.CurrentRoot()), ToBase64(batched.CurrentRoot()));
+
+  const StatusOr<string> retrieved(batched.Get("key0"));
+  EXPECT_OK(retrieved);
+  EXPECT_EQ("last", retrieved.ValueOrDie());
+}
+
+
 // TODO(alcutter): Lots and lots more tests.
 
 
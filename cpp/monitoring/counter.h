@@ -16,6 +16,28 @@ namespace cert_trans {
 template <class... LabelTypes>
 class Counter : public Metric {
  public:
+  // The counter for one set of labels, looked up once, for places
+  // which increment it often. It remains valid for as long as the
+  // Counter.
+  class Handle {
+   public:
+    void Increment() {
+      value_->IncrementBy(1);
+    }
+
+    void IncrementBy(double amount) {
+      value_->IncrementBy(amount);
+    }
+
+   private:
+    explicit Handle(LabelledValue* value) : value_(CHECK_NOTNULL(value)) {
+    }
+
+    LabelledValue* value_;
+
+    friend class Counter;
+  };
+
   static Counter<LabelTypes...>* New(
       const std::string& name,
       const typename NameType<LabelTypes>::name&... label_names,
@@ -30,6 +52,8 @@ class Counter : public Metric {
 
   double Get(const LabelTypes&... labels) const;
 
+  Handle GetHandle(const LabelTypes&... labels);
+
   std::map<std::vector<std::string>, Metric::TimestampedValue> CurrentValues()
       const override;
 
@@ -81,6 +105,13 @@ double Counter<LabelTypes...>::Get(const LabelTypes&... labels) const {
 }
 
 
+template <class... LabelTypes>
+typename Counter<LabelTypes...>::Handle Counter<LabelTypes...>::GetHandle(
+    const LabelTypes&... labels) {
+  return Handle(values_.GetValue(labels...));
+}
+
+
 template <class... LabelTypes>
 std::map<std::vector<std::string>, Metric::TimestampedValue>
 Counter<LabelTypes...>::CurrentValues() const {
@@ -4,6 +4,8 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <memory>
+#include <thread>
+#include <vector>
 
 #include "util/testing.h"
 
@@ -91,6 +93,45 @@ TEST_F(CounterTest, TestCounterWithLabelsMultiValues) {
 }
 
 
+TEST_F(CounterTest, TestCounterHandle) {
+  std::unique_ptr<Counter<std::string>> counter(
+      Counter<std::string>::New("name", "a string", "help"));
+  Counter<std::string>::Handle handle(counter->GetHandle("alpha"));
+  // Not reported until incremented.
+  EXPECT_TRUE(counter->CurrentValues().empty());
+
+  handle.Increment();
+  handle.IncrementBy(2);
+  counter->Increment("alpha");
+  EXPECT_EQ(4, counter->Get("alpha"));
+  EXPECT_EQ(0, counter->Get("beta"));
+  EXPECT_EQ(1, counter->CurrentValues().size());
+}
+
+
+TEST_F(CounterTest, TestCounterFromManyThreads) {
+  const int kNumThreads = 16;
+  const int kNumIncrements = 10000;
+  std::unique_ptr<Counter<>> counter(Counter<>::New("name", "help"));
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&counter]() {
+      Counter<>::Handle handle(counter->GetHandle());
+      for (int j = 0; j < kNumIncrements; ++j) {
+        handle.Increment();
+        counter->Increment();
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_EQ(2 * kNumThreads * kNumIncrements, counter->Get());
+}
+
+
 }  // namespace cert_trans
 
 
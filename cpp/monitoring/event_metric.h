@@ -2,7 +2,6 @@
 #define CERT_TRANS_MONITORING_EVENT_METRIC_H_
 
 #include <memory>
-#include <mutex>
 #include <string>
 
 #include "monitoring/counter.h"
@@ -29,11 +28,11 @@ class EventMetric {
 
   // Records an increment of |amount| specified by |labels|.
   // This increments the "|base_name|_overall_sum" metric by |amount|, and
-  // increments the "|base_name|_count" metric by 1.
+  // increments the "|base_name|_count" metric by 1. The two are not
+  // updated atomically, as they are not read together anyway.
   void RecordEvent(const LabelTypes&... labels, double amount);
 
  private:
-  std::mutex mutex_;
   std::unique_ptr<Counter<LabelTypes...>> totals_;
   std::unique_ptr<Counter<LabelTypes...>> counts_;
 };
@@ -54,7 +53,6 @@ EventMetric<LabelTypes...>::EventMetric(
 template <class... LabelTypes>
 void EventMetric<LabelTypes...>::RecordEvent(const LabelTypes&... labels,
                                              double amount) {
-  std::lock_guard<std::mutex> lock(mutex_);
   totals_->IncrementBy(labels..., amount);
   counts_->Increment(labels...);
 }
@@ -15,6 +15,29 @@ namespace cert_trans {
 template <class... LabelTypes>
 class Gauge : public Metric {
  public:
+  // The gauge for one set of labels, looked up once, for places which
+  // set it often. It remains valid for as long as the Gauge.
+  class Handle {
+   public:
+    void Set(double value) {
+      value_->Set(value);
+    }
+
+    // For gauges that count things coming and going (such as queued
+    // work), which are then only ever incremented, never set.
+    void IncrementBy(double amount) {
+      value_->IncrementBy(amount);
+    }
+
+   private:
+    explicit Handle(LabelledValue* value) : value_(CHECK_NOTNULL(value)) {
+    }
+
+    LabelledValue* value_;
+
+    friend class Gauge;
+  };
+
   static Gauge<LabelTypes...>* New(
       const std::string& name,
       const typename NameType<LabelTypes>::name&... label_names,
@@ -27,6 +50,8 @@ class Gauge : public Metric {
 
   void Set(const LabelTypes&... labels, double value);
 
+  Handle GetHandle(const LabelTypes&... labels);
+
   // TODO(alcutter): Not over the moon about having this here.
   std::map<std::vector<std::string>, Metric::TimestampedValue> CurrentValues()
       const override;
@@ -72,6 +97,13 @@ void Gauge<LabelTypes...>::Set(const LabelTypes&... labels, double value) {
 }
 
 
+template <class... LabelTypes>
+typename Gauge<LabelTypes...>::Handle Gauge<LabelTypes...>::GetHandle(
+    const LabelTypes&... labels) {
+  return Handle(values_.GetValue(labels...));
+}
+
+
 template <class... LabelTypes>
 std::map<std::vector<std::string>, Metric::TimestampedValue>
 Gauge<LabelTypes...>::CurrentValues() const {
@@ -96,6 +96,19 @@ TEST_F(GaugeTest, TestGaugeWithLabelsMultiValues) {
 }
 
 
+TEST_F(GaugeTest, TestGaugeHandle) {
+  std::unique_ptr<Gauge<std::string>> gauge(
+      Gauge<std::string>::New("name", "a string", "help"));
+  Gauge<std::string>::Handle handle(gauge->GetHandle("alpha"));
+  handle.Set(100);
+  EXPECT_EQ(100, gauge->Get("alpha"));
+  gauge->Set("alpha", 1);
+  EXPECT_EQ(1, gauge->Get("alpha"));
+  handle.Set(2);
+  EXPECT_EQ(2, gauge->Get("alpha"));
+}
+
+
 }  // namespace cert_trans
 
 
@@ -2,6 +2,12 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <set>
 #include <sstream>
 
 #include "monitoring/monitoring.h"
@@ -24,6 +30,14 @@ DEFINE_int32(google_compute_monitoring_credentials_refresh_interval_minutes,
              "GCM.");
 DEFINE_int32(google_compute_monitoring_retry_delay_seconds, 5,
              "Seconds between retrying failed GCM requests.");
+DEFINE_int32(google_compute_monitoring_max_timeseries_per_push, 200,
+             "Most timeseries sent to GCM in one request, the most it "
+             "accepts; more are split into several requests, sent in "
+             "parallel.");
+DEFINE_int32(google_compute_monitoring_unchanged_push_interval_seconds, 240,
+             "Only the timeseries which changed are pushed to GCM, but "
+             "unchanged ones are pushed again after this many seconds, so "
+             "that they do not go stale. 0 pushes them all every time.");
 
 
 namespace cert_trans {
@@ -32,14 +46,20 @@ using std::bind;
 using std::chrono::minutes;
 using std::chrono::seconds;
 using std::chrono::system_clock;
+using std::lock_guard;
 using std::make_pair;
+using std::make_shared;
+using std::map;
 using std::mutex;
 using std::ostringstream;
 using std::placeholders::_1;
+using std::shared_ptr;
 using std::string;
 using std::thread;
+using std::to_string;
 using std::unique_lock;
 using std::unique_ptr;
+using std::vector;
 using util::Executor;
 using util::SyncTask;
 using util::Task;
@@ -52,6 +72,10 @@ Counter<>* num_gcm_push_failures =
     Counter<>::New("num_gcm_push_failures",
                    "Number of failures to push metric data to GCM.");
 
+Counter<>* num_gcm_timeseries_pushed =
+    Counter<>::New("num_gcm_timeseries_pushed",
+                   "Number of timeseries values successfully pushed to GCM.");
+
 Counter<>* num_gcm_token_fetch_failures =
     Counter<>::New("num_gcm_token_fetch_failures",
                    "Number of failures to fetch GCM auth token");
@@ -168,14 +192,19 @@ void GCMExporter::CreateMetrics() {
         // only gauge type metrics are supported for custom metrics currently:
         // https://cloud.google.com/monitoring/api/metrics#metric-types
         desc.Add("metricType", "gauge");
+        desc.Add("valueType", "double");
         break;
       case Metric::GAUGE:
         desc.Add("metricType", "gauge");
+        desc.Add("valueType", "double");
+        break;
+      case Metric::HISTOGRAM:
+        desc.Add("metricType", "gauge");
+        desc.Add("valueType", "distribution");
         break;
       default:
         LOG(FATAL) << "Unknown type: " << m->Type();
     }
-    desc.Add("valueType", "double");
 
     JsonObject metric;
     metric.Add("name", kCloudPrefix + m->Name());
@@ -219,14 +248,149 @@ void GCMExporter::CreateMetrics() {
 namespace {
 
 
-void AddLabel(const string& key, const string& value, JsonObject* labels) {
-  CHECK_NOTNULL(labels)->Add((kCloudPrefix + key).c_str(), value);
+// Appends |s| as a JSON string, quoted and escaped.
+void AppendJsonString(const string& s, string* out) {
+  out->push_back('"');
+  for (const char c : s) {
+    if (c == '"') {
+      out->append("\\\"");
+    } else if (c == '\\') {
+      out->append("\\\\");
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out->append(buf);
+    } else {
+      out->push_back(c);
+    }
+  }
+  out->push_back('"');
+}
+
+
+// |value| must be finite, as JSON has no other numbers.
+void AppendJsonDouble(double value, string* out) {
+  // Use the shortest of the two precisions which round-trips.
+  char buf[32];
+  int len(snprintf(buf, sizeof(buf), "%.15g", value));
+  if (strtod(buf, nullptr) != value) {
+    len = snprintf(buf, sizeof(buf), "%.17g", value);
+  }
+  out->append(buf, len);
+}
+
+
+// Starts the body of a write request, to which the timeseries are
+// then appended.
+void AppendRequestStart(const string& instance_name, string* out) {
+  out->append(
+      "{\"kind\":\"cloudmonitoring#writeTimeseriesRequest\","
+      "\"commonLabels\":{");
+  AppendJsonString(string(kCloudPrefix) + "instance", out);
+  out->push_back(':');
+  AppendJsonString(instance_name, out);
+  out->append("},\"timeseries\":[");
+}
+
+
+void AppendRequestEnd(string* out) {
+  out->append("]}");
+}
+
+
+// Appends a timeseries up to its point's time range, after which
+// comes its value, and then AppendTimeseriesEnd().
+//
+// According to
+// https://cloud.google.com/monitoring/v2beta2/timeseries/write
+// GAUGE types should have a zero size timerange here
+// Which implies we need to use the current time rather than the time the
+// value was set because there's a [short ~5m] horizon over which GCM
+// won't accept samples.
+void AppendTimeseriesStart(const Metric& m, const vector<string>& values,
+                           const string& time, string* out) {
+  out->append("{\"timeseriesDesc\":{\"labels\":{");
+  for (size_t i(0); i < values.size(); ++i) {
+    if (i > 0) {
+      out->push_back(',');
+    }
+    AppendJsonString(kCloudPrefix + m.LabelName(i), out);
+    out->push_back(':');
+    AppendJsonString(values[i], out);
+  }
+  out->append("},\"metric\":");
+  AppendJsonString(kCloudPrefix + m.Name(), out);
+  out->append("},\"point\":{\"start\":");
+  AppendJsonString(time, out);
+  out->append(",\"end\":");
+  AppendJsonString(time, out);
+}
+
+
+void AppendTimeseriesEnd(string* out) {
+  out->append("}}");
+}
+
+
+// See https://cloud.google.com/monitoring/v2beta2/timeseries for the
+// structure of a distribution value. The first bucket of
+// |distribution| (for samples up to its bound) is the underflow
+// bucket, and the last one (with an infinite bound) the overflow
+// bucket.
+void AppendDistributionValue(const Metric::Distribution& distribution,
+                             string* out) {
+  const auto& buckets(distribution.buckets);
+  CHECK_GE(buckets.size(), 2U);
+
+  out->append(",\"distributionValue\":{\"underflowBucket\":{\"upperBound\":");
+  AppendJsonDouble(buckets.front().first, out);
+  out->append(",\"count\":");
+  out->append(to_string(buckets.front().second));
+  out->append("},\"buckets\":[");
+  for (size_t i(1); i + 1 < buckets.size(); ++i) {
+    if (i > 1) {
+      out->push_back(',');
+    }
+    out->append("{\"lowerBound\":");
+    AppendJsonDouble(buckets[i - 1].first, out);
+    out->append(",\"upperBound\":");
+    AppendJsonDouble(buckets[i].first, out);
+    out->append(",\"count\":");
+    out->append(to_string(buckets[i].second));
+    out->push_back('}');
+  }
+  out->append("],\"overflowBucket\":{\"lowerBound\":");
+  AppendJsonDouble(buckets[buckets.size() - 2].first, out);
+  out->append(",\"count\":");
+  out->append(to_string(buckets.back().second));
+  out->append("}}");
 }
 
 
 }  // namespace
 
 
+// A series going out in a push.
+struct GCMExporter::Sample {
+  string metric;
+  vector<string> labels;
+  double value;
+  double sum;
+};
+
+
+// The batches of one push, sent in parallel. The next push is
+// scheduled once they are all done.
+struct GCMExporter::PushRound {
+  explicit PushRound(const system_clock::time_point& at) : at(at) {
+  }
+
+  const system_clock::time_point at;
+  vector<vector<Sample>> batches;
+  std::atomic<size_t> remaining;
+};
+
+
 void GCMExporter::PushMetrics() {
   if (task_.task()->CancelRequested()) {
     task_.task()->Return(util::Status::CANCELLED);
@@ -246,76 +410,151 @@ void GCMExporter::PushMetrics() {
     CreateMetrics();
   }
 
-  // Build up the JSON write request into this object:
-  JsonObject metric_write;
-  metric_write.Add("kind", "cloudmonitoring#writeTimeseriesRequest");
-
-  JsonObject common_labels;
-  AddLabel("instance", instance_name_, &common_labels);
-  metric_write.Add("commonLabels", common_labels);
+  const system_clock::time_point now(system_clock::now());
+  const string time(RFC3339Time(now));
+  const size_t max_per_batch(std::max(
+      FLAGS_google_compute_monitoring_max_timeseries_per_push, 1));
+  const seconds unchanged_interval(
+      FLAGS_google_compute_monitoring_unchanged_push_interval_seconds);
+  // Whether a series should be pushed, because it was never pushed,
+  // changed since it was, or was last pushed long enough ago.
+  const auto is_due = [&now, &unchanged_interval](
+      const map<vector<string>, Pushed>& pushed, const vector<string>& labels,
+      double value, double sum) {
+    const auto it(pushed.find(labels));
+    return it == pushed.end() || it->second.value != value ||
+           it->second.sum != sum || now - it->second.at >= unchanged_interval;
+  };
+  const shared_ptr<PushRound> round(make_shared<PushRound>(now));
+  // Starts a new batch if there is none yet, or if the current one is
+  // full, and returns its body, ready for another timeseries.
+  const auto next_body = [this, &round, max_per_batch]() -> string* {
+    if (!round->batches.empty() &&
+        round->batches.back().size() < max_per_batch) {
+      string* const body(&bodies_[round->batches.size() - 1]);
+      body->push_back(',');
+      return body;
+    }
+    if (!round->batches.empty()) {
+      AppendRequestEnd(&bodies_[round->batches.size() - 1]);
+    }
+    round->batches.emplace_back();
+    if (bodies_.size() < round->batches.size()) {
+      bodies_.emplace_back();
+    }
+    string* const body(&bodies_[round->batches.size() - 1]);
+    body->clear();
+    AppendRequestStart(instance_name_, body);
+    return body;
+  };
 
   const std::set<const Metric*> metrics(Registry::Instance()->GetMetrics());
-  JsonArray timeseries;
-  for (auto& m : metrics) {
-    CHECK_NOTNULL(m);
-    for (auto& p : m->CurrentValues()) {
-      JsonObject labels;
-      for (size_t i(0); i < p.first.size(); ++i) {
-        AddLabel(m->LabelName(i), p.first[i], &labels);
+  {
+    lock_guard<mutex> lock(pushed_lock_);
+    std::set<string> names;
+    for (auto& m : metrics) {
+      CHECK_NOTNULL(m);
+      names.insert(m->Name());
+      const auto& pushed(pushed_[m->Name()]);
+      if (m->Type() == Metric::HISTOGRAM) {
+        for (auto& p : m->CurrentDistributions()) {
+          const double count(p.second.count);
+          if (!is_due(pushed, p.first, count, p.second.sum)) {
+            continue;
+          }
+          string* const body(next_body());
+          AppendTimeseriesStart(*m, p.first, time, body);
+          AppendDistributionValue(p.second, body);
+          AppendTimeseriesEnd(body);
+          round->batches.back().push_back(
+              Sample{m->Name(), p.first, count, p.second.sum});
+        }
+        continue;
       }
 
-      JsonObject desc;
-      desc.Add("labels", labels);
-      desc.Add("metric", kCloudPrefix + m->Name());
-
-      JsonObject ts;
-      ts.Add("timeseriesDesc", desc);
-
-      JsonObject point;
-      // According to
-      // https://cloud.google.com/monitoring/v2beta2/timeseries/write
-      // GAUGE types should have a zero size timerange here
-      // Which implies we need to use the current time rather than the time the
-      // value was set because there's a [short ~5m] horizon over which GCM
-      // won't accept samples.
-      const auto now(system_clock::now());
-      point.Add("start", RFC3339Time(now));
-      point.Add("end", RFC3339Time(now));
-      point.Add("doubleValue", p.second.second);
-      ts.Add("point", point);
-
-      timeseries.Add(&ts);
+      for (auto& p : m->CurrentValues()) {
+        const double value(p.second.second);
+        // A single value which cannot be written as JSON would get its
+        // whole batch rejected.
+        if (!std::isfinite(value) || !is_due(pushed, p.first, value, 0)) {
+          continue;
+        }
+        string* const body(next_body());
+        AppendTimeseriesStart(*m, p.first, time, body);
+        body->append(",\"doubleValue\":");
+        AppendJsonDouble(value, body);
+        AppendTimeseriesEnd(body);
+        round->batches.back().push_back(Sample{m->Name(), p.first, value, 0});
+      }
+    }
+    // Forget the metrics which are gone.
+    for (auto it(pushed_.begin()); it != pushed_.end();) {
+      if (names.count(it->first) == 0) {
+        it = pushed_.erase(it);
+      } else {
+        ++it;
+      }
     }
   }
-  metric_write.Add("timeseries", timeseries);
+
+  if (round->batches.empty()) {
+    VLOG(1) << "No metrics changed.";
+    SchedulePush();
+    return;
+  }
+  AppendRequestEnd(&bodies_[round->batches.size() - 1]);
+  round->remaining = round->batches.size();
 
   UrlFetcher::Request req(
       (URL(FLAGS_google_compute_monitoring_base_url + "/timeseries:write")));
   req.verb = UrlFetcher::Verb::POST;
   req.headers.insert(make_pair("Content-Type", "application/json"));
   req.headers.insert(make_pair("Authorization", "Bearer " + bearer_token_));
-  req.body = metric_write.ToString();
-
-  UrlFetcher::Response* resp(new UrlFetcher::Response);
-  VLOG(1) << "Pushing metrics...";
-  VLOG(2) << req.body;
-  fetcher_->Fetch(req, resp,
-                  task_.task()->AddChild(
-                      bind(&GCMExporter::PushMetricsDone, this, resp, _1)));
+
+  VLOG(1) << "Pushing metrics in " << round->batches.size() << " batches...";
+  for (size_t i(0); i < round->batches.size(); ++i) {
+    // The fetcher copies the request, so the body can be swapped back
+    // right after, keeping its buffer for the next push.
+    req.body.swap(bodies_[i]);
+    VLOG(2) << req.body;
+    UrlFetcher::Response* const resp(new UrlFetcher::Response);
+    fetcher_->Fetch(req, resp,
+                    task_.task()->AddChild(bind(&GCMExporter::PushBatchDone,
+                                                this, round, i, resp, _1)));
+    req.body.swap(bodies_[i]);
+  }
 }
 
 
-void GCMExporter::PushMetricsDone(UrlFetcher::Response* resp, Task* task) {
+void GCMExporter::PushBatchDone(const shared_ptr<PushRound>& round,
+                                size_t batch, UrlFetcher::Response* resp,
+                                Task* task) {
   unique_ptr<UrlFetcher::Response> resp_deleter(resp);
+  const vector<Sample>& samples(round->batches[batch]);
   if (!task->status().ok() || resp->status_code != 200) {
+    // The series of this batch will be pushed again next time, as if
+    // they had changed.
     num_gcm_push_failures->Increment();
     LOG(WARNING) << "Failed to push metrics to GCM, status: " << task->status()
                  << ", reponse code: " << resp->status_code;
   } else {
     VLOG(1) << "Metrics pushed.";
     VLOG(2) << resp->body;
+    num_gcm_timeseries_pushed->IncrementBy(samples.size());
+    lock_guard<mutex> lock(pushed_lock_);
+    for (const Sample& sample : samples) {
+      pushed_[sample.metric][sample.labels] =
+          Pushed{sample.value, sample.sum, round->at};
+    }
+  }
+
+  if (--round->remaining == 0) {
+    SchedulePush();
   }
+}
+
 
+void GCMExporter::SchedulePush() {
   executor_->Delay(
       seconds(FLAGS_google_compute_monitoring_push_interval_seconds),
       task_.task()->AddChild(bind(&GCMExporter::PushMetrics, this)));
@@ -3,8 +3,12 @@
 
 #include <chrono>
 #include <condition_variable>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include "net/url_fetcher.h"
 #include "util/executor.h"
@@ -13,6 +17,12 @@
 namespace cert_trans {
 
 
+// Pushes the metrics of the Registry to Google Cloud Monitoring
+// every --google_compute_monitoring_push_interval_seconds. Only the
+// series which changed since they were last pushed are sent (along
+// with those unchanged for a while, so that they do not go stale), in
+// batches of up to --google_compute_monitoring_max_timeseries_per_push
+// series, sent in parallel.
 class GCMExporter {
  public:
   GCMExporter(const std::string& instance_name, UrlFetcher* fetcher,
@@ -25,8 +35,21 @@ class GCMExporter {
 
   void CreateMetrics();
 
+  struct Sample;
+  struct PushRound;
+
   void PushMetrics();
-  void PushMetricsDone(UrlFetcher::Response* resp, util::Task* task);
+  void PushBatchDone(const std::shared_ptr<PushRound>& round, size_t batch,
+                     UrlFetcher::Response* resp, util::Task* task);
+  void SchedulePush();
+
+  // What was last pushed of a series: its value (or its count, for a
+  // histogram), its sum (for a histogram), and when.
+  struct Pushed {
+    double value;
+    double sum;
+    std::chrono::system_clock::time_point at;
+  };
 
   const std::string instance_name_;
   UrlFetcher* const fetcher_;
@@ -36,6 +59,16 @@ class GCMExporter {
   std::chrono::system_clock::time_point token_refreshed_at_;
   std::string bearer_token_;
 
+  // By metric name and label values, rather than by metric, as a
+  // metric could be replaced by another at the same address.
+  std::mutex pushed_lock_;
+  std::map<std::string, std::map<std::vector<std::string>, Pushed>> pushed_;
+
+  // The bodies of the requests of a push, kept from one push to the
+  // next so that they do not have to grow again. Only used by
+  // PushMetrics(), which does not run concurrently with itself.
+  std::vector<std::string> bodies_;
+
   friend class GCMExporterTest;
 };
 
@@ -4,6 +4,7 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <memory>
+#include <mutex>
 
 #include "monitoring/monitoring.h"
 #include "net/mock_url_fetcher.h"
@@ -16,6 +17,8 @@ DECLARE_string(google_compute_monitoring_base_url);
 DECLARE_int32(google_compute_monitoring_push_interval_seconds);
 DECLARE_string(google_compute_monitoring_service_account);
 DECLARE_int32(google_compute_monitoring_retry_delay_seconds);
+DECLARE_int32(google_compute_monitoring_max_timeseries_per_push);
+DECLARE_int32(google_compute_monitoring_unchanged_push_interval_seconds);
 
 namespace cert_trans {
 
@@ -34,7 +37,9 @@ const char kCredentialsJson[] =
 
 using std::bind;
 using std::chrono::seconds;
+using std::lock_guard;
 using std::make_pair;
+using std::mutex;
 using std::placeholders::_1;
 using std::placeholders::_2;
 using std::placeholders::_3;
@@ -49,6 +54,7 @@ using testing::InSequence;
 using testing::Invoke;
 using testing::InvokeWithoutArgs;
 using testing::IsEmpty;
+using testing::Not;
 using util::Status;
 using util::SyncTask;
 using util::Task;
@@ -72,6 +78,16 @@ void HandleFetch(Status status, int status_code,
 }
 
 
+int CountTimeseries(const string& body) {
+  int count(0);
+  for (size_t pos(body.find("timeseriesDesc")); pos != string::npos;
+       pos = body.find("timeseriesDesc", pos + 1)) {
+    ++count;
+  }
+  return count;
+}
+
+
 }  // namespace
 
 
@@ -85,6 +101,8 @@ class GCMExporterTest : public ::testing::Test {
     FLAGS_google_compute_monitoring_push_interval_seconds = kPushInterval;
     FLAGS_google_compute_metadata_url = kMetadataUrl;
     FLAGS_google_compute_monitoring_service_account = kServiceAccount;
+    FLAGS_google_compute_monitoring_max_timeseries_per_push = 200;
+    FLAGS_google_compute_monitoring_unchanged_push_interval_seconds = 0;
 
     ON_CALL(fetcher_, Fetch(_, _, _))
         .WillByDefault(Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
@@ -378,6 +396,138 @@ TEST_F(GCMExporterTest, TestRetriesWhenPushingMetricsFails) {
 }
 
 
+TEST_F(GCMExporterTest, TestPushesOnlyChangedSeries) {
+  FLAGS_google_compute_monitoring_unchanged_push_interval_seconds = 3600;
+  std::unique_ptr<Gauge<>> unchanged(Gauge<>::New("unchanged", "help1"));
+  unchanged->Set(1);
+  std::unique_ptr<Gauge<>> changed(Gauge<>::New("changed", "help2"));
+  changed->Set(2);
+
+  SyncTask sync(&pool_);
+
+  EXPECT_CALL(
+      fetcher_,
+      Fetch(IsUrlFetchRequest(
+                UrlFetcher::Verb::GET,
+                URL(string(kMetadataUrl) + "/" + kServiceAccount + "/token"),
+                UrlFetcher::Headers{make_pair("Metadata-Flavor", "Google")},
+                ""),
+            _, _))
+      .WillRepeatedly(
+          Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
+                      UrlFetcher::Headers{}, kCredentialsJson, _1, _2, _3)));
+  EXPECT_CALL(fetcher_,
+              Fetch(IsUrlFetchRequest(
+                        UrlFetcher::Verb::POST, URL(string(metrics_url_)),
+                        UrlFetcher::Headers{
+                            make_pair("Content-Type", "application/json"),
+                            make_pair("Authorization", "Bearer token")},
+                        _),
+                    _, _))
+      .WillRepeatedly(Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
+                                  UrlFetcher::Headers{}, "", _1, _2, _3)));
+  {
+    InSequence s;
+    // Everything goes out the first time, and then only "changed".
+    EXPECT_CALL(fetcher_,
+                Fetch(IsUrlFetchRequest(
+                          UrlFetcher::Verb::POST, URL(push_url_),
+                          UrlFetcher::Headers{
+                              make_pair("Content-Type", "application/json"),
+                              make_pair("Authorization", "Bearer token")},
+                          AllOf(HasSubstr("/ct/unchanged\""),
+                                HasSubstr("/ct/changed\""))),
+                      _, _))
+        .WillOnce(DoAll(InvokeWithoutArgs([&changed] { changed->Set(3); }),
+                        Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
+                                    UrlFetcher::Headers{}, "", _1, _2, _3))));
+    EXPECT_CALL(fetcher_,
+                Fetch(IsUrlFetchRequest(
+                          UrlFetcher::Verb::POST, URL(push_url_),
+                          UrlFetcher::Headers{
+                              make_pair("Content-Type", "application/json"),
+                              make_pair("Authorization", "Bearer token")},
+                          AllOf(Not(HasSubstr("/ct/unchanged\"")),
+                                HasSubstr("/ct/changed\""))),
+                      _, _))
+        .WillOnce(DoAll(InvokeWithoutArgs([&sync] { sync.task()->Return(); }),
+                        Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
+                                    UrlFetcher::Headers{}, "", _1, _2, _3))));
+  }
+  GCMExporter exporter("instance", &fetcher_, &pool_);
+  sync.Wait();
+}
+
+
+TEST_F(GCMExporterTest, TestSplitsPushesIntoBatches) {
+  FLAGS_google_compute_monitoring_max_timeseries_per_push = 1;
+  std::unique_ptr<Counter<>> one(Counter<>::New("one", "help1"));
+  one->Increment();
+  std::unique_ptr<Gauge<>> two(Gauge<>::New("two", "help2"));
+  two->Set(2);
+
+  SyncTask sync(&pool_);
+  mutex lock;
+  vector<string> bodies;
+  bool seen_one(false);
+  bool seen_two(false);
+
+  EXPECT_CALL(
+      fetcher_,
+      Fetch(IsUrlFetchRequest(
+                UrlFetcher::Verb::GET,
+                URL(string(kMetadataUrl) + "/" + kServiceAccount + "/token"),
+                UrlFetcher::Headers{make_pair("Metadata-Flavor", "Google")},
+                ""),
+            _, _))
+      .WillRepeatedly(
+          Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
+                      UrlFetcher::Headers{}, kCredentialsJson, _1, _2, _3)));
+  EXPECT_CALL(fetcher_,
+              Fetch(IsUrlFetchRequest(
+                        UrlFetcher::Verb::POST, URL(string(metrics_url_)),
+                        UrlFetcher::Headers{
+                            make_pair("Content-Type", "application/json"),
+                            make_pair("Authorization", "Bearer token")},
+                        _),
+                    _, _))
+      .WillRepeatedly(Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
+                                  UrlFetcher::Headers{}, "", _1, _2, _3)));
+  EXPECT_CALL(fetcher_,
+              Fetch(IsUrlFetchRequest(
+                        UrlFetcher::Verb::POST, URL(push_url_),
+                        UrlFetcher::Headers{
+                            make_pair("Content-Type", "application/json"),
+                            make_pair("Authorization", "Bearer token")},
+                        _),
+                    _, _))
+      .WillRepeatedly(DoAll(
+          Invoke([&](const UrlFetcher::Request& req, UrlFetcher::Response*,
+                     Task*) {
+            lock_guard<mutex> l(lock);
+            bodies.push_back(req.body);
+            const bool done(seen_one && seen_two);
+            seen_one |= req.body.find("/ct/one\"") != string::npos;
+            seen_two |= req.body.find("/ct/two\"") != string::npos;
+            if (!done && seen_one && seen_two) {
+              sync.task()->Return();
+            }
+          }),
+          Invoke(bind(&HandleFetch, ::util::OkStatus(), 200,
+                      UrlFetcher::Headers{}, "", _1, _2, _3))));
+  {
+    GCMExporter exporter("instance", &fetcher_, &pool_);
+    sync.Wait();
+  }
+
+  lock_guard<mutex> l(lock);
+  EXPECT_LE(2U, bodies.size());
+  for (const auto& body : bodies) {
+    EXPECT_EQ(1, CountTimeseries(body)) << body;
+  }
+}
+
+
 }  // namespace cert_trans
 
 
@@ -0,0 +1,222 @@
+#ifndef CERT_TRANS_MONITORING_HISTOGRAM_H_
+#define CERT_TRANS_MONITORING_HISTOGRAM_H_
+
+#include <glog/logging.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "monitoring/labelled_values.h"
+#include "monitoring/metric.h"
+
+namespace cert_trans {
+
+
+// The buckets of a histogram, for one set of labels, which are
+// updated without any lock.
+//
+// Their bounds grow exponentially, in steps of 1.5x and 2x in turn (0,
+// 1, 2, 3, 4, 6, 8, 12, 16, ..., up to 2^24), so that percentiles can
+// be estimated to within the same ratio whatever the scale of the
+// samples, and there is one more for anything larger.
+class HistogramBuckets {
+ public:
+  HistogramBuckets() {
+    for (auto& count : counts_) {
+      count.store(0, std::memory_order_relaxed);
+    }
+  }
+  HistogramBuckets(const HistogramBuckets&) = delete;
+  HistogramBuckets& operator=(const HistogramBuckets&) = delete;
+
+  // The upper bounds of the buckets, but the last (infinite) one.
+  static const std::vector<double>& Bounds() {
+    static const std::vector<double>* const bounds([]() {
+      std::vector<double>* bounds(new std::vector<double>{0, 1});
+      for (double bound = 2; bound <= 1 << 24; bound *= 2) {
+        bounds->push_back(bound);
+        bounds->push_back(bound * 1.5);
+      }
+      bounds->pop_back();
+      return bounds;
+    }());
+    return *bounds;
+  }
+
+  void Record(double value) {
+    const std::vector<double>& bounds(Bounds());
+    const size_t bucket(std::lower_bound(bounds.begin(), bounds.end(), value) -
+                        bounds.begin());
+    counts_[bucket].fetch_add(1, std::memory_order_relaxed);
+    sum_.IncrementBy(value);
+  }
+
+  // Returns false if nothing was recorded yet.
+  bool Current(Metric::Distribution* distribution) const {
+    Metric::TimestampedValue sum;
+    if (!sum_.Current(&sum)) {
+      return false;
+    }
+
+    const std::vector<double>& bounds(Bounds());
+    distribution->timestamp = sum.first;
+    distribution->sum = sum.second;
+    distribution->count = 0;
+    distribution->buckets.clear();
+    for (size_t i = 0; i < kNumBuckets; ++i) {
+      const uint64_t count(counts_[i].load(std::memory_order_relaxed));
+      distribution->count += count;
+      distribution->buckets.emplace_back(
+          i < bounds.size() ? bounds[i]
+                            : std::numeric_limits<double>::infinity(),
+          count);
+    }
+    return true;
+  }
+
+ private:
+  // The bounds above, and the infinite one.
+  static const size_t kNumBuckets = 2 + 2 * 24;
+
+  std::atomic<uint64_t> counts_[kNumBuckets];
+  LabelledValue sum_;
+};
+
+
+// A metric which records the distribution of samples, such as
+// latencies, in HistogramBuckets (e.g. request_latency_ms).
+template <class... LabelTypes>
+class Histogram : public Metric {
+ public:
+  // The histogram for one set of labels, looked up once, for places
+  // which record samples often. It remains valid for as long as the
+  // Histogram.
+  class Handle {
+   public:
+    void Record(double value) {
+      buckets_->Record(value);
+    }
+
+   private:
+    explicit Handle(HistogramBuckets* buckets)
+        : buckets_(CHECK_NOTNULL(buckets)) {
+    }
+
+    HistogramBuckets* buckets_;
+
+    friend class Histogram;
+  };
+
+  static Histogram<LabelTypes...>* New(
+      const std::string& name,
+      const typename NameType<LabelTypes>::name&... label_names,
+      const std::string& help);
+
+  Histogram(const Histogram&) = delete;
+  Histogram& operator=(const Histogram&) = delete;
+
+  void Record(const LabelTypes&... labels, double value);
+
+  Handle GetHandle(const LabelTypes&... labels);
+
+  std::map<std::vector<std::string>, Metric::TimestampedValue> CurrentValues()
+      const override;
+
+  std::map<std::vector<std::string>, Metric::Distribution>
+  CurrentDistributions() const override;
+
+ private:
+  Histogram(const std::string& name,
+            const typename NameType<LabelTypes>::name&... label_names,
+            const std::string& help);
+
+  HistogramBuckets* GetBuckets(const LabelTypes&... labels);
+
+  mutable std::mutex mutex_;
+  std::map<std::tuple<LabelTypes...>, std::unique_ptr<HistogramBuckets>>
+      buckets_;
+};
+
+
+// static
+template <class... LabelTypes>
+Histogram<LabelTypes...>* Histogram<LabelTypes...>::New(
+    const std::string& name,
+    const typename NameType<LabelTypes>::name&... label_names,
+    const std::string& help) {
+  return new Histogram(name, label_names..., help);
+}
+
+
+template <class... LabelTypes>
+Histogram<LabelTypes...>::Histogram(
+    const std::string& name,
+    const typename NameType<LabelTypes>::name&... label_names,
+    const std::string& help)
+    : Metric(HISTOGRAM, name, {label_names...}, help) {
+}
+
+
+template <class... LabelTypes>
+void Histogram<LabelTypes...>::Record(const LabelTypes&... labels,
+                                      double value) {
+  GetBuckets(labels...)->Record(value);
+}
+
+
+template <class... LabelTypes>
+typename Histogram<LabelTypes...>::Handle Histogram<LabelTypes...>::GetHandle(
+    const LabelTypes&... labels) {
+  return Handle(GetBuckets(labels...));
+}
+
+
+template <class... LabelTypes>
+HistogramBuckets* Histogram<LabelTypes...>::GetBuckets(
+    const LabelTypes&... labels) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::unique_ptr<HistogramBuckets>& buckets(
+      buckets_[std::tuple<LabelTypes...>(labels...)]);
+  if (!buckets) {
+    buckets.reset(new HistogramBuckets);
+  }
+  return buckets.get();
+}
+
+
+template <class... LabelTypes>
+std::map<std::vector<std::string>, Metric::TimestampedValue>
+Histogram<LabelTypes...>::CurrentValues() const {
+  std::map<std::vector<std::string>, Metric::TimestampedValue> ret;
+  for (const auto& distribution : CurrentDistributions()) {
+    ret[distribution.first] = Metric::TimestampedValue(
+        distribution.second.timestamp, distribution.second.count);
+  }
+  return ret;
+}
+
+
+template <class... LabelTypes>
+std::map<std::vector<std::string>, Metric::Distribution>
+Histogram<LabelTypes...>::CurrentDistributions() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::map<std::vector<std::string>, Metric::Distribution> ret;
+  for (const auto& buckets : buckets_) {
+    Metric::Distribution distribution;
+    if (buckets.second->Current(&distribution)) {
+      ret[label_values(buckets.first)] = distribution;
+    }
+  }
+  return ret;
+}
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MONITORING_HISTOGRAM_H_
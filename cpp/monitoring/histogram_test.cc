@@ -0,0 +1,125 @@
+#include "monitoring/histogram.h"
+
+#include <glog/logging.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <limits>
+#include <memory>
+#include <thread>
+
+#include "util/testing.h"
+
+namespace cert_trans {
+
+using std::string;
+using std::thread;
+using std::unique_ptr;
+using std::vector;
+using testing::ElementsAre;
+
+
+uint64_t CountUpTo(const Metric::Distribution& distribution, double bound) {
+  uint64_t count(0);
+  for (const auto& bucket : distribution.buckets) {
+    if (bucket.first > bound) {
+      break;
+    }
+    count += bucket.second;
+  }
+  return count;
+}
+
+
+TEST(HistogramTest, TestHistogramType) {
+  unique_ptr<Histogram<>> histogram(Histogram<>::New("name", "help"));
+  EXPECT_EQ(Metric::HISTOGRAM, histogram->Type());
+}
+
+
+TEST(HistogramTest, TestEmpty) {
+  unique_ptr<Histogram<string>> histogram(
+      Histogram<string>::New("name", "label", "help"));
+  EXPECT_TRUE(histogram->CurrentDistributions().empty());
+  EXPECT_TRUE(histogram->CurrentValues().empty());
+}
+
+
+TEST(HistogramTest, TestBuckets) {
+  unique_ptr<Histogram<>> histogram(Histogram<>::New("name", "help"));
+  histogram->Record(0);
+  histogram->Record(1);
+  histogram->Record(2.5);
+  histogram->Record(3);
+  histogram->Record(100);
+  histogram->Record(1e9);
+
+  const Metric::Distribution distribution(
+      histogram->CurrentDistributions().at({}));
+  EXPECT_EQ(6U, distribution.count);
+  EXPECT_DOUBLE_EQ(1e9 + 106.5, distribution.sum);
+  EXPECT_EQ(1U, CountUpTo(distribution, 0));
+  EXPECT_EQ(2U, CountUpTo(distribution, 1));
+  EXPECT_EQ(2U, CountUpTo(distribution, 2));
+  EXPECT_EQ(4U, CountUpTo(distribution, 3));
+  EXPECT_EQ(4U, CountUpTo(distribution, 96));
+  EXPECT_EQ(5U, CountUpTo(distribution, 128));
+  EXPECT_EQ(5U, CountUpTo(distribution, 1 << 24));
+  EXPECT_EQ(std::numeric_limits<double>::infinity(),
+            distribution.buckets.back().first);
+  EXPECT_EQ(1U, distribution.buckets.back().second);
+
+  EXPECT_EQ(6, histogram->CurrentValues().at({}).second);
+}
+
+
+TEST(HistogramTest, TestLabels) {
+  unique_ptr<Histogram<string, int>> histogram(
+      Histogram<string, int>::New("name", "one", "two", "help"));
+  histogram->Record("a", 1, 5);
+  histogram->Record("a", 1, 7);
+  histogram->Record("b", 2, 5);
+
+  const auto distributions(histogram->CurrentDistributions());
+  ASSERT_EQ(2U, distributions.size());
+  EXPECT_EQ(2U, distributions.at({"a", "1"}).count);
+  EXPECT_EQ(12, distributions.at({"a", "1"}).sum);
+  EXPECT_EQ(1U, distributions.at({"b", "2"}).count);
+}
+
+
+TEST(HistogramTest, TestHandleFromManyThreads) {
+  unique_ptr<Histogram<string>> histogram(
+      Histogram<string>::New("name", "label", "help"));
+  Histogram<string>::Handle handle(histogram->GetHandle("a"));
+
+  const int kNumThreads(8);
+  const int kNumRecords(10000);
+  vector<thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&handle]() {
+      for (int j = 0; j < kNumRecords; ++j) {
+        handle.Record(j % 10);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  const Metric::Distribution distribution(
+      histogram->CurrentDistributions().at({"a"}));
+  EXPECT_EQ(static_cast<uint64_t>(kNumThreads * kNumRecords),
+            distribution.count);
+  EXPECT_DOUBLE_EQ(kNumThreads * kNumRecords * 4.5, distribution.sum);
+  EXPECT_EQ(static_cast<uint64_t>(kNumThreads * kNumRecords / 10),
+            CountUpTo(distribution, 0));
+}
+
+
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
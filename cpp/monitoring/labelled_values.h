@@ -2,8 +2,12 @@
 #define CERT_TRANS_MONITORING_LABELLED_VALUES_H_
 
 #include <glog/logging.h>
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <map>
+#include <memory>
 #include <mutex>
 
 #include "monitoring/metric.h"
@@ -11,6 +15,94 @@
 namespace cert_trans {
 
 
+// The value of a metric for one set of labels, which is updated
+// without any lock. Increments go to one of a few shards, picked by
+// thread, so that threads updating the same value do not contend on
+// it, and the shards are only added up when the value is read.
+class LabelledValue {
+ public:
+  LabelledValue() {
+    for (Shard& shard : shards_) {
+      shard.value.store(0, std::memory_order_relaxed);
+      shard.timestamp.store(0, std::memory_order_relaxed);
+    }
+  }
+  LabelledValue(const LabelledValue&) = delete;
+  LabelledValue& operator=(const LabelledValue&) = delete;
+
+  // Increments made by other threads at the same time can be lost,
+  // so values are expected to be either set or incremented, not both.
+  void Set(double value) {
+    for (int i = 1; i < kNumShards; ++i) {
+      shards_[i].value.store(0, std::memory_order_relaxed);
+    }
+    shards_[0].value.store(value, std::memory_order_relaxed);
+    shards_[0].timestamp.store(Now(), std::memory_order_relaxed);
+  }
+
+  void IncrementBy(double amount) {
+    Shard& shard(shards_[ShardIndex()]);
+    double value(shard.value.load(std::memory_order_relaxed));
+    while (!shard.value.compare_exchange_weak(value, value + amount,
+                                              std::memory_order_relaxed)) {
+    }
+    shard.timestamp.store(Now(), std::memory_order_relaxed);
+  }
+
+  double Get() const {
+    double value(0);
+    for (const Shard& shard : shards_) {
+      value += shard.value.load(std::memory_order_relaxed);
+    }
+    return value;
+  }
+
+  // Returns false if the value was never set or incremented.
+  bool Current(Metric::TimestampedValue* value) const {
+    int64_t timestamp(0);
+    for (const Shard& shard : shards_) {
+      timestamp =
+          std::max(timestamp, shard.timestamp.load(std::memory_order_relaxed));
+    }
+    if (timestamp == 0) {
+      return false;
+    }
+    value->first = std::chrono::system_clock::time_point(
+        std::chrono::system_clock::duration(timestamp));
+    value->second = Get();
+    return true;
+  }
+
+ private:
+  static const int kNumShards = 8;
+
+  // Each on a cache line of its own.
+  struct Shard {
+    std::atomic<double> value;
+    // The last update, in system_clock ticks, or 0.
+    std::atomic<int64_t> timestamp;
+    char padding[64 - sizeof(std::atomic<double>) -
+                 sizeof(std::atomic<int64_t>)];
+  };
+
+  static int64_t Now() {
+    return std::chrono::system_clock::now().time_since_epoch().count();
+  }
+
+  // Threads are given shards in turn, the first time they use one.
+  static int ShardIndex() {
+    static std::atomic<int> next_shard(0);
+    static thread_local const int shard(next_shard++ % kNumShards);
+    return shard;
+  }
+
+  Shard shards_[kNumShards];
+};
+
+
+// The values of a metric, by labels. Looking up a value takes a lock,
+// but it can be looked up once with GetValue(), and then updated
+// without any.
 template <class... LabelTypes>
 class LabelledValues {
  public:
@@ -27,6 +119,10 @@ class LabelledValues {
 
   void IncrementBy(const LabelTypes&..., double value);
 
+  // Returns the value for |labels|, which remains valid for as long as
+  // this object. It is only reported once it is set or incremented.
+  LabelledValue* GetValue(const LabelTypes&... labels);
+
   std::map<std::vector<std::string>, Metric::TimestampedValue> CurrentValues()
       const;
 
@@ -34,8 +130,8 @@ class LabelledValues {
   const std::string name_;
   const std::vector<std::string> label_names_;
   mutable std::mutex mutex_;
-  std::map<std::tuple<LabelTypes...>,
-           std::pair<std::chrono::system_clock::time_point, double>> values_;
+  std::map<std::tuple<LabelTypes...>, std::unique_ptr<LabelledValue>>
+      values_;
 };
 
 
@@ -87,16 +183,14 @@ double LabelledValues<LabelTypes...>::Get(const LabelTypes&... labels) const {
   if (it == values_.end()) {
     return 0;
   }
-  return it->second.second;
+  return it->second->Get();
 }
 
 
 template <class... LabelTypes>
 void LabelledValues<LabelTypes...>::Set(const LabelTypes&... labels,
                                         double value) {
-  std::lock_guard<std::mutex> lock(mutex_);
-  values_[std::tuple<LabelTypes...>(labels...)] =
-      make_pair(std::chrono::system_clock::now(), value);
+  GetValue(labels...)->Set(value);
 }
 
 
@@ -109,15 +203,20 @@ void LabelledValues<LabelTypes...>::Increment(const LabelTypes&... labels) {
 template <class... LabelTypes>
 void LabelledValues<LabelTypes...>::IncrementBy(const LabelTypes&... labels,
                                                 double amount) {
+  GetValue(labels...)->IncrementBy(amount);
+}
+
+
+template <class... LabelTypes>
+LabelledValue* LabelledValues<LabelTypes...>::GetValue(
+    const LabelTypes&... labels) {
   std::lock_guard<std::mutex> lock(mutex_);
-  const std::tuple<LabelTypes...> key(labels...);
-  const auto it(values_.find(key));
-  if (it == values_.end()) {
-    values_[key] = make_pair(std::chrono::system_clock::now(), amount);
-    return;
+  std::unique_ptr<LabelledValue>& value(
+      values_[std::tuple<LabelTypes...>(labels...)]);
+  if (!value) {
+    value.reset(new LabelledValue);
   }
-  values_[key] = make_pair(std::chrono::system_clock::now(),
-                           values_[key].second + amount);
+  return value.get();
 }
 
 
@@ -128,7 +227,10 @@ LabelledValues<LabelTypes...>::CurrentValues() const {
   std::map<std::vector<std::string>, Metric::TimestampedValue> ret;
 
   for (const auto& v : values_) {
-    ret[label_values(v.first)] = v.second;
+    Metric::TimestampedValue value;
+    if (v.second->Current(&value)) {
+      ret[label_values(v.first)] = value;
+    }
   }
   return ret;
 }
@@ -3,9 +3,11 @@
 
 #include <string>
 
-#include "monitoring/counter.h"
-#include "monitoring/event_metric.h"
+#include <memory>
+
+#include "monitoring/histogram.h"
 #include "monitoring/monitoring.h"
+#include "util/trace.h"
 
 namespace cert_trans {
 
@@ -13,21 +15,22 @@ class ScopedLatency;
 
 
 // A helper class for monitoring latency.
-// This class creates two Counter metrics, one called "|base_name|_overall_sum"
-// which contains the sum of all latencies broken down by labels, and another
-// called "|base_name|_count" which contains the number of latency measurements
-// taken, also broken down by labels.
+// This class creates a Histogram metric called "|base_name|", which contains
+// the distribution of latencies broken down by labels, along with their sum
+// and the number of latency measurements taken, so that percentiles can be
+// estimated from it (exported to Prometheus as "|base_name|_bucket",
+// "|base_name|_sum" and "|base_name|_count").
 //
 // To actually measure latency, you can either call RecordLatency() directly
 // with a latency sample, or use the ScopedLatency() method to return an object
 // which will automatically add a latency measurement consisting of the
 // duration between the call to ScopedLatency() and the destruction of the
-// returned object.
+// returned object. Within a trace (see util/trace.h), the latter is also
+// recorded as a span named "|base_name|", tagged with the labels.
 //
 // The |TimeUnit| template parameter is used to specify the unit of the values
-// added to the counter, e.g. specifying std::chrono::milliseconds will
-// duration_cast all recorded latencies to milliseconds before adding to the
-// total count.
+// recorded in the histogram, e.g. specifying std::chrono::milliseconds will
+// record all latencies in (fractional) milliseconds.
 //
 // |LabelTypes...| works as in the Counter<> and Gauge<> templates.
 //
@@ -67,7 +70,7 @@ class Latency {
   ScopedLatency GetScopedLatency(const LabelTypes&... labels);
 
  private:
-  EventMetric<LabelTypes...> metric_;
+  const std::unique_ptr<Histogram<LabelTypes...>> metric_;
 };
 
 
@@ -86,13 +89,16 @@ class ScopedLatency {
 
  private:
   ScopedLatency(
-      const std::function<void(std::chrono::duration<double>)>& record_latency)
+      const std::function<void(std::chrono::duration<double>)>& record_latency,
+      util::trace::Span&& span)
       : record_latency_(record_latency),
-        start_(std::chrono::steady_clock::now()) {
+        start_(std::chrono::steady_clock::now()),
+        span_(std::move(span)) {
   }
 
   const std::function<void(std::chrono::duration<double>)> record_latency_;
   const std::chrono::steady_clock::time_point start_;
+  util::trace::Span span_;
 
   template <class TimeUnit, class... LabelTypes>
   friend class Latency;
@@ -104,24 +110,36 @@ Latency<TimeUnit, LabelTypes...>::Latency(
     const std::string& base_name,
     const typename NameType<LabelTypes>::name&... label_names,
     const std::string& help)
-    : metric_(base_name, label_names..., help) {
+    : metric_(Histogram<LabelTypes...>::New(base_name, label_names..., help)) {
 }
 
 
 template <class TimeUnit, class... LabelTypes>
 void Latency<TimeUnit, LabelTypes...>::RecordLatency(
     const LabelTypes&... labels, std::chrono::duration<double> latency) {
-  metric_.RecordEvent(labels...,
-                      std::chrono::duration_cast<TimeUnit>(latency).count());
+  metric_->Record(
+      labels...,
+      std::chrono::duration<double, typename TimeUnit::period>(latency)
+          .count());
 }
 
 
 template <class TimeUnit, class... LabelTypes>
 ScopedLatency Latency<TimeUnit, LabelTypes...>::GetScopedLatency(
     const LabelTypes&... labels) {
+  util::trace::Span span(metric_->Name());
+  if (span.context().traced()) {
+    const std::vector<std::string> values(
+        label_values(std::tuple<LabelTypes...>(labels...)));
+    for (size_t i = 0; i < values.size(); ++i) {
+      span.AddTag(metric_->LabelName(i), values[i]);
+    }
+  }
+
   return cert_trans::ScopedLatency(
       std::bind(&Latency<TimeUnit, LabelTypes...>::RecordLatency, this,
-                labels..., std::placeholders::_1));
+                labels..., std::placeholders::_1),
+      std::move(span));
 }
 
 
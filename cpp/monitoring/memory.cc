@@ -0,0 +1,44 @@
+#include "monitoring/memory.h"
+
+using std::string;
+
+namespace cert_trans {
+namespace {
+
+
+static Gauge<string>* memory_bytes(
+    Gauge<string>::New("memory_bytes", "component",
+                       "Bytes of memory held by each component of the "
+                       "server, as it accounts for it."));
+
+
+}  // namespace
+
+
+MemoryAccount::MemoryAccount(const string& component)
+    : bytes_(0), gauge_(memory_bytes->GetHandle(component)) {
+}
+
+
+MemoryAccount::~MemoryAccount() {
+  Set(0);
+}
+
+
+void MemoryAccount::Set(int64_t bytes) {
+  const int64_t old_bytes(bytes_.exchange(bytes));
+  if (old_bytes != bytes) {
+    gauge_.IncrementBy(bytes - old_bytes);
+  }
+}
+
+
+void MemoryAccount::Add(int64_t bytes) {
+  if (bytes != 0) {
+    bytes_ += bytes;
+    gauge_.IncrementBy(bytes);
+  }
+}
+
+
+}  // namespace cert_trans
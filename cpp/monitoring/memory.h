@@ -0,0 +1,52 @@
+#ifndef CERT_TRANS_MONITORING_MEMORY_H_
+#define CERT_TRANS_MONITORING_MEMORY_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+#include "monitoring/gauge.h"
+
+namespace cert_trans {
+
+
+// The memory held by one instance of a component of the server (such
+// as a Merkle tree, or an index), as it accounts for it, reported in
+// the metric
+//
+//   memory_bytes  bytes held, by component, summed over its instances
+//
+// so that the RSS of a server can be told apart without a heap
+// profile. Components count their main allocations (the capacity of
+// their tables, the size of the entries they keep...), not every
+// byte, and only update their account as those change. What an
+// instance accounted for is taken out of the metric on destruction.
+//
+// This class is thread-safe.
+class MemoryAccount {
+ public:
+  explicit MemoryAccount(const std::string& component);
+  ~MemoryAccount();
+  MemoryAccount(const MemoryAccount&) = delete;
+  MemoryAccount& operator=(const MemoryAccount&) = delete;
+
+  int64_t bytes() const {
+    return bytes_.load();
+  }
+
+  // Sets the bytes held by this instance to |bytes|. Cheap when they
+  // have not changed, so it can be called on every update.
+  void Set(int64_t bytes);
+
+  // Adds |bytes|, which can be negative, to those held.
+  void Add(int64_t bytes);
+
+ private:
+  std::atomic<int64_t> bytes_;
+  Gauge<std::string>::Handle gauge_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MONITORING_MEMORY_H_
@@ -0,0 +1,67 @@
+#include "monitoring/memory.h"
+
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+
+#include "monitoring/registry.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::unique_ptr;
+
+
+double MemoryBytes(const string& component) {
+  for (const Metric* metric : Registry::Instance()->GetMetrics()) {
+    if (metric->Name() == "memory_bytes") {
+      const auto values(metric->CurrentValues());
+      const auto it(values.find({component}));
+      return it == values.end() ? -1 : it->second.second;
+    }
+  }
+  return -1;
+}
+
+
+TEST(MemoryAccountTest, SumsInstances) {
+  MemoryAccount first("sums");
+  first.Set(100);
+  EXPECT_EQ(100, first.bytes());
+  EXPECT_EQ(100, MemoryBytes("sums"));
+
+  unique_ptr<MemoryAccount> second(new MemoryAccount("sums"));
+  second->Add(30);
+  second->Add(-10);
+  EXPECT_EQ(20, second->bytes());
+  EXPECT_EQ(120, MemoryBytes("sums"));
+
+  first.Set(50);
+  EXPECT_EQ(70, MemoryBytes("sums"));
+
+  // Its bytes go with it.
+  second.reset();
+  EXPECT_EQ(50, MemoryBytes("sums"));
+}
+
+
+TEST(MemoryAccountTest, KeepsComponentsApart) {
+  MemoryAccount first("first");
+  MemoryAccount second("second");
+  first.Set(1);
+  second.Set(2);
+  EXPECT_EQ(1, MemoryBytes("first"));
+  EXPECT_EQ(2, MemoryBytes("second"));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
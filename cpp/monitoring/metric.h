@@ -1,6 +1,8 @@
 #ifndef CERT_TRANS_MONITORING_METRIC_H_
 #define CERT_TRANS_MONITORING_METRIC_H_
 
+#include <stdint.h>
+#include <chrono>
 #include <map>
 #include <ostream>
 #include <set>
@@ -26,9 +28,21 @@ class Metric {
   typedef std::pair<std::chrono::system_clock::time_point, double>
       TimestampedValue;
 
+  // The samples recorded by a HISTOGRAM metric, for one set of labels.
+  struct Distribution {
+    std::chrono::system_clock::time_point timestamp;
+    uint64_t count;
+    double sum;
+    // The upper bound of each bucket (inclusive), in increasing order,
+    // and the number of samples in it (not counting the ones in the
+    // buckets before it). The last bound is infinite.
+    std::vector<std::pair<double, uint64_t>> buckets;
+  };
+
   enum Type {
     COUNTER,
     GAUGE,
+    HISTOGRAM,
   };
 
   Type Type() const {
@@ -62,9 +76,16 @@ class Metric {
 
   // TODO(alcutter): Not over the moon about having this here, but it'll do for
   // now.
+  // For HISTOGRAM metrics, these are the number of samples.
   virtual std::map<std::vector<std::string>, TimestampedValue> CurrentValues()
       const = 0;
 
+  // Only HISTOGRAM metrics have distributions.
+  virtual std::map<std::vector<std::string>, Distribution>
+  CurrentDistributions() const {
+    return std::map<std::vector<std::string>, Distribution>();
+  }
+
  protected:
   Metric(enum Type type, const std::string& name,
          const std::vector<std::string>& label_names, const std::string& help)
@@ -1,18 +1,160 @@
 #include "monitoring/prometheus/exporter.h"
+
+#include <gflags/gflags.h>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+
 #include "monitoring/metric.h"
 #include "monitoring/prometheus/metrics.pb.h"
 #include "monitoring/registry.h"
 
 using std::chrono::duration_cast;
 using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::chrono::system_clock;
+using std::lock_guard;
 using std::map;
+using std::mutex;
 using std::set;
+using std::shared_ptr;
 using std::string;
+using std::to_string;
 using std::vector;
 
+DEFINE_int32(prometheus_text_cache_ms, 1000,
+             "how long the metrics rendered in the Prometheus text format "
+             "are served to further scrapes before being rendered again");
+
 namespace cert_trans {
 namespace {
 
+
+// Escapes backslashes and newlines, and double quotes too in label
+// values, as the text format requires.
+void AppendEscaped(const string& s, bool label_value, string* out) {
+  for (const char c : s) {
+    if (c == '\\') {
+      out->append("\\\\");
+    } else if (c == '\n') {
+      out->append("\\n");
+    } else if (c == '"' && label_value) {
+      out->append("\\\"");
+    } else {
+      out->push_back(c);
+    }
+  }
+}
+
+
+void AppendDouble(double value, string* out) {
+  if (std::isnan(value)) {
+    out->append("NaN");
+    return;
+  }
+  if (std::isinf(value)) {
+    out->append(value > 0 ? "+Inf" : "-Inf");
+    return;
+  }
+  // Use the shortest of the two precisions which round-trips.
+  char buf[32];
+  int len(snprintf(buf, sizeof(buf), "%.15g", value));
+  if (strtod(buf, nullptr) != value) {
+    len = snprintf(buf, sizeof(buf), "%.17g", value);
+  }
+  out->append(buf, len);
+}
+
+
+// Appends a sample line, such as 'name_suffix{a="x",le="1"} 2 1234',
+// where the "le" label is only added if |le| is not null.
+void AppendSample(const string& name, const char* suffix,
+                  const vector<string>& label_names,
+                  const vector<string>& label_values, const double* le,
+                  double value, const system_clock::time_point& timestamp,
+                  string* out) {
+  CHECK_EQ(label_names.size(), label_values.size());
+  out->append(name);
+  out->append(suffix);
+  if (!label_names.empty() || le) {
+    out->push_back('{');
+    for (size_t i(0); i < label_names.size(); ++i) {
+      if (i > 0) {
+        out->push_back(',');
+      }
+      out->append(label_names[i]);
+      out->append("=\"");
+      AppendEscaped(label_values[i], true /* label_value */, out);
+      out->push_back('"');
+    }
+    if (le) {
+      out->append(label_names.empty() ? "le=\"" : ",le=\"");
+      AppendDouble(*le, out);
+      out->push_back('"');
+    }
+    out->push_back('}');
+  }
+  out->push_back(' ');
+  AppendDouble(value, out);
+  out->push_back(' ');
+  out->append(to_string(
+      duration_cast<milliseconds>(timestamp.time_since_epoch()).count()));
+  out->push_back('\n');
+}
+
+
+void AppendMetricText(const Metric& metric, string* out) {
+  out->append("# HELP ");
+  out->append(metric.Name());
+  out->push_back(' ');
+  AppendEscaped(metric.Help(), false /* label_value */, out);
+  out->append("\n# TYPE ");
+  out->append(metric.Name());
+  switch (metric.Type()) {
+    case Metric::COUNTER:
+      out->append(" counter\n");
+      break;
+    case Metric::GAUGE:
+      out->append(" gauge\n");
+      break;
+    case Metric::HISTOGRAM:
+      out->append(" histogram\n");
+      break;
+    default:
+      LOG(FATAL) << "Unknown metric type: " << metric.Type();
+  }
+
+  const vector<string>& label_names(metric.LabelNames());
+  if (metric.Type() != Metric::HISTOGRAM) {
+    for (const auto& value : metric.CurrentValues()) {
+      AppendSample(metric.Name(), "", label_names, value.first, nullptr,
+                   value.second.second, value.second.first, out);
+    }
+    return;
+  }
+
+  for (const auto& distribution : metric.CurrentDistributions()) {
+    const Metric::Distribution& d(distribution.second);
+    uint64_t cumulative_count(0);
+    for (const auto& bucket : d.buckets) {
+      cumulative_count += bucket.second;
+      AppendSample(metric.Name(), "_bucket", label_names, distribution.first,
+                   &bucket.first, cumulative_count, d.timestamp, out);
+    }
+    AppendSample(metric.Name(), "_sum", label_names, distribution.first,
+                 nullptr, d.sum, d.timestamp, out);
+    AppendSample(metric.Name(), "_count", label_names, distribution.first,
+                 nullptr, d.count, d.timestamp, out);
+  }
+}
+
+
+mutex cached_text_lock;
+shared_ptr<string>* cached_text(new shared_ptr<string>);
+steady_clock::time_point cached_text_time;
+
+
 void AddLabelTypes(::io::prometheus::client::Metric* metric,
                    const std::vector<std::string>& names,
                    const std::vector<std::string>& values) {
@@ -26,6 +168,29 @@ void AddLabelTypes(::io::prometheus::client::Metric* metric,
 }
 
 
+void PopulateHistograms(const Metric& metric,
+                        ::io::prometheus::client::MetricFamily* family) {
+  const vector<string> label_names(metric.LabelNames());
+  for (const auto& distribution : metric.CurrentDistributions()) {
+    io::prometheus::client::Metric* m(family->add_metric());
+    AddLabelTypes(m, label_names, distribution.first);
+    m->set_timestamp_ms(duration_cast<milliseconds>(
+                            distribution.second.timestamp.time_since_epoch())
+                            .count());
+    io::prometheus::client::Histogram* const histogram(m->mutable_histogram());
+    histogram->set_sample_count(distribution.second.count);
+    histogram->set_sample_sum(distribution.second.sum);
+    uint64_t cumulative_count(0);
+    for (const auto& bucket : distribution.second.buckets) {
+      cumulative_count += bucket.second;
+      io::prometheus::client::Bucket* const b(histogram->add_bucket());
+      b->set_upper_bound(bucket.first);
+      b->set_cumulative_count(cumulative_count);
+    }
+  }
+}
+
+
 ::io::prometheus::client::MetricFamily PopulateMetricFamily(
     const Metric& metric) {
   ::io::prometheus::client::MetricFamily family;
@@ -38,6 +203,10 @@ void AddLabelTypes(::io::prometheus::client::Metric* metric,
     case Metric::GAUGE:
       family.set_type(io::prometheus::client::MetricType::GAUGE);
       break;
+    case Metric::HISTOGRAM:
+      family.set_type(io::prometheus::client::MetricType::HISTOGRAM);
+      PopulateHistograms(metric, &family);
+      return family;
     default:
       LOG(FATAL) << "Unknown metric type: " << metric.Type();
   }
@@ -79,6 +248,36 @@ void ExportMetricsToPrometheus(std::ostream* os) {
 }
 
 
+void ExportMetricsToPrometheusText(string* out) {
+  CHECK_NOTNULL(out)->clear();
+  for (const Metric* metric : Registry::Instance()->GetMetrics()) {
+    AppendMetricText(*metric, out);
+  }
+}
+
+
+shared_ptr<const string> CachedPrometheusText() {
+  // Concurrent scrapes wait for the one rendering, and share its
+  // result.
+  lock_guard<mutex> lock(cached_text_lock);
+  const steady_clock::time_point now(steady_clock::now());
+  if (*cached_text &&
+      now - cached_text_time <
+          milliseconds(FLAGS_prometheus_text_cache_ms)) {
+    return *cached_text;
+  }
+
+  // Render into the previous buffer, unless a scrape is still sending
+  // it (new references are only taken under the lock).
+  if (!*cached_text || cached_text->use_count() > 1) {
+    cached_text->reset(new string);
+  }
+  ExportMetricsToPrometheusText(cached_text->get());
+  cached_text_time = now;
+  return *cached_text;
+}
+
+
 void ExportMetricsToHtml(std::ostream* os) {
   const set<const Metric*> metrics(Registry::Instance()->GetMetrics());
   *os << "<html>\n"
@@ -2,6 +2,9 @@
 #define CERT_TRANS_MONITORING_PROMETHEUS_H_
 
 #include <glog/logging.h>
+#include <memory>
+#include <ostream>
+#include <string>
 
 #include "util/protobuf_util.h"
 
@@ -10,6 +13,17 @@ namespace cert_trans {
 void ExportMetricsToPrometheus(std::ostream* os);
 
 
+// Writes all the metrics in the Prometheus text format (version
+// 0.0.4) to |out|, replacing its contents but reusing its buffer.
+void ExportMetricsToPrometheusText(std::string* out);
+
+
+// Returns the output of ExportMetricsToPrometheusText(), rendered at
+// most --prometheus_text_cache_ms ago, so that frequent or concurrent
+// scrapes share the work of rendering it.
+std::shared_ptr<const std::string> CachedPrometheusText();
+
+
 void ExportMetricsToHtml(std::ostream* os);
 
 
@@ -0,0 +1,101 @@
+#include "monitoring/prometheus/exporter.h"
+
+#include <gflags/gflags.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+
+#include "monitoring/monitoring.h"
+#include "util/testing.h"
+
+DECLARE_int32(prometheus_text_cache_ms);
+
+namespace cert_trans {
+
+using std::shared_ptr;
+using std::string;
+using std::unique_ptr;
+using testing::ContainsRegex;
+using testing::HasSubstr;
+using testing::Not;
+
+
+class PrometheusExporterTest : public ::testing::Test {
+ public:
+  void TearDown() {
+    Registry::Instance()->ResetForTestingOnly();
+  }
+};
+
+
+TEST_F(PrometheusExporterTest, TestCounterAndGauge) {
+  unique_ptr<Counter<>> counter(Counter<>::New("requests", "Some\nhelp."));
+  unique_ptr<Gauge<string, int>> gauge(
+      Gauge<string, int>::New("size", "name", "shard", "Sizes."));
+  counter->IncrementBy(3);
+  gauge->Set("a\"b", 1, 0.5);
+
+  string text;
+  ExportMetricsToPrometheusText(&text);
+  EXPECT_THAT(text, HasSubstr("# HELP requests Some\\nhelp.\n"
+                              "# TYPE requests counter\n"));
+  EXPECT_THAT(text, ContainsRegex("\nrequests 3 [0-9]+\n"));
+  EXPECT_THAT(text, HasSubstr("# HELP size Sizes.\n"
+                              "# TYPE size gauge\n"));
+  EXPECT_THAT(text,
+              ContainsRegex("\nsize\\{name=\"a\\\\\"b\",shard=\"1\"\\} 0\\.5 "
+                            "[0-9]+\n"));
+}
+
+
+TEST_F(PrometheusExporterTest, TestHistogram) {
+  unique_ptr<Histogram<string>> histogram(
+      Histogram<string>::New("latency", "path", "Latencies."));
+  histogram->Record("/a", 1);
+  histogram->Record("/a", 5);
+
+  string text;
+  ExportMetricsToPrometheusText(&text);
+  EXPECT_THAT(text, HasSubstr("# TYPE latency histogram\n"));
+  EXPECT_THAT(text, ContainsRegex("\nlatency_bucket\\{path=\"/a\",le=\"0\"\\} "
+                                  "0 [0-9]+\n"));
+  EXPECT_THAT(text, ContainsRegex("\nlatency_bucket\\{path=\"/a\",le=\"1\"\\} "
+                                  "1 [0-9]+\n"));
+  EXPECT_THAT(text, ContainsRegex("\nlatency_bucket\\{path=\"/a\",le=\"6\"\\} "
+                                  "2 [0-9]+\n"));
+  EXPECT_THAT(text,
+              ContainsRegex("\nlatency_bucket\\{path=\"/a\",le=\"\\+Inf\"\\} "
+                            "2 [0-9]+\n"));
+  EXPECT_THAT(text, ContainsRegex("\nlatency_sum\\{path=\"/a\"\\} 6 [0-9]+\n"));
+  EXPECT_THAT(text,
+              ContainsRegex("\nlatency_count\\{path=\"/a\"\\} 2 [0-9]+\n"));
+}
+
+
+TEST_F(PrometheusExporterTest, TestCachedText) {
+  unique_ptr<Counter<>> counter(Counter<>::New("requests", "Requests."));
+  counter->Increment();
+
+  FLAGS_prometheus_text_cache_ms = 60 * 1000;
+  const shared_ptr<const string> first(CachedPrometheusText());
+  counter->Increment();
+  // Still served from the cache.
+  EXPECT_EQ(first, CachedPrometheusText());
+
+  FLAGS_prometheus_text_cache_ms = 0;
+  const shared_ptr<const string> second(CachedPrometheusText());
+  EXPECT_NE(first, second);
+  EXPECT_THAT(*first, ContainsRegex("\nrequests 1 "));
+  EXPECT_THAT(*second, ContainsRegex("\nrequests 2 "));
+  EXPECT_THAT(*second, Not(ContainsRegex("\nrequests 1 ")));
+}
+
+
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,218 @@
+#include "monitoring/startup.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::lock_guard;
+using std::mutex;
+using std::ostringstream;
+using std::string;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+static Gauge<string>* startup_phase_done(
+    Gauge<string>::New("startup_phase_done", "phase",
+                       "Units of work (entries, leaves...) done so far by "
+                       "each phase of the startup."));
+static Gauge<string>* startup_phase_total(
+    Gauge<string>::New("startup_phase_total", "phase",
+                       "Units of work to be done by each phase of the "
+                       "startup, where known."));
+static Gauge<string>* startup_phase_eta_seconds(
+    Gauge<string>::New("startup_phase_eta_seconds", "phase",
+                       "Estimated time left for each phase of the startup, "
+                       "where its total work is known."));
+static Gauge<string>* startup_phase_duration_ms(
+    Gauge<string>::New("startup_phase_duration_ms", "phase",
+                       "How long each phase of the startup took."));
+static Gauge<>* startup_complete(
+    Gauge<>::New("startup_complete",
+                 "1 once the server has started, and is ready to serve."));
+static Gauge<>* startup_duration_ms(
+    Gauge<>::New("startup_duration_ms",
+                 "How long the server took to start, once it has."));
+
+// The progress of a phase is only reported every so many units of
+// work (or every thousandth of them, if their total is known), and
+// only logged every so often.
+const int64_t kReportEvery = 4096;
+const int64_t kReportsPerPhase = 1000;
+const seconds kLogEvery(10);
+
+const steady_clock::time_point process_start(steady_clock::now());
+
+
+struct PhaseRecord {
+  string name;
+  steady_clock::time_point start;
+  steady_clock::time_point last_logged;
+  bool ended;
+  steady_clock::duration duration;
+  int64_t done;
+  int64_t total;
+};
+
+
+mutex phases_lock;
+vector<PhaseRecord>* phases(new vector<PhaseRecord>);
+std::atomic<bool> complete(false);
+
+
+int AddPhase(const string& name) {
+  lock_guard<mutex> lock(phases_lock);
+  phases->emplace_back();
+  PhaseRecord* const phase(&phases->back());
+  phase->name = name;
+  phase->start = phase->last_logged = steady_clock::now();
+  phase->ended = false;
+  phase->duration = steady_clock::duration::zero();
+  phase->done = 0;
+  phase->total = 0;
+  LOG(INFO) << "Startup phase " << name << " started";
+  return phases->size() - 1;
+}
+
+
+string DescribeWork(int64_t done, int64_t total) {
+  ostringstream out;
+  out << done;
+  if (total > 0) {
+    out << " of " << total;
+  }
+  return out.str();
+}
+
+
+}  // namespace
+
+
+StartupPhase::StartupPhase(const string& name)
+    : index_(AddPhase(name)),
+      start_(steady_clock::now()),
+      done_(0),
+      total_(0),
+      report_every_(kReportEvery),
+      done_gauge_(startup_phase_done->GetHandle(name)),
+      eta_gauge_(startup_phase_eta_seconds->GetHandle(name)) {
+  done_gauge_.Set(0);
+}
+
+
+StartupPhase::~StartupPhase() {
+  const steady_clock::duration duration(steady_clock::now() - start_);
+  const int64_t done(done_.load());
+  lock_guard<mutex> lock(phases_lock);
+  PhaseRecord* const phase(&(*phases)[index_]);
+  phase->ended = true;
+  phase->duration = duration;
+  phase->done = done;
+  done_gauge_.Set(done);
+  eta_gauge_.Set(0);
+  const milliseconds elapsed(duration_cast<milliseconds>(duration));
+  startup_phase_duration_ms->Set(phase->name, elapsed.count());
+  LOG(INFO) << "Startup phase " << phase->name << " took " << elapsed.count()
+            << " ms (" << DescribeWork(done, phase->total) << ")";
+}
+
+
+void StartupPhase::SetTotal(int64_t total) {
+  total_.store(total);
+  report_every_.store(std::max<int64_t>(1, total / kReportsPerPhase));
+  {
+    lock_guard<mutex> lock(phases_lock);
+    PhaseRecord* const phase(&(*phases)[index_]);
+    phase->total = total;
+    startup_phase_total->Set(phase->name, total);
+  }
+  Report(done_.load());
+}
+
+
+void StartupPhase::AddDone(int64_t count) {
+  const int64_t done(done_.fetch_add(count) + count);
+  const int64_t report_every(report_every_.load());
+  if (done / report_every != (done - count) / report_every) {
+    Report(done);
+  }
+}
+
+
+void StartupPhase::Report(int64_t done) {
+  const steady_clock::time_point now(steady_clock::now());
+  const int64_t total(total_.load());
+  double eta_seconds(-1);
+  if (total > 0 && done > 0) {
+    const double elapsed_seconds(
+        duration_cast<milliseconds>(now - start_).count() / 1000.0);
+    eta_seconds = elapsed_seconds * std::max<int64_t>(0, total - done) / done;
+  }
+
+  lock_guard<mutex> lock(phases_lock);
+  PhaseRecord* const phase(&(*phases)[index_]);
+  // Reports from several threads can come out of order.
+  if (done < phase->done) {
+    return;
+  }
+  phase->done = done;
+  done_gauge_.Set(done);
+  if (eta_seconds >= 0) {
+    eta_gauge_.Set(eta_seconds);
+  }
+  if (now - phase->last_logged >= kLogEvery) {
+    phase->last_logged = now;
+    LOG(INFO) << "Startup phase " << phase->name << ": "
+              << DescribeWork(done, total) << " done"
+              << (eta_seconds >= 0
+                      ? ", about " + std::to_string(
+                                         static_cast<int64_t>(eta_seconds)) +
+                            " s left"
+                      : "");
+  }
+}
+
+
+void MarkStartupComplete() {
+  const milliseconds elapsed(
+      duration_cast<milliseconds>(steady_clock::now() - process_start));
+  startup_duration_ms->Set(elapsed.count());
+  startup_complete->Set(1);
+  complete.store(true);
+  LOG(INFO) << "Started in " << elapsed.count() << " ms:\n"
+            << StartupSummary();
+}
+
+
+bool IsStartupComplete() {
+  return complete.load();
+}
+
+
+string StartupSummary() {
+  const steady_clock::time_point now(steady_clock::now());
+  ostringstream out;
+  lock_guard<mutex> lock(phases_lock);
+  for (const PhaseRecord& phase : *phases) {
+    out << "  " << phase.name << ": ";
+    if (phase.ended) {
+      out << duration_cast<milliseconds>(phase.duration).count() << " ms";
+    } else {
+      out << "running for "
+          << duration_cast<milliseconds>(now - phase.start).count() << " ms";
+    }
+    out << " (" << DescribeWork(phase.done, phase.total) << ")\n";
+  }
+  return out.str();
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,67 @@
+#ifndef CERT_TRANS_MONITORING_STARTUP_H_
+#define CERT_TRANS_MONITORING_STARTUP_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#include "monitoring/gauge.h"
+
+namespace cert_trans {
+
+
+// Times one phase of starting a server (such as indexing the
+// database, or building the Merkle tree), from its construction to
+// its destruction, and reports how far along it is as it goes, in the
+// metrics (labelled with the |name| of the phase):
+//
+//   startup_phase_done         units of work (entries, leaves...) done
+//   startup_phase_total        units of work in all, if known
+//   startup_phase_eta_seconds  estimated time left, if the total is known
+//   startup_phase_duration_ms  how long it took, once it ended
+//
+// The phases are also listed by StartupSummary(), in the order in
+// which they started. They can be nested.
+class StartupPhase {
+ public:
+  explicit StartupPhase(const std::string& name);
+  ~StartupPhase();
+  StartupPhase(const StartupPhase&) = delete;
+  StartupPhase& operator=(const StartupPhase&) = delete;
+
+  // Sets how many units of work the phase has.
+  void SetTotal(int64_t total);
+
+  // Records that |count| more units of work are done. This can be
+  // called from several threads at once, and is cheap enough to be
+  // called for every unit.
+  void AddDone(int64_t count);
+
+ private:
+  void Report(int64_t done);
+
+  const int index_;
+  const std::chrono::steady_clock::time_point start_;
+  std::atomic<int64_t> done_;
+  std::atomic<int64_t> total_;
+  std::atomic<int64_t> report_every_;
+  Gauge<std::string>::Handle done_gauge_;
+  Gauge<std::string>::Handle eta_gauge_;
+};
+
+
+// Marks the startup as complete (which makes the server ready to
+// serve, see IsStartupComplete()), and logs StartupSummary().
+void MarkStartupComplete();
+
+bool IsStartupComplete();
+
+// Returns one line for every phase so far: how long it took (or has
+// been going on for), and how much work it did.
+std::string StartupSummary();
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MONITORING_STARTUP_H_
@@ -0,0 +1,78 @@
+#include "monitoring/startup.h"
+
+#include <glog/logging.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "monitoring/registry.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using std::string;
+using std::thread;
+using std::vector;
+using testing::HasSubstr;
+
+
+double GaugeValue(const string& name, const string& phase) {
+  for (const Metric* metric : Registry::Instance()->GetMetrics()) {
+    if (metric->Name() == name) {
+      const auto values(metric->CurrentValues());
+      const auto it(values.find({phase}));
+      return it == values.end() ? -1 : it->second.second;
+    }
+  }
+  return -1;
+}
+
+
+TEST(StartupTest, ReportsPhases) {
+  {
+    StartupPhase phase("first");
+    phase.SetTotal(4000);
+    vector<thread> threads;
+    for (int i = 0; i < 4; ++i) {
+      threads.emplace_back([&phase]() {
+        for (int j = 0; j < 1000; ++j) {
+          phase.AddDone(1);
+        }
+      });
+    }
+    for (thread& t : threads) {
+      t.join();
+    }
+    EXPECT_EQ(4000, GaugeValue("startup_phase_total", "first"));
+    EXPECT_EQ(4000, GaugeValue("startup_phase_done", "first"));
+    EXPECT_EQ(0, GaugeValue("startup_phase_eta_seconds", "first"));
+  }
+  EXPECT_LE(0, GaugeValue("startup_phase_duration_ms", "first"));
+
+  const StartupPhase second("second");
+  const string summary(StartupSummary());
+  EXPECT_THAT(summary, HasSubstr("first: "));
+  EXPECT_THAT(summary, HasSubstr("(4000 of 4000)"));
+  EXPECT_THAT(summary, HasSubstr("second: running for"));
+  EXPECT_LT(summary.find("first"), summary.find("second"));
+}
+
+
+TEST(StartupTest, Complete) {
+  EXPECT_FALSE(IsStartupComplete());
+  MarkStartupComplete();
+  EXPECT_TRUE(IsStartupComplete());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,139 @@
+#include "monitoring/zipkin/exporter.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stdio.h>
+
+#include "monitoring/monitoring.h"
+#include "net/url.h"
+#include "util/json_wrapper.h"
+#include "util/trace.h"
+
+DEFINE_string(zipkin_collector_url, "",
+              "if set, URL of the Zipkin collector to send trace spans to "
+              "(e.g. http://zipkin:9411/api/v2/spans)");
+DEFINE_int32(zipkin_push_interval_seconds, 5,
+             "Seconds between sending trace spans to Zipkin.");
+
+namespace cert_trans {
+
+using std::bind;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::seconds;
+using std::make_pair;
+using std::placeholders::_1;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using util::Executor;
+using util::Task;
+using util::trace::SpanRecord;
+
+namespace {
+
+
+static Counter<>* num_zipkin_push_failures(
+    Counter<>::New("num_zipkin_push_failures",
+                   "Number of failures to send trace spans to Zipkin."));
+
+
+string HexId(uint64_t id) {
+  char buf[17];
+  snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(id));
+  return buf;
+}
+
+
+}  // namespace
+
+
+ZipkinExporter::ZipkinExporter(const string& service_name,
+                               UrlFetcher* fetcher, Executor* executor)
+    : service_name_(service_name),
+      fetcher_(CHECK_NOTNULL(fetcher)),
+      executor_(CHECK_NOTNULL(executor)),
+      task_(executor_) {
+  CHECK(!FLAGS_zipkin_collector_url.empty());
+  executor_->Add(bind(&ZipkinExporter::PushSpans, this));
+}
+
+
+ZipkinExporter::~ZipkinExporter() {
+  task_.task()->Cancel();
+  task_.Wait();
+}
+
+
+void ZipkinExporter::PushSpans() {
+  if (task_.task()->CancelRequested()) {
+    task_.task()->Return(util::Status::CANCELLED);
+    return;
+  }
+
+  const vector<SpanRecord> spans(util::trace::TakeFinishedSpans());
+  if (spans.empty()) {
+    PushSpansDone(nullptr, nullptr);
+    return;
+  }
+
+  // See https://zipkin.io/zipkin-api/#/default/post_spans for the
+  // structure we're building here.
+  JsonArray json_spans;
+  for (const auto& span : spans) {
+    JsonObject endpoint;
+    endpoint.Add("serviceName", service_name_);
+
+    JsonObject tags;
+    for (const auto& tag : span.tags) {
+      tags.Add(tag.first.c_str(), tag.second);
+    }
+
+    JsonObject json_span;
+    json_span.Add("traceId", HexId(span.trace_id));
+    json_span.Add("id", HexId(span.span_id));
+    if (span.parent_id != 0) {
+      json_span.Add("parentId", HexId(span.parent_id));
+    }
+    json_span.Add("name", span.name);
+    json_span.Add(
+        "timestamp",
+        duration_cast<microseconds>(span.start.time_since_epoch()).count());
+    json_span.Add("duration",
+                  duration_cast<microseconds>(span.duration).count());
+    json_span.Add("localEndpoint", endpoint);
+    json_span.Add("tags", tags);
+    json_spans.Add(&json_span);
+  }
+
+  UrlFetcher::Request req((URL(FLAGS_zipkin_collector_url)));
+  req.verb = UrlFetcher::Verb::POST;
+  req.headers.insert(make_pair("Content-Type", "application/json"));
+  req.body = json_spans.ToString();
+
+  UrlFetcher::Response* resp(new UrlFetcher::Response);
+  VLOG(1) << "Sending " << spans.size() << " trace spans...";
+  VLOG(2) << req.body;
+  fetcher_->Fetch(req, resp,
+                  task_.task()->AddChild(
+                      bind(&ZipkinExporter::PushSpansDone, this, resp, _1)));
+}
+
+
+void ZipkinExporter::PushSpansDone(UrlFetcher::Response* resp, Task* task) {
+  unique_ptr<UrlFetcher::Response> resp_deleter(resp);
+  // Spans that could not be sent are dropped, they are only samples
+  // anyway.
+  if (task && (!task->status().ok() || resp->status_code / 100 != 2)) {
+    num_zipkin_push_failures->Increment();
+    LOG(WARNING) << "Failed to send trace spans to Zipkin, status: "
+                 << task->status() << ", response code: " << resp->status_code;
+  }
+
+  executor_->Delay(seconds(FLAGS_zipkin_push_interval_seconds),
+                   task_.task()->AddChild(
+                       bind(&ZipkinExporter::PushSpans, this)));
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,34 @@
+#ifndef CERT_TRANS_MONITORING_ZIPKIN_EXPORTER_H_
+#define CERT_TRANS_MONITORING_ZIPKIN_EXPORTER_H_
+
+#include <string>
+
+#include "net/url_fetcher.h"
+#include "util/executor.h"
+#include "util/sync_task.h"
+
+namespace cert_trans {
+
+
+// Periodically sends the trace spans that ended (see util/trace.h)
+// to a Zipkin collector, with the v2 JSON API.
+class ZipkinExporter {
+ public:
+  ZipkinExporter(const std::string& service_name, UrlFetcher* fetcher,
+                 util::Executor* executor);
+  ~ZipkinExporter();
+
+ private:
+  void PushSpans();
+  void PushSpansDone(UrlFetcher::Response* resp, util::Task* task);
+
+  const std::string service_name_;
+  UrlFetcher* const fetcher_;
+  util::Executor* const executor_;
+  util::SyncTask task_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_MONITORING_ZIPKIN_EXPORTER_H_
@@ -5,8 +5,10 @@
 #include <glog/logging.h>
 #include <chrono>
 
+#include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
 #include "util/openssl_util.h"
+#include "util/util.h"
 
 extern "C" {
 #include "third_party/curl/hostcheck.h"
@@ -16,11 +18,14 @@ extern "C" {
 
 using std::bind;
 using std::chrono::duration_cast;
+using std::chrono::milliseconds;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::chrono::system_clock;
 using std::lock_guard;
 using std::make_pair;
 using std::map;
+using std::max;
 using std::move;
 using std::mutex;
 using std::pair;
@@ -51,6 +56,19 @@ DEFINE_string(trusted_root_certs, "",
 DEFINE_int32(url_fetcher_max_conn_per_host_port, 4,
              "maximum number of URL fetcher connections per host:port");
 
+DEFINE_bool(tls_client_session_resumption, true,
+            "resume the latest TLS session with a host:port when opening "
+            "another connection to it, skipping most of the handshake");
+
+DEFINE_int32(connection_pool_warm_connections, 0,
+             "number of idle connections to keep open ahead of time to each "
+             "host:port that was connected to, so that requests do not wait "
+             "for a new connection and its TLS handshake");
+DEFINE_string(connection_pool_warm_urls, "",
+              "comma-separated http or https URLs whose host:port get warm "
+              "connections as soon as the URL fetcher is created (at least "
+              "one each, or --connection_pool_warm_connections)");
+
 DEFINE_string(tls_client_minimum_protocol, "tlsv12",
               "Minimum acceptable TLS "
               "version protocol (tlsv1, tlsv11, tlsv12)");
@@ -81,6 +99,16 @@ static Gauge<string>* connections_per_host_port(
     Gauge<string>::New("connections_per_host_port", "host_port",
                        "Number of cached connections port host:port"));
 
+static Latency<milliseconds, string> tls_handshake_latency_ms(
+    "tls_handshake_latency_ms", "session",
+    "Time from opening a connection to completing its TLS handshake, in ms, "
+    "by whether the session was \"resumed\" or \"full\".");
+
+static Counter<string>* tls_sessions_offered(
+    Counter<string>::New("tls_sessions_offered", "host_port",
+                         "Number of new connections to host:port offering "
+                         "to resume an earlier TLS session."));
+
 
 namespace {
 
@@ -92,6 +120,13 @@ int GetSSLConnectionIndex() {
 }
 
 
+int GetSSLCTXPoolIndex() {
+  static const int ssl_ctx_pool_index(
+      SSL_CTX_get_ex_new_index(0, nullptr, nullptr, nullptr, nullptr));
+  return ssl_ctx_pool_index;
+}
+
+
 string HostPortString(const HostPortPair& pair) {
   return pair.first + ":" + to_string(pair.second);
 }
@@ -107,6 +142,10 @@ class EvConnection {
   // Called by OpenSSL to verify the hostname presented in the server cert.
   static int SSLVerifyCallback(int preverify_ok, X509_STORE_CTX* x509_ctx);
 
+  // Called by OpenSSL as the connection progresses, to record how long
+  // the handshake took.
+  static void SSLInfoCallback(const SSL* ssl, int where, int ret);
+
   // Called by libevhtp when it detects some kind of error with the connection.
   static evhtp_res ConnectionErrorHook(evhtp_connection_t* conn,
                                        evhtp_error_flags errtype, void* arg);
@@ -118,6 +157,8 @@ class EvConnection {
   EvConnection(evhtp_connection_t* conn, HostPortPair&& other_end)
       : ev_conn_(CHECK_NOTNULL(conn)),
         other_end_(move(other_end)),
+        created_(steady_clock::now()),
+        handshake_done_(false),
         errored_(false) {
     if (ev_conn_->ssl) {
       SSL_set_ex_data(ev_conn_->ssl, GetSSLConnectionIndex(),
@@ -148,6 +189,9 @@ class EvConnection {
   // We never really own this, evhtp does, as it likes to remind us.
   evhtp_connection_t* ev_conn_;
   const HostPortPair other_end_;
+  const steady_clock::time_point created_;
+  // Only used on the libevent thread.
+  bool handshake_done_;
 
   mutable std::mutex lock_;
   bool errored_;
@@ -224,6 +268,28 @@ int EvConnection::SSLVerifyCallback(const int preverify_ok,
 }
 
 
+// static
+void EvConnection::SSLInfoCallback(const SSL* ssl, int where, int ret) {
+  if (!(where & SSL_CB_HANDSHAKE_DONE)) {
+    return;
+  }
+
+  EvConnection* const connection(static_cast<EvConnection*>(
+      SSL_get_ex_data(ssl, GetSSLConnectionIndex())));
+  // With TLS 1.3, this is also called for session tickets after the
+  // handshake.
+  if (!connection || connection->handshake_done_) {
+    return;
+  }
+  connection->handshake_done_ = true;
+
+  const bool resumed(SSL_session_reused(const_cast<SSL*>(ssl)));
+  tls_handshake_latency_ms.RecordLatency(resumed ? "resumed" : "full",
+                                         steady_clock::now() -
+                                             connection->created_);
+}
+
+
 ConnectionPool::Connection::Connection(const shared_ptr<EvConnection>& conn)
     : connection_(conn) {
 }
@@ -281,8 +347,10 @@ SSL_CTX* CreateSSLCTXFromFlags() {
 }  // namespace
 
 
-ConnectionPool::ConnectionPool(libevent::Base* base)
+ConnectionPool::ConnectionPool(libevent::Base* base,
+                               util::Executor* executor)
     : base_(CHECK_NOTNULL(base)),
+      executor_(CHECK_NOTNULL(executor)),
       cleanup_scheduled_(false),
       ssl_ctx_(CreateSSLCTXFromFlags(), SSL_CTX_free) {
   CHECK(ssl_ctx_) << "could not build SSL context: "
@@ -309,6 +377,66 @@ ConnectionPool::ConnectionPool(libevent::Base* base)
 
   SSL_CTX_set_verify(ssl_ctx_.get(), SSL_VERIFY_PEER,
                      EvConnection::SSLVerifyCallback);
+  SSL_CTX_set_info_callback(ssl_ctx_.get(), EvConnection::SSLInfoCallback);
+
+  if (FLAGS_tls_client_session_resumption) {
+    // OpenSSL's own cache is only used by servers, we keep the
+    // sessions per host:port ourselves.
+    SSL_CTX_set_session_cache_mode(ssl_ctx_.get(),
+                                   SSL_SESS_CACHE_CLIENT |
+                                       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_set_ex_data(ssl_ctx_.get(), GetSSLCTXPoolIndex(),
+                        static_cast<void*>(this));
+    SSL_CTX_sess_set_new_cb(ssl_ctx_.get(),
+                            &ConnectionPool::NewSSLSessionCallback);
+  }
+
+  if (!FLAGS_connection_pool_warm_urls.empty()) {
+    unique_lock<mutex> lock(lock_);
+    for (const auto& url_string :
+         util::split(FLAGS_connection_pool_warm_urls)) {
+      const URL url(url_string);
+      CHECK(url.Protocol() == "http" || url.Protocol() == "https")
+          << "unsupported URL in --connection_pool_warm_urls: " << url_string;
+      const bool https(url.Protocol() == "https");
+      MaybeWarm(lock, https,
+                HostPortPair(url.Host(), url.Port() != 0 ? url.Port()
+                                                         : (https ? 443 : 80)),
+                max(1, FLAGS_connection_pool_warm_connections));
+    }
+  }
+}
+
+
+ConnectionPool::~ConnectionPool() {
+  unique_lock<mutex> lock(lock_);
+  warming_done_.wait(lock, [this]() { return warming_.empty(); });
+}
+
+
+// static
+int ConnectionPool::NewSSLSessionCallback(SSL* ssl, SSL_SESSION* session) {
+  CHECK_NOTNULL(ssl);
+  CHECK_NOTNULL(session);
+  ConnectionPool* const pool(CHECK_NOTNULL(static_cast<ConnectionPool*>(
+      SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), GetSSLCTXPoolIndex()))));
+  const EvConnection* const connection(static_cast<const EvConnection*>(
+      SSL_get_ex_data(ssl, GetSSLConnectionIndex())));
+  if (!connection) {
+    return 0;
+  }
+
+  VLOG(1) << "new TLS session with " << HostPortString(connection->other_end());
+  lock_guard<mutex> lock(pool->lock_);
+  // We take over the reference passed to us, as we return 1.
+  auto it(pool->sessions_.find(connection->other_end()));
+  if (it == pool->sessions_.end()) {
+    pool->sessions_.emplace(connection->other_end(),
+                            SSLSessionPtr(session, SSL_SESSION_free));
+  } else {
+    it->second.reset(session);
+  }
+  return 1;
 }
 
 
@@ -404,10 +532,11 @@ void ConnectionPool::RemoveDeadConnectionsFromDeque(
   CHECK(lock.owns_lock());
   CHECK(deque);
 
-  // Do a sweep and remove any dead connections
+  // Do a sweep and remove any dead connections, or ones that failed
+  // while idle.
   for (auto deque_it(deque->begin()); deque_it != deque->end();) {
     CHECK(deque_it->second);
-    if (!deque_it->second->connection()) {
+    if (!deque_it->second->connection() || deque_it->second->GetErrored()) {
       VLOG(1) << "Removing dead connection to "
               << deque_it->second->other_end().first << ":"
               << deque_it->second->other_end().second;
@@ -419,9 +548,57 @@ void ConnectionPool::RemoveDeadConnectionsFromDeque(
 }
 
 
+unique_ptr<ConnectionPool::Connection> ConnectionPool::NewConnection(
+    bool https, HostPortPair key) {
+  VLOG(1) << "new evhtp_connection for " << key.first << ":" << key.second;
+  // This EvConnection has a slightly complicated lifetime; it needs to hang
+  // around until libevhtp/libevent have entirely finished with the
+  // evhtp_connection_t it references, and for at least as long as the life
+  // of the Connection we return from this method.
+  //
+  // This is accomplished through the use of a couple of shared_ptrs;
+  // this one, which goes inside the returned Connection object, and another
+  // created further below which gets passed in to the
+  // ConnectionFinishedHook.
+  auto conn(std::make_shared<EvConnection>(
+      https ? base_->HttpsConnectionNew(key.first, key.second, ssl_ctx_.get())
+            : base_->HttpConnectionNew(key.first, key.second),
+      move(key)));
+  unique_ptr<ConnectionPool::Connection> handle(new Connection(conn));
+  if (handle->connection()->ssl) {
+    lock_guard<mutex> lock(lock_);
+    const auto session(sessions_.find(handle->other_end()));
+    if (session != sessions_.end()) {
+      // The server might not resume it, in which case this is
+      // simply a full handshake.
+      tls_sessions_offered->Increment(HostPortString(handle->other_end()));
+      SSL_set_session(handle->connection()->ssl, session->second.get());
+    }
+  }
+  struct timeval read_timeout = {FLAGS_connection_read_timeout_seconds,
+                                 kZeroMillis};
+  struct timeval write_timeout = {FLAGS_connection_write_timeout_seconds,
+                                  kZeroMillis};
+  evhtp_connection_set_timeouts(handle->connection(), &read_timeout,
+                                &write_timeout);
+  evhtp_set_hook(&handle->connection()->hooks, evhtp_hook_on_conn_error,
+                 reinterpret_cast<evhtp_hook>(
+                     EvConnection::ConnectionErrorHook),
+                 reinterpret_cast<void*>(conn.get()));
+  evhtp_set_hook(
+      &handle->connection()->hooks, evhtp_hook_on_connection_fini,
+      reinterpret_cast<evhtp_hook>(EvConnection::ConnectionFinishedHook),
+      // We'll hold on to another shared_ptr to the Connection
+      // until evhtp tells us that it's finished with the cnxn.
+      reinterpret_cast<void*>(new shared_ptr<EvConnection>(conn)));
+  return handle;
+}
+
+
 unique_ptr<ConnectionPool::Connection> ConnectionPool::Get(const URL& url) {
   CHECK(url.Protocol() == "http" || url.Protocol() == "https");
-  const uint16_t default_port(url.Protocol() == "https" ? 443 : 80);
+  const bool https(url.Protocol() == "https");
+  const uint16_t default_port(https ? 443 : 80);
   HostPortPair key(url.Host(), url.Port() != 0 ? url.Port() : default_port);
   unique_lock<mutex> lock(lock_);
 
@@ -432,39 +609,9 @@ unique_ptr<ConnectionPool::Connection> ConnectionPool::Get(const URL& url) {
   }
 
   if (it == conns_.end() || it->second.empty()) {
-    VLOG(1) << "new evhtp_connection for " << key.first << ":" << key.second;
-    // This EvConnection has a slightly complicated lifetime; it needs to hang
-    // around until libevhtp/libevent have entirely finished with the
-    // evhtp_connection_t it references, and for at least as long as the life
-    // of the Connection we return from this method.
-    //
-    // This is accomplished through the use of a couple of shared_ptrs;
-    // this one, which goes inside the returned Connection object, and another
-    // created further below which gets passed in to the
-    // ConnectionFinishedHook.
-    auto conn(std::make_shared<EvConnection>(
-        url.Protocol() == "https"
-            ? base_->HttpsConnectionNew(key.first, key.second, ssl_ctx_.get())
-            : base_->HttpConnectionNew(key.first, key.second),
-        move(key)));
-    unique_ptr<ConnectionPool::Connection> handle(new Connection(conn));
-    struct timeval read_timeout = {FLAGS_connection_read_timeout_seconds,
-                                   kZeroMillis};
-    struct timeval write_timeout = {FLAGS_connection_write_timeout_seconds,
-                                    kZeroMillis};
-    evhtp_connection_set_timeouts(handle->connection(), &read_timeout,
-                                  &write_timeout);
-    evhtp_set_hook(&handle->connection()->hooks, evhtp_hook_on_conn_error,
-                   reinterpret_cast<evhtp_hook>(
-                       EvConnection::ConnectionErrorHook),
-                   reinterpret_cast<void*>(conn.get()));
-    evhtp_set_hook(
-        &handle->connection()->hooks, evhtp_hook_on_connection_fini,
-        reinterpret_cast<evhtp_hook>(EvConnection::ConnectionFinishedHook),
-        // We'll hold on to another shared_ptr to the Connection
-        // until evhtp tells us that it's finished with the cnxn.
-        reinterpret_cast<void*>(new shared_ptr<EvConnection>(conn)));
-    return handle;
+    MaybeWarm(lock, https, key, FLAGS_connection_pool_warm_connections);
+    lock.unlock();
+    return NewConnection(https, move(key));
   }
 
   VLOG(1) << "cached evhtp_connection for " << key.first << ":" << key.second;
@@ -472,11 +619,53 @@ unique_ptr<ConnectionPool::Connection> ConnectionPool::Get(const URL& url) {
       move(it->second.back().second));
   it->second.pop_back();
   CHECK_NOTNULL(retval->connection());
+  MaybeWarm(lock, https, key, FLAGS_connection_pool_warm_connections);
 
   return retval;
 }
 
 
+void ConnectionPool::MaybeWarm(const unique_lock<mutex>& lock, bool https,
+                               const HostPortPair& key, int num_warm) {
+  CHECK(lock.owns_lock());
+  if (num_warm <= 0 || warming_.count(key) > 0) {
+    return;
+  }
+
+  const auto it(conns_.find(key));
+  if (it != conns_.end() &&
+      it->second.size() >= static_cast<size_t>(num_warm)) {
+    return;
+  }
+
+  warming_.emplace(key, num_warm);
+  executor_->Add(
+      bind(&ConnectionPool::WarmConnections, this, https, key, num_warm));
+}
+
+
+void ConnectionPool::WarmConnections(bool https, const HostPortPair& key,
+                                     int num_warm) {
+  unique_lock<mutex> lock(lock_);
+  auto& idle(conns_[key]);
+  RemoveDeadConnectionsFromDeque(lock, &idle);
+  const int needed(num_warm - static_cast<int>(idle.size()));
+  lock.unlock();
+
+  // Connecting starts right away, including the TLS handshake, so it
+  // is done by the time they are used.
+  VLOG(1) << "warming up " << needed << " connections to "
+          << HostPortString(key);
+  for (int i = 0; i < needed; ++i) {
+    Put(NewConnection(https, key));
+  }
+
+  lock.lock();
+  warming_.erase(key);
+  warming_done_.notify_all();
+}
+
+
 void ConnectionPool::Put(unique_ptr<ConnectionPool::Connection> handle) {
   if (!handle) {
     VLOG(1) << "returned null Connection";
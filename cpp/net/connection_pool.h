@@ -3,6 +3,7 @@
 
 #include <openssl/ssl.h>
 #include <stdint.h>
+#include <condition_variable>
 #include <deque>
 #include <map>
 #include <memory>
@@ -10,6 +11,7 @@
 #include <string>
 
 #include "net/url.h"
+#include "util/executor.h"
 #include "util/libevent_wrapper.h"
 
 namespace cert_trans {
@@ -58,7 +60,10 @@ class ConnectionPool {
     friend class ConnectionPool;
   };
 
-  ConnectionPool(libevent::Base* base);
+  // Connections are opened ahead of time on |executor|, as that
+  // might block to resolve names.
+  ConnectionPool(libevent::Base* base, util::Executor* executor);
+  ~ConnectionPool();
   ConnectionPool(const ConnectionPool&) = delete;
   ConnectionPool& operator=(const ConnectionPool&) = delete;
 
@@ -68,6 +73,19 @@ class ConnectionPool {
  private:
   typedef std::pair<std::chrono::system_clock::time_point,
                     std::unique_ptr<Connection>> TimestampedConnection;
+  typedef std::unique_ptr<SSL_SESSION, void (*)(SSL_SESSION*)> SSLSessionPtr;
+
+  // Called by OpenSSL when a TLS session is established, which is then
+  // offered for resumption on the next connection to the same
+  // host:port.
+  static int NewSSLSessionCallback(SSL* ssl, SSL_SESSION* session);
+
+  std::unique_ptr<Connection> NewConnection(bool https, HostPortPair key);
+  // Arranges for WarmConnections() to run if there are fewer than
+  // |num_warm| idle connections to |key|.
+  void MaybeWarm(const std::unique_lock<std::mutex>& lock, bool https,
+                 const HostPortPair& key, int num_warm);
+  void WarmConnections(bool https, const HostPortPair& key, int num_warm);
 
   static void RemoveDeadConnectionsFromDeque(
       const std::unique_lock<std::mutex>& lock,
@@ -76,12 +94,17 @@ class ConnectionPool {
   void Cleanup();
 
   libevent::Base* const base_;
+  util::Executor* const executor_;
 
   std::mutex lock_;
   // We get and put connections from the back of the deque, and when
   // there are too many, we prune them from the front (LIFO).
   std::map<HostPortPair, std::deque<TimestampedConnection>> conns_;
   bool cleanup_scheduled_;
+  std::map<HostPortPair, SSLSessionPtr> sessions_;
+  // The host:port pairs with connections being opened ahead of time.
+  std::map<HostPortPair, int> warming_;
+  std::condition_variable warming_done_;
 
   std::unique_ptr<evhtp_ssl_ctx_t, void (*)(evhtp_ssl_ctx_t*)> ssl_ctx_;
 };
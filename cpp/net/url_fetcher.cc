@@ -5,6 +5,7 @@
 #include <evhtp.h>
 #include <glog/logging.h>
 #include <htparse.h>
+#include <vector>
 
 #include "net/connection_pool.h"
 #include "util/thread_pool.h"
@@ -18,6 +19,7 @@ using std::ostream;
 using std::string;
 using std::to_string;
 using std::unique_ptr;
+using std::vector;
 using util::Status;
 using util::Task;
 using util::TaskHold;
@@ -29,7 +31,7 @@ struct UrlFetcher::Impl {
   Impl(libevent::Base* base, ThreadPool* thread_pool)
       : base_(CHECK_NOTNULL(base)),
         thread_pool_(CHECK_NOTNULL(thread_pool)),
-        pool_(base_) {
+        pool_(base_, thread_pool_) {
   }
 
   libevent::Base* const base_;
@@ -91,6 +93,29 @@ void RequestCallback(evhtp_request_t* req, void* userdata) {
 }
 
 
+// Called by libevhtp with each piece of the response body, which it
+// accumulates in the request for whatever is left in |buf|.
+evhtp_res ReadCallback(evhtp_request_t* req, evbuf_t* buf, void* userdata) {
+  const UrlFetcher::Response* const response(
+      static_cast<const UrlFetcher::Response*>(CHECK_NOTNULL(userdata)));
+  if (evhtp_request_status(req) != 200) {
+    // Keep error responses whole.
+    return EVHTP_RES_OK;
+  }
+
+  const int num_chunks(evbuffer_peek(buf, -1, nullptr, nullptr, 0));
+  vector<evbuffer_iovec> chunks(num_chunks);
+  evbuffer_peek(buf, -1, nullptr, chunks.data(), num_chunks);
+  for (const auto& chunk : chunks) {
+    response->body_sink(static_cast<const char*>(chunk.iov_base),
+                        chunk.iov_len);
+  }
+  evbuffer_drain(buf, evbuffer_get_length(buf));
+
+  return EVHTP_RES_OK;
+}
+
+
 UrlFetcher::Request NormaliseRequest(UrlFetcher::Request req) {
   if (req.url.Path().empty()) {
     req.url.SetPath("/");
@@ -134,6 +159,11 @@ void State::RunRequest() {
   CHECK(libevent::Base::OnEventThread());
   evhtp_request_t* const http_req(
       CHECK_NOTNULL(evhtp_request_new(&RequestCallback, this)));
+  if (response_->body_sink) {
+    evhtp_set_hook(&http_req->hooks, evhtp_hook_on_read,
+                   reinterpret_cast<evhtp_hook>(&ReadCallback),
+                   static_cast<void*>(response_));
+  }
   if (!request_.body.empty() &&
       request_.headers.find("Content-Length") == request_.headers.end()) {
     evhtp_headers_add_header(
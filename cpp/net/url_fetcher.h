@@ -2,6 +2,7 @@
 #define CERT_TRANS_NET_URL_FETCHER_H_
 
 #include <chrono>
+#include <functional>
 #include <map>
 #include <memory>
 #include <ostream>
@@ -51,6 +52,10 @@ class UrlFetcher {
     int status_code;
     Headers headers;
     std::string body;
+    // If set, and the status code is 200, the body is passed to it in
+    // pieces as it arrives, rather than kept in |body|. It is called
+    // on the libevent thread, before the task is returned.
+    std::function<void(const char* data, size_t size)> body_sink;
   };
 
   UrlFetcher(libevent::Base* base, ThreadPool* thread_pool);
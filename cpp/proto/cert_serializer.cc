@@ -10,6 +10,8 @@
 
 using cert_trans::serialization::SerializeResult;
 using cert_trans::serialization::DeserializeResult;
+using cert_trans::serialization::TLSWriter;
+using cert_trans::serialization::VarBytesLength;
 using cert_trans::serialization::WriteFixedBytes;
 using cert_trans::serialization::WriteList;
 using cert_trans::serialization::WriteUint;
@@ -43,7 +45,7 @@ SerializeResult CheckCertificateFormat(const string& cert) {
 }
 
 
-string CertV1LeafData(const LogEntry& entry) {
+const string& CertV1LeafData(const LogEntry& entry) {
   switch (entry.type()) {
     // TODO(mhs): Because there is no X509_ENTRY_V2 we have to assume that
     // whichever of the cert fields is set defines the entry type. In other
@@ -68,10 +70,15 @@ string CertV1LeafData(const LogEntry& entry) {
 }
 
 
-SerializeResult SerializeV1CertSCTSignatureInput(uint64_t timestamp,
-                                                 const string& certificate,
-                                                 const string& extensions,
-                                                 string* result) {
+// The V1 SCT signature input and Merkle tree leaf of a certificate only
+// differ by their |type| (a SignatureType or a MerkleLeafType), which
+// is |type_length| bytes long. They are written into |result| in one
+// go, having worked out their length first.
+SerializeResult SerializeV1CertTimestampedEntry(int type, size_t type_length,
+                                                uint64_t timestamp,
+                                                const string& certificate,
+                                                const string& extensions,
+                                                string* result) {
   SerializeResult res = CheckCertificateFormat(certificate);
   if (res != SerializeResult::OK) {
     return res;
@@ -80,20 +87,30 @@ SerializeResult SerializeV1CertSCTSignatureInput(uint64_t timestamp,
   if (res != SerializeResult::OK) {
     return res;
   }
-  WriteUint(ct::V1, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::CERTIFICATE_TIMESTAMP, Serializer::kSignatureTypeLengthInBytes,
-            result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(ct::X509_ENTRY, Serializer::kLogEntryTypeLengthInBytes, result);
-  WriteVarBytes(certificate, kMaxCertificateLength, result);
-  WriteVarBytes(extensions, Serializer::kMaxExtensionsLength, result);
+  const size_t length(Serializer::kVersionLengthInBytes + type_length +
+                      Serializer::kTimestampLengthInBytes +
+                      Serializer::kLogEntryTypeLengthInBytes +
+                      VarBytesLength(certificate, kMaxCertificateLength) +
+                      VarBytesLength(extensions,
+                                     Serializer::kMaxExtensionsLength));
+  result->resize(length);
+  TLSWriter writer(&(*result)[0], length);
+  writer.WriteUint(ct::V1, Serializer::kVersionLengthInBytes);
+  writer.WriteUint(type, type_length);
+  writer.WriteUint(timestamp, Serializer::kTimestampLengthInBytes);
+  writer.WriteUint(ct::X509_ENTRY, Serializer::kLogEntryTypeLengthInBytes);
+  writer.WriteVarBytes(certificate, kMaxCertificateLength);
+  writer.WriteVarBytes(extensions, Serializer::kMaxExtensionsLength);
+  CHECK_EQ(0U, writer.Remaining());
   return SerializeResult::OK;
 }
 
 
-SerializeResult SerializeV1PrecertSCTSignatureInput(
-    uint64_t timestamp, const string& issuer_key_hash,
-    const string& tbs_certificate, const string& extensions, string* result) {
+// Same as SerializeV1CertTimestampedEntry(), for a precertificate.
+SerializeResult SerializeV1PrecertTimestampedEntry(
+    int type, size_t type_length, uint64_t timestamp,
+    const string& issuer_key_hash, const string& tbs_certificate,
+    const string& extensions, string* result) {
   SerializeResult res = CheckCertificateFormat(tbs_certificate);
   if (res != SerializeResult::OK) {
     return res;
@@ -106,19 +123,46 @@ SerializeResult SerializeV1PrecertSCTSignatureInput(
   if (res != SerializeResult::OK) {
     return res;
   }
-  result->clear();
-  WriteUint(ct::V1, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::CERTIFICATE_TIMESTAMP, Serializer::kSignatureTypeLengthInBytes,
-            result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(ct::PRECERT_ENTRY, Serializer::kLogEntryTypeLengthInBytes, result);
-  WriteFixedBytes(issuer_key_hash, result);
-  WriteVarBytes(tbs_certificate, kMaxCertificateLength, result);
-  WriteVarBytes(extensions, Serializer::kMaxExtensionsLength, result);
+  const size_t length(Serializer::kVersionLengthInBytes + type_length +
+                      Serializer::kTimestampLengthInBytes +
+                      Serializer::kLogEntryTypeLengthInBytes +
+                      issuer_key_hash.size() +
+                      VarBytesLength(tbs_certificate, kMaxCertificateLength) +
+                      VarBytesLength(extensions,
+                                     Serializer::kMaxExtensionsLength));
+  result->resize(length);
+  TLSWriter writer(&(*result)[0], length);
+  writer.WriteUint(ct::V1, Serializer::kVersionLengthInBytes);
+  writer.WriteUint(type, type_length);
+  writer.WriteUint(timestamp, Serializer::kTimestampLengthInBytes);
+  writer.WriteUint(ct::PRECERT_ENTRY, Serializer::kLogEntryTypeLengthInBytes);
+  writer.WriteFixedBytes(issuer_key_hash);
+  writer.WriteVarBytes(tbs_certificate, kMaxCertificateLength);
+  writer.WriteVarBytes(extensions, Serializer::kMaxExtensionsLength);
+  CHECK_EQ(0U, writer.Remaining());
   return SerializeResult::OK;
 }
 
 
+SerializeResult SerializeV1CertSCTSignatureInput(uint64_t timestamp,
+                                                 const string& certificate,
+                                                 const string& extensions,
+                                                 string* result) {
+  return SerializeV1CertTimestampedEntry(
+      ct::CERTIFICATE_TIMESTAMP, Serializer::kSignatureTypeLengthInBytes,
+      timestamp, certificate, extensions, result);
+}
+
+
+SerializeResult SerializeV1PrecertSCTSignatureInput(
+    uint64_t timestamp, const string& issuer_key_hash,
+    const string& tbs_certificate, const string& extensions, string* result) {
+  return SerializeV1PrecertTimestampedEntry(
+      ct::CERTIFICATE_TIMESTAMP, Serializer::kSignatureTypeLengthInBytes,
+      timestamp, issuer_key_hash, tbs_certificate, extensions, result);
+}
+
+
 SerializeResult SerializeV1SCTSignatureInput(
     const SignedCertificateTimestamp& sct, const LogEntry& entry,
     string* result) {
@@ -146,51 +190,18 @@ SerializeResult SerializeV1CertSCTMerkleTreeLeaf(uint64_t timestamp,
                                                  const string& certificate,
                                                  const string& extensions,
                                                  string* result) {
-  SerializeResult res = CheckCertificateFormat(certificate);
-  if (res != SerializeResult::OK) {
-    return res;
-  }
-  res = CheckExtensionsFormat(extensions);
-  if (res != SerializeResult::OK) {
-    return res;
-  }
-  result->clear();
-  WriteUint(ct::V1, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::TIMESTAMPED_ENTRY, Serializer::kMerkleLeafTypeLengthInBytes,
-            result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(ct::X509_ENTRY, Serializer::kLogEntryTypeLengthInBytes, result);
-  WriteVarBytes(certificate, kMaxCertificateLength, result);
-  WriteVarBytes(extensions, Serializer::kMaxExtensionsLength, result);
-  return SerializeResult::OK;
+  return SerializeV1CertTimestampedEntry(
+      ct::TIMESTAMPED_ENTRY, Serializer::kMerkleLeafTypeLengthInBytes,
+      timestamp, certificate, extensions, result);
 }
 
 
 SerializeResult SerializeV1PrecertSCTMerkleTreeLeaf(
     uint64_t timestamp, const string& issuer_key_hash,
     const string& tbs_certificate, const string& extensions, string* result) {
-  SerializeResult res = CheckCertificateFormat(tbs_certificate);
-  if (res != SerializeResult::OK) {
-    return res;
-  }
-  res = CheckKeyHashFormat(issuer_key_hash);
-  if (res != SerializeResult::OK) {
-    return res;
-  }
-  res = CheckExtensionsFormat(extensions);
-  if (res != SerializeResult::OK) {
-    return res;
-  }
-  result->clear();
-  WriteUint(ct::V1, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::TIMESTAMPED_ENTRY, Serializer::kMerkleLeafTypeLengthInBytes,
-            result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(ct::PRECERT_ENTRY, Serializer::kLogEntryTypeLengthInBytes, result);
-  WriteFixedBytes(issuer_key_hash, result);
-  WriteVarBytes(tbs_certificate, kMaxCertificateLength, result);
-  WriteVarBytes(extensions, Serializer::kMaxExtensionsLength, result);
-  return SerializeResult::OK;
+  return SerializeV1PrecertTimestampedEntry(
+      ct::TIMESTAMPED_ENTRY, Serializer::kMerkleLeafTypeLengthInBytes,
+      timestamp, issuer_key_hash, tbs_certificate, extensions, result);
 }
 
 
@@ -260,27 +271,25 @@ DeserializeResult DeserializeV1SCTMerkleTreeLeaf(TLSDeserializer* des,
 
   switch (entry_type) {
     case ct::X509_ENTRY: {
-      string x509;
+      TLSDeserializer::Bytes x509;
       if (!des->ReadVarBytes(kMaxCertificateLength, &x509)) {
         return DeserializeResult::INPUT_TOO_SHORT;
       }
-      entry->mutable_signed_entry()->set_x509(x509);
+      entry->mutable_signed_entry()->set_x509(x509.data, x509.size);
       return ReadExtensionsV1(des, entry);
     }
 
     case ct::PRECERT_ENTRY: {
-      string issuer_key_hash;
-      if (!des->ReadFixedBytes(32, &issuer_key_hash)) {
+      TLSDeserializer::Bytes issuer_key_hash;
+      TLSDeserializer::Bytes tbs_certificate;
+      if (!des->ReadFixedBytes(32, &issuer_key_hash) ||
+          !des->ReadVarBytes(kMaxCertificateLength, &tbs_certificate)) {
         return DeserializeResult::INPUT_TOO_SHORT;
       }
-      entry->mutable_signed_entry()->mutable_precert()->set_issuer_key_hash(
-          issuer_key_hash);
-      string tbs_certificate;
-      if (!des->ReadVarBytes(kMaxCertificateLength, &tbs_certificate)) {
-        return DeserializeResult::INPUT_TOO_SHORT;
-      }
-      entry->mutable_signed_entry()->mutable_precert()->set_tbs_certificate(
-          tbs_certificate);
+      ct::PreCert* const precert(
+          entry->mutable_signed_entry()->mutable_precert());
+      precert->set_issuer_key_hash(issuer_key_hash.data, issuer_key_hash.size);
+      precert->set_tbs_certificate(tbs_certificate.data, tbs_certificate.size);
       return ReadExtensionsV1(des, entry);
     }
   }
@@ -292,7 +301,7 @@ DeserializeResult DeserializeV1SCTMerkleTreeLeaf(TLSDeserializer* des,
 
 // ----------------- V2 cert stuff ------------------------
 
-string CertV2LeafData(const LogEntry& entry) {
+const string& CertV2LeafData(const LogEntry& entry) {
   switch (entry.type()) {
     // TODO(mhs): Because there is no X509_ENTRY_V2 we have to assume that
     // whichever of the cert fields is set defines the entry type. In other
@@ -518,18 +527,18 @@ DeserializeResult DeserializeV2SCTMerkleTreeLeaf(TLSDeserializer* des,
     // In V2 both X509 and Precert entries use CertInfo
     case ct::X509_ENTRY:
     case ct::PRECERT_ENTRY_V2: {
-      string issuer_key_hash;
-      if (!des->ReadFixedBytes(32, &issuer_key_hash)) {
-        return DeserializeResult::INPUT_TOO_SHORT;
-      }
-      entry->mutable_signed_entry()->mutable_cert_info()->set_issuer_key_hash(
-          issuer_key_hash);
-      string tbs_certificate;
-      if (!des->ReadVarBytes(kMaxCertificateLength, &tbs_certificate)) {
+      TLSDeserializer::Bytes issuer_key_hash;
+      TLSDeserializer::Bytes tbs_certificate;
+      if (!des->ReadFixedBytes(32, &issuer_key_hash) ||
+          !des->ReadVarBytes(kMaxCertificateLength, &tbs_certificate)) {
         return DeserializeResult::INPUT_TOO_SHORT;
       }
-      entry->mutable_signed_entry()->mutable_cert_info()->set_tbs_certificate(
-          tbs_certificate);
+      ct::CertInfo* const cert_info(
+          entry->mutable_signed_entry()->mutable_cert_info());
+      cert_info->set_issuer_key_hash(issuer_key_hash.data,
+                                     issuer_key_hash.size);
+      cert_info->set_tbs_certificate(tbs_certificate.data,
+                                     tbs_certificate.size);
       // TODO(eranm): This is wrong, V2 Extensions should be read using
       // ReadSctExtensions
       return ReadExtensionsV1(des, entry);
@@ -11,6 +11,9 @@
 using cert_trans::serialization::internal::PrefixLength;
 using cert_trans::serialization::SerializeResult;
 using cert_trans::serialization::DeserializeResult;
+using cert_trans::serialization::DigitallySignedLength;
+using cert_trans::serialization::TLSWriter;
+using cert_trans::serialization::VarBytesLength;
 using cert_trans::serialization::WriteDigitallySigned;
 using cert_trans::serialization::WriteFixedBytes;
 using cert_trans::serialization::WriteUint;
@@ -61,7 +64,7 @@ SerializeResult CheckSthExtensionsFormat(
 namespace {
 
 
-function<string(const ct::LogEntry&)> leaf_data;
+function<const string&(const ct::LogEntry&)> leaf_data;
 
 function<SerializeResult(const ct::SignedCertificateTimestamp& sct,
                          const ct::LogEntry& entry, std::string* result)>
@@ -89,7 +92,7 @@ function<DeserializeResult(TLSDeserializer* d, ct::MerkleTreeLeaf* leaf)>
 
 
 // static
-string Serializer::LeafData(const LogEntry& entry) {
+const string& Serializer::LeafData(const LogEntry& entry) {
   CHECK(leaf_data);
   return leaf_data(entry);
 }
@@ -114,11 +117,18 @@ static SerializeResult SerializeV1STHSignatureInput(uint64_t timestamp,
   result->clear();
   if (root_hash.size() != 32)
     return SerializeResult::INVALID_HASH_LENGTH;
-  WriteUint(ct::V1, Serializer::kVersionLengthInBytes, result);
-  WriteUint(ct::TREE_HEAD, Serializer::kSignatureTypeLengthInBytes, result);
-  WriteUint(timestamp, Serializer::kTimestampLengthInBytes, result);
-  WriteUint(tree_size, 8, result);
-  WriteFixedBytes(root_hash, result);
+  const size_t length(Serializer::kVersionLengthInBytes +
+                      Serializer::kSignatureTypeLengthInBytes +
+                      Serializer::kTimestampLengthInBytes + 8 +
+                      root_hash.size());
+  result->resize(length);
+  TLSWriter writer(&(*result)[0], length);
+  writer.WriteUint(ct::V1, Serializer::kVersionLengthInBytes);
+  writer.WriteUint(ct::TREE_HEAD, Serializer::kSignatureTypeLengthInBytes);
+  writer.WriteUint(timestamp, Serializer::kTimestampLengthInBytes);
+  writer.WriteUint(tree_size, 8);
+  writer.WriteFixedBytes(root_hash);
+  CHECK_EQ(0U, writer.Remaining());
   return SerializeResult::OK;
 }
 
@@ -225,11 +235,23 @@ SerializeResult WriteSCTV1(const SignedCertificateTimestamp& sct,
   if (sct.id().key_id().size() != Serializer::kKeyIDLengthInBytes) {
     return SerializeResult::INVALID_KEYID_LENGTH;
   }
-  WriteUint(sct.version(), Serializer::kVersionLengthInBytes, output);
-  WriteFixedBytes(sct.id().key_id(), output);
-  WriteUint(sct.timestamp(), Serializer::kTimestampLengthInBytes, output);
-  WriteVarBytes(sct.extensions(), Serializer::kMaxExtensionsLength, output);
-  return WriteDigitallySigned(sct.signature(), output);
+  const size_t offset(output->size());
+  const size_t length(
+      Serializer::kVersionLengthInBytes + sct.id().key_id().size() +
+      Serializer::kTimestampLengthInBytes +
+      VarBytesLength(sct.extensions(), Serializer::kMaxExtensionsLength) +
+      DigitallySignedLength(sct.signature()));
+  output->resize(offset + length);
+  TLSWriter writer(&(*output)[offset], length);
+  writer.WriteUint(sct.version(), Serializer::kVersionLengthInBytes);
+  writer.WriteFixedBytes(sct.id().key_id());
+  writer.WriteUint(sct.timestamp(), Serializer::kTimestampLengthInBytes);
+  writer.WriteVarBytes(sct.extensions(), Serializer::kMaxExtensionsLength);
+  res = writer.WriteDigitallySigned(sct.signature());
+  if (res == SerializeResult::OK) {
+    CHECK_EQ(0U, writer.Remaining());
+  }
+  return res;
 }
 
 void WriteSctExtension(const RepeatedPtrField<SctExtension>& extension,
@@ -314,7 +336,7 @@ SerializeResult Serializer::SerializeList(const repeated_string& in,
                                            max_total_length, &output);
   if (res != SerializeResult::OK)
     return res;
-  result->assign(output);
+  result->swap(output);
   return SerializeResult::OK;
 }
 
@@ -412,7 +434,7 @@ DeserializeResult ReadSCTV1(TLSDeserializer* deserializer,
     return DeserializeResult::INPUT_TOO_SHORT;
   }
   sct->set_timestamp(timestamp);
-  string extensions;
+  TLSDeserializer::Bytes extensions;
   if (!deserializer->ReadVarBytes(Serializer::kMaxExtensionsLength,
                                   &extensions)) {
     // In theory, could also be an invalid length prefix, but not if
@@ -442,7 +464,7 @@ DeserializeResult ReadSctExtension(TLSDeserializer* deserializer,
       return DeserializeResult::INPUT_TOO_SHORT;
     }
 
-    string ext_data;
+    TLSDeserializer::Bytes ext_data;
     if (!deserializer->ReadVarBytes(Serializer::kMaxExtensionsLength,
                                     &ext_data)) {
       return DeserializeResult::INPUT_TOO_SHORT;
@@ -450,7 +472,7 @@ DeserializeResult ReadSctExtension(TLSDeserializer* deserializer,
 
     SctExtension* new_ext = extension->Add();
     new_ext->set_sct_extension_type(ext_type);
-    new_ext->set_sct_extension_data(ext_data);
+    new_ext->set_sct_extension_data(ext_data.data, ext_data.size);
   }
 
   // This makes sure they're correctly ordered (See RFC section 5.3)
@@ -488,12 +510,12 @@ DeserializeResult ReadSCTV2(TLSDeserializer* deserializer,
 DeserializeResult ReadExtensionsV1(TLSDeserializer* deserializer,
                                    ct::TimestampedEntry* entry) {
   CHECK_NOTNULL(deserializer);
-  string extensions;
+  TLSDeserializer::Bytes extensions;
   if (!deserializer->ReadVarBytes(Serializer::kMaxExtensionsLength,
                                   &extensions)) {
     return DeserializeResult::INPUT_TOO_SHORT;
   }
-  CHECK_NOTNULL(entry)->set_extensions(extensions);
+  CHECK_NOTNULL(entry)->set_extensions(extensions.data, extensions.size);
   return DeserializeResult::OK;
 }
 
@@ -604,7 +626,7 @@ DeserializeResult Deserializer::DeserializeMerkleTreeLeaf(
 
 // static
 void Serializer::ConfigureV1(
-    const function<string(const ct::LogEntry&)>& leaf_data_func,
+    const function<const string&(const ct::LogEntry&)>& leaf_data_func,
     const function<SerializeResult(
         const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
         std::string* result)>& serialize_sct_sig_input_func,
@@ -624,7 +646,7 @@ void Serializer::ConfigureV1(
 
 // static
 void Serializer::ConfigureV2(
-    const function<string(const ct::LogEntry&)>& leaf_data_func,
+    const function<const string&(const ct::LogEntry&)>& leaf_data_func,
     const function<SerializeResult(
         const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
         std::string* result)>& serialize_sct_sig_input_func,
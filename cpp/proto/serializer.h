@@ -56,7 +56,7 @@ class Serializer {
   // API
   // TODO(alcutter): typedef these function<> bits
   static void ConfigureV1(
-      const std::function<std::string(const ct::LogEntry&)>& leaf_data,
+      const std::function<const std::string&(const ct::LogEntry&)>& leaf_data,
       const std::function<cert_trans::serialization::SerializeResult(
           const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
           std::string* result)>& serialize_sct_sig_input,
@@ -65,7 +65,7 @@ class Serializer {
           std::string* result)>& serialize_sct_merkle_leaf);
 
   static void ConfigureV2(
-      const std::function<std::string(const ct::LogEntry&)>& leaf_data,
+      const std::function<const std::string&(const ct::LogEntry&)>& leaf_data,
       const std::function<cert_trans::serialization::SerializeResult(
           const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
           std::string* result)>& serialize_sct_sig_input,
@@ -73,7 +73,8 @@ class Serializer {
           const ct::SignedCertificateTimestamp& sct, const ct::LogEntry& entry,
           std::string* result)>& serialize_sct_merkle_leaf);
 
-  static std::string LeafData(const ct::LogEntry& entry);
+  // Returns a reference into |entry|.
+  static const std::string& LeafData(const ct::LogEntry& entry);
 
   static cert_trans::serialization::SerializeResult SerializeSTHSignatureInput(
       const ct::SignedTreeHead& sth, std::string* result);
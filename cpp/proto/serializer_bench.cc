@@ -0,0 +1,191 @@
+#include <benchmark/benchmark.h>
+#include <glog/logging.h>
+#include <string>
+
+#include "log/test_signer.h"
+#include "proto/cert_serializer.h"
+#include "proto/ct.pb.h"
+#include "proto/serializer.h"
+#include "util/testing.h"
+
+namespace {
+
+using cert_trans::serialization::DeserializeResult;
+using cert_trans::serialization::SerializeResult;
+using std::string;
+
+
+void BM_SerializeSCT(benchmark::State& state) {
+  ct::SignedCertificateTimestamp sct;
+  TestSigner::SetDefaults(&sct);
+  string out;
+  for (auto _ : state) {
+    CHECK_EQ(SerializeResult::OK, Serializer::SerializeSCT(sct, &out));
+  }
+}
+BENCHMARK(BM_SerializeSCT);
+
+
+void BM_DeserializeSCT(benchmark::State& state) {
+  ct::SignedCertificateTimestamp sct;
+  TestSigner::SetDefaults(&sct);
+  string in;
+  CHECK_EQ(SerializeResult::OK, Serializer::SerializeSCT(sct, &in));
+  for (auto _ : state) {
+    CHECK_EQ(DeserializeResult::OK, Deserializer::DeserializeSCT(in, &sct));
+  }
+}
+BENCHMARK(BM_DeserializeSCT);
+
+
+// The argument is the number of SCTs in the list.
+void BM_SerializeSCTList(benchmark::State& state) {
+  string sct;
+  {
+    ct::SignedCertificateTimestamp s;
+    TestSigner::SetDefaults(&s);
+    CHECK_EQ(SerializeResult::OK, Serializer::SerializeSCT(s, &sct));
+  }
+  ct::SignedCertificateTimestampList list;
+  for (int i = 0; i < state.range(0); ++i) {
+    list.add_sct_list(sct);
+  }
+  string out;
+  for (auto _ : state) {
+    CHECK_EQ(SerializeResult::OK, Serializer::SerializeSCTList(list, &out));
+  }
+}
+BENCHMARK(BM_SerializeSCTList)->Arg(1)->Arg(5);
+
+
+void BM_DeserializeSCTList(benchmark::State& state) {
+  string sct;
+  {
+    ct::SignedCertificateTimestamp s;
+    TestSigner::SetDefaults(&s);
+    CHECK_EQ(SerializeResult::OK, Serializer::SerializeSCT(s, &sct));
+  }
+  ct::SignedCertificateTimestampList list;
+  for (int i = 0; i < state.range(0); ++i) {
+    list.add_sct_list(sct);
+  }
+  string in;
+  CHECK_EQ(SerializeResult::OK, Serializer::SerializeSCTList(list, &in));
+  for (auto _ : state) {
+    CHECK_EQ(DeserializeResult::OK,
+             Deserializer::DeserializeSCTList(in, &list));
+  }
+}
+BENCHMARK(BM_DeserializeSCTList)->Arg(1)->Arg(5);
+
+
+// The argument is whether the entry is for a precertificate.
+void BM_SerializeSCTMerkleTreeLeaf(benchmark::State& state) {
+  ct::SignedCertificateTimestamp sct;
+  ct::LogEntry entry;
+  if (state.range(0)) {
+    TestSigner::SetPrecertDefaults(&sct);
+    TestSigner::SetPrecertDefaults(&entry);
+  } else {
+    TestSigner::SetDefaults(&sct);
+    TestSigner::SetDefaults(&entry);
+  }
+  string out;
+  for (auto _ : state) {
+    CHECK_EQ(SerializeResult::OK,
+             Serializer::SerializeSCTMerkleTreeLeaf(sct, entry, &out));
+  }
+}
+BENCHMARK(BM_SerializeSCTMerkleTreeLeaf)->Arg(0)->Arg(1);
+
+
+// The argument is whether the entry is for a precertificate.
+void BM_SerializeSCTSignatureInput(benchmark::State& state) {
+  ct::SignedCertificateTimestamp sct;
+  ct::LogEntry entry;
+  if (state.range(0)) {
+    TestSigner::SetPrecertDefaults(&sct);
+    TestSigner::SetPrecertDefaults(&entry);
+  } else {
+    TestSigner::SetDefaults(&sct);
+    TestSigner::SetDefaults(&entry);
+  }
+  string out;
+  for (auto _ : state) {
+    CHECK_EQ(SerializeResult::OK,
+             Serializer::SerializeSCTSignatureInput(sct, entry, &out));
+  }
+}
+BENCHMARK(BM_SerializeSCTSignatureInput)->Arg(0)->Arg(1);
+
+
+void BM_LeafData(benchmark::State& state) {
+  ct::LogEntry entry;
+  TestSigner::SetDefaults(&entry);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(Serializer::LeafData(entry).size());
+  }
+}
+BENCHMARK(BM_LeafData);
+
+
+void BM_DeserializeMerkleTreeLeaf(benchmark::State& state) {
+  ct::SignedCertificateTimestamp sct;
+  ct::LogEntry entry;
+  if (state.range(0)) {
+    TestSigner::SetPrecertDefaults(&sct);
+    TestSigner::SetPrecertDefaults(&entry);
+  } else {
+    TestSigner::SetDefaults(&sct);
+    TestSigner::SetDefaults(&entry);
+  }
+  string in;
+  CHECK_EQ(SerializeResult::OK,
+           Serializer::SerializeSCTMerkleTreeLeaf(sct, entry, &in));
+  ct::MerkleTreeLeaf leaf;
+  for (auto _ : state) {
+    CHECK_EQ(DeserializeResult::OK,
+             Deserializer::DeserializeMerkleTreeLeaf(in, &leaf));
+  }
+}
+BENCHMARK(BM_DeserializeMerkleTreeLeaf)->Arg(0)->Arg(1);
+
+
+void BM_DeserializeX509Chain(benchmark::State& state) {
+  ct::LogEntry entry;
+  TestSigner::SetDefaults(&entry);
+  ct::X509ChainEntry chain;
+  for (int i = 0; i < 3; ++i) {
+    chain.add_certificate_chain(entry.x509_entry().leaf_certificate());
+  }
+  string in;
+  CHECK_EQ(SerializeResult::OK, SerializeX509Chain(chain, &in));
+  for (auto _ : state) {
+    CHECK_EQ(DeserializeResult::OK, DeserializeX509Chain(in, &chain));
+  }
+}
+BENCHMARK(BM_DeserializeX509Chain);
+
+
+void BM_SerializeSTHSignatureInput(benchmark::State& state) {
+  ct::SignedTreeHead sth;
+  TestSigner::SetDefaults(&sth);
+  string out;
+  for (auto _ : state) {
+    CHECK_EQ(SerializeResult::OK,
+             Serializer::SerializeSTHSignatureInput(sth, &out));
+  }
+}
+BENCHMARK(BM_SerializeSTHSignatureInput);
+
+
+}  // namespace
+
+
+int main(int argc, char** argv) {
+  benchmark::Initialize(&argc, argv);
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  ConfigureSerializerForV1CT();
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -1138,6 +1138,25 @@ TEST_F(SerializerTestV1, DeserializeSCTTooLong) {
             Deserializer::DeserializeSCT(token, &sct));
 }
 
+TEST_F(SerializerTestV1, DeserializeBytesWithoutCopying) {
+  const string input("\x03"
+                     "abc"
+                     "de",
+                     6);
+  TLSDeserializer deserializer(input);
+  TLSDeserializer::Bytes var_bytes;
+  ASSERT_TRUE(deserializer.ReadVarBytes(255, &var_bytes));
+  EXPECT_EQ(input.data() + 1, var_bytes.data);
+  EXPECT_EQ("abc", var_bytes.ToString());
+
+  TLSDeserializer::Bytes fixed_bytes;
+  EXPECT_FALSE(deserializer.ReadFixedBytes(3, &fixed_bytes));
+  ASSERT_TRUE(deserializer.ReadFixedBytes(2, &fixed_bytes));
+  EXPECT_EQ(input.data() + 4, fixed_bytes.data);
+  EXPECT_EQ("de", fixed_bytes.ToString());
+  EXPECT_TRUE(deserializer.ReachedEnd());
+}
+
 TEST_F(SerializerTestV1, SerializeSTHSignatureInputKatTestV1) {
   string result;
   EXPECT_EQ(SerializeResult::OK,
@@ -1,7 +1,6 @@
 /* -*- indent-tabs-mode: nil -*- */
 #include "proto/tls_encoding.h"
 
-#include <math.h>
 #include <ostream>
 #include <string>
 
@@ -145,6 +144,7 @@ SerializeResult WriteList(const repeated_string& in, size_t max_elem_length,
   size_t prefix_length = internal::PrefixLength(max_total_length);
   CHECK_GE(length, prefix_length);
 
+  output->reserve(output->size() + length);
   WriteUint(length - prefix_length, prefix_length, output);
 
   for (int i = 0; i < in.size(); ++i)
@@ -165,11 +165,40 @@ SerializeResult WriteDigitallySigned(const DigitallySigned& sig,
   return SerializeResult::OK;
 }
 
+void TLSWriter::WriteFixedBytes(const std::string& in) {
+  CHECK_LE(in.size(), Remaining());
+  memcpy(pos_, in.data(), in.size());
+  pos_ += in.size();
+}
+
+void TLSWriter::WriteVarBytes(const std::string& in, size_t max_length) {
+  CHECK_LE(in.size(), max_length);
+  WriteUint(in.size(), internal::PrefixLength(max_length));
+  WriteFixedBytes(in);
+}
+
+SerializeResult TLSWriter::WriteDigitallySigned(const DigitallySigned& sig) {
+  SerializeResult res = CheckSignatureFormat(sig);
+  if (res != SerializeResult::OK)
+    return res;
+  WriteUint(sig.hash_algorithm(), constants::kHashAlgorithmLengthInBytes);
+  WriteUint(sig.sig_algorithm(), constants::kSigAlgorithmLengthInBytes);
+  WriteVarBytes(sig.signature(), constants::kMaxSignatureLength);
+  return SerializeResult::OK;
+}
+
 namespace internal {
 
 size_t PrefixLength(size_t max_length) {
   CHECK_GT(max_length, 0U);
-  return ceil(log2(max_length) / float(8));
+  // The smallest number of bytes n such that 2^(8n) >= max_length, that
+  // is ceil(log2(max_length) / 8), without going through floating point.
+  size_t bytes(0);
+  while (bytes < sizeof(max_length) &&
+         (max_length - 1) >> (8 * bytes) != 0) {
+    ++bytes;
+  }
+  return bytes;
 }
 
 }  // namespace internal
@@ -192,16 +221,31 @@ TLSDeserializer::TLSDeserializer(const std::string& input)
 }
 
 
-bool TLSDeserializer::ReadFixedBytes(size_t bytes, std::string* result) {
+TLSDeserializer::TLSDeserializer(const char* input, size_t size)
+    : current_pos_(input), bytes_remaining_(size) {
+}
+
+
+bool TLSDeserializer::ReadFixedBytes(size_t bytes, Bytes* result) {
   if (bytes_remaining_ < bytes)
     return false;
-  result->assign(current_pos_, bytes);
+  result->data = current_pos_;
+  result->size = bytes;
   current_pos_ += bytes;
   bytes_remaining_ -= bytes;
   return true;
 }
 
 
+bool TLSDeserializer::ReadFixedBytes(size_t bytes, std::string* result) {
+  Bytes read;
+  if (!ReadFixedBytes(bytes, &read))
+    return false;
+  result->assign(read.data, read.size);
+  return true;
+}
+
+
 bool TLSDeserializer::ReadLengthPrefix(size_t max_length, size_t* result) {
   size_t prefix_length = cert_trans::serialization::internal::PrefixLength(max_length);
   size_t length;
@@ -212,17 +256,26 @@ bool TLSDeserializer::ReadLengthPrefix(size_t max_length, size_t* result) {
 }
 
 
-bool TLSDeserializer::ReadVarBytes(size_t max_length, std::string* result) {
+bool TLSDeserializer::ReadVarBytes(size_t max_length, Bytes* result) {
   size_t length;
   if (!ReadLengthPrefix(max_length, &length))
     return false;
   return ReadFixedBytes(length, result);
 }
 
+
+bool TLSDeserializer::ReadVarBytes(size_t max_length, std::string* result) {
+  Bytes read;
+  if (!ReadVarBytes(max_length, &read))
+    return false;
+  result->assign(read.data, read.size);
+  return true;
+}
+
 DeserializeResult TLSDeserializer::ReadList(size_t max_total_length,
                                             size_t max_elem_length,
                                             repeated_string* out) {
-  std::string serialized_list;
+  Bytes serialized_list;
   if (!ReadVarBytes(max_total_length, &serialized_list))
     // TODO(ekasper): could also be a length that's too large, if
     // length limits don't follow byte boundaries.
@@ -230,14 +283,15 @@ DeserializeResult TLSDeserializer::ReadList(size_t max_total_length,
   if (!ReachedEnd())
     return DeserializeResult::INPUT_TOO_LONG;
 
-  TLSDeserializer list_reader(serialized_list);
+  // The elements are copied straight from the input into |out|.
+  TLSDeserializer list_reader(serialized_list.data, serialized_list.size);
   while (!list_reader.ReachedEnd()) {
-    std::string elem;
+    Bytes elem;
     if (!list_reader.ReadVarBytes(max_elem_length, &elem))
       return DeserializeResult::INVALID_LIST_ENCODING;
-    if (elem.empty())
+    if (elem.size == 0)
       return DeserializeResult::EMPTY_ELEM_IN_LIST;
-    *(out->Add()) = elem;
+    out->Add()->assign(elem.data, elem.size);
   }
   return DeserializeResult::OK;
 }
@@ -254,13 +308,13 @@ DeserializeResult TLSDeserializer::ReadDigitallySigned(DigitallySigned* sig) {
   if (!ct::DigitallySigned_SignatureAlgorithm_IsValid(sig_algo))
     return DeserializeResult::INVALID_SIGNATURE_ALGORITHM;
 
-  std::string sig_string;
-  if (!ReadVarBytes(constants::kMaxSignatureLength, &sig_string))
+  Bytes sig_bytes;
+  if (!ReadVarBytes(constants::kMaxSignatureLength, &sig_bytes))
     return DeserializeResult::INPUT_TOO_SHORT;
   sig->set_hash_algorithm(
       static_cast<DigitallySigned::HashAlgorithm>(hash_algo));
   sig->set_sig_algorithm(
       static_cast<DigitallySigned::SignatureAlgorithm>(sig_algo));
-  sig->set_signature(sig_string);
+  sig->set_signature(sig_bytes.data, sig_bytes.size);
   return DeserializeResult::OK;
 }
@@ -2,6 +2,8 @@
 #define CERT_TRANS_PROTO_TLS_ENCODING_H_
 
 #include <glog/logging.h>
+#include <stdint.h>
+#include <string.h>
 #include <string>
 
 #include "proto/ct.pb.h"
@@ -56,6 +58,25 @@ enum class DeserializeResult {
 
 std::ostream& operator<<(std::ostream& stream, const DeserializeResult& r);
 
+namespace internal {
+
+// Returns the number of bytes needed to store a value up to max_length.
+size_t PrefixLength(size_t max_length);
+
+// Stores the low |bytes| bytes of |in| at |out|, big-endian, at once
+// rather than byte by byte.
+inline void StoreBigEndian(uint64_t in, size_t bytes, char* out) {
+  if (bytes == 0)
+    return;
+  uint64_t stored(in << (8 * (sizeof(in) - bytes)));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  stored = __builtin_bswap64(stored);
+#endif
+  memcpy(out, &stored, bytes);
+}
+
+}  // namespace internal
+
 ///////////////////////////////////////////////////////////////////////////////
 // Basic serialization functions.                                            //
 ///////////////////////////////////////////////////////////////////////////////
@@ -63,9 +84,9 @@ template <class T>
 void WriteUint(T in, size_t bytes, std::string* output) {
   CHECK_LE(bytes, sizeof(in));
   CHECK(bytes == sizeof(in) || in >> (bytes * 8) == 0);
-  for (; bytes > 0; --bytes)
-    output->push_back(((in & (static_cast<T>(0xff) << ((bytes - 1) * 8))) >>
-                       ((bytes - 1) * 8)));
+  char buffer[sizeof(uint64_t)];
+  internal::StoreBigEndian(in, bytes, buffer);
+  output->append(buffer, bytes);
 }
 
 // Fixed-length byte array.
@@ -89,12 +110,54 @@ static const size_t kHashAlgorithmLengthInBytes = 1;
 static const size_t kSigAlgorithmLengthInBytes = 1;
 }  // namespace constants
 
-namespace internal {
+// Length of the encoding of |in| by WriteVarBytes().
+inline size_t VarBytesLength(const std::string& in, size_t max_length) {
+  return internal::PrefixLength(max_length) + in.size();
+}
 
-// Returns the number of bytes needed to store a value up to max_length.
-size_t PrefixLength(size_t max_length);
+// Length of the encoding of |sig| by WriteDigitallySigned().
+inline size_t DigitallySignedLength(const ct::DigitallySigned& sig) {
+  return constants::kHashAlgorithmLengthInBytes +
+         constants::kSigAlgorithmLengthInBytes +
+         VarBytesLength(sig.signature(), constants::kMaxSignatureLength);
+}
 
-}  // namespace internal
+// Writes the same encodings as the functions above, into a buffer of
+// exactly the size of the output, computed beforehand (with the help
+// of VarBytesLength()). Structures serialized this way are written in
+// a single pass, without growing their output or allocating
+// temporaries along the way.
+class TLSWriter {
+ public:
+  TLSWriter(char* buffer, size_t size) : pos_(buffer), end_(buffer + size) {
+  }
+  TLSWriter(const TLSWriter&) = delete;
+  TLSWriter& operator=(const TLSWriter&) = delete;
+
+  template <class T>
+  void WriteUint(T in, size_t bytes) {
+    CHECK_LE(bytes, sizeof(in));
+    CHECK(bytes == sizeof(in) || in >> (bytes * 8) == 0);
+    CHECK_LE(bytes, Remaining());
+    internal::StoreBigEndian(in, bytes, pos_);
+    pos_ += bytes;
+  }
+
+  void WriteFixedBytes(const std::string& in);
+
+  // Caller is responsible for checking |in| <= max_length.
+  void WriteVarBytes(const std::string& in, size_t max_length);
+
+  SerializeResult WriteDigitallySigned(const ct::DigitallySigned& sig);
+
+  size_t Remaining() const {
+    return end_ - pos_;
+  }
+
+ private:
+  char* pos_;
+  char* const end_;
+};
 
 }  // namespace serializer
 
@@ -107,11 +170,29 @@ class TLSDeserializer {
   // (which could be to a temporary, and not valid once the
   // constructor returns).
   explicit TLSDeserializer(const std::string& input);
+  TLSDeserializer(const char* input, size_t size);
   TLSDeserializer(const TLSDeserializer&) = delete;
   TLSDeserializer& operator=(const TLSDeserializer&) = delete;
 
+  // A range of bytes of the input, read without copying them.
+  struct Bytes {
+    Bytes() : data(nullptr), size(0) {
+    }
+
+    std::string ToString() const {
+      return std::string(data, size);
+    }
+
+    const char* data;
+    size_t size;
+  };
+
+  bool ReadFixedBytes(size_t bytes, Bytes* result);
+
   bool ReadFixedBytes(size_t bytes, std::string* result);
 
+  bool ReadVarBytes(size_t max_length, Bytes* result);
+
   bool ReadVarBytes(size_t max_length, std::string* result);
 
   cert_trans::serialization::DeserializeResult ReadList(
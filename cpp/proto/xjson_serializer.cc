@@ -44,7 +44,7 @@ SerializeResult CheckJsonFormat(const string& json) {
 }
 
 
-string V1LeafData(const LogEntry& entry) {
+const string& V1LeafData(const LogEntry& entry) {
   CHECK(entry.has_x_json_entry());
   return entry.x_json_entry().json();
 }
@@ -0,0 +1,208 @@
+#include "server/access_log.h"
+
+#include <errno.h>
+#include <event2/http.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <type_traits>
+
+#include "monitoring/monitoring.h"
+
+using std::atomic;
+using std::chrono::milliseconds;
+using std::memory_order_acquire;
+using std::memory_order_relaxed;
+using std::memory_order_release;
+using std::string;
+using std::this_thread::sleep_for;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+static Counter<string>* access_log_records(
+    Counter<string>::New("access_log_records", "result",
+                         "Number of requests logged to the access log, by "
+                         "result (written, dropped or failed)."));
+
+static_assert(sizeof(AccessLog::Record) == 256,
+              "the layout of the records of the access log changed");
+static_assert(std::is_trivially_copyable<AccessLog::Record>::value,
+              "access log records are written as they are");
+
+// How much the writer writes at once, and how long it waits when
+// there is nothing to write.
+const size_t kMaxBatchRecords = 256;
+const milliseconds kIdleWait(10);
+
+
+}  // namespace
+
+
+struct AccessLog::Slot {
+  // position + 1 once the record for |position| is in, position +
+  // |buffer_records| once it is popped.
+  atomic<uint64_t> sequence;
+  Record record;
+};
+
+
+AccessLog::AccessLog(const string& path, size_t buffer_records)
+    : path_(path),
+      fd_(open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644)),
+      mask_(buffer_records - 1),
+      slots_(new Slot[buffer_records]),
+      push_position_(0),
+      pop_position_(0),
+      exiting_(false) {
+  PCHECK(fd_ >= 0) << "Cannot open " << path_;
+  CHECK_GT(buffer_records, 0U);
+  CHECK_EQ(buffer_records & mask_, 0U) << "Not a power of two: "
+                                       << buffer_records;
+  for (size_t i = 0; i < buffer_records; ++i) {
+    slots_[i].sequence.store(i, memory_order_relaxed);
+  }
+  writer_ = std::thread(&AccessLog::WriterLoop, this);
+}
+
+
+AccessLog::~AccessLog() {
+  exiting_ = true;
+  writer_.join();
+  PCHECK(close(fd_) == 0);
+}
+
+
+bool AccessLog::Log(const Record& record) {
+  uint64_t position(push_position_.load(memory_order_relaxed));
+  Slot* slot;
+  while (true) {
+    slot = &slots_[position & mask_];
+    const int64_t diff(static_cast<int64_t>(
+        slot->sequence.load(memory_order_acquire) - position));
+    if (diff == 0) {
+      if (push_position_.compare_exchange_weak(position, position + 1,
+                                               memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // Not popped since the last time around.
+      access_log_records->Increment("dropped");
+      return false;
+    } else {
+      position = push_position_.load(memory_order_relaxed);
+    }
+  }
+  slot->record = record;
+  slot->sequence.store(position + 1, memory_order_release);
+  return true;
+}
+
+
+bool AccessLog::Pop(Record* record) {
+  Slot* const slot(&slots_[pop_position_ & mask_]);
+  if (slot->sequence.load(memory_order_acquire) != pop_position_ + 1) {
+    return false;
+  }
+  *record = slot->record;
+  slot->sequence.store(pop_position_ + mask_ + 1, memory_order_release);
+  ++pop_position_;
+  return true;
+}
+
+
+void AccessLog::WriterLoop() {
+  vector<Record> batch(kMaxBatchRecords);
+  while (true) {
+    // Check before popping, so that nothing logged before exiting is
+    // left behind.
+    const bool exiting(exiting_.load());
+    size_t count(0);
+    while (count < batch.size() && Pop(&batch[count])) {
+      ++count;
+    }
+    if (count == 0) {
+      if (exiting) {
+        return;
+      }
+      sleep_for(kIdleWait);
+      continue;
+    }
+
+    const char* data(reinterpret_cast<const char*>(batch.data()));
+    size_t size(count * sizeof(Record));
+    while (size > 0) {
+      const ssize_t ret(write(fd_, data, size));
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      }
+      if (ret <= 0) {
+        PLOG_EVERY_N(ERROR, 100) << "Failed to write to " << path_;
+        break;
+      }
+      data += ret;
+      size -= ret;
+    }
+    size_t failed(0);
+    if (size > 0) {
+      // Drop whatever part of a record made it, so that the records
+      // after it stay in step.
+      failed = (size + sizeof(Record) - 1) / sizeof(Record);
+      const off_t end(lseek(fd_, 0, SEEK_END));
+      if (end > 0 && ftruncate(fd_, end - end % sizeof(Record)) != 0) {
+        PLOG_EVERY_N(ERROR, 100) << "Failed to truncate " << path_;
+      }
+    }
+    access_log_records->IncrementBy("failed", failed);
+    access_log_records->IncrementBy("written", count - failed);
+  }
+}
+
+
+// static
+bool AccessLog::CopyString(const char* str, char* dst, size_t size) {
+  const size_t length(strnlen(str, size + 1));
+  if (length > size) {
+    memcpy(dst, str, size);
+    return false;
+  }
+  memcpy(dst, str, length);
+  memset(dst + length, 0, size - length);
+  return true;
+}
+
+
+// static
+AccessLog::Method AccessLog::MethodOf(evhttp_request* req) {
+  switch (evhttp_request_get_command(req)) {
+    case EVHTTP_REQ_DELETE:
+      return DELETE;
+    case EVHTTP_REQ_GET:
+      return GET;
+    case EVHTTP_REQ_HEAD:
+      return HEAD;
+    case EVHTTP_REQ_POST:
+      return POST;
+    case EVHTTP_REQ_PUT:
+      return PUT;
+    default:
+      return UNKNOWN;
+  }
+}
+
+
+// static
+vector<AccessLog::Record> AccessLog::ParseRecords(const string& data) {
+  vector<Record> records(data.size() / sizeof(Record));
+  if (!records.empty()) {
+    memcpy(records.data(), data.data(), records.size() * sizeof(Record));
+  }
+  return records;
+}
+
+
+}  // namespace cert_trans
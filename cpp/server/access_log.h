@@ -0,0 +1,101 @@
+#ifndef CERT_TRANS_SERVER_ACCESS_LOG_H_
+#define CERT_TRANS_SERVER_ACCESS_LOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct evhttp_request;
+
+namespace cert_trans {
+
+
+// Logs a binary record of every request served to a file, without
+// the threads serving them ever formatting a string or waiting on the
+// disk: Log() copies the record into a lock-free ring buffer, and a
+// background thread writes them out in batches. When the buffer is
+// full (the disk cannot keep up), records are dropped and counted
+// rather than waited for.
+//
+// The file is a sequence of Records, each exactly sizeof(Record)
+// bytes, in the byte order of the host; see ParseRecords().
+//
+// This class is thread-safe.
+class AccessLog {
+ public:
+  enum Method : uint8_t {
+    UNKNOWN = 0,
+    GET = 1,
+    POST = 2,
+    HEAD = 3,
+    PUT = 4,
+    DELETE = 5,
+  };
+
+  struct Record {
+    // When the reply was sent, in microseconds since the epoch.
+    int64_t timestamp_us;
+    // From when the request was received, or -1 if it was not timed.
+    int32_t duration_us;
+    int32_t response_bytes;
+    int16_t status;
+    Method method;
+    // 1 if |uri| was cut short.
+    uint8_t truncated;
+    // NUL-padded, without a NUL if they fill the array.
+    char peer[48];
+    char uri[188];
+  };
+
+  // Appends to the file at |path|, keeping up to |buffer_records|
+  // records not yet written, which must be a power of two.
+  AccessLog(const std::string& path, size_t buffer_records);
+  // Writes out the records logged so far.
+  ~AccessLog();
+  AccessLog(const AccessLog&) = delete;
+  AccessLog& operator=(const AccessLog&) = delete;
+
+  // Queues |record| to be written. Returns false if it was dropped,
+  // as the buffer was full.
+  bool Log(const Record& record);
+
+  // Copies |str| into |dst|, an array of |size| bytes, as the strings
+  // of a Record are. Returns false if it was cut short.
+  static bool CopyString(const char* str, char* dst, size_t size);
+
+  // The method of |req|.
+  static Method MethodOf(evhttp_request* req);
+
+  // The records in |data|, as read from the file. A record cut short
+  // at the end (the server died while writing it) is ignored.
+  static std::vector<Record> ParseRecords(const std::string& data);
+
+ private:
+  struct Slot;
+
+  // Only called by |writer_|.
+  bool Pop(Record* record);
+  void WriterLoop();
+
+  const std::string path_;
+  const int fd_;
+  const uint64_t mask_;
+  const std::unique_ptr<Slot[]> slots_;
+  // The next position to push to. Pushers claim them in turn, and
+  // each slot has a sequence number telling whether it is free for
+  // the push at that position, or holds a record to pop.
+  std::atomic<uint64_t> push_position_;
+  // The next position to pop from, only touched by |writer_|.
+  uint64_t pop_position_;
+  std::atomic<bool> exiting_;
+  std::thread writer_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_ACCESS_LOG_H_
@@ -0,0 +1,137 @@
+#include "server/access_log.h"
+
+#include <gtest/gtest.h>
+#include <string.h>
+#include <atomic>
+#include <memory>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "util/test_db.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace cert_trans {
+namespace {
+
+using std::atomic;
+using std::set;
+using std::string;
+using std::thread;
+using std::unique_ptr;
+using std::vector;
+
+
+class AccessLogTest : public ::testing::Test {
+ protected:
+  string Path() const {
+    return tmp_.TmpStorageDir() + "/access_log";
+  }
+
+  vector<AccessLog::Record> ReadRecords() const {
+    string data;
+    CHECK(util::ReadBinaryFile(Path(), &data));
+    EXPECT_EQ(0U, data.size() % sizeof(AccessLog::Record));
+    return AccessLog::ParseRecords(data);
+  }
+
+  TmpStorage tmp_;
+};
+
+
+AccessLog::Record MakeRecord(int64_t timestamp_us, const char* uri) {
+  AccessLog::Record record;
+  record.timestamp_us = timestamp_us;
+  record.duration_us = 12;
+  record.response_bytes = 345;
+  record.status = 200;
+  record.method = AccessLog::GET;
+  record.truncated =
+      !AccessLog::CopyString(uri, record.uri, sizeof(record.uri));
+  AccessLog::CopyString("127.0.0.1", record.peer, sizeof(record.peer));
+  return record;
+}
+
+
+TEST_F(AccessLogTest, WritesRecords) {
+  {
+    AccessLog log(Path(), 16);
+    EXPECT_TRUE(log.Log(MakeRecord(1, "/ct/v1/get-sth")));
+    EXPECT_TRUE(log.Log(MakeRecord(2, "/ct/v1/get-entries?start=0&end=1")));
+  }
+
+  const vector<AccessLog::Record> records(ReadRecords());
+  ASSERT_EQ(2U, records.size());
+  EXPECT_EQ(1, records[0].timestamp_us);
+  EXPECT_EQ(12, records[0].duration_us);
+  EXPECT_EQ(345, records[0].response_bytes);
+  EXPECT_EQ(200, records[0].status);
+  EXPECT_EQ(AccessLog::GET, records[0].method);
+  EXPECT_EQ(0, records[0].truncated);
+  EXPECT_STREQ("/ct/v1/get-sth", records[0].uri);
+  EXPECT_STREQ("127.0.0.1", records[0].peer);
+  EXPECT_EQ(2, records[1].timestamp_us);
+  EXPECT_STREQ("/ct/v1/get-entries?start=0&end=1", records[1].uri);
+
+  // Reopening appends.
+  {
+    AccessLog log(Path(), 16);
+    EXPECT_TRUE(log.Log(MakeRecord(3, "/ct/v1/get-roots")));
+  }
+  ASSERT_EQ(3U, ReadRecords().size());
+}
+
+
+TEST_F(AccessLogTest, WritesEveryRecordItAccepts) {
+  const int kThreads = 4;
+  const int kRecordsPerThread = 20000;
+  atomic<int> accepted(0);
+  {
+    // Small enough to fill up.
+    AccessLog log(Path(), 4);
+    vector<thread> threads;
+    for (int i = 0; i < kThreads; ++i) {
+      threads.emplace_back([&log, &accepted, i]() {
+        for (int j = 0; j < kRecordsPerThread; ++j) {
+          if (log.Log(MakeRecord(i * kRecordsPerThread + j, "/"))) {
+            ++accepted;
+          }
+        }
+      });
+    }
+    for (thread& t : threads) {
+      t.join();
+    }
+  }
+
+  const vector<AccessLog::Record> records(ReadRecords());
+  EXPECT_EQ(static_cast<size_t>(accepted.load()), records.size());
+  set<int64_t> timestamps;
+  for (const AccessLog::Record& record : records) {
+    EXPECT_STREQ("/", record.uri);
+    EXPECT_TRUE(timestamps.insert(record.timestamp_us).second);
+  }
+}
+
+
+TEST_F(AccessLogTest, CopiesStrings) {
+  char dst[4];
+  EXPECT_TRUE(AccessLog::CopyString("ab", dst, sizeof(dst)));
+  EXPECT_EQ(0, memcmp("ab\0\0", dst, 4));
+  EXPECT_TRUE(AccessLog::CopyString("abcd", dst, sizeof(dst)));
+  EXPECT_EQ(0, memcmp("abcd", dst, 4));
+  EXPECT_FALSE(AccessLog::CopyString("abcde", dst, sizeof(dst)));
+  EXPECT_EQ(0, memcmp("abcd", dst, 4));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -1,77 +1,144 @@
+#include <gflags/gflags.h>
+#include <string.h>
 #include <functional>
+#include <vector>
 
 #include "log/frontend.h"
+#include "merkletree/serial_hasher.h"
 #include "server/certificate_handler.h"
 #include "server/json_output.h"
 #include "util/json_wrapper.h"
+#include "util/parallel_for.h"
 #include "util/status.h"
+#include "util/sync_task.h"
+#include "util/task.h"
 #include "util/thread_pool.h"
+#include "util/trace.h"
+#include "monitoring/monitoring.h"
+#include "util/util.h"
+
+DEFINE_int32(num_submission_threads, 8,
+             "Number of threads checking add-chain and add-pre-chain "
+             "submissions.");
+DEFINE_int32(max_pending_submissions, 256,
+             "Maximum number of add-chain and add-pre-chain submissions "
+             "queued or being processed. Beyond that, they are refused "
+             "with a 429.");
+DEFINE_int32(max_chains_per_bulk_submission, 0,
+             "Maximum number of chains in one add-chains request. The "
+             "(non-standard) add-chains endpoint is only served if this is "
+             "positive.");
 
 namespace cert_trans {
 
 using ct::LogEntry;
 using ct::SignedCertificateTimestamp;
 using std::bind;
+using std::lock_guard;
 using std::make_shared;
 using std::move;
 using std::multimap;
+using std::mutex;
 using std::placeholders::_1;
 using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
+using std::vector;
 using util::Status;
+using util::SyncTask;
+using util::Task;
 
 
 namespace {
 
 
-bool ExtractChain(libevent::Base* base, evhttp_request* req,
-                  CertChain* chain) {
+// Strong enough to tell sets of roots apart, short enough for a header.
+const size_t kRootsETagBytes = 16;
+
+
+Status ParseChain(const JsonArray& json_chain, CertChain* chain) {
+  VLOG(2) << "ParseChain chain:\n" << json_chain.DebugString();
+
+  // The certificates are decoded straight from the JSON strings into a
+  // buffer kept by each thread, rather than into a new string each.
+  static thread_local vector<unsigned char> der;
+  for (int i = 0; i < json_chain.Length(); ++i) {
+    JsonString json_cert(json_chain, i);
+    if (!json_cert.Ok()) {
+      return Status(util::error::INVALID_ARGUMENT,
+                    "Unable to parse provided JSON.");
+    }
+
+    const int der_length(util::FromBase64(json_cert.Value(), &der));
+    unique_ptr<Cert> cert(
+        der_length > 0 ? Cert::FromDerBuffer(der.data(), der_length)
+                       : nullptr);
+    if (!cert) {
+      return Status(util::error::INVALID_ARGUMENT,
+                    "Unable to parse provided chain.");
+    }
+
+    chain->AddCert(move(cert));
+  }
+
+  return ::util::OkStatus();
+}
+
+
+// Returns the body of a POST request, or replies to |req| and returns
+// NULL if it is not one with a JSON object in it.
+unique_ptr<JsonObject> ExtractJsonBody(libevent::Base* base,
+                                       evhttp_request* req) {
   if (evhttp_request_get_command(req) != EVHTTP_REQ_POST) {
     SendJsonError(base, req, HTTP_BADMETHOD, "Method not allowed.");
-    return false;
+    return nullptr;
   }
 
   // TODO(pphaneuf): Should we check that Content-Type says
   // "application/json", as recommended by RFC4627?
-  JsonObject json_body(evhttp_request_get_input_buffer(req));
-  if (!json_body.Ok() || !json_body.IsType(json_type_object)) {
+  unique_ptr<JsonObject> json_body(
+      new JsonObject(evhttp_request_get_input_buffer(req)));
+  if (!json_body->Ok() || !json_body->IsType(json_type_object)) {
     SendJsonError(base, req, HTTP_BADREQUEST,
                   "Unable to parse provided JSON.");
+    return nullptr;
+  }
+  return json_body;
+}
+
+
+bool ExtractChain(libevent::Base* base, evhttp_request* req,
+                  CertChain* chain) {
+  const unique_ptr<JsonObject> json_body(ExtractJsonBody(base, req));
+  if (!json_body) {
     return false;
   }
 
-  JsonArray json_chain(json_body, "chain");
+  JsonArray json_chain(*json_body, "chain");
   if (!json_chain.Ok()) {
     SendJsonError(base, req, HTTP_BADREQUEST,
                   "Unable to parse provided JSON.");
     return false;
   }
 
-  VLOG(2) << "ExtractChain chain:\n" << json_chain.DebugString();
-
-  for (int i = 0; i < json_chain.Length(); ++i) {
-    JsonString json_cert(json_chain, i);
-    if (!json_cert.Ok()) {
-      SendJsonError(base, req, HTTP_BADREQUEST,
-                    "Unable to parse provided JSON.");
-      return false;
-    }
-
-    unique_ptr<Cert> cert(Cert::FromDerString(json_cert.FromBase64()));
-    if (!cert) {
-      SendJsonError(base, req, HTTP_BADREQUEST,
-                    "Unable to parse provided chain.");
-      return false;
-    }
-
-    chain->AddCert(move(cert));
+  const Status status(ParseChain(json_chain, chain));
+  if (!status.ok()) {
+    SendJsonError(base, req, HTTP_BADREQUEST, status.error_message());
+    return false;
   }
 
   return true;
 }
 
 
+// Runs |work| once |task| is done, which is when a submission has been
+// delayed for long enough. Takes ownership of |task|.
+void RunDelayed(const std::function<void()>& work, Task* task) {
+  const unique_ptr<Task> task_deleter(task);
+  work();
+}
+
+
 CertSubmissionHandler* MaybeCreateSubmissionHandler(
     const CertChecker* checker) {
   if (checker != nullptr) {
@@ -84,6 +151,18 @@ CertSubmissionHandler* MaybeCreateSubmissionHandler(
 }  // namespace
 
 
+// The get-roots reply only changes with the trusted roots, which are
+// normally loaded once at startup, so it is rendered and compressed
+// once rather than for every request.
+struct CertificateHttpHandler::RootsReply {
+  // What it was rendered from.
+  shared_ptr<const CertChecker::TrustStore> trust_store;
+  string json_body;
+  string gzipped_body;
+  string etag;
+};
+
+
 CertificateHttpHandler::CertificateHttpHandler(
     LogLookup* log_lookup, const ReadOnlyDatabase* db,
     const ClusterStateController* controller, const CertChecker* cert_checker,
@@ -93,13 +172,24 @@ CertificateHttpHandler::CertificateHttpHandler(
                   staleness_tracker),
       cert_checker_(cert_checker),
       submission_handler_(MaybeCreateSubmissionHandler(cert_checker_)),
-      frontend_(frontend) {
+      frontend_(frontend),
+      submission_work_(frontend_
+                           ? new WorkClass("submission",
+                                           FLAGS_num_submission_threads,
+                                           FLAGS_max_pending_submissions)
+                           : nullptr) {
+}
+
+
+CertificateHttpHandler::~CertificateHttpHandler() {
 }
 
 
 void CertificateHttpHandler::AddHandlers(libevent::HttpServer* server) {
   // TODO(alcutter): Support this for mirrors too
   if (cert_checker_) {
+    // Render the reply now, rather than on the first request.
+    GetRootsReply();
     // Don't really need to proxy this one, but may as well just to keep
     // everything tidy:
     AddProxyWrappedHandler(server, "/ct/v1/get-roots",
@@ -114,23 +204,31 @@ void CertificateHttpHandler::AddHandlers(libevent::HttpServer* server) {
     AddProxyWrappedHandler(server, "/ct/v1/add-pre-chain",
                            bind(&CertificateHttpHandler::AddPreChain, this,
                                 _1));
+    if (FLAGS_max_chains_per_bulk_submission > 0) {
+      AddProxyWrappedHandler(server, "/ct/v1/add-chains",
+                             bind(&CertificateHttpHandler::AddChains, this,
+                                  _1));
+    }
   }
 }
 
 
-void CertificateHttpHandler::GetRoots(evhttp_request* req) const {
-  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
-    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
-                         "Method not allowed.");
+shared_ptr<const CertificateHttpHandler::RootsReply>
+CertificateHttpHandler::GetRootsReply() const {
+  // Any change to the roots makes a new trust store.
+  const shared_ptr<const CertChecker::TrustStore> trust_store(
+      cert_checker_->GetTrustStore());
+  lock_guard<mutex> lock(roots_reply_lock_);
+  if (roots_reply_ && roots_reply_->trust_store == trust_store) {
+    return roots_reply_;
   }
 
   JsonArray roots;
-  for (const auto& trusted_cert : cert_checker_->GetTrustedCertificates()) {
+  for (const auto& trusted_cert : trust_store->certs()) {
     string cert;
     if (trusted_cert.second->DerEncoding(&cert) != ::util::OkStatus()) {
       LOG(ERROR) << "Cert encoding failed";
-      return SendJsonError(event_base_, req, HTTP_INTERNAL,
-                           "Serialisation failed.");
+      return nullptr;
     }
     roots.AddBase64(cert);
   }
@@ -138,7 +236,54 @@ void CertificateHttpHandler::GetRoots(evhttp_request* req) const {
   JsonObject json_reply;
   json_reply.Add("certificates", roots);
 
-  SendJsonReply(event_base_, req, HTTP_OK, json_reply);
+  const shared_ptr<RootsReply> reply(make_shared<RootsReply>());
+  reply->trust_store = trust_store;
+  reply->json_body = json_reply.ToString();
+  reply->gzipped_body = GzipJsonBody(reply->json_body);
+  reply->etag =
+      "\"" + util::HexString(Sha256Hasher::Sha256Digest(reply->json_body)
+                                 .substr(0, kRootsETagBytes)) +
+      "\"";
+  VLOG(1) << "Rendered get-roots reply for " << trust_store->certs().size()
+          << " roots, " << reply->json_body.size() << " bytes ("
+          << reply->gzipped_body.size() << " gzipped), ETag " << reply->etag;
+
+  roots_reply_ = reply;
+  return roots_reply_;
+}
+
+
+void CertificateHttpHandler::GetRoots(evhttp_request* req) const {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
+                         "Method not allowed.");
+  }
+
+  const shared_ptr<const RootsReply> reply(GetRootsReply());
+  if (!reply) {
+    return SendJsonError(event_base_, req, HTTP_INTERNAL,
+                         "Serialisation failed.");
+  }
+
+  CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(req), "ETag",
+                             reply->etag.c_str()),
+           0);
+  const char* const if_none_match(evhttp_find_header(
+      evhttp_request_get_input_headers(req), "If-None-Match"));
+  if (if_none_match && (strcmp(if_none_match, "*") == 0 ||
+                        strstr(if_none_match, reply->etag.c_str()))) {
+    return SendJsonReply(event_base_, req, HTTP_NOTMODIFIED, string());
+  }
+
+  // The bodies are referred to rather than copied, for as long as the
+  // reply is being sent.
+  if (AcceptsGzip(req)) {
+    return SendGzippedJsonReply(
+        event_base_, req, HTTP_OK,
+        shared_ptr<const string>(reply, &reply->gzipped_body));
+  }
+  SendJsonReply(event_base_, req, HTTP_OK,
+                shared_ptr<const string>(reply, &reply->json_body));
 }
 
 
@@ -148,8 +293,8 @@ void CertificateHttpHandler::AddChain(evhttp_request* req) {
     return;
   }
 
-  pool_->Add(
-      bind(&CertificateHttpHandler::BlockingAddChain, this, req, chain));
+  StartSubmission(
+      req, bind(&CertificateHttpHandler::BlockingAddChain, this, req, chain));
 }
 
 
@@ -159,34 +304,200 @@ void CertificateHttpHandler::AddPreChain(evhttp_request* req) {
     return;
   }
 
-  pool_->Add(
-      bind(&CertificateHttpHandler::BlockingAddPreChain, this, req, chain));
+  StartSubmission(req, bind(&CertificateHttpHandler::BlockingAddPreChain,
+                            this, req, chain));
+}
+
+
+// Takes {"chains": [<chain>, ...]}, each chain as in add-chain, and
+// replies with:
+//
+//   {"scts": [<add-chain reply>, ...]}
+//
+// in the same order, with an {"error_message": <message>} in place of
+// the SCT for each chain which was not accepted. The chains are checked
+// and queued in parallel, and count as that many submissions.
+void CertificateHttpHandler::AddChains(evhttp_request* req) {
+  const unique_ptr<JsonObject> json_body(ExtractJsonBody(event_base_, req));
+  if (!json_body) {
+    return;
+  }
+
+  JsonArray json_chains(*json_body, "chains");
+  if (!json_chains.Ok() || json_chains.Length() == 0 ||
+      json_chains.Length() > FLAGS_max_chains_per_bulk_submission) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or too many chains.");
+  }
+
+  const shared_ptr<vector<CertChain>> chains(
+      make_shared<vector<CertChain>>(json_chains.Length()));
+  for (int i = 0; i < json_chains.Length(); ++i) {
+    JsonArray json_chain(json_chains, i);
+    const Status status(json_chain.Ok()
+                            ? ParseChain(json_chain, &(*chains)[i])
+                            : Status(util::error::INVALID_ARGUMENT,
+                                     "Unable to parse provided JSON."));
+    if (!status.ok()) {
+      return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                           status.error_message());
+    }
+  }
+
+  StartSubmission(req, bind(&CertificateHttpHandler::BlockingAddChains,
+                            this, req, chains),
+                  chains->size());
+}
+
+
+void CertificateHttpHandler::StartSubmission(evhttp_request* req,
+                                             const std::function<void()>& work,
+                                             int count) {
+  // As it was before these, which are turned away below if they do
+  // not fit.
+  frontend_->admission()->SetLoad(
+      AdmissionController::Signal::SUBMISSION_QUEUE,
+      submission_work_->Load());
+  if (!submission_work_->Admit(count)) {
+    return SendJsonError(event_base_, req, kHttpTooManyRequests,
+                         "Too many pending submissions.");
+  }
+
+  const AdmissionController::Decision decision(frontend_->AdmitSubmission());
+  switch (decision.action) {
+    case AdmissionController::Action::ADMIT:
+      submission_work_->Add(work);
+      return;
+    case AdmissionController::Action::DELAY:
+      submission_work_->Delay(decision.delay,
+                              new Task(bind(&RunDelayed, work, _1),
+                                       submission_work_.get()));
+      return;
+    case AdmissionController::Action::THROTTLE:
+      submission_work_->Done(count);
+      return SendJsonError(event_base_, req, kHttpTooManyRequests,
+                           "Log is busy, try again later.");
+    case AdmissionController::Action::REJECT:
+      submission_work_->Done(count);
+      return SendJsonError(event_base_, req, HTTP_SERVUNAVAIL,
+                           "Log is overloaded, try again later.");
+  }
+  LOG(FATAL) << "unknown action " << static_cast<int>(decision.action);
+}
+
+
+void CertificateHttpHandler::QueueX509Chain(CertChain* chain,
+                                            SignedCertificateTimestamp* sct,
+                                            Task* task) const {
+  // Answer resubmissions of logged certificates without checking the
+  // chain again: the SCT is only about the leaf certificate.
+  {
+    const util::trace::ScopedSpan span("lookup_x509_chain");
+    const Status lookup_status(frontend_->LookupX509Chain(*chain, sct));
+    if (lookup_status.CanonicalCode() == util::error::ALREADY_EXISTS) {
+      task->Return(lookup_status);
+      return;
+    }
+  }
+
+  LogEntry entry;
+  Status status;
+  {
+    const util::trace::ScopedSpan span("process_x509_submission");
+    status = submission_handler_->ProcessX509Submission(chain, &entry);
+  }
+  frontend_->QueueProcessedEntryAsync(status, move(entry), sct, task);
 }
 
 
+void CertificateHttpHandler::AddEntryDone(
+    evhttp_request* req, RequestArena* arena,
+    const SignedCertificateTimestamp* sct, Task* task) const {
+  const unique_ptr<RequestArena> arena_deleter(arena);
+  const unique_ptr<Task> task_deleter(task);
+
+  AddEntryReply(req, task->status(), *sct);
+  submission_work_->Done();
+}
+
+
+// The chain is checked on a submission thread, but the thread does not
+// wait for the consistent store to take the entry: the reply is sent
+// once it has, so that the number of submissions in flight is not
+// bounded by the number of threads.
 void CertificateHttpHandler::BlockingAddChain(
     evhttp_request* req, const shared_ptr<CertChain>& chain) const {
-  SignedCertificateTimestamp sct;
+  const util::trace::ScopedSpan span("add_chain");
+  RequestArena* const arena(new RequestArena);
+  SignedCertificateTimestamp* const sct(
+      arena->Create<SignedCertificateTimestamp>());
+  QueueX509Chain(chain.get(), sct,
+                 new Task(bind(&CertificateHttpHandler::AddEntryDone, this,
+                               req, arena, sct, _1),
+                          submission_work_.get()));
+}
 
-  LogEntry entry;
-  const Status status(frontend_->QueueProcessedEntry(
-      submission_handler_->ProcessX509Submission(chain.get(), &entry), entry,
-      &sct));
 
-  AddEntryReply(req, status, sct);
+void CertificateHttpHandler::BlockingAddChains(
+    evhttp_request* req, const shared_ptr<vector<CertChain>>& chains) const {
+  const util::trace::ScopedSpan span("add_chains");
+  vector<Status> statuses(chains->size());
+  RequestArena arena;
+  vector<SignedCertificateTimestamp*> scts(chains->size());
+  for (SignedCertificateTimestamp*& sct : scts) {
+    sct = arena.Create<SignedCertificateTimestamp>();
+  }
+  util::ParallelFor(submission_work_.get(), chains->size(),
+                    [this, &chains, &statuses, &scts](size_t i) {
+                      // The continuations run on |pool_|, as the
+                      // submission threads are all waiting here.
+                      SyncTask task(pool_);
+                      QueueX509Chain(&(*chains)[i], scts[i], task.task());
+                      task.Wait();
+                      statuses[i] = task.status();
+                    });
+
+  JsonArray json_scts;
+  for (size_t i = 0; i < chains->size(); ++i) {
+    JsonObject json_sct;
+    if (statuses[i].ok() ||
+        statuses[i].CanonicalCode() == util::error::ALREADY_EXISTS) {
+      AddSctFields(*scts[i], &json_sct);
+    } else {
+      VLOG(1) << "error adding chain: " << statuses[i];
+      json_sct.Add("error_message", statuses[i].error_message());
+    }
+    json_scts.Add(&json_sct);
+  }
+
+  JsonObject json_reply;
+  json_reply.Add("scts", json_scts);
+
+  SendJsonReply(event_base_, req, HTTP_OK, json_reply);
+  submission_work_->Done(chains->size());
 }
 
 
+// Like BlockingAddChain(), only the checking happens on this thread.
 void CertificateHttpHandler::BlockingAddPreChain(
     evhttp_request* req, const shared_ptr<PreCertChain>& chain) const {
-  SignedCertificateTimestamp sct;
+  const util::trace::ScopedSpan span("add_pre_chain");
 
   LogEntry entry;
-  const Status status(frontend_->QueueProcessedEntry(
-      submission_handler_->ProcessPreCertSubmission(chain.get(), &entry),
-      entry, &sct));
-
-  AddEntryReply(req, status, sct);
+  Status process_status;
+  {
+    const util::trace::ScopedSpan span("process_precert_submission");
+    process_status =
+        submission_handler_->ProcessPreCertSubmission(chain.get(), &entry);
+  }
+  RequestArena* const arena(new RequestArena);
+  SignedCertificateTimestamp* const sct(
+      arena->Create<SignedCertificateTimestamp>());
+  frontend_->QueueProcessedEntryAsync(
+      process_status, move(entry), sct,
+      new Task(bind(&CertificateHttpHandler::AddEntryDone, this, req, arena,
+                    sct, _1),
+               submission_work_.get()));
 }
 
 
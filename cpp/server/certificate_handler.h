@@ -1,11 +1,19 @@
 #ifndef CERT_TRANS_SERVER_CERTIFICATE_HANDLER_H_
 #define CERT_TRANS_SERVER_CERTIFICATE_HANDLER_H_
 
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
 #include "log/cert_submission_handler.h"
 #include "log/database.h"
 #include "log/logged_entry.h"
 #include "server/handler.h"
+#include "server/request_arena.h"
 #include "server/staleness_tracker.h"
+#include "server/work_class.h"
+#include "util/task.h"
 
 namespace cert_trans {
 
@@ -16,13 +24,18 @@ class CertificateHttpHandler : public HttpHandler {
   // this instance. The |frontend| and |cert_checker| parameters can be NULL,
   // in which case this server will not accept "add-chain" and "add-pre-chain"
   // requests.
+  //
+  // The submissions are checked on threads of their own, so that they
+  // do not hold up the other requests, and turned away with a 429
+  // when too many are already waiting. They are also delayed or turned
+  // away as the backends get loaded, see Frontend::AdmitSubmission().
   CertificateHttpHandler(LogLookup* log_lookup, const ReadOnlyDatabase* db,
                          const ClusterStateController* controller,
                          const CertChecker* cert_checker, Frontend* frontend,
                          ThreadPool* pool, libevent::Base* event_base,
                          StalenessTracker* staleness_tracker);
 
-  ~CertificateHttpHandler() = default;
+  ~CertificateHttpHandler();
   CertificateHttpHandler(const CertificateHttpHandler&) = delete;
   CertificateHttpHandler& operator=(const CertificateHttpHandler&) = delete;
 
@@ -30,16 +43,50 @@ class CertificateHttpHandler : public HttpHandler {
   void AddHandlers(libevent::HttpServer* server) override;
 
  private:
+  struct RootsReply;
+
   const CertChecker* const cert_checker_;
   const std::unique_ptr<CertSubmissionHandler> submission_handler_;
   Frontend* const frontend_;
 
+  mutable std::mutex roots_reply_lock_;
+  mutable std::shared_ptr<const RootsReply> roots_reply_;
+
+  // The submissions queued or being processed. NULL if |frontend_|
+  // is. Last, so that it is stopped before the rest goes away.
+  const std::unique_ptr<WorkClass> submission_work_;
+
+  // Returns the get-roots reply, rendering it if the trusted roots have
+  // changed since the last call, or NULL if they cannot be encoded.
+  std::shared_ptr<const RootsReply> GetRootsReply() const;
+
   void GetRoots(evhttp_request* req) const;
   void AddChain(evhttp_request* req);
   void AddPreChain(evhttp_request* req);
+  void AddChains(evhttp_request* req);
+
+  // Counts |count| new submissions in |submission_work_| and runs
+  // |work| there, after a delay if the frontend asks for one. Replies
+  // to |req| instead if there would be too many submissions, or if the
+  // frontend turns them away.
+  void StartSubmission(evhttp_request* req, const std::function<void()>& work,
+                       int count = 1);
 
+  // Checks |chain| and queues it, returning the status on |task|,
+  // which continues without a thread waiting on the consistent store.
+  // |sct| must stay valid until |task| is done.
+  void QueueX509Chain(CertChain* chain, ct::SignedCertificateTimestamp* sct,
+                      util::Task* task) const;
+  // Replies to an add-chain or add-pre-chain request once its |task|
+  // is done. Takes ownership of |arena| (which |sct| is on) and |task|.
+  void AddEntryDone(evhttp_request* req, RequestArena* arena,
+                    const ct::SignedCertificateTimestamp* sct,
+                    util::Task* task) const;
   void BlockingAddChain(evhttp_request* req,
                         const std::shared_ptr<CertChain>& chain) const;
+  void BlockingAddChains(
+      evhttp_request* req,
+      const std::shared_ptr<std::vector<CertChain>>& chains) const;
   void BlockingAddPreChain(evhttp_request* req,
                            const std::shared_ptr<PreCertChain>& chain) const;
 };
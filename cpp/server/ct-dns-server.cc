@@ -1,8 +1,17 @@
+#include <errno.h>
 #include <gflags/gflags.h>
 #include <ldns/ldns.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <atomic>
 #include <iostream>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "log/log_lookup.h"
 #include "log/logged_entry.h"
@@ -18,12 +27,22 @@ using cert_trans::LoggedEntry;
 using cert_trans::SQLiteDB;
 using ct::SignedTreeHead;
 using google::RegisterFlagValidator;
+using std::atomic;
+using std::lock_guard;
+using std::mutex;
 using std::string;
 using std::stringstream;
+using std::thread;
+using std::vector;
 
 DEFINE_int32(port, 0, "Server port");
 DEFINE_string(domain, "", "Domain");
 DEFINE_string(db, "", "Database for certificate and tree storage");
+DEFINE_int32(num_dns_threads, 4,
+             "Number of threads reading and answering queries, each on a "
+             "socket of its own bound to the port");
+DEFINE_int32(sth_refresh_seconds, 1,
+             "How often to check the database for a new tree head");
 
 // Basic sanity checks on flag values.
 static bool ValidatePort(const char*, int32_t port) {
@@ -40,32 +59,125 @@ static bool NonEmptyString(const char*, const string& str) {
 static const bool domain_dummy =
     RegisterFlagValidator(&FLAGS_domain, &NonEmptyString);
 
-class CTUDPDNSServer : public UDPServer {
+static bool ValidatePositive(const char*, int32_t value) {
+  return value > 0;
+}
+
+static const bool num_dns_threads_dummy =
+    RegisterFlagValidator(&FLAGS_num_dns_threads, &ValidatePositive);
+
+static const bool sth_refresh_seconds_dummy =
+    RegisterFlagValidator(&FLAGS_sth_refresh_seconds, &ValidatePositive);
+
+// How many datagrams are read (or sent) with one system call.
+static const int kPacketBatchSize = 32;
+static const size_t kMaxPacketSize = 2048;
+
+// Answers the queries read from UDP sockets. Any number of threads
+// can Serve() a socket each (or the same one), as the lookups it makes
+// are safe to share.
+class CTDNSServer {
  public:
-  CTUDPDNSServer(const string& domain, SQLiteDB* db, EventLoop* loop, int fd)
-      : UDPServer(loop, fd), domain_(domain), lookup_(db), db_(db) {
+  CTDNSServer(const string& domain, SQLiteDB* db)
+      : domain_(domain),
+        lookup_(db),
+        db_(db),
+        stop_(false),
+        sth_timestamp_(0) {
   }
 
-  virtual void PacketRead(const sockaddr_in& from, const char* buf,
-                          size_t len) {
+  // Reads queries from |fd| in batches, and sends the answers to each
+  // batch back in one go.
+  void Serve(int fd) {
+    vector<char> buffers(kPacketBatchSize * kMaxPacketSize);
+    sockaddr_in from[kPacketBatchSize];
+    iovec in_iov[kPacketBatchSize];
+    mmsghdr in_msgs[kPacketBatchSize];
+    string replies[kPacketBatchSize];
+    iovec out_iov[kPacketBatchSize];
+    mmsghdr out_msgs[kPacketBatchSize];
+
+    while (!stop_) {
+      memset(in_msgs, 0, sizeof in_msgs);
+      for (int i = 0; i < kPacketBatchSize; ++i) {
+        in_iov[i].iov_base = &buffers[i * kMaxPacketSize];
+        in_iov[i].iov_len = kMaxPacketSize;
+        in_msgs[i].msg_hdr.msg_name = &from[i];
+        in_msgs[i].msg_hdr.msg_namelen = sizeof from[i];
+        in_msgs[i].msg_hdr.msg_iov = &in_iov[i];
+        in_msgs[i].msg_hdr.msg_iovlen = 1;
+      }
+
+      // Block for the first packet only, then take whatever else is
+      // already queued.
+      const int in =
+          recvmmsg(fd, in_msgs, kPacketBatchSize, MSG_WAITFORONE, NULL);
+      if (in < 0) {
+        if (errno != EINTR)
+          PLOG(ERROR) << "Failed to read DNS packets";
+        continue;
+      }
+      if (stop_)
+        break;
+
+      int out = 0;
+      for (int i = 0; i < in; ++i) {
+        if (!Answer(static_cast<const char*>(in_iov[i].iov_base),
+                    in_msgs[i].msg_len, &replies[out]))
+          continue;
+        memset(&out_msgs[out], 0, sizeof out_msgs[out]);
+        out_iov[out].iov_base = &replies[out][0];
+        out_iov[out].iov_len = replies[out].size();
+        out_msgs[out].msg_hdr.msg_name = &from[i];
+        out_msgs[out].msg_hdr.msg_namelen = in_msgs[i].msg_hdr.msg_namelen;
+        out_msgs[out].msg_hdr.msg_iov = &out_iov[out];
+        out_msgs[out].msg_hdr.msg_iovlen = 1;
+        ++out;
+      }
+
+      for (int sent = 0; sent < out;) {
+        const int n = sendmmsg(fd, &out_msgs[sent], out - sent, 0);
+        if (n < 0) {
+          if (errno == EINTR)
+            continue;
+          PLOG(ERROR) << "Failed to send a DNS answer";
+          // Drop that one, and carry on with the others.
+          ++sent;
+          continue;
+        }
+        sent += n;
+      }
+    }
+  }
+
+  // Makes Serve() return once it reads a packet, or its socket is
+  // shut down.
+  void Stop() {
+    stop_ = true;
+  }
+
+ private:
+  bool Answer(const char* buf, size_t len, string* reply) {
     ldns_pkt* packet = NULL;
 
     ldns_status ret = ldns_wire2pkt(&packet, (const uint8_t*)buf, len);
     if (ret != LDNS_STATUS_OK) {
-      LOG(INFO) << "Bad DNS packet";
-      return;
+      VLOG(1) << "Bad DNS packet";
+      return false;
     }
 
     // ldns_pkt_print(stdout, packet);
 
     if (ldns_pkt_qr(packet) != 0) {
-      LOG(INFO) << "Packet is not a query";
-      return;
+      VLOG(1) << "Packet is not a query";
+      ldns_pkt_free(packet);
+      return false;
     }
 
     if (ldns_pkt_get_opcode(packet) != LDNS_PACKET_QUERY) {
-      LOG(INFO) << "Packet has bad opcode";
-      return;
+      VLOG(1) << "Packet has bad opcode";
+      ldns_pkt_free(packet);
+      return false;
     }
 
     ldns_pkt* answers = ldns_pkt_new();
@@ -81,20 +193,21 @@ class CTUDPDNSServer : public UDPServer {
       ldns_rr* question = ldns_rr_list_rr(questions, n);
 
       if (ldns_rr_get_type(question) != LDNS_RR_TYPE_TXT) {
-        LOG(INFO) << "Question is not TXT";
+        VLOG(1) << "Question is not TXT";
         // FIXME(benl): set error response?
         continue;
       }
 
       ldns_rdf* owner = ldns_rr_owner(question);
       if (ldns_rdf_get_type(owner) != LDNS_RDF_TYPE_DNAME) {
-        LOG(INFO) << "Owner is not a dname";
+        VLOG(1) << "Owner is not a dname";
         continue;
       }
 
       ldns_buffer* dname = ldns_buffer_new(512);
       if (ldns_rdf2buffer_str_dname(dname, owner) != LDNS_STATUS_OK) {
-        LOG(INFO) << "Can't decode owner";
+        VLOG(1) << "Can't decode owner";
+        ldns_buffer_free(dname);
         continue;
       }
 
@@ -105,12 +218,12 @@ class CTUDPDNSServer : public UDPServer {
       ldns_buffer_free(dname);
       dname = NULL;
 
-      LOG(INFO) << "Question is TXT of " << owner_name;
+      VLOG(1) << "Question is TXT of " << owner_name;
 
       if (owner_name.length() <= domain_.length() ||
           owner_name.compare(owner_name.length() - domain_.length(),
                              domain_.length(), domain_) != 0) {
-        LOG(INFO) << "Question is not for our domain";
+        VLOG(1) << "Question is not for our domain";
         continue;
       }
 
@@ -128,22 +241,25 @@ class CTUDPDNSServer : public UDPServer {
     }
     ldns_pkt_free(packet);
 
-    char* answer_str = ldns_pkt2str(answers);
-    LOG(INFO) << "Answer is " << answer_str;
-    free(answer_str);
+    if (VLOG_IS_ON(2)) {
+      char* answer_str = ldns_pkt2str(answers);
+      VLOG(2) << "Answer is " << answer_str;
+      free(answer_str);
+    }
 
     uint8_t* wire_answer;
     size_t answer_size;
-    if (ldns_pkt2wire(&wire_answer, answers, &answer_size) != LDNS_STATUS_OK) {
+    ret = ldns_pkt2wire(&wire_answer, answers, &answer_size);
+    ldns_pkt_free(answers);
+    if (ret != LDNS_STATUS_OK) {
       LOG(ERROR) << "Can't make wire answer";
-      return;
+      return false;
     }
-    QueuePacket(from, wire_answer, answer_size);
+    reply->assign(reinterpret_cast<const char*>(wire_answer), answer_size);
     free(wire_answer);
-    ldns_pkt_free(answers);
+    return true;
   }
 
- private:
   string Response(string question) {
     if (question == "sth")
       return STH();
@@ -154,7 +270,7 @@ class CTUDPDNSServer : public UDPServer {
 
     string head = question.substr(0, dot);
     string tail = question.substr(dot + 1);
-    LOG(INFO) << "head = " << head << ", tail = " << tail;
+    VLOG(1) << "head = " << head << ", tail = " << tail;
     if (tail == "tree")
       return Tree(head);
     else if (tail == "hash")
@@ -174,8 +290,6 @@ class CTUDPDNSServer : public UDPServer {
   }
 
   string Hash(const string& hash) {
-    db_->ForceNotifySTH();
-
     // FIXME: decode hash!
     int64_t index;
     if (lookup_.GetIndex(hash, &index) != lookup_.OK)
@@ -199,26 +313,32 @@ class CTUDPDNSServer : public UDPServer {
     string index = question.substr(dot + 1, dot2 - dot - 1);
     string size = question.substr(dot2 + 1);
 
-    LOG(INFO) << "level = " << level << ", index = " << index
-              << ", size = " << size;
-
-    ct::ShortMerkleAuditProof proof;
-    if (lookup_.AuditProof(atoi(index.c_str()), atoi(size.c_str()), &proof) !=
-        lookup_.OK)
-      return "Lookup of node " + index + "." + size + " failed";
+    VLOG(1) << "level = " << level << ", index = " << index
+            << ", size = " << size;
 
-    int l = atoi(level.c_str());
-    if (l < 0 || l >= proof.path_node_size())
+    const int64_t tree_size = atoll(size.c_str());
+    string node;
+    if (lookup_.Node(atoi(level.c_str()), atoll(index.c_str()), tree_size,
+                     &node) != lookup_.OK) {
+      if (tree_size > lookup_.GetSTH().tree_size())
+        return "Lookup of node " + index + "." + size + " failed";
       return "Level " + level + " is out of range";
+    }
 
-    string b64 = util::ToBase64(proof.path_node(l));
-    return b64;
+    return util::ToBase64(node);
   }
 
+  // The answer only changes with the tree head, which the database
+  // is polled for elsewhere, so it is formatted once per tree head.
   string STH() {
-    db_->ForceNotifySTH();
+    const uint64_t timestamp = lookup_.GetSTHTimestamp();
+    {
+      lock_guard<mutex> lock(sth_lock_);
+      if (!sth_response_.empty() && sth_timestamp_ == timestamp)
+        return sth_response_;
+    }
 
-    const SignedTreeHead& sth = lookup_.GetSTH();
+    const SignedTreeHead sth = lookup_.GetSTH();
 
     std::string signature;
     CHECK_EQ(Serializer::SerializeDigitallySigned(sth.signature(), &signature),
@@ -229,12 +349,40 @@ class CTUDPDNSServer : public UDPServer {
        << util::ToBase64(sth.sha256_root_hash()) << '.'
        << util::ToBase64(signature);
 
-    return ss.str();
+    lock_guard<mutex> lock(sth_lock_);
+    sth_timestamp_ = sth.timestamp();
+    sth_response_ = ss.str();
+    return sth_response_;
   }
 
-  string domain_;
+  const string domain_;
   LogLookup lookup_;
   SQLiteDB* const db_;
+  atomic<bool> stop_;
+
+  mutex sth_lock_;
+  uint64_t sth_timestamp_;
+  string sth_response_;
+};
+
+// Picks up the tree heads written to the database by the ct-server
+// that shares it, which LogLookup then catches up with.
+class STHRefresher : public RepeatedEvent {
+ public:
+  STHRefresher(SQLiteDB* db, time_t frequency_seconds)
+      : RepeatedEvent(frequency_seconds), db_(db) {
+  }
+
+  std::string Description() {
+    return "refresh the tree head";
+  }
+
+  void Execute() {
+    db_->ForceNotifySTH();
+  }
+
+ private:
+  SQLiteDB* const db_;
 };
 
 class Keyboard : public Server {
@@ -280,10 +428,31 @@ int main(int argc, char* argv[]) {
   // Mostly so we can have a clean exit for valgrind etc.
   Keyboard keyboard(&loop);
 
-  int dns_fd;
-  CHECK(Services::InitServer(&dns_fd, FLAGS_port, NULL, SOCK_DGRAM));
-  CTUDPDNSServer dns(FLAGS_domain, &db, &loop, dns_fd);
+  STHRefresher sth_refresher(&db, FLAGS_sth_refresh_seconds);
+  loop.Add(&sth_refresher);
+
+  CTDNSServer dns(FLAGS_domain, &db);
 
-  LOG(INFO) << "Server listening on port " << FLAGS_port;
+  // The kernel spreads the queries over the sockets, so that the
+  // threads do not contend for a single receive queue.
+  vector<int> dns_fds;
+  vector<thread> dns_threads;
+  for (int i = 0; i < FLAGS_num_dns_threads; ++i) {
+    int dns_fd;
+    CHECK(Services::InitServer(&dns_fd, FLAGS_port, NULL, SOCK_DGRAM, true));
+    dns_fds.push_back(dns_fd);
+    dns_threads.emplace_back(&CTDNSServer::Serve, &dns, dns_fd);
+  }
+
+  LOG(INFO) << "Server listening on port " << FLAGS_port << " with "
+            << FLAGS_num_dns_threads << " threads";
   loop.Forever();
+
+  dns.Stop();
+  for (int dns_fd : dns_fds)
+    shutdown(dns_fd, SHUT_RDWR);
+  for (thread& t : dns_threads)
+    t.join();
+  for (int dns_fd : dns_fds)
+    close(dns_fd);
 }
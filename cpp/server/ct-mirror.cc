@@ -7,6 +7,7 @@
 #include <openssl/err.h>
 #include <signal.h>
 #include <unistd.h>
+#include <algorithm>
 #include <chrono>
 #include <csignal>
 #include <cstring>
@@ -16,10 +17,12 @@
 #include <mutex>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "client/async_log_client.h"
 #include "config.h"
 #include "fetcher/continuous_fetcher.h"
+#include "fetcher/fetch_budget.h"
 #include "fetcher/peer_group.h"
 #include "fetcher/remote_peer.h"
 #include "log/cluster_state_controller.h"
@@ -37,6 +40,7 @@
 #include "server/certificate_handler.h"
 #include "server/json_output.h"
 #include "server/metrics.h"
+#include "server/mirror_log.h"
 #include "server/proxy.h"
 #include "server/server.h"
 #include "server/server_helper.h"
@@ -60,6 +64,10 @@ DEFINE_int32(target_poll_frequency_seconds, 10,
              "How often should the target log be polled for updates.");
 DEFINE_int32(num_http_server_threads, 16,
              "Number of threads for servicing the incoming HTTP requests.");
+DEFINE_bool(work_stealing_thread_pools, false,
+            "Whether the HTTP and internal thread pools give each thread a "
+            "queue of its own, taking work from the others when it runs "
+            "out, rather than have them all share one queue.");
 DEFINE_string(target_log_uri, "",
               "URI of the log to mirror, or empty to disable mirroring.");
 DEFINE_string(
@@ -67,6 +75,16 @@ DEFINE_string(
     "PEM-encoded server public key file of the log we're mirroring.");
 DEFINE_int32(local_sth_update_frequency_seconds, 30,
              "Number of seconds between local checks for updated tree data.");
+DEFINE_string(mirror_targets_config, "",
+              "File with a text format MirrorConfig, listing more logs to "
+              "mirror from this process, each served under /<name>.");
+DEFINE_int32(mirror_max_concurrent_fetches, 0,
+             "Maximum number of fetch requests in flight at once, across "
+             "all the logs mirrored, or 0 for no limit other than that of "
+             "each peer.");
+DEFINE_int32(target_fetch_priority, 1,
+             "Relative share of --mirror_max_concurrent_fetches that "
+             "--target_log_uri gets while other logs are fetched too.");
 
 namespace libevent = cert_trans::libevent;
 
@@ -79,14 +97,18 @@ using cert_trans::Counter;
 using cert_trans::Database;
 using cert_trans::EtcdClient;
 using cert_trans::EtcdConsistentStore;
+using cert_trans::FetchBudget;
 using cert_trans::Gauge;
 using cert_trans::HttpHandler;
 using cert_trans::Latency;
 using cert_trans::LogLookup;
 using cert_trans::LoggedEntry;
 using cert_trans::MasterElection;
+using cert_trans::MirrorLog;
+using cert_trans::MirrorSTHQueue;
 using cert_trans::PeriodicClosure;
 using cert_trans::Proxy;
+using cert_trans::ReadMirrorConfig;
 using cert_trans::ReadPublicKey;
 using cert_trans::RemotePeer;
 using cert_trans::ScopedLatency;
@@ -97,6 +119,7 @@ using cert_trans::ThreadPool;
 using cert_trans::Update;
 using cert_trans::UrlFetcher;
 using ct::ClusterNodeState;
+using ct::MirrorConfig;
 using ct::SignedTreeHead;
 using google::RegisterFlagValidator;
 using std::bind;
@@ -106,16 +129,13 @@ using std::chrono::milliseconds;
 using std::chrono::seconds;
 using std::chrono::steady_clock;
 using std::function;
-using std::lock_guard;
-using std::make_pair;
 using std::make_shared;
-using std::map;
-using std::mutex;
 using std::placeholders::_1;
 using std::shared_ptr;
 using std::string;
 using std::thread;
 using std::unique_ptr;
+using std::vector;
 using util::HexString;
 using util::StatusOr;
 using util::SyncTask;
@@ -162,88 +182,24 @@ static const bool follow_dummy =
 
 
 void STHUpdater(Database* db, ClusterStateController* cluster_state_controller,
-                mutex* queue_mutex, map<int64_t, ct::SignedTreeHead>* queue,
-                LogLookup* log_lookup, Task* task) {
+                MirrorSTHQueue* queue, Task* task) {
   CHECK_NOTNULL(db);
   CHECK_NOTNULL(cluster_state_controller);
-  CHECK_NOTNULL(queue_mutex);
   CHECK_NOTNULL(queue);
   CHECK_NOTNULL(task);
-  CHECK_NOTNULL(log_lookup);
 
+  // log_lookup doesn't yet have the data for the new STHs integrated (that
+  // happens via a callback when the WriteTreeHead() method is called on the
+  // DB), so the queue pre-validates the STH roots with a tree of its own.
   while (true) {
     if (task->CancelRequested()) {
       task->Return(util::Status::CANCELLED);
     }
 
-    const int64_t local_size(db->TreeSize());
-    latest_local_tree_size_gauge->Set(local_size);
-
-    // log_lookup doesn't yet have the data for the new STHs integrated (that
-    // happens via a callback when the WriteTreeHead() method is called on the
-    // DB), so we'll used a compact tree to pre-validate the STH roots.
-    //
-    // We'll start with one based on the current state of our serving tree and
-    // update it to the STH sizes we're checking.
-    unique_ptr<CompactMerkleTree> new_tree(
-        log_lookup->GetCompactMerkleTree(new Sha256Hasher));
-
-    {
-      lock_guard<mutex> lock(*queue_mutex);
-      unique_ptr<Database::Iterator> entries(
-          db->ScanEntries(new_tree->LeafCount()));
-      while (!queue->empty() &&
-             queue->begin()->second.tree_size() <= local_size) {
-        const SignedTreeHead next_sth(queue->begin()->second);
-        queue->erase(queue->begin());
-
-        // First, if necessary, catch our local compact tree up to the
-        // candidate STH size:
-        {
-          LoggedEntry entry;
-          CHECK_LE(next_sth.tree_size(), local_size);
-          CHECK_GE(next_sth.tree_size(), 0);
-          const uint64_t next_sth_tree_size(
-              static_cast<uint64_t>(next_sth.tree_size()));
-          while (new_tree->LeafCount() < next_sth_tree_size) {
-            CHECK(entries->GetNextEntry(&entry));
-            CHECK(entry.has_sequence_number());
-            CHECK_GE(entry.sequence_number(), 0);
-            const uint64_t entry_sequence_number(
-                static_cast<uint64_t>(entry.sequence_number()));
-            CHECK_EQ(new_tree->LeafCount(), entry_sequence_number);
-            string serialized_leaf;
-            CHECK(entry.SerializeForLeaf(&serialized_leaf));
-            CHECK_EQ(entry_sequence_number + 1,
-                     new_tree->AddLeaf(serialized_leaf));
-          }
-        }
-
-        // If the candidate STH is historical, use the RootAtSnapshot() from
-        // our serving tree, otherwise use the root we just calculated with our
-        // compact tree.
-        const string local_root_at_snapshot(
-            next_sth.tree_size() > log_lookup->GetSTH().tree_size()
-                ? new_tree->CurrentRoot()
-                : log_lookup->RootAtSnapshot(next_sth.tree_size()));
-
-        if (next_sth.sha256_root_hash() != local_root_at_snapshot) {
-          LOG(WARNING) << "Received STH:\n" << next_sth.DebugString()
-                       << " whose root:\n"
-                       << HexString(next_sth.sha256_root_hash())
-                       << "\ndoes not match that of local tree at "
-                       << "corresponding snapshot:\n"
-                       << HexString(local_root_at_snapshot);
-          inconsistent_sths_received->Increment();
-          // TODO(alcutter): We should probably write these bad STHs out to a
-          // separate DB table for later analysis.
-          continue;
-        }
-        LOG(INFO) << "Can serve new STH of size " << next_sth.tree_size()
-                  << " locally";
-        cluster_state_controller->NewTreeHead(next_sth);
-      }
-    }
+    latest_local_tree_size_gauge->Set(db->TreeSize());
+    inconsistent_sths_received->IncrementBy(queue->CheckReady(
+        bind(&ClusterStateController::NewTreeHead, cluster_state_controller,
+             _1)));
 
     std::this_thread::sleep_for(
         seconds(FLAGS_local_sth_update_frequency_seconds));
@@ -287,7 +243,11 @@ int main(int argc, char* argv[]) {
 
   const bool stand_alone_mode(cert_trans::IsStandalone(false));
   const shared_ptr<libevent::Base> event_base(make_shared<libevent::Base>());
-  ThreadPool internal_pool(8);
+  const ThreadPool::Scheduling pool_scheduling(
+      FLAGS_work_stealing_thread_pools
+          ? ThreadPool::Scheduling::WORK_STEALING
+          : ThreadPool::Scheduling::SHARED_QUEUE);
+  ThreadPool internal_pool("internal", 8, pool_scheduling);
   UrlFetcher url_fetcher(event_base.get(), &internal_pool);
 
   const unique_ptr<EtcdClient> etcd_client(
@@ -303,15 +263,31 @@ int main(int argc, char* argv[]) {
                                  new MerkleVerifier(unique_ptr<Sha256Hasher>(
                                      new Sha256Hasher)));
 
-  ThreadPool http_pool(FLAGS_num_http_server_threads);
+  ThreadPool http_pool("http", FLAGS_num_http_server_threads,
+                       pool_scheduling);
+
+  // Shared by all the logs mirrored, so declared before their users.
+  unique_ptr<FetchBudget> fetch_budget;
+  unique_ptr<FetchBudget::Share> target_fetch_share;
+  if (FLAGS_mirror_max_concurrent_fetches > 0) {
+    fetch_budget.reset(new FetchBudget(FLAGS_mirror_max_concurrent_fetches));
+    target_fetch_share =
+        fetch_budget->NewShare("target", FLAGS_target_fetch_priority);
+  }
+
+  MirrorConfig mirror_config;
+  if (!FLAGS_mirror_targets_config.empty()) {
+    const util::Status status(
+        ReadMirrorConfig(FLAGS_mirror_targets_config, &mirror_config));
+    CHECK(status.ok()) << "Bad --mirror_targets_config: " << status;
+  }
 
   Server server(event_base, &internal_pool, &http_pool, db.get(),
                 etcd_client.get(), &url_fetcher, &log_verifier);
-  server.Initialise(true /* is_mirror */);
+  server.Initialise(true /* is_mirror */, target_fetch_share.get());
 
   unique_ptr<StalenessTracker> staleness_tracker(
-      new StalenessTracker(server.cluster_state_controller(), &internal_pool,
-                           event_base.get()));
+      new StalenessTracker(server.cluster_state_controller()));
 
   CertificateHttpHandler handler(server.log_lookup(), db.get(),
                                  server.cluster_state_controller(),
@@ -321,6 +297,9 @@ int main(int argc, char* argv[]) {
 
   // Connect the handler, proxy and server together
   handler.SetProxy(server.proxy());
+  if (server.name_index()) {
+    handler.SetNameIndex(server.name_index());
+  }
   handler.Add(server.http_server());
 
   if (stand_alone_mode) {
@@ -352,25 +331,11 @@ int main(int argc, char* argv[]) {
   ThreadPool pool(16);
   SyncTask fetcher_task(&pool);
 
-  mutex queue_mutex;
-  map<int64_t, ct::SignedTreeHead> queue;
-
-  const function<void(const ct::SignedTreeHead&)> new_sth(
-      [&queue_mutex, &queue](const ct::SignedTreeHead& sth) {
-        lock_guard<mutex> lock(queue_mutex);
-        const auto it(queue.find(sth.tree_size()));
-        if (it != queue.end() && sth.timestamp() < it->second.timestamp()) {
-          LOG(WARNING) << "Received older STH:\nHad:\n"
-                       << it->second.DebugString() << "\nGot:\n"
-                       << sth.DebugString();
-          return;
-        }
-        queue.insert(make_pair(sth.tree_size(), sth));
-      });
-
-  const shared_ptr<RemotePeer> peer(
-      createTargetPeerFromFlags(&pool, &url_fetcher, pubkey.ValueOrDie(),
-                                fetcher_task.task(), new_sth));
+  MirrorSTHQueue queue(db.get(), server.log_lookup());
+
+  const shared_ptr<RemotePeer> peer(createTargetPeerFromFlags(
+      &pool, &url_fetcher, pubkey.ValueOrDie(), fetcher_task.task(),
+      bind(&MirrorSTHQueue::Add, &queue, _1)));
   if (peer) {
     LOG(INFO) << "Adding remote peer for target log.";
     server.continuous_fetcher()->AddPeer("target", peer);
@@ -379,12 +344,24 @@ int main(int argc, char* argv[]) {
   server.WaitForReplication();
 
   thread sth_updater(&STHUpdater, db.get(), server.cluster_state_controller(),
-                     &queue_mutex, &queue, server.log_lookup(),
-                     fetcher_task.task()->AddChild(
-                         [](Task*) { LOG(INFO) << "STHUpdater exited."; }));
+                     &queue, fetcher_task.task()->AddChild([](Task*) {
+                       LOG(INFO) << "STHUpdater exited.";
+                     }));
+
+  // The other logs are not coordinated with the cluster, so they can
+  // start right away.
+  vector<unique_ptr<MirrorLog>> mirror_logs;
+  for (const ct::MirrorTarget& target : mirror_config.target()) {
+    mirror_logs.emplace_back(new MirrorLog(
+        target, event_base.get(), &internal_pool, &url_fetcher,
+        fetch_budget.get(), server.http_server(),
+        seconds(FLAGS_local_sth_update_frequency_seconds)));
+  }
 
   server.Run();
 
+  mirror_logs.clear();
+
   fetcher_task.task()->Return();
   fetcher_task.Wait();
   sth_updater.join();
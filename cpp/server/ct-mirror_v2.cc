@@ -266,7 +266,7 @@ int main(int argc, char* argv[]) {
 
   const bool stand_alone_mode(cert_trans::IsStandalone(false));
   const shared_ptr<libevent::Base> event_base(make_shared<libevent::Base>());
-  ThreadPool internal_pool(8);
+  ThreadPool internal_pool("internal", 8);
   UrlFetcher url_fetcher(event_base.get(), &internal_pool);
 
   const unique_ptr<EtcdClient> etcd_client(
@@ -282,15 +282,14 @@ int main(int argc, char* argv[]) {
                                  new MerkleVerifier(unique_ptr<Sha256Hasher>(
                                      new Sha256Hasher)));
 
-  ThreadPool http_pool(FLAGS_num_http_server_threads);
+  ThreadPool http_pool("http", FLAGS_num_http_server_threads);
 
   Server server(event_base, &internal_pool, &http_pool, db.get(),
                 etcd_client.get(), &url_fetcher, &log_verifier);
   server.Initialise(true /* is_mirror */);
 
   unique_ptr<StalenessTracker> staleness_tracker(
-      new StalenessTracker(server.cluster_state_controller(), &internal_pool,
-                           event_base.get()));
+      new StalenessTracker(server.cluster_state_controller()));
 
   CertificateHttpHandlerV2 handler(server.log_lookup(), db.get(),
                                    server.cluster_state_controller(),
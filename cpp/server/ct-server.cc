@@ -4,7 +4,9 @@
 #include <openssl/err.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <chrono>
 #include <iostream>
 #include <string>
 
@@ -30,6 +32,7 @@
 #include "util/etcd.h"
 #include "util/init.h"
 #include "util/libevent_wrapper.h"
+#include "util/periodic_closure.h"
 #include "util/read_key.h"
 #include "util/status.h"
 #include "util/uuid.h"
@@ -37,11 +40,21 @@
 DEFINE_string(key, "", "PEM-encoded server private key file");
 DEFINE_string(trusted_cert_file, "",
               "File for trusted CA certificates, in concatenated PEM format");
+DEFINE_int32(trusted_cert_reload_seconds, 0,
+             "If positive, check --trusted_cert_file for changes this "
+             "often, and replace the trusted CA certificates with its "
+             "contents when it changes, without a restart. Submissions "
+             "being checked meanwhile use either the old or the new ones.");
 DEFINE_double(guard_window_seconds, 60,
               "Unsequenced entries newer than this "
               "number of seconds will not be sequenced.");
 DEFINE_int32(num_http_server_threads, 16,
              "Number of threads for servicing the incoming HTTP requests.");
+DEFINE_bool(work_stealing_thread_pools, false,
+            "Whether the HTTP and internal thread pools give each thread a "
+            "queue of its own, taking work from the others when it runs "
+            "out, rather than have them all share one queue.");
+DECLARE_bool(frozen);
 
 namespace libevent = cert_trans::libevent;
 
@@ -53,7 +66,9 @@ using cert_trans::ConsistentStore;
 using cert_trans::Database;
 using cert_trans::EtcdClient;
 using cert_trans::EtcdConsistentStore;
+using cert_trans::LogLookup;
 using cert_trans::LoggedEntry;
+using cert_trans::PeriodicClosure;
 using cert_trans::ReadPrivateKey;
 using cert_trans::SequenceEntries;
 using cert_trans::Server;
@@ -66,11 +81,16 @@ using ct::ClusterNodeState;
 using ct::SignedTreeHead;
 using google::RegisterFlagValidator;
 using std::bind;
+using std::chrono::seconds;
 using std::function;
 using std::make_shared;
+using std::move;
+using std::placeholders::_1;
+using std::placeholders::_2;
 using std::shared_ptr;
 using std::string;
 using std::thread;
+using std::to_string;
 using std::unique_ptr;
 
 
@@ -90,6 +110,38 @@ static const bool key_dummy = RegisterFlagValidator(&FLAGS_key, &ValidateRead);
 static const bool cert_dummy =
     RegisterFlagValidator(&FLAGS_trusted_cert_file, &ValidateRead);
 
+
+// Tells whether the file at |path| changed: a new file renamed in its
+// place has another inode, and one rewritten in place another
+// modification time.
+string FileVersion(const string& path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    return string();
+  }
+  return to_string(st.st_ino) + ":" + to_string(st.st_size) + ":" +
+         to_string(st.st_mtim.tv_sec) + "." + to_string(st.st_mtim.tv_nsec);
+}
+
+
+// Called periodically on the event loop, reloads the trusted
+// certificates on |pool| if --trusted_cert_file changed since it was
+// at |*version|.
+void CheckTrustedCertFile(CertChecker* checker, ThreadPool* pool,
+                          string* version) {
+  const string new_version(FileVersion(FLAGS_trusted_cert_file));
+  if (new_version.empty() || new_version == *version) {
+    return;
+  }
+  *version = new_version;
+  pool->Add([checker]() {
+    if (!checker->ReloadTrustedCertificates(FLAGS_trusted_cert_file)) {
+      LOG(WARNING) << "Could not reload CA certs from "
+                   << FLAGS_trusted_cert_file << ", keeping the old ones";
+    }
+  });
+}
+
 }  // namespace
 
 
@@ -109,6 +161,7 @@ int main(int argc, char* argv[]) {
   LogSigner log_signer(pkey.ValueOrDie());
 
   CertChecker checker;
+  string trusted_cert_version(FileVersion(FLAGS_trusted_cert_file));
   CHECK(checker.LoadTrustedCertificates(FLAGS_trusted_cert_file))
       << "Could not load CA certs from " << FLAGS_trusted_cert_file;
 
@@ -123,7 +176,12 @@ int main(int argc, char* argv[]) {
    // internal pool are processing add-chain request, as during processing
    // additional thread from internal pool is needed for each request for adding
    // pending entry to etcd server.
-  ThreadPool internal_pool(FLAGS_num_http_server_threads * 2);
+  const ThreadPool::Scheduling pool_scheduling(
+      FLAGS_work_stealing_thread_pools
+          ? ThreadPool::Scheduling::WORK_STEALING
+          : ThreadPool::Scheduling::SHARED_QUEUE);
+  ThreadPool internal_pool("internal", FLAGS_num_http_server_threads * 2,
+                           pool_scheduling);
   UrlFetcher url_fetcher(event_base.get(), &internal_pool);
 
   const bool stand_alone_mode(cert_trans::IsStandalone(true));
@@ -138,30 +196,49 @@ int main(int argc, char* argv[]) {
                                  new MerkleVerifier(unique_ptr<Sha256Hasher>(
                                      new Sha256Hasher)));
 
-  ThreadPool http_pool(FLAGS_num_http_server_threads);
+  ThreadPool http_pool("http", FLAGS_num_http_server_threads,
+                       pool_scheduling);
 
   Server server(event_base, &internal_pool, &http_pool, db.get(),
                 etcd_client.get(), &url_fetcher, &log_verifier);
   server.Initialise(false /* is_mirror */);
 
-  Frontend frontend(
-      new FrontendSigner(db.get(), server.consistent_store(), &log_signer));
+  // A frozen log takes no submissions, and does not sign anything new.
+  const unique_ptr<Frontend> frontend(
+      FLAGS_frozen ? nullptr
+                   : new Frontend(new FrontendSigner(
+                         db.get(), server.consistent_store(), &log_signer)));
   unique_ptr<StalenessTracker> staleness_tracker(
-      new StalenessTracker(server.cluster_state_controller(), &internal_pool,
-                           event_base.get()));
+      new StalenessTracker(server.cluster_state_controller()));
   CertificateHttpHandler handler(server.log_lookup(), db.get(),
                                  server.cluster_state_controller(), &checker,
-                                 &frontend, &internal_pool, event_base.get(),
-                                 staleness_tracker.get());
+                                 frontend.get(), &internal_pool,
+                                 event_base.get(), staleness_tracker.get());
 
   // Connect the handler, proxy and server together
   handler.SetProxy(server.proxy());
+  if (server.name_index()) {
+    handler.SetNameIndex(server.name_index());
+  }
   handler.Add(server.http_server());
 
-  TreeSigner tree_signer(
-      std::chrono::duration<double>(FLAGS_guard_window_seconds), db.get(),
-      server.log_lookup()->GetCompactMerkleTree(new Sha256Hasher),
-      server.consistent_store(), &log_signer);
+  unique_ptr<TreeSigner> tree_signer;
+  if (!FLAGS_frozen) {
+    unique_ptr<CompactMerkleTree> signer_tree(
+        TreeSigner::TreeFromCheckpoint(db.get()));
+    if (!signer_tree) {
+      signer_tree =
+          server.log_lookup()->GetCompactMerkleTree(new Sha256Hasher);
+    }
+    tree_signer.reset(new TreeSigner(
+        std::chrono::duration<double>(FLAGS_guard_window_seconds), db.get(),
+        move(signer_tree), server.consistent_store(), &log_signer,
+        &internal_pool));
+    tree_signer->SetAdmissionController(frontend->admission());
+    // Saves the LogLookup reading and hashing the new entries again.
+    tree_signer->SetLeavesAppendedCallback(
+        bind(&LogLookup::AddLeafHashes, server.log_lookup(), _1, _2));
+  }
 
   if (stand_alone_mode) {
     // Set up a simple single-node environment.
@@ -196,13 +273,21 @@ int main(int argc, char* argv[]) {
     }
 
     // Do an initial signing run to get the initial STH, again this is
-    // temporary until we re-populate FakeEtcd from the DB.
-    CHECK_EQ(tree_signer.UpdateTree(), TreeSigner::OK);
+    // temporary until we re-populate FakeEtcd from the DB. A frozen
+    // log serves its last tree head instead.
+    SignedTreeHead serving_sth;
+    if (FLAGS_frozen) {
+      CHECK_EQ(db->LatestTreeHead(&serving_sth), Database::LOOKUP_OK)
+          << "A frozen log needs a tree head in its database";
+    } else {
+      CHECK_EQ(tree_signer->UpdateTree(), TreeSigner::OK);
+      serving_sth = tree_signer->LatestSTH();
+    }
 
     // Need to boot-strap the Serving STH too because we consider it an error
     // if it's not set, which in turn causes us to not attempt to become
     // master:
-    server.consistent_store()->SetServingSTH(tree_signer.LatestSTH());
+    server.consistent_store()->SetServingSTH(serving_sth);
   }
 
   server.WaitForReplication();
@@ -211,10 +296,26 @@ int main(int argc, char* argv[]) {
   // (either not accepting any requests, or returning some internal
   // server error) until we have an STH to serve.
   const function<bool()> is_master(bind(&Server::IsMaster, &server));
-  thread sequencer(&SequenceEntries, &tree_signer, is_master);
-  thread cleanup(&CleanUpEntries, server.consistent_store(), is_master);
-  thread signer(&SignMerkleTree, &tree_signer, server.consistent_store(),
-                server.cluster_state_controller());
+  unique_ptr<thread> sequencer;
+  unique_ptr<thread> cleanup;
+  unique_ptr<thread> signer;
+  if (!FLAGS_frozen) {
+    sequencer.reset(new thread(&SequenceEntries, tree_signer.get(),
+                               server.cluster_state_controller(), is_master));
+    cleanup.reset(
+        new thread(&CleanUpEntries, server.consistent_store(), is_master));
+    signer.reset(new thread(&SignMerkleTree, tree_signer.get(),
+                            server.consistent_store(),
+                            server.cluster_state_controller()));
+  }
+
+  unique_ptr<PeriodicClosure> trusted_cert_reload;
+  if (FLAGS_trusted_cert_reload_seconds > 0) {
+    trusted_cert_reload.reset(new PeriodicClosure(
+        event_base, seconds(FLAGS_trusted_cert_reload_seconds),
+        bind(&CheckTrustedCertFile, &checker, &internal_pool,
+             &trusted_cert_version)));
+  }
 
   server.Run();
 
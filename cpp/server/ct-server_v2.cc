@@ -55,6 +55,7 @@ using cert_trans::ConsistentStore;
 using cert_trans::Database;
 using cert_trans::EtcdClient;
 using cert_trans::EtcdConsistentStore;
+using cert_trans::LogLookup;
 using cert_trans::LoggedEntry;
 using cert_trans::ReadPrivateKey;
 using cert_trans::SequenceEntries;
@@ -70,6 +71,9 @@ using google::RegisterFlagValidator;
 using std::bind;
 using std::function;
 using std::make_shared;
+using std::move;
+using std::placeholders::_1;
+using std::placeholders::_2;
 using std::shared_ptr;
 using std::string;
 using std::thread;
@@ -124,7 +128,7 @@ int main(int argc, char* argv[]) {
   CHECK(db) << "No database instance created, check flag settings";
 
   shared_ptr<libevent::Base> event_base(make_shared<libevent::Base>());
-  ThreadPool internal_pool(8);
+  ThreadPool internal_pool("internal", 8);
   UrlFetcher url_fetcher(event_base.get(), &internal_pool);
 
   const bool stand_alone_mode(cert_trans::IsStandalone(true));
@@ -139,7 +143,7 @@ int main(int argc, char* argv[]) {
                                  new MerkleVerifier(unique_ptr<Sha256Hasher>(
                                      new Sha256Hasher)));
 
-  ThreadPool http_pool(FLAGS_num_http_server_threads);
+  ThreadPool http_pool("http", FLAGS_num_http_server_threads);
 
   Server server(event_base, &internal_pool, &http_pool, db.get(),
                 etcd_client.get(), &url_fetcher, &log_verifier);
@@ -148,8 +152,7 @@ int main(int argc, char* argv[]) {
   Frontend frontend(
       new FrontendSigner(db.get(), server.consistent_store(), &log_signer));
   unique_ptr<StalenessTracker> staleness_tracker(
-      new StalenessTracker(server.cluster_state_controller(), &internal_pool,
-                           event_base.get()));
+      new StalenessTracker(server.cluster_state_controller()));
   CertificateHttpHandlerV2 handler(server.log_lookup(), db.get(),
                                    server.cluster_state_controller(), &checker,
                                    &frontend, &internal_pool, event_base.get(),
@@ -159,10 +162,17 @@ int main(int argc, char* argv[]) {
   handler.SetProxy(server.proxy());
   handler.Add(server.http_server());
 
+  unique_ptr<CompactMerkleTree> signer_tree(
+      TreeSigner::TreeFromCheckpoint(db.get()));
+  if (!signer_tree) {
+    signer_tree = server.log_lookup()->GetCompactMerkleTree(new Sha256Hasher);
+  }
   TreeSigner tree_signer(
       std::chrono::duration<double>(FLAGS_guard_window_seconds), db.get(),
-      server.log_lookup()->GetCompactMerkleTree(new Sha256Hasher),
-      server.consistent_store(), &log_signer);
+      move(signer_tree), server.consistent_store(), &log_signer,
+      &internal_pool);
+  tree_signer.SetLeavesAppendedCallback(
+      bind(&LogLookup::AddLeafHashes, server.log_lookup(), _1, _2));
 
   if (stand_alone_mode) {
     // Set up a simple single-node environment.
@@ -212,7 +222,8 @@ int main(int argc, char* argv[]) {
   // (either not accepting any requests, or returning some internal
   // server error) until we have an STH to serve.
   const function<bool()> is_master(bind(&Server::IsMaster, &server));
-  thread sequencer(&SequenceEntries, &tree_signer, is_master);
+  thread sequencer(&SequenceEntries, &tree_signer,
+                   server.cluster_state_controller(), is_master);
   thread cleanup(&CleanUpEntries, server.consistent_store(), is_master);
   thread signer(&SignMerkleTree, &tree_signer, server.consistent_store(),
                 server.cluster_state_controller());
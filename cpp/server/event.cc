@@ -242,7 +242,8 @@ void UDPServer::QueuePacket(const sockaddr_in& to, const char* buf,
   write_queue_.push_back(wbuf);
 }
 
-bool Services::InitServer(int* sock, int port, const char* ip, int type) {
+bool Services::InitServer(int* sock, int port, const char* ip, int type,
+                          bool reuse_port) {
   bool ret = false;
   struct sockaddr_in server;
   int s = -1;
@@ -265,6 +266,11 @@ bool Services::InitServer(int* sock, int port, const char* ip, int type) {
   {
     int j = 1;
     setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &j, sizeof j);
+    if (reuse_port &&
+        setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &j, sizeof j) == -1) {
+      perror("setsockopt");
+      goto err;
+    }
   }
 
   if (bind(s, (struct sockaddr*)&server, sizeof(server)) == -1) {
@@ -25,7 +25,10 @@ class Services {
     rough_time_ = 0;
   }
 
-  static bool InitServer(int* sock, int port, const char* ip, int type);
+  // If |reuse_port| is true, several sockets can be bound to the same
+  // port (with SO_REUSEPORT), and the kernel balances between them.
+  static bool InitServer(int* sock, int port, const char* ip, int type,
+                         bool reuse_port = false);
 
  private:
   // This class is only used as a namespace, it should never be
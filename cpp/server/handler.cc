@@ -1,15 +1,19 @@
 #include "server/handler.h"
 
+#include <event2/buffer.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <google/protobuf/io/coded_stream.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <algorithm>
 #include <algorithm>
 #include <functional>
+#include <limits>
+#include <map>
 #include <memory>
-#include <mutex>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include "log/cert.h"
@@ -17,20 +21,28 @@
 #include "log/cluster_state_controller.h"
 #include "log/log_lookup.h"
 #include "log/logged_entry.h"
+#include "log/name_index.h"
 #include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
+#include "server/handler_caches.h"
 #include "server/json_output.h"
 #include "server/proxy.h"
+#include "server/request_arena.h"
 #include "util/json_wrapper.h"
 #include "util/thread_pool.h"
+#include "util/trace.h"
 
 namespace libevent = cert_trans::libevent;
 
 using cert_trans::Counter;
+using cert_trans::HandlerCaches;
 using cert_trans::HttpHandler;
+using cert_trans::JsonEntriesWriter;
 using cert_trans::Latency;
 using cert_trans::LoggedEntry;
+using cert_trans::NameIndex;
 using cert_trans::Proxy;
+using cert_trans::RequestArena;
 using cert_trans::ScopedLatency;
 using ct::ShortMerkleAuditProof;
 using ct::SignedCertificateTimestamp;
@@ -38,19 +50,22 @@ using ct::SignedTreeHead;
 using std::bind;
 using std::chrono::milliseconds;
 using std::chrono::seconds;
-using std::lock_guard;
-using std::make_shared;
+using std::make_pair;
+using std::map;
 using std::multimap;
+using std::numeric_limits;
 using std::min;
-using std::mutex;
 using std::placeholders::_1;
 using std::string;
 using std::unique_ptr;
 using std::vector;
 
-DEFINE_int32(max_leaf_entries_per_response, 1000,
-             "maximum number of entries to put in the response of a "
-             "get-entries request");
+DEFINE_int32(max_proofs_per_request, 1000,
+             "maximum number of hashes accepted in a single "
+             "get-proofs-by-hash request");
+DEFINE_int32(max_name_search_results, 1000,
+             "maximum number of names returned by a single search-names "
+             "request");
 
 namespace {
 
@@ -60,6 +75,65 @@ static Latency<milliseconds, string> http_server_request_latency_ms(
     "Total request latency in ms broken down by path");
 
 
+// Appends |entry| to |buffer| the way WriteDelimitedTo() would, as
+// its length (a varint) followed by its serialization, written in
+// place.
+void AddDelimited(const LoggedEntry& entry, evbuffer* buffer) {
+  using google::protobuf::io::CodedOutputStream;
+  const int size(entry.ByteSize());
+  const int length(CodedOutputStream::VarintSize32(size) + size);
+  evbuffer_iovec iov;
+  CHECK_EQ(evbuffer_reserve_space(buffer, length, &iov, 1), 1);
+  uint8_t* const data(static_cast<uint8_t*>(iov.iov_base));
+  entry.SerializeWithCachedSizesToArray(
+      CodedOutputStream::WriteVarint32ToArray(size, data));
+  iov.iov_len = length;
+  CHECK_EQ(evbuffer_commit_space(buffer, &iov, 1), 0);
+}
+
+
+// |value| in base64, as a JSON string, encoded in scratch space of
+// |arena| rather than in a string of its own.
+json_object* NewBase64String(const string& value, RequestArena* arena) {
+  const size_t length(util::Base64Length(value.size()));
+  char* const b64(arena->Allocate(length));
+  util::ToBase64(value.data(), value.size(), b64);
+  return json_object_new_string_len(b64, length);
+}
+
+
+string RenderSTH(const SignedTreeHead& sth) {
+  JsonObject json_reply;
+  json_reply.Add("tree_size", sth.tree_size());
+  json_reply.Add("timestamp", sth.timestamp());
+  json_reply.AddBase64("sha256_root_hash", sth.sha256_root_hash());
+  json_reply.Add("tree_head_signature", sth.signature());
+  return json_reply.ToString();
+}
+
+
+bool RenderEntry(const LoggedEntry& entry, bool include_sct,
+                 string* json_entry) {
+  string leaf_input;
+  string extra_data;
+  string sct_data;
+  if (!entry.SerializeForLeaf(&leaf_input) ||
+      !entry.SerializeExtraData(&extra_data) ||
+      (include_sct &&
+       Serializer::SerializeSCT(entry.sct(), &sct_data) !=
+           cert_trans::serialization::SerializeResult::OK)) {
+    return false;
+  }
+  // The SCT is non-standard for this implementation, and is currently
+  // only used by other nodes when "following" to fetch data from each
+  // other.
+  *json_entry = JsonEntriesWriter::EncodeEntry(leaf_input, extra_data,
+                                               include_sct ? &sct_data
+                                                           : nullptr);
+  return true;
+}
+
+
 }  // namespace
 
 
@@ -69,11 +143,14 @@ HttpHandler::HttpHandler(LogLookup* log_lookup, const ReadOnlyDatabase* db,
                          StalenessTracker* staleness_tracker)
     : log_lookup_(CHECK_NOTNULL(log_lookup)),
       db_(CHECK_NOTNULL(db)),
-      controller_(CHECK_NOTNULL(controller)),
+      controller_(controller),
       proxy_(nullptr),
+      name_index_(nullptr),
       pool_(CHECK_NOTNULL(pool)),
       event_base_(CHECK_NOTNULL(event_base)),
-      staleness_tracker_(CHECK_NOTNULL(staleness_tracker)) {
+      staleness_tracker_(staleness_tracker),
+      caches_(new HandlerCaches(log_lookup_, db_, event_base_, &RenderSTH,
+                                &RenderEntry)) {
 }
 
 
@@ -84,9 +161,13 @@ HttpHandler::~HttpHandler() {
 void StatsHandlerInterceptor(const string& path,
                              const libevent::HttpServer::HandlerCallback& cb,
                              evhttp_request* req) {
+  // The work spun off to other threads for this request is traced too.
+  const util::trace::ScopedSpan request_span(
+      util::trace::Span::NewTrace(path));
   ScopedLatency total_http_server_request_latency(
       http_server_request_latency_ms.GetScopedLatency(path));
 
+  HandlerCaches::AllowCachingIfFrozen(req);
   cb(req);
 }
 
@@ -106,23 +187,32 @@ void HttpHandler::AddEntryReply(evhttp_request* req,
   }
 
   JsonObject json_reply;
-  json_reply.Add("sct_version", static_cast<int64_t>(0));
-  json_reply.AddBase64("id", sct.id().key_id());
-  json_reply.Add("timestamp", sct.timestamp());
-  json_reply.Add("extensions", "");
-  json_reply.Add("signature", sct.signature());
+  AddSctFields(sct, &json_reply);
 
   SendJsonReply(event_base_, req, HTTP_OK, json_reply);
 }
 
+
+// static
+void HttpHandler::AddSctFields(const SignedCertificateTimestamp& sct,
+                               JsonObject* json) {
+  json->Add("sct_version", static_cast<int64_t>(0));
+  json->AddBase64("id", sct.id().key_id());
+  json->Add("timestamp", sct.timestamp());
+  json->Add("extensions", "");
+  json->Add("signature", sct.signature());
+}
+
 void HttpHandler::ProxyInterceptor(
+    const string& path,
     const libevent::HttpServer::HandlerCallback& local_handler,
     evhttp_request* request) {
   VLOG(2) << "Running proxy interceptor...";
   // TODO(alcutter): We can be a bit smarter about when to proxy off
   // the request - being stale wrt to the current serving STH doesn't
   // automatically mean we're unable to answer this request.
-  if (staleness_tracker_->IsNodeStale()) {
+  if (proxy_ &&
+      (staleness_tracker_->IsNodeStale() || proxy_->AlwaysProxies(path))) {
     // Can't do this on the libevent thread since it can block on the lock in
     // ClusterStatusController::GetFreshNodes().
     pool_->Add(bind(&Proxy::ProxyRequest, proxy_, request));
@@ -135,26 +225,45 @@ void HttpHandler::ProxyInterceptor(
 void HttpHandler::AddProxyWrappedHandler(
     libevent::HttpServer* server, const string& path,
     const libevent::HttpServer::HandlerCallback& local_handler) {
+  const string full_path(prefix_ + path);
   const libevent::HttpServer::HandlerCallback stats_handler(
-      bind(&StatsHandlerInterceptor, path, local_handler, _1));
-  CHECK(server->AddHandler(path, bind(&HttpHandler::ProxyInterceptor, this,
-                                      stats_handler, _1)));
+      bind(&StatsHandlerInterceptor, full_path, local_handler, _1));
+  CHECK(server->AddHandler(full_path, bind(&HttpHandler::ProxyInterceptor, this,
+                                           path, stats_handler, _1)));
 }
 
 
-void HttpHandler::Add(libevent::HttpServer* server) {
+void HttpHandler::Add(libevent::HttpServer* server, const string& prefix) {
   CHECK_NOTNULL(server);
-  // TODO(pphaneuf): An optional prefix might be nice?
+  CHECK(prefix.empty() || (prefix[0] == '/' && prefix.back() != '/'))
+      << "Bad path prefix: " << prefix;
+  prefix_ = prefix;
   // TODO(pphaneuf): Find out which methods are CPU intensive enough
   // that they should be spun off to the thread pool.
   AddProxyWrappedHandler(server, "/ct/v1/get-entries",
                          bind(&HttpHandler::GetEntries, this, _1));
+  // Non-standard binary version of get-entries, with the SCTs, for
+  // the other nodes of the cluster.
+  AddProxyWrappedHandler(server, "/ct/v1/get-logged-entries",
+                         bind(&HttpHandler::GetLoggedEntries, this, _1));
+  // Non-standard, for monitors which only want the entries logged
+  // since a given time.
+  AddProxyWrappedHandler(server, "/ct/v1/get-index-since",
+                         bind(&HttpHandler::GetIndexSince, this, _1));
   AddProxyWrappedHandler(server, "/ct/v1/get-proof-by-hash",
                          bind(&HttpHandler::GetProof, this, _1));
+  // Non-standard batch version of get-proof-by-hash.
+  AddProxyWrappedHandler(server, "/ct/v1/get-proofs-by-hash",
+                         bind(&HttpHandler::GetProofs, this, _1));
   AddProxyWrappedHandler(server, "/ct/v1/get-sth",
                          bind(&HttpHandler::GetSTH, this, _1));
   AddProxyWrappedHandler(server, "/ct/v1/get-sth-consistency",
                          bind(&HttpHandler::GetConsistency, this, _1));
+  // Non-standard, for finding the certificates for a domain.
+  if (name_index_) {
+    AddProxyWrappedHandler(server, "/ct/v1/search-names",
+                           bind(&HttpHandler::SearchNames, this, _1));
+  }
 
   // Now add any sub-class handlers.
   AddHandlers(server);
@@ -163,39 +272,149 @@ void HttpHandler::Add(libevent::HttpServer* server) {
 
 void HttpHandler::SetProxy(Proxy* proxy) {
   LOG_IF(FATAL, proxy_) << "Attempting to re-add a Proxy.";
+  CHECK(staleness_tracker_) << "A Proxy needs a StalenessTracker";
   proxy_ = CHECK_NOTNULL(proxy);
 }
 
 
+void HttpHandler::SetNameIndex(const NameIndex* name_index) {
+  LOG_IF(FATAL, name_index_) << "Attempting to re-add a NameIndex.";
+  name_index_ = CHECK_NOTNULL(name_index);
+}
+
+
 void HttpHandler::GetEntries(evhttp_request* req) const {
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+  int64_t start;
+  int64_t end;
+  if (!caches_->ParseEntriesRange(req, query, &start, &end)) {
+    return;
+  }
+
+  // Sekrit parameter to indicate that SCTs should be included too.
+  // This is non-standard, and is only used internally by other log nodes when
+  // "following" nodes with more data.
+  const bool include_scts(libevent::GetBoolParam(query, "include_scts"));
+
+  caches_->StartGetEntries(req, start, end, include_scts);
+}
+
+
+void HttpHandler::GetLoggedEntries(evhttp_request* req) const {
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+  int64_t start;
+  int64_t end;
+  if (!caches_->ParseEntriesRange(req, query, &start, &end)) {
+    return;
+  }
+
+  WorkClass* const get_entries_work(caches_->get_entries_work());
+  if (!get_entries_work->Admit()) {
+    return SendJsonError(event_base_, req, HTTP_SERVUNAVAIL,
+                         "Too many pending get-entries requests.");
+  }
+  vector<LoggedEntry>* const entries(new vector<LoggedEntry>);
+  db_->ReadEntriesAsync(start, end, numeric_limits<size_t>::max(),
+                        caches_->GetEntriesReadPattern(start),
+                        get_entries_work, entries,
+                        new util::Task(bind(&HttpHandler::GetLoggedEntriesDone,
+                                            this, req, start, entries, _1),
+                                       get_entries_work));
+}
+
+
+void HttpHandler::GetIndexSince(evhttp_request* req) const {
   if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
     return SendJsonError(event_base_, req, HTTP_BADMETHOD,
                          "Method not allowed.");
   }
 
   const libevent::QueryParams query(libevent::ParseQuery(req));
-
-  const int64_t start(libevent::GetIntParam(query, "start"));
-  if (start < 0) {
+  const int64_t timestamp(libevent::GetIntParam(query, "timestamp"));
+  if (timestamp < 0) {
     return SendJsonError(event_base_, req, HTTP_BADREQUEST,
-                         "Missing or invalid \"start\" parameter.");
+                         "Missing or invalid \"timestamp\" parameter.");
+  }
+
+  // The first lookup reads the entries the database has not indexed
+  // yet, so it is done along with the reads of entries.
+  WorkClass* const get_entries_work(caches_->get_entries_work());
+  if (!get_entries_work->Admit()) {
+    return SendJsonError(event_base_, req, HTTP_SERVUNAVAIL,
+                         "Too many pending get-entries requests.");
+  }
+  get_entries_work->Add([this, req, timestamp, get_entries_work]() {
+    // Entries past the tree head being served cannot be fetched yet.
+    const int64_t index(min<int64_t>(db_->FirstSequenceNumberSince(timestamp),
+                                     log_lookup_->GetSTH().tree_size()));
+    get_entries_work->Done();
+
+    JsonObject json_reply;
+    json_reply.Add("index", index);
+    SendJsonReply(event_base_, req, HTTP_OK, json_reply);
+  });
+}
+
+
+// Takes a "domain" and, to get the next page, the "cursor" from the
+// previous reply, and replies with:
+//
+//   {"matches": [{"name": <name>, "index": <index>}, ...],
+//    "cursor": <base64 cursor>}
+//
+// where the matches are the names equal to "domain" or under it, and
+// "cursor" is empty once there are no more.
+void HttpHandler::SearchNames(evhttp_request* req) const {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
+                         "Method not allowed.");
   }
 
-  int64_t end(libevent::GetIntParam(query, "end"));
-  if (end < start) {
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+  string domain;
+  if (!libevent::GetParam(query, "domain", &domain) || domain.empty()) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or invalid \"domain\" parameter.");
+  }
+  string b64_cursor;
+  libevent::GetParam(query, "cursor", &b64_cursor);
+  const string cursor(
+      util::FromBase64(b64_cursor.data(), b64_cursor.size()));
+  if (cursor.empty() && !b64_cursor.empty()) {
     return SendJsonError(event_base_, req, HTTP_BADREQUEST,
-                         "Missing or invalid \"end\" parameter.");
+                         "Invalid \"cursor\" parameter.");
   }
 
-  // Limit the number of entries returned in a single request.
-  end = std::min(end, start + FLAGS_max_leaf_entries_per_response);
+  // Reading the index can block, so not on the libevent thread.
+  pool_->Add([this, req, domain, cursor]() {
+    vector<NameIndex::Match> matches;
+    string next_cursor;
+    const util::Status status(
+        name_index_->Search(domain, cursor, FLAGS_max_name_search_results,
+                            &matches, &next_cursor));
+    if (!status.ok()) {
+      return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                           status.error_message());
+    }
 
-  // Sekrit parameter to indicate that SCTs should be included too.
-  // This is non-standard, and is only used internally by other log nodes when
-  // "following" nodes with more data.
-  const bool include_scts(libevent::GetBoolParam(query, "include_scts"));
+    // Entries past the tree head being served cannot be fetched yet.
+    const int64_t tree_size(log_lookup_->GetSTH().tree_size());
+    JsonArray json_matches;
+    for (const NameIndex::Match& match : matches) {
+      if (match.sequence_number >= tree_size) {
+        continue;
+      }
+      JsonObject json_match;
+      json_match.Add("name", match.name);
+      json_match.Add("index", match.sequence_number);
+      json_matches.Add(&json_match);
+    }
 
-  BlockingGetEntries(req, start, end, include_scts);
+    JsonObject json_reply;
+    json_reply.Add("matches", json_matches);
+    json_reply.AddBase64("cursor", next_cursor);
+    SendJsonReply(event_base_, req, HTTP_OK, json_reply);
+  });
 }
 
 
@@ -205,6 +424,11 @@ void HttpHandler::GetProof(evhttp_request* req) const {
                          "Method not allowed.");
   }
 
+  if (!log_lookup_->IsReady()) {
+    return SendJsonError(event_base_, req, HTTP_SERVUNAVAIL,
+                         "The Merkle tree is still being loaded.");
+  }
+
   const libevent::QueryParams query(libevent::ParseQuery(req));
 
   string b64_hash;
@@ -213,7 +437,7 @@ void HttpHandler::GetProof(evhttp_request* req) const {
                          "Missing or invalid \"hash\" parameter.");
   }
 
-  const string hash(util::FromBase64(b64_hash.c_str()));
+  const string hash(util::FromBase64(b64_hash.data(), b64_hash.size()));
   if (hash.empty()) {
     return SendJsonError(event_base_, req, HTTP_BADREQUEST,
                          "Invalid \"hash\" parameter.");
@@ -226,53 +450,128 @@ void HttpHandler::GetProof(evhttp_request* req) const {
                          "Missing or invalid \"tree_size\" parameter.");
   }
 
-  ShortMerkleAuditProof proof;
-  if (log_lookup_->AuditProof(hash, tree_size, &proof) != LogLookup::OK) {
+  RequestArena arena;
+  ShortMerkleAuditProof* const proof(arena.Create<ShortMerkleAuditProof>());
+  if (log_lookup_->AuditProof(hash, tree_size, proof) != LogLookup::OK) {
     return SendJsonError(event_base_, req, HTTP_BADREQUEST,
                          "Couldn't find hash.");
   }
 
   JsonArray json_audit;
-  for (int i = 0; i < proof.path_node_size(); ++i) {
-    json_audit.AddBase64(proof.path_node(i));
+  for (const string& node : proof->path_node()) {
+    json_audit.Add(NewBase64String(node, &arena));
   }
 
   JsonObject json_reply;
-  json_reply.Add("leaf_index", proof.leaf_index());
+  json_reply.Add("leaf_index", proof->leaf_index());
   json_reply.Add("audit_path", json_audit);
 
   SendJsonReply(event_base_, req, HTTP_OK, json_reply);
 }
 
 
-void HttpHandler::GetSTH(evhttp_request* req) const {
+// Takes any number (up to --max_proofs_per_request) of "hash"
+// parameters and a "tree_size", and replies with:
+//
+//   {"nodes": [<base64 node>, ...],
+//    "proofs": [{"leaf_index": <index>, "audit_path": [<node>, ...]}, ...]}
+//
+// Nodes shared by several audit paths are only sent once: each audit
+// path lists indices into "nodes". The proofs are in the same order
+// as the "hash" parameters, with a "leaf_index" of -1 (and an empty
+// path) for hashes which are not in the tree of that size.
+void HttpHandler::GetProofs(evhttp_request* req) const {
   if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
     return SendJsonError(event_base_, req, HTTP_BADMETHOD,
                          "Method not allowed.");
   }
 
-  const SignedTreeHead& sth(log_lookup_->GetSTH());
+  if (!log_lookup_->IsReady()) {
+    return SendJsonError(event_base_, req, HTTP_SERVUNAVAIL,
+                         "The Merkle tree is still being loaded.");
+  }
 
-  VLOG(2) << "SignedTreeHead:\n" << sth.DebugString();
+  const libevent::QueryParams query(libevent::ParseQuery(req));
 
-  JsonObject json_reply;
-  json_reply.Add("tree_size", sth.tree_size());
-  json_reply.Add("timestamp", sth.timestamp());
-  json_reply.AddBase64("sha256_root_hash", sth.sha256_root_hash());
-  json_reply.Add("tree_head_signature", sth.signature());
+  vector<string> hashes;
+  libevent::GetParams(query, "hash", &hashes);
+  for (string& hash : hashes) {
+    hash = util::FromBase64(hash.data(), hash.size());
+    if (hash.empty()) {
+      return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                           "Invalid \"hash\" parameter.");
+    }
+  }
+  if (hashes.empty() ||
+      hashes.size() > static_cast<size_t>(FLAGS_max_proofs_per_request)) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or too many \"hash\" parameters.");
+  }
+
+  const int64_t tree_size(libevent::GetIntParam(query, "tree_size"));
+  if (tree_size < 0 ||
+      static_cast<int64_t>(tree_size) > log_lookup_->GetSTH().tree_size()) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or invalid \"tree_size\" parameter.");
+  }
 
-  VLOG(2) << "GetSTH:\n" << json_reply.DebugString();
+  vector<LogLookup::LookupResult> results;
+  vector<ShortMerkleAuditProof> proofs;
+  log_lookup_->AuditProofs(hashes, tree_size, &results, &proofs);
+
+  RequestArena arena;
+  JsonArray json_nodes;
+  map<string, int64_t> node_indices;
+  JsonArray json_proofs;
+  for (size_t i = 0; i < proofs.size(); ++i) {
+    JsonArray json_audit;
+    if (results[i] == LogLookup::OK) {
+      for (const string& node : proofs[i].path_node()) {
+        const auto inserted(
+            node_indices.insert(make_pair(node, node_indices.size())));
+        if (inserted.second)
+          json_nodes.Add(NewBase64String(node, &arena));
+        json_audit.Add(json_object_new_int64(inserted.first->second));
+      }
+    }
+
+    JsonObject json_proof;
+    json_proof.Add("leaf_index", results[i] == LogLookup::OK
+                                     ? proofs[i].leaf_index()
+                                     : static_cast<int64_t>(-1));
+    json_proof.Add("audit_path", json_audit);
+    json_proofs.Add(&json_proof);
+  }
+
+  JsonObject json_reply;
+  json_reply.Add("nodes", json_nodes);
+  json_reply.Add("proofs", json_proofs);
 
   SendJsonReply(event_base_, req, HTTP_OK, json_reply);
 }
 
 
+void HttpHandler::GetSTH(evhttp_request* req) const {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
+                         "Method not allowed.");
+  }
+
+  caches_->SendSTH(req);
+}
+
+
 void HttpHandler::GetConsistency(evhttp_request* req) const {
   if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
     return SendJsonError(event_base_, req, HTTP_BADMETHOD,
                          "Method not allowed.");
   }
 
+  if (!log_lookup_->IsReady()) {
+    return SendJsonError(event_base_, req, HTTP_SERVUNAVAIL,
+                         "The Merkle tree is still being loaded.");
+  }
+
   const libevent::QueryParams query(libevent::ParseQuery(req));
 
   const int64_t first(libevent::GetIntParam(query, "first"));
@@ -289,6 +588,13 @@ void HttpHandler::GetConsistency(evhttp_request* req) const {
 
   const vector<string> consistency(
       log_lookup_->ConsistencyProof(first, second));
+  // Only a proof from one tree size to itself, or from an empty tree,
+  // is empty. Otherwise, |second| is past our tree head, or we only
+  // have a partition of the tree, without the nodes for this one.
+  if (consistency.empty() && first > 0 && first < second) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Consistency proof not available.");
+  }
   JsonArray json_cons;
   for (vector<string>::const_iterator it = consistency.begin();
        it != consistency.end(); ++it) {
@@ -302,51 +608,33 @@ void HttpHandler::GetConsistency(evhttp_request* req) const {
 }
 
 
-void HttpHandler::BlockingGetEntries(evhttp_request* req, int64_t start,
-                                     int64_t end, bool include_scts) const {
-  JsonArray json_entries;
-  auto it(db_->ScanEntries(start));
-  for (int64_t i = start; i <= end; ++i) {
-    LoggedEntry entry;
-
-    if (!it->GetNextEntry(&entry) || entry.sequence_number() != i) {
-      break;
-    }
-
-    string leaf_input;
-    string extra_data;
-    string sct_data;
-    if (!entry.SerializeForLeaf(&leaf_input) ||
-        !entry.SerializeExtraData(&extra_data) ||
-        (include_scts &&
-         Serializer::SerializeSCT(entry.sct(), &sct_data) !=
-             cert_trans::serialization::SerializeResult::OK)) {
-      LOG(WARNING) << "Failed to serialize entry @ " << i << ":\n"
-                   << entry.DebugString();
-      return SendJsonError(event_base_, req, HTTP_INTERNAL,
-                           "Serialization failed.");
-    }
+void HttpHandler::GetLoggedEntriesDone(evhttp_request* req, int64_t start,
+                                       vector<LoggedEntry>* entries,
+                                       util::Task* task) const {
+  const unique_ptr<vector<LoggedEntry>> entries_deleter(entries);
+  const unique_ptr<util::Task> task_deleter(task);
+  caches_->get_entries_work()->Done();
 
-    JsonObject json_entry;
-    json_entry.AddBase64("leaf_input", leaf_input);
-    json_entry.AddBase64("extra_data", extra_data);
-
-    if (include_scts) {
-      // This is non-standard for this implementation, and is currently only
-      // used by other nodes when "following" to fetch data from each other:
-      json_entry.AddBase64("sct", sct_data);
-    }
-
-    json_entries.Add(&json_entry);
+  if (!task->status().ok()) {
+    LOG(WARNING) << "Failed to read entries @ " << start << ": "
+                 << task->status();
+    return SendJsonError(event_base_, req, HTTP_INTERNAL,
+                         "Failed to read entries.");
   }
 
-  if (json_entries.Length() < 1) {
+  if (entries->empty()) {
     return SendJsonError(event_base_, req, HTTP_BADREQUEST,
                          "Entry not found.");
   }
 
-  JsonObject json_reply;
-  json_reply.Add("entries", json_entries);
+  util::trace::Span serialize_span("serialize_entries",
+                                   util::trace::Phase::SERIALIZATION);
+  const unique_ptr<evbuffer, void (*)(evbuffer*)> body(
+      CHECK_NOTNULL(evbuffer_new()), &evbuffer_free);
+  for (const LoggedEntry& entry : *entries) {
+    AddDelimited(entry, body.get());
+  }
+  serialize_span.End();
 
-  SendJsonReply(event_base_, req, HTTP_OK, json_reply);
+  SendBinaryReply(event_base_, req, HTTP_OK, body.get());
 }
@@ -3,16 +3,19 @@
 
 #include <stdint.h>
 #include <memory>
-#include <mutex>
 #include <string>
+#include <vector>
 
 #include "proto/ct.pb.h"
+#include "server/handler_caches.h"
 #include "server/staleness_tracker.h"
+#include "server/work_class.h"
 #include "util/libevent_wrapper.h"
 #include "util/sync_task.h"
 #include "util/task.h"
 
 class Frontend;
+class JsonObject;
 
 namespace cert_trans {
 
@@ -21,6 +24,7 @@ class CertChecker;
 class ClusterStateController;
 class LogLookup;
 class LoggedEntry;
+class NameIndex;
 class PreCertChain;
 class Proxy;
 class ReadOnlyDatabase;
@@ -30,7 +34,9 @@ class ThreadPool;
 class HttpHandler {
  public:
   // Does not take ownership of its parameters, which must outlive
-  // this instance.
+  // this instance. |controller| and |staleness_tracker| can be null
+  // for a log this node serves on its own, outside of a cluster, in
+  // which case it has no Proxy either, and serves every request.
   HttpHandler(LogLookup* log_lookup, const ReadOnlyDatabase* db,
               const ClusterStateController* controller, ThreadPool* pool,
               libevent::Base* event_base, StalenessTracker* staleness_tracker);
@@ -38,9 +44,14 @@ class HttpHandler {
   HttpHandler(const HttpHandler&) = delete;
   HttpHandler& operator=(const HttpHandler&) = delete;
 
-  void Add(libevent::HttpServer* server);
+  // Adds the handlers to |server|, under |prefix| (such as "/logs/2017",
+  // with no trailing slash) if not empty, so that several logs can be
+  // served by the same HTTP server.
+  void Add(libevent::HttpServer* server, const std::string& prefix = "");
 
   void SetProxy(Proxy* proxy);
+  // Serves search-names from |name_index|, if set before Add().
+  void SetNameIndex(const NameIndex* name_index);
 
  protected:
   // Implemented by subclasses which want to add their own extra http handlers.
@@ -49,7 +60,14 @@ class HttpHandler {
   void AddEntryReply(evhttp_request* req, const util::Status& add_status,
                      const ct::SignedCertificateTimestamp& sct) const;
 
+  // Adds the fields of an add-chain reply for |sct| to |json|.
+  static void AddSctFields(const ct::SignedCertificateTimestamp& sct,
+                           JsonObject* json);
+
+  // Serves requests for |path| with |local_handler|, unless this node
+  // is stale, or they are always proxied.
   void ProxyInterceptor(
+      const std::string& path,
       const libevent::HttpServer::HandlerCallback& local_handler,
       evhttp_request* request);
 
@@ -58,20 +76,40 @@ class HttpHandler {
       const libevent::HttpServer::HandlerCallback& local_handler);
 
   void GetEntries(evhttp_request* req) const;
+  // Like get-entries with include_scts, but replies with the
+  // LoggedEntryPB records themselves, each preceded by its length as
+  // a varint, which is much cheaper to produce and consume than JSON.
+  void GetLoggedEntries(evhttp_request* req) const;
+  // Replies with the index get-entries can start at to get the entries
+  // logged at or after a given time, which are nearly all after it.
+  void GetIndexSince(evhttp_request* req) const;
+  // Replies with the sequence numbers of the certificates for the
+  // names equal to or under a domain, a page at a time.
+  void SearchNames(evhttp_request* req) const;
   void GetProof(evhttp_request* req) const;
+  void GetProofs(evhttp_request* req) const;
   void GetSTH(evhttp_request* req) const;
   void GetConsistency(evhttp_request* req) const;
 
-  void BlockingGetEntries(evhttp_request* req, int64_t start, int64_t end,
-                          bool include_scts) const;
+  // Takes ownership of |entries| and |task|.
+  void GetLoggedEntriesDone(evhttp_request* req, int64_t start,
+                            std::vector<LoggedEntry>* entries,
+                            util::Task* task) const;
 
   LogLookup* const log_lookup_;
   const ReadOnlyDatabase* const db_;
   const ClusterStateController* const controller_;
   Proxy* proxy_;
+  const NameIndex* name_index_;
   ThreadPool* const pool_;
   libevent::Base* const event_base_;
   StalenessTracker* const staleness_tracker_;
+  // Prepended to the paths of the handlers, set by Add().
+  std::string prefix_;
+  // The get-sth reply, the get-entries caches, and the database reads
+  // for those and get-logged-entries. Last, so that the reads are
+  // stopped before the rest goes away.
+  const std::unique_ptr<HandlerCaches> caches_;
 };
 
 
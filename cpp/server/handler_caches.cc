@@ -0,0 +1,420 @@
+#include "server/handler_caches.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <limits>
+
+#include "base/time_support.h"
+#include "log/database.h"
+#include "log/log_lookup.h"
+#include "log/logged_entry.h"
+#include "monitoring/monitoring.h"
+#include "server/json_output.h"
+#include "util/trace.h"
+
+using ct::SignedTreeHead;
+using std::bind;
+using std::get;
+using std::lock_guard;
+using std::make_shared;
+using std::make_tuple;
+using std::min;
+using std::mutex;
+using std::numeric_limits;
+using std::placeholders::_1;
+using std::shared_ptr;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+
+DEFINE_int32(max_leaf_entries_per_response, 1000,
+             "maximum number of entries to put in the response of a "
+             "get-entries request");
+DEFINE_int32(get_entries_cache_mb, 64,
+             "how many megabytes of rendered entries to keep around to "
+             "serve get-entries requests, 0 to disable");
+DEFINE_int32(gzip_entries_cache_mb, 16,
+             "how many megabytes of gzip-compressed get-entries replies "
+             "for full-size ranges to keep around, 0 to disable; only "
+             "used with --gzip_min_reply_bytes");
+DEFINE_bool(align_get_entries_ranges, false,
+            "cut get-entries ranges short at multiples of "
+            "--max_leaf_entries_per_response, so that clients scanning "
+            "the log from different offsets ask for the same ranges, and "
+            "share the cached replies");
+DEFINE_int32(num_get_entries_io_threads, 8,
+             "number of threads reading entries from the database for "
+             "get-entries requests");
+DEFINE_int32(max_pending_get_entries, 256,
+             "maximum number of get-entries requests waiting for or doing "
+             "database reads; beyond that, they get a 503");
+DEFINE_bool(frozen, false,
+            "the log accepts no more entries (as a temporal shard whose "
+            "window has passed), so its replies never change, and clients "
+            "and proxies may cache them indefinitely");
+
+DECLARE_int64(entry_cache_right_edge);
+
+namespace cert_trans {
+namespace {
+
+
+// A year, the longest that HTTP/1.1 caches are meant to keep anything.
+const char kFrozenCacheControl[] = "public, max-age=31536000, immutable";
+
+
+static Counter<>* get_entries_coalesced(
+    Counter<>::New("get_entries_coalesced",
+                   "Number of get-entries requests answered with the "
+                   "reply to an identical one already waiting on the "
+                   "database."));
+
+
+// Number of entries in a full-size get-entries range, the only ones
+// whose compressed replies are kept.
+int64_t FullRangeSize() {
+  return FLAGS_align_get_entries_ranges
+             ? FLAGS_max_leaf_entries_per_response
+             : FLAGS_max_leaf_entries_per_response + 1;
+}
+
+
+}  // namespace
+
+
+struct HandlerCaches::STHReply {
+  uint64_t timestamp;
+  string json_body;
+  string etag;
+  string last_modified;
+};
+
+
+HandlerCaches::HandlerCaches(LogLookup* log_lookup,
+                             const ReadOnlyDatabase* db,
+                             libevent::Base* event_base,
+                             const STHRenderer& render_sth,
+                             const EntryRenderer& render_entry)
+    : log_lookup_(CHECK_NOTNULL(log_lookup)),
+      db_(CHECK_NOTNULL(db)),
+      event_base_(CHECK_NOTNULL(event_base)),
+      render_sth_(render_sth),
+      render_entry_(render_entry),
+      entry_cache_(FLAGS_get_entries_cache_mb > 0
+                       ? new JsonEntryCache(
+                             static_cast<size_t>(FLAGS_get_entries_cache_mb)
+                             << 20)
+                       : nullptr),
+      gzip_range_cache_(
+          FLAGS_gzip_entries_cache_mb > 0
+              ? new JsonEntryCache(
+                    static_cast<size_t>(FLAGS_gzip_entries_cache_mb) << 20)
+              : nullptr),
+      get_entries_work_(new WorkClass("get-entries",
+                                      FLAGS_num_get_entries_io_threads,
+                                      FLAGS_max_pending_get_entries)) {
+  CHECK(render_sth_);
+  CHECK(render_entry_);
+  CHECK(!FLAGS_align_get_entries_ranges ||
+        FLAGS_max_leaf_entries_per_response > 0);
+}
+
+
+HandlerCaches::~HandlerCaches() {
+}
+
+
+// static
+void HandlerCaches::AllowCachingIfFrozen(evhttp_request* req) {
+  if (FLAGS_frozen) {
+    CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(req),
+                               "Cache-Control", kFrozenCacheControl),
+             0);
+  }
+}
+
+
+bool HandlerCaches::ParseEntriesRange(evhttp_request* req,
+                                      const libevent::QueryParams& query,
+                                      int64_t* start, int64_t* end) const {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    SendJsonError(event_base_, req, HTTP_BADMETHOD, "Method not allowed.");
+    return false;
+  }
+
+  *start = libevent::GetIntParam(query, "start");
+  if (*start < 0) {
+    SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                  "Missing or invalid \"start\" parameter.");
+    return false;
+  }
+
+  *end = libevent::GetIntParam(query, "end");
+  if (*end < *start) {
+    SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                  "Missing or invalid \"end\" parameter.");
+    return false;
+  }
+
+  // Limit the number of entries returned in a single request.
+  if (FLAGS_align_get_entries_ranges) {
+    // RFC 6962 lets us return fewer entries than asked for, and
+    // clients carry on from where the reply left off.
+    const int64_t block(FLAGS_max_leaf_entries_per_response);
+    *end = min(*end, (*start / block + 1) * block - 1);
+  } else {
+    *end = min(*end, *start + FLAGS_max_leaf_entries_per_response);
+  }
+  return true;
+}
+
+
+shared_ptr<const HandlerCaches::STHReply> HandlerCaches::GetSTHReply()
+    const {
+  // Until the tree is loaded, LogLookup has no tree head yet, so serve
+  // the one of the database, which the tree is being loaded up to.
+  const bool ready(log_lookup_->IsReady());
+  SignedTreeHead db_sth;
+  if (!ready && db_->LatestTreeHead(&db_sth) != ReadOnlyDatabase::LOOKUP_OK) {
+    db_sth.Clear();
+  }
+  const uint64_t timestamp(ready ? log_lookup_->GetSTHTimestamp()
+                                 : db_sth.timestamp());
+  lock_guard<mutex> lock(sth_reply_lock_);
+  if (sth_reply_ && sth_reply_->timestamp == timestamp) {
+    return sth_reply_;
+  }
+
+  const SignedTreeHead sth(ready ? log_lookup_->GetSTH() : db_sth);
+  VLOG(2) << "SignedTreeHead:\n" << sth.DebugString();
+
+  const shared_ptr<STHReply> reply(make_shared<STHReply>());
+  reply->timestamp = sth.timestamp();
+  reply->json_body = render_sth_(sth);
+  VLOG(2) << "GetSTH:\n" << reply->json_body;
+  // Tree head timestamps are unique, which makes them good entity tags.
+  reply->etag = "\"" + to_string(sth.timestamp()) + "\"";
+  const time_t last_modified(sth.timestamp() / kNumMillisPerSecond);
+  struct tm tm;
+  char buf[64];
+  CHECK_NOTNULL(gmtime_r(&last_modified, &tm));
+  CHECK_GT(strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm), 0U);
+  reply->last_modified = buf;
+
+  sth_reply_ = reply;
+  return sth_reply_;
+}
+
+
+void HandlerCaches::SendSTH(evhttp_request* req) const {
+  const shared_ptr<const STHReply> reply(GetSTHReply());
+
+  evkeyvalq* const output_headers(evhttp_request_get_output_headers(req));
+  CHECK_EQ(evhttp_add_header(output_headers, "ETag", reply->etag.c_str()), 0);
+  CHECK_EQ(evhttp_add_header(output_headers, "Last-Modified",
+                             reply->last_modified.c_str()),
+           0);
+
+  // Polling clients can check whether they have the latest tree head
+  // already. The entity tag is exact, so it takes precedence: the
+  // modification time has a granularity of a second.
+  evkeyvalq* const input_headers(evhttp_request_get_input_headers(req));
+  const char* const if_none_match(
+      evhttp_find_header(input_headers, "If-None-Match"));
+  const char* const if_modified_since(
+      evhttp_find_header(input_headers, "If-Modified-Since"));
+  bool not_modified(false);
+  if (if_none_match) {
+    not_modified = strcmp(if_none_match, "*") == 0 ||
+                   strstr(if_none_match, reply->etag.c_str()) != nullptr;
+  } else if (if_modified_since) {
+    struct tm tm = {};
+    const char* const end(
+        strptime(if_modified_since, "%a, %d %b %Y %H:%M:%S GMT", &tm));
+    not_modified = end && *end == '\0' &&
+                   timegm(&tm) >= static_cast<time_t>(reply->timestamp /
+                                                      kNumMillisPerSecond);
+  }
+
+  if (not_modified) {
+    return SendJsonReply(event_base_, req, HTTP_NOTMODIFIED, string());
+  }
+
+  // The body is referred to rather than copied, for as long as the
+  // reply is being sent.
+  SendJsonReply(event_base_, req, HTTP_OK,
+                shared_ptr<const string>(reply, &reply->json_body));
+}
+
+
+void HandlerCaches::StartGetEntries(evhttp_request* req, int64_t start,
+                                    int64_t end, bool include_scts) const {
+  // Bulk downloaders go through the log in full-size ranges, which,
+  // like the entries, never change, so their compressed replies are
+  // worth keeping.
+  const int64_t gzip_range_start(
+      gzip_range_cache_ && !include_scts &&
+              end - start + 1 == FullRangeSize() &&
+              AcceptsGzip(req)
+          ? start
+          : -1);
+  if (gzip_range_start >= 0) {
+    const shared_ptr<const string> gzipped_body(
+        gzip_range_cache_->Lookup(gzip_range_start));
+    if (gzipped_body) {
+      return SendGzippedJsonReply(event_base_, req, HTTP_OK, gzipped_body);
+    }
+  }
+
+  unique_ptr<JsonEntriesWriter> json_entries(new JsonEntriesWriter);
+  // Entries cannot change once sequenced, so serve as many as we can
+  // from the cache, and only go to the database from the first miss.
+  int64_t i(start);
+  if (entry_cache_ && !include_scts) {
+    shared_ptr<const string> json_entry;
+    for (; i <= end && (json_entry = entry_cache_->Lookup(i)); ++i) {
+      json_entries->AddEncodedEntry(json_entry);
+    }
+  }
+
+  if (i > end) {
+    return SendEntries({req}, gzip_range_start, json_entries.get());
+  }
+
+  const ReadKey key(
+      make_tuple(start, end, include_scts, gzip_range_start >= 0));
+  {
+    lock_guard<mutex> lock(pending_reads_lock_);
+    const auto it(pending_reads_.find(key));
+    if (it != pending_reads_.end()) {
+      get_entries_coalesced->Increment();
+      it->second.push_back(req);
+      return;
+    }
+    if (!get_entries_work_->Admit()) {
+      return SendJsonError(event_base_, req, HTTP_SERVUNAVAIL,
+                           "Too many pending get-entries requests.");
+    }
+    pending_reads_[key].push_back(req);
+  }
+
+  vector<LoggedEntry>* const entries(new vector<LoggedEntry>);
+  const ReadOnlyDatabase::ReadPattern pattern(GetEntriesReadPattern(i));
+  db_->ReadEntriesAsync(i, end, numeric_limits<size_t>::max(), pattern,
+                        get_entries_work_.get(), entries,
+                        new util::Task(bind(&HandlerCaches::GetEntriesDone,
+                                            this, key, i, gzip_range_start,
+                                            pattern, json_entries.release(),
+                                            entries, _1),
+                                       get_entries_work_.get()));
+}
+
+
+ReadOnlyDatabase::ReadPattern HandlerCaches::GetEntriesReadPattern(
+    int64_t start) const {
+  return start < db_->TreeSize() - FLAGS_entry_cache_right_edge
+             ? ReadOnlyDatabase::BULK_SCAN
+             : ReadOnlyDatabase::POINT_READ;
+}
+
+
+void HandlerCaches::GetEntriesDone(const ReadKey& key, int64_t start,
+                                   int64_t gzip_range_start,
+                                   ReadOnlyDatabase::ReadPattern pattern,
+                                   JsonEntriesWriter* json_entries,
+                                   vector<LoggedEntry>* entries,
+                                   util::Task* task) const {
+  const unique_ptr<JsonEntriesWriter> json_entries_deleter(json_entries);
+  const unique_ptr<vector<LoggedEntry>> entries_deleter(entries);
+  const unique_ptr<util::Task> task_deleter(task);
+  get_entries_work_->Done();
+
+  // Requests arriving from now on start a read of their own (which
+  // will likely be served from |entry_cache_|).
+  vector<evhttp_request*> reqs;
+  {
+    lock_guard<mutex> lock(pending_reads_lock_);
+    const auto it(pending_reads_.find(key));
+    CHECK(it != pending_reads_.end());
+    reqs.swap(it->second);
+    pending_reads_.erase(it);
+  }
+  const auto send_error([this, &reqs](int http_status, const string& msg) {
+    for (evhttp_request* const req : reqs) {
+      SendJsonError(event_base_, req, http_status, msg);
+    }
+  });
+
+  if (!task->status().ok()) {
+    LOG(WARNING) << "Failed to read entries @ " << start << ": "
+                 << task->status();
+    return send_error(HTTP_INTERNAL, "Failed to read entries.");
+  }
+
+  const bool include_scts(get<2>(key));
+  util::trace::Span serialize_span("serialize_entries",
+                                   util::trace::Phase::SERIALIZATION);
+  for (const LoggedEntry& entry : *entries) {
+    const shared_ptr<string> json_entry(make_shared<string>());
+    if (!render_entry_(entry, include_scts, json_entry.get())) {
+      LOG(WARNING) << "Failed to serialize entry @ "
+                   << entry.sequence_number() << ":\n"
+                   << entry.DebugString();
+      return send_error(HTTP_INTERNAL, "Serialization failed.");
+    }
+
+    if (entry_cache_ && !include_scts &&
+        pattern != ReadOnlyDatabase::BULK_SCAN) {
+      entry_cache_->Insert(entry.sequence_number(), json_entry);
+    }
+    json_entries->AddEncodedEntry(json_entry);
+  }
+
+  serialize_span.End();
+
+  if (json_entries->entry_count() < 1) {
+    return send_error(HTTP_BADREQUEST, "Entry not found.");
+  }
+
+  SendEntries(reqs, gzip_range_start, json_entries);
+}
+
+
+void HandlerCaches::SendEntries(const vector<evhttp_request*>& reqs,
+                                int64_t gzip_range_start,
+                                JsonEntriesWriter* json_entries) const {
+  CHECK(!reqs.empty());
+  // Only a complete range can be kept: the tree may not have grown
+  // far enough yet for the rest.
+  if (gzip_range_start >= 0 &&
+      json_entries->entry_count() == FullRangeSize()) {
+    util::trace::Span gzip_span("gzip_entries",
+                                util::trace::Phase::SERIALIZATION);
+    const shared_ptr<const string> gzipped_body(
+        make_shared<const string>(json_entries->FinishGzipped()));
+    gzip_span.End();
+    gzip_range_cache_->Insert(gzip_range_start, gzipped_body);
+    for (evhttp_request* const req : reqs) {
+      SendGzippedJsonReply(event_base_, req, HTTP_OK, gzipped_body);
+    }
+    return;
+  }
+
+  if (reqs.size() == 1) {
+    return SendJsonReply(event_base_, reqs.front(), HTTP_OK, json_entries);
+  }
+
+  // The body is rendered once, and referred to by all the replies.
+  const shared_ptr<const string> json_body(
+      make_shared<const string>(json_entries->FinishString()));
+  for (evhttp_request* const req : reqs) {
+    SendJsonReply(event_base_, req, HTTP_OK, json_body);
+  }
+}
+
+
+}  // namespace cert_trans
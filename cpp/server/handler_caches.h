@@ -0,0 +1,156 @@
+#ifndef CERT_TRANS_SERVER_HANDLER_CACHES_H_
+#define CERT_TRANS_SERVER_HANDLER_CACHES_H_
+
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "log/database.h"
+#include "proto/ct.pb.h"
+#include "server/json_entry_cache.h"
+#include "server/work_class.h"
+#include "util/libevent_wrapper.h"
+#include "util/task.h"
+
+namespace cert_trans {
+
+class JsonEntriesWriter;
+class LogLookup;
+class LoggedEntry;
+
+
+// The caches and admission control behind the get-sth and get-entries
+// requests, shared by both generations of HTTP handlers (HttpHandler
+// and HttpHandlerV2), which only differ in how they render the tree
+// heads and entries that are kept here:
+//
+//  - the get-sth reply, rendered once per tree head, with the headers
+//    for conditional requests;
+//  - the rendered entries, which never change once sequenced;
+//  - the gzip-compressed replies of full-size get-entries ranges;
+//  - the threads reading entries from the database, with a bound on
+//    how many reads can be pending;
+//  - the get-entries requests in flight, so that identical ones
+//    arriving meanwhile (as when monitors all poll for a new tree
+//    head at once) share their read and their reply.
+//
+// This class is thread-safe.
+class HandlerCaches {
+ public:
+  // Renders the JSON body of a get-sth reply for |sth|.
+  typedef std::function<std::string(const ct::SignedTreeHead& sth)>
+      STHRenderer;
+  // Renders |entry| as one JSON object of the "entries" of a
+  // get-entries reply, with the (non-standard) SCT if |include_sct| is
+  // true. Returns false if the entry cannot be serialized.
+  typedef std::function<bool(const LoggedEntry& entry, bool include_sct,
+                             std::string* json_entry)> EntryRenderer;
+
+  // Does not take ownership of |log_lookup|, |db| or |event_base|,
+  // which must outlive this instance. The sizes of the caches and the
+  // number of reading threads come from the flags.
+  HandlerCaches(LogLookup* log_lookup, const ReadOnlyDatabase* db,
+                libevent::Base* event_base, const STHRenderer& render_sth,
+                const EntryRenderer& render_entry);
+  ~HandlerCaches();
+  HandlerCaches(const HandlerCaches&) = delete;
+  HandlerCaches& operator=(const HandlerCaches&) = delete;
+
+  // Parses the "start" and "end" parameters of a get-entries request,
+  // capping the range at --max_leaf_entries_per_response entries, or,
+  // with --align_get_entries_ranges, at the end of the block of that
+  // many entries that |start| is in.
+  // Otherwise, sends an error reply and returns false.
+  bool ParseEntriesRange(evhttp_request* req,
+                         const libevent::QueryParams& query, int64_t* start,
+                         int64_t* end) const;
+
+  // Replies to a get-sth request for the latest tree head, or with a
+  // 304 if the client has it already.
+  void SendSTH(evhttp_request* req) const;
+
+  // Serves what it can of [start, end] from the entry cache, and has
+  // the rest read from the database by |get_entries_work()|, so that
+  // the HTTP threads are not held up by storage. Replies with a 503
+  // if too many reads are pending already. Entries with SCTs are not
+  // cached, nor are those read by a BULK_SCAN. If an identical request
+  // is already waiting on the database, |req| gets the same reply.
+  void StartGetEntries(evhttp_request* req, int64_t start, int64_t end,
+                       bool include_scts) const;
+
+  // How the database should read a get-entries range from |start|:
+  // the ranges starting further back than --entry_cache_right_edge
+  // are taken to be part of a pass over the log, like a mirror's, and
+  // kept out of the caches that the reads of the newest entries use.
+  ReadOnlyDatabase::ReadPattern GetEntriesReadPattern(int64_t start) const;
+
+  // With --frozen, lets clients and proxies keep the reply to |req|
+  // indefinitely, if it is successful. Otherwise, does nothing.
+  static void AllowCachingIfFrozen(evhttp_request* req);
+
+  // For other requests reading entries from the database, which
+  // should Admit() themselves first.
+  WorkClass* get_entries_work() const {
+    return get_entries_work_.get();
+  }
+
+ private:
+  // A get-sth reply, rendered once per tree head.
+  struct STHReply;
+  // Returns the reply for the latest tree head, rendering it if it has
+  // changed since the last call.
+  std::shared_ptr<const STHReply> GetSTHReply() const;
+
+  // A get-entries request waiting on the database: its start, end,
+  // whether it includes the SCTs, and whether it gets a compressed
+  // reply from |gzip_range_cache_|.
+  typedef std::tuple<int64_t, int64_t, bool, bool> ReadKey;
+
+  // Takes ownership of |json_entries|, |entries| and |task|. Replies
+  // to the request for |key|, and to those which joined it since.
+  void GetEntriesDone(const ReadKey& key, int64_t start,
+                      int64_t gzip_range_start,
+                      ReadOnlyDatabase::ReadPattern pattern,
+                      JsonEntriesWriter* json_entries,
+                      std::vector<LoggedEntry>* entries,
+                      util::Task* task) const;
+  // Sends the reply to |reqs|, compressing and keeping it in
+  // |gzip_range_cache_| if |gzip_range_start| is not -1 and the range
+  // is complete.
+  void SendEntries(const std::vector<evhttp_request*>& reqs,
+                   int64_t gzip_range_start,
+                   JsonEntriesWriter* json_entries) const;
+
+  LogLookup* const log_lookup_;
+  const ReadOnlyDatabase* const db_;
+  libevent::Base* const event_base_;
+  const STHRenderer render_sth_;
+  const EntryRenderer render_entry_;
+  // NULL if disabled.
+  const std::unique_ptr<JsonEntryCache> entry_cache_;
+  // Compressed replies for full-size get-entries ranges, keyed by the
+  // start of the range. NULL if disabled.
+  const std::unique_ptr<JsonEntryCache> gzip_range_cache_;
+
+  mutable std::mutex sth_reply_lock_;
+  mutable std::shared_ptr<const STHReply> sth_reply_;
+
+  mutable std::mutex pending_reads_lock_;
+  // The requests to reply to once the read for each key is done, the
+  // first being the one which started it.
+  mutable std::map<ReadKey, std::vector<evhttp_request*>> pending_reads_;
+
+  // The database reads for get-entries. Last, so that it is stopped
+  // before the rest goes away.
+  const std::unique_ptr<WorkClass> get_entries_work_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_HANDLER_CACHES_H_
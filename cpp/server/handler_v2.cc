@@ -13,15 +13,19 @@
 #include "log/logged_entry.h"
 #include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
+#include "server/handler_caches.h"
 #include "server/json_output.h"
 #include "server/proxy.h"
 #include "util/json_wrapper.h"
 #include "util/thread_pool.h"
+#include "util/trace.h"
 
 namespace libevent = cert_trans::libevent;
 
 using cert_trans::Counter;
+using cert_trans::HandlerCaches;
 using cert_trans::HttpHandlerV2;
+using cert_trans::JsonEntriesWriter;
 using cert_trans::Latency;
 using cert_trans::LoggedEntry;
 using cert_trans::Proxy;
@@ -42,10 +46,6 @@ using std::string;
 using std::unique_ptr;
 using std::vector;
 
-DEFINE_int32(max_leaf_entries_per_response, 1000,
-             "maximum number of entries to put in the response of a "
-             "get-entries request");
-
 namespace {
 
 
@@ -54,6 +54,34 @@ static Latency<milliseconds, string> http_server_request_latency_ms(
     "Total request latency in ms broken down by path");
 
 
+// TODO: These render the fields that v2 replies have in common with v1
+// ones, until the RFC 6962-bis TransItem encodings are supported.
+string RenderSTH(const SignedTreeHead& sth) {
+  JsonObject json_reply;
+  json_reply.Add("tree_size", sth.tree_size());
+  json_reply.Add("timestamp", sth.timestamp());
+  json_reply.AddBase64("sha256_root_hash", sth.sha256_root_hash());
+  json_reply.Add("tree_head_signature", sth.signature());
+  return json_reply.ToString();
+}
+
+
+bool RenderEntry(const LoggedEntry& entry, bool include_sct,
+                 string* json_entry) {
+  // There is no non-standard "sct" field in v2.
+  CHECK(!include_sct);
+  string leaf_input;
+  string extra_data;
+  if (!entry.SerializeForLeaf(&leaf_input) ||
+      !entry.SerializeExtraData(&extra_data)) {
+    return false;
+  }
+  *json_entry =
+      JsonEntriesWriter::EncodeEntry(leaf_input, extra_data, nullptr);
+  return true;
+}
+
+
 }  // namespace
 
 
@@ -67,7 +95,9 @@ HttpHandlerV2::HttpHandlerV2(LogLookup* log_lookup, const ReadOnlyDatabase* db,
       proxy_(nullptr),
       pool_(CHECK_NOTNULL(pool)),
       event_base_(CHECK_NOTNULL(event_base)),
-      staleness_tracker_(CHECK_NOTNULL(staleness_tracker)) {
+      staleness_tracker_(CHECK_NOTNULL(staleness_tracker)),
+      caches_(new HandlerCaches(log_lookup_, db_, event_base_, &RenderSTH,
+                                &RenderEntry)) {
 }
 
 
@@ -78,9 +108,13 @@ HttpHandlerV2::~HttpHandlerV2() {
 void StatsHandlerInterceptor(const string& path,
                              const libevent::HttpServer::HandlerCallback& cb,
                              evhttp_request* req) {
+  // The work spun off to other threads for this request is traced too.
+  const util::trace::ScopedSpan request_span(
+      util::trace::Span::NewTrace(path));
   ScopedLatency total_http_server_request_latency(
       http_server_request_latency_ms.GetScopedLatency(path));
 
+  HandlerCaches::AllowCachingIfFrozen(req);
   cb(req);
 }
 
@@ -112,16 +146,20 @@ void HttpHandlerV2::ProxyInterceptor(
 void HttpHandlerV2::AddProxyWrappedHandler(
     libevent::HttpServer* server, const string& path,
     const libevent::HttpServer::HandlerCallback& local_handler) {
+  const string full_path(prefix_ + path);
   const libevent::HttpServer::HandlerCallback stats_handler(
-      bind(&StatsHandlerInterceptor, path, local_handler, _1));
-  CHECK(server->AddHandler(path, bind(&HttpHandlerV2::ProxyInterceptor, this,
-                                      stats_handler, _1)));
+      bind(&StatsHandlerInterceptor, full_path, local_handler, _1));
+  CHECK(server->AddHandler(
+      full_path,
+      bind(&HttpHandlerV2::ProxyInterceptor, this, stats_handler, _1)));
 }
 
 
-void HttpHandlerV2::Add(libevent::HttpServer* server) {
+void HttpHandlerV2::Add(libevent::HttpServer* server, const string& prefix) {
   CHECK_NOTNULL(server);
-  // TODO(pphaneuf): An optional prefix might be nice?
+  CHECK(prefix.empty() || (prefix[0] == '/' && prefix.back() != '/'))
+      << "Bad path prefix: " << prefix;
+  prefix_ = prefix;
   // TODO(pphaneuf): Find out which methods are CPU intensive enough
   // that they should be spun off to the thread pool.
   AddProxyWrappedHandler(server, "/ct/v2/get-entries",
@@ -145,31 +183,113 @@ void HttpHandlerV2::SetProxy(Proxy* proxy) {
 
 
 void HttpHandlerV2::GetEntries(evhttp_request* req) const {
-  return SendJsonError(event_base_, req, HTTP_NOTIMPLEMENTED,
-                       "Not yet implemented.");
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+  int64_t start;
+  int64_t end;
+  if (!caches_->ParseEntriesRange(req, query, &start, &end)) {
+    return;
+  }
+
+  caches_->StartGetEntries(req, start, end, false);
 }
 
 
 void HttpHandlerV2::GetProof(evhttp_request* req) const {
-  return SendJsonError(event_base_, req, HTTP_NOTIMPLEMENTED,
-                       "Not yet implemented.");
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
+                         "Method not allowed.");
+  }
+
+  if (!log_lookup_->IsReady()) {
+    return SendJsonError(event_base_, req, HTTP_SERVUNAVAIL,
+                         "The Merkle tree is still being loaded.");
+  }
+
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+
+  string b64_hash;
+  if (!libevent::GetParam(query, "hash", &b64_hash)) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or invalid \"hash\" parameter.");
+  }
+
+  const string hash(util::FromBase64(b64_hash.data(), b64_hash.size()));
+  if (hash.empty()) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Invalid \"hash\" parameter.");
+  }
+
+  const int64_t tree_size(libevent::GetIntParam(query, "tree_size"));
+  if (tree_size < 0 || tree_size > log_lookup_->GetSTH().tree_size()) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or invalid \"tree_size\" parameter.");
+  }
+
+  // Served from the audit paths that LogLookup precomputes for the
+  // newest entries, like v1.
+  ShortMerkleAuditProof proof;
+  if (log_lookup_->AuditProof(hash, tree_size, &proof) != LogLookup::OK) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Couldn't find hash.");
+  }
+
+  JsonArray json_audit;
+  for (const string& node : proof.path_node()) {
+    json_audit.AddBase64(node);
+  }
+
+  JsonObject json_reply;
+  json_reply.Add("leaf_index", proof.leaf_index());
+  json_reply.Add("audit_path", json_audit);
+
+  SendJsonReply(event_base_, req, HTTP_OK, json_reply);
 }
 
 
 void HttpHandlerV2::GetSTH(evhttp_request* req) const {
-  return SendJsonError(event_base_, req, HTTP_NOTIMPLEMENTED,
-                       "Not yet implemented.");
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
+                         "Method not allowed.");
+  }
+
+  caches_->SendSTH(req);
 }
 
 
 void HttpHandlerV2::GetConsistency(evhttp_request* req) const {
-  return SendJsonError(event_base_, req, HTTP_NOTIMPLEMENTED,
-                       "Not yet implemented.");
-}
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    return SendJsonError(event_base_, req, HTTP_BADMETHOD,
+                         "Method not allowed.");
+  }
 
+  if (!log_lookup_->IsReady()) {
+    return SendJsonError(event_base_, req, HTTP_SERVUNAVAIL,
+                         "The Merkle tree is still being loaded.");
+  }
 
-void HttpHandlerV2::BlockingGetEntries(evhttp_request* req, int64_t start,
-                                       int64_t end, bool include_scts) const {
-  return SendJsonError(event_base_, req, HTTP_NOTIMPLEMENTED,
-                       "Not yet implemented.");
+  const libevent::QueryParams query(libevent::ParseQuery(req));
+
+  const int64_t first(libevent::GetIntParam(query, "first"));
+  if (first < 0) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or invalid \"first\" parameter.");
+  }
+
+  const int64_t second(libevent::GetIntParam(query, "second"));
+  if (second < first) {
+    return SendJsonError(event_base_, req, HTTP_BADREQUEST,
+                         "Missing or invalid \"second\" parameter.");
+  }
+
+  // The proofs from the recent tree heads to the latest one are
+  // precomputed by LogLookup.
+  JsonArray json_cons;
+  for (const string& node : log_lookup_->ConsistencyProof(first, second)) {
+    json_cons.AddBase64(node);
+  }
+
+  JsonObject json_reply;
+  json_reply.Add("consistency", json_cons);
+
+  SendJsonReply(event_base_, req, HTTP_OK, json_reply);
 }
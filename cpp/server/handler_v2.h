@@ -7,6 +7,7 @@
 #include <string>
 
 #include "proto/ct.pb.h"
+#include "server/handler_caches.h"
 #include "server/staleness_tracker.h"
 #include "util/libevent_wrapper.h"
 #include "util/sync_task.h"
@@ -39,7 +40,10 @@ class HttpHandlerV2 {
   HttpHandlerV2(const HttpHandlerV2&) = delete;
   HttpHandlerV2& operator=(const HttpHandlerV2&) = delete;
 
-  void Add(libevent::HttpServer* server);
+  // Adds the handlers to |server|, under |prefix| (such as "/logs/2017",
+  // with no trailing slash) if not empty, so that several logs can be
+  // served by the same HTTP server.
+  void Add(libevent::HttpServer* server, const std::string& prefix = "");
 
   void SetProxy(Proxy* proxy);
 
@@ -63,9 +67,6 @@ class HttpHandlerV2 {
   void GetSTH(evhttp_request* req) const;
   void GetConsistency(evhttp_request* req) const;
 
-  void BlockingGetEntries(evhttp_request* req, int64_t start, int64_t end,
-                          bool include_scts) const;
-
   LogLookup* const log_lookup_;
   const ReadOnlyDatabase* const db_;
   const ClusterStateController* const controller_;
@@ -73,6 +74,11 @@ class HttpHandlerV2 {
   ThreadPool* const pool_;
   libevent::Base* const event_base_;
   StalenessTracker* const staleness_tracker_;
+  // Prepended to the paths of the handlers, set by Add().
+  std::string prefix_;
+  // The same caches as HttpHandler has, rendering v2 replies. Last, so
+  // that its reads are stopped before the rest goes away.
+  const std::unique_ptr<HandlerCaches> caches_;
 };
 
 
@@ -0,0 +1,212 @@
+#include "server/handoff.h"
+
+#include <errno.h>
+#include <glog/logging.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <future>
+
+#include "util/libevent_wrapper.h"
+
+using cert_trans::libevent::Base;
+using cert_trans::libevent::HttpServer;
+using std::chrono::duration;
+using std::promise;
+using std::string;
+using std::thread;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+// What the new process sends to ask for the sockets.
+const char kHandoffRequest = 'H';
+// The most sockets handed over, one per loop of the HTTP server.
+const size_t kMaxSockets = 64;
+
+
+sockaddr_un UnixAddress(const string& path) {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  CHECK_LT(path.size(), sizeof(addr.sun_path)) << "Path too long: " << path;
+  memcpy(addr.sun_path, path.data(), path.size());
+  return addr;
+}
+
+
+void SendSockets(int conn, const vector<int>& fds) {
+  CHECK(!fds.empty());
+  CHECK_LE(fds.size(), kMaxSockets);
+  char byte(kHandoffRequest);
+  iovec iov;
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  vector<char> control(CMSG_SPACE(fds.size() * sizeof(int)));
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+  cmsghdr* const cmsg(CMSG_FIRSTHDR(&msg));
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), fds.data(), fds.size() * sizeof(int));
+  PCHECK(sendmsg(conn, &msg, 0) == 1) << "Cannot hand the sockets over";
+}
+
+
+vector<int> ReceiveSockets(int conn) {
+  char byte;
+  iovec iov;
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  vector<char> control(CMSG_SPACE(kMaxSockets * sizeof(int)));
+  msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+  PCHECK(recvmsg(conn, &msg, MSG_CMSG_CLOEXEC) == 1)
+      << "Cannot receive the sockets handed over";
+  CHECK_EQ(0, msg.msg_flags & MSG_CTRUNC);
+
+  vector<int> fds;
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      const size_t count((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+      const int* const data(reinterpret_cast<const int*>(CMSG_DATA(cmsg)));
+      fds.insert(fds.end(), data, data + count);
+    }
+  }
+  CHECK(!fds.empty()) << "No sockets handed over";
+  return fds;
+}
+
+
+}  // namespace
+
+
+vector<int> TakeOverListeningSockets(const string& path) {
+  const int conn(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  PCHECK(conn >= 0);
+  const sockaddr_un addr(UnixAddress(path));
+  if (connect(conn, reinterpret_cast<const sockaddr*>(&addr),
+              sizeof(addr)) != 0) {
+    LOG(INFO) << "No server to take over from at " << path << ": "
+              << strerror(errno);
+    close(conn);
+    return vector<int>();
+  }
+
+  PCHECK(write(conn, &kHandoffRequest, 1) == 1);
+  const vector<int> fds(ReceiveSockets(conn));
+  LOG(INFO) << "Took over " << fds.size() << " listening sockets, waiting "
+            << "for the old server to exit";
+
+  // It closes the connection by exiting.
+  char byte;
+  ssize_t got;
+  while ((got = read(conn, &byte, 1)) != 0) {
+    PCHECK(got > 0 || errno == EINTR);
+  }
+  close(conn);
+  return fds;
+}
+
+
+HandoffListener::HandoffListener(const string& path, Base* base,
+                                 HttpServer* server,
+                                 const duration<double>& drain)
+    : path_(path),
+      base_(CHECK_NOTNULL(base)),
+      server_(CHECK_NOTNULL(server)),
+      drain_(drain),
+      fd_(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) {
+  PCHECK(fd_ >= 0);
+  // Left behind by the server taken over from, if any.
+  unlink(path_.c_str());
+  const sockaddr_un addr(UnixAddress(path_));
+  PCHECK(bind(fd_, reinterpret_cast<const sockaddr*>(&addr),
+              sizeof(addr)) == 0)
+      << "Cannot bind to " << path_;
+  PCHECK(listen(fd_, 1) == 0);
+  thread_.reset(new thread(&HandoffListener::Listen, this));
+}
+
+
+HandoffListener::~HandoffListener() {
+  // Wakes up accept().
+  shutdown(fd_, SHUT_RDWR);
+  thread_->join();
+  close(fd_);
+}
+
+
+void HandoffListener::Listen() {
+  while (true) {
+    const int conn(accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC));
+    if (conn < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      // Shut down by the destructor.
+      return;
+    }
+
+    char request;
+    if (read(conn, &request, 1) != 1 || request != kHandoffRequest) {
+      LOG(WARNING) << "Ignoring a bad handoff request on " << path_;
+      close(conn);
+      continue;
+    }
+    // |conn| is left open, for the new process to know when this one
+    // is gone.
+    HandOff(conn);
+    return;
+  }
+}
+
+
+void HandoffListener::HandOff(int conn) {
+  LOG(WARNING) << "Handing the listening sockets over to a new process";
+
+  // The loop closes its sockets as it stops listening, so hand over
+  // copies of them.
+  promise<vector<int>> copies;
+  base_->Add([this, &copies]() {
+    vector<int> fds;
+    for (const int fd : server_->ListeningSockets()) {
+      fds.push_back(dup(fd));
+      PCHECK(fds.back() >= 0);
+    }
+    copies.set_value(fds);
+  });
+  const vector<int> fds(copies.get_future().get());
+  SendSockets(conn, fds);
+  for (const int fd : fds) {
+    close(fd);
+  }
+
+  promise<void> stopped;
+  base_->Add([this, &stopped]() {
+    server_->StopListening();
+    stopped.set_value();
+  });
+  stopped.get_future().wait();
+
+  LOG(WARNING) << "Stopped accepting connections, exiting in "
+               << drain_.count() << " seconds";
+  std::this_thread::sleep_for(drain_);
+  base_->LoopExit();
+}
+
+
+}  // namespace cert_trans
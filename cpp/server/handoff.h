@@ -0,0 +1,62 @@
+#ifndef CERT_TRANS_SERVER_HANDOFF_H_
+#define CERT_TRANS_SERVER_HANDOFF_H_
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace cert_trans {
+namespace libevent {
+class Base;
+class HttpServer;
+}  // namespace libevent
+
+
+// Restarting a server (to upgrade it, say) hands its listening
+// sockets over to the new process through a Unix socket, rather than
+// closing them, so that no connection is refused meanwhile: those
+// that come in before the new process is ready wait in the backlog.
+//
+// The new process asks for the sockets with TakeOverListeningSockets()
+// before it opens the database, and the old one then stops accepting
+// connections, finishes serving the ones it has, and exits, so that
+// the two never write to the database (or to the Merkle tree kept in
+// --merkle_tree_dir, which the new process reuses) at the same time.
+
+
+// Returns the listening sockets of the server waiting for a handoff at
+// |path|, once it has exited, or nothing if there is no such server.
+std::vector<int> TakeOverListeningSockets(const std::string& path);
+
+
+// Waits for a new process to take over from this one at |path|, and
+// then hands it the listening sockets of |server|, and exits the loop
+// of |base| (as on SIGTERM) after |drain|, so that the requests in
+// flight are served.
+class HandoffListener {
+ public:
+  HandoffListener(const std::string& path, libevent::Base* base,
+                  libevent::HttpServer* server,
+                  const std::chrono::duration<double>& drain);
+  ~HandoffListener();
+  HandoffListener(const HandoffListener&) = delete;
+  HandoffListener& operator=(const HandoffListener&) = delete;
+
+ private:
+  void Listen();
+  void HandOff(int conn);
+
+  const std::string path_;
+  libevent::Base* const base_;
+  libevent::HttpServer* const server_;
+  const std::chrono::duration<double> drain_;
+  const int fd_;
+  std::unique_ptr<std::thread> thread_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_HANDOFF_H_
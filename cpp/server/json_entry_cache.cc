@@ -0,0 +1,84 @@
+#include "server/json_entry_cache.h"
+
+#include <glog/logging.h>
+
+#include "monitoring/monitoring.h"
+
+using std::lock_guard;
+using std::make_pair;
+using std::mutex;
+using std::shared_ptr;
+using std::string;
+
+namespace cert_trans {
+namespace {
+
+
+static Counter<string>* json_entry_cache_lookups(
+    Counter<string>::New("json_entry_cache_lookups", "result",
+                         "Number of lookups of rendered get-entries "
+                         "entries, by result (hit or miss)."));
+
+
+}  // namespace
+
+
+JsonEntryCache::JsonEntryCache(size_t max_bytes)
+    : max_shard_bytes_(max_bytes / kShardCount),
+      memory_("json_entry_cache") {
+}
+
+
+JsonEntryCache::Shard* JsonEntryCache::ShardFor(int64_t sequence_number) {
+  CHECK_GE(sequence_number, 0);
+  return &shards_[sequence_number % kShardCount];
+}
+
+
+shared_ptr<const string> JsonEntryCache::Lookup(int64_t sequence_number) {
+  Shard* const shard(ShardFor(sequence_number));
+  {
+    lock_guard<mutex> lock(shard->lock);
+    const auto it(shard->index.find(sequence_number));
+    if (it != shard->index.end()) {
+      shard->lru.splice(shard->lru.begin(), shard->lru, it->second);
+      json_entry_cache_lookups->Increment("hit");
+      return it->second->second;
+    }
+  }
+
+  json_entry_cache_lookups->Increment("miss");
+  return nullptr;
+}
+
+
+void JsonEntryCache::Insert(int64_t sequence_number,
+                            const shared_ptr<const string>& json_entry) {
+  CHECK_NOTNULL(json_entry.get());
+  if (json_entry->size() > max_shard_bytes_) {
+    return;
+  }
+
+  Shard* const shard(ShardFor(sequence_number));
+  lock_guard<mutex> lock(shard->lock);
+  if (shard->index.count(sequence_number) > 0) {
+    // Another request got there first, and it is the same entry.
+    return;
+  }
+
+  const size_t old_bytes(shard->bytes);
+  while (shard->bytes + json_entry->size() > max_shard_bytes_) {
+    shard->bytes -= shard->lru.back().second->size();
+    shard->index.erase(shard->lru.back().first);
+    shard->lru.pop_back();
+  }
+
+  shard->lru.emplace_front(make_pair(sequence_number, json_entry));
+  shard->index.emplace(sequence_number, shard->lru.begin());
+  shard->bytes += json_entry->size();
+  memory_.Add(static_cast<int64_t>(shard->bytes) -
+              static_cast<int64_t>(old_bytes));
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,72 @@
+#ifndef CERT_TRANS_SERVER_JSON_ENTRY_CACHE_H_
+#define CERT_TRANS_SERVER_JSON_ENTRY_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "monitoring/memory.h"
+
+namespace cert_trans {
+
+
+// A bounded cache of log entries as rendered for get-entries replies
+// (see JsonEntriesWriter::EncodeEntry()), keyed by sequence number. It
+// also keeps compressed get-entries replies, keyed by the start of
+// their range.
+// Entries never change once sequenced, so nothing is ever
+// invalidated, only evicted when the cache is full. They are shared
+// rather than copied out, so that replies can refer to them directly.
+//
+// The cache is split into shards by sequence number, each with its
+// own lock and least recently used list, so that concurrent requests
+// rarely contend for the same lock.
+//
+// This class is thread-safe.
+class JsonEntryCache {
+ public:
+  // Keeps up to about |max_bytes| of rendered entries.
+  explicit JsonEntryCache(size_t max_bytes);
+  JsonEntryCache(const JsonEntryCache&) = delete;
+  JsonEntryCache& operator=(const JsonEntryCache&) = delete;
+
+  // Returns entry |sequence_number|, or NULL if it is not in the
+  // cache.
+  std::shared_ptr<const std::string> Lookup(int64_t sequence_number);
+
+  // Adds entry |sequence_number|, possibly evicting others. Entries
+  // larger than a shard are not kept.
+  void Insert(int64_t sequence_number,
+              const std::shared_ptr<const std::string>& json_entry);
+
+ private:
+  static const int kShardCount = 16;
+
+  struct Shard {
+    typedef std::list<
+        std::pair<int64_t, std::shared_ptr<const std::string>>> List;
+
+    std::mutex lock;
+    // Most recently used first.
+    List lru;
+    std::unordered_map<int64_t, List::iterator> index;
+    size_t bytes = 0;
+  };
+
+  Shard* ShardFor(int64_t sequence_number);
+
+  const size_t max_shard_bytes_;
+  // The bytes of all the shards.
+  MemoryAccount memory_;
+  Shard shards_[kShardCount];
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_JSON_ENTRY_CACHE_H_
@@ -0,0 +1,89 @@
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+
+#include "server/json_entry_cache.h"
+#include "util/testing.h"
+
+namespace {
+
+using cert_trans::JsonEntryCache;
+using std::make_shared;
+using std::shared_ptr;
+using std::string;
+using std::to_string;
+
+// Keep in sync with JsonEntryCache::kShardCount.
+const int kShardCount = 16;
+
+
+shared_ptr<const string> Entry(const string& json_entry) {
+  return make_shared<const string>(json_entry);
+}
+
+
+TEST(JsonEntryCacheTest, LookupAndInsert) {
+  JsonEntryCache cache(1 << 20);
+  EXPECT_FALSE(cache.Lookup(0));
+
+  for (int i = 0; i < 100; ++i) {
+    cache.Insert(i, Entry("entry" + to_string(i)));
+  }
+  for (int i = 0; i < 100; ++i) {
+    const shared_ptr<const string> json_entry(cache.Lookup(i));
+    ASSERT_TRUE(json_entry);
+    EXPECT_EQ("entry" + to_string(i), *json_entry);
+  }
+  EXPECT_FALSE(cache.Lookup(100));
+
+  // Entries do not change once sequenced, so inserting again is a
+  // no-op.
+  cache.Insert(7, Entry("something else"));
+  ASSERT_TRUE(cache.Lookup(7));
+  EXPECT_EQ("entry7", *cache.Lookup(7));
+}
+
+
+TEST(JsonEntryCacheTest, SharesEntries) {
+  JsonEntryCache cache(1 << 20);
+  const shared_ptr<const string> json_entry(Entry("entry"));
+  cache.Insert(0, json_entry);
+  EXPECT_EQ(json_entry.get(), cache.Lookup(0).get());
+}
+
+
+TEST(JsonEntryCacheTest, EvictsLeastRecentlyUsed) {
+  // Room for two 10-byte entries per shard.
+  JsonEntryCache cache(kShardCount * 20);
+  const shared_ptr<const string> kEntry(Entry(string(10, 'x')));
+
+  // These all go to the same shard.
+  cache.Insert(0, kEntry);
+  cache.Insert(kShardCount, kEntry);
+  ASSERT_TRUE(cache.Lookup(0));
+  cache.Insert(2 * kShardCount, kEntry);
+
+  EXPECT_TRUE(cache.Lookup(0));
+  EXPECT_FALSE(cache.Lookup(kShardCount));
+  EXPECT_TRUE(cache.Lookup(2 * kShardCount));
+
+  // Other shards are unaffected.
+  cache.Insert(1, kEntry);
+  EXPECT_TRUE(cache.Lookup(1));
+  EXPECT_TRUE(cache.Lookup(0));
+}
+
+
+TEST(JsonEntryCacheTest, TooLarge) {
+  JsonEntryCache cache(kShardCount * 20);
+  cache.Insert(0, Entry(string(21, 'x')));
+  EXPECT_FALSE(cache.Lookup(0));
+}
+
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -1,14 +1,53 @@
 #include "server/json_output.h"
 
+#include <event2/buffer.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <map>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
+#include "server/access_log.h"
 #include "util/json_wrapper.h"
 #include "util/libevent_wrapper.h"
+#include "util/trace.h"
+#include "util/util.h"
 
+DEFINE_int32(gzip_min_reply_bytes, 0,
+             "Replies with bodies at least this big are gzip-compressed for "
+             "clients which accept it. 0 disables compression.");
+DEFINE_int32(slow_request_threshold_ms, 1000,
+             "Requests taking at least this long, from when they are "
+             "received until their reply is sent, are logged with a "
+             "breakdown of where the time went. 0 disables this.");
+DEFINE_string(access_log, "",
+              "If set, append a binary record of every request served "
+              "(see server/access_log.h) to this file, which is written "
+              "in the background. Records are dropped, and counted, "
+              "rather than waited for if it cannot keep up.");
+DEFINE_int32(access_log_buffer_records, 1 << 16,
+             "How many records the access log buffers while they are "
+             "written out. Must be a power of two.");
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::chrono::system_clock;
+using std::map;
+using std::pair;
+using std::shared_ptr;
 using std::string;
+using std::vector;
 
 namespace cert_trans {
 namespace {
@@ -23,80 +62,527 @@ static Counter<string, int>* total_http_server_response_codes(
                               "response_code",
                               "Total number of responses sent with a given "
                               "HTTP response code for a given path."));
+static Counter<string>* slow_http_server_requests(
+    Counter<string>::New("slow_http_server_requests", "path",
+                         "Number of requests for a given path which took "
+                         "longer than --slow_request_threshold_ms."));
+static Counter<>* gzip_compressed_replies(
+    Counter<>::New("gzip_compressed_replies",
+                   "Number of reply bodies gzip-compressed as they were "
+                   "sent (not counting precompressed ones)."));
 
 static const char kJsonContentType[] = "application/json; charset=utf-8";
+static const char kBinaryContentType[] = "application/octet-stream";
+// How much to base64-encode at a time into a JsonEntriesWriter; must
+// be a multiple of 3, so that the pieces can be concatenated.
+static const size_t kBase64ChunkBytes = 3 * 16 * 1024;
 
 
-string LogRequest(evhttp_request* req, int http_status, int resp_body_length) {
-  evhttp_connection* conn = evhttp_request_get_connection(req);
-  char* peer_addr;
-  ev_uint16_t peer_port;
-  evhttp_connection_get_peer(conn, &peer_addr, &peer_port);
+// This is done for every request, so the counters are only looked up
+// once per path and thread.
+void CountRequest(const string& path, int http_status) {
+  static thread_local map<string, Counter<string>::Handle> requests;
+  static thread_local map<pair<string, int>, Counter<string, int>::Handle>
+      response_codes;
 
-  string http_verb;
-  switch (evhttp_request_get_command(req)) {
-    case EVHTTP_REQ_DELETE:
-      http_verb = "DELETE";
-      break;
-    case EVHTTP_REQ_GET:
-      http_verb = "GET";
-      break;
-    case EVHTTP_REQ_HEAD:
-      http_verb = "HEAD";
-      break;
-    case EVHTTP_REQ_POST:
-      http_verb = "POST";
-      break;
-    case EVHTTP_REQ_PUT:
-      http_verb = "PUT";
-      break;
-    default:
-      http_verb = "UNKNOWN";
+  auto request(requests.find(path));
+  if (request == requests.end()) {
+    request =
+        requests.emplace(path, total_http_server_requests->GetHandle(path))
+            .first;
+  }
+  request->second.Increment();
+
+  const pair<string, int> key(path, http_status);
+  auto response_code(response_codes.find(key));
+  if (response_code == response_codes.end()) {
+    response_code =
+        response_codes
+            .emplace(key, total_http_server_response_codes->GetHandle(
+                              path, http_status))
+            .first;
+  }
+  response_code->second.Increment();
+}
+
+
+const char* MethodName(AccessLog::Method method) {
+  switch (method) {
+    case AccessLog::DELETE:
+      return "DELETE";
+    case AccessLog::GET:
+      return "GET";
+    case AccessLog::HEAD:
+      return "HEAD";
+    case AccessLog::POST:
+      return "POST";
+    case AccessLog::PUT:
+      return "PUT";
+    case AccessLog::UNKNOWN:
       break;
   }
+  return "UNKNOWN";
+}
 
-  const string path(evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req)));
-  total_http_server_requests->Increment(path);
-  total_http_server_response_codes->Increment(path, http_status);
 
+const char* PeerAddress(evhttp_request* req) {
+  char* peer_addr;
+  ev_uint16_t peer_port;
+  evhttp_connection_get_peer(evhttp_request_get_connection(req), &peer_addr,
+                             &peer_port);
+  return peer_addr;
+}
+
+
+// Only for the text logs, which are not written for every request.
+string LogRequest(evhttp_request* req, int http_status, int resp_body_length) {
   const string uri(evhttp_request_get_uri(req));
-  return string(peer_addr) + " \"" + http_verb + " " + uri + "\" " +
+  return string(PeerAddress(req)) + " \"" +
+         MethodName(AccessLog::MethodOf(req)) + " " + uri + "\" " +
          std::to_string(http_status) + " " + std::to_string(resp_body_length);
 }
 
 
+// Null without --access_log. Never closed, as replies are sent until
+// the process exits.
+AccessLog* GetAccessLog() {
+  static AccessLog* const access_log(
+      FLAGS_access_log.empty()
+          ? nullptr
+          : new AccessLog(FLAGS_access_log,
+                          FLAGS_access_log_buffer_records));
+  return access_log;
+}
+
+
+// Copies what is to be logged about the request into the access log,
+// formatting nothing.
+void LogAccess(evhttp_request* req, int http_status, int resp_body_length,
+               const util::trace::RequestTimes* times) {
+  AccessLog* const access_log(GetAccessLog());
+  if (!access_log) {
+    return;
+  }
+  AccessLog::Record record;
+  record.timestamp_us =
+      duration_cast<microseconds>(system_clock::now().time_since_epoch())
+          .count();
+  record.duration_us =
+      times ? duration_cast<microseconds>(times->Elapsed()).count() : -1;
+  record.response_bytes = resp_body_length;
+  record.status = http_status;
+  record.method = AccessLog::MethodOf(req);
+  record.truncated = !AccessLog::CopyString(evhttp_request_get_uri(req),
+                                            record.uri, sizeof(record.uri));
+  AccessLog::CopyString(PeerAddress(req), record.peer, sizeof(record.peer));
+  access_log->Log(record);
+}
+
+
+int64_t ToMillis(const steady_clock::duration& time) {
+  return duration_cast<milliseconds>(time).count();
+}
+
+
+// Logs the request if it was slow, with how long it spent in each
+// phase. Whatever is not accounted for by those is the handlers' own
+// computation.
+void MaybeLogSlowRequest(evhttp_request* req, int http_status,
+                         int resp_body_length,
+                         const util::trace::RequestTimes& times) {
+  using util::trace::Phase;
+  const steady_clock::duration total(times.Elapsed());
+  if (FLAGS_slow_request_threshold_ms <= 0 ||
+      total < milliseconds(FLAGS_slow_request_threshold_ms)) {
+    return;
+  }
+  slow_http_server_requests->Increment(
+      evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req)));
+
+  const steady_clock::duration queue(times.Get(Phase::QUEUE));
+  const steady_clock::duration db(times.Get(Phase::DB));
+  const steady_clock::duration etcd(times.Get(Phase::ETCD));
+  const steady_clock::duration serialization(
+      times.Get(Phase::SERIALIZATION));
+  // The phases of work done in parallel can add up to more than the
+  // total.
+  const steady_clock::duration handler(
+      std::max(steady_clock::duration::zero(),
+               total - queue - db - etcd - serialization));
+  LOG(WARNING) << "slow request: "
+               << LogRequest(req, http_status, resp_body_length) << " took "
+               << ToMillis(total)
+               << " ms: queue_ms=" << ToMillis(queue)
+               << " handler_ms=" << ToMillis(handler)
+               << " db_ms=" << ToMillis(db) << " etcd_ms=" << ToMillis(etcd)
+               << " serialization_ms=" << ToMillis(serialization);
+}
+
+
+void AddString(evbuffer* buffer, const char* str) {
+  CHECK_EQ(evbuffer_add(buffer, str, strlen(str)), 0);
+}
+
+
+void AppendBase64(const string& value, string* out) {
+  const size_t offset(out->size());
+  out->resize(offset + util::Base64Length(value.size()));
+  util::ToBase64(value.data(), value.size(), &(*out)[offset]);
+}
+
+
+void ReleaseReference(const void* /*data*/, size_t /*length*/,
+                      void* reference) {
+  delete static_cast<shared_ptr<const string>*>(reference);
+}
+
+
+// Adds |data| to |buffer| by reference, keeping it alive until
+// |buffer| (or whichever buffer it gets moved to) is done with it.
+void AddReference(evbuffer* buffer, const shared_ptr<const string>& data) {
+  if (data->empty()) {
+    return;
+  }
+  CHECK_EQ(evbuffer_add_reference(buffer, data->data(), data->size(),
+                                  &ReleaseReference,
+                                  new shared_ptr<const string>(data)),
+           0);
+}
+
+
+// Feeds |size| bytes at |data| to |stream|, and appends whatever
+// comes out to |out|.
+void Deflate(z_stream* stream, const void* data, size_t size, int flush,
+             string* out) {
+  stream->next_in = static_cast<Bytef*>(const_cast<void*>(data));
+  stream->avail_in = size;
+  do {
+    char buf[16 * 1024];
+    stream->next_out = reinterpret_cast<Bytef*>(buf);
+    stream->avail_out = sizeof(buf);
+    const int ret(deflate(stream, flush));
+    // Z_BUF_ERROR only means that there was nothing to do.
+    CHECK(ret == Z_OK || ret == Z_STREAM_END || ret == Z_BUF_ERROR) << ret;
+    out->append(buf, sizeof(buf) - stream->avail_out);
+  } while (stream->avail_out == 0);
+}
+
+
+// Compresses the contents of |buffer|, in place.
+void GzipBuffer(evbuffer* buffer) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  // Adding 16 to the window bits asks for a gzip header and trailer.
+  CHECK_EQ(deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                        15 + 16, 8, Z_DEFAULT_STRATEGY),
+           Z_OK);
+
+  const size_t length(evbuffer_get_length(buffer));
+  const int num_chunks(evbuffer_peek(buffer, -1, NULL, NULL, 0));
+  vector<evbuffer_iovec> chunks(num_chunks);
+  CHECK_EQ(evbuffer_peek(buffer, -1, NULL, chunks.data(), num_chunks),
+           num_chunks);
+  string gzipped;
+  for (const evbuffer_iovec& chunk : chunks) {
+    Deflate(&stream, chunk.iov_base, chunk.iov_len, Z_NO_FLUSH, &gzipped);
+  }
+  Deflate(&stream, NULL, 0, Z_FINISH, &gzipped);
+  CHECK_EQ(deflateEnd(&stream), Z_OK);
+
+  CHECK_EQ(evbuffer_drain(buffer, length), 0);
+  CHECK_EQ(evbuffer_add(buffer, gzipped.data(), gzipped.size()), 0);
+}
+
+
+// Sends the reply, the body of which has already been put in the
+// output buffer of |req|, compressing it if it is worth it.
+void SendReply(libevent::Base* base, evhttp_request* req, int http_status,
+               const char* content_type = kJsonContentType) {
+  CHECK_NOTNULL(base);
+  CHECK_NOTNULL(req);
+  evkeyvalq* const output_headers(evhttp_request_get_output_headers(req));
+  CHECK_EQ(evhttp_add_header(output_headers, "Content-Type", content_type),
+           0);
+  if (FLAGS_gzip_min_reply_bytes > 0) {
+    // Caches must not hand compressed replies to clients that did not
+    // ask for them.
+    CHECK_EQ(evhttp_add_header(output_headers, "Vary", "Accept-Encoding"), 0);
+    evbuffer* const body(evhttp_request_get_output_buffer(req));
+    if (!evhttp_find_header(output_headers, "Content-Encoding") &&
+        evbuffer_get_length(body) >=
+            static_cast<size_t>(FLAGS_gzip_min_reply_bytes) &&
+        AcceptsGzip(req)) {
+      const util::trace::Span span("gzip_reply",
+                                   util::trace::Phase::SERIALIZATION);
+      GzipBuffer(body);
+      CHECK_EQ(evhttp_add_header(output_headers, "Content-Encoding", "gzip"),
+               0);
+      gzip_compressed_replies->Increment();
+    }
+  }
+  // Whatever the handler allowed, errors are not to be cached.
+  if (http_status != HTTP_OK && http_status != HTTP_NOTMODIFIED) {
+    evhttp_remove_header(output_headers, "Cache-Control");
+  }
+  if (http_status == HTTP_SERVUNAVAIL ||
+      http_status == kHttpTooManyRequests) {
+    CHECK_EQ(evhttp_add_header(output_headers, "Retry-After", "10"), 0);
+  }
+
+  CountRequest(evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req)),
+               http_status);
+  const int resp_body_length(
+      evbuffer_get_length(evhttp_request_get_output_buffer(req)));
+  // Requests are timed from the handler interceptor, which starts the
+  // RequestTimes along with their trace.
+  const shared_ptr<util::trace::RequestTimes> times(
+      util::trace::CurrentContext().times);
+  const auto send_reply([req, http_status, resp_body_length, times]() {
+    if (times) {
+      MaybeLogSlowRequest(req, http_status, resp_body_length, *times);
+    }
+    LogAccess(req, http_status, resp_body_length, times.get());
+    VLOG(1) << LogRequest(req, http_status, resp_body_length);
+
+    evhttp_send_reply(req, http_status, /*reason*/ NULL, /*databuf*/ NULL);
+  });
+
+  libevent::RunOnRequestLoop(req, send_reply);
+}
+
+
 }  // namespace
 
 
+string GzipJsonBody(const string& json_body) {
+  evbuffer* const buffer(CHECK_NOTNULL(evbuffer_new()));
+  CHECK_EQ(evbuffer_add(buffer, json_body.data(), json_body.size()), 0);
+  GzipBuffer(buffer);
+  string gzipped(evbuffer_get_length(buffer), '\0');
+  CHECK_EQ(evbuffer_remove(buffer, &gzipped[0], gzipped.size()),
+           static_cast<int>(gzipped.size()));
+  evbuffer_free(buffer);
+  return gzipped;
+}
+
+
+bool AcceptsGzip(evhttp_request* req) {
+  CHECK_NOTNULL(req);
+  if (FLAGS_gzip_min_reply_bytes <= 0) {
+    return false;
+  }
+  const char* const accept_encoding(evhttp_find_header(
+      evhttp_request_get_input_headers(req), "Accept-Encoding"));
+  if (!accept_encoding) {
+    return false;
+  }
+
+  // A comma-separated list of codings, each possibly with parameters,
+  // of which only the quality ("q=0" means "not this one") matters. An
+  // explicit "gzip" takes precedence over "*".
+  double any_quality(0);
+  const char* p(accept_encoding);
+  while (*p) {
+    p += strspn(p, " \t,");
+    const size_t name_length(strcspn(p, " \t;,"));
+    const bool is_gzip(name_length == 4 && strncasecmp(p, "gzip", 4) == 0);
+    const bool is_any(name_length == 1 && *p == '*');
+    const char* const end(p + strcspn(p, ","));
+    const char* q(p + name_length);
+    double quality(1);
+    while ((q = strchr(q, ';')) && q < end) {
+      q += 1 + strspn(q + 1, " \t");
+      if ((*q == 'q' || *q == 'Q') && q[1] == '=') {
+        quality = strtod(q + 2, NULL);
+      }
+    }
+    if (is_gzip) {
+      return quality > 0;
+    }
+    if (is_any) {
+      any_quality = quality;
+    }
+    p = end;
+  }
+  return any_quality > 0;
+}
+
+
+JsonEntriesWriter::JsonEntriesWriter()
+    : buffer_(CHECK_NOTNULL(evbuffer_new())), entry_count_(0) {
+  AddString(buffer_, "{\"entries\":[");
+}
+
+
+JsonEntriesWriter::~JsonEntriesWriter() {
+  evbuffer_free(buffer_);
+}
+
+
+void JsonEntriesWriter::AddEntry(const string& leaf_input,
+                                 const string& extra_data,
+                                 const string* sct) {
+  AddString(buffer_, entry_count_ > 0 ? ",{" : "{");
+  AddBase64Field("leaf_input", leaf_input);
+  AddString(buffer_, ",");
+  AddBase64Field("extra_data", extra_data);
+  if (sct) {
+    AddString(buffer_, ",");
+    AddBase64Field("sct", *sct);
+  }
+  AddString(buffer_, "}");
+  ++entry_count_;
+}
+
+
+void JsonEntriesWriter::AddEncodedEntry(
+    const shared_ptr<const string>& json_entry) {
+  if (entry_count_ > 0) {
+    AddString(buffer_, ",");
+  }
+  AddReference(buffer_, json_entry);
+  ++entry_count_;
+}
+
+
+// static
+string JsonEntriesWriter::EncodeEntry(const string& leaf_input,
+                                      const string& extra_data,
+                                      const string* sct) {
+  static const char kLeafInput[] = "{\"leaf_input\":\"";
+  static const char kExtraData[] = "\",\"extra_data\":\"";
+  static const char kSct[] = "\",\"sct\":\"";
+  static const char kEnd[] = "\"}";
+  string json;
+  json.reserve(sizeof(kLeafInput) + util::Base64Length(leaf_input.size()) +
+               sizeof(kExtraData) + util::Base64Length(extra_data.size()) +
+               (sct ? sizeof(kSct) + util::Base64Length(sct->size()) : 0) +
+               sizeof(kEnd));
+  json.append(kLeafInput);
+  AppendBase64(leaf_input, &json);
+  json.append(kExtraData);
+  AppendBase64(extra_data, &json);
+  if (sct) {
+    json.append(kSct);
+    AppendBase64(*sct, &json);
+  }
+  json.append(kEnd);
+  return json;
+}
+
+
+void JsonEntriesWriter::AddBase64Field(const char* name,
+                                       const string& value) {
+  AddString(buffer_, "\"");
+  AddString(buffer_, name);
+  AddString(buffer_, "\":\"");
+  for (size_t offset = 0; offset < value.size();
+       offset += kBase64ChunkBytes) {
+    const size_t size(std::min(kBase64ChunkBytes, value.size() - offset));
+    const size_t length(util::Base64Length(size));
+    evbuffer_iovec iov;
+    CHECK_EQ(evbuffer_reserve_space(buffer_, length, &iov, 1), 1);
+    util::ToBase64(value.data() + offset, size,
+                   static_cast<char*>(iov.iov_base));
+    iov.iov_len = length;
+    CHECK_EQ(evbuffer_commit_space(buffer_, &iov, 1), 0);
+  }
+  AddString(buffer_, "\"");
+}
+
+
+void JsonEntriesWriter::Finish() {
+  AddString(buffer_, "]}");
+}
+
+
+string JsonEntriesWriter::FinishGzipped() {
+  Finish();
+  GzipBuffer(buffer_);
+  string gzipped(evbuffer_get_length(buffer_), '\0');
+  CHECK_EQ(evbuffer_remove(buffer_, &gzipped[0], gzipped.size()),
+           static_cast<int>(gzipped.size()));
+  return gzipped;
+}
+
+
+string JsonEntriesWriter::FinishString() {
+  Finish();
+  string body(evbuffer_get_length(buffer_), '\0');
+  CHECK_EQ(evbuffer_remove(buffer_, &body[0], body.size()),
+           static_cast<int>(body.size()));
+  return body;
+}
+
+
 void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
                    const JsonObject& json) {
-  CHECK_NOTNULL(base);
   CHECK_NOTNULL(req);
+  string json_body;
+  {
+    const util::trace::Span span("serialize_json",
+                                 util::trace::Phase::SERIALIZATION);
+    json_body = json.ToString();
+  }
+  SendJsonReply(base, req, http_status, json_body);
+}
+
+
+void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
+                   const string& json_body) {
+  CHECK_NOTNULL(req);
+  CHECK_EQ(evbuffer_add(evhttp_request_get_output_buffer(req),
+                        json_body.data(), json_body.size()),
+           0);
+
+  SendReply(base, req, http_status);
+}
+
+
+void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
+                   const shared_ptr<const string>& json_body) {
+  CHECK_NOTNULL(req);
+  AddReference(evhttp_request_get_output_buffer(req), json_body);
+
+  SendReply(base, req, http_status);
+}
+
+
+void SendGzippedJsonReply(libevent::Base* base, evhttp_request* req,
+                          int http_status,
+                          const shared_ptr<const string>& gzipped_body) {
+  CHECK_NOTNULL(req);
+  AddReference(evhttp_request_get_output_buffer(req), gzipped_body);
   CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(req),
-                             "Content-Type", kJsonContentType),
+                             "Content-Encoding", "gzip"),
            0);
-  if (http_status == HTTP_SERVUNAVAIL) {
-    CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(req),
-                               "Retry-After", "10"),
-             0);
-  }
-  const string resp_body(json.ToString());
-  CHECK_GT(evbuffer_add_printf(evhttp_request_get_output_buffer(req), "%s",
-                               resp_body.c_str()),
+
+  SendReply(base, req, http_status);
+}
+
+
+void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
+                   JsonEntriesWriter* entries) {
+  CHECK_NOTNULL(req);
+  CHECK_NOTNULL(entries);
+  entries->Finish();
+  // This moves the data over, rather than copying it.
+  CHECK_EQ(evbuffer_add_buffer(evhttp_request_get_output_buffer(req),
+                               entries->buffer_),
            0);
 
-  const string logstr(LogRequest(req, http_status, resp_body.size()));
-  const auto send_reply([req, http_status, logstr]() {
-    evhttp_send_reply(req, http_status, /*reason*/ NULL, /*databuf*/ NULL);
+  SendReply(base, req, http_status);
+}
 
-    VLOG(1) << logstr;
-  });
 
-  if (!libevent::Base::OnEventThread()) {
-    base->Add(send_reply);
-  } else {
-    send_reply();
-  }
+void SendBinaryReply(libevent::Base* base, evhttp_request* req,
+                     int http_status, evbuffer* body) {
+  CHECK_NOTNULL(req);
+  CHECK_NOTNULL(body);
+  CHECK_EQ(evbuffer_add_buffer(evhttp_request_get_output_buffer(req), body),
+           0);
+
+  SendReply(base, req, http_status, kBinaryContentType);
 }
 
 
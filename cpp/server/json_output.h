@@ -1,8 +1,10 @@
 #ifndef CERT_TRANS_SERVER_JSON_OUTPUT_H_
 #define CERT_TRANS_SERVER_JSON_OUTPUT_H_
 
+#include <memory>
 #include <string>
 
+struct evbuffer;
 struct evhttp_request;
 class JsonObject;
 
@@ -12,10 +14,111 @@ class Base;
 }  // namespace libevent
 
 
+// libevent has no name for it. Like HTTP_SERVUNAVAIL, replies with it
+// come with a Retry-After header.
+const int kHttpTooManyRequests = 429;
+
+
+// Returns |json_body| gzip-compressed, for use with
+// SendGzippedJsonReply(), for bodies compressed once and sent many
+// times.
+std::string GzipJsonBody(const std::string& json_body);
+
+
+// Returns whether the reply to |req| may be gzip-compressed: that is
+// enabled with --gzip_min_reply_bytes, and the client accepts it. The
+// SendJsonReply() functions compress bodies of at least that size by
+// themselves.
+bool AcceptsGzip(evhttp_request* req);
+
+
+// Writes the body of a get-entries reply, {"entries":[...]}, straight
+// into a buffer, base64-encoding the fields of each entry in place,
+// instead of building a JsonObject for every entry and serializing the
+// whole tree at the end.
+class JsonEntriesWriter {
+ public:
+  JsonEntriesWriter();
+  ~JsonEntriesWriter();
+  JsonEntriesWriter(const JsonEntriesWriter&) = delete;
+  JsonEntriesWriter& operator=(const JsonEntriesWriter&) = delete;
+
+  // Adds an entry with the given fields, base64-encoded. If |sct| is
+  // NULL, the (non-standard) "sct" field is left out.
+  void AddEntry(const std::string& leaf_input, const std::string& extra_data,
+                const std::string* sct);
+
+  // Adds an entry previously rendered by EncodeEntry(). It is not
+  // copied, but kept until the reply is sent.
+  void AddEncodedEntry(const std::shared_ptr<const std::string>& json_entry);
+
+  // Renders an entry the same way as AddEntry() would, for later use
+  // with AddEncodedEntry().
+  static std::string EncodeEntry(const std::string& leaf_input,
+                                 const std::string& extra_data,
+                                 const std::string* sct);
+
+  // Finishes the reply body and returns it gzip-compressed, for use
+  // with SendGzippedJsonReply(). The writer should not be used
+  // afterwards.
+  std::string FinishGzipped();
+
+  // Finishes the reply body and returns it, for a reply sent to
+  // several requests. The writer should not be used afterwards.
+  std::string FinishString();
+
+  int entry_count() const {
+    return entry_count_;
+  }
+
+ private:
+  friend void SendJsonReply(libevent::Base* base, evhttp_request* req,
+                            int http_status, JsonEntriesWriter* entries);
+
+  void AddBase64Field(const char* name, const std::string& value);
+  void Finish();
+
+  evbuffer* const buffer_;
+  int entry_count_;
+};
+
+
 void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
                    const JsonObject& json);
 
 
+// As above, but with a body that is already rendered.
+void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
+                   const std::string& json_body);
+
+
+// As above, but without copying the body, which is kept until the
+// reply is sent. For large bodies rendered once and sent many times.
+void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
+                   const std::shared_ptr<const std::string>& json_body);
+
+
+// As above, but with a body that is already gzip-compressed, for
+// clients which accept that (see AcceptsGzip()). For bodies
+// compressed once and sent many times.
+void SendGzippedJsonReply(
+    libevent::Base* base, evhttp_request* req, int http_status,
+    const std::shared_ptr<const std::string>& gzipped_body);
+
+
+// Sends the entries added to |entries| as the body of the reply. This
+// moves them out of |entries|, which should not be used afterwards.
+void SendJsonReply(libevent::Base* base, evhttp_request* req, int http_status,
+                   JsonEntriesWriter* entries);
+
+
+// Sends the contents of |body| as an application/octet-stream reply,
+// moving them out of |body|. Errors should still be sent with
+// SendJsonError().
+void SendBinaryReply(libevent::Base* base, evhttp_request* req,
+                     int http_status, evbuffer* body);
+
+
 void SendJsonError(libevent::Base* base, evhttp_request* req, int http_status,
                    const std::string& error_msg);
 
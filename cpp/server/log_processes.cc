@@ -1,11 +1,14 @@
 #include "server/log_processes.h"
 
 #include <gflags/gflags.h>
+#include <algorithm>
 #include <iostream>
+#include <string>
 
 #include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
 #include "server/metrics.h"
+#include "util/util.h"
 
 DEFINE_int32(tree_signing_frequency_seconds, 600,
              "How often should we issue a new signed tree head. Approximate: "
@@ -19,6 +22,28 @@ DEFINE_int32(sequencing_frequency_seconds, 10,
 DEFINE_int32(cleanup_frequency_seconds, 10,
              "How often should new entries be cleanedup. The cleanup runs in "
              "in parallel with the tree signing and sequencing.");
+DEFINE_int32(sequencing_backlog_threshold, 0,
+             "Sequence as soon as this many pending entries are past the "
+             "guard window, rather than waiting for "
+             "--sequencing_frequency_seconds. 0 disables this.");
+DEFINE_int32(tree_signing_backlog_threshold, 0,
+             "Sign as soon as this many sequenced entries are not in the tree "
+             "yet, rather than waiting for --tree_signing_frequency_seconds. "
+             "0 disables this.");
+DEFINE_int32(target_merge_delay_seconds, 0,
+             "Sequence, and then sign, as soon as the oldest entry waiting on "
+             "either is older than half of this, so that entries get into an "
+             "STH within about this long. Set this well below the MMD, and "
+             "above the guard window. 0 disables this.");
+DEFINE_int32(tree_signing_min_interval_seconds, 10,
+             "The least time between two signings, when they are triggered "
+             "by --tree_signing_backlog_threshold or "
+             "--target_merge_delay_seconds.");
+DEFINE_int32(backlog_check_interval_ms, 1000,
+             "How often the backlog of entries is checked, when "
+             "--sequencing_backlog_threshold, "
+             "--tree_signing_backlog_threshold or "
+             "--target_merge_delay_seconds is set. Must be greater than 0.");
 
 using cert_trans::Counter;
 using cert_trans::Gauge;
@@ -26,9 +51,12 @@ using cert_trans::Latency;
 using google::RegisterFlagValidator;
 using ct::SignedTreeHead;
 using std::function;
+using std::min;
+using std::string;
 using std::chrono::milliseconds;
 using std::chrono::seconds;
 using std::chrono::steady_clock;
+using util::TimeInMilliseconds;
 
 namespace {
 
@@ -51,6 +79,11 @@ Counter<bool>* signer_total_runs =
 Latency<milliseconds> signer_run_latency_ms("signer_run_latency_ms",
                                             "Total runtime of signer");
 
+Counter<string>* early_runs = Counter<string>::New(
+    "log_processes_early_runs", "reason",
+    "Number of sequencer and signer runs started ahead of their fixed "
+    "frequency, broken out by what triggered them.");
+
 static bool ValidateIsPositive(const char* flagname, int value) {
   if (value <= 0) {
     std::cout << flagname << " must be greater than 0" << std::endl;
@@ -62,50 +95,113 @@ static bool ValidateIsPositive(const char* flagname, int value) {
 static const bool sign_dummy =
     RegisterFlagValidator(&FLAGS_tree_signing_frequency_seconds,
                           &ValidateIsPositive);
+static const bool backlog_check_dummy = RegisterFlagValidator(
+    &FLAGS_backlog_check_interval_ms, &ValidateIsPositive);
+
+
+// Whether |backlog| calls for a run ahead of time, incrementing
+// |early_runs| for the reason if so. |stage| names the process.
+bool BacklogIsDue(const char* stage,
+                  const cert_trans::TreeSigner::Backlog& backlog,
+                  int32_t threshold) {
+  if (backlog.entries == 0) {
+    return false;
+  }
+  if (threshold > 0 && backlog.entries >= threshold) {
+    early_runs->Increment(string(stage) + "_backlog");
+    return true;
+  }
+  const uint64_t now(TimeInMilliseconds());
+  if (FLAGS_target_merge_delay_seconds > 0 &&
+      backlog.oldest_timestamp < now &&
+      now - backlog.oldest_timestamp >=
+          static_cast<uint64_t>(FLAGS_target_merge_delay_seconds) * 1000 / 2) {
+    early_runs->Increment(string(stage) + "_delay");
+    return true;
+  }
+  return false;
 }
 
-namespace cert_trans {
 
-void SignMerkleTree(TreeSigner* tree_signer, ConsistentStore* store,
-                    ClusterStateController* controller) {
-  CHECK_NOTNULL(tree_signer);
-  CHECK_NOTNULL(store);
-  CHECK_NOTNULL(controller);
-  const steady_clock::duration period(
-      (seconds(FLAGS_tree_signing_frequency_seconds)));
+// Calls |run| every |period|, or earlier, once |min_interval| has
+// passed since it last started, if |due| returns true. That is checked
+// every --backlog_check_interval_ms, if |adaptive|.
+void RunPeriodically(const steady_clock::duration& period,
+                     const steady_clock::duration& min_interval,
+                     bool adaptive, const function<bool()>& due,
+                     const function<void()>& run) {
   steady_clock::time_point target_run_time(steady_clock::now());
 
   while (true) {
-    {
-      ScopedLatency signer_run_latency(
-          signer_run_latency_ms.GetScopedLatency());
-      const TreeSigner::UpdateResult result(tree_signer->UpdateTree());
-      switch (result) {
-        case TreeSigner::OK: {
-          const SignedTreeHead latest_sth(tree_signer->LatestSTH());
-          latest_local_tree_size_gauge->Set(latest_sth.tree_size());
-          controller->NewTreeHead(latest_sth);
-          signer_total_runs->Increment(true /* successful */);
-          break;
-        }
-        case TreeSigner::INSUFFICIENT_DATA:
-          LOG(INFO) << "Can't update tree because we don't have all the "
-                    << "entries locally, will try again later.";
-          signer_total_runs->Increment(false /* successful */);
-          break;
-        default:
-          LOG(FATAL) << "Error updating tree: " << result;
-      }
-    }
+    const steady_clock::time_point started(steady_clock::now());
+    run();
 
-    const steady_clock::time_point now(steady_clock::now());
+    steady_clock::time_point now(steady_clock::now());
     while (target_run_time <= now) {
       target_run_time += period;
     }
-    std::this_thread::sleep_for(target_run_time - now);
+    if (!adaptive) {
+      std::this_thread::sleep_for(target_run_time - now);
+      continue;
+    }
+
+    const milliseconds check_interval(FLAGS_backlog_check_interval_ms);
+    std::this_thread::sleep_for(
+        min(target_run_time, started + min_interval) - now);
+    while ((now = steady_clock::now()) < target_run_time && !due()) {
+      std::this_thread::sleep_for(min<steady_clock::duration>(
+          check_interval, target_run_time - now));
+    }
+    // Runs started early give the fixed frequency a new start.
+    if (now < target_run_time) {
+      target_run_time = now;
+    }
   }
 }
 
+
+}  // namespace
+
+namespace cert_trans {
+
+void SignMerkleTree(TreeSigner* tree_signer, ConsistentStore* store,
+                    ClusterStateController* controller) {
+  CHECK_NOTNULL(tree_signer);
+  CHECK_NOTNULL(store);
+  CHECK_NOTNULL(controller);
+  const bool adaptive(FLAGS_tree_signing_backlog_threshold > 0 ||
+                      FLAGS_target_merge_delay_seconds > 0);
+
+  RunPeriodically(
+      seconds(FLAGS_tree_signing_frequency_seconds),
+      seconds(FLAGS_tree_signing_min_interval_seconds), adaptive,
+      [tree_signer]() {
+        return BacklogIsDue("signing", tree_signer->UpdateBacklog(),
+                            FLAGS_tree_signing_backlog_threshold);
+      },
+      [tree_signer, controller]() {
+        ScopedLatency signer_run_latency(
+            signer_run_latency_ms.GetScopedLatency());
+        const TreeSigner::UpdateResult result(tree_signer->UpdateTree());
+        switch (result) {
+          case TreeSigner::OK: {
+            const SignedTreeHead latest_sth(tree_signer->LatestSTH());
+            latest_local_tree_size_gauge->Set(latest_sth.tree_size());
+            controller->NewTreeHead(latest_sth);
+            signer_total_runs->Increment(true /* successful */);
+            break;
+          }
+          case TreeSigner::INSUFFICIENT_DATA:
+            LOG(INFO) << "Can't update tree because we don't have all the "
+                      << "entries locally, will try again later.";
+            signer_total_runs->Increment(false /* successful */);
+            break;
+          default:
+            LOG(FATAL) << "Error updating tree: " << result;
+        }
+      });
+}
+
 void CleanUpEntries(ConsistentStore* store,
                     const function<bool()>& is_master) {
   CHECK_NOTNULL(store);
@@ -143,31 +239,37 @@ void CleanUpEntries(ConsistentStore* store,
 
 
 void SequenceEntries(TreeSigner* tree_signer,
+                     ClusterStateController* controller,
                      const function<bool()>& is_master) {
   CHECK_NOTNULL(tree_signer);
+  CHECK_NOTNULL(controller);
   CHECK(is_master);
-  const steady_clock::duration period(
-      (seconds(FLAGS_sequencing_frequency_seconds)));
-  steady_clock::time_point target_run_time(steady_clock::now());
+  const bool adaptive(FLAGS_sequencing_backlog_threshold > 0 ||
+                      FLAGS_target_merge_delay_seconds > 0);
 
-  while (true) {
-    if (is_master()) {
-      const ScopedLatency sequencer_sequence_latency(
-          sequencer_sequence_latency_ms.GetScopedLatency());
-      util::Status status(tree_signer->SequenceNewEntries());
-      if (!status.ok()) {
-        LOG(WARNING) << "Problem sequencing new entries: " << status;
-      }
-      sequencer_total_runs->Increment(status.ok());
-    }
-
-    const steady_clock::time_point now(steady_clock::now());
-    while (target_run_time <= now) {
-      target_run_time += period;
-    }
-
-    std::this_thread::sleep_for(target_run_time - now);
-  }
+  RunPeriodically(
+      seconds(FLAGS_sequencing_frequency_seconds), steady_clock::duration(),
+      adaptive,
+      [tree_signer, &is_master]() {
+        TreeSigner::Backlog backlog;
+        return is_master() && tree_signer->SequencingBacklog(&backlog).ok() &&
+               BacklogIsDue("sequencing", backlog,
+                            FLAGS_sequencing_backlog_threshold);
+      },
+      [tree_signer, controller, &is_master]() {
+        if (!is_master()) {
+          return;
+        }
+        const ScopedLatency sequencer_sequence_latency(
+            sequencer_sequence_latency_ms.GetScopedLatency());
+        util::Status status(tree_signer->SequenceNewEntries());
+        if (status.ok()) {
+          controller->UpdateContiguousTreeSize();
+        } else {
+          LOG(WARNING) << "Problem sequencing new entries: " << status;
+        }
+        sequencer_total_runs->Increment(status.ok());
+      });
 }
 
 }  // namespace cert_trans
@@ -15,7 +15,11 @@ namespace cert_trans {
 void CleanUpEntries(ConsistentStore* store,
                     const std::function<bool()>& is_master);
 
+// Publishes the new size of the local database through |controller|
+// after each run, so that the other nodes can start fetching the new
+// entries before they are in a tree head.
 void SequenceEntries(TreeSigner* tree_signer,
+                     ClusterStateController* controller,
                      const std::function<bool()>& is_master);
 
 void SignMerkleTree(TreeSigner* tree_signer, ConsistentStore* store,
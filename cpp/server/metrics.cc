@@ -3,11 +3,15 @@
 #include <event2/buffer.h>
 #include <event2/http.h>
 #include <cstring>
+#include <memory>
 #include <sstream>
+#include <string>
 
 #include "monitoring/prometheus/exporter.h"
 
 using std::ostringstream;
+using std::shared_ptr;
+using std::string;
 using std::strncmp;
 
 namespace cert_trans {
@@ -18,6 +22,14 @@ const char kPrometheusProtoContentType[] =
     "proto=io.prometheus.client.MetricFamily;encoding=delimited";
 const size_t kPrometheusProtoContentTypeLen =
     std::strlen(kPrometheusProtoContentType);
+const char kPrometheusTextContentType[] = "text/plain; version=0.0.4";
+
+
+void ReleaseCachedText(const void* /* data */, size_t /* len */,
+                       void* text) {
+  delete static_cast<shared_ptr<const string>*>(text);
+}
+
 
 }  // namespace
 
@@ -28,9 +40,25 @@ void ExportPrometheusMetrics(evhttp_request* req) {
                       /*databuf*/ nullptr);
     return;
   }
-  ostringstream oss;
   const char* req_accept(
       evhttp_find_header(evhttp_request_get_input_headers(req), "Accept"));
+  // Prometheus accepts the text format as well as the protobuf one,
+  // but the former is cheaper to render, and is cached.
+  if (req_accept && std::strstr(req_accept, "text/plain")) {
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+                      kPrometheusTextContentType);
+    // The reply refers to the cached text, which it keeps alive until
+    // it has been sent.
+    shared_ptr<const string>* const text(
+        new shared_ptr<const string>(CachedPrometheusText()));
+    evbuffer_add_reference(evhttp_request_get_output_buffer(req),
+                           (*text)->data(), (*text)->size(),
+                           ReleaseCachedText, text);
+    evhttp_send_reply(req, HTTP_OK, /*reason*/ nullptr, /*databuf*/ nullptr);
+    return;
+  }
+
+  ostringstream oss;
   if (req_accept &&
       std::strncmp(req_accept, kPrometheusProtoContentType,
                    kPrometheusProtoContentTypeLen) == 0) {
@@ -43,8 +71,9 @@ void ExportPrometheusMetrics(evhttp_request* req) {
     ExportMetricsToHtml(&oss);
   }
 
-  evbuffer_add(evhttp_request_get_output_buffer(req), oss.str().data(),
-               oss.str().size());
+  const string body(oss.str());
+  evbuffer_add(evhttp_request_get_output_buffer(req), body.data(),
+               body.size());
   evhttp_send_reply(req, HTTP_OK, /*reason*/ nullptr, /*databuf*/ nullptr);
 }
 
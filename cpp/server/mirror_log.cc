@@ -0,0 +1,332 @@
+#include "server/mirror_log.h"
+
+#include <glog/logging.h>
+#include <google/protobuf/text_format.h>
+#include <algorithm>
+#include <set>
+#include <vector>
+
+#include "client/async_log_client.h"
+#include "log/leveldb_db.h"
+#include "log/log_signer.h"
+#include "log/logged_entry.h"
+#include "merkletree/merkle_verifier.h"
+#include "merkletree/serial_hasher.h"
+#include "monitoring/monitoring.h"
+#include "util/read_key.h"
+#include "util/thread_pool.h"
+#include "util/util.h"
+
+using ct::MirrorConfig;
+using ct::MirrorTarget;
+using ct::SignedTreeHead;
+using google::protobuf::TextFormat;
+using std::bind;
+using std::function;
+using std::lock_guard;
+using std::make_pair;
+using std::make_shared;
+using std::min;
+using std::mutex;
+using std::placeholders::_1;
+using std::set;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using util::HexString;
+using util::Status;
+using util::StatusOr;
+using util::Task;
+
+namespace cert_trans {
+namespace {
+
+
+// How many entries AdvanceTree() reads before adding them to the tree.
+const uint64_t kAdvanceTreeBatchSize = 1 << 16;
+
+static Gauge<string>* mirror_log_tree_size(
+    Gauge<string>::New("mirror_log_tree_size", "log",
+                       "Number of entries of a mirrored log in the local "
+                       "database."));
+
+static Counter<string>* mirror_log_inconsistent_sths_received(
+    Counter<string>::New("mirror_log_inconsistent_sths_received", "log",
+                         "Number of STHs received from a mirrored log whose "
+                         "root hash does not match the locally built "
+                         "tree."));
+
+
+// Adds the entries of |db| to |tree| until it has |size| leaves.
+void AdvanceTree(const ReadOnlyDatabase* db, uint64_t size,
+                 CompactMerkleTree* tree) {
+  if (tree->LeafCount() >= size) {
+    return;
+  }
+
+  unique_ptr<Database::Iterator> entries(db->ScanEntries(tree->LeafCount()));
+  LoggedEntry entry;
+  vector<string> leaf_hashes;
+  while (tree->LeafCount() < size) {
+    // Leaf hashes are handed to the tree in batches, so that it can
+    // hash the subtrees they complete as a whole.
+    const uint64_t batch_end(
+        min(size, tree->LeafCount() + kAdvanceTreeBatchSize));
+    leaf_hashes.clear();
+    for (uint64_t next = tree->LeafCount(); next < batch_end; ++next) {
+      CHECK(entries->GetNextEntry(&entry));
+      CHECK(entry.has_sequence_number());
+      CHECK_GE(entry.sequence_number(), 0);
+      CHECK_EQ(next, static_cast<uint64_t>(entry.sequence_number()));
+      string serialized_leaf;
+      CHECK(entry.SerializeForLeaf(&serialized_leaf));
+      leaf_hashes.emplace_back(tree->LeafHash(serialized_leaf));
+    }
+    CHECK_EQ(batch_end, tree->AddLeafHashes(leaf_hashes, nullptr));
+  }
+}
+
+
+// Whether |name| can go in a path on its own.
+bool IsValidName(const string& name) {
+  if (name.empty() || name == "." || name == "..") {
+    return false;
+  }
+  for (const char c : name) {
+    if (!isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_' &&
+        c != '.') {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+EVP_PKEY* ReadPublicKeyOrDie(const string& file) {
+  const StatusOr<EVP_PKEY*> pubkey(ReadPublicKey(file));
+  CHECK(pubkey.ok()) << "Failed to read public key file " << file << ": "
+                     << pubkey.status();
+  return pubkey.ValueOrDie();
+}
+
+
+LogVerifier* NewLogVerifier(const string& public_key_file) {
+  return new LogVerifier(
+      new LogSigVerifier(ReadPublicKeyOrDie(public_key_file)),
+      new MerkleVerifier(unique_ptr<Sha256Hasher>(new Sha256Hasher)));
+}
+
+
+}  // namespace
+
+
+Status ReadMirrorConfig(const string& file, MirrorConfig* config) {
+  string text;
+  if (!util::ReadTextFile(file, &text)) {
+    return Status(util::error::NOT_FOUND, "cannot read " + file);
+  }
+  if (!TextFormat::ParseFromString(text, CHECK_NOTNULL(config))) {
+    return Status(util::error::INVALID_ARGUMENT,
+                  "cannot parse the MirrorConfig in " + file);
+  }
+
+  set<string> names;
+  set<string> databases;
+  for (const MirrorTarget& target : config->target()) {
+    if (!IsValidName(target.name())) {
+      return Status(util::error::INVALID_ARGUMENT,
+                    "bad mirror target name: \"" + target.name() + "\"");
+    }
+    if (target.log_uri().empty() || target.public_key_file().empty() ||
+        target.leveldb_db().empty()) {
+      return Status(util::error::INVALID_ARGUMENT,
+                    "mirror target " + target.name() +
+                        " needs a log_uri, public_key_file and leveldb_db");
+    }
+    if (target.priority() <= 0) {
+      return Status(util::error::INVALID_ARGUMENT,
+                    "mirror target " + target.name() +
+                        " must have a positive priority");
+    }
+    if (!names.insert(target.name()).second) {
+      return Status(util::error::INVALID_ARGUMENT,
+                    "mirror target " + target.name() + " given twice");
+    }
+    if (!databases.insert(target.leveldb_db()).second) {
+      return Status(util::error::INVALID_ARGUMENT,
+                    "database " + target.leveldb_db() + " used twice");
+    }
+  }
+
+  return util::OkStatus();
+}
+
+
+MirrorSTHQueue::MirrorSTHQueue(const ReadOnlyDatabase* db,
+                               LogLookup* log_lookup)
+    : db_(CHECK_NOTNULL(db)), log_lookup_(CHECK_NOTNULL(log_lookup)) {
+}
+
+
+void MirrorSTHQueue::Add(const SignedTreeHead& sth) {
+  lock_guard<mutex> lock(lock_);
+  const auto it(queue_.find(sth.tree_size()));
+  if (it != queue_.end() && sth.timestamp() < it->second.timestamp()) {
+    LOG(WARNING) << "Received older STH:\nHad:\n" << it->second.DebugString()
+                 << "\nGot:\n" << sth.DebugString();
+    return;
+  }
+  queue_.insert(make_pair(sth.tree_size(), sth));
+}
+
+
+int MirrorSTHQueue::CheckReady(
+    const function<void(const SignedTreeHead&)>& accept) {
+  lock_guard<mutex> check_lock(check_lock_);
+
+  const int64_t local_size(db_->TreeSize());
+  const int64_t serving_size(log_lookup_->GetSTH().tree_size());
+  roots_.erase(roots_.begin(), roots_.upper_bound(serving_size));
+  if (!tree_ || (serving_size > 0 &&
+                 tree_->LeafCount() < static_cast<uint64_t>(serving_size))) {
+    // The serving tree moved past us (with an STH from elsewhere in
+    // the cluster), no point in hashing those entries ourselves.
+    tree_ = log_lookup_->GetCompactMerkleTree(new Sha256Hasher);
+  }
+
+  vector<SignedTreeHead> ready;
+  {
+    lock_guard<mutex> lock(lock_);
+    while (!queue_.empty() &&
+           queue_.begin()->second.tree_size() <= local_size) {
+      ready.emplace_back(queue_.begin()->second);
+      queue_.erase(queue_.begin());
+    }
+  }
+
+  int inconsistent(0);
+  for (const SignedTreeHead& next_sth : ready) {
+    CHECK_GE(next_sth.tree_size(), 0);
+    const uint64_t next_sth_tree_size(
+        static_cast<uint64_t>(next_sth.tree_size()));
+
+    // If the candidate STH is historical, use the RootAtSnapshot() from
+    // our serving tree, otherwise use the root from our compact tree,
+    // catching it up to the candidate STH size if necessary.
+    string local_root_at_snapshot;
+    if (next_sth.tree_size() <= serving_size) {
+      local_root_at_snapshot =
+          log_lookup_->RootAtSnapshot(next_sth.tree_size());
+    } else {
+      const auto root(roots_.find(next_sth.tree_size()));
+      if (root != roots_.end()) {
+        local_root_at_snapshot = root->second;
+      } else {
+        if (tree_->LeafCount() > next_sth_tree_size) {
+          // We went past it already, start over from our serving
+          // tree. This should be rare, as the STHs come in order.
+          tree_ = log_lookup_->GetCompactMerkleTree(new Sha256Hasher);
+        }
+        AdvanceTree(db_, next_sth_tree_size, tree_.get());
+        local_root_at_snapshot = tree_->CurrentRoot();
+        roots_.emplace(next_sth.tree_size(), local_root_at_snapshot);
+      }
+    }
+
+    if (next_sth.sha256_root_hash() != local_root_at_snapshot) {
+      LOG(WARNING) << "Received STH:\n" << next_sth.DebugString()
+                   << " whose root:\n" << HexString(next_sth.sha256_root_hash())
+                   << "\ndoes not match that of local tree at "
+                   << "corresponding snapshot:\n"
+                   << HexString(local_root_at_snapshot);
+      // TODO(alcutter): We should probably write these bad STHs out to a
+      // separate DB table for later analysis.
+      ++inconsistent;
+      continue;
+    }
+    LOG(INFO) << "Can serve new STH of size " << next_sth.tree_size()
+              << " locally";
+    accept(next_sth);
+  }
+
+  return inconsistent;
+}
+
+
+MirrorLog::MirrorLog(const MirrorTarget& target, libevent::Base* base,
+                     ThreadPool* pool, UrlFetcher* url_fetcher,
+                     FetchBudget* budget, libevent::HttpServer* server,
+                     const std::chrono::duration<double>& check_period)
+    : name_(target.name()),
+      check_period_(check_period),
+      db_(new LevelDB(target.leveldb_db())),
+      log_verifier_(new LogSigVerifier(
+                        ReadPublicKeyOrDie(target.public_key_file())),
+                    new MerkleVerifier(
+                        unique_ptr<Sha256Hasher>(new Sha256Hasher))),
+      log_lookup_(db_.get()),
+      budget_share_(budget ? budget->NewShare(name_, target.priority())
+                           : nullptr),
+      fetcher_(ContinuousFetcher::New(base, pool, db_.get(), &log_verifier_,
+                                      false /* fetch_scts */,
+                                      budget_share_.get())),
+      sths_(db_.get(), &log_lookup_),
+      task_(pool),
+      handler_(&log_lookup_, db_.get(), nullptr /* controller */,
+               nullptr /* checker */, nullptr /* Frontend */, pool, base,
+               nullptr /* staleness_tracker */) {
+  const string name(name_);
+  peer_ = make_shared<RemotePeer>(
+      unique_ptr<AsyncLogClient>(
+          new AsyncLogClient(pool, url_fetcher, target.log_uri())),
+      unique_ptr<LogVerifier>(NewLogVerifier(target.public_key_file())),
+      bind(&MirrorSTHQueue::Add, &sths_, _1),
+      task_.task()->AddChild([name](Task*) {
+        LOG(INFO) << "RemotePeer for " << name << " exited.";
+      }));
+  fetcher_->AddPeer(name_, peer_);
+
+  handler_.Add(server, "/" + name_);
+  LOG(INFO) << "Mirroring " << target.log_uri() << " as " << name_;
+
+  task_.task()->executor()->Delay(check_period_,
+                                  task_.task()->AddChild(
+                                      bind(&MirrorLog::CheckSTHs, this)));
+}
+
+
+MirrorLog::~MirrorLog() {
+  fetcher_->RemovePeer(name_);
+  peer_.reset();
+  task_.task()->Return();
+  task_.Wait();
+}
+
+
+void MirrorLog::CheckSTHs() {
+  if (!task_.task()->IsActive()) {
+    return;
+  }
+
+  mirror_log_tree_size->Set(name_, db_->TreeSize());
+  mirror_log_inconsistent_sths_received->IncrementBy(
+      name_, sths_.CheckReady(bind(&MirrorLog::AcceptSTH, this, _1)));
+
+  task_.task()->executor()->Delay(check_period_,
+                                  task_.task()->AddChild(
+                                      bind(&MirrorLog::CheckSTHs, this)));
+}
+
+
+void MirrorLog::AcceptSTH(const SignedTreeHead& sth) {
+  // The LogLookup picks it up from the database. It might have it
+  // already, if it was received again after a restart.
+  const Database::WriteResult result(db_->WriteTreeHead(sth));
+  LOG_IF(WARNING, result != Database::OK &&
+                      result != Database::DUPLICATE_TREE_HEAD_TIMESTAMP)
+      << "Could not write the STH of size " << sth.tree_size() << " of "
+      << name_ << ": " << result;
+}
+
+
+}  // namespace cert_trans
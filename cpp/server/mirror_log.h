@@ -0,0 +1,126 @@
+#ifndef CERT_TRANS_SERVER_MIRROR_LOG_H_
+#define CERT_TRANS_SERVER_MIRROR_LOG_H_
+
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "fetcher/continuous_fetcher.h"
+#include "fetcher/fetch_budget.h"
+#include "fetcher/remote_peer.h"
+#include "log/database.h"
+#include "log/log_lookup.h"
+#include "log/log_verifier.h"
+#include "merkletree/compact_merkle_tree.h"
+#include "proto/ct.pb.h"
+#include "server/certificate_handler.h"
+#include "util/libevent_wrapper.h"
+#include "util/status.h"
+#include "util/sync_task.h"
+
+namespace cert_trans {
+
+class ThreadPool;
+class UrlFetcher;
+
+
+// Reads the text format MirrorConfig in |file| into |config|, and
+// checks that its targets are complete, with names that can go in a
+// path and that are not used twice, nor their databases.
+util::Status ReadMirrorConfig(const std::string& file,
+                              ct::MirrorConfig* config);
+
+
+// The tree heads received from a mirrored log, waiting for the local
+// database to have the entries they cover, so that their root hashes
+// can be checked against those entries before they are served.
+//
+// This class is thread-safe.
+class MirrorSTHQueue {
+ public:
+  // Does not take ownership of |db| or |log_lookup|, which must
+  // outlive this instance.
+  MirrorSTHQueue(const ReadOnlyDatabase* db, LogLookup* log_lookup);
+  MirrorSTHQueue(const MirrorSTHQueue&) = delete;
+  MirrorSTHQueue& operator=(const MirrorSTHQueue&) = delete;
+
+  // Queues |sth|, unless one of the same size is queued already.
+  void Add(const ct::SignedTreeHead& sth);
+
+  // Takes the queued tree heads that the database has all the entries
+  // for, and passes those whose root hash matches them to |accept|, in
+  // order of size. Returns how many did not match.
+  int CheckReady(const std::function<void(const ct::SignedTreeHead&)>& accept);
+
+ private:
+  const ReadOnlyDatabase* const db_;
+  LogLookup* const log_lookup_;
+
+  std::mutex lock_;
+  std::map<int64_t, ct::SignedTreeHead> queue_;
+
+  // Only one CheckReady() runs at a time, with these.
+  std::mutex check_lock_;
+  // The tree starts from the state of the serving tree, and only moves
+  // forward, to the sizes of the tree heads being checked, so that
+  // each entry is only hashed once. The roots at those sizes are kept
+  // until the serving tree catches up with them, in case a tree head
+  // of the same size shows up again.
+  std::unique_ptr<CompactMerkleTree> tree_;
+  std::map<int64_t, std::string> roots_;
+};
+
+
+// A log that ct-mirror mirrors besides its --target_log_uri, with a
+// database and tree of its own, and served under "/<name>" by the HTTP
+// server of the node. Unlike the main one, it is not coordinated with
+// the other nodes of the cluster: each node fetches it and serves the
+// tree heads it checked on its own.
+//
+// The logs mirrored by a process share its thread pool, its
+// UrlFetcher (and so its connections) and its FetchBudget.
+class MirrorLog {
+ public:
+  // Starts fetching |target| and serving it on |server|. Does not take
+  // ownership of the pointers, which must outlive this instance.
+  // |budget| can be null. The tree heads received are checked every
+  // |check_period|.
+  MirrorLog(const ct::MirrorTarget& target, libevent::Base* base,
+            ThreadPool* pool, UrlFetcher* url_fetcher, FetchBudget* budget,
+            libevent::HttpServer* server,
+            const std::chrono::duration<double>& check_period);
+  ~MirrorLog();
+  MirrorLog(const MirrorLog&) = delete;
+  MirrorLog& operator=(const MirrorLog&) = delete;
+
+  const std::string& name() const {
+    return name_;
+  }
+
+ private:
+  void CheckSTHs();
+  void AcceptSTH(const ct::SignedTreeHead& sth);
+
+  const std::string name_;
+  const std::chrono::duration<double> check_period_;
+  const std::unique_ptr<Database> db_;
+  // For the entries fetched.
+  const LogVerifier log_verifier_;
+  LogLookup log_lookup_;
+  const std::unique_ptr<FetchBudget::Share> budget_share_;
+  const std::unique_ptr<ContinuousFetcher> fetcher_;
+  MirrorSTHQueue sths_;
+  // The parent of the periodic checks and of the task of |peer_|.
+  util::SyncTask task_;
+  std::shared_ptr<RemotePeer> peer_;
+  CertificateHttpHandler handler_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_MIRROR_LOG_H_
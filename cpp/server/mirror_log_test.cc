@@ -0,0 +1,210 @@
+#include "server/mirror_log.h"
+
+#include <gtest/gtest.h>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "log/leveldb_db.h"
+#include "log/log_lookup.h"
+#include "log/logged_entry.h"
+#include "log/test_db.h"
+#include "log/test_signer.h"
+#include "merkletree/compact_merkle_tree.h"
+#include "merkletree/serial_hasher.h"
+#include "proto/cert_serializer.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using ct::MirrorConfig;
+using ct::SignedTreeHead;
+using std::ofstream;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+
+class ReadMirrorConfigTest : public ::testing::Test {
+ protected:
+  util::Status Read(const string& text, MirrorConfig* config) {
+    const string path(tmp_.TmpStorageDir() + "/mirror_config");
+    ofstream(path) << text;
+    return ReadMirrorConfig(path, config);
+  }
+
+  TmpStorage tmp_;
+};
+
+
+TEST_F(ReadMirrorConfigTest, ReadsTargets) {
+  MirrorConfig config;
+  EXPECT_TRUE(Read("target {\n"
+                   "  name: \"pilot\"\n"
+                   "  log_uri: \"https://ct.example.com/pilot\"\n"
+                   "  public_key_file: \"/keys/pilot.pem\"\n"
+                   "  leveldb_db: \"/data/pilot\"\n"
+                   "  priority: 3\n"
+                   "}\n"
+                   "target {\n"
+                   "  name: \"rocketeer\"\n"
+                   "  log_uri: \"https://ct.example.com/rocketeer\"\n"
+                   "  public_key_file: \"/keys/rocketeer.pem\"\n"
+                   "  leveldb_db: \"/data/rocketeer\"\n"
+                   "}\n",
+                   &config)
+                  .ok());
+  ASSERT_EQ(2, config.target_size());
+  EXPECT_EQ("pilot", config.target(0).name());
+  EXPECT_EQ(3, config.target(0).priority());
+  EXPECT_EQ("https://ct.example.com/rocketeer", config.target(1).log_uri());
+  EXPECT_EQ(1, config.target(1).priority());
+}
+
+
+TEST_F(ReadMirrorConfigTest, RejectsBadTargets) {
+  const string rest(
+      "  log_uri: \"https://ct.example.com/\"\n"
+      "  public_key_file: \"/keys/key.pem\"\n");
+  MirrorConfig config;
+  EXPECT_FALSE(Read("target {", &config).ok());
+  EXPECT_FALSE(
+      Read("target { name: \"a/b\"\n" + rest + "leveldb_db: \"/a\" }", &config)
+          .ok());
+  EXPECT_FALSE(
+      Read("target { name: \"..\"\n" + rest + "leveldb_db: \"/a\" }", &config)
+          .ok());
+  EXPECT_FALSE(Read("target { name: \"a\"\n" + rest + "}", &config).ok());
+  EXPECT_FALSE(Read("target { name: \"a\"\n" + rest +
+                        "leveldb_db: \"/a\" priority: 0 }",
+                    &config)
+                   .ok());
+  EXPECT_FALSE(Read("target { name: \"a\"\n" + rest +
+                        "leveldb_db: \"/a\" }\n"
+                        "target { name: \"a\"\n" +
+                        rest + "leveldb_db: \"/b\" }",
+                    &config)
+                   .ok());
+  EXPECT_FALSE(Read("target { name: \"a\"\n" + rest +
+                        "leveldb_db: \"/a\" }\n"
+                        "target { name: \"b\"\n" +
+                        rest + "leveldb_db: \"/a\" }",
+                    &config)
+                   .ok());
+  EXPECT_FALSE(ReadMirrorConfig(tmp_.TmpStorageDir() + "/missing", &config)
+                   .ok());
+}
+
+
+class MirrorSTHQueueTest : public ::testing::Test {
+ protected:
+  MirrorSTHQueueTest()
+      : log_lookup_(test_db_.db()),
+        tree_(unique_ptr<Sha256Hasher>(new Sha256Hasher)) {
+  }
+
+  // Adds |num| entries to the database, returning the tree head
+  // covering them all.
+  SignedTreeHead AddEntries(int num) {
+    vector<LoggedEntry> entries(num);
+    vector<const LoggedEntry*> to_write;
+    for (LoggedEntry& entry : entries) {
+      test_signer_.CreateUnique(&entry);
+      entry.set_sequence_number(tree_.LeafCount());
+      string serialized_leaf;
+      CHECK(entry.SerializeForLeaf(&serialized_leaf));
+      tree_.AddLeaf(serialized_leaf);
+      to_write.push_back(&entry);
+    }
+    CHECK_EQ(Database::OK, test_db_.db()->CreateSequencedEntries(to_write));
+
+    SignedTreeHead sth;
+    sth.set_tree_size(tree_.LeafCount());
+    sth.set_timestamp(tree_.LeafCount());
+    sth.set_sha256_root_hash(tree_.CurrentRoot());
+    return sth;
+  }
+
+  // Returns the tree heads that CheckReady() accepts, with the number
+  // it rejected in |inconsistent|.
+  vector<SignedTreeHead> CheckReady(MirrorSTHQueue* queue,
+                                    int* inconsistent) {
+    vector<SignedTreeHead> accepted;
+    *inconsistent = queue->CheckReady([&accepted](const SignedTreeHead& sth) {
+      accepted.push_back(sth);
+    });
+    return accepted;
+  }
+
+  TestDB<LevelDB> test_db_;
+  TestSigner test_signer_;
+  LogLookup log_lookup_;
+  CompactMerkleTree tree_;
+};
+
+
+TEST_F(MirrorSTHQueueTest, ChecksTreeHeadsOnceCovered) {
+  MirrorSTHQueue queue(test_db_.db(), &log_lookup_);
+
+  const SignedTreeHead sth2(AddEntries(2));
+  SignedTreeHead bad_sth2(sth2);
+  bad_sth2.set_timestamp(sth2.timestamp() + 1);
+  bad_sth2.set_sha256_root_hash(string(32, 'x'));
+  const SignedTreeHead sth5(AddEntries(3));
+  SignedTreeHead sth9(sth5);
+  sth9.set_tree_size(9);
+
+  queue.Add(sth9);
+  queue.Add(sth5);
+  queue.Add(bad_sth2);
+
+  int inconsistent;
+  vector<SignedTreeHead> accepted(CheckReady(&queue, &inconsistent));
+  EXPECT_EQ(1, inconsistent);
+  ASSERT_EQ(1U, accepted.size());
+  EXPECT_EQ(5, accepted[0].tree_size());
+  EXPECT_EQ(sth5.sha256_root_hash(), accepted[0].sha256_root_hash());
+
+  // An older one of a size already checked is still checked, but the
+  // one beyond the database waits.
+  queue.Add(sth2);
+  accepted = CheckReady(&queue, &inconsistent);
+  EXPECT_EQ(0, inconsistent);
+  ASSERT_EQ(1U, accepted.size());
+  EXPECT_EQ(2, accepted[0].tree_size());
+
+  accepted = CheckReady(&queue, &inconsistent);
+  EXPECT_EQ(0, inconsistent);
+  EXPECT_TRUE(accepted.empty());
+}
+
+
+TEST_F(MirrorSTHQueueTest, KeepsNewestOfSameSize) {
+  MirrorSTHQueue queue(test_db_.db(), &log_lookup_);
+  SignedTreeHead sth(AddEntries(3));
+  SignedTreeHead older(sth);
+  older.set_timestamp(sth.timestamp() - 1);
+  older.set_sha256_root_hash(string(32, 'x'));
+
+  queue.Add(sth);
+  queue.Add(older);
+
+  int inconsistent;
+  const vector<SignedTreeHead> accepted(CheckReady(&queue, &inconsistent));
+  EXPECT_EQ(0, inconsistent);
+  ASSERT_EQ(1U, accepted.size());
+  EXPECT_EQ(sth.timestamp(), accepted[0].timestamp());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  ConfigureSerializerForV1CT();
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,265 @@
+#include "server/partition_router.h"
+
+#include <event2/http.h>
+#include <glog/logging.h>
+#include <map>
+#include <mutex>
+
+#include "monitoring/monitoring.h"
+#include "server/json_output.h"
+#include "util/json_wrapper.h"
+#include "util/task.h"
+#include "util/util.h"
+
+using std::bind;
+using std::lock_guard;
+using std::make_pair;
+using std::map;
+using std::move;
+using std::mutex;
+using std::pair;
+using std::placeholders::_1;
+using std::shared_ptr;
+using std::stoi;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using util::Task;
+
+namespace cert_trans {
+namespace {
+
+
+static Counter<string>* total_partition_requests(
+    Counter<string>::New("total_partition_requests", "path",
+                         "Number of API requests sent to each of the "
+                         "partitions of the tree, by path."));
+
+const char kGetProofPath[] = "/ct/v1/get-proof-by-hash";
+const char kGetProofsPath[] = "/ct/v1/get-proofs-by-hash";
+const char kGetConsistencyPath[] = "/ct/v1/get-sth-consistency";
+
+
+bool EndsWith(const string& path, const string& suffix) {
+  return path.size() >= suffix.size() &&
+         path.compare(path.size() - suffix.size(), suffix.size(), suffix) ==
+             0;
+}
+
+
+vector<pair<string, int>> ParsePartitions(const vector<string>& partitions) {
+  CHECK(!partitions.empty());
+  vector<pair<string, int>> host_ports;
+  for (const string& partition : partitions) {
+    const vector<string> host_port(util::split(partition, ':'));
+    CHECK_EQ(2U, host_port.size()) << "Invalid host:port string: '"
+                                   << partition << "'";
+    const int port(stoi(host_port[1]));
+    CHECK_LT(0, port) << "Port is <= 0";
+    CHECK_GE(65535, port) << "Port is > 65535";
+    host_ports.emplace_back(host_port[0], port);
+  }
+  return host_ports;
+}
+
+
+}  // namespace
+
+
+bool MergePartitionProofs(const vector<string>& replies, string* merged) {
+  CHECK_NOTNULL(merged);
+  vector<unique_ptr<JsonObject>> objects;
+  vector<unique_ptr<JsonArray>> nodes;
+  vector<unique_ptr<JsonArray>> proofs;
+  for (const string& reply : replies) {
+    objects.emplace_back(new JsonObject(reply));
+    if (!objects.back()->Ok()) {
+      return false;
+    }
+    nodes.emplace_back(new JsonArray(*objects.back(), "nodes"));
+    proofs.emplace_back(new JsonArray(*objects.back(), "proofs"));
+    if (!nodes.back()->Ok() || !proofs.back()->Ok() ||
+        proofs.back()->Length() != proofs.front()->Length()) {
+      return false;
+    }
+  }
+
+  JsonArray json_nodes;
+  map<string, int64_t> node_indices;
+  JsonArray json_proofs;
+  for (int i = 0; !proofs.empty() && i < proofs.front()->Length(); ++i) {
+    JsonArray json_audit;
+    int64_t leaf_index(-1);
+    for (size_t partition = 0; partition < proofs.size(); ++partition) {
+      const JsonObject proof(*proofs[partition], i);
+      const JsonInt index(proof, "leaf_index");
+      const JsonArray audit(proof, "audit_path");
+      if (!index.Ok() || !audit.Ok()) {
+        return false;
+      }
+      if (index.Value() < 0) {
+        continue;
+      }
+      leaf_index = index.Value();
+      for (int j = 0; j < audit.Length(); ++j) {
+        const JsonInt node_index(audit, j);
+        if (!node_index.Ok() || node_index.Value() < 0 ||
+            node_index.Value() >= nodes[partition]->Length()) {
+          return false;
+        }
+        const JsonString node(*nodes[partition], node_index.Value());
+        if (!node.Ok()) {
+          return false;
+        }
+        // Still in base64, which is as good for telling them apart.
+        const auto inserted(
+            node_indices.insert(make_pair(node.Value(), node_indices.size())));
+        if (inserted.second)
+          json_nodes.Add(inserted.first->first);
+        json_audit.Add(json_object_new_int64(inserted.first->second));
+      }
+      break;
+    }
+
+    JsonObject json_proof;
+    json_proof.Add("leaf_index", leaf_index);
+    json_proof.Add("audit_path", json_audit);
+    json_proofs.Add(&json_proof);
+  }
+
+  JsonObject json_reply;
+  json_reply.Add("nodes", json_nodes);
+  json_reply.Add("proofs", json_proofs);
+  *merged = json_reply.ToJson();
+  return true;
+}
+
+
+// The requests sent to the partitions for one request, and what they
+// replied so far.
+struct PartitionRouter::FanOut {
+  FanOut(evhttp_request* req, const UrlFetcher::Request& fetcher_req,
+         size_t partition_count)
+      : request(req),
+        merge(EndsWith(fetcher_req.url.Path(), kGetProofsPath)),
+        path(fetcher_req.url.Path()),
+        pending(partition_count),
+        responses(partition_count),
+        ok(partition_count, false) {
+  }
+
+  evhttp_request* const request;
+  // Whether the replies are merged, rather than one picked.
+  const bool merge;
+  const string path;
+
+  mutex lock;
+  size_t pending;
+  vector<UrlFetcher::Response> responses;
+  // Whether each request got a response at all.
+  vector<bool> ok;
+};
+
+
+PartitionRouter::PartitionRouter(libevent::Base* base,
+                                 const GetFreshNodesFunction& get_fresh_nodes,
+                                 UrlFetcher* fetcher, util::Executor* executor,
+                                 const vector<string>& partitions)
+    : Proxy(base, get_fresh_nodes, fetcher, executor),
+      partitions_(ParsePartitions(partitions)) {
+}
+
+
+bool PartitionRouter::AlwaysProxies(const string& path) const {
+  return path == kGetProofPath || path == kGetProofsPath ||
+         path == kGetConsistencyPath;
+}
+
+
+void PartitionRouter::ProxyRequest(evhttp_request* req) const {
+  CHECK_NOTNULL(req);
+  // The paths of the handlers can have a prefix.
+  const string path(evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req)));
+  if (!EndsWith(path, kGetProofPath) && !EndsWith(path, kGetProofsPath) &&
+      !EndsWith(path, kGetConsistencyPath)) {
+    return Proxy::ProxyRequest(req);
+  }
+
+  UrlFetcher::Request fetcher_req;
+  if (!CopyRequest(req, &fetcher_req)) {
+    return;
+  }
+  const shared_ptr<FanOut> fan_out(
+      new FanOut(req, fetcher_req, partitions_.size()));
+  if (fan_out->merge) {
+    // The replies have to be parsed.
+    fetcher_req.headers.erase("Accept-Encoding");
+  }
+
+  VLOG(1) << "Sending request to " << partitions_.size() << " partitions: "
+          << fetcher_req.url.PathQuery();
+  for (size_t partition = 0; partition < partitions_.size(); ++partition) {
+    total_partition_requests->Increment(fan_out->path);
+    fetcher_req.url.SetHost(partitions_[partition].first);
+    fetcher_req.url.SetPort(partitions_[partition].second);
+    fetcher()->Fetch(fetcher_req, &fan_out->responses[partition],
+                     new Task(bind(&PartitionRouter::PartitionRequestDone,
+                                   this, fan_out, partition, _1),
+                              executor()));
+  }
+}
+
+
+void PartitionRouter::PartitionRequestDone(const shared_ptr<FanOut>& fan_out,
+                                           size_t partition,
+                                           Task* task) const {
+  unique_ptr<Task> task_deleter(CHECK_NOTNULL(task));
+  {
+    lock_guard<mutex> lock(fan_out->lock);
+    fan_out->ok[partition] = task->status().ok();
+    if (--fan_out->pending > 0) {
+      return;
+    }
+  }
+  ReplyFromPartitions(fan_out.get());
+}
+
+
+void PartitionRouter::ReplyFromPartitions(FanOut* fan_out) const {
+  // All the requests are done, nothing else touches |fan_out| now.
+  UrlFetcher::Response* failed(nullptr);
+  vector<string> replies;
+  for (size_t partition = 0; partition < partitions_.size(); ++partition) {
+    UrlFetcher::Response* const response(&fan_out->responses[partition]);
+    if (!fan_out->ok[partition]) {
+      continue;
+    }
+    if (response->status_code != HTTP_OK) {
+      if (!failed) {
+        failed = response;
+      }
+      continue;
+    }
+    if (!fan_out->merge) {
+      return ForwardResponse(fan_out->request, response);
+    }
+    replies.emplace_back(move(response->body));
+  }
+
+  if (fan_out->merge && replies.size() == partitions_.size()) {
+    string merged;
+    if (MergePartitionProofs(replies, &merged)) {
+      return SendJsonReply(base(), fan_out->request, HTTP_OK, merged);
+    }
+    LOG(WARNING) << "Could not merge the replies of the partitions to "
+                 << fan_out->path;
+  } else if (failed) {
+    // Such as the leaf not being in any partition.
+    return ForwardResponse(fan_out->request, failed);
+  }
+  SendJsonError(base(), fan_out->request, HTTP_INTERNAL,
+                "Request to the partitions failed.");
+}
+
+
+}  // namespace cert_trans
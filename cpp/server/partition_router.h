@@ -0,0 +1,61 @@
+#ifndef CERT_TRANS_SERVER_PARTITION_ROUTER_H_
+#define CERT_TRANS_SERVER_PARTITION_ROUTER_H_
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "server/proxy.h"
+
+
+namespace cert_trans {
+
+
+// Visible for testing: merges the get-proofs-by-hash replies of the
+// partitions, taking each proof from the first of them which found the
+// leaf. Returns false if one of them cannot be parsed.
+bool MergePartitionProofs(const std::vector<std::string>& replies,
+                          std::string* merged);
+
+
+// Sends the requests for proofs to the servers of the partitions of the
+// tree (see TreePartition), and proxies the others to the cluster like
+// a Proxy. |partitions| are the "host:port" of those servers, the i-th
+// one having --tree_partition_index=i, so that none of them needs to
+// keep the whole tree.
+//
+// As only the partition with a leaf, or the one with the range of
+// |first| for a consistency proof, can serve the proof, the requests
+// are sent to all of them, and the reply is the first successful one
+// (or, for get-proofs-by-hash, all of them merged, if they all are).
+class PartitionRouter : public Proxy {
+ public:
+  PartitionRouter(libevent::Base* base,
+                  const GetFreshNodesFunction& get_fresh_nodes,
+                  UrlFetcher* fetcher, util::Executor* executor,
+                  const std::vector<std::string>& partitions);
+  PartitionRouter(const PartitionRouter&) = delete;
+  PartitionRouter& operator=(const PartitionRouter&) = delete;
+
+  void ProxyRequest(evhttp_request* req) const override;
+
+  bool AlwaysProxies(const std::string& path) const override;
+
+ private:
+  struct FanOut;
+
+  // Takes ownership of |task|.
+  void PartitionRequestDone(const std::shared_ptr<FanOut>& fan_out,
+                            size_t partition, util::Task* task) const;
+  void ReplyFromPartitions(FanOut* fan_out) const;
+
+  // By partition index, as host and port.
+  const std::vector<std::pair<std::string, int>> partitions_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_PARTITION_ROUTER_H_
@@ -0,0 +1,83 @@
+#include "server/partition_router.h"
+
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+#include "util/json_wrapper.h"
+#include "util/testing.h"
+
+using cert_trans::MergePartitionProofs;
+using std::string;
+using std::vector;
+
+class PartitionRouterTest : public ::testing::Test {};
+
+
+TEST_F(PartitionRouterTest, MergesProofsFromThePartitionsWithTheLeaves) {
+  const vector<string> replies{
+      "{\"nodes\":[\"AA==\",\"AQ==\"],\"proofs\":["
+      "{\"leaf_index\":1,\"audit_path\":[0,1]},"
+      "{\"leaf_index\":-1,\"audit_path\":[]},"
+      "{\"leaf_index\":-1,\"audit_path\":[]}]}",
+      "{\"nodes\":[\"AQ==\",\"Ag==\"],\"proofs\":["
+      "{\"leaf_index\":1,\"audit_path\":[1]},"
+      "{\"leaf_index\":6,\"audit_path\":[1,0]},"
+      "{\"leaf_index\":-1,\"audit_path\":[]}]}"};
+  string merged;
+  ASSERT_TRUE(MergePartitionProofs(replies, &merged));
+
+  const JsonObject reply(merged);
+  ASSERT_TRUE(reply.Ok());
+  const JsonArray nodes(reply, "nodes");
+  ASSERT_TRUE(nodes.Ok());
+  ASSERT_EQ(3, nodes.Length());
+  EXPECT_EQ(string("AA=="), JsonString(nodes, 0).Value());
+  EXPECT_EQ(string("AQ=="), JsonString(nodes, 1).Value());
+  EXPECT_EQ(string("Ag=="), JsonString(nodes, 2).Value());
+
+  const JsonArray proofs(reply, "proofs");
+  ASSERT_TRUE(proofs.Ok());
+  ASSERT_EQ(3, proofs.Length());
+  // The first partition's proof, for the leaf both of them have.
+  const JsonObject first(proofs, 0);
+  EXPECT_EQ(1, JsonInt(first, "leaf_index").Value());
+  const JsonArray first_path(first, "audit_path");
+  ASSERT_EQ(2, first_path.Length());
+  EXPECT_EQ(0, JsonInt(first_path, 0).Value());
+  EXPECT_EQ(1, JsonInt(first_path, 1).Value());
+  // The node indices of the second partition point at the merged nodes.
+  const JsonObject second(proofs, 1);
+  EXPECT_EQ(6, JsonInt(second, "leaf_index").Value());
+  const JsonArray second_path(second, "audit_path");
+  ASSERT_EQ(2, second_path.Length());
+  EXPECT_EQ(2, JsonInt(second_path, 0).Value());
+  EXPECT_EQ(1, JsonInt(second_path, 1).Value());
+  // None of them found the last leaf.
+  const JsonObject third(proofs, 2);
+  EXPECT_EQ(-1, JsonInt(third, "leaf_index").Value());
+  EXPECT_EQ(0, JsonArray(third, "audit_path").Length());
+}
+
+
+TEST_F(PartitionRouterTest, DoesNotMergeBadReplies) {
+  string merged;
+  EXPECT_FALSE(MergePartitionProofs({"{\"nodes\":[],\"proofs\":[]}", "foo"},
+                                    &merged));
+  EXPECT_FALSE(MergePartitionProofs({"{\"nodes\":[]}"}, &merged));
+  // Not the same number of proofs.
+  EXPECT_FALSE(MergePartitionProofs(
+      {"{\"nodes\":[],\"proofs\":[]}",
+       "{\"nodes\":[],\"proofs\":[{\"leaf_index\":-1,\"audit_path\":[]}]}"},
+      &merged));
+  // A node index out of range.
+  EXPECT_FALSE(MergePartitionProofs(
+      {"{\"nodes\":[],\"proofs\":[{\"leaf_index\":0,\"audit_path\":[0]}]}"},
+      &merged));
+}
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
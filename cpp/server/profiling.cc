@@ -0,0 +1,259 @@
+#include "server/profiling.h"
+
+#include <dirent.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <openssl/crypto.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <sstream>
+#include <string>
+
+#include "config.h"
+#include "util/libevent_wrapper.h"
+#include "util/task.h"
+#include "util/util.h"
+
+#if defined(HAVE_LIBPROFILER) && defined(HAVE_GPERFTOOLS_PROFILER_H)
+#include <gperftools/profiler.h>
+#define HAVE_CPU_PROFILER 1
+#endif
+#if defined(HAVE_LIBTCMALLOC) && defined(HAVE_GPERFTOOLS_MALLOC_EXTENSION_H)
+#include <gperftools/malloc_extension.h>
+#define HAVE_HEAP_PROFILER 1
+#endif
+
+using cert_trans::libevent::Base;
+using cert_trans::libevent::HttpServer;
+using std::atomic;
+using std::bind;
+using std::chrono::seconds;
+using std::function;
+using std::ostringstream;
+using std::placeholders::_1;
+using std::string;
+using util::Executor;
+using util::Task;
+
+DEFINE_string(debug_handlers_token_file, "",
+              "File containing the token which requests to the profiling "
+              "handlers under /debug/pprof/ have to present; they are not "
+              "served if this is not set");
+DEFINE_int32(max_cpu_profile_seconds, 300,
+             "maximum duration of the CPU profiles taken through "
+             "/debug/pprof/profile");
+
+namespace cert_trans {
+namespace {
+
+
+const int kHttpUnauthorized = 401;
+const int kHttpNotImplemented = 501;
+
+
+void SendReply(evhttp_request* req, int code, const char* content_type,
+               const string& body) {
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+                    content_type);
+  evbuffer_add(evhttp_request_get_output_buffer(req), body.data(),
+               body.size());
+  evhttp_send_reply(req, code, /*reason*/ nullptr, /*databuf*/ nullptr);
+}
+
+
+// Returns a handler calling |handler| for GET requests presenting
+// |token|.
+HttpServer::HandlerCallback Authenticated(
+    const string& token, const function<void(evhttp_request*)>& handler) {
+  const string expected("Bearer " + token);
+  return [expected, handler](evhttp_request* req) {
+    if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+      evhttp_send_reply(req, HTTP_BADMETHOD, /*reason*/ nullptr,
+                        /*databuf*/ nullptr);
+      return;
+    }
+    const char* const authorization(evhttp_find_header(
+        evhttp_request_get_input_headers(req), "Authorization"));
+    // Compared in constant time, so as not to leak the token.
+    if (!authorization || strlen(authorization) != expected.size() ||
+        CRYPTO_memcmp(authorization, expected.data(), expected.size()) !=
+            0) {
+      SendReply(req, kHttpUnauthorized, "text/plain",
+                "Missing or wrong Authorization header.\n");
+      return;
+    }
+    handler(req);
+  };
+}
+
+
+#ifdef HAVE_CPU_PROFILER
+// Only one CPU profile can be taken at once.
+atomic<bool> cpu_profiling(false);
+
+
+void CpuProfileDone(evhttp_request* req, const string& path, Task* task) {
+  ProfilerStop();
+  delete task;
+
+  string profile;
+  const bool read(util::ReadBinaryFile(path, &profile));
+  PCHECK(unlink(path.c_str()) == 0) << "could not remove " << path;
+  cpu_profiling.store(false);
+
+  libevent::RunOnRequestLoop(req, [req, read, profile]() {
+    if (read) {
+      SendReply(req, HTTP_OK, "application/octet-stream", profile);
+    } else {
+      SendReply(req, HTTP_INTERNAL, "text/plain",
+                "Could not read the profile.\n");
+    }
+  });
+}
+#endif  // HAVE_CPU_PROFILER
+
+
+void CpuProfile(Base* base, Executor* executor, evhttp_request* req) {
+#ifdef HAVE_CPU_PROFILER
+  int64_t duration(
+      libevent::GetIntParam(libevent::ParseQuery(req), "seconds"));
+  if (duration <= 0) {
+    duration = 30;
+  }
+  duration = std::min<int64_t>(duration, FLAGS_max_cpu_profile_seconds);
+
+  if (cpu_profiling.exchange(true)) {
+    SendReply(req, HTTP_SERVUNAVAIL, "text/plain",
+              "A CPU profile is already being taken.\n");
+    return;
+  }
+
+  char path[] = "/tmp/ct-cpu-profile-XXXXXX";
+  const int fd(mkstemp(path));
+  if (fd < 0 || close(fd) != 0 || !ProfilerStart(path)) {
+    PLOG(ERROR) << "could not start a CPU profile in " << path;
+    if (fd >= 0) {
+      unlink(path);
+    }
+    cpu_profiling.store(false);
+    SendReply(req, HTTP_INTERNAL, "text/plain",
+              "Could not start the CPU profile.\n");
+    return;
+  }
+  LOG(INFO) << "taking a CPU profile for " << duration << " seconds";
+  base->Delay(seconds(duration),
+              new Task(bind(CpuProfileDone, req, string(path), _1),
+                       executor));
+#else
+  SendReply(req, kHttpNotImplemented, "text/plain",
+            "Built without the gperftools CPU profiler.\n");
+#endif
+}
+
+
+void HeapProfile(bool growth, evhttp_request* req) {
+#ifdef HAVE_HEAP_PROFILER
+  string profile;
+  if (growth) {
+    MallocExtension::instance()->GetHeapGrowthStacks(&profile);
+  } else {
+    MallocExtension::instance()->GetHeapSample(&profile);
+  }
+  SendReply(req, HTTP_OK, "text/plain", profile);
+#else
+  SendReply(req, kHttpNotImplemented, "text/plain",
+            "Built without tcmalloc.\n");
+#endif
+}
+
+
+// Lists the threads, from /proc, with their name, state and CPU time.
+// (Their stacks cannot be taken without stopping them.)
+void Threads(evhttp_request* req) {
+  DIR* const dir(opendir("/proc/self/task"));
+  if (!dir) {
+    SendReply(req, kHttpNotImplemented, "text/plain",
+              "No /proc/self/task on this system.\n");
+    return;
+  }
+
+  const double ms_per_tick(1000.0 / sysconf(_SC_CLK_TCK));
+  ostringstream out;
+  out << "tid\tstate\tuser_ms\tsystem_ms\tname\n";
+  while (const dirent* const entry = readdir(dir)) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    string stat;
+    if (!util::ReadTextFile(string("/proc/self/task/") + entry->d_name +
+                                "/stat",
+                            &stat)) {
+      // The thread exited in the meantime.
+      continue;
+    }
+    // The name is in parentheses, and can contain anything, so the
+    // fields are parsed from after the last one.
+    const size_t name_start(stat.find('('));
+    const size_t name_end(stat.rfind(')'));
+    if (name_start == string::npos || name_end == string::npos ||
+        name_end < name_start) {
+      continue;
+    }
+    std::istringstream fields(stat.substr(name_end + 1));
+    string state, skip;
+    uint64_t utime(0), stime(0);
+    fields >> state;
+    // Fields 4 to 13, up to utime and stime (14 and 15).
+    for (int i = 4; i <= 13; ++i) {
+      fields >> skip;
+    }
+    fields >> utime >> stime;
+    out << entry->d_name << "\t" << state << "\t"
+        << static_cast<int64_t>(utime * ms_per_tick) << "\t"
+        << static_cast<int64_t>(stime * ms_per_tick) << "\t"
+        << stat.substr(name_start + 1, name_end - name_start - 1) << "\n";
+  }
+  closedir(dir);
+  SendReply(req, HTTP_OK, "text/plain", out.str());
+}
+
+
+}  // namespace
+
+
+void AddProfilingHandlers(Base* base, Executor* executor,
+                          HttpServer* server) {
+  CHECK_NOTNULL(base);
+  CHECK_NOTNULL(executor);
+  CHECK_NOTNULL(server);
+  if (FLAGS_debug_handlers_token_file.empty()) {
+    return;
+  }
+
+  string token;
+  CHECK(util::ReadTextFile(FLAGS_debug_handlers_token_file, &token))
+      << "could not read " << FLAGS_debug_handlers_token_file;
+  token.erase(token.find_last_not_of(" \t\r\n") + 1);
+  CHECK(!token.empty()) << FLAGS_debug_handlers_token_file << " is empty";
+
+  CHECK(server->AddHandler(
+      "/debug/pprof/profile",
+      Authenticated(token, bind(CpuProfile, base, executor, _1))));
+  CHECK(server->AddHandler("/debug/pprof/heap",
+                           Authenticated(token, bind(HeapProfile, false, _1))));
+  CHECK(server->AddHandler("/debug/pprof/growth",
+                           Authenticated(token, bind(HeapProfile, true, _1))));
+  CHECK(server->AddHandler("/debug/pprof/threads",
+                           Authenticated(token, Threads)));
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,39 @@
+#ifndef CERT_TRANS_SERVER_PROFILING_H_
+#define CERT_TRANS_SERVER_PROFILING_H_
+
+namespace util {
+class Executor;
+}  // namespace util
+
+namespace cert_trans {
+namespace libevent {
+class Base;
+class HttpServer;
+}  // namespace libevent
+
+
+// Adds handlers for profiling a running server, in the formats of the
+// gperftools pprof tool, to |server|:
+//
+//   /debug/pprof/profile?seconds=N  CPU profile over the next N seconds
+//   /debug/pprof/heap               sample of the live heap
+//   /debug/pprof/growth             where the heap grew from
+//   /debug/pprof/threads            the threads, and their CPU time
+//
+// The profiles are symbolized with the binary of the server, as in
+// "pprof ct-server profile". They are only available if the server
+// was built with the gperftools CPU profiler and tcmalloc (and heap
+// samples need TCMALLOC_SAMPLE_PARAMETER to be set).
+//
+// Requests have to present the token in --debug_handlers_token_file,
+// in an "Authorization: Bearer <token>" header. The handlers are not
+// added if that flag is not set.
+//
+// CPU profiles are timed on |base|, and finished on |executor|.
+void AddProfilingHandlers(libevent::Base* base, util::Executor* executor,
+                          libevent::HttpServer* server);
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_PROFILING_H_
@@ -6,6 +6,7 @@
 #include <event2/keyvalq_struct.h>
 #include <glog/logging.h>
 #include <algorithm>
+#include <cstdlib>
 #include <string>
 #include <unordered_set>
 #include <vector>
@@ -19,11 +20,14 @@
 using ct::ClusterNodeState;
 using std::bind;
 using std::getline;
+using std::lock_guard;
 using std::make_pair;
+using std::mutex;
 using std::pair;
 using std::placeholders::_1;
 using std::rand;
 using std::string;
+using std::to_string;
 using std::stringstream;
 using std::unique_ptr;
 using std::unordered_set;
@@ -44,39 +48,8 @@ static Counter<string, int>* total_proxied_responses(
                               "and status code."));
 
 
-void ProxyRequestDone(libevent::Base* base, evhttp_request* request,
-                      const string& path, UrlFetcher::Response* response,
-                      Task* task) {
-  CHECK_NOTNULL(request);
-  CHECK_NOTNULL(task);
-  unique_ptr<UrlFetcher::Response> response_deleter(CHECK_NOTNULL(response));
-
-  total_proxied_requests->Increment(path);
-  total_proxied_responses->Increment(path, response->status_code);
-
-  if (!task->status().ok()) {
-    return SendJsonError(base, request, HTTP_INTERNAL,
-                         "Proxied request failed.");
-  }
-
-  // TODO(alcutter): Consider retrying the proxied request some number of times
-  // in the case where the request fails.
-  FilterHeaders(&response->headers);
-  for (auto it(response->headers.begin()); it != response->headers.end();
-       ++it) {
-    CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(request),
-                               it->first.c_str(), it->second.c_str()),
-             0);
-  }
-  CHECK_GT(evbuffer_add_printf(evhttp_request_get_output_buffer(request), "%s",
-                               response->body.c_str()),
-           -1);
-
-  const int response_code(response->status_code);
-  base->Add([request, response_code]() {
-    evhttp_send_reply(request, response_code, /*reason*/ NULL,
-                      /*databuf*/ NULL);
-  });
+void ReleaseBody(const void* /*data*/, size_t /*length*/, void* body) {
+  delete static_cast<string*>(body);
 }
 
 
@@ -122,64 +95,171 @@ Proxy::Proxy(libevent::Base* base,
 }
 
 
-void Proxy::ProxyRequest(evhttp_request* req) const {
-  CHECK_NOTNULL(req);
+const ClusterNodeState& Proxy::PickTarget(
+    const vector<ClusterNodeState>& fresh_nodes, string* target_name) const {
+  CHECK(!fresh_nodes.empty());
+  lock_guard<mutex> lock(lock_);
+  const ClusterNodeState* target(nullptr);
+  int target_in_flight(0);
+  int num_ties(0);
+  for (const ClusterNodeState& node : fresh_nodes) {
+    const auto it(
+        in_flight_.find(node.hostname() + ":" + to_string(node.log_port())));
+    const int in_flight(it == in_flight_.end() ? 0 : it->second);
+    const int64_t tree_size(node.newest_sth().tree_size());
+    if (target && in_flight == target_in_flight &&
+        tree_size == target->newest_sth().tree_size()) {
+      // Pick uniformly among equals, one at a time.
+      if (rand() % ++num_ties == 0) {
+        target = &node;
+      }
+    } else if (!target || in_flight < target_in_flight ||
+               (in_flight == target_in_flight &&
+                tree_size > target->newest_sth().tree_size())) {
+      target = &node;
+      target_in_flight = in_flight;
+      num_ties = 1;
+    }
+  }
 
-  const vector<ClusterNodeState> fresh_nodes(get_fresh_nodes_());
-  if (fresh_nodes.empty()) {
-    return SendJsonError(base_, req, HTTP_SERVUNAVAIL,
-                         "No node able to serve request.");
+  *target_name = target->hostname() + ":" + to_string(target->log_port());
+  ++in_flight_[*target_name];
+  return *target;
+}
+
+
+void Proxy::ProxyRequestDone(evhttp_request* request,
+                             const string& target_name, const string& path,
+                             UrlFetcher::Response* response,
+                             Task* task) const {
+  CHECK_NOTNULL(request);
+  CHECK_NOTNULL(task);
+  unique_ptr<UrlFetcher::Response> response_deleter(CHECK_NOTNULL(response));
+  unique_ptr<Task> task_deleter(task);
+
+  {
+    lock_guard<mutex> lock(lock_);
+    const auto it(in_flight_.find(target_name));
+    CHECK(it != in_flight_.end());
+    if (--it->second == 0) {
+      in_flight_.erase(it);
+    }
+  }
+
+  total_proxied_requests->Increment(path);
+  total_proxied_responses->Increment(path, response->status_code);
+
+  if (!task->status().ok()) {
+    return SendJsonError(base_, request, HTTP_INTERNAL,
+                         "Proxied request failed.");
+  }
+
+  // TODO(alcutter): Consider retrying the proxied request some number of times
+  // in the case where the request fails.
+  ForwardResponse(request, response);
+}
+
+
+void Proxy::ForwardResponse(evhttp_request* request,
+                            UrlFetcher::Response* response) const {
+  FilterHeaders(&response->headers);
+  for (auto it(response->headers.begin()); it != response->headers.end();
+       ++it) {
+    CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(request),
+                               it->first.c_str(), it->second.c_str()),
+             0);
+  }
+  // The body is handed over as it is, rather than copied.
+  if (!response->body.empty()) {
+    string* const body(new string);
+    body->swap(response->body);
+    CHECK_EQ(evbuffer_add_reference(evhttp_request_get_output_buffer(request),
+                                    body->data(), body->size(), &ReleaseBody,
+                                    body),
+             0);
   }
-  const ClusterNodeState& target(fresh_nodes[rand() % fresh_nodes.size()]);
 
+  const int response_code(response->status_code);
+  libevent::RunOnRequestLoop(request, [request, response_code]() {
+    evhttp_send_reply(request, response_code, /*reason*/ NULL,
+                      /*databuf*/ NULL);
+  });
+}
+
+
+bool Proxy::CopyRequest(evhttp_request* req,
+                        UrlFetcher::Request* fetcher_req) const {
+  CHECK_NOTNULL(fetcher_req);
   URL url(evhttp_request_uri(req));
   url.SetProtocol("http");
-  url.SetHost(target.hostname());
-  url.SetPort(target.log_port());
-
-  UrlFetcher::Request fetcher_req(url);
+  *fetcher_req = UrlFetcher::Request(url);
 
   switch (evhttp_request_get_command(req)) {
     case EVHTTP_REQ_DELETE:
-      fetcher_req.verb = UrlFetcher::Verb::DELETE;
+      fetcher_req->verb = UrlFetcher::Verb::DELETE;
       break;
     case EVHTTP_REQ_GET:
-      fetcher_req.verb = UrlFetcher::Verb::GET;
+      fetcher_req->verb = UrlFetcher::Verb::GET;
       break;
     case EVHTTP_REQ_POST:
-      fetcher_req.verb = UrlFetcher::Verb::POST;
+      fetcher_req->verb = UrlFetcher::Verb::POST;
       break;
     case EVHTTP_REQ_PUT:
-      fetcher_req.verb = UrlFetcher::Verb::PUT;
+      fetcher_req->verb = UrlFetcher::Verb::PUT;
       break;
     default:
-      return SendJsonError(base_, req, HTTP_BADMETHOD,
-                           "Bad method requested.");
-      break;
+      SendJsonError(base_, req, HTTP_BADMETHOD, "Bad method requested.");
+      return false;
   }
 
   for (evkeyval* ptr = evhttp_request_get_input_headers(req)->tqh_first; ptr;
        ptr = ptr->next.tqe_next) {
-    fetcher_req.headers.insert(make_pair(ptr->key, ptr->value));
+    fetcher_req->headers.insert(make_pair(ptr->key, ptr->value));
+  }
+  FilterHeaders(&fetcher_req->headers);
+  if (fetcher_req->verb == UrlFetcher::Verb::PUT ||
+      fetcher_req->verb == UrlFetcher::Verb::POST) {
+    // Copied out once, without making it contiguous in the buffer
+    // first.
+    evbuffer* const input(evhttp_request_get_input_buffer(req));
+    fetcher_req->body.resize(evbuffer_get_length(input));
+    if (!fetcher_req->body.empty()) {
+      CHECK_EQ(evbuffer_remove(input, &fetcher_req->body[0],
+                               fetcher_req->body.size()),
+               static_cast<int>(fetcher_req->body.size()));
+    }
+  }
+  return true;
+}
+
+
+void Proxy::ProxyRequest(evhttp_request* req) const {
+  CHECK_NOTNULL(req);
+
+  const vector<ClusterNodeState> fresh_nodes(get_fresh_nodes_());
+  if (fresh_nodes.empty()) {
+    return SendJsonError(base_, req, HTTP_SERVUNAVAIL,
+                         "No node able to serve request.");
   }
-  FilterHeaders(&fetcher_req.headers);
-  if (fetcher_req.verb == UrlFetcher::Verb::PUT ||
-      fetcher_req.verb == UrlFetcher::Verb::POST) {
-    const size_t body_length(
-        evbuffer_get_length(evhttp_request_get_input_buffer(req)));
-    string body(reinterpret_cast<const char*>(evbuffer_pullup(
-                    evhttp_request_get_input_buffer(req), body_length)),
-                body_length);
-    CHECK_EQ(0, evbuffer_drain(evhttp_request_get_input_buffer(req),
-                               body_length));
-    fetcher_req.body.swap(body);
+
+  UrlFetcher::Request fetcher_req;
+  if (!CopyRequest(req, &fetcher_req)) {
+    return;
   }
-  VLOG(1) << "Proxying request to " << url.Host() << ":" << url.Port()
-          << url.PathQuery();
+
+  // Counted as in flight from here on, until ProxyRequestDone().
+  string target_name;
+  const ClusterNodeState& target(PickTarget(fresh_nodes, &target_name));
+  fetcher_req.url.SetHost(target.hostname());
+  fetcher_req.url.SetPort(target.log_port());
+  VLOG(1) << "Proxying request to " << target_name
+          << fetcher_req.url.PathQuery();
   UrlFetcher::Response* resp(new UrlFetcher::Response);
-  fetcher_->Fetch(fetcher_req, resp, new Task(bind(&ProxyRequestDone, base_,
-                                                   req, url.Path(), resp, _1),
-                                              executor_));
+  fetcher_->Fetch(fetcher_req, resp,
+                  new Task(bind(&Proxy::ProxyRequestDone, this, req,
+                                target_name, fetcher_req.url.Path(), resp,
+                                _1),
+                           executor_));
 }
 
 
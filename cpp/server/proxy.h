@@ -2,6 +2,9 @@
 #define CERT_TRANS_SERVER_PROXY_H_
 
 #include <functional>
+#include <map>
+#include <mutex>
+#include <string>
 #include <vector>
 
 #include "net/url_fetcher.h"
@@ -43,11 +46,58 @@ class Proxy {
 
   virtual void ProxyRequest(evhttp_request* req) const;
 
+  // Whether the requests for |path| (such as "/ct/v1/get-sth") are to
+  // be proxied even when this node is not stale.
+  virtual bool AlwaysProxies(const std::string& path) const {
+    return false;
+  }
+
+ protected:
+  libevent::Base* base() const {
+    return base_;
+  }
+  UrlFetcher* fetcher() const {
+    return fetcher_;
+  }
+  util::Executor* executor() const {
+    return executor_;
+  }
+
+  // Sets |*fetcher_req| to a copy of |req|, for sending it on to
+  // another node, which is left to set the host and port of its URL.
+  // Replies to |req| with an error and returns false if it cannot be
+  // sent on.
+  bool CopyRequest(evhttp_request* req, UrlFetcher::Request* fetcher_req) const;
+
+  // Replies to |request| with |response|, whose body is handed over.
+  void ForwardResponse(evhttp_request* request,
+                       UrlFetcher::Response* response) const;
+
  private:
+  // Picks the node to forward a request to, among |fresh_nodes|: the
+  // one with the fewest requests in flight from us, then the one with
+  // the biggest tree, then at random. It is counted as having one more
+  // request in flight, under the name returned in |*target_name|.
+  const ct::ClusterNodeState& PickTarget(
+      const std::vector<ct::ClusterNodeState>& fresh_nodes,
+      std::string* target_name) const;
+
+  // Takes ownership of |response| and |task|.
+  void ProxyRequestDone(evhttp_request* request,
+                        const std::string& target_name,
+                        const std::string& path,
+                        UrlFetcher::Response* response,
+                        util::Task* task) const;
+
   libevent::Base* const base_;
   const GetFreshNodesFunction get_fresh_nodes_;
   UrlFetcher* const fetcher_;
   util::Executor* const executor_;
+
+  mutable std::mutex lock_;
+  // Number of requests in flight to each node, by "host:port". The
+  // connections themselves are kept alive and reused by |fetcher_|.
+  mutable std::map<std::string, int> in_flight_;
 };
 
 
@@ -0,0 +1,37 @@
+#include "server/request_arena.h"
+
+using google::protobuf::Arena;
+using google::protobuf::ArenaOptions;
+
+namespace cert_trans {
+namespace {
+
+
+// Most requests fit in the first block, so that the arena takes a
+// single allocation, and the few with much more (such as add-chains)
+// take a few larger ones.
+const size_t kStartBlockSize(4096);
+const size_t kMaxBlockSize(65536);
+
+
+ArenaOptions Options() {
+  ArenaOptions options;
+  options.start_block_size = kStartBlockSize;
+  options.max_block_size = kMaxBlockSize;
+  return options;
+}
+
+
+}  // namespace
+
+
+RequestArena::RequestArena() : arena_(Options()) {
+}
+
+
+char* RequestArena::Allocate(size_t size) {
+  return Arena::CreateArray<char>(&arena_, size);
+}
+
+
+}  // namespace cert_trans
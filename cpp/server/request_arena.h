@@ -0,0 +1,55 @@
+#ifndef CERT_TRANS_SERVER_REQUEST_ARENA_H_
+#define CERT_TRANS_SERVER_REQUEST_ARENA_H_
+
+#include <google/protobuf/arena.h>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace cert_trans {
+
+
+// Memory for the protobufs and scratch buffers used while serving one
+// request, given back all at once when it is destroyed (once the reply
+// is sent), rather than allocated and freed piece by piece. Messages
+// created here keep their fields (strings, sub-messages and repeated
+// fields) here too.
+//
+// Messages from here can be copied to and from others as usual, but
+// swapping them with messages on the heap copies them, so they are
+// not for what outlives the request, such as entries handed over to
+// the consistent store.
+//
+// Like google::protobuf::Arena, this class is thread-safe.
+class RequestArena {
+ public:
+  RequestArena();
+  RequestArena(const RequestArena&) = delete;
+  RequestArena& operator=(const RequestArena&) = delete;
+
+  // A new, empty |Message|, owned by the arena.
+  template <class Message>
+  Message* Create() {
+    return google::protobuf::Arena::CreateMessage<Message>(&arena_);
+  }
+
+  // |size| bytes of scratch space, aligned to 8 bytes, such as for
+  // encoding a string which is then copied into the reply.
+  char* Allocate(size_t size);
+
+  // How much memory the arena got so far, used or not.
+  uint64_t SpaceAllocated() const {
+    return arena_.SpaceAllocated();
+  }
+
+  google::protobuf::Arena* arena() {
+    return &arena_;
+  }
+
+ private:
+  google::protobuf::Arena arena_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_REQUEST_ARENA_H_
@@ -0,0 +1,73 @@
+#include "server/request_arena.h"
+
+#include <gtest/gtest.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+#include "proto/ct.pb.h"
+#include "util/testing.h"
+
+namespace cert_trans {
+namespace {
+
+using ct::SignedCertificateTimestamp;
+using std::string;
+
+
+TEST(RequestArenaTest, CreatesMessagesInTheArena) {
+  RequestArena arena;
+  SignedCertificateTimestamp* const sct(
+      arena.Create<SignedCertificateTimestamp>());
+  EXPECT_EQ(arena.arena(), sct->GetArena());
+  EXPECT_EQ(arena.arena(), sct->mutable_signature()->GetArena());
+
+  // They copy to and from messages elsewhere as usual.
+  SignedCertificateTimestamp heap_sct;
+  heap_sct.set_timestamp(1234);
+  heap_sct.mutable_id()->set_key_id(string(32, 'k'));
+  heap_sct.mutable_signature()->set_signature(string(72, 's'));
+  *sct = heap_sct;
+  EXPECT_EQ(1234U, sct->timestamp());
+  EXPECT_EQ(string(32, 'k'), sct->id().key_id());
+  EXPECT_EQ(string(72, 's'), sct->signature().signature());
+
+  SignedCertificateTimestamp copy;
+  copy = *sct;
+  EXPECT_EQ(nullptr, copy.GetArena());
+  EXPECT_EQ(heap_sct.SerializeAsString(), copy.SerializeAsString());
+}
+
+
+TEST(RequestArenaTest, AllocatesScratchSpace) {
+  RequestArena arena;
+  char* const first(arena.Allocate(3));
+  char* const second(arena.Allocate(100));
+  memset(first, 'a', 3);
+  memset(second, 'b', 100);
+  EXPECT_EQ(0U, reinterpret_cast<uintptr_t>(first) % 8);
+  EXPECT_EQ(0U, reinterpret_cast<uintptr_t>(second) % 8);
+  EXPECT_EQ("aaa", string(first, 3));
+  EXPECT_EQ(string(100, 'b'), string(second, 100));
+}
+
+
+TEST(RequestArenaTest, GrowsAsNeeded) {
+  RequestArena arena;
+  const uint64_t initial(arena.SpaceAllocated());
+  // Much more than the first block.
+  for (int i = 0; i < 100; ++i) {
+    memset(arena.Allocate(1000), 0, 1000);
+  }
+  EXPECT_LE(initial + 100000, arena.SpaceAllocated());
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,221 @@
+#include "server/request_capture.h"
+
+#include <errno.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <string.h>
+#include <unistd.h>
+#include <type_traits>
+
+#include "monitoring/monitoring.h"
+
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::steady_clock;
+using std::chrono::system_clock;
+using std::istream;
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::unique_lock;
+
+namespace cert_trans {
+namespace {
+
+
+static Counter<string>* request_capture_requests(
+    Counter<string>::New("request_capture_requests", "result",
+                         "Number of requests seen by the request capture, "
+                         "by result (written, dropped or failed)."));
+
+// Anything bigger is taken to be a corrupt file, rather than allocated.
+const uint32_t kMaxFieldBytes = 64 << 20;
+
+
+}  // namespace
+
+
+struct RequestCapture::Header {
+  int64_t timestamp_us;
+  uint32_t uri_size;
+  uint32_t body_size;
+  AccessLog::Method method;
+  uint8_t reserved[7];
+};
+
+
+RequestCapture::RequestCapture(const string& path, size_t buffer_bytes,
+                               const duration<double>& duration)
+    : path_(path),
+      fd_(open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)),
+      buffer_bytes_(buffer_bytes),
+      has_deadline_(duration.count() > 0),
+      deadline_(steady_clock::now() +
+                duration_cast<steady_clock::duration>(duration)),
+      over_(false),
+      exiting_(false) {
+  static_assert(sizeof(Header) == 24,
+                "the layout of the request capture changed");
+  static_assert(std::is_trivially_copyable<Header>::value,
+                "request capture headers are written as they are");
+  PCHECK(fd_ >= 0) << "Cannot open " << path_;
+  CHECK_GT(buffer_bytes_, 0U);
+  writer_ = std::thread(&RequestCapture::WriterLoop, this);
+}
+
+
+RequestCapture::~RequestCapture() {
+  {
+    lock_guard<mutex> lock(lock_);
+    exiting_ = true;
+  }
+  wake_writer_.notify_one();
+  writer_.join();
+  PCHECK(close(fd_) == 0);
+}
+
+
+void RequestCapture::Capture(evhttp_request* req) {
+  const int64_t now_us(
+      duration_cast<microseconds>(system_clock::now().time_since_epoch())
+          .count());
+  const char* const uri(evhttp_request_get_uri(req));
+  evbuffer* const input(evhttp_request_get_input_buffer(req));
+  const size_t body_size(evbuffer_get_length(input));
+  // Makes the body contiguous, without draining it for the handler.
+  const char* const body(
+      body_size > 0
+          ? reinterpret_cast<const char*>(evbuffer_pullup(input, -1))
+          : nullptr);
+  Append(now_us, AccessLog::MethodOf(req), uri, strlen(uri), body,
+         body_size);
+}
+
+
+bool RequestCapture::Capture(const Request& request) {
+  return Append(request.timestamp_us, request.method, request.uri.data(),
+                request.uri.size(), request.body.data(), request.body.size());
+}
+
+
+bool RequestCapture::Append(int64_t timestamp_us, AccessLog::Method method,
+                            const char* uri, size_t uri_size,
+                            const char* body, size_t body_size) {
+  if (uri_size > kMaxFieldBytes || body_size > kMaxFieldBytes) {
+    request_capture_requests->Increment("dropped");
+    return false;
+  }
+  Header header;
+  memset(&header, 0, sizeof(header));
+  header.timestamp_us = timestamp_us;
+  header.uri_size = uri_size;
+  header.body_size = body_size;
+  header.method = method;
+  const size_t size(sizeof(header) + uri_size + body_size);
+
+  {
+    lock_guard<mutex> lock(lock_);
+    if (over_) {
+      return false;
+    }
+    if (has_deadline_ && steady_clock::now() >= deadline_) {
+      LOG(INFO) << "Done capturing requests to " << path_;
+      over_ = true;
+      return false;
+    }
+    if (pending_.size() + size > buffer_bytes_) {
+      request_capture_requests->Increment("dropped");
+      return false;
+    }
+    const bool was_empty(pending_.empty());
+    pending_.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    pending_.append(uri, uri_size);
+    pending_.append(body, body_size);
+    if (!was_empty) {
+      return true;
+    }
+  }
+  wake_writer_.notify_one();
+  return true;
+}
+
+
+void RequestCapture::WriterLoop() {
+  // What made it to the file so far, always whole requests.
+  off_t file_size(0);
+  string batch;
+  while (true) {
+    batch.clear();
+    {
+      unique_lock<mutex> lock(lock_);
+      wake_writer_.wait(lock,
+                        [this]() { return exiting_ || !pending_.empty(); });
+      if (pending_.empty()) {
+        return;
+      }
+      // The buffers are swapped, so that each keeps its capacity.
+      batch.swap(pending_);
+    }
+
+    const char* data(batch.data());
+    size_t size(batch.size());
+    while (size > 0) {
+      const ssize_t ret(write(fd_, data, size));
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      }
+      if (ret <= 0) {
+        PLOG_EVERY_N(ERROR, 100) << "Failed to write to " << path_;
+        break;
+      }
+      data += ret;
+      size -= ret;
+    }
+
+    // Counts the requests of the batch, to tell how many made it.
+    int64_t count(0);
+    for (size_t offset = 0; offset < batch.size(); ++count) {
+      Header header;
+      memcpy(&header, batch.data() + offset, sizeof(header));
+      offset += sizeof(header) + header.uri_size + header.body_size;
+    }
+    if (size > 0) {
+      // Drop whatever part of the batch made it, so that the requests
+      // after it stay in step.
+      if (ftruncate(fd_, file_size) != 0 ||
+          lseek(fd_, file_size, SEEK_SET) != file_size) {
+        PLOG_EVERY_N(ERROR, 100) << "Failed to truncate " << path_;
+      }
+      request_capture_requests->IncrementBy("failed", count);
+    } else {
+      file_size += batch.size();
+      request_capture_requests->IncrementBy("written", count);
+    }
+  }
+}
+
+
+// static
+bool RequestCapture::ReadRequest(istream* in, Request* request) {
+  CHECK_NOTNULL(request);
+  Header header;
+  if (!in->read(reinterpret_cast<char*>(&header), sizeof(header))) {
+    return false;
+  }
+  if (header.uri_size > kMaxFieldBytes || header.body_size > kMaxFieldBytes) {
+    LOG(WARNING) << "Corrupt request capture header";
+    return false;
+  }
+  request->timestamp_us = header.timestamp_us;
+  request->method = header.method;
+  request->uri.resize(header.uri_size);
+  request->body.resize(header.body_size);
+  return in->read(&request->uri[0], header.uri_size) &&
+         in->read(&request->body[0], header.body_size);
+}
+
+
+}  // namespace cert_trans
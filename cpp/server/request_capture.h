@@ -0,0 +1,96 @@
+#ifndef CERT_TRANS_SERVER_REQUEST_CAPTURE_H_
+#define CERT_TRANS_SERVER_REQUEST_CAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <istream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "server/access_log.h"
+
+struct evhttp_request;
+
+namespace cert_trans {
+
+
+// Records the requests received by a server, with their bodies and
+// when they came in, to a file from which tools/replay_requests plays
+// them back against a test cluster, so that performance changes can be
+// checked against real traffic.
+//
+// As with the AccessLog, the threads serving the requests only copy
+// them into a buffer, and a background thread writes them out. When
+// the buffer is full, requests are dropped and counted rather than
+// waited for, so a replay is a sample of the traffic under load.
+//
+// The file is a sequence of requests, each a fixed-size header (in the
+// byte order of the host) followed by the URI and the body; see
+// ReadRequest().
+//
+// This class is thread-safe.
+class RequestCapture {
+ public:
+  struct Request {
+    // When it was received, in microseconds since the epoch.
+    int64_t timestamp_us;
+    AccessLog::Method method;
+    // As in the request line, with the query string.
+    std::string uri;
+    std::string body;
+  };
+
+  // Writes to the file at |path|, replacing it, keeping up to
+  // |buffer_bytes| of requests not yet written. If |duration| is
+  // positive, only the requests received that long after construction
+  // are captured.
+  RequestCapture(const std::string& path, size_t buffer_bytes,
+                 const std::chrono::duration<double>& duration);
+  // Writes out the requests captured so far.
+  ~RequestCapture();
+  RequestCapture(const RequestCapture&) = delete;
+  RequestCapture& operator=(const RequestCapture&) = delete;
+
+  // Captures |req|, which has been read in full. Meant to be the
+  // observer of a libevent::HttpServer.
+  void Capture(evhttp_request* req);
+
+  // Captures |request|. Returns false if it was not, as the buffer was
+  // full or the capture is over.
+  bool Capture(const Request& request);
+
+  // Reads the next request of a capture from |in| into |request|.
+  // Returns false at the end, including on a request cut short (the
+  // server died while writing it).
+  static bool ReadRequest(std::istream* in, Request* request);
+
+ private:
+  struct Header;
+
+  bool Append(int64_t timestamp_us, AccessLog::Method method,
+              const char* uri, size_t uri_size, const char* body,
+              size_t body_size);
+  void WriterLoop();
+
+  const std::string path_;
+  const int fd_;
+  const size_t buffer_bytes_;
+  const bool has_deadline_;
+  const std::chrono::steady_clock::time_point deadline_;
+
+  std::mutex lock_;
+  std::condition_variable wake_writer_;
+  // The requests not yet handed to |writer_|, as they go in the file.
+  std::string pending_;
+  bool over_;
+  bool exiting_;
+  std::thread writer_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_REQUEST_CAPTURE_H_
@@ -0,0 +1,139 @@
+#include "server/request_capture.h"
+
+#include <gtest/gtest.h>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "util/test_db.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace cert_trans {
+namespace {
+
+using std::chrono::duration;
+using std::chrono::milliseconds;
+using std::ifstream;
+using std::string;
+using std::this_thread::sleep_for;
+using std::vector;
+
+
+class RequestCaptureTest : public ::testing::Test {
+ protected:
+  string Path() const {
+    return tmp_.TmpStorageDir() + "/capture";
+  }
+
+  vector<RequestCapture::Request> ReadRequests() const {
+    ifstream in(Path(), std::ios::binary);
+    CHECK(in.good());
+    vector<RequestCapture::Request> requests;
+    RequestCapture::Request request;
+    while (RequestCapture::ReadRequest(&in, &request)) {
+      requests.push_back(request);
+    }
+    return requests;
+  }
+
+  TmpStorage tmp_;
+};
+
+
+RequestCapture::Request MakeRequest(int64_t timestamp_us,
+                                    AccessLog::Method method,
+                                    const string& uri, const string& body) {
+  RequestCapture::Request request;
+  request.timestamp_us = timestamp_us;
+  request.method = method;
+  request.uri = uri;
+  request.body = body;
+  return request;
+}
+
+
+TEST_F(RequestCaptureTest, WritesRequests) {
+  {
+    RequestCapture capture(Path(), 1 << 20, duration<double>(0));
+    EXPECT_TRUE(capture.Capture(MakeRequest(
+        1, AccessLog::GET, "/ct/v1/get-entries?start=0&end=9", "")));
+    EXPECT_TRUE(capture.Capture(MakeRequest(
+        2, AccessLog::POST, "/ct/v1/add-chain", "{\"chain\": []}")));
+    EXPECT_TRUE(capture.Capture(
+        MakeRequest(3, AccessLog::POST, "/ct/v1/add-chain", string(1, '\0'))));
+  }
+
+  const vector<RequestCapture::Request> requests(ReadRequests());
+  ASSERT_EQ(3U, requests.size());
+  EXPECT_EQ(1, requests[0].timestamp_us);
+  EXPECT_EQ(AccessLog::GET, requests[0].method);
+  EXPECT_EQ("/ct/v1/get-entries?start=0&end=9", requests[0].uri);
+  EXPECT_EQ("", requests[0].body);
+  EXPECT_EQ(AccessLog::POST, requests[1].method);
+  EXPECT_EQ("{\"chain\": []}", requests[1].body);
+  EXPECT_EQ(3, requests[2].timestamp_us);
+  EXPECT_EQ(string(1, '\0'), requests[2].body);
+}
+
+
+TEST_F(RequestCaptureTest, IgnoresRequestCutShort) {
+  {
+    RequestCapture capture(Path(), 1 << 20, duration<double>(0));
+    EXPECT_TRUE(capture.Capture(
+        MakeRequest(1, AccessLog::POST, "/ct/v1/add-chain", "body")));
+    EXPECT_TRUE(capture.Capture(
+        MakeRequest(2, AccessLog::POST, "/ct/v1/add-chain", "body")));
+  }
+  string data;
+  ASSERT_TRUE(util::ReadBinaryFile(Path(), &data));
+  std::ofstream(Path(), std::ios::binary | std::ios::trunc)
+      << data.substr(0, data.size() - 1);
+
+  const vector<RequestCapture::Request> requests(ReadRequests());
+  ASSERT_EQ(1U, requests.size());
+  EXPECT_EQ(1, requests[0].timestamp_us);
+}
+
+
+TEST_F(RequestCaptureTest, DropsWhatDoesNotFit) {
+  {
+    RequestCapture capture(Path(), 100, duration<double>(0));
+    EXPECT_FALSE(capture.Capture(
+        MakeRequest(1, AccessLog::POST, "/ct/v1/add-chain", string(100, 'x'))));
+    EXPECT_TRUE(capture.Capture(
+        MakeRequest(2, AccessLog::GET, "/ct/v1/get-sth", "")));
+  }
+
+  const vector<RequestCapture::Request> requests(ReadRequests());
+  ASSERT_EQ(1U, requests.size());
+  EXPECT_EQ(2, requests[0].timestamp_us);
+}
+
+
+TEST_F(RequestCaptureTest, StopsAfterDuration) {
+  {
+    RequestCapture capture(Path(), 1 << 20, milliseconds(50));
+    EXPECT_TRUE(capture.Capture(
+        MakeRequest(1, AccessLog::GET, "/ct/v1/get-sth", "")));
+    sleep_for(milliseconds(100));
+    EXPECT_FALSE(capture.Capture(
+        MakeRequest(2, AccessLog::GET, "/ct/v1/get-sth", "")));
+  }
+
+  const vector<RequestCapture::Request> requests(ReadRequests());
+  ASSERT_EQ(1U, requests.size());
+  EXPECT_EQ(1, requests[0].timestamp_us);
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
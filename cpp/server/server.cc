@@ -1,6 +1,9 @@
 #include "server/server.h"
 
+#include <event2/buffer.h>
+#include <event2/http.h>
 #include <gflags/gflags.h>
+#include <openssl/ssl.h>
 #include <chrono>
 #include <csignal>
 #include <functional>
@@ -8,30 +11,53 @@
 #include "log/cluster_state_controller.h"
 #include "log/etcd_consistent_store.h"
 #include "log/frontend.h"
+#include "log/journaled_consistent_store.h"
+#include "log/local_consistent_store.h"
 #include "log/log_lookup.h"
 #include "log/log_verifier.h"
+#include "log/name_index.h"
+#include "log/tree_partition.h"
+#include "merkletree/file_node_store.h"
+#include "merkletree/node_store.h"
+#include "merkletree/serial_hasher.h"
+#include "merkletree/stored_merkle_tree.h"
 #include "monitoring/gcm/exporter.h"
 #include "monitoring/monitoring.h"
+#include "monitoring/startup.h"
+#include "monitoring/zipkin/exporter.h"
+#include "server/handoff.h"
 #include "server/metrics.h"
+#include "server/partition_router.h"
+#include "server/profiling.h"
 #include "server/proxy.h"
+#include "server/request_capture.h"
+#include "server/snapshot.h"
+#include "util/cpu_affinity.h"
 #include "util/thread_pool.h"
+#include "util/util.h"
 #include "util/uuid.h"
 
 using std::bind;
 using std::chrono::seconds;
 using std::chrono::steady_clock;
+using std::move;
 using std::placeholders::_1;
 using std::shared_ptr;
 using std::signal;
 using std::string;
 using std::this_thread::sleep_for;
 using std::thread;
+using std::unique_ptr;
+using std::vector;
 
 // These flags are DEFINEd in server_helper to keep the validation logic
 // related to server startup options in one place.
 DECLARE_string(server);
 DECLARE_int32(port);
 DECLARE_string(etcd_root);
+DECLARE_string(etcd_servers);
+
+DECLARE_string(zipkin_collector_url);
 
 DEFINE_int32(node_state_refresh_seconds, 10,
              "How often to refresh the ClusterNodeState entry for this node.");
@@ -40,6 +66,114 @@ DEFINE_int32(watchdog_seconds, 120,
              "before firing the watchdog timer.");
 DEFINE_bool(watchdog_timeout_is_fatal, true,
             "Exit if the watchdog timer fires.");
+DEFINE_string(merkle_tree_dir, "",
+              "If set, keep the Merkle tree used to serve proofs in "
+              "memory-mapped files in this directory, and reuse them on "
+              "restart instead of rebuilding the tree from the database.");
+DEFINE_bool(load_merkle_tree_in_background, false,
+            "Start serving the tree head and entries of the database at "
+            "once, and load the Merkle tree used to serve proofs in the "
+            "background, replying to requests for proofs with a 503 until "
+            "it is loaded.");
+DEFINE_string(shared_merkle_tree_dir, "",
+              "If set, serve proofs from the Merkle tree that another "
+              "server keeps in this directory (with --merkle_tree_dir), "
+              "reading it in place rather than holding a tree of our own. "
+              "Lets many mirror replicas on one machine share a tree.");
+DEFINE_int32(num_http_event_loops, 1,
+             "Number of event loops doing the network I/O of the HTTP "
+             "server, each accepting connections on a socket of its own.");
+DEFINE_string(pending_entry_journal, "",
+              "If set, acknowledge new entries once they are synced to a "
+              "journal at this path, and add them to etcd in the background. "
+              "Entries submitted to two nodes in quick succession can then "
+              "be issued two SCTs, only one of which is logged.");
+DEFINE_string(local_store_journal, "",
+              "If set, in stand-alone mode, keep the pending entries, "
+              "sequence mapping and serving STH in memory and in a journal "
+              "at this path, rather than in an in-process etcd which loses "
+              "them on restart.");
+DEFINE_bool(serve_snapshots, false,
+            "Serve snapshots of the database to new nodes of the cluster, "
+            "which they load with --snapshot_peer, at /ct/v1/get-snapshot.");
+DEFINE_string(snapshot_peer, "",
+              "If set, load the snapshot of the database of the node at "
+              "this URL (which has to have --serve_snapshots) before "
+              "starting, rather than fetching every entry of the log from "
+              "the cluster. The entries past it are still fetched.");
+DEFINE_string(handoff_socket, "",
+              "If set, the path of a Unix socket through which a new "
+              "server process takes over the listening sockets of this one "
+              "as it starts, so that restarting it refuses no connection. "
+              "The new process waits for the old one to exit before it "
+              "opens the database, and builds no Merkle tree if it is kept "
+              "in --merkle_tree_dir.");
+DEFINE_double(handoff_drain_seconds, 10,
+              "How long a server keeps serving the connections it has "
+              "accepted after handing its listening sockets over to a new "
+              "process, before exiting.");
+DEFINE_string(name_index_dir, "",
+              "If set, keep an index of the DNS names of the logged "
+              "certificates in a LevelDB in this directory, updated as new "
+              "tree heads are written, and serve searches of it at "
+              "/ct/v1/search-names.");
+DEFINE_int32(tree_partition_bits, 24,
+             "The number of leaves in each partition of the tree, as a "
+             "power of two, with --tree_partition_index or "
+             "--tree_partitions.");
+DEFINE_int32(tree_partition_index, -1,
+             "If set, keep only the nodes of this partition of the Merkle "
+             "tree, and those needed to serve proofs for its leaves and the "
+             "newest ones, rather than the whole tree. Requests for other "
+             "proofs are answered with an error, and are meant to come "
+             "through a server with --tree_partitions.");
+DEFINE_string(tree_partitions, "",
+              "If set, a comma-separated list of the host:port of the "
+              "servers of each partition of the tree, in order of "
+              "--tree_partition_index. Requests for proofs are sent to all "
+              "of them, and this server keeps no Merkle tree but the top "
+              "levels and the newest leaves.");
+DEFINE_int32(tls_port, 0,
+             "If set, also serve HTTPS on this port, with "
+             "--tls_certificate_file and --tls_key_file. The nodes of a "
+             "cluster still talk to each other over plain HTTP, on --port.");
+DEFINE_string(tls_certificate_file, "",
+              "PEM-encoded certificate chain served on --tls_port.");
+DEFINE_string(tls_key_file, "",
+              "PEM-encoded private key of --tls_certificate_file.");
+DEFINE_string(tls_ticket_key_file, "",
+              "If set, a file of random bytes with which to encrypt TLS "
+              "session tickets (80 of them with OpenSSL 1.1 or later, 48 "
+              "otherwise), so that clients can resume their sessions with "
+              "any node sharing it, and across restarts. Otherwise, each "
+              "process picks keys of its own.");
+DEFINE_bool(tls_kernel_offload, false,
+            "Have the kernel encrypt what is sent over TLS (kTLS), where "
+            "both OpenSSL and the kernel support it.");
+DEFINE_bool(pin_to_numa_nodes, false,
+            "Pin the threads of the HTTP event loops, and of the thread "
+            "pools without --http_pool_cpus or --internal_pool_cpus, to "
+            "the NUMA nodes of the machine, spread evenly over them, so "
+            "that each works on memory of its own node. The main event "
+            "loop is pinned to the first node.");
+DEFINE_string(http_pool_cpus, "",
+              "If set, the CPUs to run the threads of the HTTP thread pool "
+              "on, as a list such as \"0-3,8-11\".");
+DEFINE_string(internal_pool_cpus, "",
+              "If set, the CPUs to run the threads of the internal thread "
+              "pool on, as a list such as \"0-3,8-11\".");
+DEFINE_string(capture_requests, "",
+              "If set, record the requests received, with their bodies and "
+              "arrival times, to this file (see server/request_capture.h), "
+              "to be replayed against a test cluster with "
+              "tools/replay_requests. Requests are dropped, and counted, "
+              "rather than waited for if it cannot keep up.");
+DEFINE_double(capture_requests_seconds, 0,
+              "If positive, only capture the requests received during this "
+              "long after starting, rather than until exiting.");
+DEFINE_int32(capture_requests_buffer_mb, 64,
+             "How many megabytes of requests --capture_requests buffers "
+             "while they are written out.");
 
 namespace cert_trans {
 
@@ -56,6 +190,75 @@ Gauge<>* latest_local_tree_size_gauge() {
 namespace {
 
 
+// The listening sockets taken over by StaticInit(), if any.
+vector<int>* HandedOverSockets() {
+  static vector<int>* const sockets(new vector<int>);
+  return sockets;
+}
+
+
+// Agrees to HTTP/1.1 over ALPN, which is all that evhttp speaks.
+int SelectALPN(SSL* /*ssl*/, const unsigned char** out,
+               unsigned char* out_length, const unsigned char* in,
+               unsigned int in_length, void* /*arg*/) {
+  static const unsigned char kHttp11[] = "\x08http/1.1";
+  unsigned char* selected;
+  if (SSL_select_next_proto(&selected, out_length, kHttp11,
+                            sizeof(kHttp11) - 1, in,
+                            in_length) != OPENSSL_NPN_NEGOTIATED) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  *out = selected;
+  return SSL_TLSEXT_ERR_OK;
+}
+
+
+SSL_CTX* NewTLSServerContext() {
+  SSL_CTX* const ctx(CHECK_NOTNULL(SSL_CTX_new(SSLv23_server_method())));
+  SSL_CTX_set_options(ctx, SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3);
+  CHECK_EQ(SSL_CTX_use_certificate_chain_file(
+               ctx, FLAGS_tls_certificate_file.c_str()),
+           1)
+      << "Cannot load the certificates in " << FLAGS_tls_certificate_file;
+  CHECK_EQ(SSL_CTX_use_PrivateKey_file(ctx, FLAGS_tls_key_file.c_str(),
+                                       SSL_FILETYPE_PEM),
+           1)
+      << "Cannot load the private key in " << FLAGS_tls_key_file;
+  CHECK_EQ(SSL_CTX_check_private_key(ctx), 1)
+      << FLAGS_tls_key_file << " is not the key of "
+      << FLAGS_tls_certificate_file;
+  SSL_CTX_set_alpn_select_cb(ctx, &SelectALPN, nullptr);
+
+  // Sessions are cached by this process, or resumed from tickets.
+  static const unsigned char kSessionIdContext[] = "ct";
+  CHECK_EQ(SSL_CTX_set_session_id_context(ctx, kSessionIdContext,
+                                          sizeof(kSessionIdContext) - 1),
+           1);
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+  if (!FLAGS_tls_ticket_key_file.empty()) {
+    string keys;
+    CHECK(util::ReadBinaryFile(FLAGS_tls_ticket_key_file, &keys))
+        << "Cannot read " << FLAGS_tls_ticket_key_file;
+    // Asked for with no buffer, it says how much it takes.
+    const long length(SSL_CTX_get_tlsext_ticket_keys(ctx, nullptr, 0));
+    CHECK_EQ(static_cast<long>(keys.size()), length)
+        << FLAGS_tls_ticket_key_file << " must hold " << length << " bytes";
+    CHECK_EQ(SSL_CTX_set_tlsext_ticket_keys(
+                 ctx, const_cast<char*>(keys.data()), keys.size()),
+             1);
+  }
+
+  if (FLAGS_tls_kernel_offload) {
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#else
+    LOG(WARNING) << "This OpenSSL cannot offload TLS to the kernel.";
+#endif
+  }
+  return ctx;
+}
+
+
 void RefreshNodeState(ClusterStateController* controller, util::Task* task) {
   CHECK_NOTNULL(task);
   const steady_clock::duration period(
@@ -91,6 +294,76 @@ void WatchdogTimeout(int) {
 }
 
 
+// Returns a LocalConsistentStore if --local_store_journal is set, and
+// otherwise an EtcdConsistentStore, wrapped in a
+// JournaledConsistentStore if --pending_entry_journal is set.
+ConsistentStore* NewConsistentStore(libevent::Base* base,
+                                    util::Executor* executor,
+                                    EtcdClient* etcd_client,
+                                    const MasterElection* election,
+                                    const ReadOnlyDatabase* db,
+                                    const string& node_id) {
+  if (!FLAGS_local_store_journal.empty()) {
+    CHECK(FLAGS_etcd_servers.empty())
+        << "--local_store_journal is only for stand-alone mode";
+    CHECK(FLAGS_pending_entry_journal.empty())
+        << "--local_store_journal and --pending_entry_journal are exclusive";
+    return new LocalConsistentStore(FLAGS_local_store_journal, db, node_id);
+  }
+  ConsistentStore* const store(new EtcdConsistentStore(
+      base, executor, etcd_client, election, FLAGS_etcd_root, node_id));
+  if (FLAGS_pending_entry_journal.empty()) {
+    return store;
+  }
+  return new JournaledConsistentStore(FLAGS_pending_entry_journal, executor,
+                                      store);
+}
+
+
+void SendTextReply(evhttp_request* req, int code, const string& body) {
+  evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type",
+                    "text/plain");
+  evbuffer_add(evhttp_request_get_output_buffer(req), body.data(),
+               body.size());
+  evhttp_send_reply(req, code, /*reason*/ nullptr, /*databuf*/ nullptr);
+}
+
+
+// Replies as long as the event loop is running, even while the server
+// is still starting.
+void Healthz(evhttp_request* req) {
+  SendTextReply(req, HTTP_OK, "ok\n");
+}
+
+
+// Only replies with a success once the server has started, and with
+// how far along it is until then.
+void Readyz(evhttp_request* req) {
+  if (IsStartupComplete()) {
+    SendTextReply(req, HTTP_OK, "ok\n");
+  } else {
+    SendTextReply(req, HTTP_SERVUNAVAIL, "starting:\n" + StartupSummary());
+  }
+}
+
+
+// The CPUs to pin the threads of a pool to, given |cpu_list|, the
+// flag for it, as ThreadPool::PinThreads() takes them. Empty if they
+// are not to be pinned.
+vector<vector<int>> PoolCpus(const string& cpu_list) {
+  if (!cpu_list.empty()) {
+    vector<int> cpus;
+    CHECK(util::ParseCpuList(cpu_list, &cpus) && !cpus.empty())
+        << "Invalid list of CPUs: " << cpu_list;
+    return vector<vector<int>>(1, cpus);
+  }
+  if (FLAGS_pin_to_numa_nodes) {
+    return util::NumaNodeCpus();
+  }
+  return vector<vector<int>>();
+}
+
+
 string GetNodeId(Database* db) {
   string node_id;
   if (db->NodeId(&node_id) != Database::LOOKUP_OK) {
@@ -110,6 +383,9 @@ string GetNodeId(Database* db) {
 // static
 void Server::StaticInit() {
   CHECK_NE(SIG_ERR, signal(SIGALRM, &WatchdogTimeout));
+  if (!FLAGS_handoff_socket.empty()) {
+    *HandedOverSockets() = TakeOverListeningSockets(FLAGS_handoff_socket);
+  }
 }
 
 
@@ -119,7 +395,7 @@ Server::Server(const shared_ptr<libevent::Base>& event_base,
                const LogVerifier* log_verifier)
     : event_base_(event_base),
       event_pump_(new libevent::EventPumpThread(event_base_)),
-      http_server_(*event_base_),
+      http_server_(*event_base_, FLAGS_num_http_event_loops - 1),
       db_(CHECK_NOTNULL(db)),
       log_verifier_(CHECK_NOTNULL(log_verifier)),
       node_id_(GetNodeId(db_)),
@@ -130,12 +406,37 @@ Server::Server(const shared_ptr<libevent::Base>& event_base,
       internal_pool_(CHECK_NOTNULL(internal_pool)),
       server_task_(internal_pool_),
       consistent_store_(&election_,
-                        new EtcdConsistentStore(event_base_.get(),
-                                                internal_pool_, etcd_client_,
-                                                &election_, FLAGS_etcd_root,
-                                                node_id_)),
+                        NewConsistentStore(event_base_.get(), internal_pool_,
+                                           etcd_client_, &election_, db_,
+                                           node_id_)),
+      prefetch_leaves_callback_(
+          [this]() { log_lookup_->PrefetchLeaves(db_->TreeSize()); }),
       http_pool_(CHECK_NOTNULL(http_pool)) {
   CHECK_LT(0, FLAGS_port);
+  CHECK_LT(0, FLAGS_num_http_event_loops);
+
+  const vector<vector<int>> http_pool_cpus(PoolCpus(FLAGS_http_pool_cpus));
+  if (!http_pool_cpus.empty()) {
+    http_pool_->PinThreads(http_pool_cpus);
+  }
+  const vector<vector<int>> internal_pool_cpus(
+      PoolCpus(FLAGS_internal_pool_cpus));
+  if (!internal_pool_cpus.empty()) {
+    internal_pool_->PinThreads(internal_pool_cpus);
+  }
+  if (FLAGS_pin_to_numa_nodes) {
+    http_server_.SetLoopCpus(util::NumaNodeCpus());
+  }
+  if (!FLAGS_capture_requests.empty()) {
+    CHECK_LT(0, FLAGS_capture_requests_buffer_mb);
+    request_capture_.reset(new RequestCapture(
+        FLAGS_capture_requests,
+        static_cast<size_t>(FLAGS_capture_requests_buffer_mb) << 20,
+        std::chrono::duration<double>(FLAGS_capture_requests_seconds)));
+    RequestCapture* const capture(request_capture_.get());
+    http_server_.SetObserver(
+        [capture](evhttp_request* req) { capture->Capture(req); });
+  }
 
   if (FLAGS_monitoring == kPrometheus) {
     http_server_.AddHandler("/metrics", ExportPrometheusMetrics);
@@ -145,13 +446,42 @@ Server::Server(const shared_ptr<libevent::Base>& event_base,
   } else {
     LOG(FATAL) << "Please set --monitoring to one of the supported values.";
   }
+  AddProfilingHandlers(event_base_.get(), internal_pool_, &http_server_);
+  // These are served by the temporary event pump while starting.
+  CHECK(http_server_.AddHandler("/healthz", Healthz));
+  CHECK(http_server_.AddHandler("/readyz", Readyz));
+
+  if (!FLAGS_zipkin_collector_url.empty()) {
+    zipkin_exporter_.reset(
+        new ZipkinExporter(FLAGS_server, url_fetcher_, internal_pool_));
+  }
 
-  http_server_.Bind(nullptr, FLAGS_port);
+  if (FLAGS_tls_port > 0) {
+    // HandoffListener only hands the plain HTTP sockets over.
+    CHECK(FLAGS_handoff_socket.empty())
+        << "--tls_port cannot be used with --handoff_socket yet.";
+    tls_ctx_.reset(NewTLSServerContext());
+    http_server_.BindTLS(nullptr, FLAGS_tls_port, tls_ctx_.get());
+  }
+  if (HandedOverSockets()->empty()) {
+    http_server_.Bind(nullptr, FLAGS_port);
+  } else {
+    http_server_.Adopt(*HandedOverSockets());
+    HandedOverSockets()->clear();
+  }
+  if (!FLAGS_handoff_socket.empty()) {
+    handoff_listener_.reset(new HandoffListener(
+        FLAGS_handoff_socket, event_base_.get(), &http_server_,
+        std::chrono::duration<double>(FLAGS_handoff_drain_seconds)));
+  }
   election_.StartElection();
 }
 
 
 Server::~Server() {
+  if (fetcher_) {
+    fetcher_->RemoveEntriesWrittenCallback(&prefetch_leaves_callback_);
+  }
   server_task_.Cancel();
   node_refresh_thread_->join();
   server_task_.Wait();
@@ -193,6 +523,11 @@ Proxy* Server::proxy() {
 }
 
 
+const NameIndex* Server::name_index() {
+  return name_index_.get();
+}
+
+
 libevent::HttpServer* Server::http_server() {
   return &http_server_;
 }
@@ -205,21 +540,89 @@ void Server::WaitForReplication() const {
   util::StatusOr<ct::SignedTreeHead> serving_sth(
       consistent_store_.GetServingSTH());
   if (serving_sth.ok()) {
-    while (db_->TreeSize() < serving_sth.ValueOrDie().tree_size()) {
+    StartupPhase phase("wait_for_replication");
+    int64_t tree_size(db_->TreeSize());
+    phase.SetTotal(serving_sth.ValueOrDie().tree_size());
+    phase.AddDone(tree_size);
+    while (tree_size < serving_sth.ValueOrDie().tree_size()) {
       LOG(WARNING) << "Waiting for local database to catch up to serving_sth ("
-                   << db_->TreeSize() << " of "
+                   << tree_size << " of "
                    << serving_sth.ValueOrDie().tree_size() << ")";
       sleep(1);
+      const int64_t new_tree_size(db_->TreeSize());
+      phase.AddDone(new_tree_size - tree_size);
+      tree_size = new_tree_size;
     }
   }
 }
 
 
-void Server::Initialise(bool is_mirror) {
+void Server::Initialise(bool is_mirror, FetchBudget::Share* fetch_budget) {
+  const StartupPhase phase("server_initialise");
+  if (!FLAGS_snapshot_peer.empty()) {
+    const util::StatusOr<ct::SignedTreeHead> sth(
+        LoadSnapshot(url_fetcher_, FLAGS_snapshot_peer, log_verifier_,
+                     internal_pool_, db_));
+    // Entries which do not match their tree head have been written.
+    CHECK_NE(sth.status().CanonicalCode(), util::error::DATA_LOSS)
+        << "Loading the snapshot from " << FLAGS_snapshot_peer
+        << " failed: " << sth.status();
+    LOG_IF(WARNING, !sth.ok())
+        << "Could not load the snapshot from " << FLAGS_snapshot_peer
+        << ", fetching the entries instead: " << sth.status();
+  }
+  if (FLAGS_serve_snapshots) {
+    AddSnapshotHandler(event_base_.get(), db_, http_pool_, &http_server_);
+  }
+
   fetcher_ = ContinuousFetcher::New(event_base_.get(), internal_pool_, db_,
-                                    log_verifier_, !is_mirror);
+                                    log_verifier_, !is_mirror, fetch_budget);
+
+  const size_t node_size(Sha256Hasher().DigestSize());
+  const vector<string> tree_partitions(
+      FLAGS_tree_partitions.empty() ? vector<string>()
+                                    : util::split(FLAGS_tree_partitions, ','));
+  if (FLAGS_tree_partition_index >= 0 || !tree_partitions.empty()) {
+    CHECK(FLAGS_merkle_tree_dir.empty() &&
+          FLAGS_shared_merkle_tree_dir.empty())
+        << "--tree_partition_index and --tree_partitions keep the tree in "
+        << "memory";
+    // A partition does not route, lest requests go round in circles.
+    CHECK(FLAGS_tree_partition_index < 0 || tree_partitions.empty())
+        << "--tree_partition_index and --tree_partitions are exclusive";
+    // A router serves past the last partition, which it never owns.
+    const int64_t partition_index(FLAGS_tree_partition_index >= 0
+                                      ? FLAGS_tree_partition_index
+                                      : tree_partitions.size());
+    log_lookup_.reset(new LogLookup(
+        db_, unique_ptr<TreePartition>(new TreePartition(
+                 FLAGS_tree_partition_bits, partition_index))));
+  } else if (!FLAGS_shared_merkle_tree_dir.empty()) {
+    CHECK(FLAGS_merkle_tree_dir.empty())
+        << "--merkle_tree_dir and --shared_merkle_tree_dir are exclusive";
+    log_lookup_.reset(new LogLookup(
+        db_, unique_ptr<StoredMerkleTree>(new StoredMerkleTree(
+                 unique_ptr<SerialHasher>(new Sha256Hasher),
+                 unique_ptr<MerkleTreeNodeStore>(new FileNodeStore(
+                     FLAGS_shared_merkle_tree_dir, node_size, true))))));
+  } else {
+    unique_ptr<MerkleTreeNodeStore> tree_store;
+    if (FLAGS_merkle_tree_dir.empty()) {
+      tree_store.reset(new MemoryNodeStore(node_size));
+    } else {
+      tree_store.reset(new FileNodeStore(FLAGS_merkle_tree_dir, node_size));
+    }
+    // Catching up with a large database on startup is hash-bound, so
+    // spread it over the internal pool.
+    log_lookup_.reset(new LogLookup(db_, move(tree_store), internal_pool_,
+                                    FLAGS_load_merkle_tree_in_background));
+  }
+  fetcher_->AddEntriesWrittenCallback(&prefetch_leaves_callback_);
 
-  log_lookup_.reset(new LogLookup(db_));
+  if (!FLAGS_name_index_dir.empty()) {
+    name_index_.reset(
+        new NameIndex(FLAGS_name_index_dir, db_, internal_pool_));
+  }
 
   cluster_controller_.reset(
       new ClusterStateController(internal_pool_, event_base_, url_fetcher_,
@@ -245,16 +648,27 @@ void Server::Initialise(bool is_mirror) {
                                         cluster_controller_.get(),
                                         server_task_.task()));
 
-  proxy_.reset(new Proxy(event_base_.get(),
-                         bind(&ClusterStateController::GetFreshNodes,
-                              cluster_controller_.get()),
-                         url_fetcher_, http_pool_));
+  const Proxy::GetFreshNodesFunction get_fresh_nodes(
+      bind(&ClusterStateController::GetFreshNodes, cluster_controller_.get()));
+  if (tree_partitions.empty()) {
+    proxy_.reset(new Proxy(event_base_.get(), get_fresh_nodes, url_fetcher_,
+                           http_pool_));
+  } else {
+    proxy_.reset(new PartitionRouter(event_base_.get(), get_fresh_nodes,
+                                     url_fetcher_, http_pool_,
+                                     tree_partitions));
+  }
 }
 
 
 void Server::Run() {
   // Ding the temporary event pump because we're about to enter the event loop
   event_pump_.reset();
+  MarkStartupComplete();
+  if (FLAGS_pin_to_numa_nodes) {
+    // The extra HTTP event loops leave it the first node.
+    util::PinCurrentThread(util::NumaNodeCpus().front());
+  }
   event_base_->Dispatch();
 }
 
@@ -2,14 +2,17 @@
 #define CERT_TRANS_SERVER_SERVER_H_
 
 #include <stdint.h>
+#include <functional>
 #include <memory>
 #include <string>
 #include <thread>
 
+#include "fetcher/fetch_budget.h"
 #include "log/strict_consistent_store.h"
 #include "monitoring/gauge.h"
 #include "util/libevent_wrapper.h"
 #include "util/masterelection.h"
+#include "util/openssl_scoped_ssl_types.h"
 #include "util/sync_task.h"
 
 class Frontend;
@@ -24,12 +27,16 @@ class ContinuousFetcher;
 class Database;
 class EtcdClient;
 class GCMExporter;
+class HandoffListener;
 class LogLookup;
 class LogSigner;
 class LoggedEntry;
+class NameIndex;
 class Proxy;
+class RequestCapture;
 class ThreadPool;
 class UrlFetcher;
+class ZipkinExporter;
 
 // Size of latest locally generated STH.
 Gauge<>* latest_local_tree_size_gauge();
@@ -55,15 +62,25 @@ class Server {
   LogLookup* log_lookup();
   ContinuousFetcher* continuous_fetcher();
   Proxy* proxy();
+  // Null unless --name_index_dir is set.
+  const NameIndex* name_index();
   libevent::HttpServer* http_server();
 
-  void Initialise(bool is_mirror);
+  // If set, the entries are fetched from the other nodes (or the
+  // mirrored log) as |fetch_budget| allows, which must outlive this
+  // instance.
+  void Initialise(bool is_mirror,
+                  FetchBudget::Share* fetch_budget = nullptr);
   void WaitForReplication() const;
   void Run();
 
  private:
   const std::shared_ptr<libevent::Base> event_base_;
   std::unique_ptr<libevent::EventPumpThread> event_pump_;
+  // For HTTPS, with --tls_port. Outlives |http_server_|, which uses it.
+  ScopedSSL_CTX tls_ctx_;
+  // With --capture_requests. Outlives |http_server_|, which feeds it.
+  std::unique_ptr<RequestCapture> request_capture_;
   libevent::HttpServer http_server_;
   Database* const db_;
   const LogVerifier* const log_verifier_;
@@ -75,13 +92,20 @@ class Server {
   util::SyncTask server_task_;
   StrictConsistentStore consistent_store_;
   const std::unique_ptr<Frontend> frontend_;
+  // Declared before its users below, so that it outlives them.
+  std::unique_ptr<ContinuousFetcher> fetcher_;
   std::unique_ptr<LogLookup> log_lookup_;
   std::unique_ptr<ClusterStateController> cluster_controller_;
-  std::unique_ptr<ContinuousFetcher> fetcher_;
+  // Registered with |fetcher_|, to hash the leaves of the entries it
+  // writes ahead of the tree head that will cover them.
+  const std::function<void()> prefetch_leaves_callback_;
   ThreadPool* const http_pool_;
   std::unique_ptr<Proxy> proxy_;
+  std::unique_ptr<NameIndex> name_index_;
   std::unique_ptr<std::thread> node_refresh_thread_;
   std::unique_ptr<GCMExporter> gcm_exporter_;
+  std::unique_ptr<ZipkinExporter> zipkin_exporter_;
+  std::unique_ptr<HandoffListener> handoff_listener_;
 };
 
 
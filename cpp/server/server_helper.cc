@@ -27,6 +27,17 @@ DEFINE_string(sqlite_db, "",
               "SQLite database for certificate and tree storage");
 DEFINE_string(leveldb_db, "",
               "LevelDB database for certificate and tree storage");
+DEFINE_string(rocksdb_db, "",
+              "RocksDB database for certificate and tree storage, if built "
+              "with RocksDB");
+DEFINE_string(segment_db, "",
+              "Directory of segment files for certificate and tree storage");
+DEFINE_string(segment_db_cold_dir, "",
+              "If set, directory to which the older segments of --segment_db "
+              "are moved, on slower storage");
+DEFINE_int64(segment_db_hot_entries, 1 << 22,
+             "Number of the newest entries kept in --segment_db when "
+             "--segment_db_cold_dir is set");
 // TODO(ekasper): sanity-check these against the directory structure.
 DEFINE_int32(cert_storage_depth, 0,
              "Subdirectory depth for certificates; if the directory is not "
@@ -35,6 +46,19 @@ DEFINE_int32(tree_storage_depth, 0,
              "Subdirectory depth for tree signatures; if the directory is not "
              "empty, must match the existing depth");
 
+DEFINE_int32(entry_cache_mb, 0,
+             "Size of the cache of entries read from the database, in "
+             "megabytes, or 0 for none.");
+DEFINE_int64(entry_cache_right_edge, 1 << 16,
+             "Entries this close to the tree size are cached the first time "
+             "they are read, older ones the second time. Reads of get-entries "
+             "ranges starting further back are taken to be bulk scans, which "
+             "do not fill the caches.");
+DEFINE_int32(chain_dedup_certificates, 0,
+             "If not 0, chain certificates already stored in another entry "
+             "are stored as a reference to it, and this many of them are "
+             "remembered. Once set, must stay set for the same database.");
+
 // Basic sanity checks on flag values.
 static bool ValidateWrite(const char* flagname, const string& path) {
   if (path != "" && access(path.c_str(), W_OK) != 0) {
@@ -69,17 +93,31 @@ static const bool cert_dir_dummy =
 static const bool tree_dir_dummy =
     RegisterFlagValidator(&FLAGS_tree_dir, &ValidateWrite);
 
+static const bool segment_db_dummy =
+    RegisterFlagValidator(&FLAGS_segment_db, &ValidateWrite);
+
+static const bool segment_db_cold_dir_dummy =
+    RegisterFlagValidator(&FLAGS_segment_db_cold_dir, &ValidateWrite);
+
 static const bool c_st_dummy =
     RegisterFlagValidator(&FLAGS_cert_storage_depth, &ValidateIsNonNegative);
 
 static const bool t_st_dummy =
     RegisterFlagValidator(&FLAGS_tree_storage_depth, &ValidateIsNonNegative);
 
+static const bool entry_cache_dummy =
+    RegisterFlagValidator(&FLAGS_entry_cache_mb, &ValidateIsNonNegative);
+
+static const bool chain_dedup_dummy =
+    RegisterFlagValidator(&FLAGS_chain_dedup_certificates,
+                          &ValidateIsNonNegative);
+
 namespace cert_trans {
 
 void EnsureValidatorsRegistered() {
-  CHECK(cert_dir_dummy && tree_dir_dummy && c_st_dummy && t_st_dummy &&
-        port_dummy);
+  CHECK(cert_dir_dummy && tree_dir_dummy && segment_db_dummy &&
+        segment_db_cold_dir_dummy && c_st_dummy && t_st_dummy &&
+        entry_cache_dummy && chain_dedup_dummy && port_dummy);
 }
 
 
@@ -102,28 +140,53 @@ bool IsStandalone(bool warn_data_loss) {
 
 unique_ptr<Database> ProvideDatabase() {
   if (!FLAGS_sqlite_db.empty() + !FLAGS_leveldb_db.empty() +
+          !FLAGS_rocksdb_db.empty() + !FLAGS_segment_db.empty() +
           (!FLAGS_cert_dir.empty() | !FLAGS_tree_dir.empty()) !=
       1) {
     LOG(FATAL) << "Must specify exactly one database type. Check flags.";
   }
 
-  if (FLAGS_sqlite_db.empty() && FLAGS_leveldb_db.empty()) {
+  if (FLAGS_sqlite_db.empty() && FLAGS_leveldb_db.empty() &&
+      FLAGS_rocksdb_db.empty() && FLAGS_segment_db.empty()) {
     CHECK_NE(FLAGS_cert_dir, FLAGS_tree_dir)
         << "Certificate directory and tree directory must differ";
   }
 
+  unique_ptr<Database> db;
   if (!FLAGS_sqlite_db.empty()) {
-    return unique_ptr<Database>(new SQLiteDB(FLAGS_sqlite_db));
+    db.reset(new SQLiteDB(FLAGS_sqlite_db));
   } else if (!FLAGS_leveldb_db.empty()) {
-    return unique_ptr<Database>(new LevelDB(FLAGS_leveldb_db));
+    db.reset(new LevelDB(FLAGS_leveldb_db));
+  } else if (!FLAGS_rocksdb_db.empty()) {
+#ifdef HAVE_ROCKSDB
+    db.reset(new RocksDB(FLAGS_rocksdb_db));
+#else
+    LOG(FATAL) << "--rocksdb_db given, but built without RocksDB";
+#endif
+  } else if (!FLAGS_segment_db.empty() &&
+             !FLAGS_segment_db_cold_dir.empty()) {
+    db.reset(new SegmentDB(FLAGS_segment_db, FLAGS_segment_db_cold_dir,
+                           FLAGS_segment_db_hot_entries));
+  } else if (!FLAGS_segment_db.empty()) {
+    db.reset(new SegmentDB(FLAGS_segment_db));
   } else {
-    return unique_ptr<Database>(
+    db.reset(
         new FileDB(new FileStorage(FLAGS_cert_dir, FLAGS_cert_storage_depth),
                    new FileStorage(FLAGS_tree_dir, FLAGS_tree_storage_depth),
                    new FileStorage(FLAGS_meta_dir, 0)));
   }
 
-  LOG(FATAL) << "No usable database is configured by flags";
+  if (FLAGS_chain_dedup_certificates > 0) {
+    db.reset(new ChainDedupDatabase(
+        db.release(), static_cast<size_t>(FLAGS_chain_dedup_certificates)));
+  }
+  // Cache the entries decoded.
+  if (FLAGS_entry_cache_mb > 0) {
+    db.reset(new CachingDatabase(
+        db.release(), static_cast<size_t>(FLAGS_entry_cache_mb) << 20,
+        FLAGS_entry_cache_right_edge));
+  }
+  return db;
 }
 
 
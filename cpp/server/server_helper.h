@@ -1,6 +1,8 @@
 #ifndef CERT_TRANS_SERVER_SERVER_HELPER_H_
 #define CERT_TRANS_SERVER_SERVER_HELPER_H_
 
+#include "config.h"
+
 #include <gflags/gflags.h>
 #include <openssl/crypto.h>
 #include <chrono>
@@ -11,10 +13,16 @@
 #include <memory>
 #include <mutex>
 
+#include "log/caching_database.h"
+#include "log/chain_dedup_database.h"
 #include "log/database.h"
 #include "log/file_db.h"
 #include "log/file_storage.h"
 #include "log/leveldb_db.h"
+#ifdef HAVE_ROCKSDB
+#include "log/rocksdb_db.h"
+#endif
+#include "log/segment_db.h"
 #include "log/sqlite_db.h"
 #include "util/etcd.h"
 #include "util/executor.h"
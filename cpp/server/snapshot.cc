@@ -0,0 +1,638 @@
+#include "server/snapshot.h"
+
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <glog/logging.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "base/notification.h"
+#include "log/database.h"
+#include "log/log_verifier.h"
+#include "log/logged_entry.h"
+#include "log/tree_signer.h"
+#include "merkletree/compact_merkle_tree.h"
+#include "merkletree/serial_hasher.h"
+#include "monitoring/startup.h"
+#include "net/url.h"
+#include "net/url_fetcher.h"
+#include "server/json_output.h"
+#include "util/executor.h"
+#include "util/libevent_wrapper.h"
+#include "util/parallel_for.h"
+#include "util/status.h"
+#include "util/task.h"
+
+using cert_trans::libevent::Base;
+using cert_trans::libevent::HttpServer;
+using ct::CompactTreeCheckpoint;
+using ct::SignedTreeHead;
+using std::bind;
+using std::condition_variable;
+using std::deque;
+using std::lock_guard;
+using std::min;
+using std::move;
+using std::mutex;
+using std::placeholders::_1;
+using std::placeholders::_2;
+using std::string;
+using std::to_string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+using util::Executor;
+using util::Status;
+using util::StatusOr;
+using util::Task;
+
+namespace cert_trans {
+namespace {
+
+
+// The most entries, and the most bytes of them, that are read and
+// sent at once.
+const int64_t kSnapshotBatchEntries = 1000;
+const size_t kSnapshotBatchBytes = 4 << 20;
+// How far the entries received can get ahead of those written,
+// before the reply is no longer read.
+const size_t kMaxUnwrittenBytes = 64 << 20;
+// How often the tree of the entries loaded is checkpointed.
+const int64_t kCheckpointEntries = 100000;
+const size_t kMaxVarint32Bytes = 5;
+
+
+// Appends |message| to |buffer| the way WriteDelimitedTo() would.
+template <class Message>
+void AddDelimited(const Message& message, evbuffer* buffer) {
+  using google::protobuf::io::CodedOutputStream;
+  const int size(message.ByteSize());
+  const int length(CodedOutputStream::VarintSize32(size) + size);
+  evbuffer_iovec iov;
+  CHECK_EQ(evbuffer_reserve_space(buffer, length, &iov, 1), 1);
+  uint8_t* const data(static_cast<uint8_t*>(iov.iov_base));
+  message.SerializeWithCachedSizesToArray(
+      CodedOutputStream::WriteVarint32ToArray(size, data));
+  iov.iov_len = length;
+  CHECK_EQ(evbuffer_commit_space(buffer, &iov, 1), 0);
+}
+
+
+// Streams a snapshot to one client. It goes back and forth between
+// |executor_|, where the entries are read, and the loop of the
+// request, where they are sent from, and deletes itself once it is
+// done, or once the connection is closed.
+class SnapshotStream {
+ public:
+  SnapshotStream(Base* base, const ReadOnlyDatabase* db, Executor* executor,
+                 evhttp_request* req, int64_t start)
+      : base_(base),
+        db_(db),
+        executor_(executor),
+        req_(req),
+        loop_(libevent::RequestLoop(req)),
+        buffer_(CHECK_NOTNULL(evbuffer_new()), &evbuffer_free),
+        next_(start),
+        end_(-1),
+        error_code_(0),
+        failed_(false),
+        started_(false),
+        reading_(true),
+        closed_(false) {
+  }
+  SnapshotStream(const SnapshotStream&) = delete;
+  SnapshotStream& operator=(const SnapshotStream&) = delete;
+
+  void Start() {
+    executor_->Add(bind(&SnapshotStream::Read, this));
+  }
+
+ private:
+  static void ChunkSent(evhttp_connection* conn, void* arg);
+  static void ConnectionClosed(evhttp_connection* conn, void* arg);
+
+  // Reads the tree head, the first time, and the next batch of
+  // entries into |buffer_|.
+  void Read();
+  // Sends |buffer_|, on the loop of the request.
+  void Send();
+
+  Base* const base_;
+  const ReadOnlyDatabase* const db_;
+  Executor* const executor_;
+  evhttp_request* const req_;
+  Base* const loop_;
+  const unique_ptr<evbuffer, void (*)(evbuffer*)> buffer_;
+
+  int64_t next_;
+  // The size of the tree head being sent, once it has been read.
+  int64_t end_;
+  // Set if the reply cannot be started.
+  int error_code_;
+  string error_;
+  // Set if an entry could not be read after the reply started, in
+  // which case it is cut short.
+  bool failed_;
+
+  // Only used on the loop: whether the reply has started, whether the
+  // stream is reading or about to send, rather than waiting for a
+  // chunk to go out, and whether the connection has been closed
+  // meanwhile.
+  bool started_;
+  bool reading_;
+  bool closed_;
+};
+
+
+// static
+void SnapshotStream::ChunkSent(evhttp_connection*, void* arg) {
+  SnapshotStream* const stream(static_cast<SnapshotStream*>(arg));
+  stream->reading_ = true;
+  stream->executor_->Add(bind(&SnapshotStream::Read, stream));
+}
+
+
+// static
+void SnapshotStream::ConnectionClosed(evhttp_connection*, void* arg) {
+  SnapshotStream* const stream(static_cast<SnapshotStream*>(arg));
+  if (stream->reading_) {
+    // Send() deletes it, once the read is done.
+    stream->closed_ = true;
+  } else {
+    delete stream;
+  }
+}
+
+
+void SnapshotStream::Read() {
+  if (end_ < 0) {
+    SignedTreeHead sth;
+    if (db_->LatestTreeHead(&sth) != Database::LOOKUP_OK) {
+      error_code_ = HTTP_SERVUNAVAIL;
+      error_ = "No tree head yet.";
+    } else if (next_ > sth.tree_size()) {
+      error_code_ = HTTP_BADREQUEST;
+      error_ = "\"start\" is past the tree head.";
+    } else {
+      end_ = sth.tree_size();
+      AddDelimited(sth, buffer_.get());
+    }
+  } else if (next_ < end_) {
+    vector<LoggedEntry> entries;
+    db_->ReadEntries(next_, min(end_, next_ + kSnapshotBatchEntries) - 1,
+                     kSnapshotBatchBytes, ReadOnlyDatabase::BULK_SCAN,
+                     &entries);
+    if (entries.empty()) {
+      LOG(WARNING) << "Snapshot stopped short, at missing entry " << next_;
+      failed_ = true;
+    }
+    for (const LoggedEntry& entry : entries) {
+      AddDelimited(entry, buffer_.get());
+    }
+    next_ += entries.size();
+  }
+
+  loop_->Add(bind(&SnapshotStream::Send, this));
+}
+
+
+void SnapshotStream::Send() {
+  reading_ = false;
+  if (closed_) {
+    delete this;
+    return;
+  }
+  if (error_code_ != 0) {
+    SendJsonError(base_, req_, error_code_, error_);
+    delete this;
+    return;
+  }
+
+  evhttp_connection* const conn(evhttp_request_get_connection(req_));
+  if (!started_) {
+    if (next_ >= end_) {
+      // Only the tree head: that is the whole reply.
+      SendBinaryReply(base_, req_, HTTP_OK, buffer_.get());
+      delete this;
+      return;
+    }
+    CHECK_EQ(evhttp_add_header(evhttp_request_get_output_headers(req_),
+                               "Content-Type", "application/octet-stream"),
+             0);
+    evhttp_send_reply_start(req_, HTTP_OK, /*reason*/ nullptr);
+    evhttp_connection_set_closecb(conn, &SnapshotStream::ConnectionClosed,
+                                  this);
+    started_ = true;
+  }
+
+  if (next_ >= end_ || failed_) {
+    evhttp_send_reply_chunk(req_, buffer_.get());
+    evhttp_connection_set_closecb(conn, nullptr, nullptr);
+    evhttp_send_reply_end(req_);
+    delete this;
+    return;
+  }
+  evhttp_send_reply_chunk_with_cb(req_, buffer_.get(),
+                                  &SnapshotStream::ChunkSent, this);
+}
+
+
+void GetSnapshot(Base* base, const ReadOnlyDatabase* db, Executor* executor,
+                 evhttp_request* req) {
+  if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+    return SendJsonError(base, req, HTTP_BADMETHOD, "Method not allowed.");
+  }
+  const int64_t start(
+      libevent::GetIntParam(libevent::ParseQuery(req), "start"));
+  if (start < 0) {
+    return SendJsonError(base, req, HTTP_BADREQUEST,
+                         "Missing or invalid \"start\" parameter.");
+  }
+
+  (new SnapshotStream(base, db, executor, req, start))->Start();
+}
+
+
+// Loads a snapshot into a database, see LoadSnapshot(). The reply is
+// parsed as it arrives, on the loop of the fetcher, and the entries
+// handed over a batch at a time to the thread calling Load(), which
+// checks and writes them.
+class SnapshotLoader {
+ public:
+  SnapshotLoader(const LogVerifier* verifier, Executor* executor,
+                 Database* db)
+      : verifier_(verifier),
+        executor_(executor),
+        db_(db),
+        fetch_task_(bind(&SnapshotLoader::FetchDone, this, _1), executor),
+        have_sth_(false),
+        fetch_done_(false),
+        failed_(false),
+        unwritten_bytes_(0),
+        parse_ok_(true),
+        batch_bytes_(0) {
+  }
+  SnapshotLoader(const SnapshotLoader&) = delete;
+  SnapshotLoader& operator=(const SnapshotLoader&) = delete;
+
+  StatusOr<SignedTreeHead> Load(UrlFetcher* fetcher, URL url);
+
+ private:
+  struct Batch {
+    vector<LoggedEntry> entries;
+    size_t bytes;
+  };
+
+  // Restores the tree of the entries already in |db_|.
+  unique_ptr<CompactMerkleTree> RestoreTree() const;
+  // Stops the fetch, and returns |status|.
+  Status Fail(const Status& status);
+  Status WriteBatch(Batch* batch, CompactMerkleTree* tree);
+  Status WriteCheckpoint(CompactMerkleTree* tree);
+
+  // On the loop of the fetcher.
+  void Add(const char* data, size_t size);
+  bool AddRecord(const char* data, size_t size);
+  void PushBatch();
+  void FetchDone(Task* task);
+
+  const LogVerifier* const verifier_;
+  Executor* const executor_;
+  Database* const db_;
+  UrlFetcher::Response response_;
+  Task fetch_task_;
+  Notification fetched_;
+
+  mutex lock_;
+  condition_variable cond_;
+  bool have_sth_;
+  SignedTreeHead sth_;
+  deque<Batch> batches_;
+  bool fetch_done_;
+  bool failed_;
+  size_t unwritten_bytes_;
+
+  // Only used on the loop of the fetcher.
+  bool parse_ok_;
+  string pending_;
+  vector<LoggedEntry> batch_;
+  size_t batch_bytes_;
+};
+
+
+StatusOr<SignedTreeHead> SnapshotLoader::Load(UrlFetcher* fetcher, URL url) {
+  const unique_ptr<CompactMerkleTree> tree(RestoreTree());
+  int64_t next(tree->LeafCount());
+  int64_t checkpointed(next);
+  url.SetQuery("start=" + to_string(next));
+  LOG(INFO) << "Loading the snapshot of " << url.Host() << " from entry "
+            << next;
+
+  response_.body_sink = bind(&SnapshotLoader::Add, this, _1, _2);
+  fetcher->Fetch(UrlFetcher::Request(url), &response_, &fetch_task_);
+
+  unique_lock<mutex> lock(lock_);
+  cond_.wait(lock, [this]() { return have_sth_ || fetch_done_; });
+  if (!have_sth_) {
+    lock.unlock();
+    fetched_.WaitForNotification();
+    if (!fetch_task_.status().ok()) {
+      return fetch_task_.status();
+    }
+    return Status(util::error::UNAVAILABLE,
+                  "could not get a snapshot, HTTP status " +
+                      to_string(response_.status_code) + ": " +
+                      response_.body);
+  }
+  const SignedTreeHead sth(sth_);
+  lock.unlock();
+
+  const LogVerifier::LogVerifyResult verify_result(
+      verifier_->VerifySignedTreeHead(sth));
+  if (verify_result != LogVerifier::VERIFY_OK) {
+    return Fail(Status(util::error::FAILED_PRECONDITION,
+                       "the tree head of the snapshot did not verify: " +
+                           LogVerifier::VerifyResultString(verify_result)));
+  }
+  StartupPhase phase("load_snapshot");
+  phase.SetTotal(sth.tree_size());
+  phase.AddDone(next);
+
+  lock.lock();
+  while (true) {
+    cond_.wait(lock, [this]() { return !batches_.empty() || fetch_done_; });
+    if (batches_.empty()) {
+      break;
+    }
+    Batch batch(move(batches_.front()));
+    batches_.pop_front();
+    lock.unlock();
+
+    Status status(WriteBatch(&batch, tree.get()));
+    next = tree->LeafCount();
+    if (status.ok() && next - checkpointed >= kCheckpointEntries) {
+      status = WriteCheckpoint(tree.get());
+      checkpointed = next;
+    }
+    if (!status.ok()) {
+      return Fail(status);
+    }
+    phase.AddDone(batch.entries.size());
+
+    lock.lock();
+    unwritten_bytes_ -= batch.bytes;
+    cond_.notify_all();
+  }
+  lock.unlock();
+  fetched_.WaitForNotification();
+
+  if (!fetch_task_.status().ok()) {
+    return fetch_task_.status();
+  }
+  if (!parse_ok_ || !pending_.empty()) {
+    return Status(util::error::DATA_LOSS, "malformed snapshot");
+  }
+  if (next != sth.tree_size()) {
+    return Status(util::error::UNAVAILABLE,
+                  "the snapshot stopped at entry " + to_string(next) +
+                      " of " + to_string(sth.tree_size()));
+  }
+  if (tree->CurrentRoot() != sth.sha256_root_hash()) {
+    return Status(util::error::DATA_LOSS,
+                  "the root of the entries of the snapshot does not match "
+                  "its tree head");
+  }
+  const Status status(WriteCheckpoint(tree.get()));
+  if (!status.ok()) {
+    return status;
+  }
+  const Database::WriteResult result(db_->WriteTreeHead(sth));
+  // Already there, if the snapshot was loaded before.
+  if (result != Database::OK &&
+      result != Database::DUPLICATE_TREE_HEAD_TIMESTAMP) {
+    return Status(util::error::INTERNAL,
+                  "could not write the tree head: " + to_string(result));
+  }
+  LOG(INFO) << "Loaded the snapshot, up to a tree of " << sth.tree_size()
+            << " entries";
+  return sth;
+}
+
+
+unique_ptr<CompactMerkleTree> SnapshotLoader::RestoreTree() const {
+  unique_ptr<CompactMerkleTree> tree(TreeSigner::TreeFromCheckpoint(db_));
+  if (tree) {
+    return tree;
+  }
+
+  tree.reset(new CompactMerkleTree(unique_ptr<Sha256Hasher>(new Sha256Hasher)));
+  const int64_t tree_size(db_->TreeSize());
+  if (tree_size > 0) {
+    LOG(INFO) << "Rebuilding the tree of the " << tree_size
+              << " entries already in the database";
+    const unique_ptr<ReadOnlyDatabase::LeafHashIterator> it(
+        db_->ScanLeafHashes(0));
+    int64_t sequence_number;
+    string leaf_hash;
+    while (static_cast<int64_t>(tree->LeafCount()) < tree_size &&
+           it->GetNextLeafHash(&sequence_number, &leaf_hash)) {
+      CHECK_EQ(static_cast<int64_t>(tree->LeafCount()), sequence_number);
+      tree->AddLeafHash(leaf_hash);
+    }
+  }
+  return tree;
+}
+
+
+Status SnapshotLoader::Fail(const Status& status) {
+  {
+    lock_guard<mutex> lock(lock_);
+    failed_ = true;
+    batches_.clear();
+  }
+  cond_.notify_all();
+  fetch_task_.Cancel();
+  fetched_.WaitForNotification();
+  return status;
+}
+
+
+Status SnapshotLoader::WriteBatch(Batch* batch, CompactMerkleTree* tree) {
+  vector<LoggedEntry>* const entries(&batch->entries);
+  const int64_t first(tree->LeafCount());
+  for (size_t i = 0; i < entries->size(); ++i) {
+    if ((*entries)[i].sequence_number() != first + static_cast<int64_t>(i)) {
+      return Status(util::error::DATA_LOSS,
+                    "the snapshot skipped entry " + to_string(first + i));
+    }
+  }
+
+  // The hashes that came with the entries, if any, are not trusted:
+  // they are what the tree is checked with.
+  vector<string> leaf_hashes(entries->size());
+  util::ParallelFor(executor_, entries->size(), [&](size_t i) {
+    LoggedEntry* const entry(&(*entries)[i]);
+    entry->clear_entry_hash();
+    entry->clear_merkle_leaf_hash();
+    CHECK(entry->CacheHashes());
+    leaf_hashes[i] = entry->merkle_leaf_hash();
+  });
+
+  vector<const LoggedEntry*> to_write;
+  to_write.reserve(entries->size());
+  for (const LoggedEntry& entry : *entries) {
+    to_write.push_back(&entry);
+  }
+  const Database::WriteResult result(db_->CreateSequencedEntries(to_write));
+  if (result != Database::OK) {
+    return Status(util::error::INTERNAL,
+                  "could not write the entries from " + to_string(first) +
+                      ": " + to_string(result));
+  }
+  tree->AddLeafHashes(leaf_hashes, executor_);
+  return util::OkStatus();
+}
+
+
+Status SnapshotLoader::WriteCheckpoint(CompactMerkleTree* tree) {
+  CompactTreeCheckpoint checkpoint;
+  checkpoint.set_tree_size(tree->LeafCount());
+  for (const string& node : tree->Frontier()) {
+    checkpoint.add_frontier(node);
+  }
+  checkpoint.set_sha256_root_hash(tree->CurrentRoot());
+  const Database::WriteResult result(db_->WriteTreeCheckpoint(checkpoint));
+  if (result != Database::OK) {
+    return Status(util::error::INTERNAL,
+                  "could not write the tree checkpoint: " +
+                      to_string(result));
+  }
+  return util::OkStatus();
+}
+
+
+void SnapshotLoader::Add(const char* data, size_t size) {
+  if (!parse_ok_) {
+    return;
+  }
+  pending_.append(data, size);
+
+  size_t offset(0);
+  while (parse_ok_ && offset < pending_.size()) {
+    const size_t available(pending_.size() - offset);
+    google::protobuf::io::CodedInputStream input(
+        reinterpret_cast<const uint8_t*>(pending_.data() + offset),
+        available);
+    uint32_t length;
+    if (!input.ReadVarint32(&length)) {
+      // Either the length is not all there yet, or it is garbage.
+      parse_ok_ = available < kMaxVarint32Bytes;
+      break;
+    }
+    const size_t header(input.CurrentPosition());
+    if (available - header < length) {
+      break;
+    }
+    parse_ok_ = AddRecord(pending_.data() + offset + header, length);
+    offset += header + length;
+  }
+  pending_.erase(0, offset);
+
+  if (batch_.size() >= static_cast<size_t>(kSnapshotBatchEntries) ||
+      batch_bytes_ >= kSnapshotBatchBytes) {
+    PushBatch();
+  }
+}
+
+
+bool SnapshotLoader::AddRecord(const char* data, size_t size) {
+  {
+    lock_guard<mutex> lock(lock_);
+    if (failed_) {
+      return false;
+    }
+    if (!have_sth_) {
+      if (!sth_.ParseFromArray(data, size)) {
+        return false;
+      }
+      have_sth_ = true;
+      cond_.notify_all();
+      return true;
+    }
+  }
+
+  batch_.emplace_back();
+  batch_bytes_ += size;
+  return batch_.back().ParseFromArray(data, size) &&
+         batch_.back().has_sequence_number();
+}
+
+
+// Waits while too many entries are waiting to be written: holding up
+// the loop holds up the reply too, and so the peer sending it.
+void SnapshotLoader::PushBatch() {
+  unique_lock<mutex> lock(lock_);
+  cond_.wait(lock, [this]() {
+    return failed_ || unwritten_bytes_ < kMaxUnwrittenBytes;
+  });
+  if (!failed_ && !batch_.empty()) {
+    batches_.push_back(Batch{move(batch_), batch_bytes_});
+    unwritten_bytes_ += batch_bytes_;
+    cond_.notify_all();
+  }
+  batch_.clear();
+  batch_bytes_ = 0;
+}
+
+
+void SnapshotLoader::FetchDone(Task* task) {
+  // The last of the reply has gone through Add() by now.
+  if (task->status().ok() && parse_ok_) {
+    PushBatch();
+  }
+  {
+    lock_guard<mutex> lock(lock_);
+    fetch_done_ = true;
+  }
+  cond_.notify_all();
+  fetched_.Notify();
+}
+
+
+}  // namespace
+
+
+void AddSnapshotHandler(Base* base, const ReadOnlyDatabase* db,
+                        Executor* executor, HttpServer* server) {
+  CHECK_NOTNULL(base);
+  CHECK_NOTNULL(db);
+  CHECK_NOTNULL(executor);
+  CHECK(CHECK_NOTNULL(server)->AddHandler(
+      "/ct/v1/get-snapshot", bind(GetSnapshot, base, db, executor, _1)));
+}
+
+
+StatusOr<SignedTreeHead> LoadSnapshot(UrlFetcher* fetcher,
+                                      const string& peer_url,
+                                      const LogVerifier* verifier,
+                                      Executor* executor, Database* db) {
+  URL url(peer_url);
+  string path(url.Path());
+  if (path.empty() || path.back() != '/') {
+    path.push_back('/');
+  }
+  url.SetPath(path + "ct/v1/get-snapshot");
+
+  SnapshotLoader loader(CHECK_NOTNULL(verifier), CHECK_NOTNULL(executor),
+                        CHECK_NOTNULL(db));
+  return loader.Load(CHECK_NOTNULL(fetcher), url);
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,65 @@
+#ifndef CERT_TRANS_SERVER_SNAPSHOT_H_
+#define CERT_TRANS_SERVER_SNAPSHOT_H_
+
+#include <string>
+
+#include "proto/ct.pb.h"
+#include "util/statusor.h"
+
+class LogVerifier;
+
+namespace util {
+class Executor;
+}  // namespace util
+
+namespace cert_trans {
+namespace libevent {
+class Base;
+class HttpServer;
+}  // namespace libevent
+
+class Database;
+class ReadOnlyDatabase;
+class UrlFetcher;
+
+
+// Snapshots let a new node of a cluster start from the database of
+// another node, instead of having the ContinuousFetcher fetch the
+// whole log a range at a time, checking the signature of every entry.
+//
+// A snapshot is streamed in a single reply, from
+// /ct/v1/get-snapshot?start=N: the latest tree head of the database
+// (a SignedTreeHead), then its entries from N up to the size of that
+// tree (each a LoggedEntryPB), every one of them preceded by its
+// length as a varint, like in get-logged-entries. Since the entries
+// in a tree are never changed, that is a consistent snapshot.
+
+// Adds the /ct/v1/get-snapshot handler to |server|, serving the
+// snapshot of |db|. The entries are read on |executor|, a batch at a
+// time, each once the one before has been sent, so that a slow
+// client does not make the server buffer the whole database. Errors
+// are sent through |base|.
+void AddSnapshotHandler(libevent::Base* base, const ReadOnlyDatabase* db,
+                        util::Executor* executor,
+                        libevent::HttpServer* server);
+
+
+// Loads the snapshot of the node at |peer_url| into |db|, and returns
+// its tree head. The tree head is checked with |verifier|, and the
+// entries by building their tree (hashing on |executor|) and checking
+// its root against it, rather than by checking their SCTs one by one.
+//
+// The tree is checkpointed in |db| as the entries are written, so
+// that the load can resume from there if it is interrupted, and the
+// tree signer can start from there once it is done. The tree head is
+// only written to |db| once all its entries have been.
+util::StatusOr<ct::SignedTreeHead> LoadSnapshot(UrlFetcher* fetcher,
+                                                const std::string& peer_url,
+                                                const LogVerifier* verifier,
+                                                util::Executor* executor,
+                                                Database* db);
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_SNAPSHOT_H_
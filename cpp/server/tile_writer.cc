@@ -0,0 +1,334 @@
+#include "server/tile_writer.h"
+
+#include <errno.h>
+#include <glog/logging.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "log/database.h"
+#include "log/logged_entry.h"
+#include "merkletree/serial_hasher.h"
+#include "server/json_output.h"
+#include "util/json_wrapper.h"
+#include "util/util.h"
+
+using ct::SignedTreeHead;
+using std::min;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+using util::Status;
+
+namespace cert_trans {
+namespace {
+
+
+const char kEntries[] = "entries";
+
+
+bool FileExists(const string& path) {
+  if (access(path.c_str(), F_OK) == 0) {
+    return true;
+  }
+  PCHECK(errno == ENOENT) << "Failed to check for " << path;
+  return false;
+}
+
+
+}  // namespace
+
+
+TileWriter::TileWriter(const ReadOnlyDatabase* db, const string& dir,
+                       int height)
+    : db_(CHECK_NOTNULL(db)),
+      dir_(dir),
+      height_(height),
+      width_(static_cast<int64_t>(1) << height),
+      hasher_(unique_ptr<SerialHasher>(new Sha256Hasher)) {
+  CHECK(!dir_.empty());
+  CHECK_GT(height_, 0);
+  CHECK_LT(height_, 32);
+}
+
+
+Status TileWriter::Write(const SignedTreeHead& sth) {
+  const int64_t tree_size(sth.tree_size());
+  if (tree_size > db_->TreeSize()) {
+    return Status(util::error::FAILED_PRECONDITION,
+                  "The database does not have all the entries of the tree "
+                  "yet.");
+  }
+
+  // Everything before the first missing full tile, at any level, is
+  // written. Start from there, after reading back the hashes that the
+  // tiles under way need from the tiles below them.
+  int64_t start(tree_size - tree_size % width_);
+  const int64_t full_entry_tiles(tree_size >> height_);
+  const int64_t written_entry_tiles(
+      FullTilesWritten(kEntries, full_entry_tiles));
+  if (written_entry_tiles < full_entry_tiles) {
+    start = written_entry_tiles << height_;
+  }
+  for (int level(0); (tree_size >> (level * height_)) >= width_; ++level) {
+    const int64_t full_tiles(tree_size >> ((level + 1) * height_));
+    const int64_t written(FullTilesWritten(to_string(level), full_tiles));
+    if (written < full_tiles) {
+      start = min(start, written << ((level + 1) * height_));
+    }
+  }
+
+  vector<Stratum> strata;
+  for (int level(0); level == 0 || (tree_size >> (level * height_)) > 0;
+       ++level) {
+    const int64_t next_node(start >> (level * height_));
+    strata.push_back(Stratum{next_node >> height_, 0, string()});
+    Stratum* const stratum(&strata.back());
+    for (int64_t node(stratum->index << height_); node < next_node; ++node) {
+      string root;
+      const Status status(ReadTileRoot(level - 1, node, &root));
+      if (!status.ok()) {
+        return status;
+      }
+      stratum->data.append(root);
+      ++stratum->count;
+    }
+  }
+  Stratum entries{start >> height_, 0, string()};
+
+  if (start < tree_size) {
+    const unique_ptr<ReadOnlyDatabase::Iterator> it(db_->ScanEntries(start));
+    LoggedEntry entry;
+    string leaf_input;
+    string extra_data;
+    for (int64_t i(start); i < tree_size; ++i) {
+      if (!it->GetNextEntry(&entry) || entry.sequence_number() != i) {
+        return Status(util::error::FAILED_PRECONDITION,
+                      "Entry " + to_string(i) + " is missing.");
+      }
+      if (!entry.SerializeForLeaf(&leaf_input) ||
+          !entry.SerializeExtraData(&extra_data)) {
+        return Status(util::error::INTERNAL, "Failed to serialize entry " +
+                                                 to_string(i) + ".");
+      }
+
+      if (entries.count > 0) {
+        entries.data.push_back(',');
+      }
+      entries.data.append(
+          JsonEntriesWriter::EncodeEntry(leaf_input, extra_data, nullptr));
+      if (++entries.count == width_) {
+        const Status status(WriteTile(kEntries, entries.index, 0,
+                                      "{\"entries\":[" + entries.data +
+                                          "]}"));
+        if (!status.ok()) {
+          return status;
+        }
+        ++entries.index;
+        entries.count = 0;
+        entries.data.clear();
+      }
+
+      const Status status(AddHash(0, hasher_.HashLeaf(leaf_input), &strata));
+      if (!status.ok()) {
+        return status;
+      }
+    }
+  }
+
+  if (entries.count > 0) {
+    const Status status(WriteTile(kEntries, entries.index, entries.count,
+                                  "{\"entries\":[" + entries.data + "]}"));
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  for (size_t level(0); level < strata.size(); ++level) {
+    const Stratum& stratum(strata[level]);
+    if (stratum.count > 0) {
+      const Status status(WriteTile(to_string(level), stratum.index,
+                                    stratum.count, stratum.data));
+      if (!status.ok()) {
+        return status;
+      }
+    }
+  }
+
+  if (RootHash(strata) != sth.sha256_root_hash()) {
+    return Status(util::error::DATA_LOSS,
+                  "The tiles do not match the root hash of the tree head of "
+                  "size " +
+                      to_string(tree_size) + ".");
+  }
+
+  JsonObject json_sth;
+  json_sth.Add("tree_size", sth.tree_size());
+  json_sth.Add("timestamp", sth.timestamp());
+  json_sth.AddBase64("sha256_root_hash", sth.sha256_root_hash());
+  json_sth.Add("tree_head_signature", sth.signature());
+  return WriteFile(dir_ + "/sth", json_sth.ToString());
+}
+
+
+// static
+string TileWriter::TilePath(const string& level, int64_t index, int count) {
+  CHECK_GE(index, 0);
+  string digits(to_string(index));
+  digits.insert(0, (3 - digits.size() % 3) % 3, '0');
+  string path("tile/" + level);
+  for (size_t i(0); i < digits.size(); i += 3) {
+    path.append(i + 3 < digits.size() ? "/x" : "/");
+    path.append(digits, i, 3);
+  }
+  if (count > 0) {
+    path.append(".p/" + to_string(count));
+  }
+  return path;
+}
+
+
+int64_t TileWriter::FullTilesWritten(const string& level,
+                                     int64_t full_tiles) const {
+  int64_t low(0);
+  int64_t high(full_tiles);
+  while (low < high) {
+    const int64_t middle(low + (high - low) / 2);
+    if (FileExists(dir_ + "/" + TilePath(level, middle, 0))) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+
+string TileWriter::SubtreeRoot(const char* hashes, int64_t count) const {
+  CHECK_GT(count, 0);
+  CHECK_EQ(count & (count - 1), 0);
+  const size_t digest_size(hasher_.DigestSize());
+  string level(hashes, count * digest_size);
+  for (; count > 1; count /= 2) {
+    for (int64_t i(0); i < count / 2; ++i) {
+      const string parent(
+          hasher_.HashChildren(&level[2 * i * digest_size],
+                               &level[(2 * i + 1) * digest_size]));
+      level.replace(i * digest_size, digest_size, parent);
+    }
+  }
+  level.resize(digest_size);
+  return level;
+}
+
+
+Status TileWriter::ReadTileRoot(int level, int64_t index,
+                                string* root) const {
+  const string path(dir_ + "/" + TilePath(to_string(level), index, 0));
+  string hashes;
+  if (!util::ReadBinaryFile(path, &hashes) ||
+      hashes.size() != width_ * hasher_.DigestSize()) {
+    return Status(util::error::DATA_LOSS, "Failed to read " + path + ".");
+  }
+  *root = SubtreeRoot(hashes.data(), width_);
+  return util::OkStatus();
+}
+
+
+Status TileWriter::AddHash(int level, const string& hash,
+                           vector<Stratum>* strata) const {
+  Stratum* const stratum(&(*strata)[level]);
+  stratum->data.append(hash);
+  if (++stratum->count < width_) {
+    return util::OkStatus();
+  }
+
+  const Status status(
+      WriteTile(to_string(level), stratum->index, 0, stratum->data));
+  if (!status.ok()) {
+    return status;
+  }
+  const string root(SubtreeRoot(stratum->data.data(), width_));
+  ++stratum->index;
+  stratum->count = 0;
+  stratum->data.clear();
+  // There is a stratum for every level that the tree reaches.
+  CHECK_LT(static_cast<size_t>(level + 1), strata->size());
+  return AddHash(level + 1, root, strata);
+}
+
+
+string TileWriter::RootHash(const vector<Stratum>& strata) const {
+  // The tree is made of complete subtrees, from the largest (leftmost)
+  // to the smallest: split what each stratum holds into those,
+  // starting from the top.
+  const size_t digest_size(hasher_.DigestSize());
+  vector<string> subtrees;
+  for (size_t level(strata.size()); level-- > 0;) {
+    const Stratum& stratum(strata[level]);
+    int64_t offset(0);
+    for (int64_t size(width_ / 2); size > 0; size /= 2) {
+      if (stratum.count & size) {
+        subtrees.push_back(
+            SubtreeRoot(&stratum.data[offset * digest_size], size));
+        offset += size;
+      }
+    }
+  }
+
+  if (subtrees.empty()) {
+    return hasher_.HashEmpty();
+  }
+  string root(subtrees.back());
+  for (size_t i(subtrees.size() - 1); i-- > 0;) {
+    root = hasher_.HashChildren(subtrees[i], root);
+  }
+  return root;
+}
+
+
+Status TileWriter::WriteTile(const string& level, int64_t index, int count,
+                             const string& data) const {
+  const string path(dir_ + "/" + TilePath(level, index, count));
+  // Tiles never change, so there is nothing to do if this one was
+  // written already.
+  if (FileExists(path)) {
+    return util::OkStatus();
+  }
+  return WriteFile(path, data);
+}
+
+
+Status TileWriter::WriteFile(const string& path, const string& data) const {
+  for (size_t slash(path.find('/', 1)); slash != string::npos;
+       slash = path.find('/', slash + 1)) {
+    if (mkdir(path.substr(0, slash).c_str(), 0755) != 0 && errno != EEXIST) {
+      return Status(util::error::INTERNAL,
+                    "Failed to create the directory of " + path + ": " +
+                        strerror(errno));
+    }
+  }
+
+  // The file is written under another name first, so that it is never
+  // served incomplete.
+  const string tmp_file(
+      util::WriteTemporaryBinaryFile(dir_ + "/.tmp-XXXXXX", data));
+  if (tmp_file.empty()) {
+    return Status(util::error::INTERNAL,
+                  "Failed to write a temporary file for " + path + ".");
+  }
+  chmod(tmp_file.c_str(), 0644);
+  if (rename(tmp_file.c_str(), path.c_str()) != 0) {
+    const string error(strerror(errno));
+    remove(tmp_file.c_str());
+    return Status(util::error::INTERNAL,
+                  "Failed to rename " + tmp_file + " to " + path + ": " +
+                      error);
+  }
+  return util::OkStatus();
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,111 @@
+#ifndef CERT_TRANS_SERVER_TILE_WRITER_H_
+#define CERT_TRANS_SERVER_TILE_WRITER_H_
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "merkletree/tree_hasher.h"
+#include "proto/ct.pb.h"
+#include "util/status.h"
+
+namespace cert_trans {
+
+class ReadOnlyDatabase;
+
+
+// Publishes a log as static files, which a CDN (or any plain web
+// server) can serve, and cache forever, so that the bulk of the read
+// traffic (the entries, and the hashes that proofs are made of) never
+// reaches the log nodes.
+//
+// The layout is that of tiled transparency logs: the Merkle tree is
+// cut into strata of |height| levels, and each stratum into tiles of
+// W = 2^|height| consecutive hashes (or entries):
+//
+//   tile/<L>/<N>       the hashes of the nodes N*W to N*W+W-1 at level
+//                      L*|height| of the tree (level 0 being the
+//                      leaves), back to back
+//   tile/entries/<N>   the entries N*W to N*W+W-1, as the body of the
+//                      get-entries reply for them
+//   sth                the body of the get-sth reply for the tree head
+//                      the tiles were last written for
+//
+// A node at level L*|height| is the root of a complete subtree, and
+// is also the root of the tile of level L-1 below it, so a full tile
+// is never changed by the tree growing. The hashes (or entries) of an
+// incomplete tile are written as <N>.p/<count>, which does not change
+// either. Only "sth" is ever rewritten. <N> is split into groups of
+// three digits, all but the last prefixed with "x" (tile 1234067 of
+// level 0 is tile/0/x001/x234/067), so that no directory grows too
+// large.
+class TileWriter {
+ public:
+  // Does not take ownership of |db|, which must outlive this
+  // instance. The files are written under |dir|.
+  TileWriter(const ReadOnlyDatabase* db, const std::string& dir,
+             int height = 8);
+  TileWriter(const TileWriter&) = delete;
+  TileWriter& operator=(const TileWriter&) = delete;
+
+  // Writes the tiles for the tree of |sth| that are not there yet,
+  // reading the entries they need from the database, and then, if they
+  // add up to the root hash of |sth|, replaces "sth" with it. Written
+  // tiles are not read again, other than the few which the next tile
+  // up needs, so this is cheap to call for every new tree head.
+  util::Status Write(const ct::SignedTreeHead& sth);
+
+  // The path of a tile, relative to the directory, for |level| (or
+  // "entries"), where |count| is the number of hashes (or entries) of
+  // a partial tile, or 0 for a full one.
+  static std::string TilePath(const std::string& level, int64_t index,
+                              int count);
+
+ private:
+  // The tile of a stratum (or of the entries) being filled by Write():
+  // the first |count| hashes (or rendered entries) of tile |index|.
+  struct Stratum {
+    int64_t index;
+    int64_t count;
+    std::string data;
+  };
+
+  // How many full tiles of |level| are written, out of |full_tiles|,
+  // assuming that they are written in order.
+  int64_t FullTilesWritten(const std::string& level,
+                           int64_t full_tiles) const;
+
+  // The root of the |count| hashes at |hashes|, which must be a power
+  // of two.
+  std::string SubtreeRoot(const char* hashes, int64_t count) const;
+
+  // The root of the full tile |index| of |level|, which is already
+  // written.
+  util::Status ReadTileRoot(int level, int64_t index,
+                            std::string* root) const;
+
+  // Adds |hash| to |strata| at |level|, writing out the tile it
+  // completes, and adding its root to the stratum above.
+  util::Status AddHash(int level, const std::string& hash,
+                       std::vector<Stratum>* strata) const;
+
+  // The root of the tree made of what |strata| holds.
+  std::string RootHash(const std::vector<Stratum>& strata) const;
+
+  util::Status WriteTile(const std::string& level, int64_t index, int count,
+                         const std::string& data) const;
+  util::Status WriteFile(const std::string& path,
+                         const std::string& data) const;
+
+  const ReadOnlyDatabase* const db_;
+  const std::string dir_;
+  const int height_;
+  const int64_t width_;
+  const TreeHasher hasher_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_TILE_WRITER_H_
@@ -0,0 +1,202 @@
+#include "server/tile_writer.h"
+
+#include <gtest/gtest.h>
+#include <stdio.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "log/database.h"
+#include "log/leveldb_db.h"
+#include "log/logged_entry.h"
+#include "log/test_db.h"
+#include "log/test_signer.h"
+#include "merkletree/merkle_tree.h"
+#include "merkletree/serial_hasher.h"
+#include "proto/cert_serializer.h"
+#include "util/json_wrapper.h"
+#include "util/status_test_util.h"
+#include "util/testing.h"
+#include "util/util.h"
+
+namespace cert_trans {
+namespace {
+
+using ct::SignedTreeHead;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+using util::testing::StatusIs;
+
+// Small tiles, so that a few dozen entries make several strata.
+const int kHeight = 2;
+const int64_t kWidth = 4;
+
+
+class TileWriterTest : public ::testing::Test {
+ protected:
+  TileWriterTest() : dir_(tmp_.TmpStorageDir() + "/tiles") {
+  }
+
+  LevelDB* db() const {
+    return test_db_.db();
+  }
+
+  // Adds entries to the database up to |tree_size|, and returns a tree
+  // head for them.
+  SignedTreeHead Grow(int64_t tree_size) {
+    while (static_cast<int64_t>(leaf_inputs_.size()) < tree_size) {
+      LoggedEntry entry;
+      test_signer_.CreateUnique(&entry);
+      entry.set_sequence_number(leaf_inputs_.size());
+      string leaf_input;
+      CHECK(entry.SerializeForLeaf(&leaf_input));
+      leaf_inputs_.emplace_back(leaf_input);
+      CHECK_EQ(Database::OK, db()->CreateSequencedEntry(entry));
+    }
+
+    SignedTreeHead sth;
+    sth.set_tree_size(tree_size);
+    sth.set_timestamp(tree_size + 1);
+    sth.set_sha256_root_hash(Root(0, tree_size));
+    return sth;
+  }
+
+  // The root of the tree of the leaves [begin, end).
+  string Root(int64_t begin, int64_t end) const {
+    MerkleTree tree(unique_ptr<SerialHasher>(new Sha256Hasher));
+    for (int64_t i(begin); i < end; ++i) {
+      tree.AddLeaf(leaf_inputs_[i]);
+    }
+    return tree.CurrentRoot();
+  }
+
+  string ReadTile(const string& level, int64_t index, int count) const {
+    string data;
+    EXPECT_TRUE(util::ReadBinaryFile(
+        dir_ + "/" + TileWriter::TilePath(level, index, count), &data))
+        << TileWriter::TilePath(level, index, count);
+    return data;
+  }
+
+  // Expects every tile of a tree of |tree_size| to be there, and right.
+  void ExpectTiles(int64_t tree_size) const {
+    for (int level(0); (tree_size >> (level * kHeight)) > 0; ++level) {
+      const int64_t nodes(tree_size >> (level * kHeight));
+      const int64_t node_leaves(1LL << (level * kHeight));
+      for (int64_t index(0); index * kWidth < nodes; ++index) {
+        const int count(
+            index < nodes / kWidth ? 0 : static_cast<int>(nodes % kWidth));
+        string expected;
+        for (int i(0); i < (count > 0 ? count : kWidth); ++i) {
+          const int64_t node(index * kWidth + i);
+          expected += Root(node * node_leaves, (node + 1) * node_leaves);
+        }
+        EXPECT_EQ(util::ToBase64(expected),
+                  util::ToBase64(ReadTile(to_string(level), index, count)))
+            << "level " << level << " tile " << index;
+      }
+    }
+
+    for (int64_t index(0); index * kWidth < tree_size; ++index) {
+      const int count(index < tree_size / kWidth
+                          ? 0
+                          : static_cast<int>(tree_size % kWidth));
+      JsonObject json(ReadTile("entries", index, count));
+      ASSERT_TRUE(json.Ok());
+      JsonArray entries(json, "entries");
+      ASSERT_TRUE(entries.Ok());
+      ASSERT_EQ(count > 0 ? count : kWidth, entries.Length());
+      for (int i(0); i < entries.Length(); ++i) {
+        JsonObject entry(entries, i);
+        JsonString leaf_input(entry, "leaf_input");
+        ASSERT_TRUE(leaf_input.Ok());
+        EXPECT_EQ(leaf_inputs_[index * kWidth + i], leaf_input.FromBase64());
+      }
+    }
+
+    string sth;
+    ASSERT_TRUE(util::ReadTextFile(dir_ + "/sth", &sth));
+    JsonObject json(sth);
+    JsonInt json_tree_size(json, "tree_size");
+    ASSERT_TRUE(json_tree_size.Ok());
+    EXPECT_EQ(tree_size, json_tree_size.Value());
+  }
+
+  TmpStorage tmp_;
+  const string dir_;
+  TestDB<LevelDB> test_db_;
+  TestSigner test_signer_;
+  vector<string> leaf_inputs_;
+};
+
+
+TEST_F(TileWriterTest, TilePath) {
+  EXPECT_EQ("tile/0/005", TileWriter::TilePath("0", 5, 0));
+  EXPECT_EQ("tile/2/999", TileWriter::TilePath("2", 999, 0));
+  EXPECT_EQ("tile/0/x001/x234/067", TileWriter::TilePath("0", 1234067, 0));
+  EXPECT_EQ("tile/entries/x001/000.p/7",
+            TileWriter::TilePath("entries", 1000, 7));
+}
+
+
+TEST_F(TileWriterTest, WritesTiles) {
+  TileWriter writer(db(), dir_, kHeight);
+  for (const int64_t tree_size : {0, 1, 5, 16, 17, 37, 70}) {
+    EXPECT_OK(writer.Write(Grow(tree_size)));
+    ExpectTiles(tree_size);
+  }
+}
+
+
+TEST_F(TileWriterTest, CarriesOnAfterInterruption) {
+  {
+    TileWriter writer(db(), dir_, kHeight);
+    EXPECT_OK(writer.Write(Grow(37)));
+  }
+  // As if interrupted before writing the higher tiles for 64 entries.
+  Grow(64);
+  {
+    TileWriter writer(db(), dir_, kHeight);
+    EXPECT_OK(writer.Write(Grow(48)));
+  }
+  ASSERT_EQ(0,
+            remove((dir_ + "/" + TileWriter::TilePath("1", 2, 0)).c_str()));
+
+  TileWriter writer(db(), dir_, kHeight);
+  EXPECT_OK(writer.Write(Grow(70)));
+  ExpectTiles(70);
+}
+
+
+TEST_F(TileWriterTest, ChecksRootHash) {
+  TileWriter writer(db(), dir_, kHeight);
+  EXPECT_OK(writer.Write(Grow(10)));
+
+  SignedTreeHead sth(Grow(20));
+  sth.set_sha256_root_hash(Root(0, 19));
+  EXPECT_THAT(writer.Write(sth), StatusIs(util::error::DATA_LOSS));
+  // The previous tree head is still the one published.
+  ExpectTiles(10);
+}
+
+
+TEST_F(TileWriterTest, NeedsAllEntries) {
+  TileWriter writer(db(), dir_, kHeight);
+  SignedTreeHead sth(Grow(10));
+  sth.set_tree_size(11);
+  EXPECT_THAT(writer.Write(sth),
+              StatusIs(util::error::FAILED_PRECONDITION));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  ConfigureSerializerForV1CT();
+  return RUN_ALL_TESTS();
+}
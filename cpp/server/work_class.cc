@@ -0,0 +1,87 @@
+#include "server/work_class.h"
+
+#include <glog/logging.h>
+
+#include "monitoring/latency.h"
+#include "monitoring/monitoring.h"
+#include "util/thread_pool.h"
+
+using std::bind;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::move;
+using std::string;
+
+namespace cert_trans {
+namespace {
+
+
+static Gauge<string>* work_pending(
+    Gauge<string>::New("work_pending", "class",
+                       "Number of units of work of a class queued or "
+                       "running."));
+static Counter<string>* work_refused(
+    Counter<string>::New("work_refused", "class",
+                         "Number of units of work of a class refused "
+                         "because too many were already pending."));
+static Latency<milliseconds, string> work_queue_wait_ms(
+    "work_queue_wait_ms", "class",
+    "Time spent by closures of a class waiting for a thread, in ms.");
+
+
+void RunQueued(const string* name, const steady_clock::time_point& queued,
+               const util::Closure& closure) {
+  work_queue_wait_ms.RecordLatency(*name, steady_clock::now() - queued);
+  closure();
+}
+
+
+}  // namespace
+
+
+WorkClass::WorkClass(const string& name, size_t num_threads, int max_pending)
+    : name_(name),
+      max_pending_(max_pending),
+      pending_(0),
+      pool_(new ThreadPool(name, num_threads)) {
+  CHECK_GT(max_pending_, 0);
+  work_pending->Set(name_, 0);
+}
+
+
+WorkClass::~WorkClass() {
+}
+
+
+bool WorkClass::Admit(int count) {
+  CHECK_GT(count, 0);
+  const int pending(pending_.fetch_add(count) + count);
+  if (pending > max_pending_) {
+    pending_ -= count;
+    work_refused->IncrementBy(name_, count);
+    return false;
+  }
+  work_pending->Set(name_, pending);
+  return true;
+}
+
+
+void WorkClass::Done(int count) {
+  const int pending(pending_ -= count);
+  CHECK_GE(pending, 0);
+  work_pending->Set(name_, pending);
+}
+
+
+void WorkClass::Add(util::Closure closure) {
+  pool_->Add(bind(&RunQueued, &name_, steady_clock::now(), move(closure)));
+}
+
+
+void WorkClass::Delay(const std::chrono::duration<double>& delay,
+                      util::Task* task) {
+  pool_->Delay(delay, task);
+}
+
+
+}  // namespace cert_trans
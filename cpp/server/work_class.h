@@ -0,0 +1,61 @@
+#ifndef CERT_TRANS_SERVER_WORK_CLASS_H_
+#define CERT_TRANS_SERVER_WORK_CLASS_H_
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+
+#include "util/executor.h"
+
+namespace cert_trans {
+
+class ThreadPool;
+
+
+// One kind of work done for HTTP requests (such as checking
+// submissions, or reading entries for get-entries), run on threads of
+// its own so that a surge of it does not hold up other requests, with
+// a bound on how much of it can be queued or running at a time.
+// Requests beyond that should be turned away right away, rather than
+// left waiting longer than clients would.
+//
+// Its metrics (how much is pending, how much was refused, and how long
+// closures wait before they run) are labelled with its name.
+//
+// This class is thread-safe.
+class WorkClass : public util::Executor {
+ public:
+  WorkClass(const std::string& name, size_t num_threads, int max_pending);
+  ~WorkClass();
+
+  // Counts |count| more units of work as pending and returns true,
+  // unless that would make for more than the maximum, in which case
+  // it returns false and counts nothing.
+  bool Admit(int count = 1);
+
+  // Counts |count| admitted units of work as done.
+  void Done(int count = 1);
+
+  // The units of work pending, as a fraction of the maximum.
+  double Load() const {
+    return static_cast<double>(pending_) / max_pending_;
+  }
+
+  void Add(util::Closure closure) override;
+  void Delay(const std::chrono::duration<double>& delay,
+             util::Task* task) override;
+
+ private:
+  const std::string name_;
+  const int max_pending_;
+  std::atomic<int> pending_;
+  // Last, so that it is stopped before the rest goes away.
+  const std::unique_ptr<ThreadPool> pool_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_SERVER_WORK_CLASS_H_
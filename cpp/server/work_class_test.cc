@@ -0,0 +1,49 @@
+#include <gtest/gtest.h>
+#include <atomic>
+
+#include "base/notification.h"
+#include "server/work_class.h"
+#include "util/testing.h"
+
+namespace {
+
+using cert_trans::Notification;
+using cert_trans::WorkClass;
+
+
+TEST(WorkClassTest, AdmitsUpToTheMaximum) {
+  WorkClass work("test", 1, 3);
+  EXPECT_TRUE(work.Admit(2));
+  EXPECT_FALSE(work.Admit(2));
+  EXPECT_TRUE(work.Admit());
+  EXPECT_FALSE(work.Admit());
+
+  work.Done(2);
+  EXPECT_TRUE(work.Admit(2));
+  EXPECT_FALSE(work.Admit());
+  work.Done(3);
+}
+
+
+TEST(WorkClassTest, RunsClosures) {
+  WorkClass work("test", 2, 1);
+  std::atomic<int> count(0);
+  Notification done;
+  for (int i = 0; i < 10; ++i) {
+    work.Add([&count, &done]() {
+      if (++count == 10) {
+        done.Notify();
+      }
+    });
+  }
+  done.WaitForNotification();
+  EXPECT_EQ(10, count);
+}
+
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
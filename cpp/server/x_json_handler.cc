@@ -1,21 +1,31 @@
 #include "server/x_json_handler.h"
 
+#include <event2/buffer.h>
+#include <gflags/gflags.h>
 #include <functional>
 
 #include "log/frontend.h"
+#include "merkletree/serial_hasher.h"
 #include "server/json_output.h"
 #include "util/statusor.h"
 #include "util/thread_pool.h"
 
+DEFINE_int32(xjson_recent_submissions, 10000,
+             "Number of add-json request bodies remembered with the SCT "
+             "they were given, so that resubmissions are answered without "
+             "parsing and queueing them again. 0 to disable.");
+
 namespace cert_trans {
 
 using ct::LogEntry;
 using ct::SignedCertificateTimestamp;
 using ct::X_JSON_ENTRY;
 using std::bind;
+using std::lock_guard;
 using std::make_shared;
 using std::move;
 using std::multimap;
+using std::mutex;
 using std::placeholders::_1;
 using std::shared_ptr;
 using std::string;
@@ -48,6 +58,19 @@ shared_ptr<JsonObject> ExtractJson(libevent::Base* base, evhttp_request* req) {
 }
 
 
+// The SHA-256 digest of the body of |req|, as received.
+string BodyDigest(evhttp_request* req) {
+  static const Sha256Hasher* const hasher(new Sha256Hasher);
+  evbuffer* const body(evhttp_request_get_input_buffer(req));
+  const size_t length(evbuffer_get_length(body));
+  // The JSON parser reads it again right after, so making it contiguous
+  // is no loss.
+  const char* const data(
+      reinterpret_cast<const char*>(evbuffer_pullup(body, -1)));
+  return hasher->Digest({SerialHasher::Piece(data, length)});
+}
+
+
 }  // namespace
 
 
@@ -75,17 +98,31 @@ void XJsonHttpHandler::AddHandlers(libevent::HttpServer* server) {
 
 
 void XJsonHttpHandler::AddJson(evhttp_request* req) {
+  string body_digest;
+  if (FLAGS_xjson_recent_submissions > 0 &&
+      evhttp_request_get_command(req) == EVHTTP_REQ_POST) {
+    body_digest = BodyDigest(req);
+    SignedCertificateTimestamp sct;
+    if (LookupRecentSubmission(body_digest, &sct)) {
+      return AddEntryReply(req, Status(util::error::ALREADY_EXISTS,
+                                       "entry already exists"),
+                           sct);
+    }
+  }
+
   shared_ptr<JsonObject> json(ExtractJson(event_base_, req));
   if (!json) {
     return;
   }
 
-  pool_->Add(bind(&XJsonHttpHandler::BlockingAddJson, this, req, json));
+  pool_->Add(bind(&XJsonHttpHandler::BlockingAddJson, this, req, json,
+                  body_digest));
 }
 
 
 void XJsonHttpHandler::BlockingAddJson(evhttp_request* req,
-                                       shared_ptr<JsonObject> json) const {
+                                       shared_ptr<JsonObject> json,
+                                       const string& body_digest) {
   SignedCertificateTimestamp sct;
 
   LogEntry entry;
@@ -93,9 +130,45 @@ void XJsonHttpHandler::BlockingAddJson(evhttp_request* req,
   entry.set_type(X_JSON_ENTRY);
   entry.mutable_x_json_entry()->set_json(json->ToString());
 
-  AddEntryReply(req, CHECK_NOTNULL(frontend_)
-                         ->QueueProcessedEntry(::util::OkStatus(), entry, &sct),
-                sct);
+  const Status status(CHECK_NOTNULL(frontend_)
+                          ->QueueProcessedEntry(::util::OkStatus(), entry,
+                                                &sct));
+  if (!body_digest.empty() &&
+      (status.ok() ||
+       status.CanonicalCode() == util::error::ALREADY_EXISTS)) {
+    AddRecentSubmission(body_digest, sct);
+  }
+
+  AddEntryReply(req, status, sct);
+}
+
+
+bool XJsonHttpHandler::LookupRecentSubmission(
+    const string& body_digest, SignedCertificateTimestamp* sct) {
+  lock_guard<mutex> lock(recent_lock_);
+  const auto it(recent_.find(body_digest));
+  if (it == recent_.end()) {
+    return false;
+  }
+  recent_lru_.splice(recent_lru_.begin(), recent_lru_, it->second);
+  sct->CopyFrom(it->second->second);
+  return true;
+}
+
+
+void XJsonHttpHandler::AddRecentSubmission(
+    const string& body_digest, const SignedCertificateTimestamp& sct) {
+  lock_guard<mutex> lock(recent_lock_);
+  if (recent_.find(body_digest) != recent_.end()) {
+    return;
+  }
+  recent_lru_.emplace_front(body_digest, sct);
+  recent_.emplace(body_digest, recent_lru_.begin());
+  while (recent_lru_.size() >
+         static_cast<size_t>(FLAGS_xjson_recent_submissions)) {
+    recent_.erase(recent_lru_.back().first);
+    recent_lru_.pop_back();
+  }
 }
 
 
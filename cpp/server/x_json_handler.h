@@ -1,7 +1,11 @@
 #ifndef CERT_TRANS_SERVER_X_JSON_HANDLER_H_
 #define CERT_TRANS_SERVER_X_JSON_HANDLER_H_
 
+#include <list>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 
 #include "log/logged_entry.h"
 #include "server/handler.h"
@@ -11,6 +15,12 @@
 namespace cert_trans {
 
 
+// Serves the "add-json" requests, on top of the usual ones.
+//
+// The SCTs given to the last --xjson_recent_submissions request bodies
+// are remembered, keyed by the SHA-256 digest of the body as it was
+// received, so that clients resubmitting the same documents get their
+// SCT back without them being parsed, serialized and queued again.
 class XJsonHttpHandler : public HttpHandler {
  public:
   // Does not take ownership of its parameters, which must outlive this
@@ -33,8 +43,25 @@ class XJsonHttpHandler : public HttpHandler {
 
   void AddJson(evhttp_request* req);
 
-  void BlockingAddJson(evhttp_request* req,
-                       std::shared_ptr<JsonObject> json) const;
+  // |body_digest| is empty if the submission is not to be remembered.
+  void BlockingAddJson(evhttp_request* req, std::shared_ptr<JsonObject> json,
+                       const std::string& body_digest);
+
+  // Returns whether a body with |body_digest| was given an SCT
+  // recently, and sets |*sct| to it if so.
+  bool LookupRecentSubmission(const std::string& body_digest,
+                              ct::SignedCertificateTimestamp* sct);
+  void AddRecentSubmission(const std::string& body_digest,
+                           const ct::SignedCertificateTimestamp& sct);
+
+  typedef std::pair<std::string, ct::SignedCertificateTimestamp>
+      RecentSubmission;
+  std::mutex recent_lock_;
+  // Most recently used first.
+  std::list<RecentSubmission> recent_lru_;
+  // Their positions in |recent_lru_|, by body digest.
+  std::unordered_map<std::string, std::list<RecentSubmission>::iterator>
+      recent_;
 };
 
 
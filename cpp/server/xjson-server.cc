@@ -67,6 +67,7 @@ using google::RegisterFlagValidator;
 using std::bind;
 using std::function;
 using std::make_shared;
+using std::move;
 using std::shared_ptr;
 using std::string;
 using std::thread;
@@ -109,7 +110,7 @@ int main(int argc, char* argv[]) {
   CHECK(db) << "No database instance created, check flag settings";
 
   shared_ptr<libevent::Base> event_base(make_shared<libevent::Base>());
-  ThreadPool internal_pool(8);
+  ThreadPool internal_pool("internal", 8);
   UrlFetcher url_fetcher(event_base.get(), &internal_pool);
 
   const bool stand_alone_mode(cert_trans::IsStandalone(true));
@@ -124,7 +125,7 @@ int main(int argc, char* argv[]) {
                                  new MerkleVerifier(unique_ptr<Sha256Hasher>(
                                      new Sha256Hasher)));
 
-  ThreadPool http_pool(FLAGS_num_http_server_threads);
+  ThreadPool http_pool("http", FLAGS_num_http_server_threads);
 
   Server server(event_base, &internal_pool, &http_pool, db.get(),
                 etcd_client.get(), &url_fetcher, &log_verifier);
@@ -133,8 +134,7 @@ int main(int argc, char* argv[]) {
   Frontend frontend(
       new FrontendSigner(db.get(), server.consistent_store(), &log_signer));
   unique_ptr<StalenessTracker> staleness_tracker(
-      new StalenessTracker(server.cluster_state_controller(), &internal_pool,
-                           event_base.get()));
+      new StalenessTracker(server.cluster_state_controller()));
   XJsonHttpHandler handler(server.log_lookup(), db.get(),
                            server.cluster_state_controller(), &frontend,
                            &internal_pool, event_base.get(),
@@ -144,7 +144,15 @@ int main(int argc, char* argv[]) {
   handler.SetProxy(server.proxy());
   handler.Add(server.http_server());
 
-  TreeSigner tree_signer(std::chrono::duration<double>(FLAGS_guard_window_seconds), db.get(), server.log_lookup()->GetCompactMerkleTree(new Sha256Hasher), server.consistent_store(), &log_signer);
+  unique_ptr<CompactMerkleTree> signer_tree(
+      TreeSigner::TreeFromCheckpoint(db.get()));
+  if (!signer_tree) {
+    signer_tree = server.log_lookup()->GetCompactMerkleTree(new Sha256Hasher);
+  }
+  TreeSigner tree_signer(
+      std::chrono::duration<double>(FLAGS_guard_window_seconds), db.get(),
+      move(signer_tree), server.consistent_store(), &log_signer,
+      &internal_pool);
 
   if (stand_alone_mode) {
     // Set up a simple single-node environment.
@@ -194,7 +202,8 @@ int main(int argc, char* argv[]) {
   // (either not accepting any requests, or returning some internal
   // server error) until we have an STH to serve.
   const function<bool()> is_master(bind(&Server::IsMaster, &server));
-  thread sequencer(&SequenceEntries, &tree_signer, is_master);
+  thread sequencer(&SequenceEntries, &tree_signer,
+                   server.cluster_state_controller(), is_master);
   thread cleanup(&CleanUpEntries, server.consistent_store(), is_master);
   thread signer(&SignMerkleTree, &tree_signer, server.consistent_store(),
                 server.cluster_state_controller());
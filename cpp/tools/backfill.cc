@@ -0,0 +1,385 @@
+// Imports the entries of a log into a database from a bulk dump,
+// rather than through get-entries requests, checking them against a
+// tree head of the log.
+//
+// The dump is either a directory of saved get-entries responses, or
+// the database of another mirror (such as an archive of a SegmentDB
+// directory). Entries are read and hashed in parallel, and written in
+// large batches. It can be interrupted and run again, carrying on from
+// the tree size of the database.
+#include <dirent.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "client/async_log_client.h"
+#include "log/database.h"
+#include "log/log_verifier.h"
+#include "log/logged_entry.h"
+#include "log/segment_db.h"
+#include "merkletree/compact_merkle_tree.h"
+#include "merkletree/merkle_verifier.h"
+#include "merkletree/serial_hasher.h"
+#include "proto/cert_serializer.h"
+#include "proto/ct.pb.h"
+#include "server/server_helper.h"
+#include "util/init.h"
+#include "util/json_wrapper.h"
+#include "util/parallel_for.h"
+#include "util/read_key.h"
+#include "util/status.h"
+#include "util/thread_pool.h"
+#include "util/util.h"
+
+DEFINE_string(sth, "",
+              "File with the serialized tree head of the log to import, up "
+              "to the size of which entries are imported (required)");
+DEFINE_string(target_public_key, "",
+              "If set, the signature of --sth is checked with this public "
+              "key of the log");
+DEFINE_string(get_entries_dir, "",
+              "Directory of get-entries responses to import, each named "
+              "after the sequence number of its first entry (as in "
+              "1000.json)");
+DEFINE_string(source_segment_db, "",
+              "Directory of segment files to import (as written by "
+              "--segment_db), instead of --get_entries_dir");
+DEFINE_string(source_segment_db_cold_dir, "",
+              "Directory of the older segments of --source_segment_db, if "
+              "any");
+DEFINE_int32(chunk_entries, 1000,
+             "number of entries read and hashed at once by each thread, "
+             "when importing from --source_segment_db");
+DEFINE_int32(write_batch_entries, 100000,
+             "number of entries written to the database at once");
+
+using cert_trans::AsyncLogClient;
+using cert_trans::Database;
+using cert_trans::LoggedEntry;
+using cert_trans::ReadOnlyDatabase;
+using cert_trans::ReadPublicKey;
+using cert_trans::SegmentDB;
+using cert_trans::ThreadPool;
+using std::ifstream;
+using std::map;
+using std::move;
+using std::numeric_limits;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using util::Status;
+using util::StatusOr;
+
+namespace {
+
+
+// A dump of the entries of a log, read in chunks, which can be read
+// from several threads at once.
+class EntrySource {
+ public:
+  virtual ~EntrySource() = default;
+
+  // Returns the sequence numbers of the first entry of the chunks
+  // holding the entries from |start| to |end| (exclusive), in order.
+  virtual vector<int64_t> Chunks(int64_t start, int64_t end) const = 0;
+
+  // Reads the chunk starting at |chunk_start|, setting the sequence
+  // numbers of its entries.
+  virtual Status ReadChunk(int64_t chunk_start,
+                           vector<LoggedEntry>* entries) const = 0;
+};
+
+
+class GetEntriesDirSource : public EntrySource {
+ public:
+  explicit GetEntriesDirSource(const string& dir);
+
+  vector<int64_t> Chunks(int64_t start, int64_t end) const override;
+  Status ReadChunk(int64_t chunk_start,
+                   vector<LoggedEntry>* entries) const override;
+
+ private:
+  const string dir_;
+  // The files by the sequence number of their first entry.
+  map<int64_t, string> files_;
+};
+
+
+GetEntriesDirSource::GetEntriesDirSource(const string& dir) : dir_(dir) {
+  DIR* const d(opendir(dir_.c_str()));
+  PCHECK(d) << "could not open " << dir_;
+  while (const dirent* entry = readdir(d)) {
+    char* end;
+    const long long first(strtoll(entry->d_name, &end, 10));
+    if (end == entry->d_name || string(end) != ".json" || first < 0) {
+      continue;
+    }
+    CHECK(files_.emplace(first, entry->d_name).second)
+        << "more than one file for entry " << first;
+  }
+  closedir(d);
+  LOG(INFO) << "found " << files_.size() << " get-entries responses in "
+            << dir_;
+}
+
+
+vector<int64_t> GetEntriesDirSource::Chunks(int64_t start,
+                                            int64_t end) const {
+  vector<int64_t> chunks;
+  auto it(files_.upper_bound(start));
+  if (it != files_.begin()) {
+    --it;
+  }
+  for (; it != files_.end() && it->first < end; ++it) {
+    chunks.push_back(it->first);
+  }
+  return chunks;
+}
+
+
+Status GetEntriesDirSource::ReadChunk(int64_t chunk_start,
+                                      vector<LoggedEntry>* entries) const {
+  const string path(dir_ + "/" + files_.at(chunk_start));
+  string contents;
+  if (!util::ReadBinaryFile(path, &contents)) {
+    return Status(util::error::NOT_FOUND, "could not read " + path);
+  }
+
+  int64_t sequence_number(chunk_start);
+  bool parsed(true);
+  JsonArrayStream stream(
+      "entries", [entries, &sequence_number, &parsed](const JsonObject& json) {
+        AsyncLogClient::Entry entry;
+        entries->emplace_back();
+        if (!AsyncLogClient::ParseEntry(json, &entry) ||
+            !entries->back().CopyFromClientLogEntry(entry)) {
+          parsed = false;
+          return false;
+        }
+        entries->back().set_sequence_number(sequence_number++);
+        return true;
+      });
+  if (!stream.Add(contents.data(), contents.size()) || !stream.Finish() ||
+      !parsed) {
+    return Status(util::error::INVALID_ARGUMENT,
+                  "malformed get-entries response in " + path);
+  }
+
+  return util::OkStatus();
+}
+
+
+// Reads the entries of a database, such as a SegmentDB directory
+// copied from another mirror.
+class DatabaseSource : public EntrySource {
+ public:
+  explicit DatabaseSource(unique_ptr<ReadOnlyDatabase> db)
+      : db_(move(db)) {
+  }
+
+  vector<int64_t> Chunks(int64_t start, int64_t end) const override;
+  Status ReadChunk(int64_t chunk_start,
+                   vector<LoggedEntry>* entries) const override;
+
+ private:
+  const unique_ptr<ReadOnlyDatabase> db_;
+};
+
+
+vector<int64_t> DatabaseSource::Chunks(int64_t start, int64_t end) const {
+  vector<int64_t> chunks;
+  for (int64_t chunk = start; chunk < end; chunk += FLAGS_chunk_entries) {
+    chunks.push_back(chunk);
+  }
+  return chunks;
+}
+
+
+Status DatabaseSource::ReadChunk(int64_t chunk_start,
+                                 vector<LoggedEntry>* entries) const {
+  db_->ReadEntries(chunk_start, chunk_start + FLAGS_chunk_entries - 1,
+                   numeric_limits<size_t>::max(), ReadOnlyDatabase::BULK_SCAN,
+                   entries);
+  return util::OkStatus();
+}
+
+
+unique_ptr<EntrySource> CreateSource() {
+  CHECK(FLAGS_get_entries_dir.empty() != FLAGS_source_segment_db.empty())
+      << "Must specify exactly one of --get_entries_dir and "
+      << "--source_segment_db.";
+
+  if (!FLAGS_get_entries_dir.empty()) {
+    return unique_ptr<EntrySource>(
+        new GetEntriesDirSource(FLAGS_get_entries_dir));
+  }
+
+  // With both directories, segments are read from either, and none
+  // are moved.
+  return unique_ptr<EntrySource>(new DatabaseSource(unique_ptr<SegmentDB>(
+      FLAGS_source_segment_db_cold_dir.empty()
+          ? new SegmentDB(FLAGS_source_segment_db)
+          : new SegmentDB(FLAGS_source_segment_db,
+                          FLAGS_source_segment_db_cold_dir,
+                          numeric_limits<int64_t>::max()))));
+}
+
+
+ct::SignedTreeHead ReadTreeHead() {
+  CHECK(!FLAGS_sth.empty()) << "--sth is required";
+  ifstream input(FLAGS_sth);
+  ct::SignedTreeHead sth;
+  CHECK(sth.ParseFromIstream(&input)) << "could not read " << FLAGS_sth;
+
+  if (!FLAGS_target_public_key.empty()) {
+    const StatusOr<EVP_PKEY*> pubkey(ReadPublicKey(FLAGS_target_public_key));
+    CHECK(pubkey.ok()) << "Failed to read target log's public key file: "
+                       << pubkey.status();
+    const LogVerifier verifier(new LogSigVerifier(pubkey.ValueOrDie()),
+                               new MerkleVerifier(unique_ptr<Sha256Hasher>(
+                                   new Sha256Hasher)));
+    const LogVerifier::LogVerifyResult result(
+        verifier.VerifySignedTreeHead(sth));
+    CHECK_EQ(result, LogVerifier::VERIFY_OK)
+        << "bad tree head signature: "
+        << LogVerifier::VerifyResultString(result);
+  }
+
+  return sth;
+}
+
+
+// Imports the entries of |source| that |db| does not have yet, up to
+// the size of |sth|, which is written to |db| if the entries match
+// it.
+int Backfill(const EntrySource& source, const ct::SignedTreeHead& sth,
+             Database* db) {
+  const int64_t tree_size(sth.tree_size());
+  int64_t next(db->TreeSize());
+  if (next > tree_size) {
+    LOG(ERROR) << "the database already has " << next
+               << " entries, more than the tree head";
+    return 1;
+  }
+
+  // The entries that are already there are part of the tree too.
+  CompactMerkleTree tree(unique_ptr<Sha256Hasher>(new Sha256Hasher));
+  {
+    LOG(INFO) << "hashing the " << next << " entries already imported";
+    const unique_ptr<ReadOnlyDatabase::LeafHashIterator> it(
+        db->ScanLeafHashes(0));
+    int64_t sequence_number;
+    string leaf_hash;
+    while (static_cast<int64_t>(tree.LeafCount()) < next &&
+           it->GetNextLeafHash(&sequence_number, &leaf_hash)) {
+      CHECK_EQ(static_cast<int64_t>(tree.LeafCount()), sequence_number);
+      tree.AddLeafHash(leaf_hash);
+    }
+  }
+
+  ThreadPool pool;
+  const vector<int64_t> chunks(source.Chunks(next, tree_size));
+  LOG(INFO) << "importing entries " << next << " to " << tree_size - 1
+            << " from " << chunks.size() << " chunks";
+  auto chunk(chunks.begin());
+  while (next < tree_size) {
+    // Read and hash about a batch worth of chunks in parallel...
+    vector<int64_t> batch;
+    for (int64_t entries = 0;
+         chunk != chunks.end() && entries < FLAGS_write_batch_entries;
+         ++chunk) {
+      batch.push_back(*chunk);
+      entries +=
+          (chunk + 1 != chunks.end() ? *(chunk + 1) : tree_size) - *chunk;
+    }
+    if (batch.empty()) {
+      LOG(ERROR) << "the dump ends at entry " << next;
+      return 1;
+    }
+
+    vector<vector<LoggedEntry>> entries(batch.size());
+    vector<Status> statuses(batch.size());
+    util::ParallelFor(&pool, batch.size(), [&](size_t i) {
+      statuses[i] = source.ReadChunk(batch[i], &entries[i]);
+      for (LoggedEntry& entry : entries[i]) {
+        CHECK(entry.CacheHashes());
+      }
+    });
+
+    // ...then add them to the tree, in order, and write them all at
+    // once.
+    vector<const LoggedEntry*> to_write;
+    for (size_t i = 0; i < batch.size(); ++i) {
+      if (!statuses[i].ok()) {
+        LOG(ERROR) << statuses[i];
+        return 1;
+      }
+      for (const LoggedEntry& entry : entries[i]) {
+        if (entry.sequence_number() < next) {
+          // Overlapping chunks, or already imported.
+          continue;
+        }
+        if (entry.sequence_number() > next) {
+          LOG(ERROR) << "the dump is missing entry " << next;
+          return 1;
+        }
+        if (next >= tree_size) {
+          break;
+        }
+        CHECK_EQ(static_cast<size_t>(next + 1),
+                 tree.AddLeafHash(entry.merkle_leaf_hash()));
+        to_write.push_back(&entry);
+        ++next;
+      }
+    }
+
+    if (!to_write.empty()) {
+      const Database::WriteResult result(db->CreateSequencedEntries(to_write));
+      if (result != Database::OK) {
+        LOG(ERROR) << "could not write entries from "
+                   << to_write.front()->sequence_number() << ": " << result;
+        return 1;
+      }
+    }
+    LOG(INFO) << "imported " << next << " of " << tree_size << " entries";
+  }
+
+  if (tree.CurrentRoot() != sth.sha256_root_hash()) {
+    LOG(ERROR) << "the entries do not match the tree head, expected root "
+               << util::HexString(sth.sha256_root_hash()) << " but got "
+               << util::HexString(tree.CurrentRoot())
+               << "; the database should be discarded";
+    return 1;
+  }
+
+  CHECK_EQ(db->WriteTreeHead(sth), Database::OK);
+  LOG(INFO) << "all " << tree_size << " entries match the tree head";
+
+  return 0;
+}
+
+
+}  // namespace
+
+
+int main(int argc, char* argv[]) {
+  util::InitCT(&argc, &argv);
+  ConfigureSerializerForV1CT();
+  cert_trans::EnsureValidatorsRegistered();
+
+  const ct::SignedTreeHead sth(ReadTreeHead());
+  const unique_ptr<EntrySource> source(CreateSource());
+  const unique_ptr<Database> db(cert_trans::ProvideDatabase());
+  CHECK(db) << "No database instance created, check flag settings";
+
+  return Backfill(*source, sth, db.get());
+}
@@ -0,0 +1,425 @@
+// Drives a running ct-server or ct-mirror with a mix of requests, and
+// reports the throughput and latency percentiles of each endpoint.
+//
+// Requests are sent at a constant rate, whatever the latency of the
+// server (open loop), and their latency is measured from the time they
+// were due, so that a server falling behind shows up as such rather
+// than slowing the benchmark down. Submissions cycle through the given
+// chains (the log returns the same SCT again for a chain it has
+// already seen, after the same checks). Proofs are requested for the
+// first entries of the log, against its tree head at startup.
+#include <event2/thread.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/notification.h"
+#include "client/async_log_client.h"
+#include "log/cert.h"
+#include "log/logged_entry.h"
+#include "net/url_fetcher.h"
+#include "proto/cert_serializer.h"
+#include "proto/ct.pb.h"
+#include "util/init.h"
+#include "util/libevent_wrapper.h"
+#include "util/thread_pool.h"
+#include "util/util.h"
+
+namespace libevent = cert_trans::libevent;
+
+using cert_trans::AsyncLogClient;
+using cert_trans::CertChain;
+using cert_trans::LoggedEntry;
+using cert_trans::Notification;
+using cert_trans::PreCertChain;
+using cert_trans::ThreadPool;
+using cert_trans::UrlFetcher;
+using std::atomic;
+using std::bind;
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::lock_guard;
+using std::make_shared;
+using std::mutex;
+using std::placeholders::_1;
+using std::shared_ptr;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+DEFINE_string(server, "http://127.0.0.1:8888",
+              "URL of the ct-server or ct-mirror to benchmark");
+DEFINE_double(rate, 100, "number of requests sent per second, in total");
+DEFINE_int32(duration_seconds, 60, "how long to send requests for");
+DEFINE_int32(drain_seconds, 30,
+             "how long to wait for the outstanding requests at the end");
+DEFINE_int32(max_outstanding, 10000,
+             "requests due while this many are outstanding are skipped "
+             "(and counted as such), rather than sent");
+DEFINE_string(mix,
+              "add-chain=1,add-pre-chain=1,get-sth=20,get-proof-by-hash=10,"
+              "get-sth-consistency=10,get-entries=10",
+              "relative weight of each endpoint in the requests sent");
+DEFINE_string(chains,
+              "test/testdata/test-cert.pem:test/testdata/ca-cert.pem,"
+              "test/testdata/test-intermediate-cert.pem:"
+              "test/testdata/intermediate-cert.pem:"
+              "test/testdata/ca-cert.pem",
+              "chains submitted by add-chain requests, separated by commas, "
+              "each one a list of PEM files separated by colons, leaf first");
+DEFINE_string(pre_chains,
+              "test/testdata/test-embedded-pre-cert.pem:"
+              "test/testdata/ca-cert.pem,"
+              "test/testdata/test-embedded-with-intermediate-pre-cert.pem:"
+              "test/testdata/intermediate-cert.pem:"
+              "test/testdata/ca-cert.pem",
+              "chains submitted by add-pre-chain requests, in the same "
+              "format as --chains");
+DEFINE_int32(proof_entries, 1000,
+             "number of entries, from the start of the log, for which "
+             "get-proof-by-hash requests are sent");
+DEFINE_int32(get_entries_batch, 100,
+             "number of entries asked for by each get-entries request");
+DEFINE_int32(num_threads, 4, "number of threads running the callbacks");
+
+namespace {
+
+
+enum Endpoint {
+  ADD_CHAIN,
+  ADD_PRE_CHAIN,
+  GET_STH,
+  GET_PROOF_BY_HASH,
+  GET_STH_CONSISTENCY,
+  GET_ENTRIES,
+  NUM_ENDPOINTS,
+};
+
+
+const char* const kEndpointNames[NUM_ENDPOINTS] = {
+    "add-chain",         "add-pre-chain",       "get-sth",
+    "get-proof-by-hash", "get-sth-consistency", "get-entries",
+};
+
+
+// Parses --mix into a weight for each endpoint.
+vector<double> ParseMix(const string& mix) {
+  vector<double> weights(NUM_ENDPOINTS, 0);
+  for (const string& item : util::split(mix)) {
+    const size_t equals(item.find('='));
+    CHECK_NE(equals, string::npos) << "bad --mix item: " << item;
+    const string name(item.substr(0, equals));
+    const auto it(std::find(kEndpointNames, kEndpointNames + NUM_ENDPOINTS,
+                            name));
+    CHECK(it != kEndpointNames + NUM_ENDPOINTS) << "unknown endpoint: "
+                                                << name;
+    weights[it - kEndpointNames] = std::stod(item.substr(equals + 1));
+    CHECK_GE(weights[it - kEndpointNames], 0) << "bad --mix item: " << item;
+  }
+  return weights;
+}
+
+
+// Reads chains in the format of --chains.
+template <class Chain>
+vector<unique_ptr<Chain>> ReadChains(const string& flag) {
+  vector<unique_ptr<Chain>> chains;
+  for (const string& chain : util::split(flag)) {
+    string pem;
+    for (const string& file : util::split(chain, ':')) {
+      string contents;
+      CHECK(util::ReadTextFile(file, &contents)) << "could not read " << file;
+      pem += contents;
+    }
+    chains.emplace_back(new Chain(pem));
+    CHECK(chains.back()->IsLoaded()) << "could not load the chain " << chain;
+  }
+  return chains;
+}
+
+
+// The results of the requests to one endpoint.
+struct Results {
+  Results() : errors(0), skipped(0) {
+  }
+
+  mutex lock;
+  vector<double> latencies_ms;
+  int64_t errors;
+  int64_t skipped;
+};
+
+
+// The responses of a request, which must outlive it.
+struct Request {
+  ct::SignedCertificateTimestamp sct;
+  ct::SignedTreeHead sth;
+  ct::MerkleAuditProof proof;
+  vector<string> consistency_proof;
+  vector<AsyncLogClient::Entry> entries;
+};
+
+
+class LoadGenerator {
+ public:
+  LoadGenerator(AsyncLogClient* client, const ct::SignedTreeHead& sth,
+                const vector<string>& leaf_hashes)
+      : client_(CHECK_NOTNULL(client)),
+        sth_(sth),
+        leaf_hashes_(leaf_hashes),
+        chains_(ReadChains<CertChain>(FLAGS_chains)),
+        pre_chains_(ReadChains<PreCertChain>(FLAGS_pre_chains)),
+        generator_(std::random_device()()),
+        next_chain_(0),
+        next_pre_chain_(0),
+        outstanding_(0) {
+  }
+
+  // Sends requests at |rate| per second for |length|, picking the
+  // endpoint of each according to |weights|, then waits for the
+  // outstanding ones (for up to --drain_seconds).
+  void Run(const vector<double>& weights, double rate,
+           const steady_clock::duration& length);
+
+  // Prints the results of each endpoint, over |length|.
+  void Report(const steady_clock::duration& length);
+
+ private:
+  void Send(Endpoint endpoint, const steady_clock::time_point& due);
+  void Done(Endpoint endpoint, const steady_clock::time_point& due,
+            const shared_ptr<Request>& request,
+            AsyncLogClient::Status status);
+
+  AsyncLogClient* const client_;
+  const ct::SignedTreeHead sth_;
+  const vector<string> leaf_hashes_;
+  const vector<unique_ptr<CertChain>> chains_;
+  const vector<unique_ptr<PreCertChain>> pre_chains_;
+
+  // Only used by the thread calling Run().
+  std::mt19937 generator_;
+  size_t next_chain_;
+  size_t next_pre_chain_;
+
+  atomic<int> outstanding_;
+  Results results_[NUM_ENDPOINTS];
+};
+
+
+void LoadGenerator::Run(const vector<double>& weights, double rate,
+                        const steady_clock::duration& length) {
+  CHECK_GT(rate, 0);
+  CHECK(weights[ADD_CHAIN] == 0 || !chains_.empty())
+      << "add-chain requests need --chains";
+  CHECK(weights[ADD_PRE_CHAIN] == 0 || !pre_chains_.empty())
+      << "add-pre-chain requests need --pre_chains";
+  std::discrete_distribution<int> pick(weights.begin(), weights.end());
+  const steady_clock::duration interval(
+      duration_cast<steady_clock::duration>(duration<double>(1 / rate)));
+  const steady_clock::time_point start(steady_clock::now());
+  const steady_clock::time_point end(start + length);
+
+  for (steady_clock::time_point due(start); due < end; due += interval) {
+    std::this_thread::sleep_until(due);
+    const Endpoint endpoint(static_cast<Endpoint>(pick(generator_)));
+    if (outstanding_.load() >= FLAGS_max_outstanding) {
+      lock_guard<mutex> lock(results_[endpoint].lock);
+      ++results_[endpoint].skipped;
+      continue;
+    }
+    ++outstanding_;
+    Send(endpoint, due);
+  }
+
+  const steady_clock::time_point drain_end(steady_clock::now() +
+                                           seconds(FLAGS_drain_seconds));
+  while (outstanding_.load() > 0 && steady_clock::now() < drain_end) {
+    std::this_thread::sleep_for(milliseconds(10));
+  }
+  LOG_IF(WARNING, outstanding_.load() > 0)
+      << outstanding_.load() << " requests still outstanding";
+}
+
+
+void LoadGenerator::Send(Endpoint endpoint,
+                         const steady_clock::time_point& due) {
+  const shared_ptr<Request> request(make_shared<Request>());
+  const AsyncLogClient::Callback done(
+      bind(&LoadGenerator::Done, this, endpoint, due, request, _1));
+  switch (endpoint) {
+    case ADD_CHAIN:
+      client_->AddCertChain(*chains_[next_chain_++ % chains_.size()],
+                            &request->sct, done);
+      break;
+    case ADD_PRE_CHAIN:
+      client_->AddPreCertChain(
+          *pre_chains_[next_pre_chain_++ % pre_chains_.size()],
+          &request->sct, done);
+      break;
+    case GET_STH:
+      client_->GetSTH(&request->sth, done);
+      break;
+    case GET_PROOF_BY_HASH:
+      client_->QueryInclusionProof(
+          sth_, leaf_hashes_[std::uniform_int_distribution<size_t>(
+                    0, leaf_hashes_.size() - 1)(generator_)],
+          &request->proof, done);
+      break;
+    case GET_STH_CONSISTENCY:
+      client_->GetSTHConsistency(
+          std::uniform_int_distribution<int64_t>(1, sth_.tree_size() - 1)(
+              generator_),
+          sth_.tree_size(), &request->consistency_proof, done);
+      break;
+    case GET_ENTRIES: {
+      const int64_t first(std::uniform_int_distribution<int64_t>(
+          0, sth_.tree_size() - 1)(generator_));
+      const int64_t last(std::min<int64_t>(
+          first + FLAGS_get_entries_batch - 1, sth_.tree_size() - 1));
+      client_->GetEntries(first, last, &request->entries, done);
+      break;
+    }
+    case NUM_ENDPOINTS:
+      LOG(FATAL) << "not an endpoint";
+  }
+}
+
+
+void LoadGenerator::Done(Endpoint endpoint,
+                         const steady_clock::time_point& due,
+                         const shared_ptr<Request>& request,
+                         AsyncLogClient::Status status) {
+  const double latency_ms(
+      duration<double, std::milli>(steady_clock::now() - due).count());
+  {
+    lock_guard<mutex> lock(results_[endpoint].lock);
+    if (status == AsyncLogClient::OK) {
+      results_[endpoint].latencies_ms.push_back(latency_ms);
+    } else {
+      ++results_[endpoint].errors;
+    }
+  }
+  --outstanding_;
+}
+
+
+void LoadGenerator::Report(const steady_clock::duration& length) {
+  const double length_seconds(duration<double>(length).count());
+  printf("%-20s %8s %7s %7s %8s %8s %8s %8s %8s %8s\n", "endpoint", "ok",
+         "errors", "skipped", "req/s", "p50 ms", "p90 ms", "p99 ms",
+         "p99.9 ms", "max ms");
+  for (int i = 0; i < NUM_ENDPOINTS; ++i) {
+    Results* const results(&results_[i]);
+    lock_guard<mutex> lock(results->lock);
+    vector<double>& latencies(results->latencies_ms);
+    if (latencies.empty() && results->errors == 0 && results->skipped == 0) {
+      continue;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    const auto percentile = [&latencies](double p) {
+      if (latencies.empty()) {
+        return 0.0;
+      }
+      const size_t rank(std::ceil(p * latencies.size()));
+      return latencies[std::max<size_t>(rank, 1) - 1];
+    };
+    printf("%-20s %8zu %7lld %7lld %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f\n",
+           kEndpointNames[i], latencies.size(),
+           static_cast<long long>(results->errors),
+           static_cast<long long>(results->skipped),
+           latencies.size() / length_seconds, percentile(0.5),
+           percentile(0.9), percentile(0.99), percentile(0.999),
+           percentile(1));
+  }
+}
+
+
+AsyncLogClient::Status Wait(
+    const std::function<void(const AsyncLogClient::Callback&)>& call) {
+  Notification done;
+  AsyncLogClient::Status status(AsyncLogClient::UNKNOWN_ERROR);
+  call([&done, &status](AsyncLogClient::Status s) {
+    status = s;
+    done.Notify();
+  });
+  done.WaitForNotification();
+  return status;
+}
+
+
+// Returns the leaf hashes of up to --proof_entries entries, from the
+// start of the log.
+vector<string> GetLeafHashes(AsyncLogClient* client,
+                             const ct::SignedTreeHead& sth) {
+  const int64_t count(
+      std::min<int64_t>(FLAGS_proof_entries, sth.tree_size()));
+  vector<AsyncLogClient::Entry> entries;
+  while (static_cast<int64_t>(entries.size()) < count) {
+    const size_t before(entries.size());
+    CHECK_EQ(AsyncLogClient::OK,
+             Wait(bind(&AsyncLogClient::GetEntries, client, entries.size(),
+                       count - 1, &entries, _1)))
+        << "get-entries failed";
+    CHECK_GT(entries.size(), before) << "get-entries returned no entries";
+  }
+
+  vector<string> leaf_hashes;
+  for (const AsyncLogClient::Entry& client_entry : entries) {
+    LoggedEntry entry;
+    CHECK(entry.CopyFromClientLogEntry(client_entry));
+    CHECK(entry.CacheHashes());
+    leaf_hashes.push_back(entry.merkle_leaf_hash());
+  }
+  return leaf_hashes;
+}
+
+
+}  // namespace
+
+
+int main(int argc, char* argv[]) {
+  util::InitCT(&argc, &argv);
+  ConfigureSerializerForV1CT();
+  evthread_use_pthreads();
+
+  CHECK_GT(FLAGS_duration_seconds, 0);
+  CHECK_GT(FLAGS_get_entries_batch, 0);
+  const vector<double> weights(ParseMix(FLAGS_mix));
+
+  const shared_ptr<libevent::Base> event_base(make_shared<libevent::Base>());
+  libevent::EventPumpThread pump(event_base);
+  ThreadPool pool("bench", FLAGS_num_threads);
+  UrlFetcher fetcher(event_base.get(), &pool);
+  AsyncLogClient client(&pool, &fetcher, FLAGS_server);
+
+  ct::SignedTreeHead sth;
+  CHECK_EQ(AsyncLogClient::OK,
+           Wait(bind(&AsyncLogClient::GetSTH, &client, &sth, _1)))
+      << "get-sth failed";
+  CHECK_GT(sth.tree_size(), 1)
+      << "the log needs at least two entries to be benchmarked";
+  LOG(INFO) << "tree size: " << sth.tree_size();
+
+  LoadGenerator generator(&client, sth, GetLeafHashes(&client, sth));
+  const seconds length(FLAGS_duration_seconds);
+  LOG(INFO) << "sending " << FLAGS_rate << " requests per second for "
+            << FLAGS_duration_seconds << " seconds";
+  generator.Run(weights, FLAGS_rate, length);
+  generator.Report(length);
+
+  return 0;
+}
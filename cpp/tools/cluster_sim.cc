@@ -0,0 +1,649 @@
+// Runs a cluster of --num_nodes log servers in one process, to see how
+// the cluster scales without having to deploy one: each node is a
+// Server, as in ct-server, with its own LevelDB, thread pools and
+// HTTP port (--base_port and up, on which the nodes fetch entries
+// from each other), and the nodes share an in-memory etcd, which each
+// one reaches through a FaultyEtcdClient adding latency and losing
+// requests as configured.
+//
+// Entries are submitted at --rate, to each node in turn, for
+// --duration_seconds, and the report gives:
+//  - how long they took to get an SCT, and then to be covered by a
+//    serving STH,
+//  - how long each new serving STH took to converge: from the first
+//    node seeing it to every node serving it, with the entries it
+//    covers in its database,
+//  - the load put on etcd, by operation, and how often the master
+//    changed.
+//
+// The last line sums it up, so that runs with various cluster sizes
+// can be compared, for example:
+//
+//   for n in 1 3 5 9; do
+//     cluster_sim --key=test/testdata/ct-server-key.pem --num_nodes=$n \
+//         | tail -1
+//   done
+//
+// The log processes run faster than they do by default (see main()),
+// so that a short run sees many tree heads.
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "log/cluster_state_controller.h"
+#include "log/etcd_consistent_store.h"
+#include "log/frontend_signer.h"
+#include "log/leveldb_db.h"
+#include "log/log_lookup.h"
+#include "log/log_signer.h"
+#include "log/log_verifier.h"
+#include "log/strict_consistent_store.h"
+#include "log/tree_signer.h"
+#include "merkletree/merkle_verifier.h"
+#include "net/url_fetcher.h"
+#include "proto/cert_serializer.h"
+#include "server/certificate_handler.h"
+#include "server/log_processes.h"
+#include "server/server.h"
+#include "server/staleness_tracker.h"
+#include "tools/clustertool.h"
+#include "util/fake_etcd.h"
+#include "util/faulty_etcd.h"
+#include "util/init.h"
+#include "util/libevent_wrapper.h"
+#include "util/masterelection.h"
+#include "util/read_key.h"
+#include "util/status.h"
+#include "util/sync_task.h"
+#include "util/task.h"
+#include "util/thread_pool.h"
+
+DEFINE_string(key, "", "PEM-encoded private key of the log");
+DEFINE_int32(num_nodes, 3, "number of nodes in the cluster");
+DEFINE_int32(base_port, 7100,
+             "the nodes serve HTTP on this port and the ones after it");
+DEFINE_string(data_dir, "",
+              "directory for the databases of the nodes, which must not "
+              "hold any yet. If empty, a new one is made under /tmp (and "
+              "left there)");
+DEFINE_double(etcd_min_latency_ms, 1,
+              "least one-way latency between a node and etcd");
+DEFINE_double(etcd_max_latency_ms, 5,
+              "greatest one-way latency between a node and etcd");
+DEFINE_double(etcd_loss_rate, 0,
+              "probability of a request to etcd, and then of its reply, "
+              "being lost. Note that the master election still CHECKs that "
+              "the updates of its proposal succeed");
+DEFINE_int32(etcd_seed, 1,
+             "seed of the latencies and losses, for repeatable runs");
+DEFINE_double(rate, 100, "entries submitted per second, across all nodes");
+DEFINE_int32(duration_seconds, 30, "how long to submit entries for");
+DEFINE_int32(drain_seconds, 60,
+             "how long to wait, after the last submission, for the entries "
+             "to be covered by a serving STH on every node");
+DEFINE_int32(node_threads, 4,
+             "number of threads in each of the thread pools of a node");
+DEFINE_int32(minimum_serving_nodes, 1,
+             "minimum_serving_nodes of the cluster config");
+DEFINE_double(minimum_serving_fraction, 0.75,
+              "minimum_serving_fraction of the cluster config");
+DEFINE_double(guard_window_seconds, 1,
+              "Unsequenced entries newer than this number of seconds will "
+              "not be sequenced.");
+
+DECLARE_int32(cleanup_frequency_seconds);
+DECLARE_int32(delay_between_fetches_seconds);
+DECLARE_string(etcd_root);
+DECLARE_int32(port);
+DECLARE_int32(sequencing_frequency_seconds);
+DECLARE_string(server);
+DECLARE_int32(tree_signing_frequency_seconds);
+
+namespace libevent = cert_trans::libevent;
+
+using cert_trans::CertificateHttpHandler;
+using cert_trans::CleanUpEntries;
+using cert_trans::Database;
+using cert_trans::EtcdClient;
+using cert_trans::EtcdConsistentStore;
+using cert_trans::FakeEtcdClient;
+using cert_trans::FaultyEtcdClient;
+using cert_trans::LevelDB;
+using cert_trans::LogLookup;
+using cert_trans::LoggedEntry;
+using cert_trans::MasterElection;
+using cert_trans::ReadPrivateKey;
+using cert_trans::SequenceEntries;
+using cert_trans::Server;
+using cert_trans::SignMerkleTree;
+using cert_trans::StalenessTracker;
+using cert_trans::StrictConsistentStore;
+using cert_trans::ThreadPool;
+using cert_trans::TreeSigner;
+using cert_trans::UrlFetcher;
+using std::bind;
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::lock_guard;
+using std::make_shared;
+using std::map;
+using std::move;
+using std::mutex;
+using std::placeholders::_1;
+using std::placeholders::_2;
+using std::shared_ptr;
+using std::string;
+using std::thread;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+
+namespace {
+
+
+const char kLeafPrefix[] = "sim-";
+
+
+// A node of the cluster, set up as ct-server sets itself up, but for
+// the certificate checks.
+struct Node {
+  shared_ptr<libevent::Base> base;
+  unique_ptr<ThreadPool> internal_pool;
+  unique_ptr<ThreadPool> http_pool;
+  unique_ptr<UrlFetcher> url_fetcher;
+  unique_ptr<FaultyEtcdClient> etcd;
+  unique_ptr<Database> db;
+  unique_ptr<Server> server;
+  unique_ptr<StalenessTracker> staleness_tracker;
+  unique_ptr<CertificateHttpHandler> handler;
+  unique_ptr<FrontendSigner> frontend_signer;
+  unique_ptr<TreeSigner> tree_signer;
+};
+
+
+unique_ptr<Node> StartNode(int index, const string& data_dir,
+                           FakeEtcdClient* etcd, LogSigner* log_signer,
+                           const LogVerifier* log_verifier) {
+  unique_ptr<Node> node(new Node);
+  node->base = make_shared<libevent::Base>();
+  node->internal_pool.reset(new ThreadPool(
+      "internal-" + to_string(index), FLAGS_node_threads * 2));
+  node->http_pool.reset(
+      new ThreadPool("http-" + to_string(index), FLAGS_node_threads));
+  node->url_fetcher.reset(
+      new UrlFetcher(node->base.get(), node->internal_pool.get()));
+
+  FaultyEtcdClient::Options options;
+  options.min_latency = duration<double, std::milli>(FLAGS_etcd_min_latency_ms);
+  options.max_latency = duration<double, std::milli>(FLAGS_etcd_max_latency_ms);
+  options.loss_rate = FLAGS_etcd_loss_rate;
+  options.seed = FLAGS_etcd_seed + index;
+  node->etcd.reset(new FaultyEtcdClient(etcd, node->base.get(), options));
+  node->db.reset(new LevelDB(data_dir + "/node-" + to_string(index)));
+
+  // The Server reads the port it binds, and publishes, from the flag.
+  FLAGS_port = FLAGS_base_port + index;
+  node->server.reset(new Server(node->base, node->internal_pool.get(),
+                                node->http_pool.get(), node->db.get(),
+                                node->etcd.get(), node->url_fetcher.get(),
+                                log_verifier));
+  node->server->Initialise(false /* is_mirror */);
+
+  node->staleness_tracker.reset(
+      new StalenessTracker(node->server->cluster_state_controller()));
+  node->handler.reset(new CertificateHttpHandler(
+      node->server->log_lookup(), node->db.get(),
+      node->server->cluster_state_controller(), nullptr, nullptr,
+      node->internal_pool.get(), node->base.get(),
+      node->staleness_tracker.get()));
+  node->handler->SetProxy(node->server->proxy());
+  node->handler->Add(node->server->http_server());
+
+  node->frontend_signer.reset(new FrontendSigner(
+      node->db.get(), node->server->consistent_store(), log_signer));
+  node->tree_signer.reset(new TreeSigner(
+      duration<double>(FLAGS_guard_window_seconds), node->db.get(),
+      node->server->log_lookup()->GetCompactMerkleTree(new Sha256Hasher),
+      node->server->consistent_store(), log_signer,
+      node->internal_pool.get()));
+  node->tree_signer->SetLeavesAppendedCallback(
+      bind(&LogLookup::AddLeafHashes, node->server->log_lookup(), _1, _2));
+
+  Server* const server(node->server.get());
+  const std::function<bool()> is_master(bind(&Server::IsMaster, server));
+  // These run for as long as the process does.
+  thread(&SequenceEntries, node->tree_signer.get(),
+         server->cluster_state_controller(), is_master)
+      .detach();
+  thread(&CleanUpEntries, server->consistent_store(), is_master).detach();
+  thread(&SignMerkleTree, node->tree_signer.get(),
+         server->consistent_store(), server->cluster_state_controller())
+      .detach();
+  return node;
+}
+
+
+// Sets up the cluster in |etcd|, as prepare_etcd.sh and "clustertool
+// initlog" do for a real one. The election and the consistent store
+// used to do so are returned in |*election| and |*store|, as they
+// have to outlive the watches they started.
+void InitCluster(const string& data_dir, FakeEtcdClient* etcd,
+                 const shared_ptr<libevent::Base>& base, ThreadPool* pool,
+                 LogSigner* log_signer, unique_ptr<MasterElection>* election,
+                 unique_ptr<StrictConsistentStore>* store,
+                 unique_ptr<Database>* db) {
+  {
+    EtcdClient::Response resp;
+    util::SyncTask task(base.get());
+    etcd->Create(FLAGS_etcd_root + "/sequence_mapping", "", &resp,
+                 task.task());
+    task.Wait();
+    CHECK_EQ(::util::OkStatus(), task.status());
+  }
+
+  const string node_id("cluster-sim");
+  election->reset(new MasterElection(base, etcd,
+                                     FLAGS_etcd_root + "/election", node_id));
+  (*election)->StartElection();
+  (*election)->WaitToBecomeMaster();
+  store->reset(new StrictConsistentStore(
+      election->get(), new EtcdConsistentStore(base.get(), pool, etcd,
+                                               election->get(),
+                                               FLAGS_etcd_root, node_id)));
+  db->reset(new LevelDB(data_dir + "/init"));
+  TreeSigner tree_signer(duration<double>(0), db->get(),
+                         unique_ptr<CompactMerkleTree>(new CompactMerkleTree(
+                             unique_ptr<Sha256Hasher>(new Sha256Hasher))),
+                         store->get(), log_signer);
+
+  ct::ClusterConfig config;
+  config.set_minimum_serving_nodes(FLAGS_minimum_serving_nodes);
+  config.set_minimum_serving_fraction(FLAGS_minimum_serving_fraction);
+  const util::Status status(
+      cert_trans::InitLog(config, &tree_signer, store->get()));
+  CHECK(status.ok()) << "Could not initialise the cluster: " << status;
+  (*election)->StopElection();
+}
+
+
+// The results of the run, filled in by the submissions and the
+// observation of the cluster.
+class Results {
+ public:
+  Results() : sct_errors_(0), master_changes_(0) {
+  }
+
+  // Returns the id of a new submission, made now.
+  int64_t AddSubmission() {
+    lock_guard<mutex> lock(lock_);
+    submitted_.push_back(steady_clock::now());
+    return submitted_.size() - 1;
+  }
+
+  void SubmissionDone(int64_t id, util::Task* task) {
+    const steady_clock::time_point now(steady_clock::now());
+    lock_guard<mutex> lock(lock_);
+    if (task->status().ok()) {
+      sct_ms_.push_back(Milliseconds(now - submitted_.at(id)));
+    } else {
+      ++sct_errors_;
+    }
+  }
+
+  void Covered(int64_t id, const steady_clock::time_point& now) {
+    lock_guard<mutex> lock(lock_);
+    serving_ms_.push_back(Milliseconds(now - submitted_.at(id)));
+  }
+
+  void Converged(const steady_clock::duration& lag) {
+    lock_guard<mutex> lock(lock_);
+    convergence_ms_.push_back(Milliseconds(lag));
+  }
+
+  void MasterChanged() {
+    lock_guard<mutex> lock(lock_);
+    ++master_changes_;
+  }
+
+  int64_t submitted() const {
+    lock_guard<mutex> lock(lock_);
+    return submitted_.size();
+  }
+
+  int64_t covered() const {
+    lock_guard<mutex> lock(lock_);
+    return serving_ms_.size();
+  }
+
+  void Report(const vector<unique_ptr<Node>>& nodes,
+              const steady_clock::duration& length);
+
+ private:
+  static double Milliseconds(const steady_clock::duration& d) {
+    return duration<double, std::milli>(d).count();
+  }
+
+  mutable mutex lock_;
+  vector<steady_clock::time_point> submitted_;
+  vector<double> sct_ms_;
+  int64_t sct_errors_;
+  vector<double> serving_ms_;
+  vector<double> convergence_ms_;
+  int64_t master_changes_;
+};
+
+
+// Returns the |p| percentile of |values|, which must be sorted.
+double Percentile(const vector<double>& values, double p) {
+  if (values.empty()) {
+    return 0;
+  }
+  const size_t rank(std::ceil(p * values.size()));
+  return values[std::max<size_t>(rank, 1) - 1];
+}
+
+
+void PrintLatencies(const char* name, vector<double>* latencies) {
+  std::sort(latencies->begin(), latencies->end());
+  printf("%-24s %8zu %8.1f %8.1f %8.1f %8.1f\n", name, latencies->size(),
+         Percentile(*latencies, 0.5), Percentile(*latencies, 0.9),
+         Percentile(*latencies, 0.99), Percentile(*latencies, 1));
+}
+
+
+void Results::Report(const vector<unique_ptr<Node>>& nodes,
+                     const steady_clock::duration& length) {
+  const double length_seconds(
+      std::max(duration<double>(length).count(), 1e-3));
+  lock_guard<mutex> lock(lock_);
+
+  printf("%-24s %8s %8s %8s %8s %8s\n", "latency", "count", "p50 ms",
+         "p90 ms", "p99 ms", "max ms");
+  PrintLatencies("submit to SCT", &sct_ms_);
+  PrintLatencies("submit to serving STH", &serving_ms_);
+  PrintLatencies("serving STH convergence", &convergence_ms_);
+  printf("\n%lld submitted, %lld SCT errors, %zu covered by a serving STH "
+         "(%.1f/s), %lld master changes\n\n",
+         static_cast<long long>(submitted_.size()),
+         static_cast<long long>(sct_errors_), serving_ms_.size(),
+         serving_ms_.size() / length_seconds,
+         static_cast<long long>(master_changes_));
+
+  map<string, int64_t> etcd_stats;
+  for (const auto& node : nodes) {
+    for (const auto& stat : node->etcd->GetStats()) {
+      etcd_stats[stat.first] += stat.second;
+    }
+  }
+  int64_t etcd_ops(0);
+  printf("%-24s %10s %10s %12s\n", "etcd", "total", "per s",
+         "per node/s");
+  for (const auto& stat : etcd_stats) {
+    printf("%-24s %10lld %10.1f %12.1f\n", stat.first.c_str(),
+           static_cast<long long>(stat.second), stat.second / length_seconds,
+           stat.second / length_seconds / nodes.size());
+    if (stat.first != "lost_requests" && stat.first != "lost_replies" &&
+        stat.first != "watch_updates") {
+      etcd_ops += stat.second;
+    }
+  }
+
+  printf("\nnodes=%zu entries/s=%.1f serving_p50_ms=%.1f "
+         "serving_p99_ms=%.1f convergence_p50_ms=%.1f "
+         "convergence_p99_ms=%.1f etcd_ops/s=%.1f master_changes=%lld\n",
+         nodes.size(), serving_ms_.size() / length_seconds,
+         Percentile(serving_ms_, 0.5), Percentile(serving_ms_, 0.99),
+         Percentile(convergence_ms_, 0.5), Percentile(convergence_ms_, 0.99),
+         etcd_ops / length_seconds, static_cast<long long>(master_changes_));
+}
+
+
+// Submits entries to the |nodes| in turn, at --rate, for
+// --duration_seconds, without waiting for their SCTs.
+void Submit(const vector<unique_ptr<Node>>& nodes, ThreadPool* pool,
+            Results* results) {
+  const steady_clock::time_point start(steady_clock::now());
+  const steady_clock::time_point end(start + seconds(FLAGS_duration_seconds));
+  for (int64_t i = 0;; ++i) {
+    const steady_clock::time_point due(
+        start + duration_cast<steady_clock::duration>(
+                    duration<double>(i / FLAGS_rate)));
+    if (due >= end) {
+      break;
+    }
+    std::this_thread::sleep_until(due);
+
+    const int64_t id(results->AddSubmission());
+    ct::LogEntry entry;
+    entry.set_type(ct::X509_ENTRY);
+    entry.mutable_x509_entry()->set_leaf_certificate(kLeafPrefix +
+                                                     to_string(id));
+    ct::SignedCertificateTimestamp* const sct(
+        new ct::SignedCertificateTimestamp);
+    util::Task* const task(new util::Task(
+        [results, id, sct](util::Task* task) {
+          results->SubmissionDone(id, task);
+          delete sct;
+          delete task;
+        },
+        pool));
+    nodes[id % nodes.size()]->frontend_signer->QueueEntryAsync(move(entry),
+                                                               sct, task);
+  }
+}
+
+
+// Follows the serving STH and the databases of the |nodes| until
+// |deadline|, or until every submission is covered by a serving STH
+// on every node, once |submitting| is over.
+class Observer {
+ public:
+  Observer(const vector<unique_ptr<Node>>* nodes, Results* results)
+      : nodes_(CHECK_NOTNULL(nodes)),
+        results_(CHECK_NOTNULL(results)),
+        covered_size_(0),
+        master_(-1) {
+  }
+
+  void Run(const std::function<bool()>& submitting,
+           const steady_clock::time_point& deadline);
+
+ private:
+  void Poll();
+  // Records the entries up to |size| as covered, if a node has them
+  // in its database.
+  bool Cover(int64_t size, const steady_clock::time_point& now);
+
+  const vector<unique_ptr<Node>>* const nodes_;
+  Results* const results_;
+  int64_t covered_size_;
+  // When each serving STH not yet on every node was first seen, by
+  // tree size.
+  map<int64_t, steady_clock::time_point> converging_;
+  int master_;
+};
+
+
+void Observer::Run(const std::function<bool()>& submitting,
+                   const steady_clock::time_point& deadline) {
+  while (steady_clock::now() < deadline) {
+    Poll();
+    if (!submitting() && converging_.empty() &&
+        results_->covered() >= results_->submitted()) {
+      return;
+    }
+    std::this_thread::sleep_for(milliseconds(10));
+  }
+  LOG(WARNING) << results_->submitted() - results_->covered()
+               << " entries not covered by a serving STH by the end";
+}
+
+
+void Observer::Poll() {
+  const steady_clock::time_point now(steady_clock::now());
+  vector<int64_t> serving_sizes;
+  int master(-1);
+  for (size_t i = 0; i < nodes_->size(); ++i) {
+    Server* const server((*nodes_)[i]->server.get());
+    const util::StatusOr<ct::SignedTreeHead> sth(
+        server->consistent_store()->GetServingSTH());
+    serving_sizes.push_back(sth.ok() ? sth.ValueOrDie().tree_size() : 0);
+    if (master < 0 && server->IsMaster()) {
+      master = i;
+    }
+  }
+
+  if (master >= 0 && master != master_) {
+    if (master_ >= 0) {
+      results_->MasterChanged();
+    }
+    master_ = master;
+  }
+
+  const int64_t largest(
+      *std::max_element(serving_sizes.begin(), serving_sizes.end()));
+  if (largest > covered_size_ && Cover(largest, now)) {
+    converging_.emplace(largest, now);
+  }
+
+  for (auto it = converging_.begin(); it != converging_.end();) {
+    bool converged(true);
+    for (size_t i = 0; i < nodes_->size() && converged; ++i) {
+      converged = serving_sizes[i] >= it->first &&
+                  (*nodes_)[i]->db->TreeSize() >= it->first;
+    }
+    if (!converged) {
+      // The larger ones cannot have converged either.
+      break;
+    }
+    results_->Converged(now - it->second);
+    it = converging_.erase(it);
+  }
+}
+
+
+bool Observer::Cover(int64_t size, const steady_clock::time_point& now) {
+  Database* db(nullptr);
+  for (const auto& node : *nodes_) {
+    if (node->db->TreeSize() >= size) {
+      db = node->db.get();
+      break;
+    }
+  }
+  if (!db) {
+    // Not written to any database yet, which the next poll will see.
+    return false;
+  }
+  for (int64_t index = covered_size_; index < size; ++index) {
+    LoggedEntry entry;
+    CHECK_EQ(Database::LOOKUP_OK, db->LookupByIndex(index, &entry));
+    const string& leaf(entry.entry().x509_entry().leaf_certificate());
+    CHECK_EQ(0U, leaf.compare(0, strlen(kLeafPrefix), kLeafPrefix))
+        << "unexpected entry " << index;
+    results_->Covered(std::stoll(leaf.substr(strlen(kLeafPrefix))), now);
+  }
+  covered_size_ = size;
+  return true;
+}
+
+
+}  // namespace
+
+
+int main(int argc, char* argv[]) {
+  // Runs of a few minutes should see many tree heads, and the nodes
+  // reach each other at once.
+  FLAGS_sequencing_frequency_seconds = 1;
+  FLAGS_tree_signing_frequency_seconds = 1;
+  FLAGS_cleanup_frequency_seconds = 1;
+  FLAGS_delay_between_fetches_seconds = 1;
+  FLAGS_server = "127.0.0.1";
+
+  ConfigureSerializerForV1CT();
+  util::InitCT(&argc, &argv);
+  Server::StaticInit();
+
+  CHECK(!FLAGS_key.empty()) << "--key is required";
+  CHECK_GT(FLAGS_num_nodes, 0);
+  CHECK_LE(FLAGS_minimum_serving_nodes, FLAGS_num_nodes);
+  CHECK_GT(FLAGS_rate, 0);
+  string data_dir(FLAGS_data_dir);
+  if (data_dir.empty()) {
+    char dir_template[] = "/tmp/cluster_sim.XXXXXX";
+    PCHECK(mkdtemp(dir_template)) << "Cannot make a data directory";
+    data_dir = dir_template;
+  }
+  LOG(INFO) << "keeping the databases in " << data_dir;
+
+  // The signer is shared by all the nodes, as ct-server shares it.
+  util::StatusOr<EVP_PKEY*> pkey(ReadPrivateKey(FLAGS_key));
+  CHECK_EQ(pkey.status(), ::util::OkStatus());
+  LogSigner log_signer(pkey.ValueOrDie());
+  util::StatusOr<EVP_PKEY*> verifier_pkey(ReadPrivateKey(FLAGS_key));
+  CHECK_EQ(verifier_pkey.status(), ::util::OkStatus());
+  const LogVerifier log_verifier(
+      new LogSigVerifier(verifier_pkey.ValueOrDie()),
+      new MerkleVerifier(unique_ptr<Sha256Hasher>(new Sha256Hasher)));
+
+  // etcd itself answers at once, on its own loop.
+  const shared_ptr<libevent::Base> etcd_base(make_shared<libevent::Base>());
+  libevent::EventPumpThread etcd_pump(etcd_base);
+  ThreadPool pool("sim", 4);
+  FakeEtcdClient etcd(etcd_base.get());
+
+  unique_ptr<MasterElection> init_election;
+  unique_ptr<StrictConsistentStore> init_store;
+  unique_ptr<Database> init_db;
+  InitCluster(data_dir, &etcd, etcd_base, &pool, &log_signer, &init_election,
+              &init_store, &init_db);
+
+  vector<unique_ptr<Node>> nodes;
+  for (int i = 0; i < FLAGS_num_nodes; ++i) {
+    nodes.emplace_back(
+        StartNode(i, data_dir, &etcd, &log_signer, &log_verifier));
+  }
+  LOG(INFO) << "started " << nodes.size() << " nodes";
+
+  Results results;
+  mutex submitting_lock;
+  bool submitting(true);
+  const steady_clock::time_point start(steady_clock::now());
+  thread submitter([&nodes, &pool, &results, &submitting_lock,
+                    &submitting]() {
+    Submit(nodes, &pool, &results);
+    lock_guard<mutex> lock(submitting_lock);
+    submitting = false;
+  });
+
+  Observer observer(&nodes, &results);
+  observer.Run(
+      [&submitting_lock, &submitting]() {
+        lock_guard<mutex> lock(submitting_lock);
+        return submitting;
+      },
+      start + seconds(FLAGS_duration_seconds + FLAGS_drain_seconds));
+  const steady_clock::duration length(steady_clock::now() - start);
+  submitter.join();
+
+  results.Report(nodes, length);
+
+  // The log processes never return, and the watches hang forever even
+  // when cancelled, so this does not tear the nodes down.
+  fflush(stdout);
+  exit(0);
+}
@@ -157,7 +157,7 @@ int main(int argc, char* argv[]) {
   const string node_id("clustertool");
   unique_ptr<MasterElection> election(
       BuildAndJoinMasterElection(node_id, event_base, &etcd_client));
-  ThreadPool internal_pool(4);
+  ThreadPool internal_pool("internal", 4);
   StrictConsistentStore consistent_store(
       election.get(),
       new EtcdConsistentStore(event_base.get(), &internal_pool, &etcd_client,
@@ -1,18 +1,33 @@
+#include "config.h"
+
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <limits.h>
+#include <algorithm>
 #include <functional>
 #include <iostream>
+#include <limits>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "log/database.h"
 #include "log/file_db.h"
 #include "log/file_storage.h"
 #include "log/leveldb_db.h"
 #include "log/logged_entry.h"
+#ifdef HAVE_ROCKSDB
+#include "log/rocksdb_db.h"
+#endif
+#include "log/segment_db.h"
 #include "log/sqlite_db.h"
+#include "merkletree/compact_merkle_tree.h"
+#include "merkletree/serial_hasher.h"
+#include "proto/ct.pb.h"
 #include "proto/serializer.h"
 #include "util/init.h"
+#include "util/parallel_for.h"
+#include "util/thread_pool.h"
 #include "util/util.h"
 
 DEFINE_string(cert_dir, "", "Storage directory for certificates");
@@ -28,23 +43,53 @@ DEFINE_string(sqlite_db, "",
               "SQLite database for certificate and tree storage");
 DEFINE_string(leveldb_db, "",
               "LevelDB database for certificate and tree storage");
+DEFINE_string(rocksdb_db, "",
+              "RocksDB database for certificate and tree storage, if built "
+              "with RocksDB");
+DEFINE_string(segment_db, "",
+              "Directory of segment files for certificate and tree storage");
+DEFINE_string(segment_db_cold_dir, "",
+              "Directory of the older segments of --segment_db, if any");
 
 DEFINE_int64(start, 0, "Starting sequence number (inclusive).");
 DEFINE_int64(end, std::numeric_limits<int64_t>::max(),
              "Ending sequence number (inclusive).");
 
+DEFINE_string(dest_db_type, "",
+              "Type of the database that \"migrate\" copies to: sqlite, "
+              "leveldb, rocksdb or segment");
+DEFINE_string(dest_db, "",
+              "Database file (or directory, for segment) that \"migrate\" "
+              "copies to");
+DEFINE_int32(migrate_threads, 4,
+             "Number of threads that \"migrate\" reads and writes entries "
+             "with, each a batch at a time");
+DEFINE_int32(migrate_batch_size, 1000,
+             "Number of entries that \"migrate\" reads and writes at once");
+
+using cert_trans::Database;
 using cert_trans::FileDB;
 using cert_trans::FileStorage;
 using cert_trans::LevelDB;
 using cert_trans::LoggedEntry;
+#ifdef HAVE_ROCKSDB
+using cert_trans::RocksDB;
+#endif
 using cert_trans::ReadOnlyDatabase;
+using cert_trans::SegmentDB;
 using cert_trans::SQLiteDB;
+using cert_trans::ThreadPool;
 using cert_trans::serialization::SerializeResult;
+using ct::CompactTreeCheckpoint;
+using ct::SignedTreeHead;
 using std::cerr;
 using std::cout;
 using std::function;
+using std::min;
+using std::numeric_limits;
 using std::string;
 using std::unique_ptr;
+using std::vector;
 using util::InitCT;
 using util::ToBase64;
 
@@ -52,7 +97,8 @@ using util::ToBase64;
 void Usage() {
   cerr << "Usage: db_tool [flags] <command>\n"
        << "Where <command> is one of:\n"
-       << "  dump_leaf_inputs\n";
+       << "  dump_leaf_inputs\n"
+       << "  migrate (to --dest_db)\n";
 }
 
 
@@ -86,6 +132,165 @@ int DumpLeafInputs(const ReadOnlyDatabase* db) {
 }
 
 
+unique_ptr<Database> OpenDestination() {
+  CHECK(!FLAGS_dest_db.empty()) << "--dest_db is needed to migrate";
+  if (FLAGS_dest_db_type == "sqlite") {
+    return unique_ptr<Database>(new SQLiteDB(FLAGS_dest_db));
+  } else if (FLAGS_dest_db_type == "leveldb") {
+    return unique_ptr<Database>(new LevelDB(FLAGS_dest_db));
+  } else if (FLAGS_dest_db_type == "rocksdb") {
+#ifdef HAVE_ROCKSDB
+    return unique_ptr<Database>(new RocksDB(FLAGS_dest_db));
+#else
+    LOG(FATAL) << "--dest_db_type=rocksdb, but built without RocksDB";
+#endif
+  } else if (FLAGS_dest_db_type == "segment") {
+    return unique_ptr<Database>(new SegmentDB(FLAGS_dest_db));
+  }
+  LOG(FATAL) << "Unknown --dest_db_type: " << FLAGS_dest_db_type;
+  return nullptr;
+}
+
+
+// Restores the tree of the entries already copied to |dest| from the
+// checkpoint Migrate() leaves there as it goes, so that an interrupted
+// migration carries on from there. Otherwise, starts from scratch.
+unique_ptr<CompactMerkleTree> RestoreTree(const Database* dest) {
+  CompactTreeCheckpoint checkpoint;
+  if (dest->LatestTreeCheckpoint(&checkpoint) == Database::LOOKUP_OK &&
+      checkpoint.tree_size() <= dest->TreeSize()) {
+    unique_ptr<CompactMerkleTree> tree(new CompactMerkleTree(
+        checkpoint.tree_size(),
+        vector<string>(checkpoint.frontier().begin(),
+                       checkpoint.frontier().end()),
+        unique_ptr<Sha256Hasher>(new Sha256Hasher)));
+    if (tree->CurrentRoot() == checkpoint.sha256_root_hash()) {
+      LOG(INFO) << "Resuming after the " << checkpoint.tree_size()
+                << " entries already copied";
+      return tree;
+    }
+    LOG(WARNING) << "Ignoring the checkpoint of the destination, which has "
+                 << "a mismatched root";
+  }
+  return unique_ptr<CompactMerkleTree>(
+      new CompactMerkleTree(unique_ptr<Sha256Hasher>(new Sha256Hasher)));
+}
+
+
+void CheckRoot(const SignedTreeHead& sth, CompactMerkleTree* tree) {
+  if (tree->CurrentRoot() != sth.sha256_root_hash()) {
+    LOG(FATAL) << "The root of the " << sth.tree_size()
+               << " entries copied does not match the tree head";
+  }
+  LOG(INFO) << "Checked the root of the " << sth.tree_size()
+            << " entries copied against the tree head";
+}
+
+
+// Adds |leaf_hashes| to |tree|, checking its root against |sth| (if
+// not NULL) on the way, if the tree goes through its size.
+void AddLeafHashes(const vector<string>& leaf_hashes,
+                   const SignedTreeHead* sth, util::Executor* executor,
+                   CompactMerkleTree* tree) {
+  const int64_t tree_size(tree->LeafCount());
+  if (sth && sth->tree_size() > tree_size &&
+      sth->tree_size() <=
+          tree_size + static_cast<int64_t>(leaf_hashes.size())) {
+    const auto split(leaf_hashes.begin() + (sth->tree_size() - tree_size));
+    tree->AddLeafHashes(vector<string>(leaf_hashes.begin(), split), executor);
+    CheckRoot(*sth, tree);
+    tree->AddLeafHashes(vector<string>(split, leaf_hashes.end()), executor);
+  } else {
+    tree->AddLeafHashes(leaf_hashes, executor);
+  }
+}
+
+
+// Copies the entries (up to --end) and the latest tree head of |source|
+// to the destination database, with each of --migrate_threads threads
+// reading and writing a batch of --migrate_batch_size entries at a
+// time. The tree of the entries copied is built along the way, checked
+// against the tree head, and checkpointed in the destination after
+// each round of batches, which is where the next run resumes from.
+int Migrate(ReadOnlyDatabase* source) {
+  CHECK_NOTNULL(source);
+  CHECK_GT(FLAGS_migrate_threads, 0);
+  CHECK_GT(FLAGS_migrate_batch_size, 0);
+  const unique_ptr<Database> dest(OpenDestination());
+  ThreadPool pool("migrate", FLAGS_migrate_threads);
+
+  string node_id;
+  if (dest->NodeId(&node_id) != Database::LOOKUP_OK &&
+      source->NodeId(&node_id) == Database::LOOKUP_OK) {
+    dest->InitializeNode(node_id);
+  }
+
+  SignedTreeHead sth;
+  const bool have_sth(source->LatestTreeHead(&sth) == Database::LOOKUP_OK);
+  const unique_ptr<CompactMerkleTree> tree(RestoreTree(dest.get()));
+  if (have_sth && sth.tree_size() == static_cast<int64_t>(tree->LeafCount())) {
+    CheckRoot(sth, tree.get());
+  }
+
+  const int64_t end(min(FLAGS_end, source->TreeSize() - 1));
+  const int64_t batch_size(FLAGS_migrate_batch_size);
+  int64_t next(tree->LeafCount());
+  LOG(INFO) << "Copying entries " << next << " to " << end;
+  while (next <= end) {
+    const size_t num_batches(
+        min<int64_t>(FLAGS_migrate_threads, (end - next) / batch_size + 1));
+    vector<vector<string>> leaf_hashes(num_batches);
+    util::ParallelFor(&pool, num_batches, [&](size_t i) {
+      const int64_t start(next + i * batch_size);
+      const int64_t batch_end(min(end, start + batch_size - 1));
+      vector<LoggedEntry> entries;
+      source->ReadEntries(start, batch_end, numeric_limits<size_t>::max(),
+                          ReadOnlyDatabase::BULK_SCAN, &entries);
+      CHECK_EQ(batch_end - start + 1, static_cast<int64_t>(entries.size()))
+          << "The source is missing entries from " << start;
+
+      vector<const LoggedEntry*> batch;
+      leaf_hashes[i].resize(entries.size());
+      for (size_t j = 0; j < entries.size(); ++j) {
+        CHECK(entries[j].LeafHash(&leaf_hashes[i][j]));
+        batch.push_back(&entries[j]);
+      }
+      CHECK_EQ(Database::OK, dest->CreateSequencedEntries(batch))
+          << "Failed to write the entries from " << start;
+    });
+
+    for (const vector<string>& hashes : leaf_hashes) {
+      AddLeafHashes(hashes, have_sth ? &sth : nullptr, &pool, tree.get());
+    }
+    next = tree->LeafCount();
+
+    CompactTreeCheckpoint checkpoint;
+    checkpoint.set_tree_size(next);
+    for (const string& node : tree->Frontier()) {
+      checkpoint.add_frontier(node);
+    }
+    checkpoint.set_sha256_root_hash(tree->CurrentRoot());
+    CHECK_EQ(Database::OK, dest->WriteTreeCheckpoint(checkpoint));
+    LOG(INFO) << "Copied " << next << " entries";
+  }
+
+  if (!have_sth) {
+    return 0;
+  }
+  if (sth.tree_size() > static_cast<int64_t>(tree->LeafCount())) {
+    LOG(WARNING) << "Not copying the tree head, for " << sth.tree_size()
+                 << " entries, which have not all been copied";
+    return 0;
+  }
+  const Database::WriteResult result(dest->WriteTreeHead(sth));
+  // Already there, if this resumes after it was copied.
+  CHECK(result == Database::OK ||
+        result == Database::DUPLICATE_TREE_HEAD_TIMESTAMP)
+      << "Failed to write the tree head: " << result;
+  return 0;
+}
+
+
 int main(int argc, char* argv[]) {
   InitCT(&argc, &argv);
 
@@ -98,12 +303,14 @@ int main(int argc, char* argv[]) {
   // TODO(alcutter): Refactor this out into a common CreateDatabase() call
   // somewhere.
   if (!FLAGS_sqlite_db.empty() + !FLAGS_leveldb_db.empty() +
+          !FLAGS_rocksdb_db.empty() + !FLAGS_segment_db.empty() +
           (!FLAGS_cert_dir.empty() | !FLAGS_tree_dir.empty()) !=
       1) {
     LOG(FATAL) << "Must only specify one database type.";
   }
 
-  if (FLAGS_sqlite_db.empty() && FLAGS_leveldb_db.empty()) {
+  if (FLAGS_sqlite_db.empty() && FLAGS_leveldb_db.empty() &&
+      FLAGS_rocksdb_db.empty() && FLAGS_segment_db.empty()) {
     CHECK_NE(FLAGS_cert_dir, FLAGS_tree_dir)
         << "Certificate directory and tree directory must differ";
   }
@@ -114,6 +321,19 @@ int main(int argc, char* argv[]) {
     db.reset(new SQLiteDB(FLAGS_sqlite_db));
   } else if (!FLAGS_leveldb_db.empty()) {
     db.reset(new LevelDB(FLAGS_leveldb_db));
+  } else if (!FLAGS_rocksdb_db.empty()) {
+#ifdef HAVE_ROCKSDB
+    db.reset(new RocksDB(FLAGS_rocksdb_db));
+#else
+    LOG(FATAL) << "--rocksdb_db given, but built without RocksDB";
+#endif
+  } else if (!FLAGS_segment_db.empty() &&
+             !FLAGS_segment_db_cold_dir.empty()) {
+    // Reads the segments from both directories, without moving any.
+    db.reset(new SegmentDB(FLAGS_segment_db, FLAGS_segment_db_cold_dir,
+                           numeric_limits<int64_t>::max()));
+  } else if (!FLAGS_segment_db.empty()) {
+    db.reset(new SegmentDB(FLAGS_segment_db));
   } else {
     db.reset(
         new FileDB(new FileStorage(FLAGS_cert_dir, FLAGS_cert_storage_depth),
@@ -124,6 +344,8 @@ int main(int argc, char* argv[]) {
 
   if (strcmp(argv[1], "dump_leaf_inputs") == 0) {
     return DumpLeafInputs(db.get());
+  } else if (strcmp(argv[1], "migrate") == 0) {
+    return Migrate(db.get());
   } else {
     Usage();
     return 1;
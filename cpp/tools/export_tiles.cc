@@ -0,0 +1,70 @@
+// Publishes a log, from its database, as static tiles of entries and
+// Merkle tree hashes (see server/tile_writer.h), for a CDN to serve in
+// place of the log nodes. It only writes what is missing for the
+// latest tree head, so it can run (again and again) alongside a node,
+// on a copy of its database, or on a mirror.
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+#include "log/database.h"
+#include "proto/cert_serializer.h"
+#include "proto/ct.pb.h"
+#include "server/server_helper.h"
+#include "server/tile_writer.h"
+#include "util/init.h"
+#include "util/status.h"
+
+DEFINE_string(tiles_dir, "",
+              "Directory to write the tiles in, to be served as is "
+              "(required)");
+DEFINE_int32(tile_height, 8,
+             "Number of levels of the Merkle tree in each tile, each of "
+             "which then holds 2^tile_height hashes or entries; must not "
+             "change once tiles are written");
+DEFINE_int32(export_interval_seconds, 0,
+             "If set, keep going, checking for a new tree head this often; "
+             "otherwise, export the latest tree head once and exit");
+
+using cert_trans::Database;
+using cert_trans::TileWriter;
+using std::chrono::seconds;
+using std::unique_ptr;
+
+
+int main(int argc, char* argv[]) {
+  util::InitCT(&argc, &argv);
+  ConfigureSerializerForV1CT();
+  cert_trans::EnsureValidatorsRegistered();
+  CHECK(!FLAGS_tiles_dir.empty()) << "--tiles_dir is required";
+
+  const unique_ptr<Database> db(cert_trans::ProvideDatabase());
+  CHECK(db) << "No database instance created, check flag settings";
+  TileWriter writer(db.get(), FLAGS_tiles_dir, FLAGS_tile_height);
+
+  uint64_t exported_timestamp(0);
+  while (true) {
+    ct::SignedTreeHead sth;
+    if (db->LatestTreeHead(&sth) == Database::LOOKUP_OK &&
+        sth.timestamp() != exported_timestamp) {
+      const util::Status status(writer.Write(sth));
+      if (status.ok()) {
+        LOG(INFO) << "Exported the tree head of size " << sth.tree_size();
+        exported_timestamp = sth.timestamp();
+      } else {
+        LOG(ERROR) << "Failed to export the tree head of size "
+                   << sth.tree_size() << ": " << status;
+        if (FLAGS_export_interval_seconds <= 0) {
+          return 1;
+        }
+      }
+    }
+
+    if (FLAGS_export_interval_seconds <= 0) {
+      return 0;
+    }
+    std::this_thread::sleep_for(seconds(FLAGS_export_interval_seconds));
+  }
+}
@@ -0,0 +1,309 @@
+// Replays the requests captured from a ct-server or ct-mirror (with
+// --capture_requests, see server/request_capture.h) against a test
+// cluster, and reports the throughput and latency percentiles of each
+// endpoint.
+//
+// Requests are sent at the times they were received, relative to the
+// first one, divided by --speed, whatever the latency of the servers
+// (open loop), and their latency is measured from the time they were
+// due, as with bench_server. They go to the --servers in turn. Only
+// the request line and the body are captured, so the requests are
+// sent without the headers of the original clients (nor their
+// conditional or compressed replies).
+#include <event2/thread.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "net/url_fetcher.h"
+#include "server/request_capture.h"
+#include "util/init.h"
+#include "util/libevent_wrapper.h"
+#include "util/task.h"
+#include "util/thread_pool.h"
+#include "util/util.h"
+
+namespace libevent = cert_trans::libevent;
+
+using cert_trans::AccessLog;
+using cert_trans::RequestCapture;
+using cert_trans::ThreadPool;
+using cert_trans::URL;
+using cert_trans::UrlFetcher;
+using std::atomic;
+using std::bind;
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::lock_guard;
+using std::make_shared;
+using std::map;
+using std::mutex;
+using std::placeholders::_1;
+using std::shared_ptr;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+DEFINE_string(capture, "",
+              "file of requests captured with --capture_requests, to "
+              "replay");
+DEFINE_string(servers, "http://127.0.0.1:8888",
+              "URLs of the servers of the cluster to send the requests to, "
+              "separated by commas, each one sent a request in turn");
+DEFINE_double(speed, 1,
+              "how many times faster than they were captured the requests "
+              "are sent");
+DEFINE_int32(drain_seconds, 30,
+             "how long to wait for the outstanding requests at the end");
+DEFINE_int32(max_outstanding, 10000,
+             "requests due while this many are outstanding are skipped "
+             "(and counted as such), rather than sent");
+DEFINE_int32(num_threads, 4, "number of threads running the callbacks");
+
+namespace {
+
+
+// The results of the requests to one endpoint.
+struct Results {
+  Results() : errors(0), skipped(0) {
+  }
+
+  mutex lock;
+  vector<double> latencies_ms;
+  int64_t errors;
+  int64_t skipped;
+};
+
+
+// The endpoint a request goes to, as reported: its path, without the
+// query string.
+string Endpoint(const string& uri) {
+  return uri.substr(0, uri.find('?'));
+}
+
+
+bool ToVerb(AccessLog::Method method, UrlFetcher::Verb* verb) {
+  switch (method) {
+    case AccessLog::GET:
+      *verb = UrlFetcher::Verb::GET;
+      return true;
+    case AccessLog::POST:
+      *verb = UrlFetcher::Verb::POST;
+      return true;
+    case AccessLog::PUT:
+      *verb = UrlFetcher::Verb::PUT;
+      return true;
+    case AccessLog::DELETE:
+      *verb = UrlFetcher::Verb::DELETE;
+      return true;
+    case AccessLog::HEAD:
+    case AccessLog::UNKNOWN:
+      break;
+  }
+  return false;
+}
+
+
+class Replayer {
+ public:
+  Replayer(UrlFetcher* fetcher, ThreadPool* pool,
+           const vector<string>& servers)
+      : fetcher_(CHECK_NOTNULL(fetcher)),
+        pool_(CHECK_NOTNULL(pool)),
+        servers_(servers),
+        next_server_(0),
+        unsupported_(0),
+        outstanding_(0) {
+    CHECK(!servers_.empty());
+  }
+
+  // Sends the requests read from |in| at their times divided by
+  // |speed|, then waits for the outstanding ones (for up to
+  // --drain_seconds). Returns how long it took to send them.
+  steady_clock::duration Run(std::istream* in, double speed);
+
+  // Prints the results of each endpoint, over |length|.
+  void Report(const steady_clock::duration& length);
+
+ private:
+  void Send(const RequestCapture::Request& captured,
+            const steady_clock::time_point& due, Results* results);
+  void Done(const steady_clock::time_point& due, Results* results,
+            UrlFetcher::Response* resp, util::Task* task);
+
+  UrlFetcher* const fetcher_;
+  ThreadPool* const pool_;
+  const vector<string> servers_;
+
+  // Only used by the thread calling Run().
+  size_t next_server_;
+  int64_t unsupported_;
+  map<string, unique_ptr<Results>> results_;
+
+  atomic<int> outstanding_;
+};
+
+
+steady_clock::duration Replayer::Run(std::istream* in, double speed) {
+  CHECK_GT(speed, 0);
+  RequestCapture::Request captured;
+  if (!RequestCapture::ReadRequest(in, &captured)) {
+    return steady_clock::duration::zero();
+  }
+  const int64_t first_us(captured.timestamp_us);
+  const steady_clock::time_point start(steady_clock::now());
+
+  do {
+    // Requests are captured as they are read in full, on several
+    // loops, so they can be a little out of order.
+    const steady_clock::time_point due(
+        start + duration_cast<steady_clock::duration>(duration<double>(
+                    std::max<int64_t>(captured.timestamp_us - first_us, 0) /
+                    1e6 / speed)));
+    std::this_thread::sleep_until(due);
+    unique_ptr<Results>& results(results_[Endpoint(captured.uri)]);
+    if (!results) {
+      results.reset(new Results);
+    }
+    if (outstanding_.load() >= FLAGS_max_outstanding) {
+      lock_guard<mutex> lock(results->lock);
+      ++results->skipped;
+      continue;
+    }
+    Send(captured, due, results.get());
+  } while (RequestCapture::ReadRequest(in, &captured));
+  const steady_clock::duration length(steady_clock::now() - start);
+
+  const steady_clock::time_point drain_end(steady_clock::now() +
+                                           seconds(FLAGS_drain_seconds));
+  while (outstanding_.load() > 0 && steady_clock::now() < drain_end) {
+    std::this_thread::sleep_for(milliseconds(10));
+  }
+  LOG_IF(WARNING, outstanding_.load() > 0)
+      << outstanding_.load() << " requests still outstanding";
+  LOG_IF(WARNING, unsupported_ > 0)
+      << unsupported_ << " requests with a method that cannot be replayed "
+      << "were skipped";
+  return length;
+}
+
+
+void Replayer::Send(const RequestCapture::Request& captured,
+                    const steady_clock::time_point& due, Results* results) {
+  UrlFetcher::Request req;
+  if (!ToVerb(captured.method, &req.verb)) {
+    ++unsupported_;
+    return;
+  }
+  req.url = URL(servers_[next_server_++ % servers_.size()] + captured.uri);
+  req.body = captured.body;
+
+  ++outstanding_;
+  UrlFetcher::Response* const resp(new UrlFetcher::Response);
+  fetcher_->Fetch(req, resp,
+                  new util::Task(bind(&Replayer::Done, this, due, results,
+                                      resp, _1),
+                                 pool_));
+}
+
+
+void Replayer::Done(const steady_clock::time_point& due, Results* results,
+                    UrlFetcher::Response* resp, util::Task* task) {
+  const double latency_ms(
+      duration<double, std::milli>(steady_clock::now() - due).count());
+  unique_ptr<UrlFetcher::Response> resp_deleter(CHECK_NOTNULL(resp));
+  unique_ptr<util::Task> task_deleter(CHECK_NOTNULL(task));
+  {
+    lock_guard<mutex> lock(results->lock);
+    if (task->status().ok() && resp->status_code >= 200 &&
+        resp->status_code < 300) {
+      results->latencies_ms.push_back(latency_ms);
+    } else {
+      ++results->errors;
+    }
+  }
+  --outstanding_;
+}
+
+
+void Replayer::Report(const steady_clock::duration& length) {
+  const double length_seconds(
+      std::max(duration<double>(length).count(), 1e-3));
+  printf("%-30s %8s %7s %7s %8s %8s %8s %8s %8s %8s\n", "endpoint", "ok",
+         "errors", "skipped", "req/s", "p50 ms", "p90 ms", "p99 ms",
+         "p99.9 ms", "max ms");
+  for (const auto& endpoint : results_) {
+    Results* const results(endpoint.second.get());
+    lock_guard<mutex> lock(results->lock);
+    vector<double>& latencies(results->latencies_ms);
+    if (latencies.empty() && results->errors == 0 && results->skipped == 0) {
+      continue;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    const auto percentile = [&latencies](double p) {
+      if (latencies.empty()) {
+        return 0.0;
+      }
+      const size_t rank(std::ceil(p * latencies.size()));
+      return latencies[std::max<size_t>(rank, 1) - 1];
+    };
+    printf("%-30s %8zu %7lld %7lld %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f\n",
+           endpoint.first.c_str(), latencies.size(),
+           static_cast<long long>(results->errors),
+           static_cast<long long>(results->skipped),
+           latencies.size() / length_seconds, percentile(0.5),
+           percentile(0.9), percentile(0.99), percentile(0.999),
+           percentile(1));
+  }
+}
+
+
+}  // namespace
+
+
+int main(int argc, char* argv[]) {
+  util::InitCT(&argc, &argv);
+  evthread_use_pthreads();
+
+  CHECK(!FLAGS_capture.empty()) << "--capture is required";
+  CHECK_GT(FLAGS_speed, 0);
+  vector<string> servers(util::split(FLAGS_servers));
+  for (string& server : servers) {
+    // The captured URIs start with a slash.
+    while (!server.empty() && server.back() == '/') {
+      server.pop_back();
+    }
+  }
+  CHECK(!servers.empty()) << "--servers is required";
+
+  std::ifstream in(FLAGS_capture, std::ios::binary);
+  CHECK(in.good()) << "could not open " << FLAGS_capture;
+
+  const shared_ptr<libevent::Base> event_base(make_shared<libevent::Base>());
+  libevent::EventPumpThread pump(event_base);
+  ThreadPool pool("replay", FLAGS_num_threads);
+  UrlFetcher fetcher(event_base.get(), &pool);
+
+  Replayer replayer(&fetcher, &pool, servers);
+  LOG(INFO) << "replaying " << FLAGS_capture << " at " << FLAGS_speed
+            << "x speed";
+  const steady_clock::duration length(replayer.Run(&in, FLAGS_speed));
+  replayer.Report(length);
+
+  return 0;
+}
@@ -0,0 +1,182 @@
+#ifndef CERT_TRANS_UTIL_CLOSURE_H_
+#define CERT_TRANS_UTIL_CLOSURE_H_
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace util {
+
+
+// A move-only "void()" callable, as run by an Executor. Unlike
+// std::function, it keeps small callables in place rather than on the
+// heap: a std::bind of a method with a few arguments, a lambda with a
+// few captures, or a std::function itself all fit.
+//
+// Anything callable converts to it, and an empty std::function
+// converts to an empty Closure.
+class Closure {
+ public:
+  static const size_t kInlineSize = 7 * sizeof(void*);
+
+  Closure() : ops_(nullptr) {
+  }
+
+  Closure(std::nullptr_t) : ops_(nullptr) {
+  }
+
+  Closure(const std::function<void()>& function) : ops_(nullptr) {
+    if (function) {
+      Init(function);
+    }
+  }
+
+  Closure(std::function<void()>&& function) : ops_(nullptr) {
+    if (function) {
+      Init(std::move(function));
+    }
+  }
+
+  template <class F, class = typename std::enable_if<
+                         !std::is_same<typename std::decay<F>::type,
+                                       Closure>::value &&
+                         !std::is_same<typename std::decay<F>::type,
+                                       std::function<void()>>::value>::type>
+  Closure(F&& f)
+      : ops_(nullptr) {
+    Init(std::forward<F>(f));
+  }
+
+  Closure(Closure&& other) : ops_(other.ops_) {
+    if (ops_) {
+      ops_->move(&other.storage_, &storage_);
+      other.ops_ = nullptr;
+    }
+  }
+
+  Closure& operator=(Closure&& other) {
+    if (this != &other) {
+      Reset();
+      if (other.ops_) {
+        other.ops_->move(&other.storage_, &storage_);
+        ops_ = other.ops_;
+        other.ops_ = nullptr;
+      }
+    }
+    return *this;
+  }
+
+  Closure& operator=(std::nullptr_t) {
+    Reset();
+    return *this;
+  }
+
+  ~Closure() {
+    Reset();
+  }
+
+  Closure(const Closure&) = delete;
+  Closure& operator=(const Closure&) = delete;
+
+  explicit operator bool() const {
+    return ops_ != nullptr;
+  }
+
+  // REQUIRES: the closure is not empty.
+  void operator()() const {
+    ops_->invoke(&storage_);
+  }
+
+ private:
+  typedef std::aligned_storage<kInlineSize>::type Storage;
+
+  struct Ops {
+    void (*invoke)(Storage* storage);
+    // Moves the callable from |from| to |to|, leaving |from| with
+    // nothing to destroy.
+    void (*move)(Storage* from, Storage* to);
+    void (*destroy)(Storage* storage);
+  };
+
+  template <class Functor>
+  struct InlineOps {
+    static void Invoke(Storage* storage) {
+      (*reinterpret_cast<Functor*>(storage))();
+    }
+    static void Move(Storage* from, Storage* to) {
+      Functor* const functor(reinterpret_cast<Functor*>(from));
+      new (to) Functor(std::move(*functor));
+      functor->~Functor();
+    }
+    static void Destroy(Storage* storage) {
+      reinterpret_cast<Functor*>(storage)->~Functor();
+    }
+    static const Ops kOps;
+  };
+
+  template <class Functor>
+  struct HeapOps {
+    static void Invoke(Storage* storage) {
+      (**reinterpret_cast<Functor**>(storage))();
+    }
+    static void Move(Storage* from, Storage* to) {
+      new (to) Functor*(*reinterpret_cast<Functor**>(from));
+    }
+    static void Destroy(Storage* storage) {
+      delete *reinterpret_cast<Functor**>(storage);
+    }
+    static const Ops kOps;
+  };
+
+  template <class F>
+  void Init(F&& f) {
+    typedef typename std::decay<F>::type Functor;
+    // Moving must not throw, as it happens within the move constructor.
+    Store<Functor>(std::forward<F>(f),
+                   std::integral_constant<
+                       bool,
+                       sizeof(Functor) <= sizeof(Storage) &&
+                           alignof(Functor) <= alignof(Storage) &&
+                           std::is_nothrow_move_constructible<Functor>::value>());
+  }
+
+  template <class Functor, class F>
+  void Store(F&& f, std::true_type /* inline */) {
+    new (&storage_) Functor(std::forward<F>(f));
+    ops_ = &InlineOps<Functor>::kOps;
+  }
+
+  template <class Functor, class F>
+  void Store(F&& f, std::false_type /* inline */) {
+    new (&storage_) Functor*(new Functor(std::forward<F>(f)));
+    ops_ = &HeapOps<Functor>::kOps;
+  }
+
+  void Reset() {
+    if (ops_) {
+      ops_->destroy(&storage_);
+      ops_ = nullptr;
+    }
+  }
+
+  // The callable can be called from a const method, like with
+  // std::function.
+  mutable Storage storage_;
+  const Ops* ops_;
+};
+
+
+template <class Functor>
+const Closure::Ops Closure::InlineOps<Functor>::kOps = {&Invoke, &Move,
+                                                        &Destroy};
+
+template <class Functor>
+const Closure::Ops Closure::HeapOps<Functor>::kOps = {&Invoke, &Move,
+                                                      &Destroy};
+
+
+}  // namespace util
+
+#endif  // CERT_TRANS_UTIL_CLOSURE_H_
@@ -0,0 +1,82 @@
+#include "util/closure.h"
+
+#include <gtest/gtest.h>
+#include <functional>
+#include <memory>
+#include <utility>
+
+#include "util/testing.h"
+
+namespace util {
+namespace {
+
+using std::function;
+using std::make_shared;
+using std::move;
+using std::shared_ptr;
+
+
+TEST(ClosureTest, Empty) {
+  EXPECT_FALSE(Closure());
+  EXPECT_FALSE(Closure(nullptr));
+  EXPECT_FALSE(Closure(function<void()>()));
+}
+
+
+TEST(ClosureTest, RunsSmallAndLargeCallables) {
+  int count(0);
+  const Closure small([&count]() { ++count; });
+  small();
+  EXPECT_EQ(1, count);
+
+  char padding[2 * Closure::kInlineSize] = {1};
+  const Closure large([&count, padding]() { count += padding[0]; });
+  large();
+  EXPECT_EQ(2, count);
+
+  const function<void()> function([&count]() { ++count; });
+  const Closure adapted(function);
+  ASSERT_TRUE(adapted);
+  adapted();
+  EXPECT_EQ(3, count);
+}
+
+
+TEST(ClosureTest, MovesAndDestroysOnce) {
+  char padding[2 * Closure::kInlineSize] = {0};
+  const shared_ptr<int> small_counter(make_shared<int>(0));
+  const shared_ptr<int> large_counter(make_shared<int>(0));
+  {
+    Closure small([small_counter]() { ++*small_counter; });
+    Closure large([large_counter, padding]() { ++*large_counter; });
+    EXPECT_EQ(2, small_counter.use_count());
+    EXPECT_EQ(2, large_counter.use_count());
+
+    Closure moved(move(small));
+    EXPECT_FALSE(small);
+    moved();
+    EXPECT_EQ(1, *small_counter);
+
+    moved = move(large);
+    EXPECT_FALSE(large);
+    EXPECT_EQ(1, small_counter.use_count());
+    moved();
+    EXPECT_EQ(1, *large_counter);
+
+    moved = nullptr;
+    EXPECT_FALSE(moved);
+    EXPECT_EQ(1, large_counter.use_count());
+  }
+  EXPECT_EQ(1, small_counter.use_count());
+  EXPECT_EQ(1, large_counter.use_count());
+}
+
+
+}  // namespace
+}  // namespace util
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,159 @@
+#include "util/cpu_affinity.h"
+
+#include <glog/logging.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <thread>
+
+using std::getline;
+using std::ifstream;
+using std::max;
+using std::move;
+using std::string;
+using std::to_string;
+using std::vector;
+
+namespace util {
+namespace {
+
+
+const char kNodeDir[] = "/sys/devices/system/node/";
+
+
+// Parses the decimal number at the start of |str|, advancing it past
+// it.
+bool ParseCpu(const char** str, int* cpu) {
+  if (**str < '0' || **str > '9') {
+    return false;
+  }
+  char* end;
+  const long value(strtol(*str, &end, 10));
+  if (value >= CPU_SETSIZE) {
+    return false;
+  }
+  *cpu = value;
+  *str = end;
+  return true;
+}
+
+
+// The list in the file at |path|, or an empty one if it cannot be
+// read. The files of sysfs have no size of their own, so they are
+// read a line at a time rather than with util::ReadTextFile().
+vector<int> ReadCpuList(const string& path) {
+  ifstream in(path);
+  string line;
+  vector<int> cpus;
+  if (!getline(in, line) || !ParseCpuList(line, &cpus)) {
+    cpus.clear();
+  }
+  return cpus;
+}
+
+
+}  // namespace
+
+
+bool ParseCpuList(const string& list, vector<int>* cpus) {
+  CHECK_NOTNULL(cpus)->clear();
+  // The kernel ends its lists with a newline.
+  const string trimmed(list.substr(0, list.find_last_not_of("\n ") + 1));
+  const char* str(trimmed.c_str());
+  while (*str != '\0') {
+    int first, last;
+    if (!ParseCpu(&str, &first)) {
+      return false;
+    }
+    last = first;
+    if (*str == '-') {
+      ++str;
+      if (!ParseCpu(&str, &last) || last < first) {
+        return false;
+      }
+    }
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus->push_back(cpu);
+    }
+    if (*str == ',') {
+      ++str;
+      if (*str == '\0') {
+        return false;
+      }
+    } else if (*str != '\0') {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+vector<vector<int>> NumaNodeCpus() {
+  vector<vector<int>> nodes;
+  for (const int node : ReadCpuList(string(kNodeDir) + "online")) {
+    vector<int> cpus(
+        ReadCpuList(kNodeDir + ("node" + to_string(node)) + "/cpulist"));
+    // Nodes with only memory have none.
+    if (!cpus.empty()) {
+      nodes.emplace_back(move(cpus));
+    }
+  }
+
+  if (nodes.empty()) {
+    nodes.emplace_back();
+    const int num_cpus(max(1U, std::thread::hardware_concurrency()));
+    for (int cpu = 0; cpu < num_cpus; ++cpu) {
+      nodes.back().push_back(cpu);
+    }
+  }
+  return nodes;
+}
+
+
+vector<int> CurrentThreadCpus() {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  vector<int> cpus;
+  const int ret(pthread_getaffinity_np(pthread_self(), sizeof(set), &set));
+  if (ret != 0) {
+    LOG(WARNING) << "pthread_getaffinity_np: " << strerror(ret);
+    return cpus;
+  }
+  for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &set)) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+
+bool PinThread(pthread_t thread, const vector<int>& cpus) {
+  if (cpus.empty()) {
+    LOG(WARNING) << "Not pinning a thread to no CPU at all";
+    return false;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (const int cpu : cpus) {
+    CHECK_GE(cpu, 0);
+    CHECK_LT(cpu, CPU_SETSIZE);
+    CPU_SET(cpu, &set);
+  }
+  const int ret(pthread_setaffinity_np(thread, sizeof(set), &set));
+  if (ret != 0) {
+    LOG(WARNING) << "pthread_setaffinity_np: " << strerror(ret);
+    return false;
+  }
+  return true;
+}
+
+
+bool PinCurrentThread(const vector<int>& cpus) {
+  return PinThread(pthread_self(), cpus);
+}
+
+
+}  // namespace util
@@ -0,0 +1,35 @@
+#ifndef CERT_TRANS_UTIL_CPU_AFFINITY_H_
+#define CERT_TRANS_UTIL_CPU_AFFINITY_H_
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+namespace util {
+
+
+// Parses a list of CPUs as the kernel writes them (and taskset reads
+// them), such as "0-3,8,10-11", into |cpus|, in order. Returns false
+// if it is malformed.
+bool ParseCpuList(const std::string& list, std::vector<int>* cpus);
+
+// The CPUs of each NUMA node, in order of node. If that is not known
+// (not Linux, or no NUMA support), all the CPUs are returned as one
+// node.
+std::vector<std::vector<int>> NumaNodeCpus();
+
+// The CPUs the calling thread may run on.
+std::vector<int> CurrentThreadCpus();
+
+// Restricts |thread| to running on |cpus|. Memory it touches first is
+// then allocated on their NUMA node(s), as Linux does by default.
+// Returns false (and logs why) if it could not be done.
+bool PinThread(pthread_t thread, const std::vector<int>& cpus);
+
+// Same as PinThread(), for the calling thread.
+bool PinCurrentThread(const std::vector<int>& cpus);
+
+
+}  // namespace util
+
+#endif  // CERT_TRANS_UTIL_CPU_AFFINITY_H_
@@ -0,0 +1,81 @@
+#include "util/cpu_affinity.h"
+
+#include <gtest/gtest.h>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "util/testing.h"
+
+namespace util {
+namespace {
+
+using std::set;
+using std::thread;
+using std::vector;
+
+
+TEST(CpuAffinityTest, ParsesCpuLists) {
+  vector<int> cpus;
+  EXPECT_TRUE(ParseCpuList("0-3,8,10-11\n", &cpus));
+  EXPECT_EQ(vector<int>({0, 1, 2, 3, 8, 10, 11}), cpus);
+
+  EXPECT_TRUE(ParseCpuList("5", &cpus));
+  EXPECT_EQ(vector<int>({5}), cpus);
+
+  // As for a node without CPUs.
+  EXPECT_TRUE(ParseCpuList("\n", &cpus));
+  EXPECT_TRUE(cpus.empty());
+}
+
+
+TEST(CpuAffinityTest, RejectsMalformedCpuLists) {
+  vector<int> cpus;
+  EXPECT_FALSE(ParseCpuList("a", &cpus));
+  EXPECT_FALSE(ParseCpuList("1,", &cpus));
+  EXPECT_FALSE(ParseCpuList("1-", &cpus));
+  EXPECT_FALSE(ParseCpuList("3-1", &cpus));
+  EXPECT_FALSE(ParseCpuList("-1", &cpus));
+  EXPECT_FALSE(ParseCpuList("1 2", &cpus));
+  EXPECT_FALSE(ParseCpuList("1000000", &cpus));
+}
+
+
+TEST(CpuAffinityTest, FindsNumaNodes) {
+  const vector<vector<int>> nodes(NumaNodeCpus());
+  ASSERT_FALSE(nodes.empty());
+  set<int> seen;
+  for (const vector<int>& node : nodes) {
+    EXPECT_FALSE(node.empty());
+    for (const int cpu : node) {
+      EXPECT_TRUE(seen.insert(cpu).second) << cpu;
+    }
+  }
+}
+
+
+TEST(CpuAffinityTest, PinsThreads) {
+  const vector<int> cpus(CurrentThreadCpus());
+  ASSERT_FALSE(cpus.empty());
+
+  // On a thread of its own, to leave that of the test alone.
+  thread pinned([&cpus]() {
+    const vector<int> last(1, cpus.back());
+    EXPECT_TRUE(PinCurrentThread(last));
+    EXPECT_EQ(last, CurrentThreadCpus());
+    EXPECT_FALSE(PinCurrentThread(vector<int>()));
+    EXPECT_EQ(last, CurrentThreadCpus());
+  });
+  pinned.join();
+  EXPECT_EQ(cpus, CurrentThreadCpus());
+}
+
+
+}  // namespace
+}  // namespace util
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -2,21 +2,28 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <algorithm>
 #include <ctime>
+#include <deque>
+#include <iterator>
 #include <utility>
 #include <event2/http.h>
 
 #include "util/json_wrapper.h"
 #include "util/libevent_wrapper.h"
 #include "util/statusor.h"
+#include "util/trace.h"
 
 namespace libevent = cert_trans::libevent;
 
+using std::advance;
 using std::atoll;
 using std::bind;
 using std::chrono::seconds;
 using std::chrono::system_clock;
 using std::ctime;
+using std::deque;
+using std::find;
 using std::list;
 using std::lock_guard;
 using std::make_pair;
@@ -26,12 +33,14 @@ using std::max;
 using std::move;
 using std::mutex;
 using std::ostringstream;
+using std::pair;
 using std::placeholders::_1;
 using std::shared_ptr;
 using std::stoi;
 using std::string;
 using std::time_t;
 using std::to_string;
+using std::unique_lock;
 using std::unique_ptr;
 using std::vector;
 using util::Executor;
@@ -43,11 +52,12 @@ using util::Task;
 DEFINE_int32(etcd_watch_error_retry_delay_seconds, 5,
              "delay between retrying etcd watch requests");
 DEFINE_bool(etcd_consistent, true,
-            "Add consistent=true param to all requests. Do not turn this off "
-            "unless you *know* what you're doing.");
+            "Add consistent=true param to all requests which are not "
+            "stale-ok. Do not turn this off unless you *know* what you're "
+            "doing.");
 DEFINE_bool(etcd_quorum, true,
-            "Add quorum=true param to all requests. Do not turn this off "
-            "unless you *know* what you're doing.");
+            "Add quorum=true param to all requests which are not stale-ok. "
+            "Do not turn this off unless you *know* what you're doing.");
 DEFINE_int32(etcd_connection_timeout_seconds, 10,
              "Number of seconds after which to timeout etcd connections.");
 
@@ -406,33 +416,41 @@ static const EtcdClient::Node kInvalidNode(-1, -1, "", false, "", {}, true);
 struct EtcdClient::RequestState {
   RequestState(UrlFetcher::Verb verb, const string& key,
                const string& key_space, map<string, string> params,
-               const HostPortPair& host_port, GenericResponse* gen_resp,
-               Task* parent_task)
+               Consistency consistency, const HostPortPair& host_port,
+               GenericResponse* gen_resp, Task* parent_task)
       : gen_resp_(CHECK_NOTNULL(gen_resp)),
-        parent_task_(CHECK_NOTNULL(parent_task)) {
+        parent_task_(CHECK_NOTNULL(parent_task)),
+        consistency_(consistency),
+        span_("etcd_request", util::trace::Phase::ETCD) {
     CHECK(!key.empty());
     CHECK_EQ(key[0], '/');
+    span_.AddTag("key", key_space + key);
 
     req_.verb = verb;
     SetHostPort(host_port);
 
-    if (FLAGS_etcd_consistent) {
-      params.insert(make_pair("consistent", "true"));
-    } else {
+    // Stale requests are served by the etcd member from what it has
+    // applied so far, these flags would send them to the leader.
+    if (consistency_ == Consistency::QUORUM) {
+      if (FLAGS_etcd_consistent) {
+        params.insert(make_pair("consistent", "true"));
+      } else {
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wunknown-pragmas"
 #pragma clang diagnostic ignored "-Wunused-local-typedef"
-      LOG_EVERY_N(WARNING, 100) << "Sending request without 'consistent=true'";
+        LOG_EVERY_N(WARNING, 100)
+            << "Sending request without 'consistent=true'";
 #pragma clang diagnotic pop
-    }
-    if (FLAGS_etcd_quorum) {
-      params.insert(make_pair("quorum", "true"));
-    } else {
+      }
+      if (FLAGS_etcd_quorum) {
+        params.insert(make_pair("quorum", "true"));
+      } else {
 #pragma clang diagnostic push
 #pragma clang diagnostic ignored "-Wunknown-pragmas"
 #pragma clang diagnostic ignored "-Wunused-local-typedef"
-      LOG_EVERY_N(WARNING, 100) << "Sending request without 'quorum=true'";
+        LOG_EVERY_N(WARNING, 100) << "Sending request without 'quorum=true'";
 #pragma clang diagnotic pop
+      }
     }
 
     req_.url.SetPath(key_space + key);
@@ -460,18 +478,25 @@ struct EtcdClient::RequestState {
 
   GenericResponse* const gen_resp_;
   Task* const parent_task_;
+  const Consistency consistency_;
+  // Ends when the request state is deleted, once the task is done.
+  util::trace::Span span_;
 
   UrlFetcher::Request req_;
   UrlFetcher::Response resp_;
 };
 
 
+// The stream of requests watching a key, shared by all the Watch()
+// calls for that key.
 struct EtcdClient::WatchState {
-  WatchState(const string& key, const WatchCallback& cb, Task* task)
+  WatchState(const string& key, Task* task)
       : key_(key),
-        cb_(cb),
         task_(CHECK_NOTNULL(task)),
-        highest_index_seen_(-1) {
+        highest_index_seen_(-1),
+        initialized_(false),
+        pending_deliveries_(0),
+        stalled_(false) {
   }
 
   ~WatchState() {
@@ -479,11 +504,39 @@ struct EtcdClient::WatchState {
   }
 
   const string key_;
-  const WatchCallback cb_;
   Task* const task_;
 
   int64_t highest_index_seen_;
-  map<string, int64_t> known_keys_;
+
+  mutex lock_;
+  // Whether known_nodes_ has been filled by an initial get.
+  bool initialized_;
+  map<string, Node> known_nodes_;
+  vector<shared_ptr<Watcher>> watchers_;
+  // Number of updates queued to the watchers, which have to be
+  // delivered before starting the next request.
+  int pending_deliveries_;
+  // Set when the next request was not started, because all the
+  // watchers are being cancelled.
+  bool stalled_;
+};
+
+
+struct EtcdClient::Watcher {
+  Watcher(const WatchCallback& cb, Task* task)
+      : cb_(cb), task_(CHECK_NOTNULL(task)), running_(false) {
+  }
+
+  const WatchCallback cb_;
+  // The task passed to Watch(), returned once the watcher is removed
+  // from its WatchState.
+  Task* const task_;
+
+  mutex lock_;
+  // Updates yet to be given to cb_, with the WatchState to notify
+  // once they have been (if it is waiting on them).
+  deque<pair<vector<Node>, WatchState*>> pending_;
+  bool running_;
 };
 
 
@@ -520,9 +573,10 @@ void EtcdClient::WatchInitialGetDone(WatchState* state, GetResponse* resp,
   }
 
   vector<Node> updates;
-  map<string, int64_t> new_known_keys;
+  map<string, Node> new_known_nodes;
+  unique_lock<mutex> lock(state->lock_);
   VLOG(1) << "WatchGet " << state << " : num updates = " << nodes.size();
-  for (const auto& node : nodes) {
+  for (auto& node : nodes) {
     // This simply shouldn't happen, but since I think it shouldn't
     // prevent us from continuing processing, CHECKing on this would
     // just be mean...
@@ -531,8 +585,9 @@ void EtcdClient::WatchInitialGetDone(WatchState* state, GetResponse* resp,
         << ") smaller than node modifiedIndex (" << node.modified_index_
         << ") for key \"" << node.key_ << "\"";
 
-    map<string, int64_t>::iterator it(state->known_keys_.find(node.key_));
-    if (it == state->known_keys_.end() || it->second < node.modified_index_) {
+    map<string, Node>::iterator it(state->known_nodes_.find(node.key_));
+    if (it == state->known_nodes_.end() ||
+        it->second.modified_index_ < node.modified_index_) {
       VLOG(1) << "WatchGet " << state << " : updated node " << node.key_
               << " @ " << node.modified_index_;
       // Nodes received in an initial get should *always* exist!
@@ -540,23 +595,26 @@ void EtcdClient::WatchInitialGetDone(WatchState* state, GetResponse* resp,
       updates.emplace_back(node);
     }
 
-    new_known_keys[node.key_] = node.modified_index_;
-    if (it != state->known_keys_.end()) {
+    if (it != state->known_nodes_.end()) {
       VLOG(1) << "WatchGet " << state << " : stale update " << node.key_
               << " @ " << node.modified_index_;
-      state->known_keys_.erase(it);
+      state->known_nodes_.erase(it);
     }
+    const string key(node.key_);
+    new_known_nodes.emplace(key, move(node));
   }
 
-  // The keys still in known_keys_ at this point have been deleted.
-  for (const auto& key : state->known_keys_) {
+  // The keys still in known_nodes_ at this point have been deleted.
+  for (const auto& node : state->known_nodes_) {
     // TODO(pphaneuf): Passing in -1 for the created and modified
     // indices, is that a problem? We do have a "last known" modified
-    // index in key.second...
-    updates.emplace_back(Node(-1, -1, key.first, false, "", {}, true));
+    // index in node.second...
+    updates.emplace_back(Node(-1, -1, node.first, false, "", {}, true));
   }
 
-  state->known_keys_.swap(new_known_keys);
+  state->known_nodes_.swap(new_known_nodes);
+  state->initialized_ = true;
+  lock.unlock();
 
   SendWatchUpdates(state, move(updates));
 }
@@ -606,32 +664,61 @@ void EtcdClient::WatchRequestDone(WatchState* state, GetResponse* get_resp,
       max(state->highest_index_seen_, get_resp->node.modified_index_);
   updates.emplace_back(get_resp->node);
 
-  if (!get_resp->node.deleted_) {
-    state->known_keys_[get_resp->node.key_] = get_resp->node.modified_index_;
-  } else {
-    VLOG(1) << "erased key: " << get_resp->node.key_;
-    state->known_keys_.erase(get_resp->node.key_);
+  {
+    lock_guard<mutex> lock(state->lock_);
+    if (!get_resp->node.deleted_) {
+      state->known_nodes_[get_resp->node.key_] = get_resp->node;
+    } else {
+      VLOG(1) << "erased key: " << get_resp->node.key_;
+      state->known_nodes_.erase(get_resp->node.key_);
+    }
   }
 
   SendWatchUpdates(state, move(updates));
 }
 
 
-// This method should always be called on the executor of
-// state->task_.
 void EtcdClient::SendWatchUpdates(WatchState* state,
                                   const vector<Node>& updates) {
-  if (!updates.empty() || state->highest_index_seen_ == -1) {
-    state->cb_(updates);
+  {
+    lock_guard<mutex> lock(state->lock_);
+    if (!updates.empty() || state->highest_index_seen_ == -1) {
+      for (const auto& watcher : state->watchers_) {
+        ++state->pending_deliveries_;
+        QueueWatchUpdates(watcher, updates, state);
+      }
+    }
+
+    if (state->pending_deliveries_ > 0) {
+      return;
+    }
   }
 
-  // Only start the next request once the callback has return, to make
-  // sure they are always delivered in order.
   StartWatchRequest(state);
 }
 
 
 void EtcdClient::StartWatchRequest(WatchState* state) {
+  {
+    lock_guard<mutex> lock(state->lock_);
+    if (!state->task_->CancelRequested()) {
+      bool all_cancelled(true);
+      for (const auto& watcher : state->watchers_) {
+        if (!watcher->task_->CancelRequested()) {
+          all_cancelled = false;
+          break;
+        }
+      }
+      // The last watchers are going away, and will cancel this
+      // stream once they are removed (unless a new one shows up
+      // first, and starts it again).
+      if (all_cancelled) {
+        state->stalled_ = true;
+        return;
+      }
+    }
+  }
+
   if (state->task_->CancelRequested()) {
     state->task_->Return(Status::CANCELLED);
     return;
@@ -647,6 +734,82 @@ void EtcdClient::StartWatchRequest(WatchState* state) {
 }
 
 
+// Must be called with the lock of the WatchState of the watcher held.
+void EtcdClient::QueueWatchUpdates(const shared_ptr<Watcher>& watcher,
+                                   const vector<Node>& updates,
+                                   WatchState* state) {
+  lock_guard<mutex> lock(watcher->lock_);
+  watcher->pending_.emplace_back(updates, state);
+
+  if (!watcher->running_) {
+    watcher->running_ = true;
+    watcher->task_->AddHold();
+    watcher->task_->executor()->Add(
+        bind(&EtcdClient::RunWatcher, this, watcher));
+  }
+}
+
+
+void EtcdClient::RunWatcher(const shared_ptr<Watcher>& watcher) {
+  unique_lock<mutex> lock(watcher->lock_);
+  while (!watcher->pending_.empty()) {
+    const pair<vector<Node>, WatchState*> updates(
+        move(watcher->pending_.front()));
+    watcher->pending_.pop_front();
+    lock.unlock();
+
+    if (!watcher->task_->CancelRequested()) {
+      watcher->cb_(updates.first);
+    }
+    if (updates.second) {
+      WatchUpdatesDelivered(updates.second);
+    }
+
+    lock.lock();
+  }
+  watcher->running_ = false;
+  lock.unlock();
+
+  watcher->task_->RemoveHold();
+}
+
+
+void EtcdClient::WatchUpdatesDelivered(WatchState* state) {
+  {
+    lock_guard<mutex> lock(state->lock_);
+    CHECK_GT(state->pending_deliveries_, 0);
+    if (--state->pending_deliveries_ > 0) {
+      return;
+    }
+  }
+
+  // Only start the next request once every watcher has received the
+  // updates, to make sure they are always delivered in order.
+  StartWatchRequest(state);
+}
+
+
+void EtcdClient::CancelWatcher(WatchState* state,
+                               const shared_ptr<Watcher>& watcher) {
+  bool last_watcher;
+  {
+    lock_guard<mutex> lock(watches_lock_);
+    lock_guard<mutex> state_lock(state->lock_);
+    state->watchers_.erase(find(state->watchers_.begin(),
+                                state->watchers_.end(), watcher));
+    last_watcher = state->watchers_.empty();
+    if (last_watcher) {
+      watches_.erase(state->key_);
+    }
+  }
+
+  if (last_watcher) {
+    state->task_->Cancel();
+  }
+  watcher->task_->Return(Status::CANCELLED);
+}
+
+
 EtcdClient::Node::Node(int64_t created_index, int64_t modified_index,
                        const string& key, bool is_dir, const string& value,
                        vector<Node>&& nodes, bool deleted)
@@ -701,9 +864,11 @@ EtcdClient::EtcdClient(Executor* executor, UrlFetcher* fetcher,
                        const list<HostPortPair>& etcds)
     : executor_(CHECK_NOTNULL(executor)),
       log_version_task_(new SyncTask(executor_)),
+      watch_task_(new SyncTask(executor_)),
       fetcher_(CHECK_NOTNULL(fetcher)),
       etcds_(etcds),
-      logged_version_(false) {
+      logged_version_(false),
+      next_stale_endpoint_(0) {
   CHECK(!etcds_.empty()) << "No etcd hosts provided.";
   VLOG(1) << "EtcdClient: " << this;
 
@@ -727,7 +892,10 @@ EtcdClient::HostPortPair EtcdClient::ChooseNextServer() {
 
 
 EtcdClient::EtcdClient()
-    : executor_(nullptr), log_version_task_(nullptr), fetcher_(nullptr) {
+    : executor_(nullptr),
+      log_version_task_(nullptr),
+      watch_task_(nullptr),
+      fetcher_(nullptr) {
 }
 
 
@@ -737,6 +905,10 @@ EtcdClient::~EtcdClient() {
     log_version_task_->task()->Return();
     log_version_task_->Wait();
   }
+  if (watch_task_) {
+    watch_task_->task()->Return();
+    watch_task_->Wait();
+  }
 }
 
 
@@ -748,7 +920,10 @@ void EtcdClient::FetchDone(RequestState* etcd_req, Task* task) {
       // Seems etcd wasn't available; pick a new etcd server and retry
       LOG(WARNING) << "Etcd fetch failed: " << task->status() << ", retrying "
                    << "on next etcd server.";
-      etcd_req->SetHostPort(ChooseNextServer());
+      etcd_req->SetHostPort(
+          etcd_req->consistency_ == Consistency::STALE_ANY
+              ? NextStaleEndpoint()
+              : ChooseNextServer());
       fetcher_->Fetch(etcd_req->req_, &etcd_req->resp_,
                       etcd_req->parent_task_->AddChild(
                           bind(&EtcdClient::FetchDone, this, etcd_req, _1)));
@@ -838,6 +1013,14 @@ EtcdClient::HostPortPair EtcdClient::UpdateEndpoint(
 }
 
 
+EtcdClient::HostPortPair EtcdClient::NextStaleEndpoint() {
+  lock_guard<mutex> lock(lock_);
+  list<HostPortPair>::const_iterator it(etcds_.begin());
+  advance(it, next_stale_endpoint_++ % etcds_.size());
+  return *it;
+}
+
+
 void EtcdClient::Get(const Request& req, GetResponse* resp, Task* task) {
   map<string, string> params;
   if (req.recursive) {
@@ -846,17 +1029,16 @@ void EtcdClient::Get(const Request& req, GetResponse* resp, Task* task) {
   if (req.wait_index > 0) {
     params["wait"] = "true";
     params["waitIndex"] = to_string(req.wait_index);
-    // TODO(pphaneuf): This is a hack, as "wait" is not incompatible
-    // with "quorum=true". It should be left to the caller, though
-    // (and I'm not sure defaulting to "quorum=true" is that good an
-    // idea, even).
-    params["quorum"] = "false";
   }
   GenericResponse* const gen_resp(new GenericResponse);
   task->DeleteWhenDone(gen_resp);
+  // Any member can wait for changes after an index (it gets them all,
+  // if a bit later), which takes the watches off the leader.
   Generic(req.key, kKeysSpace, params, UrlFetcher::Verb::GET, gen_resp,
           task->AddChild(
-              bind(&GetRequestDone, req.key, resp, task, gen_resp, _1)));
+              bind(&GetRequestDone, req.key, resp, task, gen_resp, _1)),
+          req.stale_ok || req.wait_index > 0 ? Consistency::STALE_ANY
+                                             : Consistency::QUORUM);
 }
 
 
@@ -914,6 +1096,20 @@ void EtcdClient::UpdateWithTTL(const string& key, const string& value,
 }
 
 
+void EtcdClient::RefreshTTL(const string& key, const seconds& ttl,
+                            const int64_t previous_index, Response* resp,
+                            Task* task) {
+  map<string, string> params;
+  params["refresh"] = "true";
+  params["prevIndex"] = to_string(previous_index);
+  params["ttl"] = to_string(ttl.count());
+  GenericResponse* const gen_resp(new GenericResponse);
+  task->DeleteWhenDone(gen_resp);
+  Generic(key, kKeysSpace, params, UrlFetcher::Verb::PUT, gen_resp,
+          task->AddChild(bind(&UpdateRequestDone, resp, task, gen_resp, _1)));
+}
+
+
 void EtcdClient::ForceSet(const string& key, const string& value,
                           Response* resp, Task* task) {
   map<string, string> params;
@@ -965,9 +1161,11 @@ void EtcdClient::GetStoreStats(StatsResponse* resp, Task* task) {
   GenericResponse* const gen_resp(new GenericResponse);
   task->DeleteWhenDone(gen_resp);
 
+  // Every member has its own stats, so keep asking the same one.
   Generic(kStoreStatsKey, kStatsSpace, params, UrlFetcher::Verb::GET, gen_resp,
           task->AddChild(
-              bind(&GetStoreStatsRequestDone, resp, task, gen_resp, _1)));
+              bind(&GetStoreStatsRequestDone, resp, task, gen_resp, _1)),
+          Consistency::STALE_CURRENT);
 }
 
 
@@ -975,21 +1173,70 @@ void EtcdClient::Watch(const string& key, const WatchCallback& cb,
                        Task* task) {
   VLOG(1) << "EtcdClient::Watch: " << key;
 
-  WatchState* const state(new WatchState(key, cb, task));
-  task->DeleteWhenDone(state);
+  const shared_ptr<Watcher> watcher(make_shared<Watcher>(cb, task));
+  WatchState* state;
+  bool new_state(false);
+  bool restart(false);
+  {
+    lock_guard<mutex> lock(watches_lock_);
+    map<string, WatchState*>::const_iterator it(watches_.find(key));
+    if (it != watches_.end()) {
+      state = it->second;
+    } else {
+      Task* const state_task(watch_task_->task()->AddChild([](Task*) {}));
+      state = new WatchState(key, state_task);
+      state_task->DeleteWhenDone(state);
+      state_task->WhenCancelled([state]() {
+        bool stalled;
+        {
+          lock_guard<mutex> lock(state->lock_);
+          stalled = state->stalled_;
+        }
+        if (stalled) {
+          state->task_->Return(Status::CANCELLED);
+        }
+      });
+      watches_.emplace(key, state);
+      new_state = true;
+    }
+
+    lock_guard<mutex> state_lock(state->lock_);
+    state->watchers_.emplace_back(watcher);
+    if (state->initialized_ && !state->known_nodes_.empty()) {
+      VLOG(1) << "EtcdClient::Watch: sharing the watch of " << key;
+      vector<Node> nodes;
+      for (const auto& node : state->known_nodes_) {
+        nodes.emplace_back(node.second);
+      }
+      QueueWatchUpdates(watcher, nodes, nullptr);
+    }
+    restart = state->stalled_;
+    state->stalled_ = false;
+  }
+
+  watcher->task_->WhenCancelled(
+      bind(&EtcdClient::CancelWatcher, this, state, watcher));
 
-  // This will kick off the watch logic, with an initial get request.
-  WatchRequestDone(state, nullptr, nullptr);
+  if (new_state) {
+    // This will kick off the watch logic, with an initial get request.
+    WatchRequestDone(state, nullptr, nullptr);
+  } else if (restart) {
+    StartWatchRequest(state);
+  }
 }
 
 
 void EtcdClient::Generic(const string& key, const string& key_space,
                          const map<string, string>& params,
                          UrlFetcher::Verb verb, GenericResponse* resp,
-                         Task* task) {
+                         Task* task, Consistency consistency) {
   MaybeLogEtcdVersion();
-  RequestState* const etcd_req(new RequestState(verb, key, key_space, params,
-                                                GetEndpoint(), resp, task));
+  RequestState* const etcd_req(
+      new RequestState(verb, key, key_space, params, consistency,
+                       consistency == Consistency::STALE_ANY
+                           ? NextStaleEndpoint()
+                           : GetEndpoint(),
+                       resp, task));
   task->DeleteWhenDone(etcd_req);
 
   fetcher_->Fetch(etcd_req->req_, &etcd_req->resp_,
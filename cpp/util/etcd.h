@@ -52,12 +52,16 @@ class EtcdClient {
 
   struct Request {
     Request(const std::string& thekey)
-        : key(thekey), recursive(false), wait_index(0) {
+        : key(thekey), recursive(false), wait_index(0), stale_ok(false) {
     }
 
     std::string key;
     bool recursive;
     int64_t wait_index;
+    // Whether any etcd member can serve this, from what it has applied
+    // so far, instead of the leader with quorum. These reads are spread
+    // across all the endpoints. Waiting requests are always like this.
+    bool stale_ok;
   };
 
   struct Response {
@@ -109,6 +113,16 @@ class EtcdClient {
                              const int64_t previous_index, Response* resp,
                              util::Task* task);
 
+  // Extends the TTL of |key|, if its modified index is still
+  // |previous_index|, keeping its value, and without waking up the
+  // watches on it (their next update will still have the new modified
+  // index). This needs etcd 2.3 or later: older versions would set the
+  // value to an empty string instead.
+  virtual void RefreshTTL(const std::string& key,
+                          const std::chrono::seconds& ttl,
+                          const int64_t previous_index, Response* resp,
+                          util::Task* task);
+
   virtual void ForceSet(const std::string& key, const std::string& value,
                         Response* resp, util::Task* task);
 
@@ -128,6 +142,11 @@ class EtcdClient {
   // will be sent to the executor at a time (for a given call to this
   // method, not for all of them), to make sure they are received in
   // order.
+  //
+  // Watches of the same key share a single stream of requests to
+  // etcd: a watch started while another one is running receives the
+  // nodes known so far as its first update, without fetching them
+  // again.
   virtual void Watch(const std::string& key, const WatchCallback& cb,
                      util::Task* task);
 
@@ -138,14 +157,27 @@ class EtcdClient {
  private:
   struct RequestState;
   struct WatchState;
+  struct Watcher;
+
+  // Who can serve a request.
+  enum class Consistency {
+    // The leader, with quorum (unless turned off with the flags).
+    QUORUM,
+    // The current endpoint, from what it has applied so far.
+    STALE_CURRENT,
+    // Any endpoint, taking turns, from what it has applied so far.
+    STALE_ANY,
+  };
 
   HostPortPair ChooseNextServer();
   HostPortPair GetEndpoint() const;
   HostPortPair UpdateEndpoint(HostPortPair&& new_endpoint);
+  HostPortPair NextStaleEndpoint();
   void FetchDone(RequestState* etcd_req, util::Task* task);
   void Generic(const std::string& key, const std::string& key_space,
                const std::map<std::string, std::string>& params,
-               UrlFetcher::Verb verb, GenericResponse* resp, util::Task* task);
+               UrlFetcher::Verb verb, GenericResponse* resp, util::Task* task,
+               Consistency consistency = Consistency::QUORUM);
 
   void WatchInitialGetDone(WatchState* state, GetResponse* resp,
                            util::Task* task);
@@ -153,16 +185,28 @@ class EtcdClient {
   void StartWatchRequest(WatchState* state);
   void WatchRequestDone(WatchState* state, GetResponse* gen_resp,
                         util::Task* child_task);
+  void QueueWatchUpdates(const std::shared_ptr<Watcher>& watcher,
+                         const std::vector<Node>& updates, WatchState* state);
+  void RunWatcher(const std::shared_ptr<Watcher>& watcher);
+  void WatchUpdatesDelivered(WatchState* state);
+  void CancelWatcher(WatchState* state,
+                     const std::shared_ptr<Watcher>& watcher);
 
   void MaybeLogEtcdVersion();
 
   util::Executor* const executor_;
   std::unique_ptr<util::SyncTask> log_version_task_;
+  // Parent of the tasks of the watch streams.
+  std::unique_ptr<util::SyncTask> watch_task_;
   UrlFetcher* const fetcher_;
 
   mutable std::mutex lock_;
   std::list<HostPortPair> etcds_;
   bool logged_version_;
+  size_t next_stale_endpoint_;
+
+  std::mutex watches_lock_;
+  std::map<std::string, WatchState*> watches_;
 };
 
 
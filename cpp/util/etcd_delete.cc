@@ -2,10 +2,17 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <algorithm>
+#include <deque>
 #include <functional>
+#include <map>
 #include <mutex>
 
 using std::bind;
+using std::deque;
+using std::map;
+using std::max;
+using std::min;
 using std::move;
 using std::mutex;
 using std::placeholders::_1;
@@ -17,17 +24,36 @@ using util::Task;
 using util::TaskHold;
 
 DEFINE_int32(etcd_delete_concurrency, 4,
-             "number of etcd keys to delete at a time");
+             "number of etcd keys to start deleting at a time");
+DEFINE_int32(etcd_delete_max_concurrency, 64,
+             "maximum number of etcd keys to delete at a time, as the "
+             "concurrency grows while etcd keeps up");
 
 namespace cert_trans {
 namespace {
 
+// Number of times a key is tried, when etcd is overloaded.
+const int kMaxDeleteAttempts = 3;
+
+
+bool IsOverloaded(const Status& status) {
+  switch (status.CanonicalCode()) {
+    case util::error::UNAVAILABLE:
+    case util::error::DEADLINE_EXCEEDED:
+    case util::error::RESOURCE_EXHAUSTED:
+      return true;
+    default:
+      return false;
+  }
+}
+
 
 class DeleteState {
  public:
   DeleteState(EtcdClient* client, vector<string>&& keys, Task* task)
       : client_(CHECK_NOTNULL(client)),
         task_(CHECK_NOTNULL(task)),
+        concurrency_(FLAGS_etcd_delete_concurrency),
         outstanding_(0),
         keys_(move(keys)),
         it_(keys_.begin()) {
@@ -46,33 +72,53 @@ class DeleteState {
   }
 
  private:
-  void RequestDone(Task* child_task);
+  void RequestDone(const string& key, Task* child_task);
   void StartNextRequest(unique_lock<mutex>&& lock);
 
+  bool HasMoreKeys() const {
+    return it_ != keys_.end() || !retries_.empty();
+  }
+
   EtcdClient* const client_;
   Task* const task_;
   mutex mutex_;
+  // Number of requests to have in flight. It grows by about one for
+  // every round of them that succeeds, and is halved whenever etcd
+  // cannot keep up.
+  double concurrency_;
   int outstanding_;
   const vector<string> keys_;
   vector<string>::const_iterator it_;
+  // Keys to try again, and how many times they were tried.
+  deque<string> retries_;
+  map<string, int> attempts_;
 };
 
 
-void DeleteState::RequestDone(Task* child_task) {
+void DeleteState::RequestDone(const string& key, Task* child_task) {
   unique_lock<mutex> lock(mutex_);
   --outstanding_;
 
-  // If a child task has an error (except for not found, this is close
-  // enough to success), return that error, and do not start any more
-  // requests.
-  if (!child_task->status().ok() &&
-      child_task->status().CanonicalCode() != util::error::NOT_FOUND) {
+  const Status status(child_task->status());
+  if (status.ok() || status.CanonicalCode() == util::error::NOT_FOUND) {
+    // Not found is close enough to success.
+    concurrency_ = min(concurrency_ + 1 / concurrency_,
+                       static_cast<double>(
+                           max(FLAGS_etcd_delete_max_concurrency,
+                               FLAGS_etcd_delete_concurrency)));
+  } else if (IsOverloaded(status) &&
+             ++attempts_[key] < kMaxDeleteAttempts) {
+    VLOG(1) << "Will try deleting " << key << " again: " << status;
+    concurrency_ = max(concurrency_ / 2, 1.0);
+    retries_.emplace_back(key);
+  } else {
+    // Return that error, and do not start any more requests.
     lock.unlock();
-    task_->Return(child_task->status());
+    task_->Return(status);
     return;
   }
 
-  if (it_ != keys_.end()) {
+  if (HasMoreKeys()) {
     StartNextRequest(move(lock));
   } else {
     if (outstanding_ < 1) {
@@ -94,18 +140,25 @@ void DeleteState::StartNextRequest(unique_lock<mutex>&& lock) {
     return;
   }
 
-  while (outstanding_ < FLAGS_etcd_delete_concurrency && it_ != keys_.end() &&
+  while (outstanding_ < static_cast<int>(concurrency_) && HasMoreKeys() &&
          task_->IsActive()) {
     CHECK(lock.owns_lock());
-    const string& key(*it_);
-    ++it_;
+    string key;
+    if (!retries_.empty()) {
+      key = move(retries_.front());
+      retries_.pop_front();
+    } else {
+      key = *it_;
+      ++it_;
+    }
     ++outstanding_;
 
     // In case the task uses an inline executor.
     lock.unlock();
 
-    client_->ForceDelete(key, task_->AddChild(
-                                  bind(&DeleteState::RequestDone, this, _1)));
+    client_->ForceDelete(key,
+                         task_->AddChild(
+                             bind(&DeleteState::RequestDone, this, key, _1)));
 
     // We must be holding the lock to evaluate the loop condition.
     lock.lock();
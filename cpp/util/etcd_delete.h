@@ -12,6 +12,9 @@ namespace cert_trans {
 
 // Force delete keys in batches (implemented using concurrent
 // requests). The "keys" argument are pairs of key and modified index.
+// The number of concurrent requests adapts to how well etcd keeps up,
+// and the keys it fails to delete because it is overloaded are tried
+// again.
 void EtcdForceDeleteKeys(EtcdClient* client, std::vector<std::string>&& keys,
                          util::Task* task);
 
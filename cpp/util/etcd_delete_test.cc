@@ -217,6 +217,65 @@ TEST_F(EtcdDeleteTest, ErrorHandling) {
 }
 
 
+TEST_F(EtcdDeleteTest, BacksOffWhenOverloaded) {
+  vector<string> keys{"/one", "/two", "/three"};
+  ASSERT_EQ(2, FLAGS_etcd_delete_concurrency);
+  SyncTask sync(&pool_);
+
+  Task* first_task(nullptr);
+  Notification first;
+  Task* second_task(nullptr);
+  Notification second;
+  EXPECT_CALL(client_, ForceDelete("/one", _))
+      .WillOnce(DoAll(SaveArg<1>(&first_task),
+                      InvokeWithoutArgs(&first, &Notification::Notify)));
+  EXPECT_CALL(client_, ForceDelete("/two", _))
+      .WillOnce(DoAll(SaveArg<1>(&second_task),
+                      InvokeWithoutArgs(&second, &Notification::Notify)));
+  EtcdForceDeleteKeys(&client_, move(keys), sync.task());
+
+  ASSERT_TRUE(first.WaitForNotificationWithTimeout(seconds(1)));
+  ASSERT_TRUE(first_task);
+  ASSERT_TRUE(second.WaitForNotificationWithTimeout(seconds(1)));
+  ASSERT_TRUE(second_task);
+
+  // Make sure all the expected calls were called.
+  Mock::VerifyAndClearExpectations(&client_);
+
+  // This halves the concurrency, so nothing else is started (the
+  // client is a strict mock) while the first request is outstanding.
+  second_task->Return(Status(util::error::UNAVAILABLE, "too busy"));
+  Notification second_done;
+  pool_.Add(bind(&Notification::Notify, &second_done));
+  ASSERT_TRUE(second_done.WaitForNotificationWithTimeout(seconds(1)));
+
+  // Once the first request succeeds, the concurrency grows back, and
+  // the second key is tried again, along with the third.
+  const auto succeed([](const string&, Task* task) { task->Return(); });
+  EXPECT_CALL(client_, ForceDelete("/two", _)).WillOnce(Invoke(succeed));
+  EXPECT_CALL(client_, ForceDelete("/three", _)).WillOnce(Invoke(succeed));
+  first_task->Return();
+
+  sync.Wait();
+  EXPECT_OK(sync.status());
+}
+
+
+TEST_F(EtcdDeleteTest, GivesUpWhenOverloaded) {
+  SyncTask sync(&pool_);
+
+  EXPECT_CALL(client_, ForceDelete("/one", _))
+      .Times(3)
+      .WillRepeatedly(Invoke([](const string&, Task* task) {
+        task->Return(Status(util::error::UNAVAILABLE, "too busy"));
+      }));
+  EtcdForceDeleteKeys(&client_, {"/one"}, sync.task());
+
+  sync.Wait();
+  EXPECT_THAT(sync.status(), StatusIs(util::error::UNAVAILABLE));
+}
+
+
 }  // namespace
 }  // namespace cert_trans
 
@@ -345,8 +345,7 @@ TEST_F(EtcdTest, GetWaitTooOld) {
   EXPECT_CALL(url_fetcher_,
               Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
                                       URL(GetEtcdUrl(kEntryKey) +
-                                          "?consistent=true&quorum=false&"
-                                          "recursive=true&wait=true&"
+                                          "?recursive=true&wait=true&"
                                           "waitIndex=" +
                                           to_string(kOldIndex)),
                                       IsEmpty(), ""),
@@ -369,6 +368,61 @@ TEST_F(EtcdTest, GetWaitTooOld) {
 }
 
 
+TEST_F(EtcdTest, StaleGetsAreSpreadAcrossEndpoints) {
+  EtcdClient multi_client(base_.get(), &url_fetcher_,
+                          {EtcdClient::HostPortPair(kEtcdHost, kEtcdPort),
+                           EtcdClient::HostPortPair(kEtcdHost2, kEtcdPort2),
+                           EtcdClient::HostPortPair(kEtcdHost3, kEtcdPort3)});
+
+  {
+    InSequence s;
+    for (const auto& host_port :
+         {make_pair(kEtcdHost, kEtcdPort), make_pair(kEtcdHost2, kEtcdPort2),
+          make_pair(kEtcdHost3, kEtcdPort3)}) {
+      EXPECT_CALL(url_fetcher_,
+                  Fetch(IsUrlFetchRequest(
+                            UrlFetcher::Verb::GET,
+                            URL(GetEtcdUrl(kEntryKey, kDefaultSpace,
+                                           host_port.first, host_port.second)),
+                            IsEmpty(), ""),
+                        _, _))
+          .WillOnce(
+              Invoke(bind(HandleFetch, ::util::OkStatus(), 200,
+                          UrlFetcher::Headers{make_pair("x-etcd-index", "11")},
+                          kGetJson, _1, _2, _3)));
+    }
+    // Other requests still go to the leader, with quorum.
+    EXPECT_CALL(url_fetcher_,
+                Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                        URL(GetEtcdUrl(kEntryKey) +
+                                            "?consistent=true&quorum=true"),
+                                        IsEmpty(), ""),
+                      _, _))
+        .WillOnce(
+            Invoke(bind(HandleFetch, ::util::OkStatus(), 200,
+                        UrlFetcher::Headers{make_pair("x-etcd-index", "11")},
+                        kGetJson, _1, _2, _3)));
+  }
+
+  EtcdClient::Request req(kEntryKey);
+  req.stale_ok = true;
+  for (int i(0); i < 3; ++i) {
+    SyncTask task(base_.get());
+    EtcdClient::GetResponse resp;
+    multi_client.Get(req, &resp, task.task());
+    task.Wait();
+    EXPECT_OK(task);
+    EXPECT_EQ("123", resp.node.value_);
+  }
+
+  SyncTask task(base_.get());
+  EtcdClient::GetResponse resp;
+  multi_client.Get(string(kEntryKey), &resp, task.task());
+  task.Wait();
+  EXPECT_OK(task);
+}
+
+
 TEST_F(EtcdTest, Create) {
   EXPECT_CALL(
       url_fetcher_,
@@ -545,6 +599,28 @@ TEST_F(EtcdTest, UpdateWithTTLFails) {
 }
 
 
+TEST_F(EtcdTest, RefreshTTL) {
+  EXPECT_CALL(
+      url_fetcher_,
+      Fetch(IsUrlFetchRequest(
+                UrlFetcher::Verb::PUT, URL(GetEtcdUrl(kEntryKey)),
+                ElementsAre(Pair(StrCaseEq("content-type"),
+                                 "application/x-www-form-urlencoded")),
+                "consistent=true&prevIndex=5&quorum=true&refresh=true&ttl=100"),
+            _, _))
+      .WillOnce(
+          Invoke(bind(HandleFetch, ::util::OkStatus(), 200,
+                      UrlFetcher::Headers{make_pair("x-etcd-index", "1")},
+                      kUpdateJson, _1, _2, _3)));
+  SyncTask task(base_.get());
+  EtcdClient::Response resp;
+  client_.RefreshTTL(kEntryKey, seconds(100), 5, &resp, task.task());
+  task.Wait();
+  EXPECT_OK(task);
+  EXPECT_EQ(6, resp.etcd_index);
+}
+
+
 TEST_F(EtcdTest, ForceSetForPreexistingKey) {
   EXPECT_CALL(url_fetcher_,
               Fetch(IsUrlFetchRequest(
@@ -786,8 +862,7 @@ TEST_F(EtcdTest, WatchHangingGetTimeoutCausesRetry) {
     EXPECT_CALL(url_fetcher_,
                 Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
                                         URL(GetEtcdUrl(kEntryKey) +
-                                            "?consistent=true&quorum=false" +
-                                            "&recursive=true&wait=true" +
+                                            "?recursive=true&wait=true" +
                                             "&waitIndex=10"),
                                         IsEmpty(), ""),
                       _, _))
@@ -797,8 +872,7 @@ TEST_F(EtcdTest, WatchHangingGetTimeoutCausesRetry) {
     EXPECT_CALL(url_fetcher_,
                 Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
                                         URL(GetEtcdUrl(kEntryKey) +
-                                            "?consistent=true&quorum=false" +
-                                            "&recursive=true&wait=true" +
+                                            "?recursive=true&wait=true" +
                                             "&waitIndex=10"),
                                         IsEmpty(), ""),
                       _, _))
@@ -826,6 +900,79 @@ TEST_F(EtcdTest, WatchHangingGetTimeoutCausesRetry) {
 }
 
 
+TEST_F(EtcdTest, WatchesOfTheSameKeyShareRequests) {
+  const char kWatchJson[] =
+      "{"
+      "  \"action\": \"set\","
+      "  \"node\": {"
+      "    \"createdIndex\": 6,"
+      "    \"key\": \"/some/key\","
+      "    \"modifiedIndex\": 10,"
+      "    \"value\": \"456\""
+      "  }"
+      "}";
+
+  {
+    InSequence s;
+    EXPECT_CALL(url_fetcher_,
+                Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                        URL(GetEtcdUrl(kEntryKey) +
+                                            "?consistent=true&quorum=true"),
+                                        IsEmpty(), ""),
+                      _, _))
+        .WillOnce(
+            Invoke(bind(HandleFetch, ::util::OkStatus(), 200,
+                        UrlFetcher::Headers{make_pair("x-etcd-index", "9")},
+                        kGetJson, _1, _2, _3)));
+    EXPECT_CALL(url_fetcher_,
+                Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
+                                        URL(GetEtcdUrl(kEntryKey) +
+                                            "?recursive=true&wait=true" +
+                                            "&waitIndex=10"),
+                                        IsEmpty(), ""),
+                      _, _))
+        .WillOnce(
+            Invoke(bind(HandleFetch, ::util::OkStatus(), 200,
+                        UrlFetcher::Headers{make_pair("x-etcd-index", "10")},
+                        kWatchJson, _1, _2, _3)));
+  }
+
+  SyncTask task1(base_.get());
+  SyncTask task2(base_.get());
+  vector<int64_t> indices1;
+  vector<int64_t> indices2;
+  client_.Watch(
+      kEntryKey,
+      [this, &task1, &task2, &indices1,
+       &indices2](const vector<EtcdClient::Node>& updates) {
+        ASSERT_EQ(static_cast<size_t>(1), updates.size());
+        indices1.push_back(updates[0].modified_index_);
+        if (indices1.size() > 1) {
+          task1.Cancel();
+          return;
+        }
+        // Joins the watch above, which already knows the key, so this
+        // gets it without another request.
+        client_.Watch(kEntryKey,
+                      [&task2,
+                       &indices2](const vector<EtcdClient::Node>& updates) {
+                        ASSERT_EQ(static_cast<size_t>(1), updates.size());
+                        indices2.push_back(updates[0].modified_index_);
+                        if (indices2.size() > 1) {
+                          task2.Cancel();
+                        }
+                      },
+                      task2.task());
+      },
+      task1.task());
+  task1.Wait();
+  task2.Wait();
+
+  EXPECT_EQ((vector<int64_t>{9, 10}), indices1);
+  EXPECT_EQ((vector<int64_t>{9, 10}), indices2);
+}
+
+
 TEST_F(EtcdTest, UnavailableEtcdRetriesOnNewServer) {
   EtcdClient multi_client(base_.get(), &url_fetcher_,
                           {EtcdClient::HostPortPair(kEtcdHost, kEtcdPort),
@@ -999,8 +1146,7 @@ TEST_F(EtcdTest, FollowsMasterChangeRedirectToKnownHost) {
 TEST_F(EtcdTest, GetStoreStats) {
   EXPECT_CALL(url_fetcher_,
               Fetch(IsUrlFetchRequest(UrlFetcher::Verb::GET,
-                                      URL(GetEtcdUrl("/store", "/v2/stats") +
-                                          "?consistent=true&quorum=true"),
+                                      URL(GetEtcdUrl("/store", "/v2/stats")),
                                       IsEmpty(), ""),
                     _, _))
       .WillOnce(
@@ -2,7 +2,8 @@
 #define CERT_TRANS_UTIL_EXECUTOR_H_
 
 #include <chrono>
-#include <functional>
+
+#include "util/closure.h"
 
 namespace util {
 class Task;
@@ -14,7 +15,7 @@ class Executor {
   Executor& operator=(const Executor&) = delete;
   virtual ~Executor() = default;
 
-  virtual void Add(const std::function<void()>& closure) = 0;
+  virtual void Add(Closure closure) = 0;
   virtual void Delay(const std::chrono::duration<double>& delay,
                      Task* task) = 0;
 
@@ -276,10 +276,11 @@ void FakeEtcdClient::Get(const Request& req, GetResponse* resp, Task* task) {
 void FakeEtcdClient::InternalPut(const string& rawkey, const string& value,
                                  const system_clock::time_point& expires,
                                  bool create, int64_t prev_index,
-                                 Response* resp, Task* task) {
+                                 Response* resp, Task* task, bool refresh) {
   const string key(NormalizeKey(rawkey));
   CHECK_NE(key.back(), '/');
   CHECK(!create || prev_index <= 0);
+  CHECK(!refresh || prev_index > 0);
 
   vector<string> parents;
   for (string::size_type offset = 0; offset < key.size();) {
@@ -340,13 +341,18 @@ void FakeEtcdClient::InternalPut(const string& rawkey, const string& value,
       return;
     }
     node.created_index_ = entry->second.created_index_;
+    if (refresh) {
+      node.value_ = entry->second.value_;
+    }
   }
 
   entries_[key] = node;
   resp->etcd_index = new_index;
   index_ = new_index;
   task->Return();
-  NotifyForPath(lock, key);
+  if (!refresh) {
+    NotifyForPath(lock, key);
+  }
   DumpEntries(lock);
   if (expires < system_clock::time_point::max()) {
     const std::chrono::duration<double> delay(expires - system_clock::now());
@@ -440,6 +446,16 @@ void FakeEtcdClient::UpdateWithTTL(const string& key, const string& value,
 }
 
 
+void FakeEtcdClient::RefreshTTL(const string& key, const seconds& ttl,
+                                const int64_t previous_index, Response* resp,
+                                Task* task) {
+  task->CleanupWhenDone(bind(&FakeEtcdClient::UpdateOperationStats, this,
+                             "compareAndSwap", task));
+  InternalPut(key, "", system_clock::now() + ttl, false, previous_index, resp,
+              task, true /* refresh */);
+}
+
+
 void FakeEtcdClient::ForceSet(const string& key, const string& value,
                               Response* resp, Task* task) {
   task->CleanupWhenDone(
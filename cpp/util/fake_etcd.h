@@ -40,6 +40,10 @@ class FakeEtcdClient : public EtcdClient {
                      const int64_t previous_index, Response* resp,
                      util::Task* task) override;
 
+  void RefreshTTL(const std::string& key, const std::chrono::seconds& ttl,
+                  const int64_t previous_index, Response* resp,
+                  util::Task* task) override;
+
   void ForceSet(const std::string& key, const std::string& value,
                 Response* resp, util::Task* task) override;
 
@@ -69,10 +73,12 @@ class FakeEtcdClient : public EtcdClient {
   void NotifyForPath(const std::unique_lock<std::mutex>& lock,
                      const std::string& path);
 
+  // If |refresh| is true, the value of the (existing) entry is kept,
+  // and the watches are not notified.
   void InternalPut(const std::string& rawkey, const std::string& value,
                    const std::chrono::system_clock::time_point& expires,
                    bool create, int64_t prev_index, Response* resp,
-                   util::Task* task);
+                   util::Task* task, bool refresh = false);
 
   void InternalDelete(const std::string& key, const int64_t current_index,
                       util::Task* task);
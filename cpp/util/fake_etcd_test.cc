@@ -131,6 +131,16 @@ class FakeEtcdTest : public ::testing::Test {
     return task.status();
   }
 
+  Status BlockingRefreshTTL(const string& key, const seconds& ttl,
+                            int64_t previous_index, int64_t* modified_index) {
+    SyncTask task(base_.get());
+    EtcdClient::Response resp;
+    client_->RefreshTTL(key, ttl, previous_index, &resp, task.task());
+    task.Wait();
+    *modified_index = resp.etcd_index;
+    return task.status();
+  }
+
   Status BlockingForceSet(const string& key, const string& value,
                           int64_t* modified_index) {
     SyncTask task(base_.get());
@@ -493,8 +503,8 @@ class CheckingExecutor : public util::Executor {
   CheckingExecutor() : inner_(1), in_executor_(false) {
   }
 
-  void Add(const std::function<void()>& closure) override {
-    inner_.Add(bind(&CheckingExecutor::Check, this, closure));
+  void Add(util::Closure closure) override {
+    inner_.Add(bind(&CheckingExecutor::Check, this, std::move(closure)));
   }
 
   void Delay(const duration<double>& delay, util::Task* task) override {
@@ -508,7 +518,7 @@ class CheckingExecutor : public util::Executor {
   }
 
  private:
-  void Check(const std::function<void()>& closure) {
+  void Check(const util::Closure& closure) {
     {
       lock_guard<mutex> lock(lock_);
       CHECK(!in_executor_);
@@ -684,6 +694,50 @@ TEST_F(FakeEtcdTest, WatcherWithTTLExpires) {
 }
 
 
+TEST_F(FakeEtcdTest, RefreshTTLKeepsValueAndWatchers) {
+  const string kDir(key_prefix_);
+  const string kPath(kDir + "/subkey");
+  const seconds kTtl(3);
+  int64_t created_index;
+  EXPECT_OK(BlockingCreateWithTTL(kPath, kValue, kTtl, &created_index));
+
+  StrictMock<MockFunction<void(const vector<EtcdClient::Node>&)>> watcher;
+  Notification initial;
+  EXPECT_CALL(watcher,
+              Call(ElementsAre(EtcdClientNodeIs(kPath, "value", false))))
+      .WillOnce(InvokeWithoutArgs(&initial, &Notification::Notify));
+
+  util::SyncTask watch_task(base_.get());
+  client_->Watch(
+      kDir, bind(&MockFunction<void(const vector<EtcdClient::Node>&)>::Call,
+                 &watcher, _1),
+      watch_task.task());
+
+  ASSERT_TRUE(initial.WaitForNotificationWithTimeout(seconds(1)));
+  Mock::VerifyAndClearExpectations(&watcher);
+
+  // Keep it alive past its original TTL, with no update to the watch.
+  int64_t modified_index(created_index);
+  for (int i = 0; i < 4; ++i) {
+    sleep_for(seconds(1));
+    const int64_t previous_index(modified_index);
+    EXPECT_OK(BlockingRefreshTTL(kPath, kTtl, previous_index, &modified_index));
+    EXPECT_LT(previous_index, modified_index);
+  }
+  EXPECT_THAT(BlockingRefreshTTL(kPath, kTtl, created_index, &modified_index),
+              StatusIs(util::error::FAILED_PRECONDITION));
+
+  EtcdClient::Node node;
+  EXPECT_OK(BlockingGet(kPath, &node));
+  EXPECT_EQ(kValue, node.value_);
+  EXPECT_EQ(created_index, node.created_index_);
+
+  watch_task.Cancel();
+  watch_task.Wait();
+  EXPECT_THAT(watch_task.status(), StatusIs(util::error::CANCELLED));
+}
+
+
 TEST_F(FakeEtcdTest, PutUnderNonDir) {
   const string kPath1(key_prefix_);
   const string kPath2(kPath1 + "/subkey");
@@ -0,0 +1,282 @@
+#include "util/faulty_etcd.h"
+
+#include <glog/logging.h>
+#include <deque>
+
+using std::bind;
+using std::chrono::duration;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::deque;
+using std::function;
+using std::lock_guard;
+using std::map;
+using std::move;
+using std::mutex;
+using std::placeholders::_1;
+using std::string;
+using std::unique_lock;
+using std::vector;
+using util::Status;
+using util::Task;
+
+namespace cert_trans {
+
+
+struct FaultyEtcdClient::WatchState {
+  explicit WatchState(const WatchCallback& cb)
+      : cb(cb), last_due(steady_clock::now()), delivering(false) {
+  }
+
+  const WatchCallback cb;
+
+  mutex lock;
+  // The updates waiting for their delay, in order.
+  deque<vector<Node>> delayed;
+  steady_clock::time_point last_due;
+  // The updates due, waiting for the thread delivering them.
+  deque<vector<Node>> ready;
+  bool delivering;
+};
+
+
+FaultyEtcdClient::FaultyEtcdClient(EtcdClient* target, libevent::Base* base,
+                                   const Options& options)
+    : target_(CHECK_NOTNULL(target)),
+      base_(CHECK_NOTNULL(base)),
+      options_(options),
+      generator_(options.seed) {
+  CHECK_LE(options_.min_latency, options_.max_latency);
+  CHECK_GE(options_.loss_rate, 0);
+  CHECK_LT(options_.loss_rate, 1);
+}
+
+
+void FaultyEtcdClient::Get(const Request& req, GetResponse* resp,
+                           Task* task) {
+  Forward("get", task, [this, req, resp](Task* child) {
+    target_->Get(req, resp, child);
+  });
+}
+
+
+void FaultyEtcdClient::Create(const string& key, const string& value,
+                              Response* resp, Task* task) {
+  Forward("create", task, [this, key, value, resp](Task* child) {
+    target_->Create(key, value, resp, child);
+  });
+}
+
+
+void FaultyEtcdClient::CreateWithTTL(const string& key, const string& value,
+                                     const seconds& ttl, Response* resp,
+                                     Task* task) {
+  Forward("create", task, [this, key, value, ttl, resp](Task* child) {
+    target_->CreateWithTTL(key, value, ttl, resp, child);
+  });
+}
+
+
+void FaultyEtcdClient::Update(const string& key, const string& value,
+                              const int64_t previous_index, Response* resp,
+                              Task* task) {
+  Forward("update", task,
+          [this, key, value, previous_index, resp](Task* child) {
+            target_->Update(key, value, previous_index, resp, child);
+          });
+}
+
+
+void FaultyEtcdClient::UpdateWithTTL(const string& key, const string& value,
+                                     const seconds& ttl,
+                                     const int64_t previous_index,
+                                     Response* resp, Task* task) {
+  Forward("update", task,
+          [this, key, value, ttl, previous_index, resp](Task* child) {
+            target_->UpdateWithTTL(key, value, ttl, previous_index, resp,
+                                   child);
+          });
+}
+
+
+void FaultyEtcdClient::RefreshTTL(const string& key, const seconds& ttl,
+                                  const int64_t previous_index, Response* resp,
+                                  Task* task) {
+  Forward("refresh_ttl", task,
+          [this, key, ttl, previous_index, resp](Task* child) {
+            target_->RefreshTTL(key, ttl, previous_index, resp, child);
+          });
+}
+
+
+void FaultyEtcdClient::ForceSet(const string& key, const string& value,
+                                Response* resp, Task* task) {
+  Forward("force_set", task, [this, key, value, resp](Task* child) {
+    target_->ForceSet(key, value, resp, child);
+  });
+}
+
+
+void FaultyEtcdClient::ForceSetWithTTL(const string& key, const string& value,
+                                       const seconds& ttl, Response* resp,
+                                       Task* task) {
+  Forward("force_set", task, [this, key, value, ttl, resp](Task* child) {
+    target_->ForceSetWithTTL(key, value, ttl, resp, child);
+  });
+}
+
+
+void FaultyEtcdClient::Delete(const string& key, const int64_t current_index,
+                              Task* task) {
+  Forward("delete", task, [this, key, current_index](Task* child) {
+    target_->Delete(key, current_index, child);
+  });
+}
+
+
+void FaultyEtcdClient::ForceDelete(const string& key, Task* task) {
+  Forward("delete", task,
+          [this, key](Task* child) { target_->ForceDelete(key, child); });
+}
+
+
+void FaultyEtcdClient::GetStoreStats(StatsResponse* resp, Task* task) {
+  Forward("get_store_stats", task,
+          [this, resp](Task* child) { target_->GetStoreStats(resp, child); });
+}
+
+
+void FaultyEtcdClient::Watch(const string& key, const WatchCallback& cb,
+                             Task* task) {
+  Count("watch");
+  WatchState* const state(new WatchState(cb));
+  task->DeleteWhenDone(state);
+  // The target holds on to |task| until its last update is through,
+  // and the delays are children of it, so |state| outlives them.
+  target_->Watch(key,
+                 bind(&FaultyEtcdClient::WatchUpdate, this, state, task, _1),
+                 task);
+}
+
+
+map<string, int64_t> FaultyEtcdClient::GetStats() const {
+  lock_guard<mutex> lock(lock_);
+  return stats_;
+}
+
+
+void FaultyEtcdClient::Forward(const string& op, Task* task,
+                               const function<void(Task*)>& call) {
+  Count(op);
+  base_->Delay(PickLatency(),
+               task->AddChild(bind(&FaultyEtcdClient::RequestDone, this, task,
+                                   call, _1)));
+}
+
+
+void FaultyEtcdClient::RequestDone(Task* task,
+                                   const function<void(Task*)>& call,
+                                   Task* delay) {
+  if (!delay->status().ok()) {
+    task->Return(delay->status());
+    return;
+  }
+  if (PickLoss()) {
+    // The caller only finds out when it gives up waiting, which is
+    // taken to be when the reply would have come.
+    Count("lost_requests");
+    Reply(task, Status(util::error::UNAVAILABLE, "request lost"));
+    return;
+  }
+  call(task->AddChild(bind(&FaultyEtcdClient::ReplyDone, this, task, _1)));
+}
+
+
+void FaultyEtcdClient::ReplyDone(Task* task, Task* reply) {
+  if (PickLoss()) {
+    Count("lost_replies");
+    Reply(task, Status(util::error::UNAVAILABLE, "reply lost"));
+    return;
+  }
+  Reply(task, reply->status());
+}
+
+
+void FaultyEtcdClient::Reply(Task* task, const Status& status) {
+  base_->Delay(PickLatency(), task->AddChild([task, status](Task* delay) {
+    task->Return(delay->status().ok() ? status : delay->status());
+  }));
+}
+
+
+void FaultyEtcdClient::WatchUpdate(WatchState* state, Task* task,
+                                   const vector<Node>& updates) {
+  Count("watch_updates");
+  const steady_clock::time_point now(steady_clock::now());
+  steady_clock::time_point due(
+      now + std::chrono::duration_cast<steady_clock::duration>(PickLatency()));
+  {
+    lock_guard<mutex> lock(state->lock);
+    // Updates are not reordered, so one can be held up by the one
+    // before it.
+    due = std::max(due, state->last_due);
+    state->last_due = due;
+    state->delayed.push_back(updates);
+  }
+  base_->Delay(due - now,
+               task->AddChild(bind(&FaultyEtcdClient::WatchDelayDone, this,
+                                   state, _1)));
+}
+
+
+void FaultyEtcdClient::WatchDelayDone(WatchState* state, Task* delay) {
+  unique_lock<mutex> lock(state->lock);
+  // The delays can end out of order, but the first update is always
+  // due when any of them is.
+  vector<Node> updates(move(state->delayed.front()));
+  state->delayed.pop_front();
+  if (!delay->status().ok()) {
+    // The watch was cancelled.
+    return;
+  }
+  state->ready.emplace_back(move(updates));
+  if (state->delivering) {
+    return;
+  }
+
+  // Only one update is delivered at a time, as with EtcdClient.
+  state->delivering = true;
+  while (!state->ready.empty()) {
+    const vector<Node> next(move(state->ready.front()));
+    state->ready.pop_front();
+    lock.unlock();
+    state->cb(next);
+    lock.lock();
+  }
+  state->delivering = false;
+}
+
+
+duration<double> FaultyEtcdClient::PickLatency() {
+  lock_guard<mutex> lock(lock_);
+  return duration<double>(std::uniform_real_distribution<double>(
+      options_.min_latency.count(), options_.max_latency.count())(generator_));
+}
+
+
+bool FaultyEtcdClient::PickLoss() {
+  if (options_.loss_rate <= 0) {
+    return false;
+  }
+  lock_guard<mutex> lock(lock_);
+  return std::bernoulli_distribution(options_.loss_rate)(generator_);
+}
+
+
+void FaultyEtcdClient::Count(const string& stat) {
+  lock_guard<mutex> lock(lock_);
+  ++stats_[stat];
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,130 @@
+#ifndef CERT_TRANS_UTIL_FAULTY_ETCD_H_
+#define CERT_TRANS_UTIL_FAULTY_ETCD_H_
+
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "util/etcd.h"
+#include "util/libevent_wrapper.h"
+#include "util/status.h"
+#include "util/task.h"
+
+namespace cert_trans {
+
+
+// Passes the requests of one node on to an EtcdClient shared with
+// others (typically a FakeEtcdClient), as if over a network: each
+// request, and each reply, is delayed by a latency picked at random,
+// and can be lost. A lost request is not passed on, and a lost reply
+// is dropped after the request was carried out; either way the caller
+// gets UNAVAILABLE, as it would on a timeout. Watch updates are only
+// delayed, in order, as etcd does not lose them.
+//
+// It counts the requests by operation, so that the load put on etcd
+// by each node can be compared.
+//
+// This class is thread-safe.
+class FaultyEtcdClient : public EtcdClient {
+ public:
+  struct Options {
+    Options() : min_latency(0), max_latency(0), loss_rate(0), seed(0) {
+    }
+
+    // One way, so that a request takes twice as long.
+    std::chrono::duration<double> min_latency;
+    std::chrono::duration<double> max_latency;
+    // The probability of a request being lost, and then of its reply.
+    double loss_rate;
+    uint32_t seed;
+  };
+
+  // Does not take ownership of |target| or |base|, which must outlive
+  // this instance. The delays are timed on |base|.
+  FaultyEtcdClient(EtcdClient* target, libevent::Base* base,
+                   const Options& options);
+  FaultyEtcdClient(const FaultyEtcdClient&) = delete;
+  FaultyEtcdClient& operator=(const FaultyEtcdClient&) = delete;
+
+  void Get(const Request& req, GetResponse* resp, util::Task* task) override;
+
+  void Create(const std::string& key, const std::string& value, Response* resp,
+              util::Task* task) override;
+
+  void CreateWithTTL(const std::string& key, const std::string& value,
+                     const std::chrono::seconds& ttl, Response* resp,
+                     util::Task* task) override;
+
+  void Update(const std::string& key, const std::string& value,
+              const int64_t previous_index, Response* resp,
+              util::Task* task) override;
+
+  void UpdateWithTTL(const std::string& key, const std::string& value,
+                     const std::chrono::seconds& ttl,
+                     const int64_t previous_index, Response* resp,
+                     util::Task* task) override;
+
+  void RefreshTTL(const std::string& key, const std::chrono::seconds& ttl,
+                  const int64_t previous_index, Response* resp,
+                  util::Task* task) override;
+
+  void ForceSet(const std::string& key, const std::string& value,
+                Response* resp, util::Task* task) override;
+
+  void ForceSetWithTTL(const std::string& key, const std::string& value,
+                       const std::chrono::seconds& ttl, Response* resp,
+                       util::Task* task) override;
+
+  void Delete(const std::string& key, const int64_t current_index,
+              util::Task* task) override;
+
+  void ForceDelete(const std::string& key, util::Task* task) override;
+
+  void GetStoreStats(StatsResponse* resp, util::Task* task) override;
+
+  void Watch(const std::string& key, const WatchCallback& cb,
+             util::Task* task) override;
+
+  // The number of requests made so far, by operation (as "get",
+  // "create", ...), along with "lost_requests", "lost_replies" and
+  // "watch_updates".
+  std::map<std::string, int64_t> GetStats() const;
+
+ private:
+  struct WatchState;
+
+  // Sends the request made by |call| after a delay, or loses it, and
+  // returns its status on |task| after another delay.
+  void Forward(const std::string& op, util::Task* task,
+               const std::function<void(util::Task*)>& call);
+  void RequestDone(util::Task* task,
+                   const std::function<void(util::Task*)>& call,
+                   util::Task* delay);
+  void ReplyDone(util::Task* task, util::Task* reply);
+  // Returns |status| on |task|, after a delay.
+  void Reply(util::Task* task, const util::Status& status);
+  void WatchUpdate(WatchState* state, util::Task* task,
+                   const std::vector<Node>& updates);
+  void WatchDelayDone(WatchState* state, util::Task* delay);
+  std::chrono::duration<double> PickLatency();
+  bool PickLoss();
+  void Count(const std::string& stat);
+
+  EtcdClient* const target_;
+  libevent::Base* const base_;
+  const Options options_;
+
+  mutable std::mutex lock_;
+  std::mt19937 generator_;
+  std::map<std::string, int64_t> stats_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_FAULTY_ETCD_H_
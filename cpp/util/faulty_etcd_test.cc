@@ -0,0 +1,181 @@
+#include "util/faulty_etcd.h"
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "util/fake_etcd.h"
+#include "util/libevent_wrapper.h"
+#include "util/status_test_util.h"
+#include "util/sync_task.h"
+#include "util/testing.h"
+#include "util/thread_pool.h"
+
+namespace cert_trans {
+namespace {
+
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::lock_guard;
+using std::map;
+using std::mutex;
+using std::string;
+using std::this_thread::sleep_for;
+using std::to_string;
+using std::vector;
+using util::Status;
+using util::SyncTask;
+using util::testing::StatusIs;
+
+const char kKey[] = "/key";
+const char kValue[] = "value";
+
+
+class FaultyEtcdTest : public ::testing::Test {
+ public:
+  FaultyEtcdTest()
+      : base_(std::make_shared<libevent::Base>()),
+        event_pump_(base_),
+        etcd_(base_.get()) {
+  }
+
+ protected:
+  FaultyEtcdClient::Options Latency(int min_ms, int max_ms) const {
+    FaultyEtcdClient::Options options;
+    options.min_latency = milliseconds(min_ms);
+    options.max_latency = milliseconds(max_ms);
+    return options;
+  }
+
+  Status ForceSet(EtcdClient* client, const string& key,
+                  const string& value) {
+    EtcdClient::Response resp;
+    SyncTask task(&pool_);
+    client->ForceSet(key, value, &resp, task.task());
+    task.Wait();
+    return task.status();
+  }
+
+  Status Get(EtcdClient* client, const string& key, string* value) {
+    EtcdClient::GetResponse resp;
+    SyncTask task(&pool_);
+    client->Get(EtcdClient::Request(key), &resp, task.task());
+    task.Wait();
+    *value = resp.node.value_;
+    return task.status();
+  }
+
+  std::shared_ptr<libevent::Base> base_;
+  libevent::EventPumpThread event_pump_;
+  ThreadPool pool_;
+  FakeEtcdClient etcd_;
+};
+
+
+TEST_F(FaultyEtcdTest, DelaysRequestsAndReplies) {
+  FaultyEtcdClient client(&etcd_, base_.get(), Latency(20, 30));
+
+  const steady_clock::time_point start(steady_clock::now());
+  EXPECT_OK(ForceSet(&client, kKey, kValue));
+  string value;
+  EXPECT_OK(Get(&client, kKey, &value));
+  EXPECT_EQ(kValue, value);
+  // Two requests, each delayed both ways.
+  EXPECT_GE(steady_clock::now() - start, milliseconds(80));
+
+  const map<string, int64_t> stats(client.GetStats());
+  EXPECT_EQ(1, stats.at("force_set"));
+  EXPECT_EQ(1, stats.at("get"));
+  EXPECT_EQ(0U, stats.count("lost_requests"));
+}
+
+
+TEST_F(FaultyEtcdTest, LosesRequestsAndReplies) {
+  FaultyEtcdClient::Options options(Latency(0, 1));
+  options.loss_rate = 0.3;
+  options.seed = 1;
+  FaultyEtcdClient client(&etcd_, base_.get(), options);
+
+  const int kRequests(100);
+  int failed(0);
+  for (int i = 0; i < kRequests; ++i) {
+    const Status status(ForceSet(&client, kKey + to_string(i), kValue));
+    if (!status.ok()) {
+      EXPECT_THAT(status, StatusIs(util::error::UNAVAILABLE));
+      ++failed;
+    }
+  }
+
+  map<string, int64_t> stats(client.GetStats());
+  EXPECT_GT(stats["lost_requests"], 0);
+  EXPECT_GT(stats["lost_replies"], 0);
+  EXPECT_EQ(failed, stats["lost_requests"] + stats["lost_replies"]);
+
+  // Lost replies are for requests that still went through.
+  int applied(0);
+  for (int i = 0; i < kRequests; ++i) {
+    string value;
+    if (Get(&etcd_, kKey + to_string(i), &value).ok()) {
+      ++applied;
+    }
+  }
+  EXPECT_EQ(kRequests - stats["lost_requests"], applied);
+}
+
+
+TEST_F(FaultyEtcdTest, DelaysWatchUpdatesInOrder) {
+  FaultyEtcdClient client(&etcd_, base_.get(), Latency(0, 30));
+
+  mutex lock;
+  vector<string> values;
+  SyncTask watch(&pool_);
+  client.Watch(kKey,
+               [&lock, &values](const vector<EtcdClient::Node>& updates) {
+                 lock_guard<mutex> guard(lock);
+                 for (const auto& node : updates) {
+                   values.push_back(node.value_);
+                 }
+               },
+               watch.task());
+
+  const int kUpdates(20);
+  for (int i = 0; i < kUpdates; ++i) {
+    ASSERT_OK(ForceSet(&etcd_, kKey, to_string(i)));
+  }
+
+  const steady_clock::time_point deadline(steady_clock::now() +
+                                          std::chrono::seconds(5));
+  while (steady_clock::now() < deadline) {
+    {
+      lock_guard<mutex> guard(lock);
+      if (values.size() >= static_cast<size_t>(kUpdates)) {
+        break;
+      }
+    }
+    sleep_for(milliseconds(10));
+  }
+
+  watch.Cancel();
+  watch.Wait();
+  EXPECT_THAT(watch.status(), StatusIs(util::error::CANCELLED));
+  ASSERT_EQ(static_cast<size_t>(kUpdates), values.size());
+  for (int i = 0; i < kUpdates; ++i) {
+    EXPECT_EQ(to_string(i), values[i]);
+  }
+  EXPECT_EQ(1, client.GetStats()["watch"]);
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
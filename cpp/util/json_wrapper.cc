@@ -1,5 +1,7 @@
 #include "json_wrapper.h"
 
+#include <string.h>
+#include <cctype>
 #include <memory>
 
 using std::unique_ptr;
@@ -60,6 +62,24 @@ JsonObject::JsonObject(evbuffer* buffer) : obj_(NULL) {
 }
 
 
+// static
+json_object* JsonObject::Parse(const std::string& json) {
+  const unique_ptr<json_tokener, void (*)(json_tokener*)> tokener(
+      json_tokener_new(), json_tokener_free);
+  // Including the terminating NUL, like json_tokener_parse() does, so
+  // that a number at the end of the document is complete.
+  json_object* const obj(
+      json_tokener_parse_ex(tokener.get(), json.c_str(), json.size() + 1));
+  if (json_tokener_get_error(tokener.get()) != json_tokener_success) {
+    if (obj) {
+      json_object_put(obj);
+    }
+    return NULL;
+  }
+  return obj;
+}
+
+
 JsonObject::JsonObject(const JsonArray& from, int offset, json_type type) {
   obj_ = json_object_array_get_idx(from.obj_, offset);
   if (obj_ != NULL) {
@@ -75,3 +95,145 @@ JsonObject::JsonObject(const JsonArray& from, int offset, json_type type) {
   }
   json_object_get(obj_);
 }
+
+
+JsonArrayStream::JsonArrayStream(
+    const std::string& field,
+    const std::function<bool(const JsonObject&)>& element_cb)
+    : field_(field),
+      element_cb_(element_cb),
+      ok_(true),
+      depth_(0),
+      seen_object_(false),
+      in_string_(false),
+      escaped_(false),
+      in_array_(false),
+      array_done_(false) {
+}
+
+
+bool JsonArrayStream::Add(const char* data, size_t size) {
+  const char* const end(data + size);
+  while (ok_ && data < end) {
+    if (in_string_ && !escaped_) {
+      // Most of a document is usually in strings (such as the base64
+      // fields of get-entries), so they are skipped through a run at a
+      // time, up to the next quote or backslash, rather than character
+      // by character.
+      const char* quote(
+          static_cast<const char*>(memchr(data, '"', end - data)));
+      if (!quote) {
+        quote = end;
+      }
+      const char* const backslash(
+          static_cast<const char*>(memchr(data, '\\', quote - data)));
+      const char* const run_end(backslash ? backslash : quote);
+      AddStringRun(data, run_end - data);
+      data = run_end;
+      if (data == end) {
+        break;
+      }
+    }
+    ok_ = AddChar(*data++);
+  }
+
+  return ok_;
+}
+
+
+void JsonArrayStream::AddStringRun(const char* data, size_t size) {
+  if (in_array_ && depth_ > 2) {
+    element_.append(data, size);
+  } else if (depth_ == 1) {
+    string_.append(data, size);
+  }
+}
+
+
+bool JsonArrayStream::AddChar(char c) {
+  // Inside the elements of the array.
+  const bool in_element(in_array_ && depth_ > 2);
+  if (in_element) {
+    element_.push_back(c);
+  }
+
+  if (in_string_) {
+    if (escaped_) {
+      escaped_ = false;
+    } else if (c == '\\') {
+      escaped_ = true;
+    } else if (c == '"') {
+      in_string_ = false;
+    } else if (depth_ == 1) {
+      string_.push_back(c);
+    }
+    return true;
+  }
+
+  if (depth_ == 0) {
+    // Only whitespace can surround the top-level object.
+    if (c == '{' && !seen_object_) {
+      seen_object_ = true;
+      depth_ = 1;
+      return true;
+    }
+    return isspace(static_cast<unsigned char>(c));
+  }
+
+  switch (c) {
+    case '"':
+      in_string_ = true;
+      if (depth_ == 1) {
+        string_.clear();
+      }
+      return true;
+
+    case ':':
+      if (depth_ == 1) {
+        key_ = string_;
+      }
+      return true;
+
+    case ',':
+      if (depth_ == 1) {
+        key_.clear();
+      }
+      return true;
+
+    case '{':
+    case '[':
+      if (depth_ == 1 && c == '[' && key_ == field_) {
+        if (array_done_) {
+          // Twice the same field.
+          return false;
+        }
+        in_array_ = true;
+      } else if (in_array_ && depth_ == 2) {
+        if (c != '{') {
+          return false;
+        }
+        element_.assign(1, c);
+      }
+      ++depth_;
+      return true;
+
+    case '}':
+    case ']':
+      --depth_;
+      if (in_array_ && depth_ == 2) {
+        const JsonObject element(element_);
+        element_.clear();
+        return element.Ok() && element_cb_(element);
+      }
+      if (in_array_ && depth_ == 1) {
+        in_array_ = false;
+        array_done_ = true;
+      }
+      return depth_ >= 0;
+
+    default:
+      // Only objects are expected in the array.
+      return !in_array_ || depth_ > 2 ||
+             isspace(static_cast<unsigned char>(c));
+  }
+}
@@ -7,6 +7,7 @@
 #undef FALSE  // json.h pollution
 
 #include <event2/buffer.h>
+#include <functional>
 #include <sstream>
 #include <string>
 
@@ -24,12 +25,11 @@ class JsonObject {
   explicit JsonObject(json_object* obj) : obj_(obj) {
   }
 
-  explicit JsonObject(const std::ostringstream& response) {
-    obj_ = json_tokener_parse(response.str().c_str());
+  explicit JsonObject(const std::ostringstream& response)
+      : obj_(Parse(response.str())) {
   }
 
-  explicit JsonObject(const std::string& response) {
-    obj_ = json_tokener_parse(response.c_str());
+  explicit JsonObject(const std::string& response) : obj_(Parse(response)) {
   }
 
   // This constructor is destructive: if a JSON object is parsed
@@ -84,7 +84,7 @@ class JsonObject {
   }
 
   void Add(const char* name, const std::string& value) {
-    Add(name, json_object_new_string(value.c_str()));
+    Add(name, json_object_new_string_len(value.data(), value.size()));
   }
 
   void AddBase64(const char* name, const std::string& value) {
@@ -102,6 +102,10 @@ class JsonObject {
     Add(name, json_object_new_boolean(b));
   }
 
+  void AddDouble(const char* name, double value) {
+    Add(name, json_object_new_double(value));
+  }
+
   const char* ToString() const {
     return json_object_to_json_string(obj_);
   }
@@ -118,6 +122,10 @@ class JsonObject {
   json_object* obj_;
 
  private:
+  // Parses a whole document, without another pass over it to find its
+  // length, as json_tokener_parse() would.
+  static json_object* Parse(const std::string& json);
+
   void InitFromChild(const JsonObject& from, const char* field,
                      json_type type) {
     if (json_object_object_get_ex(from.obj_, field, &obj_)) {
@@ -166,7 +174,7 @@ class JsonString : public JsonObject {
   }
 
   std::string FromBase64() {
-    return util::FromBase64(Value());
+    return util::FromBase64(Value(), json_object_get_string_len(obj_));
   }
 };
 
@@ -178,6 +186,10 @@ class JsonInt : public JsonObject {
       : JsonObject(from, field, json_type_int) {
   }
 
+  JsonInt(const JsonArray& from, int offset)
+      : JsonObject(from, offset, json_type_int) {
+  }
+
   int64_t Value() const {
     return json_object_get_int64(obj_);
   }
@@ -189,6 +201,10 @@ class JsonArray : public JsonObject {
       : JsonObject(from, field, json_type_array) {
   }
 
+  JsonArray(const JsonArray& from, int offset)
+      : JsonObject(from, offset, json_type_array) {
+  }
+
   JsonArray() : JsonObject(json_object_new_array()) {
   }
 
@@ -197,7 +213,7 @@ class JsonArray : public JsonObject {
   }
 
   void Add(const std::string& addand) {
-    Add(json_object_new_string(addand.c_str()));
+    Add(json_object_new_string_len(addand.data(), addand.size()));
   }
 
   void Add(JsonObject* addand) {
@@ -213,4 +229,55 @@ class JsonArray : public JsonObject {
   }
 };
 
+// Finds the elements of an array of objects in a JSON document, as
+// the document arrives in pieces, such as the "entries" of a
+// get-entries response. Only one element is kept in memory at a time,
+// rather than the whole document and its parsed form.
+//
+// Only the structure of the document is checked here, each element is
+// parsed with json-c as it completes.
+class JsonArrayStream {
+ public:
+  // |element_cb| is called with each element of the array in the
+  // |field| of the top-level object, and returns false to stop.
+  JsonArrayStream(const std::string& field,
+                  const std::function<bool(const JsonObject&)>& element_cb);
+  JsonArrayStream(const JsonArrayStream&) = delete;
+  JsonArrayStream& operator=(const JsonArrayStream&) = delete;
+
+  // Returns false if the document is malformed so far, or
+  // |element_cb| returned false, in which case further data is
+  // ignored.
+  bool Add(const char* data, size_t size);
+
+  // Returns true if the whole document was added without errors, and
+  // the array was found in it.
+  bool Finish() const {
+    return ok_ && depth_ == 0 && seen_object_ && array_done_;
+  }
+
+ private:
+  bool AddChar(char c);
+  // Adds the |size| characters at |data|, which are all inside a
+  // string, and neither quotes nor backslashes.
+  void AddStringRun(const char* data, size_t size);
+
+  const std::string field_;
+  const std::function<bool(const JsonObject&)> element_cb_;
+
+  bool ok_;
+  // The nesting of objects and arrays, 1 in the top-level object.
+  int depth_;
+  bool seen_object_;
+  bool in_string_;
+  bool escaped_;
+  // The last string and key at depth 1.
+  std::string string_;
+  std::string key_;
+  bool in_array_;
+  bool array_done_;
+  // The element being accumulated, if in one.
+  std::string element_;
+};
+
 #endif  // CERT_TRANS_UTIL_JSON_WRAPPER_H_
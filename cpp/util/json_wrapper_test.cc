@@ -1,13 +1,16 @@
 #include "util/json_wrapper.h"
 
 #include <gtest/gtest.h>
+#include <algorithm>
 #include <memory>
+#include <vector>
 
 #include "util/testing.h"
 #include "util/util.h"
 
 using std::shared_ptr;
 using std::string;
+using std::vector;
 
 class JsonWrapperTest : public ::testing::Test {};
 
@@ -49,6 +52,47 @@ TEST_F(JsonWrapperTest, UnwrapResponse) {
   EXPECT_EQ(util::HexString(p2.FromBase64()), p2v);
 }
 
+TEST_F(JsonWrapperTest, FromBase64IntoBuffer) {
+  JsonObject jresponse(string("{\"a\":[\"Zm9vYmFy\",\"Zm8=\",\"%%\"]}"));
+  JsonArray values(jresponse, "a");
+  ASSERT_TRUE(values.Ok());
+
+  std::vector<unsigned char> buf;
+  EXPECT_EQ(6, util::FromBase64(JsonString(values, 0).Value(), &buf));
+  EXPECT_EQ("foobar", string(buf.begin(), buf.begin() + 6));
+  const size_t capacity(buf.size());
+  EXPECT_EQ(2, util::FromBase64(JsonString(values, 1).Value(), &buf));
+  EXPECT_EQ("fo", string(buf.begin(), buf.begin() + 2));
+  EXPECT_EQ(capacity, buf.size());
+  EXPECT_EQ(-1, util::FromBase64(JsonString(values, 2).Value(), &buf));
+}
+
+TEST_F(JsonWrapperTest, Base64) {
+  string bytes;
+  for (int i = 0; i < 256; ++i) {
+    bytes.push_back(i);
+  }
+  // Long enough values to go through the vectorized code as well.
+  for (size_t length = 0; length < 64; ++length) {
+    const string value(bytes.substr(0, length));
+    const string b64(util::ToBase64(value));
+    EXPECT_EQ(util::Base64Length(length), b64.size());
+    EXPECT_EQ(value, util::FromBase64(b64.c_str())) << b64;
+  }
+  EXPECT_EQ(bytes, util::FromBase64(util::ToBase64(bytes).c_str()));
+  EXPECT_EQ("Zm9vYmFy", util::ToBase64("foobar"));
+  EXPECT_EQ("Zm8=", util::ToBase64("fo"));
+
+  // Whitespace is allowed, but not leftover bits or misplaced padding.
+  EXPECT_EQ("foobar", util::FromBase64(" Zm9v\nYmFy "));
+  EXPECT_EQ("", util::FromBase64("Zm9="));
+  EXPECT_EQ("", util::FromBase64("Zg==Zm8="));
+  EXPECT_EQ("", util::FromBase64("Zm9vYmF"));
+  string invalid(util::ToBase64(bytes));
+  invalid[40] = '%';
+  EXPECT_EQ("", util::FromBase64(invalid.c_str()));
+}
+
 TEST_F(JsonWrapperTest, PartialEvBuffer) {
   const string partial_input("{ \"foo\": 42 ");
   const shared_ptr<evbuffer> buffer(CHECK_NOTNULL(evbuffer_new()),
@@ -83,6 +127,89 @@ TEST_F(JsonWrapperTest, FragmentedEvBuffer) {
   EXPECT_EQ(0U, evbuffer_get_length(buffer.get()));
 }
 
+bool AddElement(vector<string>* values, const JsonObject& element) {
+  const JsonString value(element, "value");
+  if (!value.Ok()) {
+    return false;
+  }
+  values->emplace_back(value.Value());
+  return true;
+}
+
+TEST_F(JsonWrapperTest, ArrayStreamByteByByte) {
+  const string input(
+      " {\"skipped\": [{\"value\": \"no\"}], \"s\": \"entries\",\n"
+      "  \"entries\": [ {\"value\": \"a]}\\\"\"},\n"
+      "    {\"nested\": {\"x\": [1, 2]}, \"value\": \"b\"} ],\n"
+      "  \"after\": 1 } ");
+  vector<string> values;
+  JsonArrayStream stream("entries",
+                         std::bind(AddElement, &values, std::placeholders::_1));
+  for (char c : input) {
+    EXPECT_TRUE(stream.Add(&c, 1));
+    EXPECT_FALSE(stream.Finish());
+    if (c == ']' && values.size() == 2) {
+      break;
+    }
+  }
+  ASSERT_EQ(2U, values.size());
+  EXPECT_EQ("a]}\"", values[0]);
+  EXPECT_EQ("b", values[1]);
+
+  // The rest, all at once.
+  const size_t rest(input.find("],\n  \"after\"") + 1);
+  EXPECT_TRUE(stream.Add(input.data() + rest, input.size() - rest));
+  EXPECT_TRUE(stream.Finish());
+}
+
+TEST_F(JsonWrapperTest, ArrayStreamInChunks) {
+  const string input(
+      "{\"entries\": [{\"value\": \"a\\\"b\\\\\"}, {\"value\": \"cd\"}], "
+      "\"key\": \"\\\"entries\\\"\"}");
+  for (size_t chunk = 1; chunk <= input.size(); ++chunk) {
+    vector<string> values;
+    JsonArrayStream stream("entries", std::bind(AddElement, &values,
+                                                std::placeholders::_1));
+    for (size_t offset = 0; offset < input.size(); offset += chunk) {
+      EXPECT_TRUE(stream.Add(input.data() + offset,
+                             std::min(chunk, input.size() - offset)));
+    }
+    EXPECT_TRUE(stream.Finish()) << chunk;
+    ASSERT_EQ(2U, values.size()) << chunk;
+    EXPECT_EQ("a\"b\\", values[0]);
+    EXPECT_EQ("cd", values[1]);
+  }
+}
+
+TEST_F(JsonWrapperTest, ArrayStreamErrors) {
+  vector<string> values;
+  const std::function<bool(const JsonObject&)> add(
+      std::bind(AddElement, &values, std::placeholders::_1));
+
+  const string truncated("{\"entries\": [{\"value\": \"a\"}");
+  JsonArrayStream stream1("entries", add);
+  EXPECT_TRUE(stream1.Add(truncated.data(), truncated.size()));
+  EXPECT_FALSE(stream1.Finish());
+
+  const string missing("{\"other\": []}");
+  JsonArrayStream stream2("entries", add);
+  EXPECT_TRUE(stream2.Add(missing.data(), missing.size()));
+  EXPECT_FALSE(stream2.Finish());
+
+  const string not_objects("{\"entries\": [1]}");
+  JsonArrayStream stream3("entries", add);
+  EXPECT_FALSE(stream3.Add(not_objects.data(), not_objects.size()));
+  EXPECT_FALSE(stream3.Finish());
+
+  const string rejected("{\"entries\": [{\"other\": 1}]}");
+  JsonArrayStream stream4("entries", add);
+  EXPECT_FALSE(stream4.Add(rejected.data(), rejected.size()));
+
+  const string trailing("{\"entries\": []} {");
+  JsonArrayStream stream5("entries", add);
+  EXPECT_FALSE(stream5.Add(trailing.data(), trailing.size()));
+}
+
 int main(int argc, char** argv) {
   cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
   return RUN_ALL_TESTS();
@@ -6,12 +6,21 @@
 #ifdef HAVE_ARPA_NAMESER_H
 #include <arpa/nameser.h> /* DNS HEADER struct */
 #endif
+#include <event2/bufferevent_ssl.h>
 #include <event2/keyvalq_struct.h>
 #include <event2/thread.h>
 #include <evhtp.h>
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 #include <math.h>
+#include <openssl/ssl.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
 #include <climits>
+#include <future>
+#include <limits>
+#include <unordered_map>
 #ifdef HAVE_NETDB_H
 #include <netdb.h>
 #endif
@@ -26,28 +35,86 @@
 #endif
 #include <signal.h>
 
+#include "monitoring/monitoring.h"
+#include "util/cpu_affinity.h"
+#include "util/trace.h"
+
 using std::bind;
 using std::chrono::duration;
 using std::chrono::duration_cast;
 using std::chrono::microseconds;
 using std::chrono::milliseconds;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
 using std::chrono::system_clock;
+using std::find;
 using std::function;
 using std::lock_guard;
 using std::make_pair;
-using std::multimap;
+using std::max;
+using std::min;
+using std::make_shared;
+using std::memory_order_acquire;
+using std::memory_order_relaxed;
+using std::memory_order_release;
 using std::mutex;
+using std::pair;
 using std::placeholders::_1;
+using std::promise;
 using std::recursive_mutex;
 using std::shared_ptr;
 using std::string;
+using std::to_string;
+using std::unique_lock;
 using std::unique_ptr;
+using std::unordered_map;
 using std::vector;
-using util::TaskHold;
+
+DEFINE_int32(libevent_lag_probe_interval_ms, 1000,
+             "interval of the timer used to measure how late event loops "
+             "are in handling events; 0 disables it");
+DEFINE_int32(dns_cache_ttl_seconds, 60,
+             "maximum time for which the address of a host is reused "
+             "before looking it up again, and how long it is reused when "
+             "its TTL is not known; 0 disables the cache");
 
 namespace {
 
+
+cert_trans::Counter<>* closures_run(cert_trans::Counter<>::New(
+    "libevent_closures_run",
+    "Number of closures added to an event loop from any thread and run."));
+
+cert_trans::Counter<>* closure_wakeups(cert_trans::Counter<>::New(
+    "libevent_closure_wakeups",
+    "Number of times an event loop woke up to run closures added to it, "
+    "which can be fewer than the closures."));
+
+cert_trans::Gauge<string>* queued_closures(cert_trans::Gauge<string>::New(
+    "libevent_queued_closures", "loop",
+    "Number of closures added to an event loop, waiting to run."));
+
+cert_trans::Histogram<string>* closure_wait_ms(
+    cert_trans::Histogram<string>::New(
+        "libevent_closure_wait_ms", "loop",
+        "Time closures added to an event loop wait before running, in ms."));
+
+cert_trans::Histogram<string>* closure_run_ms(
+    cert_trans::Histogram<string>::New(
+        "libevent_closure_run_ms", "loop",
+        "Time taken running closures added to an event loop, in ms."));
+
+cert_trans::Histogram<string>* loop_lag_ms(cert_trans::Histogram<string>::New(
+    "libevent_loop_lag_ms", "loop",
+    "How late an event loop handles a periodic timer, in ms."));
+
+cert_trans::Counter<string>* dns_cache_lookups(cert_trans::Counter<
+    string>::New("libevent_dns_cache_lookups", "result",
+                 "Number of host names looked up in the DNS cache, by "
+                 "result: hit, stale (returned while being refreshed) or "
+                 "miss."));
+
+
 void FreeEvDns(evdns_base* dns) {
   if (dns) {
     evdns_base_free(dns, true);
@@ -69,24 +136,97 @@ void SetExitLoopHandler(event_base* base, int signum) {
 }
 
 
-void DelayCancel(event* timer, util::Task* task) {
-  event_del(timer);
-  task->Return(util::Status::CANCELLED);
+#ifdef HAVE_THREAD_LOCAL
+thread_local bool on_event_thread = false;
+// The loop dispatched by this thread, if any.
+thread_local const void* dispatching_base = nullptr;
+#elif HAVE___THREAD
+__thread bool on_event_thread = false;
+__thread const void* dispatching_base = nullptr;
+#else
+#error No suitable thread local storage available
+#endif
+
+
+// All the live Base instances, by their event_base, so that replies can
+// be sent from the loop a request came in on.
+mutex* BasesLock() {
+  static mutex* const lock(new mutex);
+  return lock;
 }
 
 
-void DelayDispatch(evutil_socket_t, short, void* userdata) {
-  static_cast<util::Task*>(CHECK_NOTNULL(userdata))->Return();
+unordered_map<const event_base*, cert_trans::libevent::Base*>* Bases() {
+  static unordered_map<const event_base*, cert_trans::libevent::Base*>* const
+      bases(new unordered_map<const event_base*,
+                              cert_trans::libevent::Base*>);
+  return bases;
 }
 
 
-#ifdef HAVE_THREAD_LOCAL
-thread_local bool on_event_thread = false;
-#elif HAVE___THREAD
-__thread bool on_event_thread = false;
+// Returns a non-blocking socket listening on |address| (any, if NULL)
+// and |port|, which other sockets can listen on too, if the platform
+// supports it.
+evutil_socket_t ListenSocket(const char* address, ev_uint16_t port) {
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  addrinfo* info;
+  const int resolved(getaddrinfo(address ? address : "0.0.0.0",
+                                 to_string(port).c_str(), &hints, &info));
+  CHECK_EQ(resolved, 0) << "Cannot resolve " << (address ? address : "")
+                        << ": " << gai_strerror(resolved);
+
+  const evutil_socket_t fd(
+      socket(info->ai_family, info->ai_socktype, info->ai_protocol));
+  PCHECK(fd >= 0) << "Cannot create listening socket";
+  CHECK_EQ(evutil_make_socket_nonblocking(fd), 0);
+  CHECK_EQ(evutil_make_socket_closeonexec(fd), 0);
+  CHECK_EQ(evutil_make_listen_socket_reuseable(fd), 0);
+#ifdef SO_REUSEPORT
+  const int one(1);
+  PCHECK(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == 0);
+#endif
+  PCHECK(bind(fd, info->ai_addr, info->ai_addrlen) == 0)
+      << "Cannot bind to port " << port;
+  PCHECK(listen(fd, 128) == 0);
+  freeaddrinfo(info);
+  return fd;
+}
+
+
+// Returns a socket listening on |address| and |port| for each of
+// |count| loops. With SO_REUSEPORT, the kernel spreads the connections
+// over them, otherwise the loops take turns on the same one.
+vector<evutil_socket_t> ListenSockets(const char* address, ev_uint16_t port,
+                                      size_t count) {
+  vector<evutil_socket_t> fds;
+  fds.push_back(ListenSocket(address, port));
+  while (fds.size() < count) {
+#ifdef SO_REUSEPORT
+    fds.push_back(ListenSocket(address, port));
 #else
-#error No suitable thread local storage available
+    fds.push_back(dup(fds.front()));
+    PCHECK(fds.back() >= 0);
 #endif
+  }
+  return fds;
+}
+
+
+// Called by evhttp for each connection accepted on an HTTPS listener,
+// which sets its socket afterwards.
+bufferevent* NewTLSBufferEvent(event_base* base, void* ssl_ctx) {
+  SSL* const ssl(CHECK_NOTNULL(SSL_new(static_cast<SSL_CTX*>(ssl_ctx))));
+  bufferevent* const bev(CHECK_NOTNULL(bufferevent_openssl_socket_new(
+      base, -1, ssl, BUFFEREVENT_SSL_ACCEPTING, BEV_OPT_CLOSE_ON_FREE)));
+  // Plenty of clients just close the connection once they have their
+  // reply.
+  bufferevent_openssl_set_allow_dirty_shutdown(bev, 1);
+  return bev;
+}
 
 
 }  // namespace
@@ -96,10 +236,12 @@ namespace libevent {
 
 
 struct HttpServer::Handler {
-  Handler(const string& _path, const HandlerCallback& _cb)
-      : path(_path), cb(_cb) {
+  Handler(const HttpServer* _server, const string& _path,
+          const HandlerCallback& _cb)
+      : server(_server), path(_path), cb(_cb) {
   }
 
+  const HttpServer* const server;
   const string path;
   const HandlerCallback cb;
 };
@@ -120,7 +262,7 @@ class ResolverImpl : public Base::Resolver {
     if (resolved != 0) {
       LOG(WARNING) << "Failed to resolve HTTPS hostname " << host << ": "
                    << gai_strerror(resolved);
-      return nullptr;
+      return string();
     }
 
     struct addrinfo* res(info);
@@ -144,7 +286,8 @@ class ResolverImpl : public Base::Resolver {
 
     if (!addr) {
       LOG(WARNING) << "Got no usable address for " << host;
-      return nullptr;
+      freeaddrinfo(info);
+      return string();
     }
 
     char addr_str[INET6_ADDRSTRLEN];
@@ -155,25 +298,87 @@ class ResolverImpl : public Base::Resolver {
 };
 
 
+struct Base::DnsRefresh {
+  Base* base;
+  string host;
+};
+
+
+struct Base::ClosureNode {
+  util::Closure closure;
+  steady_clock::time_point added;
+  std::atomic<ClosureNode*> next;
+};
+
+
+struct Base::Stats {
+  explicit Stats(const string& loop)
+      : queued_closures(::queued_closures->GetHandle(loop)),
+        closure_wait_ms(::closure_wait_ms->GetHandle(loop)),
+        closure_run_ms(::closure_run_ms->GetHandle(loop)),
+        loop_lag_ms(::loop_lag_ms->GetHandle(loop)) {
+    queued_closures.IncrementBy(0);
+  }
+
+  static string NextLoop() {
+    static std::atomic<int> num_loops(0);
+    return to_string(num_loops.fetch_add(1));
+  }
+
+  Gauge<string>::Handle queued_closures;
+  Histogram<string>::Handle closure_wait_ms;
+  Histogram<string>::Handle closure_run_ms;
+  Histogram<string>::Handle loop_lag_ms;
+};
+
+
 Base::Base() : Base(unique_ptr<Resolver>(new ResolverImpl)) {
 }
 
 
 Base::Base(unique_ptr<Resolver> resolver)
     : base_(CHECK_NOTNULL(event_base_new()), event_base_free),
+      stats_(new Stats(Stats::NextLoop())),
       dns_(nullptr, FreeEvDns),
+      closures_head_(new ClosureNode),
+      closures_tail_(closures_head_.load()),
+      wake_pending_(false),
       wake_closures_(event_new(base_.get(), -1, 0, &Base::RunClosures, this),
                      &event_free),
-      resolver_(std::move(resolver)) {
+      resolver_(std::move(resolver)),
+      wake_timers_(evtimer_new(base_.get(), &Base::RunTimers, this),
+                   &event_free),
+      lag_probe_(evtimer_new(base_.get(), &Base::LagProbe, this),
+                 &event_free) {
   evthread_make_base_notifiable(base_.get());
 
   // So much stuff breaks if there's not a Dns client around to keep the
   // event loop doing stuff that we may as well just have one from the get go.
   GetDns();
+
+  lock_guard<mutex> lock(*BasesLock());
+  CHECK(Bases()->emplace(base_.get(), this).second);
 }
 
 
 Base::~Base() {
+  {
+    lock_guard<mutex> lock(*BasesLock());
+    Bases()->erase(base_.get());
+  }
+
+  // Closures that never got to run are dropped, as before.
+  while (closures_tail_) {
+    ClosureNode* const next(closures_tail_->next.load());
+    delete closures_tail_;
+    closures_tail_ = next;
+  }
+
+  vector<util::Task*> to_be_cancelled;
+  timers_.Clear(&to_be_cancelled);
+  for (util::Task* const task : to_be_cancelled) {
+    task->Return(util::Status::CANCELLED);
+  }
 }
 
 
@@ -189,10 +394,22 @@ void Base::CheckNotOnEventThread() {
 }
 
 
-void Base::Add(const function<void()>& cb) {
-  lock_guard<mutex> lock(closures_lock_);
-  closures_.push_back(cb);
-  event_active(wake_closures_.get(), 0, 0);
+void Base::Add(util::Closure cb) {
+  ClosureNode* const closure(new ClosureNode);
+  closure->closure = util::trace::Propagate(std::move(cb), "libevent_queue");
+  closure->added = steady_clock::now();
+  closure->next.store(nullptr, memory_order_relaxed);
+  stats_->queued_closures.IncrementBy(1);
+  // Take the place of the head, then link the previous one to us. The
+  // loop waits for that link if it sees the new head before it is
+  // made.
+  ClosureNode* const prev(closures_head_.exchange(closure));
+  prev->next.store(closure, memory_order_release);
+
+  // Only the first closure since the loop last woke up has to wake it.
+  if (!wake_pending_.exchange(true)) {
+    event_active(wake_closures_.get(), 0, 0);
+  }
 }
 
 
@@ -203,36 +420,40 @@ void Base::Delay(const duration<double>& delay, util::Task* task) {
     return;
   }
 
-  // Make sure nothing "bad" happens while we're still setting up our
-  // callbacks.
-  TaskHold hold(task);
-
-  event* timer(CHECK_NOTNULL(evtimer_new(base_.get(), &DelayDispatch, task)));
-
-  // Ensure that the cancellation callback is run on this libevent::Base, to
-  // avoid races during cancellation.
+  // The wheel takes care of cancellation, and we only have to wake up
+  // earlier if this is now the first task to expire.
+  lock_guard<mutex> lock(timers_lock_);
+  if (timers_.Add(delay, task)) {
+    ArmTimers();
+  }
+}
 
-  // Cancellation callbacks are always called before the task enters
-  // the DONE state (and "timer" is freed), and "event_del" is
-  // thread-safe, so it does not matter on which thread "DelayCancel"
-  // is called on.
-  task->WhenCancelled(bind(DelayCancel, timer, task));
 
-  task->CleanupWhenDone(bind(event_free, timer));
+void Base::ArmTimers() {
+  const steady_clock::time_point next(timers_.NextExpiry());
+  if (next == steady_clock::time_point::max()) {
+    return;
+  }
+  const steady_clock::duration delay(
+      std::max(next - steady_clock::now(), steady_clock::duration::zero()));
 
   timeval tv;
   const seconds sec(duration_cast<seconds>(delay));
   tv.tv_sec = sec.count();
   tv.tv_usec = duration_cast<microseconds>(delay - sec).count();
 
-  CHECK_EQ(evtimer_add(timer, &tv), 0);
+  // This is thread-safe, and replaces the timeout if it was pending.
+  CHECK_EQ(evtimer_add(wake_timers_.get(), &tv), 0);
 }
 
 
-void Base::Dispatch() {
-  SetExitLoopHandler(base_.get(), SIGHUP);
-  SetExitLoopHandler(base_.get(), SIGINT);
-  SetExitLoopHandler(base_.get(), SIGTERM);
+void Base::Dispatch(bool exit_on_signals) {
+  // libevent only delivers signals to one loop.
+  if (exit_on_signals) {
+    SetExitLoopHandler(base_.get(), SIGHUP);
+    SetExitLoopHandler(base_.get(), SIGINT);
+    SetExitLoopHandler(base_.get(), SIGTERM);
+  }
 
   // There should /never/ be more than 1 thread trying to call Dispatch(), so
   // we should expect to always own the lock here.
@@ -240,9 +461,16 @@ void Base::Dispatch() {
   LOG_IF(WARNING, on_event_thread)
       << "Huh?, Are you calling Dispatch() from a libevent thread?";
   const bool old_on_event_thread(on_event_thread);
+  const void* const old_dispatching_base(dispatching_base);
   on_event_thread = true;
+  dispatching_base = this;
+  // Only loops that are dispatched for good are probed, as the probe
+  // would make DispatchOnce() return early.
+  ArmLagProbe();
   CHECK_EQ(event_base_dispatch(base_.get()), 0);
+  event_del(lag_probe_.get());
   on_event_thread = old_on_event_thread;
+  dispatching_base = old_dispatching_base;
   dispatch_lock_.unlock();
 }
 
@@ -253,9 +481,12 @@ void Base::DispatchOnce() {
   LOG_IF(WARNING, on_event_thread)
       << "Huh?, Are you calling Dispatch() from a libevent thread?";
   const bool old_on_event_thread(on_event_thread);
+  const void* const old_dispatching_base(dispatching_base);
   on_event_thread = true;
+  dispatching_base = this;
   CHECK_EQ(event_base_loop(base_.get(), EVLOOP_ONCE), 0);
   on_event_thread = old_on_event_thread;
+  dispatching_base = old_dispatching_base;
 }
 
 
@@ -292,8 +523,122 @@ evdns_base* Base::GetDns() {
 }
 
 
+string Base::Resolve(const string& host) {
+  string address;
+  if (CachedAddress(host, &address)) {
+    return address;
+  }
+
+  address = resolver_->Resolve(host);
+  if (!address.empty() && FLAGS_dns_cache_ttl_seconds > 0) {
+    lock_guard<mutex> lock(dns_cache_lock_);
+    DnsEntry& entry(dns_cache_[host]);
+    entry.address = address;
+    entry.expiry =
+        steady_clock::now() + seconds(FLAGS_dns_cache_ttl_seconds);
+    entry.refreshing = false;
+  }
+
+  return address;
+}
+
+
+bool Base::CachedAddress(const string& host, string* address) {
+  in_addr literal;
+  if (evutil_inet_pton(AF_INET, host.c_str(), &literal) == 1) {
+    *address = host;
+    return true;
+  }
+
+  unique_lock<mutex> lock(dns_cache_lock_);
+  const auto it(dns_cache_.find(host));
+  // Hosts being looked up for the first time have no address yet.
+  if (it == dns_cache_.end() || it->second.address.empty()) {
+    dns_cache_lookups->Increment("miss");
+    return false;
+  }
+
+  *address = it->second.address;
+  if (it->second.expiry > steady_clock::now()) {
+    dns_cache_lookups->Increment("hit");
+    return true;
+  }
+
+  dns_cache_lookups->Increment("stale");
+  if (!it->second.refreshing) {
+    it->second.refreshing = true;
+    lock.unlock();
+    RefreshAddress(host);
+  }
+
+  return true;
+}
+
+
+void Base::RefreshAddress(const string& host) {
+  DnsRefresh* const refresh(new DnsRefresh{this, host});
+  if (!evdns_base_resolve_ipv4(GetDns(), host.c_str(), 0,
+                               &Base::AddressRefreshed, refresh)) {
+    // Not even started, so the next lookup will resolve it again.
+    delete refresh;
+    lock_guard<mutex> lock(dns_cache_lock_);
+    dns_cache_.erase(host);
+  }
+}
+
+
+// static
+void Base::AddressRefreshed(int result, char type, int count, int ttl,
+                            void* addresses, void* userdata) {
+  const unique_ptr<DnsRefresh> refresh(
+      static_cast<DnsRefresh*>(CHECK_NOTNULL(userdata)));
+  if (result == DNS_ERR_SHUTDOWN) {
+    // The base is going away.
+    return;
+  }
+
+  Base* const self(refresh->base);
+  lock_guard<mutex> lock(self->dns_cache_lock_);
+  if (result != DNS_ERR_NONE || type != DNS_IPv4_A || count <= 0) {
+    // Hosts that only the resolver knows about (such as those in
+    // /etc/hosts) end up here too, and are looked up with it next
+    // time.
+    VLOG(1) << "Failed to refresh address of " << refresh->host << ": "
+            << evdns_err_to_string(result);
+    self->dns_cache_.erase(refresh->host);
+    return;
+  }
+
+  char address[INET_ADDRSTRLEN];
+  CHECK_NOTNULL(evutil_inet_ntop(AF_INET, static_cast<in_addr*>(addresses),
+                                 address, sizeof(address)));
+  DnsEntry& entry(self->dns_cache_[refresh->host]);
+  entry.address = address;
+  entry.expiry = steady_clock::now() +
+                 seconds(max(1, min(ttl, FLAGS_dns_cache_ttl_seconds)));
+  entry.refreshing = false;
+}
+
+
 evhtp_connection_t* Base::HttpConnectionNew(const string& host,
                                             unsigned short port) {
+  string address;
+  if (FLAGS_dns_cache_ttl_seconds > 0 && CachedAddress(host, &address)) {
+    return CHECK_NOTNULL(
+        evhtp_connection_new(base_.get(), address.c_str(), port));
+  }
+
+  // This one has to wait for the name to be resolved, but the next
+  // ones will not.
+  if (FLAGS_dns_cache_ttl_seconds > 0) {
+    unique_lock<mutex> lock(dns_cache_lock_);
+    DnsEntry& entry(dns_cache_[host]);
+    if (!entry.refreshing) {
+      entry.refreshing = true;
+      lock.unlock();
+      RefreshAddress(host);
+    }
+  }
   return CHECK_NOTNULL(
       evhtp_connection_new_dns(base_.get(), GetDns(), host.c_str(), port));
 }
@@ -306,7 +651,7 @@ evhtp_connection_t* Base::HttpsConnectionNew(const string& host,
 
   // TODO(alcutter): remove this all temporary name resolution stuff when this
   // PR is merged: https://github.com/ellzey/libevhtp/pull/163
-  const string addr_str(resolver_->Resolve(host));
+  const string addr_str(Resolve(host));
   VLOG(1) << "Got addr: " << addr_str << ":" << port;
   evhtp_connection_t* ret(CHECK_NOTNULL(
       evhtp_connection_ssl_new(base_.get(), addr_str.c_str(), port, ssl_ctx)));
@@ -317,18 +662,83 @@ evhtp_connection_t* Base::HttpsConnectionNew(const string& host,
 void Base::RunClosures(evutil_socket_t, short, void* userdata) {
   Base* self(static_cast<Base*>(CHECK_NOTNULL(userdata)));
 
-  vector<function<void()>> closures;
+  // Anything added from now on wakes us up again (these are
+  // sequentially consistent with the ones in Add()). Only run what was
+  // there already, so closures that add more cannot starve the loop.
+  self->wake_pending_.store(false);
+  ClosureNode* const last(self->closures_head_.load());
+
+  int64_t num_run(0);
+  while (self->closures_tail_ != last) {
+    ClosureNode* const next(
+        self->closures_tail_->next.load(memory_order_acquire));
+    if (!next) {
+      // Some Add() is between taking the head and linking to it.
+      std::this_thread::yield();
+      continue;
+    }
+    delete self->closures_tail_;
+    self->closures_tail_ = next;
+
+    const util::Closure closure(std::move(next->closure));
+    const steady_clock::time_point started(steady_clock::now());
+    self->stats_->queued_closures.IncrementBy(-1);
+    self->stats_->closure_wait_ms.Record(
+        duration<double, std::milli>(started - next->added).count());
+    closure();
+    self->stats_->closure_run_ms.Record(
+        duration<double, std::milli>(steady_clock::now() - started).count());
+    ++num_run;
+  }
+
+  closure_wakeups->Increment();
+  closures_run->IncrementBy(num_run);
+}
+
+
+void Base::RunTimers(evutil_socket_t, short, void* userdata) {
+  Base* self(static_cast<Base*>(CHECK_NOTNULL(userdata)));
+
+  vector<util::Task*> expired;
   {
-    lock_guard<mutex> lock(self->closures_lock_);
-    closures.swap(self->closures_);
+    lock_guard<mutex> lock(self->timers_lock_);
+    self->timers_.Expire(steady_clock::now(), &expired);
+    self->ArmTimers();
   }
 
-  for (const auto& closure : closures) {
-    closure();
+  for (util::Task* const task : expired) {
+    task->Return();
   }
 }
 
 
+void Base::ArmLagProbe() {
+  if (FLAGS_libevent_lag_probe_interval_ms <= 0) {
+    return;
+  }
+  const milliseconds interval(FLAGS_libevent_lag_probe_interval_ms);
+  lag_probe_due_ = steady_clock::now() + interval;
+
+  timeval tv;
+  tv.tv_sec = interval.count() / 1000;
+  tv.tv_usec = (interval.count() % 1000) * 1000;
+  CHECK_EQ(evtimer_add(lag_probe_.get(), &tv), 0);
+}
+
+
+// static
+void Base::LagProbe(evutil_socket_t, short, void* userdata) {
+  Base* self(static_cast<Base*>(CHECK_NOTNULL(userdata)));
+
+  self->stats_->loop_lag_ms.Record(duration<double, std::milli>(
+                                       max(steady_clock::now() -
+                                               self->lag_probe_due_,
+                                           steady_clock::duration::zero()))
+                                       .count());
+  self->ArmLagProbe();
+}
+
+
 Event::Event(const Base& base, evutil_socket_t sock, short events,
              const Callback& cb)
     : cb_(cb), ev_(base.EventNew(sock, events, this)) {
@@ -360,11 +770,24 @@ void Event::Dispatch(evutil_socket_t sock, short events, void* userdata) {
 }
 
 
-HttpServer::HttpServer(const Base& base) : http_(base.HttpNew()) {
+HttpServer::HttpServer(const Base& base, int num_extra_loops)
+    : base_(&base), http_(base.HttpNew()) {
+  CHECK_GE(num_extra_loops, 0);
+  for (int i = 0; i < num_extra_loops; ++i) {
+    extra_bases_.emplace_back(make_shared<Base>());
+    extra_https_.push_back(extra_bases_.back()->HttpNew());
+  }
 }
 
 
 HttpServer::~HttpServer() {
+  extra_pumps_.clear();
+  for (evhttp* const http : tls_https_) {
+    evhttp_free(http);
+  }
+  for (evhttp* const http : extra_https_) {
+    evhttp_free(http);
+  }
   evhttp_free(http_);
   for (vector<Handler*>::iterator it = handlers_.begin();
        it != handlers_.end(); ++it) {
@@ -374,98 +797,373 @@ HttpServer::~HttpServer() {
 
 
 void HttpServer::Bind(const char* address, ev_uint16_t port) {
-  CHECK_EQ(evhttp_bind_socket(http_, address, port), 0);
+  if (extra_https_.empty()) {
+    evhttp_bound_socket* const bound(
+        evhttp_bind_socket_with_handle(http_, address, port));
+    CHECK_NOTNULL(bound);
+    listeners_.emplace_back(http_, bound);
+    return;
+  }
+
+  // Each loop accepts connections on a socket of its own.
+  Adopt(ListenSockets(address, port, extra_https_.size() + 1));
+}
+
+
+void HttpServer::BindTLS(const char* address, ev_uint16_t port,
+                         SSL_CTX* ssl_ctx) {
+  CHECK_NOTNULL(ssl_ctx);
+  CHECK(tls_https_.empty());
+  // The extra loops are not running yet, so their evhttps can be set
+  // up from here.
+  CHECK(extra_pumps_.empty()) << "BindTLS() must be called before Bind()";
+  tls_https_.push_back(base_->HttpNew());
+  for (const shared_ptr<Base>& base : extra_bases_) {
+    tls_https_.push_back(base->HttpNew());
+  }
+
+  const vector<evutil_socket_t> fds(
+      ListenSockets(address, port, tls_https_.size()));
+  for (size_t i = 0; i < tls_https_.size(); ++i) {
+    evhttp* const http(tls_https_[i]);
+    evhttp_set_bevcb(http, &NewTLSBufferEvent, ssl_ctx);
+    for (Handler* const handler : handlers_) {
+      CHECK_EQ(evhttp_set_cb(http, handler->path.c_str(), &HandleRequest,
+                             handler),
+               0);
+    }
+    evhttp_bound_socket* const bound(
+        evhttp_accept_socket_with_handle(http, fds[i]));
+    CHECK_NOTNULL(bound);
+    tls_listeners_.emplace_back(http, bound);
+  }
+}
+
+
+void HttpServer::Adopt(const vector<evutil_socket_t>& fds) {
+  CHECK(listeners_.empty());
+  CHECK(!fds.empty());
+  vector<evhttp*> https(1, http_);
+  https.insert(https.end(), extra_https_.begin(), extra_https_.end());
+  for (size_t i = 0; i < max(fds.size(), https.size()); ++i) {
+    evhttp* const http(https[i % https.size()]);
+    evutil_socket_t fd(i < fds.size() ? fds[i] : dup(fds.front()));
+    PCHECK(fd >= 0);
+    CHECK_EQ(evutil_make_socket_nonblocking(fd), 0);
+    CHECK_EQ(evutil_make_socket_closeonexec(fd), 0);
+    evhttp_bound_socket* const bound(
+        evhttp_accept_socket_with_handle(http, fd));
+    CHECK_NOTNULL(bound);
+    listeners_.emplace_back(http, bound);
+  }
+
+  for (const shared_ptr<Base>& base : extra_bases_) {
+    extra_pumps_.emplace_back(
+        new EventPumpThread(base, /*exit_on_signals*/ false));
+    if (!loop_cpus_.empty()) {
+      // Right away, so that the memory for its connections comes
+      // from the node of its CPUs.
+      extra_pumps_.back()->PinTo(
+          loop_cpus_[extra_pumps_.size() % loop_cpus_.size()]);
+    }
+  }
+}
+
+
+vector<evutil_socket_t> HttpServer::ListeningSockets() const {
+  vector<evutil_socket_t> fds;
+  for (const auto& listener : listeners_) {
+    fds.push_back(evhttp_bound_socket_get_fd(listener.second));
+  }
+  return fds;
+}
+
+
+void HttpServer::StopListening() {
+  vector<pair<evhttp*, evhttp_bound_socket*>> listeners(listeners_);
+  listeners.insert(listeners.end(), tls_listeners_.begin(),
+                   tls_listeners_.end());
+  for (const auto& listener : listeners) {
+    const int loop(ExtraLoopOf(listener.first));
+    if (loop < 0) {
+      evhttp_del_accept_socket(listener.first, listener.second);
+      continue;
+    }
+    // The other loops are running, so their sockets are removed from
+    // there.
+    promise<void> removed;
+    extra_bases_[loop]->Add([&listener, &removed]() {
+      evhttp_del_accept_socket(listener.first, listener.second);
+      removed.set_value();
+    });
+    removed.get_future().get();
+  }
+  listeners_.clear();
+  tls_listeners_.clear();
 }
 
 
 bool HttpServer::AddHandler(const string& path, const HandlerCallback& cb) {
-  Handler* handler(new Handler(path, cb));
+  Handler* handler(new Handler(this, path, cb));
   handlers_.push_back(handler);
 
-  return evhttp_set_cb(http_, path.c_str(), &HandleRequest, handler) == 0;
+  bool ok(evhttp_set_cb(http_, path.c_str(), &HandleRequest, handler) == 0);
+  if (!tls_https_.empty()) {
+    ok &= evhttp_set_cb(tls_https_.front(), path.c_str(), &HandleRequest,
+                        handler) == 0;
+  }
+  for (size_t i = 0; i < extra_https_.size(); ++i) {
+    vector<evhttp*> https(1, extra_https_[i]);
+    if (!tls_https_.empty()) {
+      https.push_back(tls_https_[i + 1]);
+    }
+    const auto add([https, &path, handler]() {
+      bool added(true);
+      for (evhttp* const http : https) {
+        added &=
+            evhttp_set_cb(http, path.c_str(), &HandleRequest, handler) == 0;
+      }
+      return added;
+    });
+    if (extra_pumps_.empty()) {
+      ok &= add();
+      continue;
+    }
+    // The loop is already running, so its handlers are changed from
+    // there.
+    promise<bool> added;
+    extra_bases_[i]->Add([&add, &added]() { added.set_value(add()); });
+    ok &= added.get_future().get();
+  }
+  return ok;
+}
+
+
+void HttpServer::SetLoopCpus(const vector<vector<int>>& groups) {
+  CHECK(extra_pumps_.empty()) << "SetLoopCpus() must be called before "
+                                 "Bind()";
+  CHECK(!groups.empty());
+  loop_cpus_ = groups;
+}
+
+
+void HttpServer::SetObserver(const HandlerCallback& observer) {
+  CHECK(extra_pumps_.empty() && listeners_.empty())
+      << "SetObserver() must be called before Bind()";
+  observer_ = observer;
 }
 
 
 void HttpServer::HandleRequest(evhttp_request* req, void* userdata) {
-  static_cast<Handler*>(userdata)->cb(req);
+  const Handler* const handler(static_cast<Handler*>(userdata));
+  // Only set before the loops start, so it can be read from any.
+  if (handler->server->observer_) {
+    handler->server->observer_(req);
+  }
+  handler->cb(req);
 }
 
 
-QueryParams ParseQuery(evhttp_request* req) {
-  evkeyvalq keyval;
-  QueryParams retval;
-
-  // We return an empty result in case of a parsing error.
-  if (evhttp_parse_query_str(evhttp_uri_get_query(
-                                 evhttp_request_get_evhttp_uri(req)),
-                             &keyval) == 0) {
-    for (evkeyval* i = keyval.tqh_first; i; i = i->next.tqe_next) {
-      retval.insert(make_pair(i->key, i->value));
-    }
+int HttpServer::ExtraLoopOf(const evhttp* http) const {
+  const auto extra(find(extra_https_.begin(), extra_https_.end(), http));
+  if (extra != extra_https_.end()) {
+    return extra - extra_https_.begin();
+  }
+  const auto tls(find(tls_https_.begin(), tls_https_.end(), http));
+  if (tls != tls_https_.end() && tls != tls_https_.begin()) {
+    return tls - tls_https_.begin() - 1;
   }
+  return -1;
+}
 
-  return retval;
+
+void RunOnRequestLoop(evhttp_request* req, const function<void()>& cb) {
+  Base* const base(RequestLoop(req));
+  if (dispatching_base == base) {
+    cb();
+  } else {
+    base->Add(cb);
+  }
 }
 
 
-bool GetParam(const QueryParams& query, const string& param, string* value) {
-  CHECK_NOTNULL(value);
+Base* RequestLoop(evhttp_request* req) {
+  const event_base* const ev_base(evhttp_connection_get_base(
+      evhttp_request_get_connection(CHECK_NOTNULL(req))));
+  lock_guard<mutex> lock(*BasesLock());
+  const auto it(Bases()->find(ev_base));
+  CHECK(it != Bases()->end());
+  return it->second;
+}
 
-  auto it = query.find(param);
-  if (it == query.end()) {
-    return false;
+
+QueryParams::QueryParams(const char* query) : num_params_(0) {
+  // Same rules as evhttp_parse_query_str(): "&"-separated "key=value"
+  // pairs, none of which can be without a key or a "=". A trailing "&"
+  // is fine.
+  const char* p(query);
+  while (p && *p) {
+    const char* const end(p + strcspn(p, "&"));
+    const char* const equals(
+        static_cast<const char*>(memchr(p, '=', end - p)));
+    if (!equals || equals == p) {
+      VLOG(1) << "malformed query string: " << query;
+      more_params_.clear();
+      num_params_ = 0;
+      return;
+    }
+    const Param param{p, static_cast<size_t>(equals - p), equals + 1,
+                      static_cast<size_t>(end - (equals + 1))};
+    if (num_params_ < kInlineParams) {
+      inline_params_[num_params_] = param;
+    } else {
+      more_params_.push_back(param);
+    }
+    ++num_params_;
+    p = *end ? end + 1 : end;
   }
+}
 
-  const string possible_value(it->second);
-  ++it;
 
-  // Flag duplicate query parameters as invalid.
-  const bool retval(it == query.end() || it->first != param);
-  if (retval) {
-    *value = possible_value;
+// static
+bool QueryParams::Is(const Param& param, const char* name, size_t length) {
+  return param.key_length == length && memcmp(param.key, name, length) == 0;
+}
+
+
+const QueryParams::Param* QueryParams::Find(const char* name) const {
+  const size_t length(strlen(name));
+  const Param* found(nullptr);
+  for (int i = 0; i < num_params_; ++i) {
+    if (Is(param(i), name, length)) {
+      if (found) {
+        // Flag duplicate query parameters as invalid.
+        return nullptr;
+      }
+      found = &param(i);
+    }
   }
+  return found;
+}
 
-  return retval;
+
+QueryParams ParseQuery(evhttp_request* req) {
+  return QueryParams(
+      evhttp_uri_get_query(evhttp_request_get_evhttp_uri(req)));
 }
 
 
-// Returns -1 on error, and on success too if the parameter contains
-// -1 (so it's advised to only use it when expecting unsigned
-// parameters).
-int64_t GetIntParam(const QueryParams& query, const string& param) {
-  int retval(-1);
-  string value;
-  if (GetParam(query, param, &value)) {
-    errno = 0;
-    const long num(strtol(value.c_str(), /*endptr*/ NULL, 10));
-    // Detect strtol() errors or overflow/underflow when casting to
-    // retval's type clips the value. We do the following by doing it,
-    // and checking that they're still equal afterward (this will
-    // still work if we change retval's type later on).
-    retval = num;
-    if (errno || static_cast<long>(retval) != num) {
-      VLOG(1) << "over/underflow getting \"" << param << "\": " << retval
-              << ", " << num << " (" << strerror(errno) << ")";
-      retval = -1;
+namespace {
+
+
+int HexValue(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+
+// Decodes the way evhttp_parse_query_str() does: "+" is a space, and
+// "%" followed by anything other than two hex digits is left alone.
+void PercentDecode(const char* data, size_t length, string* out) {
+  out->clear();
+  out->reserve(length);
+  for (size_t i = 0; i < length; ++i) {
+    if (data[i] == '+') {
+      out->push_back(' ');
+    } else if (data[i] == '%' && i + 2 < length &&
+               HexValue(data[i + 1]) >= 0 && HexValue(data[i + 2]) >= 0) {
+      out->push_back(
+          static_cast<char>(HexValue(data[i + 1]) * 16 + HexValue(data[i + 2])));
+      i += 2;
+    } else {
+      out->push_back(data[i]);
     }
   }
+}
+
+
+}  // namespace
+
+
+bool GetParam(const QueryParams& query, const char* param, string* value) {
+  CHECK_NOTNULL(value);
+  const QueryParams::Param* const found(query.Find(param));
+  if (!found) {
+    return false;
+  }
+  PercentDecode(found->value, found->value_length, value);
+  return true;
+}
+
+
+int64_t GetIntParam(const QueryParams& query, const char* param) {
+  const QueryParams::Param* const found(query.Find(param));
+  if (!found) {
+    return -1;
+  }
 
+  // Numbers hardly ever need decoding, so it is only done if needed.
+  const char* digits(found->value);
+  size_t length(found->value_length);
+  string decoded;
+  if (memchr(digits, '%', length) || memchr(digits, '+', length)) {
+    PercentDecode(digits, length, &decoded);
+    digits = decoded.data();
+    length = decoded.size();
+  }
+
+  if (length == 0) {
+    return -1;
+  }
+  int64_t retval(0);
+  for (size_t i = 0; i < length; ++i) {
+    if (digits[i] < '0' || digits[i] > '9' ||
+        retval > (std::numeric_limits<int64_t>::max() - (digits[i] - '0')) /
+                     10) {
+      VLOG(1) << "invalid or out of range integer for \"" << param << "\"";
+      return -1;
+    }
+    retval = retval * 10 + (digits[i] - '0');
+  }
   return retval;
 }
 
 
-bool GetBoolParam(const QueryParams& query, const string& param) {
+bool GetBoolParam(const QueryParams& query, const char* param) {
   string value;
-  if (GetParam(query, param, &value)) {
-    return (value == "true");
-  } else {
-    return false;
+  return GetParam(query, param, &value) && value == "true";
+}
+
+
+bool GetParams(const QueryParams& query, const char* param,
+               vector<string>* values) {
+  CHECK_NOTNULL(values);
+  values->clear();
+  const size_t length(strlen(param));
+  for (int i = 0; i < query.num_params_; ++i) {
+    const QueryParams::Param& p(query.param(i));
+    if (QueryParams::Is(p, param, length)) {
+      values->emplace_back();
+      PercentDecode(p.value, p.value_length, &values->back());
+    }
   }
+  return !values->empty();
 }
 
 
-EventPumpThread::EventPumpThread(const shared_ptr<Base>& base)
-    : base_(base), pump_thread_(bind(&EventPumpThread::Pump, this)) {
+EventPumpThread::EventPumpThread(const shared_ptr<Base>& base,
+                                 bool exit_on_signals)
+    : base_(base),
+      exit_on_signals_(exit_on_signals),
+      pump_thread_(bind(&EventPumpThread::Pump, this)) {
 }
 
 
@@ -475,8 +1173,13 @@ EventPumpThread::~EventPumpThread() {
 }
 
 
+bool EventPumpThread::PinTo(const vector<int>& cpus) {
+  return util::PinThread(pump_thread_.native_handle(), cpus);
+}
+
+
 void EventPumpThread::Pump() {
-  base_->Dispatch();
+  base_->Dispatch(exit_on_signals_);
 }
 
 
@@ -14,18 +14,24 @@
 #include <mutex>
 #include <string>
 #include <thread>
+#include <utility>
 #include <vector>
 
 #include "util/executor.h"
 #include "util/task.h"
+#include "util/timer_wheel.h"
 
 namespace cert_trans {
 namespace libevent {
 
 
 class Event;
+class EventPumpThread;
 
 
+// Its metrics (how many closures are queued and how long they wait
+// and run, and how late the loop is in handling a periodic timer)
+// are labelled with the number of the loop, in order of creation.
 class Base : public util::Executor {
  public:
   class Resolver {
@@ -43,18 +49,28 @@ class Base : public util::Executor {
   Base& operator=(const Base&) = delete;
 
   // Arranges to run the closure on the main loop.
-  void Add(const std::function<void()>& cb) override;
+  void Add(util::Closure cb) override;
 
   void Delay(const std::chrono::duration<double>& delay,
              util::Task* task) override;
 
-  void Dispatch();
+  // Runs the loop until LoopExit() is called or, if |exit_on_signals|,
+  // the process gets a SIGHUP, SIGINT or SIGTERM. Only one loop of
+  // the process should exit on signals.
+  void Dispatch(bool exit_on_signals = true);
   void DispatchOnce();
   void LoopExit();
 
   event* EventNew(evutil_socket_t& sock, short events, Event* event) const;
   evhttp* HttpNew() const;
   evdns_base* GetDns();
+  // Returns an address for |host|, or an empty string if it cannot be
+  // resolved. Addresses are cached for as long as their DNS records
+  // allow (up to --dns_cache_ttl_seconds), and once they expire, the
+  // old one keeps being returned while it is looked up again in the
+  // background, so that only the first connection to a host waits for
+  // the resolver.
+  std::string Resolve(const std::string& host);
   evhtp_connection_t* HttpConnectionNew(const std::string& host,
                                         unsigned short port);
   evhtp_connection_t* HttpsConnectionNew(const std::string& host,
@@ -63,20 +79,71 @@ class Base : public util::Executor {
 
  private:
   static void RunClosures(evutil_socket_t sock, short flag, void* userdata);
+  static void RunTimers(evutil_socket_t sock, short flag, void* userdata);
+  // Records how late the probe timer fired, and arms it again.
+  static void LagProbe(evutil_socket_t sock, short flag, void* userdata);
+  void ArmLagProbe();
+  // Arranges for RunTimers() to be called when the next delayed task
+  // might expire. Must be called with |timers_lock_| held.
+  void ArmTimers();
+
+  struct DnsEntry {
+    DnsEntry() : refreshing(false) {
+    }
+
+    std::string address;
+    std::chrono::steady_clock::time_point expiry;
+    bool refreshing;
+  };
+  struct DnsRefresh;
+  // Sets |*address| to the cached address of |host|, if any, starting
+  // a refresh if it expired.
+  bool CachedAddress(const std::string& host, std::string* address);
+  // Looks up |host| again with |dns_|, in the background.
+  void RefreshAddress(const std::string& host);
+  static void AddressRefreshed(int result, char type, int count, int ttl,
+                               void* addresses, void* userdata);
 
   const std::unique_ptr<event_base, void (*)(event_base*)> base_;
   std::mutex dispatch_lock_;
 
+  struct Stats;
+  const std::unique_ptr<Stats> stats_;
+
   std::mutex dns_lock_;
+  std::mutex dns_cache_lock_;
+  std::map<std::string, DnsEntry> dns_cache_;
   // "dns_" should be after base_, so that it gets destroyed first.
   std::unique_ptr<evdns_base, void (*)(evdns_base*)> dns_;
 
-  std::mutex closures_lock_;
+  // Closures are handed over to the loop through a lock-free queue: a
+  // list that Add() appends to at |closures_head_|, and RunClosures()
+  // consumes from |closures_tail_|, which is the last one it ran (or
+  // an empty one, at first).
+  struct ClosureNode;
+  std::atomic<ClosureNode*> closures_head_;
+  ClosureNode* closures_tail_;
+  // Set once |wake_closures_| is activated, until RunClosures() is
+  // called, so that closures added meanwhile do not activate it again.
+  std::atomic<bool> wake_pending_;
   // "wake_closures_" should be after base_, so that it gets destroyed
   // first.
   const std::unique_ptr<event, void (*)(event*)> wake_closures_;
-  std::vector<std::function<void()>> closures_;
   std::unique_ptr<Resolver> resolver_;
+
+  // Delayed tasks share a single timer event, rather than having one
+  // each.
+  std::mutex timers_lock_;
+  TimerWheel timers_;
+  // "wake_timers_" should be after base_, so that it gets destroyed
+  // first.
+  const std::unique_ptr<event, void (*)(event*)> wake_timers_;
+
+  // Only used on the loop, once Dispatch() is called.
+  std::chrono::steady_clock::time_point lag_probe_due_;
+  // "lag_probe_" should be after base_, so that it gets destroyed
+  // first.
+  const std::unique_ptr<event, void (*)(event*)> lag_probe_;
 };
 
 
@@ -104,50 +171,181 @@ class HttpServer {
  public:
   typedef std::function<void(evhttp_request*)> HandlerCallback;
 
-  explicit HttpServer(const Base& base);
+  // Serves requests on the loop of |base| and, if |num_extra_loops| is
+  // positive, on that many more loops of its own, each pumped by a
+  // thread of its own and accepting connections on a listener of its
+  // own (with SO_REUSEPORT, where available), so that the network I/O
+  // is spread over as many cores. Handlers can then be called on any
+  // of these loops; replies should be sent with RunOnRequestLoop().
+  explicit HttpServer(const Base& base, int num_extra_loops = 0);
   ~HttpServer();
   HttpServer(const HttpServer&) = delete;
   HttpServer& operator=(const HttpServer&) = delete;
 
   void Bind(const char* address, ev_uint16_t port);
 
+  // Also serves HTTPS on |port|, on all the loops, with |ssl_ctx|,
+  // which must outlive this instance. Has to be called before Bind()
+  // or Adopt(). These sockets are not among the ListeningSockets(), so
+  // they are not handed over to another process.
+  void BindTLS(const char* address, ev_uint16_t port, SSL_CTX* ssl_ctx);
+
+  // Instead of Bind(), accepts connections on |fds|, listening sockets
+  // handed over by another process (see server/handoff.h), and takes
+  // ownership of them. They are spread over the loops; loops left
+  // without one of their own share the first.
+  void Adopt(const std::vector<evutil_socket_t>& fds);
+
+  // The sockets it accepts plain HTTP connections on, still owned by
+  // this instance.
+  std::vector<evutil_socket_t> ListeningSockets() const;
+
+  // Stops accepting connections, and closes the listening sockets;
+  // the connections already accepted are still served. Must be called
+  // on the loop of the |base| given to the constructor.
+  void StopListening();
+
   // Returns false if there was an error adding the handler.
   bool AddHandler(const std::string& path, const HandlerCallback& cb);
 
+  // Pins the threads pumping the extra loops, each with its listener,
+  // to the CPUs of |groups| (typically those of the NUMA nodes, see
+  // util/cpu_affinity.h): the i-th to groups[(i + 1) % groups.size()],
+  // leaving the first for the thread pumping |base|. Has to be called
+  // before Bind() or Adopt().
+  void SetLoopCpus(const std::vector<std::vector<int>>& groups);
+
+  // Calls |observer| with every request, on the loop it came in on,
+  // before the handler for its path (requests without one are not
+  // seen). It must not reply to them. Has to be called before Bind()
+  // or Adopt().
+  void SetObserver(const HandlerCallback& observer);
+
  private:
   struct Handler;
 
   static void HandleRequest(evhttp_request* req, void* userdata);
 
+  // Returns the index in |extra_bases_| of the loop |http| is on, or
+  // -1 if it is on that of |base_|.
+  int ExtraLoopOf(const evhttp* http) const;
+
+  const Base* const base_;
   evhttp* const http_;
   // Could have been a vector<Handler>, but it is important that
   // pointers to entries remain valid.
   std::vector<Handler*> handlers_;
+  // The extra loops, with their listeners. The pump threads are only
+  // started once bound, and are stopped before the rest goes away.
+  std::vector<std::shared_ptr<Base>> extra_bases_;
+  std::vector<evhttp*> extra_https_;
+  std::vector<std::unique_ptr<EventPumpThread>> extra_pumps_;
+  std::vector<std::vector<int>> loop_cpus_;
+  HandlerCallback observer_;
+  // The listening sockets, with the evhttp accepting on each.
+  std::vector<std::pair<evhttp*, evhttp_bound_socket*>> listeners_;
+  // The same for HTTPS, with one evhttp per loop, the first on that of
+  // |base_|. Empty unless BindTLS() was called.
+  std::vector<evhttp*> tls_https_;
+  std::vector<std::pair<evhttp*, evhttp_bound_socket*>> tls_listeners_;
 };
 
-typedef std::multimap<std::string, std::string> QueryParams;
 
+// Runs |cb| on the loop |req| came in on: right away if called from
+// it, later otherwise. Replies to |req| have to be sent from there.
+void RunOnRequestLoop(evhttp_request* req, const std::function<void()>& cb);
+
+// Returns the loop |req| came in on, for replies that still have to
+// be sent from there after |req| itself may have gone away (because
+// its connection was closed).
+Base* RequestLoop(evhttp_request* req);
+
+// The parameters of a query string, split up in place: nothing is
+// copied or decoded until the value of a parameter is asked for. It
+// refers to the query string, which has to outlive it.
+//
+// As with evhttp_parse_query_str(), a malformed query string is
+// treated as empty.
+class QueryParams {
+ public:
+  // |query| can be NULL, for no query string at all.
+  explicit QueryParams(const char* query);
+
+ private:
+  struct Param {
+    const char* key;
+    size_t key_length;
+    const char* value;
+    size_t value_length;
+  };
+
+  friend bool GetParam(const QueryParams& query, const char* param,
+                       std::string* value);
+  friend int64_t GetIntParam(const QueryParams& query, const char* param);
+  friend bool GetBoolParam(const QueryParams& query, const char* param);
+
+  friend bool GetParams(const QueryParams& query, const char* param,
+                        std::vector<std::string>* values);
+
+  // Requests rarely have more parameters than this, and those are kept
+  // without allocating.
+  static const int kInlineParams = 8;
+
+  const Param& param(int i) const {
+    return i < kInlineParams ? inline_params_[i]
+                             : more_params_[i - kInlineParams];
+  }
+  // Returns whether |param| is called |name|, of length |length|.
+  static bool Is(const Param& param, const char* name, size_t length);
+  // Returns |name|, or NULL if it is missing or appears more than
+  // once.
+  const Param* Find(const char* name) const;
+
+  Param inline_params_[kInlineParams];
+  std::vector<Param> more_params_;
+  int num_params_;
+};
+
+// The returned parameters refer to the URI of |req|.
 QueryParams ParseQuery(evhttp_request* req);
 
-bool GetParam(const QueryParams& query, const std::string& param,
+// Sets |*value| to the (percent-decoded) value of |param|, if it
+// appears exactly once.
+bool GetParam(const QueryParams& query, const char* param,
               std::string* value);
 
-int64_t GetIntParam(const QueryParams& query, const std::string& param);
+// Returns -1 on error, and on success too if the parameter contains
+// -1 (so it's advised to only use it when expecting unsigned
+// parameters).
+int64_t GetIntParam(const QueryParams& query, const char* param);
+
+bool GetBoolParam(const QueryParams& query, const char* param);
 
-bool GetBoolParam(const QueryParams& query, const std::string& param);
+// Sets |*values| to the (percent-decoded) values of |param|, in
+// order, for parameters which can be repeated. Returns false if it is
+// missing.
+bool GetParams(const QueryParams& query, const char* param,
+               std::vector<std::string>* values);
 
 
 class EventPumpThread {
  public:
-  EventPumpThread(const std::shared_ptr<Base>& base);
+  // See Base::Dispatch() for |exit_on_signals|.
+  EventPumpThread(const std::shared_ptr<Base>& base,
+                  bool exit_on_signals = true);
   ~EventPumpThread();
   EventPumpThread(const EventPumpThread&) = delete;
   EventPumpThread& operator=(const EventPumpThread&) = delete;
 
+  // Restricts the thread to running on |cpus|. Returns false if it
+  // could not be done.
+  bool PinTo(const std::vector<int>& cpus);
+
  private:
   void Pump();
 
   const std::shared_ptr<Base> base_;
+  const bool exit_on_signals_;
   std::thread pump_thread_;
 };
 
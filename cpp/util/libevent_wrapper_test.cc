@@ -1,9 +1,14 @@
 #include "util/libevent_wrapper.h"
 
+#include <gflags/gflags.h>
 #include <gtest/gtest.h>
+#include <thread>
+#include <vector>
 
 #include "util/testing.h"
 
+DECLARE_int32(dns_cache_ttl_seconds);
+
 namespace cert_trans {
 namespace libevent {
 
@@ -26,6 +31,21 @@ class LibEventWrapperTest : public ::testing::Test {
 typedef class LibEventWrapperTest LibEventWrapperDeathTest;
 
 
+class CountingResolver : public Base::Resolver {
+ public:
+  explicit CountingResolver(int* count) : count_(count) {
+  }
+
+  std::string Resolve(const std::string& host) override {
+    ++*count_;
+    return host == "unknown.test" ? std::string() : "192.0.2.1";
+  }
+
+ private:
+  int* const count_;
+};
+
+
 TEST_F(LibEventWrapperTest, TestOnEventThread) {
   ExpectToBeOnEventThread(false);
   std::shared_ptr<Base> base(std::make_shared<Base>());
@@ -57,6 +77,115 @@ TEST_F(LibEventWrapperDeathTest, TestCheckNotOnEventThread) {
 }
 
 
+TEST_F(LibEventWrapperTest, TestAddFromManyThreads) {
+  const int kThreads(16);
+  const int kClosuresPerThread(1000);
+  std::shared_ptr<Base> base(std::make_shared<Base>());
+  // Only touched on the event thread.
+  int count(0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; ++i) {
+    threads.emplace_back([&base, &count]() {
+      for (int j = 0; j < kClosuresPerThread; ++j) {
+        base->Add([&count]() {
+          EXPECT_TRUE(Base::OnEventThread());
+          ++count;
+        });
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  while (count < kThreads * kClosuresPerThread) {
+    base->DispatchOnce();
+  }
+  EXPECT_EQ(kThreads * kClosuresPerThread, count);
+}
+
+
+TEST_F(LibEventWrapperTest, TestResolveCachesAddresses) {
+  FLAGS_dns_cache_ttl_seconds = 60;
+  int count(0);
+  Base base(std::unique_ptr<Base::Resolver>(new CountingResolver(&count)));
+
+  EXPECT_EQ("192.0.2.1", base.Resolve("example.test"));
+  EXPECT_EQ("192.0.2.1", base.Resolve("example.test"));
+  EXPECT_EQ(1, count);
+
+  // Failures are not cached.
+  EXPECT_EQ("", base.Resolve("unknown.test"));
+  EXPECT_EQ("", base.Resolve("unknown.test"));
+  EXPECT_EQ(3, count);
+
+  // Addresses need no resolving at all.
+  EXPECT_EQ("127.0.0.1", base.Resolve("127.0.0.1"));
+  EXPECT_EQ(3, count);
+}
+
+
+TEST_F(LibEventWrapperTest, TestResolveWithoutCache) {
+  FLAGS_dns_cache_ttl_seconds = 0;
+  int count(0);
+  Base base(std::unique_ptr<Base::Resolver>(new CountingResolver(&count)));
+
+  EXPECT_EQ("192.0.2.1", base.Resolve("example.test"));
+  EXPECT_EQ("192.0.2.1", base.Resolve("example.test"));
+  EXPECT_EQ(2, count);
+}
+
+
+TEST_F(LibEventWrapperTest, TestQueryParams) {
+  const QueryParams query("start=10&end=%32%30&hash=a%2Bb+c&flag=true&"
+                          "dup=1&dup=2&");
+  EXPECT_EQ(10, GetIntParam(query, "start"));
+  EXPECT_EQ(20, GetIntParam(query, "end"));
+  EXPECT_EQ(-1, GetIntParam(query, "missing"));
+  EXPECT_EQ(-1, GetIntParam(query, "dup"));
+  EXPECT_EQ(-1, GetIntParam(query, "hash"));
+  std::string value;
+  EXPECT_TRUE(GetParam(query, "hash", &value));
+  EXPECT_EQ("a+b c", value);
+  EXPECT_FALSE(GetParam(query, "dup", &value));
+  EXPECT_TRUE(GetBoolParam(query, "flag"));
+  EXPECT_FALSE(GetBoolParam(query, "start"));
+  std::vector<std::string> values;
+  EXPECT_TRUE(GetParams(query, "dup", &values));
+  EXPECT_EQ((std::vector<std::string>{"1", "2"}), values);
+  EXPECT_FALSE(GetParams(query, "missing", &values));
+}
+
+
+TEST_F(LibEventWrapperTest, TestQueryParamsIntegers) {
+  EXPECT_EQ(9223372036854775807LL,
+            GetIntParam(QueryParams("n=9223372036854775807"), "n"));
+  EXPECT_EQ(-1, GetIntParam(QueryParams("n=9223372036854775808"), "n"));
+  EXPECT_EQ(-1, GetIntParam(QueryParams("n="), "n"));
+  EXPECT_EQ(-1, GetIntParam(QueryParams("n=-5"), "n"));
+  EXPECT_EQ(-1, GetIntParam(QueryParams("n=12x"), "n"));
+}
+
+
+TEST_F(LibEventWrapperTest, TestQueryParamsManyAndMalformed) {
+  std::string many;
+  for (int i = 0; i < 100; ++i) {
+    many += "hash=" + std::to_string(i) + "&";
+  }
+  many += "last=100";
+  const QueryParams query(many.c_str());
+  std::vector<std::string> values;
+  EXPECT_TRUE(GetParams(query, "hash", &values));
+  EXPECT_EQ(100U, values.size());
+  EXPECT_EQ("99", values.back());
+  EXPECT_EQ(100, GetIntParam(query, "last"));
+
+  EXPECT_EQ(-1, GetIntParam(QueryParams(nullptr), "n"));
+  EXPECT_EQ(-1, GetIntParam(QueryParams("n=1&novalue"), "n"));
+  EXPECT_EQ(-1, GetIntParam(QueryParams("n=1&=2"), "n"));
+}
+
+
 }  // namespace libevent
 }  // namespace cert_trans
 
@@ -2,9 +2,9 @@
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
-#include <climits>
 #include <functional>
 
+#include "monitoring/latency.h"
 #include "monitoring/monitoring.h"
 #include "util/periodic_closure.h"
 
@@ -12,7 +12,10 @@ namespace cert_trans {
 
 using cert_trans::Gauge;
 using std::bind;
+using std::chrono::milliseconds;
 using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::make_pair;
 using std::mutex;
 using std::placeholders::_1;
 using std::placeholders::_2;
@@ -28,6 +31,11 @@ DEFINE_int32(master_keepalive_interval_seconds, 60,
 DEFINE_int32(masterelection_retry_delay_seconds, 5,
              "Seconds to delay before retrying a failed attempt to create a "
              "proposal file.");
+DEFINE_bool(master_keepalive_refresh_ttl, false,
+            "Refresh the TTL of the mastership proposal, rather than "
+            "rewriting it, when it is unchanged, so that the other "
+            "participants are not woken up by keepalives. Requires etcd 2.3 "
+            "or later.");
 
 namespace {
 
@@ -45,6 +53,18 @@ static Counter<>* proposal_creation_failures(
                    "Total number of failures to create an election "
                    "proposal."));
 
+static Counter<string>* proposal_watch_updates(
+    Counter<string>::New("election_proposal_watch_updates", "result",
+                         "Number of updates to the election proposals "
+                         "received, by whether they were evaluated or "
+                         "ignored as not changing the election."));
+
+static Latency<milliseconds> election_transition_latency_ms(
+    "election_transition_latency_ms",
+    "Time from the participants no longer agreeing on a master (or from "
+    "joining the election) to them agreeing on one, as seen by this node, "
+    "in ms.");
+
 
 // Special backing string which indicates that we're not backing any proposal.
 const char kNoBacking[] = "";
@@ -106,7 +126,10 @@ MasterElection::MasterElection(const shared_ptr<libevent::Base>& base,
       proposal_state_(ProposalState::NONE),
       running_(false),
       backed_proposal_(kNoBacking),
-      is_master_(false) {
+      published_backing_(kNoBacking),
+      update_dropped_(false),
+      is_master_(false),
+      has_agreed_master_(false) {
   CHECK_NE(kNoBacking, node_id);
   is_master_gauge->Set(0);
   participating_in_election_gauge->Set(0);
@@ -135,6 +158,8 @@ void MasterElection::StartElection() {
     VLOG(1) << my_proposal_path_ << ": Joining election";
     running_ = true;
     participating_in_election_gauge->Set(1);
+    has_agreed_master_ = false;
+    no_agreed_master_since_ = steady_clock::now();
 
     Transition(lock, ProposalState::AWAITING_CREATION);
   }
@@ -296,6 +321,7 @@ void MasterElection::ProposalCreateDone(EtcdClient::Response* resp,
           << resp->etcd_index;
 
   my_proposal_modified_index_ = my_proposal_create_index_ = resp->etcd_index;
+  published_backing_ = kNoBacking;
   // Start a periodic callback to keep our proposal from being garbage
   // collected
   CHECK(!proposal_refresh_callback_);
@@ -345,16 +371,22 @@ void MasterElection::UpdateProposal(const string& backed) {
 
   // TODO(alcutter): Set the HTTP timeout inside here to something sensible.
   EtcdClient::Response* const resp(new EtcdClient::Response);
-  client_->UpdateWithTTL(my_proposal_path_, backed,
-                         seconds(FLAGS_master_keepalive_interval_seconds * 2),
-                         my_proposal_modified_index_, resp,
-                         new Task(bind(&MasterElection::ProposalUpdateDone,
-                                       this, resp, _1),
-                                  base_.get()));
+  Task* const task(new Task(
+      bind(&MasterElection::ProposalUpdateDone, this, backed, resp, _1),
+      base_.get()));
+  const seconds ttl(FLAGS_master_keepalive_interval_seconds * 2);
+  if (FLAGS_master_keepalive_refresh_ttl && backed == published_backing_) {
+    client_->RefreshTTL(my_proposal_path_, ttl, my_proposal_modified_index_,
+                        resp, task);
+  } else {
+    client_->UpdateWithTTL(my_proposal_path_, backed, ttl,
+                           my_proposal_modified_index_, resp, task);
+  }
 }
 
 
-void MasterElection::ProposalUpdateDone(EtcdClient::Response* resp,
+void MasterElection::ProposalUpdateDone(const string& backed,
+                                        EtcdClient::Response* resp,
                                         Task* task) {
   unique_ptr<EtcdClient::Response> resp_deleter(resp);
   unique_lock<mutex> lock(mutex_);
@@ -365,8 +397,16 @@ void MasterElection::ProposalUpdateDone(EtcdClient::Response* resp,
   // Keep a note of the current modification index of our proposal since
   // we'll need it in order to update or delete the proposal
   my_proposal_modified_index_ = resp->etcd_index;
+  published_backing_ = backed;
   VLOG(1) << my_proposal_path_ << ": Proposal refreshed @ "
           << resp->etcd_index;
+
+  // A TTL refresh does not come back through the watch, so catch up
+  // with the updates we could not act on while it was in flight.
+  if (update_dropped_ && running_) {
+    update_dropped_ = false;
+    EvaluateProposals(lock);
+  }
 }
 
 
@@ -392,6 +432,9 @@ void MasterElection::ProposalDeleteDone(Task* task) {
   // Now clean up
   my_proposal_create_index_ = -1;
   proposals_.clear();
+  proposals_by_index_.clear();
+  backing_counts_.clear();
+  update_dropped_ = false;
   Transition(lock, ProposalState::NONE);
 }
 
@@ -409,39 +452,71 @@ void MasterElection::ProposalKeepAliveCallback() {
 }
 
 
-void MasterElection::UpdateProposalView(
+bool MasterElection::UpdateProposalView(
     const vector<EtcdClient::Node>& updates) {
+  bool changed(false);
   for (const auto& update : updates) {
+    const auto it(proposals_.find(update.key_));
     if (!update.deleted_) {
       VLOG(1) << my_proposal_path_
               << ": Proposal updated: " << update.ToString();
-      proposals_[update.key_] = update;
+      if (it == proposals_.end()) {
+        proposals_.emplace(update.key_, update);
+        IndexProposal(update);
+        changed = true;
+      } else if (it->second.created_index_ != update.created_index_ ||
+                 it->second.value_ != update.value_) {
+        UnindexProposal(it->second);
+        it->second = update;
+        IndexProposal(update);
+        changed = true;
+      } else {
+        // Just a keepalive.
+        it->second = update;
+      }
     } else {
       VLOG(1) << my_proposal_path_
               << ": Proposal deleted: " << update.ToString();
-      CHECK_EQ(static_cast<size_t>(1), proposals_.erase(update.key_))
+      CHECK(it != proposals_.end())
           << my_proposal_path_
           << ": Unknown proposal deleted: " << update.ToString();
+      UnindexProposal(it->second);
+      proposals_.erase(it);
+      changed = true;
     }
   }
+  return changed;
+}
+
+
+void MasterElection::IndexProposal(const EtcdClient::Node& proposal) {
+  CHECK(proposals_by_index_.emplace(proposal.created_index_, proposal.key_)
+            .second);
+  ++backing_counts_[proposal.value_];
+}
+
+
+void MasterElection::UnindexProposal(const EtcdClient::Node& proposal) {
+  CHECK_EQ(static_cast<size_t>(1),
+           proposals_by_index_.erase(
+               make_pair(proposal.created_index_, proposal.key_)));
+  const auto it(backing_counts_.find(proposal.value_));
+  CHECK(it != backing_counts_.end());
+  if (--it->second == 0) {
+    backing_counts_.erase(it);
+  }
 }
 
 
 bool MasterElection::DetermineApparentMaster(
     EtcdClient::Node* apparent_master) const {
-  EtcdClient::Node tmp_master(INT_MAX, INT_MAX, "", false, "", {}, true);
-  bool found(false);
-  for (const auto& pair : proposals_) {
-    CHECK_EQ(pair.first, pair.second.key_);
-    if (pair.second.created_index_ < tmp_master.created_index_) {
-      found = true;
-      tmp_master = pair.second;
-    }
-  }
-  if (found) {
-    *apparent_master = tmp_master;
+  if (proposals_by_index_.empty()) {
+    return false;
   }
-  return found;
+  const auto it(proposals_.find(proposals_by_index_.begin()->second));
+  CHECK(it != proposals_.end());
+  *apparent_master = it->second;
+  return true;
 }
 
 
@@ -456,10 +531,22 @@ void MasterElection::OnProposalUpdate(
     return;
   }
 
-  // First, update our view of the proposals:
-  UpdateProposalView(updates);
+  // First, update our view of the proposals. If nobody came or went,
+  // or changed their mind, the outcome is the same as last time.
+  if (!UpdateProposalView(updates)) {
+    proposal_watch_updates->Increment("ignored");
+    return;
+  }
+  proposal_watch_updates->Increment("evaluated");
 
-  // Now figure out who we think the master should be based on proposal
+  EvaluateProposals(lock);
+}
+
+
+void MasterElection::EvaluateProposals(const unique_lock<mutex>& lock) {
+  CHECK(lock.owns_lock());
+
+  // Figure out who we think the master should be based on proposal
   // creation indicies:
   EtcdClient::Node apparent_master;
   if (!DetermineApparentMaster(&apparent_master)) {
@@ -469,8 +556,7 @@ void MasterElection::OnProposalUpdate(
     VLOG(1) << my_proposal_path_
             << ": No proposals to consider; no master currently";
     // Since nobody is a master, that includes us:
-    is_master_ = false;
-    is_master_gauge->Set(0);
+    LoseAgreedMaster(lock);
     return;
   }
 
@@ -482,60 +568,65 @@ void MasterElection::OnProposalUpdate(
             << is_master_;
     // Try to update our proposal to show our support of the apparent master.
     // If this fails it'll be because there's already an update in-flight, so
-    // we'll get notified of that shortly and end up here agin, at which point
-    // we can try again.
+    // we'll try again once it is done.
     if (MaybeUpdateProposal(lock, apparent_master.key_)) {
       // We managed to send the the update so store our backing here so we
       // don't continually fire off 'updates' saying the same thing
       backed_proposal_ = apparent_master.key_;
+    } else {
+      update_dropped_ = true;
     }
     // Since we changed our mind about who to back, that means there's not
     // currently consensus, so we can't be a master either.
     // Strictly this might not be true - if everyone else already voted for us
     // we could short circuit and set this true here, but there's no really
     // anything to be gained from that other than more complex code.
-    is_master_ = false;
-    is_master_gauge->Set(0);
+    LoseAgreedMaster(lock);
     return;
   }
 
   // Check to see whether the apparent master from the previous stage is backed
   // by all participating nodes:
   CHECK(!proposals_.empty());
-  // Check if everyone is in agreement about who the master is:
-  for (const auto& pair : proposals_) {
-    // Discount any participant who has explicitly abstained from the vote.
-    // This is because participants who have just joined the election will not
-    // have had a chance to decide who to back, this would cause temporary
-    // blibs to No Master for the election each time a new participant joined,
-    // so we allow them to abstain from the vote, they should then analyze the
-    // situation and update their proposal with new backing info, at which
-    // point everybody will run OnProposalUpdate() and check for
-    // consensus again.
-    if (pair.second.value_ == kNoBacking) {
-      continue;
-    }
-    if (pair.second.value_ != apparent_master.key_) {
-      // Whoops, we don't have agreement: nobody is a master at the moment.
-      // In effect, we're now waiting for everybody to update their proposals
-      // an reach agreement for who the master is, or, possibly, for the
-      // dissenting participants (who have probably just crashed/wedged) to
-      // have their proposals expired by etcd.
-      VLOG(1) << my_proposal_path_ << ": No master currently, " << is_master_;
-      VLOG(1) << my_proposal_path_ << ": Apparent master is "
-              << apparent_master.key_ << " but " << pair.first
-              << " is backing: " << pair.second.value_;
-      // No master, so we can't be master
-      is_master_ = false;
-      is_master_gauge->Set(0);
-      return;
+  // Discount any participant who has explicitly abstained from the vote.
+  // This is because participants who have just joined the election will not
+  // have had a chance to decide who to back, this would cause temporary
+  // blibs to No Master for the election each time a new participant joined,
+  // so we allow them to abstain from the vote, they should then analyze the
+  // situation and update their proposal with new backing info, at which
+  // point everybody will run OnProposalUpdate() and check for
+  // consensus again.
+  int backers(0);
+  for (const string& backing : {string(kNoBacking), apparent_master.key_}) {
+    const auto it(backing_counts_.find(backing));
+    if (it != backing_counts_.end()) {
+      backers += it->second;
     }
   }
+  if (static_cast<size_t>(backers) != proposals_.size()) {
+    // Whoops, we don't have agreement: nobody is a master at the moment.
+    // In effect, we're now waiting for everybody to update their proposals
+    // an reach agreement for who the master is, or, possibly, for the
+    // dissenting participants (who have probably just crashed/wedged) to
+    // have their proposals expired by etcd.
+    VLOG(1) << my_proposal_path_ << ": No master currently, " << is_master_;
+    VLOG(1) << my_proposal_path_ << ": Apparent master is "
+            << apparent_master.key_ << " but only " << backers << " of "
+            << proposals_.size() << " participants back it";
+    // No master, so we can't be master
+    LoseAgreedMaster(lock);
+    return;
+  }
 
   // There must be consensus about who the master is now.
   VLOG(2) << my_proposal_path_ << ": Agreed that master is "
           << apparent_master.key_;
   current_master_ = apparent_master;
+  if (!has_agreed_master_) {
+    has_agreed_master_ = true;
+    election_transition_latency_ms.RecordLatency(steady_clock::now() -
+                                                 no_agreed_master_since_);
+  }
 
   // Finally, determine if we're the master, and wake up anyone blocked in
   // WaitToBecomeMaster() if so:
@@ -550,4 +641,15 @@ void MasterElection::OnProposalUpdate(
 }
 
 
+void MasterElection::LoseAgreedMaster(const unique_lock<mutex>& lock) {
+  CHECK(lock.owns_lock());
+  is_master_ = false;
+  is_master_gauge->Set(0);
+  if (has_agreed_master_) {
+    has_agreed_master_ = false;
+    no_agreed_master_since_ = steady_clock::now();
+  }
+}
+
+
 }  // namespace cert_trans
@@ -2,11 +2,15 @@
 #define CERT_TRANS_UTIL_MASTERELECTION_H_
 
 #include <stdint.h>
+#include <chrono>
 #include <condition_variable>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <set>
 #include <string>
 #include <thread>
+#include <utility>
 #include <vector>
 
 #include "util/etcd.h"
@@ -35,7 +39,14 @@ class PeriodicClosure;
 // This helps to detect failed candidates and clear up after them.
 // In order to keep this from happening to live candidates, each instance
 // maintains a periodic callback whose sole job is to update the TTL on its
-// proposal file.
+// proposal file. With --master_keepalive_refresh_ttl, this refreshes the TTL
+// without waking up the other participants' watches, so that the keepalives
+// of N participants no longer cost N^2 watch updates.
+//
+// Each participant keeps track of the lowest creation index and of the number
+// of proposals backing each candidate as the updates come in, and ignores the
+// updates which change neither (such as keepalives), so that the cost of an
+// update does not grow with the number of participants either.
 //
 // TODO(alcutter): Some enhancements:
 //   - Recover gracefully from a crash where an old proposal exists for this
@@ -100,12 +111,15 @@ class MasterElection {
                            const std::string& backed);
 
   // Updates this node's proposal.  |backed| should contain the id of the
-  // proposal this node is backing.
+  // proposal this node is backing. If that is what the proposal says
+  // already, and --master_keepalive_refresh_ttl is set, only its TTL is
+  // refreshed.
   // This should only be called on the base_ event thread.
   void UpdateProposal(const std::string& backed);
 
-  // Called when our proposal file has been refreshed by the KeepAlive thread.
-  void ProposalUpdateDone(EtcdClient::Response* resp, util::Task* task);
+  // Called when our proposal file has been updated to back |backed|.
+  void ProposalUpdateDone(const std::string& backed,
+                          EtcdClient::Response* resp, util::Task* task);
 
   // Deletes this node's proposal.
   // This should only be called on the base_ event thread.
@@ -118,8 +132,15 @@ class MasterElection {
   // Thread entry point for the periodic callback to refresh the proposal TTL.
   void ProposalKeepAliveCallback();
 
-  // Updates our local view of the election proposals.
-  void UpdateProposalView(const std::vector<EtcdClient::Node>& updates);
+  // Updates our local view of the election proposals. Returns true iff
+  // a proposal was created or deleted, or changed its backing, i.e. if
+  // the outcome of the election might have changed.
+  bool UpdateProposalView(const std::vector<EtcdClient::Node>& updates);
+
+  // Adds |proposal| to, or removes it from, proposals_by_index_ and
+  // backing_counts_.
+  void IndexProposal(const EtcdClient::Node& proposal);
+  void UnindexProposal(const EtcdClient::Node& proposal);
 
   // Works out which proposal /should/ be master based on created_index_.
   // Returns true iff there was an apparent master, false otherwise.
@@ -129,6 +150,14 @@ class MasterElection {
   // more of the proposal files.
   void OnProposalUpdate(const std::vector<EtcdClient::Node>& updates);
 
+  // Works out who the master is from our view of the proposals, updating
+  // our own proposal if we need to change our backing.
+  void EvaluateProposals(const std::unique_lock<std::mutex>& lock);
+
+  // Notes that there is no agreed master at the moment (which means
+  // that we are not master either).
+  void LoseAgreedMaster(const std::unique_lock<std::mutex>& lock);
+
   // Internal non-locking accessor for is_master_
   bool IsMaster(const std::unique_lock<std::mutex>& lock) const;
 
@@ -150,14 +179,29 @@ class MasterElection {
 
   // Our local copy of the proposals
   std::map<std::string, EtcdClient::Node> proposals_;
+  // The keys of |proposals_|, by creation index, the lowest of which is
+  // the apparent master.
+  std::set<std::pair<int64_t, std::string>> proposals_by_index_;
+  // The number of |proposals_| backing each proposal (or kNoBacking).
+  std::map<std::string, int> backing_counts_;
 
   int64_t my_proposal_create_index_;
   int64_t my_proposal_modified_index_;
 
   std::string backed_proposal_;
+  // What our proposal in etcd currently backs.
+  std::string published_backing_;
+  // Whether EvaluateProposals() could not update our proposal because
+  // of an update in flight, in which case it is run again once that
+  // update is done.
+  bool update_dropped_;
 
   bool is_master_;
   EtcdClient::Node current_master_;
+  // Whether the participants agree on a master, and, if not, since
+  // when, for the election transition latency.
+  bool has_agreed_master_;
+  std::chrono::steady_clock::time_point no_agreed_master_since_;
 
   friend class ElectionTest;
   friend std::ostream& operator<<(std::ostream& output, ProposalState state);
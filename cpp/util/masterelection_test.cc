@@ -53,6 +53,7 @@ DEFINE_string(etcd, "", "etcd server address");
 DEFINE_int32(etcd_port, 4001, "etcd server port");
 DECLARE_int32(master_keepalive_interval_seconds);
 DECLARE_int32(masterelection_retry_delay_seconds);
+DECLARE_bool(master_keepalive_refresh_ttl);
 
 
 // Simple helper class, represents a thread of interest in participating in
@@ -299,6 +300,31 @@ TEST_F(ElectionTest, RetresCreatingProposal) {
 }
 
 
+TEST_F(ElectionTest, RefreshesProposalTTL) {
+  FLAGS_master_keepalive_interval_seconds = 1;
+  FLAGS_master_keepalive_refresh_ttl = true;
+  Participant one(kProposalDir, "1", base_, client_.get());
+  one.ElectLikeABoss();
+  Participant two(kProposalDir, "2", base_, client_.get());
+  two.StartElection();
+
+  // Well past the TTL of the proposals, which must have been kept
+  // alive, with their backing.
+  sleep(4);
+  EXPECT_TRUE(one.IsMaster());
+  EXPECT_FALSE(two.IsMaster());
+
+  one.StopElection();
+  EXPECT_TRUE(two.WaitToBecomeMaster());
+  sleep(3);
+  EXPECT_TRUE(two.IsMaster());
+  two.StopElection();
+
+  FLAGS_master_keepalive_interval_seconds = 60;
+  FLAGS_master_keepalive_refresh_ttl = false;
+}
+
+
 TEST_F(ElectionTest, ElectionMania) {
   const int kNumRounds(20);
   const int kNumParticipants(20);
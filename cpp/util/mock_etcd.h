@@ -26,6 +26,10 @@ class MockEtcdClient : public EtcdClient {
                     const std::chrono::seconds& ttl,
                     const int64_t previous_index, Response* resp,
                     util::Task* task));
+  MOCK_METHOD5(RefreshTTL,
+               void(const std::string& key, const std::chrono::seconds& ttl,
+                    const int64_t previous_index, Response* resp,
+                    util::Task* task));
   MOCK_METHOD4(ForceSet, void(const std::string& key, const std::string& value,
                               Response* resp, util::Task* task));
   MOCK_METHOD5(ForceSetWithTTL,
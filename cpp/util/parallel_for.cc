@@ -0,0 +1,74 @@
+#include "util/parallel_for.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+using std::atomic;
+using std::condition_variable;
+using std::function;
+using std::lock_guard;
+using std::make_shared;
+using std::min;
+using std::mutex;
+using std::shared_ptr;
+using std::unique_lock;
+
+namespace util {
+namespace {
+
+
+// Keeps track of the work handed out by ParallelFor(). It is shared
+// with the closures, as they might only start running (and find there
+// is nothing left to do) after ParallelFor() has returned.
+struct ParallelWork {
+  explicit ParallelWork(size_t item_count)
+      : next(0), count(item_count), done(0) {
+  }
+
+  // Run items until there are none left to start.
+  void Run(const function<void(size_t)>& fn) {
+    for (size_t i = next++; i < count; i = next++) {
+      fn(i);
+      lock_guard<mutex> lock(done_lock);
+      if (++done == count)
+        done_cond.notify_all();
+    }
+  }
+
+  atomic<size_t> next;
+  const size_t count;
+  mutex done_lock;
+  condition_variable done_cond;
+  size_t done;
+};
+
+
+}  // namespace
+
+
+void ParallelFor(Executor* executor, size_t count,
+                 const function<void(size_t)>& fn) {
+  CHECK_NOTNULL(executor);
+  if (count == 0)
+    return;
+
+  const shared_ptr<ParallelWork> work(make_shared<ParallelWork>(count));
+  // |fn| is only called for items which have been claimed, and we
+  // wait for those below, so the closures can safely refer to it.
+  const size_t helpers(
+      min<size_t>(count - 1, std::thread::hardware_concurrency()));
+  for (size_t i = 0; i < helpers; ++i)
+    executor->Add([work, &fn]() { work->Run(fn); });
+
+  work->Run(fn);
+  unique_lock<mutex> lock(work->done_lock);
+  work->done_cond.wait(lock, [&work]() { return work->done == work->count; });
+}
+
+
+}  // namespace util
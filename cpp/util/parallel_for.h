@@ -0,0 +1,22 @@
+#ifndef CERT_TRANS_UTIL_PARALLEL_FOR_H_
+#define CERT_TRANS_UTIL_PARALLEL_FOR_H_
+
+#include <stddef.h>
+#include <functional>
+
+#include "util/executor.h"
+
+namespace util {
+
+
+// Call fn(0), ..., fn(count - 1), spread over |executor| and the
+// calling thread, and return once all have returned. Since the
+// calling thread works through the items too, this makes progress
+// even if no thread of |executor| is free.
+void ParallelFor(Executor* executor, size_t count,
+                 const std::function<void(size_t)>& fn);
+
+
+}  // namespace util
+
+#endif  // CERT_TRANS_UTIL_PARALLEL_FOR_H_
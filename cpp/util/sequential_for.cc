@@ -0,0 +1,47 @@
+#include "util/sequential_for.h"
+
+#include <glog/logging.h>
+#include <memory>
+
+using std::function;
+using std::make_shared;
+using std::shared_ptr;
+
+namespace util {
+namespace {
+
+typedef function<void(size_t i, Task* step_task)> Step;
+
+
+void RunStep(const shared_ptr<const Step>& step, size_t i, size_t count,
+             Task* task) {
+  (*step)(i, task->AddChild([step, i, count, task](Task* step_task) {
+    if (!step_task->status().ok()) {
+      task->Return(step_task->status());
+    } else if (i + 1 == count) {
+      task->Return();
+    } else if (task->CancelRequested()) {
+      task->Return(Status::CANCELLED);
+    } else {
+      RunStep(step, i + 1, count, task);
+    }
+  }));
+}
+
+
+}  // namespace
+
+
+void SequentialFor(size_t count, const Step& step, Task* task) {
+  CHECK(step);
+  CHECK_NOTNULL(task);
+  if (count == 0) {
+    task->Return();
+    return;
+  }
+
+  RunStep(make_shared<const Step>(step), 0, count, task);
+}
+
+
+}  // namespace util
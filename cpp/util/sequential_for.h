@@ -0,0 +1,28 @@
+#ifndef CERT_TRANS_UTIL_SEQUENTIAL_FOR_H_
+#define CERT_TRANS_UTIL_SEQUENTIAL_FOR_H_
+
+#include <stddef.h>
+#include <functional>
+
+#include "util/task.h"
+
+namespace util {
+
+
+// The asynchronous counterpart of a loop of SyncTask::Wait() calls:
+// call step(0, task_0), ..., step(count - 1, task_n), each once the
+// previous one has returned on its task, without a thread waiting in
+// between. Returns on |task| once all steps have, or with the status
+// of the first step which fails, or CANCELLED if |task| is cancelled
+// between steps.
+//
+// The steps run on the executor of |task|, except for the first one,
+// which is called right away.
+void SequentialFor(size_t count,
+                   const std::function<void(size_t i, Task* step_task)>& step,
+                   Task* task);
+
+
+}  // namespace util
+
+#endif  // CERT_TRANS_UTIL_SEQUENTIAL_FOR_H_
@@ -19,6 +19,7 @@ namespace util {
 Task::Task(const function<void(Task*)>& done_callback, Executor* executor)
     : done_callback_(done_callback),
       executor_(CHECK_NOTNULL(executor)),
+      trace_context_(trace::CurrentContext()),
       state_(ACTIVE),
       cancelled_(false),
       holds_(0) {
@@ -61,8 +62,8 @@ void Task::Cancel() {
     child_task->Cancel();
   }
 
-  for (const auto& cb : cancel_callbacks) {
-    executor_->Add(bind(&Task::RunCancelCallback, this, cb));
+  for (auto& cb : cancel_callbacks) {
+    executor_->Add(bind(&Task::RunCancelCallback, this, std::move(cb)));
   }
 }
 
@@ -225,12 +226,15 @@ void Task::TryDoneTransition(unique_lock<mutex>* lock) {
 
 
 void Task::RunCancelCallback(const std::function<void()>& cb) {
+  const trace::ContextScope trace_scope(trace_context_);
   cb();
   RemoveHold();
 }
 
 
 void Task::RunCleanupAndDoneCallbacks() {
+  // This only holds a copy of the context, so it can outlive the task.
+  const trace::ContextScope trace_scope(trace_context_);
   vector<function<void()>> cleanup_callbacks;
 
   {
@@ -18,6 +18,9 @@
 //
 // Once util::Task::Return() is called, the done callback is run on
 // the executor.
+//
+// The callbacks of a task are run with the trace span that was
+// current when the task was created (see util/trace.h).
 
 #ifndef CERT_TRANS_UTIL_TASK_H_
 #define CERT_TRANS_UTIL_TASK_H_
@@ -29,6 +32,7 @@
 
 #include "util/executor.h"
 #include "util/status.h"
+#include "util/trace.h"
 
 namespace util {
 
@@ -171,6 +175,7 @@ class Task {
 
   const std::function<void(Task*)> done_callback_;
   Executor* const executor_;
+  const trace::Context trace_context_;
 
   mutable std::mutex lock_;
   State state_;
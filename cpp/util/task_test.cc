@@ -30,7 +30,7 @@ namespace {
 
 
 class InlineExecutor : public util::Executor {
-  void Add(const std::function<void()>& closure) override {
+  void Add(util::Closure closure) override {
     closure();
   }
   void Delay(const std::chrono::duration<double>& delay,
@@ -1,49 +1,266 @@
 #include "util/thread_pool.h"
+#include "monitoring/monitoring.h"
+#include "util/cpu_affinity.h"
 #include "util/task.h"
+#include "util/timer_wheel.h"
+#include "util/trace.h"
 
 #include <glog/logging.h>
+#include <atomic>
 #include <condition_variable>
+#include <deque>
 #include <mutex>
-#include <queue>
 #include <thread>
 #include <vector>
 
 using std::chrono::duration;
-using std::chrono::duration_cast;
-using std::chrono::seconds;
 using std::chrono::steady_clock;
+using std::atomic;
 using std::condition_variable;
-using std::function;
-using std::get;
+using std::deque;
 using std::lock_guard;
+using std::milli;
+using std::move;
 using std::mutex;
-using std::priority_queue;
+using std::string;
 using std::thread;
-using std::tuple;
+using std::to_string;
 using std::unique_lock;
+using std::unique_ptr;
 using std::vector;
 
 namespace cert_trans {
 namespace {
 
-typedef tuple<steady_clock::time_point, function<void()>, util::Task*>
-    QueueEntry;
 
+// The work-stealing pool whose worker is running on this thread, if
+// any, and which of its queues belongs to that worker.
+thread_local const void* current_pool(nullptr);
+thread_local size_t current_queue(0);
 
-struct QueueOrdering {
-  bool operator()(const QueueEntry& lhs, const QueueEntry& rhs) const {
-    return get<0>(lhs) > get<0>(rhs);
+
+static Gauge<string>* thread_pool_threads(
+    Gauge<string>::New("thread_pool_threads", "pool",
+                       "Number of threads of a thread pool."));
+
+static Gauge<string>* thread_pool_busy_threads(
+    Gauge<string>::New("thread_pool_busy_threads", "pool",
+                       "Number of threads of a thread pool running a "
+                       "closure."));
+
+static Gauge<string>* thread_pool_queued_closures(
+    Gauge<string>::New("thread_pool_queued_closures", "pool",
+                       "Number of closures waiting for a thread of a "
+                       "thread pool."));
+
+static Histogram<string>* thread_pool_wait_ms(
+    Histogram<string>::New("thread_pool_wait_ms", "pool",
+                           "Time closures wait for a thread of a thread "
+                           "pool, in ms."));
+
+static Histogram<string>* thread_pool_run_ms(
+    Histogram<string>::New("thread_pool_run_ms", "pool",
+                           "Time taken running closures on a thread pool, "
+                           "in ms."));
+
+static Counter<string>* thread_pool_delayed_tasks(
+    Counter<string>::New("thread_pool_delayed_tasks", "pool",
+                         "Number of tasks delayed on a thread pool."));
+
+
+string DefaultName() {
+  static atomic<int> num_pools(0);
+  return "thread_pool_" + to_string(num_pools.fetch_add(1));
+}
+
+
+bool PinWorkers(vector<thread>* threads, const vector<vector<int>>& groups) {
+  bool pinned(true);
+  for (size_t i = 0; i < threads->size(); ++i) {
+    pinned &= util::PinThread((*threads)[i].native_handle(),
+                              groups[i % groups.size()]);
   }
-};
+  return pinned;
+}
 
 
 }  // namespace
 
 
+// Delayed tasks are kept in a timer wheel, which a thread of its own
+// expires, returning them on the pool.
 class ThreadPool::Impl {
  public:
-  ~Impl();
+  Impl(const string& name, size_t num_threads);
+  virtual ~Impl();
+
+  virtual void Add(util::Closure closure) = 0;
+  void Delay(const duration<double>& delay, util::Task* task);
+  // Pins the timer thread; subclasses pin their workers too.
+  virtual bool PinThreads(const vector<vector<int>>& groups);
+
+ protected:
+  // A closure, and when it was added.
+  struct QueuedClosure {
+    QueuedClosure() = default;
+    explicit QueuedClosure(util::Closure&& c)
+        : closure(move(c)), added(steady_clock::now()) {
+    }
+
+    util::Closure closure;
+    steady_clock::time_point added;
+  };
+
+  // To be called by the subclass when a closure is added to, or taken
+  // from, its queues.
+  void Queued();
+  void Unqueued();
+  // Runs |queued|, which was taken from the queues.
+  void Run(QueuedClosure* queued);
+
+
+  // To be called by the constructor of the subclass, once Add() works.
+  void StartTimer();
+  // To be called by the destructor of the subclass, which then has to
+  // call CancelDelayed() too.
+  void StopTimer();
+  void CancelDelayed();
+
+ private:
+  void TimerLoop();
+
+  TimerWheel timers_;
+  mutex timer_lock_;
+  condition_variable timer_cond_var_;
+  bool timer_exiting_;
+  thread timer_thread_;
+
+  Gauge<string>::Handle busy_threads_;
+  Gauge<string>::Handle queued_closures_;
+  Histogram<string>::Handle wait_ms_;
+  Histogram<string>::Handle run_ms_;
+  Counter<string>::Handle delayed_tasks_;
+};
+
+
+ThreadPool::Impl::Impl(const string& name, size_t num_threads)
+    : timer_exiting_(false),
+      busy_threads_(thread_pool_busy_threads->GetHandle(name)),
+      queued_closures_(thread_pool_queued_closures->GetHandle(name)),
+      wait_ms_(thread_pool_wait_ms->GetHandle(name)),
+      run_ms_(thread_pool_run_ms->GetHandle(name)),
+      delayed_tasks_(thread_pool_delayed_tasks->GetHandle(name)) {
+  thread_pool_threads->Set(name, num_threads);
+  busy_threads_.IncrementBy(0);
+  queued_closures_.IncrementBy(0);
+}
+
+
+ThreadPool::Impl::~Impl() {
+  CHECK(!timer_thread_.joinable());
+}
+
+
+void ThreadPool::Impl::Delay(const duration<double>& delay,
+                             util::Task* task) {
+  delayed_tasks_.Increment();
+  // Only wake the timer thread up if it sleeps past the new deadline.
+  lock_guard<mutex> lock(timer_lock_);
+  if (timers_.Add(delay, task)) {
+    timer_cond_var_.notify_one();
+  }
+}
+
+
+bool ThreadPool::Impl::PinThreads(const vector<vector<int>>& groups) {
+  return util::PinThread(timer_thread_.native_handle(), groups.front());
+}
+
+
+void ThreadPool::Impl::Queued() {
+  queued_closures_.IncrementBy(1);
+}
+
+
+void ThreadPool::Impl::Unqueued() {
+  queued_closures_.IncrementBy(-1);
+}
+
+
+void ThreadPool::Impl::Run(QueuedClosure* queued) {
+  const steady_clock::time_point started(steady_clock::now());
+  wait_ms_.Record(duration<double, milli>(started - queued->added).count());
+  busy_threads_.IncrementBy(1);
+
+  queued->closure();
+  queued->closure = nullptr;
+
+  busy_threads_.IncrementBy(-1);
+  run_ms_.Record(
+      duration<double, milli>(steady_clock::now() - started).count());
+}
+
+
+void ThreadPool::Impl::StartTimer() {
+  timer_thread_ = thread(&Impl::TimerLoop, this);
+}
+
+
+void ThreadPool::Impl::StopTimer() {
+  {
+    lock_guard<mutex> lock(timer_lock_);
+    timer_exiting_ = true;
+  }
+  timer_cond_var_.notify_one();
+  timer_thread_.join();
+}
+
+
+void ThreadPool::Impl::CancelDelayed() {
+  CHECK(!timer_thread_.joinable());
+  vector<util::Task*> to_be_cancelled;
+  timers_.Clear(&to_be_cancelled);
+  for (util::Task* const task : to_be_cancelled) {
+    task->Return(util::Status::CANCELLED);
+  }
+  VLOG(1) << "Cancelled " << to_be_cancelled.size() << " delayed tasks.";
+}
+
+
+void ThreadPool::Impl::TimerLoop() {
+  vector<util::Task*> expired;
+  unique_lock<mutex> lock(timer_lock_);
+  while (!timer_exiting_) {
+    timers_.Expire(steady_clock::now(), &expired);
+    if (!expired.empty()) {
+      lock.unlock();
+      for (util::Task* const task : expired) {
+        Add([task]() { task->Return(); });
+      }
+      expired.clear();
+      lock.lock();
+      continue;
+    }
+
+    const steady_clock::time_point next(timers_.NextExpiry());
+    if (next == steady_clock::time_point::max()) {
+      timer_cond_var_.wait(lock);
+    } else {
+      timer_cond_var_.wait_until(lock, next);
+    }
+  }
+}
+
+
+class ThreadPool::SharedQueueImpl : public ThreadPool::Impl {
+ public:
+  SharedQueueImpl(const string& name, size_t num_threads);
+  ~SharedQueueImpl() override;
+
+  void Add(util::Closure closure) override;
+  bool PinThreads(const vector<vector<int>>& groups) override;
 
+ private:
   void Worker();
 
   // TODO(pphaneuf): I'd like this to be const, but it required
@@ -52,18 +269,31 @@ class ThreadPool::Impl {
 
   mutex queue_lock_;
   condition_variable queue_cond_var_;
-  priority_queue<QueueEntry, vector<QueueEntry>, QueueOrdering> queue_;
+  deque<QueuedClosure> queue_;
 };
 
 
-ThreadPool::Impl::~Impl() {
-  // Start by sending an empty closure to every thread (and notify
-  // them), to have them exit cleanly.
+ThreadPool::SharedQueueImpl::SharedQueueImpl(const string& name,
+                                             size_t num_threads)
+    : Impl(name, num_threads) {
+  CHECK_GT(num_threads, static_cast<size_t>(0));
+  for (size_t i = 0; i < num_threads; ++i)
+    threads_.emplace_back(thread(&SharedQueueImpl::Worker, this));
+  StartTimer();
+}
+
+
+ThreadPool::SharedQueueImpl::~SharedQueueImpl() {
+  // Nothing gets added by the timer once the workers are gone.
+  StopTimer();
+
+  // Then send an empty closure to every thread (and notify
+  // them), to have them exit cleanly once they are done with what was
+  // added before.
   {
     lock_guard<mutex> lock(queue_lock_);
     for (int i = threads_.size(); i > 0; --i)
-      queue_.emplace(
-          make_tuple(steady_clock::time_point(), function<void()>(), nullptr));
+      queue_.emplace_back();
   }
   // Notify all the threads *after* adding all the empty closures, to
   // avoid any races.
@@ -74,62 +304,206 @@ ThreadPool::Impl::~Impl() {
     thread.join();
   }
 
+  // Anyone who adds more stuff when their delayed task is cancelled
+  // is going to cause the CHECK below to fail, but at least they'll
+  // know about it that way.
+  CancelDelayed();
+
   // Workers should've drained everything from the queue.
   CHECK(queue_.empty());
 }
 
 
-void ThreadPool::Impl::Worker() {
+bool ThreadPool::SharedQueueImpl::PinThreads(
+    const vector<vector<int>>& groups) {
+  const bool pinned(Impl::PinThreads(groups));
+  return PinWorkers(&threads_, groups) && pinned;
+}
+
+
+void ThreadPool::SharedQueueImpl::Worker() {
   while (true) {
-    QueueEntry entry;
+    QueuedClosure queued;
 
     {
       unique_lock<mutex> lock(queue_lock_);
-      while (queue_.empty() || get<0>(queue_.top()) > steady_clock::now()) {
-        if (queue_.empty()) {
-          // If there's nothing to do, wait until there is.
-          queue_cond_var_.wait(lock);
-        } else {
-          // Otherwise, wait until the next thing we currently know about is
-          // ready.
-          const steady_clock::duration duration(get<0>(queue_.top()) -
-                                                steady_clock::now());
-          queue_cond_var_.wait_for(lock, duration);
-        }
-      }
+      queue_cond_var_.wait(lock, [this]() { return !queue_.empty(); });
+      queued = move(queue_.front());
+      queue_.pop_front();
+    }
 
-      entry = queue_.top();
-      queue_.pop();
-
-      // If we received an empty entry, exit cleanly.
-      if (!get<1>(entry)) {
-        // Anything left in the queue must be either other exit sentinels, or
-        // future (delayed) tasks, so we'll cancel anything we find, up until
-        // either the next exit sentinel, or the end of the queue.
-        VLOG(1) << "Cancelling delayed tasks...";
-        vector<util::Task*> to_be_cancelled;
-        while (!queue_.empty() && get<2>(queue_.top())) {
-          to_be_cancelled.push_back(CHECK_NOTNULL(get<2>(queue_.top())));
-          queue_.pop();
-        }
+    // If we received an empty closure, exit cleanly.
+    if (!queued.closure) {
+      return;
+    }
 
-        // Cancel the callbacks below outside of the lock to avoid deadlocking
-        // anyone who tries to Add() more stuff when they're cancelled.
-        // Anyone who does that is going to cause a CHECK fail in the d'tor of
-        // the pool anyway, but at least they'll know about it that way.
-        lock.unlock();
+    // Make sure not to hold the lock while calling the closure.
+    Unqueued();
+    Run(&queued);
+  }
+}
 
-        for (const auto& t : to_be_cancelled) {
-          t->Return(util::Status::CANCELLED);
-        }
 
-        VLOG(1) << "Cancelled " << to_be_cancelled.size() << " delayed tasks.";
-        return;
+void ThreadPool::SharedQueueImpl::Add(util::Closure closure) {
+  Queued();
+  {
+    lock_guard<mutex> lock(queue_lock_);
+    queue_.emplace_back(move(closure));
+  }
+  queue_cond_var_.notify_one();
+}
+
+
+class ThreadPool::WorkStealingImpl : public ThreadPool::Impl {
+ public:
+  WorkStealingImpl(const string& name, size_t num_threads);
+  ~WorkStealingImpl() override;
+
+  void Add(util::Closure closure) override;
+  bool PinThreads(const vector<vector<int>>& groups) override;
+
+ private:
+  struct WorkerQueue {
+    mutex lock;
+    deque<QueuedClosure> closures;
+  };
+
+  // Takes the oldest closure from queue |index|, or else the newest
+  // from one of the others. Returns false if they are all empty.
+  bool TakeClosure(size_t index, QueuedClosure* closure);
+  void Worker(size_t index);
+
+  vector<unique_ptr<WorkerQueue>> queues_;
+  // Where closures added from outside the pool go next.
+  atomic<size_t> next_queue_;
+
+  // Idle workers wait on |sleep_cond_var_|, and count themselves in
+  // |num_sleeping_| (under |sleep_lock_|) before they last look for
+  // work, so that Add() only has to take the lock if one might be.
+  mutex sleep_lock_;
+  condition_variable sleep_cond_var_;
+  atomic<int> num_sleeping_;
+  bool exiting_;
+
+  vector<thread> threads_;
+};
+
+
+ThreadPool::WorkStealingImpl::WorkStealingImpl(const string& name,
+                                               size_t num_threads)
+    : Impl(name, num_threads),
+      next_queue_(0),
+      num_sleeping_(0),
+      exiting_(false) {
+  CHECK_GT(num_threads, static_cast<size_t>(0));
+  for (size_t i = 0; i < num_threads; ++i) {
+    queues_.emplace_back(new WorkerQueue);
+  }
+  for (size_t i = 0; i < num_threads; ++i) {
+    threads_.emplace_back(thread(&WorkStealingImpl::Worker, this, i));
+  }
+  StartTimer();
+}
+
+
+ThreadPool::WorkStealingImpl::~WorkStealingImpl() {
+  // Stop the timer first, as the delayed tasks it cancels might still
+  // add closures.
+  StopTimer();
+  CancelDelayed();
+
+  // The workers exit once there is nothing left to run.
+  {
+    lock_guard<mutex> lock(sleep_lock_);
+    exiting_ = true;
+  }
+  sleep_cond_var_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+
+  for (const auto& queue : queues_) {
+    CHECK(queue->closures.empty());
+  }
+}
+
+
+void ThreadPool::WorkStealingImpl::Add(util::Closure closure) {
+  // A worker keeps what it adds to itself, as it is likely to be
+  // related to what it is doing; the others can still take it.
+  const size_t index(current_pool == this
+                         ? current_queue
+                         : next_queue_.fetch_add(1) % queues_.size());
+  Queued();
+  {
+    lock_guard<mutex> lock(queues_[index]->lock);
+    queues_[index]->closures.emplace_back(move(closure));
+  }
+  if (num_sleeping_.load() > 0) {
+    lock_guard<mutex> lock(sleep_lock_);
+    sleep_cond_var_.notify_one();
+  }
+}
+
+
+bool ThreadPool::WorkStealingImpl::PinThreads(
+    const vector<vector<int>>& groups) {
+  const bool pinned(Impl::PinThreads(groups));
+  return PinWorkers(&threads_, groups) && pinned;
+}
+
+
+bool ThreadPool::WorkStealingImpl::TakeClosure(size_t index,
+                                               QueuedClosure* closure) {
+  {
+    WorkerQueue* const own(queues_[index].get());
+    lock_guard<mutex> lock(own->lock);
+    if (!own->closures.empty()) {
+      *closure = move(own->closures.front());
+      own->closures.pop_front();
+      return true;
+    }
+  }
+
+  for (size_t i = 1; i < queues_.size(); ++i) {
+    WorkerQueue* const other(queues_[(index + i) % queues_.size()].get());
+    lock_guard<mutex> lock(other->lock);
+    if (!other->closures.empty()) {
+      *closure = move(other->closures.back());
+      other->closures.pop_back();
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+void ThreadPool::WorkStealingImpl::Worker(size_t index) {
+  current_pool = this;
+  current_queue = index;
+  QueuedClosure closure;
+  while (true) {
+    if (!TakeClosure(index, &closure)) {
+      unique_lock<mutex> lock(sleep_lock_);
+      ++num_sleeping_;
+      // Anything added from now on will wake us up.
+      const bool found(TakeClosure(index, &closure));
+      if (!found) {
+        if (exiting_) {
+          --num_sleeping_;
+          return;
+        }
+        sleep_cond_var_.wait(lock);
+      }
+      --num_sleeping_;
+      if (!found) {
+        continue;
       }
     }
 
-    // Make sure not to hold the lock while calling the closure.
-    get<1>(entry)();
+    Unqueued();
+    Run(&closure);
   }
 }
 
@@ -141,11 +515,20 @@ ThreadPool::ThreadPool()
 }
 
 
-ThreadPool::ThreadPool(size_t num_threads) : impl_(new Impl) {
-  CHECK_GT(num_threads, static_cast<size_t>(0));
-  LOG(INFO) << "ThreadPool starting with " << num_threads << " threads";
-  for (int i = 0; i < static_cast<int64_t>(num_threads); ++i)
-    impl_->threads_.emplace_back(thread(&Impl::Worker, impl_.get()));
+ThreadPool::ThreadPool(size_t num_threads, Scheduling scheduling)
+    : ThreadPool(DefaultName(), num_threads, scheduling) {
+}
+
+
+ThreadPool::ThreadPool(const string& name, size_t num_threads,
+                       Scheduling scheduling)
+    : impl_(scheduling == Scheduling::WORK_STEALING
+                ? static_cast<Impl*>(new WorkStealingImpl(name, num_threads))
+                : new SharedQueueImpl(name, num_threads)) {
+  LOG(INFO) << "ThreadPool " << name << " started with " << num_threads
+            << " threads"
+            << (scheduling == Scheduling::WORK_STEALING ? " (work stealing)"
+                                                        : "");
 }
 
 
@@ -155,30 +538,26 @@ ThreadPool::~ThreadPool() {
 }
 
 
-void ThreadPool::Add(const function<void()>& closure) {
+void ThreadPool::Add(util::Closure closure) {
   // Empty closures signal a thread to exit, don't allow that (also,
   // it doesn't make sense).
   if (!closure) {
     return;
   }
 
-  {
-    lock_guard<mutex> lock(impl_->queue_lock_);
-    impl_->queue_.emplace(make_tuple(steady_clock::now(), closure, nullptr));
-  }
-  impl_->queue_cond_var_.notify_one();
+  impl_->Add(util::trace::Propagate(move(closure), "thread_pool_queue"));
 }
 
 
 void ThreadPool::Delay(const duration<double>& delay, util::Task* task) {
   CHECK_NOTNULL(task);
-  {
-    lock_guard<mutex> lock(impl_->queue_lock_);
-    impl_->queue_.emplace(make_tuple(
-        steady_clock::now() + duration_cast<std::chrono::microseconds>(delay),
-        [task]() { task->Return(); }, task));
-  }
-  impl_->queue_cond_var_.notify_one();
+  impl_->Delay(delay, task);
+}
+
+
+bool ThreadPool::PinThreads(const vector<vector<int>>& groups) {
+  CHECK(!groups.empty());
+  return impl_->PinThreads(groups);
 }
 
 
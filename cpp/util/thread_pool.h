@@ -5,6 +5,8 @@
 #include <functional>
 #include <map>
 #include <memory>
+#include <string>
+#include <vector>
 
 #include "util/executor.h"
 
@@ -13,13 +15,31 @@ namespace cert_trans {
 
 // Provides a fixed size thread pool to run closures on. The pool is
 // sized according to the number of cores in the system.
+//
+// Its metrics (how many closures are queued and how long they wait,
+// how many threads are busy running them and for how long) are
+// labelled with its name, which is "thread_pool_<n>" if not given.
 class ThreadPool : public util::Executor {
  public:
+  enum class Scheduling {
+    // All the threads take closures from one queue.
+    SHARED_QUEUE,
+    // Each thread has a queue of its own, and takes closures from the
+    // others when it runs out. There is less contention with many
+    // threads.
+    WORK_STEALING,
+  };
+
   // Creates the threads.
   ThreadPool();
 
   // Creates the threads.
-  ThreadPool(size_t num_threads);
+  ThreadPool(size_t num_threads,
+             Scheduling scheduling = Scheduling::SHARED_QUEUE);
+
+  // Creates the threads.
+  ThreadPool(const std::string& name, size_t num_threads,
+             Scheduling scheduling = Scheduling::SHARED_QUEUE);
 
   // The destructor will wait for any outstanding closures to finish.
   ~ThreadPool();
@@ -29,13 +49,25 @@ class ThreadPool : public util::Executor {
 
   // Arranges for "closure" to be called in the thread pool. The
   // function must not be empty.
-  void Add(const std::function<void()>& closure) override;
+  void Add(util::Closure closure) override;
 
+  // Delayed tasks are kept in a timer wheel, expired by a thread of
+  // its own. They return CANCELLED right away if they are cancelled,
+  // or if the pool is destroyed first.
   void Delay(const std::chrono::duration<double>& delay,
              util::Task* task) override;
 
+  // Restricts the i-th thread of the pool to the CPUs in
+  // groups[i % groups.size()], and that expiring the delayed tasks to
+  // those in the first group, so that a pool can be kept on one NUMA
+  // node, or spread evenly over all of them (see
+  // util/cpu_affinity.h). Returns false if any could not be pinned.
+  bool PinThreads(const std::vector<std::vector<int>>& groups);
+
  private:
   class Impl;
+  class SharedQueueImpl;
+  class WorkStealingImpl;
   const std::unique_ptr<Impl> impl_;
 };
 
@@ -3,32 +3,64 @@
 #include <glog/logging.h>
 #include <gtest/gtest.h>
 #include <atomic>
+#include <chrono>
 #include <memory>
+#include <thread>
+#include <vector>
 
 #include "base/notification.h"
+#include "monitoring/metric.h"
+#include "monitoring/registry.h"
+#include "util/cpu_affinity.h"
 #include "util/sync_task.h"
 #include "util/testing.h"
 
 namespace cert_trans {
 
+using std::atomic;
+using std::chrono::duration_cast;
 using std::chrono::milliseconds;
+using std::chrono::steady_clock;
 using std::chrono::system_clock;
+using std::string;
+using std::thread;
 using std::unique_ptr;
+using std::vector;
 using util::SyncTask;
 
-class ThreadPoolTest : public ::testing::Test {
+class ThreadPoolTest
+    : public ::testing::TestWithParam<ThreadPool::Scheduling> {
  public:
-  ThreadPoolTest() : pool_of_one_(1) {
+  ThreadPoolTest() : pool_of_one_(1, GetParam()) {
   }
 
  protected:
   ThreadPool pool_of_one_;
 };
 
-typedef class ThreadPoolTest ThreadPoolDeathTest;
+// Returns the value of the metric |name| for |pool|, or -1.
+double MetricValue(const string& name, const string& pool) {
+  for (const Metric* metric : Registry::Instance()->GetMetrics()) {
+    if (metric->Name() == name) {
+      const auto values(metric->CurrentValues());
+      const auto it(values.find({pool}));
+      return it == values.end() ? -1 : it->second.second;
+    }
+  }
+  return -1;
+}
+
+class ThreadPoolDeathTest : public ::testing::Test {
+ public:
+  ThreadPoolDeathTest() : pool_of_one_(1) {
+  }
+
+ protected:
+  ThreadPool pool_of_one_;
+};
 
 
-TEST_F(ThreadPoolTest, Delay) {
+TEST_P(ThreadPoolTest, Delay) {
   SyncTask task(&pool_of_one_);
   pool_of_one_.Delay(milliseconds(200), task.task());
   EXPECT_FALSE(task.IsDone());
@@ -45,7 +77,7 @@ TEST_F(ThreadPoolDeathTest, AddingMoreTasksAfterClosedGoesBang) {
 }
 
 
-TEST_F(ThreadPoolTest, DelayDoesNotBlockAThread) {
+TEST_P(ThreadPoolTest, DelayDoesNotBlockAThread) {
   SyncTask delay_task(&pool_of_one_);
   pool_of_one_.Delay(milliseconds(200), delay_task.task());
 
@@ -63,7 +95,7 @@ TEST_F(ThreadPoolTest, DelayDoesNotBlockAThread) {
 }
 
 
-TEST_F(ThreadPoolTest, NaturalOrderingPreserved) {
+TEST_P(ThreadPoolTest, NaturalOrderingPreserved) {
   SyncTask task1(&pool_of_one_);
   SyncTask task2(&pool_of_one_);
 
@@ -76,8 +108,8 @@ TEST_F(ThreadPoolTest, NaturalOrderingPreserved) {
 }
 
 
-TEST_F(ThreadPoolTest, CancelsDelayTasks) {
-  unique_ptr<ThreadPool> pool(new ThreadPool(1));
+TEST_P(ThreadPoolTest, CancelsDelayTasks) {
+  unique_ptr<ThreadPool> pool(new ThreadPool(1, GetParam()));
 
   SyncTask task1(&pool_of_one_);
 
@@ -89,6 +121,129 @@ TEST_F(ThreadPoolTest, CancelsDelayTasks) {
 }
 
 
+TEST_P(ThreadPoolTest, RunsClosuresAddedFromWithin) {
+  ThreadPool pool(4, GetParam());
+  const int kClosures(1000);
+  atomic<int> count(0);
+  Notification done;
+  for (int i = 0; i < kClosures / 2; ++i) {
+    pool.Add([&pool, &count, &done]() {
+      // Each closure adds another one.
+      pool.Add([&count, &done]() {
+        if (++count == kClosures) {
+          done.Notify();
+        }
+      });
+      if (++count == kClosures) {
+        done.Notify();
+      }
+    });
+  }
+  done.WaitForNotification();
+  EXPECT_EQ(kClosures, count);
+}
+
+
+// Not much of a test: it logs how long it takes for a few threads to
+// push many small closures through a pool with many threads, to
+// compare the ways of scheduling them.
+TEST_P(ThreadPoolTest, Contention) {
+  const int kPoolThreads(16);
+  const int kAddingThreads(4);
+  const int kClosuresPerThread(50000);
+  const int kClosures(kAddingThreads * kClosuresPerThread);
+
+  ThreadPool pool(kPoolThreads, GetParam());
+  atomic<int> count(0);
+  Notification done;
+  const steady_clock::time_point start(steady_clock::now());
+  vector<thread> adding_threads;
+  for (int i = 0; i < kAddingThreads; ++i) {
+    adding_threads.emplace_back([&pool, &count, &done]() {
+      for (int j = 0; j < kClosuresPerThread; ++j) {
+        pool.Add([&count, &done]() {
+          if (++count == kClosures) {
+            done.Notify();
+          }
+        });
+      }
+    });
+  }
+  for (auto& adding_thread : adding_threads) {
+    adding_thread.join();
+  }
+  done.WaitForNotification();
+
+  LOG(INFO) << (GetParam() == ThreadPool::Scheduling::WORK_STEALING
+                    ? "work stealing"
+                    : "shared queue")
+            << ": " << kClosures << " closures in "
+            << duration_cast<milliseconds>(steady_clock::now() - start).count()
+            << " ms";
+  EXPECT_EQ(kClosures, count);
+}
+
+
+TEST_P(ThreadPoolTest, ReportsSaturation) {
+  const string name(GetParam() == ThreadPool::Scheduling::WORK_STEALING
+                        ? "saturation_work_stealing"
+                        : "saturation_shared_queue");
+  ThreadPool pool(name, 1, GetParam());
+  EXPECT_EQ(1, MetricValue("thread_pool_threads", name));
+
+  Notification started, release, done;
+  pool.Add([&started, &release]() {
+    started.Notify();
+    release.WaitForNotification();
+  });
+  pool.Add([&done]() { done.Notify(); });
+  started.WaitForNotification();
+  EXPECT_EQ(1, MetricValue("thread_pool_busy_threads", name));
+  EXPECT_EQ(1, MetricValue("thread_pool_queued_closures", name));
+
+  release.Notify();
+  done.WaitForNotification();
+  // The number of closures that waited and ran.
+  while (MetricValue("thread_pool_run_ms", name) < 2) {
+    std::this_thread::yield();
+  }
+  EXPECT_EQ(2, MetricValue("thread_pool_wait_ms", name));
+  EXPECT_EQ(0, MetricValue("thread_pool_busy_threads", name));
+  EXPECT_EQ(0, MetricValue("thread_pool_queued_closures", name));
+}
+
+
+TEST_P(ThreadPoolTest, PinsThreads) {
+  const vector<int> cpus(util::CurrentThreadCpus());
+  ASSERT_FALSE(cpus.empty());
+  const vector<int> first(1, cpus.front());
+  ThreadPool pool(2, GetParam());
+  EXPECT_TRUE(pool.PinThreads({first}));
+
+  for (int i = 0; i < 10; ++i) {
+    Notification done;
+    vector<int> ran_on;
+    pool.Add([&done, &ran_on]() {
+      ran_on = util::CurrentThreadCpus();
+      done.Notify();
+    });
+    done.WaitForNotification();
+    EXPECT_EQ(first, ran_on);
+  }
+
+  // Delayed tasks still run.
+  SyncTask task(&pool);
+  pool.Delay(milliseconds(10), task.task());
+  task.Wait();
+}
+
+
+INSTANTIATE_TEST_CASE_P(Scheduling, ThreadPoolTest,
+                        ::testing::Values(
+                            ThreadPool::Scheduling::SHARED_QUEUE,
+                            ThreadPool::Scheduling::WORK_STEALING));
+
+
 }  // namespace cert_trans
 
 
@@ -0,0 +1,279 @@
+#include "util/timer_wheel.h"
+
+#include <glog/logging.h>
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+
+#include "util/task.h"
+
+using std::bind;
+using std::chrono::duration;
+using std::lock_guard;
+using std::min;
+using std::mutex;
+using std::numeric_limits;
+using std::vector;
+
+namespace cert_trans {
+namespace {
+
+
+// Four levels of 256 slots cover 2^32 ticks (about 50 days, with
+// the default tick), deadlines further than that go around the last
+// level again.
+const int kSlotBits(8);
+const uint64_t kSlots(1 << kSlotBits);
+const uint64_t kSlotMask(kSlots - 1);
+const size_t kLevels(4);
+const uint64_t kSpan(uint64_t(1) << (kSlotBits * kLevels));
+// Longer delays are shortened to this, it is far enough.
+const double kMaxDelayTicks(1e12);
+
+
+int Shift(size_t level) {
+  return kSlotBits * level;
+}
+
+
+}  // namespace
+
+
+struct TimerWheel::Timer {
+  util::Task* task;
+  uint64_t deadline;
+  // Index in |slots_|, or -1 if the timer is not in the wheel.
+  int slot;
+  Timer* prev;
+  Timer* next;
+};
+
+
+TimerWheel::TimerWheel(const clock::duration& tick,
+                       const clock::time_point& start)
+    : tick_(tick),
+      start_(start),
+      current_tick_(0),
+      slots_(kLevels * kSlots, nullptr),
+      level_sizes_(kLevels, 0),
+      size_(0),
+      next_expiry_(clock::time_point::max()) {
+  CHECK_GT(tick_.count(), 0);
+}
+
+
+TimerWheel::~TimerWheel() {
+  CHECK_EQ(size_, static_cast<size_t>(0));
+}
+
+
+bool TimerWheel::Add(const duration<double>& delay, util::Task* task,
+                     const clock::time_point& now) {
+  CHECK_NOTNULL(task);
+  // Make sure the task does not get to the DONE state (and free the
+  // timer) before the callbacks are set up.
+  util::TaskHold hold(task);
+
+  Timer* const timer(new Timer);
+  timer->task = task;
+  timer->slot = -1;
+  timer->prev = nullptr;
+  timer->next = nullptr;
+
+  bool earlier;
+  {
+    lock_guard<mutex> lock(lock_);
+    const double ticks((duration<double>(now - start_) + delay) /
+                       duration<double>(tick_));
+    // Anything due now goes in the next tick, as the current one has
+    // already expired.
+    timer->deadline =
+        ticks <= current_tick_ + 1
+            ? current_tick_ + 1
+            : static_cast<uint64_t>(ceil(min(ticks, kMaxDelayTicks)));
+    Insert(timer);
+    ++size_;
+
+    const clock::time_point deadline(TickTime(timer->deadline));
+    earlier = deadline < next_expiry_;
+    if (earlier) {
+      next_expiry_ = deadline;
+    }
+  }
+
+  task->WhenCancelled(bind(&TimerWheel::Cancel, this, timer));
+  task->DeleteWhenDone(timer);
+
+  return earlier;
+}
+
+
+TimerWheel::clock::time_point TimerWheel::NextExpiry() {
+  lock_guard<mutex> lock(lock_);
+  uint64_t next(numeric_limits<uint64_t>::max());
+  for (size_t level = 0; level < kLevels; ++level) {
+    if (level_sizes_[level] == 0) {
+      continue;
+    }
+    // The first non-empty slot of a level is the next to expire (at
+    // level 0) or to be spread over the levels below (at the others),
+    // which cannot happen before the start of its tick.
+    const uint64_t block(current_tick_ >> Shift(level));
+    for (uint64_t i = 1; i <= kSlots; ++i) {
+      if (slots_[level * kSlots + ((block + i) & kSlotMask)]) {
+        next = min(next, (block + i) << Shift(level));
+        break;
+      }
+    }
+  }
+
+  next_expiry_ = next == numeric_limits<uint64_t>::max()
+                     ? clock::time_point::max()
+                     : TickTime(next);
+  return next_expiry_;
+}
+
+
+void TimerWheel::Expire(const clock::time_point& now,
+                        vector<util::Task*>* expired) {
+  CHECK_NOTNULL(expired);
+  if (now < start_) {
+    return;
+  }
+  const uint64_t target((now - start_) / tick_);
+
+  lock_guard<mutex> lock(lock_);
+  while (current_tick_ < target) {
+    if (size_ == 0) {
+      current_tick_ = target;
+      break;
+    }
+
+    // Nothing can happen before the next tick of the lowest level
+    // that has timers, skip right to it.
+    uint64_t next(current_tick_ + 1);
+    for (size_t level = 0; level + 1 < kLevels && level_sizes_[level] == 0;
+         ++level) {
+      next = ((current_tick_ >> Shift(level + 1)) + 1) << Shift(level + 1);
+    }
+    current_tick_ = min(next, target);
+
+    // Spread the timers of the slots we just reached over the levels
+    // below, from the top, so they can go down more than one level.
+    for (size_t level = kLevels - 1; level > 0; --level) {
+      if ((current_tick_ & ((uint64_t(1) << Shift(level)) - 1)) != 0) {
+        continue;
+      }
+      const size_t slot(level * kSlots +
+                        ((current_tick_ >> Shift(level)) & kSlotMask));
+      Timer* timer(slots_[slot]);
+      while (timer) {
+        Timer* const next_timer(timer->next);
+        Unlink(timer);
+        Insert(timer);
+        timer = next_timer;
+      }
+    }
+
+    Timer* timer(slots_[current_tick_ & kSlotMask]);
+    while (timer) {
+      Timer* const next_timer(timer->next);
+      DCHECK_LE(timer->deadline, current_tick_);
+      Unlink(timer);
+      --size_;
+      expired->push_back(timer->task);
+      timer = next_timer;
+    }
+  }
+}
+
+
+void TimerWheel::Clear(vector<util::Task*>* tasks) {
+  CHECK_NOTNULL(tasks);
+  lock_guard<mutex> lock(lock_);
+  for (Timer* head : slots_) {
+    while (head) {
+      Timer* const next(head->next);
+      Unlink(head);
+      tasks->push_back(head->task);
+      head = next;
+    }
+  }
+  size_ = 0;
+  next_expiry_ = clock::time_point::max();
+}
+
+
+size_t TimerWheel::size() const {
+  lock_guard<mutex> lock(lock_);
+  return size_;
+}
+
+
+void TimerWheel::Insert(Timer* timer) {
+  CHECK_EQ(timer->slot, -1);
+  uint64_t position(timer->deadline);
+  size_t level(0);
+  if (position <= current_tick_) {
+    // Only when spreading a slot over the levels below, this goes in
+    // the slot of level 0 about to expire.
+    position = current_tick_;
+  } else {
+    const uint64_t delta(position - current_tick_);
+    while (level + 1 < kLevels && delta >= uint64_t(1) << Shift(level + 1)) {
+      ++level;
+    }
+    if (delta >= kSpan) {
+      position = current_tick_ + kSpan - 1;
+    }
+  }
+
+  timer->slot = level * kSlots + ((position >> Shift(level)) & kSlotMask);
+  timer->prev = nullptr;
+  timer->next = slots_[timer->slot];
+  if (timer->next) {
+    timer->next->prev = timer;
+  }
+  slots_[timer->slot] = timer;
+  ++level_sizes_[level];
+}
+
+
+void TimerWheel::Unlink(Timer* timer) {
+  CHECK_GE(timer->slot, 0);
+  if (timer->prev) {
+    timer->prev->next = timer->next;
+  } else {
+    slots_[timer->slot] = timer->next;
+  }
+  if (timer->next) {
+    timer->next->prev = timer->prev;
+  }
+  --level_sizes_[timer->slot / kSlots];
+  timer->slot = -1;
+  timer->prev = nullptr;
+  timer->next = nullptr;
+}
+
+
+void TimerWheel::Cancel(Timer* timer) {
+  {
+    lock_guard<mutex> lock(lock_);
+    // It might have expired already.
+    if (timer->slot < 0) {
+      return;
+    }
+    Unlink(timer);
+    --size_;
+  }
+  timer->task->Return(util::Status::CANCELLED);
+}
+
+
+TimerWheel::clock::time_point TimerWheel::TickTime(uint64_t tick) const {
+  return start_ + tick_ * static_cast<clock::rep>(tick);
+}
+
+
+}  // namespace cert_trans
@@ -0,0 +1,88 @@
+#ifndef CERT_TRANS_UTIL_TIMER_WHEEL_H_
+#define CERT_TRANS_UTIL_TIMER_WHEEL_H_
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace util {
+class Task;
+}  // namespace util
+
+namespace cert_trans {
+
+
+// Keeps delayed tasks in a hierarchical timing wheel, so that adding
+// and cancelling one takes constant time, however many are pending.
+// Deadlines are rounded up to a tick.
+//
+// The wheel does not run anything by itself: its owner calls
+// Expire() once NextExpiry() is reached, and returns the expired
+// tasks (typically, on its executor). A task that is cancelled
+// before expiring is removed from the wheel and returned with
+// CANCELLED right away.
+//
+// This class is thread-safe.
+class TimerWheel {
+ public:
+  typedef std::chrono::steady_clock clock;
+
+  explicit TimerWheel(
+      const clock::duration& tick = std::chrono::milliseconds(1),
+      const clock::time_point& start = clock::now());
+  // All the tasks must have been removed with Clear() first.
+  ~TimerWheel();
+
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+
+  // Adds |task|, to expire once |delay| has passed since |now|.
+  // Returns true if it might expire before the last time returned by
+  // NextExpiry(), in which case the owner has to call that again.
+  bool Add(const std::chrono::duration<double>& delay, util::Task* task,
+           const clock::time_point& now = clock::now());
+
+  // Returns a time at or before which Expire() has something to do,
+  // or clock::time_point::max() if the wheel is empty.
+  clock::time_point NextExpiry();
+
+  // Removes the tasks that expire at or before |now|, and appends
+  // them to |expired|.
+  void Expire(const clock::time_point& now, std::vector<util::Task*>* expired);
+
+  // Removes all the tasks, and appends them to |tasks|.
+  void Clear(std::vector<util::Task*>* tasks);
+
+  size_t size() const;
+
+ private:
+  struct Timer;
+
+  // Links |timer| into the slot for its deadline, relative to
+  // |current_tick_|.
+  void Insert(Timer* timer);
+  // Unlinks |timer| from its slot.
+  void Unlink(Timer* timer);
+  // Called when the task of |timer| is cancelled.
+  void Cancel(Timer* timer);
+  clock::time_point TickTime(uint64_t tick) const;
+
+  const clock::duration tick_;
+  const clock::time_point start_;
+
+  mutable std::mutex lock_;
+  // Every timer due at or before this tick has expired.
+  uint64_t current_tick_;
+  // Each level has a slot per tick of the level below, and each slot
+  // is the head of a doubly linked list of timers.
+  std::vector<Timer*> slots_;
+  std::vector<size_t> level_sizes_;
+  size_t size_;
+  clock::time_point next_expiry_;
+};
+
+
+}  // namespace cert_trans
+
+#endif  // CERT_TRANS_UTIL_TIMER_WHEEL_H_
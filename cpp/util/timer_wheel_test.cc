@@ -0,0 +1,137 @@
+#include "util/timer_wheel.h"
+
+#include <gtest/gtest.h>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "util/sync_task.h"
+#include "util/testing.h"
+#include "util/thread_pool.h"
+
+namespace cert_trans {
+namespace {
+
+using std::chrono::hours;
+using std::chrono::milliseconds;
+using std::unique_ptr;
+using std::vector;
+using util::SyncTask;
+using util::Task;
+
+
+class TimerWheelTest : public ::testing::Test {
+ public:
+  TimerWheelTest()
+      : start_(TimerWheel::clock::now()),
+        wheel_(milliseconds(1), start_),
+        pool_(1) {
+  }
+
+ protected:
+  // Adds a task expiring |delay| after the start of the wheel.
+  SyncTask* AddAt(const TimerWheel::clock::duration& delay) {
+    tasks_.emplace_back(new SyncTask(&pool_));
+    wheel_.Add(delay, tasks_.back()->task(), start_);
+    return tasks_.back().get();
+  }
+
+  // Returns the tasks expired at |delay| after the start of the
+  // wheel.
+  vector<Task*> ExpireAt(const TimerWheel::clock::duration& delay) {
+    vector<Task*> expired;
+    wheel_.Expire(start_ + delay, &expired);
+    for (Task* const task : expired) {
+      task->Return();
+    }
+    return expired;
+  }
+
+  void TearDown() override {
+    vector<Task*> remaining;
+    wheel_.Clear(&remaining);
+    for (Task* const task : remaining) {
+      task->Return(util::Status::CANCELLED);
+    }
+    for (const auto& task : tasks_) {
+      task->Wait();
+    }
+  }
+
+  const TimerWheel::clock::time_point start_;
+  TimerWheel wheel_;
+  ThreadPool pool_;
+  vector<unique_ptr<SyncTask>> tasks_;
+};
+
+
+TEST_F(TimerWheelTest, ExpiresInOrder) {
+  SyncTask* const late(AddAt(milliseconds(70000)));
+  SyncTask* const soon(AddAt(milliseconds(5)));
+  SyncTask* const later(AddAt(milliseconds(300)));
+  EXPECT_EQ(3U, wheel_.size());
+
+  EXPECT_TRUE(ExpireAt(milliseconds(4)).empty());
+  EXPECT_EQ(vector<Task*>{soon->task()}, ExpireAt(milliseconds(5)));
+  EXPECT_TRUE(ExpireAt(milliseconds(299)).empty());
+  EXPECT_EQ(vector<Task*>{later->task()}, ExpireAt(milliseconds(69999)));
+  EXPECT_EQ(vector<Task*>{late->task()}, ExpireAt(milliseconds(70000)));
+  EXPECT_EQ(0U, wheel_.size());
+}
+
+
+TEST_F(TimerWheelTest, ExpiresBeyondTheLastLevel) {
+  // Further than the 2^32 ticks the levels cover.
+  SyncTask* const task(AddAt(hours(24 * 60)));
+  EXPECT_TRUE(ExpireAt(hours(24 * 60) - milliseconds(1)).empty());
+  EXPECT_EQ(vector<Task*>{task->task()}, ExpireAt(hours(24 * 60)));
+}
+
+
+TEST_F(TimerWheelTest, NextExpiryIsNotLate) {
+  EXPECT_EQ(TimerWheel::clock::time_point::max(), wheel_.NextExpiry());
+
+  AddAt(milliseconds(70000));
+  // It might be early, but never past the deadline.
+  TimerWheel::clock::time_point next(wheel_.NextExpiry());
+  while (next < start_ + milliseconds(70000)) {
+    EXPECT_TRUE(ExpireAt(next - start_).empty());
+    next = wheel_.NextExpiry();
+  }
+  EXPECT_EQ(start_ + milliseconds(70000), next);
+  EXPECT_EQ(1U, ExpireAt(next - start_).size());
+  EXPECT_EQ(TimerWheel::clock::time_point::max(), wheel_.NextExpiry());
+}
+
+
+TEST_F(TimerWheelTest, AddTellsWhenEarlier) {
+  tasks_.emplace_back(new SyncTask(&pool_));
+  EXPECT_TRUE(wheel_.Add(milliseconds(100), tasks_.back()->task(), start_));
+  tasks_.emplace_back(new SyncTask(&pool_));
+  EXPECT_FALSE(wheel_.Add(milliseconds(200), tasks_.back()->task(), start_));
+  tasks_.emplace_back(new SyncTask(&pool_));
+  EXPECT_TRUE(wheel_.Add(milliseconds(50), tasks_.back()->task(), start_));
+}
+
+
+TEST_F(TimerWheelTest, CancelRemoves) {
+  SyncTask* const cancelled(AddAt(milliseconds(100)));
+  SyncTask* const other(AddAt(milliseconds(100)));
+
+  cancelled->Cancel();
+  cancelled->Wait();
+  EXPECT_EQ(util::Status::CANCELLED, cancelled->status());
+  EXPECT_EQ(1U, wheel_.size());
+
+  EXPECT_EQ(vector<Task*>{other->task()}, ExpireAt(milliseconds(100)));
+}
+
+
+}  // namespace
+}  // namespace cert_trans
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,223 @@
+#include "util/trace.h"
+
+#include <gflags/gflags.h>
+#include <mutex>
+#include <random>
+
+#include "monitoring/monitoring.h"
+
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+using std::chrono::system_clock;
+using std::lock_guard;
+using std::make_shared;
+using std::move;
+using std::mutex;
+using std::string;
+using std::vector;
+
+DEFINE_double(trace_sample_rate, 0,
+              "fraction of the requests for which a trace is recorded");
+DEFINE_int32(trace_max_buffered_spans, 10000,
+             "maximum number of ended spans kept until they are exported, "
+             "further ones are dropped");
+
+namespace util {
+namespace trace {
+namespace {
+
+
+static cert_trans::Counter<>* trace_spans_dropped(
+    cert_trans::Counter<>::New("trace_spans_dropped",
+                               "Number of trace spans dropped because too "
+                               "many were waiting to be exported."));
+
+
+thread_local Context current_context;
+
+
+uint64_t NewId() {
+  static thread_local std::mt19937_64 generator(std::random_device{}());
+  uint64_t id;
+  do {
+    id = generator();
+  } while (id == 0);
+  return id;
+}
+
+
+bool Sample() {
+  static thread_local std::mt19937_64 generator(std::random_device{}());
+  return FLAGS_trace_sample_rate > 0 &&
+         std::uniform_real_distribution<double>()(generator) <
+             FLAGS_trace_sample_rate;
+}
+
+
+mutex finished_lock;
+vector<SpanRecord>* finished_spans(new vector<SpanRecord>);
+
+
+void Finish(SpanRecord&& span) {
+  lock_guard<mutex> lock(finished_lock);
+  if (finished_spans->size() >=
+      static_cast<size_t>(FLAGS_trace_max_buffered_spans)) {
+    trace_spans_dropped->Increment();
+    return;
+  }
+  finished_spans->emplace_back(move(span));
+}
+
+
+// Runs a closure with the span that was current when it was queued.
+struct PropagatedClosure {
+  void operator()() {
+    queued.End();
+    const ContextScope scope(context);
+    closure();
+  }
+
+  Closure closure;
+  Context context;
+  Span queued;
+};
+
+
+}  // namespace
+
+
+RequestTimes::RequestTimes() : start_(steady_clock::now()) {
+  for (auto& nanos : nanos_) {
+    nanos.store(0, std::memory_order_relaxed);
+  }
+}
+
+
+steady_clock::duration RequestTimes::Elapsed() const {
+  return steady_clock::now() - start_;
+}
+
+
+steady_clock::duration RequestTimes::Get(Phase phase) const {
+  return nanoseconds(
+      nanos_[static_cast<int>(phase)].load(std::memory_order_relaxed));
+}
+
+
+void RequestTimes::Add(Phase phase, const steady_clock::duration& time) {
+  if (phase == Phase::OTHER) {
+    return;
+  }
+  nanos_[static_cast<int>(phase)].fetch_add(
+      std::chrono::duration_cast<nanoseconds>(time).count(),
+      std::memory_order_relaxed);
+}
+
+
+Context CurrentContext() {
+  return current_context;
+}
+
+
+ContextScope::ContextScope(const Context& context)
+    : previous_(current_context) {
+  current_context = context;
+}
+
+
+ContextScope::~ContextScope() {
+  current_context = previous_;
+}
+
+
+Span::Span(const string& name, Phase phase)
+    : times_(current_context.times), phase_(phase) {
+  if (times_ && phase_ != Phase::OTHER) {
+    phase_start_ = steady_clock::now();
+  }
+  if (current_context.traced()) {
+    Span(current_context, name, system_clock::now(), steady_clock::now())
+        .record_.swap(record_);
+  }
+}
+
+
+Span::Span(const Context& parent, const string& name,
+           const system_clock::time_point& start,
+           const steady_clock::time_point& steady_start)
+    : record_(new Record) {
+  record_->span.trace_id = parent.traced() ? parent.trace_id : NewId();
+  record_->span.span_id = NewId();
+  record_->span.parent_id = parent.span_id;
+  record_->span.name = name;
+  record_->span.start = start;
+  record_->steady_start = steady_start;
+}
+
+
+Span::~Span() {
+  End();
+}
+
+
+// static
+Span Span::NewTrace(const string& name) {
+  Span span(Sample() ? Span(Context(), name, system_clock::now(),
+                            steady_clock::now())
+                     : Span());
+  span.times_ = make_shared<RequestTimes>();
+  return span;
+}
+
+
+Context Span::context() const {
+  Context context;
+  if (record_) {
+    context.trace_id = record_->span.trace_id;
+    context.span_id = record_->span.span_id;
+  }
+  context.times = times_;
+  return context;
+}
+
+
+void Span::AddTag(const string& key, const string& value) {
+  if (record_) {
+    record_->span.tags[key] = value;
+  }
+}
+
+
+void Span::End() {
+  if (times_ && phase_ != Phase::OTHER) {
+    times_->Add(phase_, steady_clock::now() - phase_start_);
+    phase_ = Phase::OTHER;
+  }
+  if (!record_) {
+    return;
+  }
+  record_->span.duration = steady_clock::now() - record_->steady_start;
+  Finish(move(record_->span));
+  record_.reset();
+}
+
+
+Closure Propagate(Closure closure, const char* queue_name) {
+  if (!current_context.traced() && !current_context.times) {
+    return closure;
+  }
+  return PropagatedClosure{move(closure), current_context,
+                           Span(queue_name, Phase::QUEUE)};
+}
+
+
+vector<SpanRecord> TakeFinishedSpans() {
+  vector<SpanRecord> spans;
+  lock_guard<mutex> lock(finished_lock);
+  spans.swap(*finished_spans);
+  return spans;
+}
+
+
+}  // namespace trace
+}  // namespace util
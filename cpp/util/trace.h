@@ -0,0 +1,197 @@
+#ifndef CERT_TRANS_UTIL_TRACE_H_
+#define CERT_TRANS_UTIL_TRACE_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "util/closure.h"
+
+namespace util {
+namespace trace {
+
+// Lightweight request tracing.
+//
+// A trace is a tree of spans, each timing one step of the work done
+// for a request (such as checking a chain, or an etcd round trip).
+// Traces are started for a sample of the requests, and the span
+// currently open on a thread is passed along to the work it causes:
+// util::Task callbacks run with the span that was current when the
+// task was created, and the executors run closures with the span
+// that was current when they were added (recording how long they
+// were queued, too).
+//
+// Outside of a sampled trace, creating a span only costs a
+// thread-local lookup.
+//
+// Independently of sampling, every request started with
+// Span::NewTrace() also adds up how long the spans done for it spent
+// in each Phase, so that slow requests can be broken down.
+
+
+// What a span is spending its time on.
+enum class Phase {
+  OTHER,
+  // Waiting in an executor queue (see Propagate()).
+  QUEUE,
+  DB,
+  ETCD,
+  SERIALIZATION,
+};
+
+
+// How long the work done for one request spent in each Phase (other
+// than OTHER), and since when the request is being handled. The work
+// done in parallel is added up, so the total can exceed the elapsed
+// time.
+class RequestTimes {
+ public:
+  RequestTimes();
+  RequestTimes(const RequestTimes&) = delete;
+  RequestTimes& operator=(const RequestTimes&) = delete;
+
+  std::chrono::steady_clock::duration Elapsed() const;
+
+  std::chrono::steady_clock::duration Get(Phase phase) const;
+
+  void Add(Phase phase, const std::chrono::steady_clock::duration& time);
+
+ private:
+  const std::chrono::steady_clock::time_point start_;
+  std::atomic<int64_t> nanos_[static_cast<int>(Phase::SERIALIZATION) + 1];
+};
+
+
+// Identifies a span within a trace. A zero |trace_id| means that
+// there is no trace.
+struct Context {
+  Context() : trace_id(0), span_id(0) {
+  }
+
+  bool traced() const {
+    return trace_id != 0;
+  }
+
+  uint64_t trace_id;
+  uint64_t span_id;
+  // The request the span is part of, if any, whether traced or not.
+  std::shared_ptr<RequestTimes> times;
+};
+
+
+// A span that ended, waiting to be exported.
+struct SpanRecord {
+  uint64_t trace_id;
+  uint64_t span_id;
+  // Zero for the root span of a trace.
+  uint64_t parent_id;
+  std::string name;
+  std::chrono::system_clock::time_point start;
+  std::chrono::steady_clock::duration duration;
+  std::map<std::string, std::string> tags;
+};
+
+
+// Returns the span currently open on this thread.
+Context CurrentContext();
+
+
+// Makes |context| the current one until it goes out of scope.
+class ContextScope {
+ public:
+  explicit ContextScope(const Context& context);
+  ~ContextScope();
+  ContextScope(const ContextScope&) = delete;
+  ContextScope& operator=(const ContextScope&) = delete;
+
+ private:
+  const Context previous_;
+};
+
+
+// A span, which ends when End() is called, or when it is destroyed.
+// It does not become the current span (see ScopedSpan for that), so
+// it can also time asynchronous operations.
+class Span {
+ public:
+  // Starts a span as a child of the current one, or does nothing if
+  // there is no current trace. If the current context is part of a
+  // request, the time until End() is added to its |phase|.
+  explicit Span(const std::string& name, Phase phase = Phase::OTHER);
+  Span(Span&& other) = default;
+  Span(const Span&) = delete;
+  Span& operator=(const Span&) = delete;
+  ~Span();
+
+  // Starts a new trace with this as its root span, for a fraction
+  // --trace_sample_rate of the calls, or does nothing otherwise. In
+  // both cases, the context of the span starts a new RequestTimes.
+  static Span NewTrace(const std::string& name);
+
+  // Returns a context which is not traced if this span does nothing.
+  // It is part of the same request as the span, if any.
+  Context context() const;
+
+  void AddTag(const std::string& key, const std::string& value);
+
+  void End();
+
+ private:
+  Span() = default;
+  Span(const Context& parent, const std::string& name,
+       const std::chrono::system_clock::time_point& start,
+       const std::chrono::steady_clock::time_point& steady_start);
+
+  struct Record {
+    SpanRecord span;
+    std::chrono::steady_clock::time_point steady_start;
+  };
+
+  std::unique_ptr<Record> record_;
+  std::shared_ptr<RequestTimes> times_;
+  Phase phase_ = Phase::OTHER;
+  std::chrono::steady_clock::time_point phase_start_;
+};
+
+
+// A span which is the current one for as long as it is in scope.
+class ScopedSpan {
+ public:
+  explicit ScopedSpan(const std::string& name)
+      : span_(name), scope_(span_.context()) {
+  }
+  explicit ScopedSpan(Span&& span)
+      : span_(std::move(span)), scope_(span_.context()) {
+  }
+  ScopedSpan(const ScopedSpan&) = delete;
+  ScopedSpan& operator=(const ScopedSpan&) = delete;
+
+  Span* span() {
+    return &span_;
+  }
+
+ private:
+  Span span_;
+  const ContextScope scope_;
+};
+
+
+// Returns a closure that runs |closure| with the current span, and
+// records how long it waited before running as a |queue_name| span
+// (in the QUEUE phase). If there is no current trace or request,
+// returns |closure| itself.
+Closure Propagate(Closure closure, const char* queue_name);
+
+
+// Returns (and forgets) the spans that ended since the last call.
+std::vector<SpanRecord> TakeFinishedSpans();
+
+
+}  // namespace trace
+}  // namespace util
+
+#endif  // CERT_TRANS_UTIL_TRACE_H_
@@ -0,0 +1,171 @@
+#include "util/trace.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+#include "base/notification.h"
+#include "util/sync_task.h"
+#include "util/testing.h"
+#include "util/thread_pool.h"
+
+DECLARE_double(trace_sample_rate);
+
+namespace util {
+namespace trace {
+namespace {
+
+using cert_trans::Notification;
+using cert_trans::ThreadPool;
+using std::string;
+using std::vector;
+
+
+class TraceTest : public ::testing::Test {
+ protected:
+  TraceTest() {
+    FLAGS_trace_sample_rate = 1;
+    TakeFinishedSpans();
+  }
+
+  ~TraceTest() {
+    FLAGS_trace_sample_rate = 0;
+  }
+
+  const SpanRecord* Find(const vector<SpanRecord>& spans,
+                         const string& name) {
+    for (const auto& span : spans) {
+      if (span.name == name) {
+        return &span;
+      }
+    }
+    return nullptr;
+  }
+};
+
+
+TEST_F(TraceTest, NotSampled) {
+  FLAGS_trace_sample_rate = 0;
+  {
+    const ScopedSpan root(Span::NewTrace("root"));
+    EXPECT_FALSE(CurrentContext().traced());
+    const ScopedSpan child("child");
+  }
+  EXPECT_TRUE(TakeFinishedSpans().empty());
+}
+
+
+TEST_F(TraceTest, NoChildOutsideATrace) {
+  { const Span span("orphan"); }
+  EXPECT_TRUE(TakeFinishedSpans().empty());
+}
+
+
+TEST_F(TraceTest, ChildSpans) {
+  {
+    ScopedSpan root(Span::NewTrace("root"));
+    EXPECT_TRUE(CurrentContext().traced());
+    {
+      ScopedSpan child("child");
+      child.span()->AddTag("key", "value");
+    }
+    EXPECT_EQ(root.span()->context().span_id, CurrentContext().span_id);
+  }
+  EXPECT_FALSE(CurrentContext().traced());
+
+  const vector<SpanRecord> spans(TakeFinishedSpans());
+  ASSERT_EQ(2U, spans.size());
+  const SpanRecord* const root(Find(spans, "root"));
+  const SpanRecord* const child(Find(spans, "child"));
+  ASSERT_TRUE(root && child);
+  EXPECT_EQ(0U, root->parent_id);
+  EXPECT_EQ(root->trace_id, child->trace_id);
+  EXPECT_EQ(root->span_id, child->parent_id);
+  EXPECT_EQ("value", child->tags.at("key"));
+}
+
+
+TEST_F(TraceTest, PropagatesThroughExecutorsAndTasks) {
+  ThreadPool pool(2);
+  Context root_context;
+  {
+    ScopedSpan root(Span::NewTrace("root"));
+    root_context = root.span()->context();
+
+    Notification ran;
+    pool.Add([&ran]() {
+      const ScopedSpan span("on_pool");
+      ran.Notify();
+    });
+    ran.WaitForNotification();
+
+    SyncTask task(&pool);
+    Context done_context;
+    Task* const child(task.task()->AddChild(
+        [&done_context](Task*) { done_context = CurrentContext(); }));
+    pool.Add([child]() { child->Return(); });
+    task.task()->Return();
+    task.Wait();
+    EXPECT_EQ(root_context.span_id, done_context.span_id);
+  }
+
+  const vector<SpanRecord> spans(TakeFinishedSpans());
+  const SpanRecord* const queued(Find(spans, "thread_pool_queue"));
+  const SpanRecord* const on_pool(Find(spans, "on_pool"));
+  ASSERT_TRUE(queued && on_pool);
+  EXPECT_EQ(root_context.span_id, queued->parent_id);
+  EXPECT_EQ(root_context.span_id, on_pool->parent_id);
+  EXPECT_EQ(root_context.trace_id, on_pool->trace_id);
+}
+
+
+TEST_F(TraceTest, AddsUpRequestTimesWithoutSampling) {
+  FLAGS_trace_sample_rate = 0;
+  ThreadPool pool(2);
+  std::shared_ptr<RequestTimes> times;
+  {
+    const ScopedSpan root(Span::NewTrace("root"));
+    times = CurrentContext().times;
+    ASSERT_TRUE(times);
+    EXPECT_FALSE(CurrentContext().traced());
+
+    Notification ran;
+    pool.Add([&ran, times]() {
+      EXPECT_EQ(times, CurrentContext().times);
+      {
+        const Span db("db", Phase::DB);
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      }
+      ran.Notify();
+    });
+    ran.WaitForNotification();
+  }
+  EXPECT_FALSE(CurrentContext().times);
+
+  EXPECT_GE(times->Get(Phase::DB), std::chrono::milliseconds(5));
+  EXPECT_GT(times->Get(Phase::QUEUE), std::chrono::nanoseconds(0));
+  EXPECT_EQ(std::chrono::nanoseconds(0), times->Get(Phase::ETCD));
+  EXPECT_GE(times->Elapsed(), times->Get(Phase::DB));
+  EXPECT_TRUE(TakeFinishedSpans().empty());
+}
+
+
+TEST_F(TraceTest, NoRequestTimesOutsideARequest) {
+  const Span span("db", Phase::DB);
+  EXPECT_FALSE(span.context().times);
+  EXPECT_FALSE(CurrentContext().times);
+}
+
+
+}  // namespace
+}  // namespace trace
+}  // namespace util
+
+
+int main(int argc, char** argv) {
+  cert_trans::test::InitTesting(argv[0], &argc, &argv, true);
+  return RUN_ALL_TESTS();
+}
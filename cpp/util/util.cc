@@ -2,7 +2,7 @@
 
 #include <glog/logging.h>
 #include <netinet/in.h>  // for resolv.h
-#include <resolv.h>      // for b64_ntop
+#include <resolv.h>      // for b64_pton
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,6 +18,13 @@
 #include "log/ct_extensions.h"
 #include "version.h"
 
+// The SSSE3 base64 code is compiled for x86 whatever the target, and
+// only used if the CPU running it supports it.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BASE64_SSSE3 1
+#include <tmmintrin.h>
+#endif
+
 using std::getline;
 using std::move;
 using std::string;
@@ -43,6 +50,191 @@ char ByteValue(char high, char low) {
   return ret;
 }
 
+const char kBase64Chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+const uint8_t kNotBase64 = 0xff;
+
+// Lookup tables for base64, built once. Encoding looks up two
+// characters at a time (for 12 bits of input), decoding one.
+struct Base64Tables {
+  Base64Tables() {
+    for (int i = 0; i < 4096; ++i) {
+      pairs[2 * i] = kBase64Chars[i >> 6];
+      pairs[2 * i + 1] = kBase64Chars[i & 0x3f];
+    }
+    memset(values, kNotBase64, sizeof(values));
+    for (int i = 0; i < 64; ++i) {
+      values[static_cast<uint8_t>(kBase64Chars[i])] = i;
+    }
+  }
+
+  char pairs[2 * 4096];
+  uint8_t values[256];
+};
+
+
+const Base64Tables& GetBase64Tables() {
+  static const Base64Tables* const tables(new Base64Tables);
+  return *tables;
+}
+
+
+#ifdef BASE64_SSSE3
+bool HasSSSE3() {
+  static const bool has_ssse3(__builtin_cpu_supports("ssse3"));
+  return has_ssse3;
+}
+
+
+// Encodes blocks of 12 bytes into 16 characters, 16 bytes of |in|
+// being loaded for each. Returns how many bytes were encoded, which
+// leaves at least 4 (and so at least one block) to the caller.
+__attribute__((target("ssse3"))) size_t EncodeBase64SSSE3(const u_char* in,
+                                                           size_t length,
+                                                           char* out) {
+  // Spreads the 3 bytes of each group of 4 output characters over
+  // those 4 bytes, then moves each 6-bit index to its own byte, and
+  // finally offsets each index by the amount that gives its character
+  // (which depends on which of the 5 ranges of the alphabet it is in).
+  const __m128i spread(
+      _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10));
+  const __m128i offsets(_mm_setr_epi8(
+      'a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+      '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0));
+  size_t done(0);
+  for (; length - done >= 16; done += 12, out += 16) {
+    __m128i block(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + done)));
+    block = _mm_shuffle_epi8(block, spread);
+    const __m128i high(_mm_mulhi_epu16(
+        _mm_and_si128(block, _mm_set1_epi32(0x0fc0fc00)),
+        _mm_set1_epi32(0x04000040)));
+    const __m128i low(_mm_mullo_epi16(
+        _mm_and_si128(block, _mm_set1_epi32(0x003f03f0)),
+        _mm_set1_epi32(0x01000010)));
+    const __m128i indices(_mm_or_si128(high, low));
+    // 0 for A-Z, 1 for a-z, 2-11 for 0-9, 12 for +, 13 for /.
+    __m128i range(_mm_subs_epu8(indices, _mm_set1_epi8(51)));
+    range = _mm_or_si128(
+        range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), indices),
+                             _mm_set1_epi8(13)));
+    _mm_storeu_si128(
+        reinterpret_cast<__m128i*>(out),
+        _mm_add_epi8(_mm_shuffle_epi8(offsets, range), indices));
+  }
+  return done;
+}
+
+
+// Decodes blocks of 16 characters into 12 bytes, storing 16 bytes at
+// |out| for each, for as long as they are all in the base64 alphabet.
+// Returns how many characters were decoded, which leaves at least 8
+// to the caller, so that there is always room for the 16 bytes
+// stored.
+__attribute__((target("ssse3"))) size_t DecodeBase64SSSE3(const u_char* in,
+                                                           size_t length,
+                                                           u_char* out) {
+  // The characters of the alphabet are classified by their high and
+  // low nibbles: the bits of the two lookups only overlap for
+  // characters outside of it. The value of each character is then
+  // found by adding an offset, which depends on its high nibble (and
+  // whether it is '/').
+  const __m128i low_classes(
+      _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                    0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a));
+  const __m128i high_classes(
+      _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10,
+                    0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10));
+  const __m128i offsets(_mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0,
+                                      0, 0, 0, 0, 0, 0));
+  const __m128i slash(_mm_set1_epi8(0x2f));
+  const __m128i pack(
+      _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+  size_t done(0);
+  for (; length - done >= 24; done += 16, out += 12) {
+    const __m128i block(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + done)));
+    const __m128i high_nibbles(
+        _mm_and_si128(_mm_srli_epi32(block, 4), slash));
+    const __m128i classes(
+        _mm_and_si128(_mm_shuffle_epi8(high_classes, high_nibbles),
+                      _mm_shuffle_epi8(low_classes,
+                                       _mm_and_si128(block, slash))));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(classes, _mm_setzero_si128())) !=
+        0xffff) {
+      break;
+    }
+    const __m128i values(_mm_add_epi8(
+        block,
+        _mm_shuffle_epi8(offsets,
+                         _mm_add_epi8(_mm_cmpeq_epi8(block, slash),
+                                      high_nibbles))));
+    // Merges pairs of 6-bit values into 12 bits, then pairs of those
+    // into 24 bits, and packs the 3 bytes of each.
+    const __m128i pairs(
+        _mm_maddubs_epi16(values, _mm_set1_epi32(0x01400140)));
+    const __m128i groups(_mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out),
+                     _mm_shuffle_epi8(groups, pack));
+  }
+  return done;
+}
+#endif  // BASE64_SSSE3
+
+
+// Decodes |b64| into |out|, which must have room for 3 / 4 of
+// |length| bytes, if it is in the canonical form produced by
+// ToBase64(): no whitespace, and padding only at the end. Returns the
+// length of the decoded value, or -1 if |b64| is not canonical (and
+// so should be left to b64_pton(), which also accepts whitespace, and
+// rejects what is not base64 at all).
+int DecodeCanonicalBase64(const char* b64, size_t length, u_char* out) {
+  if (length % 4 != 0) {
+    return -1;
+  }
+  size_t padding(0);
+  if (length > 0 && b64[length - 1] == '=') {
+    padding = b64[length - 2] == '=' ? 2 : 1;
+  }
+
+  const uint8_t* const values(GetBase64Tables().values);
+  const u_char* in(reinterpret_cast<const u_char*>(b64));
+  const u_char* const end(in + length - (padding > 0 ? 4 : 0));
+  u_char* const begin(out);
+#ifdef BASE64_SSSE3
+  if (HasSSSE3()) {
+    const size_t decoded(DecodeBase64SSSE3(in, length, out));
+    in += decoded;
+    out += decoded / 4 * 3;
+  }
+#endif
+  uint8_t invalid(0);
+  for (; in < end; in += 4, out += 3) {
+    const uint8_t a(values[in[0]]), b(values[in[1]]), c(values[in[2]]),
+        d(values[in[3]]);
+    invalid |= a | b | c | d;
+    const uint32_t bits((a << 18) | (b << 12) | (c << 6) | d);
+    out[0] = bits >> 16;
+    out[1] = bits >> 8;
+    out[2] = bits;
+  }
+  if (padding > 0) {
+    const uint8_t a(values[in[0]]), b(values[in[1]]),
+        c(padding == 1 ? values[in[2]] : 0);
+    invalid |= a | b | c;
+    const uint32_t bits((a << 18) | (b << 12) | (c << 6));
+    // As with b64_pton(), the bits left over must be zero.
+    invalid |= (bits & (padding == 1 ? 0xff : 0xffff)) != 0 ? kNotBase64 : 0;
+    *out++ = bits >> 16;
+    if (padding == 1) {
+      *out++ = bits >> 8;
+    }
+  }
+  if (invalid & 0xc0) {
+    return -1;
+  }
+  return out - begin;
+}
+
 }  // namespace
 
 string HexString(const string& data) {
@@ -176,30 +368,69 @@ string RandomString(size_t min_length, size_t max_length) {
 }
 
 string FromBase64(const char* b64) {
-  size_t length = strlen(b64);
+  return FromBase64(b64, strlen(b64));
+}
+
+string FromBase64(const char* b64, size_t length) {
   // Lazy: base 64 encoding is always >= in length to decoded value
   // (equality occurs for zero length).
-  u_char* buf = new u_char[length];
-  int rlength = b64_pton(b64, buf, length);
+  string ret(length, '\0');
+  u_char* const buf(reinterpret_cast<u_char*>(&ret[0]));
+  int rlength(DecodeCanonicalBase64(b64, length, buf));
+  if (rlength < 0) {
+    // b64_pton() needs it NUL-terminated.
+    rlength = b64_pton(string(b64, length).c_str(), buf, length);
+  }
   // Treat decode errors as empty strings.
   if (rlength < 0)
     rlength = 0;
-  string ret(reinterpret_cast<char*>(buf), rlength);
-  delete[] buf;
+  ret.resize(rlength);
   return ret;
 }
 
+int FromBase64(const char* b64, vector<u_char>* buf) {
+  const size_t length(strlen(b64));
+  if (buf->size() < length) {
+    buf->resize(length);
+  }
+  const int rlength(DecodeCanonicalBase64(b64, length, buf->data()));
+  if (rlength >= 0) {
+    return rlength;
+  }
+  return b64_pton(b64, buf->data(), buf->size());
+}
+
 string ToBase64(const string& from) {
-  // base 64 is 4 output bytes for every 3 input bytes (rounded up).
-  size_t length = ((from.size() + 2) / 3) * 4;
-  char* buf = new char[length + 1];
-  length =
-      b64_ntop((const u_char*)from.data(), from.length(), buf, length + 1);
-  string ret(buf, length);
-  delete[] buf;
+  string ret(Base64Length(from.size()), '\0');
+  ToBase64(from.data(), from.size(), &ret[0]);
   return ret;
 }
 
+void ToBase64(const char* from, size_t length, char* to) {
+  const char* const pairs(GetBase64Tables().pairs);
+  const u_char* in(reinterpret_cast<const u_char*>(from));
+#ifdef BASE64_SSSE3
+  if (HasSSSE3()) {
+    const size_t encoded(EncodeBase64SSSE3(in, length, to));
+    in += encoded;
+    length -= encoded;
+    to += encoded / 3 * 4;
+  }
+#endif
+  for (; length >= 3; length -= 3, in += 3, to += 4) {
+    const uint32_t bits((in[0] << 16) | (in[1] << 8) | in[2]);
+    memcpy(to, pairs + 2 * (bits >> 12), 2);
+    memcpy(to + 2, pairs + 2 * (bits & 0xfff), 2);
+  }
+  if (length > 0) {
+    const uint32_t bits((in[0] << 16) | (length > 1 ? in[1] << 8 : 0));
+    to[0] = kBase64Chars[bits >> 18];
+    to[1] = kBase64Chars[(bits >> 12) & 0x3f];
+    to[2] = length > 1 ? kBase64Chars[(bits >> 6) & 0x3f] : '=';
+    to[3] = '=';
+  }
+}
+
 vector<string> split(const string& in, char delim) {
   vector<string> ret;
   string item;
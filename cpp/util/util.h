@@ -34,8 +34,26 @@ std::string RandomString(size_t min_length, size_t max_length);
 
 std::string FromBase64(const char* b64);
 
+// As above, for the |length| characters at |b64|, which need not be
+// NUL-terminated.
+std::string FromBase64(const char* b64, size_t length);
+
+// Decodes |b64| into |*buf|, which is grown as needed but never shrunk,
+// so that it can be reused without allocating. Returns the length of
+// the decoded value, or -1 if |b64| is not valid base64.
+int FromBase64(const char* b64, std::vector<unsigned char>* buf);
+
 std::string ToBase64(const std::string& from);
 
+// The length of the base64 encoding of |length| bytes.
+inline size_t Base64Length(size_t length) {
+  return ((length + 2) / 3) * 4;
+}
+
+// Encodes the |length| bytes at |from| into the Base64Length(length)
+// characters at |to|, without NUL-terminating them.
+void ToBase64(const char* from, size_t length, char* to);
+
 std::vector<std::string> split(const std::string& in, char delim = ',');
 
 }  // namespace util